@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dtoa.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+namespace Akumuli {
+
+//! Max number of decimal places in fixed-point representation (powers of ten are exact)
+static const int MAX_DECIMALS = 15;
+
+static const double POW10[MAX_DECIMALS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+//! Largest integer that can be represented exactly
+static const double MAX_EXACT = 9007199254740992.0;  // 2^53
+
+//! Write `mantissa / 10^ndecimals`
+static int write_fixed(uint64_t mantissa, int ndecimals, bool negative, char* buffer, size_t buffer_size) {
+    char digits[32];
+    int ndigits = 0;
+    do {
+        digits[ndigits++] = static_cast<char>('0' + mantissa % 10);
+        mantissa /= 10;
+    } while (mantissa);
+    while (ndigits <= ndecimals) {
+        // Leading zeroes, e.g. "0.05"
+        digits[ndigits++] = '0';
+    }
+    size_t len = static_cast<size_t>(ndigits) + (negative ? 1 : 0) + (ndecimals ? 1 : 0);
+    if (len > buffer_size) {
+        return -1;
+    }
+    char* p = buffer;
+    if (negative) {
+        *p++ = '-';
+    }
+    for (int i = ndigits - 1; i >= 0; i--) {
+        *p++ = digits[i];
+        if (i == ndecimals && ndecimals != 0) {
+            *p++ = '.';
+        }
+    }
+    return static_cast<int>(len);
+}
+
+int dtoa(double value, char* buffer, size_t buffer_size) {
+    double abs = std::fabs(value);
+    // Same range where "%.17g" uses fixed-point notation
+    if (abs >= 1e-4 && abs < 1e15) {
+        // Value `r / 10^d` is correctly rounded when it's converted back because both
+        // `r` and `10^d` are exact, so the result can be checked using division. The
+        // first match has the smallest number of digits.
+        for (int d = 0; d <= MAX_DECIMALS; d++) {
+            double m = abs * POW10[d];
+            if (m >= MAX_EXACT) {
+                break;
+            }
+            double r = std::round(m);
+            if (r / POW10[d] == abs) {
+                return write_fixed(static_cast<uint64_t>(r), d, value < 0, buffer, buffer_size);
+            }
+        }
+    } else if (value == 0) {
+        return write_fixed(0, 0, std::signbit(value), buffer, buffer_size);
+    }
+    int len = snprintf(buffer, buffer_size, "%.17g", value);
+    if (len < 0 || static_cast<size_t>(len) >= buffer_size) {
+        return -1;
+    }
+    return len;
+}
+
+}  // namespace
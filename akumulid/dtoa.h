@@ -0,0 +1,31 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace Akumuli {
+
+/** Format floating point value.
+  * Output is the shortest decimal fraction that is parsed back to the same value if
+  * the value has a short exact fixed-point representation (most measurements), other
+  * values are formatted using "%.17g". Output is not null-terminated.
+  * @return number of characters written or -1 if there is not enough space in the buffer
+  */
+int dtoa(double value, char* buffer, size_t buffer_size);
+
+}  // namespace
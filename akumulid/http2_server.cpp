@@ -0,0 +1,710 @@
+#include "http2_server.h"
+
+#ifdef AKU_WITH_NGHTTP2
+
+#include <cstring>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include <boost/bind.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace Akumuli {
+namespace Http {
+
+static void throw_error(const char* what, int err) {
+    std::stringstream fmt;
+    fmt << what << ": " << strerror(err);
+    std::runtime_error error(fmt.str());
+    BOOST_THROW_EXCEPTION(error);
+}
+
+//                       //
+//     HTTP/2 Stream     //
+//                       //
+
+struct Http2Server::Stream {
+    i32                            id;
+    std::string                    method;
+    std::string                    path;
+    //! Client accepts gzip
+    bool                           gzip;
+    std::unique_ptr<ReadOperation> cursor;
+    std::unique_ptr<QueryResponse> response;
+    //! Error response, sent instead of the query results
+    std::string                    error;
+    int                            status;
+    size_t                         error_sent;
+
+    Stream(i32 id)
+        : id(id)
+        , gzip(false)
+        , status(200)
+        , error_sent(0)
+    {
+    }
+
+    void set_error(const char* msg, int code) {
+        error = std::string("-") + msg + "\r\n";
+        status = code;
+    }
+};
+
+//                           //
+//     HTTP/2 Connection     //
+//                           //
+
+struct Http2Server::Connection {
+    Http2Server*                                     server;
+    int                                              fd;
+    nghttp2_session*                                 session;
+    std::unordered_map<i32, std::unique_ptr<Stream>> streams;
+    //! Streams that wait for the cursor
+    std::vector<i32>                                 deferred;
+    //! Output that wasn't accepted by the socket
+    std::vector<u8>                                  output;
+    size_t                                           output_pos;
+    //! EPOLLOUT is requested
+    bool                                             want_out;
+
+    Connection(Http2Server* server, int fd)
+        : server(server)
+        , fd(fd)
+        , session(nullptr)
+        , output_pos(0)
+        , want_out(false)
+    {
+    }
+
+    ~Connection() {
+        if (session) {
+            nghttp2_session_del(session);
+        }
+        for (auto& kv: streams) {
+            close_stream(kv.second.get());
+        }
+        ::close(fd);
+    }
+
+    static int on_begin_headers(nghttp2_session* session, const nghttp2_frame* frame, void* user_data) {
+        auto conn = static_cast<Connection*>(user_data);
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+            return 0;
+        }
+        std::unique_ptr<Stream> stream(new Stream(frame->hd.stream_id));
+        nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream.get());
+        conn->streams[frame->hd.stream_id] = std::move(stream);
+        return 0;
+    }
+
+    static int on_header(nghttp2_session* session, const nghttp2_frame* frame,
+                         const u8* name, size_t namelen, const u8* value, size_t valuelen,
+                         u8, void*)
+    {
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+            return 0;
+        }
+        auto stream = static_cast<Stream*>(nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+        if (stream == nullptr) {
+            return 0;
+        }
+        std::string key(reinterpret_cast<const char*>(name), namelen);
+        std::string val(reinterpret_cast<const char*>(value), valuelen);
+        if (key == ":method") {
+            stream->method = val;
+        } else if (key == ":path") {
+            // Url parameters are not used by the query endpoints
+            stream->path = val.substr(0, val.find('?'));
+        } else if (key == "accept-encoding") {
+            stream->gzip = val.find("gzip") != std::string::npos;
+        }
+        return 0;
+    }
+
+    static int on_frame_recv(nghttp2_session* session, const nghttp2_frame* frame, void* user_data) {
+        auto conn = static_cast<Connection*>(user_data);
+        if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) {
+            return 0;
+        }
+        auto stream = static_cast<Stream*>(nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+        if (stream == nullptr) {
+            return 0;
+        }
+        try {
+            if (frame->hd.type == NGHTTP2_HEADERS && frame->headers.cat == NGHTTP2_HCAT_REQUEST) {
+                conn->open_cursor(stream);
+            }
+            if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+                return conn->respond(stream);
+            }
+        } catch (...) {
+            conn->server->logger_.error() << "Stream " << stream->id << " error: "
+                                          << boost::current_exception_diagnostic_information();
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+        return 0;
+    }
+
+    static int on_data_chunk_recv(nghttp2_session* session, u8, i32 stream_id, const u8* data, size_t len,
+                                  void* user_data)
+    {
+        auto conn = static_cast<Connection*>(user_data);
+        auto stream = static_cast<Stream*>(nghttp2_session_get_stream_user_data(session, stream_id));
+        if (stream == nullptr || !stream->cursor || !stream->error.empty()) {
+            return 0;
+        }
+        try {
+            stream->cursor->append(reinterpret_cast<const char*>(data), len);
+        } catch (...) {
+            conn->server->logger_.error() << "Stream " << stream_id << " error: "
+                                          << boost::current_exception_diagnostic_information();
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+        return 0;
+    }
+
+    static int on_stream_close(nghttp2_session*, i32 stream_id, u32, void* user_data) {
+        auto conn = static_cast<Connection*>(user_data);
+        auto it = conn->streams.find(stream_id);
+        if (it != conn->streams.end()) {
+            conn->close_stream(it->second.get());
+            conn->streams.erase(it);
+        }
+        return 0;
+    }
+
+    static ssize_t read_callback(nghttp2_session*, i32, u8* buf, size_t length, u32* data_flags,
+                                 nghttp2_data_source* source, void* user_data)
+    {
+        auto conn = static_cast<Connection*>(user_data);
+        auto stream = static_cast<Stream*>(source->ptr);
+        return conn->read(stream, buf, length, data_flags);
+    }
+
+    void init(u32 max_streams) {
+        nghttp2_session_callbacks* callbacks;
+        if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+            BOOST_THROW_EXCEPTION(std::runtime_error("can't create nghttp2 callbacks"));
+        }
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &on_begin_headers);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, &on_header);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &on_frame_recv);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &on_data_chunk_recv);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &on_stream_close);
+        int ret = nghttp2_session_server_new(&session, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+        if (ret != 0) {
+            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("can't create nghttp2 session: ") + nghttp2_strerror(ret)));
+        }
+        nghttp2_settings_entry settings[] = {
+            { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, max_streams },
+        };
+        nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, settings, sizeof(settings)/sizeof(settings[0]));
+    }
+
+    //! Create cursor when the request headers are received
+    void open_cursor(Stream* stream) {
+        auto endpoint = get_endpoint(stream->path);
+        if (stream->method != "POST" || endpoint == ApiEndpoint::UNKNOWN) {
+            std::string error_msg = "Invalid url " + stream->path;
+            server->logger_.error() << error_msg << " (" << stream->method << ")";
+            stream->set_error(error_msg.c_str(), 404);
+            return;
+        }
+        ReadOperationBuilder* queryproc = server->proc_.get();
+        if (endpoint == ApiEndpoint::EXECUTE) {
+            u64 id;
+            if (get_prepared_id(stream->path, &id)) {
+                stream->cursor.reset(queryproc->create_execute(id));
+            }
+            if (!stream->cursor) {
+                std::string error_msg = "Unknown prepared query " + stream->path;
+                server->logger_.error() << error_msg;
+                stream->set_error(error_msg.c_str(), 404);
+                return;
+            }
+        } else {
+            stream->cursor.reset(queryproc->create(endpoint));
+        }
+        server->logger_.info() << "Cursor " << reinterpret_cast<u64>(stream->cursor.get()) << " created";
+    }
+
+    //! Start the query and submit the response when the request body is received
+    int respond(Stream* stream) {
+        auto cursor = stream->cursor.get();
+        if (stream->error.empty()) {
+            try {
+                server->logger_.info() << "Cursor " << reinterpret_cast<u64>(cursor) << " started";
+                cursor->start();
+            } catch (const std::exception& err) {
+                server->logger_.error() << "Cursor " << reinterpret_cast<u64>(cursor) << " start error: " << err.what();
+                stream->set_error(err.what(), 400);
+            }
+        }
+        if (stream->error.empty()) {
+            auto err = cursor->get_error();
+            if (err != AKU_SUCCESS) {
+                const char* error_msg = aku_error_message(err);
+                server->logger_.error() << "Cursor " << reinterpret_cast<u64>(cursor) << " error: " << error_msg;
+                stream->set_error(error_msg, 400);
+            }
+        }
+        std::string status = std::to_string(stream->status);
+        std::vector<nghttp2_nv> headers;
+        auto add_header = [&](const char* name, std::string const& value) {
+            nghttp2_nv nv = {
+                reinterpret_cast<u8*>(const_cast<char*>(name)),
+                reinterpret_cast<u8*>(const_cast<char*>(value.data())),
+                strlen(name),
+                value.size(),
+                NGHTTP2_NV_FLAG_NONE,
+            };
+            headers.push_back(nv);
+        };
+        add_header(":status", status);
+        std::string gzip = "gzip";
+        if (stream->error.empty()) {
+            // Cursor is read by the event loop so the response can't block
+            stream->response.reset(new QueryResponse(cursor, true, stream->gzip && server->settings_.gzip,
+                                                     server->settings_.chunk_size));
+            if (stream->response->compress) {
+                add_header("content-encoding", gzip);
+            }
+        }
+        nghttp2_data_provider provider;
+        provider.source.ptr = stream;
+        provider.read_callback = &read_callback;
+        int ret = nghttp2_submit_response(session, stream->id, headers.data(), headers.size(), &provider);
+        if (ret != 0) {
+            server->logger_.error() << "Stream " << stream->id << " can't submit response: " << nghttp2_strerror(ret);
+            return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+        return 0;
+    }
+
+    /** Read the response body into the DATA frame. Called only when the flow control
+      * window of the stream is open, `length` is limited by the window size.
+      */
+    ssize_t read(Stream* stream, u8* buf, size_t length, u32* data_flags) {
+        if (!stream->response) {
+            size_t len = std::min(length, stream->error.size() - stream->error_sent);
+            memcpy(buf, stream->error.data() + stream->error_sent, len);
+            stream->error_sent += len;
+            if (stream->error_sent == stream->error.size()) {
+                *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+            }
+            return static_cast<ssize_t>(len);
+        }
+        size_t sz;
+        bool is_done;
+        try {
+            std::tie(sz, is_done) = stream->response->read_some(reinterpret_cast<char*>(buf), length);
+        } catch (...) {
+            // Stream is reset
+            server->logger_.error() << "Cursor " << reinterpret_cast<u64>(stream->cursor.get()) << " read error: "
+                                    << boost::current_exception_diagnostic_information();
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        }
+        if (is_done) {
+            server->logger_.info() << "Cursor " << reinterpret_cast<u64>(stream->cursor.get()) << " done";
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+            return static_cast<ssize_t>(sz);
+        }
+        if (sz == 0) {
+            // Data is not ready yet, the stream is resumed by the event loop
+            deferred.push_back(stream->id);
+            return NGHTTP2_ERR_DEFERRED;
+        }
+        return static_cast<ssize_t>(sz);
+    }
+
+    void close_stream(Stream* stream) {
+        stream->response.reset();
+        if (stream->cursor) {
+            auto cur = stream->cursor.get();
+            cur->close();
+            server->logger_.info() << "Cursor " << reinterpret_cast<u64>(cur) << " destroyed";
+            stream->cursor.reset();
+        }
+    }
+
+    //! Resume streams that wait for the cursor
+    void resume() {
+        std::vector<i32> ids;
+        std::swap(ids, deferred);
+        for (auto id: ids) {
+            // Fails if the stream was closed in the meantime
+            nghttp2_session_resume_data(session, id);
+        }
+    }
+
+    /** Read from the socket until it would block.
+      * @return false if the connection should be closed
+      */
+    bool on_readable() {
+        u8 buf[0x4000];
+        while (true) {
+            auto nread = ::recv(fd, buf, sizeof(buf), 0);
+            if (nread == 0) {
+                return false;
+            }
+            if (nread < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                server->logger_.error() << "Connection read error: " << strerror(errno);
+                return false;
+            }
+            auto ret = nghttp2_session_mem_recv(session, buf, static_cast<size_t>(nread));
+            if (ret < 0) {
+                server->logger_.error() << "HTTP/2 protocol error: " << nghttp2_strerror(static_cast<int>(ret));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** Send frames while the socket accepts the data. New frames (and new data
+      * from the cursors) are not produced until the pending output is sent.
+      * @return false if the connection should be closed
+      */
+    bool flush() {
+        while (true) {
+            if (output_pos < output.size()) {
+                auto nsent = ::send(fd, output.data() + output_pos, output.size() - output_pos, MSG_NOSIGNAL);
+                if (nsent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    return false;
+                }
+                output_pos += static_cast<size_t>(nsent);
+                continue;
+            }
+            output.clear();
+            output_pos = 0;
+            const u8* data = nullptr;
+            auto len = nghttp2_session_mem_send(session, &data);
+            if (len < 0) {
+                server->logger_.error() << "HTTP/2 protocol error: " << nghttp2_strerror(static_cast<int>(len));
+                return false;
+            }
+            if (len == 0) {
+                break;
+            }
+            auto nsent = ::send(fd, data, static_cast<size_t>(len), MSG_NOSIGNAL);
+            if (nsent < 0) {
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                }
+                nsent = 0;
+            }
+            if (nsent < len) {
+                // Data is valid until the next call to nghttp2_session_mem_send
+                output.assign(data + nsent, data + len);
+            }
+        }
+        return true;
+    }
+
+    //! Connection should be kept open
+    bool is_alive() const {
+        return nghttp2_session_want_read(session) || nghttp2_session_want_write(session) ||
+               output_pos < output.size();
+    }
+};
+
+//                       //
+//     HTTP/2 Worker     //
+//                       //
+
+struct Http2Server::Worker {
+    enum {
+        MAX_EVENTS = 256,
+    };
+
+    int                                                  epfd;
+    int                                                  listen_fd;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+
+    Worker()
+        : epfd(-1)
+        , listen_fd(-1)
+    {
+    }
+
+    ~Worker() {
+        release();
+    }
+
+    void init(int port) {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            throw_error("can't create epoll instance", errno);
+        }
+        listen_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            throw_error("can't create socket", errno);
+        }
+        int one = 1;
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<u16>(port));
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+            bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(listen_fd, SOMAXCONN) != 0)
+        {
+            throw_error("can't listen on port", errno);
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+            throw_error("can't add socket to epoll", errno);
+        }
+    }
+
+    void release() {
+        connections.clear();
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+        }
+        if (epfd >= 0) {
+            ::close(epfd);
+            epfd = -1;
+        }
+    }
+
+    //! Flush the output and update the events of the connection, return false if it was closed
+    bool update(Connection* conn) {
+        if (!conn->flush() || !conn->is_alive()) {
+            connections.erase(conn->fd);
+            return false;
+        }
+        bool want_out = conn->output_pos < conn->output.size();
+        if (want_out != conn->want_out) {
+            epoll_event ev = {};
+            ev.events = want_out ? EPOLLIN|EPOLLOUT : EPOLLIN;
+            ev.data.fd = conn->fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+            conn->want_out = want_out;
+        }
+        return true;
+    }
+};
+
+//                       //
+//     HTTP/2 Server     //
+//                       //
+
+Http2Server::Http2Server(int port, std::shared_ptr<ReadOperationBuilder> qproc, int nworkers, u32 max_streams,
+                         HttpSettings const& settings)
+    : proc_(qproc)
+    , port_(port)
+    , nworkers_(nworkers)
+    , max_streams_(max_streams)
+    , settings_(settings)
+    , start_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_{0}
+    , logger_("http2-server")
+{
+    logger_.info() << "HTTP/2 server created, concurrency: " << nworkers;
+}
+
+Http2Server::~Http2Server() {
+    logger_.info() << "HTTP/2 server destroyed";
+}
+
+void Http2Server::start(SignalHandler* sig, int id) {
+    // Sockets are created before the workers so the errors are reported here
+    for (int i = 0; i < nworkers_; i++) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->init(port_);
+        workers_.push_back(std::move(worker));
+    }
+    logger_.info() << "Listening on port " << port_;
+    auto self = shared_from_this();
+    sig->add_handler(boost::bind(&Http2Server::stop, std::move(self)), id);
+
+    for (int i = 0; i < nworkers_; i++) {
+        std::thread thread(std::bind(&Http2Server::run, shared_from_this(), workers_.at(static_cast<size_t>(i)).get(), i));
+        thread.detach();
+    }
+    start_barrier_.wait();
+}
+
+void Http2Server::stop() {
+    // Workers notice the flag after the next wait
+    stop_.store(1, std::memory_order_seq_cst);
+    stop_barrier_.wait();
+    workers_.clear();
+    logger_.info() << "HTTP/2 server stopped";
+}
+
+void Http2Server::run(Worker* w, int ix) {
+#ifdef __gnu_linux__
+        // Name the thread
+        auto thread = pthread_self();
+        pthread_setname_np(thread, "HTTP2-worker");
+#endif
+    aku_apply_thread_policy(AKU_THREAD_HTTP);
+    start_barrier_.wait();
+
+    auto on_accept = [this, w]() {
+        while (true) {
+            int fd = accept4(w->listen_fd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    logger_.error() << "Accept error: " << strerror(errno);
+                }
+                break;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<Connection> conn(new Connection(this, fd));
+            conn->init(max_streams_);
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                logger_.error() << "Can't add connection to epoll: " << strerror(errno);
+                continue;
+            }
+            auto ptr = conn.get();
+            w->connections[fd] = std::move(conn);
+            // Server connection preface (SETTINGS frame)
+            w->update(ptr);
+        }
+    };
+
+    try {
+        logger_.info() << "Event loop " << ix << " started";
+        epoll_event events[Worker::MAX_EVENTS];
+        bool deferred = false;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            int nevents = epoll_wait(w->epfd, events, Worker::MAX_EVENTS, deferred ? RETRY_TIMEOUT_MS : WAIT_TIMEOUT_MS);
+            if (nevents < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw_error("epoll error", errno);
+            }
+            for (int i = 0; i < nevents; i++) {
+                int fd = events[i].data.fd;
+                if (fd == w->listen_fd) {
+                    on_accept();
+                    continue;
+                }
+                auto it = w->connections.find(fd);
+                if (it == w->connections.end()) {
+                    continue;
+                }
+                auto conn = it->second.get();
+                if ((events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && !conn->on_readable()) {
+                    w->connections.erase(it);
+                    continue;
+                }
+                w->update(conn);
+            }
+            // Streams that were waiting for the data are polled again
+            deferred = false;
+            std::vector<Connection*> waiting;
+            for (auto& kv: w->connections) {
+                if (!kv.second->deferred.empty()) {
+                    waiting.push_back(kv.second.get());
+                }
+            }
+            for (auto conn: waiting) {
+                conn->resume();
+                if (w->update(conn) && !conn->deferred.empty()) {
+                    deferred = true;
+                }
+            }
+        }
+        logger_.info() << "Event loop " << ix << " stopped";
+    } catch (...) {
+        logger_.error() << "Error in event loop " << ix << ": " << boost::current_exception_diagnostic_information();
+    }
+    w->release();
+    stop_barrier_.wait();
+}
+
+static Logger s_logger_("http2-server");
+
+static const size_t MIN_CHUNK_SIZE = 0x8000;
+
+struct Http2ServerBuilder {
+
+    Http2ServerBuilder() {
+        ServerFactory::instance().register_type("HTTP2", *this);
+    }
+
+    std::shared_ptr<Server> operator () (std::shared_ptr<DbConnection>,
+                                         std::shared_ptr<ReadOperationBuilder> qproc,
+                                         const ServerSettings& settings) {
+        if (settings.protocols.size() != 1) {
+            s_logger_.error() << "Can't initialize HTTP/2 server, more than one protocol specified";
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid http2-server settings"));
+        }
+        HttpSettings http;
+        u32 max_streams = 100;
+        try {
+            auto it = settings.options.find("chunk_size");
+            if (it != settings.options.end()) {
+                http.chunk_size = std::max(boost::lexical_cast<size_t>(it->second), MIN_CHUNK_SIZE);
+            }
+            it = settings.options.find("max_streams");
+            if (it != settings.options.end()) {
+                max_streams = boost::lexical_cast<u32>(it->second);
+            }
+        } catch (boost::bad_lexical_cast const&) {
+            s_logger_.error() << "Can't initialize HTTP/2 server, invalid chunk_size or max_streams value";
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid http2-server settings"));
+        }
+        auto it = settings.options.find("compression");
+        if (it != settings.options.end()) {
+            if (it->second == "gzip") {
+                http.gzip = true;
+            } else if (it->second != "none") {
+                s_logger_.error() << "Unknown HTTP compression method " << it->second;
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid http2-server settings"));
+            }
+        }
+        if (max_streams == 0 || settings.nworkers <= 0) {
+            s_logger_.error() << "Can't initialize HTTP/2 server, pool_size and max_streams should be positive";
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid http2-server settings"));
+        }
+        return std::make_shared<Http2Server>(settings.protocols.front().port, qproc, settings.nworkers,
+                                             max_streams, http);
+    }
+};
+
+static Http2ServerBuilder reg_type;
+
+}  // namespace Http
+}  // namespace Akumuli
+
+#endif
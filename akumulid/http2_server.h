@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef AKU_WITH_NGHTTP2
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <boost/thread/barrier.hpp>
+
+#include "httpserver.h"
+#include "logger.h"
+#include "server.h"
+
+
+namespace Akumuli {
+namespace Http {
+
+/** HTTP/2 query endpoint (cleartext HTTP/2 with prior knowledge, no TLS and
+  * no upgrade from HTTP/1.1).
+  * Serves the same query endpoints as the HTTP server (`/api/query`, `/api/suggest`,
+  * `/api/search`, `/api/subscribe`, `/api/explain` and `/api/execute/<id>`), every request is
+  * a separate stream so many queries can share one connection.
+  * Every worker owns an epoll instance and SO_REUSEPORT listening socket, the
+  * kernel balances the connections between the workers. Response data is read
+  * from the cursor directly into the DATA frame when the flow control window of
+  * the stream allows it and the socket is writable, so slow clients don't make
+  * the cursors buffer the results. Streams whose cursors have no data yet are
+  * resumed on the next iteration of the event loop.
+  */
+class Http2Server : public std::enable_shared_from_this<Http2Server>, public Server {
+    struct Worker;
+    struct Connection;
+    struct Stream;
+
+    std::shared_ptr<ReadOperationBuilder> proc_;
+    const int                             port_;
+    const int                             nworkers_;
+    const u32                             max_streams_;
+    HttpSettings                          settings_;
+    boost::barrier                        start_barrier_;  //< Barrier to start worker thread
+    boost::barrier                        stop_barrier_;   //< Barrier to stop worker thread
+    std::atomic<int>                      stop_;
+    std::vector<std::unique_ptr<Worker>>  workers_;
+
+    Logger logger_;
+
+    //! Max wait time, defines how fast the workers react to stop
+    static const int WAIT_TIMEOUT_MS = 100;
+    //! Wait time if some streams are waiting for the cursor
+    static const int RETRY_TIMEOUT_MS = 1;
+
+public:
+    /** C-tor.
+      * @param port port number
+      * @param qproc query processor
+      * @param nworkers number of workers
+      * @param max_streams max number of concurrent streams per connection
+      * @param settings HTTP settings (chunk size and compression are used)
+      */
+    Http2Server(int port, std::shared_ptr<ReadOperationBuilder> qproc, int nworkers, u32 max_streams,
+                HttpSettings const& settings);
+
+    ~Http2Server();
+
+    //! Create listening sockets and start the workers
+    virtual void start(SignalHandler* sig, int id);
+
+private:
+    //! Stop the workers (should be called from signal handler)
+    void stop();
+
+    //! Event loop of the worker
+    void run(Worker* worker, int ix);
+};
+
+}  // namespace Http
+}  // namespace Akumuli
+
+#endif
@@ -1,51 +1,211 @@
 #include "httpserver.h"
+#include "profiler.h"
 #include "utility.h"
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <sstream>
 #include <thread>
 
 #include <boost/bind.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#ifdef AKU_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 namespace Akumuli {
 namespace Http {
 
 static Logger logger("http");
 
+//! Add memory usage of the process to the storage stats
+static std::string add_memory_stats(std::string const& stats) {
+    boost::property_tree::ptree tree;
+    std::stringstream input(stats);
+    try {
+        boost::property_tree::json_parser::read_json(input, tree);
+    } catch (boost::property_tree::json_parser_error const&) {
+        return stats;
+    }
+    std::vector<std::pair<std::string, u64>> memory;
+    MemoryStats::collect(&memory);
+    for (auto const& kv: memory) {
+        tree.put(kv.first, kv.second);
+    }
+    std::stringstream output;
+    boost::property_tree::json_parser::write_json(output, tree, true);
+    return output.str();
+}
+
+QueryResponse::QueryResponse(ReadOperation* cur, bool pooled, bool compress, size_t chunk_size)
+    : cursor(cur)
+    , pooled(pooled)
+    , compress(compress)
+    , eof(false)
+    , pending(false)
+    , finished(false)
+{
+    // Pool thread serves other connections, it shouldn't wait for the query
+    cursor->set_nonblocking(pooled);
+    if (compress) {
+        memset(&zstream, 0, sizeof(zstream));
+        // 15 + 16 is a max window size with gzip header
+        if (deflateInit2(&zstream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            logger.error() << "Can't initialize gzip stream, response is not compressed";
+            this->compress = false;
+        } else {
+            inbuf.resize(chunk_size);
+        }
+    }
+}
+
+QueryResponse::~QueryResponse() {
+    if (compress) {
+        deflateEnd(&zstream);
+    }
+}
+
+std::tuple<size_t, bool> QueryResponse::read_some(char* buf, size_t max) {
+    if (!compress) {
+        return cursor->read_some(buf, max);
+    }
+    if (finished) {
+        return std::make_tuple(0u, true);
+    }
+    zstream.next_out  = reinterpret_cast<Bytef*>(buf);
+    zstream.avail_out = static_cast<uInt>(max);
+    while (zstream.avail_out != 0) {
+        int flush = Z_NO_FLUSH;
+        if (!eof && zstream.avail_in == 0) {
+            size_t sz;
+            std::tie(sz, eof) = cursor->read_some(inbuf.data(), inbuf.size());
+            zstream.next_in  = reinterpret_cast<Bytef*>(inbuf.data());
+            zstream.avail_in = static_cast<uInt>(sz);
+            if (!eof && sz == 0) {
+                if (!pending) {
+                    break;
+                }
+                // Data is not ready yet, send everything that was compressed so far
+                flush = Z_SYNC_FLUSH;
+            }
+        }
+        if (eof) {
+            flush = Z_FINISH;
+        }
+        int ret = deflate(&zstream, flush);
+        if (ret == Z_STREAM_END) {
+            finished = true;
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            logger.error() << "Cursor " << reinterpret_cast<u64>(cursor) << " gzip stream error " << ret;
+            finished = true;
+            break;
+        }
+        if (flush == Z_SYNC_FLUSH) {
+            // Flush is complete if there is some space left in the output buffer
+            pending = zstream.avail_out == 0;
+            if (!pending) {
+                break;
+            }
+        } else {
+            pending = true;
+        }
+    }
+    size_t sz = max - zstream.avail_out;
+    return std::make_tuple(sz, finished && sz == 0);
+}
+
+static const char* EXECUTE_PREFIX = "/api/execute/";
+
+ApiEndpoint get_endpoint(const std::string& path) {
+    if (path == "/api/query") {
+        return ApiEndpoint::QUERY;
+    } else if (path == "/api/suggest") {
+        return ApiEndpoint::SUGGEST;
+    } else if (path == "/api/search") {
+        return ApiEndpoint::SEARCH;
+    } else if (path == "/api/subscribe") {
+        return ApiEndpoint::SUBSCRIBE;
+    } else if (path == "/api/explain") {
+        return ApiEndpoint::EXPLAIN;
+    } else if (path.compare(0, strlen(EXECUTE_PREFIX), EXECUTE_PREFIX) == 0) {
+        return ApiEndpoint::EXECUTE;
+    }
+    return ApiEndpoint::UNKNOWN;
+}
+
+bool get_prepared_id(const std::string& path, u64* id) {
+    try {
+        *id = boost::lexical_cast<u64>(path.substr(strlen(EXECUTE_PREFIX)));
+    } catch (boost::bad_lexical_cast const&) {
+        return false;
+    }
+    return true;
+}
+
 //! Microhttpd callback functions
 namespace MHD {
 static ssize_t read_callback(void *data, u64 pos, char *buf, size_t max) {
     AKU_UNUSED(pos);
-    ReadOperation* cur = (ReadOperation*)data;
+    QueryResponse* response = (QueryResponse*)data;
     size_t sz;
     bool is_done;
-    std::tie(sz, is_done) = cur->read_some(buf, max);
+    std::tie(sz, is_done) = response->read_some(buf, max);
     if (is_done) {
-        logger.info() << "Cursor " << reinterpret_cast<u64>(cur) << " done";
+        logger.info() << "Cursor " << reinterpret_cast<u64>(response->cursor) << " done";
         return MHD_CONTENT_READER_END_OF_STREAM;
     } else {
         if (sz == 0u) {
-            // Not at the end of the stream but data is not ready yet.
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            // Not at the end of the stream but data is not ready yet. Pooled cursor
+            // doesn't wait for the query, short pause keeps the pool thread from
+            // spinning on the writable socket while it serves other connections.
+            std::this_thread::sleep_for(std::chrono::milliseconds(response->pooled ? 1 : 10));
         }
     }
     return sz;
 }
 
 static void free_callback(void *data) {
-    ReadOperation* cur = (ReadOperation*)data;
+    QueryResponse* response = (QueryResponse*)data;
+    ReadOperation* cur = response->cursor;
     cur->close();
     logger.info() << "Cursor " << reinterpret_cast<u64>(cur) << " destroyed";
+    delete response;
     delete cur;
 }
 
-static ApiEndpoint get_endpoint(const std::string& path) {
-    if (path == "/api/query") {
-        return ApiEndpoint::QUERY;
-    } else if (path == "/api/suggest") {
-        return ApiEndpoint::SUGGEST;
-    } else if (path == "/api/search") {
-        return ApiEndpoint::SEARCH;
+//! Check `Accept-Encoding` header of the request
+static bool accepts_gzip(MHD_Connection* connection) {
+    const char* encoding = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    return encoding != nullptr && strstr(encoding, "gzip") != nullptr;
+}
+
+//! Get numeric value of the url parameter
+static u32 get_argument(MHD_Connection* connection, const char* name, u32 default_value) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    if (value == nullptr) {
+        return default_value;
+    }
+    try {
+        return boost::lexical_cast<u32>(value);
+    } catch (boost::bad_lexical_cast const&) {
+        return 0;  // rejected by the profiler
     }
-    return ApiEndpoint::UNKNOWN;
+}
+
+//! Bulk write endpoint
+static bool is_write_endpoint(const std::string& path) {
+    return path == "/api/write";
+}
+
+//! Prepare query endpoint, response contains id of the prepared query
+static bool is_prepare_endpoint(const std::string& path) {
+    return path == "/api/prepare";
 }
 
 static int accept_connection(void           *cls,
@@ -57,22 +217,154 @@ static int accept_connection(void           *cls,
                              size_t         *upload_data_size,
                              void          **con_cls)
 {
+    // MHD doesn't report thread start, policy is applied on the first request
+    static thread_local bool policy_applied = false;
+    if (!policy_applied) {
+        aku_apply_thread_policy(AKU_THREAD_HTTP);
+        policy_applied = true;
+    }
     std::string path = url;
     auto error_response = [&](const char* msg, unsigned int error_code) {
-        char buffer[0x200];
-        int len = snprintf(buffer, 0x200, "-%s\r\n", msg);
-        auto response = MHD_create_response_from_buffer(len, buffer, MHD_RESPMEM_MUST_COPY);
+        // Buffer is owned by the response
+        const size_t size = 0x200;
+        char* buffer = static_cast<char*>(malloc(size));
+        if (buffer == nullptr) {
+            return static_cast<int>(MHD_NO);
+        }
+        int len = snprintf(buffer, size, "-%s\r\n", msg);
+        len = std::min(len, static_cast<int>(size) - 1);
+        auto response = MHD_create_response_from_buffer(len, buffer, MHD_RESPMEM_MUST_FREE);
         int ret = MHD_queue_response(connection, error_code, response);
         MHD_destroy_response(response);
         return ret;
     };
-    if (strcmp(method, "POST") == 0) {
+    HttpServer* server = static_cast<HttpServer*>(cls);
+    if (strcmp(method, "POST") == 0 && is_write_endpoint(path)) {
+        if (!server->db_) {
+            std::string error_msg = "Write endpoint is not available";
+            logger.error() << error_msg;
+            return error_response(error_msg.c_str(), MHD_HTTP_NOT_FOUND);
+        }
+        WriteOperation* writer = static_cast<WriteOperation*>(*con_cls);
+        if (writer == nullptr) {
+            auto format = WriteOperation::Format::RESP;
+            const char* name = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+            if (name != nullptr && !WriteOperation::get_format(name, &format)) {
+                std::string error_msg = std::string("Unknown format ") + name;
+                logger.error() << error_msg;
+                return error_response(error_msg.c_str(), MHD_HTTP_BAD_REQUEST);
+            }
+            auto encoding = WriteOperation::Encoding::IDENTITY;
+            name = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_ENCODING);
+            if (name != nullptr && !WriteOperation::get_encoding(name, &encoding)) {
+                std::string error_msg = std::string("Unsupported content encoding ") + name;
+                logger.error() << error_msg;
+                return error_response(error_msg.c_str(), MHD_HTTP_UNSUPPORTED_MEDIA_TYPE);
+            }
+            std::shared_ptr<DbSession> session;
+            const char* tenant = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "tenant");
+            if (tenant != nullptr) {
+                session = server->db_->create_tenant_session(tenant);
+                if (!session) {
+                    std::string error_msg = std::string("Can't open tenant ") + tenant;
+                    logger.error() << error_msg;
+                    return error_response(error_msg.c_str(), MHD_HTTP_BAD_REQUEST);
+                }
+            } else {
+                session = server->db_->create_session();
+            }
+            writer = new WriteOperation(session, format, encoding);
+            *con_cls = writer;
+            return MHD_YES;
+        }
+        if (*upload_data_size) {
+            writer->append(upload_data, *upload_data_size);
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+        // Request body is processed
+        writer->finish();
+        std::string error_msg;
+        bool db_error;
+        std::tie(error_msg, db_error) = writer->get_error();
+        delete writer;
+        *con_cls = nullptr;
+        if (!error_msg.empty()) {
+            logger.error() << "Bulk write error: " << error_msg;
+            auto response = MHD_create_response_from_buffer(error_msg.size(), const_cast<char*>(error_msg.data()), MHD_RESPMEM_MUST_COPY);
+            int ret = MHD_queue_response(connection, db_error ? MHD_HTTP_INTERNAL_SERVER_ERROR : MHD_HTTP_BAD_REQUEST, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+        static const char* OK = "+OK\r\n";
+        auto response = MHD_create_response_from_buffer(strlen(OK), const_cast<char*>(OK), MHD_RESPMEM_PERSISTENT);
+        int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+        MHD_destroy_response(response);
+        return ret;
+    } else if (strcmp(method, "POST") == 0 && is_prepare_endpoint(path)) {
+        std::string* query = static_cast<std::string*>(*con_cls);
+        if (query == nullptr) {
+            *con_cls = new std::string();
+            return MHD_YES;
+        }
+        if (*upload_data_size) {
+            query->append(upload_data, *upload_data_size);
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
+        // Request body is received
+        std::unique_ptr<std::string> text(query);
+        *con_cls = nullptr;
+        aku_Status status;
+        u64 id;
+        try {
+            std::tie(status, id) = server->proc_->prepare(*text);
+        } catch (const std::exception& err) {
+            logger.error() << "Prepare error: " << err.what();
+            return error_response(err.what(), MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        if (status != AKU_SUCCESS) {
+            const char* error_msg = aku_error_message(status);
+            logger.error() << "Can't prepare query: " << error_msg;
+            return error_response(error_msg, MHD_HTTP_BAD_REQUEST);
+        }
+        std::string result = "+" + std::to_string(id) + "\r\n";
+        auto response = MHD_create_response_from_buffer(result.size(), const_cast<char*>(result.data()), MHD_RESPMEM_MUST_COPY);
+        int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+        MHD_destroy_response(response);
+        return ret;
+    } else if (strcmp(method, "POST") == 0) {
         ApiEndpoint endpoint = get_endpoint(path);
         if (endpoint != ApiEndpoint::UNKNOWN) {
-            ReadOperationBuilder *queryproc = static_cast<ReadOperationBuilder*>(cls);
+            ReadOperationBuilder *queryproc = server->proc_.get();
             ReadOperation* cursor = static_cast<ReadOperation*>(*con_cls);
             if (cursor == nullptr) {
-                cursor = queryproc->create(endpoint);
+                const char* tenant = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "tenant");
+                if (tenant != nullptr && endpoint == ApiEndpoint::EXECUTE) {
+                    // Prepared queries are resolved using the default namespace
+                    std::string error_msg = "Prepared queries can't be used with tenants";
+                    logger.error() << error_msg;
+                    return error_response(error_msg.c_str(), MHD_HTTP_BAD_REQUEST);
+                } else if (tenant != nullptr) {
+                    cursor = queryproc->create_tenant(endpoint, tenant);
+                    if (cursor == nullptr) {
+                        std::string error_msg = std::string("Can't open tenant ") + tenant;
+                        logger.error() << error_msg;
+                        return error_response(error_msg.c_str(), MHD_HTTP_BAD_REQUEST);
+                    }
+                } else if (endpoint == ApiEndpoint::EXECUTE) {
+                    u64 id;
+                    if (get_prepared_id(path, &id)) {
+                        cursor = queryproc->create_execute(id);
+                    }
+                    if (cursor == nullptr) {
+                        std::string error_msg = "Unknown prepared query " + path;
+                        logger.error() << error_msg;
+                        return error_response(error_msg.c_str(), MHD_HTTP_NOT_FOUND);
+                    }
+                } else {
+                    cursor = queryproc->create(endpoint);
+                }
                 *con_cls = cursor;
                 logger.info() << "Cursor " << reinterpret_cast<u64>(con_cls) << " created";
                 return MHD_YES;
@@ -100,7 +392,13 @@ static int accept_connection(void           *cls,
                 return error_response(error_msg, MHD_HTTP_BAD_REQUEST);
             }
 
-            auto response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 64*1024, &read_callback, cursor, &free_callback);
+            bool gzip = server->settings_.gzip && accepts_gzip(connection);
+            auto qresponse = new QueryResponse(cursor, server->settings_.pool_size > 0, gzip, server->settings_.chunk_size);
+            auto response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, server->settings_.chunk_size,
+                                                              &read_callback, qresponse, &free_callback);
+            if (qresponse->compress) {
+                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
+            }
             int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
             MHD_destroy_response(response);
             return ret;
@@ -111,14 +409,14 @@ static int accept_connection(void           *cls,
         }
     } else if (strcmp(method, "GET") == 0) {
         static const char* SIGIL = "";
-        auto queryproc = static_cast<ReadOperationBuilder*>(cls);
+        auto queryproc = server->proc_.get();
         auto cursor = static_cast<const char*>(*con_cls);
         if (cursor == nullptr) {
             *con_cls = const_cast<char*>(SIGIL);
             return MHD_YES;
         }
         if (path == "/api/stats") {
-            std::string stats = queryproc->get_all_stats();
+            std::string stats = add_memory_stats(queryproc->get_all_stats());
             auto response = MHD_create_response_from_buffer(stats.size(), const_cast<char*>(stats.data()), MHD_RESPMEM_MUST_COPY);
             int ret = MHD_add_response_header(response, "content-type", "application/json");
             if (ret == MHD_NO) {
@@ -127,6 +425,48 @@ static int accept_connection(void           *cls,
             ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
             MHD_destroy_response(response);
             return ret;
+        } else if (path == "/metrics") {
+            std::string metrics = queryproc->get_metrics();
+            auto response = MHD_create_response_from_buffer(metrics.size(), const_cast<char*>(metrics.data()), MHD_RESPMEM_MUST_COPY);
+            int ret = MHD_add_response_header(response, "content-type", "text/plain; version=0.0.4");
+            if (ret == MHD_NO) {
+                return ret;
+            }
+            ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+            MHD_destroy_response(response);
+            return ret;
+        } else if (path == "/api/profile/cpu" || path == "/api/profile/heap") {
+            if (!server->settings_.profiling) {
+                return error_response("Profiling is disabled", MHD_HTTP_NOT_FOUND);
+            }
+            std::string profile;
+            aku_Status status;
+            if (path == "/api/profile/cpu") {
+                // Blocks the connection thread until the profile is captured
+                auto seconds = get_argument(connection, "seconds", 30);
+                auto frequency = get_argument(connection, "frequency", CpuProfiler::DEFAULT_FREQUENCY);
+                status = CpuProfiler::collect(std::chrono::seconds(seconds), frequency, &profile);
+            } else {
+                status = HeapProfiler::dump(&profile);
+            }
+            if (status == AKU_EBUSY) {
+                return error_response("Profile is already being captured", MHD_HTTP_SERVICE_UNAVAILABLE);
+            } else if (status == AKU_EBAD_ARG) {
+                return error_response("Invalid profiling parameters", MHD_HTTP_BAD_REQUEST);
+            } else if (status == AKU_ENOT_IMPLEMENTED) {
+                return error_response("Heap profiling requires jemalloc with MALLOC_CONF=prof:true",
+                                      MHD_HTTP_NOT_IMPLEMENTED);
+            } else if (status != AKU_SUCCESS) {
+                return error_response("Can't capture the profile", MHD_HTTP_INTERNAL_SERVER_ERROR);
+            }
+            auto response = MHD_create_response_from_buffer(profile.size(), const_cast<char*>(profile.data()), MHD_RESPMEM_MUST_COPY);
+            int ret = MHD_add_response_header(response, "content-type", "application/octet-stream");
+            if (ret == MHD_NO) {
+                return ret;
+            }
+            ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+            MHD_destroy_response(response);
+            return ret;
         } else if (path == "/api/function-names") {
             std::string stats = queryproc->get_resource("function-names");
             auto response = MHD_create_response_from_buffer(stats.size(), const_cast<char*>(stats.data()), MHD_RESPMEM_MUST_COPY);
@@ -149,6 +489,247 @@ static int accept_connection(void           *cls,
 }
 }
 
+struct WriteOperation::Parser {
+    virtual ~Parser() = default;
+    //! Parse data, throws the same exceptions as protocol parsers
+    virtual void parse(const char* data, size_t size) = 0;
+    virtual std::string error_repr(int kind, std::string const& err) const = 0;
+};
+
+template<class ParserT>
+struct ProtocolBodyParser : WriteOperation::Parser {
+    ParserT parser_;
+
+    ProtocolBodyParser(std::shared_ptr<DbSession> session)
+        : parser_(session)
+    {
+        parser_.start();
+    }
+
+    ~ProtocolBodyParser() {
+        parser_.close();
+    }
+
+    virtual void parse(const char* data, size_t size) {
+        while (size) {
+            u32 chunk = static_cast<u32>(std::min(size, static_cast<size_t>(ParserT::RDBUF_SIZE)));
+            Byte* buf = parser_.get_next_buffer();
+            memcpy(buf, data, chunk);
+            parser_.parse_next(buf, chunk);
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    virtual std::string error_repr(int kind, std::string const& err) const {
+        return parser_.error_repr(kind, err);
+    }
+};
+
+struct WriteOperation::Decoder {
+    enum {
+        OUTPUT_SIZE = 0x10000,
+    };
+    Encoding          encoding;
+    z_stream          zstream;
+#ifdef AKU_WITH_ZSTD
+    ZSTD_DStream*     zstd;
+#endif
+    std::vector<char> output;
+    //! Compressed stream is complete
+    bool              done;
+    //! Stream can't be initialized
+    const char*       init_error;
+
+    Decoder(Encoding enc)
+        : encoding(enc)
+        , output(OUTPUT_SIZE)
+        , done(false)
+        , init_error(nullptr)
+    {
+        if (encoding == Encoding::GZIP) {
+            memset(&zstream, 0, sizeof(zstream));
+            // 15 + 32 is a max window size with automatic gzip/zlib header detection
+            if (inflateInit2(&zstream, 15 + 32) != Z_OK) {
+                init_error = "can't initialize gzip stream";
+            }
+        }
+#ifdef AKU_WITH_ZSTD
+        if (encoding == Encoding::ZSTD) {
+            zstd = ZSTD_createDStream();
+            if (zstd == nullptr || ZSTD_isError(ZSTD_initDStream(zstd))) {
+                init_error = "can't initialize zstd stream";
+            }
+        }
+#endif
+    }
+
+    ~Decoder() {
+        if (encoding == Encoding::GZIP && init_error == nullptr) {
+            inflateEnd(&zstream);
+        }
+#ifdef AKU_WITH_ZSTD
+        if (encoding == Encoding::ZSTD) {
+            ZSTD_freeDStream(zstd);
+        }
+#endif
+    }
+
+    /** Decompress the data and pass the output to `sink` in chunks.
+      * @return error message or nullptr
+      */
+    template<class Fn>
+    const char* decode(const char* data, size_t size, Fn const& sink) {
+        if (init_error != nullptr) {
+            return init_error;
+        }
+        if (encoding == Encoding::GZIP) {
+            zstream.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            zstream.avail_in = static_cast<uInt>(size);
+            // Inflate can consume the whole input but keep the output that doesn't
+            // fit into the buffer, continue until the output buffer is not filled.
+            while (!done) {
+                zstream.next_out  = reinterpret_cast<Bytef*>(output.data());
+                zstream.avail_out = static_cast<uInt>(output.size());
+                int ret = inflate(&zstream, Z_NO_FLUSH);
+                if (ret == Z_BUF_ERROR && zstream.avail_in == 0) {
+                    // No progress is possible until the next chunk arrives
+                    break;
+                }
+                if (ret != Z_OK && ret != Z_STREAM_END) {
+                    return "invalid gzip stream";
+                }
+                sink(output.data(), output.size() - zstream.avail_out);
+                if (ret == Z_STREAM_END) {
+                    done = true;
+                } else if (zstream.avail_in == 0 && zstream.avail_out != 0) {
+                    break;
+                }
+            }
+        }
+#ifdef AKU_WITH_ZSTD
+        if (encoding == Encoding::ZSTD) {
+            ZSTD_inBuffer in = { data, size, 0 };
+            while (true) {
+                ZSTD_outBuffer out = { output.data(), output.size(), 0 };
+                size_t ret = ZSTD_decompressStream(zstd, &out, &in);
+                if (ZSTD_isError(ret)) {
+                    return "invalid zstd stream";
+                }
+                sink(output.data(), out.pos);
+                // Zero means that the frame is complete and flushed, next frame can follow
+                done = ret == 0;
+                // Full output buffer means that the decoder can have more data to flush
+                if (in.pos == in.size && (done || out.pos < out.size)) {
+                    break;
+                }
+            }
+        }
+#endif
+        return nullptr;
+    }
+};
+
+WriteOperation::WriteOperation(std::shared_ptr<DbSession> session, Format format, Encoding encoding)
+    : db_error_(false)
+{
+    switch (format) {
+    case Format::RESP:
+        parser_.reset(new ProtocolBodyParser<RESPProtocolParser>(session));
+        break;
+    case Format::INFLUX:
+        parser_.reset(new ProtocolBodyParser<InfluxProtocolParser>(session));
+        break;
+    case Format::GRAPHITE:
+        parser_.reset(new ProtocolBodyParser<GraphiteProtocolParser>(session));
+        break;
+    }
+    if (encoding != Encoding::IDENTITY) {
+        decoder_.reset(new Decoder(encoding));
+    }
+}
+
+WriteOperation::~WriteOperation() {
+}
+
+bool WriteOperation::get_format(const char* name, Format* format) {
+    if (strcmp(name, "resp") == 0) {
+        *format = Format::RESP;
+    } else if (strcmp(name, "influx") == 0) {
+        *format = Format::INFLUX;
+    } else if (strcmp(name, "graphite") == 0) {
+        *format = Format::GRAPHITE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool WriteOperation::get_encoding(const char* name, Encoding* encoding) {
+    if (strcmp(name, "identity") == 0) {
+        *encoding = Encoding::IDENTITY;
+    } else if (strcmp(name, "gzip") == 0 || strcmp(name, "x-gzip") == 0 || strcmp(name, "deflate") == 0) {
+        *encoding = Encoding::GZIP;
+#ifdef AKU_WITH_ZSTD
+    } else if (strcmp(name, "zstd") == 0) {
+        *encoding = Encoding::ZSTD;
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void WriteOperation::append(const char* data, size_t size) {
+    if (!error_.empty()) {
+        // The rest of the request is ignored after error
+        return;
+    }
+    if (!decoder_) {
+        parse(data, size);
+        return;
+    }
+    auto err = decoder_->decode(data, size, [this](const char* out, size_t outsize) {
+        if (error_.empty()) {
+            parse(out, outsize);
+        }
+    });
+    if (err != nullptr && error_.empty()) {
+        error_ = parser_->error_repr(RESPProtocolParser::PARSE, err);
+    }
+}
+
+void WriteOperation::finish() {
+    if (error_.empty() && decoder_ && !decoder_->done) {
+        error_ = parser_->error_repr(RESPProtocolParser::PARSE, "compressed stream is truncated");
+    }
+}
+
+void WriteOperation::parse(const char* data, size_t size) {
+    try {
+        parser_->parse(data, size);
+    } catch (StreamError const& err) {
+        error_ = parser_->error_repr(RESPProtocolParser::PARSE, err.what());
+    } catch (DatabaseError const& err) {
+        error_ = parser_->error_repr(RESPProtocolParser::DB, err.what());
+        db_error_ = true;
+    } catch (...) {
+        error_ = parser_->error_repr(RESPProtocolParser::ERR, boost::current_exception_diagnostic_information());
+    }
+}
+
+std::tuple<std::string, bool> WriteOperation::get_error() const {
+    return std::make_tuple(error_, db_error_);
+}
+
+HttpSettings::HttpSettings()
+    : pool_size(0)
+    , chunk_size(64*1024)
+    , gzip(false)
+    , profiling(false)
+{
+}
+
 HttpServer::HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc, AccessControlList const& acl)
     : acl_(acl)
     , proc_(qproc)
@@ -162,18 +743,50 @@ HttpServer::HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder
 {
 }
 
+HttpServer::HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc, std::shared_ptr<DbConnection> db)
+    : HttpServer(port, qproc, AccessControlList())
+{
+    db_ = db;
+}
+
+HttpServer::HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc,
+                       std::shared_ptr<DbConnection> db, HttpSettings const& settings)
+    : HttpServer(port, qproc, db)
+{
+    settings_ = settings;
+}
+
 void HttpServer::start(SignalHandler* sig, int id) {
-    logger.info() << "Start MHD daemon";
-    daemon_ = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
-                               port_,
-                               NULL,
-                               NULL,
-                               &MHD::accept_connection,
-                               proc_.get(),
-                               MHD_OPTION_END);
+    if (settings_.pool_size > 0) {
+        logger.info() << "Start MHD daemon, thread pool size: " << settings_.pool_size;
+        daemon_ = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY,
+                                   port_,
+                                   NULL,
+                                   NULL,
+                                   &MHD::accept_connection,
+                                   this,
+                                   MHD_OPTION_THREAD_POOL_SIZE, static_cast<unsigned int>(settings_.pool_size),
+                                   MHD_OPTION_END);
+    } else {
+        logger.info() << "Start MHD daemon";
+        daemon_ = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
+                                   port_,
+                                   NULL,
+                                   NULL,
+                                   &MHD::accept_connection,
+                                   this,
+                                   MHD_OPTION_END);
+    }
     if (daemon_ == nullptr) {
         BOOST_THROW_EXCEPTION(std::runtime_error("can't start daemon"));
     }
+    if (settings_.profiling) {
+        if (HeapProfiler::activate()) {
+            logger.info() << "Profiling endpoints enabled, heap profiling is active";
+        } else {
+            logger.info() << "Profiling endpoints enabled, heap profiling is not available";
+        }
+    }
 
     auto self = shared_from_this();
     sig->add_handler(boost::bind(&HttpServer::stop, std::move(self)), id);
@@ -186,20 +799,44 @@ void HttpServer::stop() {
 
 static Logger s_logger_("http-server");
 
+static const size_t MIN_CHUNK_SIZE = 0x8000;
+
 struct HttpServerBuilder {
 
     HttpServerBuilder() {
         ServerFactory::instance().register_type("HTTP", *this);
     }
 
-    std::shared_ptr<Server> operator () (std::shared_ptr<DbConnection>,
+    std::shared_ptr<Server> operator () (std::shared_ptr<DbConnection> con,
                                          std::shared_ptr<ReadOperationBuilder> qproc,
                                          const ServerSettings& settings) {
         if (settings.protocols.size() != 1) {
             s_logger_.error() << "Can't initialize HTTP server, more than one protocol specified";
             BOOST_THROW_EXCEPTION(std::runtime_error("invalid http-server settings"));
         }
-        return std::make_shared<HttpServer>(settings.protocols.front().port, qproc);
+        HttpSettings http;
+        if (settings.nworkers > 0) {
+            http.pool_size = settings.nworkers;
+        }
+        auto it = settings.options.find("chunk_size");
+        if (it != settings.options.end()) {
+            // Chunk should fit the largest formatted sample (series name and value)
+            http.chunk_size = std::max(boost::lexical_cast<size_t>(it->second), MIN_CHUNK_SIZE);
+        }
+        it = settings.options.find("compression");
+        if (it != settings.options.end()) {
+            if (it->second == "gzip") {
+                http.gzip = true;
+            } else if (it->second != "none") {
+                s_logger_.error() << "Unknown HTTP compression method " << it->second;
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid http-server settings"));
+            }
+        }
+        it = settings.options.find("profiling");
+        if (it != settings.options.end()) {
+            http.profiling = it->second == "true";
+        }
+        return std::make_shared<HttpServer>(settings.protocols.front().port, qproc, con, http);
     }
 };
 
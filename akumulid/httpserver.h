@@ -18,27 +18,136 @@
 #include <memory>
 #include <string>
 #include <tuple>
+#include <vector>
 
 #include <microhttpd.h>
+#include <zlib.h>
 
 #include "akumuli.h"
 #include "logger.h"
 #include "server.h"
+#include "protocolparser.h"
 
 namespace Akumuli {
 namespace Http {
 
 struct AccessControlList {};  // TODO: implement ACL
 
+/** Bulk write operation.
+  * Request body can be encoded using RESP protocol (the same format that TCP
+  * server uses, binary protocol is detected automatically), InfluxDB line protocol
+  * or Graphite plaintext protocol. Body can be compressed using gzip, deflate or
+  * zstd (`Content-Encoding` header), it's decompressed incrementally as the chunks
+  * arrive. Samples are written in batches.
+  */
+struct WriteOperation {
+    //! Format of the request body
+    enum class Format {
+        RESP,
+        INFLUX,
+        GRAPHITE,
+    };
+
+    //! Content encoding of the request body
+    enum class Encoding {
+        IDENTITY,
+        GZIP,  //< gzip or deflate (zlib), the header is detected automatically
+        ZSTD,
+    };
+
+    //! Protocol parser (type erased)
+    struct Parser;
+    //! Decompressor state
+    struct Decoder;
+
+    std::unique_ptr<Parser>  parser_;
+    std::unique_ptr<Decoder> decoder_;
+    std::string              error_;
+    bool                     db_error_;
+
+    WriteOperation(std::shared_ptr<DbSession> session,
+                   Format format = Format::RESP,
+                   Encoding encoding = Encoding::IDENTITY);
+    ~WriteOperation();
+
+    //! Parse next portion of the request body
+    void append(const char* data, size_t size);
+
+    //! Should be called when the whole body is received, checks that compressed stream is complete
+    void finish();
+
+    //! Return error message (empty on success) and true if error was caused by the database
+    std::tuple<std::string, bool> get_error() const;
+
+    //! Get format by name (`format` url parameter), return false if format is unknown
+    static bool get_format(const char* name, Format* format);
+
+    //! Get encoding by name (`Content-Encoding` header), return false if encoding is not supported
+    static bool get_encoding(const char* name, Encoding* encoding);
+
+private:
+    //! Pass decoded data to the parser
+    void parse(const char* data, size_t size);
+};
+
+//! Query results that are sent to the client
+struct QueryResponse {
+    ReadOperation*    cursor;
+    //! Thread pool is used, the callback shouldn't block
+    bool              pooled;
+    bool              compress;
+    z_stream          zstream;
+    //! Uncompressed data
+    std::vector<char> inbuf;
+    //! Cursor is done
+    bool              eof;
+    //! Compressed stream has some data that wasn't flushed yet
+    bool              pending;
+    //! Compressed stream is complete
+    bool              finished;
+
+    QueryResponse(ReadOperation* cur, bool pooled, bool compress, size_t chunk_size);
+    ~QueryResponse();
+
+    //! Same as ReadOperation::read_some but compresses the output if needed
+    std::tuple<size_t, bool> read_some(char* buf, size_t max);
+};
+
+//! Get query endpoint by url path
+ApiEndpoint get_endpoint(const std::string& path);
+
+//! Extract id of the prepared query from the `/api/execute/<id>` path
+bool get_prepared_id(const std::string& path, u64* id);
+
+//! HTTP server parameters
+struct HttpSettings {
+    //! Size of the thread pool, 0 means that every connection is served by its own thread
+    int    pool_size;
+    //! Size of the response chunk
+    size_t chunk_size;
+    //! Compress query results using gzip if client accepts it
+    bool   gzip;
+    //! Enable profiling endpoints (/api/profile/cpu and /api/profile/heap)
+    bool   profiling;
+
+    HttpSettings();
+};
+
 struct HttpServer : std::enable_shared_from_this<HttpServer>, Server {
     AccessControlList                     acl_;
     std::shared_ptr<ReadOperationBuilder> proc_;
+    std::shared_ptr<DbConnection>         db_;
     unsigned short                        port_;
     MHD_Daemon*                           daemon_;
+    HttpSettings                          settings_;
 
     HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc);
     HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc,
                AccessControlList const& acl);
+    HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc,
+               std::shared_ptr<DbConnection> db);
+    HttpServer(unsigned short port, std::shared_ptr<ReadOperationBuilder> qproc,
+               std::shared_ptr<DbConnection> db, HttpSettings const& settings);
 
     virtual void start(SignalHandler* handler, int id);
     void stop();
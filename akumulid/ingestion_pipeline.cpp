@@ -23,6 +23,10 @@ struct AkumuliCursor : DbCursor {
         return aku_cursor_read(cursor_, dest, dest_size);
     }
 
+    virtual size_t read_nowait(void *dest, size_t dest_size) {
+        return aku_cursor_read_nowait(cursor_, dest, dest_size);
+    }
+
     virtual int is_done() {
         return aku_cursor_is_done(cursor_);
     }
@@ -34,6 +38,48 @@ struct AkumuliCursor : DbCursor {
     virtual void close() {
         aku_cursor_close(cursor_);
     }
+
+    virtual std::string get_profile() {
+        std::vector<char> buffer(0x400);
+        int len = aku_cursor_profile(cursor_, buffer.data(), buffer.size());
+        if (len < 0) {
+            buffer.resize(static_cast<size_t>(-len));
+            len = aku_cursor_profile(cursor_, buffer.data(), buffer.size());
+        }
+        if (len <= 0) {
+            return std::string();
+        }
+        return std::string(buffer.data(), buffer.data() + len);
+    }
+
+    virtual std::string get_resume_token() {
+        std::vector<char> buffer(0x400);
+        int len = aku_cursor_resume_token(cursor_, buffer.data(), buffer.size());
+        if (len < 0) {
+            buffer.resize(static_cast<size_t>(-len));
+            len = aku_cursor_resume_token(cursor_, buffer.data(), buffer.size());
+        }
+        if (len <= 0) {
+            return std::string();
+        }
+        return std::string(buffer.data(), buffer.data() + len);
+    }
+
+    virtual void set_prefetch(size_t nbytes) {
+        aku_cursor_set_prefetch(cursor_, nbytes);
+    }
+};
+
+
+//! Abstraction layer above aku_PreparedQuery
+struct AkumuliPreparedQuery : DbPreparedQuery {
+    aku_PreparedQuery* query_;
+
+    AkumuliPreparedQuery(aku_PreparedQuery* query) : query_(query) { }
+
+    virtual ~AkumuliPreparedQuery() {
+        aku_destroy_prepared(query_);
+    }
 };
 
 
@@ -52,6 +98,10 @@ aku_Status AkumuliSession::write(const aku_Sample &sample) {
     return aku_write(session_, &sample);
 }
 
+aku_Status AkumuliSession::write_batch(const aku_Sample* samples, size_t size) {
+    return aku_write_batch(session_, samples, size);
+}
+
 std::shared_ptr<DbCursor> AkumuliSession::query(std::string query) {
     aku_Cursor* cursor = aku_query(session_, query.c_str());
     return std::make_shared<AkumuliCursor>(cursor);
@@ -67,6 +117,36 @@ std::shared_ptr<DbCursor> AkumuliSession::search(std::string query) {
     return std::make_shared<AkumuliCursor>(cursor);
 }
 
+std::shared_ptr<DbCursor> AkumuliSession::subscribe(std::string query) {
+    aku_Cursor* cursor = aku_subscribe(session_, query.c_str());
+    return std::make_shared<AkumuliCursor>(cursor);
+}
+
+std::shared_ptr<DbPreparedQuery> AkumuliSession::prepare(std::string query, aku_Status* status) {
+    aku_PreparedQuery* prepared = aku_prepare(session_, query.c_str(), status);
+    if (prepared == nullptr) {
+        return std::shared_ptr<DbPreparedQuery>();
+    }
+    return std::make_shared<AkumuliPreparedQuery>(prepared);
+}
+
+std::shared_ptr<DbCursor> AkumuliSession::execute(std::shared_ptr<DbPreparedQuery> query,
+                                                  aku_Timestamp begin, aku_Timestamp end)
+{
+    auto prepared = std::static_pointer_cast<AkumuliPreparedQuery>(query);
+    aku_Cursor* cursor = aku_execute(session_, prepared->query_, begin, end);
+    return std::make_shared<AkumuliCursor>(cursor);
+}
+
+std::shared_ptr<DbCursor> AkumuliSession::poll(std::shared_ptr<DbPreparedQuery> query,
+                                               aku_Timestamp begin, aku_Timestamp end,
+                                               std::string resume_token)
+{
+    auto prepared = std::static_pointer_cast<AkumuliPreparedQuery>(query);
+    aku_Cursor* cursor = aku_poll(session_, prepared->query_, begin, end, resume_token.c_str());
+    return std::make_shared<AkumuliCursor>(cursor);
+}
+
 int AkumuliSession::param_id_to_series(aku_ParamId id, char *buffer, size_t buffer_size) {
     return aku_param_id_to_series(session_, id, buffer, buffer_size);
 }
@@ -81,11 +161,38 @@ int AkumuliSession::name_to_param_id_list(const char* begin, const char* end, ak
 
 // Connection //
 
-AkumuliConnection::AkumuliConnection(const char *path)
+AkumuliConnectionParams::AkumuliConnectionParams()
+    : durability(AKU_MAX_DURABILITY)
+    , max_cache_size(0)
+    , numa_aware(false)
+    , query_memory_limit(0)
+    , read_only(false)
+    , warmup_blocks(0)
+    , prefetch_blocks(0)
+    , index_resident_metrics(0)
+    , tenant_max_series(0)
+    , tenant_memory_limit(0)
+    , tenant_ingest_rate(0)
+{
+}
+
+AkumuliConnection::AkumuliConnection(const char *path, AkumuliConnectionParams const& conn_params)
     : dbpath_(path)
 {
     db_logger_.info() << "Open database at: " << path;
     aku_FineTuneParams params = {};
+    params.durability = conn_params.durability;
+    params.max_cache_size = conn_params.max_cache_size;
+    params.input_log_path = conn_params.input_log_path.empty() ? nullptr : conn_params.input_log_path.c_str();
+    params.numa_aware = conn_params.numa_aware ? 1 : 0;
+    params.query_memory_limit = conn_params.query_memory_limit;
+    params.read_only = conn_params.read_only ? 1 : 0;
+    params.warmup_blocks = conn_params.warmup_blocks;
+    params.prefetch_blocks = conn_params.prefetch_blocks;
+    params.index_resident_metrics = conn_params.index_resident_metrics;
+    params.tenant_max_series = conn_params.tenant_max_series;
+    params.tenant_memory_limit = conn_params.tenant_memory_limit;
+    params.tenant_ingest_rate = conn_params.tenant_ingest_rate;
     db_ = aku_open_database(dbpath_.c_str(), params);
 }
 
@@ -103,12 +210,31 @@ std::string AkumuliConnection::get_all_stats() {
     std::vector<char> buffer;
     buffer.resize(0x1000);
     int nbytes = aku_json_stats(db_, buffer.data(), buffer.size());
+    if (nbytes < -1) {
+        buffer.resize(static_cast<size_t>(-nbytes) + 1);
+        nbytes = aku_json_stats(db_, buffer.data(), buffer.size());
+    }
     if (nbytes > 0) {
         return std::string(buffer.data(), buffer.data() + nbytes);
     }
     return "Can't generate stats, buffer is too small";
 }
 
+std::string AkumuliConnection::get_metrics() {
+    std::vector<char> buffer;
+    buffer.resize(0x4000);
+    int nbytes = aku_prometheus_metrics(db_, buffer.data(), buffer.size());
+    if (nbytes < -1) {
+        buffer.resize(static_cast<size_t>(-nbytes));
+        nbytes = aku_prometheus_metrics(db_, buffer.data(), buffer.size());
+    }
+    if (nbytes >= 0) {
+        return std::string(buffer.data(), buffer.data() + nbytes);
+    }
+    std::runtime_error err("Can't generate metrics");
+    BOOST_THROW_EXCEPTION(err);
+}
+
 std::shared_ptr<DbSession> AkumuliConnection::create_session() {
     auto session = aku_create_session(db_);
     std::shared_ptr<DbSession> result;
@@ -116,4 +242,13 @@ std::shared_ptr<DbSession> AkumuliConnection::create_session() {
     return result;
 }
 
+std::shared_ptr<DbSession> AkumuliConnection::create_tenant_session(std::string tenant) {
+    auto session = aku_create_tenant_session(db_, tenant.c_str());
+    std::shared_ptr<DbSession> result;
+    if (session != nullptr) {
+        result.reset(new AkumuliSession(session));
+    }
+    return result;
+}
+
 }
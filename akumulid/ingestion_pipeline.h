@@ -38,6 +38,9 @@ struct DbCursor {
     //! Read data from cursor
     virtual size_t read(void* dest, size_t dest_size) = 0;
 
+    //! Read data that is ready without waiting for the query (zero if nothing is ready)
+    virtual size_t read_nowait(void* dest, size_t dest_size) { return read(dest, dest_size); }
+
     //! Check is cursor is done reading
     virtual int is_done() = 0;
 
@@ -46,6 +49,21 @@ struct DbCursor {
 
     //! Close cursor
     virtual void close() = 0;
+
+    //! Get execution profile (JSON), empty if profiling wasn't requested
+    virtual std::string get_profile() = 0;
+
+    //! Get resume token, empty if the query isn't incremental
+    virtual std::string get_resume_token() = 0;
+
+    //! Limit the amount of results computed ahead of the reader (in bytes)
+    virtual void set_prefetch(size_t nbytes) {}
+};
+
+
+//! Prepared query, maps to aku_PreparedQuery (doesn't depend on the session)
+struct DbPreparedQuery {
+    virtual ~DbPreparedQuery() = default;
 };
 
 
@@ -56,6 +74,21 @@ struct DbSession {
     //! Write value to DB
     virtual aku_Status write(const aku_Sample& sample) = 0;
 
+    /** Write several values to DB at once. Default implementation
+      * writes values one by one.
+      * @return status of the first failed write
+      */
+    virtual aku_Status write_batch(const aku_Sample* samples, size_t size) {
+        aku_Status result = AKU_SUCCESS;
+        for (size_t i = 0; i < size; i++) {
+            auto status = write(samples[i]);
+            if (status != AKU_SUCCESS && result == AKU_SUCCESS) {
+                result = status;
+            }
+        }
+        return result;
+    }
+
     //! Execute database query
     virtual std::shared_ptr<DbCursor> query(std::string query) = 0;
 
@@ -65,6 +98,23 @@ struct DbSession {
     //! Execute search query
     virtual std::shared_ptr<DbCursor> search(std::string query) = 0;
 
+    //! Register continuous query (cursor is not done until the end of the query range)
+    virtual std::shared_ptr<DbCursor> subscribe(std::string query) = 0;
+
+    /** Prepare query for repeated execution.
+      * @return prepared query or empty pointer on error (error code is written to `status`)
+      */
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string query, aku_Status* status) = 0;
+
+    //! Execute prepared query using the new time range
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery> query,
+                                              aku_Timestamp begin, aku_Timestamp end) = 0;
+
+    //! Execute prepared select query incrementally (empty token for the first poll)
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery> query,
+                                           aku_Timestamp begin, aku_Timestamp end,
+                                           std::string resume_token) = 0;
+
     //! Convert paramid to series name
     virtual int param_id_to_series(aku_ParamId id, char* buffer, size_t buffer_size) = 0;
 
@@ -81,7 +131,13 @@ struct DbConnection {
 
     virtual std::string get_all_stats() = 0;
 
+    //! Get counters and latency histograms in Prometheus text format
+    virtual std::string get_metrics() = 0;
+
     virtual std::shared_ptr<DbSession> create_session() = 0;
+
+    //! Create session of the tenant namespace (returns empty pointer if the tenant can't be opened)
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string tenant) = 0;
 };
 
 
@@ -91,15 +147,53 @@ public:
     AkumuliSession(aku_Session* session);
     virtual ~AkumuliSession() override;
     virtual aku_Status write(const aku_Sample &sample) override;
+    virtual aku_Status write_batch(const aku_Sample* samples, size_t size) override;
     virtual std::shared_ptr<DbCursor> query(std::string query) override;
     virtual std::shared_ptr<DbCursor> suggest(std::string query) override;
     virtual std::shared_ptr<DbCursor> search(std::string query) override;
+    virtual std::shared_ptr<DbCursor> subscribe(std::string query) override;
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string query, aku_Status* status) override;
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery> query,
+                                              aku_Timestamp begin, aku_Timestamp end) override;
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery> query,
+                                           aku_Timestamp begin, aku_Timestamp end,
+                                           std::string resume_token) override;
     virtual int param_id_to_series(aku_ParamId id, char *buffer, size_t buffer_size) override;
     virtual aku_Status series_to_param_id(const char *name, size_t size, aku_Sample *sample) override;
     virtual int name_to_param_id_list(const char* begin, const char* end, aku_ParamId* ids, u32 cap) override;
 };
 
 
+//! Parameters of the database opened by AkumuliConnection
+struct AkumuliConnectionParams {
+    //! Durability mode (AKU_MAX_DURABILITY, AKU_DURABILITY_SPEED_TRADEOFF or AKU_MAX_WRITE_SPEED)
+    u32 durability;
+    //! Block cache size limit in bytes (0 - default)
+    u64 max_cache_size;
+    //! Input log directory (empty - input log disabled)
+    std::string input_log_path;
+    //! Enables NUMA-aware block cache
+    bool numa_aware;
+    //! Memory budget of a single query (0 - default)
+    u64 query_memory_limit;
+    //! Open the database read-only (queries only)
+    bool read_only;
+    //! Max size of the hot block list used to warm up the cache (0 - disabled)
+    u32 warmup_blocks;
+    //! Max number of blocks per series prefetched by the queries (0 - disabled)
+    u32 prefetch_blocks;
+    //! Max number of metrics with series index built (0 - all metrics)
+    u32 index_resident_metrics;
+    //! Max number of series of every tenant (0 - unlimited)
+    u64 tenant_max_series;
+    //! Memory limit of every tenant (0 - unlimited)
+    u64 tenant_memory_limit;
+    //! Max number of samples per second written to every tenant (0 - unlimited)
+    u64 tenant_ingest_rate;
+
+    AkumuliConnectionParams();
+};
+
 //! Object of this class writes everything to the database
 class AkumuliConnection : public DbConnection {
 
@@ -107,13 +201,22 @@ class AkumuliConnection : public DbConnection {
     aku_Database* db_;
 
 public:
-    AkumuliConnection(const char* path);
+    /**
+     * @brief Open database
+     * @param path is a path to the database
+     * @param params are the database parameters
+     */
+    AkumuliConnection(const char* path, AkumuliConnectionParams const& params = AkumuliConnectionParams());
 
     virtual ~AkumuliConnection() override;
 
     virtual std::string get_all_stats() override;
 
+    virtual std::string get_metrics() override;
+
     virtual std::shared_ptr<DbSession> create_session() override;
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string tenant) override;
 };
 
 }  // namespace Akumuli
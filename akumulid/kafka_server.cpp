@@ -0,0 +1,228 @@
+#include "kafka_server.h"
+
+#ifdef AKU_WITH_KAFKA
+
+#include <thread>
+
+#include <boost/bind.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+
+namespace Akumuli {
+
+KafkaServer::Counters::Counters()
+    : messages{0}
+    , bytes{0}
+    , errors{0}
+{
+}
+
+KafkaServer::KafkaServer(std::shared_ptr<DbConnection> db, int nworkers, Settings settings)
+    : db_(db)
+    , start_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_{0}
+    , nworkers_(nworkers)
+    , settings_(std::move(settings))
+    , logger_("KafkaServer")
+{
+}
+
+static void throw_kafka_error(const char* what, const char* err) {
+    std::stringstream fmt;
+    fmt << what << ": " << err;
+    std::runtime_error error(fmt.str());
+    BOOST_THROW_EXCEPTION(error);
+}
+
+rd_kafka_t* KafkaServer::create_consumer() {
+    char errstr[512];
+    rd_kafka_conf_t* conf = rd_kafka_conf_new();
+    std::vector<std::pair<const char*, std::string>> params = {
+        { "bootstrap.servers", settings_.brokers },
+        { "group.id", settings_.group },
+        // Offset is stored by the worker after the message is written
+        { "enable.auto.offset.store", "false" },
+        { "enable.auto.commit", "true" },
+        { "auto.offset.reset", "earliest" },
+    };
+    for (auto const& kv: params) {
+        if (rd_kafka_conf_set(conf, kv.first, kv.second.c_str(), errstr, sizeof(errstr)) != RD_KAFKA_CONF_OK) {
+            rd_kafka_conf_destroy(conf);
+            throw_kafka_error("can't configure consumer", errstr);
+        }
+    }
+    // Configuration is owned by the consumer after this call
+    rd_kafka_t* rk = rd_kafka_new(RD_KAFKA_CONSUMER, conf, errstr, sizeof(errstr));
+    if (rk == nullptr) {
+        rd_kafka_conf_destroy(conf);
+        throw_kafka_error("can't create consumer", errstr);
+    }
+    rd_kafka_poll_set_consumer(rk);
+    auto topics = rd_kafka_topic_partition_list_new(1);
+    rd_kafka_topic_partition_list_add(topics, settings_.topic.c_str(), RD_KAFKA_PARTITION_UA);
+    auto err = rd_kafka_subscribe(rk, topics);
+    rd_kafka_topic_partition_list_destroy(topics);
+    if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        rd_kafka_destroy(rk);
+        throw_kafka_error("can't subscribe to topic", rd_kafka_err2str(err));
+    }
+    return rk;
+}
+
+void KafkaServer::start(SignalHandler *sig, int id) {
+    auto self = shared_from_this();
+    sig->add_handler(boost::bind(&KafkaServer::stop, std::move(self)), id);
+
+    // Consumers are created before the workers so the errors are reported here
+    try {
+        for (int i = 0; i < nworkers_; i++) {
+            consumers_.push_back(create_consumer());
+            counters_.emplace_back(new Counters());
+        }
+    } catch (...) {
+        for (auto rk: consumers_) {
+            rd_kafka_destroy(rk);
+        }
+        consumers_.clear();
+        throw;
+    }
+
+    for (int i = 0; i < nworkers_; i++) {
+        auto session = db_->create_session();
+        auto fn = &KafkaServer::worker<RESPProtocolParser>;
+        if (settings_.protocol == Protocol::INFLUX) {
+            fn = &KafkaServer::worker<InfluxProtocolParser>;
+        } else if (settings_.protocol == Protocol::GRAPHITE) {
+            fn = &KafkaServer::worker<GraphiteProtocolParser>;
+        }
+        std::thread thread(std::bind(fn, shared_from_this(), i, std::move(session)));
+        thread.detach();
+    }
+    start_barrier_.wait();
+}
+
+void KafkaServer::stop() {
+    // Workers notice the flag after the next poll
+    stop_.store(1, std::memory_order_seq_cst);
+    stop_barrier_.wait();
+    for (size_t i = 0; i < consumers_.size(); i++) {
+        auto const& cnt = *counters_.at(i);
+        logger_.info() << "Kafka worker " << i << " received " << cnt.messages.load()
+                       << " messages (" << cnt.bytes.load() << " bytes), "
+                       << cnt.errors.load() << " parse errors";
+        // Commits stored offsets and leaves the group
+        rd_kafka_consumer_close(consumers_[i]);
+        rd_kafka_destroy(consumers_[i]);
+    }
+    consumers_.clear();
+    logger_.info() << "Kafka server stopped";
+}
+
+template<class ParserT>
+void KafkaServer::worker(int ix, std::shared_ptr<DbSession> spout) {
+#ifdef __gnu_linux__
+        // Name the thread
+        auto thread = pthread_self();
+        pthread_setname_np(thread, "Kafka-worker");
+#endif
+    aku_apply_thread_policy(AKU_THREAD_INGESTION);
+    start_barrier_.wait();
+
+    rd_kafka_t* rk = consumers_.at(static_cast<size_t>(ix));
+    Counters& counters = *counters_.at(static_cast<size_t>(ix));
+    // Every message of the line protocol contains whole lines, the last line
+    // may not be terminated
+    const bool terminate_lines = settings_.protocol != Protocol::RESP;
+    ParserT parser(spout);
+    try {
+        parser.start();
+        while (!stop_.load(std::memory_order_seq_cst)) {
+            rd_kafka_message_t* msg = rd_kafka_consumer_poll(rk, POLL_TIMEOUT_MS);
+            if (msg == nullptr) {
+                continue;
+            }
+            if (msg->err) {
+                if (msg->err != RD_KAFKA_RESP_ERR__PARTITION_EOF) {
+                    logger_.error() << "Kafka worker " << ix << " error: " << rd_kafka_message_errstr(msg);
+                }
+                rd_kafka_message_destroy(msg);
+                continue;
+            }
+            // Message can be larger than the parser's buffer
+            auto payload = static_cast<const Byte*>(msg->payload);
+            size_t size = msg->len;
+            try {
+                for (size_t pos = 0; pos < size;) {
+                    auto buf = parser.get_next_buffer();
+                    u32 chunk = static_cast<u32>(std::min<size_t>(size - pos, ParserT::RDBUF_SIZE - 1));
+                    memcpy(buf, payload + pos, chunk);
+                    pos += chunk;
+                    if (terminate_lines && pos == size && buf[chunk - 1] != '\n') {
+                        buf[chunk++] = '\n';
+                    }
+                    parser.parse_next(buf, chunk);
+                }
+            } catch (StreamError const& err) {
+                // Malformed message can't be processed later, it's skipped
+                counters.errors++;
+                logger_.error() << err.what();
+            }
+            counters.messages++;
+            counters.bytes += size;
+            // Data of the message is written by the session
+            auto err = rd_kafka_offset_store(msg->rkt, msg->partition, msg->offset);
+            if (err != RD_KAFKA_RESP_ERR_NO_ERROR) {
+                logger_.error() << "Kafka worker " << ix << " can't store offset: " << rd_kafka_err2str(err);
+            }
+            rd_kafka_message_destroy(msg);
+        }
+    } catch(...) {
+        logger_.error() << boost::current_exception_diagnostic_information();
+    }
+
+    parser.close();
+    stop_barrier_.wait();
+}
+
+static Logger s_logger_("kafka-server");
+
+struct KafkaServerBuilder {
+
+    KafkaServerBuilder() {
+        ServerFactory::instance().register_type("Kafka", *this);
+    }
+
+    std::shared_ptr<Server> operator () (std::shared_ptr<DbConnection> con,
+                                         std::shared_ptr<ReadOperationBuilder>,
+                                         const ServerSettings& settings) {
+        auto get_option = [&](const char* name) {
+            auto it = settings.options.find(name);
+            if (it == settings.options.end() || it->second.empty()) {
+                s_logger_.error() << "Can't initialize Kafka consumer, " << name << " is not set";
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid kafka-server settings"));
+            }
+            return it->second;
+        };
+        KafkaServer::Settings params;
+        params.brokers = get_option("brokers");
+        params.topic = get_option("topic");
+        params.group = get_option("group");
+        params.protocol = KafkaServer::Protocol::RESP;
+        auto protocol = get_option("protocol");
+        if (protocol == "Influx") {
+            params.protocol = KafkaServer::Protocol::INFLUX;
+        } else if (protocol == "Graphite") {
+            params.protocol = KafkaServer::Protocol::GRAPHITE;
+        } else if (protocol != "RESP") {
+            s_logger_.error() << "Can't initialize Kafka consumer, unknown protocol " << protocol;
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid kafka-server settings"));
+        }
+        return std::make_shared<KafkaServer>(con, settings.nworkers, params);
+    }
+};
+
+static KafkaServerBuilder reg_type;
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef AKU_WITH_KAFKA
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread/barrier.hpp>
+
+#include <librdkafka/rdkafka.h>
+
+#include "ingestion_pipeline.h"
+#include "logger.h"
+#include "protocolparser.h"
+#include "server.h"
+
+
+namespace Akumuli {
+
+/** Kafka consumer used as an ingestion source.
+  * Every worker is a member of the same consumer group and owns its own
+  * database session, the broker spreads the partitions of the topic between
+  * the workers. Every message should contain whole protocol data units.
+  * Offsets are stored after the data of the message is written by the session
+  * and committed in background, so the delivery is at-least-once.
+  */
+class KafkaServer : public std::enable_shared_from_this<KafkaServer>, public Server {
+public:
+    //! Format of the messages
+    enum class Protocol {
+        RESP,
+        INFLUX,
+        GRAPHITE,
+    };
+
+    struct Settings {
+        std::string brokers;  //< Bootstrap servers
+        std::string topic;
+        std::string group;    //< Consumer group id
+        Protocol    protocol;
+    };
+
+private:
+    std::shared_ptr<DbConnection>      db_;
+    boost::barrier                     start_barrier_;  //< Barrier to start worker thread
+    boost::barrier                     stop_barrier_;   //< Barrier to stop worker thread
+    std::atomic<int>                   stop_;
+    const int                          nworkers_;
+    const Settings                     settings_;
+    std::vector<rd_kafka_t*>           consumers_;      //< Consumers (one per worker)
+
+    Logger logger_;
+
+    //! Max poll time, defines how fast the workers react to stop
+    static const int POLL_TIMEOUT_MS = 100;
+
+    //! Worker counters
+    struct Counters {
+        std::atomic<u64> messages;
+        std::atomic<u64> bytes;
+        std::atomic<u64> errors;
+
+        Counters();
+    };
+
+    std::vector<std::unique_ptr<Counters>> counters_;
+
+public:
+    /** C-tor.
+      * @param db is a database connection
+      * @param nworkers is a number of workers (should be less or equal to the number of partitions)
+      * @param settings are consumer settings
+      */
+    KafkaServer(std::shared_ptr<DbConnection> db, int nworkers, Settings settings);
+
+    //! Create consumers and start processing messages
+    virtual void start(SignalHandler* sig, int id);
+
+private:
+    //! Stop workers and close consumers
+    void stop();
+
+    //! Create consumer and subscribe to the topic
+    rd_kafka_t* create_consumer();
+
+    template<class ParserT>
+    void worker(int ix, std::shared_ptr<DbSession> spout);
+};
+
+}  // namespace
+
+#endif
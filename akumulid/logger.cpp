@@ -1,44 +1,238 @@
 #include "logger.h"
 #include "log4cxx/propertyconfigurator.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+
+#include <pthread.h>
+
 namespace Akumuli {
 
 static log4cxx::LoggerPtr s_common_logger_ = log4cxx::Logger::getLogger("main");
 
-Formatter::Formatter()
-    : sink_(NONE)
-{
-}
+namespace {
 
-Formatter::~Formatter() {
-    switch (sink_) {
-    case LOGGER_INFO:
-        LOG4CXX_INFO(logger_, str_.str());
+struct LogRecord {
+    log4cxx::LoggerPtr  logger;
+    Formatter::SinkType sink;
+    std::string         text;
+};
+
+static void write_record(LogRecord const& rec) {
+    switch (rec.sink) {
+    case Formatter::LOGGER_INFO:
+        LOG4CXX_INFO(rec.logger, rec.text);
         break;
-    case LOGGER_ERROR:
-        LOG4CXX_ERROR(logger_, str_.str());
+    case Formatter::LOGGER_ERROR:
+        LOG4CXX_ERROR(rec.logger, rec.text);
         break;
-    case LOGGER_TRACE:
-        LOG4CXX_TRACE(logger_, str_.str());
+    case Formatter::LOGGER_TRACE:
+        LOG4CXX_TRACE(rec.logger, rec.text);
         break;
-    case NONE:
+    case Formatter::NONE:
     break;
     };
 }
 
+/** Bounded lock-free queue (D. Vyukov's MPMC queue, used with single consumer).
+  * Every cell has a sequence number that tells whether the cell is ready
+  * for the producer (seq == pos) or for the consumer (seq == pos + 1).
+  */
+class LogRing {
+    struct Cell {
+        std::atomic<size_t> seq;
+        LogRecord           rec;
+    };
+    const size_t            mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> head_;  //< producers position
+    alignas(64) std::atomic<size_t> tail_;  //< consumer position
+
+public:
+    LogRing(size_t size)  // size should be a power of two
+        : mask_(size - 1)
+        , cells_(new Cell[size])
+        , head_{0}
+        , tail_{0}
+    {
+        for (size_t i = 0; i < size; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    //! Add record to the queue, return false if queue is full
+    bool try_push(LogRecord&& rec) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.rec = std::move(rec);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //! Extract record from the queue, return false if queue is empty
+    bool try_pop(LogRecord* rec) {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & mask_];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1) < 0) {
+            return false;
+        }
+        *rec = std::move(cell.rec);
+        tail_.store(pos + 1, std::memory_order_relaxed);
+        cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+//! Background thread that writes queued messages to log4cxx
+class AsyncLog {
+    LogRing             ring_;
+    std::atomic<bool>   running_;
+    std::atomic<bool>   stop_;
+    std::atomic<u64>    dropped_;
+    std::mutex          mutex_;  //< guards start and stop
+    std::thread         thread_;
+
+    void report_dropped() {
+        auto ndropped = dropped_.exchange(0);
+        if (ndropped) {
+            std::stringstream msg;
+            msg << ndropped << " log messages dropped (log queue is full)";
+            LOG4CXX_ERROR(s_common_logger_, msg.str());
+        }
+    }
+
+    void worker() {
+#ifdef __gnu_linux__
+        pthread_setname_np(pthread_self(), "log-writer");
+#endif
+        LogRecord rec;
+        int backoff = 0;
+        while (true) {
+            if (ring_.try_pop(&rec)) {
+                write_record(rec);
+                backoff = 0;
+                continue;
+            }
+            report_dropped();
+            if (stop_.load()) {
+                // `running_` is reset before `stop_` is set so the queue can't be refilled
+                while (ring_.try_pop(&rec)) {
+                    write_record(rec);
+                }
+                break;
+            }
+            // Queue is empty, wait for new messages with exponential backoff (1-16ms)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1 << backoff));
+            backoff = std::min(backoff + 1, 4);
+        }
+    }
+
+public:
+    AsyncLog()
+        : ring_(Logger::QUEUE_SIZE)
+        , running_{false}
+        , stop_{false}
+        , dropped_{0}
+    {
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (running_.load()) {
+            return;
+        }
+        stop_.store(false);
+        thread_ = std::thread(std::bind(&AsyncLog::worker, this));
+        running_.store(true);
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_.load()) {
+            return;
+        }
+        running_.store(false);
+        // Producers that passed the `running_` check can still push the message
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        stop_.store(true);
+        thread_.join();
+    }
+
+    void write(LogRecord&& rec) {
+        if (!running_.load(std::memory_order_relaxed)) {
+            write_record(rec);
+        } else if (!ring_.try_push(std::move(rec))) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+static AsyncLog& async_log() {
+    static AsyncLog log;
+    return log;
+}
+
+/** Per call site rate limiter (fixed one second window).
+  * Call sites are hashed into the fixed table, sites that collide share the limit.
+  */
+struct SiteLimit {
+    std::atomic<u64> window;
+    std::atomic<u32> count;
+    std::atomic<u32> suppressed;
+};
+
+enum {
+    NSITES = 0x400,
+};
+
+static SiteLimit s_sites[NSITES];
+static std::atomic<u32> s_rate_limit = {Logger::DEFAULT_RATE_LIMIT};
+
+}  // namespace
+
+Formatter::Formatter()
+    : sink_(NONE)
+{
+}
+
+Formatter::~Formatter() {
+    if (sink_ != NONE && str_) {
+        async_log().write({ logger_, sink_, str_->str() });
+    }
+}
+
 void Formatter::set_info_sink(log4cxx::LoggerPtr logger) {
     sink_ = LOGGER_INFO;
     logger_ = logger;
+    str_.reset(new std::stringstream());
 }
 
 void Formatter::set_trace_sink(log4cxx::LoggerPtr logger) {
     sink_ = LOGGER_TRACE;
     logger_ = logger;
+    str_.reset(new std::stringstream());
 }
 
 void Formatter::set_error_sink(log4cxx::LoggerPtr logger) {
     sink_ = LOGGER_ERROR;
     logger_ = logger;
+    str_.reset(new std::stringstream());
 }
 
 Logger::Logger(const char* log_name)
@@ -51,24 +245,70 @@ Logger::Logger(std::string log_name)
 {
 }
 
-Formatter&& Logger::trace(Formatter&& fmt) {
-    fmt.set_trace_sink(plogger_);
+bool Logger::acquire(const char* file, int line) {
+    u32 limit = s_rate_limit.load(std::memory_order_relaxed);
+    if (limit == 0) {
+        return true;
+    }
+    auto hash = std::hash<const void*>()(file) ^ (static_cast<size_t>(line) * 0x9E3779B97F4A7C15ull);
+    SiteLimit& site = s_sites[hash & (NSITES - 1)];
+    auto now = static_cast<u64>(std::chrono::duration_cast<std::chrono::seconds>(
+                                    std::chrono::steady_clock::now().time_since_epoch()).count());
+    u64 window = site.window.load(std::memory_order_relaxed);
+    if (window != now && site.window.compare_exchange_strong(window, now)) {
+        site.count.store(0, std::memory_order_relaxed);
+        auto nsuppressed = site.suppressed.exchange(0);
+        if (nsuppressed) {
+            std::stringstream msg;
+            msg << nsuppressed << " messages suppressed at " << file << ":" << line;
+            async_log().write({ plogger_, Formatter::LOGGER_ERROR, msg.str() });
+        }
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+    }
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+Formatter&& Logger::trace(Formatter&& fmt, const char* file, int line) {
+    if (plogger_->isTraceEnabled() && acquire(file, line)) {
+        fmt.set_trace_sink(plogger_);
+    }
     return std::move(fmt);
 }
 
-Formatter&& Logger::info(Formatter&& fmt) {
-    fmt.set_info_sink(plogger_);
+Formatter&& Logger::info(Formatter&& fmt, const char* file, int line) {
+    if (plogger_->isInfoEnabled() && acquire(file, line)) {
+        fmt.set_info_sink(plogger_);
+    }
     return std::move(fmt);
 }
 
-Formatter&& Logger::error(Formatter&& fmt) {
-    fmt.set_error_sink(plogger_);
+Formatter&& Logger::error(Formatter&& fmt, const char* file, int line) {
+    if (plogger_->isErrorEnabled() && acquire(file, line)) {
+        fmt.set_error_sink(plogger_);
+    }
     return std::move(fmt);
 }
 
 void Logger::init(std::string path) {
     log4cxx::File file(path);
     log4cxx::PropertyConfigurator::configure(file);
+    static std::once_flag once;
+    std::call_once(once, []() {
+        async_log();  // should be constructed before `atexit` call
+        std::atexit(&Logger::shutdown);
+    });
+    async_log().start();
+}
+
+void Logger::shutdown() {
+    async_log().stop();
+}
+
+void Logger::set_rate_limit(u32 nmessages) {
+    s_rate_limit.store(nmessages);
 }
 
 }  // namespace
@@ -15,6 +15,9 @@
  */
 
 #pragma once
+#include "akumuli_def.h"
+
+#include <memory>
 #include <mutex>
 #include <sstream>
 
@@ -24,6 +27,10 @@
 
 namespace Akumuli {
 
+/** Log message builder.
+  * Message is formatted only if it will be written (sink is set), the text is passed
+  * to the background thread on destruction.
+  */
 class Formatter {
 public:
     enum SinkType {
@@ -34,7 +41,7 @@ public:
     };
 
 private:
-    std::stringstream str_;
+    std::unique_ptr<std::stringstream> str_;
     // Optional parameters
     SinkType                 sink_;
     log4cxx::LoggerPtr       logger_;
@@ -49,24 +56,45 @@ public:
     void set_error_sink(log4cxx::LoggerPtr logger);
 
     template <class T> Formatter& operator<<(T const& value) {
-        str_ << value;
+        if (str_) {
+            *str_ << value;
+        }
         return *this;
     }
 };
 
 /** Logger class.
+  * Messages are written to log4cxx by the background thread (started by `init`), the
+  * thread that logs the message never blocks on I/O. If the queue is full the message
+  * is dropped (number of dropped messages is logged later). Number of messages per
+  * second is limited for every call site, messages above the limit are not formatted.
   */
 class Logger {
     log4cxx::LoggerPtr      plogger_;
 
+    //! Return false if the message from the call site should be suppressed
+    bool acquire(const char* file, int line);
+
 public:
+    enum {
+        QUEUE_SIZE = 0x2000,        //< max number of messages waiting for the background thread
+        DEFAULT_RATE_LIMIT = 100,   //< max number of messages per second per call site
+    };
+
     Logger(const char* log_name);
     Logger(std::string log_name);
 
-    Formatter&& trace(Formatter&& fmt = Formatter());
-    Formatter&& info(Formatter&& fmt = Formatter());
-    Formatter&& error(Formatter&& fmt = Formatter());
+    Formatter&& trace(Formatter&& fmt = Formatter(), const char* file = __builtin_FILE(), int line = __builtin_LINE());
+    Formatter&& info(Formatter&& fmt = Formatter(), const char* file = __builtin_FILE(), int line = __builtin_LINE());
+    Formatter&& error(Formatter&& fmt = Formatter(), const char* file = __builtin_FILE(), int line = __builtin_LINE());
 
+    //! Configure log4cxx and start the background thread.
     static void init(std::string path);
+
+    //! Write all queued messages and stop the background thread (messages are written synchronously after that)
+    static void shutdown();
+
+    //! Set max number of messages per second per call site (0 - no limit)
+    static void set_rate_limit(u32 nmessages);
 };
 }
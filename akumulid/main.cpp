@@ -50,12 +50,93 @@ nvolumes=%1%
 # Default value is 4GB (if value is not set).
 volume_size=4GB
 
+# Max number of children of the NB+tree inner node, from 4 to 42.
+# Used only when the database is created (0 - default, 42).
+nbtree_fanout=0
+
+# Durability mode: max_durability (every block is written to the volume
+# immediately), durability_speed_tradeoff (blocks are buffered, the volume
+# is synced on write if the flush interval has passed since the last sync)
+# or max_write_speed (blocks are buffered and synced on commit).
+durability=max_durability
+
+# Block cache size limit. You can use MB or GB suffix (0 - default, 128MB).
+max_cache_size=128MB
+
+# Path to the input log directory (uncomment to enable). Values that are not
+# committed to disk yet are written to the log and restored on startup after
+# crash.
+#input_log_path=~/.akumuli/inputlog
+
+# NUMA-aware mode. TCP workers are bound to NUMA nodes (round robin) and
+# accept their own connections so the sessions are allocated on the node
+# of the worker, block cache is partitioned by node.
+numa=false
+
+# Memory budget of a single query. Merges that don't fit into the budget are
+# spilled to temporary files, other operators use smaller buffers or fail
+# the query. You can use MB or GB suffix.
+query_memory_limit=1GB
+
+# Read-only mode. Database (e.g. a copy or a filesystem snapshot of the volumes)
+# is memory mapped read-only and only the query endpoints (HTTP and HTTP/2)
+# are started, recovery and the background sync are skipped.
+read_only=false
+
+# Number of the most frequently read blocks that are recorded periodically and
+# on shutdown, on startup they're loaded into the block cache in background so
+# the first queries after restart don't have to wait for the disk (0 - disabled).
+warmup_blocks=32768
+
+# Max number of blocks per series that are prefetched when the dashboard pans
+# (queries adjacent time range) or zooms out (queries wider time range). The next
+# range in the same direction is loaded into the block cache in background (0 - disabled).
+prefetch_blocks=64
+
+# Max number of metrics that have their series index in memory. Index of the metric
+# is built on first query and dropped when the metric wasn't queried for a while,
+# use it when the database has a lot of series but only some metrics are queried
+# (0 - all metrics are indexed on startup and on write).
+index_resident_metrics=0
+
+# Quota of every tenant namespace. Tenant is selected by the `tenant` parameter
+# of the HTTP write and query endpoints, every tenant has its own series index
+# and column store on top of the shared volumes. Max number of series, memory
+# limit of the index and write buffers (you can use MB or GB suffix) and max
+# number of samples written per second (0 - unlimited).
+tenant_max_series=0
+tenant_memory_limit=0
+tenant_ingest_rate=0
+
 
 # HTTP API endpoint configuration
 
 [HTTP]
 # port number
 port=8181
+# worker pool size (0 means that every connection is served by its own thread)
+pool_size=0
+# size of the response chunk
+chunk_size=64KB
+# compress responses if client accepts it (none or gzip)
+compression=none
+# enable /api/profile/cpu?seconds=N and /api/profile/heap endpoints (pprof
+# profiles), heap profiles require jemalloc started with MALLOC_CONF=prof:true
+profiling=false
+
+# HTTP/2 query endpoint (uncomment to enable, akumulid should be built with
+# AKU_WITH_NGHTTP2). Serves the query endpoints over cleartext HTTP/2 (prior
+# knowledge), many queries can be multiplexed over one connection.
+
+#[HTTP2]
+# port number
+#port=8484
+# number of worker threads, every worker has its own SO_REUSEPORT socket
+#pool_size=1
+# max number of concurrent streams per connection
+#max_streams=100
+# compress responses if client accepts it (none or gzip)
+#compression=none
 
 
 # TCP ingestion server config (delete to disable)
@@ -65,6 +146,22 @@ port=8181
 port=8282
 # worker pool size (0 means that the size of the pool will be chosen automatically)
 pool_size=0
+# use separate SO_REUSEPORT acceptor in every worker thread and pin the
+# workers to cores, the kernel balances the connections between the workers
+reuse_port=false
+# I/O backend: 'asio' or 'uring' (io_uring, requires Linux 6.0 and akumulid
+# built with AKU_WITH_URING), every io_uring worker has its own SO_REUSEPORT
+# listening socket, compressed connections are not supported by this backend
+io_backend=asio
+# max number of samples per second received by all connections and by one
+# connection (0 - unlimited), connections that exceed the limit are paused
+# (socket is not read) so the clients are slowed down by the TCP flow control,
+# only the 'asio' backend is supported
+rate_limit=0
+connection_rate_limit=0
+# assign timestamps to the RESP samples that use empty string instead of the
+# timestamp (coarse clock is read once per chunk of data)
+server_timestamps=false
 
 
 # UDP ingestion server config (delete to disable)
@@ -74,6 +171,40 @@ pool_size=0
 port=8383
 # worker pool size
 pool_size=1
+# datagram steering between the workers, 'none' - kernel chooses the worker
+# using the hash of the address/port pair, 'source' - datagrams from the same
+# source address are always processed by the same worker
+steering=none
+# protocol of the datagrams: RESP, Influx (InfluxDB line protocol) or
+# Graphite (Graphite plaintext protocol)
+protocol=RESP
+# UDP GRO (Linux 5.0 or newer), the kernel coalesces datagrams of the same
+# flow and the worker receives several datagrams at once
+gro=false
+# busy polling time in microseconds, 0 - disabled (values larger than
+# net.core.busy_read require CAP_NET_ADMIN)
+busy_poll=0
+# max number of messages received by one call, 0 - choose automatically
+# (512 datagrams or 64 coalesced messages if GRO is enabled)
+batch_size=0
+# assign timestamps to the samples that use empty string instead of the
+# timestamp (RESP only, coarse clock is read once per batch of messages)
+server_timestamps=false
+
+# Kafka consumer (uncomment to enable, akumulid should be built with
+# AKU_WITH_KAFKA). Every message should contain whole data points.
+
+#[Kafka]
+# comma separated list of brokers
+#brokers=localhost:9092
+# topic name
+#topic=metrics
+# consumer group, offsets are committed after the data is written
+#group=akumuli
+# number of consumers in the group (partitions are spread between them)
+#pool_size=1
+# format of the messages: RESP, Influx or Graphite
+#protocol=RESP
 
 # OpenTSDB telnet-style data connection enabled (remove this section to disable).
 
@@ -81,6 +212,39 @@ pool_size=1
 # port number
 port=4242
 
+# InfluxDB line protocol connection (uncomment to enable). Every field of the
+# line is stored as a separate series 'measurement.field tag=value ...'.
+
+#[Influx]
+# port number
+#port=8089
+
+# Graphite plaintext protocol connection (uncomment to enable).
+
+#[Graphite]
+# port number
+#port=2003
+
+# CPU affinity and priority of the threads by role (uncomment to enable).
+# Core sets use the cpulist format (e.g. 0-3,8), empty value - threads are
+# not pinned. Nice values are set per thread, negative values require
+# CAP_SYS_NICE. Core set of the ingestion threads overrides the pinning
+# enabled by `reuse_port` and `numa`.
+
+#[Threads]
+# TCP and UDP workers
+#ingestion_cpus=0-3
+#ingestion_nice=-5
+# query, cursor and search workers
+#query_cpus=4-7
+#query_nice=5
+# HTTP server threads
+#http_cpus=4-7
+#http_nice=0
+# sync, compression, rollup and recovery workers
+#background_cpus=
+#background_nice=10
+
 
 
 # Logging configuration
@@ -146,7 +310,11 @@ struct ConfigFile {
     }
 
     static boost::filesystem::path get_path(PTree conf) {
-        std::string path = conf.get<std::string>("path");
+        return expand_path(conf.get<std::string>("path"));
+    }
+
+    //! Expand `~` and environment variables of the path
+    static boost::filesystem::path expand_path(std::string path) {
         wordexp_t we;
         int err = wordexp(path.c_str(), &we, 0);
         if (err) {
@@ -171,22 +339,22 @@ struct ConfigFile {
         return conf.get<i32>("nvolumes");
     }
 
-    static u64 get_volume_size(PTree conf) {
+    //! Decode size with optional suffix (KB, MB or GB)
+    static u64 decode_size(std::string strsize, const char* what) {
         u64 result = 0;
-        auto strsize = conf.get<std::string>("volume_size", "4GB");
         try {
             result = boost::lexical_cast<u64>(strsize);
         } catch (boost::bad_lexical_cast const&) {
-            // Try to read suffix (GB or MB)
-            auto throw_decode_error = [strsize]() {
+            // Try to read suffix (GB, MB or KB)
+            auto throw_decode_error = [strsize, what]() {
                 std::stringstream fmt;
-                fmt << "can't decode volume size: `" << strsize << "`";
+                fmt << "can't decode " << what << ": `" << strsize << "`";
                 std::runtime_error err(fmt.str());
                 BOOST_THROW_EXCEPTION(err);
             };
             auto tmp = strsize;
             u64 mul = 1;
-            if (tmp.back() != 'B' && tmp.back() != 'b') {
+            if (tmp.size() < 2 || (tmp.back() != 'B' && tmp.back() != 'b')) {
                 throw_decode_error();
             }
             tmp.pop_back();
@@ -196,6 +364,8 @@ struct ConfigFile {
                 mul = 1024*1024*1024;
             } else if (symbol == 'M' || symbol == 'm') {
                 mul = 1024*1024;
+            } else if (symbol == 'K' || symbol == 'k') {
+                mul = 1024;
             } else {
                 throw_decode_error();
             }
@@ -209,12 +379,132 @@ struct ConfigFile {
         return result;
     }
 
+    static u64 get_volume_size(PTree conf) {
+        return decode_size(conf.get<std::string>("volume_size", "4GB"), "volume size");
+    }
+
+    static u32 get_nbtree_fanout(PTree conf) {
+        return conf.get<u32>("nbtree_fanout", 0);
+    }
+
+    static u32 get_durability(PTree conf) {
+        auto durability = conf.get<std::string>("durability", "max_durability");
+        if (durability == "max_durability") {
+            return AKU_MAX_DURABILITY;
+        } else if (durability == "durability_speed_tradeoff") {
+            return AKU_DURABILITY_SPEED_TRADEOFF;
+        } else if (durability == "max_write_speed") {
+            return AKU_MAX_WRITE_SPEED;
+        }
+        std::stringstream fmt;
+        fmt << "can't decode durability: `" << durability << "`";
+        std::runtime_error err(fmt.str());
+        BOOST_THROW_EXCEPTION(err);
+    }
+
+    static u64 get_max_cache_size(PTree conf) {
+        return decode_size(conf.get<std::string>("max_cache_size", "0"), "max cache size");
+    }
+
+    //! Return input log directory or empty string if the input log is disabled
+    static std::string get_input_log_path(PTree conf) {
+        auto path = conf.get<std::string>("input_log_path", "");
+        if (path.empty()) {
+            return path;
+        }
+        return expand_path(path).string();
+    }
+
+    //! Read [Threads] section and set CPU affinity and priority of the thread roles
+    static void set_thread_policies(PTree conf) {
+        if (!conf.count("Threads")) {
+            return;
+        }
+        std::vector<std::pair<std::string, aku_ThreadRole>> roles = {
+            { "ingestion",  AKU_THREAD_INGESTION },
+            { "query",      AKU_THREAD_QUERY },
+            { "http",       AKU_THREAD_HTTP },
+            { "background", AKU_THREAD_BACKGROUND },
+        };
+        for (auto const& role: roles) {
+            auto cpus = conf.get<std::string>("Threads." + role.first + "_cpus", "");
+            auto nice = conf.get<int>("Threads." + role.first + "_nice", 0);
+            if (cpus.empty() && nice == 0) {
+                continue;
+            }
+            if (aku_set_thread_policy(role.second, cpus.c_str(), nice) != AKU_SUCCESS) {
+                std::stringstream fmt;
+                fmt << "can't decode " << role.first << "_cpus: `" << cpus << "`";
+                std::runtime_error err(fmt.str());
+                BOOST_THROW_EXCEPTION(err);
+            }
+        }
+    }
+
+    static bool get_numa(PTree conf) {
+        return conf.get<std::string>("numa", "false") == "true";
+    }
+
+    static bool get_read_only(PTree conf) {
+        return conf.get<std::string>("read_only", "false") == "true";
+    }
+
+    static u32 get_warmup_blocks(PTree conf) {
+        return conf.get<u32>("warmup_blocks", 0);
+    }
+
+    static u32 get_prefetch_blocks(PTree conf) {
+        return conf.get<u32>("prefetch_blocks", 0);
+    }
+
+    static u32 get_index_resident_metrics(PTree conf) {
+        return conf.get<u32>("index_resident_metrics", 0);
+    }
+
+    static u64 get_tenant_max_series(PTree conf) {
+        return conf.get<u64>("tenant_max_series", 0);
+    }
+
+    static u64 get_tenant_memory_limit(PTree conf) {
+        return decode_size(conf.get<std::string>("tenant_memory_limit", "0"), "tenant memory limit");
+    }
+
+    static u64 get_tenant_ingest_rate(PTree conf) {
+        return conf.get<u64>("tenant_ingest_rate", 0);
+    }
+
+    static u64 get_query_memory_limit(PTree conf) {
+        return decode_size(conf.get<std::string>("query_memory_limit", "1GB"), "query memory limit");
+    }
+
     static ServerSettings get_http_server(PTree conf) {
         ServerSettings settings;
         settings.name = "HTTP";
         settings.protocols.push_back({ "HTTP", conf.get<int>("HTTP.port")});
-        settings.nworkers = -1;
+        settings.nworkers = conf.get<int>("HTTP.pool_size", 0);
+        auto chunk_size = conf.get_optional<std::string>("HTTP.chunk_size");
+        if (chunk_size) {
+            settings.options["chunk_size"] = std::to_string(decode_size(*chunk_size, "chunk size"));
+        }
+        settings.options["compression"] = conf.get<std::string>("HTTP.compression", "none");
+        settings.options["profiling"] = conf.get<std::string>("HTTP.profiling", "false");
+        return settings;
+    }
+
+    static ServerSettings get_http2_server(PTree conf) {
+#ifndef AKU_WITH_NGHTTP2
+        (void)conf;
+        std::runtime_error err("akumulid is built without HTTP/2 support");
+        BOOST_THROW_EXCEPTION(err);
+#else
+        ServerSettings settings;
+        settings.name = "HTTP2";
+        settings.protocols.push_back({ "HTTP2", conf.get<int>("HTTP2.port")});
+        settings.nworkers = conf.get<int>("HTTP2.pool_size", 1);
+        settings.options["max_streams"] = conf.get<std::string>("HTTP2.max_streams", "100");
+        settings.options["compression"] = conf.get<std::string>("HTTP2.compression", "none");
         return settings;
+#endif
     }
 
     static ServerSettings get_udp_server(PTree conf) {
@@ -222,9 +512,32 @@ struct ConfigFile {
         settings.name = "UDP";
         settings.protocols.push_back({ "UDP", conf.get<int>("UDP.port")});
         settings.nworkers = conf.get<int>("UDP.pool_size");
+        settings.options["steering"] = conf.get<std::string>("UDP.steering", "none");
+        settings.options["protocol"] = conf.get<std::string>("UDP.protocol", "RESP");
+        settings.options["gro"] = conf.get<std::string>("UDP.gro", "false");
+        settings.options["busy_poll"] = conf.get<std::string>("UDP.busy_poll", "0");
+        settings.options["batch_size"] = conf.get<std::string>("UDP.batch_size", "0");
+        settings.options["server_timestamps"] = conf.get<std::string>("UDP.server_timestamps", "false");
         return settings;
     }
 
+    static ServerSettings get_kafka_server(PTree conf) {
+#ifndef AKU_WITH_KAFKA
+        (void)conf;
+        std::runtime_error err("akumulid is built without Kafka support");
+        BOOST_THROW_EXCEPTION(err);
+#else
+        ServerSettings settings;
+        settings.name = "Kafka";
+        settings.nworkers = conf.get<int>("Kafka.pool_size", 1);
+        settings.options["brokers"] = conf.get<std::string>("Kafka.brokers");
+        settings.options["topic"] = conf.get<std::string>("Kafka.topic");
+        settings.options["group"] = conf.get<std::string>("Kafka.group", "akumuli");
+        settings.options["protocol"] = conf.get<std::string>("Kafka.protocol", "RESP");
+        return settings;
+#endif
+    }
+
     static ServerSettings get_tcp_server(PTree conf) {
         ServerSettings settings;
         settings.name = "TCP";
@@ -232,7 +545,19 @@ struct ConfigFile {
         if (conf.count("OpenTSDB")) {
             settings.protocols.push_back({ "OpenTSDB", conf.get<int>("OpenTSDB.port")});
         }
+        if (conf.count("Influx")) {
+            settings.protocols.push_back({ "Influx", conf.get<int>("Influx.port")});
+        }
+        if (conf.count("Graphite")) {
+            settings.protocols.push_back({ "Graphite", conf.get<int>("Graphite.port")});
+        }
         settings.nworkers = conf.get<int>("TCP.pool_size");
+        settings.options["reuse_port"] = conf.get<std::string>("TCP.reuse_port", "false");
+        settings.options["io_backend"] = conf.get<std::string>("TCP.io_backend", "asio");
+        settings.options["rate_limit"] = conf.get<std::string>("TCP.rate_limit", "0");
+        settings.options["connection_rate_limit"] = conf.get<std::string>("TCP.connection_rate_limit", "0");
+        settings.options["server_timestamps"] = conf.get<std::string>("TCP.server_timestamps", "false");
+        settings.options["numa"] = conf.get<std::string>("numa", "false");
         return settings;
     }
 
@@ -241,6 +566,8 @@ struct ConfigFile {
             { "TCP", &get_tcp_server },
             { "UDP", &get_udp_server },
             { "HTTP", &get_http_server },
+            { "HTTP2", &get_http2_server },
+            { "Kafka", &get_kafka_server },
         };
         std::vector<ServerSettings> result;
         for (auto kv: mapping) {
@@ -271,6 +598,8 @@ const char* CLI_HELP_MESSAGE = R"(`akumulid` - time-series database daemon
 
         akumuild --delete
 
+        akumulid --import <file>
+
 **DESCRIPTION**
         **akumulid** is a time-series database daemon.
         All configuration can be done via `~/.akumulid` configuration
@@ -295,6 +624,12 @@ const char* CLI_HELP_MESSAGE = R"(`akumulid` - time-series database daemon
         **delete**
             delete database files in `~/.akumuli` folder
 
+        **import**
+            import data from CSV file and exit,  each line should have
+            `series name,timestamp,value` format,  timestamp  can  be
+            an integer or an ISO 8601 string; all lines of the series
+            should be sorted by timestamp
+
         **(empty)**
             run server
 
@@ -371,12 +706,13 @@ static void static_logger(aku_LogLevel tag, const char * msg) {
 void create_db_files(const char* path,
                      i32 nvolumes,
                      u64 volume_size,
+                     u32 fanout,
                      bool allocate)
 {
     auto full_path = boost::filesystem::path(path) / "db.akumuli";
     if (!boost::filesystem::exists(full_path)) {
         apr_status_t status = APR_SUCCESS;
-        status = aku_create_database_ex("db", path, path, nvolumes, volume_size, allocate);
+        status = aku_create_database_with_fanout("db", path, path, nvolumes, volume_size, allocate, fanout);
         if (status != APR_SUCCESS) {
             char buffer[1024];
             apr_strerror(status, buffer, 1024);
@@ -405,6 +741,20 @@ void cmd_run_server() {
     auto config                 = ConfigFile::read_config_file(config_path);
     auto path                   = ConfigFile::get_path(config);
     auto ingestion_servers      = ConfigFile::get_server_settings(config);
+    AkumuliConnectionParams params;
+    params.durability             = ConfigFile::get_durability(config);
+    params.max_cache_size         = ConfigFile::get_max_cache_size(config);
+    params.input_log_path         = ConfigFile::get_input_log_path(config);
+    params.numa_aware             = ConfigFile::get_numa(config);
+    params.query_memory_limit     = ConfigFile::get_query_memory_limit(config);
+    params.read_only              = ConfigFile::get_read_only(config);
+    params.warmup_blocks          = ConfigFile::get_warmup_blocks(config);
+    params.prefetch_blocks        = ConfigFile::get_prefetch_blocks(config);
+    params.index_resident_metrics = ConfigFile::get_index_resident_metrics(config);
+    params.tenant_max_series      = ConfigFile::get_tenant_max_series(config);
+    params.tenant_memory_limit    = ConfigFile::get_tenant_memory_limit(config);
+    params.tenant_ingest_rate     = ConfigFile::get_tenant_ingest_rate(config);
+    ConfigFile::set_thread_policies(config);
     auto full_path              = boost::filesystem::path(path) / "db.akumuli";
 
     if (!boost::filesystem::exists(full_path)) {
@@ -412,13 +762,17 @@ void cmd_run_server() {
         fmt << "**ERROR** database file doesn't exists at " << path;
         std::cout << cli_format(fmt.str()) << std::endl;
     } else {
-        auto connection             = std::make_shared<AkumuliConnection>(full_path.c_str());
+        auto connection             = std::make_shared<AkumuliConnection>(full_path.c_str(), params);
         auto qproc                  = std::make_shared<QueryProcessor>(connection, 1000);
 
         SignalHandler sighandler;
         int srvid = 0;
         std::map<int, std::string> srvnames;
         for(auto settings: ingestion_servers) {
+            if (params.read_only && settings.name != "HTTP" && settings.name != "HTTP2") {
+                logger.info() << "Read-only mode, " << settings.name << " server is not started";
+                continue;
+            }
             auto srv = ServerFactory::instance().create(connection, qproc, settings);
             assert(srv != nullptr);
             srvnames[srvid] = settings.name;
@@ -455,12 +809,13 @@ void cmd_create_database(bool test_db=false, bool allocate=false) {
     auto path        = ConfigFile::get_path(config);
     auto volumes     = ConfigFile::get_nvolumes(config);
     auto volsize     = ConfigFile::get_volume_size(config);
+    auto fanout      = ConfigFile::get_nbtree_fanout(config);
 
     if (test_db) {
         volsize = AKU_TEST_DB_SIZE;
     }
 
-    create_db_files(path.c_str(), volumes, volsize, allocate);
+    create_db_files(path.c_str(), volumes, volsize, fanout, allocate);
 }
 
 void cmd_delete_database() {
@@ -557,12 +912,111 @@ void cmd_dump_recovery_debug_information(const char* outfname) {
     }
 }
 
+/** Import data from CSV file directly into the database (offline).
+  * Consecutive lines of the same series are grouped and written using
+  * single `aku_import_series` call.
+  */
+void cmd_import(const char* fname) {
+    enum {
+        IMPORT_RANGE_SIZE = 0x10000,
+    };
+    auto config_path = ConfigFile::default_config_path();
+    auto config     = ConfigFile::read_config_file(config_path);
+    auto path       = ConfigFile::get_path(config);
+
+    auto full_path = boost::filesystem::path(path) / "db.akumuli";
+    if (!boost::filesystem::exists(full_path)) {
+        std::stringstream fmt;
+        fmt << "**ERROR** database file doesn't exists";
+        std::cout << cli_format(fmt.str()) << std::endl;
+        return;
+    }
+    std::ifstream input(fname);
+    if (!input) {
+        std::stringstream fmt;
+        fmt << "can't open input file `" << fname << "`";
+        std::runtime_error err(fmt.str());
+        BOOST_THROW_EXCEPTION(err);
+    }
+
+    aku_FineTuneParams params = {};
+    params.durability = AKU_MAX_WRITE_SPEED;
+    aku_Database* db = aku_open_database(full_path.c_str(), params);
+
+    std::string series;
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    u64 nlines = 0;
+    u64 nerrors = 0;
+
+    auto flush = [&]() {
+        if (tss.empty()) {
+            return;
+        }
+        auto status = aku_import_series(db, series.data(), series.data() + series.size(),
+                                        tss.data(), xss.data(), tss.size());
+        if (status != AKU_SUCCESS) {
+            logger.error() << "Can't import `" << series << "`: " << aku_error_message(status);
+            nerrors += tss.size();
+        }
+        tss.clear();
+        xss.clear();
+    };
+
+    std::string line;
+    while (std::getline(input, line)) {
+        nlines++;
+        auto vpos = line.rfind(',');
+        auto tpos = vpos == std::string::npos || vpos == 0 ? std::string::npos : line.rfind(',', vpos - 1);
+        if (tpos == std::string::npos) {
+            logger.error() << "Bad line " << nlines << ": `" << line << "`";
+            nerrors++;
+            continue;
+        }
+        std::string tsstr = line.substr(tpos + 1, vpos - tpos - 1);
+        std::string valstr = line.substr(vpos + 1);
+        aku_Sample sample = {};
+        char* endptr = nullptr;
+        sample.timestamp = strtoull(tsstr.c_str(), &endptr, 10);
+        if ((tsstr.empty() || *endptr != '\0') && aku_parse_timestamp(tsstr.c_str(), &sample) != AKU_SUCCESS) {
+            logger.error() << "Bad timestamp at line " << nlines << ": `" << tsstr << "`";
+            nerrors++;
+            continue;
+        }
+        double value = strtod(valstr.c_str(), &endptr);
+        if (endptr == valstr.c_str()) {
+            logger.error() << "Bad value at line " << nlines << ": `" << valstr << "`";
+            nerrors++;
+            continue;
+        }
+        if (line.compare(0, tpos, series) != 0 || tss.size() == IMPORT_RANGE_SIZE) {
+            flush();
+            series = line.substr(0, tpos);
+        }
+        tss.push_back(sample.timestamp);
+        xss.push_back(value);
+    }
+    flush();
+    aku_close_database(db);
+
+    std::stringstream fmt;
+    if (nerrors == 0) {
+        fmt << "**OK** " << nlines << " lines imported from `" << fname << "`";
+    } else {
+        fmt << "**ERROR** " << (nlines - std::min(nlines, nerrors)) << " of " << nlines
+            << " lines imported from `" << fname << "`, see log for details";
+    }
+    std::cout << cli_format(fmt.str()) << std::endl;
+}
+
 
 /** Panic handler for libakumuli.
   * Shouldn't be called directly, writes error message and
   * writes coredump (this depends on system configuration)
   */
 void panic_handler(const char * msg) {
+    // write queued messages, the rest is written synchronously
+    Logger::shutdown();
     // write error message
     static_logger(AKU_LOG_ERROR, msg);
     static_logger(AKU_LOG_ERROR, "Terminating (core dumped)");
@@ -592,6 +1046,7 @@ int main(int argc, char** argv) {
                 ("CI", "Create database for CI environment (for testing)")
                 ("init", "Create default configuration")
                 ("init-expandable", "Create configuration for expandable storage")
+                ("import", po::value<std::string>(), "Import data from CSV file")
                 ("debug-dump", po::value<std::string>(), "Create debug dump")
                 ("debug-recovery-dump", po::value<std::string>(), "Create debug dump of the system after crash recovery")
                 ;
@@ -654,6 +1109,12 @@ int main(int argc, char** argv) {
             exit(EXIT_SUCCESS);
         }
 
+        if (vm.count("import")) {
+            auto fname = vm["import"].as<std::string>();
+            cmd_import(fname.c_str());
+            exit(EXIT_SUCCESS);
+        }
+
         if (vm.count("debug-dump")) {
             auto path = vm["debug-dump"].as<std::string>();
             if (path == "stdout") {
@@ -0,0 +1,566 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "profiler.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace Akumuli {
+
+static Logger s_logger_("profiler");
+
+// Sample collection
+
+namespace {
+
+enum {
+    MAX_DEPTH = 64,
+    BUFFER_SIZE = 0x200000,  //< number of words in the sample buffer (16MB)
+};
+
+/** Samples are stored one after another: thread id, number of frames, frames.
+  * First frame is an address of the interrupted instruction, others are return
+  * addresses.
+  */
+struct SampleBuffer {
+    std::unique_ptr<uintptr_t[]> data;
+    std::atomic<size_t>          pos;
+    std::atomic<u64>             dropped;
+
+    SampleBuffer()
+        : data(new uintptr_t[BUFFER_SIZE]())
+        , pos{0}
+        , dropped{0}
+    {
+    }
+};
+
+std::atomic<SampleBuffer*> s_buffer{nullptr};
+std::atomic<int>           s_active_handlers{0};
+std::mutex                 s_collect_mutex;
+
+uintptr_t get_pc(void* ucontext) {
+#if defined(__x86_64__)
+    return static_cast<uintptr_t>(static_cast<ucontext_t*>(ucontext)->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+    return static_cast<uintptr_t>(static_cast<ucontext_t*>(ucontext)->uc_mcontext.pc);
+#else
+    AKU_UNUSED(ucontext);
+    return 0;
+#endif
+}
+
+void sigprof_handler(int, siginfo_t*, void* ucontext) {
+    int saved_errno = errno;
+    s_active_handlers.fetch_add(1);
+    auto buffer = s_buffer.load();
+    if (buffer) {
+        void* stack[MAX_DEPTH];
+        int depth = backtrace(stack, MAX_DEPTH);
+        // Skip the frames of the signal handler
+        uintptr_t pc = get_pc(ucontext);
+        int first = -1;
+        for (int i = 0; i < depth; i++) {
+            if (reinterpret_cast<uintptr_t>(stack[i]) == pc) {
+                first = i;
+                break;
+            }
+        }
+        int nframes = 0;
+        uintptr_t frames[MAX_DEPTH];
+        if (first >= 0) {
+            for (int i = first; i < depth; i++) {
+                frames[nframes++] = reinterpret_cast<uintptr_t>(stack[i]);
+            }
+        } else if (pc != 0) {
+            // Unwinder can't step through the signal frame
+            frames[nframes++] = pc;
+        }
+        if (nframes != 0) {
+            size_t need = static_cast<size_t>(nframes) + 2;
+            size_t off = buffer->pos.fetch_add(need);
+            if (off + need <= BUFFER_SIZE) {
+                uintptr_t* dest = buffer->data.get() + off;
+                dest[0] = static_cast<uintptr_t>(syscall(SYS_gettid));
+                dest[1] = static_cast<uintptr_t>(nframes);
+                std::copy(frames, frames + nframes, dest + 2);
+            } else {
+                buffer->dropped.fetch_add(1);
+            }
+        }
+    }
+    s_active_handlers.fetch_sub(1);
+    errno = saved_errno;
+}
+
+void install_handler() {
+    // Handler is never removed, pending SIGPROF would terminate the process otherwise
+    struct sigaction action = {};
+    action.sa_sigaction = &sigprof_handler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+        s_logger_.error() << "Can't install SIGPROF handler, errno: " << errno;
+    }
+    // `backtrace` loads libgcc on first call, this can't be done inside the signal handler
+    void* dummy[1];
+    backtrace(dummy, 1);
+}
+
+// Profile serialization (profile.proto)
+
+class ProtoWriter {
+    std::string buf_;
+
+    enum {
+        VARINT = 0,
+        LENGTH_DELIMITED = 2,
+    };
+
+    void key(int field, int type) {
+        varint(static_cast<u64>(field) << 3 | static_cast<u64>(type));
+    }
+
+public:
+    void varint(u64 value) {
+        while (value >= 0x80) {
+            buf_.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        buf_.push_back(static_cast<char>(value));
+    }
+
+    void uint64(int field, u64 value) {
+        key(field, VARINT);
+        varint(value);
+    }
+
+    void boolean(int field, bool value) {
+        uint64(field, value ? 1 : 0);
+    }
+
+    void bytes(int field, std::string const& value) {
+        key(field, LENGTH_DELIMITED);
+        varint(value.size());
+        buf_.append(value);
+    }
+
+    void message(int field, ProtoWriter const& msg) {
+        bytes(field, msg.buf_);
+    }
+
+    void packed(int field, std::vector<u64> const& values) {
+        ProtoWriter tmp;
+        for (auto value: values) {
+            tmp.varint(value);
+        }
+        bytes(field, tmp.buf_);
+    }
+
+    std::string const& str() const {
+        return buf_;
+    }
+};
+
+struct Mapping {
+    u64 id;
+    uintptr_t start;
+    uintptr_t limit;
+    u64 offset;
+    std::string path;
+    bool has_functions;
+};
+
+//! Read executable mappings of the process
+std::vector<Mapping> read_mappings() {
+    std::vector<Mapping> result;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::stringstream str(line);
+        std::string range, perms, offset, dev, inode, path;
+        str >> range >> perms >> offset >> dev >> inode;
+        std::getline(str >> std::ws, path);
+        if (perms.size() < 3 || perms[2] != 'x') {
+            continue;
+        }
+        auto dash = range.find('-');
+        if (dash == std::string::npos) {
+            continue;
+        }
+        Mapping mapping;
+        mapping.id = result.size() + 1;
+        mapping.start = std::strtoull(range.substr(0, dash).c_str(), nullptr, 16);
+        mapping.limit = std::strtoull(range.substr(dash + 1).c_str(), nullptr, 16);
+        mapping.offset = std::strtoull(offset.c_str(), nullptr, 16);
+        mapping.path = path;
+        mapping.has_functions = true;
+        result.push_back(mapping);
+    }
+    return result;
+}
+
+std::string get_thread_name(u64 tid) {
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    if (!std::getline(comm, name) || name.empty()) {
+        // Thread has finished
+        name = "thread-" + std::to_string(tid);
+    }
+    return name;
+}
+
+//! Find name of the function that contains the address (empty string if not found)
+std::tuple<std::string, std::string> symbolize(uintptr_t addr) {
+    Dl_info info = {};
+    if (dladdr(reinterpret_cast<void*>(addr), &info) == 0 || info.dli_sname == nullptr) {
+        return std::make_tuple(std::string(), std::string());
+    }
+    std::string system_name = info.dli_sname;
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = status == 0 && demangled ? demangled : system_name;
+    std::free(demangled);
+    return std::make_tuple(name, system_name);
+}
+
+class ProfileBuilder {
+    std::vector<std::string> strings_;
+    std::unordered_map<std::string, u64> string_ids_;
+    std::vector<Mapping> mappings_;
+    std::map<uintptr_t, u64> location_ids_;
+    std::map<std::string, u64> function_ids_;
+    ProtoWriter locations_;
+    ProtoWriter functions_;
+    ProtoWriter samples_;
+
+    u64 intern(std::string const& str) {
+        auto it = string_ids_.find(str);
+        if (it != string_ids_.end()) {
+            return it->second;
+        }
+        u64 id = strings_.size();
+        strings_.push_back(str);
+        string_ids_[str] = id;
+        return id;
+    }
+
+    Mapping* find_mapping(uintptr_t addr) {
+        for (auto& mapping: mappings_) {
+            if (addr >= mapping.start && addr < mapping.limit) {
+                return &mapping;
+            }
+        }
+        return nullptr;
+    }
+
+    u64 get_function(std::string const& name, std::string const& system_name) {
+        auto it = function_ids_.find(name);
+        if (it != function_ids_.end()) {
+            return it->second;
+        }
+        u64 id = function_ids_.size() + 1;
+        function_ids_[name] = id;
+        ProtoWriter fn;
+        fn.uint64(1, id);
+        fn.uint64(2, intern(name));
+        fn.uint64(3, intern(system_name));
+        functions_.message(5, fn);
+        return id;
+    }
+
+    u64 get_location(uintptr_t addr) {
+        auto it = location_ids_.find(addr);
+        if (it != location_ids_.end()) {
+            return it->second;
+        }
+        u64 id = location_ids_.size() + 1;
+        location_ids_[addr] = id;
+        ProtoWriter loc;
+        loc.uint64(1, id);
+        auto mapping = find_mapping(addr);
+        if (mapping) {
+            loc.uint64(2, mapping->id);
+        }
+        loc.uint64(3, addr);
+        std::string name, system_name;
+        std::tie(name, system_name) = symbolize(addr);
+        if (!name.empty()) {
+            ProtoWriter line;
+            line.uint64(1, get_function(name, system_name));
+            loc.message(4, line);
+        } else if (mapping) {
+            // pprof should symbolize the addresses of this mapping using the binary
+            mapping->has_functions = false;
+        }
+        locations_.message(4, loc);
+        return id;
+    }
+
+    ProtoWriter value_type(std::string const& type, std::string const& unit) {
+        ProtoWriter vt;
+        vt.uint64(1, intern(type));
+        vt.uint64(2, intern(unit));
+        return vt;
+    }
+
+public:
+    ProfileBuilder()
+        : mappings_(read_mappings())
+    {
+        intern("");
+    }
+
+    /** Add sample
+      * @param thread is a thread name
+      * @param tid is a thread id
+      * @param frames is a stack trace (leaf first)
+      * @param count is a number of samples
+      * @param period is a sampling period in nanoseconds
+      */
+    void add_sample(std::string const& thread, u64 tid, std::vector<uintptr_t> const& frames, u64 count, u64 period) {
+        std::vector<u64> locations;
+        for (size_t i = 0; i < frames.size(); i++) {
+            // Return addresses point to the next instruction after the call
+            uintptr_t addr = i == 0 ? frames[i] : frames[i] - 1;
+            locations.push_back(get_location(addr));
+        }
+        ProtoWriter sample;
+        sample.packed(1, locations);
+        sample.packed(2, { count, count*period });
+        ProtoWriter name;
+        name.uint64(1, intern("thread"));
+        name.uint64(2, intern(thread));
+        sample.message(3, name);
+        ProtoWriter id;
+        id.uint64(1, intern("tid"));
+        id.uint64(3, tid);
+        sample.message(3, id);
+        samples_.message(2, sample);
+    }
+
+    std::string build(u64 time_nanos, u64 duration_nanos, u64 period) {
+        ProtoWriter profile;
+        profile.message(1, value_type("samples", "count"));
+        profile.message(1, value_type("cpu", "nanoseconds"));
+        auto period_type = value_type("cpu", "nanoseconds");
+        std::string result = profile.str() + samples_.str();
+        ProtoWriter tail;
+        for (auto const& mapping: mappings_) {
+            ProtoWriter m;
+            m.uint64(1, mapping.id);
+            m.uint64(2, mapping.start);
+            m.uint64(3, mapping.limit);
+            m.uint64(4, mapping.offset);
+            m.uint64(5, intern(mapping.path));
+            m.boolean(7, mapping.has_functions);
+            tail.message(3, m);
+        }
+        result += tail.str() + locations_.str() + functions_.str();
+        ProtoWriter footer;
+        for (auto const& str: strings_) {
+            footer.bytes(6, str);
+        }
+        footer.uint64(9, time_nanos);
+        footer.uint64(10, duration_nanos);
+        footer.message(11, period_type);
+        footer.uint64(12, period);
+        return result + footer.str();
+    }
+};
+
+}  // namespace
+
+
+aku_Status CpuProfiler::collect(std::chrono::seconds duration, u32 frequency, std::string* result) {
+    if (duration.count() <= 0 || duration.count() > MAX_DURATION_SEC || frequency == 0 || frequency > MAX_FREQUENCY) {
+        return AKU_EBAD_ARG;
+    }
+    std::unique_lock<std::mutex> lock(s_collect_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return AKU_EBUSY;
+    }
+    static std::once_flag once;
+    std::call_once(once, &install_handler);
+
+    SampleBuffer buffer;
+    u64 period = 1000000000ull / frequency;
+    auto start = std::chrono::system_clock::now();
+    s_buffer.store(&buffer);
+    itimerval timer = {};
+    timer.it_interval.tv_usec = static_cast<suseconds_t>(period / 1000);
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        s_buffer.store(nullptr);
+        s_logger_.error() << "Can't start profiling timer, errno: " << errno;
+        return AKU_EGENERAL;
+    }
+    s_logger_.info() << "CPU profiling started, duration: " << duration.count() << "s, frequency: " << frequency << "Hz";
+    std::this_thread::sleep_for(duration);
+    itimerval stop = {};
+    setitimer(ITIMER_PROF, &stop, nullptr);
+    s_buffer.store(nullptr);
+    while (s_active_handlers.load() != 0) {
+        std::this_thread::yield();
+    }
+    auto elapsed = std::chrono::system_clock::now() - start;
+
+    // Aggregate identical stack traces
+    std::map<std::vector<uintptr_t>, u64> stacks;
+    size_t end = std::min(buffer.pos.load(), static_cast<size_t>(BUFFER_SIZE));
+    const uintptr_t* data = buffer.data.get();
+    size_t nsamples = 0;
+    for (size_t off = 0; off + 2 <= end;) {
+        auto tid = data[off];
+        auto nframes = static_cast<size_t>(data[off + 1]);
+        if (tid == 0 || nframes == 0 || off + 2 + nframes > end) {
+            // Sample didn't fit the buffer
+            break;
+        }
+        std::vector<uintptr_t> key(data + off, data + off + 2 + nframes);
+        stacks[key]++;
+        nsamples++;
+        off += 2 + nframes;
+    }
+    if (buffer.dropped.load() != 0) {
+        s_logger_.error() << buffer.dropped.load() << " samples dropped, sample buffer is full";
+    }
+
+    ProfileBuilder builder;
+    std::unordered_map<u64, std::string> thread_names;
+    for (auto const& kv: stacks) {
+        u64 tid = kv.first.at(0);
+        auto it = thread_names.find(tid);
+        if (it == thread_names.end()) {
+            it = thread_names.insert(std::make_pair(tid, get_thread_name(tid))).first;
+        }
+        std::vector<uintptr_t> frames(kv.first.begin() + 2, kv.first.end());
+        builder.add_sample(it->second, tid, frames, kv.second, period);
+    }
+    u64 time_nanos = static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count());
+    u64 duration_nanos = static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    *result = builder.build(time_nanos, duration_nanos, period);
+    s_logger_.info() << "CPU profiling finished, " << nsamples << " samples collected";
+    return AKU_SUCCESS;
+}
+
+
+// Heap profiler
+
+typedef int (*MallctlFn)(const char*, void*, size_t*, void*, size_t);
+
+//! Find jemalloc's mallctl function (nullptr if jemalloc is not used)
+static MallctlFn get_mallctl() {
+    static MallctlFn fn = reinterpret_cast<MallctlFn>(dlsym(RTLD_DEFAULT, "mallctl"));
+    return fn;
+}
+
+//! Check if jemalloc was started with heap profiling support (MALLOC_CONF=prof:true)
+static bool heap_profiling_enabled(MallctlFn mallctl) {
+    bool enabled = false;
+    size_t size = sizeof(enabled);
+    return mallctl && mallctl("opt.prof", &enabled, &size, nullptr, 0) == 0 && enabled;
+}
+
+bool HeapProfiler::activate() {
+    auto mallctl = get_mallctl();
+    if (!heap_profiling_enabled(mallctl)) {
+        return false;
+    }
+    bool active = true;
+    return mallctl("prof.active", nullptr, nullptr, &active, sizeof(active)) == 0;
+}
+
+aku_Status HeapProfiler::dump(std::string* result) {
+    auto mallctl = get_mallctl();
+    if (!heap_profiling_enabled(mallctl)) {
+        return AKU_ENOT_IMPLEMENTED;
+    }
+    char path[] = "/tmp/akumulid-heap-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        s_logger_.error() << "Can't create temporary file for the heap profile, errno: " << errno;
+        return AKU_EGENERAL;
+    }
+    close(fd);
+    const char* fname = path;
+    if (mallctl("prof.dump", nullptr, nullptr, &fname, sizeof(fname)) != 0) {
+        s_logger_.error() << "Can't dump heap profile";
+        unlink(path);
+        return AKU_EGENERAL;
+    }
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream content;
+    content << file.rdbuf();
+    *result = content.str();
+    unlink(path);
+    return AKU_SUCCESS;
+}
+
+
+// Memory stats
+
+void MemoryStats::collect(std::vector<std::pair<std::string, u64>>* result) {
+    std::ifstream statm("/proc/self/statm");
+    u64 vsize = 0, rss = 0;
+    if (statm >> vsize >> rss) {
+        u64 page_size = static_cast<u64>(sysconf(_SC_PAGESIZE));
+        result->push_back(std::make_pair("process.rss", rss * page_size));
+        result->push_back(std::make_pair("process.vsize", vsize * page_size));
+    }
+    auto mallctl = get_mallctl();
+    if (mallctl == nullptr) {
+        return;
+    }
+    // Counters are cached by jemalloc and updated when the epoch is advanced
+    u64 epoch = 1;
+    size_t size = sizeof(epoch);
+    mallctl("epoch", &epoch, &size, &epoch, size);
+    const char* names[] = {
+        "allocated", "active", "metadata", "resident", "mapped", "retained",
+    };
+    for (auto name: names) {
+        size_t value = 0;
+        size = sizeof(value);
+        std::string key = std::string("stats.") + name;
+        if (mallctl(key.c_str(), &value, &size, nullptr, 0) == 0) {
+            result->push_back(std::make_pair(std::string("allocator.") + name, static_cast<u64>(value)));
+        }
+    }
+}
+
+}  // namespace
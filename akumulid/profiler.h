@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "akumuli_def.h"
+
+namespace Akumuli {
+
+/** Sampling CPU profiler.
+  * Process-wide ITIMER_PROF timer delivers SIGPROF to the running threads, signal
+  * handler records the stack trace and the thread id into the preallocated buffer.
+  * Nothing is sampled between the captures. The result is serialized in pprof
+  * format (uncompressed profile.proto), every sample has the "thread" label with
+  * the name of the thread (thread names are read when the capture is finished).
+  *
+  * Usage: `go tool pprof -tagroot=thread akumulid cpu.pb`
+  */
+struct CpuProfiler {
+    enum {
+        DEFAULT_FREQUENCY = 100,   //< samples per second of CPU time
+        MAX_FREQUENCY = 1000,
+        MAX_DURATION_SEC = 300,
+    };
+
+    /** Capture the profile (blocks the calling thread for `duration`).
+      * @param duration is a profiling duration
+      * @param frequency is a sampling frequency in Hz
+      * @param result is a serialized profile
+      * @return AKU_EBUSY if the profile is captured by some other thread,
+      *         AKU_EBAD_ARG if parameters are out of range
+      */
+    static aku_Status collect(std::chrono::seconds duration, u32 frequency, std::string* result);
+};
+
+
+/** Heap profiler, relies on jemalloc (linked or preloaded using LD_PRELOAD).
+  * Heap profiling is compiled into the executable in inactive state and gets
+  * activated by `activate` (no need to set MALLOC_CONF), this only works if
+  * jemalloc was built with --enable-prof.
+  */
+struct HeapProfiler {
+    //! Activate allocation sampling, returns false if jemalloc or heap profiling is not available
+    static bool activate();
+
+    /** Dump heap profile (of the allocations sampled since activation) in jemalloc
+      * format (can be processed by jeprof or pprof).
+      * @return AKU_ENOT_IMPLEMENTED if heap profiling is not available
+      */
+    static aku_Status dump(std::string* result);
+};
+
+
+/** Memory usage of the process: resident set size and virtual memory size (from
+  * /proc/self/statm) and jemalloc counters (if jemalloc is linked or preloaded).
+  * Reported by the stats endpoint to track memory growth of the long running server.
+  */
+struct MemoryStats {
+    //! Append counters (name and value in bytes) to `result`
+    static void collect(std::vector<std::pair<std::string, u64>>* result);
+};
+
+}  // namespace
@@ -1,10 +1,16 @@
 #include "protocolparser.h"
 #include <sstream>
 #include <cassert>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <unordered_map>
 #include <boost/algorithm/string.hpp>
 
 #include "resp.h"
 #include "ingestion_pipeline.h"
+#include "akumuli_tracing.h"
 
 namespace Akumuli {
 
@@ -27,61 +33,161 @@ const char* DatabaseError::what() const noexcept {
 
 // ReadBuffer class //
 
+namespace {
+
+/** Pool of read buffer chunks shared by all connections.
+  * Freed chunks are cached and reused by other buffers. Memory of all chunks
+  * (including cached) is accounted as AKU_MEM_READ_BUFFERS.
+  */
+class ChunkPool {
+    enum {
+        MAX_FREE = 0x400,  // max number of cached chunks of one size
+    };
+    std::mutex lock_;
+    std::unordered_map<size_t, std::vector<Byte*>> free_;
+
+    void release(Byte* ptr, size_t size) {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            auto& list = free_[size];
+            if (list.size() < MAX_FREE) {
+                list.push_back(ptr);
+                return;
+            }
+        }
+        delete[] ptr;
+        aku_memory_add(AKU_MEM_READ_BUFFERS, -static_cast<i64>(size));
+    }
+
+public:
+    static ChunkPool& instance() {
+        // Never destroyed, chunks can be released during static destruction
+        static ChunkPool* pool = new ChunkPool();
+        return *pool;
+    }
+
+    std::shared_ptr<Byte> allocate(size_t size) {
+        Byte* ptr = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            auto& list = free_[size];
+            if (!list.empty()) {
+                ptr = list.back();
+                list.pop_back();
+            }
+        }
+        if (ptr == nullptr) {
+            ptr = new Byte[size];
+            aku_memory_add(AKU_MEM_READ_BUFFERS, static_cast<i64>(size));
+        }
+        return std::shared_ptr<Byte>(ptr, [this, size](Byte* p) {
+            release(p, size);
+        });
+    }
+};
+
+}
+
 ReadBuffer::ReadBuffer(const size_t buffer_size)
     : BUFFER_SIZE(buffer_size)
-    , buffer_(buffer_size*N_BUF, 0)
-    , rpos_(0)
-    , wpos_(0)
-    , cons_(0)
+    , CHUNK_SIZE(buffer_size*N_BUF)
+    , rpos_{0, 0}
+    , cons_{0, 0}
     , buffers_allocated_(0)
 {
 }
 
+bool ReadBuffer::normalize() const {
+    while (rpos_.chunk < chunks_.size()) {
+        if (rpos_.offset < chunks_[rpos_.chunk].size) {
+            return true;
+        }
+        if (rpos_.chunk + 1 == chunks_.size()) {
+            break;
+        }
+        rpos_.chunk++;
+        rpos_.offset = 0;
+    }
+    return false;
+}
+
 Byte ReadBuffer::get() {
-    if (rpos_ == wpos_) {
+    if (!normalize()) {
         auto ctx = get_error_context("unexpected end of stream");
         BOOST_THROW_EXCEPTION(ProtocolParserError(std::get<0>(ctx), std::get<1>(ctx)));
     }
-    return buffer_[rpos_++];
+    return chunks_[rpos_.chunk].data.get()[rpos_.offset++];
 }
 
 Byte ReadBuffer::pick() const {
-    if (rpos_ == wpos_) {
+    if (!normalize()) {
         auto ctx = get_error_context("unexpected end of stream");
         BOOST_THROW_EXCEPTION(ProtocolParserError(std::get<0>(ctx), std::get<1>(ctx)));
     }
-    return buffer_[rpos_];
+    return chunks_[rpos_.chunk].data.get()[rpos_.offset];
 }
 
 bool ReadBuffer::is_eof() {
-    return rpos_ == wpos_;
+    return !normalize();
 }
 
 int ReadBuffer::read(Byte *buffer, size_t buffer_len) {
     assert(buffer_len < 0x100000000ul);
-    u32 to_read = wpos_ - rpos_;
-    to_read = std::min(static_cast<u32>(buffer_len), to_read);
-    std::copy(buffer_.begin() + rpos_, buffer_.begin() + rpos_ + to_read, buffer);
-    rpos_ += to_read;
-    return static_cast<int>(to_read);
+    size_t nread = 0;
+    while (nread < buffer_len && normalize()) {
+        auto const& chunk = chunks_[rpos_.chunk];
+        auto size = std::min(static_cast<size_t>(chunk.size - rpos_.offset), buffer_len - nread);
+        memcpy(buffer + nread, chunk.data.get() + rpos_.offset, size);
+        rpos_.offset += static_cast<u32>(size);
+        nread += size;
+    }
+    return static_cast<int>(nread);
 }
 
 int ReadBuffer::read_line(Byte* buffer, size_t quota) {
     assert(quota < 0x100000000ul);
-    u32 available = wpos_ - rpos_;
-    auto to_read = std::min(static_cast<u32>(quota), available);
-    for (u32 i = 0; i < to_read; i++) {
-        Byte c = buffer_[rpos_ + i];
-        buffer[i] = c;
-        if (c == '\n') {
-            // Stop iteration
-            u32 bytes_copied = i + 1;
-            rpos_ += bytes_copied;
-            return static_cast<int>(bytes_copied);
+    if (!normalize()) {
+        return 0;
+    }
+    // Read position is not changed unless the end of line is found
+    size_t copied = 0;
+    Pos pos = rpos_;
+    while (copied < quota && pos.chunk < chunks_.size()) {
+        auto const& chunk = chunks_[pos.chunk];
+        auto begin = chunk.data.get() + pos.offset;
+        auto size = std::min(static_cast<size_t>(chunk.size - pos.offset), quota - copied);
+        auto eol = static_cast<const Byte*>(memchr(begin, '\n', size));
+        if (eol != nullptr) {
+            auto len = static_cast<size_t>(eol - begin) + 1;
+            memcpy(buffer + copied, begin, len);
+            rpos_ = { pos.chunk, pos.offset + static_cast<u32>(len) };
+            return static_cast<int>(copied + len);
         }
+        memcpy(buffer + copied, begin, size);
+        copied += size;
+        pos = { pos.chunk + 1, 0 };
     }
     // No end of line found
-    return -1*static_cast<int>(to_read);
+    return -1*static_cast<int>(copied);
+}
+
+size_t ReadBuffer::get_chunk(const Byte** data) const {
+    if (!normalize()) {
+        *data = nullptr;
+        return 0;
+    }
+    auto const& chunk = chunks_[rpos_.chunk];
+    *data = chunk.data.get() + rpos_.offset;
+    return chunk.size - rpos_.offset;
+}
+
+void ReadBuffer::skip(size_t n) {
+    while (n != 0 && normalize()) {
+        auto size = std::min(static_cast<size_t>(chunks_[rpos_.chunk].size - rpos_.offset), n);
+        rpos_.offset += static_cast<u32>(size);
+        n -= size;
+    }
+    assert(n == 0);
 }
 
 void ReadBuffer::close() {
@@ -89,20 +195,22 @@ void ReadBuffer::close() {
 
 std::tuple<std::string, size_t> ReadBuffer::get_error_context(const char *error_message) const {
     // Get the frame: [...\r\n...\r\n...\r\n]
-    auto origin = buffer_.data() + cons_;
-    const Byte* stop = origin;
+    std::string err;
     int nlcnt = 0;
-    const Byte* end = buffer_.data() + wpos_;
-    while (stop < end) {
-        if (*stop == '\n') {
-            nlcnt++;
-            if (nlcnt == 3) {
-                break;
+    for (size_t ix = cons_.chunk; ix < chunks_.size() && nlcnt < 3; ix++) {
+        auto const& chunk = chunks_[ix];
+        const Byte* it = chunk.data.get() + (ix == cons_.chunk ? cons_.offset : 0);
+        const Byte* end = chunk.data.get() + chunk.size;
+        while (it < end) {
+            if (*it == '\n') {
+                nlcnt++;
+                if (nlcnt == 3) {
+                    break;
+                }
             }
+            err.push_back(*it++);
         }
-        stop++;
     }
-    auto err = std::string(origin, stop);
     boost::algorithm::replace_all(err, "\r", "\\r");
     boost::algorithm::replace_all(err, "\n", "\\n");
     std::stringstream message;
@@ -111,9 +219,29 @@ std::tuple<std::string, size_t> ReadBuffer::get_error_context(const char *error_
     return std::make_tuple(message.str(), 0);
 }
 
+void ReadBuffer::release() {
+    assert(buffers_allocated_ == 0);  // Invariant check: buffer can be invalidated!
+    if (cons_.chunk + 1 >= chunks_.size() &&
+        (chunks_.empty() || cons_.offset == chunks_.back().size))
+    {
+        // Everything is consumed
+        chunks_.clear();
+        cons_ = rpos_ = { 0, 0 };
+        return;
+    }
+    auto nfree = cons_.chunk;
+    for (size_t i = 0; i < nfree; i++) {
+        chunks_.pop_front();
+    }
+    cons_.chunk -= nfree;
+    rpos_.chunk -= nfree;
+}
+
 void ReadBuffer::consume() {
     assert(buffers_allocated_ == 0);  // Invariant check: buffer can be invalidated!
+    normalize();
     cons_ = rpos_;
+    release();
 }
 
 void ReadBuffer::discard() {
@@ -121,31 +249,54 @@ void ReadBuffer::discard() {
     rpos_ = cons_;
 }
 
+u32 ReadBuffer::available() const {
+    if (!normalize()) {
+        return 0;
+    }
+    size_t size = chunks_[rpos_.chunk].size - rpos_.offset;
+    for (size_t ix = rpos_.chunk + 1; ix < chunks_.size(); ix++) {
+        size += chunks_[ix].size;
+    }
+    return static_cast<u32>(size);
+}
+
+const Byte* ReadBuffer::read_block(u32 size) {
+    const Byte* chunk;
+    auto contiguous = get_chunk(&chunk);
+    if (contiguous >= size && chunk != nullptr) {
+        rpos_.offset += size;
+        return chunk;
+    }
+    if (available() < size) {
+        return nullptr;
+    }
+    // Block spans several chunks
+    scratch_.resize(std::max(size, 1u));
+    read(scratch_.data(), size);
+    return scratch_.data();
+}
+
+size_t ReadBuffer::_get_nchunks() const {
+    return chunks_.size();
+}
+
 ReadBuffer::BufferT ReadBuffer::pull() {
-    assert(buffers_allocated_ == 0);  // Invariant check: buffer will be invalidated after vector.resize!
+    assert(buffers_allocated_ == 0);  // Invariant check: only one buffer can be acquired
     buffers_allocated_++;
-
-    u32 sz = static_cast<u32>(buffer_.size()) - wpos_;  // because previous push can bring partially filled buffer
-    if (sz < BUFFER_SIZE) {
-        if ((cons_ + sz) > BUFFER_SIZE) {
-            // Problem can be solved by rotating the buffer and asjusting wpos_, rpos_ and cons_
-            std::copy(buffer_.begin() + cons_, buffer_.end(), buffer_.begin());
-            wpos_ -= cons_;
-            rpos_ -= cons_;
-            cons_ = 0;
-        } else {
-            // Double the size of the buffer
-            buffer_.resize(buffer_.size() * 2);
-        }
+    if (chunks_.empty() || CHUNK_SIZE - chunks_.back().size < BUFFER_SIZE) {
+        // Chunks are never moved so the data can be parsed in place
+        Chunk chunk = { ChunkPool::instance().allocate(CHUNK_SIZE), 0 };
+        chunks_.push_back(std::move(chunk));
     }
-    Byte* ptr = buffer_.data() + wpos_;
-    return ptr;
+    auto& last = chunks_.back();
+    return last.data.get() + last.size;
 }
 
 void ReadBuffer::push(ReadBuffer::BufferT, u32 size) {
     assert(buffers_allocated_ == 1);
     buffers_allocated_--;
-    wpos_ += size;
+    assert(chunks_.back().size + size <= CHUNK_SIZE);
+    chunks_.back().size += size;
 }
 
 
@@ -156,6 +307,13 @@ RESPProtocolParser::RESPProtocolParser(std::shared_ptr<DbSession> consumer)
     , rdbuf_(RDBUF_SIZE)
     , consumer_(consumer)
     , logger_("resp-protocol-parser")
+    , mode_(Mode::UNKNOWN)
+    , ack_pending_(false)
+    , ack_seq_(0)
+    , nsamples_(0)
+    , server_ts_mode_(ServerTimestamps::DISABLED)
+    , server_ts_(0)
+    , clock_stale_(true)
 {
 }
 
@@ -163,6 +321,36 @@ void RESPProtocolParser::start() {
     logger_.info() << "Starting protocol parser";
 }
 
+void RESPProtocolParser::set_server_timestamps(ServerTimestamps mode) {
+    server_ts_mode_ = mode;
+    clock_stale_ = true;
+}
+
+void RESPProtocolParser::begin_batch() {
+    clock_stale_ = true;
+}
+
+//! Read low resolution clock (doesn't require a syscall)
+static aku_Timestamp read_coarse_clock() {
+#ifdef CLOCK_REALTIME_COARSE
+    timespec ts;
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+        return static_cast<aku_Timestamp>(ts.tv_sec)*1000000000ull + static_cast<aku_Timestamp>(ts.tv_nsec);
+    }
+#endif
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<aku_Timestamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+aku_Timestamp RESPProtocolParser::next_server_timestamp() {
+    if (clock_stale_) {
+        // Batches can be received faster than the clock ticks, timestamps shouldn't go back
+        server_ts_ = std::max(server_ts_, read_coarse_clock());
+        clock_stale_ = false;
+    }
+    return server_ts_++;
+}
+
 bool RESPProtocolParser::parse_timestamp(RESPStream& stream, aku_Sample& sample) {
     bool success = false;
     int bytes_read = 0;
@@ -184,6 +372,10 @@ bool RESPProtocolParser::parse_timestamp(RESPStream& stream, aku_Sample& sample)
             return false;
         }
         tsbuf[bytes_read] = '\0';
+        if (bytes_read == 0 && server_ts_mode_ != ServerTimestamps::DISABLED) {
+            sample.timestamp = next_server_timestamp();
+            break;
+        }
         if (aku_parse_timestamp(tsbuf, &sample) == AKU_SUCCESS) {
             break;
         }
@@ -202,6 +394,121 @@ bool RESPProtocolParser::parse_timestamp(RESPStream& stream, aku_Sample& sample)
     return true;
 }
 
+bool RESPProtocolParser::bind_alias(u64 alias, const char* begin, const char* end) {
+    assert(alias < MAX_ALIASES);
+    aku_ParamId ids[AKU_LIMITS_MAX_ROW_WIDTH];
+    int width = consumer_->name_to_param_id_list(begin, end, ids, AKU_LIMITS_MAX_ROW_WIDTH);
+    if (width <= 0) {
+        return false;
+    }
+    if (alias >= aliases_.size()) {
+        aliases_.resize(alias + 1);
+    }
+    aliases_[alias].assign(ids, ids + width);
+    return true;
+}
+
+const std::vector<aku_ParamId>* RESPProtocolParser::find_alias(u64 alias) const {
+    if (alias >= aliases_.size() || aliases_[alias].empty()) {
+        return nullptr;
+    }
+    return &aliases_[alias];
+}
+
+bool RESPProtocolParser::parse_array(RESPStream& stream) {
+    bool success;
+    u64 size, alias;
+    int bytes_read;
+    const int buffer_len = RESPStream::STRING_LENGTH_MAX;
+    Byte buffer[buffer_len];
+    auto throw_error = [&](const char* error) {
+        std::string msg;
+        size_t pos;
+        std::tie(msg, pos) = rdbuf_.get_error_context(error);
+        BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
+    };
+    std::tie(success, size) = stream.read_array_size();
+    if (!success) {
+        return false;
+    }
+    if (size != 2) {
+        throw_error("alias binding should contain alias and series name");
+    }
+    auto next = stream.next_type();
+    if (next == RESPStream::_AGAIN) {
+        return false;
+    } else if (next == RESPStream::STRING) {
+        // Acknowledgement request
+        std::tie(success, bytes_read) = stream.read_string(buffer, buffer_len);
+        if (!success) {
+            return false;
+        }
+        if (std::string(buffer, buffer + bytes_read) != "ack") {
+            throw_error("unknown command");
+        }
+        next = stream.next_type();
+        if (next == RESPStream::_AGAIN) {
+            return false;
+        } else if (next != RESPStream::INTEGER) {
+            throw_error("acknowledgement request should contain sequence number");
+        }
+        u64 seq;
+        std::tie(success, seq) = stream.read_int();
+        if (!success) {
+            return false;
+        }
+        ack_pending_ = true;
+        ack_seq_ = seq;
+        return true;
+    } else if (next != RESPStream::INTEGER) {
+        throw_error("alias binding should start with an integer");
+    }
+    std::tie(success, alias) = stream.read_int();
+    if (!success) {
+        return false;
+    }
+    if (alias >= MAX_ALIASES) {
+        throw_error("alias is too large");
+    }
+    next = stream.next_type();
+    if (next == RESPStream::_AGAIN) {
+        return false;
+    } else if (next != RESPStream::STRING) {
+        throw_error("alias binding should contain series name");
+    }
+    std::tie(success, bytes_read) = stream.read_string(buffer, buffer_len);
+    if (!success) {
+        return false;
+    }
+    if (!bind_alias(alias, buffer, buffer + bytes_read)) {
+        throw_error("invalid series name format");
+    }
+    return true;
+}
+
+int RESPProtocolParser::resolve_name(const char* begin, const char* end, aku_ParamId* ids, int nvalues) {
+    name_key_.assign(begin, end);
+    auto it = name_cache_.find(name_key_);
+    if (it != name_cache_.end()) {
+        int width = static_cast<int>(it->second.size());
+        if (width > nvalues) {
+            return -1*width;
+        }
+        std::copy(it->second.begin(), it->second.end(), ids);
+        return width;
+    }
+    int width = consumer_->name_to_param_id_list(begin, end, ids, nvalues);
+    if (width <= 0) {
+        return width;
+    }
+    if (name_cache_.size() >= NAME_CACHE_SIZE) {
+        // Working set is too large, start over
+        name_cache_.clear();
+    }
+    name_cache_.emplace(name_key_, std::vector<aku_ParamId>(ids, ids + width));
+    return width;
+}
+
 int RESPProtocolParser::parse_ids(RESPStream& stream, aku_ParamId* ids, int nvalues) {
     bool success;
     int bytes_read;
@@ -220,7 +527,7 @@ int RESPProtocolParser::parse_ids(RESPStream& stream, aku_ParamId* ids, int nval
             rdbuf_.discard();
             return -1;
         }
-        rowwidth = consumer_->name_to_param_id_list(buffer, buffer + bytes_read, ids, nvalues);
+        rowwidth = resolve_name(buffer, buffer + bytes_read, ids, nvalues);
         if (rowwidth <= 0) {
             std::string msg;
             size_t pos;
@@ -228,8 +535,33 @@ int RESPProtocolParser::parse_ids(RESPStream& stream, aku_ParamId* ids, int nval
             BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
         }
         break;
-    case RESPStream::INTEGER:
+    case RESPStream::INTEGER: {
+            // Series alias
+            u64 alias;
+            std::tie(success, alias) = stream.read_int();
+            if (!success) {
+                rdbuf_.discard();
+                return -1;
+            }
+            auto ids_list = find_alias(alias);
+            if (ids_list == nullptr) {
+                std::string msg;
+                size_t pos;
+                std::tie(msg, pos) = rdbuf_.get_error_context("unknown series alias");
+                BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
+            }
+            rowwidth = static_cast<int>(ids_list->size());
+            std::copy(ids_list->begin(), ids_list->end(), ids);
+        }
+        break;
     case RESPStream::ARRAY:
+        // Alias binding or acknowledgement request, doesn't contain data
+        if (!parse_array(stream)) {
+            rdbuf_.discard();
+            return -1;
+        }
+        rowwidth = 0;
+        break;
     case RESPStream::BULK_STR:
     case RESPStream::ERROR:
     case RESPStream::_BAD:
@@ -251,7 +583,7 @@ bool RESPProtocolParser::parse_values(RESPStream& stream, double* values, int nv
     int arrsize;
     bool success;
     auto parse_int_value = [&](int at) {
-        std::tie(success, values[0]) = stream.read_int();
+        std::tie(success, values[at]) = stream.read_int();
         if (!success) {
             return false;
         }
@@ -268,6 +600,9 @@ bool RESPProtocolParser::parse_values(RESPStream& stream, double* values, int nv
             std::tie(msg, pos) = rdbuf_.get_error_context("floating point value can't be that big");
             BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
         }
+        if (parse_decimal(buf, buf + bytes_read, &values[at])) {
+            return true;
+        }
         buf[bytes_read] = '\0';
         char* endptr = nullptr;
         values[at] = strtod(buf, &endptr);
@@ -376,7 +711,6 @@ void RESPProtocolParser::worker() {
     int rowwidth = 0;
     // Data to read
     aku_Sample sample;
-    aku_Status status = AKU_SUCCESS;
     //
     RESPStream stream(&rdbuf_);
     while(true) {
@@ -387,6 +721,11 @@ void RESPProtocolParser::worker() {
             rdbuf_.discard();
             return;
         }
+        if (rowwidth == 0) {
+            // Alias binding or acknowledgement request
+            rdbuf_.consume();
+            continue;
+        }
         // read ts
         success = parse_timestamp(stream, sample);
         if (!success) {
@@ -407,20 +746,188 @@ void RESPProtocolParser::worker() {
         for (int i = 0; i < rowwidth; i++) {
             sample.paramid = paramids[i];
             sample.payload.float64 = values[i];
-            status = consumer_->write(sample);
-            // Message processed and frame can be removed (if possible)
-            if (status != AKU_SUCCESS) {
-                BOOST_THROW_EXCEPTION(DatabaseError(status));
-            }
+            batch_.push_back(sample);
+        }
+        if (batch_.size() >= BATCH_SIZE) {
+            flush_batch();
         }
     }
 }
 
-NullResponse RESPProtocolParser::parse_next(Byte* buffer, u32 sz) {
-    static NullResponse response;
+static const char BINARY_MAGIC[] = "AKUI";
+static const u32 BINARY_MAGIC_SIZE = 4;
+static const u32 FRAME_HEADER_SIZE = 5;
+
+bool RESPProtocolParser::detect_protocol() {
+    auto size = std::min(rdbuf_.available(), BINARY_MAGIC_SIZE);
+    if (size == 0) {
+        return false;
+    }
+    auto head = rdbuf_.read_block(size);
+    if (memcmp(head, BINARY_MAGIC, size) != 0) {
+        // Text protocol frame can't start with the magic
+        rdbuf_.discard();
+        mode_ = Mode::TEXT;
+        return true;
+    }
+    if (size < BINARY_MAGIC_SIZE) {
+        rdbuf_.discard();
+        return false;
+    }
+    rdbuf_.consume();
+    mode_ = Mode::BINARY;
+    logger_.info() << "Binary protocol detected";
+    return true;
+}
+
+static void throw_binary_error(const char* error, char type) {
+    std::stringstream fmt;
+    fmt << error << " - binary frame '" << type << "'";
+    BOOST_THROW_EXCEPTION(ProtocolParserError(fmt.str(), 0));
+}
+
+void RESPProtocolParser::parse_dict_frame(const Byte* payload, u32 size) {
+    if (size <= sizeof(u32)) {
+        throw_binary_error("dictionary entry is too short", 'D');
+    }
+    u32 id;
+    memcpy(&id, payload, sizeof(u32));
+    if (id >= MAX_ALIASES) {
+        throw_binary_error("dictionary id is too large", 'D');
+    }
+    if (!bind_alias(id, payload + sizeof(u32), payload + size)) {
+        throw_binary_error("invalid series name format", 'D');
+    }
+}
+
+void RESPProtocolParser::parse_points_frame(const Byte* payload, u32 size) {
+    if (size < 2*sizeof(u32)) {
+        throw_binary_error("data points frame is too short", 'P');
+    }
+    u32 id, n;
+    memcpy(&id, payload, sizeof(u32));
+    memcpy(&n, payload + sizeof(u32), sizeof(u32));
+    auto alias = find_alias(id);
+    if (alias == nullptr) {
+        throw_binary_error("unknown series id", 'P');
+    }
+    auto const& ids = *alias;
+    // Frame size is limited so this can't overflow
+    u64 expected = 2*sizeof(u32) + static_cast<u64>(n)*sizeof(u64)*(1 + ids.size());
+    if (expected != size) {
+        throw_binary_error("invalid data points frame size", 'P');
+    }
+    const Byte* tsarray = payload + 2*sizeof(u32);
+    const Byte* xsarray = tsarray + n*sizeof(u64);
+    aku_Sample sample = {};
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    sample.payload.size = sizeof(aku_Sample);
+    batch_.reserve(batch_.size() + n*ids.size());
+    for (u32 i = 0; i < n; i++) {
+        memcpy(&sample.timestamp, tsarray + i*sizeof(u64), sizeof(u64));
+        for (size_t col = 0; col < ids.size(); col++) {
+            sample.paramid = ids[col];
+            memcpy(&sample.payload.float64, xsarray + (col*n + i)*sizeof(double), sizeof(double));
+            batch_.push_back(sample);
+        }
+    }
+}
+
+void RESPProtocolParser::parse_ack_frame(const Byte* payload, u32 size) {
+    if (size != sizeof(u64)) {
+        throw_binary_error("invalid acknowledgement request size", 'A');
+    }
+    memcpy(&ack_seq_, payload, sizeof(u64));
+    ack_pending_ = true;
+}
+
+void RESPProtocolParser::binary_worker() {
+    while(true) {
+        auto header = rdbuf_.read_block(FRAME_HEADER_SIZE);
+        if (header == nullptr) {
+            rdbuf_.discard();
+            return;
+        }
+        char type = header[0];
+        u32 size;
+        memcpy(&size, header + 1, sizeof(u32));
+        if (size > MAX_FRAME_SIZE) {
+            throw_binary_error("frame is too large", type);
+        }
+        auto payload = rdbuf_.read_block(size);
+        if (payload == nullptr) {
+            rdbuf_.discard();
+            return;
+        }
+        switch (type) {
+        case 'D':
+            parse_dict_frame(payload, size);
+            break;
+        case 'P':
+            parse_points_frame(payload, size);
+            break;
+        case 'A':
+            parse_ack_frame(payload, size);
+            break;
+        default:
+            throw_binary_error("unknown frame type", type);
+        };
+        rdbuf_.consume();
+        if (batch_.size() >= BATCH_SIZE) {
+            flush_batch();
+        }
+    }
+}
+
+u64 RESPProtocolParser::get_nsamples() const {
+    return nsamples_;
+}
+
+aku_Status RESPProtocolParser::write_batch() {
+    aku_Status status = AKU_SUCCESS;
+    if (!batch_.empty()) {
+        status = consumer_->write_batch(batch_.data(), batch_.size());
+        nsamples_ += batch_.size();
+        batch_.clear();
+    }
+    return status;
+}
+
+void RESPProtocolParser::flush_batch() {
+    aku_Status status = write_batch();
+    if (status != AKU_SUCCESS) {
+        BOOST_THROW_EXCEPTION(DatabaseError(status));
+    }
+}
+
+RESPResponse RESPProtocolParser::parse_next(Byte* buffer, u32 sz) {
+    AKU_TRACE_SCOPE1(resp_parse, sz);
+    if (server_ts_mode_ == ServerTimestamps::PER_CHUNK) {
+        clock_stale_ = true;
+    }
     rdbuf_.push(buffer, sz);
-    worker();
-    return response;
+    if (mode_ == Mode::UNKNOWN && !detect_protocol()) {
+        return RESPResponse();
+    }
+    try {
+        if (mode_ == Mode::BINARY) {
+            binary_worker();
+        } else {
+            worker();
+        }
+    } catch (...) {
+        // Samples parsed before the error should be written
+        write_batch();
+        ack_pending_ = false;
+        throw;
+    }
+    flush_batch();
+    if (ack_pending_) {
+        // Everything received before the request is written
+        ack_pending_ = false;
+        return RESPResponse(":" + std::to_string(ack_seq_) + "\r\n");
+    }
+    return RESPResponse();
 }
 
 Byte* RESPProtocolParser::get_next_buffer() {
@@ -451,6 +958,7 @@ OpenTSDBProtocolParser::OpenTSDBProtocolParser(std::shared_ptr<DbSession> consum
     , rdbuf_(RDBUF_SIZE)
     , consumer_(consumer)
     , logger_("opentsdb-protocol-parser")
+    , nsamples_(0)
 {
 }
 
@@ -459,8 +967,57 @@ void OpenTSDBProtocolParser::start() {
 }
 
 OpenTSDBResponse OpenTSDBProtocolParser::parse_next(Byte* buffer, u32 sz) {
+    AKU_TRACE_SCOPE1(opentsdb_parse, sz);
     rdbuf_.push(buffer, sz);
-    return worker();
+    OpenTSDBResponse response;
+    try {
+        response = worker();
+    } catch (...) {
+        // Samples parsed before the error should be written
+        write_batch();
+        throw;
+    }
+    flush_batch();
+    return response;
+}
+
+u64 OpenTSDBProtocolParser::get_nsamples() const {
+    return nsamples_;
+}
+
+aku_Status OpenTSDBProtocolParser::write_batch() {
+    aku_Status status = AKU_SUCCESS;
+    if (!batch_.empty()) {
+        status = consumer_->write_batch(batch_.data(), batch_.size());
+        nsamples_ += batch_.size();
+        batch_.clear();
+    }
+    return status;
+}
+
+void OpenTSDBProtocolParser::flush_batch() {
+    aku_Status status = write_batch();
+    if (status != AKU_SUCCESS) {
+        BOOST_THROW_EXCEPTION(DatabaseError(status));
+    }
+}
+
+aku_Status OpenTSDBProtocolParser::series_to_param_id(const char* name, u32 size, aku_Sample* sample) {
+    name_key_.assign(name, size);
+    auto it = name_cache_.find(name_key_);
+    if (it != name_cache_.end()) {
+        sample->paramid = it->second;
+        return AKU_SUCCESS;
+    }
+    aku_Status status = consumer_->series_to_param_id(name, size, sample);
+    if (status == AKU_SUCCESS) {
+        if (name_cache_.size() >= NAME_CACHE_SIZE) {
+            // Working set is too large, start over
+            name_cache_.clear();
+        }
+        name_cache_.emplace(name_key_, sample->paramid);
+    }
+    return status;
 }
 
 Byte* OpenTSDBProtocolParser::get_next_buffer() {
@@ -581,7 +1138,7 @@ static aku_Timestamp from_unix_time(u64 ts) {
 }
 
 OpenTSDBResponse OpenTSDBProtocolParser::worker() {
-    static OpenTSDBResponse result;
+    OpenTSDBResponse result;
     const size_t buffer_len = AKU_LIMITS_MAX_SNAME + 3 + 17 + 26;  // 3 space delimiters + 17 for value + 26 for timestampm
     Byte buffer[buffer_len];
     while(true) {
@@ -666,7 +1223,7 @@ OpenTSDBResponse OpenTSDBProtocolParser::worker() {
             std::rotate(a, b, pend);
 
             // Buffer contains only one data point
-            status = consumer_->series_to_param_id(pbuf, static_cast<u32>(name_size - tags_trailing), &sample);  // -1 because name_size includes space
+            status = series_to_param_id(pbuf, static_cast<u32>(name_size - tags_trailing), &sample);
             if (status != AKU_SUCCESS) {
                 std::string msg;
                 size_t pos;
@@ -730,24 +1287,26 @@ OpenTSDBResponse OpenTSDBProtocolParser::worker() {
             sample.payload.type = AKU_PAYLOAD_FLOAT;
 
             // Put value
-            status = consumer_->write(sample);
-            if (status != AKU_SUCCESS) {
-                BOOST_THROW_EXCEPTION(DatabaseError(status));
-            }
-
+            batch_.push_back(sample);
             rdbuf_.consume();
+            if (batch_.size() >= BATCH_SIZE) {
+                flush_batch();
+            }
             break;
         }
         case OpenTSDBMessageType::STATS: {
             // Fake response
             // TODO: revamp akumuli stats
-            OpenTSDBResponse stats("akumuli.rpcs 1479600574 0 type=fake\n" );
-            return stats;
+            rdbuf_.consume();
+            result.append("akumuli.rpcs 1479600574 0 type=fake\n");
+            break;
         }
         case OpenTSDBMessageType::VERSION: {
-            OpenTSDBResponse ver("net.opentsdb.tools BuildData built at revision a000000\n"
-                                 "Akumuli to TSD converter/n");
-            return ver;
+            // Response is sent after the batch is flushed (see parse_next)
+            rdbuf_.consume();
+            result.append("net.opentsdb.tools BuildData built at revision a000000\n"
+                          "Akumuli to TSD converter\n");
+            break;
         }
         case OpenTSDBMessageType::UNKNOWN: {
             std::string msg;
@@ -773,4 +1332,406 @@ std::string OpenTSDBProtocolParser::error_repr(int kind, std::string const& err)
     return err + "\n";
 }
 
+//     Line protocols      //
+
+LineProtocolParser::LineProtocolParser(std::shared_ptr<DbSession> consumer, const char* name)
+    : done_(false)
+    , rdbuf_(RDBUF_SIZE)
+    , consumer_(consumer)
+    , logger_(name)
+    , nsamples_(0)
+{
+}
+
+void LineProtocolParser::start() {
+    logger_.info() << "Starting protocol parser";
+}
+
+Byte* LineProtocolParser::get_next_buffer() {
+    return rdbuf_.pull();
+}
+
+void LineProtocolParser::close() {
+    done_ = true;
+}
+
+u64 LineProtocolParser::get_nsamples() const {
+    return nsamples_;
+}
+
+aku_Status LineProtocolParser::write_batch() {
+    aku_Status status = AKU_SUCCESS;
+    if (!batch_.empty()) {
+        status = consumer_->write_batch(batch_.data(), batch_.size());
+        nsamples_ += batch_.size();
+        batch_.clear();
+    }
+    return status;
+}
+
+void LineProtocolParser::flush_batch() {
+    aku_Status status = write_batch();
+    if (status != AKU_SUCCESS) {
+        BOOST_THROW_EXCEPTION(DatabaseError(status));
+    }
+}
+
+const std::vector<aku_ParamId>* LineProtocolParser::resolve_name() {
+    auto it = name_cache_.find(name_);
+    if (it != name_cache_.end()) {
+        return &it->second;
+    }
+    aku_ParamId ids[AKU_LIMITS_MAX_ROW_WIDTH];
+    int width = consumer_->name_to_param_id_list(name_.data(), name_.data() + name_.size(),
+                                                 ids, AKU_LIMITS_MAX_ROW_WIDTH);
+    if (width <= 0) {
+        return nullptr;
+    }
+    if (name_cache_.size() >= NAME_CACHE_SIZE) {
+        // Working set is too large, start over
+        name_cache_.clear();
+    }
+    auto res = name_cache_.emplace(name_, std::vector<aku_ParamId>(ids, ids + width));
+    return &res.first->second;
+}
+
+void LineProtocolParser::throw_parse_error(const char* message) const {
+    std::string msg;
+    size_t pos;
+    std::tie(msg, pos) = rdbuf_.get_error_context(message);
+    BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
+}
+
+template<class Fn>
+void LineProtocolParser::parse_lines(Byte* buffer, u32 sz, Fn const& parse_line) {
+    rdbuf_.push(buffer, sz);
+    Byte line[LINE_SIZE];
+    try {
+        while (true) {
+            int len = rdbuf_.read_line(line, LINE_SIZE);
+            if (len == -LINE_SIZE) {
+                // The line can't be parsed, drop the data
+                std::string msg;
+                size_t pos;
+                std::tie(msg, pos) = rdbuf_.get_error_context("line is too long");
+                rdbuf_.skip(rdbuf_.available());
+                rdbuf_.consume();
+                BOOST_THROW_EXCEPTION(ProtocolParserError(msg, pos));
+            }
+            if (len <= 0) {
+                // Buffer doesn't have a full line
+                break;
+            }
+            try {
+                parse_line(line, len);
+            } catch (ProtocolParserError const&) {
+                // Skip the line, the rest of the stream can be parsed (if the
+                // server doesn't close the connection, e.g. UDP server)
+                rdbuf_.consume();
+                throw;
+            }
+            rdbuf_.consume();
+            if (batch_.size() >= BATCH_SIZE) {
+                flush_batch();
+            }
+        }
+    } catch (...) {
+        // Samples parsed before the error should be written
+        write_batch();
+        throw;
+    }
+    flush_batch();
+}
+
+std::string LineProtocolParser::error_repr(int kind, std::string const& err) const {
+    switch (kind) {
+    case ERR:
+        return "error: " + err + "\n";
+    case DB:
+        return "database: " + err + "\n";
+    };
+    return err + "\n";
+}
+
+//! Get line length without the line terminator and trailing spaces
+static int trim_line(const Byte* line, int len) {
+    while (len > 0) {
+        Byte c = line[len - 1];
+        if (c != '\n' && c != '\r' && c != ' ') {
+            break;
+        }
+        len--;
+    }
+    return len;
+}
+
+static const Byte* skip_spaces(const Byte* p, const Byte* end) {
+    while (p < end && *p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+//! Find the character or return `end`
+static const Byte* find_char(const Byte* p, const Byte* end, Byte c) {
+    auto res = static_cast<const Byte*>(memchr(p, c, static_cast<size_t>(end - p)));
+    return res ? res : end;
+}
+
+//! Parse unsigned integer, return false if the string contains anything but digits
+static bool parse_u64(const Byte* p, const Byte* end, u64* result) {
+    if (p == end) {
+        return false;
+    }
+    u64 value = 0;
+    for (; p < end; p++) {
+        unsigned digit = static_cast<unsigned>(*p - '0');
+        if (digit > 9) {
+            return false;
+        }
+        value = value*10 + digit;
+    }
+    *result = value;
+    return true;
+}
+
+//! Parse floating point number, the whole string should be consumed
+static bool parse_double(const Byte* p, const Byte* end, double* result) {
+    char buffer[64];
+    auto len = static_cast<size_t>(end - p);
+    if (len == 0 || len >= sizeof(buffer)) {
+        return false;
+    }
+    memcpy(buffer, p, len);
+    buffer[len] = '\0';
+    char* endptr = nullptr;
+    *result = strtod(buffer, &endptr);
+    return endptr == buffer + len;
+}
+
+static aku_Timestamp current_time() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<aku_Timestamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+}
+
+//     Influx line protocol      //
+
+InfluxProtocolParser::InfluxProtocolParser(std::shared_ptr<DbSession> consumer)
+    : LineProtocolParser(consumer, "influx-protocol-parser")
+{
+}
+
+NullResponse InfluxProtocolParser::parse_next(Byte* buffer, u32 sz) {
+    AKU_TRACE_SCOPE1(influx_parse, sz);
+    static NullResponse response;
+    parse_lines(buffer, sz, [this](Byte* line, int len) {
+        parse_line(line, len);
+    });
+    return response;
+}
+
+//! Parse value of the numeric or boolean field
+static bool parse_influx_value(const Byte* p, const Byte* end, double* result) {
+    auto is = [p, end](const char* str) {
+        return static_cast<size_t>(end - p) == strlen(str) && std::equal(p, end, str);
+    };
+    if (is("t") || is("T") || is("true") || is("True") || is("TRUE")) {
+        *result = 1.0;
+        return true;
+    }
+    if (is("f") || is("F") || is("false") || is("False") || is("FALSE")) {
+        *result = 0.0;
+        return true;
+    }
+    Byte last = *(end - 1);
+    if (last == 'i' || last == 'u') {
+        // Integer field
+        end--;
+    }
+    return parse_double(p, end, result);
+}
+
+void InfluxProtocolParser::parse_line(Byte* line, int len) {
+    const Byte* p   = line;
+    const Byte* end = line + trim_line(line, len);
+    p = skip_spaces(p, end);
+    if (p == end || *p == '#') {
+        // Empty line or comment
+        return;
+    }
+    // Series key ends at the first space, tags are separated by commas
+    const Byte* key_end = find_char(p, end, ' ');
+    if (key_end == end) {
+        throw_parse_error("influx: fields expected");
+    }
+    if (find_char(p, key_end, '\\') != key_end) {
+        throw_parse_error("influx: escaped characters are not supported");
+    }
+    const Byte* measurement = p;
+    const Byte* measurement_end = find_char(p, key_end, ',');
+    if (measurement_end == measurement) {
+        throw_parse_error("influx: measurement name expected");
+    }
+
+    // Build compound series name 'm.f1|m.f2 tags', one series per numeric field
+    name_.clear();
+    double values[AKU_LIMITS_MAX_ROW_WIDTH];
+    u32 nvalues = 0;
+    p = skip_spaces(key_end, end);
+    while (true) {
+        const Byte* field = p;
+        while (p < end && *p != '=' && *p != ',' && *p != ' ') {
+            p++;
+        }
+        if (p == field || p == end || *p != '=' || p + 1 == end) {
+            throw_parse_error("influx: invalid field");
+        }
+        const Byte* field_end = p++;
+        if (*p == '"') {
+            // String fields are skipped
+            p++;
+            while (p < end && *p != '"') {
+                if (*p == '\\') {
+                    p++;
+                }
+                p++;
+            }
+            if (p >= end) {
+                throw_parse_error("influx: unterminated string field");
+            }
+            p++;
+        } else {
+            const Byte* value = p;
+            while (p < end && *p != ',' && *p != ' ') {
+                p++;
+            }
+            if (nvalues == AKU_LIMITS_MAX_ROW_WIDTH) {
+                throw_parse_error("influx: too many fields");
+            }
+            if (p == value || !parse_influx_value(value, p, &values[nvalues])) {
+                throw_parse_error("influx: invalid field value");
+            }
+            if (nvalues != 0) {
+                name_.push_back('|');
+            }
+            name_.append(measurement, measurement_end);
+            name_.push_back('.');
+            name_.append(field, field_end);
+            nvalues++;
+        }
+        if (p == end || *p == ' ') {
+            break;
+        }
+        if (*p != ',') {
+            throw_parse_error("influx: invalid field");
+        }
+        p++;
+    }
+
+    aku_Timestamp timestamp;
+    p = skip_spaces(p, end);
+    if (p == end) {
+        timestamp = current_time();
+    } else if (!parse_u64(p, end, &timestamp)) {
+        throw_parse_error("influx: invalid timestamp");
+    }
+    if (nvalues == 0) {
+        // Only string fields
+        return;
+    }
+
+    // Tags
+    name_.push_back(' ');
+    for (const Byte* it = measurement_end + 1; it < key_end; it++) {
+        name_.push_back(*it == ',' ? ' ' : *it);
+    }
+
+    auto ids = resolve_name();
+    if (ids == nullptr || ids->size() != nvalues) {
+        throw_parse_error("influx: invalid series name format");
+    }
+    aku_Sample sample = {};
+    sample.timestamp = timestamp;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    sample.payload.size = sizeof(aku_Sample);
+    for (u32 i = 0; i < nvalues; i++) {
+        sample.paramid = (*ids)[i];
+        sample.payload.float64 = values[i];
+        batch_.push_back(sample);
+    }
+}
+
+//     Graphite plaintext protocol      //
+
+GraphiteProtocolParser::GraphiteProtocolParser(std::shared_ptr<DbSession> consumer)
+    : LineProtocolParser(consumer, "graphite-protocol-parser")
+{
+}
+
+NullResponse GraphiteProtocolParser::parse_next(Byte* buffer, u32 sz) {
+    AKU_TRACE_SCOPE1(graphite_parse, sz);
+    static NullResponse response;
+    parse_lines(buffer, sz, [this](Byte* line, int len) {
+        parse_line(line, len);
+    });
+    return response;
+}
+
+void GraphiteProtocolParser::parse_line(Byte* line, int len) {
+    const Byte* p   = line;
+    const Byte* end = line + trim_line(line, len);
+    p = skip_spaces(p, end);
+    if (p == end) {
+        return;
+    }
+    const Byte* path = p;
+    const Byte* path_end = find_char(p, end, ' ');
+    const Byte* value = skip_spaces(path_end, end);
+    const Byte* value_end = find_char(value, end, ' ');
+    const Byte* ts = skip_spaces(value_end, end);
+    if (ts == end) {
+        throw_parse_error("graphite: not enough arguments (need 3)");
+    }
+    if (find_char(ts, end, ' ') != end) {
+        throw_parse_error("graphite: too many arguments");
+    }
+
+    double xs;
+    if (!parse_double(value, value_end, &xs)) {
+        throw_parse_error("graphite: bad floating point value");
+    }
+    aku_Timestamp timestamp;
+    if (end - ts == 2 && ts[0] == '-' && ts[1] == '1') {
+        timestamp = current_time();
+    } else {
+        double seconds;
+        if (!parse_double(ts, end, &seconds) || seconds < 0) {
+            throw_parse_error("graphite: invalid timestamp");
+        }
+        timestamp = static_cast<aku_Timestamp>(seconds*1000000.0)*1000;
+    }
+
+    // Convert 'path;tag=value;tag=value' to 'path tag=value tag=value'
+    const Byte* tags = find_char(path, path_end, ';');
+    name_.assign(path, tags);
+    if (tags == path_end) {
+        name_.append(" source=graphite");
+    } else {
+        for (const Byte* it = tags; it < path_end; it++) {
+            name_.push_back(*it == ';' ? ' ' : *it);
+        }
+    }
+    auto ids = resolve_name();
+    if (ids == nullptr || ids->size() != 1) {
+        throw_parse_error("graphite: invalid series name format");
+    }
+    aku_Sample sample = {};
+    sample.paramid = ids->front();
+    sample.timestamp = timestamp;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    sample.payload.size = sizeof(aku_Sample);
+    sample.payload.float64 = xs;
+    batch_.push_back(sample);
+}
+
 }
@@ -18,8 +18,10 @@
 
 // Using old-style boost.coroutines
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <queue>
+#include <unordered_map>
 #include <vector>
 
 #include "logger.h"
@@ -78,20 +80,43 @@ struct ChunkedWriter {
 
 /** This class should be used in conjunction with tcp-server class.
  * It allocates buffers for server and makes them available to parser.
+ * Data is stored in the list of fixed-size chunks acquired from the global
+ * pool. Messages are parsed in place, message can span several chunks. Chunks
+ * are returned to the pool when all their data is consumed so idle buffer
+ * doesn't hold any memory.
  */
 class ReadBuffer : public ByteStreamReader, public ChunkedWriter {
     enum {
-        // This parameter defines initial buffer size as a number of BUFFER_SIZE regions.
+        // This parameter defines chunk size as a number of BUFFER_SIZE regions.
         // Increasing this parameter will increase memory requirements. Decreasing this parameter
-        // will increase amount of copying.
+        // will increase the number of chunk boundaries inside messages.
         N_BUF = 4,
     };
+
+    struct Chunk {
+        std::shared_ptr<Byte> data;  //< Chunk memory (returned to the pool on release)
+        u32 size;                    //< Number of bytes written to the chunk
+    };
+
+    //! Position in the chunk list
+    struct Pos {
+        size_t chunk;
+        u32    offset;
+    };
+
     const size_t BUFFER_SIZE;
-    std::vector<Byte> buffer_;
-    mutable u32 rpos_;   // Current read position
-    mutable u32 wpos_;   // Current write position
-    mutable u32 cons_;   // Consumed part of the buffer
+    const size_t CHUNK_SIZE;
+    std::deque<Chunk> chunks_;
+    mutable Pos rpos_;      // Current read position
+    Pos cons_;              // Consumed part of the buffer
     int buffers_allocated_; // Buffer counter (only one allocated buffer is allowed)
+    //! Copy of the block that spans several chunks (see `read_block`)
+    std::vector<Byte> scratch_;
+
+    //! Move read position to the next chunk if current one is exhausted, return false on eof
+    bool normalize() const;
+    //! Release chunks that precede the consumed position
+    void release();
 
 public:
     ReadBuffer(const size_t buffer_size);
@@ -103,11 +128,26 @@ public:
     virtual bool is_eof() override;
     virtual int read(Byte *buffer, size_t buffer_len) override;
     virtual int read_line(Byte* buffer, size_t quota) override;
+    virtual size_t get_chunk(const Byte** data) const override;
+    virtual void skip(size_t n) override;
     virtual void close() override;
     virtual std::tuple<std::string, size_t> get_error_context(const char *error_message) const override;
     virtual void consume();
     virtual void discard();
 
+    //! Number of bytes available for reading
+    u32 available() const;
+
+    /** Get pointer to `size` contiguous bytes and advance read position.
+      * Return nullptr if there is not enough data. If the block spans several
+      * chunks it's copied to the internal buffer. Pointer is valid until the
+      * next call to `read_block`, `consume` or `pull`.
+      */
+    const Byte* read_block(u32 size);
+
+    //! Number of chunks held by the buffer (for tests)
+    size_t _get_nchunks() const;
+
     // BufferAllocator interface
 public:
     /** Get pointer to buffer. Size of the buffer is guaranteed to be at least
@@ -129,6 +169,30 @@ struct NullResponse : ProtocolParserResponse {
     }
 };
 
+//! Acknowledgement sent back by the RESP parser
+struct RESPResponse : ProtocolParserResponse {
+    bool is_set_;
+    std::string body_;
+
+    RESPResponse()
+        : is_set_(false)
+    {
+    }
+
+    RESPResponse(std::string body)
+        : is_set_(true)
+        , body_(std::move(body))
+    {
+    }
+
+    virtual bool is_available() const {
+        return is_set_;
+    }
+    virtual std::string get_body() const {
+        return body_;
+    }
+};
+
 /**
  * @brief RESP protocol parser
  * Implements two complimentary protocols:
@@ -155,7 +219,9 @@ struct NullResponse : ProtocolParserResponse {
  * that contains ISO8601 formatted timestamp (only basic ISO8601 format supported).
  * Alternatively, if the second line contains a RESP integer, it's interpreted as a timestamp
  * (number of nanoseconds since epoch). The timestamp should be followed by the array of values.
- * The array of value is encoded using RESP array.
+ * The array of value is encoded using RESP array. Series names are cached by the
+ * parser as is, so the tags of the compound name are canonicalized and the ids of all
+ * its series are resolved only when the name is seen for the first time.
  * Example:
  *     +cpu.real|cpu.user|cpu.sys host=machine1 region=NW
  *     +20141210T074343
@@ -164,31 +230,154 @@ struct NullResponse : ProtocolParserResponse {
  *     +8.11
  *     +12.6
  *
+ * SERIES ALIASES can be used to avoid sending series names with every data point. The
+ * alias is bound to the series name (or compound series name) using RESP array that
+ * contains an integer alias and a series name. After that the RESP integer can be
+ * used instead of the series name. Aliases are local to the connection, the binding
+ * can be changed by sending new array with the same alias. Alias should be less than
+ * MAX_ALIASES.
+ * Example:
+ *     *2
+ *     :1
+ *     +cpu.user host=machine1 region=NW
+ *     :1
+ *     +20141210T074343
+ *     +8.11
+ *
+ * ACKNOWLEDGEMENTS can be requested by the client. Acknowledgement request is a RESP
+ * array that contains the "ack" string and the sequence number chosen by the client.
+ * Server sends the sequence number back as a RESP integer when all data points received
+ * before the request are written to the database. Requests are not waited for, the client
+ * can send many batches before the first acknowledgement arrives. If several requests are
+ * received at once only the last one is acknowledged (acknowledgements are cumulative).
+ * Errors are sent as RESP errors so they can't be mistaken for acknowledgements. Data points
+ * that weren't acknowledged before the error should be resent.
+ * Example:
+ *     *2
+ *     +ack
+ *     :42
+ * Response:
+ *     :42
+ *
  * Protocol data units of each protocol can be interleaved.
+ *
+ * BINARY PROTOCOL is used instead of the text protocols if the stream starts with
+ * the "AKUI" magic. Stream consists of frames, every frame starts with the frame type
+ * (one byte) and the size of the frame payload (u32). All numbers use native (little
+ * endian) byte order. Frame types:
+ * - 'D' dictionary entry: u32 id, series name (rest of the payload). Binds client
+ *   defined id to the series name (compound name can be used), ids are the same
+ *   as series aliases of the text protocol;
+ * - 'P' data points: u32 id, u32 n, u64 timestamps[n], f64 values[width][n] where
+ *   `width` is a number of series in the dictionary entry (values are stored
+ *   series by series);
+ * - 'A' acknowledgement request: u64 sequence number (the response is the same as
+ *   in the text protocol).
+ * Example (dictionary entry followed by two data points):
+ *     AKUI
+ *     D <19> <1> cpu.user host=A
+ *     P <40> <1> <2> <ts0> <ts1> <val0> <val1>
+ *
+ * SERVER TIMESTAMPS can be enabled for the clients that don't have a clock. Empty RESP
+ * string is used instead of the timestamp in this case. Coarse clock is read once per
+ * chunk of data (or once per batch of datagrams) and the samples of the chunk get
+ * consecutive timestamps (one nanosecond apart) starting from the clock value. Series
+ * that are sent at the same position of every chunk keep the regular timestamps.
+ * Example:
+ *     +cpu.user host=machine1 region=NW
+ *     +
+ *     +8.11
  */
 class RESPProtocolParser {
+public:
+    enum class ServerTimestamps {
+        DISABLED,   //< Timestamp is required
+        PER_CHUNK,  //< Clock is read once per `parse_next` call
+        PER_BATCH,  //< Clock is read once per `begin_batch` call
+    };
+private:
+    enum class Mode {
+        UNKNOWN,
+        TEXT,
+        BINARY,
+    };
     bool                               done_;
     ReadBuffer                         rdbuf_;
     std::shared_ptr<DbSession>         consumer_;
     Logger                             logger_;
+    std::vector<aku_Sample>            batch_;
+    Mode                               mode_;
+    //! Series aliases (binary protocol dictionary), alias is an index
+    std::vector<std::vector<aku_ParamId>> aliases_;
+    //! Ids of the recently seen series names (compound names are cached as is)
+    std::unordered_map<std::string, std::vector<aku_ParamId>> name_cache_;
+    //! Lookup key, reused to avoid allocations
+    std::string                        name_key_;
+    //! Set if acknowledgement was requested
+    bool                               ack_pending_;
+    //! Sequence number of the last acknowledgement request
+    u64                                ack_seq_;
+    //! Number of samples passed to the database
+    u64                                nsamples_;
+    ServerTimestamps                   server_ts_mode_;
+    //! Next server assigned timestamp
+    aku_Timestamp                      server_ts_;
+    //! Set if the clock should be read before the next timestamp is assigned
+    bool                               clock_stale_;
 
     //! Process frames from queue
     void worker();
+    //! Write all parsed samples to DB, return status of the write
+    aku_Status write_batch();
+    //! Write all parsed samples to DB, throw DatabaseError on error
+    void flush_batch();
     //! Generate error message
     std::tuple<std::string, size_t> get_error_from_pdu(PDU const& pdu) const;
 
     bool parse_timestamp(RESPStream& stream, aku_Sample& sample);
+    //! Assign timestamp to the sample that doesn't have one
+    aku_Timestamp next_server_timestamp();
     bool parse_values(RESPStream& stream, double* values, int nvalues);
     int parse_ids(RESPStream& stream, aku_ParamId* ids, int nvalues);
+    /** Resolve series name (or compound series name), return number of ids or zero or
+      * negative value on error. Names are cached as is, canonicalization and id lookup
+      * are performed only on cache miss.
+      */
+    int resolve_name(const char* begin, const char* end, aku_ParamId* ids, int nvalues);
+    //! Parse alias binding or acknowledgement request, return false if more data needed
+    bool parse_array(RESPStream& stream);
+
+    //! Bind alias to the series name (or compound series name), return false if name is invalid
+    bool bind_alias(u64 alias, const char* begin, const char* end);
+    //! Get series ids of the alias or nullptr if alias is not bound
+    const std::vector<aku_ParamId>* find_alias(u64 alias) const;
+
+    //! Choose protocol using the first bytes of the stream, return false if more data needed
+    bool detect_protocol();
+    //! Process binary frames
+    void binary_worker();
+    void parse_dict_frame(const Byte* payload, u32 size);
+    void parse_points_frame(const Byte* payload, u32 size);
+    void parse_ack_frame(const Byte* payload, u32 size);
 public:
     enum {
         RDBUF_SIZE = 0x1000,  // 4KB
+        BATCH_SIZE = 0x400,   // max number of samples written at once
+        MAX_FRAME_SIZE = 0x100000,  // max size of the binary frame payload (1MB)
+        MAX_ALIASES = 0x100000,     // max number of series aliases
+        NAME_CACHE_SIZE = 0x10000,  // max number of cached series names
     };
     RESPProtocolParser(std::shared_ptr<DbSession> consumer);
     void start();
-    NullResponse parse_next(Byte *buffer, u32 sz);
+    RESPResponse parse_next(Byte *buffer, u32 sz);
     void close();
     Byte* get_next_buffer();
+    //! Get number of samples passed to the database
+    u64 get_nsamples() const;
+    //! Enable or disable server assigned timestamps
+    void set_server_timestamps(ServerTimestamps mode);
+    //! Start new batch of data (the clock is read again in PER_BATCH mode)
+    void begin_batch();
 
     // Error representation
     enum {
@@ -206,11 +395,10 @@ public:
 
 struct OpenTSDBResponse : ProtocolParserResponse {
     bool is_set_;
-    const char* body_;
+    std::string body_;
 
     OpenTSDBResponse()
         : is_set_(false)
-        , body_(nullptr)
     {
     }
 
@@ -220,6 +408,12 @@ struct OpenTSDBResponse : ProtocolParserResponse {
     {
     }
 
+    //! Add response to the end (responses to several commands can be sent at once)
+    void append(const char* body) {
+        is_set_ = true;
+        body_.append(body);
+    }
+
     virtual bool is_available() const {
         return is_set_;
     }
@@ -233,6 +427,9 @@ struct OpenTSDBResponse : ProtocolParserResponse {
  *
  * Implements OpenTSDB protocol. In this protocol PDU delimiter is a new line character.
  * Each line contains exactly one command. This parser supports only 'put' command.
+ * Responses to the 'version' and 'stats' commands are sent after all data points
+ * received before the command are written to the database, so the 'version' command
+ * can be used by clients as an acknowledgement.
  *
  * Example:
  *     put cpu.real 20141210T074343 3.12 host=machine1 region=NW
@@ -244,11 +441,29 @@ class OpenTSDBProtocolParser {
     ReadBuffer                         rdbuf_;
     std::shared_ptr<DbSession>         consumer_;
     Logger                             logger_;
+    std::vector<aku_Sample>            batch_;
+    //! Series ids of the recently seen series names (names are not canonicalized)
+    std::unordered_map<std::string, aku_ParamId> name_cache_;
+    //! Lookup key, reused to avoid allocations
+    std::string                        name_key_;
+    //! Number of samples passed to the database
+    u64                                nsamples_;
 
     OpenTSDBResponse worker();
+    /** Resolve series name. Collectors send the same series with the same tag order
+      * every time so the names are cached as is, canonicalization and id lookup are
+      * performed only on cache miss.
+      */
+    aku_Status series_to_param_id(const char* name, u32 size, aku_Sample* sample);
+    //! Write all parsed samples to DB, return status of the write
+    aku_Status write_batch();
+    //! Write all parsed samples to DB, throw DatabaseError on error
+    void flush_batch();
 public:
     enum {
         RDBUF_SIZE = 0x1000,  // 4KB
+        BATCH_SIZE = 0x400,   // max number of samples written at once
+        NAME_CACHE_SIZE = 0x10000,  // max number of cached series names
     };
 
     OpenTSDBProtocolParser(std::shared_ptr<DbSession> consumer);
@@ -257,6 +472,8 @@ public:
     OpenTSDBResponse parse_next(Byte *buffer, u32 sz);
     void close();
     Byte* get_next_buffer();
+    //! Get number of samples passed to the database
+    u64 get_nsamples() const;
 
     // Error representation
     enum {
@@ -271,4 +488,109 @@ public:
     std::string error_repr(int kind, std::string const& err) const;
 };
 
+
+/**
+ * @brief Base class of the line oriented protocol parsers (Influx and Graphite)
+ *
+ * Every line is a PDU. Lines are parsed in place and the samples are written
+ * to the database in batches. Series names produced by the parser are cached
+ * (clients send the same series again and again) so canonicalization and
+ * series id lookup are performed only on cache miss.
+ */
+class LineProtocolParser {
+protected:
+    bool                               done_;
+    ReadBuffer                         rdbuf_;
+    std::shared_ptr<DbSession>         consumer_;
+    Logger                             logger_;
+    std::vector<aku_Sample>            batch_;
+    //! Ids of the recently seen series names (compound names are cached as is)
+    std::unordered_map<std::string, std::vector<aku_ParamId>> name_cache_;
+    //! Series name of the current line, reused to avoid allocations
+    std::string                        name_;
+    //! Number of samples passed to the database
+    u64                                nsamples_;
+
+    //! Write all parsed samples to DB, return status of the write
+    aku_Status write_batch();
+    //! Write all parsed samples to DB, throw DatabaseError on error
+    void flush_batch();
+    //! Resolve series name (or compound series name) in `name_`, return nullptr if name is invalid
+    const std::vector<aku_ParamId>* resolve_name();
+    //! Throw ProtocolParserError that points to the current line
+    [[noreturn]] void throw_parse_error(const char* message) const;
+    /** Push data to the buffer, call `parse_line(line, len)` for every complete
+      * line and write the samples to the database.
+      */
+    template<class Fn>
+    void parse_lines(Byte* buffer, u32 sz, Fn const& parse_line);
+
+    LineProtocolParser(std::shared_ptr<DbSession> consumer, const char* name);
+public:
+    enum {
+        RDBUF_SIZE = 0x1000,  // 4KB
+        BATCH_SIZE = 0x400,   // max number of samples written at once
+        NAME_CACHE_SIZE = 0x10000,  // max number of cached series names
+        LINE_SIZE = AKU_LIMITS_MAX_SNAME + 0x400,  // max line length (name + values)
+    };
+
+    void start();
+    void close();
+    Byte* get_next_buffer();
+    //! Get number of samples passed to the database
+    u64 get_nsamples() const;
+
+    // Error representation
+    enum {
+        DB,
+        ERR,
+        PARSE,
+    };
+
+    std::string error_repr(int kind, std::string const& err) const;
+};
+
+
+/**
+ * @brief InfluxDB line protocol parser
+ *
+ * Line format: `measurement[,tag=value...] field=value[,field=value...] [timestamp]`.
+ * Every field is mapped to the series `measurement.field tag=value...`, all fields
+ * of the line are resolved at once using compound series name. Float, integer
+ * (`i` and `u` suffixes) and boolean fields are supported, string fields are
+ * skipped. Timestamp is a number of nanoseconds since epoch, current time is used
+ * if the timestamp is omitted. Escaped characters in measurement and tag names
+ * are not supported (the names can't contain spaces). Lines that start with `#`
+ * are comments.
+ *
+ * Example:
+ *     cpu,host=machine1,region=NW user=8.11,sys=12.6,idle=79i 1418197423000000000
+ */
+class InfluxProtocolParser : public LineProtocolParser {
+    void parse_line(Byte* line, int len);
+public:
+    InfluxProtocolParser(std::shared_ptr<DbSession> consumer);
+    NullResponse parse_next(Byte *buffer, u32 sz);
+};
+
+
+/**
+ * @brief Graphite plaintext protocol parser
+ *
+ * Line format: `path[;tag=value...] value timestamp`. Timestamp is a Unix time
+ * in seconds (fractional part is allowed), -1 means current time. Tags of the
+ * Graphite 1.1 tagged series are converted to Akumuli tags, series without tags
+ * get the `source=graphite` tag (Akumuli requires at least one tag).
+ *
+ * Example:
+ *     servers.machine1.cpu.user 8.11 1418197423
+ *     cpu.user;host=machine1;region=NW 8.11 1418197423
+ */
+class GraphiteProtocolParser : public LineProtocolParser {
+    void parse_line(Byte* line, int len);
+public:
+    GraphiteProtocolParser(std::shared_ptr<DbSession> consumer);
+    NullResponse parse_next(Byte *buffer, u32 sz);
+};
+
 }  // namespace
@@ -1,6 +1,12 @@
 #include "query_results_pooler.h"
 #include "logger.h"
+#include "dtoa.h"
+#include <chrono>
 #include <cstdio>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <thread>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -8,6 +14,39 @@
 
 namespace Akumuli {
 
+//! Tuple header decoder (tuple format is described in akumuli_def.h)
+struct TupleHeader {
+    u32           ncols;
+    u64           bitmap;   //< bitmap of the compact tuple
+    u64 const*    words;    //< bitmap of the extended tuple
+    double const* values;
+
+    TupleHeader(const aku_Sample& sample)
+        : words(nullptr)
+        , values(reinterpret_cast<double const*>(sample.payload.data))
+    {
+        union {
+            u64 u;
+            double d;
+        } bits;
+        bits.d = sample.payload.float64;
+        ncols  = static_cast<u32>(bits.u >> 58);  // top 6 bits contains number of elements
+        bitmap = bits.u & 0x3ffffffffffffffull;
+        if (ncols == AKU_TUPLE_EXTENDED) {
+            ncols  = static_cast<u32>(bits.u);
+            words  = reinterpret_cast<u64 const*>(sample.payload.data);
+            values = reinterpret_cast<double const*>(words + (ncols + 63)/64);
+        }
+    }
+
+    bool is_set(u32 ix) const {
+        if (words) {
+            return (words[ix/64] >> (ix % 64)) & 1;
+        }
+        return (bitmap >> ix) & 1;
+    }
+};
+
 static Logger logger("query_results_pooler");
 
 static boost::property_tree::ptree from_json(std::string json) {
@@ -26,15 +65,81 @@ static boost::property_tree::ptree from_json(std::string json) {
     return ptree;
 }
 
-struct CSVOutputFormatter : OutputFormatter {
+//! Same as snprintf with "<prefix>%.17g<suffix>" format string but uses shortest representation
+static int format_double(char* begin, int size, const char* prefix, double value, const char* suffix) {
+    int len = 0;
+    for (const char* p = prefix; *p; p++) {
+        if (len == size) {
+            return -1;
+        }
+        begin[len++] = *p;
+    }
+    int vlen = dtoa(value, begin + len, static_cast<size_t>(size - len));
+    if (vlen < 0) {
+        return -1;
+    }
+    len += vlen;
+    for (const char* p = suffix; *p; p++) {
+        if (len == size) {
+            return -1;
+        }
+        begin[len++] = *p;
+    }
+    return len;
+}
+
+/** Per-query series name cache.
+  * Every output row contains the series name, lookup in the session takes a lock
+  * and copies the name. Names are cached on first use, the cache is dropped when
+  * it becomes too large.
+  */
+struct SeriesNameCache {
+    enum {
+        MAX_SIZE = 0x10000,
+    };
 
     std::shared_ptr<DbSession> session_;
+    std::unordered_map<aku_ParamId, std::string> names_;
+    std::vector<char> buffer_;
+
+    SeriesNameCache(std::shared_ptr<DbSession> con)
+        : session_(con)
+        , buffer_(AKU_LIMITS_MAX_SNAME)
+    {
+    }
+
+    //! Same as DbSession::param_id_to_series
+    int param_id_to_series(aku_ParamId id, char* buffer, size_t buffer_size) {
+        auto it = names_.find(id);
+        if (it == names_.end()) {
+            int len = session_->param_id_to_series(id, buffer_.data(), buffer_.size());
+            if (len <= 0) {
+                // Not found, not cached
+                return len;
+            }
+            if (names_.size() == MAX_SIZE) {
+                names_.clear();
+            }
+            it = names_.insert(std::make_pair(id, std::string(buffer_.data(), static_cast<size_t>(len)))).first;
+        }
+        auto const& name = it->second;
+        if (name.size() > buffer_size) {
+            return -1*static_cast<int>(name.size());
+        }
+        memcpy(buffer, name.data(), name.size());
+        return static_cast<int>(name.size());
+    }
+};
+
+struct CSVOutputFormatter : OutputFormatter {
+
+    SeriesNameCache names_;
     const bool iso_timestamps_;
 
     // TODO: parametrize column separator
 
     CSVOutputFormatter(std::shared_ptr<DbSession> con, bool iso_timestamps)
-        : session_(con)
+        : names_(con)
         , iso_timestamps_(iso_timestamps)
     {
     }
@@ -51,7 +156,7 @@ struct CSVOutputFormatter : OutputFormatter {
 
         if (sample.payload.type & aku_PData::PARAMID_BIT) {
             // Series name
-            len = session_->param_id_to_series(sample.paramid, begin, size);
+            len = names_.param_id_to_series(sample.paramid, begin, size);
             // '\0' character is counted in len
             if (len == 0) { // Error, no such Id
                 len = snprintf(begin, size, "id=%lu", sample.paramid);
@@ -120,7 +225,7 @@ struct CSVOutputFormatter : OutputFormatter {
                 size  -= 1;
             }
             // Floating-point
-            len = snprintf(begin, size, "%.17g", sample.payload.float64);
+            len = format_double(begin, size, "", sample.payload.float64, "");
             if (len == size || len < 0) {
                 return nullptr;
             }
@@ -139,20 +244,15 @@ struct CSVOutputFormatter : OutputFormatter {
                 begin += 1;
                 size  -= 1;
             }
-            union {
-                u64 u;
-                double d;
-            } bits;
-            bits.d = sample.payload.float64;
-            int nelements = bits.u >> 58;  // top 6 bits contains number of elements
-            double const* tuple = reinterpret_cast<double const*>(sample.payload.data);
+            TupleHeader header(sample);
+            double const* tuple = header.values;
             int tup_ix = 0;
-            for (int ix = 0; ix < nelements; ix++) {
-                if (bits.u & (1 << ix)) {
+            for (u32 ix = 0; ix < header.ncols; ix++) {
+                if (header.is_set(ix)) {
                     if (tup_ix == 0) {
-                        len = snprintf(begin, size, "%.17g", tuple[tup_ix]);
+                        len = format_double(begin, size, "", tuple[tup_ix], "");
                     } else {
-                        len = snprintf(begin, size, ",%.17g", tuple[tup_ix]);
+                        len = format_double(begin, size, ",", tuple[tup_ix], "");
                     }
                     tup_ix++;
                 } else {
@@ -201,16 +301,20 @@ struct CSVOutputFormatter : OutputFormatter {
 
         return begin;
     }
+
+    virtual std::string format_profile(std::string const& profile) {
+        return "#" + profile + "\n";
+    }
 };
 
 //! RESP output implementation
 struct RESPOutputFormatter : OutputFormatter {
 
-    std::shared_ptr<DbSession> session_;
+    SeriesNameCache names_;
     const bool iso_timestamps_;
 
     RESPOutputFormatter(std::shared_ptr<DbSession> con, bool iso_timestamps)
-        : session_(con)
+        : names_(con)
         , iso_timestamps_(iso_timestamps)
     {
     }
@@ -233,7 +337,7 @@ struct RESPOutputFormatter : OutputFormatter {
 
         if (sample.payload.type & aku_PData::PARAMID_BIT) {
             // Series name
-            len = session_->param_id_to_series(sample.paramid, begin, size);
+            len = names_.param_id_to_series(sample.paramid, begin, size);
             // '\0' character is counted in len
             if (len == 0) { // Error, no such Id
                 len = snprintf(begin, size, "id=%lu", sample.paramid);
@@ -300,7 +404,7 @@ struct RESPOutputFormatter : OutputFormatter {
 
         if (sample.payload.type & aku_PData::FLOAT_BIT) {
             // Floating-point
-            len = snprintf(begin, size, "+%.17g\r\n", sample.payload.float64);
+            len = format_double(begin, size, "+", sample.payload.float64, "\r\n");
             if (len == size || len < 0) {
                 return nullptr;
             }
@@ -309,15 +413,10 @@ struct RESPOutputFormatter : OutputFormatter {
         }
 
         if (sample.payload.type & aku_PData::TUPLE_BIT) {
-            union {
-                u64 u;
-                double d;
-            } bits;
-            bits.d = sample.payload.float64;
-            int nelements = bits.u >> 58;  // top 6 bits contains number of elements
+            TupleHeader header(sample);
 
             // Output RESP array, start with number of elements
-            len = snprintf(begin, size, "*%d\r\n", nelements);
+            len = snprintf(begin, size, "*%u\r\n", header.ncols);
             if (len == size || len < 0) {
                 return nullptr;
             }
@@ -325,11 +424,11 @@ struct RESPOutputFormatter : OutputFormatter {
             size  -= len;
 
             // Output array elements
-            double const* tuple = reinterpret_cast<double const*>(sample.payload.data);
+            double const* tuple = header.values;
             int tup_ix = 0;
-            for (int ix = 0; ix < nelements; ix++) {
-                if (bits.u & (1 << ix)) {
-                    len = snprintf(begin, size, "+%.17g\r\n", tuple[tup_ix++]);
+            for (u32 ix = 0; ix < header.ncols; ix++) {
+                if (header.is_set(ix)) {
+                    len = format_double(begin, size, "+", tuple[tup_ix++], "\r\n");
                 } else {
                     // Empty tuple value encountered. RESP uses bulk string with length equal to -1
                     // to represent Null values.
@@ -361,22 +460,264 @@ struct RESPOutputFormatter : OutputFormatter {
         }
         return begin;
     }
+
+    virtual std::string format_profile(std::string const& profile) {
+        return "+" + profile + "\r\n";
+    }
+};
+
+/** Binary columnar output.
+  * Values of the same series are batched into blocks, series names are sent
+  * once per query (before the first block of the series). All numbers use
+  * native byte order. Stream starts with the "AKUB" magic followed by records,
+  * every record starts with the record type:
+  * - 'S' series name: u64 id, u32 length, name;
+  * - 'F' float values: u64 id, u32 n, u64 timestamps[n], f64 values[n];
+  * - 'T' tuples: u64 id, u32 n, u32 ncols, u64 timestamps[n], f64 values[ncols][n]
+  *   (the values are stored column by column, missing values are NaN);
+  * - 'W' SAX word: u64 id, u64 timestamp, u32 length, word.
+  * Errors are reported the same way as in other formats ("-message\r\n").
+  */
+struct BinaryOutputFormatter : OutputFormatter {
+
+    enum {
+        //! Max size of the values in block, block should fit into the output buffer of the http server
+        MAX_BLOCK_SIZE = 0x4000,
+    };
+
+    std::shared_ptr<DbSession> session_;
+    bool header_sent_;
+    //! Ids of the series that were sent to the client
+    std::unordered_set<aku_ParamId> dict_;
+    std::vector<char> name_;
+
+    // Current block, `type_` is 0 if block is empty
+    char                       type_;
+    aku_ParamId                id_;
+    u32                        ncols_;
+    std::vector<aku_Timestamp> ts_;
+    //! Values (row by row)
+    std::vector<double>        xs_;
+    //! SAX word
+    std::vector<char>          word_;
+
+    BinaryOutputFormatter(std::shared_ptr<DbSession> con)
+        : session_(con)
+        , header_sent_(false)
+        , name_(AKU_LIMITS_MAX_SNAME)
+        , type_(0)
+        , id_(0)
+        , ncols_(0)
+    {
+    }
+
+    static char* put(char* begin, char* end, const void* data, size_t size) {
+        if (begin == nullptr || static_cast<size_t>(end - begin) < size) {
+            return nullptr;
+        }
+        memcpy(begin, data, size);
+        return begin + size;
+    }
+
+    template<class T>
+    static char* put(char* begin, char* end, T value) {
+        return put(begin, end, &value, sizeof(T));
+    }
+
+    char* put_series_name(char* begin, char* end, aku_ParamId id) {
+        if (dict_.count(id)) {
+            return begin;
+        }
+        std::string name;
+        int len = session_->param_id_to_series(id, name_.data(), name_.size());
+        if (len > 0) {
+            name.assign(name_.data(), static_cast<size_t>(len));
+        } else {
+            name = "id=" + std::to_string(id);
+        }
+        begin = put(begin, end, 'S');
+        begin = put<u64>(begin, end, id);
+        begin = put<u32>(begin, end, static_cast<u32>(name.size()));
+        return put(begin, end, name.data(), name.size());
+    }
+
+    //! Write current block, the state is not changed
+    char* put_block(char* begin, char* end) {
+        if (!header_sent_) {
+            begin = put(begin, end, "AKUB", 4);
+        }
+        if (type_ == 0) {
+            return begin;
+        }
+        begin = put_series_name(begin, end, id_);
+        switch (type_) {
+        case 'F':
+            begin = put(begin, end, type_);
+            begin = put<u64>(begin, end, id_);
+            begin = put<u32>(begin, end, static_cast<u32>(ts_.size()));
+            begin = put(begin, end, ts_.data(), ts_.size()*sizeof(aku_Timestamp));
+            begin = put(begin, end, xs_.data(), xs_.size()*sizeof(double));
+            break;
+        case 'T':
+            begin = put(begin, end, type_);
+            begin = put<u64>(begin, end, id_);
+            begin = put<u32>(begin, end, static_cast<u32>(ts_.size()));
+            begin = put<u32>(begin, end, ncols_);
+            begin = put(begin, end, ts_.data(), ts_.size()*sizeof(aku_Timestamp));
+            for (u32 col = 0; col < ncols_; col++) {
+                for (size_t row = 0; row < ts_.size(); row++) {
+                    begin = put<double>(begin, end, xs_[row*ncols_ + col]);
+                }
+            }
+            break;
+        case 'W':
+            begin = put(begin, end, type_);
+            begin = put<u64>(begin, end, id_);
+            begin = put<u64>(begin, end, ts_.front());
+            begin = put<u32>(begin, end, static_cast<u32>(word_.size()));
+            begin = put(begin, end, word_.data(), word_.size());
+            break;
+        default:
+            // Series name only
+            break;
+        }
+        return begin;
+    }
+
+    virtual char* flush(char* begin, char* end) {
+        begin = put_block(begin, end);
+        if (begin == nullptr) {
+            return nullptr;
+        }
+        header_sent_ = true;
+        if (type_ != 0) {
+            dict_.insert(id_);
+        }
+        type_ = 0;
+        ts_.clear();
+        xs_.clear();
+        word_.clear();
+        return begin;
+    }
+
+    virtual char* format(char* begin, char* end, const aku_Sample& sample) {
+        char type = 'S';
+        u32 ncols = 0;
+        TupleHeader header(sample);
+        if (sample.payload.type & aku_PData::TUPLE_BIT) {
+            type = 'T';
+            ncols = header.ncols;
+        } else if (sample.payload.type & aku_PData::FLOAT_BIT) {
+            type = 'F';
+        } else if (sample.payload.type & aku_PData::SAX_WORD) {
+            type = 'W';
+        }
+        bool batch = type == 'F' || type == 'T';
+        if (type_ != 0) {
+            size_t rowsize = sizeof(aku_Timestamp) + sizeof(double)*std::max(ncols, 1u);
+            if (!batch || type != type_ || sample.paramid != id_ || ncols != ncols_ ||
+                (ts_.size() + 1)*rowsize > MAX_BLOCK_SIZE)
+            {
+                begin = flush(begin, end);
+                if (begin == nullptr) {
+                    return nullptr;
+                }
+            }
+        }
+        // Sample is added to the block, the block is written later
+        type_  = type;
+        id_    = sample.paramid;
+        ncols_ = ncols;
+        ts_.push_back(sample.timestamp);
+        if (type == 'F') {
+            xs_.push_back(sample.payload.float64);
+        } else if (type == 'T') {
+            double const* tuple = header.values;
+            int tup_ix = 0;
+            for (u32 ix = 0; ix < ncols; ix++) {
+                if (header.is_set(ix)) {
+                    xs_.push_back(tuple[tup_ix++]);
+                } else {
+                    xs_.push_back(std::numeric_limits<double>::quiet_NaN());
+                }
+            }
+        } else if (type == 'W') {
+            size_t sample_size = std::max(sizeof(aku_Sample), (size_t)sample.payload.size);
+            word_.assign(sample.payload.data, sample.payload.data + (sample_size - sizeof(aku_Sample)));
+        }
+        return begin;
+    }
 };
 
+ChunkSizeController::ChunkSizeController()
+    : chunk_size_(MIN_CHUNK)
+    , last_size_(0)
+{
+}
+
+size_t ChunkSizeController::next() {
+    return next(std::chrono::steady_clock::now());
+}
+
+size_t ChunkSizeController::next(TimePoint now) {
+    if (last_size_ != 0) {
+        auto interval = now - last_time_;
+        auto usec = std::chrono::duration_cast<std::chrono::microseconds>(interval).count();
+        // Amount of data the client can drain in FLUSH_INTERVAL_US at the measured rate,
+        // the chunk size moves halfway towards it
+        double target = static_cast<double>(last_size_) * FLUSH_INTERVAL_US / std::max<double>(usec, 1.0);
+        target = std::min(std::max(target, static_cast<double>(MIN_CHUNK)), static_cast<double>(MAX_CHUNK));
+        chunk_size_ = (chunk_size_ + static_cast<size_t>(target)) / 2;
+        last_size_ = 0;
+    }
+    return chunk_size_;
+}
+
+void ChunkSizeController::produced(size_t nbytes) {
+    produced(nbytes, std::chrono::steady_clock::now());
+}
+
+void ChunkSizeController::produced(size_t nbytes, TimePoint now) {
+    // Time spent waiting for the query results is not a part of the drain time
+    if (nbytes != 0) {
+        last_size_ = nbytes;
+        last_time_ = now;
+    }
+}
+
+size_t ChunkSizeController::prefetch() const {
+    return chunk_size_ * PREFETCH_CHUNKS;
+}
+
 QueryResultsPooler::QueryResultsPooler(std::shared_ptr<DbSession> session, int readbufsize, ApiEndpoint endpoint)
     : session_(session)
     , rdbuf_pos_(0)
     , rdbuf_top_(0)
     , endpoint_(endpoint)
+    , format_ns_(0)
+    , trailer_pos_(0)
+    , trailer_ready_(false)
+    , prefetch_(0)
+    , nonblocking_(false)
 {
+    // Read buffer should fit the largest tuple, otherwise it can't be read from the cursor
+    size_t minsize = AKU_MAX_TUPLE_SIZE;
     try {
-        rdbuf_.resize(readbufsize);
+        rdbuf_.resize(std::max(static_cast<size_t>(readbufsize), minsize));
     } catch (const std::bad_alloc&) {
         // readbufsize is too large (bad config probably), use default value
-        rdbuf_.resize(DEFAULT_RDBUF_SIZE_);
+        rdbuf_.resize(std::max(DEFAULT_RDBUF_SIZE_, minsize));
     }
 }
 
+QueryResultsPooler::QueryResultsPooler(std::shared_ptr<DbSession> session, int readbufsize,
+                                       std::shared_ptr<DbPreparedQuery> prepared, std::string prepared_text)
+    : QueryResultsPooler(session, readbufsize, ApiEndpoint::EXECUTE)
+{
+    prepared_ = prepared;
+    prepared_text_ = prepared_text;
+}
+
 void QueryResultsPooler::throw_if_started() const {
     if (cursor_) {
         BOOST_THROW_EXCEPTION(std::runtime_error("allready started"));
@@ -391,18 +732,26 @@ void QueryResultsPooler::throw_if_not_started() const {
 
 void QueryResultsPooler::start() {
     throw_if_started();
-    enum Format { RESP, CSV };
+    enum Format { RESP, CSV, BINARY };
     bool use_iso_timestamps = true;
     Format output_format = RESP;
     boost::property_tree::ptree tree;
     try {
-        tree = from_json(query_text_);
+        // Output format of the prepared query can't be changed
+        tree = from_json(prepared_ ? prepared_text_ : query_text_);
     } catch (boost::property_tree::json_parser_error const& e) {
         logger.error() << "Bad JSON document received, error: " << e.what();
         // We need to pass invalid document further to generate proper error response
         _init_cursor();
         return;
     }
+    if (endpoint_ == ApiEndpoint::EXPLAIN) {
+        // Same as the regular query with `explain` flag
+        tree.put("explain", true);
+        std::stringstream text;
+        boost::property_tree::json_parser::write_json(text, tree, false);
+        query_text_ = text.str();
+    }
     auto output = tree.get_child_optional("output");
     if (output) {
         for (auto kv: *output) {
@@ -422,6 +771,8 @@ void QueryResultsPooler::start() {
                     output_format = RESP;
                 } else if (fmt == "csv" || fmt == "CSV") {
                     output_format = CSV;
+                } else if (fmt == "binary" || fmt == "BINARY") {
+                    output_format = BINARY;
                 } else {
                     std::runtime_error err("invalid output statement (format)");
                     BOOST_THROW_EXCEPTION(err);
@@ -436,14 +787,43 @@ void QueryResultsPooler::start() {
     case CSV:
         formatter_.reset(new CSVOutputFormatter(session_, use_iso_timestamps));
         break;
+    case BINARY:
+        formatter_.reset(new BinaryOutputFormatter(session_));
+        break;
     };
 
     _init_cursor();
 }
 
+/** Parse time range of the prepared query execution, format:
+  * { "range": { "from": "20170101T000000", "to": "20170102T000000" }, "resume": "token" }
+  * Optional `resume` field makes the execution incremental (empty string for the first poll).
+  */
+static std::tuple<aku_Timestamp, aku_Timestamp, boost::optional<std::string>> parse_range(std::string const& text) {
+    boost::property_tree::ptree tree;
+    try {
+        tree = from_json(text);
+    } catch (boost::property_tree::json_parser_error const& e) {
+        logger.error() << "Bad JSON document received, error: " << e.what();
+        BOOST_THROW_EXCEPTION(std::runtime_error("invalid range statement"));
+    }
+    aku_Timestamp range[2];
+    const char* keys[] = { "range.from", "range.to" };
+    for (int i = 0; i < 2; i++) {
+        auto value = tree.get_optional<std::string>(keys[i]);
+        aku_Sample sample;
+        if (!value || aku_parse_timestamp(value->c_str(), &sample) != AKU_SUCCESS) {
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid range statement"));
+        }
+        range[i] = sample.timestamp;
+    }
+    return std::make_tuple(range[0], range[1], tree.get_optional<std::string>("resume"));
+}
+
 void QueryResultsPooler::_init_cursor() {
     switch (endpoint_) {
     case ApiEndpoint::QUERY:
+    case ApiEndpoint::EXPLAIN:
         cursor_ = session_->query(query_text_);
         break;
     case ApiEndpoint::SUGGEST:
@@ -452,6 +832,20 @@ void QueryResultsPooler::_init_cursor() {
     case ApiEndpoint::SEARCH:
         cursor_ = session_->search(query_text_);
         break;
+    case ApiEndpoint::SUBSCRIBE:
+        cursor_ = session_->subscribe(query_text_);
+        break;
+    case ApiEndpoint::EXECUTE: {
+        aku_Timestamp begin, end;
+        boost::optional<std::string> resume_token;
+        std::tie(begin, end, resume_token) = parse_range(query_text_);
+        if (resume_token) {
+            cursor_ = session_->poll(prepared_, begin, end, *resume_token);
+        } else {
+            cursor_ = session_->execute(prepared_, begin, end);
+        }
+    }
+        break;
     default:
         BOOST_THROW_EXCEPTION(std::runtime_error("Init-cursor failure, invalid endpoint"));
     };
@@ -462,6 +856,29 @@ void QueryResultsPooler::append(const char *data, size_t data_size) {
     query_text_ += std::string(data, data + data_size);
 }
 
+void QueryResultsPooler::_init_trailer() {
+    trailer_ready_ = true;
+    std::string profile = cursor_->get_profile();
+    std::string resume_token = cursor_->get_resume_token();
+    std::string fields;
+    if (!profile.empty() && profile.back() == '}') {
+        // Profile is a JSON object, formatting time is added to it
+        profile.pop_back();
+        profile += ", \"format_ns\": " + std::to_string(format_ns_)
+                 + ", \"chunk_size\": " + std::to_string(chunk_.chunk_size_) + "}";
+        fields = "\"profile\": " + profile;
+    }
+    if (!resume_token.empty()) {
+        // Token is a base64url string, it doesn't have to be escaped
+        fields += fields.empty() ? "" : ", ";
+        fields += "\"resume\": \"" + resume_token + "\"";
+    }
+    if (!formatter_ || fields.empty()) {
+        return;
+    }
+    trailer_ = formatter_->format_profile("{" + fields + "}");
+}
+
 aku_Status QueryResultsPooler::get_error() {
     aku_Status err = AKU_SUCCESS;
     if (cursor_->is_error(&err)) {
@@ -473,8 +890,21 @@ aku_Status QueryResultsPooler::get_error() {
 std::tuple<size_t, bool> QueryResultsPooler::read_some(char *buf, size_t buf_size) {
     aku_Status status = AKU_SUCCESS;
     throw_if_not_started();
+    size_t chunk_size = std::min(chunk_.next(), buf_size);
+    if (chunk_.prefetch() != prefetch_) {
+        // Slow clients shouldn't hold many results in memory
+        prefetch_ = chunk_.prefetch();
+        cursor_->set_prefetch(prefetch_);
+    }
     if (rdbuf_pos_ == rdbuf_top_) {
         if (cursor_->is_done()) {
+            if (formatter_) {
+                // Write buffered output before the end of the stream
+                char* next = formatter_->flush(buf, buf + buf_size);
+                if (next != nullptr && next != buf) {
+                    return std::make_tuple(static_cast<size_t>(next - buf), false);
+                }
+            }
             // This can be the case if error occured
             if (cursor_->is_error(&status)) {
                 // Some error occured, put error message to the outgoing buffer and return
@@ -482,11 +912,25 @@ std::tuple<size_t, bool> QueryResultsPooler::read_some(char *buf, size_t buf_siz
                 if (len > 0) {
                     return std::make_tuple((size_t)len, true);
                 }
+                return std::make_tuple(0u, true);
+            }
+            // Query profile is sent after the results (can take several calls)
+            if (!trailer_ready_) {
+                _init_trailer();
+            }
+            if (trailer_pos_ < trailer_.size()) {
+                size_t len = std::min(buf_size, trailer_.size() - trailer_pos_);
+                memcpy(buf, trailer_.data() + trailer_pos_, len);
+                trailer_pos_ += len;
+                return std::make_tuple(len, false);
             }
             return std::make_tuple(0u, true);
         }
-        // read new data from DB
-        rdbuf_top_ = cursor_->read(rdbuf_.data(), rdbuf_.size());
+        // read new data from DB, cursor returns when the buffer is full so small
+        // chunks are read faster
+        size_t rdsize = std::min(rdbuf_.size(), std::max(chunk_size, static_cast<size_t>(AKU_MAX_TUPLE_SIZE)));
+        rdbuf_top_ = nonblocking_ ? cursor_->read_nowait(rdbuf_.data(), rdsize)
+                                  : cursor_->read(rdbuf_.data(), rdsize);
         rdbuf_pos_ = 0u;
         if (cursor_->is_error(&status)) {
             // Some error occured, put error message to the outgoing buffer and return
@@ -500,11 +944,17 @@ std::tuple<size_t, bool> QueryResultsPooler::read_some(char *buf, size_t buf_siz
 
     // format output
     char* begin = buf;
-    char* end = begin + buf_size;
+    char* end = begin + chunk_size;
+    auto format_start = std::chrono::steady_clock::now();
     while(rdbuf_pos_ < rdbuf_top_) {
         const aku_Sample* sample = reinterpret_cast<const aku_Sample*>(rdbuf_.data() + rdbuf_pos_);
         char* next = formatter_->format(begin, end, *sample);
         if (next == nullptr) {
+            if (begin == buf && end != buf + buf_size) {
+                // Sample doesn't fit the chunk, the whole buffer can be used
+                end = buf + buf_size;
+                continue;
+            }
             // done
             break;
         }
@@ -512,9 +962,23 @@ std::tuple<size_t, bool> QueryResultsPooler::read_some(char *buf, size_t buf_siz
         assert(sample->payload.size);
         rdbuf_pos_ += sample->payload.size;
     }
+    if (formatter_ && rdbuf_pos_ == rdbuf_top_ && endpoint_ == ApiEndpoint::SUBSCRIBE) {
+        // Results of the continuous query shouldn't wait for the next bucket
+        char* next = formatter_->flush(begin, end);
+        if (next != nullptr) {
+            begin = next;
+        }
+    }
+    auto format_time = std::chrono::steady_clock::now() - format_start;
+    format_ns_ += static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(format_time).count());
+    chunk_.produced(static_cast<size_t>(begin - buf));
     return std::make_tuple(begin - buf, false);
 }
 
+void QueryResultsPooler::set_nonblocking(bool nonblocking) {
+    nonblocking_ = nonblocking;
+}
+
 void QueryResultsPooler::close() {
     throw_if_not_started();
     cursor_->close();
@@ -523,6 +987,7 @@ void QueryResultsPooler::close() {
 QueryProcessor::QueryProcessor(std::weak_ptr<DbConnection> con, int rdbuf)
     : con_(con)
     , rdbufsize_(rdbuf)
+    , next_prepared_id_(1)
 {
     logger.info() << "QueryProcessor created";
 }
@@ -540,6 +1005,19 @@ ReadOperation *QueryProcessor::create(ApiEndpoint endpoint) {
     BOOST_THROW_EXCEPTION(err);
 }
 
+ReadOperation *QueryProcessor::create_tenant(ApiEndpoint endpoint, std::string tenant) {
+    auto con = con_.lock();
+    if (con) {
+        auto session = con->create_tenant_session(tenant);
+        if (!session) {
+            return nullptr;
+        }
+        return new QueryResultsPooler(session, rdbufsize_, endpoint);
+    }
+    std::runtime_error err("Database connection was closed");
+    BOOST_THROW_EXCEPTION(err);
+}
+
 std::string QueryProcessor::get_all_stats() {
     auto con = con_.lock();
     if (con) {
@@ -549,6 +1027,54 @@ std::string QueryProcessor::get_all_stats() {
     BOOST_THROW_EXCEPTION(err);
 }
 
+std::string QueryProcessor::get_metrics() {
+    auto con = con_.lock();
+    if (con) {
+        return con->get_metrics();
+    }
+    std::runtime_error err("Database connection was closed");
+    BOOST_THROW_EXCEPTION(err);
+}
+
+std::tuple<aku_Status, u64> QueryProcessor::prepare(std::string query) {
+    auto con = con_.lock();
+    if (!con) {
+        std::runtime_error err("Database connection was closed");
+        BOOST_THROW_EXCEPTION(err);
+    }
+    aku_Status status = AKU_SUCCESS;
+    auto prepared = con->create_session()->prepare(query, &status);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, u64());
+    }
+    std::lock_guard<std::mutex> guard(prepared_lock_);
+    if (prepared_.size() >= MAX_PREPARED) {
+        prepared_.erase(prepared_.begin());
+    }
+    u64 id = next_prepared_id_++;
+    prepared_[id] = { prepared, query };
+    logger.info() << "Query " << id << " prepared";
+    return std::make_tuple(AKU_SUCCESS, id);
+}
+
+ReadOperation* QueryProcessor::create_execute(u64 id) {
+    Prepared prepared;
+    {
+        std::lock_guard<std::mutex> guard(prepared_lock_);
+        auto it = prepared_.find(id);
+        if (it == prepared_.end()) {
+            return nullptr;
+        }
+        prepared = it->second;
+    }
+    auto con = con_.lock();
+    if (con) {
+        return new QueryResultsPooler(con->create_session(), rdbufsize_, prepared.query, prepared.text);
+    }
+    std::runtime_error err("Database connection was closed");
+    BOOST_THROW_EXCEPTION(err);
+}
+
 std::string QueryProcessor::get_resource(std::string name) {
     size_t outbufsize = 0x1000;
     char outbuf[outbufsize];
@@ -2,7 +2,10 @@
 #include "httpserver.h"
 #include "ingestion_pipeline.h"
 #include "server.h"
+#include <chrono>
 #include <memory>
+#include <map>
+#include <mutex>
 
 namespace Akumuli {
 
@@ -10,6 +13,57 @@ namespace Akumuli {
 struct OutputFormatter {
     virtual ~OutputFormatter() = default;
     virtual char* format(char* begin, char* end, const aku_Sample& sample) = 0;
+
+    /** Write buffered output (if any).
+      * @return pointer to the end of the written data or nullptr if there is not enough space in the buffer
+      */
+    virtual char* flush(char* begin, char* end) { return begin; }
+
+    //! Format query profile (JSON) that is sent after the results, empty string if not supported
+    virtual std::string format_profile(std::string const& profile) { return std::string(); }
+};
+
+
+/** Output chunk size controller.
+  * Chunk size follows the drain rate of the client (measured between the calls of
+  * `read_some`): fast local consumers get large chunks (fewer calls and cursor reads),
+  * interactive clients get small chunks that are flushed sooner. The first chunk is
+  * small to reduce the time to first byte.
+  */
+struct ChunkSizeController {
+    enum {
+        MIN_CHUNK = 0x1000,
+        MAX_CHUNK = 0x100000,
+        //! Chunk should be drained by the client in this time (in microseconds)
+        FLUSH_INTERVAL_US = 10000,
+        //! Results computed ahead of the reader (in chunks)
+        PREFETCH_CHUNKS = 4,
+    };
+
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    size_t chunk_size_;
+    //! Size of the last chunk
+    size_t last_size_;
+    //! Time when the last chunk was produced
+    TimePoint last_time_;
+
+    ChunkSizeController();
+
+    //! Size of the next chunk (updated using the drain rate of the previous one)
+    size_t next();
+
+    //! Same as `next()` but the current time is passed by the caller
+    size_t next(TimePoint now);
+
+    //! Chunk of size `nbytes` was produced (empty chunks are not measured)
+    void produced(size_t nbytes);
+
+    //! Same as `produced(nbytes)` but the current time is passed by the caller
+    void produced(size_t nbytes, TimePoint now);
+
+    //! Max size of the results computed ahead of the reader
+    size_t prefetch() const;
 };
 
 
@@ -26,11 +80,35 @@ struct QueryResultsPooler : ReadOperation {
     static const size_t DEFAULT_RDBUF_SIZE_ = 1000u;
     static const size_t DEFAULT_ITEM_SIZE_  = sizeof(aku_Sample);
     ApiEndpoint                      endpoint_;
+    //! Prepared query and its text (only for EXECUTE endpoint)
+    std::shared_ptr<DbPreparedQuery> prepared_;
+    std::string                      prepared_text_;
+    //! Time spent in the output formatter
+    u64                              format_ns_;
+    //! Formatted query profile that is sent after the results
+    std::string                      trailer_;
+    size_t                           trailer_pos_;
+    bool                             trailer_ready_;
+    //! Output chunk size
+    ChunkSizeController              chunk_;
+    //! Prefetch limit of the cursor (updated when the chunk size changes)
+    size_t                           prefetch_;
+    //! Don't wait for the cursor in `read_some`
+    bool                             nonblocking_;
 
     QueryResultsPooler(std::shared_ptr<DbSession> session, int readbufsize, ApiEndpoint endpoint);
 
+    /** Create read operation that executes prepared query.
+      * Request body should contain the time range, output format is defined by the prepared query.
+      */
+    QueryResultsPooler(std::shared_ptr<DbSession> session, int readbufsize,
+                       std::shared_ptr<DbPreparedQuery> prepared, std::string prepared_text);
+
     void _init_cursor();
 
+    //! Create trailer from the profile of the query (if any)
+    void _init_trailer();
+
     void throw_if_started() const;
 
     void throw_if_not_started() const;
@@ -43,20 +121,39 @@ struct QueryResultsPooler : ReadOperation {
 
     virtual std::tuple<size_t, bool> read_some(char* buf, size_t buf_size);
 
+    virtual void set_nonblocking(bool nonblocking);
+
     virtual void close();
 };
 
 struct QueryProcessor : ReadOperationBuilder {
+    //! Max number of prepared queries (oldest query is removed when the limit is reached)
+    enum { MAX_PREPARED = 1024 };
+
+    struct Prepared {
+        std::shared_ptr<DbPreparedQuery> query;
+        std::string                      text;
+    };
+
     std::weak_ptr<DbConnection> con_;
     int                         rdbufsize_;
+    //! Prepared queries by id (ids are increasing)
+    std::map<u64, Prepared>     prepared_;
+    u64                         next_prepared_id_;
+    std::mutex                  prepared_lock_;
 
     QueryProcessor(std::weak_ptr<DbConnection> con, int rdbuf);
     ~QueryProcessor() override;
 
     virtual ReadOperation* create(ApiEndpoint endpoint);
+    virtual ReadOperation* create_tenant(ApiEndpoint endpoint, std::string tenant);
 
     virtual std::string get_all_stats();
+    virtual std::string get_metrics();
     virtual std::string get_resource(std::string name);
+
+    virtual std::tuple<aku_Status, u64> prepare(std::string query);
+    virtual ReadOperation* create_execute(u64 id);
 };
 
 }  // namespace
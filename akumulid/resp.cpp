@@ -1,6 +1,7 @@
 #include "resp.h"
 #include <boost/exception/all.hpp>
 #include <cassert>
+#include <cstring>
 
 namespace Akumuli {
 
@@ -9,15 +10,59 @@ RESPError::RESPError(std::string msg, size_t pos)
 {
 }
 
+// Mantissa and power of ten are exact so the result of the division is correctly
+// rounded (the same as strtod).
+bool parse_decimal(const Byte* begin, const Byte* end, double* result) {
+    static const double POW10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const u64 MAX_MANTISSA = 1ull << 53;
+    const int MAX_DIGITS = 19;  // u64 can't overflow
+    auto it = begin;
+    bool negative = false;
+    if (it != end && (*it == '-' || *it == '+')) {
+        negative = *it == '-';
+        it++;
+    }
+    u64 mantissa = 0;
+    int ndigits = 0;
+    int nfrac = 0;
+    bool dot = false;
+    for (; it != end; it++) {
+        u32 digit = static_cast<u32>(static_cast<unsigned char>(*it)) - '0';
+        if (digit < 10) {
+            mantissa = mantissa*10 + digit;
+            ndigits++;
+            nfrac += dot;
+        } else if (*it == '.' && !dot) {
+            dot = true;
+        } else {
+            return false;
+        }
+    }
+    if (ndigits == 0 || ndigits > MAX_DIGITS || mantissa > MAX_MANTISSA || nfrac > 22) {
+        return false;
+    }
+    auto value = static_cast<double>(mantissa) / POW10[nfrac];
+    *result = negative ? -value : value;
+    return true;
+}
+
 RESPStream::RESPStream(ByteStreamReader *stream) {
     stream_ = stream;
 }
 
 RESPStream::Type RESPStream::next_type() const {
-    if (stream_->is_eof()) {
+    const Byte* chunk;
+    Byte ch;
+    if (stream_->get_chunk(&chunk) != 0) {
+        ch = *chunk;
+    } else if (stream_->is_eof()) {
         return _AGAIN;
+    } else {
+        ch = stream_->pick();
     }
-    auto ch = stream_->pick();
     Type result = _BAD;
     switch(ch) {
     case '+':
@@ -42,10 +87,53 @@ RESPStream::Type RESPStream::next_type() const {
     return result;
 }
 
+static void throw_resp_error(ByteStreamReader* stream, const char* error) {
+    auto ctx = stream->get_error_context(error);
+    BOOST_THROW_EXCEPTION(RESPError(std::get<0>(ctx), std::get<1>(ctx)));
+}
+
+static const int MAX_DIGITS = 84 + 2;  // Maximum number of decimal digits in u64 + \r\n
+
+bool RESPStream::_read_int_fast(const Byte* chunk, size_t size, size_t prefix, u64* result) {
+    auto limit = std::min(size - prefix, static_cast<size_t>(MAX_DIGITS));
+    auto begin = chunk + prefix;
+    auto eol = static_cast<const Byte*>(memchr(begin, '\n', limit));
+    if (eol == nullptr) {
+        if (limit == MAX_DIGITS) {
+            // Invalid input, too many digits in the number
+            throw_resp_error(stream_, "integer is too long");
+        }
+        // Line can continue in the next chunk
+        return false;
+    }
+    auto end = eol;
+    if (end != begin && end[-1] == '\r') {
+        end--;
+    }
+    u64 value = 0;
+    for (auto it = begin; it != end; it++) {
+        u32 digit = static_cast<u32>(static_cast<unsigned char>(*it)) - '0';
+        if (digit > 9) {
+            if (*it == '\r') {
+                throw_resp_error(stream_, "invalid symbol inside stream - '\\r'");
+            }
+            throw_resp_error(stream_, "can't parse integer (character value out of range)");
+        }
+        value = value*10 + digit;
+    }
+    stream_->skip(static_cast<size_t>(eol - chunk) + 1);
+    *result = value;
+    return true;
+}
+
 std::tuple<bool, u64> RESPStream::_read_int_body() {
-    const int MAX_DIGITS = 84 + 2;  // Maximum number of decimal digits in u64 + \r\n
-    Byte buf[MAX_DIGITS];
+    const Byte* chunk;
     u64 result = 0;
+    auto size = stream_->get_chunk(&chunk);
+    if (size != 0 && _read_int_fast(chunk, size, 0, &result)) {
+        return std::make_tuple(true, result);
+    }
+    Byte buf[MAX_DIGITS];
     int res = stream_->read_line(buf, MAX_DIGITS);
     if (res <= 0) {
         if (res == -1*MAX_DIGITS) {
@@ -82,6 +170,12 @@ std::tuple<bool, u64> RESPStream::_read_int_body() {
 }
 
 std::tuple<bool, u64> RESPStream::read_int() {
+    const Byte* chunk;
+    u64 result;
+    auto size = stream_->get_chunk(&chunk);
+    if (size != 0 && *chunk == ':' && _read_int_fast(chunk, size, 1, &result)) {
+        return std::make_tuple(true, result);
+    }
     if (stream_->is_eof()) {
         return std::make_tuple(false, 0ull);
     }
@@ -93,8 +187,39 @@ std::tuple<bool, u64> RESPStream::read_int() {
     return _read_int_body();
 }
 
+bool RESPStream::_read_string_fast(const Byte* chunk, size_t size, size_t prefix,
+                                   Byte* buffer, size_t quota, int* result)
+{
+    auto limit = std::min(size - prefix, quota);
+    auto begin = chunk + prefix;
+    auto eol = static_cast<const Byte*>(memchr(begin, '\n', limit));
+    if (eol == nullptr) {
+        if (limit == quota) {
+            // Max string length reached, invalid input.
+            throw_resp_error(stream_, "out of quota");
+        }
+        // Line can continue in the next chunk
+        return false;
+    }
+    auto end = eol;
+    if (end != begin && end[-1] == '\r') {
+        end--;
+    }
+    auto len = static_cast<size_t>(end - begin);
+    memcpy(buffer, begin, len);
+    stream_->skip(static_cast<size_t>(eol - chunk) + 1);
+    *result = static_cast<int>(len);
+    return true;
+}
+
 std::tuple<bool, int> RESPStream::_read_string_body(Byte *buffer, size_t byte_buffer_size) {
     auto quota = std::min(byte_buffer_size, static_cast<size_t>(RESPStream::STRING_LENGTH_MAX));
+    const Byte* chunk;
+    auto size = stream_->get_chunk(&chunk);
+    int len;
+    if (size != 0 && _read_string_fast(chunk, size, 0, buffer, quota, &len)) {
+        return std::make_tuple(true, len);
+    }
     auto res = stream_->read_line(buffer, quota);
     if (res > 0) {
         // Success
@@ -115,6 +240,15 @@ std::tuple<bool, int> RESPStream::_read_string_body(Byte *buffer, size_t byte_bu
 }
 
 std::tuple<bool, int> RESPStream::read_string(Byte *buffer, size_t byte_buffer_size) {
+    const Byte* chunk;
+    auto size = stream_->get_chunk(&chunk);
+    if (size != 0 && *chunk == '+') {
+        auto quota = std::min(byte_buffer_size, static_cast<size_t>(RESPStream::STRING_LENGTH_MAX));
+        int len;
+        if (_read_string_fast(chunk, size, 1, buffer, quota, &len)) {
+            return std::make_tuple(true, len);
+        }
+    }
     if (stream_->is_eof()) {
         return std::make_tuple(false, 0ull);
     }
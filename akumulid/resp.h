@@ -25,6 +25,12 @@ struct RESPError : StreamError {
     RESPError(std::string msg, size_t pos);
 };
 
+/** Parse plain decimal number ("-12.345") without exponent.
+  * Return false if the number can't be parsed this way, strtod should be
+  * used in this case.
+  */
+bool parse_decimal(const Byte* begin, const Byte* end, double* result);
+
 /**
   * REdis Serialization Protocol implementation.
   */
@@ -69,6 +75,12 @@ struct RESPStream {
       */
     std::tuple<bool, u64> _read_int_body();
 
+    /** Read integer directly from the stream chunk (no per-byte calls).
+      * @param prefix number of bytes to skip before the integer (element type)
+      * @return false if the chunk doesn't contain the whole line (slow path should be used)
+      */
+    bool _read_int_fast(const Byte* chunk, size_t size, size_t prefix, u64* result);
+
     /** Read string element.
       * Result is undefined unless next element in a stream is a string.
       * @param buffer user suplied buffer
@@ -80,6 +92,10 @@ struct RESPStream {
     /** Read string implementation */
     std::tuple<bool, int> _read_string_body(Byte* buffer, size_t buffer_size);
 
+    //! Read string directly from the stream chunk, return false if slow path should be used
+    bool _read_string_fast(const Byte* chunk, size_t size, size_t prefix,
+                           Byte* buffer, size_t quota, int* result);
+
     /** Read bulk string element.
       * Result is undefined unless next element in a stream is a bulk string.
       * @param buffer user suplied buffer
@@ -19,6 +19,8 @@ struct ServerSettings {
     std::string                   name;
     std::vector<ProtocolSettings> protocols;
     int                           nworkers;
+    //! Server specific parameters
+    std::map<std::string, std::string> options;
 };
 
 
@@ -50,6 +52,11 @@ struct ReadOperation {
       */
     virtual std::tuple<size_t, bool> read_some(char* buf, size_t buf_size) = 0;
 
+    /** Don't wait for the query results in `read_some`, return (0, false) if
+      * nothing is ready instead. Should be used by the callers that can't block.
+      */
+    virtual void set_nonblocking(bool nonblocking) {}
+
     /** Close cursor.
       * Should be called after read operation was completed or interrupted.
       */
@@ -63,6 +70,11 @@ enum class ApiEndpoint {
     QUERY,
     SUGGEST,
     SEARCH,
+    SUBSCRIBE,
+    //! Execute prepared query (request body contains time range)
+    EXECUTE,
+    //! Return query plan and size estimates instead of the query results
+    EXPLAIN,
     UNKNOWN,
 };
 
@@ -70,8 +82,20 @@ enum class ApiEndpoint {
 struct ReadOperationBuilder {
     virtual ~ReadOperationBuilder()                        = default;
     virtual ReadOperation* create(ApiEndpoint ep)          = 0;
+
+    //! Create read operation of the tenant namespace (returns nullptr if the tenant can't be opened)
+    virtual ReadOperation* create_tenant(ApiEndpoint ep, std::string tenant) = 0;
     virtual std::string    get_all_stats()                 = 0;
+    virtual std::string    get_metrics()                   = 0;
     virtual std::string    get_resource(std::string name)  = 0;
+
+    /** Prepare query for repeated execution.
+      * @return status and id of the prepared query
+      */
+    virtual std::tuple<aku_Status, u64> prepare(std::string query) = 0;
+
+    //! Create read operation that executes prepared query (returns nullptr if `id` is unknown)
+    virtual ReadOperation* create_execute(u64 id)          = 0;
 };
 
 //! Server interface
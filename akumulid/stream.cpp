@@ -28,6 +28,17 @@ std::string StreamError::get_bottom_line() const {
 
 ByteStreamReader::~ByteStreamReader() {}
 
+size_t ByteStreamReader::get_chunk(const Byte** data) const {
+    *data = nullptr;
+    return 0;
+}
+
+void ByteStreamReader::skip(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        get();
+    }
+}
+
 // MemStreamReader implementation
 
 MemStreamReader::MemStreamReader(const Byte *buffer, size_t buffer_len)
@@ -67,20 +78,29 @@ int MemStreamReader::read(Byte *buffer, size_t buffer_len) {
 int MemStreamReader::read_line(Byte* buffer, size_t quota) {
     auto available = size_ - pos_;
     auto to_read = std::min(quota, available);
-    for (u32 i = 0; i < to_read; i++) {
-        Byte c = buf_[pos_ + i];
-        buffer[i] = c;
-        if (c == '\n') {
-            // Stop iteration
-            u32 bytes_copied = i + 1;
-            pos_ += bytes_copied;
-            return static_cast<int>(bytes_copied);
-        }
+    auto begin = buf_ + pos_;
+    auto eol = static_cast<const Byte*>(memchr(begin, '\n', to_read));
+    if (eol != nullptr) {
+        auto bytes_copied = static_cast<size_t>(eol - begin) + 1;
+        memcpy(buffer, begin, bytes_copied);
+        pos_ += bytes_copied;
+        return static_cast<int>(bytes_copied);
     }
     // No end of line found
+    memcpy(buffer, begin, to_read);
     return -1*static_cast<int>(to_read);
 }
 
+size_t MemStreamReader::get_chunk(const Byte** data) const {
+    *data = buf_ + pos_;
+    return size_ - pos_;
+}
+
+void MemStreamReader::skip(size_t n) {
+    assert(pos_ + n <= size_);
+    pos_ += n;
+}
+
 void MemStreamReader::close() {
     pos_ = size_;
 }
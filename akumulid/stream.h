@@ -79,6 +79,18 @@ struct ByteStreamReader {
       */
     virtual int read_line(Byte* buffer, size_t quota) = 0;
 
+    /** Get direct access to the unread part of the stream.
+      * Set `data` to the next byte of the stream and return number of bytes that
+      * can be read through the pointer. Stream can consist of several chunks, in this
+      * case only the current chunk is returned. Zero is returned if the stream doesn't
+      * support direct access (default). Pointer is valid until the stream is modified.
+      */
+    virtual size_t get_chunk(const Byte** data) const;
+
+    /** Skip `n` bytes, `n` shouldn't exceed the size returned by `get_chunk`.
+      */
+    virtual void skip(size_t n);
+
     /** Close stream.
      **/
     virtual void close() = 0;
@@ -120,6 +132,8 @@ public:
     virtual void consume();
     virtual void discard();
     virtual int read_line(Byte* buffer, size_t quota) override;
+    virtual size_t get_chunk(const Byte** data) const override;
+    virtual void skip(size_t n) override;
 };
 
 }  // namespace
@@ -1,17 +1,86 @@
 #include "tcp_server.h"
+#include "uring_server.h"
 #include "utility.h"
 #include <thread>
 #include <atomic>
 #include <boost/function.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/exception/diagnostic_information.hpp>
+#ifdef AKU_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 namespace Akumuli {
 
 
+//                     //
+//     Token Bucket    //
+//                     //
+
+TokenBucket::TokenBucket(u64 rate)
+    : rate_(static_cast<double>(rate))
+    , burst_(static_cast<double>(rate))
+    , tokens_(static_cast<double>(rate))
+    , last_(ClockT::now())
+{
+}
+
+u64 TokenBucket::take(u64 n) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = ClockT::now();
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed*rate_);
+    tokens_ -= static_cast<double>(n);
+    if (tokens_ >= 0) {
+        return 0;
+    }
+    return static_cast<u64>(-tokens_*1000000.0/rate_);
+}
+
+IngestLimits::IngestLimits()
+    : connection_rate(0)
+{
+}
+
+IngestLimits::IngestLimits(u64 rate, u64 connection_rate)
+    : connection_rate(connection_rate)
+    , counters(std::make_shared<Counters>())
+{
+    if (rate != 0) {
+        global = std::make_shared<TokenBucket>(rate);
+    }
+    counters->samples = 0;
+    counters->throttled = 0;
+    counters->paused_us = 0;
+}
+
+bool IngestLimits::enabled() const {
+    return connection_rate != 0 || global;
+}
+
+
 //                       //
 //     Telnet Session    //
 //                       //
 
+/** Handshake prefix of the compressed connection. Client sends it as the first
+  * bytes of the connection and the rest of the stream is a zstd stream. It starts
+  * with zero byte so it can't be mistaken for the beginning of the text protocol.
+  */
+static const char COMPRESSION_MAGIC[] = "\0AKZ";
+static const u32 COMPRESSION_MAGIC_SIZE = 4;
+
+//! Server timestamps are supported only by the RESP parser
+template<class ParserT>
+static void enable_server_timestamps(ParserT&) {
+}
+
+static void enable_server_timestamps(RESPProtocolParser& parser) {
+    // Every chunk read from the socket is stamped once
+    parser.set_server_timestamps(RESPProtocolParser::ServerTimestamps::PER_CHUNK);
+}
+
 std::string make_unique_session_name() {
     static std::atomic<int> counter = {0};
     std::stringstream str;
@@ -28,6 +97,11 @@ class TelnetSession : public ProtocolSession, public std::enable_shared_from_thi
     enum {
         BUFFER_SIZE = ProtocolT::RDBUF_SIZE,  //< Buffer size
     };
+    enum class Compression {
+        UNKNOWN,  //< Handshake is not received yet
+        NONE,
+        ZSTD,
+    };
     const bool                      parallel_;
     IOServiceT*                     io_;
     SocketT                         socket_;
@@ -35,11 +109,27 @@ class TelnetSession : public ProtocolSession, public std::enable_shared_from_thi
     std::shared_ptr<DbSession>      spout_;
     ProtocolT                       parser_;
     Logger                          logger_;
+    Compression                     compression_;
+    u32                             magic_pos_;  //< Number of handshake bytes received
+    IngestLimits                    limits_;
+    //! Per-connection limit (nullptr - unlimited)
+    std::unique_ptr<TokenBucket>    bucket_;
+    //! Used to resume reads when the session is throttled
+    TimerT                          timer_;
+    //! Number of samples already counted by the limiters
+    u64                             nsamples_;
+    u64                             nthrottled_;
+#ifdef AKU_WITH_ZSTD
+    ZSTD_DStream*                   zstd_;
+    //! Compressed data (decompressed directly into the parser's buffers)
+    std::vector<Byte>               input_;
+#endif
 
 public:
     typedef Byte* BufferT;
 
-    TelnetSession(IOServiceT *io, std::shared_ptr<DbSession> spout, bool parallel)
+    TelnetSession(IOServiceT *io, std::shared_ptr<DbSession> spout, bool parallel, IngestLimits limits,
+                  bool server_timestamps)
         : parallel_(parallel)
         , io_(io)
         , socket_(*io)
@@ -47,12 +137,35 @@ public:
         , spout_(spout)
         , parser_(spout)
     , logger_(make_unique_session_name())
+    , compression_(Compression::UNKNOWN)
+    , magic_pos_(0)
+    , limits_(limits)
+    , timer_(*io)
+    , nsamples_(0)
+    , nthrottled_(0)
+#ifdef AKU_WITH_ZSTD
+    , zstd_(nullptr)
+#endif
     {
         logger_.info() << "Session created";
+        if (limits_.connection_rate) {
+            bucket_.reset(new TokenBucket(limits_.connection_rate));
+        }
+        if (server_timestamps) {
+            enable_server_timestamps(parser_);
+        }
         parser_.start();
     }
 
     ~TelnetSession() {
+#ifdef AKU_WITH_ZSTD
+        if (zstd_) {
+            ZSTD_freeDStream(zstd_);
+        }
+#endif
+        if (nthrottled_) {
+            logger_.info() << "Session was throttled " << nthrottled_ << " times";
+        }
         logger_.info() << "Session destroyed";
     }
 
@@ -108,13 +221,134 @@ public:
     }
 
 private:
-    /** Allocate new buffer.
+    /** Take tokens for the samples written since the last call and continue reading.
+      * If the limits are exceeded the next read starts after the debt is repaid, the
+      * socket is not read meanwhile so the client is blocked by the TCP flow control.
+      */
+    void read_next() {
+        if (!limits_.enabled()) {
+            start();
+            return;
+        }
+        u64 total = parser_.get_nsamples();
+        u64 n = total - nsamples_;
+        nsamples_ = total;
+        u64 delay = 0;
+        if (bucket_) {
+            delay = bucket_->take(n);
+        }
+        if (limits_.global) {
+            delay = std::max(delay, limits_.global->take(n));
+        }
+        limits_.counters->samples += n;
+        if (delay == 0) {
+            start();
+            return;
+        }
+        nthrottled_++;
+        limits_.counters->throttled++;
+        limits_.counters->paused_us += delay;
+        timer_.expires_from_now(std::chrono::microseconds(delay));
+        auto self = this->shared_from_this();
+        auto resume = [self](boost::system::error_code error) {
+            if (!error) {
+                self->start();
+            }
+        };
+        if (parallel_) {
+            timer_.async_wait(strand_.wrap(resume));
+        } else {
+            timer_.async_wait(resume);
+        }
+    }
+
+    /** Allocate new buffer. Compressed stream is read into the session's own
+      * buffer, otherwise data is read directly into the parser's buffer.
       */
     std::tuple<BufferT, size_t> get_next_buffer() {
+#ifdef AKU_WITH_ZSTD
+        if (compression_ == Compression::ZSTD) {
+            return std::make_tuple(input_.data(), input_.size());
+        }
+#endif
         Byte *buffer = parser_.get_next_buffer();
         return std::make_tuple(buffer, BUFFER_SIZE);
     }
 
+    //! Pass data to the parser and send the response back if needed
+    void parse(BufferT buffer, u32 nbytes) {
+        auto response = parser_.parse_next(buffer, nbytes);
+        if(response.is_available()) {
+            // Buffer should outlive the write operation
+            auto body = std::make_shared<std::string>(response.get_body());
+            auto self = this->shared_from_this();
+            boost::asio::async_write(socket_, boost::asio::buffer(*body),
+                                     [self, body](boost::system::error_code error, size_t) {
+                                         self->handle_write(error);
+                                     });
+        }
+    }
+
+    /** Check the beginning of the connection for the compression handshake
+      * and pass the data to the parser.
+      * @param buffer is a parser's buffer that contains the data
+      * @param nbytes is a number of bytes in the buffer
+      */
+    void detect_compression(BufferT buffer, size_t nbytes) {
+        auto size = std::min(static_cast<u32>(nbytes), COMPRESSION_MAGIC_SIZE - magic_pos_);
+        if (memcmp(buffer, COMPRESSION_MAGIC + magic_pos_, size) != 0) {
+            if (magic_pos_ != 0) {
+                BOOST_THROW_EXCEPTION(StreamError("invalid compression handshake", 0));
+            }
+            compression_ = Compression::NONE;
+            parse(buffer, static_cast<u32>(nbytes));
+            return;
+        }
+        magic_pos_ += size;
+        if (magic_pos_ < COMPRESSION_MAGIC_SIZE) {
+            parse(buffer, 0);
+            return;
+        }
+#ifdef AKU_WITH_ZSTD
+        zstd_ = ZSTD_createDStream();
+        if (zstd_ == nullptr || ZSTD_isError(ZSTD_initDStream(zstd_))) {
+            BOOST_THROW_EXCEPTION(std::runtime_error("can't initialize zstd stream"));
+        }
+        // Rest of the first read is already compressed
+        input_.resize(BUFFER_SIZE);
+        memcpy(input_.data(), buffer + size, nbytes - size);
+        compression_ = Compression::ZSTD;
+        logger_.info() << "Compressed stream detected";
+        decompress(input_.data(), nbytes - size, buffer);
+#else
+        BOOST_THROW_EXCEPTION(StreamError("compression is not supported", 0));
+#endif
+    }
+
+#ifdef AKU_WITH_ZSTD
+    /** Decompress data into the parser's buffers and parse it.
+      * @param data is a compressed data
+      * @param size is a size of the compressed data
+      * @param buffer is a parser's buffer that should be used first
+      */
+    void decompress(const Byte* data, size_t size, BufferT buffer) {
+        ZSTD_inBuffer in = { data, size, 0 };
+        while (true) {
+            ZSTD_outBuffer out = { buffer, BUFFER_SIZE, 0 };
+            size_t ret = ZSTD_decompressStream(zstd_, &out, &in);
+            if (ZSTD_isError(ret)) {
+                BOOST_THROW_EXCEPTION(StreamError(std::string("invalid zstd stream, ") + ZSTD_getErrorName(ret), 0));
+            }
+            parse(buffer, static_cast<u32>(out.pos));
+            if (in.pos == in.size && out.pos < out.size) {
+                // Decompressor flushed everything it could
+                break;
+            }
+            buffer = parser_.get_next_buffer();
+        }
+    }
+#endif
+
     void handle_read(BufferT buffer,
                      boost::system::error_code error,
                      size_t nbytes)
@@ -124,18 +358,18 @@ private:
             parser_.close();
         } else {
             try {
-                auto response = parser_.parse_next(buffer, static_cast<u32>(nbytes));
-                if(response.is_available()) {
-                    boost::asio::streambuf stream;
-                    std::ostream os(&stream);
-                    os << ProtocolT::PARSE, response.get_body();
-                    boost::asio::async_write(socket_, stream,
-                                             boost::bind(&TelnetSession::handle_write,
-                                                         this->shared_from_this(),
-                                                         boost::asio::placeholders::error)
-                                             );
+                if (compression_ == Compression::UNKNOWN) {
+                    detect_compression(buffer, nbytes);
                 }
-                start();
+#ifdef AKU_WITH_ZSTD
+                else if (compression_ == Compression::ZSTD) {
+                    decompress(buffer, nbytes, parser_.get_next_buffer());
+                }
+#endif
+                else {
+                    parse(buffer, static_cast<u32>(nbytes));
+                }
+                read_next();
             } catch (StreamError const& stream_error) {
                 // This error is related to client so we need to send it back
                 logger_.error() << stream_error.what();
@@ -200,6 +434,8 @@ private:
 
 typedef TelnetSession<RESPProtocolParser> RESPSession;
 typedef TelnetSession<OpenTSDBProtocolParser> OpenTSDBSession;
+typedef TelnetSession<InfluxProtocolParser> InfluxSession;
+typedef TelnetSession<GraphiteProtocolParser> GraphiteSession;
 
 //                           //
 //     Protocol builders     //
@@ -215,13 +451,21 @@ struct RESPSessionBuilder : ProtocolSessionBuilder {
 
     virtual std::shared_ptr<ProtocolSession> create(IOServiceT *io, std::shared_ptr<DbSession> session) {
         std::shared_ptr<ProtocolSession> result;
-        result.reset(new RESPSession(io, session, parallel_));
+        result.reset(new RESPSession(io, session, parallel_, limits, server_timestamps));
         return result;
     }
 
     virtual std::string name() const {
         return "RESP";
     }
+
+    virtual std::unique_ptr<ProtocolSessionBuilder> clone() const {
+        std::unique_ptr<ProtocolSessionBuilder> res;
+        res.reset(new RESPSessionBuilder(parallel_));
+        res->limits = limits;
+        res->server_timestamps = server_timestamps;
+        return res;
+    }
 };
 
 
@@ -235,13 +479,52 @@ struct OpenTSDBSessionBuilder : ProtocolSessionBuilder {
 
     virtual std::shared_ptr<ProtocolSession> create(IOServiceT *io, std::shared_ptr<DbSession> session) {
         std::shared_ptr<ProtocolSession> result;
-        result.reset(new OpenTSDBSession(io, session, parallel_));
+        result.reset(new OpenTSDBSession(io, session, parallel_, limits, server_timestamps));
         return result;
     }
 
     virtual std::string name() const {
         return "OpenTSDB";
     }
+
+    virtual std::unique_ptr<ProtocolSessionBuilder> clone() const {
+        std::unique_ptr<ProtocolSessionBuilder> res;
+        res.reset(new OpenTSDBSessionBuilder(parallel_));
+        res->limits = limits;
+        res->server_timestamps = server_timestamps;
+        return res;
+    }
+};
+
+//! Builder of the line protocol sessions
+template<class SessionT>
+struct LineSessionBuilder : ProtocolSessionBuilder {
+    bool parallel_;
+    const char* name_;
+
+    LineSessionBuilder(const char* name, bool parallel=true)
+        : parallel_(parallel)
+        , name_(name)
+    {
+    }
+
+    virtual std::shared_ptr<ProtocolSession> create(IOServiceT *io, std::shared_ptr<DbSession> session) {
+        std::shared_ptr<ProtocolSession> result;
+        result.reset(new SessionT(io, session, parallel_, limits, server_timestamps));
+        return result;
+    }
+
+    virtual std::string name() const {
+        return name_;
+    }
+
+    virtual std::unique_ptr<ProtocolSessionBuilder> clone() const {
+        std::unique_ptr<ProtocolSessionBuilder> res;
+        res.reset(new LineSessionBuilder(name_, parallel_));
+        res->limits = limits;
+        res->server_timestamps = server_timestamps;
+        return res;
+    }
 };
 
 std::unique_ptr<ProtocolSessionBuilder> ProtocolSessionBuilder::create_resp_builder(bool parallel) {
@@ -256,6 +539,18 @@ std::unique_ptr<ProtocolSessionBuilder> ProtocolSessionBuilder::create_opentsdb_
     return res;
 }
 
+std::unique_ptr<ProtocolSessionBuilder> ProtocolSessionBuilder::create_influx_builder(bool parallel) {
+    std::unique_ptr<ProtocolSessionBuilder> res;
+    res.reset(new LineSessionBuilder<InfluxSession>("Influx", parallel));
+    return res;
+}
+
+std::unique_ptr<ProtocolSessionBuilder> ProtocolSessionBuilder::create_graphite_builder(bool parallel) {
+    std::unique_ptr<ProtocolSessionBuilder> res;
+    res.reset(new LineSessionBuilder<GraphiteSession>("Graphite", parallel));
+    return res;
+}
+
 //                      //
 //     Tcp Acceptor     //
 //                      //
@@ -265,7 +560,9 @@ TcpAcceptor::TcpAcceptor(// Server parameters
                         // Storage & pipeline
                         std::shared_ptr<DbConnection> connection , bool parallel)
     : parallel_(parallel)
-    , acceptor_(own_io_, EndpointT(boost::asio::ip::tcp::v4(), static_cast<u16>(port)))
+    , reuse_port_(false)
+    , accept_io_(&own_io_)
+    , acceptor_(own_io_)
     , protocol_(ProtocolSessionBuilder::create_resp_builder(true))
     , sessions_io_(io)
     , connection_(connection)
@@ -276,6 +573,7 @@ TcpAcceptor::TcpAcceptor(// Server parameters
 {
     logger_.info() << "Server created!";
     logger_.info() << "Port: " << port;
+    listen(port);
 
     // Blocking I/O services
     for (auto io: sessions_io_) {
@@ -288,9 +586,12 @@ TcpAcceptor::TcpAcceptor(
         int port,
         std::unique_ptr<ProtocolSessionBuilder> protocol,
         std::shared_ptr<DbConnection> connection,
-        bool parallel)
+        bool parallel,
+        bool reuse_port)
     : parallel_(parallel)
-    , acceptor_(own_io_, EndpointT(boost::asio::ip::tcp::v4(), static_cast<u16>(port)))
+    , reuse_port_(reuse_port)
+    , accept_io_(reuse_port ? io.at(0) : &own_io_)
+    , acceptor_(*accept_io_)
     , protocol_(std::move(protocol))
     , sessions_io_(io)
     , connection_(connection)
@@ -301,6 +602,7 @@ TcpAcceptor::TcpAcceptor(
 {
     logger_.info() << "Server created!";
     logger_.info() << "Port: " << port;
+    listen(port);
 
     // Blocking I/O services
     for (auto io: sessions_io_) {
@@ -312,7 +614,30 @@ TcpAcceptor::~TcpAcceptor() {
     logger_.info() << "TCP acceptor destroyed";
 }
 
+void TcpAcceptor::listen(int port) {
+    EndpointT endpoint(boost::asio::ip::tcp::v4(), static_cast<u16>(port));
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(AcceptorT::reuse_address(true));
+    if (reuse_port_) {
+#ifdef SO_REUSEPORT
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> ReusePortT;
+        acceptor_.set_option(ReusePortT(true));
+#else
+        logger_.error() << "SO_REUSEPORT is not supported";
+        BOOST_THROW_EXCEPTION(std::runtime_error("SO_REUSEPORT is not supported"));
+#endif
+    }
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+}
+
 void TcpAcceptor::start() {
+    if (reuse_port_) {
+        // Connections are accepted by the session's event loop
+        logger_.info() << "Start listening";
+        _start();
+        return;
+    }
     WorkT work(own_io_);
 
     // Run detached thread for accepts
@@ -324,6 +649,7 @@ void TcpAcceptor::start() {
         auto thread = pthread_self();
         pthread_setname_np(thread, thread_name.c_str());
 #endif
+        aku_apply_thread_policy(AKU_THREAD_INGESTION);
         self->logger_.info() << "Starting acceptor worker thread";
         self->start_barrier_.wait();
         self->logger_.info() << "Acceptor worker thread have started";
@@ -348,7 +674,7 @@ void TcpAcceptor::start() {
 }
 
 void TcpAcceptor::_run_one() {
-    own_io_.run_one();
+    accept_io_->run_one();
 }
 
 void TcpAcceptor::_start() {
@@ -375,8 +701,13 @@ void TcpAcceptor::_start() {
 void TcpAcceptor::stop() {
     logger_.info() << "Stopping acceptor";
     acceptor_.cancel();
-    own_io_.stop();
     sessions_work_.clear();
+    if (reuse_port_) {
+        // Session's event loop is stopped by the server
+        logger_.info() << "Acceptor successfully stopped";
+        return;
+    }
+    own_io_.stop();
     logger_.info() << "Trying to stop acceptor";
     stop_barrier_.wait();
     logger_.info() << "Acceptor successfully stopped";
@@ -385,7 +716,7 @@ void TcpAcceptor::stop() {
 void TcpAcceptor::_stop() {
     logger_.info() << "Stopping acceptor (test runner)";
     acceptor_.close();
-    own_io_.stop();
+    accept_io_->stop();
     sessions_work_.clear();
 }
 
@@ -411,9 +742,11 @@ TcpServer::TcpServer(std::shared_ptr<DbConnection> connection, int concurrency,
     , barrier(static_cast<u32>(concurrency) + 1)
     , stopped{0}
     , logger_("tcp-server")
+    , mode_(mode)
+    , numa_(false)
 {
     logger_.info() << "TCP server created, concurrency: " << concurrency;
-    if (mode == Mode::EVENT_LOOP_PER_THREAD) {
+    if (mode != Mode::SHARED_EVENT_LOOP) {
         for(int i = 0; i < concurrency; i++) {
             IOPtr ptr = IOPtr(new IOServiceT(1));
             iovec.push_back(ptr.get());
@@ -426,7 +759,15 @@ TcpServer::TcpServer(std::shared_ptr<DbConnection> connection, int concurrency,
     }
     bool parallel = mode == Mode::SHARED_EVENT_LOOP;
     auto con = connection_.lock();
-    if (con) {
+    if (con && mode == Mode::ACCEPTOR_PER_THREAD) {
+        for (auto io: iovec) {
+            std::vector<IOServiceT*> single = { io };
+            auto serv = std::make_shared<TcpAcceptor>(single, port, ProtocolSessionBuilder::create_resp_builder(false),
+                                                      con, false, true);
+            serv->start();
+            acceptors_.push_back(serv);
+        }
+    } else if (con) {
         auto serv = std::make_shared<TcpAcceptor>(iovec, port, con, parallel);
         serv->start();
         acceptors_.push_back(serv);
@@ -440,14 +781,19 @@ TcpServer::TcpServer(std::shared_ptr<DbConnection> connection, int concurrency,
 TcpServer::TcpServer(std::shared_ptr<DbConnection> connection,
                      int concurrency,
                      std::map<int, std::unique_ptr<ProtocolSessionBuilder> > protocol_map,
-                     TcpServer::Mode mode)
+                     TcpServer::Mode mode,
+                     bool numa,
+                     IngestLimits limits)
     : connection_(connection)
     , barrier(static_cast<u32>(concurrency) + 1)
     , stopped{0}
     , logger_("tcp-server")
+    , mode_(mode)
+    , numa_(numa && mode == Mode::ACCEPTOR_PER_THREAD)
+    , limits_(limits)
 {
     logger_.info() << "TCP server created, concurrency: " << concurrency;
-    if (mode == Mode::EVENT_LOOP_PER_THREAD) {
+    if (mode != Mode::SHARED_EVENT_LOOP) {
         for(int i = 0; i < concurrency; i++) {
             IOPtr ptr = IOPtr(new IOServiceT(1));
             iovec.push_back(ptr.get());
@@ -463,8 +809,17 @@ TcpServer::TcpServer(std::shared_ptr<DbConnection> connection,
     for (auto& kv: protocol_map) {
         int port = kv.first;
         auto protocol = std::move(kv.second);
+        protocol->limits = limits_;
         logger_.info() << "Create acceptor for " << protocol->name() << ", port: " << port;
-        if (con) {
+        if (con && mode == Mode::ACCEPTOR_PER_THREAD) {
+            // Kernel balances connections between the acceptors
+            for (auto io: iovec) {
+                std::vector<IOServiceT*> single = { io };
+                auto serv = std::make_shared<TcpAcceptor>(single, port, protocol->clone(), con, parallel, true);
+                serv->start();
+                acceptors_.push_back(serv);
+            }
+        } else if (con) {
             auto serv = std::make_shared<TcpAcceptor>(iovec, port, std::move(protocol), con, parallel);
             serv->start();
             acceptors_.push_back(serv);
@@ -491,7 +846,23 @@ void TcpServer::start(SignalHandler* sig, int id) {
             // Name the thread
             auto thread = pthread_self();
             pthread_setname_np(thread, "TCP-worker");
+            if (self->numa_) {
+                // Every event loop accepts its own connections so sessions created by
+                // the loop (and leaf nodes of the series written by them) are node-local
+                aku_numa_bind_thread(cnt);
+            } else if (self->mode_ == Mode::ACCEPTOR_PER_THREAD) {
+                // Pin event loop to the core
+                auto ncpus = std::thread::hardware_concurrency();
+                if (ncpus != 0) {
+                    cpu_set_t cpuset;
+                    CPU_ZERO(&cpuset);
+                    CPU_SET(static_cast<unsigned>(cnt) % ncpus, &cpuset);
+                    pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
+                }
+            }
 #endif
+            // Configured core set overrides the automatic pinning
+            aku_apply_thread_policy(AKU_THREAD_INGESTION);
             Logger logger("tcp-server-worker");
             try {
                 logger.info() << "Event loop " << cnt << " started";
@@ -531,6 +902,11 @@ void TcpServer::stop() {
 
         barrier.wait();
         logger_.info() << "I/O threads stopped";
+        if (limits_.enabled()) {
+            logger_.info() << "Received " << limits_.counters->samples.load() << " samples, reads were paused "
+                           << limits_.counters->throttled.load() << " times for "
+                           << limits_.counters->paused_us.load() / 1000 << " ms";
+        }
     }
 }
 
@@ -546,27 +922,114 @@ struct TcpServerBuilder {
                                          std::shared_ptr<ReadOperationBuilder>,
                                          const ServerSettings& settings) {
         auto nworkers = settings.nworkers;
-        auto ncpus = std::thread::hardware_concurrency();
-        if (ncpus <= 4) {
-            nworkers = 1;
-        } else if (ncpus <= 8) {
-            nworkers = static_cast<int>(ncpus - 2);
-        } else {
-            nworkers = static_cast<int>(ncpus - 4);
+        if (nworkers <= 0) {
+            // Choose pool size automatically
+            auto ncpus = std::thread::hardware_concurrency();
+            if (ncpus <= 4) {
+                nworkers = 1;
+            } else if (ncpus <= 8) {
+                nworkers = static_cast<int>(ncpus - 2);
+            } else {
+                nworkers = static_cast<int>(ncpus - 4);
+            }
+        }
+        auto mode = TcpServer::Mode::EVENT_LOOP_PER_THREAD;
+        auto it = settings.options.find("reuse_port");
+        if (it != settings.options.end() && it->second == "true") {
+            mode = TcpServer::Mode::ACCEPTOR_PER_THREAD;
+        }
+        bool numa = false;
+        it = settings.options.find("numa");
+        if (it != settings.options.end() && it->second == "true") {
+            // Workers accept connections on the node they're bound to
+            mode = TcpServer::Mode::ACCEPTOR_PER_THREAD;
+            numa = true;
         }
+        it = settings.options.find("io_backend");
+        if (it != settings.options.end() && it->second == "uring") {
+            return create_uring_server(con, nworkers, settings);
+        } else if (it != settings.options.end() && it->second != "asio") {
+            s_logger_.error() << "Unknown I/O backend " << it->second;
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid tcp-server settings"));
+        }
+        // Every event loop is served by one thread so sessions don't need a strand
+        bool parallel = mode == TcpServer::Mode::SHARED_EVENT_LOOP;
+        it = settings.options.find("server_timestamps");
+        bool server_timestamps = it != settings.options.end() && it->second == "true";
         std::map<int, std::unique_ptr<ProtocolSessionBuilder>> protocol_map;
         for (const auto& protocol: settings.protocols) {
             std::unique_ptr<ProtocolSessionBuilder> inst;
             if (protocol.name == "RESP") {
-                inst = ProtocolSessionBuilder::create_resp_builder(true);
+                inst = ProtocolSessionBuilder::create_resp_builder(parallel);
             } else if (protocol.name == "OpenTSDB") {
-                inst = ProtocolSessionBuilder::create_opentsdb_builder(true);
+                inst = ProtocolSessionBuilder::create_opentsdb_builder(parallel);
+            } else if (protocol.name == "Influx") {
+                inst = ProtocolSessionBuilder::create_influx_builder(parallel);
+            } else if (protocol.name == "Graphite") {
+                inst = ProtocolSessionBuilder::create_graphite_builder(parallel);
             } else {
                 s_logger_.error() << "Unknown protocol " << protocol.name;
             }
+            if (inst && protocol.name == "RESP") {
+                inst->server_timestamps = server_timestamps;
+            }
             protocol_map[protocol.port] = std::move(inst);
         }
-        return std::make_shared<TcpServer>(con, nworkers, std::move(protocol_map));
+        return std::make_shared<TcpServer>(con, nworkers, std::move(protocol_map), mode, numa, get_limits(settings));
+    }
+
+    //! Read ingestion limits (samples per second, 0 - unlimited)
+    static IngestLimits get_limits(const ServerSettings& settings) {
+        u64 rate = 0, connection_rate = 0;
+        auto it = settings.options.find("rate_limit");
+        try {
+            if (it != settings.options.end()) {
+                rate = boost::lexical_cast<u64>(it->second);
+            }
+            it = settings.options.find("connection_rate_limit");
+            if (it != settings.options.end()) {
+                connection_rate = boost::lexical_cast<u64>(it->second);
+            }
+        } catch (boost::bad_lexical_cast const&) {
+            s_logger_.error() << "Can't initialize TCP server, invalid " << it->first << " value " << it->second;
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid tcp-server settings"));
+        }
+        if (rate == 0 && connection_rate == 0) {
+            return IngestLimits();
+        }
+        s_logger_.info() << "Ingestion rate limit: " << rate << ", per connection: " << connection_rate;
+        return IngestLimits(rate, connection_rate);
+    }
+
+    //! Every worker of the io_uring server accepts its own connections (like Mode::ACCEPTOR_PER_THREAD)
+    static std::shared_ptr<Server> create_uring_server(std::shared_ptr<DbConnection> con,
+                                                       int nworkers,
+                                                       const ServerSettings& settings)
+    {
+#ifdef AKU_WITH_URING
+        std::vector<UringTcpServer::Listener> listeners;
+        for (const auto& protocol: settings.protocols) {
+            UringTcpServer::Listener listener = { protocol.port, UringTcpServer::Protocol::RESP };
+            if (protocol.name == "OpenTSDB") {
+                listener.protocol = UringTcpServer::Protocol::OPENTSDB;
+            } else if (protocol.name == "Influx") {
+                listener.protocol = UringTcpServer::Protocol::INFLUX;
+            } else if (protocol.name == "Graphite") {
+                listener.protocol = UringTcpServer::Protocol::GRAPHITE;
+            } else if (protocol.name != "RESP") {
+                s_logger_.error() << "Unknown protocol " << protocol.name;
+                continue;
+            }
+            listeners.push_back(listener);
+        }
+        return std::make_shared<UringTcpServer>(con, nworkers, std::move(listeners));
+#else
+        (void)con;
+        (void)nworkers;
+        (void)settings;
+        s_logger_.error() << "akumulid is built without io_uring support";
+        BOOST_THROW_EXCEPTION(std::runtime_error("invalid tcp-server settings"));
+#endif
     }
 };
 
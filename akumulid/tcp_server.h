@@ -16,7 +16,10 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
 
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
@@ -38,9 +41,60 @@ typedef boost::asio::ip::tcp::socket         SocketT;
 typedef boost::asio::ip::tcp::endpoint       EndpointT;
 typedef boost::asio::strand                  StrandT;
 typedef boost::asio::io_service::work        WorkT;
+typedef boost::asio::steady_timer            TimerT;
 typedef std::function<void(aku_Status, u64)> ErrorCallback;
 
 
+/** Token bucket that limits ingestion rate (samples per second).
+  * Samples are counted after they were written so the bucket can go into debt,
+  * the writer should wait until the debt is repaid before reading more data.
+  */
+class TokenBucket {
+    typedef std::chrono::steady_clock ClockT;
+    const double       rate_;    //< Tokens per second
+    const double       burst_;   //< Max number of accumulated tokens
+    std::mutex         lock_;
+    double             tokens_;  //< Negative if the bucket is in debt
+    ClockT::time_point last_;
+public:
+    //! C-tor, bucket is full initially (burst is equal to one second worth of tokens)
+    TokenBucket(u64 rate);
+
+    /** Take `n` tokens.
+      * @return number of microseconds the writer should wait (zero if not in debt)
+      */
+    u64 take(u64 n);
+};
+
+
+/** Ingestion limits of the TCP sessions.
+  * Sessions that exceed the limits stop reading from the socket for some time,
+  * TCP flow control pushes back on the clients so memory use stays bounded and
+  * nothing is dropped.
+  */
+struct IngestLimits {
+    //! Max number of samples per second per connection (0 - unlimited)
+    u64 connection_rate;
+    //! Limit shared by all connections (nullptr - unlimited)
+    std::shared_ptr<TokenBucket> global;
+
+    //! Throttle counters
+    struct Counters {
+        std::atomic<u64> samples;    //< Number of samples received by throttled server
+        std::atomic<u64> throttled;  //< Number of times the reads were paused
+        std::atomic<u64> paused_us;  //< Total duration of the pauses
+    };
+    std::shared_ptr<Counters> counters;
+
+    IngestLimits();
+
+    //! Create limits, `rate` and `connection_rate` are in samples per second (0 - unlimited)
+    IngestLimits(u64 rate, u64 connection_rate);
+
+    bool enabled() const;
+};
+
+
 /**
  * Common interface for all protocol session (RESP, line, etc)
  */
@@ -71,6 +125,12 @@ struct ProtocolSession {
  * protocol sessions.
  */
 struct ProtocolSessionBuilder {
+    //! Limits of the created sessions (unlimited by default)
+    IngestLimits limits;
+    //! Assign timestamps to the samples without them (RESP only)
+    bool server_timestamps = false;
+
+    virtual ~ProtocolSessionBuilder() = default;
 
     /**
      * @brief create new ProtocolSession instance
@@ -84,6 +144,11 @@ struct ProtocolSessionBuilder {
      */
     virtual std::string name() const = 0;
 
+    /**
+     * Create a copy of the builder (every acceptor owns its builder)
+     */
+    virtual std::unique_ptr<ProtocolSessionBuilder> clone() const = 0;
+
     /**
      * @brief Create RESP parser builder
      * @param parallel use thread safe implementation if true
@@ -97,6 +162,20 @@ struct ProtocolSessionBuilder {
      * @return newly created object
      */
     static std::unique_ptr<ProtocolSessionBuilder> create_opentsdb_builder(bool parallel=true);
+
+    /**
+     * @brief Create InfluxDB line protocol parser builder
+     * @param parallel use thread safe implementation if true
+     * @return newly created object
+     */
+    static std::unique_ptr<ProtocolSessionBuilder> create_influx_builder(bool parallel=true);
+
+    /**
+     * @brief Create Graphite plaintext protocol parser builder
+     * @param parallel use thread safe implementation if true
+     * @return newly created object
+     */
+    static std::unique_ptr<ProtocolSessionBuilder> create_graphite_builder(bool parallel=true);
 };
 
 
@@ -107,7 +186,9 @@ class TcpAcceptor : public std::enable_shared_from_this<TcpAcceptor> {
     typedef std::unique_ptr<ProtocolSessionBuilder> ProtocolSessionBuilderT;
 
     const bool                         parallel_;  //< Flag for TcpSession instances
+    const bool                       reuse_port_;  //< Acceptor uses session's io-service and SO_REUSEPORT
     IOServiceT                           own_io_;  //< Acceptor's own io-service
+    IOServiceT*                       accept_io_;  //< Io-service used by acceptor
     AcceptorT                          acceptor_;  //< Acceptor
     ProtocolSessionBuilderT            protocol_;  //< Protocol builder
     std::vector<IOServiceT*>        sessions_io_;  //< List of io-services for sessions
@@ -137,13 +218,17 @@ public:
       * @param port port to listen for new connections
       * @param protocol is a protocol builder
       * @param connection to the database
+      * @param reuse_port if set, the acceptor runs inside the only session's io-service
+      *        and the port is opened with SO_REUSEPORT so several acceptors can listen on
+      *        the same port
      */
     TcpAcceptor(
         std::vector<IOServiceT*> io,
         int port,
         std::unique_ptr<ProtocolSessionBuilder> protocol,
         std::shared_ptr<DbConnection> connection,
-        bool parallel=true);
+        bool parallel=true,
+        bool reuse_port=false);
 
     ~TcpAcceptor();
 
@@ -165,6 +250,9 @@ public:
     std::string name() const;
 
 private:
+    //! Bind acceptor to the port
+    void listen(int port);
+
     //! Accept event handler
     void handle_accept(std::shared_ptr<ProtocolSession> session, boost::system::error_code err);
 };
@@ -174,6 +262,9 @@ struct TcpServer : std::enable_shared_from_this<TcpServer>, Server {
     enum class Mode {
         EVENT_LOOP_PER_THREAD,
         SHARED_EVENT_LOOP,
+        //! Event loop per thread, every loop has its own SO_REUSEPORT acceptor
+        //! (the kernel balances the connections) and thread is pinned to the core
+        ACCEPTOR_PER_THREAD,
     };
     typedef std::unique_ptr<IOServiceT>  IOPtr;
     std::weak_ptr<DbConnection>          connection_;
@@ -183,6 +274,11 @@ struct TcpServer : std::enable_shared_from_this<TcpServer>, Server {
     boost::barrier                       barrier;
     std::atomic<int>                     stopped;
     Logger                               logger_;
+    Mode                                 mode_;
+    //! Bind workers to NUMA nodes instead of cores (Mode::ACCEPTOR_PER_THREAD only)
+    bool                                 numa_;
+    //! Ingestion limits (reported on stop)
+    IngestLimits                         limits_;
 
     /**
      * @brief Creates TCP server that accepts only RESP connections
@@ -197,7 +293,9 @@ struct TcpServer : std::enable_shared_from_this<TcpServer>, Server {
     TcpServer(std::shared_ptr<DbConnection> connection,
               int concurrency,
               std::map<int, std::unique_ptr<ProtocolSessionBuilder>> protocol_map,
-              Mode mode=Mode::EVENT_LOOP_PER_THREAD);
+              Mode mode=Mode::EVENT_LOOP_PER_THREAD,
+              bool numa=false,
+              IngestLimits limits=IngestLimits());
 
     ~TcpServer();
 
@@ -1,176 +1,385 @@
 #include "udp_server.h"
 
+#include <chrono>
 #include <thread>
 
 #include <sys/socket.h>
 #include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef __gnu_linux__
+#include <linux/filter.h>
+#endif
 
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 
 namespace Akumuli {
 
-UdpServer::UdpServer(std::shared_ptr<DbConnection> db, int nworkers, int port)
+UdpServer::Counters::Counters()
+    : packets{0}
+    , bytes{0}
+    , drops{0}
+    , errors{0}
+{
+}
+
+UdpServer::Options::Options()
+    : gro(false)
+    , busy_poll(0)
+    , batch_size(0)
+    , server_timestamps(false)
+{
+}
+
+UdpServer::IOBuf::IOBuf(size_t npackets, size_t slot_size)
+    : msgs(npackets)
+    , iovecs(npackets)
+    , bufs(nullptr, &free)
+    , ctrl(npackets * CTRL_SIZE)
+    , slot_size(slot_size)
+{
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, 64, npackets * slot_size) != 0) {
+        throw std::bad_alloc();
+    }
+    bufs.reset(static_cast<char*>(ptr));
+    reset();
+}
+
+char* UdpServer::IOBuf::buf(size_t i) const {
+    return bufs.get() + i * slot_size;
+}
+
+void UdpServer::IOBuf::reset() {
+    for (size_t i = 0; i < msgs.size(); i++) {
+        iovecs[i].iov_base         = buf(i);
+        iovecs[i].iov_len          = slot_size;
+        msgs[i].msg_hdr.msg_iov    = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name   = nullptr;
+        msgs[i].msg_hdr.msg_namelen = 0;
+        msgs[i].msg_hdr.msg_control = ctrl.data() + i * CTRL_SIZE;
+        msgs[i].msg_hdr.msg_controllen = CTRL_SIZE;
+        msgs[i].msg_hdr.msg_flags  = 0;
+        msgs[i].msg_len            = 0;
+    }
+}
+
+UdpServer::UdpServer(std::shared_ptr<DbConnection> db, int nworkers, int port, bool steer_by_source,
+                     Protocol protocol, Options options)
     : db_(db)
     , start_barrier_(static_cast<u32>(nworkers + 1))
     , stop_barrier_(static_cast<u32>(nworkers + 1))
     , stop_{0}
     , port_(port)
     , nworkers_(nworkers)
-    , sockfd_(-1)
+    , steer_by_source_(steer_by_source)
+    , protocol_(protocol)
+    , options_(options)
     , logger_("UdpServer")
 {
 }
 
+static void throw_socket_error(const char* what) {
+    const char* msg = strerror(errno);
+    std::stringstream fmt;
+    fmt << what << ": " << msg;
+    std::runtime_error err(fmt.str());
+    BOOST_THROW_EXCEPTION(err);
+}
+
+int UdpServer::create_socket() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        throw_socket_error("can't create socket");
+    }
+
+    // Set socket options
+    int optval = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
+        close(sockfd);
+        throw_socket_error("can't set socket options");
+    }
+#ifdef SO_RXQ_OVFL
+    // Ask the kernel to report the number of dropped datagrams
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval)) == -1) {
+        logger_.error() << "can't enable drop counter: " << strerror(errno);
+    }
+#endif
+    if (options_.gro) {
+#ifdef UDP_GRO
+        // Kernel coalesces datagrams of the same flow into one message
+        if (setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &optval, sizeof(optval)) == -1) {
+            logger_.error() << "can't enable UDP GRO: " << strerror(errno);
+        }
+#else
+        logger_.error() << "UDP GRO is not supported on this platform";
+#endif
+    }
+    if (options_.busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+        // Values larger than net.core.busy_read require CAP_NET_ADMIN
+        int timeout = options_.busy_poll;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &timeout, sizeof(timeout)) == -1) {
+            logger_.error() << "can't enable busy polling: " << strerror(errno);
+        }
+#ifdef SO_PREFER_BUSY_POLL
+        else if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &optval, sizeof(optval)) == -1) {
+            logger_.error() << "can't enable preferred busy polling: " << strerror(errno);
+        }
+#endif
+#else
+        logger_.error() << "busy polling is not supported on this platform";
+#endif
+    }
+
+    // Bind socket to port
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(static_cast<u16>(port_));
+
+    if (bind(sockfd, (sockaddr *) &sa, sizeof(sa)) == -1) {
+        close(sockfd);
+        throw_socket_error("can't bind socket");
+    }
+    return sockfd;
+}
+
+void UdpServer::attach_steering_program(int sockfd) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    // The program returns index of the socket in the reuseport group (sockets
+    // are added to the group in bind order): source_address % nworkers.
+    sock_filter code[] = {
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, static_cast<u32>(SKF_NET_OFF + 12) },
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, static_cast<u32>(nworkers_) },
+        { BPF_RET | BPF_A,             0, 0, 0 },
+    };
+    sock_fprog prog = {
+        static_cast<unsigned short>(sizeof(code) / sizeof(code[0])),
+        code,
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        logger_.error() << "can't attach steering program: " << strerror(errno)
+                        << ", datagrams will be distributed by the kernel";
+    } else {
+        logger_.info() << "datagrams are steered to workers by source address";
+    }
+#else
+    (void)sockfd;
+    logger_.error() << "steering by source address is not supported on this platform";
+#endif
+}
+
 void UdpServer::start(SignalHandler *sig, int id) {
     auto self = shared_from_this();
     sig->add_handler(boost::bind(&UdpServer::stop, std::move(self)), id);
 
+    // Sockets are created before the workers so the errors are reported here
+    // and the order of the sockets in the reuseport group is known.
+    try {
+        for (int i = 0; i < nworkers_; i++) {
+            sockets_.push_back(create_socket());
+            counters_.emplace_back(new Counters());
+        }
+    } catch (...) {
+        for (auto fd: sockets_) {
+            close(fd);
+        }
+        sockets_.clear();
+        throw;
+    }
+    if (steer_by_source_ && !sockets_.empty()) {
+        // The program is shared by the group, it's enough to attach it to one socket
+        attach_steering_program(sockets_.front());
+    }
+
     // Create workers
     for (int i = 0; i < nworkers_; i++) {
         auto session = db_->create_session();
-        std::thread thread(std::bind(&UdpServer::worker, shared_from_this(), std::move(session)));
+        auto fn = &UdpServer::worker<RESPProtocolParser>;
+        if (protocol_ == Protocol::INFLUX) {
+            fn = &UdpServer::worker<InfluxProtocolParser>;
+        } else if (protocol_ == Protocol::GRAPHITE) {
+            fn = &UdpServer::worker<GraphiteProtocolParser>;
+        }
+        std::thread thread(std::bind(fn, shared_from_this(), i, std::move(session)));
         thread.detach();
     }
     start_barrier_.wait();
 }
 
-static void sendByteToLocalhost(int port) {
-    Logger logger("UdpServer");
-    int fd;
-    struct sockaddr_in addr;
-    const char* ip = "127.0.0.1";
-
-    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        // We can't send the message to the socket thus, we wouldn't be able
-        // to stop the program normally anyway.
-        logger.error() << "Can't create the socket";
-        std::terminate();
+void UdpServer::stop() {
+    // Set the flag and then shutdown the sockets to wake up the
+    // worker threads. The socket descriptors can be closed afterwards.
+    stop_.store(1, std::memory_order_seq_cst);
+    for (auto fd: sockets_) {
+        shutdown(fd, SHUT_RDWR);
     }
+    stop_barrier_.wait();
+    for (size_t i = 0; i < sockets_.size(); i++) {
+        auto const& cnt = *counters_.at(i);
+        logger_.info() << "UDP worker " << i << " received " << cnt.packets.load()
+                       << " packets (" << cnt.bytes.load() << " bytes), "
+                       << cnt.drops.load() << " dropped, "
+                       << cnt.errors.load() << " parse errors";
+        close(sockets_[i]);
+    }
+    sockets_.clear();
+    logger_.info() << "UDP server stopped";
+}
 
-    addr.sin_family = AF_INET;
-    inet_aton(ip, &addr.sin_addr);
-    addr.sin_port = htons(port);
-    char payload = 0;
+//! Extract kernel drop counter and GRO segment size from the control messages
+static void get_control_data(msghdr* hdr, u32* drops, int* segment_size) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+#ifdef SO_RXQ_OVFL
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(drops, CMSG_DATA(cmsg), sizeof(u32));
+        }
+#endif
+#ifdef UDP_GRO
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(segment_size, CMSG_DATA(cmsg), sizeof(int));
+        }
+#endif
+    }
+    (void)drops;
+    (void)segment_size;
+}
 
-    if (sendto(fd, &payload, 1, 0, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-        // Same reasoning as previously
-        logger.error() << "Can't send the data through the socket";
-        std::terminate();
+template<class ParserT>
+void UdpServer::parse_datagram(ParserT& parser, const char* data, size_t size) {
+    // Every datagram of the line protocol contains whole lines, the last line
+    // may not be terminated
+    const bool terminate_lines = protocol_ != Protocol::RESP;
+    // Datagram can be larger than the parser's buffer if the slots are large
+    for (size_t pos = 0; pos < size;) {
+        auto buf = parser.get_next_buffer();
+        u32 chunk = static_cast<u32>(std::min<size_t>(size - pos, ParserT::RDBUF_SIZE - 1));
+        memcpy(buf, data + pos, chunk);
+        pos += chunk;
+        if (terminate_lines && pos == size && buf[chunk - 1] != '\n') {
+            buf[chunk++] = '\n';
+        }
+        parser.parse_next(buf, chunk);
     }
 }
 
-void UdpServer::stop() {
-    // Set the flag and then send the 1-byte payload to wake up the
-    // worker thread. The socket descriptor can be closed afterwards.
-    stop_.store(1, std::memory_order_relaxed);
-    sendByteToLocalhost(port_);
-    stop_barrier_.wait();
-    logger_.info() << "UDP server stopped";
-    close(sockfd_);
+//! Server timestamps are supported only by the RESP parser
+template<class ParserT>
+static void enable_server_timestamps(ParserT&) {
+}
+
+static void enable_server_timestamps(RESPProtocolParser& parser) {
+    // Every recvmmsg batch is stamped once
+    parser.set_server_timestamps(RESPProtocolParser::ServerTimestamps::PER_BATCH);
 }
 
+template<class ParserT>
+static void begin_batch(ParserT&) {
+}
+
+static void begin_batch(RESPProtocolParser& parser) {
+    parser.begin_batch();
+}
 
-void UdpServer::worker(std::shared_ptr<DbSession> spout) {
+template<class ParserT>
+void UdpServer::worker(int ix, std::shared_ptr<DbSession> spout) {
 #ifdef __gnu_linux__
         // Name the thread
         auto thread = pthread_self();
         pthread_setname_np(thread, "UDP-worker");
 #endif
+    aku_apply_thread_policy(AKU_THREAD_INGESTION);
     start_barrier_.wait();
 
     int retval;
-    sockaddr_in sa{};
-
-    RESPProtocolParser parser(spout);
+    int sockfd = sockets_.at(static_cast<size_t>(ix));
+    Counters& counters = *counters_.at(static_cast<size_t>(ix));
+    // Kernel reports total number of drops since the socket was created
+    u32 kernel_drops = 0;
+    auto last_report = std::chrono::steady_clock::now();
+    u64 reported_drops = 0;
+
+    // Coalesced message can be up to 64KB long so the batch is smaller
+    const size_t slot_size = options_.gro ? GRO_MSS : MSS;
+    size_t npackets = options_.gro ? GRO_NPACKETS : NPACKETS;
+    if (options_.batch_size > 0) {
+        npackets = static_cast<size_t>(options_.batch_size);
+    }
+    ParserT parser(spout);
     try {
 
         parser.start();
-
-        // Create socket
-        sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sockfd_ == -1) {
-            const char* msg = strerror(errno);
-            std::stringstream fmt;
-            fmt << "can't create socket: " << msg;
-            std::runtime_error err(fmt.str());
-            BOOST_THROW_EXCEPTION(err);
-        }
-
-        // Set socket options
-        int optval = 1;
-        if (setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) == -1) {
-            const char* msg = strerror(errno);
-            std::stringstream fmt;
-            fmt << "can't set socket options: " << msg;
-            std::runtime_error err(fmt.str());
-            BOOST_THROW_EXCEPTION(err);
-        }
-
-        // Bind socket to port
-        sa.sin_family = AF_INET;
-        sa.sin_addr.s_addr = htonl(INADDR_ANY);
-        sa.sin_port = htons(port_);
-
-        if (bind(sockfd_, (sockaddr *) &sa, sizeof(sa)) == -1) {
-            const char* msg = strerror(errno);
-            std::stringstream fmt;
-            fmt << "can't bind socket: " << msg;
-            std::runtime_error err(fmt.str());
-            BOOST_THROW_EXCEPTION(err);
+        if (options_.server_timestamps) {
+            enable_server_timestamps(parser);
         }
 
-        auto iobuf = std::make_shared<IOBuf>();
+        std::unique_ptr<IOBuf> iobuf(new IOBuf(npackets, slot_size));
 
         while(true) {
-            retval = recvmmsg(sockfd_, iobuf->msgs, NPACKETS, MSG_WAITFORONE, nullptr);
+            retval = recvmmsg(sockfd, iobuf->msgs.data(), static_cast<unsigned>(npackets),
+                              MSG_WAITFORONE, nullptr);
             if (retval == -1) {
                 if (errno == EAGAIN || errno == EINTR) {
                     continue;
                 }
-                const char* msg = strerror(errno);
-                std::stringstream fmt;
-                fmt << "socket read error: " << msg;
-                std::runtime_error err(fmt.str());
-                BOOST_THROW_EXCEPTION(err);
+                if (stop_.load(std::memory_order_seq_cst)) {
+                    break;
+                }
+                throw_socket_error("socket read error");
             }
             if (stop_.load(std::memory_order_seq_cst)) {
                 break;
             }
 
-            iobuf->pps++;
-
+            u64 nbytes = 0;
+            u64 ndatagrams = 0;
+            begin_batch(parser);
             for (int i = 0; i < retval; i++) {
-                // reset buffer to receive new message
-                iobuf->bps += iobuf->msgs[i].msg_len;
-                auto mlen = iobuf->msgs[i].msg_len;
-                iobuf->msgs[i].msg_len = 0;
-
-                // parse message content
-                PDU pdu = {
-                    std::shared_ptr<Byte>(iobuf, iobuf->bufs[i]),
-                    mlen,
-                    0u,
-                    0u,
-                };
-
-                auto buf = parser.get_next_buffer();
-                memcpy(buf, iobuf->bufs[i], mlen);
-                try {
-                    parser.parse_next(buf, mlen);
-                } catch (StreamError const& err) {
-                    // Catch protocol parsing errors here and continue processing data
-                    logger_.error() << err.what();
-                }
+                size_t mlen = iobuf->msgs[i].msg_len;
+                int segment_size = 0;
+                nbytes += mlen;
+                get_control_data(&iobuf->msgs[i].msg_hdr, &kernel_drops, &segment_size);
+
+                // Coalesced message contains datagrams of the same size (except the last one)
+                const char* data = iobuf->buf(static_cast<size_t>(i));
+                size_t step = segment_size > 0 ? static_cast<size_t>(segment_size) : mlen;
+                size_t pos = 0;
+                do {
+                    size_t size = std::min(step, mlen - pos);
+                    try {
+                        parse_datagram(parser, data + pos, size);
+                    } catch (StreamError const& err) {
+                        // Catch protocol parsing errors here and continue processing data
+                        counters.errors++;
+                        logger_.error() << err.what();
+                    }
+                    pos += size;
+                    ndatagrams++;
+                } while (pos < mlen);
             }
-            if (retval != 0) {
-                iobuf = std::make_shared<IOBuf>();
+            counters.packets += ndatagrams;
+            counters.bytes   += nbytes;
+            counters.drops.store(kernel_drops, std::memory_order_relaxed);
+            iobuf->reset();
+
+            if (kernel_drops != reported_drops) {
+                // Report drops at most once per second to avoid flooding the log
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_report > std::chrono::seconds(1)) {
+                    logger_.error() << "UDP worker " << ix << " dropped "
+                                    << (kernel_drops - reported_drops) << " packets";
+                    reported_drops = kernel_drops;
+                    last_report = now;
+                }
             }
         }
     } catch(...) {
@@ -183,6 +392,9 @@ void UdpServer::worker(std::shared_ptr<DbSession> spout) {
 
 static Logger s_logger_("udp-server");
 
+//! Kernel doesn't receive more messages in one recvmmsg call
+static const int MAX_BATCH_SIZE = 1024;
+
 struct UdpServerBuilder {
 
     UdpServerBuilder() {
@@ -196,7 +408,60 @@ struct UdpServerBuilder {
             s_logger_.error() << "Can't initialize UDP server, more than one protocol specified";
             BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
         }
-        return std::make_shared<UdpServer>(con, settings.nworkers, settings.protocols.front().port);
+        bool steer_by_source = false;
+        auto it = settings.options.find("steering");
+        if (it != settings.options.end()) {
+            if (it->second == "source") {
+                steer_by_source = true;
+            } else if (it->second != "none") {
+                s_logger_.error() << "Can't initialize UDP server, unknown steering mode " << it->second;
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
+            }
+        }
+        auto protocol = UdpServer::Protocol::RESP;
+        it = settings.options.find("protocol");
+        if (it != settings.options.end()) {
+            if (it->second == "Influx") {
+                protocol = UdpServer::Protocol::INFLUX;
+            } else if (it->second == "Graphite") {
+                protocol = UdpServer::Protocol::GRAPHITE;
+            } else if (it->second != "RESP") {
+                s_logger_.error() << "Can't initialize UDP server, unknown protocol " << it->second;
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
+            }
+        }
+        UdpServer::Options options;
+        it = settings.options.find("gro");
+        if (it != settings.options.end()) {
+            options.gro = it->second == "true";
+        }
+        it = settings.options.find("server_timestamps");
+        if (it != settings.options.end() && it->second == "true") {
+            if (protocol != UdpServer::Protocol::RESP) {
+                s_logger_.error() << "Can't initialize UDP server, server timestamps require RESP protocol";
+                BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
+            }
+            options.server_timestamps = true;
+        }
+        try {
+            it = settings.options.find("busy_poll");
+            if (it != settings.options.end()) {
+                options.busy_poll = boost::lexical_cast<int>(it->second);
+            }
+            it = settings.options.find("batch_size");
+            if (it != settings.options.end()) {
+                options.batch_size = boost::lexical_cast<int>(it->second);
+            }
+        } catch (boost::bad_lexical_cast const&) {
+            s_logger_.error() << "Can't initialize UDP server, invalid " << it->first << " value " << it->second;
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
+        }
+        if (options.busy_poll < 0 || options.batch_size < 0 || options.batch_size > MAX_BATCH_SIZE) {
+            s_logger_.error() << "Can't initialize UDP server, invalid busy_poll or batch_size value";
+            BOOST_THROW_EXCEPTION(std::runtime_error("invalid upd-server settings"));
+        }
+        return std::make_shared<UdpServer>(con, settings.nworkers, settings.protocols.front().port,
+                                           steer_by_source, protocol, options);
     }
 };
 
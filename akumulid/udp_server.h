@@ -17,7 +17,11 @@
 #pragma once
 
 #include <atomic>
+#include <cstdlib>
 #include <memory>
+#include <vector>
+
+#include <sys/socket.h>
 
 #include <boost/thread/barrier.hpp>
 
@@ -31,59 +35,119 @@ namespace Akumuli {
 
 
 /** UDP server for data ingestion.
+  * Every worker has its own socket bound to the same port with SO_REUSEPORT
+  * so the kernel spreads the datagrams between the workers.
+  * If UDP GRO is enabled the kernel can coalesce datagrams of the same flow
+  * into one message, the message is split into datagrams using the segment
+  * size reported by the kernel.
   */
 class UdpServer : public std::enable_shared_from_this<UdpServer>, public Server {
+public:
+    //! Protocol of the datagrams
+    enum class Protocol {
+        RESP,
+        INFLUX,
+        GRAPHITE,
+    };
+
+    //! Socket and batching options
+    struct Options {
+        bool gro;         //< Enable UDP GRO
+        int  busy_poll;   //< Busy polling time in microseconds (0 - disabled)
+        int  batch_size;  //< Max number of messages received at once (0 - choose automatically)
+        bool server_timestamps;  //< Assign timestamps to the samples without them (RESP only)
+
+        Options();
+    };
+private:
     std::shared_ptr<DbConnection>      db_;
     boost::barrier                     start_barrier_;  //< Barrier to start worker thread
     boost::barrier                     stop_barrier_;   //< Barrier to stop worker thread
     std::atomic<int>                   stop_;
     const int                          port_;
     const int                          nworkers_;
-    int                                sockfd_;         //< UDP socket file descriptor
+    const bool                         steer_by_source_;  //< Choose worker using source address
+    const Protocol                     protocol_;
+    const Options                      options_;
+    std::vector<int>                   sockets_;        //< UDP socket file descriptors (one per worker)
 
     Logger logger_;
 
     static const int MSS      = 2048 - 128;
     static const int NPACKETS = 512;
+    //! Max size of the coalesced message (UDP GRO)
+    static const int GRO_MSS  = 0x10000;
+    //! Default batch size if UDP GRO is enabled
+    static const int GRO_NPACKETS = 64;
+
+    //! Worker counters
+    struct Counters {
+        std::atomic<u64> packets;
+        std::atomic<u64> bytes;
+        //! Number of datagrams dropped by the kernel (socket buffer overflow)
+        std::atomic<u64> drops;
+        std::atomic<u64> errors;
+        //! Counters of different workers shouldn't share the cache line
+        char pad[64 - 4*sizeof(u64)];
+
+        Counters();
+    };
+
+    std::vector<std::unique_ptr<Counters>> counters_;
 
     struct IOBuf {
-        // Counters
-        std::atomic<u64> pps;
-        std::atomic<u64> bps;
-
         // Packet recv structs
-        mmsghdr msgs[NPACKETS];
-        iovec   iovecs[NPACKETS];
-        char    bufs[NPACKETS][MSS];
-
-        IOBuf() {
-            memset(this, 0, sizeof(IOBuf));
-            for (int i = 0; i < NPACKETS; i++) {
-                iovecs[i].iov_base         = bufs[i];
-                iovecs[i].iov_len          = MSS;
-                msgs[i].msg_hdr.msg_iov    = &iovecs[i];
-                msgs[i].msg_hdr.msg_iovlen = 1;
-            }
-        }
-
-    } __attribute__((aligned(64)));  // Otherwise struct will be aligned by sizeof(bufs) and this is crazy expensive
+        std::vector<mmsghdr> msgs;
+        std::vector<iovec>   iovecs;
+        //! Message buffers, every slot is aligned by the cache line
+        std::unique_ptr<char, decltype(&free)> bufs;
+        //! Control messages (drop counter and GRO segment size)
+        std::vector<char>    ctrl;
+        const size_t         slot_size;
+
+        static const size_t CTRL_SIZE = CMSG_SPACE(sizeof(u32)) + CMSG_SPACE(sizeof(int));
+
+        IOBuf(size_t npackets, size_t slot_size);
+
+        //! Buffer of the i-th message
+        char* buf(size_t i) const;
+
+        //! Prepare buffers to receive next batch of messages
+        void reset();
+    };
 
 public:
     /** C-tor.
       * @param nworker number of workers
       * @param port port number
       * @param pipeline pointer to ingestion pipeline
+      * @param steer_by_source if set, datagrams from the same source address are
+      *        always processed by the same worker
+      * @param protocol protocol of the datagrams
+      * @param options socket and batching options
       */
-    UdpServer(std::shared_ptr<DbConnection> pipeline, int nworkers, int port);
+    UdpServer(std::shared_ptr<DbConnection> pipeline, int nworkers, int port, bool steer_by_source=false,
+              Protocol protocol=Protocol::RESP, Options options=Options());
 
     //! Start processing packets
     virtual void start(SignalHandler* sig, int id);
 
 private:
-    //! Stop processing packets, close the socket
+    //! Stop processing packets, close the sockets
     void stop();
 
-    void worker(std::shared_ptr<DbSession> spout);
+    //! Create socket bound to the port
+    int create_socket();
+
+    //! Attach BPF program that chooses the socket using source address
+    void attach_steering_program(int sockfd);
+
+    template<class ParserT>
+    void worker(int ix, std::shared_ptr<DbSession> spout);
+
+    //! Pass one datagram to the parser
+    template<class ParserT>
+    void parse_datagram(ParserT& parser, const char* data, size_t size);
 };
 
 }  // namespace
@@ -0,0 +1,531 @@
+#include "uring_server.h"
+
+#ifdef AKU_WITH_URING
+
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include <boost/bind.hpp>
+#include <boost/exception/diagnostic_information.hpp>
+
+#include "protocolparser.h"
+
+namespace Akumuli {
+
+//                       //
+//     Uring Session     //
+//                       //
+
+namespace {
+
+//! Parser of the connection (protocol is chosen at runtime)
+struct UringSession {
+    enum class ErrorKind {
+        DB,
+        ERR,
+        PARSE,
+    };
+
+    virtual ~UringSession() = default;
+
+    /** Copy received data into the parser's buffers and parse it.
+      * @return response that should be sent back (empty if there is nothing to send)
+      * @throw StreamError, DatabaseError
+      */
+    virtual std::string parse(const Byte* data, size_t size) = 0;
+
+    //! Error representation in the session's protocol
+    virtual std::string error_repr(ErrorKind kind, std::string const& msg) const = 0;
+
+    virtual void close() = 0;
+};
+
+template<class ProtocolT>
+struct UringParserSession : UringSession {
+    ProtocolT parser_;
+
+    UringParserSession(std::shared_ptr<DbSession> spout)
+        : parser_(spout)
+    {
+        parser_.start();
+    }
+
+    virtual std::string parse(const Byte* data, size_t size) {
+        std::string response;
+        for (size_t pos = 0; pos < size;) {
+            auto buf = parser_.get_next_buffer();
+            u32 chunk = static_cast<u32>(std::min<size_t>(size - pos, ProtocolT::RDBUF_SIZE));
+            memcpy(buf, data + pos, chunk);
+            pos += chunk;
+            auto result = parser_.parse_next(buf, chunk);
+            if (result.is_available()) {
+                response += result.get_body();
+            }
+        }
+        return response;
+    }
+
+    virtual std::string error_repr(ErrorKind kind, std::string const& msg) const {
+        int code = ProtocolT::ERR;
+        if (kind == ErrorKind::DB) {
+            code = ProtocolT::DB;
+        } else if (kind == ErrorKind::PARSE) {
+            code = ProtocolT::PARSE;
+        }
+        return parser_.error_repr(code, msg);
+    }
+
+    virtual void close() {
+        parser_.close();
+    }
+};
+
+std::unique_ptr<UringSession> create_session(UringTcpServer::Protocol protocol, std::shared_ptr<DbSession> spout) {
+    std::unique_ptr<UringSession> result;
+    switch (protocol) {
+    case UringTcpServer::Protocol::RESP:
+        result.reset(new UringParserSession<RESPProtocolParser>(spout));
+        break;
+    case UringTcpServer::Protocol::OPENTSDB:
+        result.reset(new UringParserSession<OpenTSDBProtocolParser>(spout));
+        break;
+    case UringTcpServer::Protocol::INFLUX:
+        result.reset(new UringParserSession<InfluxProtocolParser>(spout));
+        break;
+    case UringTcpServer::Protocol::GRAPHITE:
+        result.reset(new UringParserSession<GraphiteProtocolParser>(spout));
+        break;
+    }
+    return result;
+}
+
+//! Kind of the operation, stored in the upper byte of the user data
+enum Op : u64 {
+    ACCEPT = 1,
+    RECV = 2,
+    SEND = 3,
+};
+
+const int OP_SHIFT = 56;
+const u64 ID_MASK = (1ull << OP_SHIFT) - 1;
+
+u64 make_user_data(Op op, u64 id) {
+    return (static_cast<u64>(op) << OP_SHIFT) | id;
+}
+
+struct Connection {
+    int                           fd;
+    std::unique_ptr<UringSession> session;
+    //! Responses, the first one is being sent
+    std::deque<std::string>       output;
+    //! Number of bytes of the first response that were sent
+    size_t                        sent;
+    //! Number of operations in flight (multishot receive counts as one)
+    int                           inflight;
+    //! Set if the connection should be closed after the output is sent
+    bool                          closing;
+    //! Set if the socket was shut down
+    bool                          shut;
+};
+
+}  // namespace
+
+//                      //
+//     Uring Worker     //
+//                      //
+
+struct UringTcpServer::Worker {
+    enum {
+        QUEUE_DEPTH = 1024,
+        NBUFFERS = 1024,        //< Number of provided buffers (power of two)
+        BUFFER_SIZE = 0x1000,   //< Size of the provided buffer
+        BUFFER_GROUP = 0,
+    };
+
+    io_uring                                         ring;
+    bool                                             ring_ready;
+    io_uring_buf_ring*                               bufring;
+    std::vector<Byte>                                buffers;
+    //! Listening sockets (indexes are the same as in `listeners_`)
+    std::vector<int>                                 sockets;
+    std::unordered_map<u64, std::unique_ptr<Connection>> connections;
+    u64                                              next_id;
+    u64                                              nobufs;  //< Number of receives that ran out of buffers
+
+    Worker()
+        : ring_ready(false)
+        , bufring(nullptr)
+        , next_id(0)
+        , nobufs(0)
+    {
+    }
+
+    ~Worker() {
+        release();
+    }
+
+    void init(std::vector<Listener> const& listeners) {
+        io_uring_params params = {};
+        // Completions are processed only when the worker enters the kernel anyway
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        int ret = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+        if (ret == -EINVAL) {
+            params = {};
+            ret = io_uring_queue_init_params(QUEUE_DEPTH, &ring, &params);
+        }
+        if (ret < 0) {
+            throw_error("can't create io_uring", -ret);
+        }
+        ring_ready = true;
+        buffers.resize(NBUFFERS * BUFFER_SIZE);
+        bufring = io_uring_setup_buf_ring(&ring, NBUFFERS, BUFFER_GROUP, 0, &ret);
+        if (bufring == nullptr) {
+            throw_error("can't register provided buffers", -ret);
+        }
+        for (u32 i = 0; i < NBUFFERS; i++) {
+            io_uring_buf_ring_add(bufring, buffers.data() + i*BUFFER_SIZE, BUFFER_SIZE, static_cast<unsigned short>(i),
+                                  io_uring_buf_ring_mask(NBUFFERS), static_cast<int>(i));
+        }
+        io_uring_buf_ring_advance(bufring, NBUFFERS);
+        for (auto const& listener: listeners) {
+            sockets.push_back(listen(listener.port));
+        }
+    }
+
+    void release() {
+        for (auto& kv: connections) {
+            kv.second->session->close();
+            ::close(kv.second->fd);
+        }
+        connections.clear();
+        if (ring_ready) {
+            if (bufring) {
+                io_uring_free_buf_ring(&ring, bufring, NBUFFERS, BUFFER_GROUP);
+                bufring = nullptr;
+            }
+            io_uring_queue_exit(&ring);
+            ring_ready = false;
+        }
+        for (auto fd: sockets) {
+            ::close(fd);
+        }
+        sockets.clear();
+    }
+
+    static void throw_error(const char* what, int err) {
+        std::stringstream fmt;
+        fmt << what << ": " << strerror(err);
+        std::runtime_error error(fmt.str());
+        BOOST_THROW_EXCEPTION(error);
+    }
+
+    static int listen(int port) {
+        int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw_error("can't create socket", errno);
+        }
+        int one = 1;
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<u16>(port));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+            bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(fd, SOMAXCONN) != 0)
+        {
+            int err = errno;
+            ::close(fd);
+            throw_error("can't listen on port", err);
+        }
+        return fd;
+    }
+
+    //! Get SQE, submit queued operations if the submission queue is full
+    io_uring_sqe* get_sqe() {
+        auto sqe = io_uring_get_sqe(&ring);
+        while (sqe == nullptr) {
+            io_uring_submit(&ring);
+            sqe = io_uring_get_sqe(&ring);
+        }
+        return sqe;
+    }
+
+    void arm_accept(size_t ix) {
+        auto sqe = get_sqe();
+        io_uring_prep_multishot_accept(sqe, sockets.at(ix), nullptr, nullptr, SOCK_CLOEXEC);
+        io_uring_sqe_set_data64(sqe, make_user_data(ACCEPT, ix));
+    }
+
+    void arm_recv(u64 id, Connection* conn) {
+        auto sqe = get_sqe();
+        io_uring_prep_recv_multishot(sqe, conn->fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        io_uring_sqe_set_data64(sqe, make_user_data(RECV, id));
+        conn->inflight++;
+    }
+
+    void arm_send(u64 id, Connection* conn) {
+        auto const& front = conn->output.front();
+        auto sqe = get_sqe();
+        io_uring_prep_send(sqe, conn->fd, front.data() + conn->sent, front.size() - conn->sent, MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, make_user_data(SEND, id));
+        conn->inflight++;
+    }
+
+    //! Queue the response, only one send is in flight at a time
+    void send(u64 id, Connection* conn, std::string response) {
+        conn->output.push_back(std::move(response));
+        if (conn->output.size() == 1) {
+            conn->sent = 0;
+            arm_send(id, conn);
+        }
+    }
+
+    //! Return provided buffer to the ring
+    void recycle(unsigned short bid) {
+        io_uring_buf_ring_add(bufring, buffers.data() + static_cast<size_t>(bid)*BUFFER_SIZE, BUFFER_SIZE, bid,
+                              io_uring_buf_ring_mask(NBUFFERS), 0);
+        io_uring_buf_ring_advance(bufring, 1);
+    }
+
+    /** Shut down the socket of the closing connection when its output is sent (this
+      * terminates the multishot receive) and close it when nothing is in flight.
+      */
+    void try_close(u64 id, Connection* conn) {
+        if (!conn->closing) {
+            return;
+        }
+        if (!conn->shut && conn->output.empty()) {
+            ::shutdown(conn->fd, SHUT_RDWR);
+            conn->shut = true;
+        }
+        if (conn->inflight == 0) {
+            conn->session->close();
+            ::close(conn->fd);
+            connections.erase(id);
+        }
+    }
+};
+
+//                       //
+//     Uring Server      //
+//                       //
+
+UringTcpServer::UringTcpServer(std::shared_ptr<DbConnection> connection, int nworkers, std::vector<Listener> listeners)
+    : connection_(connection)
+    , nworkers_(nworkers)
+    , listeners_(std::move(listeners))
+    , start_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_barrier_(static_cast<u32>(nworkers + 1))
+    , stop_{0}
+    , logger_("uring-server")
+{
+    logger_.info() << "io_uring TCP server created, concurrency: " << nworkers;
+}
+
+UringTcpServer::~UringTcpServer() {
+    logger_.info() << "io_uring TCP server destroyed";
+}
+
+void UringTcpServer::start(SignalHandler* sig, int id) {
+    // Rings and sockets are created before the workers so the errors are reported here
+    for (int i = 0; i < nworkers_; i++) {
+        std::unique_ptr<Worker> worker(new Worker());
+        worker->init(listeners_);
+        for (size_t ix = 0; ix < listeners_.size(); ix++) {
+            worker->arm_accept(ix);
+        }
+        workers_.push_back(std::move(worker));
+    }
+    for (auto const& listener: listeners_) {
+        logger_.info() << "Listening on port " << listener.port;
+    }
+    auto self = shared_from_this();
+    sig->add_handler(boost::bind(&UringTcpServer::stop, std::move(self)), id);
+
+    for (int i = 0; i < nworkers_; i++) {
+        std::thread thread(std::bind(&UringTcpServer::run, shared_from_this(), workers_.at(static_cast<size_t>(i)).get(), i));
+        thread.detach();
+    }
+    start_barrier_.wait();
+}
+
+void UringTcpServer::stop() {
+    // Workers notice the flag after the next wait
+    stop_.store(1, std::memory_order_seq_cst);
+    stop_barrier_.wait();
+    workers_.clear();
+    logger_.info() << "io_uring TCP server stopped";
+}
+
+void UringTcpServer::run(Worker* w, int ix) {
+#ifdef __gnu_linux__
+        // Name the thread
+        auto thread = pthread_self();
+        pthread_setname_np(thread, "TCP-uring");
+#endif
+    aku_apply_thread_policy(AKU_THREAD_INGESTION);
+    start_barrier_.wait();
+
+    auto on_accept = [this, w](io_uring_cqe* cqe, size_t lix) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // Multishot accept was terminated
+            w->arm_accept(lix);
+        }
+        if (cqe->res < 0) {
+            logger_.error() << "Accept error: " << strerror(-cqe->res);
+            return;
+        }
+        auto con = connection_.lock();
+        if (!con) {
+            logger_.error() << "Database was already closed";
+            ::close(cqe->res);
+            return;
+        }
+        std::unique_ptr<Connection> conn(new Connection());
+        conn->fd = cqe->res;
+        conn->session = create_session(listeners_.at(lix).protocol, con->create_session());
+        conn->sent = 0;
+        conn->inflight = 0;
+        conn->closing = false;
+        conn->shut = false;
+        u64 id = w->next_id++ & ID_MASK;
+        w->arm_recv(id, conn.get());
+        w->connections[id] = std::move(conn);
+    };
+
+    auto on_recv = [this, w](io_uring_cqe* cqe, u64 id, Connection* conn) {
+        bool more = cqe->flags & IORING_CQE_F_MORE;
+        if (!more) {
+            conn->inflight--;
+        }
+        if (cqe->res > 0) {
+            auto bid = static_cast<unsigned short>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (!conn->closing) {
+                const Byte* data = w->buffers.data() + static_cast<size_t>(bid)*Worker::BUFFER_SIZE;
+                typedef UringSession::ErrorKind ErrorKind;
+                std::string response;
+                bool failed = true;
+                ErrorKind kind = ErrorKind::ERR;
+                std::string error;
+                try {
+                    response = conn->session->parse(data, static_cast<size_t>(cqe->res));
+                    failed = false;
+                } catch (StreamError const& stream_error) {
+                    // This error is related to client so we need to send it back
+                    logger_.error() << stream_error.what();
+                    kind = ErrorKind::PARSE;
+                    error = stream_error.what();
+                } catch (DatabaseError const& dberr) {
+                    logger_.error() << boost::current_exception_diagnostic_information();
+                    kind = ErrorKind::DB;
+                    error = dberr.what();
+                } catch (...) {
+                    logger_.error() << boost::current_exception_diagnostic_information();
+                    error = boost::current_exception_diagnostic_information();
+                }
+                if (failed) {
+                    // Connection is closed after the error is sent back
+                    response += conn->session->error_repr(kind, error);
+                    conn->closing = true;
+                }
+                if (!response.empty()) {
+                    w->send(id, conn, std::move(response));
+                }
+            }
+            w->recycle(bid);
+            if (!more && !conn->closing) {
+                w->arm_recv(id, conn);
+            }
+        } else if (cqe->res == -ENOBUFS) {
+            // All buffers are in use, the worker will return them before the next wait
+            w->nobufs++;
+            if (!more && !conn->closing) {
+                w->arm_recv(id, conn);
+            }
+        } else {
+            if (cqe->res < 0 && cqe->res != -ECONNRESET) {
+                logger_.error() << "Receive error: " << strerror(-cqe->res);
+            }
+            // Connection closed by the client
+            conn->closing = true;
+        }
+    };
+
+    auto on_send = [this, w](io_uring_cqe* cqe, u64 id, Connection* conn) {
+        conn->inflight--;
+        if (cqe->res < 0) {
+            logger_.error() << "Error sending response to client: " << strerror(-cqe->res);
+            conn->output.clear();
+            conn->closing = true;
+            return;
+        }
+        conn->sent += static_cast<size_t>(cqe->res);
+        if (conn->sent == conn->output.front().size()) {
+            conn->output.pop_front();
+            conn->sent = 0;
+        }
+        if (!conn->output.empty()) {
+            w->arm_send(id, conn);
+        }
+    };
+
+    try {
+        logger_.info() << "Event loop " << ix << " started";
+        while (!stop_.load(std::memory_order_relaxed)) {
+            io_uring_cqe* cqe = nullptr;
+            __kernel_timespec ts = {};
+            ts.tv_nsec = WAIT_TIMEOUT_MS * 1000000ll;
+            // Everything queued by the previous iteration is submitted by one call
+            int ret = io_uring_submit_and_wait_timeout(&w->ring, &cqe, 1, &ts, nullptr);
+            if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+                logger_.error() << "Event loop " << ix << " error: " << strerror(-ret);
+                break;
+            }
+            unsigned head;
+            unsigned count = 0;
+            io_uring_for_each_cqe(&w->ring, head, cqe) {
+                count++;
+                u64 data = io_uring_cqe_get_data64(cqe);
+                u64 id = data & ID_MASK;
+                auto op = static_cast<Op>(data >> OP_SHIFT);
+                if (op == ACCEPT) {
+                    on_accept(cqe, static_cast<size_t>(id));
+                    continue;
+                }
+                auto it = w->connections.find(id);
+                if (it == w->connections.end()) {
+                    continue;
+                }
+                auto conn = it->second.get();
+                if (op == RECV) {
+                    on_recv(cqe, id, conn);
+                } else {
+                    on_send(cqe, id, conn);
+                }
+                w->try_close(id, conn);
+            }
+            io_uring_cq_advance(&w->ring, count);
+        }
+        logger_.info() << "Event loop " << ix << " stopped, " << w->nobufs << " receives ran out of buffers";
+    } catch (...) {
+        logger_.error() << "Error in event loop " << ix << ": " << boost::current_exception_diagnostic_information();
+    }
+    w->release();
+    stop_barrier_.wait();
+}
+
+}
+
+#endif
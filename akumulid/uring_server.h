@@ -0,0 +1,99 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef AKU_WITH_URING
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread/barrier.hpp>
+
+#include "ingestion_pipeline.h"
+#include "logger.h"
+#include "server.h"
+
+
+namespace Akumuli {
+
+/** TCP server that uses io_uring instead of boost.asio (alternative backend
+  * of the TCP server).
+  * Every worker owns its ring, SO_REUSEPORT listening socket for every port (the
+  * kernel balances the connections between the workers) and a ring of provided
+  * buffers. Connections are accepted using multishot accept and read using
+  * multishot receive, the kernel picks the buffer for every completion. Data is
+  * copied from the provided buffer into the parser's buffer and the provided
+  * buffer is returned to the ring. Operations queued while the completions are
+  * processed are submitted at once.
+  * Requires Linux 6.0 or newer.
+  */
+class UringTcpServer : public std::enable_shared_from_this<UringTcpServer>, public Server {
+public:
+    enum class Protocol {
+        RESP,
+        OPENTSDB,
+        INFLUX,
+        GRAPHITE,
+    };
+
+    struct Listener {
+        int      port;
+        Protocol protocol;
+    };
+
+private:
+    struct Worker;
+
+    std::weak_ptr<DbConnection>          connection_;
+    const int                            nworkers_;
+    const std::vector<Listener>          listeners_;
+    boost::barrier                       start_barrier_;  //< Barrier to start worker thread
+    boost::barrier                       stop_barrier_;   //< Barrier to stop worker thread
+    std::atomic<int>                     stop_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    Logger logger_;
+
+    //! Max wait time, defines how fast the workers react to stop
+    static const int WAIT_TIMEOUT_MS = 100;
+
+public:
+    /** C-tor.
+      * @param connection is a database connection
+      * @param nworkers is a number of workers (every worker has its own ring)
+      * @param listeners is a list of ports and protocols
+      */
+    UringTcpServer(std::shared_ptr<DbConnection> connection, int nworkers, std::vector<Listener> listeners);
+
+    ~UringTcpServer();
+
+    //! Create rings and listening sockets and start the workers
+    virtual void start(SignalHandler* sig, int id);
+
+private:
+    //! Stop the workers (should be called from signal handler)
+    void stop();
+
+    //! Event loop of the worker
+    void run(Worker* worker, int ix);
+};
+
+}  // namespace
+
+#endif
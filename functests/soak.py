@@ -0,0 +1,215 @@
+"""Soak test: long running ingestion with series churn and query mix.
+
+Writer process sends data through TCP at the target rate, part of the series
+is replaced by the new ones every churn period (old series stop receiving data).
+Reader process runs a mix of queries (select, aggregate, group-aggregate) in a loop.
+Memory usage of the server (RSS, allocator counters, write buffers) and query
+latencies are sampled periodically and printed as JSON lines. At the end the
+trend of every sampled value is computed (least squares fit, warmup samples are
+skipped) and the values that grew more than the threshold are reported.
+Series index grows with every churn period, use `--churn 0` to exclude it.
+
+Usage:
+    python soak.py <path-to-akumulid-dir> [--duration HOURS] [--interval SEC] ...
+
+Use DEBUG instead of the path to attach to the running server.
+Exit code is 1 if any upward trend was detected.
+"""
+from __future__ import print_function
+import akumulid_test_tools as att
+import argparse
+import datetime
+import json
+import multiprocessing
+import random
+import sys
+import time
+import traceback
+try:
+    from urllib2 import urlopen
+except ImportError:
+    from urllib import urlopen
+
+HOST = '127.0.0.1'
+TCPPORT = 8282
+HTTPPORT = 8181
+
+# Sampled values, (name, path in the stats document)
+MEMORY_STATS = [
+    ("rss", "process.rss"),
+    ("allocator_active", "allocator.active"),
+    ("allocator_resident", "allocator.resident"),
+    ("write_buffers", "memory.write_buffers"),
+    ("memory_total", "memory.total"),
+]
+
+def series_name(ix, generation):
+    return "soak.cpu host=h{0}-g{1} group=g{2}".format(ix, generation, ix % 10)
+
+def writer(args, done):
+    """Send data at the target rate, replace `churn` part of the series every churn period"""
+    try:
+        chan = att.TCPChan(HOST, TCPPORT)
+        generations = [0]*args.series
+        generation = 0
+        last_churn = time.time()
+        batch = 100
+        period = float(batch) / args.rate
+        value = 0
+        while not done.is_set():
+            start = time.time()
+            if start - last_churn > args.churn_period:
+                generation += 1
+                for ix in random.sample(range(args.series), int(args.series*args.churn)):
+                    generations[ix] = generation
+                last_churn = start
+            ts = datetime.datetime.utcnow().strftime('%Y%m%dT%H%M%S.%f')
+            lines = []
+            for i in range(batch):
+                ix = (value + i) % args.series
+                lines.append("+{0}\r\n+{1}\r\n+{2}\r\n".format(series_name(ix, generations[ix]), ts, float(value + i)))
+            chan.send(''.join(lines))
+            value += batch
+            elapsed = time.time() - start
+            if elapsed < period:
+                time.sleep(period - elapsed)
+        chan.close()
+    except:
+        print("Exception in writer")
+        traceback.print_exc()
+        raise
+
+def make_queries():
+    end = datetime.datetime.utcnow()
+    begin = end - datetime.timedelta(minutes=10)
+    return [
+        ("select", att.make_select_query("soak.cpu", end - datetime.timedelta(minutes=1), end,
+                                         where={"group": ["g{0}".format(random.randint(0, 9))]})),
+        ("aggregate", att.make_aggregate_query("soak.cpu", begin, end, "max")),
+        ("group-aggregate", att.make_group_aggregate_query("soak.cpu", begin, end, ["min", "max"], "1m")),
+    ]
+
+def reader(latencies, done):
+    """Run the query mix in a loop, send (query name, latency) to the queue"""
+    queryurl = "http://{0}:{1}/api/query".format(HOST, HTTPPORT)
+    while not done.is_set():
+        for name, query in make_queries():
+            start = time.time()
+            try:
+                response = urlopen(queryurl, json.dumps(query))
+                for _ in response:
+                    pass
+                latencies.put((name, time.time() - start))
+            except:
+                latencies.put((name, None))
+        time.sleep(1)
+
+def get_stats():
+    response = urlopen("http://{0}:{1}/api/stats".format(HOST, HTTPPORT))
+    return json.loads(response.read())
+
+def lookup(stats, path):
+    node = stats
+    for key in path.split('.'):
+        if not isinstance(node, dict) or key not in node:
+            return None
+        node = node[key]
+    return float(node)
+
+def percentile(values, q):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(int(q*(len(values) - 1) + 0.5), len(values) - 1)]
+
+def trend(points):
+    """Least squares fit, returns relative growth over the sampled period"""
+    if len(points) < 3:
+        return None
+    n = float(len(points))
+    mx = sum(x for x, _ in points)/n
+    my = sum(y for _, y in points)/n
+    sxx = sum((x - mx)**2 for x, _ in points)
+    if sxx == 0 or my == 0:
+        return None
+    slope = sum((x - mx)*(y - my) for x, y in points)/sxx
+    start = my - slope*(mx - points[0][0])
+    if start <= 0:
+        return None
+    return slope*(points[-1][0] - points[0][0])/start
+
+def main(path, args):
+    akumulid = att.create_akumulid(path)
+    if path != "DEBUG":
+        akumulid.delete_database()
+        akumulid.create_database()
+        akumulid.serve()
+        time.sleep(5)
+    done = multiprocessing.Event()
+    latencies = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=writer, args=(args, done)),
+             multiprocessing.Process(target=reader, args=(latencies, done))]
+    for proc in procs:
+        proc.start()
+    samples = []
+    nerrors = 0
+    try:
+        begin = time.time()
+        while time.time() - begin < args.duration*3600:
+            time.sleep(args.interval)
+            lat = {}
+            while not latencies.empty():
+                name, value = latencies.get()
+                if value is None:
+                    nerrors += 1
+                else:
+                    lat.setdefault(name, []).append(value)
+            stats = get_stats()
+            sample = {"time": round(time.time() - begin, 1),
+                      "series": lookup(stats, "series.count"),
+                      "query_errors": nerrors}
+            for name, stat in MEMORY_STATS:
+                sample[name] = lookup(stats, stat)
+            for name, values in lat.items():
+                sample[name + "_p50_ms"] = percentile(values, 0.5)*1000.0
+                sample[name + "_p99_ms"] = percentile(values, 0.99)*1000.0
+            samples.append(sample)
+            print(json.dumps(sample))
+            sys.stdout.flush()
+    finally:
+        done.set()
+        for proc in procs:
+            proc.join()
+        if path != "DEBUG":
+            akumulid.stop()
+    # Trends of the memory usage and query latency
+    tracked = [name for name, _ in MEMORY_STATS] + \
+              [name + "_p99_ms" for name, _ in make_queries()]
+    growth = {}
+    flagged = []
+    for name in tracked:
+        points = [(s["time"], s[name]) for s in samples[args.warmup:] if s.get(name) is not None]
+        value = trend(points)
+        if value is None:
+            continue
+        growth[name] = round(value, 4)
+        if value > args.threshold:
+            flagged.append(name)
+    summary = {"samples": len(samples), "query_errors": nerrors, "growth": growth,
+               "flagged": flagged, "success": not flagged}
+    print(json.dumps({"summary": summary}))
+    return 0 if not flagged else 1
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="akumulid soak test")
+    parser.add_argument("path", help="path to akumulid directory or DEBUG")
+    parser.add_argument("--duration", type=float, default=4.0, help="test duration in hours")
+    parser.add_argument("--interval", type=float, default=60.0, help="sampling interval in seconds")
+    parser.add_argument("--series", type=int, default=10000, help="number of active series")
+    parser.add_argument("--rate", type=float, default=100000.0, help="ingestion rate (points per second)")
+    parser.add_argument("--churn", type=float, default=0.1, help="part of the series replaced every churn period")
+    parser.add_argument("--churn-period", type=float, default=600.0, help="churn period in seconds")
+    parser.add_argument("--warmup", type=int, default=5, help="number of samples not used to compute the trend")
+    parser.add_argument("--threshold", type=float, default=0.1, help="max relative growth over the test duration")
+    args = parser.parse_args()
+    sys.exit(main(args.path, args))
@@ -1,9 +1,28 @@
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include "datetime.h"
 
 using namespace Akumuli;
 
+//! Convert "YYYYMMDDTHHMMSS.fffffffff" to "YYYY-MM-DDTHH:MM:SS.fffffffffZ"
+static std::string to_rfc3339(const char* basic) {
+    std::string res(basic, 4);
+    res += '-';
+    res.append(basic + 4, 2);
+    res += '-';
+    res.append(basic + 6, 2);
+    res += 'T';
+    res.append(basic + 9, 2);
+    res += ':';
+    res.append(basic + 11, 2);
+    res += ':';
+    res.append(basic + 13);
+    res += 'Z';
+    return res;
+}
+
 int main(int argc, char** argv) {
     if (argc == 1) {
         return 1;
@@ -12,10 +31,32 @@ int main(int argc, char** argv) {
     std::fstream input(file_name, std::ios::binary|std::ios::in|std::ios::out);
 
     for (std::string line; std::getline(input, line);) {
+        aku_Timestamp ts;
         try {
-            DateTimeUtil::from_iso_string(line.c_str());
+            ts = DateTimeUtil::from_iso_string(line.c_str());
         } catch(BadDateTimeFormat const&) {
             continue;
         }
+        // Parsed value should survive the round trip through both formats.
+        // Fast path and cached hour prefix are used for the same input.
+        const aku_Timestamp MAX_TS = 7258118400ul*1000000000ul;  // 2200-01-01
+        char buffer[100];
+        if (ts >= MAX_TS || DateTimeUtil::to_iso_string(ts, buffer, sizeof(buffer)) <= 0) {
+            continue;
+        }
+        try {
+            if (DateTimeUtil::from_iso_string(buffer) != ts) {
+                std::cerr << "Basic format mismatch: " << line << " -> " << buffer << std::endl;
+                abort();
+            }
+            auto rfc = to_rfc3339(buffer);
+            if (DateTimeUtil::from_iso_string(rfc.c_str()) != ts) {
+                std::cerr << "RFC 3339 mismatch: " << line << " -> " << rfc << std::endl;
+                abort();
+            }
+        } catch(BadDateTimeFormat const& e) {
+            std::cerr << "Can't parse formatted timestamp: " << line << " -> " << e.what() << std::endl;
+            abort();
+        }
     }
 }
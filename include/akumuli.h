@@ -56,6 +56,11 @@ typedef struct { size_t padding; } aku_Cursor;
  */
 typedef struct { size_t padding; } aku_Session;
 
+/**
+ * @brief Query that can be executed many times using different time ranges
+ */
+typedef struct { size_t padding; } aku_PreparedQuery;
+
 
 //! Search stats
 typedef struct {
@@ -140,6 +145,20 @@ AKU_EXPORT aku_Status aku_create_database_ex(const char* base_file_name, const c
                                              const char* volumes_path, i32 num_volumes,
                                              u64 page_size, bool allocate);
 
+/**
+ * @brief Creates storage for new database with the custom NB+tree fanout
+ * Small fanout makes the superblocks smaller and the tree deeper. Fanout is stored in
+ * the database and can't be changed after creation.
+ * @param base_file_name database file name (excl suffix)
+ * @param metadata_path path to metadata file
+ * @param volumes_path path to volumes
+ * @param num_volumes number of volumes to create
+ * @param fanout is a max number of children of the superblock, from 4 to 42 (0 - default)
+ */
+AKU_EXPORT aku_Status aku_create_database_with_fanout(const char* base_file_name, const char* metadata_path,
+                                                      const char* volumes_path, i32 num_volumes,
+                                                      u64 page_size, bool allocate, u32 fanout);
+
 
 /** Remove all volumes.
   * @param file_name
@@ -161,12 +180,103 @@ AKU_EXPORT aku_Database* aku_open_database(const char* path, aku_FineTuneParams
 AKU_EXPORT void aku_close_database(aku_Database* db);
 
 
+/** Set retention period of the metric. Data points older than retention period
+  * are not returned by queries.
+  * @param db is an opened database
+  * @param metric is a metric name
+  * @param retention is a retention period in nanoseconds (0 - disable retention)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_set_retention(aku_Database* db, const char* metric, aku_Timestamp retention);
+
+
+/** Set max number of series of the metric. New series of the metric are rejected
+  * with AKU_ESERIES_LIMIT error when the limit is reached. Global limit is set
+  * using `max_series` parameter.
+  * @param db is an opened database
+  * @param metric is a metric name
+  * @param limit is a max number of series (0 - disable limit)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_set_series_limit(aku_Database* db, const char* metric, u64 limit);
+
+/** Set quota of the tenant namespace (see `aku_create_tenant_session`). New series
+  * are rejected with AKU_ESERIES_LIMIT error when the series limit or the memory limit
+  * is reached, samples that exceed the ingest rate are rejected with AKU_EBUSY error.
+  * Quota is not persisted, `tenant_*` parameters are used after restart.
+  * @param db is an opened database
+  * @param tenant is a tenant name
+  * @param max_series is a max number of series (0 - unlimited)
+  * @param memory_limit is a memory limit of the index and write buffers (0 - unlimited)
+  * @param ingest_rate is a max number of samples written per second (0 - unlimited)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_set_tenant_quota(aku_Database* db, const char* tenant, u64 max_series,
+                                           u64 memory_limit, u64 ingest_rate);
+
+
+/** Set precision hint of the metric. New values of the metric are rounded to `digits`
+  * decimal digits after the point (lossy), this makes them much more compressible.
+  * Setting is persisted.
+  * @param db is an opened database
+  * @param metric is a metric name
+  * @param digits is a number of decimal digits, up to 9 (negative - disable rounding)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_set_precision(aku_Database* db, const char* metric, int digits);
+
+
+/** Store values of the metric only when they change. Repeated value is not stored if
+  * the last stored value of the series is younger than `heartbeat`, queries see the
+  * stored values as a step function (use `"fill": "prev"` in group-aggregate query to
+  * fill the empty buckets). Setting is persisted.
+  * @param db is an opened database
+  * @param metric is a metric name
+  * @param heartbeat is a max interval between the stored values (0 - store every value)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_set_change_only(aku_Database* db, const char* metric, aku_Timestamp heartbeat);
+
+
+/** Delete all series that match the search query. Deleted series are not returned
+  * by queries, space used by them is reclaimed in background. New values with the
+  * same series names create new series.
+  * @param db is an opened database
+  * @param query is a search query (JSON), the same as in `aku_search`
+  * @param count receives number of deleted series (can be null)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_delete_series(aku_Database* db, const char* query, u64* count);
+
+
+/** Write online backup of the database. Full backup contains all blocks and metadata,
+  * incremental backup contains blocks appended after the base backup and names of
+  * the series created after it. Metadata of the tenants is always copied in full.
+  * Database can be used while the backup is written.
+  * @param db is an opened database
+  * @param dest is a path to the new backup directory
+  * @param base is a path to the previous backup (null - full backup)
+  * @param rate is a max write rate in bytes per second (0 - unlimited)
+  * @returns operation status
+  */
+AKU_EXPORT aku_Status aku_backup(aku_Database* db, const char* dest, const char* base, u64 rate);
+
+
 //-----------
 // Ingestion
 //-----------
 
 AKU_EXPORT aku_Session* aku_create_session(aku_Database* db);
 
+/** Create session of the tenant namespace. Every tenant has its own series index
+  * and column store on top of the shared volumes, queries of the session only see
+  * series of the tenant. Tenant is created if it doesn't exist.
+  * @param db is an opened database
+  * @param tenant is a tenant name (latin letters, digits, '-' and '_')
+  * @return session or NULL if the name is invalid or the tenant can't be created
+  */
+AKU_EXPORT aku_Session* aku_create_tenant_session(aku_Database* db, const char* tenant);
+
 AKU_EXPORT void aku_destroy_session(aku_Session* stream);
 
 //---------
@@ -231,6 +341,29 @@ AKU_EXPORT aku_Status aku_write_double_raw(aku_Session* session, aku_ParamId par
   */
 AKU_EXPORT aku_Status aku_write(aku_Session* ist, const aku_Sample* sample);
 
+/** Write several measurements to DB at once
+  * @param ist is an opened ingestion stream
+  * @param samples is an array of valid measurements
+  * @param size is a size of the array
+  * @returns operation status (status of the first failed write if some samples
+  *          can't be written, all other samples are written anyway)
+  */
+AKU_EXPORT aku_Status aku_write_batch(aku_Session* ist, const aku_Sample* samples, size_t size);
+
+/** Import ordered range of values of the single series. This is a bulk
+  * import path, it doesn't require session and writes values directly to
+  * the column.
+  * @param db is an opened database
+  * @param begin should point to the begining of the series name
+  * @param end should point to the next after end character of the series name
+  * @param timestamps is an array of timestamps (should be sorted)
+  * @param values is an array of values
+  * @param size is a size of both arrays
+  * @returns operation status (nothing is written if AKU_ELATE_WRITE is returned)
+  */
+AKU_EXPORT aku_Status aku_import_series(aku_Database* db, const char* begin, const char* end,
+                                        const aku_Timestamp* timestamps, const double* values, size_t size);
+
 
 //---------
 // Queries
@@ -257,6 +390,59 @@ AKU_EXPORT aku_Cursor* aku_suggest(aku_Session* session, const char* query);
   */
 AKU_EXPORT aku_Cursor* aku_search(aku_Session* session, const char* query);
 
+/** @brief Register continuous query
+  * Cursor receives complete buckets of the group-aggregate query as new values
+  * are written. Cursor is never done until the end of the query range is reached,
+  * `aku_cursor_read` returns zero if there is no new data yet. Query is removed
+  * when the cursor is closed.
+  * @param sesson should point to opened session instance
+  * @param query should contain valid group-aggregate query
+  * @return cursor instance
+  */
+AKU_EXPORT aku_Cursor* aku_subscribe(aku_Session* session, const char* query);
+
+/** @brief Prepare query for repeated execution
+  * Query is parsed and its series are resolved once. Series ids are resolved again
+  * on execution if new series were added to the database. Prepared query doesn't
+  * depend on the session and can be executed using any session of the database.
+  * @param session should point to opened session instance
+  * @param query should contain valid select, aggregate, group-aggregate or join query
+  * @param out_error_or_null receives error code (AKU_EBAD_ARG if query can't be prepared)
+  * @return prepared query or NULL on error
+  */
+AKU_EXPORT aku_PreparedQuery* aku_prepare(aku_Session* session, const char* query, aku_Status* out_error_or_null);
+
+/** @brief Execute prepared query
+  * Time range of the query is replaced with the new one, the rest of the query
+  * is not changed. Returned cursor should be closed using `aku_cursor_close`.
+  * @param session should point to opened session instance
+  * @param query should point to prepared query
+  * @param begin is a beginning of the query range
+  * @param end is an end of the query range (can be less than `begin` to read data backward)
+  * @return cursor instance
+  */
+AKU_EXPORT aku_Cursor* aku_execute(aku_Session* session, aku_PreparedQuery* query, aku_Timestamp begin, aku_Timestamp end);
+
+/** @brief Execute prepared select query incrementally
+  * Every series is read starting from the value that follows the last value returned
+  * by the previous poll (or from `begin` if nothing was returned yet). Token for the
+  * next poll is available when the cursor is done (see `aku_cursor_resume_token`).
+  * Query shouldn't use group-by or compare statements.
+  * @param session should point to opened session instance
+  * @param query should point to prepared query
+  * @param begin is a beginning of the query range
+  * @param end is an end of the query range (should be greater than `begin`)
+  * @param resume_token is a token returned by the previous poll (empty string for the first poll)
+  * @return cursor instance
+  */
+AKU_EXPORT aku_Cursor* aku_poll(aku_Session* session, aku_PreparedQuery* query, aku_Timestamp begin, aku_Timestamp end,
+                                const char* resume_token);
+
+/** @brief Destroy prepared query
+  * Cursors that were created using this query are not affected.
+  */
+AKU_EXPORT void aku_destroy_prepared(aku_PreparedQuery* query);
+
 /**
  * @brief Close cursor
  * @param pcursor pointer to cursor
@@ -271,12 +457,53 @@ AKU_EXPORT void aku_cursor_close(aku_Cursor* pcursor);
   */
 AKU_EXPORT size_t aku_cursor_read(aku_Cursor* cursor, void* dest, size_t dest_size);
 
+/** Read the values under cursor without waiting for the results that are not
+  * computed yet. Can be mixed with `aku_cursor_read`.
+  * @param cursor should point to active cursor instance
+  * @param dest is an output buffer
+  * @param dest_size is an output buffer size
+  * @returns number of overwriten bytes, zero if nothing is ready yet (the cursor
+  *          is not done until `aku_cursor_is_done` says so)
+  */
+AKU_EXPORT size_t aku_cursor_read_nowait(aku_Cursor* cursor, void* dest, size_t dest_size);
+
+/** Read the values under cursor in columnar form without copying them into
+  * the caller's buffer. Can be mixed with `aku_cursor_read`.
+  * @param cursor should point to active cursor instance
+  * @param batch receives arrays owned by the cursor, they stay valid until the
+  *        next call or until the cursor is closed, `batch->size` is zero if the
+  *        cursor is done
+  * @returns AKU_SUCCESS or AKU_EBAD_DATA if the next value is not a scalar
+  *          (tuple), it should be read using `aku_cursor_read`
+  */
+AKU_EXPORT aku_Status aku_cursor_next_batch(aku_Cursor* cursor, aku_Batch* batch);
+
 //! Check cursor state. Returns zero value if not done yet, non zero value otherwise.
 AKU_EXPORT int aku_cursor_is_done(aku_Cursor* pcursor);
 
 //! Check cursor error state. Returns zero value if everything is OK, non zero value otherwise.
 AKU_EXPORT int aku_cursor_is_error(aku_Cursor* pcursor, aku_Status* out_error_code_or_null);
 
+/** Get execution profile of the query (JSON object), profile is available when the
+  * cursor is done if the query has `"profile": true` field.
+  * @return profile size (zero if there is no profile) or negative value (required size) if buffer is too small
+  */
+AKU_EXPORT int aku_cursor_profile(aku_Cursor* pcursor, char* buffer, size_t size);
+
+/** Get resume token of the incremental query (see `aku_poll` and `resume` query field),
+  * token is available when the cursor is done.
+  * @return token size (zero if there is no token) or negative value (required size) if buffer is too small
+  */
+AKU_EXPORT int aku_cursor_resume_token(aku_Cursor* pcursor, char* buffer, size_t size);
+
+/** Limit the amount of results computed ahead of the reader. Query execution is
+  * paused when the limit is reached and resumed when the reader drains the buffered
+  * results. Slow readers can use small limit to reduce memory usage, fast readers
+  * can use large limit to avoid stalls.
+  * @param nbytes is a max size of the buffered results, zero - default limit
+  */
+AKU_EXPORT void aku_cursor_set_prefetch(aku_Cursor* pcursor, size_t nbytes);
+
 /** Convert timestamp to string if possible, return string length
   * @return 0 on bad string, -LEN if buffer is too small, LEN on success
   */
@@ -314,6 +541,44 @@ AKU_EXPORT void aku_debug_print(aku_Database* db);
 
 AKU_EXPORT int aku_json_stats(aku_Database* db, char* buffer, size_t size);
 
+/** Get counters and latency histograms in Prometheus text format.
+  * @param db database instance.
+  * @param buffer destination buffer
+  * @param size size of the buffer
+  * @return number of bytes written or negative value (required size) if buffer is too small
+  */
+AKU_EXPORT int aku_prometheus_metrics(aku_Database* db, char* buffer, size_t size);
+
+/** Account memory allocated by the application on behalf of the database (e.g. network
+  * buffers). Memory counters are global and are reported by `aku_json_stats` and
+  * `aku_prometheus_metrics`, they're also taken into account by the memory limit.
+  * @param subsystem is a subsystem that owns the memory
+  * @param delta is a number of allocated (positive) or freed (negative) bytes
+  */
+AKU_EXPORT void aku_memory_add(aku_MemorySubsystem subsystem, i64 delta);
+
+/** Bind calling thread to the CPUs of the NUMA node. Memory allocated by the thread
+  * afterwards (e.g. sessions and leaf nodes of the series written by it) is placed on
+  * this node by the kernel.
+  * @param node is a node index, wraps around the number of nodes
+  * @return index of the node or -1 if the thread can't be bound
+  */
+AKU_EXPORT int aku_numa_bind_thread(int node);
+
+/** Set CPU affinity and scheduling priority of the threads with the role. Policy is
+  * applied by the threads when they start (see `aku_apply_thread_policy`), threads that
+  * are already running are not affected.
+  * @param role is a thread role
+  * @param cpus is a set of cores in the cpulist format (e.g. "0-3,8"), NULL or empty
+  *        string - threads are not pinned
+  * @param nice is a nice value of the threads (negative values require CAP_SYS_NICE)
+  * @return AKU_EBAD_ARG if the role or the core set is invalid
+  */
+AKU_EXPORT aku_Status aku_set_thread_policy(aku_ThreadRole role, const char* cpus, int nice);
+
+//! Apply policy of the role to the calling thread
+AKU_EXPORT void aku_apply_thread_policy(aku_ThreadRole role);
+
 /** Get global resource value by name
   */
 AKU_EXPORT aku_Status aku_get_resource(const char* res_name, char* buf, size_t* bufsize);
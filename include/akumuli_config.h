@@ -28,6 +28,15 @@
 #define AKU_DURABILITY_SPEED_TRADEOFF 2
 #define AKU_MAX_WRITE_SPEED 4
 
+// Values for checksum_policy parameter
+#define AKU_CHECKSUM_EVERY_READ 0  // default value
+#define AKU_CHECKSUM_FIRST_READ 1
+
+// Values for volume_access_pattern parameter
+#define AKU_ACCESS_NORMAL 0  // default value
+#define AKU_ACCESS_RANDOM 1
+#define AKU_ACCESS_SEQUENTIAL 2
+
 
 // Log levels
 typedef enum {
@@ -54,10 +63,14 @@ typedef struct {
     //! Pointer to logging function, can be null
     aku_logger_cb_t logger;
 
-    //! 0 - huge tlbs disabled, other value - enabled
+    //! 0 - huge tlbs disabled, other value - memory mapped volumes use transparent huge pages if possible
     u32 enable_huge_tlb;
 
-    //! Consistency-speed tradeoff, 1 - max durability, 2 - tradeoff some durability for speed, 4 - max speed
+    /** Consistency-speed tradeoff, 1 - max durability (every block is written immediately),
+      * 2 - tradeoff some durability for speed (blocks are buffered, the volume is synced on
+      * write if the flush interval has passed since the last sync), 4 - max speed (blocks
+      * are buffered and synced on commit)
+      */
     u32 durability;
 
     //! Number of data points that should be stored in one compressed chunk
@@ -66,7 +79,154 @@ typedef struct {
     //! Windth of the sliding window
     u64 window_size;
 
-    //! Cache size limit
+    //! Block cache size limit in bytes (0 - use default value)
     u64 max_cache_size;
 
+    /** Comma separated list of rollup tier widths (e.g. "1m,1h,24h"), can be null.
+      * Group-aggregate queries with the step that is a multiple of the tier's width
+      * use precomputed aggregates.
+      */
+    const char* rollup_tiers;
+
+    //! Group-aggregate results cache size limit in bytes (0 - cache disabled)
+    u64 query_cache_size;
+
+    /** Block checksum verification policy, 0 - checksum is verified on every read,
+      * 1 - checksum is verified only on the first read of the block after open
+      */
+    u32 checksum_policy;
+
+    //! Max number of series in the database (0 - unlimited), per-metric limits are set using `aku_set_series_limit`
+    u64 max_series;
+
+    /** Memory budget for the leaf nodes that are not committed yet in bytes (0 - unlimited).
+      * Leaf nodes of the least recently written series are committed early when the budget is exceeded.
+      */
+    u64 write_buffer_budget;
+
+    /** Number of the latest values of every series that are buffered and sorted before
+      * they're written (0 - values should be written in order). Value that is older than
+      * the last value moved out of the buffer is rejected. Buffered values are not visible to queries.
+      */
+    u32 reorder_window;
+
+    /** Fill factor of the leaf nodes (between 0 and 1) below which the series is rewritten
+      * by the background compaction (0 - compaction disabled).
+      */
+    double compaction_min_fill;
+
+    /** Path to the archive directory (can be a mount point of the slow or remote
+      * storage). Full volumes are copied there before reuse and old blocks can be
+      * read back from the archive (NULL - archive disabled).
+      */
+    const char* archive_path;
+
+    //! Max number of volumes in the archive (0 - unlimited)
+    u32 archive_capacity;
+
+    /** Path to the input log directory (NULL - input log disabled). Values that are not
+      * committed to disk yet are written to the log and restored on startup after crash.
+      * Only values of the series that were synced with the metadata storage can be restored.
+      */
+    const char* input_log_path;
+
+    //! Number of input log files that are written in parallel (0 - one file)
+    u32 input_log_concurrency;
+
+    /** Size of the input log in bytes after which all leaf nodes are committed and
+      * the log is truncated (0 - default value).
+      */
+    u64 input_log_max_size;
+
+    /** Memory limit in bytes (0 - unlimited), see `aku_memory_add`. When the memory used by
+      * the database exceeds the limit new queries are rejected with AKU_ENO_MEM error and
+      * leaf nodes of the least recently written series are committed early.
+      */
+    u64 memory_limit;
+
+    /** Readahead policy of the volumes, AKU_ACCESS_RANDOM disables kernel readahead (range
+      * scans still prefetch the child nodes), AKU_ACCESS_SEQUENTIAL makes it more aggressive.
+      */
+    u32 volume_access_pattern;
+
+    //! 0 - disabled, other value - memory mapping of the current volume is locked in RAM
+    u32 lock_current_volume;
+
+    /** 0 - disabled, other value - volumes bypass the OS page cache (O_DIRECT) and the block
+      * cache (max_cache_size) becomes the only cache of the volume data.
+      */
+    u32 direct_io;
+
+    /** Age of the values (the difference with the last timestamp of the series) after which
+      * they're repacked by the background compaction into the deflated leaf nodes that take
+      * less space but are slower to read (0 - disabled).
+      */
+    u64 recompression_age;
+
+    /** Number of values per series that are buffered uncompressed and compressed by the
+      * background workers instead of the writer thread (0 - disabled). Buffered values
+      * are not visible to queries until the flush. Not used if `reorder_window` is set.
+      */
+    u32 write_ring_size;
+
+    //! Number of the background compression threads (0 - half of the available cores)
+    u32 compression_workers;
+
+    /** 0 - disabled, other value - the block cache is partitioned by NUMA node and every
+      * thread uses the partition of its own node (see `aku_numa_bind_thread`).
+      */
+    u32 numa_aware;
+
+    /** Memory budget of a single query in bytes (0 - default value, 1GB). Merges that don't
+      * fit into the budget are spilled to temporary files, other operators use smaller
+      * buffers or fail with AKU_ENO_MEM error.
+      */
+    u64 query_memory_limit;
+
+    /** Number of empty volumes that are created in background before they're needed
+      * (0 - disabled, new volume is created by the writer when the last one becomes full).
+      * Spare volumes are preallocated (fallocate). Only used by the expandable storage.
+      */
+    u32 spare_volumes;
+
+    /** 0 - disabled, other value - database is opened read-only. Volumes are memory mapped
+      * read-only, crash recovery, the input log and the sync worker are skipped and writes
+      * are rejected with AKU_ENOT_PERMITTED. Used to serve queries from a copy or a
+      * filesystem snapshot of the database.
+      */
+    u32 read_only;
+
+    /** Max number of the hot block addresses that are saved periodically and on close
+      * (0 - disabled). Blocks from the list are loaded into the block cache in background
+      * on the next open so the latency of the first queries after restart stays close to
+      * the steady state. Only the blocks that are cached (see `max_cache_size`) are recorded.
+      */
+    u32 warmup_blocks;
+
+    /** Max number of blocks per series that are loaded into the block cache in background
+      * when the query pattern is detected (0 - disabled). If the query range is adjacent to
+      * the previous range of the series (pan) or contains it (zoom out) the next range in
+      * the same direction is prefetched.
+      */
+    u32 prefetch_blocks;
+
+    /** Max number of metrics that have their series index built (0 - index everything).
+      * If set, posting lists of the metric are built on first query that uses it and
+      * dropped when the metric wasn't queried for a while, so the memory used by the
+      * index depends on the queried metrics and not on the number of series written.
+      */
+    u32 index_resident_metrics;
+
+    /** Max number of series of every tenant namespace (0 - unlimited). Tenants are
+      * selected by the session (see `aku_create_tenant_session`), every tenant has its
+      * own series index and column store on top of the shared volumes.
+      */
+    u64 tenant_max_series;
+
+    //! Memory limit of the index and write buffers of every tenant namespace (0 - unlimited)
+    u64 tenant_memory_limit;
+
+    //! Max number of samples written to every tenant namespace per second (0 - unlimited)
+    u64 tenant_ingest_rate;
+
 } aku_FineTuneParams;
@@ -89,6 +89,17 @@ typedef struct {
     aku_PData     payload;
 } aku_Sample;
 
+/** Columnar view of the scalar samples (see `aku_cursor_next_batch`).
+  * Arrays are owned by the cursor.
+  */
+typedef struct {
+    //! Number of samples
+    u32                  size;
+    const aku_ParamId*   paramid;
+    const aku_Timestamp* timestamp;
+    const double*        value;
+} aku_Batch;
+
 
 //! Result of the aggregation operation (extra payload for aku_PData)
 typedef struct {
@@ -118,7 +129,20 @@ typedef struct {
 #define AKU_MAX_TIMESTAMP (~0ull)
 #define AKU_STACK_SIZE 0x100000
 #define AKU_HISTOGRAM_SIZE 0x10000
-#define AKU_MAX_COLUMNS 8
+//! Max number of columns in join query
+#define AKU_MAX_COLUMNS 256
+
+/* Tuple format. Header of the tuple is stored in payload.float64 field (as u64).
+ * Compact tuple: top 6 bits contain number of columns (up to 58), lower 58 bits
+ * contain the bitmap of present values, payload.data contains present values.
+ * Extended tuple: top 6 bits are set to AKU_TUPLE_EXTENDED, lower 32 bits contain
+ * number of columns, payload.data contains the bitmap ((ncolumns + 63)/64 u64
+ * words) followed by the present values.
+ */
+#define AKU_TUPLE_COMPACT_MAX_COLUMNS 58
+#define AKU_TUPLE_EXTENDED 63
+//! Size of the largest tuple (cursor read buffer should be at least this large)
+#define AKU_MAX_TUPLE_SIZE (sizeof(aku_Sample) + sizeof(u64)*((AKU_MAX_COLUMNS + 63)/64) + sizeof(double)*AKU_MAX_COLUMNS)
 
 //! Max number of live generations in cache
 #define AKU_LIMITS_MAX_CACHES 8
@@ -174,13 +198,57 @@ typedef enum {
     AKU_EREGULLAR_EXPECTED = 21,
     //! Function can't handle missing values
     AKU_EMISSING_DATA_NOT_SUPPORTED = 22,
+    //! Series can't be created because the series limit is reached
+    AKU_ESERIES_LIMIT = 23,
     //! All error codes should be less then AKU_EMAX_ERROR
-    AKU_EMAX_ERROR = 23,
+    AKU_EMAX_ERROR = 24,
     // NOTE: Update status_util.cpp and AKU_EMAX_ERROR to add new error code!
 } aku_Status;
 
 
 
+// Memory accounting
+
+//! Subsystems that have their own memory counter
+typedef enum {
+    //! Series name lookup tables
+    AKU_MEM_SERIES_TABLE = 0,
+    //! Posting lists of the series index
+    AKU_MEM_POSTINGS = 1,
+    //! Series names
+    AKU_MEM_STRING_POOL = 2,
+    //! Leaf nodes that are not committed yet
+    AKU_MEM_WRITE_BUFFERS = 3,
+    //! Block cache
+    AKU_MEM_BLOCK_CACHE = 4,
+    //! Group-aggregate results cache
+    AKU_MEM_QUERY_CACHE = 5,
+    //! Buffers of the query cursors
+    AKU_MEM_CURSORS = 6,
+    //! Network read buffers (accounted by the server)
+    AKU_MEM_READ_BUFFERS = 7,
+    //! Write sessions
+    AKU_MEM_SESSIONS = 8,
+    AKU_MEM_MAX = 9,
+} aku_MemorySubsystem;
+
+
+// Thread roles
+
+//! Roles of the threads, CPU affinity and priority can be set per role
+typedef enum {
+    //! Network workers that write data (TCP, UDP)
+    AKU_THREAD_INGESTION = 0,
+    //! Query, cursor, search workers and materializers
+    AKU_THREAD_QUERY = 1,
+    //! HTTP server threads
+    AKU_THREAD_HTTP = 2,
+    //! Sync, compression, rollup and recovery workers
+    AKU_THREAD_BACKGROUND = 3,
+    AKU_THREAD_ROLE_MAX = 4,
+} aku_ThreadRole;
+
+
 // Cursor directions
 #define AKU_CURSOR_DIR_FORWARD 0
 #define AKU_CURSOR_DIR_BACKWARD 1
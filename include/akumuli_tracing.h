@@ -0,0 +1,93 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Static tracepoints (USDT probes) used by libakumuli and akumulid
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+/** Probes are compiled in if AKU_ENABLE_USDT is defined (set by cmake if
+  * `sys/sdt.h` is available). Every probe is a single `nop` instruction and
+  * doesn't change the generated code otherwise, arguments are only read by
+  * the tracer when the probe is attached. Without AKU_ENABLE_USDT probes
+  * are removed completely. Probe arguments should be cheap to compute (ids,
+  * addresses, sizes).
+  *
+  * Provider name is `akumuli`. Scoped probes generate `<name>_start` and `<name>_done`
+  * pair (done fires when the scope is left), e.g. latency of the block reads:
+  *
+  *     bpftrace -e '
+  *       usdt:/usr/lib/libakumuli.so:akumuli:block_read_start { @ts[tid] = nsecs; }
+  *       usdt:/usr/lib/libakumuli.so:akumuli:block_read_done /@ts[tid]/ {
+  *           @us = hist((nsecs - @ts[tid]) / 1000); delete(@ts[tid]);
+  *       }'
+  *
+  * Probes:
+  *   libakumuli
+  *     session_write_start(paramid, timestamp), session_write_done
+  *     session_write_batch_start(size), session_write_batch_done
+  *     nbtree_append_start(id, timestamp), nbtree_append_done
+  *     nbtree_leaf_commit(id, addr), nbtree_sblock_commit(id, addr)
+  *     block_read_start(addr), block_read_done
+  *     block_append_start(size), block_append_done
+  *     query_execute_start, query_execute_done
+  *     cursor_put_start, cursor_put_done (waits if the reader is slow)
+  *     cursor_read_start(buffer_size), cursor_read_done (waits if the query is slow)
+  *   akumulid
+  *     resp_parse_start(size), resp_parse_done
+  *     opentsdb_parse_start(size), opentsdb_parse_done
+  *     influx_parse_start(size), influx_parse_done
+  *     graphite_parse_start(size), graphite_parse_done
+  */
+
+#ifdef AKU_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define AKU_TRACE0(name)          DTRACE_PROBE(akumuli, name)
+#define AKU_TRACE1(name, a)       DTRACE_PROBE1(akumuli, name, a)
+#define AKU_TRACE2(name, a, b)    DTRACE_PROBE2(akumuli, name, a, b)
+
+#else
+
+#define AKU_TRACE0(name)          do {} while (0)
+#define AKU_TRACE1(name, a)       do {} while (0)
+#define AKU_TRACE2(name, a, b)    do {} while (0)
+
+#endif
+
+//! Fires `<name>_done` probe when the scope is left
+#define AKU_TRACE_DONE_ON_EXIT(name)                                        \
+    struct AkuTraceDone_##name {                                            \
+        ~AkuTraceDone_##name() { AKU_TRACE0(name##_done); }                 \
+    } aku_trace_done_##name
+
+//! Fire `<name>_start` probe with no arguments and `<name>_done` when the scope is left
+#define AKU_TRACE_SCOPE0(name)                                              \
+    AKU_TRACE0(name##_start);                                               \
+    AKU_TRACE_DONE_ON_EXIT(name)
+
+//! Fire `<name>_start` probe with one argument and `<name>_done` when the scope is left
+#define AKU_TRACE_SCOPE1(name, a)                                           \
+    AKU_TRACE1(name##_start, a);                                            \
+    AKU_TRACE_DONE_ON_EXIT(name)
+
+//! Fire `<name>_start` probe with two arguments and `<name>_done` when the scope is left
+#define AKU_TRACE_SCOPE2(name, a, b)                                        \
+    AKU_TRACE2(name##_start, a, b);                                         \
+    AKU_TRACE_DONE_ON_EXIT(name)
@@ -20,6 +20,7 @@
 #include <string>
 #include <memory>
 #include <iostream>
+#include <sstream>
 
 #include <apr_dbd.h>
 
@@ -31,6 +32,9 @@
 #include "log_iface.h"
 #include "status_util.h"
 #include "cursor.h"
+#include "metrics.h"
+#include "memory_accounting.h"
+#include "util.h"
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -88,6 +92,24 @@ const char* aku_error_message(int error_code) {
 }
 
 
+/** Get priority class of the query ("priority" field).
+  * Malformed queries and unknown values are reported by the query parser,
+  * here they're treated as interactive.
+  */
+static CursorExecutor::Priority get_query_priority(std::string const& query) {
+    boost::property_tree::ptree ptree;
+    try {
+        std::stringstream stream(query);
+        boost::property_tree::json_parser::read_json(stream, ptree);
+    } catch (boost::property_tree::json_parser_error const&) {
+        return CursorExecutor::Priority::INTERACTIVE;
+    }
+    if (ptree.get<std::string>("priority", "interactive") == "batch") {
+        return CursorExecutor::Priority::BATCH;
+    }
+    return CursorExecutor::Priority::INTERACTIVE;
+}
+
 struct CursorImpl : aku_Cursor {
     std::unique_ptr<ExternalCursor> cursor_;
     aku_Status status_;
@@ -97,7 +119,34 @@ struct CursorImpl : aku_Cursor {
         : query_(query)
     {
         status_ = AKU_SUCCESS;
-        cursor_ = ConcurrentCursor::make(&StorageSession::query, storage, query_.data());
+        std::unique_ptr<ConcurrentCursor> cursor(new ConcurrentCursor());
+        cursor->start(std::bind(&StorageSession::query, storage, cursor.get(), query_.data()),
+                      get_query_priority(query_));
+        cursor_ = std::move(cursor);
+    }
+
+    //! Execute prepared statement
+    CursorImpl(std::shared_ptr<StorageSession> storage, std::shared_ptr<PreparedStatement> stmt,
+               aku_Timestamp begin, aku_Timestamp end)
+        : query_(stmt->query)
+    {
+        status_ = AKU_SUCCESS;
+        std::unique_ptr<ConcurrentCursor> cursor(new ConcurrentCursor());
+        cursor->start(std::bind(&StorageSession::execute, storage, cursor.get(), stmt, begin, end),
+                      get_query_priority(query_));
+        cursor_ = std::move(cursor);
+    }
+
+    //! Execute prepared statement incrementally
+    CursorImpl(std::shared_ptr<StorageSession> storage, std::shared_ptr<PreparedStatement> stmt,
+               aku_Timestamp begin, aku_Timestamp end, std::string const& resume_token)
+        : query_(stmt->query)
+    {
+        status_ = AKU_SUCCESS;
+        std::unique_ptr<ConcurrentCursor> cursor(new ConcurrentCursor());
+        cursor->start(std::bind(&StorageSession::poll, storage, cursor.get(), stmt, begin, end, resume_token),
+                      get_query_priority(query_));
+        cursor_ = std::move(cursor);
     }
 
     ~CursorImpl() {
@@ -121,6 +170,28 @@ struct CursorImpl : aku_Cursor {
     {
         return cursor_->read(values, values_size);
     }
+
+    u32 read_values_nowait( void  *values
+                          , u32    values_size )
+    {
+        return cursor_->read_nowait(values, values_size);
+    }
+
+    aku_Status read_batch(aku_Batch* batch) {
+        return cursor_->read_batch(batch);
+    }
+
+    std::string get_profile() const {
+        return cursor_->get_profile();
+    }
+
+    std::string get_resume_token() const {
+        return cursor_->get_resume_token();
+    }
+
+    void set_prefetch(size_t nbytes) {
+        cursor_->set_prefetch(nbytes);
+    }
 };
 
 
@@ -202,6 +273,56 @@ struct SearchCursorImpl : aku_Cursor {
 };
 
 
+/**
+ * Cursor that returns results of the continuous query.
+ */
+struct SubscriptionCursorImpl : aku_Cursor {
+    std::unique_ptr<ExternalCursor> cursor_;
+    aku_Status status_;
+    std::string query_;
+
+    SubscriptionCursorImpl(std::shared_ptr<StorageSession> storage, const char* query)
+        : query_(query)
+    {
+        status_ = AKU_SUCCESS;
+        std::unique_ptr<StreamingCursor> cursor(new StreamingCursor());
+        storage->subscribe(cursor.get(), query_.data());
+        cursor_ = std::move(cursor);
+    }
+
+    ~SubscriptionCursorImpl() {
+        cursor_->close();
+    }
+
+    bool is_done() const {
+        return cursor_->is_done();
+    }
+
+    bool is_error(aku_Status* out_error_code_or_null) const {
+        if (status_ != AKU_SUCCESS) {
+            *out_error_code_or_null = status_;
+            return false;
+        }
+        return cursor_->is_error(out_error_code_or_null);
+    }
+
+    u32 read_values( void  *values
+                   , u32    values_size )
+    {
+        return cursor_->read(values, values_size);
+    }
+};
+
+
+struct PreparedQueryImpl : aku_PreparedQuery {
+    std::shared_ptr<PreparedStatement> stmt_;
+
+    PreparedQueryImpl(std::shared_ptr<PreparedStatement> stmt)
+        : stmt_(stmt)
+    {
+    }
+};
+
 
 class Session : public aku_Session {
     std::shared_ptr<StorageSession> session_;
@@ -228,6 +349,10 @@ public:
         return session_->write(sample);
     }
 
+    aku_Status add_samples(aku_Sample const* samples, size_t size) {
+        return session_->write_batch(samples, size);
+    }
+
     CursorImpl* query(const char* q) {
         auto res = new CursorImpl(session_, q);
         return res;
@@ -242,6 +367,34 @@ public:
         auto res = new SearchCursorImpl(session_, q);
         return res;
     }
+
+    SubscriptionCursorImpl* subscribe(const char* q) {
+        auto res = new SubscriptionCursorImpl(session_, q);
+        return res;
+    }
+
+    PreparedQueryImpl* prepare(const char* q, aku_Status* out_error_or_null) {
+        aku_Status status;
+        std::shared_ptr<PreparedStatement> stmt;
+        std::tie(status, stmt) = session_->prepare(q);
+        if (out_error_or_null) {
+            *out_error_or_null = status;
+        }
+        if (status != AKU_SUCCESS) {
+            return nullptr;
+        }
+        return new PreparedQueryImpl(stmt);
+    }
+
+    CursorImpl* execute(PreparedQueryImpl* prepared, aku_Timestamp begin, aku_Timestamp end) {
+        auto res = new CursorImpl(session_, prepared->stmt_, begin, end);
+        return res;
+    }
+
+    CursorImpl* poll(PreparedQueryImpl* prepared, aku_Timestamp begin, aku_Timestamp end, const char* token) {
+        auto res = new CursorImpl(session_, prepared->stmt_, begin, end, std::string(token ? token : ""));
+        return res;
+    }
 };
 
 /** 
@@ -253,12 +406,12 @@ class DatabaseImpl : public aku_Database
     std::shared_ptr<Storage> storage_;
 public:
     // private fields
-    DatabaseImpl(const char* path)
+    DatabaseImpl(const char* path, aku_FineTuneParams const& params)
     {
         if (path == std::string(":memory:")) {
             storage_ = std::make_shared<Storage>();
         } else {
-            storage_ = std::make_shared<Storage>(path);
+            storage_ = std::make_shared<Storage>(path, params);
         }
     }
 
@@ -266,8 +419,8 @@ public:
         storage_->close();
     }
 
-    static aku_Database* create(const char* path) {
-        DatabaseImpl* ptr = new DatabaseImpl(path);
+    static aku_Database* create(const char* path, aku_FineTuneParams const& params) {
+        DatabaseImpl* ptr = new DatabaseImpl(path, params);
         return static_cast<aku_Database*>(ptr);
     }
 
@@ -286,14 +439,85 @@ public:
         storage_->debug_print();
     }
 
+    aku_Status import_series(const char* begin, const char* end, aku_Timestamp const* ts, double const* xs, size_t size) {
+        return storage_->import_series(begin, end, ts, xs, size);
+    }
+
+    aku_Status set_retention(const char* metric, aku_Timestamp retention) {
+        return storage_->set_retention(metric, retention);
+    }
+
+    aku_Status set_series_limit(const char* metric, u64 limit) {
+        return storage_->set_series_limit(metric, limit);
+    }
+
+    aku_Status set_precision(const char* metric, int digits) {
+        return storage_->set_precision(metric, digits);
+    }
+
+    aku_Status set_change_only(const char* metric, aku_Timestamp heartbeat) {
+        return storage_->set_change_only(metric, heartbeat);
+    }
+
+    aku_Status delete_series(const char* query, u64* count) {
+        return storage_->delete_series(query, count);
+    }
+
+    aku_Status backup(const char* dest, const char* base, u64 rate) {
+        return storage_->backup(dest, base, rate);
+    }
+
     aku_Session* create_session() {
         auto disp = storage_->create_write_session();
         Session* ptr = new Session(disp);
         return static_cast<aku_Session*>(ptr);
     }
 
+    aku_Session* create_tenant_session(const char* tenant) {
+        aku_Status status;
+        std::shared_ptr<StorageSession> disp;
+        std::tie(status, disp) = storage_->create_tenant_session(tenant);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, std::string("Can't open tenant ") + tenant + ", " + StatusUtil::str(status));
+            return nullptr;
+        }
+        Session* ptr = new Session(disp);
+        return static_cast<aku_Session*>(ptr);
+    }
+
+    aku_Status set_tenant_quota(const char* tenant, Storage::TenantQuota const& quota) {
+        return storage_->set_tenant_quota(tenant, quota);
+    }
+
     boost::property_tree::ptree get_stats() {
-        return storage_->get_stats();
+        auto result = storage_->get_stats();
+        auto qstats = CursorExecutor::instance().get_stats();
+        result.put("queries_queued", qstats.queued);
+        result.put("queries_running", qstats.running);
+        result.put("queries_rejected", qstats.rejected);
+        result.put("batch_queries_queued", qstats.queued_batch);
+        result.put("batch_queries_running", qstats.running_batch);
+        result.put("queries_suspended", qstats.suspended);
+        return result;
+    }
+
+    std::string get_metrics() {
+        std::stringstream out;
+        storage_->format_metrics(out);
+        auto qstats = CursorExecutor::instance().get_stats();
+        Metrics::format_gauge(out, "akumuli_queries_queued", "Number of queries waiting for execution",
+                              static_cast<double>(qstats.queued));
+        Metrics::format_gauge(out, "akumuli_queries_running", "Number of queries being executed",
+                              static_cast<double>(qstats.running));
+        Metrics::format_counter(out, "akumuli_queries_rejected_total", "Number of rejected queries",
+                                qstats.rejected);
+        Metrics::format_gauge(out, "akumuli_batch_queries_queued", "Number of batch queries waiting for execution",
+                              static_cast<double>(qstats.queued_batch));
+        Metrics::format_gauge(out, "akumuli_batch_queries_running", "Number of batch queries being executed",
+                              static_cast<double>(qstats.running_batch));
+        Metrics::format_gauge(out, "akumuli_queries_suspended", "Number of queries waiting for the client to read the output",
+                              static_cast<double>(qstats.suspended));
+        return out.str();
     }
 };
 
@@ -304,7 +528,26 @@ aku_Status aku_create_database_ex( const char     *base_file_name
                                  , u64             page_size
                                  , bool            allocate)
 {
-    return Storage::new_database(base_file_name, metadata_path, volumes_path, num_volumes, page_size, allocate);
+    return aku_create_database_with_fanout(base_file_name, metadata_path, volumes_path, num_volumes, page_size,
+                                           allocate, 0);
+}
+
+aku_Status aku_create_database_with_fanout( const char     *base_file_name
+                                          , const char     *metadata_path
+                                          , const char     *volumes_path
+                                          , i32             num_volumes
+                                          , u64             page_size
+                                          , bool            allocate
+                                          , u32             fanout)
+{
+    if (fanout == 0) {
+        fanout = StorageEngine::AKU_NBTREE_FANOUT;
+    } else if (fanout > StorageEngine::AKU_NBTREE_FANOUT) {
+        Logger::msg(AKU_LOG_ERROR, "NB+tree fanout is too large: " + std::to_string(fanout));
+        return AKU_EBAD_ARG;
+    }
+    return Storage::new_database(base_file_name, metadata_path, volumes_path, num_volumes, page_size, allocate,
+                                 static_cast<u16>(fanout));
 }
 
 aku_Status aku_create_database( const char     *base_file_name
@@ -328,6 +571,11 @@ aku_Session* aku_create_session(aku_Database* db) {
     return dbi->create_session();
 }
 
+aku_Session* aku_create_tenant_session(aku_Database* db, const char* tenant) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->create_tenant_session(tenant);
+}
+
 void aku_destroy_session(aku_Session* session) {
     DatabaseImpl::free(session);
 }
@@ -347,6 +595,11 @@ aku_Status aku_write(aku_Session* session, const aku_Sample* sample) {
     return ises->add_sample(*sample);
 }
 
+aku_Status aku_write_batch(aku_Session* session, const aku_Sample* samples, size_t size) {
+    auto ises = reinterpret_cast<Session*>(session);
+    return ises->add_samples(samples, size);
+}
+
 
 aku_Status aku_parse_duration(const char* str, int* value) {
     try {
@@ -357,6 +610,51 @@ aku_Status aku_parse_duration(const char* str, int* value) {
     return AKU_SUCCESS;
 }
 
+aku_Status aku_import_series(aku_Database* db, const char* begin, const char* end,
+                             const aku_Timestamp* timestamps, const double* values, size_t size)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->import_series(begin, end, timestamps, values, size);
+}
+
+aku_Status aku_set_retention(aku_Database* db, const char* metric, aku_Timestamp retention) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->set_retention(metric, retention);
+}
+
+aku_Status aku_set_series_limit(aku_Database* db, const char* metric, u64 limit) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->set_series_limit(metric, limit);
+}
+
+aku_Status aku_set_tenant_quota(aku_Database* db, const char* tenant, u64 max_series,
+                                u64 memory_limit, u64 ingest_rate)
+{
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    Storage::TenantQuota quota = { max_series, memory_limit, ingest_rate };
+    return dbi->set_tenant_quota(tenant, quota);
+}
+
+aku_Status aku_set_precision(aku_Database* db, const char* metric, int digits) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->set_precision(metric, digits);
+}
+
+aku_Status aku_set_change_only(aku_Database* db, const char* metric, aku_Timestamp heartbeat) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->set_change_only(metric, heartbeat);
+}
+
+aku_Status aku_delete_series(aku_Database* db, const char* query, u64* count) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->delete_series(query, count);
+}
+
+aku_Status aku_backup(aku_Database* db, const char* dest, const char* base, u64 rate) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    return dbi->backup(dest, base, rate);
+}
+
 aku_Status aku_parse_timestamp(const char* iso_str, aku_Sample* sample) {
     try {
         sample->timestamp = DateTimeUtil::from_iso_string(iso_str);
@@ -377,8 +675,7 @@ int aku_name_to_param_id_list(aku_Session* ist, const char* begin, const char* e
 }
 
 aku_Database* aku_open_database(const char* path, aku_FineTuneParams parameters) {
-    AKU_UNUSED(parameters);
-    return DatabaseImpl::create(path);
+    return DatabaseImpl::create(path, parameters);
 }
 
 void aku_close_database(aku_Database* db) {
@@ -403,6 +700,39 @@ aku_Cursor* aku_search(aku_Session* session, const char* query) {
     return static_cast<aku_Cursor*>(cursor);
 }
 
+aku_Cursor* aku_subscribe(aku_Session* session, const char* query) {
+    auto impl = reinterpret_cast<Session*>(session);
+    auto cursor = impl->subscribe(query);
+    return static_cast<aku_Cursor*>(cursor);
+}
+
+aku_PreparedQuery* aku_prepare(aku_Session* session, const char* query, aku_Status* out_error_or_null) {
+    auto impl = reinterpret_cast<Session*>(session);
+    auto prepared = impl->prepare(query, out_error_or_null);
+    return static_cast<aku_PreparedQuery*>(prepared);
+}
+
+aku_Cursor* aku_execute(aku_Session* session, aku_PreparedQuery* query, aku_Timestamp begin, aku_Timestamp end) {
+    auto impl = reinterpret_cast<Session*>(session);
+    auto prepared = reinterpret_cast<PreparedQueryImpl*>(query);
+    auto cursor = impl->execute(prepared, begin, end);
+    return static_cast<aku_Cursor*>(cursor);
+}
+
+aku_Cursor* aku_poll(aku_Session* session, aku_PreparedQuery* query, aku_Timestamp begin, aku_Timestamp end,
+                     const char* resume_token)
+{
+    auto impl = reinterpret_cast<Session*>(session);
+    auto prepared = reinterpret_cast<PreparedQueryImpl*>(query);
+    auto cursor = impl->poll(prepared, begin, end, resume_token);
+    return static_cast<aku_Cursor*>(cursor);
+}
+
+void aku_destroy_prepared(aku_PreparedQuery* query) {
+    auto impl = reinterpret_cast<PreparedQueryImpl*>(query);
+    delete impl;
+}
+
 void aku_cursor_close(aku_Cursor* pcursor) {
     auto impl = reinterpret_cast<CursorImpl*>(pcursor);
     delete impl;  // destructor calls `close` method
@@ -416,6 +746,19 @@ size_t aku_cursor_read( aku_Cursor       *cursor
     return impl->read_values(dest, static_cast<u32>(dest_size));
 }
 
+size_t aku_cursor_read_nowait( aku_Cursor       *cursor
+                             , void             *dest
+                             , size_t            dest_size)
+{
+    auto impl = reinterpret_cast<CursorImpl*>(cursor);
+    return impl->read_values_nowait(dest, static_cast<u32>(dest_size));
+}
+
+aku_Status aku_cursor_next_batch(aku_Cursor* cursor, aku_Batch* batch) {
+    auto impl = reinterpret_cast<CursorImpl*>(cursor);
+    return impl->read_batch(batch);
+}
+
 int aku_cursor_is_done(aku_Cursor* pcursor) {
     auto impl = reinterpret_cast<CursorImpl*>(pcursor);
     return impl->is_done();
@@ -426,6 +769,31 @@ int aku_cursor_is_error(aku_Cursor* pcursor, aku_Status* out_error_code_or_null)
     return impl->is_error(out_error_code_or_null);
 }
 
+int aku_cursor_profile(aku_Cursor* pcursor, char* buffer, size_t size) {
+    auto impl = reinterpret_cast<CursorImpl*>(pcursor);
+    auto profile = impl->get_profile();
+    if (profile.size() >= size) {
+        return -1*static_cast<int>(profile.size() + 1);
+    }
+    strcpy(buffer, profile.c_str());
+    return static_cast<int>(profile.size());
+}
+
+int aku_cursor_resume_token(aku_Cursor* pcursor, char* buffer, size_t size) {
+    auto impl = reinterpret_cast<CursorImpl*>(pcursor);
+    auto token = impl->get_resume_token();
+    if (token.size() >= size) {
+        return -1*static_cast<int>(token.size() + 1);
+    }
+    strcpy(buffer, token.c_str());
+    return static_cast<int>(token.size());
+}
+
+void aku_cursor_set_prefetch(aku_Cursor* pcursor, size_t nbytes) {
+    auto impl = reinterpret_cast<CursorImpl*>(pcursor);
+    impl->set_prefetch(nbytes);
+}
+
 int aku_timestamp_to_string(aku_Timestamp ts, char* buffer, size_t buffer_size) {
     return DateTimeUtil::to_iso_string(ts, buffer, buffer_size);
 }
@@ -468,10 +836,58 @@ int aku_json_stats(aku_Database *db, char* buffer, size_t size) {
     return -1;
 }
 
+int aku_prometheus_metrics(aku_Database *db, char* buffer, size_t size) {
+    auto dbi = reinterpret_cast<DatabaseImpl*>(db);
+    try {
+        auto str = dbi->get_metrics();
+        if (str.size() >= size) {
+            return -1*static_cast<int>(str.size() + 1);
+        }
+        strcpy(buffer, str.c_str());
+        return static_cast<int>(str.size());
+    } catch (std::exception const& e) {
+        Logger::msg(AKU_LOG_ERROR, e.what());
+    } catch (...) {
+        AKU_PANIC("unexpected error in `aku_prometheus_metrics`");
+    }
+    return -1;
+}
+
 void aku_debug_print(aku_Database *db) {
     AKU_PANIC("Not implemented");
 }
 
+void aku_memory_add(aku_MemorySubsystem subsystem, i64 delta) {
+    int ix = static_cast<int>(subsystem);
+    if (ix < 0 || ix >= AKU_MEM_MAX) {
+        return;
+    }
+    if (delta >= 0) {
+        MemoryAccounting::add(subsystem, static_cast<size_t>(delta));
+    } else {
+        MemoryAccounting::sub(subsystem, static_cast<size_t>(-delta));
+    }
+}
+
+int aku_numa_bind_thread(int node) {
+    if (node < 0) {
+        return -1;
+    }
+    auto ix = static_cast<u32>(node) % get_numa_node_count();
+    if (!bind_thread_to_numa_node(ix)) {
+        return -1;
+    }
+    return static_cast<int>(ix);
+}
+
+aku_Status aku_set_thread_policy(aku_ThreadRole role, const char* cpus, int nice) {
+    return set_thread_policy(role, cpus ? cpus : "", nice);
+}
+
+void aku_apply_thread_policy(aku_ThreadRole role) {
+    apply_thread_policy(role);
+}
+
 aku_Status aku_get_resource(const char* res_name, char* buf, size_t* bufsize) {
     std::string res(res_name);
     if (res != "function-names") {
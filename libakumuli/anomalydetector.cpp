@@ -52,6 +52,16 @@ struct CountingSketch {
         }
     }
 
+    //! Copy sketch that uses the same hash functions (copy of `cs.hashes_`)
+    CountingSketch(HashFnFamily const& hf, CountingSketch const& cs)
+        : hashes_(hf)
+        , N(cs.N)
+        , K(cs.K)
+        , sum_(cs.sum_)
+        , tables_(cs.tables_)
+    {
+    }
+
     void _update_sum() {
         sum_ = 0.0;
         for (auto val: tables_[0]) {
@@ -68,6 +78,20 @@ struct CountingSketch {
         }
     }
 
+    void add(const u64* ids, const double* values, size_t size) {
+        for (size_t j = 0; j < size; j++) {
+            sum_ += values[j];
+        }
+        // Rows are independent so every row is updated in a separate pass, the
+        // loop touches one table and doesn't depend on the previous iteration
+        for (u32 i = 0; i < N; i++) {
+            std::vector<double>& row = tables_[i];
+            for (size_t j = 0; j < size; j++) {
+                row[hashes_.hash(static_cast<int>(i), ids[j])] += values[j];
+            }
+        }
+    }
+
     //! Second moment estimator
     double estimateF2() const {
         std::vector<double> results;
@@ -186,10 +210,21 @@ struct PreciseCounter {
     {
     }
 
+    PreciseCounter(HashFnFamily const&, PreciseCounter const& cs)
+        : table_(cs.table_)
+    {
+    }
+
     void add(u64 id, double value) {
         table_[id] += value;
     }
 
+    void add(const u64* ids, const double* values, size_t size) {
+        for (size_t j = 0; j < size; j++) {
+            table_[ids[j]] += values[j];
+        }
+    }
+
     //! Unbiased value estimator
     double estimate(u64 id) const {
         auto it = table_.find(id);
@@ -271,6 +306,16 @@ struct PreciseCounter {
 //      SMASlidingWindow        //
 //                              //
 
+//! Copy frame, the copy uses hash functions `hf`
+template<class Frame>
+static std::unique_ptr<Frame> copy_frame(HashFnFamily const& hf, std::unique_ptr<Frame> const& frame) {
+    std::unique_ptr<Frame> res;
+    if (frame) {
+        res.reset(new Frame(hf, *frame));
+    }
+    return res;
+}
+
 static double checked_inv(u32 depth) {
     if (depth == 0) {
         NodeException err("Sliding window depth can't be zero.");
@@ -294,6 +339,16 @@ struct SMASlidingWindow {
     {
     }
 
+    SMASlidingWindow(SMASlidingWindow const& other, HashFnFamily const& hf)
+        : sma_(copy_frame(hf, other.sma_))
+        , depth_(other.depth_)
+        , mul_(other.mul_)
+    {
+        for (auto const& frame: other.queue_) {
+            queue_.push_back(copy_frame(hf, frame));
+        }
+    }
+
     void add(PFrame sketch) {
         if (!sma_) {
             sma_.reset(new Frame(*sketch));
@@ -313,11 +368,11 @@ struct SMASlidingWindow {
         PFrame res;
         if (queue_.size() < depth_) {
             // return empty response
-            return std::move(res);
+            return res;
         }
         res.reset(new Frame(*sma_));
         res->mul(mul_);
-        return std::move(res);
+        return res;
     }
 };
 
@@ -341,6 +396,13 @@ struct EWMASlidingWindow {
     {
     }
 
+    EWMASlidingWindow(EWMASlidingWindow const& other, HashFnFamily const& hf)
+        : ewma_(copy_frame(hf, other.ewma_))
+        , decay_(other.decay_)
+        , counter_(other.counter_)
+    {
+    }
+
     void add(PFrame sketch) {
         if (!ewma_) {
             ewma_.reset(new Frame(*sketch));
@@ -362,10 +424,10 @@ struct EWMASlidingWindow {
         PFrame res;
         if (counter_ < 10) {
             // return empty response
-            return std::move(res);
+            return res;
         }
         res.reset(new Frame(*ewma_));
-        return std::move(res);
+        return res;
     }
 };
 
@@ -395,6 +457,15 @@ struct DoubleExpSmoothingSlidingWindow {
     {
     }
 
+    DoubleExpSmoothingSlidingWindow(DoubleExpSmoothingSlidingWindow const& other, HashFnFamily const& hf)
+        : baseline_(copy_frame(hf, other.baseline_))
+        , slope_(copy_frame(hf, other.slope_))
+        , alpha_(other.alpha_)
+        , beta_(other.beta_)
+        , counter_(other.counter_)
+    {
+    }
+
     void add(PFrame value) {
         switch(counter_) {
         case 0:
@@ -435,11 +506,11 @@ struct DoubleExpSmoothingSlidingWindow {
         PFrame res;
         if (counter_ < 2) {
             // return empty response
-            return std::move(res);
+            return res;
         }
         res.reset(new Frame(*baseline_));
         res->add(*slope_);
-        return std::move(res);
+        return res;
     }
 };
 
@@ -472,6 +543,20 @@ struct HoltWintersSlidingWindow {
     {
     }
 
+    HoltWintersSlidingWindow(HoltWintersSlidingWindow const& other, HashFnFamily const& hf)
+        : baseline_(copy_frame(hf, other.baseline_))
+        , slope_(copy_frame(hf, other.slope_))
+        , alpha_(other.alpha_)
+        , beta_(other.beta_)
+        , gamma_(other.gamma_)
+        , counter_(other.counter_)
+        , period_(other.period_)
+    {
+        for (auto const& frame: other.seasonal_) {
+            seasonal_.push_back(copy_frame(hf, frame));
+        }
+    }
+
     void add(PFrame value) {
         if (counter_ == 0) {
             baseline_.reset(new Frame(*value));
@@ -525,12 +610,12 @@ struct HoltWintersSlidingWindow {
         PFrame res;
         if (counter_ < period_) {
             // return empty response
-            return std::move(res);
+            return res;
         }
         res.reset(new Frame(*baseline_));
         res->add(*slope_);
         res->add(*seasonal_.back());
-        return std::move(res);
+        return res;
     }
 };
 
@@ -568,10 +653,33 @@ struct AnomalyDetectorPipeline : AnomalyDetectorIface {
         current_.reset(new Frame(hashes_));
     }
 
+    //! Copy c-tor, frames of the copy use copy of the hash functions
+    AnomalyDetectorPipeline(AnomalyDetectorPipeline const& other)
+        : hashes_(other.hashes_)
+        , N(other.N)
+        , K(other.K)
+        , current_(copy_frame(hashes_, other.current_))
+        , error_(copy_frame(hashes_, other.error_))
+        , F2_(other.F2_)
+        , threshold_(other.threshold_)
+        , sliding_window_(new FcastMethod(*other.sliding_window_, hashes_))
+    {
+    }
+
     void add(u64 id, double value) {
         current_->add(id, value);
     }
 
+    void add(const u64* ids, const double* values, size_t size) {
+        current_->add(ids, values, size);
+    }
+
+    std::unique_ptr<AnomalyDetectorIface> clone() const {
+        std::unique_ptr<AnomalyDetectorIface> result;
+        result.reset(new AnomalyDetectorPipeline(*this));
+        return result;
+    }
+
     //! Returns true if series is anomalous (approx)
     bool is_anomaly_candidate(u64 id) const {
         if (error_) {
@@ -582,9 +690,9 @@ struct AnomalyDetectorPipeline : AnomalyDetectorIface {
     }
 
     void move_sliding_window() {
-        PFrame forecast = std::move(sliding_window_->forecast());
+        PFrame forecast = sliding_window_->forecast();
         if (forecast) {
-            error_ = std::move(calculate_error(forecast, current_));
+            error_ = calculate_error(forecast, current_);
             F2_ = sqrt(error_->estimateF2())*threshold_;
         }
         sliding_window_->add(std::move(current_));
@@ -595,7 +703,7 @@ struct AnomalyDetectorPipeline : AnomalyDetectorIface {
         PFrame res;
         res.reset(new Frame(hashes_));
         res->diff(*forecast, *actual);
-        return std::move(res);
+        return res;
     }
 };
 
@@ -608,7 +716,7 @@ std::unique_ptr<AnomalyDetectorIface> create_detector(u32 N,
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(window_size));
     result.reset(new Detector(N, K, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create approximate anomaly detector based on simple moving-average smothing
@@ -623,7 +731,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(window_size));
     result.reset(new Detector(N, K, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create precise anomaly detector based on simple moving-average smothing
@@ -636,7 +744,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(window_size));
     result.reset(new Detector(1, 8, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create approximate anomaly detector based on simple moving-average smothing or EWMA
@@ -651,7 +759,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha));
     result.reset(new Detector(N, K, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create precise anomaly detector based on simple moving-average smothing or EWMA
@@ -664,7 +772,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha));
     result.reset(new Detector(1, 8, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create precise anomaly detector based on simple moving-average smothing or EWMA
@@ -679,7 +787,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha, beta));
     result.reset(new Detector(1, 8, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 std::unique_ptr<AnomalyDetectorIface>
@@ -695,7 +803,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha, beta));
     result.reset(new Detector(N, K, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create precise anomaly detector based on simple moving-average smothing or EWMA
@@ -712,7 +820,7 @@ std::unique_ptr<AnomalyDetectorIface>
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha, beta, gamma, period));
     result.reset(new Detector(1, 8, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 //! Create precise anomaly detector based on simple moving-average smothing or EWMA
@@ -726,12 +834,12 @@ std::unique_ptr<AnomalyDetectorIface>
                                              double gamma,
                                              int period)
 {
-    typedef AnomalyDetectorPipeline<PreciseCounter, HoltWintersSlidingWindow>         Detector;
-    typedef HoltWintersSlidingWindow<PreciseCounter>                                  Window;
+    typedef AnomalyDetectorPipeline<CountingSketch, HoltWintersSlidingWindow>         Detector;
+    typedef HoltWintersSlidingWindow<CountingSketch>                                  Window;
     std::unique_ptr<AnomalyDetectorIface> result;
     std::unique_ptr<Window> window(new Window(alpha, beta, gamma, period));
     result.reset(new Detector(N, K, threshold, std::move(window)));
-    return std::move(result);
+    return result;
 }
 
 }
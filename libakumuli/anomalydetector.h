@@ -16,8 +16,15 @@ namespace QP {
 struct AnomalyDetectorIface {
     virtual ~AnomalyDetectorIface() = default;
     virtual void add(u64 id, double value) = 0;
+    //! Add array of values to the current frame (same as `add` for every value)
+    virtual void add(const u64* ids, const double* values, size_t size) = 0;
     virtual bool is_anomaly_candidate(u64 id) const = 0;
     virtual void move_sliding_window()              = 0;
+    /** Make a copy of the detector state (forecasting model and current frame).
+      * Copy can be used as a checkpoint, it produces the same results as the
+      * original detector if it receives the same values.
+      */
+    virtual std::unique_ptr<AnomalyDetectorIface> clone() const = 0;
 };
 
 struct AnomalyDetectorUtil {
@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "continuous_query.h"
+#include "storage_engine/tuples.h"
+
+namespace Akumuli {
+namespace QP {
+
+typedef LockGuard<RWLock, &RWLock::rdlock> ReadLock;
+typedef LockGuard<RWLock, &RWLock::wrlock> WriteLock;
+
+ContinuousQueries::ContinuousQueries()
+    : size_{0}
+    , next_id_{1}
+{
+}
+
+u64 ContinuousQueries::add(ReshapeRequest const& req, std::shared_ptr<IStreamProcessor> proc) {
+    auto query = std::make_shared<Query>();
+    query->begin = req.select.begin;
+    query->end = req.select.end;
+    query->step = req.agg.step;
+    query->func = req.agg.func;
+    query->proc = proc;
+    query->done = false;
+    query->outbuf.resize(TupleOutputUtils::get_tuple_size(query->func));
+    for (auto id: req.select.columns.at(0).ids) {
+        // Window is empty until the first value is written
+        Window window = { AKU_MAX_TIMESTAMP, 0, StorageEngine::INIT_AGGRES, false };
+        query->windows.insert(std::make_pair(id, window));
+    }
+    query->nactive = query->windows.size();
+    WriteLock lock(lock_);
+    auto id = next_id_++;
+    queries_[id] = query;
+    for (auto const& kv: query->windows) {
+        columns_.insert(std::make_pair(kv.first, query));
+    }
+    size_.store(queries_.size());
+    return id;
+}
+
+void ContinuousQueries::remove(u64 id) {
+    // Writers hold the shared lock while updating queries so the processing
+    // topology is not used after this call
+    WriteLock lock(lock_);
+    auto it = queries_.find(id);
+    if (it == queries_.end()) {
+        return;
+    }
+    auto query = it->second;
+    queries_.erase(it);
+    for (auto const& kv: query->windows) {
+        auto range = columns_.equal_range(kv.first);
+        for (auto col = range.first; col != range.second; col++) {
+            if (col->second == query) {
+                columns_.erase(col);
+                break;
+            }
+        }
+    }
+    size_.store(queries_.size());
+}
+
+size_t ContinuousQueries::size() const {
+    return size_.load();
+}
+
+void ContinuousQueries::emit(Query* query, aku_ParamId id, Window const& window) {
+    aku_Sample* sample;
+    double* tuple;
+    std::tie(sample, tuple) = TupleOutputUtils::cast(query->outbuf.data());
+    sample->payload.type    = AKU_PAYLOAD_TUPLE|aku_PData::REGULLAR;
+    sample->payload.size    = static_cast<u16>(query->outbuf.size());
+    sample->paramid         = id;
+    sample->timestamp       = window.agg._begin;
+    sample->payload.float64 = TupleOutputUtils::get_flags(query->func);
+    TupleOutputUtils::set_tuple(tuple, query->func, window.agg);
+    if (!query->proc->put(*sample)) {
+        // Processing topology is interrupted (e.g. cursor was closed or overflowed)
+        query->done = true;
+        query->proc->stop();
+    }
+}
+
+void ContinuousQueries::update(Query* query, aku_Sample const& sample) {
+    std::lock_guard<std::mutex> lock(query->lock);
+    if (query->done || sample.timestamp < query->begin) {
+        return;
+    }
+    auto it = query->windows.find(sample.paramid);
+    if (it == query->windows.end()) {
+        return;
+    }
+    auto& window = it->second;
+    if (window.done) {
+        return;
+    }
+    if (window.bucket != AKU_MAX_TIMESTAMP && sample.timestamp < window.last) {
+        // Late write, the value is rejected by the column
+        return;
+    }
+    if (sample.timestamp >= query->end) {
+        if (window.bucket != AKU_MAX_TIMESTAMP) {
+            emit(query, sample.paramid, window);
+        }
+        window.done = true;
+        query->nactive--;
+        if (query->nactive == 0 && !query->done) {
+            query->done = true;
+            query->proc->stop();
+        }
+        return;
+    }
+    auto bucket = query->begin + (sample.timestamp - query->begin) / query->step * query->step;
+    if (window.bucket != bucket) {
+        if (window.bucket != AKU_MAX_TIMESTAMP) {
+            emit(query, sample.paramid, window);
+            if (query->done) {
+                return;
+            }
+        }
+        window.bucket = bucket;
+        window.agg = StorageEngine::INIT_AGGRES;
+    }
+    window.agg.add(sample.timestamp, sample.payload.float64, true);
+    window.last = sample.timestamp;
+}
+
+void ContinuousQueries::on_write(aku_Sample const& sample) {
+    on_write(&sample, 1);
+}
+
+void ContinuousQueries::on_write(aku_Sample const* samples, size_t size) {
+    if (size_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    ReadLock lock(lock_);
+    for (size_t i = 0; i < size; i++) {
+        auto const& sample = samples[i];
+        if (sample.payload.type != AKU_PAYLOAD_FLOAT) {
+            continue;
+        }
+        auto range = columns_.equal_range(sample.paramid);
+        for (auto it = range.first; it != range.second; it++) {
+            update(it->second.get(), sample);
+        }
+    }
+}
+
+}}  // namespace
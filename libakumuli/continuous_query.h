@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Stdlib
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Project
+#include "akumuli.h"
+#include "queryprocessor_framework.h"
+#include "util.h"
+
+namespace Akumuli {
+namespace QP {
+
+/** Standing group-aggregate queries.
+  * Query is registered once and receives values from the write path. Every
+  * column of the query has its own window that contains the current bucket.
+  * The bucket is complete when the first value of the next bucket is written
+  * (writes are ordered within the column), complete buckets are sent to the
+  * processing topology of the query. Output is the same as the output of the
+  * group-aggregate query with the same parameters (series order is defined by
+  * the order of writes).
+  * Query is complete when all its columns were written past the end of the range.
+  */
+class ContinuousQueries {
+    //! Current bucket of the column
+    struct Window {
+        //! Start of the bucket
+        aku_Timestamp bucket;
+        //! Timestamp of the last value
+        aku_Timestamp last;
+        StorageEngine::AggregationResult agg;
+        //! Set when column is written past the end of the range
+        bool done;
+    };
+
+    struct Query {
+        std::mutex lock;
+        aku_Timestamp begin;
+        aku_Timestamp end;
+        aku_Timestamp step;
+        std::vector<StorageEngine::AggregationFunction> func;
+        std::shared_ptr<IStreamProcessor> proc;
+        std::unordered_map<aku_ParamId, Window> windows;
+        //! Number of columns that are not done yet
+        size_t nactive;
+        bool done;
+        //! Output buffer (single sample)
+        std::vector<u8> outbuf;
+    };
+
+    //! Protects `queries_` and `columns_`, writers take shared lock
+    mutable RWLock lock_;
+    //! Number of registered queries (checked without the lock)
+    std::atomic<size_t> size_;
+    u64 next_id_;
+    std::unordered_map<u64, std::shared_ptr<Query>> queries_;
+    //! Mapping from column id to the queries that use it
+    std::unordered_multimap<aku_ParamId, std::shared_ptr<Query>> columns_;
+
+    void update(Query* query, aku_Sample const& sample);
+
+    //! Send complete bucket to the processing topology
+    void emit(Query* query, aku_ParamId id, Window const& window);
+
+public:
+    ContinuousQueries();
+
+    ContinuousQueries(ContinuousQueries const&) = delete;
+    ContinuousQueries& operator = (ContinuousQueries const&) = delete;
+
+    /** Register new query.
+      * @param req is a group-aggregate request (range should be forward)
+      * @param proc is a processing topology that receives complete buckets
+      * @return query id
+      */
+    u64 add(ReshapeRequest const& req, std::shared_ptr<IStreamProcessor> proc);
+
+    //! Remove the query, after this call the processing topology will not receive values
+    void remove(u64 id);
+
+    //! Pass written value to the queries
+    void on_write(aku_Sample const& sample);
+
+    //! Pass written values to the queries
+    void on_write(aku_Sample const* samples, size_t size);
+
+    //! Number of registered queries
+    size_t size() const;
+};
+
+}}  // namespace
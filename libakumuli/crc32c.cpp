@@ -29,6 +29,7 @@
    1.0  10 Feb 2013  First version
    1.1   1 Aug 2013  Correct comments on why three crc instructions in parallel
    1.2  14 Jun 2016  C++ version without `main` function and other minor updates
+   1.3  14 Oct 2026  PCLMUL based combine step, ARMv8 version
  */
 
 #include "crc32c.h"
@@ -37,6 +38,14 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 /* CRC-32C (iSCSI) polynomial in reversed bit order. */
 #define POLY 0x82f63b78
@@ -220,6 +229,8 @@ static void crc32c_init_hw(void)
     crc32c_zeros(crc32c_short, SHORT);
 }
 
+#if defined(__x86_64__)
+
 /* Compute CRC-32C using the Intel hardware instruction. */
 static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
 {
@@ -309,6 +320,108 @@ static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
     return static_cast<uint32_t>(crc0) ^ 0xffffffff;
 }
 
+/* Shift constants for the PCLMUL version, x^(8*len - 33) modulo POLY. */
+static uint32_t crc32c_long_k;
+static uint32_t crc32c_short_k;
+
+/* Compute x^n modulo POLY (in reversed bit order). */
+static uint32_t crc32c_xpow(size_t n)
+{
+    uint32_t v = 0x80000000u;   /* x^0 */
+    while (n--) {
+        v = (v & 1) ? (v >> 1) ^ POLY : v >> 1;
+    }
+    return v;
+}
+
+static pthread_once_t crc32c_once_pclmul = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_pclmul(void)
+{
+    crc32c_long_k = crc32c_xpow(LONG*8 - 33);
+    crc32c_short_k = crc32c_xpow(SHORT*8 - 33);
+}
+
+/* Shift crc by the number of zero bytes that corresponds to k. Carry-less
+   product of the crc and x^(8*len - 33) is reduced by the crc32 instruction
+   which multiplies its input by x^32 and the product by x (bit order is
+   reversed) so the result is crc*x^(8*len) modulo POLY. */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint64_t crc32c_shift_pclmul(uint32_t k, uint64_t crc)
+{
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi64_si128(static_cast<long long>(crc)),
+                                        _mm_cvtsi32_si128(static_cast<int>(k)), 0);
+    return _mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(prod)));
+}
+
+/* Compute CRC-32C using three interleaved crc32 instruction streams, the
+   streams are combined using carry-less multiplication instead of the shift
+   tables (no table lookups and no cache misses). */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = reinterpret_cast<const uint8_t*>(buf);
+    const unsigned char *end;
+    uint64_t crc0, crc1, crc2;
+
+    pthread_once(&crc32c_once_pclmul, crc32c_init_pclmul);
+
+    crc0 = crc ^ 0xffffffff;
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next);
+        next++;
+        len--;
+    }
+
+    while (len >= LONG*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *reinterpret_cast<const uint64_t*>(next));
+            crc1 = _mm_crc32_u64(crc1, *reinterpret_cast<const uint64_t*>(next + LONG));
+            crc2 = _mm_crc32_u64(crc2, *reinterpret_cast<const uint64_t*>(next + LONG*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift_pclmul(crc32c_long_k, crc0) ^ crc1;
+        crc0 = crc32c_shift_pclmul(crc32c_long_k, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *reinterpret_cast<const uint64_t*>(next));
+            crc1 = _mm_crc32_u64(crc1, *reinterpret_cast<const uint64_t*>(next + SHORT));
+            crc2 = _mm_crc32_u64(crc2, *reinterpret_cast<const uint64_t*>(next + SHORT*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift_pclmul(crc32c_short_k, crc0) ^ crc1;
+        crc0 = crc32c_shift_pclmul(crc32c_short_k, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+
+    end = next + (len - (len & 7));
+    while (next < end) {
+        crc0 = _mm_crc32_u64(crc0, *reinterpret_cast<const uint64_t*>(next));
+        next += 8;
+    }
+    len &= 7;
+
+    while (len) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next);
+        next++;
+        len--;
+    }
+
+    return static_cast<uint32_t>(crc0) ^ 0xffffffff;
+}
+
 /* Check for SSE 4.2.  SSE 4.2 was first supported in Nehalem processors
    introduced in November, 2008.  This does not check for the existence of the
    cpuid instruction itself, which was introduced on the 486SL in 1992, so this
@@ -324,6 +437,116 @@ static bool hardwared_crc32c_available() {
     return (ecx >> 20) & 1;
 }
 
+/* Check for PCLMULQDQ (Westmere and later). */
+static bool pclmul_available() {
+    uint32_t eax, ecx;
+    eax = 1;
+    __asm__("cpuid"
+            : "=c"(ecx)
+            : "a"(eax)
+            : "%ebx", "%edx");
+    return (ecx >> 1) & 1;
+}
+
+static Akumuli::crc32c_impl_t best_hw_implementation() {
+    return pclmul_available() ? &crc32c_hw_pclmul : &crc32c_hw;
+}
+
+#elif defined(__aarch64__)
+
+/* Compute CRC-32C using the ARMv8 crc32c instructions, three independent
+   streams are combined using the shift tables (same as the Intel version). */
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *next = reinterpret_cast<const uint8_t*>(buf);
+    const unsigned char *end;
+    uint32_t crc0, crc1, crc2;
+
+    pthread_once(&crc32c_once_hw, crc32c_init_hw);
+
+    crc0 = crc ^ 0xffffffff;
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+
+    while (len >= LONG*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + LONG;
+        do {
+            crc0 = __crc32cd(crc0, *reinterpret_cast<const uint64_t*>(next));
+            crc1 = __crc32cd(crc1, *reinterpret_cast<const uint64_t*>(next + LONG));
+            crc2 = __crc32cd(crc2, *reinterpret_cast<const uint64_t*>(next + LONG*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+        next += LONG*2;
+        len -= LONG*3;
+    }
+
+    while (len >= SHORT*3) {
+        crc1 = 0;
+        crc2 = 0;
+        end = next + SHORT;
+        do {
+            crc0 = __crc32cd(crc0, *reinterpret_cast<const uint64_t*>(next));
+            crc1 = __crc32cd(crc1, *reinterpret_cast<const uint64_t*>(next + SHORT));
+            crc2 = __crc32cd(crc2, *reinterpret_cast<const uint64_t*>(next + SHORT*2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+        next += SHORT*2;
+        len -= SHORT*3;
+    }
+
+    end = next + (len - (len & 7));
+    while (next < end) {
+        crc0 = __crc32cd(crc0, *reinterpret_cast<const uint64_t*>(next));
+        next += 8;
+    }
+    len &= 7;
+
+    while (len) {
+        crc0 = __crc32cb(crc0, *next);
+        next++;
+        len--;
+    }
+
+    return crc0 ^ 0xffffffff;
+}
+
+static bool hardwared_crc32c_available() {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+static Akumuli::crc32c_impl_t best_hw_implementation() {
+    return &crc32c_hw;
+}
+
+#else
+
+/* No hardware support, software version is used instead. */
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+
+static bool hardwared_crc32c_available() {
+    return false;
+}
+
+static Akumuli::crc32c_impl_t best_hw_implementation() {
+    return &crc32c_hw;
+}
+
+#endif
+
 namespace Akumuli {
 
 crc32c_impl_t chose_crc32c_implementation(CRC32C_hint hint) {
@@ -332,8 +555,10 @@ crc32c_impl_t chose_crc32c_implementation(CRC32C_hint hint) {
         return &crc32c_hw;
     case CRC32C_hint::FORCE_SW:
         return &crc32c_sw;
+    case CRC32C_hint::FORCE_BEST_HW:
+        return best_hw_implementation();
     case CRC32C_hint::DETECT:
-        return hardwared_crc32c_available() ? &crc32c_hw : &crc32c_sw;
+        return hardwared_crc32c_available() ? best_hw_implementation() : &crc32c_sw;
     };
     return &crc32c_sw;
 }
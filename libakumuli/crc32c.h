@@ -12,7 +12,10 @@ typedef uint32_t (*crc32c_impl_t)(uint32_t crc, const void *buf, size_t len);
 enum class CRC32C_hint {
     DETECT,
     FORCE_SW,
+    //! Basic hardware version (SSE 4.2 or ARMv8 CRC)
     FORCE_HW,
+    //! Fastest hardware version (uses PCLMUL on x86 if available)
+    FORCE_BEST_HW,
 };
 
 //! Return crc32c implementation.
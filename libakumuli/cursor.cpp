@@ -25,6 +25,9 @@
 // TODO: remove
 #include "log_iface.h"
 #include "status_util.h"
+#include "util.h"
+#include "akumuli_tracing.h"
+#include "storage_engine/operators/arena.h"
 
 
 namespace Akumuli {
@@ -36,16 +39,293 @@ namespace {
         BUFFER_SIZE = 0x4000,
         QUEUE_MAX = 0x20,
         CURSOR_READ_TIMEOUT = 10,
+        //! Min number of executor threads (query threads are mostly blocked by the clients)
+        EXECUTOR_MIN_WORKERS = 8,
+        //! Max number of queries waiting for the executor thread
+        EXECUTOR_QUEUE_MAX = 1024,
     };
 }
 
+// CursorExecutor //
+
+struct CursorExecutor::Job {
+    CursorExecutor* executor;
+    //! Index of the worker that runs the job
+    u32 worker;
+    Priority priority;
+    Fiber fiber;
+    //! Job is suspended and waits for `resume`
+    bool suspended;
+    //! `resume` was called before the job was suspended
+    bool wakeup;
+
+    Job(CursorExecutor* executor, u32 worker, Priority priority, std::function<void()>&& task)
+        : executor(executor)
+        , worker(worker)
+        , priority(priority)
+        , fiber([task]() {
+            try {
+                task();
+            } catch (std::exception const& e) {
+                Logger::msg(AKU_LOG_ERROR, std::string("Cursor task failed: ") + e.what());
+            }
+        })
+        , suspended(false)
+        , wakeup(false)
+    {
+    }
+};
+
+static CursorExecutor::Job*& current_job() {
+    static thread_local CursorExecutor::Job* job = nullptr;
+    return job;
+}
+
+CursorExecutor::CursorExecutor(u32 nworkers, u32 max_queue_depth)
+    : pass_{0, 0}
+    , ready_(nworkers)
+    , njobs_(nworkers, 0)
+    , suspended_(0)
+    , max_queue_depth_(max_queue_depth)
+    , max_running_batch_(std::max(1u, nworkers / 2))
+    , next_id_(0)
+    , running_(0)
+    , running_batch_(0)
+    , rejected_(0)
+    , stop_(false)
+{
+    for (u32 i = 0; i < nworkers; i++) {
+        workers_.emplace_back(&CursorExecutor::worker, this, i);
+    }
+}
+
+CursorExecutor::~CursorExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    for (auto& th: workers_) {
+        th.join();
+    }
+}
+
+std::tuple<bool, CursorExecutor::TaskId> CursorExecutor::submit(std::function<void()> task, Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (queues_[0].size() + queues_[1].size() >= max_queue_depth_) {
+        rejected_++;
+        return std::make_tuple(false, 0ull);
+    }
+    auto ix = static_cast<int>(priority);
+    if (queues_[ix].empty()) {
+        // Idle class can't accumulate turns while it has nothing to run
+        pass_[ix] = std::max(pass_[ix], std::min(pass_[0], pass_[1]));
+    }
+    auto id = next_id_++;
+    queues_[ix].push_back(std::make_pair(id, std::move(task)));
+    cond_.notify_one();
+    return std::make_tuple(true, id);
+}
+
+bool CursorExecutor::cancel(TaskId id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& queue: queues_) {
+        auto it = std::find_if(queue.begin(), queue.end(),
+                               [id](std::pair<TaskId, std::function<void()>> const& item) {
+                                   return item.first == id;
+                               });
+        if (it != queue.end()) {
+            queue.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+CursorExecutor::Stats CursorExecutor::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats;
+    stats.queued = queues_[0].size() + queues_[1].size();
+    stats.running = running_;
+    stats.rejected = rejected_;
+    stats.queued_batch = queues_[static_cast<int>(Priority::BATCH)].size();
+    stats.running_batch = running_batch_;
+    stats.suspended = suspended_;
+    return stats;
+}
+
+bool CursorExecutor::pick(Priority* priority) const {
+    auto interactive = !queues_[static_cast<int>(Priority::INTERACTIVE)].empty();
+    auto batch = !queues_[static_cast<int>(Priority::BATCH)].empty() && running_batch_ < max_running_batch_;
+    if (interactive && batch) {
+        *priority = pass_[static_cast<int>(Priority::INTERACTIVE)] <= pass_[static_cast<int>(Priority::BATCH)]
+                  ? Priority::INTERACTIVE
+                  : Priority::BATCH;
+        return true;
+    }
+    if (interactive || batch) {
+        *priority = interactive ? Priority::INTERACTIVE : Priority::BATCH;
+        return true;
+    }
+    return false;
+}
+
+void CursorExecutor::worker(u32 index) {
+    set_thread_name("cursor-worker");
+    apply_thread_policy(AKU_THREAD_QUERY);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        Job* job = nullptr;
+        if (!ready_[index].empty()) {
+            // Resumed jobs go first, they hold resources already
+            job = ready_[index].front();
+            ready_[index].pop_front();
+        } else {
+            Priority priority;
+            if (!pick(&priority)) {
+                if (stop_ && queues_[0].empty() && queues_[1].empty() && njobs_[index] == 0) {
+                    return;
+                }
+                cond_.wait(lock);
+                continue;
+            }
+            auto ix = static_cast<int>(priority);
+            pass_[ix] += priority == Priority::INTERACTIVE ? STRIDE / INTERACTIVE_WEIGHT : STRIDE / BATCH_WEIGHT;
+            auto task = std::move(queues_[ix].front().second);
+            queues_[ix].pop_front();
+            running_++;
+            njobs_[index]++;
+            lock.unlock();
+            job = new Job(this, index, priority, std::move(task));
+            lock.lock();
+        }
+        bool is_batch = job->priority == Priority::BATCH;
+        if (is_batch) {
+            running_batch_++;
+        }
+        lock.unlock();
+        bool done = run(job);
+        if (done) {
+            // release captured state outside of the lock
+            delete job;
+        }
+        lock.lock();
+        if (is_batch) {
+            running_batch_--;
+            // Batch task could wait for the free slot
+            cond_.notify_all();
+        }
+        if (done) {
+            running_--;
+            njobs_[index]--;
+        } else if (job->wakeup) {
+            job->wakeup = false;
+            ready_[index].push_back(job);
+        } else {
+            job->suspended = true;
+            suspended_++;
+        }
+    }
+}
+
+bool CursorExecutor::run(Job* job) {
+    current_job() = job;
+    bool done;
+    if (job->priority == Priority::BATCH) {
+        LowIOPriorityScope io_scope;
+        done = job->fiber.resume();
+    } else {
+        done = job->fiber.resume();
+    }
+    current_job() = nullptr;
+    return done;
+}
+
+CursorExecutor::Job* CursorExecutor::get_current_job() {
+    return current_job();
+}
+
+void CursorExecutor::suspend() {
+    if (current_job() == nullptr) {
+        AKU_PANIC("CursorExecutor::suspend called outside of the job");
+    }
+    // Query context is detached from the worker while the job is suspended,
+    // the worker runs other jobs in the meantime
+    auto arena = StorageEngine::QueryArena::swap_current(nullptr);
+    auto profile = QueryProfile::swap_current(nullptr);
+    auto cancellation = QueryCancellation::swap_current(nullptr);
+    Fiber::yield();
+    StorageEngine::QueryArena::swap_current(arena);
+    QueryProfile::swap_current(profile);
+    QueryCancellation::swap_current(cancellation);
+}
+
+void CursorExecutor::resume(Job* job) {
+    auto executor = job->executor;
+    std::lock_guard<std::mutex> lock(executor->mutex_);
+    if (job->suspended) {
+        job->suspended = false;
+        executor->suspended_--;
+        executor->ready_[job->worker].push_back(job);
+        executor->cond_.notify_all();
+    } else {
+        // Job is still running, it will be requeued when it yields
+        job->wakeup = true;
+    }
+}
+
+CursorExecutor& CursorExecutor::instance() {
+    static CursorExecutor executor(std::max(static_cast<u32>(EXECUTOR_MIN_WORKERS),
+                                            2*std::thread::hardware_concurrency()),
+                                   EXECUTOR_QUEUE_MAX);
+    return executor;
+}
+
 // External cursor implementation //
 
 ConcurrentCursor::ConcurrentCursor()
     : done_{false}
+    , ring_(QUEUE_MAX)
+    , ring_head_{0}
+    , ring_size_{0}
+    , ring_limit_{QUEUE_MAX}
+    , reader_waiting_{false}
+    , writer_waiting_{false}
+    , writer_job_{nullptr}
     , error_code_{AKU_SUCCESS}
+    , task_running_{false}
+    , task_id_{0}
 {}
 
+ConcurrentCursor::~ConcurrentCursor() {
+    close();
+}
+
+void ConcurrentCursor::start_task(std::function<void()> fn, CursorExecutor::Priority priority) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_running_ = true;
+    }
+    bool accepted;
+    std::tie(accepted, task_id_) = CursorExecutor::instance().submit([this, fn]() {
+        if (!done_) {
+            QueryCancellation::Scope scope(&cancellation_);
+            fn();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_running_ = false;
+        cond_.notify_all();
+    }, priority);
+    if (!accepted) {
+        Logger::msg(AKU_LOG_ERROR, "Query rejected, too many queries in the queue");
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_running_ = false;
+        done_ = true;
+        error_code_ = AKU_EBUSY;
+        cond_.notify_all();
+    }
+}
+
 
 /**
  * This function copies samples from one buffer to another with respect of individual
@@ -69,32 +349,84 @@ static u32 samplecpy(u8* dest, u8 const* source, u32 size) {
     return static_cast<u32>(rcvbuf - dest);
 }
 
+// SampleColumns //
+
+void SampleColumns::clear() {
+    paramid.clear();
+    timestamp.clear();
+    value.clear();
+}
+
+size_t SampleColumns::append(u8 const* data, size_t size) {
+    u8 const* it  = data;
+    u8 const* end = data + size;
+    while (it < end && !full()) {
+        aku_Sample const* s = reinterpret_cast<aku_Sample const*>(it);
+        if ((s->payload.type & (AKU_PAYLOAD_FLOAT|aku_PData::TUPLE_BIT)) != AKU_PAYLOAD_FLOAT) {
+            break;
+        }
+        paramid.push_back(s->paramid);
+        timestamp.push_back(s->timestamp);
+        value.push_back(s->payload.float64);
+        it += s->payload.size;
+    }
+    return static_cast<size_t>(it - data);
+}
+
+bool SampleColumns::full() const {
+    return paramid.size() == BATCH_SIZE;
+}
+
+void SampleColumns::get(aku_Batch* batch) const {
+    batch->size      = static_cast<u32>(paramid.size());
+    batch->paramid   = paramid.data();
+    batch->timestamp = timestamp.data();
+    batch->value     = value.data();
+}
+
 u32 ConcurrentCursor::read(void* buffer, u32 buffer_size) {
+    return read_impl(buffer, buffer_size, true);
+}
+
+u32 ConcurrentCursor::read_nowait(void* buffer, u32 buffer_size) {
+    return read_impl(buffer, buffer_size, false);
+}
+
+u32 ConcurrentCursor::read_impl(void* buffer, u32 buffer_size, bool wait) {
+    AKU_TRACE_SCOPE1(cursor_read, buffer_size);
     u32 nbytes = 0;
     u8* dest = static_cast<u8*>(buffer);
     std::unique_lock<std::mutex> lock(mutex_);
     while(true) {
-        if (queue_.empty()) {
-            if (done_) {
+        if (ring_size_ == 0) {
+            if (done_ || !wait) {
                 return nbytes;
             }
+            reader_waiting_ = true;
             cond_.wait_for(lock, std::chrono::milliseconds(CURSOR_READ_TIMEOUT));
+            reader_waiting_ = false;
             continue;
         }
-        auto front = queue_.front();
-        auto bytes2read = std::min(buffer_size, static_cast<u32>(front->wrpos - front->rdpos));
-        auto out = samplecpy(dest, front->buf.data() + front->rdpos, bytes2read);
+        auto& front = ring_[ring_head_];
+        auto bytes2read = std::min(buffer_size, static_cast<u32>(front.wrpos - front.rdpos));
+        auto out = samplecpy(dest, front.buf.data() + front.rdpos, bytes2read);
         if (out == 0) {
             // The last sample in the array doesn't fit
             break;
         }
-        front->rdpos += out;
+        front.rdpos += out;
         nbytes += out;
         dest += out;
         buffer_size -= out;
-        if (front->rdpos == front->wrpos) {
-            queue_.pop_front();
-            cond_.notify_all();
+        if (front.rdpos == front.wrpos) {
+            // Release the buffer, it will be reused by the writer
+            front.rdpos = 0;
+            front.wrpos = 0;
+            ring_head_ = (ring_head_ + 1) % ring_.size();
+            ring_size_--;
+            if (writer_waiting_) {
+                wake_writer();
+            }
         }
         if (buffer_size < sizeof(aku_Sample)) {
             break;
@@ -103,9 +435,45 @@ u32 ConcurrentCursor::read(void* buffer, u32 buffer_size) {
     return nbytes;
 }
 
+aku_Status ConcurrentCursor::read_batch(aku_Batch* batch) {
+    columns_.clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!columns_.full()) {
+        if (ring_size_ == 0) {
+            if (done_ || !columns_.paramid.empty()) {
+                break;
+            }
+            reader_waiting_ = true;
+            cond_.wait_for(lock, std::chrono::milliseconds(CURSOR_READ_TIMEOUT));
+            reader_waiting_ = false;
+            continue;
+        }
+        auto& front = ring_[ring_head_];
+        front.rdpos += columns_.append(front.buf.data() + front.rdpos, front.wrpos - front.rdpos);
+        if (front.rdpos == front.wrpos) {
+            // Samples are decoded, the buffer can be reused by the writer
+            front.rdpos = 0;
+            front.wrpos = 0;
+            ring_head_ = (ring_head_ + 1) % ring_.size();
+            ring_size_--;
+            if (writer_waiting_) {
+                wake_writer();
+            }
+        } else if (!columns_.full()) {
+            // Next sample is not a scalar
+            break;
+        }
+    }
+    columns_.get(batch);
+    if (batch->size == 0 && ring_size_ != 0) {
+        return AKU_EBAD_DATA;
+    }
+    return AKU_SUCCESS;
+}
+
 bool ConcurrentCursor::is_done() const {
     std::lock_guard<std::mutex> lock(mutex_);
-    return done_ && queue_.empty();
+    return done_ && ring_size_ == 0;
 }
 
 bool ConcurrentCursor::is_error(aku_Status* out_error_code_or_null) const {
@@ -117,11 +485,22 @@ bool ConcurrentCursor::is_error(aku_Status* out_error_code_or_null) const {
 }
 
 void ConcurrentCursor::close() {
-    std::lock_guard<std::mutex> lock(mutex_);
+    // Running computation stops at the next check instead of running to completion
+    cancellation_.cancel();
+    std::unique_lock<std::mutex> lock(mutex_);
     done_ = true;
-    cond_.notify_all();
-    if (thread_.joinable()) {
-        thread_.join();
+    wake_writer();
+    if (task_running_) {
+        // Task is not started yet, it can be removed from the queue
+        lock.unlock();
+        bool cancelled = CursorExecutor::instance().cancel(task_id_);
+        lock.lock();
+        if (cancelled) {
+            task_running_ = false;
+        }
+    }
+    while (task_running_) {
+        cond_.wait(lock);
     }
 }
 
@@ -134,49 +513,214 @@ void ConcurrentCursor::set_error(aku_Status error_code) {
     cond_.notify_all();
 }
 
-static std::shared_ptr<ConcurrentCursor::BufferT> make_empty() {
-    auto buf = std::make_shared<ConcurrentCursor::BufferT>();
-    buf->buf.resize(BUFFER_SIZE);
-    buf->rdpos = 0;
-    buf->wrpos = 0;
-    return buf;
-}
-
 bool ConcurrentCursor::put(aku_Sample const& result) {
     if (done_) {
         return false;
     }
+    AKU_TRACE_SCOPE0(cursor_put);
     u32 bytes = result.payload.size;
     std::unique_lock<std::mutex> lock(mutex_);
-    std::shared_ptr<BufferT> top;
+    BufferT* top = nullptr;
     while(true) {
-        if(queue_.empty()) {
-            top = make_empty();
-            queue_.push_back(top);
-        }
-        top = queue_.back();
-        if (top->wrpos + bytes > BUFFER_SIZE) {
-            // Overflow
-            if (queue_.size() < QUEUE_MAX) {
-                top = make_empty();
-                queue_.push_back(top);
-            } else {
-                cond_.wait(lock);
+        if (ring_size_ != 0) {
+            top = &ring_[(ring_head_ + ring_size_ - 1) % ring_.size()];
+            if (top->wrpos + bytes <= BUFFER_SIZE) {
+                break;
             }
-            continue;
-        } else {
+        }
+        // Overflow
+        if (ring_size_ < ring_limit_) {
+            top = &ring_[(ring_head_ + ring_size_) % ring_.size()];
+            if (top->buf.empty()) {
+                top->buf.resize(BUFFER_SIZE);
+            }
+            top->rdpos = 0;
+            top->wrpos = 0;
+            ring_size_++;
             break;
         }
+        // Ring is full, wait until reader will release some buffers
+        writer_waiting_ = true;
+        auto job = CursorExecutor::get_current_job();
+        if (job) {
+            // Executor's thread is released until the reader drains the ring
+            writer_job_ = job;
+            lock.unlock();
+            CursorExecutor::suspend();
+            lock.lock();
+        } else {
+            cond_.wait(lock);
+        }
+        writer_waiting_ = false;
+        if (done_) {
+            // Cursor was closed by the reader
+            return false;
+        }
     }
     memcpy(top->buf.data() + top->wrpos, &result, bytes);
     top->wrpos += bytes;
-    cond_.notify_all();
+    if (reader_waiting_) {
+        cond_.notify_all();
+    }
     return true;
 }
 
+void ConcurrentCursor::wake_writer() {
+    if (writer_job_) {
+        CursorExecutor::resume(writer_job_);
+        writer_job_ = nullptr;
+    }
+    cond_.notify_all();
+}
+
 void ConcurrentCursor::complete() {
     done_ = true;
     cond_.notify_all();
 }
 
+void ConcurrentCursor::set_profile(std::string const& profile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    profile_ = profile;
+}
+
+std::string ConcurrentCursor::get_profile() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return profile_;
+}
+
+void ConcurrentCursor::set_resume_token(std::string const& token) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    resume_token_ = token;
+}
+
+std::string ConcurrentCursor::get_resume_token() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resume_token_;
+}
+
+void ConcurrentCursor::set_prefetch(size_t nbytes) {
+    size_t limit = nbytes == 0 ? static_cast<size_t>(QUEUE_MAX)
+                               : (nbytes + BUFFER_SIZE - 1) / BUFFER_SIZE;
+    limit = std::min(std::max(limit, size_t(1)), ring_.size());
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool grows = limit > ring_limit_;
+    ring_limit_ = limit;
+    // Buffers that are already in use are not released, the writer waits
+    // until the reader drains the ring below the new limit
+    if (grows && writer_waiting_) {
+        wake_writer();
+    }
+}
+
+// StreamingCursor //
+
+StreamingCursor::StreamingCursor(size_t capacity)
+    : buf_(capacity)
+    , rdpos_{0}
+    , wrpos_{0}
+    , done_{false}
+    , error_code_{AKU_SUCCESS}
+{
+}
+
+StreamingCursor::~StreamingCursor() {
+    close();
+}
+
+void StreamingCursor::set_close_handler(std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    on_close_ = std::move(fn);
+}
+
+u32 StreamingCursor::read(void* buffer, u32 buffer_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto bytes2read = std::min(buffer_size, static_cast<u32>(wrpos_ - rdpos_));
+    auto out = samplecpy(static_cast<u8*>(buffer), buf_.data() + rdpos_, bytes2read);
+    rdpos_ += out;
+    if (rdpos_ == wrpos_) {
+        rdpos_ = 0;
+        wrpos_ = 0;
+    }
+    return out;
+}
+
+aku_Status StreamingCursor::read_batch(aku_Batch* batch) {
+    columns_.clear();
+    std::lock_guard<std::mutex> lock(mutex_);
+    rdpos_ += columns_.append(buf_.data() + rdpos_, wrpos_ - rdpos_);
+    bool empty = rdpos_ == wrpos_;
+    if (empty) {
+        rdpos_ = 0;
+        wrpos_ = 0;
+    }
+    columns_.get(batch);
+    if (batch->size == 0 && !empty) {
+        return AKU_EBAD_DATA;
+    }
+    return AKU_SUCCESS;
+}
+
+bool StreamingCursor::is_done() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_ && rdpos_ == wrpos_;
+}
+
+bool StreamingCursor::is_error(aku_Status* out_error_code_or_null) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (out_error_code_or_null != nullptr) {
+        *out_error_code_or_null = error_code_;
+    }
+    return done_ && error_code_ != AKU_SUCCESS;
+}
+
+void StreamingCursor::close() {
+    std::function<void()> fn;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        fn.swap(on_close_);
+    }
+    // Handler waits for the writers so it can't be called under the lock
+    if (fn) {
+        fn();
+    }
+}
+
+void StreamingCursor::set_error(aku_Status error_code) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!done_) {
+        done_ = true;
+        error_code_ = error_code;
+    }
+}
+
+bool StreamingCursor::put(aku_Sample const& result) {
+    u32 bytes = result.payload.size;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done_) {
+        return false;
+    }
+    if (wrpos_ + bytes > buf_.size() && rdpos_ != 0) {
+        std::copy(buf_.begin() + static_cast<std::ptrdiff_t>(rdpos_),
+                  buf_.begin() + static_cast<std::ptrdiff_t>(wrpos_),
+                  buf_.begin());
+        wrpos_ -= rdpos_;
+        rdpos_ = 0;
+    }
+    if (wrpos_ + bytes > buf_.size()) {
+        // Reader is too slow, writers can't wait
+        done_ = true;
+        error_code_ = AKU_EOVERFLOW;
+        return false;
+    }
+    memcpy(buf_.data() + wrpos_, &result, bytes);
+    wrpos_ += bytes;
+    return true;
+}
+
+void StreamingCursor::complete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+}
+
 }
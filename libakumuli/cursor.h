@@ -29,11 +29,14 @@
 #include <atomic>
 #include <deque>
 #include <functional>
+#include <tuple>
 
 
 #include "akumuli.h"
 #include "internal_cursor.h"
 #include "external_cursor.h"
+#include "memory_accounting.h"
+#include "metrics.h"
 
 namespace Akumuli {
 
@@ -44,6 +47,135 @@ std::ostream& operator<<(std::ostream& st, aku_Sample res);
 struct Cursor : InternalCursor, ExternalCursor {};
 
 
+//! Column arrays returned by `read_batch`
+struct SampleColumns {
+    enum {
+        //! Max number of samples in one batch
+        BATCH_SIZE = 0x1000,
+    };
+    std::vector<aku_ParamId>   paramid;
+    std::vector<aku_Timestamp> timestamp;
+    std::vector<double>        value;
+
+    void clear();
+
+    /** Decode scalar samples until the batch is full or a non-scalar sample is found.
+      * @return number of consumed bytes
+      */
+    size_t append(u8 const* data, size_t size);
+
+    bool full() const;
+
+    void get(aku_Batch* batch) const;
+};
+
+
+/**
+ * @brief Bounded thread pool that runs cursor computations.
+ * Every task runs in its own fiber. Task that can't make progress (e.g. the
+ * output buffer of the cursor is full) suspends itself and the worker picks
+ * another task, so the number of concurrent queries is not limited by the
+ * number of threads. Suspended task is resumed by the same worker.
+ * Tasks that can't be started immediately are queued. If the queue is full
+ * the task is rejected. Interactive and batch tasks are queued separately and
+ * picked using stride scheduling (interactive tasks get INTERACTIVE_WEIGHT
+ * times more turns). Batch tasks can't occupy more than half of the workers
+ * and run with the lowest I/O priority so the interactive queries are not
+ * stuck behind them.
+ */
+struct CursorExecutor {
+    typedef u64 TaskId;
+
+    //! Started task
+    struct Job;
+
+    enum class Priority {
+        INTERACTIVE,
+        BATCH,
+    };
+
+    enum {
+        INTERACTIVE_WEIGHT = 4,
+        BATCH_WEIGHT = 1,
+        STRIDE = INTERACTIVE_WEIGHT*BATCH_WEIGHT,
+        NCLASSES = 2,
+    };
+
+    struct Stats {
+        u64 queued;
+        //! Number of started tasks (including suspended)
+        u64 running;
+        u64 rejected;
+        u64 queued_batch;
+        u64 running_batch;
+        //! Number of suspended tasks
+        u64 suspended;
+    };
+
+    CursorExecutor(u32 nworkers, u32 max_queue_depth);
+    ~CursorExecutor();
+
+    CursorExecutor(CursorExecutor const&) = delete;
+    CursorExecutor& operator = (CursorExecutor const&) = delete;
+
+    /** Submit task for execution.
+      * @return false and task id, false means that the task was rejected
+      *         (queue is full) and will not be executed
+      */
+    std::tuple<bool, TaskId> submit(std::function<void()> task, Priority priority = Priority::INTERACTIVE);
+
+    /** Remove queued task.
+      * @return true if task was removed, false if task already started
+      */
+    bool cancel(TaskId id);
+
+    Stats get_stats() const;
+
+    //! Get global instance
+    static CursorExecutor& instance();
+
+    //! Get job that runs on the current thread (nullptr if the thread is not a worker)
+    static Job* get_current_job();
+
+    //! Suspend the current job until `resume` is called (should be called by the job)
+    static void suspend();
+
+    //! Make suspended job runnable again, can be called before the job is suspended
+    static void resume(Job* job);
+
+private:
+    typedef std::deque<std::pair<TaskId, std::function<void()>>> QueueT;
+
+    void worker(u32 index);
+
+    //! Run job until it yields or completes
+    bool run(Job* job);
+
+    //! Choose the queue of the next task, return false if no task can be started
+    bool pick(Priority* priority) const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    QueueT queues_[NCLASSES];
+    //! Virtual time of every class (stride scheduling)
+    u64 pass_[NCLASSES];
+    //! Resumed jobs of every worker
+    std::vector<std::deque<Job*>> ready_;
+    //! Number of unfinished jobs of every worker
+    std::vector<u64> njobs_;
+    u64 suspended_;
+    std::vector<std::thread> workers_;
+    const u32 max_queue_depth_;
+    //! Max number of batch tasks running at once
+    const u64 max_running_batch_;
+    TaskId next_id_;
+    u64 running_;
+    u64 running_batch_;
+    u64 rejected_;
+    bool stop_;
+};
+
+
 /**
  * @brief The ConcurrentCursor struct
  * Implements cursor interface. Starts computation in parallel thread.
@@ -52,30 +184,68 @@ struct Cursor : InternalCursor, ExternalCursor {};
 struct ConcurrentCursor : Cursor {
 
     struct BufferT {
-        std::vector<u8> buf;
+        std::vector<u8, TrackingAllocator<u8, AKU_MEM_CURSORS>> buf;
         size_t rdpos;
         size_t wrpos;
     };
 
-    std::thread thread_;
     mutable std::mutex  mutex_;
     std::condition_variable cond_;
     std::atomic_bool done_;
-    std::deque<std::shared_ptr<BufferT>> queue_;
+    //! Fixed size ring of buffers, buffers are allocated on first use and reused
+    std::vector<BufferT> ring_;
+    //! Index of the first (oldest) buffer in the ring
+    size_t ring_head_;
+    //! Number of buffers in use
+    size_t ring_size_;
+    //! Max number of buffers in use (set by the reader, can't exceed the ring size)
+    size_t ring_limit_;
+    //! Set when reader waits for data
+    bool reader_waiting_;
+    //! Set when writer waits for free buffer
+    bool writer_waiting_;
+    //! Suspended executor job of the writer (resumed by the reader)
+    CursorExecutor::Job* writer_job_;
     aku_Status error_code_;
+    //! Set if computation is queued or running in the executor
+    bool task_running_;
+    CursorExecutor::TaskId task_id_;
+    //! Arrays of the last batch
+    SampleColumns columns_;
+    //! Execution profile (JSON)
+    std::string profile_;
+    //! Resume token of the incremental query
+    std::string resume_token_;
+    //! Cancelled by `close`, attached to the thread that runs the computation
+    QueryCancellation cancellation_;
 
     ConcurrentCursor();
+    ~ConcurrentCursor();
+
+    //! Run computation using the global executor
+    void start_task(std::function<void()> fn,
+                    CursorExecutor::Priority priority = CursorExecutor::Priority::INTERACTIVE);
 
     // External cursor implementation
 
     virtual u32 read(void* buffer, u32 buffer_size);
 
+    virtual u32 read_nowait(void* buffer, u32 buffer_size);
+
+    virtual aku_Status read_batch(aku_Batch* batch);
+
     virtual bool is_done() const;
 
     virtual bool is_error(aku_Status* out_error_code_or_null = nullptr) const;
 
     virtual void close();
 
+    virtual std::string get_profile() const;
+
+    virtual std::string get_resume_token() const;
+
+    virtual void set_prefetch(size_t nbytes);
+
     // Internal cursor implementation
 
     void set_error(aku_Status error_code);
@@ -84,8 +254,21 @@ struct ConcurrentCursor : Cursor {
 
     void complete();
 
-    template <class Fn_1arg_caller> void start(Fn_1arg_caller const& fn) {
-        thread_ = std::thread(fn);
+    void set_profile(std::string const& profile);
+
+    void set_resume_token(std::string const& token);
+
+private:
+    //! Read results, wait until the buffer is full or the query is done if `wait` is set
+    u32 read_impl(void* buffer, u32 buffer_size, bool wait);
+
+    //! Wake up the writer (should be called under the lock)
+    void wake_writer();
+
+public:
+    template <class Fn_1arg_caller>
+    void start(Fn_1arg_caller const& fn, CursorExecutor::Priority priority = CursorExecutor::Priority::INTERACTIVE) {
+        start_task(std::function<void()>(fn), priority);
     }
 
     template <class Fn_1arg> static std::unique_ptr<ExternalCursor> make(Fn_1arg const& fn) {
@@ -120,4 +303,43 @@ struct ConcurrentCursor : Cursor {
     }
 };
 
+/**
+ * @brief Cursor of the continuous query.
+ * Results are pushed by the writers so `put` never blocks. If the reader can't
+ * keep up and the buffer is full the cursor fails with AKU_EOVERFLOW. `read`
+ * doesn't wait for data, it returns zero if nothing is available yet.
+ */
+struct StreamingCursor : Cursor {
+    enum {
+        DEFAULT_CAPACITY = 0x100000,
+    };
+    mutable std::mutex mutex_;
+    std::vector<u8, TrackingAllocator<u8, AKU_MEM_CURSORS>> buf_;
+    size_t rdpos_;
+    size_t wrpos_;
+    bool done_;
+    aku_Status error_code_;
+    //! Called once on close (detaches the cursor from the write path)
+    std::function<void()> on_close_;
+    //! Arrays of the last batch
+    SampleColumns columns_;
+
+    StreamingCursor(size_t capacity = DEFAULT_CAPACITY);
+    ~StreamingCursor();
+
+    void set_close_handler(std::function<void()> fn);
+
+    // External cursor implementation
+    virtual u32 read(void* buffer, u32 buffer_size);
+    virtual aku_Status read_batch(aku_Batch* batch);
+    virtual bool is_done() const;
+    virtual bool is_error(aku_Status* out_error_code_or_null = nullptr) const;
+    virtual void close();
+
+    // Internal cursor implementation
+    void set_error(aku_Status error_code);
+    bool put(aku_Sample const& result);
+    void complete();
+};
+
 }  // namespace
@@ -16,8 +16,13 @@
 
 #include "datetime.h"
 #include <cstdio>
+#include <cstring>
 #include <boost/regex.hpp>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace Akumuli {
 
 //! 1ns interval
@@ -57,6 +62,200 @@ static int parse_n_digits(const char* p, int n, const char* error_message = "can
     return value;
 }
 
+//! Returns bitmask of the decimal digits among the first 16 characters (16 bytes should be readable)
+static u32 digit_mask(const char* p) {
+#ifdef __SSE2__
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i d = _mm_sub_epi8(s, _mm_set1_epi8('0'));
+    // Characters outside of the '0'-'9' range wrap around and become larger than 9
+    __m128i digits = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    return static_cast<u32>(_mm_movemask_epi8(digits));
+#else
+    u32 mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (p[i] >= '0' && p[i] <= '9') {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+//! Convert two digits (should be validated by the caller)
+static int two_digits(const char* p) {
+    return (p[0] - '0')*10 + (p[1] - '0');
+}
+
+//! Number of days since epoch (proleptic Gregorian calendar)
+static i64 days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const i64 era = (y >= 0 ? y : y - 399) / 400;
+    const i64 yoe = y - era * 400;
+    const i64 doy = (153*(m + (m > 2 ? -3 : 9)) + 2)/5 + d - 1;
+    const i64 doe = yoe * 365 + yoe/4 - yoe/100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static int days_in_month(int y, int m) {
+    static const int DAYS[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return m == 2 && leap ? 29 : DAYS[m - 1];
+}
+
+/** Get epoch seconds of the beginning of the hour. Collectors usually send many
+  * timestamps of the same hour so the last value is cached.
+  * @return false if date is invalid or can't be represented as aku_Timestamp
+  */
+static bool hour_to_epoch(int year, int month, int day, int hour, i64* result) {
+    static thread_local u64 cached_key = 0;
+    static thread_local i64 cached_value = 0;
+    u64 key = ((static_cast<u64>(year)*100 + static_cast<u64>(month))*100 + static_cast<u64>(day))*100 + static_cast<u64>(hour);
+    if (key == cached_key) {
+        *result = cached_value;
+        return true;
+    }
+    // Later dates overflow nanosecond timestamp
+    if (year < 1970 || year > 2200 || month < 1 || month > 12 || day < 1 ||
+        day > days_in_month(year, month) || hour > 23)
+    {
+        return false;
+    }
+    cached_value = days_from_civil(year, month, day)*86400 + hour*3600;
+    cached_key = key;
+    *result = cached_value;
+    return true;
+}
+
+/** Parse fractional part (digits only).
+  * @return false if string contains non-digit characters
+  */
+static bool parse_fraction(const char* p, const char* end, u32* nanoseconds) {
+    u32 value = 0;
+    int n = 0;
+    for (; p != end; p++) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        if (n < 9) {
+            value = value*10 + static_cast<u32>(*p - '0');
+            n++;
+        }
+    }
+    for (; n < 9; n++) {
+        value *= 10;
+    }
+    *nanoseconds = value;
+    return true;
+}
+
+/** Fast path for the most common "YYYYMMDDTHHMMSS[.fffffffff]" format.
+  * @return false if the string should be parsed by the generic parser
+  */
+static bool parse_basic_format(const char* p, u32 len, aku_Timestamp* result) {
+    // Digits at positions 0-7 and 9-14, 'T' at position 8
+    if ((digit_mask(p) & 0x7EFF) != 0x7EFF || p[8] != 'T') {
+        return false;
+    }
+    int minute = two_digits(p + 11);
+    int second = two_digits(p + 13);
+    if (minute > 59 || second > 59) {
+        return false;
+    }
+    u32 nanoseconds = 0;
+    if (len > 15) {
+        // Generic parser rejects fractions that are too long or empty
+        if ((p[15] != '.' && p[15] != ',') || len == 16 || len > 25 ||
+            !parse_fraction(p + 16, p + len, &nanoseconds))
+        {
+            return false;
+        }
+    }
+    i64 hour_start;
+    if (!hour_to_epoch(two_digits(p)*100 + two_digits(p + 2), two_digits(p + 4), two_digits(p + 6),
+                       two_digits(p + 9), &hour_start))
+    {
+        return false;
+    }
+    *result = static_cast<aku_Timestamp>(hour_start + minute*60 + second)*1000000000ul + nanoseconds;
+    return true;
+}
+
+static void throw_bad_format(const char* msg) {
+    BadDateTimeFormat error(msg);
+    BOOST_THROW_EXCEPTION(error);
+}
+
+//! Check if the string looks like RFC 3339 timestamp ("YYYY-MM-DD...")
+static bool is_rfc3339(const char* p, u32 len) {
+    return len >= 19 && p[4] == '-' && p[7] == '-';
+}
+
+//! Parse RFC 3339 timestamp "YYYY-MM-DDTHH:MM:SS[.fff][Z|+HH:MM|-HH:MM]"
+static aku_Timestamp parse_rfc3339(const char* p, u32 len) {
+    const char* end = p + len;
+    // Digits at positions 0-3, 5-6, 8-9, 11-12, 14-15
+    if ((digit_mask(p) & 0xDB6F) != 0xDB6F || p[16] != ':' || p[17] < '0' || p[17] > '9' ||
+        p[18] < '0' || p[18] > '9')
+    {
+        throw_bad_format("bad timestamp format, YYYY-MM-DDTHH:MM:SS was expected");
+    }
+    if (p[10] != 'T' && p[10] != 't' && p[10] != ' ') {
+        throw_bad_format("bad timestamp format, 'T' was expected");
+    }
+    if (p[13] != ':') {
+        throw_bad_format("bad timestamp format, ':' was expected");
+    }
+    int minute = two_digits(p + 14);
+    int second = two_digits(p + 17);
+    if (minute > 59 || second > 60) {
+        throw_bad_format("bad timestamp format, time is out of range");
+    }
+    const char* it = p + 19;
+    u32 nanoseconds = 0;
+    if (it != end && (*it == '.' || *it == ',')) {
+        it++;
+        const char* frac = it;
+        while (it != end && *it >= '0' && *it <= '9') {
+            it++;
+        }
+        if (it == frac) {
+            throw_bad_format("can't parse fractional part");
+        }
+        parse_fraction(frac, it, &nanoseconds);
+    }
+    i64 offset = 0;
+    if (it != end) {
+        if (*it == 'Z' || *it == 'z') {
+            it++;
+        } else if (*it == '+' || *it == '-') {
+            if (end - it != 6 || it[1] < '0' || it[1] > '9' || it[2] < '0' || it[2] > '9' ||
+                it[3] != ':' || it[4] < '0' || it[4] > '9' || it[5] < '0' || it[5] > '9')
+            {
+                throw_bad_format("bad timezone offset, +HH:MM was expected");
+            }
+            offset = two_digits(it + 1)*3600 + two_digits(it + 4)*60;
+            if (*it == '-') {
+                offset = -offset;
+            }
+            it += 6;
+        }
+        if (it != end) {
+            throw_bad_format("unknown timestamp format");
+        }
+    }
+    i64 hour_start;
+    if (!hour_to_epoch(two_digits(p)*100 + two_digits(p + 2), two_digits(p + 5), two_digits(p + 8),
+                       two_digits(p + 11), &hour_start))
+    {
+        throw_bad_format("bad timestamp format, date is out of range");
+    }
+    i64 seconds = hour_start + minute*60 + second - offset;
+    if (seconds < 0) {
+        throw_bad_format("timestamp is out of range");
+    }
+    return static_cast<aku_Timestamp>(seconds)*1000000000ul + nanoseconds;
+}
+
 aku_Timestamp DateTimeUtil::from_iso_string(const char* iso_str) {
     u32 len = static_cast<u32>(std::strlen(iso_str));
     if (len == 0) {
@@ -71,6 +270,15 @@ aku_Timestamp DateTimeUtil::from_iso_string(const char* iso_str) {
             break;
         }
     }
+    if (len >= 15) {
+        aku_Timestamp result;
+        if (parse_basic_format(iso_str, len, &result)) {
+            return result;
+        }
+        if (is_rfc3339(iso_str, len)) {
+            return parse_rfc3339(iso_str, len);
+        }
+    }
     if (len < 15 || iso_str[8] != 'T') {
         // Raw timestamp
         aku_Timestamp ts;
@@ -150,24 +358,45 @@ aku_Timestamp DateTimeUtil::from_iso_string(const char* iso_str) {
 int DateTimeUtil::to_iso_string(aku_Timestamp ts, char* buffer, size_t buffer_size) {
     using namespace boost::gregorian;
     using namespace boost::posix_time;
-    ptime ptime = to_boost_ptime(ts);
-    date date = ptime.date();
-    time_duration time = ptime.time_of_day();
-    gregorian_calendar::ymd_type ymd = gregorian_calendar::from_day_number(date.day_number());
-
-    auto fracsec = time.fractional_seconds();
-
-    int len = snprintf(buffer, buffer_size, "%04d%02d%02dT%02d%02d%02d.%09d",
-             // date part
-             (int)ymd.year, (int)ymd.month, (int)ymd.day,
-             // time part
-             (int)time.hours(), (int)time.minutes(), (int)time.seconds(), (int)fracsec
-             );
-
-    if (len < 0 || len == (int)buffer_size) {
-        return -26;
+    // Output is "YYYYMMDDTHHMMSS.nnnnnnnnn", date and time part is the same for all
+    // values of the same second so it's formatted only once, only fractional part
+    // is formatted for every value.
+    enum {
+        PREFIX_SIZE = 16,
+        OUTPUT_SIZE = 26,  // including '\0'
+    };
+    static thread_local aku_Timestamp cached_second = AKU_MAX_TIMESTAMP;
+    static thread_local char cached_prefix[PREFIX_SIZE + 1];
+    if (buffer_size < OUTPUT_SIZE) {
+        return -OUTPUT_SIZE;
+    }
+    const aku_Timestamp NS = 1000000000ul;
+    aku_Timestamp second = ts / NS;
+    if (second != cached_second) {
+        ptime ptime = to_boost_ptime(second * NS);
+        date date = ptime.date();
+        time_duration time = ptime.time_of_day();
+        gregorian_calendar::ymd_type ymd = gregorian_calendar::from_day_number(date.day_number());
+        int len = snprintf(cached_prefix, sizeof(cached_prefix), "%04d%02d%02dT%02d%02d%02d.",
+                 // date part
+                 (int)ymd.year, (int)ymd.month, (int)ymd.day,
+                 // time part
+                 (int)time.hours(), (int)time.minutes(), (int)time.seconds()
+                 );
+        if (len != PREFIX_SIZE) {
+            cached_second = AKU_MAX_TIMESTAMP;
+            return -OUTPUT_SIZE;
+        }
+        cached_second = second;
+    }
+    memcpy(buffer, cached_prefix, PREFIX_SIZE);
+    auto fracsec = ts % NS;
+    for (int i = OUTPUT_SIZE - 2; i >= PREFIX_SIZE; i--) {
+        buffer[i] = static_cast<char>('0' + fracsec % 10);
+        fracsec /= 10;
     }
-    return len + 1;
+    buffer[OUTPUT_SIZE - 1] = '\0';
+    return OUTPUT_SIZE;
 }
 
 aku_Duration DateTimeUtil::parse_duration(const char* str, size_t size) {
@@ -50,8 +50,9 @@ struct DateTimeUtil {
 
     /** Convert ISO formatter timestamp to aku_Timestamp value.
       * @note This function implements ISO 8601 partially compatible parser. Most of the standard is not
-      * supported yet - extended formatting (only basic format is supported), fractions on minutes or hours (
-      * like "20150102T1230.999"), timezones (values is treated as UTC time).
+      * supported yet - extended formatting (only basic format and RFC 3339 "YYYY-MM-DDTHH:MM:SS.fffZ"
+      * are supported), fractions on minutes or hours (like "20150102T1230.999"), timezones in the basic
+      * format (values is treated as UTC time).
       */
     static aku_Timestamp from_iso_string(const char* iso_str);
 
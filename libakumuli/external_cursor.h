@@ -1,6 +1,7 @@
 #pragma once
 
 #include "akumuli_def.h"
+#include <string>
 
 namespace Akumuli {
 
@@ -17,6 +18,22 @@ struct ExternalCursor {
      */
     virtual u32 read(void* buffer, u32 buffer_size) = 0;
 
+    /** Same as `read` but doesn't wait for the results that are not computed yet.
+     * @return number of overwritten bytes in `buffer`, zero if nothing is ready
+     *         (default implementation waits)
+     */
+    virtual u32 read_nowait(void* buffer, u32 buffer_size) { return read(buffer, buffer_size); }
+
+    /** Read scalar samples in columnar form.
+     * @param batch receives arrays owned by the cursor, they stay valid until the next call
+     * @return AKU_SUCCESS (batch->size is zero if nothing was read) or AKU_EBAD_DATA if
+     *         the next sample is not a scalar and should be read using `read`
+     */
+    virtual aku_Status read_batch(aku_Batch* batch) {
+        batch->size = 0;
+        return AKU_ENOT_IMPLEMENTED;
+    }
+
     //! Check is everything done
     virtual bool is_done() const = 0;
 
@@ -26,6 +43,18 @@ struct ExternalCursor {
     //! Finalizer
     virtual void close() = 0;
 
+    //! Get execution profile (empty if profiling wasn't requested)
+    virtual std::string get_profile() const { return std::string(); }
+
+    //! Get resume token of the incremental query (empty if the query isn't incremental)
+    virtual std::string get_resume_token() const { return std::string(); }
+
+    /** Limit the amount of results computed ahead of the reader.
+     * @param nbytes is a max size of the buffered results (rounded to the internal
+     *        buffer size), zero - default limit
+     */
+    virtual void set_prefetch(size_t nbytes) {}
+
     virtual ~ExternalCursor() = default;
 };
 
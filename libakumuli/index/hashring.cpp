@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hashring.h"
+#include "seriesparser.h"
+
+#include <algorithm>
+
+namespace Akumuli {
+
+HashRing::HashRing(u32 vnodes)
+    : vnodes_(std::max(vnodes, 1u))
+{
+}
+
+u64 HashRing::hash(const char* begin, const char* end) {
+    // FNV-1a followed by the 64-bit finalizer of the murmur3, djb2 used by
+    // the string pool doesn't mix the short strings well enough
+    u64 hash = 14695981039346656037ull;
+    for (const char* it = begin; it < end; it++) {
+        hash ^= static_cast<u8>(*it);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool HashRing::add_node(std::string const& name) {
+    if (std::find(nodes_.begin(), nodes_.end(), name) != nodes_.end()) {
+        return false;
+    }
+    nodes_.push_back(name);
+    for (u32 i = 0; i < vnodes_; i++) {
+        auto point = name + "#" + std::to_string(i);
+        auto key = hash(point.data(), point.data() + point.size());
+        // In case of collision the point is owned by the node with the smallest name
+        auto it = ring_.find(key);
+        if (it == ring_.end() || name < it->second) {
+            ring_[key] = name;
+        }
+    }
+    return true;
+}
+
+bool HashRing::remove_node(std::string const& name) {
+    auto it = std::find(nodes_.begin(), nodes_.end(), name);
+    if (it == nodes_.end()) {
+        return false;
+    }
+    nodes_.erase(it);
+    // Rebuild the ring to restore points that collided with the removed node
+    std::vector<std::string> nodes;
+    std::swap(nodes, nodes_);
+    ring_.clear();
+    for (auto const& node: nodes) {
+        add_node(node);
+    }
+    return true;
+}
+
+std::vector<std::string> const& HashRing::get_nodes() const {
+    return nodes_;
+}
+
+std::tuple<aku_Status, std::string> HashRing::find_owner(const char* begin, const char* end) const {
+    if (ring_.empty()) {
+        return std::make_tuple(AKU_ENOT_FOUND, std::string());
+    }
+    // Series is owned by the first point that follows its hash (clockwise)
+    auto it = ring_.lower_bound(hash(begin, end));
+    if (it == ring_.end()) {
+        it = ring_.begin();
+    }
+    return std::make_tuple(AKU_SUCCESS, it->second);
+}
+
+std::tuple<aku_Status, std::string> HashRing::route(const char* begin, const char* end) const {
+    char buf[AKU_LIMITS_MAX_SNAME];
+    const char* ksbegin = nullptr;
+    const char* ksend = nullptr;
+    auto status = SeriesParser::to_canonical_form(begin, end, buf, buf + AKU_LIMITS_MAX_SNAME,
+                                                  &ksbegin, &ksend);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, std::string());
+    }
+    return find_owner(buf, ksend);
+}
+
+}  // namespace
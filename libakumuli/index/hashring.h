@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include "akumuli_def.h"
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace Akumuli {
+
+/** Consistent hash ring.
+  * Maps series to the nodes of the cluster by the hash of the canonical series name.
+  * Every node is mapped to many points of the ring (virtual nodes) so the series are
+  * distributed evenly and only the series of the removed or added node change owner.
+  * Hash function doesn't depend on the process so every node of the cluster computes
+  * the same owner given the same set of nodes.
+  */
+class HashRing {
+    //! Point of the ring to the node name mapping
+    std::map<u64, std::string> ring_;
+    std::vector<std::string> nodes_;
+    const u32 vnodes_;
+
+public:
+    /** C-tor.
+      * @param vnodes is a number of virtual nodes per node
+      */
+    HashRing(u32 vnodes = 128);
+
+    //! Add node to the ring, return false if node was already added
+    bool add_node(std::string const& name);
+
+    //! Remove node from the ring, return false if node wasn't added
+    bool remove_node(std::string const& name);
+
+    //! Return list of nodes
+    std::vector<std::string> const& get_nodes() const;
+
+    /** Find owner of the series.
+      * @param begin points to the beginning of the series name (should be in canonical form)
+      * @param end points to the end of the series name
+      * @return AKU_ENOT_FOUND if the ring is empty and node name otherwise
+      */
+    std::tuple<aku_Status, std::string> find_owner(const char* begin, const char* end) const;
+
+    /** Convert series name to canonical form and find its owner.
+      * Same series is routed to the same node regardless of the order of tags.
+      */
+    std::tuple<aku_Status, std::string> route(const char* begin, const char* end) const;
+
+    //! Hash function used by the ring
+    static u64 hash(const char* begin, const char* end);
+};
+
+}  // namespace
@@ -0,0 +1,351 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "indexsnapshot.h"
+#include "log_iface.h"
+#include "crc32c.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Akumuli {
+
+static const u32 SNAPSHOT_MAGIC = 0x58494B41;  // "AKIX"
+static const u32 SNAPSHOT_VERSION = 1;
+
+//! Segment header
+struct SegmentHeader {
+    u32 magic;
+    u32 version;
+    u64 payload_size;
+    u32 crc;       //! Payload checksum
+    u32 nnames;    //! Number of series names in the segment
+    u64 last_id;   //! Largest series id in the segment
+} __attribute__((packed));
+
+static u32 checksum(const char* data, size_t size) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data, size);
+}
+
+template<class T>
+static void put(std::vector<char>* buf, T value) {
+    auto p = reinterpret_cast<const char*>(&value);
+    buf->insert(buf->end(), p, p + sizeof(T));
+}
+
+//! Payload reader, all reads are bounds checked
+struct PayloadReader {
+    const char* pos;
+    const char* end;
+
+    template<class T>
+    bool get(T* value) {
+        if (static_cast<size_t>(end - pos) < sizeof(T)) {
+            return false;
+        }
+        memcpy(value, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool get(const char** str, u32 size) {
+        if (static_cast<size_t>(end - pos) < size) {
+            return false;
+        }
+        *str = pos;
+        pos += size;
+        return true;
+    }
+};
+
+static void put_postings(std::vector<char>* buf, std::unordered_map<u64, std::vector<u32>> const& postings) {
+    put(buf, static_cast<u32>(postings.size()));
+    for (auto const& kv: postings) {
+        put(buf, kv.first);
+        put(buf, static_cast<u32>(kv.second.size()));
+        for (auto ord: kv.second) {
+            put(buf, ord);
+        }
+    }
+}
+
+static bool get_postings(PayloadReader* reader, u32 nnames, Index::PostingsT* postings) {
+    u32 nlists;
+    if (!reader->get(&nlists)) {
+        return false;
+    }
+    postings->reserve(nlists);
+    for (u32 i = 0; i < nlists; i++) {
+        u64 hash;
+        u32 size;
+        if (!reader->get(&hash) || !reader->get(&size)) {
+            return false;
+        }
+        std::vector<u32> ords;
+        ords.reserve(size);
+        for (u32 j = 0; j < size; j++) {
+            u32 ord;
+            if (!reader->get(&ord) || ord >= nnames) {
+                return false;
+            }
+            ords.push_back(ord);
+        }
+        postings->push_back(std::make_pair(hash, std::move(ords)));
+    }
+    return true;
+}
+
+IndexSnapshot::IndexSnapshot(std::string path)
+    : path_(path)
+    , fd_(-1)
+{
+    fd_ = open(path_.c_str(), O_RDWR|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP);
+    if (fd_ < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't open index snapshot " + path_ + ", error: " + strerror(errno));
+    }
+}
+
+IndexSnapshot::~IndexSnapshot() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void IndexSnapshot::disable(std::string const& reason) {
+    Logger::msg(AKU_LOG_ERROR, "Index snapshot " + path_ + " disabled, " + reason);
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+u64 IndexSnapshot::load(SeriesMatcher* matcher, u64 max_id) {
+    if (fd_ < 0) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        disable(std::string("can't read file size: ") + strerror(errno));
+        return 0;
+    }
+    std::vector<char> data(static_cast<size_t>(st.st_size));
+    size_t nread = 0;
+    while (nread < data.size()) {
+        auto n = pread(fd_, data.data() + nread, data.size() - nread, static_cast<off_t>(nread));
+        if (n <= 0) {
+            disable(std::string("read error: ") + strerror(errno));
+            return 0;
+        }
+        nread += static_cast<size_t>(n);
+    }
+    // Parse all segments first, snapshot can't be used if it's ahead of the
+    // metadata storage
+    struct Segment {
+        std::vector<std::tuple<const char*, u32, u64>> names;
+        Index::DeferredPostings postings;
+    };
+    std::vector<Segment> segments;
+    size_t valid_size = 0;
+    u64 last_id = 0;
+    u64 nnames = 0;
+    while (data.size() - valid_size >= sizeof(SegmentHeader)) {
+        SegmentHeader hdr;
+        memcpy(&hdr, data.data() + valid_size, sizeof(hdr));
+        const char* payload = data.data() + valid_size + sizeof(hdr);
+        if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION ||
+            hdr.payload_size > data.size() - valid_size - sizeof(hdr) ||
+            hdr.crc != checksum(payload, hdr.payload_size))
+        {
+            break;
+        }
+        PayloadReader reader = { payload, payload + hdr.payload_size };
+        Segment segment;
+        bool ok = true;
+        for (u32 i = 0; i < hdr.nnames && ok; i++) {
+            u64 id;
+            u32 size;
+            const char* name;
+            ok = reader.get(&id) && reader.get(&size) && reader.get(&name, size) && size != 0;
+            segment.names.push_back(std::make_tuple(name, size, id));
+        }
+        ok = ok && get_postings(&reader, hdr.nnames, &segment.postings.metrics)
+                && get_postings(&reader, hdr.nnames, &segment.postings.tags);
+        if (!ok) {
+            Logger::msg(AKU_LOG_ERROR, "Index snapshot " + path_ + " has malformed segment");
+            break;
+        }
+        segments.push_back(std::move(segment));
+        valid_size += sizeof(hdr) + hdr.payload_size;
+        last_id = std::max(last_id, hdr.last_id);
+        nnames += hdr.nnames;
+    }
+    if (last_id > max_id) {
+        Logger::msg(AKU_LOG_INFO, "Index snapshot " + path_ + " doesn't match metadata storage, discarded");
+        valid_size = 0;
+        segments.clear();
+        last_id = 0;
+        nnames = 0;
+    }
+    if (valid_size != data.size()) {
+        Logger::msg(AKU_LOG_INFO, "Index snapshot " + path_ + " truncated to " + std::to_string(valid_size) + " bytes");
+        if (ftruncate(fd_, static_cast<off_t>(valid_size)) != 0) {
+            disable(std::string("can't truncate file: ") + strerror(errno));
+            return 0;
+        }
+    }
+    // Add names and posting lists to the matcher
+    for (auto& segment: segments) {
+        segment.postings.ids.reserve(segment.names.size());
+        for (auto const& item: segment.names) {
+            const char* name;
+            u32 size;
+            u64 id;
+            std::tie(name, size, id) = item;
+            u64 poolid = matcher->_add_canonical(name, name + size, id);
+            if (poolid == 0) {
+                AKU_PANIC("Can't add series name from index snapshot");
+            }
+            segment.postings.ids.push_back(poolid);
+        }
+        matcher->_add_postings(std::move(segment.postings));
+    }
+    Logger::msg(AKU_LOG_INFO, "Index snapshot " + path_ + ": " + std::to_string(nnames) +
+                " names loaded from " + std::to_string(segments.size()) + " segments");
+    return last_id;
+}
+
+//! Serialize names and posting lists, return false if some name is malformed
+static bool make_segment(std::vector<IndexSnapshot::SeriesT> const& names, std::vector<char>* segment) {
+    std::vector<char> payload;
+    std::unordered_map<u64, std::vector<u32>> metrics;
+    std::unordered_map<u64, std::vector<u32>> tags;
+    std::vector<u64> hashes;
+    u64 last_id = 0;
+    u32 ord = 0;
+    for (auto const& item: names) {
+        const char* name;
+        int size;
+        u64 id;
+        std::tie(name, size, id) = item;
+        u64 mhash;
+        hashes.clear();
+        if (!Index::get_posting_keys(std::make_pair(name, size), &mhash, &hashes)) {
+            return false;
+        }
+        put(&payload, id);
+        put(&payload, static_cast<u32>(size));
+        payload.insert(payload.end(), name, name + size);
+        metrics[mhash].push_back(ord);
+        for (auto hash: hashes) {
+            tags[hash].push_back(ord);
+        }
+        last_id = std::max(last_id, id);
+        ord++;
+    }
+    put_postings(&payload, metrics);
+    put_postings(&payload, tags);
+
+    SegmentHeader hdr = {};
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.payload_size = payload.size();
+    hdr.crc = checksum(payload.data(), payload.size());
+    hdr.nnames = ord;
+    hdr.last_id = last_id;
+    segment->assign(reinterpret_cast<const char*>(&hdr),
+                    reinterpret_cast<const char*>(&hdr) + sizeof(hdr));
+    segment->insert(segment->end(), payload.begin(), payload.end());
+    return true;
+}
+
+//! Write the whole buffer, return false on error (errno is set)
+static bool write_all(int fd, std::vector<char> const& data) {
+    size_t nwritten = 0;
+    while (nwritten < data.size()) {
+        auto n = write(fd, data.data() + nwritten, data.size() - nwritten);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        nwritten += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+aku_Status IndexSnapshot::append(std::vector<SeriesT> const& names) {
+    if (fd_ < 0) {
+        return AKU_EGENERAL;
+    }
+    if (names.empty()) {
+        return AKU_SUCCESS;
+    }
+    std::vector<char> segment;
+    if (!make_segment(names, &segment)) {
+        return AKU_EBAD_DATA;
+    }
+    // Durability is not required, damaged segment will be discarded on load
+    if (!write_all(fd_, segment)) {
+        disable(std::string("write error: ") + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status IndexSnapshot::rewrite(std::vector<SeriesT> const& names) {
+    if (fd_ < 0) {
+        return AKU_EGENERAL;
+    }
+    std::vector<char> segment;
+    if (!names.empty() && !make_segment(names, &segment)) {
+        return AKU_EBAD_DATA;
+    }
+    // Old file stays in place until the new one is completely written
+    std::string tmp = path_ + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP);
+    if (fd < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + tmp + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    if (!write_all(fd, segment) || fsync(fd) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't write " + tmp + ", error: " + strerror(errno));
+        close(fd);
+        unlink(tmp.c_str());
+        return AKU_EGENERAL;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path_.c_str()) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't replace " + path_ + ", error: " + strerror(errno));
+        unlink(tmp.c_str());
+        return AKU_EGENERAL;
+    }
+    close(fd_);
+    fd_ = open(path_.c_str(), O_RDWR|O_APPEND);
+    if (fd_ < 0) {
+        disable(std::string("can't reopen file: ") + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+}  // namespace
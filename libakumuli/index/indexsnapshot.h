@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+#include "akumuli_def.h"
+#include "index/seriesparser.h"
+
+#include <string>
+#include <vector>
+
+namespace Akumuli {
+
+/** Append-only file that contains series names and posting lists of the index.
+  * Metadata storage (sqlite) is still the source of truth, the snapshot is used
+  * to avoid parsing and indexing every series name on startup.
+  *
+  * The file consists of segments, one segment is written on every sync. Segment
+  * starts with the header that contains payload size and checksum, payload
+  * contains series names (in canonical form) with their ids and posting lists.
+  * Postings reference names by their position inside the segment.
+  * Damaged segments at the end of the file (e.g. after crash) are truncated
+  * on load, missing names are loaded from the metadata storage and written
+  * to the snapshot again.
+  */
+class IndexSnapshot {
+    std::string path_;
+    int         fd_;
+
+    //! Close file and stop writing if something goes wrong
+    void disable(std::string const& reason);
+public:
+    typedef PlainSeriesMatcher::SeriesNameT SeriesT;
+
+    IndexSnapshot(std::string path);
+    ~IndexSnapshot();
+
+    IndexSnapshot(IndexSnapshot const&) = delete;
+    IndexSnapshot& operator = (IndexSnapshot const&) = delete;
+
+    /** Load snapshot into the series matcher. Names are added immediately,
+      * posting lists are added to the index on first query.
+      * @param matcher is a series matcher that should be updated
+      * @param max_id is a largest series id in metadata storage, if the snapshot
+      *        contains larger ids it's considered invalid and discarded
+      * @return largest series id in the snapshot (or 0 if nothing was loaded)
+      */
+    u64 load(SeriesMatcher* matcher, u64 max_id);
+
+    /** Append new segment. Names should be in canonical form and should be
+      * added in the same order as series ids were assigned.
+      */
+    aku_Status append(std::vector<SeriesT> const& names);
+
+    /** Replace the whole file with one segment that contains `names` (used to
+      * drop removed series). New file is written next to the old one and renamed.
+      */
+    aku_Status rewrite(std::vector<SeriesT> const& names);
+};
+
+}  // namespace
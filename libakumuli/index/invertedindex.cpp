@@ -19,8 +19,16 @@
 #include <random>
 #include <memory>
 #include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <limits>
 #include <sstream>
 
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
 #include "util.h"
 #include "stringpool.h"
 #include "seriesparser.h"
@@ -54,23 +62,6 @@ static const char* skip_tag(const char* p, const char* end, bool *error) {
     return c;
 }
 
-template<class Table>
-bool write_tags(const char* begin, const char* end, Table* dest_sketch, u64 id) {
-    const char* tag_begin = begin;
-    const char* tag_end = begin;
-    bool err = false;
-    while(!err && tag_begin != end) {
-        tag_begin = skip_space(tag_begin, end);
-        tag_end = tag_begin;
-        tag_end = skip_tag(tag_end, end, &err);
-        auto tagpair = std::make_pair(tag_begin, static_cast<u32>(tag_end - tag_begin));
-        u64 hash = StringTools::hash(tagpair);
-        dest_sketch->add(hash, id);
-        tag_begin = tag_end;
-    }
-    return err;
-}
-
 static StringT skip_metric_name(const char* begin, const char* end) {
     const char* p = begin;
     // skip metric name
@@ -128,39 +119,334 @@ u64 TwoUnivHashFnFamily::hash(int ix, u64 value) const {
 }
 
 
+//                      //
+//  Roaring containers  //
+//                      //
+
+namespace details {
+
+RoaringContainer::RoaringContainer(u64 key)
+    : key(key)
+    , cardinality(0)
+{
+}
+
+bool RoaringContainer::is_bitmap() const {
+    return !bitmap.empty();
+}
+
+bool RoaringContainer::add(u16 value) {
+    if (is_bitmap()) {
+        u64& word = bitmap[value >> 6];
+        u64 mask = 1ull << (value & 63);
+        if (word & mask) {
+            return false;
+        }
+        word |= mask;
+        cardinality++;
+        return true;
+    }
+    if (array.empty() || array.back() < value) {
+        array.push_back(value);
+    } else {
+        auto it = std::lower_bound(array.begin(), array.end(), value);
+        if (*it == value) {
+            return false;
+        }
+        array.insert(it, value);
+    }
+    cardinality++;
+    if (cardinality > MAX_ARRAY_SIZE) {
+        normalize();
+    }
+    return true;
+}
+
+bool RoaringContainer::remove(u16 value) {
+    if (is_bitmap()) {
+        u64& word = bitmap[value >> 6];
+        u64 mask = 1ull << (value & 63);
+        if ((word & mask) == 0) {
+            return false;
+        }
+        word &= ~mask;
+        cardinality--;
+        if (cardinality <= MAX_ARRAY_SIZE/2) {
+            // Hysteresis, array and bitmap shouldn't be switched back and forth
+            normalize();
+        }
+        return true;
+    }
+    auto it = std::lower_bound(array.begin(), array.end(), value);
+    if (it == array.end() || *it != value) {
+        return false;
+    }
+    array.erase(it);
+    cardinality--;
+    return true;
+}
+
+bool RoaringContainer::contains(u16 value) const {
+    if (is_bitmap()) {
+        return (bitmap[value >> 6] >> (value & 63)) & 1;
+    }
+    return std::binary_search(array.begin(), array.end(), value);
+}
+
+void RoaringContainer::normalize() {
+    if (is_bitmap() && cardinality <= MAX_ARRAY_SIZE) {
+        std::vector<u16> tmp;
+        tmp.reserve(cardinality);
+        for (u32 i = 0; i < BITMAP_WORDS; i++) {
+            u64 word = bitmap[i];
+            while (word) {
+                tmp.push_back(static_cast<u16>(i*64 + __builtin_ctzll(word)));
+                word &= word - 1;
+            }
+        }
+        array.swap(tmp);
+        std::vector<u64>().swap(bitmap);
+    } else if (!is_bitmap() && cardinality > MAX_ARRAY_SIZE) {
+        bitmap.resize(BITMAP_WORDS, 0);
+        for (auto value: array) {
+            bitmap[value >> 6] |= 1ull << (value & 63);
+        }
+        std::vector<u16>().swap(array);
+    }
+}
+
+size_t RoaringContainer::get_size_in_bytes() const {
+    return sizeof(RoaringContainer) + array.capacity()*sizeof(u16) + bitmap.capacity()*sizeof(u64);
+}
+
+/** Copy elements of `a` that are present (Keep = true) or not present (Keep = false) in `b`.
+  * Both arrays should be sorted.
+  */
+template<bool Keep>
+static void filter_array(const u16* a, size_t na, const u16* b, size_t nb, std::vector<u16>* out) {
+    size_t ia = 0;
+    size_t ib = 0;
+    size_t base = out->size();
+    out->resize(base + na);
+    u16* dest = out->data() + base;
+    if (na*64 < nb) {
+        // Sizes are skewed, use binary search
+        for (; ia < na; ia++) {
+            ib = static_cast<size_t>(std::lower_bound(b + ib, b + nb, a[ia]) - b);
+            bool present = ib < nb && b[ib] == a[ia];
+            if (present == Keep) {
+                *dest++ = a[ia];
+            }
+        }
+        out->resize(static_cast<size_t>(dest - out->data()));
+        return;
+    }
+#ifdef __SSE4_2__
+    const int mode = _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+    const size_t tail = nb & ~static_cast<size_t>(7);
+    while (ia + 8 <= na && ib + 8 <= nb) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + ia));
+        u16 amin = a[ia];
+        u16 amax = a[ia + 7];
+        // Skip blocks of `b` that are below the current block of `a`
+        while (ib + 8 <= nb && b[ib + 7] < amin) {
+            ib += 8;
+        }
+        int mask = 0;
+        size_t jb = ib;
+        while (jb + 8 <= nb && b[jb] <= amax) {
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + jb));
+            mask |= _mm_cvtsi128_si32(_mm_cmpestrm(vb, 8, va, 8, mode));
+            if (b[jb + 7] >= amax) {
+                break;
+            }
+            jb += 8;
+        }
+        if (jb == tail) {
+            // Last few elements of `b` don't fill the whole block
+            for (int i = 0; i < 8; i++) {
+                for (size_t k = tail; k < nb; k++) {
+                    if (b[k] == a[ia + i]) {
+                        mask |= 1 << i;
+                    }
+                }
+            }
+        }
+        unsigned bits = static_cast<unsigned>(Keep ? mask : ~mask & 0xFF);
+        while (bits) {
+            *dest++ = a[ia + __builtin_ctz(bits)];
+            bits &= bits - 1;
+        }
+        ia += 8;
+    }
+#endif
+    for (; ia < na; ia++) {
+        while (ib < nb && b[ib] < a[ia]) {
+            ib++;
+        }
+        bool present = ib < nb && b[ib] == a[ia];
+        if (present == Keep) {
+            *dest++ = a[ia];
+        }
+    }
+    out->resize(static_cast<size_t>(dest - out->data()));
+}
+
+//! Copy elements of the array container that are present (or not present) in the bitmap container
+template<bool Keep>
+static void filter_array(RoaringContainer const& a, RoaringContainer const& bmp, std::vector<u16>* out) {
+    for (auto value: a.array) {
+        if (bmp.contains(value) == Keep) {
+            out->push_back(value);
+        }
+    }
+}
+
+static RoaringContainer to_bitmap(RoaringContainer const& c) {
+    RoaringContainer res(c.key);
+    res.cardinality = c.cardinality;
+    if (c.is_bitmap()) {
+        res.bitmap = c.bitmap;
+    } else {
+        res.bitmap.resize(RoaringContainer::BITMAP_WORDS, 0);
+        for (auto value: c.array) {
+            res.bitmap[value >> 6] |= 1ull << (value & 63);
+        }
+    }
+    return res;
+}
+
+enum class SetOp {
+    AND,
+    OR,
+    ANDNOT,
+};
+
+//! Perform operation on two bitmaps word by word, result is stored in `lhs`
+template<SetOp op>
+static void bitmap_op(RoaringContainer* lhs, RoaringContainer const& rhs) {
+    u64* dest = lhs->bitmap.data();
+    const u64* src = rhs.bitmap.data();
+    u32 card = 0;
+    for (u32 i = 0; i < RoaringContainer::BITMAP_WORDS; i++) {
+        switch (op) {
+        case SetOp::AND:
+            dest[i] &= src[i];
+            break;
+        case SetOp::OR:
+            dest[i] |= src[i];
+            break;
+        case SetOp::ANDNOT:
+            dest[i] &= ~src[i];
+            break;
+        }
+        card += static_cast<u32>(__builtin_popcountll(dest[i]));
+    }
+    lhs->cardinality = card;
+    lhs->normalize();
+}
+
+static RoaringContainer container_and(RoaringContainer const& lhs, RoaringContainer const& rhs) {
+    RoaringContainer res(lhs.key);
+    if (lhs.is_bitmap() && rhs.is_bitmap()) {
+        res = to_bitmap(lhs);
+        bitmap_op<SetOp::AND>(&res, rhs);
+        return res;
+    }
+    if (lhs.is_bitmap()) {
+        filter_array<true>(rhs, lhs, &res.array);
+    } else if (rhs.is_bitmap()) {
+        filter_array<true>(lhs, rhs, &res.array);
+    } else if (lhs.array.size() <= rhs.array.size()) {
+        filter_array<true>(lhs.array.data(), lhs.array.size(), rhs.array.data(), rhs.array.size(), &res.array);
+    } else {
+        filter_array<true>(rhs.array.data(), rhs.array.size(), lhs.array.data(), lhs.array.size(), &res.array);
+    }
+    res.cardinality = static_cast<u32>(res.array.size());
+    return res;
+}
+
+static RoaringContainer container_or(RoaringContainer const& lhs, RoaringContainer const& rhs) {
+    RoaringContainer res(lhs.key);
+    if (lhs.is_bitmap() || rhs.is_bitmap()) {
+        RoaringContainer const& bmp = lhs.is_bitmap() ? lhs : rhs;
+        RoaringContainer const& other = lhs.is_bitmap() ? rhs : lhs;
+        res = to_bitmap(bmp);
+        if (other.is_bitmap()) {
+            bitmap_op<SetOp::OR>(&res, other);
+        } else {
+            for (auto value: other.array) {
+                res.add(value);
+            }
+        }
+        return res;
+    }
+    res.array.reserve(lhs.array.size() + rhs.array.size());
+    std::set_union(lhs.array.begin(), lhs.array.end(), rhs.array.begin(), rhs.array.end(),
+                   std::back_inserter(res.array));
+    res.cardinality = static_cast<u32>(res.array.size());
+    res.normalize();
+    return res;
+}
+
+static RoaringContainer container_andnot(RoaringContainer const& lhs, RoaringContainer const& rhs) {
+    RoaringContainer res(lhs.key);
+    if (lhs.is_bitmap()) {
+        res = to_bitmap(lhs);
+        if (rhs.is_bitmap()) {
+            bitmap_op<SetOp::ANDNOT>(&res, rhs);
+        } else {
+            for (auto value: rhs.array) {
+                u64& word = res.bitmap[value >> 6];
+                u64 mask = 1ull << (value & 63);
+                if (word & mask) {
+                    word &= ~mask;
+                    res.cardinality--;
+                }
+            }
+            res.normalize();
+        }
+        return res;
+    }
+    if (rhs.is_bitmap()) {
+        filter_array<false>(lhs, rhs, &res.array);
+    } else {
+        filter_array<false>(lhs.array.data(), lhs.array.size(), rhs.array.data(), rhs.array.size(), &res.array);
+    }
+    res.cardinality = static_cast<u32>(res.array.size());
+    return res;
+}
+
+}  // namespace details
+
+
 //                           //
 //  CompressedPListIterator  //
 //                           //
 
-CompressedPListConstIterator::CompressedPListConstIterator(std::vector<char> const& vec, size_t c)
-    : card_(c)
-    , reader_(reinterpret_cast<const unsigned char*>(vec.data()),
-              reinterpret_cast<const unsigned char*>(vec.data() + vec.size()))
-    , delta_(reader_)
+CompressedPListConstIterator::CompressedPListConstIterator(std::vector<details::RoaringContainer> const& containers)
+    : containers_(&containers)
+    , container_(0)
     , pos_(0)
+    , curr_()
 {
-    if (pos_ < card_) {
-        curr_ = delta_.next();
-    }
+    settle();
 }
 
 /**
  * @brief Create iterator pointing to the end of the sequence
  */
-CompressedPListConstIterator::CompressedPListConstIterator(std::vector<char> const& vec, size_t c, bool)
-    : card_(c)
-    , reader_(reinterpret_cast<const unsigned char*>(vec.data()),
-              reinterpret_cast<const unsigned char*>(vec.data() + vec.size()))
-    , delta_(reader_)
-    , pos_(c)
+CompressedPListConstIterator::CompressedPListConstIterator(std::vector<details::RoaringContainer> const& containers, bool)
+    : containers_(&containers)
+    , container_(containers.size())
+    , pos_(0)
     , curr_()
 {
 }
 
 CompressedPListConstIterator::CompressedPListConstIterator(CompressedPListConstIterator const& other)
-    : card_(other.card_)
-    , reader_(other.reader_)
-    , delta_(reader_, other.delta_)
+    : containers_(other.containers_)
+    , container_(other.container_)
     , pos_(other.pos_)
     , curr_(other.curr_)
 {
@@ -170,32 +456,57 @@ CompressedPListConstIterator& CompressedPListConstIterator::operator = (Compress
     if (this == &other) {
         return *this;
     }
-    card_ = other.card_;
-    reader_ = other.reader_;
-    delta_ = other.delta_;
+    containers_ = other.containers_;
+    container_ = other.container_;
     pos_ = other.pos_;
     curr_ = other.curr_;
     return *this;
 }
 
+void CompressedPListConstIterator::settle() {
+    while (container_ < containers_->size()) {
+        auto const& c = (*containers_)[container_];
+        if (c.is_bitmap()) {
+            u32 word = pos_ / 64;
+            if (word < details::RoaringContainer::BITMAP_WORDS) {
+                u64 bits = c.bitmap[word] & (~0ull << (pos_ % 64));
+                while (true) {
+                    if (bits) {
+                        pos_ = word*64 + static_cast<u32>(__builtin_ctzll(bits));
+                        curr_ = (c.key << 16) | pos_;
+                        return;
+                    }
+                    if (++word == details::RoaringContainer::BITMAP_WORDS) {
+                        break;
+                    }
+                    bits = c.bitmap[word];
+                }
+            }
+        } else if (pos_ < c.array.size()) {
+            curr_ = (c.key << 16) | c.array[pos_];
+            return;
+        }
+        container_++;
+        pos_ = 0;
+    }
+}
+
 u64 CompressedPListConstIterator::operator * () const {
     return curr_;
 }
 
 CompressedPListConstIterator& CompressedPListConstIterator::operator ++ () {
     pos_++;
-    if (pos_ < card_) {
-        curr_ = delta_.next();
-    }
+    settle();
     return *this;
 }
 
 bool CompressedPListConstIterator::operator == (CompressedPListConstIterator const& other) const {
-    return pos_ == other.pos_;
+    return container_ == other.container_ && pos_ == other.pos_;
 }
 
 bool CompressedPListConstIterator::operator != (CompressedPListConstIterator const& other) const {
-    return pos_ != other.pos_;
+    return !(*this == other);
 }
 
 
@@ -204,109 +515,158 @@ bool CompressedPListConstIterator::operator != (CompressedPListConstIterator con
 //                   //
 
 CompressedPList::CompressedPList()
-    : writer_(buffer_)
-    , delta_(writer_)
-    , cardinality_(0)
-    , moved_(false)
+    : cardinality_(0)
 {
 }
 
 CompressedPList::CompressedPList(CompressedPList const& other)
-    : buffer_(other.buffer_)
-    , writer_(buffer_)
-    , delta_(writer_)
+    : containers_(other.containers_)
     , cardinality_(other.cardinality_)
-    , moved_(false)
 {
-    assert(!other.moved_);
 }
 
 CompressedPList& CompressedPList::operator = (CompressedPList && other) {
-    assert(!other.moved_);
     if (this == &other) {
         return *this;
     }
-    other.moved_ = true;
-    buffer_.swap(other.buffer_);
-    // we don't need to assign writer_ since it contains pointer to buffer_
-    // already
-    // delta already contain correct pointer to writer_ we only need to
-    // update prev_ field
-    delta_.prev_ = other.delta_.prev_;
+    containers_.swap(other.containers_);
     cardinality_ = other.cardinality_;
     return *this;
 }
 
 CompressedPList::CompressedPList(CompressedPList && other)
-    : buffer_(std::move(other.buffer_))
-    , writer_(buffer_)
-    , delta_(writer_)
+    : containers_(std::move(other.containers_))
     , cardinality_(other.cardinality_)
-    , moved_(false)
 {
-    assert(!other.moved_);
-    other.moved_ = true;
 }
 
 void CompressedPList::add(u64 x) {
-    assert(!moved_);
-    delta_.put(x);
-    cardinality_++;
+    u64 key = x >> 16;
+    u16 low = static_cast<u16>(x & 0xFFFF);
+    if (containers_.empty() || containers_.back().key < key) {
+        containers_.emplace_back(key);
+        containers_.back().add(low);
+        cardinality_++;
+        return;
+    }
+    auto it = containers_.end() - 1;
+    if (it->key != key) {
+        it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                              [](details::RoaringContainer const& c, u64 k) {
+                                  return c.key < k;
+                              });
+        if (it->key != key) {
+            it = containers_.emplace(it, key);
+        }
+    }
+    if (it->add(low)) {
+        cardinality_++;
+    }
 }
 
 void CompressedPList::push_back(u64 x) {
-    assert(!moved_);
     add(x);
 }
 
+void CompressedPList::remove(u64 x) {
+    u64 key = x >> 16;
+    u16 low = static_cast<u16>(x & 0xFFFF);
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](details::RoaringContainer const& c, u64 k) {
+                                   return c.key < k;
+                               });
+    if (it == containers_.end() || it->key != key || !it->remove(low)) {
+        return;
+    }
+    cardinality_--;
+    if (it->cardinality == 0) {
+        containers_.erase(it);
+    }
+}
+
 size_t CompressedPList::getSizeInBytes() const {
-    assert(!moved_);
-    return buffer_.capacity();
+    size_t sum = 0;
+    for (auto const& c: containers_) {
+        sum += c.get_size_in_bytes();
+    }
+    return sum;
 }
 
 size_t CompressedPList::cardinality() const {
-    assert(!moved_);
     return cardinality_;
 }
 
 CompressedPList CompressedPList::operator & (CompressedPList const& other) const {
-    assert(!moved_);
     CompressedPList result;
-    std::set_intersection(begin(), end(), other.begin(), other.end(),
-                          std::back_inserter(result));
+    auto i = containers_.begin();
+    auto j = other.containers_.begin();
+    while (i != containers_.end() && j != other.containers_.end()) {
+        if (i->key < j->key) {
+            ++i;
+        } else if (j->key < i->key) {
+            ++j;
+        } else {
+            auto c = details::container_and(*i, *j);
+            if (c.cardinality != 0) {
+                result.cardinality_ += c.cardinality;
+                result.containers_.push_back(std::move(c));
+            }
+            ++i;
+            ++j;
+        }
+    }
     return result;
 }
 
 CompressedPList CompressedPList::operator | (CompressedPList const& other) const {
-    assert(!moved_);
     CompressedPList result;
-    std::set_union(begin(), end(), other.begin(), other.end(),
-                   std::back_inserter(result));
+    auto i = containers_.begin();
+    auto j = other.containers_.begin();
+    while (i != containers_.end() || j != other.containers_.end()) {
+        if (j == other.containers_.end() || (i != containers_.end() && i->key < j->key)) {
+            result.containers_.push_back(*i++);
+        } else if (i == containers_.end() || j->key < i->key) {
+            result.containers_.push_back(*j++);
+        } else {
+            result.containers_.push_back(details::container_or(*i++, *j++));
+        }
+        result.cardinality_ += result.containers_.back().cardinality;
+    }
     return result;
 }
 
 CompressedPList CompressedPList::operator ^ (CompressedPList const& other) const {
-    assert(!moved_);
     CompressedPList result;
-    std::set_difference(begin(), end(), other.begin(), other.end(),
-                        std::back_inserter(result));
+    auto j = other.containers_.begin();
+    for (auto const& c: containers_) {
+        while (j != other.containers_.end() && j->key < c.key) {
+            ++j;
+        }
+        if (j == other.containers_.end() || j->key != c.key) {
+            result.containers_.push_back(c);
+        } else {
+            auto diff = details::container_andnot(c, *j);
+            if (diff.cardinality == 0) {
+                continue;
+            }
+            result.containers_.push_back(std::move(diff));
+        }
+        result.cardinality_ += result.containers_.back().cardinality;
+    }
     return result;
 }
 
 CompressedPList CompressedPList::unique() const {
-    CompressedPList result;
-    std::unique_copy(begin(), end(), std::back_inserter(result));
-    return result;
+    // Values are always unique
+    return *this;
 }
 
 CompressedPListConstIterator CompressedPList::begin() const {
-    assert(!moved_);
-    return CompressedPListConstIterator(buffer_, cardinality_);
+    return CompressedPListConstIterator(containers_);
 }
 
 CompressedPListConstIterator CompressedPList::end() const {
-    assert(!moved_);
-    return CompressedPListConstIterator(buffer_, cardinality_, false);
+    return CompressedPListConstIterator(containers_, false);
 }
 
 //  CMSketch  //
@@ -336,6 +696,88 @@ void CMSketch::add(u64 key, u64 value) {
     }
 }
 
+aku_Status CMSketch::merge(CMSketch const& other) {
+    if (other.N != N || other.M != M) {
+        return AKU_EBAD_ARG;
+    }
+    for (u32 i = 0; i < N; i++) {
+        for (u32 j = 0; j < M; j++) {
+            table_[i][j] = table_[i][j] | other.table_[i][j];
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+void CMSketch::serialize(std::vector<char>* dest) const {
+    details::Base128StreamWriter stream(*dest);
+    stream.put(N);
+    stream.put(M);
+    for (auto const& row: table_) {
+        for (auto const& cell: row) {
+            stream.put(cell.cardinality());
+            u64 prev = 0;
+            for (auto it = cell.begin(); it != cell.end(); ++it) {
+                stream.put(*it - prev);
+                prev = *it;
+            }
+        }
+    }
+}
+
+//! Read base 128 encoded integer, return false on error
+static bool read_base128(const unsigned char** pos, const unsigned char* end, u64* dest) {
+    if (*pos == end) {
+        return false;
+    }
+    details::Base128Int<u64> val;
+    auto next = val.get(*pos, end);
+    if (next == *pos) {
+        return false;
+    }
+    *pos = next;
+    *dest = static_cast<u64>(val);
+    return true;
+}
+
+aku_Status CMSketch::deserialize(const char* begin, const char* end) {
+    auto pos = reinterpret_cast<const unsigned char*>(begin);
+    auto last = reinterpret_cast<const unsigned char*>(end);
+    u64 n, m;
+    if (!read_base128(&pos, last, &n) || !read_base128(&pos, last, &m) || n != N || m != M) {
+        return AKU_EBAD_DATA;
+    }
+    // Values are added only after the whole buffer is validated
+    std::vector<std::vector<u64>> cells(static_cast<size_t>(N)*M);
+    for (auto& cell: cells) {
+        u64 size;
+        if (!read_base128(&pos, last, &size) || size > static_cast<u64>(last - pos)) {
+            // Every value takes at least one byte
+            return AKU_EBAD_DATA;
+        }
+        u64 value = 0;
+        cell.reserve(size);
+        for (u64 k = 0; k < size; k++) {
+            u64 delta;
+            if (!read_base128(&pos, last, &delta)) {
+                return AKU_EBAD_DATA;
+            }
+            value += delta;
+            cell.push_back(value);
+        }
+    }
+    if (pos != last) {
+        return AKU_EBAD_DATA;
+    }
+    for (u32 i = 0; i < N; i++) {
+        for (u32 j = 0; j < M; j++) {
+            for (auto value: cells[static_cast<size_t>(i)*M + j]) {
+                table_[i][j].add(value);
+            }
+        }
+    }
+    return AKU_SUCCESS;
+}
+
 size_t CMSketch::get_size_in_bytes() const {
     size_t sum = 0;
     for (auto const& row: table_) {
@@ -356,6 +798,92 @@ CMSketch::TVal CMSketch::extract(u64 value) const {
     return *inputs[0] & *inputs[1] & *inputs[2];
 }
 
+//               //
+//  HyperLogLog  //
+//               //
+
+u64 HyperLogLog::mix(u64 hash) {
+    // Finalizer of the MurmurHash3
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void HyperLogLog::add_to_registers(u64 hash) {
+    auto ix = static_cast<u32>(hash >> (64 - PRECISION));
+    // Guard bit limits the rank if all remaining bits are zeroes
+    u64 rest = (hash << PRECISION) | (1ull << (PRECISION - 1));
+    auto rank = static_cast<u8>(__builtin_clzll(rest) + 1);
+    registers_[ix] = std::max(registers_[ix], rank);
+}
+
+void HyperLogLog::add(u64 hash) {
+    if (!registers_.empty()) {
+        add_to_registers(hash);
+        return;
+    }
+    if (std::find(exact_.begin(), exact_.end(), hash) != exact_.end()) {
+        return;
+    }
+    if (exact_.size() < MAX_EXACT) {
+        exact_.push_back(hash);
+        return;
+    }
+    registers_.resize(NREGISTERS, 0);
+    for (auto h: exact_) {
+        add_to_registers(h);
+    }
+    add_to_registers(hash);
+    exact_ = std::vector<u64>();
+}
+
+void HyperLogLog::merge(HyperLogLog const& other) {
+    for (auto hash: other.exact_) {
+        add(hash);
+    }
+    if (other.registers_.empty()) {
+        return;
+    }
+    if (registers_.empty()) {
+        registers_ = other.registers_;
+        for (auto h: exact_) {
+            add_to_registers(h);
+        }
+        exact_ = std::vector<u64>();
+        return;
+    }
+    for (size_t i = 0; i < NREGISTERS; i++) {
+        registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+}
+
+u64 HyperLogLog::estimate() const {
+    if (registers_.empty()) {
+        return exact_.size();
+    }
+    const double m = NREGISTERS;
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0;
+    u32 zeroes = 0;
+    for (auto r: registers_) {
+        sum += std::ldexp(1.0, -r);
+        zeroes += r == 0;
+    }
+    double estimate = alpha * m * m / sum;
+    if (estimate <= 2.5 * m && zeroes != 0) {
+        // Linear counting is more accurate for small cardinalities
+        estimate = m * std::log(m / zeroes);
+    }
+    return static_cast<u64>(estimate + 0.5);
+}
+
+size_t HyperLogLog::get_size_in_bytes() const {
+    return exact_.capacity() * sizeof(u64) + registers_.capacity();
+}
+
 //               //
 // InvertedIndex //
 //               //
@@ -367,6 +895,26 @@ void InvertedIndex::add(u64 key, u64 value) {
     table_[key].add(value);
 }
 
+void InvertedIndex::merge(u64 key, TVal&& plist) {
+    auto it = table_.find(key);
+    if (it == table_.end()) {
+        table_.insert(std::make_pair(key, std::move(plist)));
+    } else {
+        it->second = it->second | plist;
+    }
+}
+
+void InvertedIndex::remove(u64 key, u64 value) {
+    auto it = table_.find(key);
+    if (it == table_.end()) {
+        return;
+    }
+    it->second.remove(value);
+    if (it->second.cardinality() == 0) {
+        table_.erase(it);
+    }
+}
+
 size_t InvertedIndex::get_size_in_bytes() const {
     size_t sum = 0;
     for (auto const& row: table_) {
@@ -385,6 +933,14 @@ InvertedIndex::TVal InvertedIndex::extract(u64 value) const {
     return it->second;
 }
 
+size_t InvertedIndex::cardinality(u64 value) const {
+    auto it = table_.find(value);
+    if (it == table_.end()) {
+        return 0;
+    }
+    return it->second.cardinality();
+}
+
 
 //              //
 //  MetricName  //
@@ -476,6 +1032,117 @@ bool TagValuePair::check(const char* begin, const char* end) const {
 }
 
 
+//                   //
+//  TagValuePattern  //
+//                   //
+
+static bool glob_match(const char* pbegin, const char* pend, const char* begin, const char* end) {
+    const char* p = pbegin;
+    const char* s = begin;
+    // Position of the last star and the character that it should consume
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (s != end) {
+        if (p != pend && (*p == '?' || *p == *s)) {
+            p++;
+            s++;
+        } else if (p != pend && *p == '*') {
+            star = p++;
+            resume = s;
+        } else if (star != nullptr) {
+            p = star + 1;
+            s = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p != pend && *p == '*') {
+        p++;
+    }
+    return p == pend;
+}
+
+static std::string get_literal_prefix(TagValuePattern::Kind kind, std::string const& pattern) {
+    std::string prefix;
+    switch (kind) {
+    case TagValuePattern::Kind::GLOB:
+        for (auto c: pattern) {
+            if (c == '*' || c == '?') {
+                break;
+            }
+            prefix.push_back(c);
+        }
+        break;
+    case TagValuePattern::Kind::REGEX: {
+        if (pattern.find('|') != std::string::npos) {
+            // Alternatives may not have common prefix
+            break;
+        }
+        static const char* meta = "\\^$.|?*+()[]{}";
+        size_t ix = pattern.size() && pattern[0] == '^' ? 1 : 0;
+        for (; ix < pattern.size(); ix++) {
+            if (std::strchr(meta, pattern[ix]) != nullptr) {
+                break;
+            }
+            prefix.push_back(pattern[ix]);
+        }
+        if (ix < pattern.size() && !prefix.empty()) {
+            auto c = pattern[ix];
+            if (c == '?' || c == '*' || c == '{') {
+                // Quantifier is applied to the last character of the prefix
+                prefix.pop_back();
+            }
+        }
+    }
+    break;
+    };
+    return prefix;
+}
+
+TagValuePattern::TagValuePattern(Kind kind, std::string pattern)
+    : kind_(kind)
+    , pattern_(pattern)
+    , prefix_(get_literal_prefix(kind, pattern))
+{
+    if (kind_ == Kind::REGEX) {
+        regex_ = std::make_shared<std::regex>(pattern_, std::regex_constants::ECMAScript |
+                                                        std::regex_constants::optimize);
+    }
+}
+
+StringT TagValuePattern::get_prefix() const {
+    return std::make_pair(prefix_.data(), prefix_.size());
+}
+
+std::string TagValuePattern::to_regex() const {
+    if (kind_ == Kind::REGEX) {
+        return "(?:" + pattern_ + ")";
+    }
+    std::string res;
+    for (auto c: pattern_) {
+        if (c == '*') {
+            res += "\\S*";
+        } else if (c == '?') {
+            res += "\\S";
+        } else if (std::isalnum(static_cast<unsigned char>(c))) {
+            res.push_back(c);
+        } else {
+            res.push_back('\\');
+            res.push_back(c);
+        }
+    }
+    return res;
+}
+
+bool TagValuePattern::match(StringT value) const {
+    if (kind_ == Kind::REGEX) {
+        return std::regex_match(value.first, value.first + value.second, *regex_);
+    }
+    return glob_match(pattern_.data(), pattern_.data() + pattern_.size(),
+                      value.first, value.first + value.second);
+}
+
+
 //                             //
 //  IndexQueryResultsIterator  //
 //                             //
@@ -591,15 +1258,50 @@ IndexQueryResultsIterator IndexQueryResults::end() const {
 //  IncludeTags  //
 //               //
 
-IndexQueryResults IncludeIfAllTagsMatch::query(IndexBase const& index) const {
-    IndexQueryResults results = index.metric_query(metric_);
-    for(auto const& tv: pairs_) {
-        auto res = index.tagvalue_query(tv);
-        results = results.intersection(res);
+/** Intersect posting lists of the tag=value pairs and the base posting list.
+  * Lists are intersected in the order of their cardinality (smallest first),
+  * iteration stops when the intermediate result is empty.
+  * @param base returns base posting list (metric or union of metrics)
+  * @param base_card is a cardinality of the base posting list
+  */
+template<class Fn>
+static IndexQueryResults intersect_by_cardinality(IndexBase const& index,
+                                                  Fn const& base,
+                                                  size_t base_card,
+                                                  std::vector<TagValuePair> const& pairs)
+{
+    // Base list has index pairs.size()
+    std::vector<std::pair<size_t, size_t>> order;
+    order.push_back(std::make_pair(base_card, pairs.size()));
+    for (size_t i = 0; i < pairs.size(); i++) {
+        order.push_back(std::make_pair(index.tagvalue_cardinality(pairs[i]), i));
+    }
+    std::sort(order.begin(), order.end());
+    if (order.front().first == 0) {
+        return IndexQueryResults();
     }
+    auto extract = [&](size_t ix) {
+        return ix == pairs.size() ? base() : index.tagvalue_query(pairs[ix]);
+    };
+    IndexQueryResults results = extract(order.front().second);
+    for (size_t i = 1; i < order.size() && results.cardinality() != 0; i++) {
+        results = results.intersection(extract(order[i].second));
+    }
+    return results;
+}
+
+IndexQueryResults IncludeIfAllTagsMatch::query(IndexBase const& index) const {
+    auto base = [&]() {
+        return index.metric_query(metric_);
+    };
+    auto results = intersect_by_cardinality(index, base, index.metric_cardinality(metric_), pairs_);
     return results.filter(metric_).filter(pairs_);
 }
 
+std::vector<StringT> IncludeIfAllTagsMatch::get_metrics() const {
+    return { metric_.get_value() };
+}
+
 //                    //
 //  IncludeMany2Many  //
 //                    //
@@ -611,11 +1313,39 @@ IncludeMany2Many::IncludeMany2Many(std::string mname, std::map<std::string, std:
 {
 }
 
+IncludeMany2Many::IncludeMany2Many(std::string mname,
+                                   std::map<std::string, std::vector<std::string>> const& map,
+                                   std::map<std::string, TagValuePattern> const& patterns)
+    : IndexQueryNodeBase(node_name_)
+    , metric_(mname.data(), mname.data() + mname.size())
+    , tags_(map)
+    , patterns_(patterns)
+{
+}
+
 IndexQueryResults IncludeMany2Many::query(IndexBase const& index) const {
+    std::map<std::string, std::vector<std::string>> tags(tags_);
+    for (auto const& kv: patterns_) {
+        // Only values that share the literal prefix with the pattern
+        // are extracted from the index
+        auto values = index.list_tag_values(metric_.get_value(), tostrt(kv.first),
+                                            kv.second.get_prefix(), std::numeric_limits<size_t>::max());
+        auto& dest = tags[kv.first];
+        auto size = dest.size();
+        for (auto val: values) {
+            if (kv.second.match(val)) {
+                dest.push_back(fromstrt(val));
+            }
+        }
+        if (dest.size() == size) {
+            // Nothing matches the pattern
+            return IndexQueryResults();
+        }
+    }
     std::vector<TagValuePair> tgv;
     IndexQueryResults final_res;
     bool first = true;
-    for (auto kv: tags_) {
+    for (auto const& kv: tags) {
         if (kv.second.size() > 0) {
             std::stringstream pair;
             pair << kv.first << "=" << kv.second[0];
@@ -647,6 +1377,10 @@ IndexQueryResults IncludeMany2Many::query(IndexBase const& index) const {
     return final_res.filter(metric_).filter(tgv);
 }
 
+std::vector<StringT> IncludeMany2Many::get_metrics() const {
+    return { metric_.get_value() };
+}
+
 //                   //
 //  IncludeIfHasTag  //
 //                   //
@@ -666,6 +1400,10 @@ IndexQueryResults IncludeIfHasTag::query(IndexBase const& index) const {
     return subquery.query(index);
 }
 
+std::vector<StringT> IncludeIfHasTag::get_metrics() const {
+    return { tostrt(metric_) };
+}
+
 
 //               //
 //  ExcludeTags  //
@@ -681,44 +1419,60 @@ IndexQueryResults ExcludeTags::query(IndexBase const& index) const {
     return results.filter(metric_);
 }
 
+std::vector<StringT> ExcludeTags::get_metrics() const {
+    return { metric_.get_value() };
+}
+
 
 //              //
 //  JoinByTags  //
 //              //
 
 IndexQueryResults JoinByTags::query(IndexBase const& index) const {
-    IndexQueryResults results;
+    size_t card = 0;
     for(auto const& m: metrics_) {
-        auto res = index.metric_query(m);
-        results = results.join(res);
-    }
-    for(auto const& tv: pairs_) {
-        auto res = index.tagvalue_query(tv);
-        results.difference(res);
+        card += index.metric_cardinality(m);
     }
+    auto base = [&]() {
+        IndexQueryResults results;
+        for(auto const& m: metrics_) {
+            auto res = index.metric_query(m);
+            results = results.join(res);
+        }
+        return results;
+    };
+    auto results = intersect_by_cardinality(index, base, card, pairs_);
     return results.filter(metrics_).filter(pairs_);
 }
 
+std::vector<StringT> JoinByTags::get_metrics() const {
+    std::vector<StringT> result;
+    for (auto const& m: metrics_) {
+        result.push_back(m.get_value());
+    }
+    return result;
+}
+
 
 //                      //
 //  SeriesNameTopology  //
 //                      //
 
 
+bool SeriesNameTopology::Less::operator () (StringT const& lhs, StringT const& rhs) const {
+    auto len = std::min(lhs.second, rhs.second);
+    int res = std::memcmp(lhs.first, rhs.first, static_cast<size_t>(len));
+    return res == 0 ? lhs.second < rhs.second : res < 0;
+}
+
 SeriesNameTopology::SeriesNameTopology()
-    : index_(StringTools::create_l3_table(1000))
 {
 }
 
 void SeriesNameTopology::add_name(StringT name) {
     StringT metric = skip_metric_name(name.first, name.first + name.second);
     StringT tags = std::make_pair(name.first + metric.second, name.second - metric.second);
-    auto it = index_.find(metric);
-    if (it == index_.end()) {
-        StringTools::L2TableT tagtable = StringTools::create_l2_table(1024);
-        index_[metric] = std::move(tagtable);
-        it = index_.find(metric);
-    }
+    TagsT& tagtable = index_[metric];
     // Iterate through tags
     const char* p = tags.first;
     const char* end = p + tags.second;
@@ -737,69 +1491,230 @@ void SeriesNameTopology::add_name(StringT name) {
         if (!split_pair(tagstr, &tag, &val)) {
             error = true;
         }
-        StringTools::L2TableT& tagtable = it->second;
-        auto tagit = tagtable.find(tag);
-        if (tagit == tagtable.end()) {
-            auto valtab = StringTools::create_set(1024);
-            tagtable[tag] = std::move(valtab);
-            tagit = tagtable.find(tag);
-        }
-        StringTools::SetT& valueset = tagit->second;
-        valueset.insert(val);
+        tagtable[tag].insert(val);
         // next
         p = skip_space(tag_end, end);
     }
 }
 
-std::vector<StringT> SeriesNameTopology::list_metric_names() const {
+void SeriesNameTopology::add_metric(StringT metric) {
+    index_[metric];
+}
+
+void SeriesNameTopology::clear_metric(StringT metric) {
+    auto it = index_.find(metric);
+    if (it != index_.end()) {
+        it->second.clear();
+    }
+}
+
+//! Copy first `limit` keys that start with the prefix
+template<class Container, class Fn>
+static std::vector<StringT> list_prefix_range(Container const& cont, StringT prefix, size_t limit, Fn const& getkey) {
     std::vector<StringT> res;
-    std::transform(index_.begin(), index_.end(), std::back_inserter(res),
-                   [](std::pair<StringT, StringTools::L2TableT> const& v) {
-                        return v.first;
-                   });
+    for (auto it = cont.lower_bound(prefix); it != cont.end() && res.size() < limit; it++) {
+        StringT key = getkey(*it);
+        if (key.second < prefix.second || std::memcmp(key.first, prefix.first, static_cast<size_t>(prefix.second)) != 0) {
+            break;
+        }
+        res.push_back(key);
+    }
     return res;
 }
 
+std::vector<StringT> SeriesNameTopology::list_metric_names() const {
+    return list_metric_names(std::make_pair("", 0), std::numeric_limits<size_t>::max());
+}
+
 std::vector<StringT> SeriesNameTopology::list_tags(StringT metric) const {
-    std::vector<StringT> res;
+    return list_tags(metric, std::make_pair("", 0), std::numeric_limits<size_t>::max());
+}
+
+std::vector<StringT> SeriesNameTopology::list_tag_values(StringT metric, StringT tag) const {
+    return list_tag_values(metric, tag, std::make_pair("", 0), std::numeric_limits<size_t>::max());
+}
+
+std::vector<StringT> SeriesNameTopology::list_metric_names(StringT prefix, size_t limit) const {
+    return list_prefix_range(index_, prefix, limit, [](IndexT::value_type const& kv) {
+        return kv.first;
+    });
+}
+
+std::vector<StringT> SeriesNameTopology::list_tags(StringT metric, StringT prefix, size_t limit) const {
     auto it = index_.find(metric);
     if (it == index_.end()) {
-        return res;
+        return std::vector<StringT>();
     }
-    std::transform(it->second.begin(), it->second.end(), std::back_inserter(res),
-                   [](std::pair<StringT, StringTools::SetT> const& v) {
-                        return v.first;
-                   });
-    return res;
+    return list_prefix_range(it->second, prefix, limit, [](TagsT::value_type const& kv) {
+        return kv.first;
+    });
 }
 
-std::vector<StringT> SeriesNameTopology::list_tag_values(StringT metric, StringT tag) const {
-    std::vector<StringT> res;
+std::vector<StringT> SeriesNameTopology::list_tag_values(StringT metric, StringT tag, StringT prefix, size_t limit) const {
     auto it = index_.find(metric);
     if (it == index_.end()) {
-        return res;
+        return std::vector<StringT>();
     }
     auto vit = it->second.find(tag);
     if (vit == it->second.end()) {
-        return res;
+        return std::vector<StringT>();
     }
-    const auto& set = vit->second;
-    std::copy(set.begin(), set.end(), std::back_inserter(res));
-    return res;
+    return list_prefix_range(vit->second, prefix, limit, [](StringT const& val) {
+        return val;
+    });
 }
 
 //         //
 //  Index  //
 //         //
 
+Index::MetricSegment::MetricSegment()
+    : resident(false)
+    , last_access{0}
+{
+}
+
 Index::Index()
-    : table_(StringTools::create_table(100000))
+    : table_(100000, &StringTools::hash, &StringTools::equal)
     , metrics_names_(1024)
     , tagvalue_pairs_(1024)
+    , resident_limit_(0)
+    , access_clock_{0}
+    , nmaterialized_(0)
+    , nevicted_(0)
 {
 }
 
+void Index::set_resident_limit(size_t limit) {
+    resident_limit_ = limit;
+}
+
+size_t Index::get_resident_limit() const {
+    return resident_limit_;
+}
+
+bool Index::touch(std::vector<StringT> const& metrics) const {
+    if (resident_limit_ == 0) {
+        return true;
+    }
+    auto now = ++access_clock_;
+    for (auto metric: metrics) {
+        auto it = segments_.find(StringTools::hash(metric));
+        if (it == segments_.end()) {
+            // Metric doesn't have any series
+            continue;
+        }
+        if (!it->second.resident) {
+            return false;
+        }
+        it->second.last_access.store(now);
+    }
+    return true;
+}
+
+void Index::materialize(std::vector<StringT> const& metrics) const {
+    restore_deferred();
+    if (resident_limit_ == 0) {
+        return;
+    }
+    auto now = ++access_clock_;
+    for (auto metric: metrics) {
+        auto it = segments_.find(StringTools::hash(metric));
+        if (it == segments_.end()) {
+            continue;
+        }
+        it->second.last_access.store(now);
+        if (!it->second.resident) {
+            build_segment(it->first, it->second);
+        }
+    }
+    // Evict least recently used metrics, metrics of the current
+    // query have the latest access time and stay resident
+    while (resident_.size() > resident_limit_) {
+        size_t victim = resident_.size();
+        u64 oldest = now;
+        for (size_t i = 0; i < resident_.size(); i++) {
+            auto last_access = segments_.at(resident_[i]).last_access.load();
+            if (last_access < oldest) {
+                oldest = last_access;
+                victim = i;
+            }
+        }
+        if (victim == resident_.size()) {
+            break;
+        }
+        auto hash = resident_[victim];
+        drop_segment(hash, segments_.at(hash));
+        resident_[victim] = resident_.back();
+        resident_.pop_back();
+    }
+}
+
+void Index::build_segment(u64 metric_hash, MetricSegment& segment) const {
+    // Ids are sorted to build metric posting list in ascending order
+    std::sort(segment.ids.begin(), segment.ids.end());
+    std::vector<u64> thashes;
+    for (auto id: segment.ids) {
+        auto name = pool_.str(id);
+        u64 mhash;
+        thashes.clear();
+        if (get_posting_keys(name, &mhash, &thashes)) {
+            add_postings(name, id, metric_hash, thashes);
+        }
+    }
+    segment.resident = true;
+    resident_.push_back(metric_hash);
+    nmaterialized_++;
+}
+
+void Index::drop_segment(u64 metric_hash, MetricSegment& segment) const {
+    std::vector<u64> thashes;
+    for (auto id: segment.ids) {
+        auto name = pool_.str(id);
+        u64 mhash;
+        thashes.clear();
+        if (get_posting_keys(name, &mhash, &thashes)) {
+            metrics_names_.remove(metric_hash, id);
+            for (auto hash: thashes) {
+                tagvalue_pairs_.remove(hash, id);
+            }
+            // Metrics with colliding hashes share the segment
+            topology_.clear_metric(skip_metric_name(name.first, name.first + name.second));
+        }
+    }
+    segment.resident = false;
+    nevicted_++;
+}
+
+void Index::add_postings(StringT name, u64 id, u64 metric_hash, std::vector<u64> const& tag_hashes) const {
+    for (auto hash: tag_hashes) {
+        tagvalue_pairs_.add(hash, id);
+    }
+    metrics_names_.add(metric_hash, id);
+    topology_.add_name(name);
+}
+
+void Index::add_to_segment(StringT name, u64 id, u64 metric_hash, std::vector<u64> const& tag_hashes) const {
+    auto& segment = segments_[metric_hash];
+    segment.ids.push_back(id);
+    if (segment.resident) {
+        add_postings(name, id, metric_hash, tag_hashes);
+    } else {
+        topology_.add_metric(skip_metric_name(name.first, name.first + name.second));
+    }
+}
+
+Index::ResidentStats Index::get_resident_stats() const {
+    ResidentStats stats = {};
+    stats.metrics = segments_.size();
+    stats.resident = resident_.size();
+    stats.materialized = nmaterialized_;
+    stats.evicted = nevicted_;
+    return stats;
+}
+
 SeriesNameTopology const& Index::get_topology() const {
+    restore_deferred();
     return topology_;
 }
 
@@ -808,7 +1723,7 @@ size_t Index::cardinality() const {
 }
 
 size_t Index::memory_use() const {
-    // TODO: use counting allocator for table_ to provide memory stats
+    // table_ is not included, it's accounted globally (see AKU_MEM_SERIES_TABLE)
     size_t sm = metrics_names_.get_size_in_bytes();
     size_t st = tagvalue_pairs_.get_size_in_bytes();
     size_t sp = pool_.mem_used();
@@ -816,16 +1731,44 @@ size_t Index::memory_use() const {
 }
 
 size_t Index::index_memory_use() const {
-    // TODO: use counting allocator for table_ to provide memory stats
+    // table_ is not included, it's accounted globally (see AKU_MEM_SERIES_TABLE)
     size_t sm = metrics_names_.get_size_in_bytes();
     size_t st = tagvalue_pairs_.get_size_in_bytes();
-    return sm + st;
+    size_t sk = 0;
+    for (auto const& kv: metric_sketches_) {
+        sk += kv.second.get_size_in_bytes();
+    }
+    for (auto const& kv: tagvalue_sketches_) {
+        sk += kv.second.get_size_in_bytes();
+    }
+    for (auto const& kv: segments_) {
+        sk += kv.second.ids.capacity() * sizeof(u64);
+    }
+    return sm + st + sk;
 }
 
 size_t Index::pool_memory_use() const {
     return pool_.mem_used();
 }
 
+bool Index::get_posting_keys(StringT name, u64* metric_hash, std::vector<u64>* tag_hashes) {
+    const char* end = name.first + name.second;
+    auto mname = skip_metric_name(name.first, end);
+    if (mname.second == 0) {
+        return false;
+    }
+    *metric_hash = StringTools::hash(mname);
+    const char* tag_begin = skip_space(mname.first + mname.second, end);
+    bool err = false;
+    while(!err && tag_begin != end) {
+        const char* tag_end = skip_tag(tag_begin, end, &err);
+        auto tagpair = std::make_pair(tag_begin, static_cast<u32>(tag_end - tag_begin));
+        tag_hashes->push_back(StringTools::hash(tagpair));
+        tag_begin = skip_space(tag_end, end);
+    }
+    return !err;
+}
+
 std::tuple<aku_Status, StringT> Index::append(const char* begin, const char* end) {
     static StringT EMPTY_STRING = std::make_pair(nullptr, 0);
     // Parse string value and sort tags alphabetically
@@ -839,50 +1782,233 @@ std::tuple<aku_Status, StringT> Index::append(const char* begin, const char* end
     // Check if name is already been added
     auto name = std::make_pair(static_cast<const char*>(buffer), tags_end - buffer);
     if (table_.count(name) == 0) {
-        // insert value
-        auto id = pool_.add(buffer, tags_end);
-        if (id == 0) {
+        u64 mhash;
+        std::vector<u64> thashes;
+        if (!get_posting_keys(name, &mhash, &thashes)) {
             return std::make_tuple(AKU_EBAD_DATA, EMPTY_STRING);
         }
-        write_tags(tags_begin, tags_end, &tagvalue_pairs_, id);
-        name = pool_.str(id);  // name now have the same lifetime as pool
-        table_[name] = id;
-        auto mname = skip_metric_name(buffer, tags_begin);
-        if (mname.second == 0) {
-            return std::make_tuple(AKU_EBAD_DATA, EMPTY_STRING);
-        }
-        auto mhash = StringTools::hash(mname);
-        metrics_names_.add(mhash, id);
-        // update topology
-        topology_.add_name(name);
-        return std::make_tuple(AKU_SUCCESS, name);
+        return append_parsed(name, mhash, thashes);
     }
     auto it = table_.find(name);
     return std::make_tuple(AKU_SUCCESS, it->first);
 }
 
+std::tuple<aku_Status, StringT> Index::append_parsed(StringT name, u64 metric_hash, std::vector<u64> const& tag_hashes) {
+    static StringT EMPTY_STRING = std::make_pair(nullptr, 0);
+    auto it = table_.find(name);
+    if (it != table_.end()) {
+        return std::make_tuple(AKU_SUCCESS, it->first);
+    }
+    // insert value
+    auto id = pool_.add(name.first, name.first + name.second);
+    if (id == 0) {
+        return std::make_tuple(AKU_EBAD_DATA, EMPTY_STRING);
+    }
+    name = pool_.str(id);  // name now have the same lifetime as pool
+    table_[name] = id;
+    update_sketches(name, metric_hash, tag_hashes);
+    if (resident_limit_ != 0) {
+        add_to_segment(name, id, metric_hash, tag_hashes);
+    } else {
+        add_postings(name, id, metric_hash, tag_hashes);
+    }
+    return std::make_tuple(AKU_SUCCESS, name);
+}
+
+std::tuple<aku_Status, StringT, u64> Index::append_canonical(const char* begin, const char* end) {
+    static StringT EMPTY_STRING = std::make_pair(nullptr, 0);
+    auto name = std::make_pair(begin, end - begin);
+    auto it = table_.find(name);
+    if (it != table_.end()) {
+        return std::make_tuple(AKU_SUCCESS, it->first, it->second);
+    }
+    auto id = pool_.add(begin, end);
+    if (id == 0) {
+        return std::make_tuple(AKU_EBAD_DATA, EMPTY_STRING, 0ull);
+    }
+    name = pool_.str(id);
+    table_[name] = id;
+    return std::make_tuple(AKU_SUCCESS, name, id);
+}
+
+void Index::append_deferred(DeferredPostings&& postings) {
+    deferred_.push_back(std::move(postings));
+}
+
+bool Index::remove(StringT name) {
+    // Postings from the snapshot should be merged first, otherwise
+    // the name will be added back on first query
+    restore_deferred();
+    auto it = table_.find(name);
+    if (it == table_.end()) {
+        return false;
+    }
+    auto id = it->second;
+    u64 mhash;
+    std::vector<u64> thashes;
+    if (get_posting_keys(it->first, &mhash, &thashes)) {
+        metrics_names_.remove(mhash, id);
+        for (auto hash: thashes) {
+            tagvalue_pairs_.remove(hash, id);
+        }
+        auto sit = segments_.find(mhash);
+        if (sit != segments_.end()) {
+            auto& ids = sit->second.ids;
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+        }
+    }
+    table_.erase(it);
+    return true;
+}
+
+void Index::restore_deferred() const {
+    if (deferred_.empty()) {
+        return;
+    }
+    // Deferred names were added before any other name so their ids are
+    // smaller. Posting lists are built in ascending order and then merged.
+    // Zero id marks the name that was already indexed.
+    std::unordered_map<u64, CompressedPList> metrics;
+    std::unordered_map<u64, CompressedPList> tags;
+    if (resident_limit_ != 0) {
+        // Lazy mode, names are only grouped by metric, posting lists are
+        // built on first query
+        std::vector<u64> thashes;
+        for (auto const& segment: deferred_) {
+            for (auto id: segment.ids) {
+                if (id == 0) {
+                    continue;
+                }
+                auto name = pool_.str(id);
+                u64 mhash;
+                thashes.clear();
+                if (get_posting_keys(name, &mhash, &thashes)) {
+                    update_sketches(name, mhash, thashes);
+                    add_to_segment(name, id, mhash, thashes);
+                }
+            }
+        }
+        deferred_.clear();
+        return;
+    }
+    for (auto const& segment: deferred_) {
+        for (auto const& kv: segment.metrics) {
+            auto& plist = metrics[kv.first];
+            for (auto ord: kv.second) {
+                if (auto id = segment.ids.at(ord)) {
+                    plist.add(id);
+                }
+            }
+        }
+        for (auto const& kv: segment.tags) {
+            auto& plist = tags[kv.first];
+            for (auto ord: kv.second) {
+                if (auto id = segment.ids.at(ord)) {
+                    plist.add(id);
+                }
+            }
+        }
+        std::vector<u64> thashes;
+        for (auto id: segment.ids) {
+            if (id == 0) {
+                continue;
+            }
+            auto name = pool_.str(id);
+            topology_.add_name(name);
+            u64 mhash;
+            thashes.clear();
+            if (get_posting_keys(name, &mhash, &thashes)) {
+                update_sketches(name, mhash, thashes);
+            }
+        }
+    }
+    for (auto& kv: metrics) {
+        metrics_names_.merge(kv.first, std::move(kv.second));
+    }
+    for (auto& kv: tags) {
+        tagvalue_pairs_.merge(kv.first, std::move(kv.second));
+    }
+    deferred_.clear();
+}
+
 IndexQueryResults Index::tagvalue_query(const TagValuePair &value) const {
+    restore_deferred();
     auto hash = StringTools::hash(value.get_value());
     auto post = tagvalue_pairs_.extract(hash);
     return IndexQueryResults(std::move(post), &pool_);
 }
 
 IndexQueryResults Index::metric_query(const MetricName &value) const {
+    restore_deferred();
     auto hash = StringTools::hash(value.get_value());
     auto post = metrics_names_.extract(hash);
     return IndexQueryResults(std::move(post), &pool_);
 }
 
+size_t Index::tagvalue_cardinality(const TagValuePair &value) const {
+    restore_deferred();
+    return tagvalue_pairs_.cardinality(StringTools::hash(value.get_value()));
+}
+
+size_t Index::metric_cardinality(const MetricName &value) const {
+    restore_deferred();
+    auto hash = StringTools::hash(value.get_value());
+    if (resident_limit_ != 0) {
+        // Doesn't require posting lists
+        auto it = segments_.find(hash);
+        return it == segments_.end() ? 0 : it->second.ids.size();
+    }
+    return metrics_names_.cardinality(hash);
+}
+
+//! Key of the tag=value pair sketch
+static u64 sketch_key(u64 metric_hash, u64 tag_hash) {
+    return HyperLogLog::mix(metric_hash) ^ tag_hash;
+}
+
+void Index::update_sketches(StringT name, u64 metric_hash, std::vector<u64> const& tag_hashes) const {
+    auto hash = HyperLogLog::mix(StringTools::hash(name));
+    metric_sketches_[metric_hash].add(hash);
+    for (auto tag_hash: tag_hashes) {
+        tagvalue_sketches_[sketch_key(metric_hash, tag_hash)].add(hash);
+    }
+}
+
+u64 Index::estimate_cardinality(StringT metric, std::vector<StringT> const& pairs) const {
+    restore_deferred();
+    auto metric_hash = StringTools::hash(metric);
+    if (pairs.empty()) {
+        auto it = metric_sketches_.find(metric_hash);
+        return it == metric_sketches_.end() ? 0 : it->second.estimate();
+    }
+    HyperLogLog result;
+    for (auto pair: pairs) {
+        auto it = tagvalue_sketches_.find(sketch_key(metric_hash, StringTools::hash(pair)));
+        if (it != tagvalue_sketches_.end()) {
+            result.merge(it->second);
+        }
+    }
+    return result.estimate();
+}
+
 std::vector<StringT> Index::list_metric_names() const {
+    restore_deferred();
     return topology_.list_metric_names();
 }
 
 std::vector<StringT> Index::list_tags(StringT metric) const {
+    restore_deferred();
     return topology_.list_tags(metric);
 }
 
 std::vector<StringT> Index::list_tag_values(StringT metric, StringT tag) const {
+    restore_deferred();
     return topology_.list_tag_values(metric, tag);
 }
 
+std::vector<StringT> Index::list_tag_values(StringT metric, StringT tag, StringT prefix, size_t limit) const {
+    restore_deferred();
+    return topology_.list_tag_values(metric, tag, prefix, limit);
+}
+
 }  // namespace
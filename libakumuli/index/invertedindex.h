@@ -19,7 +19,9 @@
 #include "hashfnfamily.h"
 #include "stringpool.h"
 #include "util.h"
+#include "memory_accounting.h"
 
+#include <atomic>
 #include <memory>
 #include <unordered_map>
 #include <vector>
@@ -27,7 +29,9 @@
 #include <iterator>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <sstream>
+#include <regex>
 
 namespace Akumuli {
 
@@ -325,23 +329,67 @@ struct DeltaStreamReader {
 
 }
 
+//                      //
+//  Roaring containers  //
+//                      //
+
+namespace details {
+
+/** Set of 16-bit values (low bits of the ids) that share the same high bits (key).
+  * Sparse sets are stored as sorted arrays, dense sets as bitmaps.
+  */
+struct RoaringContainer {
+    enum {
+        //! Max number of elements in array container
+        MAX_ARRAY_SIZE = 4096,
+        //! Number of words in bitmap container
+        BITMAP_WORDS = 0x10000 / 64,
+    };
+
+    u64              key;
+    u32              cardinality;
+    std::vector<u16> array;
+    std::vector<u64> bitmap;
+
+    RoaringContainer(u64 key);
+
+    bool is_bitmap() const;
+
+    //! Add value, return false if value is already present
+    bool add(u16 value);
+
+    //! Remove value, return false if value is not present
+    bool remove(u16 value);
+
+    bool contains(u16 value) const;
+
+    //! Switch between array and bitmap representation if needed
+    void normalize();
+
+    size_t get_size_in_bytes() const;
+};
+
+}
+
 // Iterator for compressed PList
 
 class CompressedPListConstIterator {
-    size_t card_;
-    details::Base128StreamReader reader_;
-    details::DeltaStreamReader delta_;
-    size_t pos_;
+    std::vector<details::RoaringContainer> const* containers_;
+    size_t container_;  //! Index of the current container
+    u32 pos_;           //! Index inside array container or bit index inside bitmap container
     u64 curr_;
+
+    //! Move to the first element starting from the current position
+    void settle();
 public:
     typedef u64 value_type;
 
-    CompressedPListConstIterator(std::vector<char> const& vec, size_t c);
+    CompressedPListConstIterator(std::vector<details::RoaringContainer> const& containers);
 
     /**
      * @brief Create iterator pointing to the end of the sequence
      */
-    CompressedPListConstIterator(std::vector<char> const& vec, size_t c, bool);
+    CompressedPListConstIterator(std::vector<details::RoaringContainer> const& containers, bool);
 
     CompressedPListConstIterator(CompressedPListConstIterator const& other);
 
@@ -369,14 +417,15 @@ namespace std {
 namespace Akumuli {
 
 /**
- * Compressed postings list
+ * Compressed postings list.
+ * Roaring bitmap: ids are partitioned by high 48 bits, every partition is stored
+ * in its own container (sorted array of low 16 bits or a bitmap).
+ * Set operations are done container by container, array containers are
+ * intersected using SSE4.2 string instructions if available.
  */
 class CompressedPList {
-    std::vector<char> buffer_;
-    details::Base128StreamWriter writer_;
-    details::DeltaStreamWriter delta_;
+    std::vector<details::RoaringContainer> containers_;
     size_t cardinality_;
-    bool moved_;
 public:
 
     typedef u64 value_type;
@@ -391,18 +440,25 @@ public:
 
     CompressedPList& operator = (CompressedPList const& other) = delete;
 
+    //! Add value to the list (fast if values are added in ascending order)
     void add(u64 x);
 
     void push_back(u64 x);
 
+    //! Remove value from the list, empty containers are released
+    void remove(u64 x);
+
     size_t getSizeInBytes() const;
 
     size_t cardinality() const;
 
+    //! Intersection
     CompressedPList operator & (CompressedPList const& other) const;
 
+    //! Union
     CompressedPList operator | (CompressedPList const& other) const;
 
+    //! Difference
     CompressedPList operator ^ (CompressedPList const& other) const;
 
     CompressedPList unique() const;
@@ -434,12 +490,65 @@ public:
 
     void add(u64 key, u64 value);
 
+    /** Add all values from the other sketch. Sketches should have the same size,
+      * the result is the same as if all values were added to this sketch.
+      */
+    aku_Status merge(CMSketch const& other);
+
+    /** Write compact representation of the sketch to the buffer.
+      * Cells are written as delta encoded lists of values (base 128).
+      */
+    void serialize(std::vector<char>* dest) const;
+
+    /** Read sketch written by `serialize` and merge it into this sketch
+      * (partial sketches can be combined without creating intermediate objects).
+      * @return AKU_EBAD_DATA if the data is damaged or sketch size doesn't match
+      */
+    aku_Status deserialize(const char* begin, const char* end);
+
     size_t get_size_in_bytes() const;
 
     TVal extract(u64 value) const;
 };
 
 
+//               //
+//  HyperLogLog  //
+//               //
+
+/** HyperLogLog cardinality estimator.
+  * Small sets are stored exactly as a list of hashes, registers are allocated
+  * when the list becomes as large as the registers. Relative error of the
+  * estimate is about 1.04/sqrt(NREGISTERS) (~3%). Values can't be removed.
+  */
+class HyperLogLog {
+    enum {
+        PRECISION = 10,
+        NREGISTERS = 1 << PRECISION,
+        //! Max number of hashes stored exactly
+        MAX_EXACT = NREGISTERS / sizeof(u64),
+    };
+    std::vector<u64> exact_;
+    std::vector<u8>  registers_;
+
+    void add_to_registers(u64 hash);
+public:
+    //! Add value, `hash` should be uniformly distributed (see `mix`)
+    void add(u64 hash);
+
+    //! Add all values from the other sketch
+    void merge(HyperLogLog const& other);
+
+    //! Estimate number of distinct values
+    u64 estimate() const;
+
+    size_t get_size_in_bytes() const;
+
+    //! Mix bits of the string hash so it can be added to the sketch
+    static u64 mix(u64 hash);
+};
+
+
 //               //
 // Inverted Index //
 //               //
@@ -452,9 +561,20 @@ public:
 
     void add(u64 key, u64 value);
 
+    //! Merge posting list with the posting list stored under the same key
+    void merge(u64 key, TVal&& plist);
+
+    //! Remove value from the posting list, empty posting list is removed too
+    void remove(u64 key, u64 value);
+
     size_t get_size_in_bytes() const;
 
     TVal extract(u64 value) const;
+
+    /** Get size of the posting list without copying it.
+      * Can be larger than the actual number of matching names because of hash collisions.
+      */
+    size_t cardinality(u64 value) const;
 };
 
 //              //
@@ -496,6 +616,41 @@ public:
 };
 
 
+//                   //
+//  TagValuePattern  //
+//                   //
+
+/**
+ * @brief Pattern that matches tag values
+ * Glob pattern supports `*` (any sequence) and `?` (any character).
+ * Regular expression (ECMAScript syntax) should match the whole value.
+ * Values are looked up in the index using the literal prefix of the pattern.
+ */
+class TagValuePattern {
+public:
+    enum class Kind {
+        GLOB,
+        REGEX,
+    };
+private:
+    Kind kind_;
+    std::string pattern_;
+    std::string prefix_;
+    std::shared_ptr<std::regex> regex_;  //! Compiled regex (only for REGEX kind)
+public:
+    //! C-tor, throws std::regex_error if the pattern is not a valid regex
+    TagValuePattern(Kind kind, std::string pattern);
+
+    //! Literal prefix of all values that can match
+    StringT get_prefix() const;
+
+    //! Get equivalent regular expression
+    std::string to_regex() const;
+
+    bool match(StringT value) const;
+};
+
+
 //                             //
 //  IndexQueryResultsIterator  //
 //                             //
@@ -567,13 +722,9 @@ public:
                 auto id = *it;
                 auto str = spool_->str(id);
                 for (auto const& value: values) {
-                    bool add = false;
                     if (value.check(str.first, str.first + str.second)) {
-                        add = true;
-                        break;
-                    }
-                    if (add) {
                         newplist.add(id);
+                        break;
                     }
                 }
             }
@@ -633,9 +784,14 @@ struct IndexBase {
     virtual ~IndexBase() = default;
     virtual IndexQueryResults tagvalue_query(TagValuePair const& value) const = 0;
     virtual IndexQueryResults metric_query(MetricName const& value) const = 0;
+    //! Estimated number of series that match the tag=value pair (used to order intersections)
+    virtual size_t tagvalue_cardinality(TagValuePair const& value) const = 0;
+    //! Estimated number of series of the metric
+    virtual size_t metric_cardinality(MetricName const& value) const = 0;
     virtual std::vector<StringT> list_metric_names() const = 0;
     virtual std::vector<StringT> list_tags(StringT metric) const = 0;
     virtual std::vector<StringT> list_tag_values(StringT metric, StringT tag) const = 0;
+    virtual std::vector<StringT> list_tag_values(StringT metric, StringT tag, StringT prefix, size_t limit) const = 0;
 };
 
 
@@ -661,6 +817,9 @@ public:
 
     virtual IndexQueryResults query(const IndexBase&) const = 0;
 
+    //! Names of the metrics that can be returned by the query (see `Index::materialize`)
+    virtual std::vector<StringT> get_metrics() const = 0;
+
     const char* get_name() const {
         return name_;
     }
@@ -673,7 +832,8 @@ public:
 
 /**
  * Extracts only series that have all specified tag-value
- * combinations.
+ * combinations. Posting lists are intersected in the order
+ * of their cardinality (smallest first).
  */
 struct IncludeIfAllTagsMatch : IndexQueryNodeBase {
     constexpr static const char* node_name_ = "include-tags";
@@ -689,6 +849,8 @@ struct IncludeIfAllTagsMatch : IndexQueryNodeBase {
     }
 
     virtual IndexQueryResults query(IndexBase const&) const;
+
+    virtual std::vector<StringT> get_metrics() const;
 };
 
 
@@ -700,10 +862,21 @@ struct IncludeMany2Many : IndexQueryNodeBase {
     constexpr static const char* node_name_ = "many2many";
     MetricName metric_;
     std::map<std::string, std::vector<std::string>> tags_;
+    std::map<std::string, TagValuePattern> patterns_;
 
     IncludeMany2Many(std::string mname, std::map<std::string, std::vector<std::string>> const& map);
 
+    /** C-tor.
+      * @param patterns contains tag names and patterns of their values, series
+      *        should match any value of every tag and every pattern
+      */
+    IncludeMany2Many(std::string mname,
+                     std::map<std::string, std::vector<std::string>> const& map,
+                     std::map<std::string, TagValuePattern> const& patterns);
+
     virtual IndexQueryResults query(IndexBase const& index) const;
+
+    virtual std::vector<StringT> get_metrics() const;
 };
 
 //                   //
@@ -736,6 +909,8 @@ struct IncludeIfHasTag : IndexQueryNodeBase {
     }
 
     virtual IndexQueryResults query(IndexBase const&) const;
+
+    virtual std::vector<StringT> get_metrics() const;
 };
 
 //               //
@@ -760,6 +935,8 @@ struct ExcludeTags : IndexQueryNodeBase {
     }
 
     virtual IndexQueryResults query(IndexBase const&) const;
+
+    virtual std::vector<StringT> get_metrics() const;
 };
 
 
@@ -781,6 +958,8 @@ struct JoinByTags : IndexQueryNodeBase {
     }
 
     virtual IndexQueryResults query(IndexBase const&) const;
+
+    virtual std::vector<StringT> get_metrics() const;
 };
 
 
@@ -788,19 +967,44 @@ struct JoinByTags : IndexQueryNodeBase {
 //  SeriesNameTopology  //
 //                      //
 
+/** Metric names, tags and tag values of the series.
+  * Every level is sorted so names that start with the prefix form a contiguous
+  * range that can be found using binary search (O(log n + K) for first K matches).
+  */
 class SeriesNameTopology {
-    typedef StringTools::L3TableT IndexT;
+    //! Lexicographical order of the strings
+    struct Less {
+        bool operator () (StringT const& lhs, StringT const& rhs) const;
+    };
+    typedef std::set<StringT, Less> ValuesT;
+    typedef std::map<StringT, ValuesT, Less> TagsT;
+    typedef std::map<StringT, TagsT, Less> IndexT;
     IndexT index_;
 public:
     SeriesNameTopology();
 
     void add_name(StringT name);
 
+    //! Add metric name without tags
+    void add_metric(StringT metric);
+
+    //! Remove tags and values of the metric, metric name is kept
+    void clear_metric(StringT metric);
+
     std::vector<StringT> list_metric_names() const;
 
     std::vector<StringT> list_tags(StringT metric) const;
 
     std::vector<StringT> list_tag_values(StringT metric, StringT tag) const;
+
+    //! List first `limit` metric names that start with the prefix (in sorted order)
+    std::vector<StringT> list_metric_names(StringT prefix, size_t limit) const;
+
+    //! List first `limit` tags of the metric that start with the prefix (in sorted order)
+    std::vector<StringT> list_tags(StringT metric, StringT prefix, size_t limit) const;
+
+    //! List first `limit` values of the tag that start with the prefix (in sorted order)
+    std::vector<StringT> list_tag_values(StringT metric, StringT tag, StringT prefix, size_t limit) const;
 };
 
 
@@ -809,16 +1013,114 @@ public:
 //         //
 
 class Index : public IndexBase {
+public:
+    //! Hash -> list of names (ordinals) with this hash
+    typedef std::vector<std::pair<u64, std::vector<u32>>> PostingsT;
+
+    /** Posting lists restored from the snapshot or built by the loader.
+      * Names are referenced by ordinals, `ids` maps ordinals to string pool ids
+      * (zero id means that the name is already indexed).
+      */
+    struct DeferredPostings {
+        std::vector<u64> ids;
+        PostingsT        metrics;  //! Metric name postings
+        PostingsT        tags;     //! Tag=value postings
+    };
+
+    //! Counters of the lazy mode (see `set_resident_limit`)
+    struct ResidentStats {
+        u64 metrics;       //! Number of metrics
+        u64 resident;      //! Number of metrics with posting lists
+        u64 materialized;  //! Number of times posting lists of some metric were built
+        u64 evicted;       //! Number of times posting lists of some metric were dropped
+    };
+private:
+    /** Series of one metric (string pool ids), used in lazy mode. Posting lists
+      * and topology of the metric are built only when it's resident.
+      */
+    struct MetricSegment {
+        std::vector<u64> ids;
+        bool             resident;
+        //! Value of the access clock when the metric was queried last time
+        std::atomic<u64> last_access;
+
+        MetricSegment();
+    };
+
+    //! Series name to id mapping, memory is accounted as AKU_MEM_SERIES_TABLE
+    typedef std::unordered_map<StringTools::StringT, u64, decltype(&StringTools::hash),
+                               decltype(&StringTools::equal),
+                               TrackingAllocator<std::pair<const StringTools::StringT, u64>, AKU_MEM_SERIES_TABLE>>
+        TableT;
+
     StringPool pool_;
-    StringTools::TableT table_;
+    TableT table_;
     //CMSketch metrics_names_;
     //CMSketch tagvalue_pairs_;
-    InvertedIndex metrics_names_;
-    InvertedIndex tagvalue_pairs_;
-    SeriesNameTopology topology_;
+    // Posting lists and topology can be restored from the snapshot lazily
+    // (on first query) so these fields are mutable.
+    mutable InvertedIndex metrics_names_;
+    mutable InvertedIndex tagvalue_pairs_;
+    mutable SeriesNameTopology topology_;
+    mutable std::vector<DeferredPostings> deferred_;
+    //! Cardinality sketches of the metrics (key is a metric name hash)
+    mutable std::unordered_map<u64, HyperLogLog> metric_sketches_;
+    //! Cardinality sketches of the tag=value pairs inside every metric
+    mutable std::unordered_map<u64, HyperLogLog> tagvalue_sketches_;
+    //! Max number of resident metrics (0 - lazy mode is disabled)
+    size_t resident_limit_;
+    //! Series of every metric (key is a metric name hash), lazy mode only
+    mutable std::unordered_map<u64, MetricSegment> segments_;
+    //! Hashes of the resident metrics
+    mutable std::vector<u64> resident_;
+    mutable std::atomic<u64> access_clock_;
+    mutable u64 nmaterialized_;
+    mutable u64 nevicted_;
+
+    //! Add deferred posting lists to the index
+    void restore_deferred() const;
+
+    //! Add name to the posting lists and topology
+    void add_postings(StringT name, u64 id, u64 metric_hash, std::vector<u64> const& tag_hashes) const;
+
+    //! Add name to the metric segment (lazy mode), posting lists are updated if the metric is resident
+    void add_to_segment(StringT name, u64 id, u64 metric_hash, std::vector<u64> const& tag_hashes) const;
+
+    //! Build posting lists and topology of the metric
+    void build_segment(u64 metric_hash, MetricSegment& segment) const;
+
+    //! Remove series of the metric from the posting lists and topology
+    void drop_segment(u64 metric_hash, MetricSegment& segment) const;
+
+    //! Add name to the cardinality sketches
+    void update_sketches(StringT name, u64 metric_hash, std::vector<u64> const& tag_hashes) const;
 public:
     Index();
 
+    /** Enable lazy mode. Posting lists and topology of the metric are built on first
+      * query (from the series names) and only `limit` most recently queried metrics
+      * are kept, posting lists of other metrics are dropped. Metric names and
+      * cardinality sketches are always maintained. Zero limit means that all names
+      * are indexed eagerly. Should be called before any name is added.
+      */
+    void set_resident_limit(size_t limit);
+
+    size_t get_resident_limit() const;
+
+    /** Check that posting lists of all metrics are built and mark metrics as recently used.
+      * Doesn't modify the index so it can be called by concurrent readers.
+      * @return false if some metric should be materialized first
+      */
+    bool touch(std::vector<StringT> const& metrics) const;
+
+    /** Build posting lists of the metrics that are not resident and evict least recently
+      * queried metrics if the resident set is too large (metrics from the list are
+      * never evicted by this call). Modifies the index, readers shouldn't share the lock.
+      */
+    void materialize(std::vector<StringT> const& metrics) const;
+
+    ResidentStats get_resident_stats() const;
+
     SeriesNameTopology const& get_topology() const;
 
     size_t cardinality() const;
@@ -835,15 +1137,68 @@ public:
      */
     std::tuple<aku_Status, StringT> append(const char* begin, const char* end);
 
+    /**
+     * @brief Add string in canonical form, posting keys should be computed using `get_posting_keys`.
+     * Name is not parsed again so most of the work can be done before taking the lock.
+     * @return status and resulting string (scope of the string is the same as the scope of the index)
+     */
+    std::tuple<aku_Status, StringT> append_parsed(StringT name, u64 metric_hash, std::vector<u64> const& tag_hashes);
+
+    /**
+     * @brief Add string in canonical form without updating posting lists and topology.
+     * Posting lists should be added using `append_deferred`.
+     * @return status, resulting string and its id in the string pool
+     */
+    std::tuple<aku_Status, StringT, u64> append_canonical(const char* begin, const char* end);
+
+    /**
+     * @brief Add posting lists restored from the snapshot.
+     * Posting lists are merged into the index on first query, names should be
+     * added using `append_canonical` beforehand.
+     */
+    void append_deferred(DeferredPostings&& postings);
+
+    /**
+     * @brief Remove series name from the index and posting lists.
+     * String pool is append-only so the name itself stays in memory until
+     * restart, topology is not updated either (metric and tag suggestions can
+     * return names that don't have series anymore).
+     * @return false if name is not present
+     */
+    bool remove(StringT name);
+
+    /**
+     * @brief Get hashes used as posting list keys
+     * @param name is a series name in canonical form
+     * @param metric_hash is an output parameter that receives metric name hash
+     * @param tag_hashes is an output parameter that receives hashes of all tag=value pairs
+     * @return false if name is malformed
+     */
+    static bool get_posting_keys(StringT name, u64* metric_hash, std::vector<u64>* tag_hashes);
+
     virtual IndexQueryResults tagvalue_query(const TagValuePair &value) const;
 
     virtual IndexQueryResults metric_query(const MetricName &value) const;
 
+    virtual size_t tagvalue_cardinality(const TagValuePair &value) const;
+
+    virtual size_t metric_cardinality(const MetricName &value) const;
+
+    /** Estimate number of series using cardinality sketches, posting lists are not used.
+      * Removed series are still counted (until restart).
+      * @param metric is a metric name
+      * @param pairs is a list of tag=value pairs, series of the metric that have any of
+      *        them are counted (all series of the metric are counted if the list is empty)
+      */
+    u64 estimate_cardinality(StringT metric, std::vector<StringT> const& pairs) const;
+
     virtual std::vector<StringT> list_metric_names() const;
 
     virtual std::vector<StringT> list_tags(StringT metric) const;
 
     virtual std::vector<StringT> list_tag_values(StringT metric, StringT tag) const;
+
+    virtual std::vector<StringT> list_tag_values(StringT metric, StringT tag, StringT prefix, size_t limit) const;
 };
 
 }  // namespace
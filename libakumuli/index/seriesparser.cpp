@@ -24,21 +24,156 @@
 #include <map>
 #include <algorithm>
 #include <regex>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 
 namespace Akumuli {
 
+void SeriesMatcherBase::_add_batch(std::vector<std::pair<std::string, u64>> const& items) {
+    for (auto const& item: items) {
+        _add(item.first, item.second);
+    }
+}
+
+//                        //
+//      SeriesTokens      //
+//                        //
+
+SeriesTokens::SeriesTokens()
+    : dict_(StringTools::create_table(0x1000))
+    , tags_(1, 0)
+    , arena_(1, 0)
+    , base_(0)
+{
+}
+
+SeriesTokens::TokenT SeriesTokens::intern(StringTools::StringT str, TokenT tag) {
+    auto it = dict_.find(str);
+    if (it != dict_.end()) {
+        auto token = static_cast<TokenT>(it->second);
+        if (tags_[token] == 0) {
+            // Value was added as a metric name first
+            tags_[token] = tag;
+        }
+        return token;
+    }
+    strings_.push_back(std::string(str.first, str.first + str.second));
+    auto const& value = strings_.back();
+    auto token = static_cast<TokenT>(strings_.size());
+    dict_[std::make_pair(value.data(), static_cast<int>(value.size()))] = token;
+    tags_.push_back(tag);
+    return token;
+}
+
+void SeriesTokens::add(u64 id, StringT name) {
+    const char* it = name.first;
+    const char* end = name.first + name.second;
+    const char* metric_end = std::find(it, end, ' ');
+    if (metric_end == it) {
+        return;
+    }
+    u64 offset = arena_.size();
+    arena_.push_back(1);
+    arena_.push_back(intern(std::make_pair(it, static_cast<int>(metric_end - it)), 0));
+    it = metric_end;
+    while (it < end) {
+        it++;
+        const char* pair_end = std::find(it, end, ' ');
+        if (pair_end == it) {
+            continue;
+        }
+        const char* tag_end = std::find(it, pair_end, '=');
+        auto tag = intern(std::make_pair(it, static_cast<int>(tag_end - it)), 0);
+        arena_.push_back(intern(std::make_pair(it, static_cast<int>(pair_end - it)), tag));
+        arena_[offset]++;
+        it = pair_end;
+    }
+    if (dense_.empty() && sparse_.empty()) {
+        base_ = id;
+    }
+    if (id >= base_ && id - base_ < dense_.size() + MAX_GAP) {
+        auto ix = static_cast<size_t>(id - base_);
+        if (ix >= dense_.size()) {
+            dense_.resize(ix + 1, 0);
+        }
+        dense_[ix] = offset;
+    } else {
+        sparse_[id] = offset;
+    }
+}
+
+void SeriesTokens::erase(u64 id) {
+    if (id >= base_ && id - base_ < dense_.size()) {
+        dense_[static_cast<size_t>(id - base_)] = 0;
+    } else {
+        sparse_.erase(id);
+    }
+}
+
+SeriesTokens::Name SeriesTokens::find(u64 id) const {
+    Name result = { nullptr, 0 };
+    u64 offset = 0;
+    if (id >= base_ && id - base_ < dense_.size()) {
+        offset = dense_[static_cast<size_t>(id - base_)];
+    } else {
+        auto it = sparse_.find(id);
+        if (it != sparse_.end()) {
+            offset = it->second;
+        }
+    }
+    if (offset != 0) {
+        result.tokens = arena_.data() + offset + 1;
+        result.size = arena_[offset];
+    }
+    return result;
+}
+
+SeriesTokens::TokenT SeriesTokens::token(StringTools::StringT str) const {
+    auto it = dict_.find(str);
+    return it == dict_.end() ? 0 : static_cast<TokenT>(it->second);
+}
+
+StringTools::StringT SeriesTokens::str(TokenT token) const {
+    auto const& value = strings_.at(token - 1);
+    return std::make_pair(value.data(), static_cast<int>(value.size()));
+}
+
+SeriesTokens::TokenT SeriesTokens::tag_of(TokenT token) const {
+    return tags_.at(token);
+}
+
+size_t SeriesTokens::mem_used() const {
+    size_t strsize = 0;
+    for (auto const& str: strings_) {
+        strsize += sizeof(str) + str.capacity();
+    }
+    return strsize
+         + tags_.capacity() * sizeof(TokenT)
+         + arena_.capacity() * sizeof(TokenT)
+         + dense_.capacity() * sizeof(u64)
+         + sparse_.size() * (sizeof(u64) * 4);
+}
+
 //                        //
 //     SeriesMatcher      //
 //                        //
 
 static const StringT EMPTY = std::make_pair(nullptr, 0);
 
+typedef LockGuard<RWLock, &RWLock::rdlock> ReadLock;
+typedef LockGuard<RWLock, &RWLock::wrlock> WriteLock;
+
 SeriesMatcher::SeriesMatcher(u64 starting_id)
-    : table(StringTools::create_table(0x1000))
-    , series_id(starting_id)
+    : series_id(starting_id)
+    , deferred{false}
 {
     if (starting_id == 0u) {
         AKU_PANIC("Bad series ID");
@@ -46,7 +181,7 @@ SeriesMatcher::SeriesMatcher(u64 starting_id)
 }
 
 u64 SeriesMatcher::add(const char* begin, const char* end) {
-    std::lock_guard<std::mutex> guard(mutex);
+    WriteLock guard(lock);
     auto id = series_id++;
     aku_Status status;
     StringT sname;
@@ -56,12 +191,44 @@ u64 SeriesMatcher::add(const char* begin, const char* end) {
         return 0;
     }
     auto tup = std::make_tuple(std::get<0>(sname), std::get<1>(sname), id);
-    table[sname] = id;
-    inv_table[id] = sname;
+    table.insert(sname, StringTools::hash(sname), id);
+    inv_table.insert(id, sname);
+    tokens.add(id, sname);
+    std::lock_guard<std::mutex> names_guard(names_mutex);
     names.push_back(tup);
     return id;
 }
 
+u64 SeriesMatcher::add_if_absent(const char* begin, const char* end, u64 hash, bool* created) {
+    *created = false;
+    StringT name = std::make_pair(begin, static_cast<u32>(end - begin));
+    u64 mhash;
+    std::vector<u64> thashes;
+    if (!Index::get_posting_keys(name, &mhash, &thashes)) {
+        return 0;
+    }
+    WriteLock guard(lock);
+    auto id = table.find(name, hash);
+    if (id != 0) {
+        // Added by another writer
+        return id;
+    }
+    aku_Status status;
+    StringT sname;
+    std::tie(status, sname) = index.append_parsed(name, mhash, thashes);
+    if (status != AKU_SUCCESS) {
+        return 0;
+    }
+    id = series_id++;
+    table.insert(sname, hash, id);
+    inv_table.insert(id, sname);
+    tokens.add(id, sname);
+    std::lock_guard<std::mutex> names_guard(names_mutex);
+    names.push_back(std::make_tuple(std::get<0>(sname), std::get<1>(sname), id));
+    *created = true;
+    return id;
+}
+
 void SeriesMatcher::_add(std::string series, u64 id) {
     if (series.empty()) {
         return;
@@ -70,111 +237,399 @@ void SeriesMatcher::_add(std::string series, u64 id) {
 }
 
 void SeriesMatcher::_add(const char*  begin, const char* end, u64 id) {
-    std::lock_guard<std::mutex> guard(mutex);
+    WriteLock guard(lock);
     aku_Status status;
     StringT sname;
     std::tie(status, sname) = index.append(begin, end);
     StatusUtil::throw_on_error(status);
-    table[sname] = id;
-    inv_table[id] = sname;
+    table.insert(sname, StringTools::hash(sname), id);
+    inv_table.insert(id, sname);
+    tokens.add(id, sname);
 }
 
-u64 SeriesMatcher::match(const char* begin, const char* end) const {
-    int len = static_cast<int>(end - begin);
-    StringT str = std::make_pair(begin, len);
+void SeriesMatcher::_add_batch(std::vector<std::pair<std::string, u64>> const& items) {
+    _add_batch(items, 0);
+}
 
-    std::lock_guard<std::mutex> guard(mutex);
-    auto it = table.find(str);
-    if (it == table.end()) {
-        return 0ul;
+void SeriesMatcher::_add_batch(std::vector<std::pair<std::string, u64>> const& items, size_t nworkers) {
+    enum {
+        //! Number of names parsed by the worker at once
+        RANGE_SIZE = 0x10000,
+        MAX_WORKERS = 16,
+    };
+    //! Names of the range in canonical form and their posting lists (names are referenced by ordinals)
+    struct Range {
+        std::vector<char>                   buffer;
+        std::vector<std::tuple<size_t, u32, u64>> names;  //! Offset, size and series id
+        Index::DeferredPostings             postings;
+        aku_Status                          status;
+    };
+    size_t nranges = (items.size() + RANGE_SIZE - 1) / RANGE_SIZE;
+    std::vector<Range> ranges(nranges);
+    auto parse = [&items, &ranges](size_t ix) {
+        size_t begin = ix * RANGE_SIZE;
+        size_t end = std::min(begin + RANGE_SIZE, items.size());
+        auto& range = ranges[ix];
+        range.status = AKU_SUCCESS;
+        range.names.reserve(end - begin);
+        std::unordered_map<u64, std::vector<u32>> metrics;
+        std::unordered_map<u64, std::vector<u32>> tags;
+        std::vector<u64> thashes;
+        char buffer[0x1000];
+        for (size_t i = begin; i < end; i++) {
+            auto const& series = items[i].first;
+            if (series.empty()) {
+                continue;
+            }
+            const char* tags_begin;
+            const char* tags_end;
+            auto status = SeriesParser::to_canonical_form(series.data(), series.data() + series.size(),
+                                                          buffer, buffer + sizeof(buffer), &tags_begin, &tags_end);
+            u64 mhash;
+            thashes.clear();
+            StringT name = std::make_pair(static_cast<const char*>(buffer), static_cast<int>(tags_end - buffer));
+            if (status == AKU_SUCCESS && !Index::get_posting_keys(name, &mhash, &thashes)) {
+                status = AKU_EBAD_DATA;
+            }
+            if (status != AKU_SUCCESS) {
+                range.status = status;
+                return;
+            }
+            auto ord = static_cast<u32>(range.names.size());
+            range.names.push_back(std::make_tuple(range.buffer.size(), static_cast<u32>(name.second), items[i].second));
+            range.buffer.insert(range.buffer.end(), name.first, name.first + name.second);
+            metrics[mhash].push_back(ord);
+            for (auto hash: thashes) {
+                tags[hash].push_back(ord);
+            }
+        }
+        range.postings.metrics.assign(std::make_move_iterator(metrics.begin()), std::make_move_iterator(metrics.end()));
+        range.postings.tags.assign(std::make_move_iterator(tags.begin()), std::make_move_iterator(tags.end()));
+    };
+    // Names are added in one critical section per range, posting lists reference string
+    // pool ids that grow monotonically (see `Index::restore_deferred`)
+    auto insert = [this, &ranges](size_t ix) {
+        auto& range = ranges[ix];
+        StatusUtil::throw_on_error(range.status);
+        range.postings.ids.reserve(range.names.size());
+        WriteLock guard(lock);
+        for (auto const& item: range.names) {
+            size_t offset;
+            u32 size;
+            u64 id;
+            std::tie(offset, size, id) = item;
+            StringT name = std::make_pair(static_cast<const char*>(range.buffer.data() + offset), static_cast<int>(size));
+            auto hash = StringTools::hash(name);
+            // Name that is already indexed is not added to the posting lists twice
+            bool duplicate = table.find(name, hash) != 0;
+            aku_Status status;
+            StringT sname;
+            u64 poolid;
+            std::tie(status, sname, poolid) = index.append_canonical(name.first, name.first + size);
+            StatusUtil::throw_on_error(status);
+            range.postings.ids.push_back(duplicate ? 0 : poolid);
+            table.insert(sname, hash, id);
+            inv_table.insert(id, sname);
+            tokens.add(id, sname);
+        }
+        index.append_deferred(std::move(range.postings));
+        deferred.store(true);
+        range = Range();
+    };
+    if (nworkers == 0) {
+        nworkers = std::thread::hardware_concurrency();
     }
-    return it->second;
+    nworkers = std::min(std::min(nworkers, nranges), static_cast<size_t>(MAX_WORKERS));
+    if (nworkers < 2) {
+        for (size_t ix = 0; ix < nranges; ix++) {
+            parse(ix);
+            insert(ix);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::atomic<bool> stop(false);
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<char> ready(nranges, 0);
+    auto worker = [&]() {
+        size_t ix;
+        while (!stop.load() && (ix = next++) < nranges) {
+            parse(ix);
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                ready[ix] = 1;
+            }
+            cond.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nworkers; i++) {
+        threads.emplace_back([&worker]() {
+            set_thread_name("index-loader");
+            worker();
+        });
+    }
+    // Current thread adds parsed ranges in order
+    auto join = [&]() {
+        stop.store(true);
+        for (auto& th: threads) {
+            th.join();
+        }
+    };
+    try {
+        for (size_t ix = 0; ix < nranges; ix++) {
+            {
+                std::unique_lock<std::mutex> guard(mutex);
+                cond.wait(guard, [&ready, ix]() { return ready[ix] != 0; });
+            }
+            insert(ix);
+        }
+    } catch (...) {
+        join();
+        throw;
+    }
+    join();
+}
+
+u64 SeriesMatcher::_add_canonical(const char* begin, const char* end, u64 id) {
+    WriteLock guard(lock);
+    aku_Status status;
+    StringT sname;
+    u64 poolid;
+    std::tie(status, sname, poolid) = index.append_canonical(begin, end);
+    if (status != AKU_SUCCESS) {
+        return 0;
+    }
+    table.insert(sname, StringTools::hash(sname), id);
+    inv_table.insert(id, sname);
+    tokens.add(id, sname);
+    return poolid;
+}
+
+void SeriesMatcher::_add_postings(Index::DeferredPostings&& postings) {
+    WriteLock guard(lock);
+    index.append_deferred(std::move(postings));
+    deferred.store(true);
+}
+
+void SeriesMatcher::remove(std::vector<u64> const& ids, std::vector<SeriesNameT>* removed) {
+    {
+        WriteLock guard(lock);
+        // Posting lists from the snapshot should be merged before anything can
+        // be removed from them (see `restore_postings`)
+        index.get_topology();
+        deferred.store(false);
+        for (auto id: ids) {
+            auto str = inv_table.find(id);
+            if (str.first == nullptr) {
+                continue;
+            }
+            removed->push_back(std::make_tuple(str.first, str.second, id));
+            table.erase(str, StringTools::hash(str));
+            inv_table.erase(id);
+            tokens.erase(id);
+            index.remove(str);
+        }
+    }
+    // Cached group-by mappings can contain removed ids
+    std::lock_guard<std::mutex> guard(groups_mutex);
+    groups.clear();
+}
+
+void SeriesMatcher::restore_postings() const {
+    if (!deferred.load()) {
+        return;
+    }
+    // Index merges deferred posting lists on first access, this
+    // shouldn't happen when readers share the lock
+    WriteLock guard(lock);
+    index.get_topology();
+    deferred.store(false);
+}
+
+void SeriesMatcher::set_resident_limit(size_t limit) {
+    WriteLock guard(lock);
+    index.set_resident_limit(limit);
+}
+
+Index::ResidentStats SeriesMatcher::get_resident_stats() const {
+    ReadLock guard(lock);
+    return index.get_resident_stats();
+}
+
+/** Run `fn` under the shared lock if posting lists of all metrics are built,
+  * otherwise build them and run `fn` under the exclusive lock (so they can't
+  * be evicted by concurrent queries before `fn` is done).
+  */
+template<class Fn>
+static void with_resident_metrics(SeriesMatcher const& matcher, std::vector<StringT> const& metrics, Fn const& fn) {
+    matcher.restore_postings();
+    {
+        ReadLock guard(matcher.lock);
+        if (matcher.index.touch(metrics)) {
+            fn();
+            return;
+        }
+    }
+    WriteLock guard(matcher.lock);
+    matcher.index.materialize(metrics);
+    fn();
+}
+
+u64 SeriesMatcher::get_series_id() const {
+    ReadLock guard(lock);
+    return series_id;
+}
+
+size_t SeriesMatcher::size() const {
+    ReadLock guard(lock);
+    return index.cardinality();
+}
+
+size_t SeriesMatcher::pool_memory_use() const {
+    ReadLock guard(lock);
+    return index.pool_memory_use() + tokens.mem_used();
+}
+
+size_t SeriesMatcher::index_memory_use() const {
+    ReadLock guard(lock);
+    return index.index_memory_use();
+}
+
+size_t SeriesMatcher::metric_cardinality(const char* begin, const char* end) const {
+    restore_postings();
+    ReadLock guard(lock);
+    return index.metric_cardinality(MetricName(begin, end));
+}
+
+u64 SeriesMatcher::match(const char* begin, const char* end) const {
+    StringTools::StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    return table.find(str);
+}
+
+u64 SeriesMatcher::match(const char* begin, const char* end, u64 hash) const {
+    StringTools::StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    return table.find(str, hash);
 }
 
 StringT SeriesMatcher::id2str(u64 tokenid) const {
-    std::lock_guard<std::mutex> guard(mutex);
-    auto it = inv_table.find(tokenid);
-    if (it == inv_table.end()) {
+    ReadLock guard(lock);
+    auto str = inv_table.find(tokenid);
+    if (str.first == nullptr) {
         return EMPTY;
     }
-    return it->second;
+    return str;
 }
 
 void SeriesMatcher::pull_new_names(std::vector<PlainSeriesMatcher::SeriesNameT> *buffer) {
-    std::lock_guard<std::mutex> guard(mutex);
+    // Doesn't block writers and readers of the index
+    std::lock_guard<std::mutex> guard(names_mutex);
     std::swap(names, *buffer);
 }
 
 std::vector<u64> SeriesMatcher::get_all_ids() const {
-    std::vector<u64> result;
-    {
-        std::lock_guard<std::mutex> guard(mutex);
-        for (auto const &tup: inv_table) {
-            result.push_back(tup.first);
-        }
+    ReadLock guard(lock);
+    return inv_table.get_ids();
+}
+
+std::shared_ptr<GroupByTag> SeriesMatcher::group_by(std::string metric, std::vector<std::string> tags) const {
+    std::sort(tags.begin(), tags.end());
+    std::string key = metric;
+    for (auto const& tag: tags) {
+        key += " " + tag;
+    }
+    std::lock_guard<std::mutex> guard(groups_mutex);
+    auto it = groups.find(key);
+    if (it != groups.end()) {
+        return it->second;
+    }
+    if (groups.size() >= GROUP_BY_CACHE_SIZE) {
+        // Mappings that are still in use are kept alive by the queries
+        groups.clear();
     }
-    std::sort(result.begin(), result.end());
+    auto result = std::make_shared<GroupByTag>(*this, metric, tags);
+    groups[key] = result;
     return result;
 }
 
 std::vector<SeriesMatcher::SeriesNameT> SeriesMatcher::search(IndexQueryNodeBase const& query) const {
     std::vector<SeriesMatcher::SeriesNameT> result;
-    std::lock_guard<std::mutex> guard(mutex);
-    auto resultset = query.query(index);
-    for (auto it = resultset.begin(); it != resultset.end(); ++it) {
-        auto str = *it;
-        auto fit = table.find(str);
-        if (fit == table.end()) {
-            AKU_PANIC("Invalid index state");
-        }
-        result.push_back(std::make_tuple(str.first, str.second, fit->second));
-    }
+    search(query, [&result](std::vector<SeriesNameT> const& batch) {
+        result.insert(result.end(), batch.begin(), batch.end());
+        return true;
+    });
     return result;
 }
 
-std::vector<StringT> SeriesMatcher::suggest_metric(std::string prefix) const {
-    std::vector<StringT> results;
-    std::lock_guard<std::mutex> guard(mutex);
-    results = index.get_topology().list_metric_names();
-    auto resit = std::remove_if(results.begin(), results.end(), [prefix](StringT val) {
-        if (val.second < prefix.size()) {
-            return true;
+void SeriesMatcher::search(IndexQueryNodeBase const& query, SearchSink const& sink) const {
+    enum {
+        //! Number of names resolved under the lock at once
+        SHARD_SIZE = 0x4000,
+    };
+    std::vector<StringT> names;
+    with_resident_metrics(*this, query.get_metrics(), [&]() {
+        auto resultset = query.query(index);
+        for (auto it = resultset.begin(); it != resultset.end(); ++it) {
+            names.push_back(*it);
         }
-        auto eq = std::equal(prefix.begin(), prefix.end(), val.first);
-        return !eq;
     });
-    results.erase(resit, results.end());
-    return results;
+    // String pool is append only, names stay valid without the lock
+    std::vector<SeriesNameT> shard;
+    shard.reserve(std::min(names.size(), static_cast<size_t>(SHARD_SIZE)));
+    for (size_t begin = 0; begin < names.size(); begin += SHARD_SIZE) {
+        size_t end = std::min(begin + SHARD_SIZE, names.size());
+        shard.clear();
+        {
+            ReadLock guard(lock);
+            for (size_t i = begin; i < end; i++) {
+                auto str = names[i];
+                auto id = table.find(str);
+                if (id == 0) {
+                    // Series was removed after the index query was evaluated
+                    continue;
+                }
+                shard.push_back(std::make_tuple(str.first, str.second, id));
+            }
+        }
+        if (!sink(shard)) {
+            break;
+        }
+    }
 }
 
-std::vector<StringT> SeriesMatcher::suggest_tags(std::string metric, std::string tag_prefix) const {
-    std::vector<StringT> results;
-    std::lock_guard<std::mutex> guard(mutex);
-    results = index.get_topology().list_tags(tostrt(metric));
-    auto resit = std::remove_if(results.begin(), results.end(), [tag_prefix](StringT val) {
-        if (val.second < tag_prefix.size()) {
-            return true;
-        }
-        auto eq = std::equal(tag_prefix.begin(), tag_prefix.end(), val.first);
-        return !eq;
+std::vector<StringT> SeriesMatcher::suggest_metric(std::string prefix, size_t limit) const {
+    restore_postings();
+    ReadLock guard(lock);
+    return index.get_topology().list_metric_names(tostrt(prefix), limit);
+}
+
+std::vector<StringT> SeriesMatcher::suggest_tags(std::string metric, std::string tag_prefix, size_t limit) const {
+    std::vector<StringT> result;
+    with_resident_metrics(*this, { tostrt(metric) }, [&]() {
+        result = index.get_topology().list_tags(tostrt(metric), tostrt(tag_prefix), limit);
     });
-    results.erase(resit, results.end());
-    return results;
+    return result;
 }
 
-std::vector<StringT> SeriesMatcher::suggest_tag_values(std::string metric, std::string tag, std::string value_prefix) const {
-    std::vector<StringT> results;
-    std::lock_guard<std::mutex> guard(mutex);
-    results = index.get_topology().list_tag_values(tostrt(metric), tostrt(tag));
-    auto resit = std::remove_if(results.begin(), results.end(), [value_prefix](StringT val) {
-        if (val.second < value_prefix.size()) {
-            return true;
-        }
-        auto eq = std::equal(value_prefix.begin(), value_prefix.end(), val.first);
-        return !eq;
+std::vector<StringT> SeriesMatcher::suggest_tag_values(std::string metric, std::string tag, std::string value_prefix,
+                                                       size_t limit) const
+{
+    std::vector<StringT> result;
+    with_resident_metrics(*this, { tostrt(metric) }, [&]() {
+        result = index.get_topology().list_tag_values(tostrt(metric), tostrt(tag), tostrt(value_prefix), limit);
     });
-    results.erase(resit, results.end());
-    return results;
+    return result;
+}
+
+u64 SeriesMatcher::estimate_cardinality(std::string metric, std::vector<std::string> const& pairs) const {
+    restore_postings();
+    std::vector<StringT> strs;
+    for (auto const& pair: pairs) {
+        strs.push_back(tostrt(pair));
+    }
+    ReadLock guard(lock);
+    return index.estimate_cardinality(tostrt(metric), strs);
 }
 
 //                          //
@@ -182,8 +637,7 @@ std::vector<StringT> SeriesMatcher::suggest_tag_values(std::string metric, std::
 //                          //
 
 PlainSeriesMatcher::PlainSeriesMatcher(u64 starting_id)
-    : table(StringTools::create_table(0x1000))
-    , series_id(starting_id)
+    : series_id(starting_id)
 {
     if (starting_id == 0u) {
         AKU_PANIC("Bad series ID");
@@ -195,8 +649,8 @@ u64 PlainSeriesMatcher::add(const char* begin, const char* end) {
     StringT pstr = pool.add(begin, end);
     auto tup = std::make_tuple(std::get<0>(pstr), std::get<1>(pstr), id);
     std::lock_guard<std::mutex> guard(mutex);
-    table[pstr] = id;
-    inv_table[id] = pstr;
+    table.insert(pstr, StringTools::hash(pstr), id);
+    inv_table.insert(id, pstr);
     names.push_back(tup);
     return id;
 }
@@ -209,37 +663,55 @@ void PlainSeriesMatcher::_add(std::string series, u64 id) {
     const char* end = begin + series.size();
     StringT pstr = pool.add(begin, end);
     std::lock_guard<std::mutex> guard(mutex);
-    table[pstr] = id;
-    inv_table[id] = pstr;
+    table.insert(pstr, StringTools::hash(pstr), id);
+    inv_table.insert(id, pstr);
 }
 
 void PlainSeriesMatcher::_add(const char*  begin, const char* end, u64 id) {
     StringT pstr = pool.add(begin, end);
     std::lock_guard<std::mutex> guard(mutex);
-    table[pstr] = id;
-    inv_table[id] = pstr;
+    table.insert(pstr, StringTools::hash(pstr), id);
+    inv_table.insert(id, pstr);
 }
 
 u64 PlainSeriesMatcher::match(const char* begin, const char* end) const {
+    StringTools::StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    std::lock_guard<std::mutex> guard(mutex);
+    return table.find(str);
+}
 
-    int len = static_cast<int>(end - begin);
-    StringT str = std::make_pair(begin, len);
+u64 PlainSeriesMatcher::match(const char* begin, const char* end, u64 hash) const {
+    StringTools::StringT str = std::make_pair(begin, static_cast<int>(end - begin));
+    std::lock_guard<std::mutex> guard(mutex);
+    return table.find(str, hash);
+}
 
+void PlainSeriesMatcher::match(StringT const* names, u64 const* hashes, size_t n, u64* ids) const {
     std::lock_guard<std::mutex> guard(mutex);
-    auto it = table.find(str);
-    if (it == table.end()) {
-        return 0ul;
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = table.find(names[i], hashes[i]);
     }
-    return it->second;
 }
 
 StringT PlainSeriesMatcher::id2str(u64 tokenid) const {
     std::lock_guard<std::mutex> guard(mutex);
-    auto it = inv_table.find(tokenid);
-    if (it == inv_table.end()) {
+    auto str = inv_table.find(tokenid);
+    if (str.first == nullptr) {
         return EMPTY;
     }
-    return it->second;
+    return str;
+}
+
+void PlainSeriesMatcher::remove(std::vector<u64> const& ids) {
+    std::lock_guard<std::mutex> guard(mutex);
+    for (auto id: ids) {
+        auto str = inv_table.find(id);
+        if (str.first == nullptr) {
+            continue;
+        }
+        table.erase(str, StringTools::hash(str));
+        inv_table.erase(id);
+    }
 }
 
 void PlainSeriesMatcher::pull_new_names(std::vector<PlainSeriesMatcher::SeriesNameT> *buffer) {
@@ -248,15 +720,8 @@ void PlainSeriesMatcher::pull_new_names(std::vector<PlainSeriesMatcher::SeriesNa
 }
 
 std::vector<u64> PlainSeriesMatcher::get_all_ids() const {
-    std::vector<u64> result;
-    {
-        std::lock_guard<std::mutex> guard(mutex);
-        for (auto const &tup: inv_table) {
-            result.push_back(tup.first);
-        }
-    }
-    std::sort(result.begin(), result.end());
-    return result;
+    std::lock_guard<std::mutex> guard(mutex);
+    return inv_table.get_ids();
 }
 
 std::vector<PlainSeriesMatcher::SeriesNameT> PlainSeriesMatcher::regex_match(const char* rexp) const {
@@ -270,15 +735,14 @@ std::vector<PlainSeriesMatcher::SeriesNameT> PlainSeriesMatcher::regex_match(con
     std::vector<LegacyStringPool::StringT> res = pool.regex_match(rexp, offset, prevsize);
 
     std::lock_guard<std::mutex> guard(mutex);
-    std::transform(res.begin(), res.end(), std::back_inserter(series), [this](StringT s) {
-        auto it = table.find(s);
-        if (it == table.end()) {
-            // We should always find id by string, otherwise - invariant is
-            // broken (due to memory corruption most likely).
-            AKU_PANIC("Invalid string-pool.");
-        }
-        return std::make_tuple(s.first, s.second, it->second);
-    });
+    for (auto s: res) {
+        auto id = table.find(s);
+        if (id == 0 || inv_table.find(id).first != s.first) {
+            // Removed name or the old copy of the name that was added again
+            continue;
+        }
+        series.push_back(std::make_tuple(s.first, s.second, id));
+    }
     return series;
 }
 
@@ -294,18 +758,6 @@ static const char* skip_space(const char* p, const char* end) {
     return p;
 }
 
-static StringTools::StringT get_tag_name(const char* p, const char* end) {
-    StringTools::StringT EMPTY = {nullptr, 0};
-    auto begin = p;
-    while(p < end && *p != '=' && *p != ' ' && *p != '\t') {
-        p++;
-    }
-    if (p == end || *p != '=') {
-        return EMPTY;
-    }
-    return {begin, p - begin};
-}
-
 static const char* copy_until(const char* begin, const char* end, const char pattern, char** out) {
     char* it_out = *out;
     while(begin < end) {
@@ -320,26 +772,134 @@ static const char* copy_until(const char* begin, const char* end, const char pat
     return begin;
 }
 
-//! Move pointer to the beginning of the next tag, return this pointer or end on error
-static const char* skip_tag(const char* begin, const char* end, bool *error) {
-    // skip until '='
-    const char* p = begin;
+//! Find first ' ' character, return end if not found
+static const char* find_space(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    while (p + 16 <= end) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space));
+        if (mask) {
+            return p + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+        p += 16;
+    }
+#endif
+    while(p < end && *p != ' ') {
+        p++;
+    }
+    return p;
+}
+
+//! Find first '=', ' ' or '\t' character, return end if not found
+static const char* find_tag_delim(const char* p, const char* end) {
+#ifdef __SSE2__
+    const __m128i eq    = _mm_set1_epi8('=');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab   = _mm_set1_epi8('\t');
+    while (p + 16 <= end) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(chunk, eq),
+                                   _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                                _mm_cmpeq_epi8(chunk, tab)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(static_cast<unsigned>(mask));
+        }
+        p += 16;
+    }
+#endif
     while(p < end && *p != '=' && *p != ' ' && *p != '\t') {
         p++;
     }
+    return p;
+}
+
+//! Move pointer to the beginning of the next tag, return this pointer or end on error
+static const char* skip_tag(const char* begin, const char* end, const char** key_end, bool *error) {
+    // skip until '='
+    const char* p = find_tag_delim(begin, end);
     if (p == begin || p == end || *p != '=') {
         *error = true;
         return end;
     }
+    *key_end = p;
     // skip until ' '
-    const char* c = p;
-    while(c < end && *c != ' ') {
-        c++;
-    }
+    const char* c = find_space(p, end);
     *error = c == p;
     return c;
 }
 
+namespace {
+
+//! Tag reference used to sort tags by key
+struct TagRef {
+    const char* tag;
+    //! First eight bytes of the key (big endian, zero padded, signed order preserved)
+    u64 prefix;
+    u32 keylen;
+    u32 taglen;
+
+    void init(const char* begin, const char* key_end, const char* tag_end, const char* end) {
+        tag = begin;
+        keylen = static_cast<u32>(key_end - begin);
+        taglen = static_cast<u32>(tag_end - begin);
+        // Flip the sign bit so unsigned comparison of the prefix gives the
+        // same order as comparison of the 'char' values.
+        const u64 SIGN = 0x8080808080808080ull;
+        if (end - begin >= 8) {
+            u64 bytes;
+            memcpy(&bytes, begin, 8);
+            prefix = __builtin_bswap64(bytes) ^ SIGN;
+            if (keylen < 8) {
+                prefix &= ~(~0ull >> (keylen * 8));
+            }
+        } else {
+            prefix = 0;
+            for (u32 i = 0; i < 8; i++) {
+                prefix <<= 8;
+                if (i < keylen) {
+                    prefix |= static_cast<u8>(begin[i] ^ 0x80);
+                }
+            }
+        }
+    }
+};
+
+//! Compare tags by key, same order as byte by byte comparison of the keys
+bool tag_less(TagRef const& lhs, TagRef const& rhs) {
+    if (lhs.prefix != rhs.prefix) {
+        return lhs.prefix < rhs.prefix;
+    }
+    u32 len = std::min(lhs.keylen, rhs.keylen);
+    for (u32 i = 0; i < len; i++) {
+        if (lhs.tag[i] != rhs.tag[i]) {
+            return lhs.tag[i] < rhs.tag[i];
+        }
+    }
+    return lhs.keylen < rhs.keylen;
+}
+
+//! Sort tags, insertion sort is used for short lists (stable, same as std::sort for these sizes)
+void sort_tags(TagRef* tags, u32 ntags) {
+    enum { SMALL_N = 16 };
+    if (ntags > SMALL_N) {
+        std::sort(tags, tags + ntags, &tag_less);
+        return;
+    }
+    for (u32 i = 1; i < ntags; i++) {
+        TagRef val = tags[i];
+        u32 j = i;
+        while (j > 0 && tag_less(val, tags[j - 1])) {
+            tags[j] = tags[j - 1];
+            j--;
+        }
+        tags[j] = val;
+    }
+}
+
+}  // namespace
+
 aku_Status SeriesParser::to_canonical_form(const char* begin, const char* end,
                                            char* out_begin, char* out_end,
                                            const char** keystr_begin,
@@ -364,29 +924,29 @@ aku_Status SeriesParser::to_canonical_form(const char* begin, const char* end,
     const char* it = begin;
     // Get metric name
     it = skip_space(it, end);
-    it = copy_until(it, end, ' ', &it_out);
-    it = skip_space(it, end);
+    const char* metric_end = find_space(it, end);
+    memcpy(it_out, it, static_cast<size_t>(metric_end - it));
+    it_out += metric_end - it;
+    it = skip_space(metric_end, end);
 
     if (it == end) {
         // At least one tag should be specified
         return AKU_EBAD_DATA;
     }
 
-    *keystr_begin = it_out;
-
     // Get pointers to the keys
-    const char* tags[AKU_LIMITS_MAX_TAGS];
+    TagRef tags[AKU_LIMITS_MAX_TAGS];
     auto ix_tag = 0u;
     bool error = false;
     while(it < end && ix_tag < AKU_LIMITS_MAX_TAGS) {
-        tags[ix_tag] = it;
-        it = skip_tag(it, end, &error);
-        it = skip_space(it, end);
-        if (!error) {
-            ix_tag++;
-        } else {
+        const char* tag_begin = it;
+        const char* key_end = nullptr;
+        const char* tag_end = skip_tag(it, end, &key_end, &error);
+        if (error) {
             break;
         }
+        tags[ix_tag++].init(tag_begin, key_end, tag_end, end);
+        it = skip_space(tag_end, end);
     }
     if (error) {
         // Bad string
@@ -397,46 +957,17 @@ aku_Status SeriesParser::to_canonical_form(const char* begin, const char* end,
         return AKU_EBAD_DATA;
     }
 
-    auto sort_pred = [tags, end](const char* lhs, const char* rhs) {
-        // lhs should be always less thenn rhs
-        auto lenl = 0u;
-        auto lenr = 0u;
-        if (lhs < rhs) {
-            lenl = rhs - lhs;
-            lenr = end - rhs;
-        } else {
-            lenl = end - lhs;
-            lenr = lhs - rhs;
-        }
-        auto it = 0u;
-        while(true) {
-            if (it >= lenl || it >= lenr) {
-                return it < lenl;
-            }
-            if (lhs[it] == '=' || rhs[it] == '=') {
-                return lhs[it] == '=' && rhs[it] != '=';
-            }
-            if (lhs[it] < rhs[it]) {
-                return true;
-            } else if (lhs[it] > rhs[it]) {
-                return false;
-            }
-            it++;
-        }
-        return true;
-    };
+    sort_tags(tags, ix_tag);
 
-    std::sort(tags, tags + ix_tag, std::ref(sort_pred));  // std::sort can't move from predicate if predicate is a rvalue
-                                                          // nor it can pass predicate by reference
     // Copy tags to output string
+    *keystr_begin = it_out + 1;
     for (auto i = 0u; i < ix_tag; i++) {
         // insert space
         *it_out++ = ' ';
         // insert tag
-        const char* tag = tags[i];
-        copy_until(tag, end, ' ', &it_out);
+        memcpy(it_out, tags[i].tag, tags[i].taglen);
+        it_out += tags[i].taglen;
     }
-    *keystr_begin = skip_space(*keystr_begin, out_end);
     *keystr_end = it_out;
     return AKU_SUCCESS;
 }
@@ -464,10 +995,11 @@ std::tuple<aku_Status, SeriesParser::StringT> SeriesParser::filter_tags(SeriesPa
     bool error = false;
     while(it < end && ix_tag < AKU_LIMITS_MAX_TAGS) {
         last_tag = it;
-        it = skip_tag(it, end, &error);
+        const char* key_end = nullptr;
+        it = skip_tag(it, end, &key_end, &error);
         if (!error) {
             // Check tag
-            StringT tag = get_tag_name(last_tag, it);
+            StringT tag = {last_tag, key_end - last_tag};
             if (tags.count(tag) != 0) {
                 *it_out = ' ';
                 it_out++;
@@ -576,50 +1108,109 @@ bool LegacyGroupByTag::apply(aku_Sample* sample) {
 
 GroupByTag::GroupByTag(const SeriesMatcher& matcher, std::string metric, std::vector<std::string> const& tags)
     : matcher_(matcher)
-    , offset_{}
-    , prev_size_(0)
     , metric_(metric)
     , tags_(tags)
     , local_matcher_(1ul)
-    , snames_(StringTools::create_set(64))
+    , next_id_(0)
 {
+    std::lock_guard<std::mutex> guard(lock_);
     refresh_();
 }
 
-std::unordered_map<aku_ParamId, aku_ParamId> GroupByTag::get_mapping() const {
-    return ids_;
+std::shared_ptr<const DenseIdMap> GroupByTag::get_dense_mapping() {
+    std::lock_guard<std::mutex> guard(lock_);
+    refresh_();
+    return map_;
+}
+
+std::unordered_map<aku_ParamId, aku_ParamId> GroupByTag::get_mapping() {
+    std::unordered_map<aku_ParamId, aku_ParamId> result;
+    auto map = get_dense_mapping();
+    for (size_t i = 0; i < map->ids.size(); i++) {
+        if (map->ids[i] != 0) {
+            result[map->base + i] = map->ids[i];
+        }
+    }
+    return result;
 }
 
 void GroupByTag::refresh_() {
-    IncludeIfHasTag tag_query(metric_, tags_);
-    auto results = matcher_.search(tag_query);
-    auto filter = StringTools::create_set(tags_.size());
+    u64 watermark = matcher_.get_series_id();
+    if (map_ && watermark == next_id_) {
+        return;
+    }
+    std::vector<u64> ids;
+    if (!map_) {
+        // Initial state is extracted from the index, all series
+        // added after the watermark will be processed incrementally.
+        IncludeIfHasTag tag_query(metric_, tags_);
+        for (auto const& item: matcher_.search(tag_query)) {
+            ids.push_back(std::get<2>(item));
+        }
+    } else {
+        for (u64 id = next_id_; id < watermark; id++) {
+            ids.push_back(id);
+        }
+    }
+    auto map = std::make_shared<DenseIdMap>();
+    if (map_) {
+        *map = *map_;
+    } else {
+        map->base = watermark;
+        for (auto id: ids) {
+            map->base = std::min(map->base, id);
+        }
+    }
+    map->ids.resize(std::max(static_cast<size_t>(watermark - map->base), map->ids.size()), 0ul);
+    next_id_ = watermark;
+
+    ReadLock guard(matcher_.lock);
+    auto const& tokens = matcher_.tokens;
+    auto metric = tokens.token(std::make_pair(metric_.data(), static_cast<int>(metric_.size())));
+    std::vector<SeriesTokens::TokenT> tags;
     for (const auto& tag: tags_) {
-        filter.insert(std::make_pair(tag.data(), tag.size()));
+        tags.push_back(tokens.token(std::make_pair(tag.data(), static_cast<int>(tag.size()))));
     }
-    char buffer[AKU_LIMITS_MAX_SNAME];
-    for (auto item: results) {
-        aku_Status status;
-        SeriesParser::StringT result, stritem;
-        stritem = std::make_pair(std::get<0>(item), std::get<1>(item));
-        std::tie(status, result) = SeriesParser::filter_tags(stritem, filter, buffer);
-        if (status == AKU_SUCCESS) {
-            if (snames_.count(result) == 0) {
-                // put result to local stringpool and ids list
-                auto localid = local_matcher_.add(result.first, result.first + result.second);
-                auto str = local_matcher_.id2str(localid);
-                snames_.insert(str);
-                ids_[std::get<2>(item)] = localid;
-            } else {
-                // local name already created
-                auto localid = local_matcher_.match(result.first, result.first + result.second);
-                if (localid == 0ul) {
-                    AKU_PANIC("inconsistent matcher state");
-                }
-                ids_[std::get<2>(item)] = localid;
+    if (metric == 0 || std::count(tags.begin(), tags.end(), 0) != 0) {
+        // Series with all tags are not added yet
+        map_ = map;
+        return;
+    }
+    std::vector<SeriesTokens::TokenT> key;
+    for (auto id: ids) {
+        auto name = tokens.find(id);
+        if (name.size == 0 || name.tokens[0] != metric) {
+            continue;
+        }
+        key.clear();
+        for (u32 i = 1; i < name.size; i++) {
+            auto tag = tokens.tag_of(name.tokens[i]);
+            if (std::find(tags.begin(), tags.end(), tag) != tags.end()) {
+                key.push_back(name.tokens[i]);
             }
         }
+        if (key.size() != tags_.size()) {
+            // Series doesn't have all tags
+            continue;
+        }
+        auto it = groups_.find(key);
+        if (it == groups_.end()) {
+            // Local name is materialized only once per group
+            std::string localname = metric_;
+            for (auto token: key) {
+                auto str = tokens.str(token);
+                localname.push_back(' ');
+                localname.append(str.first, str.first + str.second);
+            }
+            auto localid = local_matcher_.add(localname.data(), localname.data() + localname.size());
+            it = groups_.insert(std::make_pair(key, localid)).first;
+        }
+        if (id - map->base >= map->ids.size()) {
+            map->ids.resize(id - map->base + 1, 0ul);
+        }
+        map->ids[id - map->base] = it->second;
     }
+    map_ = map;
 }
 
 
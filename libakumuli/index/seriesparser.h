@@ -20,10 +20,13 @@
 #include "index/invertedindex.h"
 
 #include <deque>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <stdint.h>
+#include <string>
 #include <tuple>
 #include <unordered_map>
 #include <unordered_set>
@@ -33,6 +36,8 @@ namespace Akumuli {
 
 static const u64 AKU_STARTING_SERIES_ID = 1024;
 
+struct GroupByTag;
+
 struct SeriesMatcherBase {
 
     ~SeriesMatcherBase() = default;
@@ -55,6 +60,12 @@ struct SeriesMatcherBase {
       */
     virtual void _add(const char* begin, const char* end, u64 id) = 0;
 
+    /** Add several values to matcher. This function should be
+      * used only to load data to matcher (see `_add`).
+      * @param items is a list of names and ids
+      */
+    virtual void _add_batch(std::vector<std::pair<std::string, u64>> const& items);
+
     /**
       * Match string and return it's id. If string is new return 0.
       */
@@ -66,6 +77,60 @@ struct SeriesMatcherBase {
     virtual StringT id2str(u64 tokenid) const = 0;
 };
 
+/** Tokenized series names.
+  * Metric names, tag names and tag-value pairs are interned and every series
+  * name is stored as a metric token followed by the tag-value tokens (in the same
+  * order as in canonical form). Tag of every tag-value token is known so group-by
+  * can select tags without parsing the names.
+  */
+class SeriesTokens {
+public:
+    typedef u32 TokenT;
+
+    //! Tokenized name (first token is a metric name)
+    struct Name {
+        TokenT const* tokens;
+        u32           size;
+    };
+private:
+    //! Max distance between the dense range and the id that can be stored in the array
+    enum { MAX_GAP = 0x10000 };
+
+    std::deque<std::string>     strings_;  //! Token values (token `i` is stored at `i - 1`)
+    StringTools::TableT         dict_;     //! Value to token mapping
+    std::vector<TokenT>         tags_;     //! Tag of every token (0 if token is not a tag-value pair)
+    std::vector<TokenT>         arena_;    //! Tokenized names, every name is prefixed by its size
+    u64                         base_;
+    std::vector<u64>            dense_;    //! Offsets of the names in the arena (0 if not present)
+    std::unordered_map<u64, u64> sparse_;
+
+    TokenT intern(StringTools::StringT str, TokenT tag);
+public:
+    SeriesTokens();
+    SeriesTokens(SeriesTokens const&) = delete;
+    SeriesTokens& operator=(SeriesTokens const&) = delete;
+
+    //! Tokenize series name in canonical form and store it (replaces previous name)
+    void add(u64 id, StringT name);
+
+    //! Remove series name (tokens are not released)
+    void erase(u64 id);
+
+    //! Find tokenized name, return {nullptr, 0} if id is not present
+    Name find(u64 id) const;
+
+    //! Find token by value, return 0 if value is not present
+    TokenT token(StringTools::StringT str) const;
+
+    //! Get value of the token
+    StringTools::StringT str(TokenT token) const;
+
+    //! Get tag of the tag-value token
+    TokenT tag_of(TokenT token) const;
+
+    size_t mem_used() const;
+};
+
 /** Series index. Can be used to retreive series names and ids by tags.
   * Implements inverted index with compression and other optimizations.
   * It's more efficient than PlainSeriesMatcher but it's costly to have
@@ -75,15 +140,28 @@ struct SeriesMatcher : SeriesMatcherBase {
     //! Series name descriptor - pointer to string, length, series id.
     typedef std::tuple<const char*, int, u64> SeriesNameT;
 
-    typedef StringTools::TableT TableT;
+    typedef FlatStringTable     TableT;
     typedef StringTools::InvT   InvT;
 
     Index                    index;      //! Series name index and storage
     TableT                   table;      //! Series table (name to id mapping)
     InvT                     inv_table;  //! Ids table (id to name mapping)
+    SeriesTokens             tokens;     //! Tokenized names (id to tokens mapping)
     u64                      series_id;  //! Series ID counter
     std::vector<SeriesNameT> names;      //! List of recently added names
-    mutable std::mutex       mutex;      //! Mutex for shared data
+    //! Protects index, tables and series ID counter (queries and id lookups share the lock)
+    mutable RWLock           lock;
+    //! Protects the list of recently added names
+    mutable std::mutex       names_mutex;
+    //! Set if the index has posting lists that are not merged yet
+    mutable std::atomic<bool> deferred;
+
+    //! Max number of cached group-by mappings
+    enum { GROUP_BY_CACHE_SIZE = 256 };
+    //! Cached group-by mappings (key is a metric name followed by the sorted list of tags)
+    mutable std::unordered_map<std::string, std::shared_ptr<GroupByTag>> groups;
+    //! Mutex for group-by cache
+    mutable std::mutex       groups_mutex;
 
     SeriesMatcher(u64 starting_id=AKU_STARTING_SERIES_ID);
 
@@ -91,6 +169,15 @@ struct SeriesMatcher : SeriesMatcherBase {
       */
     u64 add(const char* begin, const char* end);
 
+    /** Add series name in canonical form if it's not added yet.
+      * Name is parsed before taking the lock, lookup and insertion are done in
+      * one critical section so concurrent writers don't need extra locking.
+      * @param hash should be equal to StringTools::hash of the series name
+      * @param created is set if the name was added by this call
+      * @return series id or 0 if the name is malformed
+      */
+    u64 add_if_absent(const char* begin, const char* end, u64 hash, bool* created);
+
     /** Add value to matcher. This function should be
       * used only to load data to matcher. Internal
       * `series_id` counter wouldn't be affected by this call, so
@@ -105,11 +192,75 @@ struct SeriesMatcher : SeriesMatcherBase {
       */
     void _add(const char* begin, const char* end, u64 id);
 
+    /** Add names loaded from the metadata storage. Names are split into ranges,
+      * every range is parsed and its posting lists are built by one of the
+      * `nworkers` threads (0 - one per core). Ranges are added to the matcher
+      * in order, posting lists are merged into the index on first query so
+      * this method should be called before any name is added using `add`.
+      * @throw std::exception if some name is malformed
+      */
+    void _add_batch(std::vector<std::pair<std::string, u64>> const& items, size_t nworkers);
+
+    void _add_batch(std::vector<std::pair<std::string, u64>> const& items);
+
+    /** Add value loaded from the index snapshot. Series name should be in
+      * canonical form. Posting lists are not updated, they should be added
+      * using `_add_postings`.
+      * @return string pool id of the name or 0 on error
+      */
+    u64 _add_canonical(const char* begin, const char* end, u64 id);
+
+    //! Add posting lists loaded from the index snapshot
+    void _add_postings(Index::DeferredPostings&& postings);
+
+    /** Remove series from the index. Removed names can't be found by queries
+      * and `match`, the same name can be added again later and will get a new id.
+      * @param ids is a list of series ids
+      * @param removed receives names and ids of the removed series (ids that are
+      *        not present are skipped), names stay valid because the pool is append-only
+      */
+    void remove(std::vector<u64> const& ids, std::vector<SeriesNameT>* removed);
+
+    //! Merge posting lists loaded from the snapshot, called by readers before taking the shared lock
+    void restore_postings() const;
+
+    /** Build posting lists of the metrics lazily, keep only `limit` most recently
+      * queried metrics indexed (0 - index everything eagerly, see `Index::set_resident_limit`).
+      * Should be called before any name is added.
+      */
+    void set_resident_limit(size_t limit);
+
+    //! Number of resident metrics, materializations and evictions
+    Index::ResidentStats get_resident_stats() const;
+
+    //! Value of the series ID counter, all series with smaller ids can be found in the index
+    u64 get_series_id() const;
+
+    //! Number of series in the matcher
+    size_t size() const;
+
+    //! Memory used by the series names
+    size_t pool_memory_use() const;
+
+    //! Memory used by the posting lists
+    size_t index_memory_use() const;
+
+    /** Number of series of the metric.
+      * Can be larger than the actual number because of hash collisions.
+      */
+    size_t metric_cardinality(const char* begin, const char* end) const;
+
     /**
       * Match string and return it's id. If string is new return 0.
+      * Doesn't take the lock, can be called concurrently with `add`.
       */
     u64 match(const char* begin, const char* end) const;
 
+    /**
+      * Match string using precomputed hash (StringTools::hash of the string).
+      */
+    u64 match(const char* begin, const char* end, u64 hash) const;
+
     /**
       * Convert id to string
       */
@@ -124,11 +275,39 @@ struct SeriesMatcher : SeriesMatcherBase {
 
     std::vector<SeriesNameT> search(IndexQueryNodeBase const& query) const;
 
-    std::vector<StringT> suggest_metric(std::string prefix) const;
+    //! Receives search results in batches, returns false to stop the search
+    typedef std::function<bool(std::vector<SeriesNameT> const&)> SearchSink;
+
+    /** Search the index and pass results to `sink`.
+      * Names found by the query are resolved to series ids in shards, each shard
+      * under the read lock, and passed to `sink` as soon as it's resolved in the
+      * same order as `search` returns them. `sink` is called without the lock so
+      * it can block.
+      */
+    void search(IndexQueryNodeBase const& query, SearchSink const& sink) const;
+
+    /** Get group-by mapping for the metric and set of tags.
+      * Mapping is created on first access and cached, next calls return
+      * the same object.
+      */
+    std::shared_ptr<GroupByTag> group_by(std::string metric, std::vector<std::string> tags) const;
+
+    //! Return first `limit` metric names that start with the prefix (in sorted order)
+    std::vector<StringT> suggest_metric(std::string prefix, size_t limit = std::numeric_limits<size_t>::max()) const;
 
-    std::vector<StringT> suggest_tags(std::string metric, std::string tag_prefix) const;
+    //! Return first `limit` tags of the metric that start with the prefix (in sorted order)
+    std::vector<StringT> suggest_tags(std::string metric, std::string tag_prefix,
+                                      size_t limit = std::numeric_limits<size_t>::max()) const;
 
-    std::vector<StringT> suggest_tag_values(std::string metric, std::string tag, std::string value_prefix) const;
+    //! Return first `limit` values of the tag that start with the prefix (in sorted order)
+    std::vector<StringT> suggest_tag_values(std::string metric, std::string tag, std::string value_prefix,
+                                            size_t limit = std::numeric_limits<size_t>::max()) const;
+
+    /** Estimate number of series using cardinality sketches (doesn't search the index).
+      * @param pairs is a list of tag=value pairs, series of the metric that have any of
+      *        them are counted (all series of the metric are counted if the list is empty)
+      */
+    u64 estimate_cardinality(std::string metric, std::vector<std::string> const& pairs) const;
 };
 
 
@@ -142,7 +321,7 @@ struct PlainSeriesMatcher : SeriesMatcherBase {
     //! Series name descriptor - pointer to string, length, series id.
     typedef std::tuple<const char*, int, u64> SeriesNameT;
 
-    typedef StringTools::TableT TableT;
+    typedef FlatStringTable     TableT;
     typedef StringTools::InvT   InvT;
 
     // Variables
@@ -177,9 +356,21 @@ struct PlainSeriesMatcher : SeriesMatcherBase {
       */
     u64 match(const char* begin, const char* end) const;
 
+    /** Match string using precomputed hash (StringTools::hash of the string).
+      */
+    u64 match(const char* begin, const char* end, u64 hash) const;
+
+    /** Match `n` strings with precomputed hashes under one lock.
+      * Ids of the new strings are set to 0.
+      */
+    void match(StringT const* names, u64 const* hashes, size_t n, u64* ids) const;
+
     //! Convert id to string
     StringT id2str(u64 tokenid) const;
 
+    //! Remove ids from the lookup tables (strings stay in the pool)
+    void remove(std::vector<u64> const& ids);
+
     /** Push all new elements to the buffer.
       * @param buffer is an output parameter that will receive new elements
       */
@@ -251,33 +442,59 @@ struct LegacyGroupByTag {
 
 
 
+/** Dense mapping from global series ids to local series ids.
+  * Element `i` of the array contains local id of the series `base + i`
+  * or 0 if the series is not mapped.
+  */
+struct DenseIdMap {
+    aku_ParamId base;
+    std::vector<aku_ParamId> ids;
+
+    //! Get local id (0 if id is not mapped)
+    aku_ParamId find(aku_ParamId id) const {
+        if (id < base || id - base >= ids.size()) {
+            return 0;
+        }
+        return ids[id - base];
+    }
+};
+
+
 /** Group-by processor. Maps set of global series names to
   * some other set of local series ids.
+  * Mapping is updated incrementally, only series added after the previous
+  * update are processed. Tokenized names are used so the names are not parsed,
+  * local names are materialized only for new groups. Instances are cached by
+  * the SeriesMatcher and can be used by several queries concurrently.
   */
 struct GroupByTag {
-    //! Mapping from global parameter ids to local parameter ids
-    std::unordered_map<aku_ParamId, aku_ParamId> ids_;
     //! Shared series matcher
     SeriesMatcher const& matcher_;
-    //! Previous string pool offset
-    StringPoolOffset offset_;
-    //! Previous string pool size
-    size_t prev_size_;
     //! Metric name
     std::string metric_;
     //! List of tags of interest
     std::vector<std::string> tags_;
     //! Local string pool. All transient series names lives here.
     PlainSeriesMatcher local_matcher_;
-    //! List of string already added string pool
-    StringTools::SetT snames_;
+    //! Local ids of the groups (key is a list of tag-value tokens)
+    std::map<std::vector<SeriesTokens::TokenT>, aku_ParamId> groups_;
+    //! Id of the first series that wasn't processed yet
+    u64 next_id_;
+    //! Current mapping, replaced (not modified) on update
+    std::shared_ptr<const DenseIdMap> map_;
+    //! Protects all fields above
+    mutable std::mutex lock_;
 
     //! Main c-tor
     GroupByTag(const SeriesMatcher &matcher, std::string metric, std::vector<std::string> const& tags);
 
+    //! Process series that were added after the previous call (should be called under the lock)
     void refresh_();
 
-    std::unordered_map<aku_ParamId, aku_ParamId> get_mapping() const;
+    //! Get current mapping, it's updated first if new series were added to the matcher
+    std::shared_ptr<const DenseIdMap> get_dense_mapping();
+
+    std::unordered_map<aku_ParamId, aku_ParamId> get_mapping();
 };
 
 
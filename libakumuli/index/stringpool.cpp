@@ -15,8 +15,18 @@
  */
 
 #include "stringpool.h"
+#include "log_iface.h"
+
+#include <algorithm>
+
 #include <boost/regex.hpp>
 
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace Akumuli {
 
 //                        //
@@ -135,32 +145,36 @@ StringPool::StringPool()
 {
 }
 
+StringPool::~StringPool() {
+    for (auto const& bin: pool) {
+        munmap(bin.data, MAX_BIN_SIZE);
+    }
+}
+
 u64 StringPool::add(const char* begin, const char* end) {
     assert(begin < end);
     std::lock_guard<std::mutex> guard(pool_mutex);
-    if (pool.empty()) {
-        pool.emplace_back();
-        pool.back().reserve(MAX_BIN_SIZE);
-    }
     auto size = static_cast<u64>(end - begin);
     if (size == 0) {
         return 0;
     }
     size += 1;  // 1 is for 0 character
-    u32 bin_index = static_cast<u32>(pool.size()); // bin index is 1-based
-    std::vector<char>* bin = &pool.back();
-    if (bin->size() + size > MAX_BIN_SIZE) {
+    if (pool.empty() || pool.back().size + size > MAX_BIN_SIZE) {
         // New bin
-        pool.emplace_back();
-        bin = &pool.back();
-        bin->reserve(MAX_BIN_SIZE);
-        bin_index = static_cast<u32>(pool.size());
-    }
-    u32 offset = static_cast<u32>(bin->size()); // offset is 0-based
-    for(auto i = begin; i < end; i++) {
-        bin->push_back(*i);
+        void* data = mmap(nullptr, MAX_BIN_SIZE, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (data == MAP_FAILED) {
+            Logger::msg(AKU_LOG_ERROR, "Can't allocate string pool bin");
+            return 0;
+        }
+        pool.push_back({ static_cast<char*>(data), 0 });
     }
-    bin->push_back('\0');
+    u32 bin_index = static_cast<u32>(pool.size()); // bin index is 1-based
+    Bin* bin = &pool.back();
+    u32 offset = static_cast<u32>(bin->size); // offset is 0-based
+    std::copy(begin, end, bin->data + offset);
+    bin->data[offset + size - 1] = '\0';
+    bin->size += size;
     std::atomic_fetch_add(&counter, 1ul);
     return bin_index*MAX_BIN_SIZE + offset;
 }
@@ -171,9 +185,9 @@ StringT StringPool::str(u64 bits) const {
     assert(ix != 0);
     std::lock_guard<std::mutex> guard(pool_mutex);
     if (ix <= pool.size()) {
-        std::vector<char> const* bin = &pool.at(ix - 1);
-        if (offset < bin->size()) {
-            const char* pstr = bin->data() + offset;
+        Bin const& bin = pool.at(ix - 1);
+        if (offset < bin.size) {
+            const char* pstr = bin.data + offset;
             return std::make_pair(pstr, std::strlen(pstr));
         }
     }
@@ -188,11 +202,91 @@ size_t StringPool::mem_used() const {
     size_t res = 0;
     std::lock_guard<std::mutex> guard(pool_mutex);
     for (auto const& bin: pool) {
-        res += bin.size();
+        res += bin.size;
     }
     return res;
 }
 
+//                         //
+//  InvertedStringTable    //
+//                         //
+
+InvertedStringTable::InvertedStringTable()
+    : base_(0)
+    , size_(0)
+{
+}
+
+void InvertedStringTable::insert(u64 id, StringT str) {
+    if (dense_.empty() && sparse_.empty()) {
+        base_ = id;
+    }
+    if (id >= base_ && id - base_ < dense_.size() + MAX_GAP) {
+        auto ix = static_cast<size_t>(id - base_);
+        if (ix >= dense_.size()) {
+            dense_.resize(ix + 1, std::make_pair(nullptr, 0));
+        }
+        if (dense_[ix].first == nullptr) {
+            size_++;
+        }
+        dense_[ix] = str;
+    } else {
+        auto res = sparse_.insert(std::make_pair(id, str));
+        if (res.second) {
+            size_++;
+        } else {
+            res.first->second = str;
+        }
+    }
+}
+
+InvertedStringTable::StringT InvertedStringTable::find(u64 id) const {
+    if (id >= base_ && id - base_ < dense_.size()) {
+        return dense_[static_cast<size_t>(id - base_)];
+    }
+    auto it = sparse_.find(id);
+    if (it == sparse_.end()) {
+        return std::make_pair(nullptr, 0);
+    }
+    return it->second;
+}
+
+bool InvertedStringTable::erase(u64 id) {
+    if (id >= base_ && id - base_ < dense_.size()) {
+        auto& item = dense_[static_cast<size_t>(id - base_)];
+        if (item.first == nullptr) {
+            return false;
+        }
+        item = std::make_pair(nullptr, 0);
+        size_--;
+        return true;
+    }
+    if (sparse_.erase(id) == 0) {
+        return false;
+    }
+    size_--;
+    return true;
+}
+
+size_t InvertedStringTable::size() const {
+    return size_;
+}
+
+std::vector<u64> InvertedStringTable::get_ids() const {
+    std::vector<u64> result;
+    result.reserve(size_);
+    for (size_t i = 0; i < dense_.size(); i++) {
+        if (dense_[i].first != nullptr) {
+            result.push_back(base_ + i);
+        }
+    }
+    for (auto const& kv: sparse_) {
+        result.push_back(kv.first);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
 //               //
 //  StringTools  //
 //               //
@@ -234,5 +328,156 @@ StringTools::L3TableT StringTools::create_l3_table(size_t size_hint) {
     return L3TableT(size_hint, &StringTools::hash, &StringTools::equal);
 }
 
+//                     //
+//   FlatStringTable   //
+//                     //
+
+FlatStringTable::Buckets::Buckets(size_t ngroups)
+    : ngroups(ngroups)
+    , ctrl(new u8[ngroups*GROUP_SIZE])
+    , slots(new Slot[ngroups*GROUP_SIZE])
+{
+    std::fill(ctrl.get(), ctrl.get() + ngroups*GROUP_SIZE, static_cast<u8>(EMPTY_SLOT));
+}
+
+FlatStringTable::FlatStringTable()
+    : buckets_(new Buckets(INITIAL_NGROUPS))
+    , current_(buckets_.get())
+    , readers_{0}
+    , size_(0)
+{
+}
+
+u64 FlatStringTable::mix(u64 h) {
+    // djb2 hash has poor high bits, use murmur3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
 }
 
+//! Return bitmask of the control bytes in the group that are equal to `tag`
+static u32 match_group(const u8* group, u8 tag) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<u32>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(tag)))));
+#else
+    u32 mask = 0;
+    for (int i = 0; i < 16; i++) {
+        if (group[i] == tag) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+FlatStringTable::Slot const* FlatStringTable::find_slot(Buckets const* buckets, StringT str, u64 hash) {
+    const u8 tag = static_cast<u8>(hash & 0x7F);
+    const size_t gmask = buckets->ngroups - 1;
+    size_t group = static_cast<size_t>(hash >> 7) & gmask;
+    for (size_t nprobes = 0; nprobes < buckets->ngroups; nprobes++) {
+        const u8* ctrl = buckets->ctrl.get() + group*GROUP_SIZE;
+        u32 mask = match_group(ctrl, tag);
+        // Control byte is published after the slot, see `insert_slot`
+        std::atomic_thread_fence(std::memory_order_acquire);
+        while (mask) {
+            int ix = __builtin_ctz(mask);
+            Slot const* slot = buckets->slots.get() + group*GROUP_SIZE + ix;
+            if (slot->len == str.second && std::equal(str.first, str.first + str.second, slot->str)) {
+                return slot;
+            }
+            mask &= mask - 1;
+        }
+        if (match_group(ctrl, EMPTY_SLOT) != 0) {
+            return nullptr;
+        }
+        group = (group + 1) & gmask;
+    }
+    return nullptr;
+}
+
+void FlatStringTable::insert_slot(Buckets* buckets, StringT str, u64 hash, u64 value) {
+    const u8 tag = static_cast<u8>(hash & 0x7F);
+    const size_t gmask = buckets->ngroups - 1;
+    size_t group = static_cast<size_t>(hash >> 7) & gmask;
+    while (true) {
+        u8* ctrl = buckets->ctrl.get() + group*GROUP_SIZE;
+        u32 mask = match_group(ctrl, EMPTY_SLOT);
+        if (mask) {
+            int ix = __builtin_ctz(mask);
+            Slot* slot = buckets->slots.get() + group*GROUP_SIZE + ix;
+            slot->str = str.first;
+            slot->len = str.second;
+            slot->value = value;
+            std::atomic_thread_fence(std::memory_order_release);
+            ctrl[ix] = tag;
+            return;
+        }
+        group = (group + 1) & gmask;
+    }
+}
+
+void FlatStringTable::grow() {
+    std::unique_ptr<Buckets> buckets(new Buckets(buckets_->ngroups*2));
+    const size_t nslots = buckets_->ngroups*GROUP_SIZE;
+    for (size_t i = 0; i < nslots; i++) {
+        if (buckets_->ctrl[i] != EMPTY_SLOT) {
+            Slot const& slot = buckets_->slots[i];
+            StringT str = std::make_pair(slot.str, slot.len);
+            insert_slot(buckets.get(), str, mix(StringTools::hash(str)), slot.value);
+        }
+    }
+    current_.store(buckets.get());
+    retired_.push_back(std::move(buckets_));
+    buckets_ = std::move(buckets);
+}
+
+void FlatStringTable::insert(StringT str, u64 hash, u64 value) {
+    hash = mix(hash);
+    auto slot = const_cast<Slot*>(find_slot(buckets_.get(), str, hash));
+    if (slot != nullptr) {
+        __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+        return;
+    }
+    // Max load factor is 7/8
+    if ((size_ + 1)*8 > buckets_->ngroups*GROUP_SIZE*7) {
+        grow();
+    }
+    insert_slot(buckets_.get(), str, hash, value);
+    size_++;
+    // Readers that will start after this point will see new buckets
+    if (!retired_.empty() && readers_.load() == 0) {
+        retired_.clear();
+    }
+}
+
+bool FlatStringTable::erase(StringT str, u64 hash) {
+    auto slot = const_cast<Slot*>(find_slot(buckets_.get(), str, mix(hash)));
+    if (slot == nullptr || slot->value == 0) {
+        return false;
+    }
+    __atomic_store_n(&slot->value, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+u64 FlatStringTable::find(StringT str, u64 hash) const {
+    readers_++;
+    Buckets const* buckets = current_.load();
+    Slot const* slot = find_slot(buckets, str, mix(hash));
+    u64 result = slot ? __atomic_load_n(&slot->value, __ATOMIC_RELAXED) : 0;
+    readers_--;
+    return result;
+}
+
+u64 FlatStringTable::find(StringT str) const {
+    return find(str, StringTools::hash(str));
+}
+
+size_t FlatStringTable::size() const {
+    return size_;
+}
+
+}
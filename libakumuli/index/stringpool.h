@@ -18,6 +18,7 @@
 
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <unordered_set>
@@ -77,11 +78,21 @@ class StringPool {
 public:
     const u64 MAX_BIN_SIZE = AKU_LIMITS_MAX_SNAME * 0x1000;  // 8Mb
 
-    std::deque<std::vector<char>> pool;
+    /** String pool bin.
+      * Memory is mapped directly (anonymous mapping) and not allocated from
+      * the heap. Pages are committed by the OS on first write.
+      */
+    struct Bin {
+        char* data;
+        u64   size;
+    };
+
+    std::vector<Bin>              pool;
     mutable std::mutex            pool_mutex;
     std::atomic<size_t>           counter;
 
     StringPool();
+    ~StringPool();
     StringPool(StringPool const&) = delete;
     StringPool& operator=(StringPool const&) = delete;
 
@@ -107,6 +118,41 @@ public:
 };
 
 
+/** Id to string mapping.
+  * Series ids are allocated sequentially so most of them are stored in a flat
+  * array indexed by id (one pointer-length pair per id, no per-element allocations).
+  * Ids that are far from the dense range are stored in a hash map.
+  */
+class InvertedStringTable {
+public:
+    typedef std::pair<const char*, int> StringT;
+private:
+    //! Max distance between the dense range and the id that can be stored in the array
+    enum { MAX_GAP = 0x10000 };
+
+    u64                              base_;
+    std::vector<StringT>             dense_;
+    std::unordered_map<u64, StringT> sparse_;
+    size_t                           size_;
+public:
+    InvertedStringTable();
+
+    //! Add or replace value
+    void insert(u64 id, StringT str);
+
+    //! Find string by id, return {nullptr, 0} if id is not present
+    StringT find(u64 id) const;
+
+    //! Remove id, return false if id is not present
+    bool erase(u64 id);
+
+    size_t size() const;
+
+    //! Get all ids in ascending order
+    std::vector<u64> get_ids() const;
+};
+
+
 struct StringTools {
     //! Pooled string
     typedef std::pair<const char*, int> StringT;
@@ -126,7 +172,7 @@ struct StringTools {
     typedef std::unordered_map<StringT, L2TableT, decltype(&StringTools::hash), decltype(&StringTools::equal)> L3TableT;
 
     //! Inverted table type (id to string mapping)
-    typedef std::unordered_map<u64, StringT> InvT;
+    typedef InvertedStringTable InvT;
 
     static TableT create_table(size_t size);
 
@@ -136,4 +182,75 @@ struct StringTools {
 
     static L3TableT create_l3_table(size_t size_hint);
 };
+
+
+/** Open addressing hash table that maps strings to ids.
+  * Slots are organized in groups of 16. Every slot has a control byte that
+  * stores 7 bits of the hash (or marks the slot as empty), so the whole group
+  * is probed at once (using SSE2 if available) and the string itself is compared
+  * only if the control byte matches.
+  * Readers don't take locks: `find` can run concurrently with `insert` (it can
+  * miss the value that is being inserted), all calls to `insert` should be
+  * serialized by the caller. Strings are not copied and should outlive the table.
+  * Hash value should be computed using StringTools::hash, zero value can't be stored.
+  */
+class FlatStringTable {
+public:
+    typedef StringTools::StringT StringT;
+private:
+    enum {
+        GROUP_SIZE = 16,
+        INITIAL_NGROUPS = 4,
+        EMPTY_SLOT = 0x80,
+    };
+
+    struct Slot {
+        const char* str;
+        u64         value;
+        int         len;
+    };
+
+    struct Buckets {
+        size_t                  ngroups;  //! Number of groups (power of two)
+        std::unique_ptr<u8[]>   ctrl;     //! Control bytes
+        std::unique_ptr<Slot[]> slots;
+
+        Buckets(size_t ngroups);
+    };
+
+    std::unique_ptr<Buckets>              buckets_;
+    //! Buckets visible to readers
+    std::atomic<Buckets*>                 current_;
+    //! Buckets replaced by `grow` but possibly used by readers
+    std::vector<std::unique_ptr<Buckets>> retired_;
+    //! Number of active readers
+    mutable std::atomic<int>              readers_;
+    size_t                                size_;
+
+    static u64 mix(u64 hash);
+    static Slot const* find_slot(Buckets const* buckets, StringT str, u64 hash);
+    static void insert_slot(Buckets* buckets, StringT str, u64 hash, u64 value);
+    void grow();
+public:
+    FlatStringTable();
+    FlatStringTable(FlatStringTable const&) = delete;
+    FlatStringTable& operator=(FlatStringTable const&) = delete;
+
+    //! Add or replace value (not thread-safe)
+    void insert(StringT str, u64 hash, u64 value);
+
+    /** Remove value (not thread-safe). The slot is not released, `find` returns 0
+      * and the next `insert` of the same string reuses the slot.
+      * @return false if string is not present
+      */
+    bool erase(StringT str, u64 hash);
+
+    //! Find value by string, return 0 if string is not present (thread-safe)
+    u64 find(StringT str, u64 hash) const;
+
+    //! Find value by string, return 0 if string is not present (thread-safe)
+    u64 find(StringT str) const;
+
+    size_t size() const;
+};
 }
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <boost/version.hpp>
+#include <string>
 
 #include "akumuli.h"
 
@@ -35,5 +36,9 @@ struct InternalCursor {
     virtual void complete() = 0;
     //! Set error and stop execution
     virtual void set_error(aku_Status error_code) = 0;
+    //! Attach execution profile (JSON), should be called before `complete`
+    virtual void set_profile(std::string const&) {}
+    //! Attach resume token of the incremental query, should be called before `complete`
+    virtual void set_resume_token(std::string const&) {}
 };
 }
@@ -0,0 +1,86 @@
+#include "memory_accounting.h"
+
+#include <atomic>
+
+namespace Akumuli {
+
+//! Counters are padded to avoid false sharing between the subsystems
+struct alignas(64) MemoryCounter {
+    std::atomic<i64> value;
+};
+
+//! Zero-initialized and trivially destructible, can be used during static init and destruction
+static MemoryCounter g_counters[AKU_MEM_MAX];
+
+static MemoryCounter* get_counters() {
+    return g_counters;
+}
+
+void MemoryAccounting::add(aku_MemorySubsystem subsystem, size_t nbytes) {
+    get_counters()[subsystem].value.fetch_add(static_cast<i64>(nbytes), std::memory_order_relaxed);
+}
+
+void MemoryAccounting::sub(aku_MemorySubsystem subsystem, size_t nbytes) {
+    get_counters()[subsystem].value.fetch_sub(static_cast<i64>(nbytes), std::memory_order_relaxed);
+}
+
+u64 MemoryAccounting::get(aku_MemorySubsystem subsystem) {
+    auto value = get_counters()[subsystem].value.load(std::memory_order_relaxed);
+    // Counter can be updated by the application (see `aku_memory_add`)
+    return value < 0 ? 0 : static_cast<u64>(value);
+}
+
+MemoryAccounting::Snapshot MemoryAccounting::get_all() {
+    Snapshot result;
+    for (int i = 0; i < AKU_MEM_MAX; i++) {
+        result[i] = get(static_cast<aku_MemorySubsystem>(i));
+    }
+    return result;
+}
+
+const char* MemoryAccounting::name(aku_MemorySubsystem subsystem) {
+    switch (subsystem) {
+    case AKU_MEM_SERIES_TABLE:
+        return "series_table";
+    case AKU_MEM_POSTINGS:
+        return "postings";
+    case AKU_MEM_STRING_POOL:
+        return "string_pool";
+    case AKU_MEM_WRITE_BUFFERS:
+        return "write_buffers";
+    case AKU_MEM_BLOCK_CACHE:
+        return "block_cache";
+    case AKU_MEM_QUERY_CACHE:
+        return "query_cache";
+    case AKU_MEM_CURSORS:
+        return "cursors";
+    case AKU_MEM_READ_BUFFERS:
+        return "read_buffers";
+    case AKU_MEM_SESSIONS:
+        return "sessions";
+    case AKU_MEM_MAX:
+        break;
+    };
+    return "unknown";
+}
+
+MemoryTracker::MemoryTracker(aku_MemorySubsystem subsystem)
+    : subsystem_(subsystem)
+    , size_(0)
+{
+}
+
+MemoryTracker::~MemoryTracker() {
+    MemoryAccounting::sub(subsystem_, size_);
+}
+
+void MemoryTracker::add(size_t nbytes) {
+    size_ += nbytes;
+    MemoryAccounting::add(subsystem_, nbytes);
+}
+
+size_t MemoryTracker::size() const {
+    return size_;
+}
+
+}  // namespace
@@ -0,0 +1,113 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Per-subsystem memory counters and tagged allocator
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+#include "akumuli_def.h"
+
+#include <array>
+#include <cstddef>
+#include <memory>
+
+namespace Akumuli {
+
+/** Process-wide memory counters, one per subsystem.
+  * Counters are updated by the tagged allocator (see `TrackingAllocator`) and
+  * by `MemoryTracker` objects. Memory of the objects that know their own size
+  * (caches, string pools, write buffers) is not tracked this way, storage adds
+  * it to the counters when the stats are collected (see `Storage::get_memory_use`).
+  */
+struct MemoryAccounting {
+    typedef std::array<u64, AKU_MEM_MAX> Snapshot;
+
+    static void add(aku_MemorySubsystem subsystem, size_t nbytes);
+
+    static void sub(aku_MemorySubsystem subsystem, size_t nbytes);
+
+    static u64 get(aku_MemorySubsystem subsystem);
+
+    //! Get values of all counters
+    static Snapshot get_all();
+
+    //! Name of the subsystem (used in stats)
+    static const char* name(aku_MemorySubsystem subsystem);
+};
+
+
+/** Allocator that adds size of every allocation to the subsystem's counter.
+  * Stateless, all instances with the same tag are interchangeable.
+  */
+template <class T, aku_MemorySubsystem S>
+struct TrackingAllocator {
+    typedef T value_type;
+
+    template <class U>
+    struct rebind {
+        typedef TrackingAllocator<U, S> other;
+    };
+
+    TrackingAllocator() = default;
+
+    template <class U>
+    TrackingAllocator(TrackingAllocator<U, S> const&) {}
+
+    T* allocate(size_t n) {
+        T* res = std::allocator<T>().allocate(n);
+        MemoryAccounting::add(S, n * sizeof(T));
+        return res;
+    }
+
+    void deallocate(T* p, size_t n) {
+        std::allocator<T>().deallocate(p, n);
+        MemoryAccounting::sub(S, n * sizeof(T));
+    }
+};
+
+template <class T, class U, aku_MemorySubsystem S>
+bool operator == (TrackingAllocator<T, S> const&, TrackingAllocator<U, S> const&) {
+    return true;
+}
+
+template <class T, class U, aku_MemorySubsystem S>
+bool operator != (TrackingAllocator<T, S> const&, TrackingAllocator<U, S> const&) {
+    return false;
+}
+
+
+/** Accounts memory that is not allocated through the tagged allocator.
+  * Everything that was added is subtracted from the counter on destruction.
+  */
+class MemoryTracker {
+    const aku_MemorySubsystem subsystem_;
+    size_t size_;
+public:
+    MemoryTracker(aku_MemorySubsystem subsystem);
+    ~MemoryTracker();
+    MemoryTracker(MemoryTracker const&) = delete;
+    MemoryTracker& operator = (MemoryTracker const&) = delete;
+
+    void add(size_t nbytes);
+
+    //! Number of bytes accounted by this tracker
+    size_t size() const;
+};
+
+}  // namespace
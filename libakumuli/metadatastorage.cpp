@@ -18,13 +18,16 @@
 #include "metadatastorage.h"
 #include "util.h"
 #include "log_iface.h"
+#include "status_util.h"
 
+#include <algorithm>
+#include <cstdlib>
 #include <sstream>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/exception/diagnostic_information.hpp>
 
-#include <sqlite3.h>  // to set trace callback
+#include <sqlite3.h>  // to set trace callback and to use prepared statements
 
 namespace Akumuli {
 
@@ -45,6 +48,12 @@ void AprHandleDeleter::operator()(apr_dbd_t* handle) {
     }
 }
 
+void SqliteStmtDeleter::operator()(sqlite3_stmt* stmt) {
+    if (stmt != nullptr) {
+        sqlite3_finalize(stmt);
+    }
+}
+
 
 //-------------------------------MetadataStorage----------------------------------------
 
@@ -79,49 +88,183 @@ MetadataStorage::MetadataStorage(const char* db)
     }
     handle_ = HandleT(handle, AprHandleDeleter(driver_));
 
-    auto sqlite_handle = apr_dbd_native_handle(driver_, handle);
-    sqlite3_trace(static_cast<sqlite3*>(sqlite_handle), callback_adapter, nullptr);
+    sqlite_ = static_cast<sqlite3*>(apr_dbd_native_handle(driver_, handle));
+    sqlite3_trace(sqlite_, callback_adapter, nullptr);
+
+    // Readers shouldn't be blocked by the sync worker
+    select_query("PRAGMA journal_mode=WAL;");
 
     create_tables();
 
-    // Create prepared statement
-    const char* query = "INSERT INTO akumuli_series (series_id, keyslist, storage_id) VALUES (%s, %s, %d)";
-    status = apr_dbd_prepare(driver_, pool_.get(), handle_.get(), query, "INSERT_SERIES_NAME", &insert_);
-    if (status != 0) {
+    // Create prepared statements
+    insert_series_ = prepare("INSERT INTO akumuli_series (series_id, keyslist, storage_id) VALUES (?, ?, ?);");
+    upsert_rescue_point_ = prepare(
+        "INSERT OR REPLACE INTO akumuli_rescue_points (storage_id, addr0, addr1, addr2, addr3, addr4, addr5, addr6, addr7) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);");
+    upsert_volume_ = prepare(
+        "INSERT OR REPLACE INTO akumuli_volumes (id, path, version, nblocks, capacity, generation) "
+        "VALUES (?, ?, ?, ?, ?, ?);");
+    upsert_retention_ = prepare("INSERT OR REPLACE INTO akumuli_retention (metric, duration) VALUES (?, ?);");
+    upsert_config_ = prepare("INSERT OR REPLACE INTO akumuli_configuration (name, value, comment) VALUES (?, ?, '');");
+    delete_config_ = prepare("DELETE FROM akumuli_configuration WHERE name = ?;");
+    insert_tombstone_ = prepare("INSERT OR IGNORE INTO akumuli_tombstones (series_id) VALUES (?);");
+    delete_series_ = prepare("DELETE FROM akumuli_series WHERE storage_id = ?;");
+    delete_rescue_point_ = prepare("DELETE FROM akumuli_rescue_points WHERE storage_id = ?;");
+}
+
+MetadataStorage::PreparedT MetadataStorage::prepare(const char* query) {
+    sqlite3_stmt* stmt = nullptr;
+    auto status = sqlite3_prepare_v2(sqlite_, query, -1, &stmt, nullptr);
+    if (status != SQLITE_OK) {
         Logger::msg(AKU_LOG_ERROR, "Error creating prepared statement");
-        AKU_PANIC(apr_dbd_error(driver_, handle_.get(), status));
+        AKU_PANIC(sqlite3_errmsg(sqlite_));
+    }
+    return PreparedT(stmt);
+}
+
+void MetadataStorage::execute_prepared(sqlite3_stmt* stmt) {
+    auto status = sqlite3_step(stmt);
+    if (status != SQLITE_DONE) {
+        Logger::msg(AKU_LOG_ERROR, "Error executing prepared statement");
+        AKU_PANIC(sqlite3_errmsg(sqlite_));
     }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
 }
 
-void MetadataStorage::sync_with_metadata_storage(std::function<void(std::vector<SeriesT>*)> pull_new_names) {
+void MetadataStorage::sync_with_metadata_storage(std::function<void(std::vector<SeriesT>*)> pull_new_names,
+                                                 size_t max_rescue_points)
+{
     // Make temporary copies under the lock
     std::vector<PlainSeriesMatcher::SeriesNameT>           newnames;
     std::unordered_map<aku_ParamId, std::vector<u64>> rescue_points;
     std::unordered_map<u32, VolumeDesc>               volume_records;
+    std::unordered_map<std::string, u64>              retention;
+    std::unordered_map<std::string, std::string>      config;
+    std::vector<aku_ParamId>                          tombstones;
     {
         std::lock_guard<std::mutex> guard(sync_lock_);
-        std::swap(rescue_points, pending_rescue_points_);
+        if (max_rescue_points == 0 || pending_rescue_points_.size() <= max_rescue_points) {
+            std::swap(rescue_points, pending_rescue_points_);
+        } else {
+            // Leftovers will be picked up by the next sync
+            auto it = pending_rescue_points_.begin();
+            while (rescue_points.size() < max_rescue_points) {
+                rescue_points.insert(std::move(*it));
+                it = pending_rescue_points_.erase(it);
+            }
+        }
         std::swap(volume_records, pending_volumes_);
+        std::swap(retention, pending_retention_);
+        std::swap(config, pending_config_);
+        std::swap(tombstones, pending_tombstones_);
     }
     pull_new_names(&newnames);
 
+    std::lock_guard<std::mutex> guard(db_lock_);
+
     // Save new names
     begin_transaction();
     insert_new_names(std::move(newnames));
 
-    // Save rescue points
-    upsert_rescue_points(std::move(rescue_points));
+    // Save rescue points (the log is written after the transaction, names and
+    // configuration should be durable before the rescue points)
+    if (!rplog_) {
+        upsert_rescue_points(std::move(rescue_points));
+    }
 
     // Save volume records
     upsert_volume_records(std::move(volume_records));
 
+    // Save retention settings
+    upsert_retention(std::move(retention));
+
+    // Save configuration parameters
+    upsert_config(std::move(config));
+
+    // Save tombstones (after the names, deleted series can be added by the same sync)
+    insert_tombstones(std::move(tombstones));
+
     end_transaction();
+
+    if (rplog_) {
+        auto status = rplog_->append(rescue_points);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't write rescue points to the log, " + StatusUtil::str(status));
+            // Older records from the log shouldn't overwrite these rescue points
+            compact_rescue_point_log();
+            begin_transaction();
+            upsert_rescue_points(std::move(rescue_points));
+            end_transaction();
+        } else if (rplog_->size() > RPLOG_MAX_SIZE) {
+            compact_rescue_point_log();
+        }
+    }
 }
 
 void MetadataStorage::force_sync() {
     sync_cvar_.notify_one();
 }
 
+void MetadataStorage::set_read_only() {
+    select_query("PRAGMA query_only=ON;");
+}
+
+aku_Status MetadataStorage::export_metadata(std::string const& path, u64 since_id, u64* until_id) {
+    std::lock_guard<std::mutex> guard(db_lock_);
+    // Rescue points from the log should be in the database
+    compact_rescue_point_log();
+
+    auto exec = [this](std::string const& query) {
+        char* errmsg = nullptr;
+        auto status = sqlite3_exec(sqlite_, query.c_str(), nullptr, nullptr, &errmsg);
+        if (status != SQLITE_OK) {
+            Logger::msg(AKU_LOG_ERROR, "Can't export metadata, error: " + std::string(errmsg ? errmsg : "unknown"));
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    };
+
+    auto attach = prepare("ATTACH DATABASE ? AS backup;");
+    sqlite3_bind_text(attach.get(), 1, path.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(attach.get()) != SQLITE_DONE) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + path + ", error: " + sqlite3_errmsg(sqlite_));
+        return AKU_EGENERAL;
+    }
+    attach.reset();
+
+    u64 maxid = since_id;
+    auto max_callback = [](void* arg, int ncol, char** values, char**) {
+        if (ncol == 1 && values[0] != nullptr) {
+            auto maxid = static_cast<u64*>(arg);
+            *maxid = std::max(*maxid, static_cast<u64>(std::strtoull(values[0], nullptr, 10)));
+        }
+        return 0;
+    };
+    auto since = std::to_string(since_id);
+    bool success = exec("BEGIN TRANSACTION;")
+        && exec("CREATE TABLE backup.akumuli_volumes AS SELECT * FROM main.akumuli_volumes;")
+        && exec("CREATE TABLE backup.akumuli_configuration AS SELECT * FROM main.akumuli_configuration;")
+        && exec("CREATE TABLE backup.akumuli_series AS SELECT * FROM main.akumuli_series "
+                "WHERE storage_id > " + since + ";")
+        && exec("CREATE TABLE backup.akumuli_rescue_points AS SELECT * FROM main.akumuli_rescue_points;")
+        && exec("CREATE TABLE backup.akumuli_retention AS SELECT * FROM main.akumuli_retention;")
+        && exec("CREATE TABLE backup.akumuli_tombstones AS SELECT * FROM main.akumuli_tombstones;")
+        && sqlite3_exec(sqlite_, "SELECT max(storage_id) FROM main.akumuli_series;",
+                        max_callback, &maxid, nullptr) == SQLITE_OK
+        && exec("END TRANSACTION;");
+    if (!success) {
+        exec("ROLLBACK;");
+    }
+    exec("DETACH DATABASE backup;");
+    if (!success) {
+        return AKU_EGENERAL;
+    }
+    *until_id = maxid;
+    return AKU_SUCCESS;
+}
+
 int MetadataStorage::execute_query(std::string query) {
     int nrows = -1;
     int status = apr_dbd_query(driver_, handle_.get(), &nrows, query.c_str());
@@ -180,11 +323,27 @@ void MetadataStorage::create_tables() {
             "addr7 INTEGER"
             ");";
     execute_query(query);
+
+    // Create retention table (metric name - retention period)
+    query =
+            "CREATE TABLE IF NOT EXISTS akumuli_retention("
+            "metric TEXT PRIMARY KEY UNIQUE,"
+            "duration INTEGER"
+            ");";
+    execute_query(query);
+
+    // Create tombstones table (ids of the deleted series)
+    query =
+            "CREATE TABLE IF NOT EXISTS akumuli_tombstones("
+            "series_id INTEGER PRIMARY KEY UNIQUE"
+            ");";
+    execute_query(query);
 }
 
 void MetadataStorage::init_config(const char* db_name,
                                   const char* creation_datetime,
-                                  const char* bstore_type)
+                                  const char* bstore_type,
+                                  u16 nbtree_fanout)
 {
     // Create table and insert data into it
 
@@ -195,6 +354,7 @@ void MetadataStorage::init_config(const char* db_name,
           #ifdef AKU_VERSION
            << "('storage_version', '" << AKU_VERSION << "', " << "'Akumuli version used to create the database.'),"
           #endif
+           << "('nbtree_fanout', '" << nbtree_fanout << "', " << "'Fanout of the NB+tree nodes.'),"
            << "('db_name', '" << db_name << "', " << "'Name of DB instance.');"
            << std::endl;
     std::string insert_query = insert.str();
@@ -356,16 +516,34 @@ static bool split_series(const char* str, int n, LightweightString* outname, Lig
 
 aku_Status MetadataStorage::wait_for_sync_request(int timeout_us) {
     std::unique_lock<std::mutex> lock(sync_lock_);
+    if (!pending_rescue_points_.empty() || !pending_volumes_.empty() || !pending_retention_.empty()
+        || !pending_config_.empty() || !pending_tombstones_.empty())
+    {
+        // Previous sync was partial or notification was sent while sync was in progress
+        return AKU_SUCCESS;
+    }
     auto res = sync_cvar_.wait_for(lock, std::chrono::microseconds(timeout_us));
     if (res == std::cv_status::timeout) {
         return AKU_ETIMEOUT;
     }
-    return (pending_rescue_points_.empty() && pending_volumes_.empty()) ? AKU_ERETRY : AKU_SUCCESS;
+    return (pending_rescue_points_.empty() && pending_volumes_.empty() && pending_retention_.empty()
+            && pending_config_.empty() && pending_tombstones_.empty()) ? AKU_ERETRY : AKU_SUCCESS;
 }
 
 void MetadataStorage::add_rescue_point(aku_ParamId id, std::vector<u64>&& val) {
     std::lock_guard<std::mutex> guard(sync_lock_);
-    pending_rescue_points_[id] = val;
+    pending_rescue_points_[id] = std::move(val);
+    sync_cvar_.notify_one();
+}
+
+void MetadataStorage::add_rescue_points(std::unordered_map<aku_ParamId, std::vector<u64>>&& vals) {
+    if (vals.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(sync_lock_);
+    for (auto& kv: vals) {
+        pending_rescue_points_[kv.first] = std::move(kv.second);
+    }
     sync_cvar_.notify_one();
 }
 
@@ -375,6 +553,57 @@ void MetadataStorage::update_volume(const VolumeDesc& vol) {
     sync_cvar_.notify_one();
 }
 
+void MetadataStorage::set_retention(std::string const& metric, u64 duration) {
+    std::lock_guard<std::mutex> guard(sync_lock_);
+    pending_retention_[metric] = duration;
+    sync_cvar_.notify_one();
+}
+
+void MetadataStorage::set_config_param(std::string const& name, std::string const& value) {
+    std::lock_guard<std::mutex> guard(sync_lock_);
+    pending_config_[name] = value;
+    sync_cvar_.notify_one();
+}
+
+void MetadataStorage::add_tombstones(std::vector<aku_ParamId> const& ids) {
+    if (ids.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(sync_lock_);
+    pending_tombstones_.insert(pending_tombstones_.end(), ids.begin(), ids.end());
+    sync_cvar_.notify_one();
+}
+
+void MetadataStorage::remove_series(std::vector<aku_ParamId> const& ids) {
+    if (ids.empty()) {
+        return;
+    }
+    {
+        // Rescue points of the removed columns can still be pending
+        std::lock_guard<std::mutex> guard(sync_lock_);
+        for (auto id: ids) {
+            pending_rescue_points_.erase(id);
+        }
+    }
+    std::lock_guard<std::mutex> guard(db_lock_);
+    if (rplog_) {
+        // Written first, otherwise the replay can restore the removed columns
+        auto status = rplog_->remove(ids);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't write removed columns to the log, " + StatusUtil::str(status));
+            compact_rescue_point_log();
+        }
+    }
+    begin_transaction();
+    for (auto id: ids) {
+        sqlite3_bind_int64(delete_series_.get(), 1, static_cast<sqlite3_int64>(id));
+        execute_prepared(delete_series_.get());
+        sqlite3_bind_int64(delete_rescue_point_.get(), 1, static_cast<sqlite3_int64>(id));
+        execute_prepared(delete_rescue_point_.get());
+    }
+    end_transaction();
+}
+
 std::string MetadataStorage::get_dbname() {
     std::string dbname;
     bool success = get_config_param("db_name", &dbname);
@@ -392,120 +621,82 @@ void MetadataStorage::end_transaction() {
     execute_query("END TRANSACTION;");}
 
 void MetadataStorage::upsert_volume_records(std::unordered_map<u32, VolumeDesc>&& input) {
-    if (input.empty()) {
-        return;
+    auto stmt = upsert_volume_.get();
+    for (auto const& kv: input) {
+        auto const& vol = kv.second;
+        sqlite3_bind_int64(stmt, 1, vol.id);
+        sqlite3_bind_text(stmt, 2, vol.path.data(), static_cast<int>(vol.path.size()), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, vol.version);
+        sqlite3_bind_int64(stmt, 4, vol.nblocks);
+        sqlite3_bind_int64(stmt, 5, vol.capacity);
+        sqlite3_bind_int64(stmt, 6, vol.generation);
+        execute_prepared(stmt);
     }
-    std::stringstream query;
-    std::vector<VolumeDesc> items;
-    for (const auto& kv: input) {
-        items.push_back(kv.second);
-    }
-    while(!items.empty()) {
-        const size_t batchsize = 500;  // This limit is defined by SQLITE_MAX_COMPOUND_SELECT
-        const size_t newsize = items.size() > batchsize ? items.size() - batchsize : 0;
-        std::vector<VolumeDesc> batch(items.begin() + static_cast<ssize_t>(newsize), items.end());
-        items.resize(newsize);
-        query << "INSERT OR REPLACE INTO akumuli_volumes (id, path, version, nblocks, capacity, generation) VALUES ";
-        size_t ix = 0;
-        for (auto const& vol: batch) {
-            query << "(" << std::to_string(vol.id)         << ", '"
-                         << vol.path                       << "', "
-                         << std::to_string(vol.version)    << ", "
-                         << std::to_string(vol.nblocks)    << ", "
-                         << std::to_string(vol.capacity)   << ", "
-                         << std::to_string(vol.generation) << ")";
-            ix++;
-            if (ix == batch.size()) {
-                query << ";\n";
-            } else {
-                query << ",";
-            }
+}
+
+void MetadataStorage::upsert_retention(std::unordered_map<std::string, u64>&& input) {
+    auto stmt = upsert_retention_.get();
+    for (auto const& kv: input) {
+        sqlite3_bind_text(stmt, 1, kv.first.data(), static_cast<int>(kv.first.size()), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(kv.second));
+        execute_prepared(stmt);
+    }
+}
+
+void MetadataStorage::upsert_config(std::unordered_map<std::string, std::string>&& input) {
+    for (auto const& kv: input) {
+        auto stmt = kv.second.empty() ? delete_config_.get() : upsert_config_.get();
+        sqlite3_bind_text(stmt, 1, kv.first.data(), static_cast<int>(kv.first.size()), SQLITE_STATIC);
+        if (!kv.second.empty()) {
+            sqlite3_bind_text(stmt, 2, kv.second.data(), static_cast<int>(kv.second.size()), SQLITE_STATIC);
         }
+        execute_prepared(stmt);
     }
-    execute_query(query.str());
 }
 
-void MetadataStorage::upsert_rescue_points(std::unordered_map<aku_ParamId, std::vector<u64>>&& input) {
-    if (input.empty()) {
-        return;
+void MetadataStorage::insert_tombstones(std::vector<aku_ParamId>&& ids) {
+    auto stmt = insert_tombstone_.get();
+    for (auto id: ids) {
+        sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(id));
+        execute_prepared(stmt);
     }
-    std::stringstream query;
-    typedef std::pair<aku_ParamId, std::vector<u64>> ValueT;
-    std::vector<ValueT> items(input.begin(), input.end());
-    while(!items.empty()) {
-        const size_t batchsize = 500;  // This limit is defined by SQLITE_MAX_COMPOUND_SELECT
-        const size_t newsize = items.size() > batchsize ? items.size() - batchsize : 0;
-        std::vector<ValueT> batch(items.begin() + static_cast<ssize_t>(newsize), items.end());
-        items.resize(newsize);
-        query <<
-            "INSERT OR REPLACE INTO akumuli_rescue_points (storage_id, addr0, addr1, addr2, addr3, addr4, addr5, addr6, addr7) VALUES ";
-        size_t ix = 0;
-        for (auto const& kv: batch) {
-            query << "( " << kv.first;
-            for (auto id: kv.second) {
-                if (id == ~0ull) {
-                    // Values that big can't be represented in SQLite, -1 value should be interpreted as EMPTY_ADDR,
-                    query << ", -1";
-                } else {
-                    query << ", " << id;
-                }
-            }
-            for(auto i = kv.second.size(); i < 8; i++) {
-                query << ", null";
-            }
-            query << ")";
-            ix++;
-            if (ix == batch.size()) {
-                query << ";\n";
-            } else {
-                query << ",";
+}
+
+void MetadataStorage::upsert_rescue_points(std::unordered_map<aku_ParamId, std::vector<u64>>&& input) {
+    auto stmt = upsert_rescue_point_.get();
+    for (auto const& kv: input) {
+        sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(kv.first));
+        int col = 2;
+        for (auto id: kv.second) {
+            if (col > 9) {
+                AKU_PANIC("Too many rescue points, id = " + std::to_string(kv.first));
             }
+            // Values that big can't be represented in SQLite, -1 value should be interpreted as EMPTY_ADDR,
+            sqlite3_bind_int64(stmt, col++, id == ~0ull ? -1 : static_cast<sqlite3_int64>(id));
         }
+        // Unbound parameters are null
+        execute_prepared(stmt);
     }
-    execute_query(query.str());
-
 }
 
 void MetadataStorage::insert_new_names(std::vector<SeriesT> &&items) {
-    if (items.size() == 0) {
-        return;
-    }
-    // Write all data
-    std::stringstream query;
-    while(!items.empty()) {
-        const size_t batchsize = 500; // This limit is defined by SQLITE_MAX_COMPOUND_SELECT
-        const size_t newsize = items.size() > batchsize ? items.size() - batchsize : 0;
-        std::vector<MetadataStorage::SeriesT> batch(items.begin() + static_cast<ssize_t>(newsize), items.end());
-        items.resize(newsize);
-        query << "INSERT INTO akumuli_series (series_id, keyslist, storage_id)" << std::endl;
-        bool first = true;
-        for (auto item: batch) {
-            LightweightString name, keys;
-            auto stid = std::get<2>(item);
-            if (split_series(std::get<0>(item), std::get<1>(item), &name, &keys)) {
-                if (first) {
-                    query << "\tSELECT '" << name << "' as series_id, '"
-                                          << keys << "' as keyslist, "
-                                          << stid << "  as storage_id"
-                                          << std::endl;
-                    first = false;
-                } else {
-                    query << "\tUNION "
-                          <<   "SELECT '" << name << "', '"
-                                          << keys << "', "
-                                          << stid
-                                          << std::endl;
-                }
-            }
+    auto stmt = insert_series_.get();
+    for (auto const& item: items) {
+        LightweightString name, keys;
+        auto stid = std::get<2>(item);
+        if (split_series(std::get<0>(item), std::get<1>(item), &name, &keys)) {
+            sqlite3_bind_text(stmt, 1, name.str, name.len, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, keys.str, keys.len, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(stid));
+            execute_prepared(stmt);
         }
-        query << ";\n";
     }
-    std::string full_query = query.str();
-    execute_query(full_query);
 }
 
 boost::optional<u64> MetadataStorage::get_prev_largest_id() {
-    auto query = "SELECT max(storage_id) FROM akumuli_series;";
+    // Ids of the deleted series can't be reused
+    auto query = "SELECT max(id) FROM (SELECT max(storage_id) AS id FROM akumuli_series "
+                 "UNION ALL SELECT max(series_id) FROM akumuli_tombstones);";
     try {
         auto results = select_query(query);
         auto row = results.at(0);
@@ -524,17 +715,42 @@ boost::optional<u64> MetadataStorage::get_prev_largest_id() {
     }
 }
 
-aku_Status MetadataStorage::load_matcher_data(SeriesMatcherBase& matcher) {
-    auto query = "SELECT series_id || ' ' || keyslist, storage_id FROM akumuli_series;";
+aku_Status MetadataStorage::load_matcher_data(SeriesMatcherBase& matcher, u64 min_id) {
+    std::string query = "SELECT series_id || ' ' || keyslist, storage_id FROM akumuli_series "
+                        "WHERE storage_id > " + std::to_string(min_id) + ";";
+    try {
+        auto results = select_query(query.c_str());
+        std::vector<std::pair<std::string, u64>> items;
+        items.reserve(results.size());
+        for(auto& row: results) {
+            if (row.size() != 2) {
+                continue;
+            }
+            auto id = boost::lexical_cast<u64>(row.at(1));
+            items.push_back(std::make_pair(std::move(row.at(0)), id));
+        }
+        results = std::vector<UntypedTuple>();
+        // Names are parsed and indexed in parallel
+        matcher._add_batch(items);
+    } catch(...) {
+        Logger::msg(AKU_LOG_ERROR, boost::current_exception_diagnostic_information().c_str());
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status MetadataStorage::load_retention(std::unordered_map<std::string, u64>* mapping) {
+    auto query = "SELECT metric, duration FROM akumuli_retention;";
     try {
         auto results = select_query(query);
         for(auto row: results) {
             if (row.size() != 2) {
                 continue;
             }
-            auto series = row.at(0);
-            auto id = boost::lexical_cast<u64>(row.at(1));
-            matcher._add(series, id);
+            auto duration = boost::lexical_cast<u64>(row.at(1));
+            if (duration != 0) {
+                (*mapping)[row.at(0)] = duration;
+            }
         }
     } catch(...) {
         Logger::msg(AKU_LOG_ERROR, boost::current_exception_diagnostic_information().c_str());
@@ -543,6 +759,80 @@ aku_Status MetadataStorage::load_matcher_data(SeriesMatcherBase& matcher) {
     return AKU_SUCCESS;
 }
 
+aku_Status MetadataStorage::load_tombstones(std::vector<aku_ParamId>* ids) {
+    auto query = "SELECT series_id FROM akumuli_tombstones;";
+    try {
+        auto results = select_query(query);
+        for(auto row: results) {
+            if (row.size() != 1) {
+                continue;
+            }
+            ids->push_back(boost::lexical_cast<u64>(row.at(0)));
+        }
+    } catch(...) {
+        Logger::msg(AKU_LOG_ERROR, boost::current_exception_diagnostic_information().c_str());
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status MetadataStorage::load_config_params(std::string const& prefix,
+                                               std::unordered_map<std::string, std::string>* mapping)
+{
+    auto query = "SELECT name, value FROM akumuli_configuration;";
+    try {
+        auto results = select_query(query);
+        for(auto row: results) {
+            if (row.size() != 2) {
+                continue;
+            }
+            auto const& name = row.at(0);
+            if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0) {
+                (*mapping)[name.substr(prefix.size())] = row.at(1);
+            }
+        }
+    } catch(...) {
+        Logger::msg(AKU_LOG_ERROR, boost::current_exception_diagnostic_information().c_str());
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status MetadataStorage::open_rescue_point_log(std::string const& path) {
+    std::unique_ptr<StorageEngine::RescuePointLog> log(new StorageEngine::RescuePointLog(path));
+    auto status = log->open();
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't open rescue point log, " + StatusUtil::str(status));
+        return status;
+    }
+    rplog_ = std::move(log);
+    compact_rescue_point_log();
+    return AKU_SUCCESS;
+}
+
+void MetadataStorage::compact_rescue_point_log() {
+    if (!rplog_) {
+        return;
+    }
+    StorageEngine::RescuePointLog::MappingT updates;
+    StorageEngine::RescuePointLog::IdSetT removed;
+    rplog_->take_entries(&updates, &removed);
+    if (!updates.empty() || !removed.empty()) {
+        begin_transaction();
+        for (auto id: removed) {
+            sqlite3_bind_int64(delete_rescue_point_.get(), 1, static_cast<sqlite3_int64>(id));
+            execute_prepared(delete_rescue_point_.get());
+        }
+        upsert_rescue_points(std::move(updates));
+        end_transaction();
+    }
+    auto status = rplog_->reset();
+    if (status != AKU_SUCCESS) {
+        // Stale records can't be left in the log, they will be replayed on startup
+        AKU_PANIC("Can't truncate rescue point log, " + StatusUtil::str(status));
+    }
+}
+
 aku_Status MetadataStorage::load_rescue_points(std::unordered_map<u64, std::vector<u64>>& mapping) {
     auto query =
         "SELECT storage_id, addr0, addr1, addr2, addr3,"
@@ -27,8 +27,12 @@
 
 #include "akumuli_def.h"
 #include "index/seriesparser.h"
+#include "storage_engine/rescue_point_log.h"
 #include "volumeregistry.h"
 
+struct sqlite3;
+struct sqlite3_stmt;
+
 namespace Akumuli {
 
 //! Delete apr pool
@@ -41,6 +45,11 @@ struct AprHandleDeleter {
     void operator()(apr_dbd_t* handle);
 };
 
+//! Sqlite prepared statement deleter
+struct SqliteStmtDeleter {
+    void operator()(sqlite3_stmt* stmt);
+};
+
 
 /** Sqlite3 backed storage for metadata.
   * Metadata includes:
@@ -53,20 +62,43 @@ struct MetadataStorage : VolumeRegistry {
     typedef std::unique_ptr<apr_pool_t, decltype(&delete_apr_pool)> PoolT;
     typedef const apr_dbd_driver_t* DriverT;
     typedef std::unique_ptr<apr_dbd_t, AprHandleDeleter> HandleT;
-    typedef apr_dbd_prepared_t* PreparedT;
+    typedef std::unique_ptr<sqlite3_stmt, SqliteStmtDeleter> PreparedT;
     typedef PlainSeriesMatcher::SeriesNameT SeriesT;
 
     // Members
     PoolT           pool_;
     DriverT         driver_;
     HandleT         handle_;
-    PreparedT       insert_;
+    //! Native sqlite handle (owned by `handle_`)
+    sqlite3*        sqlite_;
+    // Prepared statements (should be destroyed before `handle_`)
+    PreparedT       insert_series_;
+    PreparedT       upsert_rescue_point_;
+    PreparedT       upsert_volume_;
+    PreparedT       upsert_retention_;
+    PreparedT       upsert_config_;
+    PreparedT       delete_config_;
+    PreparedT       insert_tombstone_;
+    PreparedT       delete_series_;
+    PreparedT       delete_rescue_point_;
+    //! Log of the rescue point updates (optional, rescue points are written to sqlite if not set)
+    std::unique_ptr<StorageEngine::RescuePointLog> rplog_;
+
+    //! Log is compacted when its size exceeds this value
+    static const u64 RPLOG_MAX_SIZE = 0x1000000;
 
     // Synchronization
+    //! Serializes transactions of the sync, series removal and backups
+    std::mutex                                        db_lock_;
     mutable std::mutex                                sync_lock_;
     std::condition_variable                           sync_cvar_;
     std::unordered_map<aku_ParamId, std::vector<u64>> pending_rescue_points_;
     std::unordered_map<u32, VolumeDesc>               pending_volumes_;
+    std::unordered_map<std::string, u64>              pending_retention_;
+    //! Configuration parameters (empty value - parameter should be removed)
+    std::unordered_map<std::string, std::string>      pending_config_;
+    //! Ids of the deleted series
+    std::vector<aku_ParamId>                          pending_tombstones_;
 
     /** Create new or open existing db.
       * @throw std::runtime_error in a case of error
@@ -86,9 +118,14 @@ struct MetadataStorage : VolumeRegistry {
       */
     void init_volumes(std::vector<VolumeDesc> volumes);
 
+    /** Initialize configuration table
+      * @param nbtree_fanout is a fanout of the column trees
+      * @throw std::runtime_error in a case of error
+      */
     void init_config(const char* db_name,
                      const char* creation_datetime,
-                     const char* bstore_type);
+                     const char* bstore_type,
+                     u16 nbtree_fanout);
 
     // Retreival //
 
@@ -111,42 +148,119 @@ struct MetadataStorage : VolumeRegistry {
      */
     bool get_config_param(const std::string param_name, std::string* value);
 
-    /** Read larges series id */
+    /** Load configuration parameters with names that start with `prefix`.
+      * @param prefix is a name prefix
+      * @param mapping receives parameters (prefix is removed from the names)
+      */
+    aku_Status load_config_params(std::string const& prefix, std::unordered_map<std::string, std::string>* mapping);
+
+    /**
+     * @brief Set configuration parameter asynchronously
+     * @param name is a parameter name
+     * @param value is a parameter value (empty string - remove the parameter)
+     */
+    void set_config_param(std::string const& name, std::string const& value);
+
+    /** Read larges series id (ids of the deleted series are taken into account) */
     boost::optional<u64> get_prev_largest_id();
 
-    aku_Status load_matcher_data(SeriesMatcherBase &matcher);
+    /** Load series names into the series matcher
+      * @param matcher is a series matcher that should be updated
+      * @param min_id only names with larger ids will be loaded
+      */
+    aku_Status load_matcher_data(SeriesMatcherBase &matcher, u64 min_id = 0);
 
     aku_Status load_rescue_points(std::unordered_map<u64, std::vector<u64>>& mapping);
 
+    /** Open the log of the rescue point updates. Records left by the previous run are
+      * saved to the database, so this method should be called before `load_rescue_points`.
+      * Rescue points are written to the log by the sync after that.
+      * @param path is a path to the log file
+      */
+    aku_Status open_rescue_point_log(std::string const& path);
+
+    //! Save latest rescue points from the log to the database and truncate the log
+    void compact_rescue_point_log();
+
+    //! Load retention settings (metric name to duration mapping)
+    aku_Status load_retention(std::unordered_map<std::string, u64>* mapping);
+
+    //! Load ids of all deleted series
+    aku_Status load_tombstones(std::vector<aku_ParamId>* ids);
+
     // Synchronization
 
     void add_rescue_point(aku_ParamId id, std::vector<u64>&& val);
 
+    //! Add rescue points of several columns at once (lock is acquired only once)
+    void add_rescue_points(std::unordered_map<aku_ParamId, std::vector<u64>>&& vals);
+
     /**
      * @brief Add/update volume metadata asynchronously
      * @param vol is a volume description
      */
     virtual void update_volume(const VolumeDesc& vol);
+
+    /**
+     * @brief Set retention of the metric asynchronously
+     * @param metric is a metric name
+     * @param duration is a retention period (0 - disable retention)
+     */
+    void set_retention(std::string const& metric, u64 duration);
+
+    /**
+     * @brief Mark series as deleted asynchronously
+     * Tombstones are never removed, they are used to skip deleted series on
+     * startup and to prevent reuse of their ids.
+     * @param ids is a list of series ids
+     */
+    void add_tombstones(std::vector<aku_ParamId> const& ids);
+
+    /**
+     * @brief Remove names and rescue points of the deleted series synchroniously
+     * Should be called after the tombstones were written by the sync.
+     * @param ids is a list of series ids
+     */
+    void remove_series(std::vector<aku_ParamId> const& ids);
     virtual std::string get_dbname();
 
     aku_Status wait_for_sync_request(int timeout_us);
 
-    void sync_with_metadata_storage(std::function<void(std::vector<SeriesT>*)> pull_new_names);
+    /** Write pending changes to the database in one transaction.
+      * @param pull_new_names should return names added since the last sync
+      * @param max_rescue_points is a max number of rescue points to write (0 - no limit),
+      *        the rest will be written by the next calls
+      */
+    void sync_with_metadata_storage(std::function<void(std::vector<SeriesT>*)> pull_new_names,
+                                    size_t max_rescue_points = 0);
 
     //! Forces `wait_for_sync_request` to return immediately
     void force_sync();
 
+    //! Reject all changes of the database file (used by the read-only storage)
+    void set_read_only();
+
+    /** Copy the metadata to the new database file for the backup. Only names of
+      * the series with ids larger than `since_id` are copied, other tables (volumes,
+      * configuration, rescue points, retention and tombstones) are copied entirely.
+      * Changes that wasn't synced yet are not included.
+      * @param path is a path to the new database file (it shouldn't exist)
+      * @param since_id is a largest series id copied by the previous backup
+      * @param until_id receives largest series id copied by this backup
+      */
+    aku_Status export_metadata(std::string const& path, u64 since_id, u64* until_id);
+
     // should be private:
 
     void begin_transaction();
 
     void end_transaction();
 
-    /** Add new series to the metadata storage (generate sql query and execute it).
+    /** Add new series to the metadata storage (using prepared statement).
       */
     void insert_new_names(std::vector<SeriesT>&& items);
 
-    /** Insert or update rescue provided points (generate sql query and execute it).
+    /** Insert or update rescue provided points (using prepared statement).
       */
     void upsert_rescue_points(std::unordered_map<aku_ParamId, std::vector<u64> > &&input);
 
@@ -158,8 +272,26 @@ struct MetadataStorage : VolumeRegistry {
      */
     void upsert_volume_records(std::unordered_map<u32, VolumeDesc>&& input);
 
+    /** Insert or update retention settings (using prepared statement).
+      */
+    void upsert_retention(std::unordered_map<std::string, u64>&& input);
+
+    /** Insert, update or delete configuration parameters (using prepared statements).
+      */
+    void upsert_config(std::unordered_map<std::string, std::string>&& input);
+
+    /** Insert tombstones of the deleted series (using prepared statement).
+      */
+    void insert_tombstones(std::vector<aku_ParamId>&& ids);
+
 private:
 
+    //! Create prepared statement
+    PreparedT prepare(const char* query);
+
+    //! Execute prepared statement and reset it
+    void execute_prepared(sqlite3_stmt* stmt);
+
     /** Execute query that doesn't return anything.
       * @throw std::runtime_error in a case of error
       * @return number of rows changed
@@ -0,0 +1,305 @@
+#include "metrics.h"
+
+#include <limits>
+#include <sstream>
+
+namespace Akumuli {
+
+static std::atomic<u32> g_next_stripe = {0};
+
+//! Pick stripe for the current thread (round-robin on the first use)
+static u32 get_stripe_index() {
+    static thread_local u32 index = g_next_stripe.fetch_add(1, std::memory_order_relaxed);
+    return index % LatencyHistogram::NSTRIPES;
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto& stripe: stripes_) {
+        for (auto& bucket: stripe.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        stripe.sum.store(0, std::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::get_bucket(u64 nanoseconds) {
+    u64 us = nanoseconds / 1000;
+    if (us == 0) {
+        return 0;
+    }
+    int ix = 64 - __builtin_clzll(us);
+    return ix < NBUCKETS - 1 ? ix : NBUCKETS - 1;
+}
+
+double LatencyHistogram::get_upper_bound(int ix) {
+    if (ix >= NBUCKETS - 1) {
+        return std::numeric_limits<double>::infinity();
+    }
+    return static_cast<double>(1ull << ix) / 1000000.0;
+}
+
+void LatencyHistogram::add(u64 nanoseconds) {
+    auto& stripe = stripes_[get_stripe_index()];
+    stripe.buckets[static_cast<size_t>(get_bucket(nanoseconds))].fetch_add(1, std::memory_order_relaxed);
+    stripe.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::get_snapshot() const {
+    Snapshot result = {};
+    for (auto const& stripe: stripes_) {
+        for (size_t i = 0; i < NBUCKETS; i++) {
+            auto cnt = stripe.buckets[i].load(std::memory_order_relaxed);
+            result.buckets[i] += cnt;
+            result.count += cnt;
+        }
+        result.sum += stripe.sum.load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+ScopedLatency::ScopedLatency(LatencyHistogram& hist)
+    : hist_(hist)
+    , start_(std::chrono::steady_clock::now())
+{
+}
+
+ScopedLatency::~ScopedLatency() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    hist_.add(static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+}
+
+LatencyHistogram& Metrics::ingest() {
+    static LatencyHistogram hist;
+    return hist;
+}
+
+LatencyHistogram& Metrics::block_read() {
+    static LatencyHistogram hist;
+    return hist;
+}
+
+LatencyHistogram& Metrics::block_write() {
+    static LatencyHistogram hist;
+    return hist;
+}
+
+LatencyHistogram& Metrics::query_prepare() {
+    static LatencyHistogram hist;
+    return hist;
+}
+
+LatencyHistogram& Metrics::query_execute() {
+    static LatencyHistogram hist;
+    return hist;
+}
+
+void Metrics::format_histograms(std::ostream& out) {
+    format_histogram(out, "akumuli_ingest_latency_seconds",
+                     "Latency of the write calls", ingest());
+    format_histogram(out, "akumuli_block_read_latency_seconds",
+                     "Latency of the block reads that missed the cache", block_read());
+    format_histogram(out, "akumuli_block_write_latency_seconds",
+                     "Latency of the block appends", block_write());
+    format_histogram(out, "akumuli_query_prepare_latency_seconds",
+                     "Latency of the query parsing and planning", query_prepare());
+    format_histogram(out, "akumuli_query_latency_seconds",
+                     "Latency of the query execution", query_execute());
+}
+
+void Metrics::format_histogram(std::ostream& out, std::string const& name,
+                               std::string const& help, LatencyHistogram const& hist)
+{
+    auto snapshot = hist.get_snapshot();
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " histogram\n";
+    u64 cumulative = 0;
+    for (int i = 0; i < LatencyHistogram::NBUCKETS; i++) {
+        cumulative += snapshot.buckets[static_cast<size_t>(i)];
+        out << name << "_bucket{le=\"";
+        if (i == LatencyHistogram::NBUCKETS - 1) {
+            out << "+Inf";
+        } else {
+            out << LatencyHistogram::get_upper_bound(i);
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    out << name << "_sum " << (static_cast<double>(snapshot.sum) / 1000000000.0) << "\n";
+    out << name << "_count " << snapshot.count << "\n";
+}
+
+void Metrics::format_gauge(std::ostream& out, std::string const& name, std::string const& help, double value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " gauge\n";
+    out << name << " " << value << "\n";
+}
+
+void Metrics::format_counter(std::ostream& out, std::string const& name, std::string const& help, u64 value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " counter\n";
+    out << name << " " << value << "\n";
+}
+
+//! Escape label value (backslash, double-quote and line feed should be escaped)
+static std::string escape_label(std::string const& value) {
+    std::string result;
+    for (auto c: value) {
+        switch (c) {
+        case '\\':
+            result += "\\\\";
+            break;
+        case '"':
+            result += "\\\"";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        default:
+            result += c;
+        }
+    }
+    return result;
+}
+
+void Metrics::format_counter(std::ostream& out, std::string const& name, std::string const& help,
+                             std::string const& label, std::vector<std::pair<std::string, u64>> const& values)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " counter\n";
+    for (auto const& kv: values) {
+        out << name << "{" << label << "=\"" << escape_label(kv.first) << "\"} " << kv.second << "\n";
+    }
+}
+
+void Metrics::format_gauge(std::ostream& out, std::string const& name, std::string const& help,
+                           std::string const& label, std::vector<std::pair<std::string, u64>> const& values)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " gauge\n";
+    for (auto const& kv: values) {
+        out << name << "{" << label << "=\"" << escape_label(kv.first) << "\"} " << kv.second << "\n";
+    }
+}
+
+static QueryProfile*& current_profile() {
+    static thread_local QueryProfile* profile = nullptr;
+    return profile;
+}
+
+QueryProfile::QueryProfile()
+    : prepare_ns{0}
+    , plan_ns{0}
+    , exec_ns{0}
+    , blocks_read{0}
+    , bytes_read{0}
+    , cache_hits{0}
+    , leaves_decoded{0}
+    , subtrees_skipped{0}
+    , samples_in{0}
+    , samples_out{0}
+    , series_total{0}
+    , series_sampled{0}
+    , leaves_estimated{0}
+    , count_error{0}
+{
+}
+
+QueryProfile* QueryProfile::get_current() {
+    return current_profile();
+}
+
+QueryProfile* QueryProfile::swap_current(QueryProfile* profile) {
+    auto prev = current_profile();
+    current_profile() = profile;
+    return prev;
+}
+
+std::string QueryProfile::to_json() const {
+    std::stringstream out;
+    out << "{\"prepare_ns\": "      << prepare_ns.load()
+        << ", \"plan_ns\": "        << plan_ns.load()
+        << ", \"exec_ns\": "        << exec_ns.load()
+        << ", \"blocks_read\": "    << blocks_read.load()
+        << ", \"bytes_read\": "     << bytes_read.load()
+        << ", \"cache_hits\": "     << cache_hits.load()
+        << ", \"leaves_decoded\": " << leaves_decoded.load()
+        << ", \"subtrees_skipped\": " << subtrees_skipped.load()
+        << ", \"samples_in\": "     << samples_in.load()
+        << ", \"samples_out\": "    << samples_out.load();
+    if (series_total.load()) {
+        // Approximate query
+        out << ", \"series_total\": "       << series_total.load()
+            << ", \"series_sampled\": "     << series_sampled.load()
+            << ", \"leaves_estimated\": "   << leaves_estimated.load()
+            << ", \"count_error\": "        << count_error.load();
+    }
+    out << "}";
+    return out.str();
+}
+
+QueryProfile::Scope::Scope(QueryProfile* profile)
+    : prev_(current_profile())
+{
+    current_profile() = profile;
+}
+
+QueryProfile::Scope::~Scope() {
+    current_profile() = prev_;
+}
+
+
+static QueryCancellation*& current_cancellation() {
+    static thread_local QueryCancellation* state = nullptr;
+    return state;
+}
+
+static i64 steady_now_ns() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+QueryCancellation::QueryCancellation()
+    : cancelled{false}
+    , deadline_ns{0}
+{
+}
+
+void QueryCancellation::cancel() {
+    cancelled.store(true, std::memory_order_relaxed);
+}
+
+void QueryCancellation::set_timeout(u64 timeout_ns) {
+    deadline_ns.store(steady_now_ns() + static_cast<i64>(timeout_ns), std::memory_order_relaxed);
+}
+
+aku_Status QueryCancellation::status() const {
+    if (cancelled.load(std::memory_order_relaxed)) {
+        return AKU_ECLOSED;
+    }
+    auto deadline = deadline_ns.load(std::memory_order_relaxed);
+    if (deadline != 0 && steady_now_ns() > deadline) {
+        return AKU_ETIMEOUT;
+    }
+    return AKU_SUCCESS;
+}
+
+QueryCancellation* QueryCancellation::get_current() {
+    return current_cancellation();
+}
+
+QueryCancellation* QueryCancellation::swap_current(QueryCancellation* state) {
+    auto prev = current_cancellation();
+    current_cancellation() = state;
+    return prev;
+}
+
+QueryCancellation::Scope::Scope(QueryCancellation* state)
+    : prev_(current_cancellation())
+{
+    current_cancellation() = state;
+}
+
+QueryCancellation::Scope::~Scope() {
+    current_cancellation() = prev_;
+}
+
+}  // namespace
@@ -0,0 +1,226 @@
+/**
+ * PRIVATE HEADER
+ *
+ * Internal metrics (latency histograms) exposed in Prometheus text format
+ *
+ * Copyright (c) 2013 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+#include "akumuli_def.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Akumuli {
+
+/** Latency histogram with power of two buckets.
+  * Bucket `i` counts values below 2^i microseconds, the last bucket is unbounded.
+  * Histogram is updated on the hot path without locks. Every thread updates
+  * its own stripe and stripes are cache line aligned to avoid false sharing.
+  */
+class LatencyHistogram {
+public:
+    enum {
+        NBUCKETS = 26,  // 1us ... 16s, +Inf
+        NSTRIPES = 16,
+    };
+
+    struct Snapshot {
+        std::array<u64, NBUCKETS> buckets;  //< not cumulative
+        u64 count;
+        u64 sum;                            //< in nanoseconds
+    };
+
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<u64>, NBUCKETS> buckets;
+        std::atomic<u64> sum;
+    };
+    std::array<Stripe, NSTRIPES> stripes_;
+
+public:
+    LatencyHistogram();
+    LatencyHistogram(LatencyHistogram const&) = delete;
+    LatencyHistogram& operator = (LatencyHistogram const&) = delete;
+
+    //! Add value (in nanoseconds)
+    void add(u64 nanoseconds);
+
+    //! Combine all stripes (the result is not atomic but every value is counted once)
+    Snapshot get_snapshot() const;
+
+    //! Get upper bound of the bucket in seconds (last bucket doesn't have bound)
+    static double get_upper_bound(int ix);
+
+    //! Get bucket index for the value
+    static int get_bucket(u64 nanoseconds);
+};
+
+
+//! Adds time elapsed since construction to the histogram
+class ScopedLatency {
+    LatencyHistogram& hist_;
+    std::chrono::steady_clock::time_point start_;
+public:
+    ScopedLatency(LatencyHistogram& hist);
+    ~ScopedLatency();
+};
+
+
+//! Global metrics registry
+struct Metrics {
+    //! Sample ingestion (write and write_batch calls of the session)
+    static LatencyHistogram& ingest();
+
+    //! Block read (reads that miss the block cache)
+    static LatencyHistogram& block_read();
+
+    //! Block append
+    static LatencyHistogram& block_write();
+
+    //! Query parsing and planning
+    static LatencyHistogram& query_prepare();
+
+    //! Query execution (from parsing till the last value is sent to cursor)
+    static LatencyHistogram& query_execute();
+
+    //! Write all histograms in Prometheus text format
+    static void format_histograms(std::ostream& out);
+
+    //! Write histogram in Prometheus text format
+    static void format_histogram(std::ostream& out, std::string const& name,
+                                 std::string const& help, LatencyHistogram const& hist);
+
+    //! Write gauge in Prometheus text format
+    static void format_gauge(std::ostream& out, std::string const& name, std::string const& help, double value);
+
+    //! Write gauge with one label in Prometheus text format (one sample per label value)
+    static void format_gauge(std::ostream& out, std::string const& name, std::string const& help,
+                             std::string const& label, std::vector<std::pair<std::string, u64>> const& values);
+
+    //! Write counter in Prometheus text format
+    static void format_counter(std::ostream& out, std::string const& name, std::string const& help, u64 value);
+
+    //! Write counter with one label in Prometheus text format (one sample per label value)
+    static void format_counter(std::ostream& out, std::string const& name, std::string const& help,
+                               std::string const& label, std::vector<std::pair<std::string, u64>> const& values);
+};
+
+
+/** Execution profile of the single query.
+  * The profile is attached to the thread that executes the query (worker threads
+  * that take part in the execution should attach it too). Counters are updated
+  * using `QueryProfile::add`, it does nothing if profiling wasn't requested.
+  */
+struct QueryProfile {
+    std::atomic<u64> prepare_ns;        //< query parsing and series resolution
+    std::atomic<u64> plan_ns;           //< query plan build
+    std::atomic<u64> exec_ns;           //< query plan execution
+    std::atomic<u64> blocks_read;       //< number of block reads
+    std::atomic<u64> bytes_read;        //< number of bytes read from volumes (cache misses)
+    std::atomic<u64> cache_hits;        //< number of block cache hits
+    std::atomic<u64> leaves_decoded;    //< number of decompressed leaf nodes
+    std::atomic<u64> subtrees_skipped;  //< number of subtrees replaced by aggregates from the SubtreeRef
+    std::atomic<u64> samples_in;        //< number of samples passed to the processing topology
+    std::atomic<u64> samples_out;       //< number of samples sent to cursor
+    std::atomic<u64> series_total;      //< number of series matched by the approximate query
+    std::atomic<u64> series_sampled;    //< number of series used by the approximate query
+    std::atomic<u64> leaves_estimated;  //< number of leaf nodes that were partially in range and were estimated
+    std::atomic<u64> count_error;       //< upper bound of the absolute error of the estimated count
+
+    QueryProfile();
+
+    //! Get profile attached to the current thread (or nullptr)
+    static QueryProfile* get_current();
+
+    //! Attach the profile to the current thread and return previous one (used to switch fibers)
+    static QueryProfile* swap_current(QueryProfile* profile);
+
+    //! Add value to the counter of the current thread's profile
+    static void add(std::atomic<u64> QueryProfile::*counter, u64 value) {
+        auto profile = get_current();
+        if (profile) {
+            (profile->*counter).fetch_add(value, std::memory_order_relaxed);
+        }
+    }
+
+    //! Convert to JSON object
+    std::string to_json() const;
+
+    //! Attaches the profile to the current thread, previous profile is restored on destruction
+    class Scope {
+        QueryProfile* prev_;
+    public:
+        Scope(QueryProfile* profile);
+        ~Scope();
+        Scope(Scope const&) = delete;
+        Scope& operator = (Scope const&) = delete;
+    };
+};
+
+
+/** Cancellation state of the single query. The query is cancelled when the cursor
+  * is closed by the client or when the deadline expires. Attached to the threads
+  * that execute the query the same way as the QueryProfile, storage operators
+  * call `QueryCancellation::check` before they read the next node.
+  */
+struct QueryCancellation {
+    std::atomic<bool> cancelled;
+    //! Deadline (steady clock, nanoseconds), 0 - no deadline
+    std::atomic<i64>  deadline_ns;
+
+    QueryCancellation();
+
+    //! Cancel the query
+    void cancel();
+
+    //! Set deadline relative to the current time
+    void set_timeout(u64 timeout_ns);
+
+    //! Return AKU_ECLOSED if the query was cancelled, AKU_ETIMEOUT if the deadline expired
+    aku_Status status() const;
+
+    //! Get cancellation state attached to the current thread (or nullptr)
+    static QueryCancellation* get_current();
+
+    //! Attach the state to the current thread and return previous one (used to switch fibers)
+    static QueryCancellation* swap_current(QueryCancellation* state);
+
+    //! Check the query of the current thread (AKU_SUCCESS if the thread doesn't run the query)
+    static aku_Status check() {
+        auto state = get_current();
+        return state ? state->status() : AKU_SUCCESS;
+    }
+
+    //! Attaches the state to the current thread, previous state is restored on destruction
+    class Scope {
+        QueryCancellation* prev_;
+    public:
+        Scope(QueryCancellation* state);
+        ~Scope();
+        Scope(Scope const&) = delete;
+        Scope& operator = (Scope const&) = delete;
+    };
+};
+
+}  // namespace
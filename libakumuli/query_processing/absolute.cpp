@@ -32,6 +32,19 @@ bool Absolute::put(MutableSample &mut) {
     return next_->put(mut);
 }
 
+bool Absolute::put_batch(SampleBatch& batch) {
+    for (auto& value: batch.values) {
+        value = std::abs(value);
+    }
+    return next_->put_batch(batch);
+}
+
+bool Absolute::get_value_transform(StorageEngine::ValueTransform* dest) const {
+    dest->kind = StorageEngine::ValueTransform::Kind::ABS;
+    dest->weight = 1.0;
+    return true;
+}
+
 void Absolute::set_error(aku_Status status) {
     next_->set_error(status);
 }
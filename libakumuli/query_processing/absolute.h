@@ -21,6 +21,10 @@ struct Absolute : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual bool put_batch(SampleBatch& batch);
+
+    virtual bool get_value_transform(StorageEngine::ValueTransform* dest) const;
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -187,12 +187,64 @@ AnomalyDetector::AnomalyDetector(
     }
 }
 
+bool AnomalyDetector::flush() {
+    if (frame_.empty()) {
+        return true;
+    }
+    detector_->add(frame_.paramids.data(), frame_.values.data(), frame_.size());
+    detector_->move_sliding_window();
+    for (size_t i = 0; i < frame_.size(); i++) {
+        if (detector_->is_anomaly_candidate(frame_.paramids[i])) {
+            auto sample = frame_.get_sample(i);
+            MutableSample mut(&sample);
+            if (!next_->put(mut)) {
+                frame_.clear();
+                return false;
+            }
+        }
+    }
+    frame_.clear();
+    return true;
+}
+
+bool AnomalyDetector::add(aku_ParamId id, aku_Timestamp ts, double value) {
+    if (!frame_.empty() && frame_.timestamps.back() != ts) {
+        if (!flush()) {
+            return false;
+        }
+    }
+    frame_.paramids.push_back(id);
+    frame_.timestamps.push_back(ts);
+    frame_.values.push_back(value);
+    return true;
+}
+
 void AnomalyDetector::complete() {
-    next_->complete();
+    if (flush()) {
+        next_->complete();
+    }
+}
+
+bool AnomalyDetector::put(MutableSample &sample) {
+    if (sample.size() != 1) {
+        // Not supported, only scalars can be used
+        set_error(AKU_EHIGH_CARDINALITY);
+        return false;
+    }
+    double* value = sample[0];
+    if (value == nullptr) {
+        return true;
+    }
+    return add(sample.get_paramid(), sample.get_timestamp(), *value);
 }
 
-bool AnomalyDetector::put(const aku_Sample &sample) {
-    return false;
+bool AnomalyDetector::put_batch(SampleBatch& batch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (!add(batch.paramids[i], batch.timestamps[i], batch.values[i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void AnomalyDetector::set_error(aku_Status status) {
@@ -203,6 +255,8 @@ int AnomalyDetector::get_requirements() const {
     return TERMINAL|GROUP_BY_REQUIRED;
 }
 
+static QueryParserToken<AnomalyDetector> anomaly_detector_token("anomaly-detector");
+
 
 }}  // namespace
 
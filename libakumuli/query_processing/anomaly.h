@@ -21,12 +21,20 @@ namespace Forecasting {
     };
 }
 
+/** Anomaly detector.
+  * Input should be ordered by time. Values with the same timestamp form a frame,
+  * frame is added to the forecasting model when the timestamp changes or the
+  * query is completed. Values of the series that are far from the forecast are
+  * passed to the next node, the rest is dropped.
+  */
 struct AnomalyDetector : Node {
     typedef std::unique_ptr<AnomalyDetectorIface> PDetector;
     typedef Forecasting::FcastMethod FcastMethod;
 
     std::shared_ptr<Node> next_;
     PDetector             detector_;
+    //! Values of the current frame
+    SampleBatch           frame_;
 
     AnomalyDetector(u32 nhashes, u32 bits, double threshold, double alpha, double beta,
                     double gamma, int period, FcastMethod method, std::shared_ptr<Node> next);
@@ -35,11 +43,19 @@ struct AnomalyDetector : Node {
 
     virtual void complete();
 
-    virtual bool put(const aku_Sample& sample);
+    virtual bool put(MutableSample& sample);
+
+    virtual bool put_batch(SampleBatch& batch);
 
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
+
+private:
+    //! Add current frame to the model and send anomalous values to the next node
+    bool flush();
+
+    bool add(aku_ParamId id, aku_Timestamp ts, double value);
 };
 
 }
@@ -1,5 +1,7 @@
 #include "limiter.h"
 
+#include <algorithm>
+
 namespace Akumuli {
 namespace QP {
 
@@ -17,9 +19,10 @@ void Limiter::complete() {
 
 bool Limiter::put(MutableSample &sample) {
     if (counter_ < offset_) {
-        // continue iteration
+        // skip the sample and continue iteration
+        counter_++;
         return true;
-    } else if (counter_ >= limit_) {
+    } else if (limit_ != 0 && counter_ - offset_ >= limit_) {
         // stop iteration
         return false;
     }
@@ -27,6 +30,36 @@ bool Limiter::put(MutableSample &sample) {
     return next_->put(sample);
 }
 
+bool Limiter::put_batch(SampleBatch& batch) {
+    // Same result as if samples were passed to `put` one by one
+    if (counter_ < offset_) {
+        auto nskip = std::min(static_cast<u64>(batch.size()), offset_ - counter_);
+        batch.skip(nskip);
+        counter_ += nskip;
+        if (batch.empty()) {
+            return true;
+        }
+    }
+    if (limit_ == 0) {
+        counter_ += batch.size();
+        return next_->put_batch(batch);
+    }
+    if (counter_ - offset_ >= limit_) {
+        return false;
+    }
+    auto size = std::min(static_cast<u64>(batch.size()), limit_ - (counter_ - offset_));
+    bool truncated = size < batch.size();
+    batch.truncate(size);
+    counter_ += size;
+    return next_->put_batch(batch) && !truncated;
+}
+
+bool Limiter::get_limit(u64* limit, u64* offset) const {
+    *limit = limit_;
+    *offset = offset_;
+    return true;
+}
+
 void Limiter::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -7,6 +7,9 @@
 namespace Akumuli {
 namespace QP {
 
+/** Skips first `offset` samples and passes next `limit` samples (zero limit
+  * means no limit).
+  */
 struct Limiter : Node {
 
     u64                   limit_;
@@ -20,6 +23,10 @@ struct Limiter : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual bool put_batch(SampleBatch& batch);
+
+    virtual bool get_limit(u64* limit, u64* offset) const;
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -20,6 +20,8 @@ struct MathOperation : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual bool put_batch(SampleBatch& batch);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -69,6 +71,16 @@ bool MathOperation<Op>::put(MutableSample &mut) {
     return next_->put(mut);
 }
 
+template<class Op>
+bool MathOperation<Op>::put_batch(SampleBatch& batch) {
+    // Every scalar is a tuple with one element
+    Op operation;
+    for (auto& value: batch.values) {
+        value = operation(0., value);
+    }
+    return next_->put_batch(batch);
+}
+
 template<class Op>
 void MathOperation<Op>::set_error(aku_Status status) {
     next_->set_error(status);
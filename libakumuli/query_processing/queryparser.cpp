@@ -5,6 +5,9 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/exception/diagnostic_information.hpp>
+#include <algorithm>
+#include <cmath>
+#include <map>
 #include <set>
 #include <regex>
 
@@ -34,7 +37,7 @@ aku_Status SeriesRetreiver::add_tag(std::string name, std::string value) {
         Logger::msg(AKU_LOG_ERROR, "Series already set");
         return AKU_EBAD_ARG;
     }
-    if (tags_.count(name)) {
+    if (tags_.count(name) || patterns_.count(name)) {
         // Duplicates not allowed
         Logger::msg(AKU_LOG_ERROR, "Duplicate tag '" + name + "' found");
         return AKU_EBAD_ARG;
@@ -53,7 +56,7 @@ aku_Status SeriesRetreiver::add_tags(std::string name, std::vector<std::string>
         Logger::msg(AKU_LOG_ERROR, "Series already set");
         return AKU_EBAD_ARG;
     }
-    if (tags_.count(name)) {
+    if (tags_.count(name) || patterns_.count(name)) {
         // Duplicates not allowed
         Logger::msg(AKU_LOG_ERROR, "Duplicate tag '" + name + "' found");
         return AKU_EBAD_ARG;
@@ -62,8 +65,35 @@ aku_Status SeriesRetreiver::add_tags(std::string name, std::vector<std::string>
     return AKU_SUCCESS;
 }
 
+//! Add tag name and pattern of its values
+aku_Status SeriesRetreiver::add_tag_pattern(std::string name, TagValuePattern pattern) {
+    if (metric_.empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Metric not set");
+        return AKU_EBAD_ARG;
+    }
+    if (!series_.empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Series already set");
+        return AKU_EBAD_ARG;
+    }
+    if (tags_.count(name) || patterns_.count(name)) {
+        // Duplicates not allowed
+        Logger::msg(AKU_LOG_ERROR, "Duplicate tag '" + name + "' found");
+        return AKU_EBAD_ARG;
+    }
+    patterns_.insert(std::make_pair(name, pattern));
+    return AKU_SUCCESS;
+}
+
+std::map<std::string, std::vector<std::string>> SeriesRetreiver::get_value_regexes() const {
+    auto result = tags_;
+    for (auto const& kv: patterns_) {
+        result[kv.first].push_back(kv.second.to_regex());
+    }
+    return result;
+}
+
 aku_Status SeriesRetreiver::add_series_name(std::string name) {
-    if (!tags_.empty()) {
+    if (!tags_.empty() || !patterns_.empty()) {
         Logger::msg(AKU_LOG_ERROR, "Tags already set");
         return AKU_EBAD_ARG;
     }
@@ -102,7 +132,7 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::extract_ids(Se
     } else {
         // Case 3, metric is set
         auto first_metric = metric_.front();
-        IncludeMany2Many query(first_metric, tags_);
+        IncludeMany2Many query(first_metric, tags_, patterns_);
         auto search_results = matcher.search(query);
         for (auto tup: search_results) {
             ids.push_back(std::get<2>(tup));
@@ -133,6 +163,28 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::extract_ids(Se
     return std::make_tuple(AKU_SUCCESS, ids);
 }
 
+aku_Status SeriesRetreiver::extract_ids(SeriesMatcher const& matcher, IdSink const& sink) const {
+    if (!series_.empty() || metric_.size() != 1) {
+        aku_Status status;
+        std::vector<aku_ParamId> ids;
+        std::tie(status, ids) = extract_ids(matcher);
+        if (status == AKU_SUCCESS) {
+            sink(ids);
+        }
+        return status;
+    }
+    IncludeMany2Many query(metric_.front(), tags_, patterns_);
+    std::vector<aku_ParamId> ids;
+    matcher.search(query, [&sink, &ids](std::vector<SeriesMatcher::SeriesNameT> const& batch) {
+        ids.clear();
+        for (auto const& tup: batch) {
+            ids.push_back(std::get<2>(tup));
+        }
+        return sink(ids);
+    });
+    return AKU_SUCCESS;
+}
+
 std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::extract_ids(PlainSeriesMatcher const& matcher) const {
     std::vector<aku_ParamId> ids;
     // Three cases, no metric (get all ids), only metric is set and both metric and tags are set.
@@ -141,7 +193,7 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::extract_ids(Pl
         ids = matcher.get_all_ids();
     } else {
         auto first_metric = metric_.front();
-        if (tags_.empty()) {
+        if (tags_.empty() && patterns_.empty()) {
             // Case 2, only metric is set
             std::stringstream regex;
             regex << first_metric << "(?:\\s[\\w\\.\\-]+=[\\w\\.\\-]+)*";
@@ -154,7 +206,7 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::extract_ids(Pl
             // Case 3, both metric and tags are set
             std::stringstream regexp;
             regexp << first_metric;
-            for (auto kv: tags_) {
+            for (auto kv: get_value_regexes()) {
                 auto const& key = kv.first;
                 bool first = true;
                 regexp << "(?:";
@@ -209,7 +261,7 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::fuzzy_match(Pl
         return std::make_tuple(AKU_EBAD_ARG, ids);
     } else {
         auto first_metric = metric_.front();
-        if (tags_.empty()) {
+        if (tags_.empty() && patterns_.empty()) {
             // Case 2, only metric is set
             std::stringstream regex;
             regex << first_metric << "\\S*(?:\\s[\\w\\.\\-]+=[\\w\\.\\-]+)*";
@@ -222,7 +274,7 @@ std::tuple<aku_Status, std::vector<aku_ParamId>> SeriesRetreiver::fuzzy_match(Pl
             // Case 3, both metric and tags are set
             std::stringstream regexp;
             regexp << first_metric << "\\S*";
-            for (auto kv: tags_) {
+            for (auto kv: get_value_regexes()) {
                 auto const& key = kv.first;
                 bool first = true;
                 regexp << "(?:";
@@ -314,6 +366,10 @@ static std::tuple<aku_Status, std::vector<std::string>> parse_join_stmt(boost::p
     if (result.empty()) {
         return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
     }
+    if (result.size() > AKU_MAX_COLUMNS) {
+        Logger::msg(AKU_LOG_ERROR, "Too many columns in `join` statement, max " + std::to_string(AKU_MAX_COLUMNS));
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
     return std::make_tuple(AKU_SUCCESS, result);
 }
 
@@ -341,10 +397,15 @@ struct GroupAggregate {
     std::string metric;
     std::vector<AggregationFunction> func;
     aku_Duration step;
+    aku_Duration window;
+    StorageEngine::FillMode fill;
 };
 
 /** Parse `group-aggregate` statement, format:
-  * { "group-aggregate": { "step": "30s", "metric": "name", "func": ["cnt", "avg"] }, ... }
+  * { "group-aggregate": { "step": "30s", "metric": "name", "func": ["cnt", "avg"], "fill": "prev" }, ... }
+  * Optional `fill` field can be set to `null`, `prev` or `linear`.
+  * Optional `window` field (e.g. "5m") turns buckets into hopping windows, every
+  * bucket is an aggregate of the last `window` ending with the bucket.
   * @return status, metric name, functions array, step (as timestamp)
   */
 static std::tuple<aku_Status, GroupAggregate> parse_group_aggregate_stmt(boost::property_tree::ptree const& ptree) {
@@ -352,6 +413,8 @@ static std::tuple<aku_Status, GroupAggregate> parse_group_aggregate_stmt(boost::
         false, false, false
     };
     GroupAggregate result;
+    result.fill = StorageEngine::FillMode::NONE;
+    result.window = 0;
     auto aggregate = ptree.get_child_optional("group-aggregate");
     if (aggregate) {
         // select query
@@ -419,6 +482,32 @@ static std::tuple<aku_Status, GroupAggregate> parse_group_aggregate_stmt(boost::
                     }
                     components[2] = n;
                 }
+            } else if (tag_name == "fill") {
+                if (!value) {
+                    Logger::msg(AKU_LOG_ERROR, "Tag `fill` is not set in `group-aggregate` statement");
+                    return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+                }
+                if (*value == "null") {
+                    result.fill = StorageEngine::FillMode::NULL_VALUE;
+                } else if (*value == "prev") {
+                    result.fill = StorageEngine::FillMode::PREVIOUS;
+                } else if (*value == "linear") {
+                    result.fill = StorageEngine::FillMode::LINEAR;
+                } else {
+                    Logger::msg(AKU_LOG_ERROR, "Invalid fill mode `" + *value + "`");
+                    return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+                }
+            } else if (tag_name == "window") {
+                if (!value) {
+                    Logger::msg(AKU_LOG_ERROR, "Tag `window` is not set in `group-aggregate` statement");
+                    return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+                }
+                try {
+                    result.window = DateTimeUtil::parse_duration(value.get().data(), value.get().size());
+                } catch (const BadDateTimeFormat& e) {
+                    Logger::msg(AKU_LOG_ERROR, "Can't parse time-duration: " + *value);
+                    return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+                }
             }
         }
     }
@@ -435,6 +524,45 @@ static std::tuple<aku_Status, GroupAggregate> parse_group_aggregate_stmt(boost::
     return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
 }
 
+/**
+ * Result of the ohlc stmt parsing
+ */
+struct Ohlc {
+    std::string metric;
+    aku_Duration step;
+};
+
+/** Parse `ohlc` statement, format:
+  * { "ohlc": { "step": "1h", "metric": "name" }, ... }
+  * @return status, metric name, step (as timestamp)
+  */
+static std::tuple<aku_Status, Ohlc> parse_ohlc_stmt(boost::property_tree::ptree const& ptree) {
+    Ohlc result = {};
+    auto ohlc = ptree.get_child_optional("ohlc");
+    if (!ohlc) {
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    auto metric = ohlc->get_optional<std::string>("metric");
+    if (!metric || metric->empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Can't validate `ohlc` statement, `metric` field required");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    auto step = ohlc->get_optional<std::string>("step");
+    if (!step) {
+        Logger::msg(AKU_LOG_ERROR, "Can't validate `ohlc` statement, `step` field required");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    try {
+        result.step = DateTimeUtil::parse_duration(step->data(), step->size());
+    } catch (const BadDateTimeFormat& e) {
+        Logger::msg(AKU_LOG_ERROR, "Can't parse time-duration: " + *step);
+        Logger::msg(AKU_LOG_ERROR, boost::current_exception_diagnostic_information());
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    result.metric = *metric;
+    return std::make_tuple(AKU_SUCCESS, result);
+}
+
 /** Parse `oreder-by` statement, format:
   * { "oreder-by": "series", ... }
   */
@@ -476,6 +604,108 @@ static std::tuple<aku_Status, std::vector<std::string>> parse_groupby(boost::pro
     return std::make_tuple(AKU_SUCCESS, tags);
 }
 
+/** Parse `approximate` statement, format:
+  * { "approximate": { "error": 0.01 }, ... }
+  * @return relative error or 0 if the statement is not set
+  */
+static std::tuple<aku_Status, double> parse_approximate(boost::property_tree::ptree const& ptree) {
+    auto approx = ptree.get_child_optional("approximate");
+    if (!approx) {
+        return std::make_tuple(AKU_SUCCESS, 0.0);
+    }
+    double error = 0;
+    try {
+        error = approx->get<double>("error");
+    } catch (boost::property_tree::ptree_error const& e) {
+        Logger::msg(AKU_LOG_ERROR, std::string("Can't parse `approximate` statement: ") + e.what());
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, 0.0);
+    }
+    if (!(error > 0 && error < 1)) {
+        Logger::msg(AKU_LOG_ERROR, "Field `error` should be in (0, 1) range");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, 0.0);
+    }
+    return std::make_tuple(AKU_SUCCESS, error);
+}
+
+/** Select the sample of series for the approximate query. Around 1/error^2 series are
+  * selected. Choice depends only on series id so the same series are used by every query.
+  * @return sampling rate
+  */
+static double sample_series(std::vector<aku_ParamId>* ids, double error) {
+    double target = std::ceil(1.0 / (error * error));
+    if (static_cast<double>(ids->size()) <= target) {
+        return 1.0;
+    }
+    double rate = target / static_cast<double>(ids->size());
+    auto rejected = [rate](aku_ParamId id) {
+        // 64-bit finalizer of the MurmurHash3
+        u64 h = id;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return static_cast<double>(h >> 11) / 9007199254740992.0 >= rate;  // 2^53
+    };
+    ids->erase(std::remove_if(ids->begin(), ids->end(), rejected), ids->end());
+    return rate;
+}
+
+/** Parse `approximate` statement and sample the series of the aggregate query.
+  */
+static aku_Status init_approximate(boost::property_tree::ptree const& ptree, std::vector<aku_ParamId>* ids, Aggregation* agg) {
+    aku_Status status;
+    std::tie(status, agg->approx_error) = parse_approximate(ptree);
+    if (status != AKU_SUCCESS || agg->approx_error == 0) {
+        return status;
+    }
+    agg->series_total = ids->size();
+    agg->sample_rate = sample_series(ids, agg->approx_error);
+    return AKU_SUCCESS;
+}
+
+/** Parse `compare` statement, format:
+  * { "compare": [ "-7d", "-1d" ], ... }
+  * Every element is a negative duration. Query range shifted back by this
+  * duration is returned as an additional column.
+  * @return names of the shifted ranges and durations (empty if the statement is not set)
+  */
+static std::tuple<aku_Status, std::vector<std::string>, std::vector<aku_Timestamp>> parse_compare(
+        boost::property_tree::ptree const& ptree, aku_Timestamp begin, aku_Timestamp end)
+{
+    std::vector<std::string> names;
+    std::vector<aku_Timestamp> shifts;
+    auto compare = ptree.get_child_optional("compare");
+    if (!compare) {
+        return std::make_tuple(AKU_SUCCESS, names, shifts);
+    }
+    if (compare->empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `compare` should be a list of durations");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, names, shifts);
+    }
+    for (auto const& child: *compare) {
+        auto str = child.second.get_value<std::string>();
+        if (str.size() < 2 || str.front() != '-') {
+            Logger::msg(AKU_LOG_ERROR, "Time shift `" + str + "` should be a negative duration");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, names, shifts);
+        }
+        aku_Timestamp shift = 0;
+        try {
+            shift = DateTimeUtil::parse_duration(str.data() + 1, str.size() - 1);
+        } catch (const BadDateTimeFormat& e) {
+            Logger::msg(AKU_LOG_ERROR, "Can't parse time-duration: " + str);
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, names, shifts);
+        }
+        if (shift == 0 || shift > std::min(begin, end)) {
+            Logger::msg(AKU_LOG_ERROR, "Time shift `" + str + "` is out of range");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, names, shifts);
+        }
+        names.push_back(str);
+        shifts.push_back(shift);
+    }
+    return std::make_tuple(AKU_SUCCESS, names, shifts);
+}
+
 /** Parse `limit` and `offset` statements, format:
   * { "limit": 10, "offset": 200, ... }
   */
@@ -487,7 +717,7 @@ static std::pair<u64, u64> parse_limit_offset(boost::property_tree::ptree const&
     }
     auto optoffset = ptree.get_child_optional("offset");
     if (optoffset) {
-        limit = optoffset->get_value<u64>();
+        offset = optoffset->get_value<u64>();
     }
     return std::make_pair(limit, offset);
 }
@@ -527,15 +757,16 @@ static std::tuple<aku_Status, aku_Timestamp, aku_Timestamp> parse_range_timestam
 /** Parse `where` statement, format:
   * "where": { "tag": [ "value1", "value2" ], ... },
   * or
+  * "where": { "tag": { "glob": "value*" }, "tag2": { "regex": "value[0-9]+" } },
+  * or
   * "where": [ { "tag1": "value1", "tag2": "value2" },
   *            { "tag1": "value3", "tag2": "value4" } ]
   */
-static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_where_clause(boost::property_tree::ptree const& ptree,
-                                                                           std::vector<std::string> metrics,
-                                                                           SeriesMatcher const& matcher)
+static std::tuple<aku_Status, SeriesRetreiver> parse_where_retreiver(boost::property_tree::ptree const& ptree,
+                                                                    std::vector<std::string> metrics)
 {
     aku_Status status = AKU_SUCCESS;
-    std::vector<aku_ParamId> output;
+    SeriesRetreiver output;
     auto where = ptree.get_child_optional("where");
     if (where) {
         if (metrics.empty()) {
@@ -558,8 +789,32 @@ static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_where_clause(boost
                 }
             } else {
                 auto idslist = item.second;
-                // Read idlist
-                if (!idslist.empty()) {
+                if (!idslist.empty() && !idslist.front().first.empty()) {
+                    // Read pattern, e.g. { "glob": "web-*" } or { "regex": "web-[0-9]+" }
+                    if (idslist.size() != 1) {
+                        Logger::msg(AKU_LOG_ERROR, "Only one pattern can be set for tag '" + tag + "'");
+                        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, output);
+                    }
+                    auto kind = idslist.front().first;
+                    auto pattern = idslist.front().second.get_value<std::string>();
+                    try {
+                        if (kind == "glob") {
+                            status = retreiver.add_tag_pattern(tag, TagValuePattern(TagValuePattern::Kind::GLOB, pattern));
+                        } else if (kind == "regex") {
+                            status = retreiver.add_tag_pattern(tag, TagValuePattern(TagValuePattern::Kind::REGEX, pattern));
+                        } else {
+                            Logger::msg(AKU_LOG_ERROR, "Unknown pattern type '" + kind + "'");
+                            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, output);
+                        }
+                    } catch (std::regex_error const& err) {
+                        Logger::msg(AKU_LOG_ERROR, "Invalid regex '" + pattern + "': " + err.what());
+                        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, output);
+                    }
+                    if (status != AKU_SUCCESS) {
+                        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, output);
+                    }
+                } else if (!idslist.empty()) {
+                    // Read idlist
                     std::vector<std::string> tag_values;
                     for (auto idnode: idslist) {
                         tag_values.push_back(idnode.second.get_value<std::string>());
@@ -570,20 +825,107 @@ static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_where_clause(boost
                 }
             }
         }
-        std::tie(status, output) = retreiver.extract_ids(matcher);
+        output = retreiver;
     } else if (metrics.size()) {
         // only metric is specified
-        SeriesRetreiver retreiver(metrics);
-        std::tie(status, output) = retreiver.extract_ids(matcher);
-    } else {
-        // we need to include all series
-        // were stmt is not used
-        SeriesRetreiver retreiver;
-        std::tie(status, output) = retreiver.extract_ids(matcher);
+        output = SeriesRetreiver(metrics);
     }
+    // otherwise we need to include all series, were stmt is not used
     return std::make_tuple(status, output);
 }
 
+static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_where_clause(boost::property_tree::ptree const& ptree,
+                                                                           std::vector<std::string> metrics,
+                                                                           SeriesMatcher const& matcher)
+{
+    aku_Status status;
+    SeriesRetreiver retreiver;
+    std::vector<aku_ParamId> output;
+    std::tie(status, retreiver) = parse_where_retreiver(ptree, metrics);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, output);
+    }
+    return retreiver.extract_ids(matcher);
+}
+
+/** Parse value conditions, format:
+  * { "gt": 10, "le": 20 }
+  * Supported conditions are "gt", "ge", "lt" and "le".
+  */
+static aku_Status parse_value_conditions(boost::property_tree::ptree const& conds, StorageEngine::ValueFilter* result) {
+    static const std::map<std::string, StorageEngine::ValueFilter::Op> OPS = {
+        { "gt", StorageEngine::ValueFilter::Op::GT },
+        { "ge", StorageEngine::ValueFilter::Op::GE },
+        { "lt", StorageEngine::ValueFilter::Op::LT },
+        { "le", StorageEngine::ValueFilter::Op::LE },
+    };
+    for (auto const& cond: conds) {
+        auto op = OPS.find(cond.first);
+        auto threshold = cond.second.get_value_optional<double>();
+        if (op == OPS.end() || !threshold) {
+            Logger::msg(AKU_LOG_ERROR, "Invalid filter condition `" + cond.first + "`");
+            return AKU_EQUERY_PARSING_ERROR;
+        }
+        result->add(op->second, *threshold);
+    }
+    return AKU_SUCCESS;
+}
+
+/** Parse filter clause:
+  * { "filter": { "metric": { "gt": 10, "le": 20 } }, ... }
+  * Filter is disabled if the clause is not set.
+  */
+static std::tuple<aku_Status, StorageEngine::ValueFilter> parse_filter_clause(boost::property_tree::ptree const& ptree,
+                                                                              std::string const& metric)
+{
+    StorageEngine::ValueFilter result;
+    auto filter = ptree.get_child_optional("filter");
+    if (!filter) {
+        return std::make_tuple(AKU_SUCCESS, result);
+    }
+    for (auto const& item: *filter) {
+        if (item.first != metric) {
+            Logger::msg(AKU_LOG_ERROR, "Filter metric `" + item.first + "` is not selected");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+        }
+        aku_Status status = parse_value_conditions(item.second, &result);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, result);
+        }
+    }
+    if (!result.is_enabled()) {
+        Logger::msg(AKU_LOG_ERROR, "Filter doesn't have any conditions");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    return std::make_tuple(AKU_SUCCESS, result);
+}
+
+/** Parse `where-value` statement, format:
+  * { "where-value": { "metric": { "gt": 1000 } }, ... }
+  * Conditions are the same as in the filter clause.
+  * @return status, metric name and value filter
+  */
+static std::tuple<aku_Status, std::string, StorageEngine::ValueFilter> parse_where_value_stmt(
+        boost::property_tree::ptree const& ptree)
+{
+    StorageEngine::ValueFilter result;
+    auto stmt = ptree.get_child_optional("where-value");
+    if (!stmt || stmt->size() != 1) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `where-value` should contain one metric");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, "", result);
+    }
+    auto const& item = stmt->front();
+    aku_Status status = parse_value_conditions(item.second, &result);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, "", result);
+    }
+    if (!result.is_enabled()) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `where-value` doesn't have any conditions");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, "", result);
+    }
+    return std::make_tuple(AKU_SUCCESS, item.first, result);
+}
+
 static std::string to_json(boost::property_tree::ptree const& ptree, bool pretty_print = true) {
     std::stringstream ss;
     boost::property_tree::write_json(ss, ptree, pretty_print);
@@ -637,6 +979,12 @@ std::tuple<aku_Status, QueryKind> QueryParser::get_query_kind(boost::property_tr
             return std::make_tuple(AKU_SUCCESS, QueryKind::JOIN);
         } else if (item.first == "group-aggregate") {
             return std::make_tuple(AKU_SUCCESS, QueryKind::GROUP_AGGREGATE);
+        } else if (item.first == "select-last") {
+            return std::make_tuple(AKU_SUCCESS, QueryKind::SELECT_LAST);
+        } else if (item.first == "ohlc") {
+            return std::make_tuple(AKU_SUCCESS, QueryKind::OHLC);
+        } else if (item.first == "where-value") {
+            return std::make_tuple(AKU_SUCCESS, QueryKind::WHERE_VALUE);
         }
     }
     return std::make_tuple(AKU_EQUERY_PARSING_ERROR, QueryKind::SELECT);
@@ -647,7 +995,10 @@ aku_Status validate_query(boost::property_tree::ptree const& ptree) {
         "select",
         "aggregate",
         "join",
-        "group-aggregate"
+        "group-aggregate",
+        "select-last",
+        "ohlc",
+        "where-value"
     };
     static const std::set<std::string> ALLOWED_STMTS = {
         "select",
@@ -661,8 +1012,35 @@ aku_Status validate_query(boost::property_tree::ptree const& ptree) {
         "range",
         "where",
         "group-aggregate",
-        "apply"
+        "apply",
+        "filter",
+        "select-last",
+        "ohlc",
+        "where-value",
+        "profile",
+        "timeout",
+        "priority",
+        "approximate",
+        "compare",
+        "explain",
+        "resume"
     };
+    if (ptree.count("filter") && ptree.count("select") == 0) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `filter` can be used only with `select`");
+        return AKU_EQUERY_PARSING_ERROR;
+    }
+    if (ptree.count("approximate") && ptree.count("aggregate") == 0 && ptree.count("group-aggregate") == 0) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `approximate` can be used only with `aggregate` or `group-aggregate`");
+        return AKU_EQUERY_PARSING_ERROR;
+    }
+    if (ptree.count("resume") && ptree.count("select") == 0) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `resume` can be used only with `select`");
+        return AKU_EQUERY_PARSING_ERROR;
+    }
+    if (ptree.count("compare") && ptree.count("select") == 0 && ptree.count("group-aggregate") == 0) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `compare` can be used only with `select` or `group-aggregate`");
+        return AKU_EQUERY_PARSING_ERROR;
+    }
     std::set<std::string> keywords;
     for (const auto& item: ptree) {
         std::string keyword = item.first;
@@ -718,6 +1096,59 @@ std::tuple<aku_Status, std::vector<aku_ParamId> > QueryParser::parse_select_meta
     return std::make_tuple(AKU_SUCCESS, ids);
 }
 
+aku_Status QueryParser::parse_search_query(boost::property_tree::ptree const& ptree,
+                                           SeriesMatcher const& matcher,
+                                           SeriesRetreiver::IdSink const& sink)
+{
+    aku_Status status = validate_query(ptree);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    std::string name;
+    std::tie(status, name) = parse_select_stmt(ptree);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    std::vector<std::string> metrics;
+    if (!name.empty()) {
+        metrics.push_back(name);
+    }
+    SeriesRetreiver retreiver;
+    std::tie(status, retreiver) = parse_where_retreiver(ptree, metrics);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    return retreiver.extract_ids(matcher, sink);
+}
+
+
+/** Select-last query:
+ * { "select-last": "metric", "where": { ... } }
+ * Query returns the latest value of every series of the metric.
+ */
+std::tuple<aku_Status, std::vector<aku_ParamId>> QueryParser::parse_select_last_query(
+        boost::property_tree::ptree const& ptree,
+        SeriesMatcher const& matcher)
+{
+    std::vector<aku_ParamId> ids;
+    aku_Status status = validate_query(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, ids);
+    }
+    for (auto stmt: { "group-by", "order-by", "range", "apply", "filter" }) {
+        if (ptree.count(stmt)) {
+            Logger::msg(AKU_LOG_ERROR, std::string("Statement `") + stmt + "` can't be used with `select-last`");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, ids);
+        }
+    }
+    auto metric = ptree.get_optional<std::string>("select-last");
+    if (!metric || metric->empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Metric is not set");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, ids);
+    }
+    return parse_where_clause(ptree, { *metric }, matcher);
+}
+
 
 /**
  * Search query parser
@@ -844,6 +1275,8 @@ static aku_Status validate_suggest_query(boost::property_tree::ptree const& ptre
         "metric",
         "tag",
         "starts-with",
+        "limit",
+        "offset",
         "output"
     };
     for (const auto& item: ptree) {
@@ -917,13 +1350,17 @@ std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Para
     SuggestQueryKind kind;
     std::tie(kind, status) = get_suggest_query_type(ptree);
     std::string starts_with = get_starts_with(ptree);
+    // Names are sorted so only the first `limit + offset` names are needed
+    auto limoff = parse_limit_offset(ptree);
+    size_t limit = limoff.first == 0 ? std::numeric_limits<size_t>::max()
+                                     : static_cast<size_t>(limoff.first + limoff.second);
     std::vector<StringT> results;
     std::string metric_name;
     std::string tag_name;
     switch (kind) {
     case SuggestQueryKind::SUGGEST_METRIC_NAMES:
         // This should work for empty 'starts_with' values. Method should return all metric names.
-        results = matcher.suggest_metric(starts_with);
+        results = matcher.suggest_metric(starts_with, limit);
     break;
     case SuggestQueryKind::SUGGEST_TAG_NAMES:
         std::tie(status, metric_name) = get_property("metric", ptree);
@@ -931,7 +1368,7 @@ std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Para
             Logger::msg(AKU_LOG_ERROR, "Metric name expected");
             return std::make_tuple(AKU_EQUERY_PARSING_ERROR, substitute, ids);
         }
-        results = matcher.suggest_tags(metric_name, starts_with);
+        results = matcher.suggest_tags(metric_name, starts_with, limit);
     break;
     case SuggestQueryKind::SUGGEST_TAG_VALUES:
         std::tie(status, metric_name) = get_property("metric", ptree);
@@ -944,7 +1381,7 @@ std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Para
             Logger::msg(AKU_LOG_ERROR, "Tag name expected");
             return std::make_tuple(AKU_EQUERY_PARSING_ERROR, substitute, ids);
         }
-        results = matcher.suggest_tag_values(metric_name, tag_name, starts_with);
+        results = matcher.suggest_tag_values(metric_name, tag_name, starts_with, limit);
     break;
     case SuggestQueryKind::SUGGEST_ERROR:
         return std::make_tuple(AKU_EQUERY_PARSING_ERROR, substitute, ids);
@@ -959,6 +1396,96 @@ std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Para
     return std::make_tuple(AKU_SUCCESS, substitute, ids);
 }
 
+bool QueryParser::is_cardinality_query(boost::property_tree::ptree const& ptree) {
+    return ptree.get<std::string>("select", "") == "cardinality";
+}
+
+std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Sample>>
+    QueryParser::parse_cardinality_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher)
+{
+    std::shared_ptr<PlainSeriesMatcher> substitute;
+    std::vector<aku_Sample> samples;
+    aku_Status status = validate_suggest_query(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, substitute, samples);
+    }
+    std::string starts_with = get_starts_with(ptree);
+    auto limoff = parse_limit_offset(ptree);
+    size_t limit = limoff.first == 0 ? std::numeric_limits<size_t>::max()
+                                     : static_cast<size_t>(limoff.first + limoff.second);
+    std::string metric_name;
+    std::string tag_name;
+    std::tie(status, metric_name) = get_property("metric", ptree);
+    if (status == AKU_EBAD_ARG) {
+        Logger::msg(AKU_LOG_ERROR, "Metric name expected");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, substitute, samples);
+    }
+    std::tie(status, tag_name) = get_property("tag", ptree);
+    if (status == AKU_EBAD_ARG || (status == AKU_SUCCESS && metric_name.empty())) {
+        Logger::msg(AKU_LOG_ERROR, "Tag name and metric name expected");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, substitute, samples);
+    }
+    // Every row is a metric or a tag=value pair of the metric
+    std::vector<std::pair<std::string, std::vector<std::string>>> rows;
+    if (!tag_name.empty()) {
+        for (auto value: matcher.suggest_tag_values(metric_name, tag_name, starts_with, limit)) {
+            std::string pair = tag_name + "=" + std::string(value.first, value.first + value.second);
+            rows.push_back(std::make_pair(metric_name + " " + pair, std::vector<std::string>({ pair })));
+        }
+    } else if (!metric_name.empty()) {
+        rows.push_back(std::make_pair(metric_name, std::vector<std::string>()));
+    } else {
+        for (auto mname: matcher.suggest_metric(starts_with, limit)) {
+            rows.push_back(std::make_pair(std::string(mname.first, mname.first + mname.second),
+                                          std::vector<std::string>()));
+        }
+    }
+
+    substitute.reset(new PlainSeriesMatcher());
+    for (auto const& row: rows) {
+        auto metric = tag_name.empty() ? row.first : metric_name;
+        aku_Sample sample = {};
+        sample.paramid = substitute->add(row.first.data(), row.first.data() + row.first.size());
+        sample.timestamp = 0;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.size = sizeof(aku_Sample);
+        sample.payload.float64 = static_cast<double>(matcher.estimate_cardinality(metric, row.second));
+        samples.push_back(sample);
+    }
+    return std::make_tuple(AKU_SUCCESS, substitute, samples);
+}
+
+/** Initialize matcher of the query with `compare` statement. Every output series
+  * has a column for the query range and a column for every shifted range, e.g.
+  * "cpu|cpu@-7d|cpu@-1d host=A".
+  */
+static aku_Status init_matcher_in_compare_query(ReshapeRequest* req,
+                                                SeriesMatcherBase const& global_matcher,
+                                                std::string const& metric_name,
+                                                std::string const& column_name,
+                                                std::vector<std::string> const& compare)
+{
+    auto matcher = std::make_shared<PlainSeriesMatcher>();
+    for (auto id: req->select.columns.at(0).ids) {
+        auto sname = global_matcher.id2str(id);
+        std::string name(sname.first, sname.first + sname.second);
+        if (!boost::algorithm::starts_with(name, metric_name)) {
+            Logger::msg(AKU_LOG_ERROR, "Matcher initialization failed. Invalid metric name.");
+            return AKU_EBAD_DATA;
+        }
+        auto tags = name.substr(metric_name.size());
+        std::stringstream str;
+        str << column_name;
+        for (auto const& shift: compare) {
+            str << '|' << column_name << '@' << shift;
+        }
+        str << tags;
+        matcher->_add(str.str(), id);
+    }
+    req->select.matcher = matcher;
+    return AKU_SUCCESS;
+}
+
 std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_select_query(
                                                     boost::property_tree::ptree const& ptree,
                                                     const SeriesMatcher &matcher)
@@ -988,7 +1515,7 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_select_query(
     }
     auto groupbytag = std::shared_ptr<GroupByTag>();
     if (!tags.empty()) {
-        groupbytag.reset(new GroupByTag(matcher, metric, tags));
+        groupbytag = matcher.group_by(metric, tags);
     }
 
     // Order-by statment
@@ -1005,6 +1532,13 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_select_query(
         return std::make_tuple(status, result);
     }
 
+    // Filter statement
+    StorageEngine::ValueFilter filter;
+    std::tie(status, filter) = parse_filter_clause(ptree, metric);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
     // Read timestamps
     aku_Timestamp ts_begin, ts_end;
     std::tie(status, ts_begin, ts_end) = parse_range_timestamp(ptree);
@@ -1012,20 +1546,39 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_select_query(
         return std::make_tuple(status, result);
     }
 
+    // Compare statement
+    std::vector<std::string> compare;
+    std::tie(status, compare, result.compare) = parse_compare(ptree, ts_begin, ts_end);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (!compare.empty() && (groupbytag || filter.is_enabled())) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `compare` can't be used with `group-by` or `filter`");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+
     // Initialize request
     result.agg.enabled = false;
     result.select.begin = ts_begin;
     result.select.end = ts_end;
     result.select.columns.push_back(Column{ids});
+    result.filter = filter;
 
     result.order_by = order;
 
     result.group_by.enabled = static_cast<bool>(groupbytag);
     if (groupbytag) {
-        result.group_by.transient_map = groupbytag->get_mapping();
+        result.group_by.dense_map = groupbytag->get_dense_mapping();
         result.select.matcher = std::shared_ptr<PlainSeriesMatcher>(groupbytag, &groupbytag->local_matcher_);
     }
 
+    if (!compare.empty()) {
+        status = init_matcher_in_compare_query(&result, matcher, metric, metric, compare);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, result);
+        }
+    }
+
     return std::make_tuple(AKU_SUCCESS, result);
 }
 
@@ -1062,7 +1615,7 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_aggregate_query(boost:
     }
     auto groupbytag = std::shared_ptr<GroupByTag>();
     if (!tags.empty()) {
-        groupbytag.reset(new GroupByTag(matcher, metric, tags));
+        groupbytag = matcher.group_by(metric, tags);
     }
 
     // Order-by statment is disallowed
@@ -1079,6 +1632,12 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_aggregate_query(boost:
         return std::make_tuple(status, result);
     }
 
+    // Approximate statement
+    status = init_approximate(ptree, &ids, &result.agg);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
     // Read timestamps
     aku_Timestamp ts_begin, ts_end;
     std::tie(status, ts_begin, ts_end) = parse_range_timestamp(ptree);
@@ -1098,19 +1657,23 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_aggregate_query(boost:
 
     result.group_by.enabled = static_cast<bool>(groupbytag);
     if (groupbytag) {
-        result.group_by.transient_map = groupbytag->get_mapping();
+        result.group_by.dense_map = groupbytag->get_dense_mapping();
         result.select.matcher = std::shared_ptr<PlainSeriesMatcher>(groupbytag, &groupbytag->local_matcher_);
     }
 
     return std::make_tuple(AKU_SUCCESS, result);
 }
 
+/** Create output names of the group-aggregate query.
+  * @param global_matcher is a matcher that contains names of the `ids`
+  * @param ids is a list of output series
+  */
 static aku_Status init_matcher_in_group_aggregate(ReshapeRequest* req,
-                                                  SeriesMatcher const& global_matcher,
+                                                  SeriesMatcherBase const& global_matcher,
                                                   std::string metric_name,
-                                                  std::vector<AggregationFunction> const& func_names)
+                                                  std::vector<AggregationFunction> const& func_names,
+                                                  std::vector<aku_ParamId> const& ids)
 {
-    std::vector<aku_ParamId> ids = req->select.columns.at(0).ids;
     auto matcher = std::make_shared<PlainSeriesMatcher>();
     for (auto id: ids) {
         auto sname = global_matcher.id2str(id);
@@ -1165,6 +1728,24 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_group_aggregate_query(
         Logger::msg(AKU_LOG_ERROR, "Step can't be zero");
         return std::make_tuple(status, result);
     }
+    if (gagg.fill != StorageEngine::FillMode::NONE &&
+        std::any_of(gagg.func.begin(), gagg.func.end(), &StorageEngine::is_quantile))
+    {
+        // Quantiles are computed from raw values by a different materializer
+        Logger::msg(AKU_LOG_ERROR, "Field `fill` can't be used with quantiles");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    if (gagg.window != 0) {
+        // Windows are combined from the step sized buckets
+        if (gagg.window < gagg.step || gagg.window % gagg.step != 0) {
+            Logger::msg(AKU_LOG_ERROR, "Field `window` should be a multiple of the `step`");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+        }
+        if (std::any_of(gagg.func.begin(), gagg.func.end(), &StorageEngine::is_quantile)) {
+            Logger::msg(AKU_LOG_ERROR, "Field `window` can't be used with quantiles");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+        }
+    }
 
     // Group-by statement
     std::vector<std::string> tags;
@@ -1174,7 +1755,7 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_group_aggregate_query(
     }
     auto groupbytag = std::shared_ptr<GroupByTag>();
     if (!tags.empty()) {
-        groupbytag.reset(new GroupByTag(matcher, gagg.metric, tags));
+        groupbytag = matcher.group_by(gagg.metric, tags);
     }
 
     // Where statement
@@ -1183,6 +1764,21 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_group_aggregate_query(
     if (status != AKU_SUCCESS) {
         return std::make_tuple(status, result);
     }
+    if (groupbytag) {
+        result.group_by.enabled = true;
+        result.group_by.dense_map = groupbytag->get_dense_mapping();
+        // Series that don't belong to any group are not read
+        ids.erase(std::remove_if(ids.begin(), ids.end(), [&](aku_ParamId id) {
+                      return result.group_by.find(id) == 0;
+                  }),
+                  ids.end());
+    }
+
+    // Approximate statement (only the series are sampled)
+    status = init_approximate(ptree, &ids, &result.agg);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
 
     // Read timestamps
     aku_Timestamp ts_begin, ts_end;
@@ -1191,10 +1787,30 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_group_aggregate_query(
         return std::make_tuple(status, result);
     }
 
+    // Compare statement
+    std::vector<std::string> compare;
+    std::tie(status, compare, result.compare) = parse_compare(ptree, ts_begin, ts_end);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (!compare.empty()) {
+        // Shifted ranges are joined with the query range, every range produces one column
+        if (gagg.func.size() != 1 || StorageEngine::is_quantile(gagg.func.front())) {
+            Logger::msg(AKU_LOG_ERROR, "Statement `compare` requires single non-quantile aggregation function");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+        }
+        if (groupbytag || gagg.fill != StorageEngine::FillMode::NONE) {
+            Logger::msg(AKU_LOG_ERROR, "Statement `compare` can't be used with `group-by` or `fill`");
+            return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+        }
+    }
+
     // Initialize request
     result.agg.enabled = true;
     result.agg.func = gagg.func;
     result.agg.step = gagg.step;
+    result.agg.window = gagg.window;
+    result.agg.fill = gagg.fill;
 
     result.select.begin = ts_begin;
     result.select.end = ts_end;
@@ -1205,18 +1821,178 @@ std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_group_aggregate_query(
         return std::make_tuple(status, result);
     }
 
-    status = init_matcher_in_group_aggregate(&result, matcher, gagg.metric, gagg.func);
-
-    result.group_by.enabled = static_cast<bool>(groupbytag);
     if (groupbytag) {
-        result.group_by.transient_map = groupbytag->get_mapping();
-        result.select.matcher = std::shared_ptr<PlainSeriesMatcher>(groupbytag, &groupbytag->local_matcher_);
+        // Series of the group are combined by the storage, output contains one series per group
+        std::set<aku_ParamId> groups;
+        for (auto id: ids) {
+            groups.insert(result.group_by.find(id));
+        }
+        std::vector<aku_ParamId> groupids(groups.begin(), groups.end());
+        status = init_matcher_in_group_aggregate(&result, groupbytag->local_matcher_, gagg.metric, gagg.func, groupids);
+    } else if (!compare.empty()) {
+        auto column = gagg.metric + ":" + Aggregation::to_string(gagg.func.front());
+        status = init_matcher_in_compare_query(&result, matcher, gagg.metric, column, compare);
+    } else {
+        status = init_matcher_in_group_aggregate(&result, matcher, gagg.metric, gagg.func, ids);
+    }
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
     }
 
     return std::make_tuple(AKU_SUCCESS, result);
 
 }
 
+std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_ohlc_query(
+        boost::property_tree::ptree const& ptree,
+        SeriesMatcher const& matcher)
+{
+    ReshapeRequest result = {};
+
+    aku_Status status = validate_query(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    Logger::msg(AKU_LOG_INFO, "Parsing query:");
+    Logger::msg(AKU_LOG_INFO, to_json(ptree, true).c_str());
+
+    Ohlc ohlc;
+    std::tie(status, ohlc) = parse_ohlc_stmt(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (ohlc.step == 0) {
+        Logger::msg(AKU_LOG_ERROR, "Step can't be zero");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+    if (ptree.count("group-by")) {
+        // Candlesticks of different series are not aligned and can't be merged
+        Logger::msg(AKU_LOG_ERROR, "Statement `group-by` can't be used with `ohlc`");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+
+    // Where statement
+    std::vector<aku_ParamId> ids;
+    std::tie(status, ids) = parse_where_clause(ptree, {ohlc.metric}, matcher);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    // Read timestamps
+    aku_Timestamp ts_begin, ts_end;
+    std::tie(status, ts_begin, ts_end) = parse_range_timestamp(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (ts_begin > ts_end) {
+        // `first` and `last` are returned in iteration order
+        Logger::msg(AKU_LOG_ERROR, "Statement `ohlc` requires forward time range");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+
+    // Initialize request
+    std::vector<AggregationFunction> func = {
+        AggregationFunction::FIRST,
+        AggregationFunction::MAX,
+        AggregationFunction::MIN,
+        AggregationFunction::LAST,
+    };
+    result.agg.enabled = true;
+    result.agg.func = func;
+    result.agg.step = ohlc.step;
+    result.agg.candlestick = true;
+
+    result.select.begin = ts_begin;
+    result.select.end = ts_end;
+    result.select.columns.push_back(Column{ids});
+
+    std::tie(status, result.order_by) = parse_orderby(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    status = init_matcher_in_group_aggregate(&result, matcher, ohlc.metric, func, result.select.columns.at(0).ids);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    return std::make_tuple(AKU_SUCCESS, result);
+}
+
+std::tuple<aku_Status, ReshapeRequest> QueryParser::parse_where_value_query(
+        boost::property_tree::ptree const& ptree,
+        SeriesMatcher const& matcher)
+{
+    ReshapeRequest result = {};
+
+    aku_Status status = validate_query(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    Logger::msg(AKU_LOG_INFO, "Parsing query:");
+    Logger::msg(AKU_LOG_INFO, to_json(ptree, true).c_str());
+
+    std::string metric;
+    StorageEngine::ValueFilter filter;
+    std::tie(status, metric, filter) = parse_where_value_stmt(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (ptree.count("group-by")) {
+        // Ranges of different series can't be merged
+        Logger::msg(AKU_LOG_ERROR, "Statement `group-by` can't be used with `where-value`");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+
+    // Where statement
+    std::vector<aku_ParamId> ids;
+    std::tie(status, ids) = parse_where_clause(ptree, {metric}, matcher);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    // Read timestamps
+    aku_Timestamp ts_begin, ts_end;
+    std::tie(status, ts_begin, ts_end) = parse_range_timestamp(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    if (ts_begin > ts_end) {
+        // `first` and `last` are returned in iteration order
+        Logger::msg(AKU_LOG_ERROR, "Statement `where-value` requires forward time range");
+        return std::make_tuple(AKU_EQUERY_PARSING_ERROR, result);
+    }
+
+    // Initialize request, every output tuple describes one range (tuple
+    // timestamp is a beginning of the range)
+    std::vector<AggregationFunction> func = {
+        AggregationFunction::LAST_TIMESTAMP,
+        AggregationFunction::CNT,
+        AggregationFunction::MIN,
+        AggregationFunction::MAX,
+    };
+    result.agg.enabled = true;
+    result.agg.func = func;
+    result.agg.value_ranges = true;
+    result.filter = filter;
+
+    result.select.begin = ts_begin;
+    result.select.end = ts_end;
+    result.select.columns.push_back(Column{ids});
+
+    std::tie(status, result.order_by) = parse_orderby(ptree);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+
+    status = init_matcher_in_group_aggregate(&result, matcher, metric, func, result.select.columns.at(0).ids);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, result);
+    }
+    return std::make_tuple(AKU_SUCCESS, result);
+}
+
 static aku_Status init_matcher_in_join_query(ReshapeRequest* req,
                                              SeriesMatcher const& global_matcher,
                                              std::vector<std::string> const& metric_names)
@@ -1340,7 +2116,16 @@ struct TerminalNode : QP::Node {
     }
 
     bool put(MutableSample& sample) {
-        return cursor->put(sample.payload_.sample);
+        return cursor->put(sample.get_sample());
+    }
+
+    bool put_batch(SampleBatch& batch) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!cursor->put(batch.get_sample(i))) {
+                return false;
+            }
+        }
+        return true;
     }
 
     void set_error(aku_Status status) {
@@ -1403,6 +2188,9 @@ std::tuple<aku_Status, std::vector<std::shared_ptr<Node>>> QueryParser::parse_pr
         prev = node;
     }
 
+    // Nodes were created from the end of the topology, the first node
+    // should be the entry point and the terminal should be the last
+    std::reverse(result.begin(), result.end());
     result.push_back(terminal);
     return std::make_tuple(AKU_SUCCESS, result);
 }
@@ -16,12 +16,19 @@ enum class QueryKind {
     JOIN,
     AGGREGATE,
     GROUP_AGGREGATE,
+    SELECT_LAST,
+    OHLC,
+    WHERE_VALUE,
 };
 
 class SeriesRetreiver {
     std::vector<std::string> metric_;
     std::map<std::string, std::vector<std::string>> tags_;
+    std::map<std::string, TagValuePattern> patterns_;
     std::vector<std::string> series_;
+
+    //! Get regular expressions that match values of every tag
+    std::map<std::string, std::vector<std::string>> get_value_regexes() const;
 public:
     //! Matches all series names
     SeriesRetreiver();
@@ -35,6 +42,9 @@ public:
     //! Add tag name and set of possible values
     aku_Status add_tags(std::string name, std::vector<std::string> values);
 
+    //! Add tag name and pattern of its values
+    aku_Status add_tag_pattern(std::string name, TagValuePattern pattern);
+
     //! Add full series name
     aku_Status add_series_name(std::string name);
 
@@ -43,6 +53,14 @@ public:
 
     std::tuple<aku_Status, std::vector<aku_ParamId>> extract_ids(SeriesMatcher const& matcher) const;
 
+    //! Receives ids in batches, returns false to stop
+    typedef std::function<bool(std::vector<aku_ParamId> const&)> IdSink;
+
+    /** Pass results to `sink` as they're found. Index search is done in parallel
+      * if only one metric is set, otherwise all ids are passed at once.
+      */
+    aku_Status extract_ids(SeriesMatcher const& matcher, IdSink const& sink) const;
+
     std::tuple<aku_Status, std::vector<aku_ParamId>> fuzzy_match(PlainSeriesMatcher const& matcher) const;
 };
 
@@ -67,12 +85,27 @@ struct QueryParser {
       */
     static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_select_meta_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher);
 
+    /** Parse select-last query (latest value of every series).
+      * @param ptree is a property tree generated from query json
+      * @param matcher is a global matcher
+      */
+    static std::tuple<aku_Status, std::vector<aku_ParamId>> parse_select_last_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher);
+
     /** Parse search query.
       * @param ptree is a property tree generated from query json
       * @param matcher is a global matcher
       */
     static std::tuple<aku_Status, std::vector<aku_ParamId> > parse_search_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher);
 
+    /** Parse search query and stream results.
+      * @param ptree is a property tree generated from query json
+      * @param matcher is a global matcher
+      * @param sink receives ids in batches while the index is searched
+      */
+    static aku_Status parse_search_query(boost::property_tree::ptree const& ptree,
+                                         SeriesMatcher const& matcher,
+                                         SeriesRetreiver::IdSink const& sink);
+
     /**
      * @brief Parse suggest query
      * @param ptree is a property tree generated from query json
@@ -81,6 +114,23 @@ struct QueryParser {
     static std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_ParamId>>
         parse_suggest_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher);
 
+    //! Check if the suggest query is a cardinality query
+    static bool is_cardinality_query(boost::property_tree::ptree const& ptree);
+
+    /**
+     * @brief Parse cardinality query and compute the estimates
+     * { "select": "cardinality", "metric": "cpu", "tag": "region" }
+     * Without "tag" query returns number of series of the metric (or of every metric
+     * if "metric" is not set too), otherwise it returns number of series of the metric
+     * for every value of the tag. Estimates are computed using the cardinality sketches
+     * of the index, the index is not searched.
+     * @param ptree is a property tree generated from query json
+     * @param matcher is a series matcher object
+     * @return status, matcher that contains names of the rows and one sample per row
+     */
+    static std::tuple<aku_Status, std::shared_ptr<PlainSeriesMatcher>, std::vector<aku_Sample>>
+        parse_cardinality_query(boost::property_tree::ptree const& ptree, SeriesMatcher const& matcher);
+
     /** Parse aggregate query and produce reshape request.
      */
     static std::tuple<aku_Status, ReshapeRequest> parse_aggregate_query(
@@ -102,6 +152,24 @@ struct QueryParser {
     static std::tuple<aku_Status, ReshapeRequest> parse_group_aggregate_query(boost::property_tree::ptree const& ptree,
                                                                               SeriesMatcher const& matcher);
 
+    /**
+     * Parse ohlc (candlestick) query
+     * @param ptree is a json query
+     * @param matcher is a series matcher
+     * @return status and request object
+     */
+    static std::tuple<aku_Status, ReshapeRequest> parse_ohlc_query(boost::property_tree::ptree const& ptree,
+                                                                   SeriesMatcher const& matcher);
+
+    /**
+     * Parse where-value query (time ranges in which values match the condition)
+     * @param ptree is a json query
+     * @param matcher is a series matcher
+     * @return status and request object
+     */
+    static std::tuple<aku_Status, ReshapeRequest> parse_where_value_query(boost::property_tree::ptree const& ptree,
+                                                                          SeriesMatcher const& matcher);
+
     /** Parse stream processing pipeline.
       * @param ptree contains query
       * @returns vector of Nodes in proper order
@@ -8,6 +8,13 @@
 #include "storage_engine/operators/join.h"
 #include "log_iface.h"
 #include "status_util.h"
+#include "util.h"
+#include "metrics.h"
+#include "akumuli_tracing.h"
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
 
 namespace Akumuli {
 namespace QP {
@@ -19,6 +26,8 @@ using namespace StorageEngine;
  */
 struct ProcessingPrelude {
     virtual ~ProcessingPrelude() = default;
+    //! Name of the processing step (used by explain)
+    virtual const char* name() const = 0;
     //! Compute processing step result (list of low level operators)
     virtual aku_Status apply(const ColumnStore& cstore) = 0;
     //! Get result of the processing step
@@ -34,6 +43,9 @@ struct MaterializationStep {
 
     virtual ~MaterializationStep() = default;
 
+    //! Name of the processing step (used by explain)
+    virtual const char* name() const = 0;
+
     //! Compute processing step result (list of low level operators)
     virtual aku_Status apply(ProcessingPrelude* prelude) = 0;
 
@@ -53,17 +65,101 @@ struct ScanProcessingStep : ProcessingPrelude {
     aku_Timestamp begin_;
     aku_Timestamp end_;
     std::vector<aku_ParamId> ids_;
+    //! Transformations applied to every operator
+    std::vector<ValueTransform> fn_;
+    //! Filter applied by the storage operators (before transformations)
+    ValueFilter filter_;
+    //! Limit applied by the storage operators (zero means no limit)
+    u64 limit_;
+    u64 offset_;
+    //! Limit is applied to the concatenation of the series (otherwise to every series)
+    bool chained_;
+    //! Begin of the range of every series (empty if all series are read from `begin_`)
+    std::vector<aku_Timestamp> begins_;
 
     template<class T>
     ScanProcessingStep(aku_Timestamp begin, aku_Timestamp end, T&& t)
         : begin_(begin)
         , end_(end)
         , ids_(std::forward<T>(t))
+        , limit_(0)
+        , offset_(0)
+        , chained_(false)
     {
     }
 
+    //! Create limit for every series
+    std::vector<std::shared_ptr<ScanLimit>> make_limits() const {
+        ScanLimit limit = { offset_, limit_ == 0 ? std::numeric_limits<u64>::max() : limit_ };
+        std::vector<std::shared_ptr<ScanLimit>> limits;
+        auto shared = std::make_shared<ScanLimit>(limit);
+        for (size_t i = 0; i < ids_.size(); i++) {
+            limits.push_back(chained_ ? shared : std::make_shared<ScanLimit>(limit));
+        }
+        return limits;
+    }
+
+    virtual const char* name() const {
+        return "scan";
+    }
+
+    //! Add operators of the series to the scan list
+    aku_Status scan(const ColumnStore& cstore, std::vector<aku_ParamId> const& ids, aku_Timestamp begin,
+                    std::vector<std::shared_ptr<ScanLimit>> const& limits)
+    {
+        aku_Status status;
+        bool limited = limit_ != 0 || offset_ != 0;
+        if (filter_.is_enabled()) {
+            size_t first = scanlist_.size();
+            status = cstore.filter(ids, begin, end_, filter_, &scanlist_);
+            if (status == AKU_SUCCESS && limited) {
+                // Value count of the subtree can't be used if values are filtered
+                for (size_t i = first; i < scanlist_.size(); i++) {
+                    scanlist_[i].reset(new LimitOperator(std::move(scanlist_[i]), limits.at(i - first)));
+                }
+            }
+        } else if (limited) {
+            status = cstore.scan(ids, begin, end_, limits, &scanlist_);
+        } else {
+            status = cstore.scan(ids, begin, end_, &scanlist_);
+        }
+        return status;
+    }
+
     virtual aku_Status apply(const ColumnStore& cstore) {
-        return cstore.scan(ids_, begin_, end_, &scanlist_);
+        aku_Status status = AKU_SUCCESS;
+        auto limits = make_limits();
+        if (begins_.empty()) {
+            status = scan(cstore, ids_, begin_, limits);
+        } else {
+            // Series that start at the same timestamp are scanned together
+            size_t i = 0;
+            while (i < ids_.size() && status == AKU_SUCCESS) {
+                size_t j = i + 1;
+                while (j < ids_.size() && begins_[j] == begins_[i]) {
+                    j++;
+                }
+                auto first = static_cast<std::ptrdiff_t>(i);
+                auto last  = static_cast<std::ptrdiff_t>(j);
+                if (begins_[i] >= end_) {
+                    // Series doesn't have new values
+                    for (size_t k = i; k < j; k++) {
+                        EmptyOperator<double>::push(&scanlist_, end_, end_);
+                    }
+                } else {
+                    std::vector<aku_ParamId> ids(ids_.begin() + first, ids_.begin() + last);
+                    std::vector<std::shared_ptr<ScanLimit>> lim(limits.begin() + first, limits.begin() + last);
+                    status = scan(cstore, ids, begins_[i], lim);
+                }
+                i = j;
+            }
+        }
+        if (status == AKU_SUCCESS && !fn_.empty()) {
+            for (auto& it: scanlist_) {
+                it.reset(new TransformOperator(std::move(it), fn_));
+            }
+        }
+        return status;
     }
 
     virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
@@ -79,22 +175,60 @@ struct ScanProcessingStep : ProcessingPrelude {
     }
 };
 
+/** Evaluate aggregate operators in parallel.
+  * Operators are distributed between the calling thread and the threads of the
+  * shared pool dynamically (each thread grabs the next unprocessed operator) and
+  * results are stored in place, so the order of the operators is preserved.
+  * @param min_ops_per_worker is a min number of operators per worker thread
+  * @param max_workers is a max number of worker threads (chosen by the planner)
+  */
+static void parallel_aggregate(std::vector<std::unique_ptr<AggregateOperator>>* ops, size_t min_ops_per_worker,
+                               size_t max_workers)
+{
+    size_t nworkers = std::min(max_workers, ops->size() / min_ops_per_worker);
+    if (nworkers < 2) {
+        return;
+    }
+    auto profile = QueryProfile::get_current();
+    auto cancellation = QueryCancellation::get_current();
+    ForkJoinPool::instance().parallel_for(ops->size(), [ops, profile, cancellation](size_t ix) {
+        QueryProfile::Scope scope(profile);
+        QueryCancellation::Scope cancellation_scope(cancellation);
+        auto& op = ops->at(ix);
+        op = PrecomputedAggregateOperator::drain(std::move(op));
+    }, nworkers - 1);  // current thread participates too
+}
+
 struct AggregateProcessingStep : ProcessingPrelude {
     std::vector<std::unique_ptr<AggregateOperator>> agglist_;
     aku_Timestamp begin_;
     aku_Timestamp end_;
     std::vector<aku_ParamId> ids_;
+    bool approximate_;
+    //! Max number of worker threads
+    size_t nworkers_;
 
     template<class T>
-    AggregateProcessingStep(aku_Timestamp begin, aku_Timestamp end, T&& t)
+    AggregateProcessingStep(aku_Timestamp begin, aku_Timestamp end, T&& t, bool approximate, size_t nworkers)
         : begin_(begin)
         , end_(end)
         , ids_(std::forward<T>(t))
+        , approximate_(approximate)
+        , nworkers_(nworkers)
     {
     }
 
+    virtual const char* name() const {
+        return approximate_ ? "approximate" : "aggregate";
+    }
+
     virtual aku_Status apply(const ColumnStore& cstore) {
-        return cstore.aggregate(ids_, begin_, end_, &agglist_);
+        auto status = approximate_ ? cstore.approximate(ids_, begin_, end_, &agglist_)
+                                   : cstore.aggregate(ids_, begin_, end_, &agglist_);
+        if (status == AKU_SUCCESS) {
+            parallel_aggregate(&agglist_, 32, nworkers_);
+        }
+        return status;
     }
 
     virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
@@ -116,19 +250,39 @@ struct GroupAggregateProcessingStep : ProcessingPrelude {
     aku_Timestamp begin_;
     aku_Timestamp end_;
     aku_Timestamp step_;
+    //! Hopping window width (0 - disabled)
+    aku_Timestamp window_;
     std::vector<aku_ParamId> ids_;
 
     template<class T>
-    GroupAggregateProcessingStep(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step, T&& t)
+    GroupAggregateProcessingStep(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step, aku_Timestamp window, T&& t)
         : begin_(begin)
         , end_(end)
         , step_(step)
+        , window_(window)
         , ids_(std::forward<T>(t))
     {
     }
 
+    virtual const char* name() const {
+        return window_ == 0 ? "group-aggregate" : "hopping-window";
+    }
+
     virtual aku_Status apply(const ColumnStore& cstore) {
-        return cstore.group_aggregate(ids_, begin_, end_, step_, &agglist_);
+        if (window_ == 0) {
+            return cstore.group_aggregate(ids_, begin_, end_, step_, &agglist_);
+        }
+        // Step sized buckets are read once and combined into windows
+        aku_Timestamp begin, end;
+        std::tie(begin, end) = HoppingWindowOperator::get_scan_range(begin_, end_, step_, window_);
+        auto status = cstore.group_aggregate(ids_, begin, end, step_, &agglist_);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        for (auto& it: agglist_) {
+            it.reset(new HoppingWindowOperator(std::move(it), begin_, end_, step_, window_));
+        }
+        return AKU_SUCCESS;
     }
 
     virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
@@ -145,6 +299,104 @@ struct GroupAggregateProcessingStep : ProcessingPrelude {
 };
 
 
+/**
+ * Reads every series in the query range and in the ranges shifted back in time
+ * (raw values or single aggregation function of every bucket). Timestamps of the
+ * shifted ranges are moved forward so the join materializer can align them with
+ * the query range. Result contains `shifts.size() + 1` operators per series.
+ */
+struct CompareProcessingStep : ProcessingPrelude {
+    std::vector<std::unique_ptr<RealValuedOperator>> scanlist_;
+    aku_Timestamp begin_;
+    aku_Timestamp end_;
+    std::vector<aku_Timestamp> shifts_;
+    std::vector<aku_ParamId> ids_;
+    //! Aggregation parameters (step is 0 if raw values are compared)
+    aku_Timestamp step_;
+    aku_Timestamp window_;
+    AggregationFunction func_;
+
+    template<class T>
+    CompareProcessingStep(aku_Timestamp begin, aku_Timestamp end, std::vector<aku_Timestamp> const& shifts, T&& t)
+        : begin_(begin)
+        , end_(end)
+        , shifts_(shifts)
+        , ids_(std::forward<T>(t))
+        , step_(0)
+        , window_(0)
+        , func_(AggregationFunction::MEAN)
+    {
+    }
+
+    aku_Status read_range(const ColumnStore& cstore, aku_Timestamp begin, aku_Timestamp end,
+                          std::vector<std::unique_ptr<RealValuedOperator>>* dest)
+    {
+        if (step_ == 0) {
+            return cstore.scan(ids_, begin, end, dest);
+        }
+        GroupAggregateProcessingStep gagg(begin, end, step_, window_, ids_);
+        auto status = gagg.apply(cstore);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        std::vector<std::unique_ptr<AggregateOperator>> agglist;
+        status = gagg.extract_result(&agglist);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        for (auto& it: agglist) {
+            dest->push_back(std::unique_ptr<RealValuedOperator>(new AggregateValueOperator(std::move(it), func_)));
+        }
+        return AKU_SUCCESS;
+    }
+
+    virtual const char* name() const {
+        return step_ == 0 ? "compare-scan" : "compare-group-aggregate";
+    }
+
+    virtual aku_Status apply(const ColumnStore& cstore) {
+        std::vector<std::vector<std::unique_ptr<RealValuedOperator>>> ranges(shifts_.size() + 1);
+        auto status = read_range(cstore, begin_, end_, &ranges.front());
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        for (size_t i = 0; i < shifts_.size(); i++) {
+            auto shift = shifts_.at(i);
+            if (shift > std::min(begin_, end_)) {
+                return AKU_EBAD_ARG;
+            }
+            auto& range = ranges.at(i + 1);
+            status = read_range(cstore, begin_ - shift, end_ - shift, &range);
+            if (status != AKU_SUCCESS) {
+                return status;
+            }
+            for (auto& it: range) {
+                it.reset(new TimeShiftOperator(std::move(it), shift));
+            }
+        }
+        // Operators of the same series should be adjacent
+        for (size_t i = 0; i < ids_.size(); i++) {
+            for (auto& range: ranges) {
+                scanlist_.push_back(std::move(range.at(i)));
+            }
+        }
+        return AKU_SUCCESS;
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
+        if (scanlist_.empty()) {
+            return AKU_ENO_DATA;
+        }
+        *dest = std::move(scanlist_);
+        return AKU_SUCCESS;
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<AggregateOperator>>* dest) {
+        return AKU_ENO_DATA;
+    }
+};
+
+
 // -------------------------------- //
 //              Tier-2              //
 // -------------------------------- //
@@ -156,14 +408,21 @@ struct GroupAggregateProcessingStep : ProcessingPrelude {
 template<OrderBy order>
 struct MergeBy : MaterializationStep {
     std::vector<aku_ParamId> ids_;
+    //! Max number of merge workers (time order only)
+    size_t nworkers_;
     std::unique_ptr<ColumnMaterializer> mat_;
 
     template<class IdVec>
-    MergeBy(IdVec&& ids)
+    MergeBy(IdVec&& ids, size_t nworkers)
         : ids_(std::forward<IdVec>(ids))
+        , nworkers_(nworkers)
     {
     }
 
+    const char* name() const {
+        return order == OrderBy::SERIES ? "merge-by-series" : "merge-by-time";
+    }
+
     aku_Status apply(ProcessingPrelude* prelude) {
         std::vector<std::unique_ptr<RealValuedOperator>> iters;
         auto status = prelude->extract_result(&iters);
@@ -173,7 +432,8 @@ struct MergeBy : MaterializationStep {
         if (order == OrderBy::SERIES) {
             mat_.reset(new MergeMaterializer<SeriesOrder>(std::move(ids_), std::move(iters)));
         } else {
-            mat_.reset(new MergeMaterializer<TimeOrder>(std::move(ids_), std::move(iters)));
+            mat_ = make_merge_materializer<TimeOrder, MergeJoinUtil::OrderByTimestamp>(std::move(ids_), std::move(iters),
+                                                                                       nworkers_);
         }
         return AKU_SUCCESS;
     }
@@ -197,6 +457,10 @@ struct Chain : MaterializationStep {
     {
     }
 
+    const char* name() const {
+        return "chain";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         std::vector<std::unique_ptr<RealValuedOperator>> iters;
         auto status = prelude->extract_result(&iters);
@@ -234,6 +498,10 @@ struct Aggregate : MaterializationStep {
     {
     }
 
+    const char* name() const {
+        return "aggregate";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         std::vector<std::unique_ptr<AggregateOperator>> iters;
         auto status = prelude->extract_result(&iters);
@@ -260,18 +528,53 @@ struct Aggregate : MaterializationStep {
  * operators. Maps each id to operator and then combines operators
  * with the same id (used to implement aggregate + group-by).
  */
+/** Extrapolates aggregate computed from the sample of series to
+  * all series (count and sum are divided by the sampling rate).
+  */
+struct ExtrapolateAggregateOperator : AggregateOperator {
+    std::unique_ptr<AggregateOperator> op_;
+    double rate_;
+
+    ExtrapolateAggregateOperator(std::unique_ptr<AggregateOperator>&& op, double rate)
+        : op_(std::move(op))
+        , rate_(rate)
+    {
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+        aku_Status status;
+        size_t outsz;
+        std::tie(status, outsz) = op_->read(destts, destval, size);
+        for (size_t i = 0; i < outsz; i++) {
+            destval[i].cnt /= rate_;
+            destval[i].sum /= rate_;
+        }
+        return std::make_tuple(status, outsz);
+    }
+
+    virtual Direction get_direction() {
+        return op_->get_direction();
+    }
+};
+
 struct AggregateCombiner : MaterializationStep {
     std::vector<aku_ParamId> ids_;
     AggregationFunction fn_;
+    double sample_rate_;
     std::unique_ptr<ColumnMaterializer> mat_;
 
     template<class IdVec>
-    AggregateCombiner(IdVec&& vec, AggregationFunction fn)
+    AggregateCombiner(IdVec&& vec, AggregationFunction fn, double sample_rate)
         : ids_(std::forward<IdVec>(vec))
         , fn_(fn)
+        , sample_rate_(sample_rate)
     {
     }
 
+    const char* name() const {
+        return "aggregate-combiner";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         std::vector<std::unique_ptr<AggregateOperator>> iters;
         auto status = prelude->extract_result(&iters);
@@ -289,7 +592,10 @@ struct AggregateCombiner : MaterializationStep {
         for (auto& kv: groupings) {
             auto& vec = kv.second;
             ids.push_back(kv.first);
-            std::unique_ptr<CombineAggregateOperator> it(new CombineAggregateOperator(std::move(vec)));
+            std::unique_ptr<AggregateOperator> it(new CombineAggregateOperator(std::move(vec)));
+            if (sample_rate_ < 1.0) {
+                it.reset(new ExtrapolateAggregateOperator(std::move(it), sample_rate_));
+            }
             agglist.push_back(std::move(it));
         }
         mat_.reset(new AggregateMaterializer(std::move(ids),
@@ -333,6 +639,10 @@ struct Join : MaterializationStep {
     {
     }
 
+    const char* name() const {
+        return order_ == OrderBy::SERIES ? "join-by-series" : "join-by-time";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         int inc = cardinality_;
         std::vector<std::unique_ptr<RealValuedOperator>> scanlist;
@@ -376,27 +686,187 @@ struct Join : MaterializationStep {
     }
 };
 
+struct CandlestickProcessingStep : ProcessingPrelude {
+    std::vector<std::unique_ptr<AggregateOperator>> agglist_;
+    aku_Timestamp begin_;
+    aku_Timestamp end_;
+    NBTreeCandlestickHint hint_;
+    std::vector<aku_ParamId> ids_;
+
+    template<class T>
+    CandlestickProcessingStep(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step, T&& t)
+        : begin_(begin)
+        , end_(end)
+        , ids_(std::forward<T>(t))
+    {
+        hint_.min_delta = step;
+    }
+
+    virtual const char* name() const {
+        return "candlesticks";
+    }
+
+    virtual aku_Status apply(const ColumnStore& cstore) {
+        return cstore.candlesticks(ids_, begin_, end_, hint_, &agglist_);
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
+        return AKU_ENO_DATA;
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<AggregateOperator>>* dest) {
+        if (agglist_.empty()) {
+            return AKU_ENO_DATA;
+        }
+        *dest = std::move(agglist_);
+        return AKU_SUCCESS;
+    }
+};
+
+struct ValueRangeProcessingStep : ProcessingPrelude {
+    std::vector<std::unique_ptr<AggregateOperator>> agglist_;
+    aku_Timestamp begin_;
+    aku_Timestamp end_;
+    ValueFilter filter_;
+    std::vector<aku_ParamId> ids_;
+
+    template<class T>
+    ValueRangeProcessingStep(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter, T&& t)
+        : begin_(begin)
+        , end_(end)
+        , filter_(filter)
+        , ids_(std::forward<T>(t))
+    {
+    }
+
+    virtual const char* name() const {
+        return "value-ranges";
+    }
+
+    virtual aku_Status apply(const ColumnStore& cstore) {
+        return cstore.value_ranges(ids_, begin_, end_, filter_, &agglist_);
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<RealValuedOperator>>* dest) {
+        return AKU_ENO_DATA;
+    }
+
+    virtual aku_Status extract_result(std::vector<std::unique_ptr<AggregateOperator>>* dest) {
+        if (agglist_.empty()) {
+            return AKU_ENO_DATA;
+        }
+        *dest = std::move(agglist_);
+        return AKU_SUCCESS;
+    }
+};
+
 /**
  * Merges several group-aggregate operators by chaining
  */
+/**
+ * Group-aggregate with group-by. Operators of the series that belong to the same
+ * group are combined bucket by bucket (groups are evaluated in parallel) and the
+ * result is materialized as one series per group.
+ * Accepts list of group ids (one per operator, 0 if the series doesn't belong to
+ * any group).
+ */
+struct GroupAggregateCombiner : MaterializationStep {
+    std::vector<aku_ParamId> ids_;
+    std::vector<AggregationFunction> fn_;
+    OrderBy order_;
+    TimeOrderAggregateMaterializer::Fill fill_;
+    //! Max number of worker threads
+    size_t nworkers_;
+    std::unique_ptr<ColumnMaterializer> mat_;
+
+    template<class IdVec, class FnVec>
+    GroupAggregateCombiner(IdVec&& vec, FnVec&& fn, OrderBy order, TimeOrderAggregateMaterializer::Fill const& fill,
+                           size_t nworkers)
+        : ids_(std::forward<IdVec>(vec))
+        , fn_(std::forward<FnVec>(fn))
+        , order_(order)
+        , fill_(fill)
+        , nworkers_(nworkers)
+    {
+    }
+
+    const char* name() const {
+        return order_ == OrderBy::SERIES ? "group-by-series" : "group-by-time";
+    }
+
+    aku_Status apply(ProcessingPrelude *prelude) {
+        std::vector<std::unique_ptr<AggregateOperator>> iters;
+        auto status = prelude->extract_result(&iters);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        std::map<aku_ParamId, std::vector<std::unique_ptr<AggregateOperator>>> groupings;
+        for (size_t i = 0; i < ids_.size(); i++) {
+            if (ids_.at(i) != 0) {
+                groupings[ids_.at(i)].push_back(std::move(iters.at(i)));
+            }
+        }
+        std::vector<aku_ParamId> ids;
+        std::vector<std::unique_ptr<AggregateOperator>> agglist;
+        for (auto& kv: groupings) {
+            ids.push_back(kv.first);
+            std::unique_ptr<AggregateOperator> it;
+            it.reset(new ReduceGroupAggregateOperator(fill_.begin, fill_.step, std::move(kv.second)));
+            agglist.push_back(std::move(it));
+        }
+        // Every group combines many series so even a few groups are worth a thread
+        parallel_aggregate(&agglist, 1, nworkers_);
+        if (order_ == OrderBy::SERIES) {
+            if (fill_.mode != FillMode::NONE) {
+                for (auto& it: agglist) {
+                    it.reset(new GapFillOperator(std::move(it), fill_.begin, fill_.end, fill_.step, fill_.mode));
+                }
+            }
+            mat_.reset(new SeriesOrderAggregateMaterializer(std::move(ids), std::move(agglist), fn_));
+        } else {
+            mat_.reset(new TimeOrderAggregateMaterializer(ids, agglist, fn_, fill_));
+        }
+        return AKU_SUCCESS;
+    }
+
+    aku_Status extract_result(std::unique_ptr<ColumnMaterializer> *dest) {
+        if (!mat_) {
+            return AKU_ENO_DATA;
+        }
+        *dest = std::move(mat_);
+        return AKU_SUCCESS;
+    }
+};
+
 struct SeriesOrderAggregate : MaterializationStep {
     std::vector<aku_ParamId> ids_;
     std::vector<AggregationFunction> fn_;
+    TimeOrderAggregateMaterializer::Fill fill_;
     std::unique_ptr<ColumnMaterializer> mat_;
 
     template<class IdVec, class FnVec>
-    SeriesOrderAggregate(IdVec&& vec, FnVec&& fn)
+    SeriesOrderAggregate(IdVec&& vec, FnVec&& fn, TimeOrderAggregateMaterializer::Fill const& fill)
         : ids_(std::forward<IdVec>(vec))
         , fn_(std::forward<FnVec>(fn))
+        , fill_(fill)
     {
     }
 
+    const char* name() const {
+        return "series-order-aggregate";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         std::vector<std::unique_ptr<AggregateOperator>> iters;
         auto status = prelude->extract_result(&iters);
         if (status != AKU_SUCCESS) {
             return status;
         }
+        if (fill_.mode != FillMode::NONE) {
+            for (auto& it: iters) {
+                it.reset(new GapFillOperator(std::move(it), fill_.begin, fill_.end, fill_.step, fill_.mode));
+            }
+        }
         mat_.reset(new SeriesOrderAggregateMaterializer(std::move(ids_), std::move(iters), fn_));
         return AKU_SUCCESS;
     }
@@ -413,22 +883,112 @@ struct SeriesOrderAggregate : MaterializationStep {
 struct TimeOrderAggregate : MaterializationStep {
     std::vector<aku_ParamId> ids_;
     std::vector<AggregationFunction> fn_;
+    TimeOrderAggregateMaterializer::Fill fill_;
     std::unique_ptr<ColumnMaterializer> mat_;
 
     template<class IdVec, class FnVec>
-    TimeOrderAggregate(IdVec&& vec, FnVec&& fn)
+    TimeOrderAggregate(IdVec&& vec, FnVec&& fn, TimeOrderAggregateMaterializer::Fill const& fill)
         : ids_(std::forward<IdVec>(vec))
         , fn_(std::forward<FnVec>(fn))
+        , fill_(fill)
     {
     }
 
+    const char* name() const {
+        return "time-order-aggregate";
+    }
+
     aku_Status apply(ProcessingPrelude *prelude) {
         std::vector<std::unique_ptr<AggregateOperator>> iters;
         auto status = prelude->extract_result(&iters);
         if (status != AKU_SUCCESS) {
             return status;
         }
-        mat_.reset(new TimeOrderAggregateMaterializer(ids_, iters, fn_));
+        mat_.reset(new TimeOrderAggregateMaterializer(ids_, iters, fn_, fill_));
+        return AKU_SUCCESS;
+    }
+
+    aku_Status extract_result(std::unique_ptr<ColumnMaterializer> *dest) {
+        if (!mat_) {
+            return AKU_ENO_DATA;
+        }
+        *dest = std::move(mat_);
+        return AKU_SUCCESS;
+    }
+};
+
+/**
+ * Computes aggregates with quantiles from raw values.
+ * Accepts list of output ids (one per operator). Operators with the same
+ * output id are combined (used to implement aggregate + group-by).
+ */
+struct QuantileAggregate : MaterializationStep {
+    std::vector<aku_ParamId> ids_;
+    std::vector<AggregationFunction> fn_;
+    aku_Timestamp begin_;
+    aku_Timestamp end_;
+    u64 step_;
+    OrderBy order_;
+    bool combine_;
+    std::unique_ptr<ColumnMaterializer> mat_;
+
+    template<class IdVec>
+    QuantileAggregate(IdVec&& vec, std::vector<AggregationFunction> const& fn, aku_Timestamp begin, aku_Timestamp end,
+                      u64 step, OrderBy order, bool combine)
+        : ids_(std::forward<IdVec>(vec))
+        , fn_(fn)
+        , begin_(begin)
+        , end_(end)
+        , step_(step)
+        , order_(order)
+        , combine_(combine)
+    {
+    }
+
+    const char* name() const {
+        return "quantile-aggregate";
+    }
+
+    aku_Status apply(ProcessingPrelude *prelude) {
+        typedef QuantileAggregateMaterializer::Group Group;
+        std::vector<std::unique_ptr<RealValuedOperator>> iters;
+        auto status = prelude->extract_result(&iters);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        std::vector<aku_ParamId> ids;
+        std::vector<Group> groups;
+        if (combine_) {
+            std::map<aku_ParamId, Group> groupings;
+            for (size_t i = 0; i < ids_.size(); i++) {
+                groupings[ids_.at(i)].push_back(std::move(iters.at(i)));
+            }
+            for (auto& kv: groupings) {
+                ids.push_back(kv.first);
+                groups.push_back(std::move(kv.second));
+            }
+        } else {
+            for (size_t i = 0; i < ids_.size(); i++) {
+                Group group;
+                group.push_back(std::move(iters.at(i)));
+                ids.push_back(ids_.at(i));
+                groups.push_back(std::move(group));
+            }
+        }
+        if (order_ == OrderBy::SERIES) {
+            mat_.reset(new QuantileAggregateMaterializer(std::move(ids), std::move(groups), fn_, begin_, end_, step_));
+        } else {
+            std::vector<std::unique_ptr<ColumnMaterializer>> mats;
+            for (size_t i = 0; i < ids.size(); i++) {
+                std::vector<Group> group;
+                group.push_back(std::move(groups.at(i)));
+                std::unique_ptr<ColumnMaterializer> mat;
+                mat.reset(new QuantileAggregateMaterializer({ ids.at(i) }, std::move(group), fn_, begin_, end_, step_));
+                mats.push_back(std::move(mat));
+            }
+            typedef MergeJoinMaterializer<MergeJoinUtil::OrderByTimestamp> Materializer;
+            mat_.reset(new Materializer(std::move(mats), begin_ < end_));
+        }
         return AKU_SUCCESS;
     }
 
@@ -445,14 +1005,26 @@ struct TwoStepQueryPlan : IQueryPlan {
     std::unique_ptr<ProcessingPrelude> prelude_;
     std::unique_ptr<MaterializationStep> mater_;
     std::unique_ptr<ColumnMaterializer> column_;
+    //! Max number of worker threads used by the plan
+    size_t nworkers_;
 
     template<class T1, class T2>
-    TwoStepQueryPlan(T1&& t1, T2&& t2)
+    TwoStepQueryPlan(T1&& t1, T2&& t2, size_t nworkers = 1)
         : prelude_(std::forward<T1>(t1))
         , mater_(std::forward<T2>(t2))
+        , nworkers_(nworkers)
     {
     }
 
+    std::string explain() const {
+        std::stringstream out;
+        out << "{\"tier1\": \""       << prelude_->name()
+            << "\", \"tier2\": \""   << mater_->name()
+            << "\", \"parallelism\": " << nworkers_
+            << "}";
+        return out.str();
+    }
+
     aku_Status execute(const ColumnStore &cstore) {
         auto status = prelude_->apply(cstore);
         if (status != AKU_SUCCESS) {
@@ -475,10 +1047,34 @@ struct TwoStepQueryPlan : IQueryPlan {
 
 // ----------- Query plan builder ------------ //
 
-static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> scan_query_plan(ReshapeRequest const& req) {
+enum {
+    //! Min number of values per worker thread of the time order merge
+    MIN_VALUES_PER_WORKER = 0x100000,
+    //! Min number of leaf nodes per worker thread of the group-aggregate with group-by
+    MIN_LEAVES_PER_WORKER = 0x100,
+    //! Min number of series per worker thread of the aggregate
+    MIN_SERIES_PER_WORKER = 32,
+};
+
+/** Get max number of worker threads of the query. All cores can be used if the
+  * query wasn't estimated, otherwise small queries are evaluated by one thread.
+  * @param work is a field of the estimate that defines the size of the query
+  */
+static size_t get_parallelism(QueryEstimate const* est, u64 QueryEstimate::* work, u64 min_work_per_worker) {
+    u64 ncores = std::max(std::thread::hardware_concurrency(), 1u);
+    if (est == nullptr) {
+        return ncores;
+    }
+    return std::max<u64>(1, std::min(ncores, est->*work / min_work_per_worker));
+}
+
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> scan_query_plan(ReshapeRequest const& req,
+                                                                               QueryEstimate const* est)
+{
     // Hardwired query plan for scan query
     // Tier1
-    // - List of range scan operators
+    // - List of range scan operators (with fused value transformations
+    //   if the request has any)
     // Tier2
     // - If group-by is enabled:
     //   - Transform ids and matcher (generate new names)
@@ -486,7 +1082,9 @@ static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> scan_query_plan(Resha
     //     order-by clause.
     // - Otherwise
     //   - If oreder-by is series add chain materialization step.
-    //   - Otherwise add merge materializer.
+    //   - Otherwise add merge materializer (or chain materializer if
+    //     the estimate shows that only one series has data).
+    // Number of merge workers depends on the estimated number of values.
 
     std::unique_ptr<IQueryPlan> result;
 
@@ -494,37 +1092,91 @@ static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> scan_query_plan(Resha
         return std::make_tuple(AKU_EBAD_ARG, std::move(result));
     }
 
-    std::unique_ptr<ProcessingPrelude> t1stage;
-    t1stage.reset(new ScanProcessingStep(req.select.begin, req.select.end, req.select.columns.at(0).ids));
+    std::unique_ptr<ScanProcessingStep> scan;
+    scan.reset(new ScanProcessingStep(req.select.begin, req.select.end, req.select.columns.at(0).ids));
+    scan->fn_ = req.transforms;
+    scan->filter_ = req.filter;
+    scan->limit_ = req.limit;
+    scan->offset_ = req.offset;
+    scan->begins_ = req.resume;
+    // Series are read one after another if they're not merged
+    scan->chained_ = !req.group_by.enabled && req.order_by == OrderBy::SERIES;
+    std::unique_ptr<ProcessingPrelude> t1stage(std::move(scan));
 
     std::unique_ptr<MaterializationStep> t2stage;
+    size_t nworkers = 1;
     if (req.group_by.enabled) {
         std::vector<aku_ParamId> ids;
         for(auto id: req.select.columns.at(0).ids) {
-            auto it = req.group_by.transient_map.find(id);
-            if (it != req.group_by.transient_map.end()) {
-                ids.push_back(it->second);
+            auto localid = req.group_by.find(id);
+            if (localid != 0) {
+                ids.push_back(localid);
             }
         }
         if (req.order_by == OrderBy::SERIES) {
-            t2stage.reset(new MergeBy<OrderBy::SERIES>(std::move(ids)));
+            t2stage.reset(new MergeBy<OrderBy::SERIES>(std::move(ids), nworkers));
         } else {
-            t2stage.reset(new MergeBy<OrderBy::TIME>(std::move(ids)));
+            nworkers = get_parallelism(est, &QueryEstimate::nvalues, MIN_VALUES_PER_WORKER);
+            t2stage.reset(new MergeBy<OrderBy::TIME>(std::move(ids), nworkers));
         }
     } else {
         auto ids = req.select.columns.at(0).ids;
-        if (req.order_by == OrderBy::SERIES) {
+        // Series without data don't produce any output, single series doesn't have to be merged
+        bool single = est != nullptr && est->nseries < 2;
+        if (req.order_by == OrderBy::SERIES || single) {
             t2stage.reset(new Chain(std::move(ids)));
         } else {
-            t2stage.reset(new MergeBy<OrderBy::TIME>(std::move(ids)));
+            nworkers = get_parallelism(est, &QueryEstimate::nvalues, MIN_VALUES_PER_WORKER);
+            t2stage.reset(new MergeBy<OrderBy::TIME>(std::move(ids), nworkers));
         }
     }
 
+    result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage), nworkers));
+    return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
+
+static bool has_quantiles(std::vector<AggregationFunction> const& func) {
+    return std::any_of(func.begin(), func.end(), &is_quantile);
+}
+
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> quantile_query_plan(ReshapeRequest const& req,
+                                                                                   QueryEstimate const* est)
+{
+    // Query plan for aggregate and group-aggregate queries with quantiles
+    // Tier1
+    // - List of range scan operators (quantiles can't be computed from
+    //   the precomputed aggregates)
+    // Tier2
+    // - Quantile aggregate materializer, series with the same name are
+    //   combined if group-by is enabled
+    std::unique_ptr<IQueryPlan> result;
+    std::unique_ptr<ProcessingPrelude> t1stage;
+    t1stage.reset(new ScanProcessingStep(req.select.begin, req.select.end, req.select.columns.at(0).ids));
+
+    std::unique_ptr<MaterializationStep> t2stage;
+    bool combine = req.group_by.enabled;
+    std::vector<aku_ParamId> ids;
+    if (combine) {
+        for(auto id: req.select.columns.at(0).ids) {
+            auto localid = req.group_by.find(id);
+            if (localid != 0) {
+                ids.push_back(localid);
+            }
+        }
+    } else {
+        ids = req.select.columns.at(0).ids;
+    }
+    auto order = req.agg.step == 0 ? OrderBy::SERIES : req.order_by;
+    t2stage.reset(new QuantileAggregate(std::move(ids), req.agg.func, req.select.begin, req.select.end,
+                                        req.agg.step, order, combine));
+
     result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage)));
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
-static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> aggregate_query_plan(ReshapeRequest const& req) {
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> aggregate_query_plan(ReshapeRequest const& req,
+                                                                                    QueryEstimate const* est)
+{
     // Hardwired query plan for aggregate query
     // Tier1
     // - List of aggregate operators
@@ -545,29 +1197,39 @@ static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> aggregate_query_plan(
         return std::make_tuple(AKU_EBAD_ARG, std::move(result));
     }
 
+    if (has_quantiles(req.agg.func)) {
+        return quantile_query_plan(req, est);
+    }
+
     std::unique_ptr<ProcessingPrelude> t1stage;
-    t1stage.reset(new AggregateProcessingStep(req.select.begin, req.select.end, req.select.columns.at(0).ids));
+    bool approximate = req.agg.approx_error > 0;
+    auto nworkers = get_parallelism(est, &QueryEstimate::nseries, MIN_SERIES_PER_WORKER);
+    t1stage.reset(new AggregateProcessingStep(req.select.begin, req.select.end, req.select.columns.at(0).ids,
+                                              approximate, nworkers));
 
     std::unique_ptr<MaterializationStep> t2stage;
     if (req.group_by.enabled) {
         std::vector<aku_ParamId> ids;
         for(auto id: req.select.columns.at(0).ids) {
-            auto it = req.group_by.transient_map.find(id);
-            if (it != req.group_by.transient_map.end()) {
-                ids.push_back(it->second);
+            auto localid = req.group_by.find(id);
+            if (localid != 0) {
+                ids.push_back(localid);
             }
         }
-        t2stage.reset(new AggregateCombiner(std::move(ids), req.agg.func.front()));
+        double rate = approximate ? req.agg.sample_rate : 1.0;
+        t2stage.reset(new AggregateCombiner(std::move(ids), req.agg.func.front(), rate));
     } else {
         auto ids = req.select.columns.at(0).ids;
         t2stage.reset(new Aggregate(std::move(ids), req.agg.func.front()));
     }
 
-    result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage)));
+    result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage), nworkers));
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
-static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> join_query_plan(ReshapeRequest const& req) {
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> join_query_plan(ReshapeRequest const& req,
+                                                                               QueryEstimate const* est)
+{
     std::unique_ptr<IQueryPlan> result;
 
     // Group-by and aggregation is not supported currently
@@ -597,18 +1259,56 @@ static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> join_query_plan(Resha
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
-static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> group_aggregate_query_plan(ReshapeRequest const& req) {
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> compare_query_plan(ReshapeRequest const& req,
+                                                                                  QueryEstimate const* est)
+{
+    // Query plan for select and group-aggregate queries with `compare` statement
+    // Tier1
+    // - List of scan or group aggregate operators, one for the query range and
+    //   one for every shifted range per series, shifted timestamps are aligned
+    //   with the query range
+    // Tier2
+    // - Join materializer, operators of the series are joined into one tuple
+    std::unique_ptr<IQueryPlan> result;
+
+    if (req.group_by.enabled || req.select.columns.size() != 1 ||
+        (req.agg.enabled && (req.agg.step == 0 || req.agg.func.size() != 1)))
+    {
+        return std::make_tuple(AKU_EBAD_ARG, std::move(result));
+    }
+
+    std::unique_ptr<CompareProcessingStep> compare;
+    compare.reset(new CompareProcessingStep(req.select.begin, req.select.end, req.compare, req.select.columns.at(0).ids));
+    if (req.agg.enabled) {
+        compare->step_ = req.agg.step;
+        compare->window_ = req.agg.window;
+        compare->func_ = req.agg.func.front();
+    }
+    std::unique_ptr<ProcessingPrelude> t1stage(std::move(compare));
+
+    std::unique_ptr<MaterializationStep> t2stage;
+    int cardinality = static_cast<int>(req.compare.size() + 1);
+    t2stage.reset(new Join(req.select.columns.at(0).ids, cardinality, req.order_by, req.select.begin, req.select.end));
+
+    result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage)));
+    return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
+
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> group_aggregate_query_plan(ReshapeRequest const& req,
+                                                                                          QueryEstimate const* est)
+{
     // Hardwired query plan for group aggregate query
     // Tier1
-    // - List of group aggregate operators
+    // - List of group aggregate operators (precomputed rollup tier is used
+    //   by the column-store if the step is a multiple of the tier's width)
     // Tier2
     // - If group-by is enabled:
-    //   - Transform ids and matcher (generate new names)
-    //   - Add merge materialization step (series or time order, depending on the
-    //     order-by clause.
+    //   - Transform ids (series of the same group get the same id)
+    //   - Combine operators of every group bucket by bucket
+    //   - Add series or time order materialization step
     // - Otherwise
-    //   - If oreder-by is series add chain materialization step.
-    //   - Otherwise add merge materializer.
+    //   - If oreder-by is series add series order materialization step.
+    //   - Otherwise add time order materializer.
     std::unique_ptr<IQueryPlan> result;
 
     if (!req.agg.enabled || req.agg.step == 0) {
@@ -616,34 +1316,106 @@ static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> group_aggregate_query
     }
 
     std::unique_ptr<ProcessingPrelude> t1stage;
-    t1stage.reset(new GroupAggregateProcessingStep(req.select.begin, req.select.end, req.agg.step, req.select.columns.at(0).ids));
+    if (req.agg.candlestick) {
+        // Candlesticks are not aligned to the step, subtree aggregates are used as is
+        t1stage.reset(new CandlestickProcessingStep(req.select.begin, req.select.end, req.agg.step, req.select.columns.at(0).ids));
+    } else if (has_quantiles(req.agg.func)) {
+        return quantile_query_plan(req, est);
+    } else {
+        t1stage.reset(new GroupAggregateProcessingStep(req.select.begin, req.select.end, req.agg.step, req.agg.window,
+                                                       req.select.columns.at(0).ids));
+    }
 
+    // Candlesticks are not aligned so the gaps can't be filled
+    TimeOrderAggregateMaterializer::Fill fill = {
+        req.agg.candlestick ? FillMode::NONE : req.agg.fill, req.select.begin, req.select.end, req.agg.step
+    };
+    std::unique_ptr<MaterializationStep> t2stage;
+    size_t nworkers = 1;
+    if (req.group_by.enabled && !req.agg.candlestick) {
+        std::vector<aku_ParamId> ids;
+        for(auto id: req.select.columns.at(0).ids) {
+            ids.push_back(req.group_by.find(id));
+        }
+        nworkers = get_parallelism(est, &QueryEstimate::nleaves, MIN_LEAVES_PER_WORKER);
+        t2stage.reset(new GroupAggregateCombiner(std::move(ids), req.agg.func, req.order_by, fill, nworkers));
+    } else if (req.order_by == OrderBy::SERIES) {
+        t2stage.reset(new SeriesOrderAggregate(req.select.columns.at(0).ids, req.agg.func, fill));
+    } else {
+        t2stage.reset(new TimeOrderAggregate(req.select.columns.at(0).ids, req.agg.func, fill));
+    }
+
+    result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage), nworkers));
+    return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
+
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> value_range_query_plan(ReshapeRequest const& req,
+                                                                                      QueryEstimate const* est)
+{
+    // Hardwired query plan for where-value query
+    // Tier1
+    // - List of value range operators (subtrees are skipped or returned
+    //   as a whole using their min and max values)
+    // Tier2
+    // - If oreder-by is series add series order materialization step.
+    // - Otherwise add time order materializer.
+    std::unique_ptr<IQueryPlan> result;
+
+    if (!req.agg.enabled || !req.filter.is_enabled()) {
+        return std::make_tuple(AKU_EBAD_ARG, std::move(result));
+    }
+
+    std::unique_ptr<ProcessingPrelude> t1stage;
+    t1stage.reset(new ValueRangeProcessingStep(req.select.begin, req.select.end, req.filter, req.select.columns.at(0).ids));
+
+    TimeOrderAggregateMaterializer::Fill fill = {
+        FillMode::NONE, req.select.begin, req.select.end, 0
+    };
     std::unique_ptr<MaterializationStep> t2stage;
     if (req.order_by == OrderBy::SERIES) {
-        t2stage.reset(new SeriesOrderAggregate(req.select.columns.at(0).ids, req.agg.func));
+        t2stage.reset(new SeriesOrderAggregate(req.select.columns.at(0).ids, req.agg.func, fill));
     } else {
-        t2stage.reset(new TimeOrderAggregate(req.select.columns.at(0).ids, req.agg.func));
+        t2stage.reset(new TimeOrderAggregate(req.select.columns.at(0).ids, req.agg.func, fill));
     }
 
     result.reset(new TwoStepQueryPlan(std::move(t1stage), std::move(t2stage)));
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
-std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> QueryPlanBuilder::create(const ReshapeRequest& req) {
-    if (req.agg.enabled && req.agg.step == 0) {
+static std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> create_plan(const ReshapeRequest& req,
+                                                                       QueryEstimate const* est)
+{
+    if (!req.compare.empty()) {
+        // Select or group aggregate query with shifted ranges
+        return compare_query_plan(req, est);
+    } else if (req.agg.enabled && req.agg.value_ranges) {
+        // Where-value query
+        return value_range_query_plan(req, est);
+    } else if (req.agg.enabled && req.agg.step == 0) {
         // Aggregate query
-        return aggregate_query_plan(req);
+        return aggregate_query_plan(req, est);
     } else if (req.agg.enabled && req.agg.step != 0) {
         // Group aggregate query
-        return group_aggregate_query_plan(req);
+        return group_aggregate_query_plan(req, est);
     } else if (req.agg.enabled == false && req.select.columns.size() > 1) {
         // Join query
-        return join_query_plan(req);
+        return join_query_plan(req, est);
     }
-    return scan_query_plan(req);
+    return scan_query_plan(req, est);
+}
+
+std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> QueryPlanBuilder::create(const ReshapeRequest& req) {
+    return create_plan(req, nullptr);
+}
+
+std::tuple<aku_Status, std::unique_ptr<IQueryPlan>> QueryPlanBuilder::create(const ReshapeRequest& req,
+                                                                             QueryEstimate const& est)
+{
+    return create_plan(req, &est);
 }
 
 void QueryPlanExecutor::execute(const StorageEngine::ColumnStore& cstore, std::unique_ptr<QP::IQueryPlan>&& iter, QP::IStreamProcessor& qproc) {
+    AKU_TRACE_SCOPE0(query_execute);
     aku_Status status = iter->execute(cstore);
     if (status != AKU_SUCCESS) {
         Logger::msg(AKU_LOG_ERROR, "Query plan error" + StatusUtil::str(status));
@@ -653,26 +1425,55 @@ void QueryPlanExecutor::execute(const StorageEngine::ColumnStore& cstore, std::u
     const size_t dest_size = 0x1000;
     std::vector<u8> dest;
     dest.resize(dest_size);
+    QP::SampleBatch batch;
     while(status == AKU_SUCCESS) {
         size_t size;
         // This is OK because normal query (aggregate or select) will write fixed size samples with size = sizeof(aku_Sample).
         //
         std::tie(status, size) = iter->read(reinterpret_cast<u8*>(dest.data()), dest_size);
+        if (status == AKU_SUCCESS) {
+            // Operators that don't read the tree (e.g. cached results) are stopped here
+            status = QueryCancellation::check();
+        }
+        if (status == AKU_ECLOSED) {
+            Logger::msg(AKU_LOG_TRACE, "Query cancelled by client");
+            qproc.set_error(status);
+            return;
+        }
         if (status != AKU_SUCCESS && (status != AKU_ENO_DATA && status != AKU_EUNAVAILABLE)) {
             Logger::msg(AKU_LOG_ERROR, "Iteration error " + StatusUtil::str(status));
             qproc.set_error(status);
             return;
         }
 
+        // Scalars are passed to the processing topology in batches, other
+        // samples (tuples) are passed one by one
         size_t pos = 0;
+        u64 nsamples = 0;
+        batch.clear();
         while(pos < size) {
             aku_Sample const* sample = reinterpret_cast<aku_Sample const*>(dest.data() + pos);
-            if (!qproc.put(*sample)) {
-                Logger::msg(AKU_LOG_TRACE, "Iteration stopped by client");
-                return;
+            nsamples++;
+            if (sample->payload.type == AKU_PAYLOAD_FLOAT && sample->payload.size == sizeof(aku_Sample)) {
+                batch.append(*sample);
+            } else {
+                if (!batch.empty() && !qproc.put_batch(batch)) {
+                    Logger::msg(AKU_LOG_TRACE, "Iteration stopped by client");
+                    return;
+                }
+                batch.clear();
+                if (!qproc.put(*sample)) {
+                    Logger::msg(AKU_LOG_TRACE, "Iteration stopped by client");
+                    return;
+                }
             }
             pos += sample->payload.size;
         }
+        QueryProfile::add(&QueryProfile::samples_in, nsamples);
+        if (!batch.empty() && !qproc.put_batch(batch)) {
+            Logger::msg(AKU_LOG_TRACE, "Iteration stopped by client");
+            return;
+        }
     }
 }
 
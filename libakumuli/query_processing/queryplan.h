@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "index/seriesparser.h"
@@ -29,10 +30,20 @@ struct IQueryPlan {
       * @return status of the operation (success or error code) and number of written bytes
       */
     virtual std::tuple<aku_Status, size_t> read(u8 *dest, size_t size) = 0;
+
+    //! Describe processing steps of the plan (JSON object)
+    virtual std::string explain() const = 0;
 };
 
 struct QueryPlanBuilder {
     static std::tuple<aku_Status, std::unique_ptr<IQueryPlan> > create(const ReshapeRequest& req);
+
+    /** Create query plan using the estimated size of the query (see ColumnStore::estimate).
+      * Estimate is used to choose the number of worker threads and to avoid the merge
+      * if only one series has data in the query range.
+      */
+    static std::tuple<aku_Status, std::unique_ptr<IQueryPlan> > create(const ReshapeRequest& req,
+                                                                       StorageEngine::QueryEstimate const& est);
 };
 
 struct QueryPlanExecutor {
@@ -28,26 +28,54 @@ bool SimpleRate::put(MutableSample &mut) {
         double* value = mut[ix];
         if (value) {
             // calculate new value
-            auto key = std::make_tuple(mut.get_paramid(), ix);
-            double oldX = 0;
-            aku_Timestamp oldT = 0;
-            auto it = table_.find(key);
-            if (it != table_.end()) {
-                oldT = std::get<0>(it->second);
-                oldX = std::get<1>(it->second);
-            }
+            auto& state = table_.get(mut.get_paramid(), ix, [] { return std::make_tuple(aku_Timestamp(0), 0.0); });
+            aku_Timestamp oldT = std::get<0>(state);
+            double oldX = std::get<1>(state);
             auto newT = mut.get_timestamp();
             double newX = *value;
             // Formula: rate = Δx/Δt
             const double nsec = 1000000000;
             double dX = (newX - oldX) / (newT - oldT) * nsec;
             *value = dX;
-            table_[key] = std::make_tuple(newT, newX);
+            state = std::make_tuple(newT, newX);
         }
     }
     return next_->put(mut);
 }
 
+bool SimpleRate::put_batch(SampleBatch& batch) {
+    const double nsec = 1000000000;
+    const size_t size = batch.size();
+    size_t ix = 0;
+    while (ix < size) {
+        // Values of the same series usually go one after another,
+        // the state is accessed once per run
+        auto id = batch.paramids[ix];
+        auto& state = table_.get(id, 0, [] { return std::make_tuple(aku_Timestamp(0), 0.0); });
+        aku_Timestamp oldT = std::get<0>(state);
+        double oldX = std::get<1>(state);
+        for (; ix < size && batch.paramids[ix] == id; ix++) {
+            auto newT = batch.timestamps[ix];
+            double newX = batch.values[ix];
+            batch.values[ix] = (newX - oldX) / (newT - oldT) * nsec;
+            oldT = newT;
+            oldX = newX;
+        }
+        state = std::make_tuple(oldT, oldX);
+    }
+    return next_->put_batch(batch);
+}
+
+void SimpleRate::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    table_.set_slots(slots);
+}
+
+bool SimpleRate::get_value_transform(StorageEngine::ValueTransform* dest) const {
+    dest->kind = StorageEngine::ValueTransform::Kind::RATE;
+    dest->weight = 1.0;
+    return true;
+}
+
 void SimpleRate::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -80,24 +108,18 @@ bool CumulativeSum::put(MutableSample &mut) {
         double* value = mut[ix];
         if (value) {
             // calculate new value
-            auto key = std::make_tuple(mut.get_paramid(), ix);
-            double prev = 0;
-            auto it = table_.find(key);
-            if (it != table_.end()) {
-                prev = it->second;
-            } else {
-                table_[key] = 0;
-                it = table_.find(key);
-            }
-            double cur = *value;
-            double sum = cur + prev;
+            double& sum = table_.get(mut.get_paramid(), ix, [] { return 0.0; });
+            sum += *value;
             *value = sum;
-            it->second = sum;
         }
     }
     return next_->put(mut);
 }
 
+void CumulativeSum::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    table_.set_slots(slots);
+}
+
 void CumulativeSum::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -9,10 +9,7 @@ namespace QP {
 
 struct SimpleRate : Node {
 
-    std::unordered_map< std::tuple<aku_ParamId, u32>
-                      , std::tuple<aku_Timestamp, double>
-                      , KeyHash
-                      , KeyEqual> table_;
+    SeriesState<std::tuple<aku_Timestamp, double>> table_;
 
     std::shared_ptr<Node> next_;
 
@@ -24,6 +21,12 @@ struct SimpleRate : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual bool put_batch(SampleBatch& batch);
+
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
+    virtual bool get_value_transform(StorageEngine::ValueTransform* dest) const;
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -31,10 +34,7 @@ struct SimpleRate : Node {
 
 struct CumulativeSum : Node {
 
-    std::unordered_map< std::tuple<aku_ParamId, u32>
-                      , double
-                      , KeyHash
-                      , KeyEqual> table_;
+    SeriesState<double> table_;
 
     std::shared_ptr<Node> next_;
 
@@ -46,6 +46,8 @@ struct CumulativeSum : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
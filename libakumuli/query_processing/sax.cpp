@@ -44,26 +44,37 @@ void SAXNode::complete() {
     next_->complete();
 }
 
+SAX::SAXEncoder& SAXNode::get_encoder(aku_ParamId id) {
+    auto it = encoders_.find(id);
+    if (it == encoders_.end()) {
+        it = encoders_.insert(std::make_pair(id, SAX::SAXEncoder(alphabet_size_, window_width_))).first;
+    }
+    return it->second;
+}
+
+bool SAXNode::put_word(aku_ParamId id, aku_Timestamp ts, const char* word) {
+    aku_Sample sample = {};
+    sample.paramid = id;
+    sample.timestamp = ts;
+    MutableSample mut(&sample);
+    mut.convert_to_sax_word(static_cast<u32>(window_width_));
+    memcpy(mut.get_payload(), word, static_cast<size_t>(window_width_));
+    if (inverse_) {
+        std::reverse(mut.get_payload(), mut.get_payload() + window_width_);
+    }
+    return next_->put(mut);
+}
+
 bool SAXNode::put(MutableSample &sample) {
     if (sample.size() != 1) {
         // Not supported, SAX works only with scalars
         set_error(AKU_EHIGH_CARDINALITY);
         return false;
     }
-    if ((sample.payload_.sample.payload.type & aku_PData::REGULLAR) == 0) {
-        // Not supported, SAX require regullar data
-        set_error(AKU_EREGULLAR_EXPECTED);
-        return false;
-    }
-    auto key = sample.get_paramid();
-    auto it = encoders_.find(key);
-    if (it == encoders_.end()) {
-        encoders_[key] = SAX::SAXEncoder(alphabet_size_, window_width_);
-        it = encoders_.find(key);
-    }
     double* value = sample[0];
     if (value) {
-        if (it->second.encode(*value, buffer_, static_cast<size_t>(window_width_))) {
+        auto& encoder = get_encoder(sample.get_paramid());
+        if (encoder.encode(*value, buffer_, static_cast<size_t>(window_width_))) {
             sample.convert_to_sax_word(static_cast<u32>(window_width_));
             memcpy(sample.get_payload(), buffer_, static_cast<size_t>(window_width_));
             if (inverse_) {
@@ -78,6 +89,32 @@ bool SAXNode::put(MutableSample &sample) {
     return true;
 }
 
+bool SAXNode::put_batch(SampleBatch& batch) {
+    const size_t width = static_cast<size_t>(window_width_);
+    size_t begin = 0;
+    while (begin < batch.size()) {
+        // Encode run of values of the same series at once
+        auto id = batch.paramids[begin];
+        size_t end = begin + 1;
+        while (end < batch.size() && batch.paramids[end] == id) {
+            end++;
+        }
+        size_t size = end - begin;
+        words_.resize(size * width);
+        indexes_.resize(size);
+        auto& encoder = get_encoder(id);
+        auto nwords = encoder.encode(batch.values.data() + begin, size, words_.data(), indexes_.data());
+        for (size_t i = 0; i < nwords; i++) {
+            auto ts = batch.timestamps[begin + indexes_[i]];
+            if (!put_word(id, ts, words_.data() + i*width)) {
+                return false;
+            }
+        }
+        begin = end;
+    }
+    return true;
+}
+
 void SAXNode::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -86,6 +123,6 @@ int SAXNode::get_requirements() const {
     return GROUP_BY_REQUIRED;
 }
 
-//static QueryParserToken<SAXNode> sax_token("sax");
+static QueryParserToken<SAXNode> sax_token("sax");
 
 }}  // namespace
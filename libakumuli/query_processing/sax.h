@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "../queryprocessor_framework.h"
 #include "../saxencoder.h"
@@ -23,6 +24,9 @@ struct SAXNode : Node {
     bool disable_value_;
     bool inverse_;
     char buffer_[MutableSample::MAX_PAYLOAD_SIZE];
+    //! Words and indexes of the encoded batch
+    std::vector<char>   words_;
+    std::vector<size_t> indexes_;
 
     SAXNode(int alphabet_size, int window_width, bool disable_original_value,
             std::shared_ptr<Node> next);
@@ -33,9 +37,17 @@ struct SAXNode : Node {
 
     virtual bool put(MutableSample &sample);
 
+    virtual bool put_batch(SampleBatch& batch);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
+
+private:
+    SAX::SAXEncoder& get_encoder(aku_ParamId id);
+
+    //! Send SAX word to the next node
+    bool put_word(aku_ParamId id, aku_Timestamp ts, const char* word);
 };
 }
 }  // namespace
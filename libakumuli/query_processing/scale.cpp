@@ -42,6 +42,24 @@ bool Scale::put(MutableSample &mut) {
     return next_->put(mut);
 }
 
+bool Scale::put_batch(SampleBatch& batch) {
+    // Batch contains scalars so only the first weight is used
+    if (!weights_.empty()) {
+        const double weight = weights_.front();
+        for (auto& value: batch.values) {
+            value *= weight;
+        }
+    }
+    return next_->put_batch(batch);
+}
+
+bool Scale::get_value_transform(StorageEngine::ValueTransform* dest) const {
+    // Scan query produces scalars so only the first weight is used
+    dest->kind = StorageEngine::ValueTransform::Kind::SCALE;
+    dest->weight = weights_.empty() ? 1.0 : weights_.front();
+    return true;
+}
+
 void Scale::set_error(aku_Status status) {
     next_->set_error(status);
 }
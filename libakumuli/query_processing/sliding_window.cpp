@@ -1,6 +1,9 @@
 #include "sliding_window.h"
 #include "../storage_engine/operators/aggregate.h"
 
+#include <cmath>
+#include <iterator>
+
 namespace Akumuli {
 namespace QP {
 
@@ -74,7 +77,7 @@ void EWMAPrediction::complete() {
 }
 
 bool EWMAPrediction::put(MutableSample &mut) {
-    if ((mut.payload_.sample.payload.type & aku_PData::REGULLAR) == 0) {
+    if ((mut.get_sample().payload.type & aku_PData::REGULLAR) == 0) {
         // Not supported, query require regullar data
         set_error(AKU_EREGULLAR_EXPECTED);
         return false;
@@ -85,11 +88,7 @@ bool EWMAPrediction::put(MutableSample &mut) {
         double* value = mut[ix];
         if (value) {
             // calculate new value
-            auto key = std::make_tuple(mut.get_paramid(), ix);
-            if (swind_.count(key) == 0) {
-                swind_[key] = EWMA(decay_);
-            }
-            EWMA& ewma = swind_[key];
+            EWMA& ewma = swind_.get(mut.get_paramid(), ix, [this] { return EWMA(decay_); });
             double exp = ewma.get(*value);
             ewma.add(*value);
             if (delta_) {
@@ -103,6 +102,10 @@ bool EWMAPrediction::put(MutableSample &mut) {
     return next_->put(mut);
 }
 
+void EWMAPrediction::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    swind_.set_slots(slots);
+}
+
 void EWMAPrediction::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -153,12 +156,14 @@ double SMA::get() const {
 
 SMAPrediction::SMAPrediction(size_t window_width, bool calculate_delta, std::shared_ptr<Node> next)
     : width_(window_width)
+    , next_(next)
     , delta_(calculate_delta)
 {
 }
 
 SMAPrediction::SMAPrediction(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
-    : delta_(false)
+    : next_(next)
+    , delta_(false)
 {
     width_ = ptree.get<double>("window-width");
 }
@@ -168,7 +173,7 @@ void SMAPrediction::complete() {
 }
 
 bool SMAPrediction::put(MutableSample& mut) {
-    if ((mut.payload_.sample.payload.type & aku_PData::REGULLAR) == 0) {
+    if ((mut.get_sample().payload.type & aku_PData::REGULLAR) == 0) {
         // Not supported, query require regullar data
         set_error(AKU_EREGULLAR_EXPECTED);
         return false;
@@ -178,11 +183,7 @@ bool SMAPrediction::put(MutableSample& mut) {
         double* value = mut[ix];
         if (value) {
             // calculate new value
-            auto key = std::make_tuple(mut.get_paramid(), ix);
-            if (swind_.count(key) == 0) {
-                swind_[key] = SMA(width_);
-            }
-            SMA& sma = swind_[key];
+            SMA& sma = swind_.get(mut.get_paramid(), ix, [this] { return SMA(width_); });
             double exp = sma.get();
             sma.add(*value);
             if (delta_) {
@@ -196,6 +197,10 @@ bool SMAPrediction::put(MutableSample& mut) {
     return next_->put(mut);
 }
 
+void SMAPrediction::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    swind_.set_slots(slots);
+}
+
 void SMAPrediction::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -237,19 +242,23 @@ bool CMAPrediction::put(MutableSample& mut) {
         double* value = mut[ix];
         if (value) {
             // calculate new value
-            auto key = std::make_tuple(mut.get_paramid(), ix);
+            auto& state = swind_.get(mut.get_paramid(), ix, [] { return std::make_pair(0.0, size_t(0)); });
             double sum;
             size_t cnt;
-            std::tie(sum, cnt) = swind_[key];
+            std::tie(sum, cnt) = state;
             sum += *value;
             cnt += 1;
-            swind_[key] = std::make_pair(sum + *value, cnt + 1);
+            state = std::make_pair(sum + *value, cnt + 1);
             *value = sum / cnt;
         }
     }
     return next_->put(mut);
 }
 
+void CMAPrediction::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    swind_.set_slots(slots);
+}
+
 void CMAPrediction::set_error(aku_Status status) {
     next_->set_error(status);
 }
@@ -258,6 +267,210 @@ int CMAPrediction::get_requirements() const {
     return TERMINAL;
 }
 
+// ---------------
+// Rolling windows
+// ---------------
+
+static size_t get_window_width(boost::property_tree::ptree const& ptree) {
+    auto width = ptree.get<size_t>("window-width");
+    if (width == 0) {
+        NodeException err("`window-width` can't be zero");
+        BOOST_THROW_EXCEPTION(err);
+    }
+    return width;
+}
+
+RollingMinMax::RollingMinMax()
+    : count_(0)
+    , width_(1)
+    , max_(false)
+{
+}
+
+RollingMinMax::RollingMinMax(size_t n, bool max)
+    : count_(0)
+    , width_(n)
+    , max_(max)
+{
+}
+
+void RollingMinMax::add(double value) {
+    // Dominated values will never be returned
+    while (!deque_.empty() && (max_ ? deque_.back().second <= value : deque_.back().second >= value)) {
+        deque_.pop_back();
+    }
+    deque_.push_back(std::make_pair(count_, value));
+    if (deque_.front().first + width_ <= count_) {
+        // Left the window
+        deque_.pop_front();
+    }
+    count_++;
+}
+
+double RollingMinMax::get() const {
+    return deque_.front().second;
+}
+
+RollingQuantile::RollingQuantile()
+    : buffer_(1)
+    , q_(0.5)
+{
+}
+
+RollingQuantile::RollingQuantile(size_t n, double q)
+    : buffer_(n)
+    , q_(q)
+{
+}
+
+void RollingQuantile::add(double value) {
+    if (buffer_.full()) {
+        // Every value of the lower set is not larger than any value of the upper set
+        double old = buffer_.front();
+        if (!low_.empty() && old <= *low_.rbegin()) {
+            low_.erase(low_.find(old));
+        } else {
+            high_.erase(high_.find(old));
+        }
+    }
+    buffer_.push_back(value);
+    if (low_.empty() || value <= *low_.rbegin()) {
+        low_.insert(value);
+    } else {
+        high_.insert(value);
+    }
+    size_t rank = static_cast<size_t>(q_*static_cast<double>(buffer_.size() - 1)) + 1;
+    while (low_.size() > rank) {
+        auto it = std::prev(low_.end());
+        high_.insert(*it);
+        low_.erase(it);
+    }
+    while (low_.size() < rank) {
+        auto it = high_.begin();
+        low_.insert(*it);
+        high_.erase(it);
+    }
+}
+
+double RollingQuantile::get() const {
+    return *low_.rbegin();
+}
+
+RollingMinMaxNode::RollingMinMaxNode(size_t window_width, bool max, std::shared_ptr<Node> next)
+    : width_(window_width)
+    , max_(max)
+    , next_(next)
+{
+}
+
+void RollingMinMaxNode::complete() {
+    next_->complete();
+}
+
+bool RollingMinMaxNode::put(MutableSample& mut) {
+    if ((mut.get_sample().payload.type & aku_PData::REGULLAR) == 0) {
+        // Not supported, query require regullar data
+        set_error(AKU_EREGULLAR_EXPECTED);
+        return false;
+    }
+    auto size = mut.size();
+    for (u32 ix = 0; ix < size; ix++) {
+        double* value = mut[ix];
+        // NaN values are not ordered, they're passed as is
+        if (value && !std::isnan(*value)) {
+            RollingMinMax& wnd = swind_.get(mut.get_paramid(), ix, [this] { return RollingMinMax(width_, max_); });
+            wnd.add(*value);
+            *value = wnd.get();
+        }
+    }
+    return next_->put(mut);
+}
+
+void RollingMinMaxNode::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    swind_.set_slots(slots);
+}
+
+void RollingMinMaxNode::set_error(aku_Status status) {
+    next_->set_error(status);
+}
+
+int RollingMinMaxNode::get_requirements() const {
+    return TERMINAL;
+}
+
+struct RollingMin : RollingMinMaxNode {
+    RollingMin(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
+        : RollingMinMaxNode(get_window_width(ptree), false, next)
+    {
+    }
+};
+
+struct RollingMax : RollingMinMaxNode {
+    RollingMax(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
+        : RollingMinMaxNode(get_window_width(ptree), true, next)
+    {
+    }
+};
+
+RollingQuantileNode::RollingQuantileNode(size_t window_width, double q, std::shared_ptr<Node> next)
+    : width_(window_width)
+    , q_(q)
+    , next_(next)
+{
+}
+
+RollingQuantileNode::RollingQuantileNode(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
+    : width_(get_window_width(ptree))
+    , q_(ptree.get<double>("quantile"))
+    , next_(next)
+{
+    if (!(q_ >= 0.0 && q_ <= 1.0)) {
+        NodeException err("`quantile` should be in [0, 1] range");
+        BOOST_THROW_EXCEPTION(err);
+    }
+}
+
+void RollingQuantileNode::complete() {
+    next_->complete();
+}
+
+bool RollingQuantileNode::put(MutableSample& mut) {
+    if ((mut.get_sample().payload.type & aku_PData::REGULLAR) == 0) {
+        // Not supported, query require regullar data
+        set_error(AKU_EREGULLAR_EXPECTED);
+        return false;
+    }
+    auto size = mut.size();
+    for (u32 ix = 0; ix < size; ix++) {
+        double* value = mut[ix];
+        if (value && !std::isnan(*value)) {
+            RollingQuantile& wnd = swind_.get(mut.get_paramid(), ix, [this] { return RollingQuantile(width_, q_); });
+            wnd.add(*value);
+            *value = wnd.get();
+        }
+    }
+    return next_->put(mut);
+}
+
+void RollingQuantileNode::set_series_slots(std::shared_ptr<const SeriesSlots> slots) {
+    swind_.set_slots(slots);
+}
+
+void RollingQuantileNode::set_error(aku_Status status) {
+    next_->set_error(status);
+}
+
+int RollingQuantileNode::get_requirements() const {
+    return TERMINAL;
+}
+
+struct RollingMedian : RollingQuantileNode {
+    RollingMedian(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
+        : RollingQuantileNode(get_window_width(ptree), 0.5, next)
+    {
+    }
+};
+
 static QueryParserToken<EWMAPredictionError> ewma_error_token("ewma-error");
 static QueryParserToken<EWMAPrediction> ewma_token("ewma");
 
@@ -266,4 +479,9 @@ static QueryParserToken<SMAPrediction> sma_token("sma");
 
 static QueryParserToken<CMAPrediction> cma_token("cma");
 
+static QueryParserToken<RollingMin> rolling_min_token("rolling-min");
+static QueryParserToken<RollingMax> rolling_max_token("rolling-max");
+static QueryParserToken<RollingMedian> rolling_median_token("rolling-median");
+static QueryParserToken<RollingQuantileNode> rolling_quantile_token("rolling-quantile");
+
 }}  // namespace
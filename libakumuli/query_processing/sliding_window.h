@@ -7,9 +7,12 @@
   * - Simple moving average
   * - Exponentially weighted moving average
   * - Cumulative moving average
+  * - Rolling min, max and quantile
   */
 
+#include <deque>
 #include <memory>
+#include <set>
 
 #include "../queryprocessor_framework.h"
 #include <boost/circular_buffer.hpp>
@@ -35,7 +38,7 @@ public:
 
 struct EWMAPrediction : Node {
     double decay_;
-    std::unordered_map<std::tuple<aku_ParamId, u32>, EWMA, KeyHash, KeyEqual> swind_;
+    SeriesState<EWMA> swind_;
     std::shared_ptr<Node> next_;
     const bool delta_;
 
@@ -47,6 +50,8 @@ struct EWMAPrediction : Node {
 
     virtual bool put(MutableSample& sample);
 
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -72,7 +77,7 @@ struct SMA {
 
 struct SMAPrediction : Node {
     size_t width_;
-    std::unordered_map<std::tuple<aku_ParamId, u32>, SMA, KeyHash, KeyEqual> swind_;
+    SeriesState<SMA> swind_;
     std::shared_ptr<Node> next_;
     const bool delta_;
 
@@ -84,6 +89,8 @@ struct SMAPrediction : Node {
 
     virtual bool put(MutableSample& mut);
 
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -94,7 +101,7 @@ struct SMAPrediction : Node {
 // -------------------------
 
 struct CMAPrediction : Node {
-    std::unordered_map<std::tuple<aku_ParamId, u32>, std::pair<double, size_t>, KeyHash, KeyEqual> swind_;
+    SeriesState<std::pair<double, size_t>> swind_;
     std::shared_ptr<Node> next_;
 
     CMAPrediction(std::shared_ptr<Node> next);
@@ -105,6 +112,97 @@ struct CMAPrediction : Node {
 
     virtual bool put(MutableSample& mut);
 
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
+    virtual void set_error(aku_Status status);
+
+    virtual int get_requirements() const;
+};
+
+// ---------------
+// Rolling windows
+// ---------------
+
+/** Min or max of the last N values. Monotonic deque, amortized O(1) update:
+  * values that can't become the extremum before they leave the window are
+  * dropped when the new value is added.
+  */
+struct RollingMinMax {
+    //! Sequence number and value
+    std::deque<std::pair<u64, double>> deque_;
+    u64 count_;
+    size_t width_;
+    bool max_;
+
+    RollingMinMax();
+
+    RollingMinMax(size_t n, bool max);
+
+    void add(double value);
+
+    double get() const;
+};
+
+/** Quantile of the last N values (nearest rank, lower value is used for
+  * even windows). Window is split into two ordered sets, lower one contains
+  * exactly rank values so the quantile is its largest element, O(log N) update.
+  */
+struct RollingQuantile {
+    boost::circular_buffer<double> buffer_;
+    std::multiset<double> low_;
+    std::multiset<double> high_;
+    double q_;
+
+    RollingQuantile();
+
+    RollingQuantile(size_t n, double q);
+
+    void add(double value);
+
+    double get() const;
+};
+
+/** Replaces every value with the min or max of the last `window-width`
+  * values of the series (including the current one).
+  */
+struct RollingMinMaxNode : Node {
+    size_t width_;
+    const bool max_;
+    SeriesState<RollingMinMax> swind_;
+    std::shared_ptr<Node> next_;
+
+    RollingMinMaxNode(size_t window_width, bool max, std::shared_ptr<Node> next);
+
+    virtual void complete();
+
+    virtual bool put(MutableSample& mut);
+
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
+    virtual void set_error(aku_Status status);
+
+    virtual int get_requirements() const;
+};
+
+/** Replaces every value with the quantile of the last `window-width`
+  * values of the series (including the current one).
+  */
+struct RollingQuantileNode : Node {
+    size_t width_;
+    double q_;
+    SeriesState<RollingQuantile> swind_;
+    std::shared_ptr<Node> next_;
+
+    RollingQuantileNode(size_t window_width, double q, std::shared_ptr<Node> next);
+
+    RollingQuantileNode(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next);
+
+    virtual void complete();
+
+    virtual bool put(MutableSample& mut);
+
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
     virtual void set_error(aku_Status status);
 
     virtual int get_requirements() const;
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <unordered_map>
 
 #include "../queryprocessor_framework.h"
+#include "index/invertedindex.h"
+#include "log_iface.h"
 
 namespace Akumuli {
 namespace QP {
@@ -18,11 +22,32 @@ struct SpaceSaver : Node {
         aku_Timestamp time;
     };
 
+    enum {
+        //! Approximate memory used by one counter
+        COUNTER_SIZE = sizeof(Item) + sizeof(aku_ParamId) + 4*sizeof(void*),
+        //! Min number of counters, used even if they don't fit into the memory budget
+        MIN_COUNTERS = 0x100,
+    };
+
     std::unordered_map<aku_ParamId, Item> counters_;
     //! Capacity
     double N;
     size_t M;
     double P;
+    //! Memory used by the counters
+    StorageEngine::QueryMemoryReservation mem_;
+
+    /** Reserve memory for M counters. If the counters don't fit into the memory
+      * budget of the query their number is reduced (error bound grows).
+      */
+    void reserve_counters() {
+        while (M > MIN_COUNTERS && !mem_.grow(M*COUNTER_SIZE)) {
+            M /= 2;
+        }
+        if (M <= MIN_COUNTERS) {
+            mem_.grow(M*COUNTER_SIZE);
+        }
+    }
 
     /** C-tor.
       * @param error is a allowed error value between 0 and 1
@@ -38,6 +63,7 @@ struct SpaceSaver : Node {
     {
         assert(P >= 0.0);
         assert(P <= 1.0);
+        reserve_counters();
     }
 
     SpaceSaver(boost::property_tree::ptree const& ptree, std::shared_ptr<Node> next)
@@ -60,6 +86,144 @@ struct SpaceSaver : Node {
             QueryParserError error("`portion` can't be greater then 1.");
             BOOST_THROW_EXCEPTION(error);
         }
+        auto requested = M;
+        reserve_counters();
+        if (M != requested) {
+            Logger::msg(AKU_LOG_INFO, "Query memory budget exceeded, number of counters reduced from "
+                                      + std::to_string(requested) + " to " + std::to_string(M));
+        }
+    }
+
+    //! Find counter with the smallest count (summary shouldn't be empty)
+    typename std::unordered_map<aku_ParamId, Item>::iterator find_min() {
+        auto min_iter = counters_.begin();
+        for (auto i = counters_.begin(); i != counters_.end(); i++) {
+            if (i->second.count < min_iter->second.count) {
+                min_iter = i;
+            }
+        }
+        return min_iter;
+    }
+
+    //! Smallest count that an unknown item can have
+    double get_min_count() const {
+        if (counters_.size() < M) {
+            return 0;
+        }
+        double min = std::numeric_limits<double>::max();
+        for (auto const& kv: counters_) {
+            min = std::min(min, kv.second.count);
+        }
+        return min;
+    }
+
+    /** Merge summary computed on other part of the stream (e.g. by other worker).
+      * Items that are missing from one of the summaries are assumed to have the
+      * smallest count of that summary, only M largest counters are kept.
+      * Summaries should be created with the same error value.
+      */
+    void merge(SpaceSaver const& other) {
+        auto min_this  = get_min_count();
+        auto min_other = other.get_min_count();
+        std::vector<std::pair<aku_ParamId, Item>> items;
+        for (auto const& kv: counters_) {
+            auto item = kv.second;
+            auto it = other.counters_.find(kv.first);
+            if (it != other.counters_.end()) {
+                item.count += it->second.count;
+                item.error += it->second.error;
+            } else {
+                item.count += min_other;
+                item.error += min_other;
+            }
+            items.push_back(std::make_pair(kv.first, item));
+        }
+        for (auto const& kv: other.counters_) {
+            if (counters_.count(kv.first) == 0) {
+                auto item = kv.second;
+                item.count += min_this;
+                item.error += min_this;
+                items.push_back(std::make_pair(kv.first, item));
+            }
+        }
+        if (items.size() > M) {
+            std::nth_element(items.begin(), items.begin() + static_cast<std::ptrdiff_t>(M), items.end(),
+                             [](std::pair<aku_ParamId, Item> const& lhs, std::pair<aku_ParamId, Item> const& rhs) {
+                                 return lhs.second.count > rhs.second.count;
+                             });
+            items.resize(M);
+        }
+        counters_.clear();
+        counters_.insert(items.begin(), items.end());
+        N += other.N;
+    }
+
+    static u64 to_bits(double x) {
+        u64 bits;
+        memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
+
+    static double from_bits(u64 bits) {
+        double x;
+        memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+
+    /** Write compact representation of the summary to the buffer.
+      * Integers are base 128 encoded, doubles are stored as their bit patterns.
+      */
+    void serialize(std::vector<char>* dest) const {
+        details::Base128StreamWriter stream(*dest);
+        stream.put(M);
+        stream.put(to_bits(N));
+        stream.put(counters_.size());
+        for (auto const& kv: counters_) {
+            stream.put(kv.first);
+            stream.put(to_bits(kv.second.count));
+            stream.put(to_bits(kv.second.error));
+            stream.put(kv.second.time);
+        }
+    }
+
+    /** Read summary written by `serialize` and merge it into this summary.
+      * @return AKU_EBAD_DATA if the data is damaged or the error value doesn't match
+      */
+    aku_Status deserialize(const char* begin, const char* end) {
+        auto pos  = reinterpret_cast<const unsigned char*>(begin);
+        auto last = reinterpret_cast<const unsigned char*>(end);
+        auto read = [&pos, last](u64* dest) {
+            if (pos == last) {
+                return false;
+            }
+            details::Base128Int<u64> val;
+            auto next = val.get(pos, last);
+            if (next == pos) {
+                return false;
+            }
+            pos = next;
+            *dest = static_cast<u64>(val);
+            return true;
+        };
+        u64 m, n, size;
+        if (!read(&m) || m != M || !read(&n) || !read(&size) || size > M) {
+            return AKU_EBAD_DATA;
+        }
+        SpaceSaver other(1.0, P, next_);
+        other.M = M;
+        other.N = from_bits(n);
+        for (u64 i = 0; i < size; i++) {
+            u64 id, count, error, time;
+            if (!read(&id) || !read(&count) || !read(&error) || !read(&time)) {
+                return AKU_EBAD_DATA;
+            }
+            other.counters_[id] = { from_bits(count), from_bits(error), time };
+        }
+        if (pos != last) {
+            return AKU_EBAD_DATA;
+        }
+        merge(other);
+        return AKU_SUCCESS;
     }
 
     bool count() {
@@ -100,7 +264,7 @@ struct SpaceSaver : Node {
 
     virtual bool put(MutableSample& sample) {
         // Require scalar
-        if ((sample.payload_.sample.payload.type & AKU_PAYLOAD_FLOAT) != AKU_PAYLOAD_FLOAT) {
+        if ((sample.get_sample().payload.type & AKU_PAYLOAD_FLOAT) != AKU_PAYLOAD_FLOAT) {
             // Query doesn't work with tuples
             set_error(AKU_EHIGH_CARDINALITY);
             return false;
@@ -123,14 +287,8 @@ struct SpaceSaver : Node {
             double error = 0;
             if (counters_.size() == M) {
                 // remove element with smallest count
-                size_t min      = std::numeric_limits<size_t>::max();
-                auto   min_iter = it;
-                for (auto i = counters_.begin(); i != counters_.end(); i++) {
-                    if (i->second.count < min) {
-                        min_iter = i;
-                        min      = i->second.count;
-                    }
-                }
+                auto min_iter = find_min();
+                double min    = min_iter->second.count;
                 counters_.erase(min_iter);
                 count += min;
                 error = min;
@@ -1,4 +1,7 @@
 #include "top.h"
+#include "log_iface.h"
+
+#include <algorithm>
 
 namespace Akumuli {
 namespace QP {
@@ -15,23 +18,57 @@ TopN::TopN(const boost::property_tree::ptree& ptree, std::shared_ptr<Node> next)
     N_ = ptree.get<size_t>("N");
 }
 
+//! Order of the result, ties are resolved using series ids
+static bool greater(TopN::Context const& lhs, TopN::Context const& rhs) {
+    if (lhs.sum != rhs.sum) {
+        return lhs.sum > rhs.sum;
+    }
+    return lhs.id < rhs.id;
+}
+
+TopN::Heap::Heap(size_t N)
+    : N_(N)
+{
+}
+
+void TopN::Heap::add(Context const& ctx) {
+    if (N_ == 0) {
+        return;
+    }
+    if (heap_.size() < N_) {
+        heap_.push_back(ctx);
+        std::push_heap(heap_.begin(), heap_.end(), &greater);
+    } else if (greater(ctx, heap_.front())) {
+        std::pop_heap(heap_.begin(), heap_.end(), &greater);
+        heap_.back() = ctx;
+        std::push_heap(heap_.begin(), heap_.end(), &greater);
+    }
+}
+
+void TopN::Heap::merge(Heap const& other) {
+    for (auto const& ctx: other.heap_) {
+        add(ctx);
+    }
+}
+
+std::vector<TopN::Context> TopN::Heap::extract() {
+    std::sort_heap(heap_.begin(), heap_.end(), &greater);
+    std::vector<Context> result;
+    result.swap(heap_);
+    return result;
+}
+
 void TopN::complete() {
-    std::vector<const Context*> ctx;
+    Heap heap(N_);
     for (const auto& p: table_) {
-        ctx.push_back(&p.second);
+        heap.add(p.second);
     }
-    std::sort(ctx.begin(), ctx.end(), [](const Context* lhs, const Context* rhs) {
-        return lhs->sum > rhs->sum;
-    });
-    for (size_t i = 0; i < N_; i++) {
-        if (i >= ctx.size()) {
-            break;
-        }
+    for (auto const& ctx: heap.extract()) {
         aku_Sample sample;
-        sample.paramid = ctx[i]->id;
-        sample.timestamp = ctx[i]->last_ts;
+        sample.paramid = ctx.id;
+        sample.timestamp = ctx.last_ts;
         sample.payload.size    = sizeof(aku_Sample);
-        sample.payload.float64 = ctx[i]->sum;
+        sample.payload.float64 = ctx.sum;
         sample.payload.type = AKU_PAYLOAD_FLOAT;
         MutableSample mut(&sample);
         if (!next_->put(mut)) {
@@ -44,7 +81,7 @@ void TopN::complete() {
 bool TopN::put(MutableSample& sample) {
     static const double nanosinsec = 1000000000.0;
     // Require scalar
-    if ((sample.payload_.sample.payload.type & AKU_PAYLOAD_FLOAT) != AKU_PAYLOAD_FLOAT) {
+    if ((sample.get_sample().payload.type & AKU_PAYLOAD_FLOAT) != AKU_PAYLOAD_FLOAT) {
         // Query doesn't work with tuples
         set_error(AKU_EHIGH_CARDINALITY);
         return false;
@@ -53,6 +90,12 @@ bool TopN::put(MutableSample& sample) {
     auto key = sample.get_paramid();
     auto it = table_.find(key);
     if (it == table_.end()) {
+        if ((table_.size() + 1)*ENTRY_SIZE > mem_.size() && !mem_.grow(RESERVE_STEP*ENTRY_SIZE)) {
+            Logger::msg(AKU_LOG_ERROR, "Query memory budget exceeded by `top` ("
+                                       + std::to_string(table_.size()) + " series)");
+            set_error(AKU_ENO_MEM);
+            return false;
+        }
         bool inserted;
         std::tie(it, inserted) = table_.insert(std::make_pair(key, Context{}));
         assert(inserted);
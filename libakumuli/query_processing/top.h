@@ -16,6 +16,35 @@ struct TopN : Node {
         aku_ParamId id;
     };
 
+    /** Bounded set of the N series with the largest sums.
+      * Memory usage doesn't depend on the number of series. Partial results
+      * (e.g. computed by different workers) can be merged.
+      */
+    class Heap {
+        size_t N_;
+        //! Min-heap, the smallest of the selected series is at the front
+        std::vector<Context> heap_;
+
+    public:
+        Heap(size_t N);
+
+        //! Add series to the set (series is added only if it's larger than the smallest one)
+        void add(Context const& ctx);
+
+        //! Add all series from the other set
+        void merge(Heap const& other);
+
+        //! Get selected series in descending order, the set becomes empty
+        std::vector<Context> extract();
+    };
+
+    enum {
+        //! Approximate memory used by one series in the table
+        ENTRY_SIZE = sizeof(Context) + 4*sizeof(void*),
+        //! Number of table entries reserved at once
+        RESERVE_STEP = 0x1000,
+    };
+
     std::unordered_map< aku_ParamId
                       , Context
                       > table_;
@@ -24,6 +53,9 @@ struct TopN : Node {
 
     size_t N_;
 
+    //! Memory used by the table, query fails when it doesn't fit into the budget
+    StorageEngine::QueryMemoryReservation mem_;
+
     TopN(size_t N, std::shared_ptr<Node> next);
 
     TopN(const boost::property_tree::ptree&, std::shared_ptr<Node> next);
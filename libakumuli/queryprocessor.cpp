@@ -66,6 +66,10 @@ bool ScanQueryProcessor::put(const aku_Sample &sample) {
     return root_node_->put(mut);
 }
 
+bool ScanQueryProcessor::put_batch(SampleBatch& batch) {
+    return root_node_->put_batch(batch);
+}
+
 void ScanQueryProcessor::stop() {
     root_node_->complete();
 }
@@ -82,7 +86,11 @@ MetadataQueryProcessor::MetadataQueryProcessor(std::shared_ptr<Node> node, std::
 }
 
 bool MetadataQueryProcessor::start() {
-    for (auto id: ids_) {
+    return write(ids_);
+}
+
+bool MetadataQueryProcessor::write(std::vector<aku_ParamId> const& ids) {
+    for (auto id: ids) {
         aku_Sample s;
         s.paramid = id;
         s.timestamp = 0;
@@ -42,6 +42,8 @@ struct ScanQueryProcessor : IStreamProcessor {
     bool start();
     //! Process value
     bool put(const aku_Sample& sample);
+    //! Process batch of values
+    bool put_batch(SampleBatch& batch);
     //! Should be called when processing completed
     void stop();
     //! Set execution error
@@ -56,6 +58,9 @@ struct MetadataQueryProcessor : IStreamProcessor {
 
     MetadataQueryProcessor(std::shared_ptr<Node> node, std::vector<aku_ParamId>&& ids);
 
+    //! Pass ids to the node (used to stream results), returns false if the node is done
+    bool write(std::vector<aku_ParamId> const& ids);
+
     bool start();
     bool put(const aku_Sample& sample);
     void stop();
@@ -1,6 +1,8 @@
 #include "queryprocessor_framework.h"
 #include "storage_engine/tuples.h"
 #include "util.h"
+#include <algorithm>
+#include <iterator>
 #include <map>
 
 namespace Akumuli {
@@ -38,23 +40,233 @@ std::shared_ptr<Node> create_node(std::string tag, boost::property_tree::ptree c
 }
 
 
+// -----------
+// SampleBatch
+// -----------
+
+size_t SampleBatch::size() const {
+    return values.size();
+}
+
+bool SampleBatch::empty() const {
+    return values.empty();
+}
+
+void SampleBatch::clear() {
+    paramids.clear();
+    timestamps.clear();
+    values.clear();
+}
+
+void SampleBatch::append(aku_Sample const& sample) {
+    assert(sample.payload.type == AKU_PAYLOAD_FLOAT);
+    paramids.push_back(sample.paramid);
+    timestamps.push_back(sample.timestamp);
+    values.push_back(sample.payload.float64);
+}
+
+void SampleBatch::skip(size_t size) {
+    size = std::min(size, values.size());
+    paramids.erase(paramids.begin(), paramids.begin() + static_cast<std::ptrdiff_t>(size));
+    timestamps.erase(timestamps.begin(), timestamps.begin() + static_cast<std::ptrdiff_t>(size));
+    values.erase(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(size));
+}
+
+void SampleBatch::truncate(size_t size) {
+    if (size < values.size()) {
+        paramids.resize(size);
+        timestamps.resize(size);
+        values.resize(size);
+    }
+}
+
+aku_Sample SampleBatch::get_sample(size_t ix) const {
+    aku_Sample sample = {};
+    sample.paramid         = paramids[ix];
+    sample.timestamp       = timestamps[ix];
+    sample.payload.type    = AKU_PAYLOAD_FLOAT;
+    sample.payload.size    = sizeof(aku_Sample);
+    sample.payload.float64 = values[ix];
+    return sample;
+}
+
+bool Node::put_batch(SampleBatch& batch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        aku_Sample sample = batch.get_sample(i);
+        MutableSample mut(&sample);
+        if (!put(mut)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Node::set_series_slots(std::shared_ptr<const SeriesSlots>) {
+}
+
+bool Node::get_value_transform(StorageEngine::ValueTransform*) const {
+    return false;
+}
+
+bool Node::get_limit(u64*, u64*) const {
+    return false;
+}
+
+// -----------
+// SeriesSlots
+// -----------
+
+SeriesSlots::SeriesSlots(std::vector<aku_ParamId> ids, u32 width)
+    : width_(std::max(width, 1u))
+    , size_(0)
+    , base_(0)
+{
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    size_ = static_cast<u32>(ids.size());
+    if (ids.empty()) {
+        return;
+    }
+    // Series ids are allocated sequentially so the range is usually compact
+    base_ = ids.front();
+    u64 range = ids.back() - ids.front() + 1;
+    if (range <= 4ull*ids.size() + 0x1000) {
+        direct_.resize(range, NO_SLOT);
+        for (u32 i = 0; i < size_; i++) {
+            direct_[ids[i] - base_] = i;
+        }
+    } else {
+        sorted_ = std::move(ids);
+    }
+}
+
+aku_ParamId GroupBy::find(aku_ParamId id) const {
+    if (dense_map) {
+        return dense_map->find(id);
+    }
+    auto it = transient_map.find(id);
+    if (it == transient_map.end()) {
+        return 0;
+    }
+    return it->second;
+}
+
+std::vector<aku_ParamId> GroupBy::get_transient_ids() const {
+    std::vector<aku_ParamId> ids;
+    if (dense_map) {
+        std::copy_if(dense_map->ids.begin(), dense_map->ids.end(), std::back_inserter(ids),
+                     [](aku_ParamId id) { return id != 0; });
+    } else {
+        for (auto const& kv: transient_map) {
+            ids.push_back(kv.second);
+        }
+    }
+    return ids;
+}
+
+std::shared_ptr<const SeriesSlots> make_series_slots(ReshapeRequest const& req) {
+    std::vector<aku_ParamId> ids;
+    if (req.group_by.enabled) {
+        ids = req.group_by.get_transient_ids();
+    } else if (!req.select.columns.empty()) {
+        // Join query output uses ids of the first column
+        ids = req.select.columns.front().ids;
+    }
+    u32 width = 1;
+    if (!req.compare.empty()) {
+        // Compare query output has a column for every range
+        width = static_cast<u32>(req.compare.size() + 1);
+    } else if (req.agg.enabled) {
+        width = static_cast<u32>(req.agg.func.size());
+    } else if (req.select.columns.size() > 1) {
+        width = static_cast<u32>(req.select.columns.size());
+    }
+    return std::make_shared<SeriesSlots>(std::move(ids), width);
+}
+
+bool IStreamProcessor::put_batch(SampleBatch& batch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (!put(batch.get_sample(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // -------------
 // MutableSample
 // -------------
 
+//! Thread local cache of the extended tuple buffers
+struct PayloadArena {
+    enum {
+        MAX_CACHED = 64
+    };
+
+    std::vector<char*> free_;
+
+    ~PayloadArena() {
+        for (auto buf: free_) {
+            delete[] buf;
+        }
+    }
+
+    char* allocate() {
+        if (free_.empty()) {
+            return new char[MutableSample::MAX_EXT_SIZE];
+        }
+        auto buf = free_.back();
+        free_.pop_back();
+        return buf;
+    }
+
+    void release(char* buf) {
+        if (free_.size() < MAX_CACHED) {
+            free_.push_back(buf);
+        } else {
+            delete[] buf;
+        }
+    }
+};
+
+static thread_local PayloadArena s_payload_arena;
+
 MutableSample::MutableSample(const aku_Sample* source)
-    : istuple_((source->payload.type & AKU_PAYLOAD_TUPLE) == AKU_PAYLOAD_TUPLE)
+    : ext_(nullptr)
+    , sample_(&payload_.sample)
+    , bitmap_(1)
+    , words_(&bitmap_)
+    , istuple_((source->payload.type & AKU_PAYLOAD_TUPLE) == AKU_PAYLOAD_TUPLE)
 {
+    static_assert(MAX_EXT_SIZE >= MAX_SIZE, "extended tuple buffer can't hold compact tuple");
     auto size = std::max(sizeof(aku_Sample), static_cast<size_t>(source->payload.size));
-    memcpy(payload_.raw, source, size);
+    if (size > INLINE_SIZE) {
+        if (size > MAX_EXT_SIZE) {
+            AKU_PANIC("MutableSample - sample is too large");
+        }
+        ext_ = s_payload_arena.allocate();
+        sample_ = reinterpret_cast<aku_Sample*>(ext_);
+    }
+    memcpy(sample_, source, size);
+    values_ = reinterpret_cast<double*>(sample_->payload.data);
     if (!istuple_) {
         size_ = 1;
-        bitmap_ = 1;
+    } else if (TupleOutputUtils::is_extended(source->payload.float64)) {
+        std::tie(size_, bitmap_) = TupleOutputUtils::get_size_and_bitmap(source->payload.float64);
+        auto nwords = TupleOutputUtils::get_bitmap_words(size_);
+        words_  = reinterpret_cast<const u64*>(sample_->payload.data);
+        values_ = reinterpret_cast<double*>(sample_->payload.data + sizeof(u64)*nwords);
     } else {
         std::tie(size_, bitmap_) = TupleOutputUtils::get_size_and_bitmap(source->payload.float64);
     }
 }
 
+MutableSample::~MutableSample() {
+    if (ext_) {
+        s_payload_arena.release(ext_);
+    }
+}
+
 u32 MutableSample::size() const {
     return size_;
 }
@@ -66,84 +278,94 @@ void MutableSample::collapse() {
     }
     size_ = 1;
     bitmap_ = 1;
-    payload_.sample.payload.size = sizeof(aku_Sample) + sizeof(double);
+    words_ = &bitmap_;
+    values_ = reinterpret_cast<double*>(sample_->payload.data);
+    sample_->payload.size = sizeof(aku_Sample) + sizeof(double);
     union {
         double d;
         u64 u;
     } bits;
     bits.u = 0x400000000000001ul;
-    payload_.sample.payload.float64 = bits.d;
-    double* first = reinterpret_cast<double*>(payload_.sample.payload.data);
-    *first = 0.0;
+    sample_->payload.float64 = bits.d;
+    *values_ = 0.0;
 }
 
-static int count_ones(u64 value) {
-    return value == 0 ? 0 : (64 - __builtin_clzll(value));
+//! Returns offset of the value in the tuple or -1 if value is not present
+static int get_offset(const u64* words, u32 size, u32 index) {
+    if (index >= size) {
+        return -1;
+    }
+    const u64 bit = 1ull << (index % 64);
+    const u64 word = words[index / 64];
+    if ((word & bit) == 0) {
+        return -1;
+    }
+    // count 1's before index
+    int offset = __builtin_popcountll(word & (bit - 1));
+    for (u32 i = 0; i < index / 64; i++) {
+        offset += __builtin_popcountll(words[i]);
+    }
+    return offset;
 }
 
 double* MutableSample::operator[] (u32 index) {
     if (istuple_) {
-        const auto bit = static_cast<u32>(1 << index);
-        // If `index` is out of range this branch wouldn't be taken
-        // and nullptr will be returned.
-        if (bitmap_ & bit) {
-            // value is present
-            // count 1's before index
-            const auto mask = bit - 1;
-            const auto tail = mask & bitmap_;
-            const auto offset = count_ones(tail);
-            double* tuple = reinterpret_cast<double*>(payload_.sample.payload.data);
-            return tuple + offset;
+        auto offset = get_offset(words_, size_, index);
+        if (offset >= 0) {
+            return values_ + offset;
         }
     } else if (index == 0) {
-        return &payload_.sample.payload.float64;
+        return &sample_->payload.float64;
     }
     return nullptr;
 }
 
 const double* MutableSample::operator[] (u32 index) const {
     if (istuple_) {
-        const auto bit = static_cast<u32>(1 << index);
-        // If `index` is out of range this branch wouldn't be taken
-        // and nullptr will be returned.
-        if (bitmap_ & bit) {
-            // value is present
-            // count 1's before index
-            const auto mask = bit - 1;
-            const auto tail = mask & bitmap_;
-            const auto offset = count_ones(tail);
-            auto tuple = reinterpret_cast<const double*>(payload_.sample.payload.data);
-            return tuple + offset;
+        auto offset = get_offset(words_, size_, index);
+        if (offset >= 0) {
+            return values_ + offset;
         }
     } else if (index == 0) {
-        return &payload_.sample.payload.float64;
+        return &sample_->payload.float64;
     }
     return nullptr;
 }
 
 aku_Timestamp MutableSample::get_timestamp() const {
-    return payload_.sample.timestamp;
+    return sample_->timestamp;
 }
 
 aku_ParamId MutableSample::get_paramid() const {
-    return payload_.sample.paramid;
+    return sample_->paramid;
 }
 
 void MutableSample::convert_to_sax_word(u32 width) {
     auto id = get_paramid();
     auto ts = get_timestamp();
     u32 used_size = width + static_cast<u32>(sizeof(aku_Sample));
-    std::fill(payload_.raw, payload_.raw + used_size, 0);
-    payload_.sample.paramid = id;
-    payload_.sample.timestamp = ts;
-    payload_.sample.payload.type = aku_PData::PARAMID_BIT|aku_PData::TIMESTAMP_BIT|aku_PData::SAX_WORD;
-    payload_.sample.payload.size = static_cast<u16>(used_size);
+    if (used_size > INLINE_SIZE && ext_ == nullptr) {
+        // Long word doesn't fit inline
+        ext_ = s_payload_arena.allocate();
+        sample_ = reinterpret_cast<aku_Sample*>(ext_);
+    }
+    char* raw = reinterpret_cast<char*>(sample_);
+    std::fill(raw, raw + used_size, 0);
+    sample_->paramid = id;
+    sample_->timestamp = ts;
+    sample_->payload.type = aku_PData::PARAMID_BIT|aku_PData::TIMESTAMP_BIT|aku_PData::SAX_WORD;
+    sample_->payload.size = static_cast<u16>(used_size);
     bitmap_ = 0;
+    words_ = &bitmap_;
     size_ = width;
 }
 
 char* MutableSample::get_payload() {
-    return payload_.sample.payload.data;
+    return sample_->payload.data;
+}
+
+aku_Sample const& MutableSample::get_sample() const {
+    return *sample_;
 }
 
 }}  // namespace
@@ -1,6 +1,9 @@
 #pragma once
 #include <memory>
 #include <stdexcept>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
 
 #include "akumuli.h"
 #include "util.h"
@@ -44,6 +47,13 @@ struct Aggregation {
     bool enabled;
     std::vector<AggregationFunction> func;
     u64 step;  // 0 if group by time disabled
+    bool candlestick;  // step is a minimal candlestick width (ohlc query)
+    StorageEngine::FillMode fill;  // gap filling mode (group-aggregate query)
+    u64 window;  // hopping window width, multiple of the step (0 if buckets don't overlap)
+    double approx_error;  // target relative error of the approximate query (0 if the query is exact)
+    double sample_rate;  // fraction of series used by the approximate query
+    u64 series_total;  // number of series matched by the approximate query
+    bool value_ranges;  // output contains ranges that match the value filter (where-value query)
 
     static std::string to_string(AggregationFunction f) {
         switch(f) {
@@ -61,6 +71,24 @@ struct Aggregation {
             return "min";
         case AggregationFunction::MIN_TIMESTAMP:
             return "min_timestamp";
+        case AggregationFunction::P50:
+            return "p50";
+        case AggregationFunction::P90:
+            return "p90";
+        case AggregationFunction::P95:
+            return "p95";
+        case AggregationFunction::P99:
+            return "p99";
+        case AggregationFunction::P999:
+            return "p999";
+        case AggregationFunction::FIRST:
+            return "first";
+        case AggregationFunction::LAST:
+            return "last";
+        case AggregationFunction::FIRST_TIMESTAMP:
+            return "first_timestamp";
+        case AggregationFunction::LAST_TIMESTAMP:
+            return "last_timestamp";
         };
         AKU_PANIC("Invalid aggregation function");
     }
@@ -80,6 +108,24 @@ struct Aggregation {
             return std::make_tuple(AKU_SUCCESS, AggregationFunction::MAX_TIMESTAMP);
         } else if (str == "mean") {
             return std::make_tuple(AKU_SUCCESS, AggregationFunction::MEAN);
+        } else if (str == "p50" || str == "median") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::P50);
+        } else if (str == "p90") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::P90);
+        } else if (str == "p95") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::P95);
+        } else if (str == "p99") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::P99);
+        } else if (str == "p999") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::P999);
+        } else if (str == "first") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::FIRST);
+        } else if (str == "last") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::LAST);
+        } else if (str == "first_timestamp") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::FIRST_TIMESTAMP);
+        } else if (str == "last_timestamp") {
+            return std::make_tuple(AKU_SUCCESS, AggregationFunction::LAST_TIMESTAMP);
         }
         return std::make_tuple(AKU_EBAD_ARG, AggregationFunction::CNT);
     }
@@ -109,6 +155,14 @@ struct Selection {
 struct GroupBy {
     bool enabled;
     std::unordered_map<aku_ParamId, aku_ParamId> transient_map;
+    //! Dense version of the mapping (used instead of `transient_map` if set)
+    std::shared_ptr<const DenseIdMap> dense_map;
+
+    //! Get transient id of the series (0 if series is not mapped)
+    aku_ParamId find(aku_ParamId id) const;
+
+    //! Get all transient ids (can contain duplicates)
+    std::vector<aku_ParamId> get_transient_ids() const;
 };
 
 //! Output order
@@ -123,6 +177,20 @@ struct ReshapeRequest {
     Selection select;
     GroupBy group_by;
     OrderBy order_by;
+    //! Transformations computed by the storage operators (scan query only)
+    std::vector<StorageEngine::ValueTransform> transforms;
+    //! Value filter computed by the storage operators (scan and where-value queries)
+    StorageEngine::ValueFilter filter;
+    //! Limit computed by the storage operators (scan query only, zero means no limit)
+    u64 limit;
+    //! Offset computed by the storage operators (scan query without merge only)
+    u64 offset;
+    //! Time shifts of the compared ranges (compare queries only), every shifted
+    //! range is returned as an additional column aligned with the query range
+    std::vector<aku_Timestamp> compare;
+    //! Begin of the range of every series of the first column (incremental scan query only,
+    //! empty if all series are read from `select.begin`)
+    std::vector<aku_Timestamp> resume;
 };
 
 
@@ -134,20 +202,39 @@ struct QueryParserError : std::runtime_error {
 
 struct Node;
 
+/** Mutable copy of the sample that is passed through the processing topology.
+  * Scalars and small tuples are stored inline, larger tuples (and long SAX words)
+  * are stored in the buffer from the thread local arena. Inline storage is kept
+  * small because most pipelines are scalar and the sample is created for every value.
+  */
 struct MutableSample {
     static constexpr size_t MAX_PAYLOAD_SIZE = sizeof(double)*58;
     static constexpr size_t MAX_SIZE = sizeof(aku_Sample) + MAX_PAYLOAD_SIZE;
+    //! Size of the largest payload that can be stored inline (tuple with up to 8 values)
+    static constexpr size_t INLINE_PAYLOAD_SIZE = sizeof(double)*8;
+    static constexpr size_t INLINE_SIZE = sizeof(aku_Sample) + INLINE_PAYLOAD_SIZE;
+    //! Size of the largest extended tuple
+    static constexpr size_t MAX_EXT_SIZE = AKU_MAX_TUPLE_SIZE;
     union Payload {
         aku_Sample sample;
-        char       raw[MAX_SIZE];
+        char       raw[INLINE_SIZE];
     };
     Payload        payload_;
+    char*          ext_;        //< arena buffer (payloads that don't fit inline)
+    aku_Sample*    sample_;     //< points to `payload_` or to `ext_`
     u32            size_;
-    u32            bitmap_;
+    u64            bitmap_;     //< bitmap of the compact tuple
+    const u64*     words_;      //< bitmap words (`bitmap_` or bitmap of the extended tuple)
+    double*        values_;     //< first tuple value
     const bool     istuple_;
 
     MutableSample(const aku_Sample* source);
 
+    ~MutableSample();
+
+    MutableSample(MutableSample const&) = delete;
+    MutableSample& operator = (MutableSample const&) = delete;
+
     u32 size() const;
 
     /** Collapse tuple to single value, the value will be allocated
@@ -167,8 +254,41 @@ struct MutableSample {
     void convert_to_sax_word(u32 width);
 
     char* get_payload();
+
+    //! Underlying sample
+    aku_Sample const& get_sample() const;
 };
 
+/** Batch of scalar samples in columnar layout.
+  * All elements are AKU_PAYLOAD_FLOAT values, tuples and other kinds of samples
+  * are passed through the processing topology one by one.
+  */
+struct SampleBatch {
+    std::vector<aku_ParamId>   paramids;
+    std::vector<aku_Timestamp> timestamps;
+    std::vector<double>        values;
+
+    size_t size() const;
+
+    bool empty() const;
+
+    void clear();
+
+    //! Add scalar sample to the batch
+    void append(aku_Sample const& sample);
+
+    //! Remove first `size` elements
+    void skip(size_t size);
+
+    //! Remove elements starting from `size`
+    void truncate(size_t size);
+
+    //! Make sample from the batch element
+    aku_Sample get_sample(size_t ix) const;
+};
+
+class SeriesSlots;
+
 struct Node {
 
     virtual ~Node() = default;
@@ -181,6 +301,30 @@ struct Node {
       */
     virtual bool put(MutableSample& sample) = 0;
 
+    /** Process batch of values, return false to interrupt process.
+      * Batch can be modified in place and passed to the next node.
+      * Default implementation passes values to `put` one by one.
+      */
+    virtual bool put_batch(SampleBatch& batch);
+
+    /** Set mapping from series id to slot, will be called before the query execution
+      * if the query output is known in advance. Default implementation does nothing.
+      */
+    virtual void set_series_slots(std::shared_ptr<const SeriesSlots> slots);
+
+    /** Get elementwise transformation of the series values that is equivalent to
+      * this node (for scalar samples). If the transformation is returned it can be
+      * computed by the storage operators and the node can be removed from the
+      * topology. Default implementation returns false.
+      */
+    virtual bool get_value_transform(StorageEngine::ValueTransform* dest) const;
+
+    /** Get limit and offset of the node. If returned, the node doesn't change
+      * samples and only passes `limit` samples after the first `offset` samples.
+      * Default implementation returns false.
+      */
+    virtual bool get_limit(u64* limit, u64* offset) const;
+
     virtual void set_error(aku_Status status) = 0;
 
     // Query validation
@@ -229,6 +373,105 @@ struct KeyEqual : public std::binary_function<std::tuple<aku_ParamId, u32>, std:
 };
 
 
+/** Dense mapping from series id to slot index.
+  * Ids of the query output are known before the query is executed, so per-series
+  * state of the processing node can be stored in the array instead of the hash table.
+  * Every series has `width` slots, one for each tuple element.
+  */
+class SeriesSlots {
+    u32 width_;
+    u32 size_;
+    aku_ParamId base_;
+    //! Maps `id - base_` to slot (ids are compact)
+    std::vector<u32> direct_;
+    //! Sorted ids (ids are sparse)
+    std::vector<aku_ParamId> sorted_;
+
+public:
+    enum {
+        NO_SLOT = 0xFFFFFFFF,
+    };
+
+    SeriesSlots(std::vector<aku_ParamId> ids, u32 width);
+
+    //! Get slot of the series or NO_SLOT if series is unknown
+    u32 get(aku_ParamId id) const {
+        if (!direct_.empty()) {
+            if (id < base_ || id - base_ >= direct_.size()) {
+                return NO_SLOT;
+            }
+            return direct_[id - base_];
+        }
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(), id);
+        if (it == sorted_.end() || *it != id) {
+            return NO_SLOT;
+        }
+        return static_cast<u32>(it - sorted_.begin());
+    }
+
+    //! Number of series
+    u32 size() const {
+        return size_;
+    }
+
+    //! Number of slots per series
+    u32 width() const {
+        return width_;
+    }
+};
+
+//! Create series mapping for the query output
+std::shared_ptr<const SeriesSlots> make_series_slots(ReshapeRequest const& req);
+
+/** Per-series state of the processing node.
+  * State is stored in the dense array if the series is known in advance (see
+  * SeriesSlots), otherwise the hash table is used.
+  */
+template<class T>
+class SeriesState {
+    std::shared_ptr<const SeriesSlots> slots_;
+    std::vector<T>  dense_;
+    std::vector<u8> used_;
+    std::unordered_map<std::tuple<aku_ParamId, u32>, T, KeyHash, KeyEqual> sparse_;
+
+public:
+    void set_slots(std::shared_ptr<const SeriesSlots> slots) {
+        slots_ = slots;
+        dense_.clear();
+        used_.clear();
+    }
+
+    /** Get state of the element `ix` of the series `id`.
+      * State is initialized on first access using the value returned by `init()`.
+      */
+    template<class Init>
+    T& get(aku_ParamId id, u32 ix, Init const& init) {
+        if (slots_) {
+            u32 slot = slots_->get(id);
+            u32 width = slots_->width();
+            if (slot != SeriesSlots::NO_SLOT && ix < width) {
+                if (dense_.empty()) {
+                    // Allocated on first use
+                    dense_.resize(static_cast<size_t>(slots_->size())*width);
+                    used_.resize(dense_.size(), 0);
+                }
+                size_t pos = static_cast<size_t>(slot)*width + ix;
+                if (!used_[pos]) {
+                    dense_[pos] = init();
+                    used_[pos] = 1;
+                }
+                return dense_[pos];
+            }
+        }
+        auto key = std::make_tuple(id, ix);
+        auto it = sparse_.find(key);
+        if (it == sparse_.end()) {
+            it = sparse_.insert(std::make_pair(key, init())).first;
+        }
+        return it->second;
+    }
+};
+
 struct NodeException : std::runtime_error {
     NodeException(const char* msg)
         : std::runtime_error(msg) {}
@@ -251,6 +494,9 @@ struct IStreamProcessor {
     //! Get new value
     virtual bool put(const aku_Sample& sample) = 0;
 
+    //! Get batch of scalar values (default implementation calls `put` for every value)
+    virtual bool put_batch(SampleBatch& batch);
+
     //! Will be called when processing completed without errors
     virtual void stop() = 0;
 
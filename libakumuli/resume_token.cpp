@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "resume_token.h"
+#include "crc32c.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace Akumuli {
+
+static const u32 TOKEN_MAGIC = 0x54524B41;  // "AKRT"
+static const u8 TOKEN_VERSION = 1;
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static u32 checksum(const std::string& data) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data.data(), data.size());
+}
+
+static void put_u32(std::string* out, u32 value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back(static_cast<char>((value >> (8*i)) & 0xFF));
+    }
+}
+
+static void put_varint(std::string* out, u64 value) {
+    while (value >= 0x80) {
+        out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+static u64 zigzag(i64 value) {
+    return (static_cast<u64>(value) << 1) ^ static_cast<u64>(value >> 63);
+}
+
+static i64 unzigzag(u64 value) {
+    return static_cast<i64>(value >> 1) ^ -static_cast<i64>(value & 1);
+}
+
+namespace {
+
+//! Reads fields of the decoded token, `ok` is false if the input is truncated
+struct TokenReader {
+    const std::string& data;
+    size_t pos;
+    bool ok;
+
+    TokenReader(const std::string& d)
+        : data(d)
+        , pos(0)
+        , ok(true)
+    {
+    }
+
+    u32 get_u32() {
+        if (data.size() - pos < 4) {
+            ok = false;
+            return 0;
+        }
+        u32 value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= static_cast<u32>(static_cast<u8>(data[pos++])) << (8*i);
+        }
+        return value;
+    }
+
+    u8 get_u8() {
+        if (pos == data.size()) {
+            ok = false;
+            return 0;
+        }
+        return static_cast<u8>(data[pos++]);
+    }
+
+    u64 get_varint() {
+        u64 value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos == data.size()) {
+                break;
+            }
+            u8 byte = static_cast<u8>(data[pos++]);
+            value |= static_cast<u64>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+};
+
+}
+
+static std::string base64_encode(const std::string& data) {
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    u32 acc = 0;
+    int nbits = 0;
+    for (char c: data) {
+        acc = (acc << 8) | static_cast<u8>(c);
+        nbits += 8;
+        while (nbits >= 6) {
+            nbits -= 6;
+            out.push_back(BASE64_ALPHABET[(acc >> nbits) & 0x3F]);
+        }
+    }
+    if (nbits > 0) {
+        out.push_back(BASE64_ALPHABET[(acc << (6 - nbits)) & 0x3F]);
+    }
+    return out;
+}
+
+static bool base64_decode(const std::string& text, std::string* out) {
+    u32 acc = 0;
+    int nbits = 0;
+    out->reserve(text.size() * 3 / 4);
+    for (char c: text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '-') {
+            value = 62;
+        } else if (c == '_') {
+            value = 63;
+        } else {
+            return false;
+        }
+        acc = (acc << 6) | static_cast<u32>(value);
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            out->push_back(static_cast<char>((acc >> nbits) & 0xFF));
+        }
+    }
+    return true;
+}
+
+ResumeToken::ResumeToken()
+    : watermark(0)
+    , generation(0)
+{
+}
+
+std::string ResumeToken::encode() const {
+    std::string out;
+    // Zero (no position) is encoded separately so it doesn't affect the base
+    aku_Timestamp base = std::numeric_limits<aku_Timestamp>::max();
+    for (auto ts: timestamps) {
+        if (ts != 0) {
+            base = std::min(base, ts);
+        }
+    }
+    put_u32(&out, TOKEN_MAGIC);
+    out.push_back(static_cast<char>(TOKEN_VERSION));
+    put_varint(&out, watermark);
+    put_varint(&out, generation);
+    put_varint(&out, ids.size());
+    put_varint(&out, base);
+    // Ids are usually sorted and timestamps are close to each other
+    aku_ParamId prev = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+        put_varint(&out, zigzag(static_cast<i64>(ids[i] - prev)));
+        put_varint(&out, timestamps[i] == 0 ? 0 : timestamps[i] - base + 1);
+        prev = ids[i];
+    }
+    put_u32(&out, checksum(out));
+    return base64_encode(out);
+}
+
+aku_Status ResumeToken::decode(std::string const& text, ResumeToken* token) {
+    std::string data;
+    if (!base64_decode(text, &data) || data.size() < 9) {
+        return AKU_EBAD_ARG;
+    }
+    std::string payload = data.substr(0, data.size() - 4);
+    std::string crc = data.substr(data.size() - 4);
+    TokenReader crcreader(crc);
+    if (crcreader.get_u32() != checksum(payload)) {
+        return AKU_EBAD_ARG;
+    }
+    TokenReader reader(payload);
+    if (reader.get_u32() != TOKEN_MAGIC || reader.get_u8() != TOKEN_VERSION) {
+        return AKU_EBAD_ARG;
+    }
+    token->watermark = reader.get_varint();
+    token->generation = reader.get_varint();
+    u64 size = reader.get_varint();
+    aku_Timestamp base = reader.get_varint();
+    // Every entry takes at least two bytes
+    if (!reader.ok || size > payload.size()) {
+        return AKU_EBAD_ARG;
+    }
+    token->ids.resize(size);
+    token->timestamps.resize(size);
+    aku_ParamId prev = 0;
+    for (u64 i = 0; i < size && reader.ok; i++) {
+        prev += static_cast<aku_ParamId>(unzigzag(reader.get_varint()));
+        token->ids[i] = prev;
+        u64 offset = reader.get_varint();
+        token->timestamps[i] = offset == 0 ? 0 : base + offset - 1;
+    }
+    if (!reader.ok || reader.pos != payload.size()) {
+        return AKU_EBAD_ARG;
+    }
+    return AKU_SUCCESS;
+}
+
+}  // namespace
@@ -0,0 +1,62 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <string>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+
+namespace Akumuli {
+
+/** Position of the incremental (polling) query.
+  * Token contains the position of every series (timestamp that follows the last
+  * returned one) and the version of the series index (series counter and deletion
+  * counter) at the moment when the ids were resolved. Next query reads only the
+  * values that follow these positions. If the index version didn't change, the
+  * series are stored in the same order as the resolved ids and can be matched
+  * without lookup.
+  *
+  * Encoded token is a base64url string (without padding): magic, format version,
+  * index version, smallest position and the list of series (delta encoded id and
+  * position offset from the smallest one, LEB128) followed by the crc32c checksum.
+  */
+struct ResumeToken {
+    //! Series counter value at the moment when the ids were resolved
+    u64 watermark;
+    //! Deletion counter value at the moment when the ids were resolved
+    u64 generation;
+    //! Series ids (in the order of the resolved ids)
+    std::vector<aku_ParamId> ids;
+    //! Position of every series (0 if nothing was returned yet)
+    std::vector<aku_Timestamp> timestamps;
+
+    ResumeToken();
+
+    //! Encode token
+    std::string encode() const;
+
+    /** Decode token.
+      * @return AKU_EBAD_ARG if the token is malformed
+      */
+    static aku_Status decode(std::string const& text, ResumeToken* token);
+};
+
+}  // namespace
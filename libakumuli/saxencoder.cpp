@@ -16,6 +16,7 @@
  */
 
 #include "saxencoder.h"
+#include <algorithm>
 #include <map>
 #include <cmath>
 #include <vector>
@@ -132,28 +133,25 @@ static const char ALPHABET[] = {
     'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u' // 21 symbols
 };
 
-static char to_char(double value, const std::vector<double>& cuts) {
-    for (auto i = 0u; i < cuts.size(); i++) {
-        if (value < cuts[i]) {
-            return ALPHABET[i];
-        }
-    }
-    return ALPHABET[cuts.size()];
-}
-
-//! Convert array of doubles to characters (both array modified in-place)
-static void saxify(const boost::circular_buffer<double>& input, std::string& output, double threshold, int alphabet_size) {
+static const std::vector<double>& get_cutpoints(int alphabet_size) {
     auto it = CUTPOINTS.find(alphabet_size);
     if (it == CUTPOINTS.end()) {
         std::runtime_error error("invalid alphabet size");
         BOOST_THROW_EXCEPTION(error);
     }
-    const std::vector<double>& cuts = it->second;
+    return it->second;
+}
+
+static char to_char(double value, const std::vector<double>& cuts) {
+    // Index of the first cut point that is larger than the value
+    auto it = std::upper_bound(cuts.begin(), cuts.end(), value);
+    return ALPHABET[std::distance(cuts.begin(), it)];
+}
 
+//! Convert window of doubles to characters
+static void saxify(const double* input, size_t size, char* output, double threshold, const std::vector<double>& cuts) {
     double mean, stddev;
-    std::tie(mean, stddev) = mean_and_stddev(input.begin(), input.end());
-    auto size = input.size();
-    output.resize(size);
+    std::tie(mean, stddev) = mean_and_stddev(input, input + size);
     if (stddev < threshold) {
         for (size_t i = 0; i < size; i++) {
             double val = input[i] - mean;
@@ -175,31 +173,52 @@ int leading_zeroes(int value) {
 SAXEncoder::SAXEncoder()
     : alphabet_(0)
     , window_width_(0)
-    , input_samples_(1)
+    , cuts_(nullptr)
 {
 }
 
 SAXEncoder::SAXEncoder(int alphabet, int window_width)
     : alphabet_(alphabet)
     , window_width_(window_width)
-    , input_samples_(window_width)
+    , cuts_(&get_cutpoints(alphabet))
+    , buffer_(static_cast<size_t>(window_width), '\0')
 {
+    window_.reserve(static_cast<size_t>(window_width));
+}
+
+bool SAXEncoder::encode(double sample, char *outword, size_t) {
+    size_t index;
+    return encode(&sample, 1, outword, &index) != 0;
 }
 
-bool SAXEncoder::encode(double sample, char *outword, size_t outword_size) {
-    input_samples_.push_back(sample);
-    if (input_samples_.full()) {
-        // scan samples
-        saxify(input_samples_, buffer_, AKU_ZNORM_THRESHOLD, alphabet_);
+size_t SAXEncoder::encode(const double* samples, size_t size, char* outwords, size_t* indexes) {
+    if (cuts_ == nullptr) {
+        std::runtime_error error("invalid alphabet size");
+        BOOST_THROW_EXCEPTION(error);
+    }
+    const size_t width = static_cast<size_t>(window_width_);
+    const size_t first = window_.size();
+    window_.insert(window_.end(), samples, samples + size);
+    size_t nwords = 0;
+    for (size_t i = 0; i < size; i++) {
+        // Window that ends at `ix` is complete, every window is contiguous
+        size_t ix = first + i;
+        if (ix + 1 < width) {
+            continue;
+        }
+        saxify(window_.data() + ix + 1 - width, width, &buffer_[0], AKU_ZNORM_THRESHOLD, *cuts_);
         if (buffer_ != last_) {
             // Simple numerocity reduction
             last_ = buffer_;
-            memcpy(outword, buffer_.data(), buffer_.size());
-            buffer_.clear();
-            return true;
+            memcpy(outwords + nwords*width, buffer_.data(), width);
+            indexes[nwords++] = i;
         }
     }
-    return false;
+    // Only the tail of the last window is needed for the next call
+    if (window_.size() >= width) {
+        window_.erase(window_.begin(), window_.end() - static_cast<std::ptrdiff_t>(width - 1));
+    }
+    return nwords;
 }
 
 }}  // namespace
@@ -16,8 +16,14 @@
  */
 #pragma once
 
-#include <boost/circular_buffer.hpp>
 #include <boost/range.hpp>
+#include <boost/throw_exception.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 
 namespace Akumuli {
@@ -205,9 +211,12 @@ struct SAXEncoder {
     int alphabet_;      //! alphabet size
     int window_width_;  //! sliding window width
 
-    boost::circular_buffer<double> input_samples_;
-    std::string                    buffer_;
-    std::string                    last_;
+    //! Cut points of the alphabet (resolved once)
+    const std::vector<double>* cuts_;
+    //! Last `window_width - 1` samples followed by the new samples
+    std::vector<double>        window_;
+    std::string                buffer_;
+    std::string                last_;
 
     SAXEncoder();
 
@@ -222,6 +231,16 @@ struct SAXEncoder {
      * @returns true if new sax word returned; false otherwise
      */
     bool encode(double sample, char* outword, size_t outword_size);
+
+    /** Add array of samples to sliding window. Produces the same words as the
+     * sequence of `encode` calls.
+     * @param samples is an array of values
+     * @param size is a number of values
+     * @param outwords receives new sax words (should be `size*window_width` bytes long)
+     * @param indexes receives index of the sample that completes every new word (`size` elements)
+     * @returns number of new sax words
+     */
+    size_t encode(const double* samples, size_t size, char* outwords, size_t* indexes);
 };
 }
 }
@@ -17,24 +17,39 @@
 
 
 #include "storage2.h"
+#include "resume_token.h"
 #include "util.h"
 #include "queryprocessor.h"
+#include "cursor.h"
 #include "query_processing/queryparser.h"
 #include "query_processing/queryplan.h"
 #include "log_iface.h"
 #include "status_util.h"
 #include "datetime.h"
 #include "akumuli_version.h"
+#include "metrics.h"
+#include "akumuli_tracing.h"
+#include "storage_engine/checkpoint.h"
+#include "storage_engine/hotlist.h"
+#include "storage_engine/backup.h"
 
 #include <algorithm>
 #include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <sstream>
 #include <cassert>
 #include <functional>
+#include <limits>
+#include <numeric>
+#include <unordered_set>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/bind.hpp>
+#include <boost/exception/diagnostic_information.hpp>
 #include <boost/filesystem.hpp>
 
 #include <fcntl.h>
@@ -44,9 +59,164 @@ namespace Akumuli {
 
 // Utility functions & classes //
 
+//! Name of the config parameter that contains generation of the shutdown checkpoint
+static const char* CHECKPOINT_GENERATION = "checkpoint_generation";
+
+static u64 elapsed_ns(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+/** Cursor wrapper used by the profiled query. Counts output samples and
+  * attaches the profile to the cursor on completion.
+  */
+struct ProfilingCursor : InternalCursor {
+    InternalCursor* cur_;
+    QueryProfile profile_;
+    std::chrono::steady_clock::time_point exec_start_;
+
+    ProfilingCursor(InternalCursor* cur)
+        : cur_(cur)
+        , exec_start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    //! Mark the start of the query plan execution
+    void start_execution() {
+        exec_start_ = std::chrono::steady_clock::now();
+    }
+
+    virtual bool put(aku_Sample const& sample) override {
+        profile_.samples_out.fetch_add(1, std::memory_order_relaxed);
+        return cur_->put(sample);
+    }
+
+    virtual void complete() override {
+        profile_.exec_ns = elapsed_ns(exec_start_);
+        cur_->set_profile(profile_.to_json());
+        cur_->complete();
+    }
+
+    virtual void set_error(aku_Status error_code) override {
+        cur_->set_error(error_code);
+    }
+
+    virtual void set_resume_token(std::string const& token) override {
+        cur_->set_resume_token(token);
+    }
+};
+
+/** Cursor wrapper used by the incremental query. Tracks the last output timestamp
+  * of every series and attaches the new resume token to the cursor on completion.
+  */
+struct ResumeCursor : InternalCursor {
+    InternalCursor* cur_;
+    //! Resolved ids and their positions before the query (see `resume_query`)
+    ResumeToken token_;
+    std::unordered_map<aku_ParamId, aku_Timestamp> last_;
+    //! Last written series (consecutive samples usually belong to the same series)
+    aku_ParamId prev_id_;
+    aku_Timestamp* prev_ts_;
+
+    ResumeCursor(InternalCursor* cur)
+        : cur_(cur)
+        , prev_id_(0)
+        , prev_ts_(nullptr)
+    {
+    }
+
+    virtual bool put(aku_Sample const& sample) override {
+        if (sample.paramid != prev_id_ || prev_ts_ == nullptr) {
+            auto it = last_.insert(std::make_pair(sample.paramid, sample.timestamp)).first;
+            prev_id_ = sample.paramid;
+            prev_ts_ = &it->second;
+        }
+        *prev_ts_ = std::max(*prev_ts_, sample.timestamp);
+        return cur_->put(sample);
+    }
+
+    virtual void complete() override {
+        // Series without new values keep their previous position
+        for (size_t i = 0; i < token_.ids.size(); i++) {
+            auto it = last_.find(token_.ids[i]);
+            if (it != last_.end() && it->second != std::numeric_limits<aku_Timestamp>::max()) {
+                token_.timestamps[i] = std::max(token_.timestamps[i], it->second + 1);
+            }
+        }
+        cur_->set_resume_token(token_.encode());
+        cur_->complete();
+    }
+
+    virtual void set_error(aku_Status error_code) override {
+        cur_->set_error(error_code);
+    }
+
+    virtual void set_profile(std::string const& profile) override {
+        cur_->set_profile(profile);
+    }
+};
+
+/** Set the begin of the range of every series of the incremental query.
+  * @param prev is a token of the previous poll
+  * @param curr receives positions of the resolved series (its index version should be set)
+  */
+static void resume_query(QP::ReshapeRequest* req, ResumeToken const& prev, ResumeToken* curr) {
+    auto const& ids = req->select.columns.at(0).ids;
+    curr->ids = ids;
+    curr->timestamps.assign(ids.size(), 0);
+    bool aligned = prev.watermark == curr->watermark && prev.generation == curr->generation
+                && prev.ids == ids;
+    if (aligned) {
+        // Index didn't change, series are stored in the same order
+        curr->timestamps = prev.timestamps;
+    } else {
+        std::unordered_map<aku_ParamId, aku_Timestamp> positions;
+        for (size_t i = 0; i < prev.ids.size(); i++) {
+            positions[prev.ids[i]] = prev.timestamps[i];
+        }
+        for (size_t i = 0; i < ids.size(); i++) {
+            auto it = positions.find(ids[i]);
+            if (it != positions.end()) {
+                curr->timestamps[i] = it->second;
+            }
+        }
+    }
+    req->resume.resize(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        req->resume[i] = std::max(req->select.begin, curr->timestamps[i]);
+    }
+}
+
 
 // Standalone functions //
 
+/** Parse comma separated list of rollup tier widths.
+  * Bad values are skipped, result is sorted.
+  */
+static std::vector<aku_Timestamp> parse_rollup_tiers(const char* str) {
+    std::vector<aku_Timestamp> result;
+    if (str == nullptr) {
+        return result;
+    }
+    std::stringstream input(str);
+    std::string item;
+    while (std::getline(input, item, ',')) {
+        try {
+            auto width = DateTimeUtil::parse_duration(item.c_str(), item.size());
+            if (width == 0) {
+                Logger::msg(AKU_LOG_ERROR, "Rollup tier width can't be zero");
+                continue;
+            }
+            result.push_back(width);
+        } catch (...) {
+            Logger::msg(AKU_LOG_ERROR, "Can't parse rollup tier width `" + item + "`");
+        }
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
 /** This function creates metadata file - root of the storage system.
   * This page contains creation date and time, number of pages,
   * all the page file names and they order.
@@ -56,7 +226,8 @@ static apr_status_t create_metadata_page(const char* db_name
                                         , const char* file_name
                                         , std::vector<std::string> const& page_file_names
                                         , std::vector<u32> const& capacities
-                                        , const char* bstore_type )
+                                        , const char* bstore_type
+                                        , u16 nbtree_fanout )
 {
     using namespace std;
     try {
@@ -66,7 +237,7 @@ static apr_status_t create_metadata_page(const char* db_name
         char date_time[0x100];
         apr_rfc822_date(date_time, now);
 
-        storage->init_config(db_name, date_time, bstore_type);
+        storage->init_config(db_name, date_time, bstore_type, nbtree_fanout);
 
         std::vector<MetadataStorage::VolumeDesc> desc;
         u32 ix = 0;
@@ -97,22 +268,120 @@ static apr_status_t create_metadata_page(const char* db_name
 StorageSession::StorageSession(std::shared_ptr<Storage> storage, std::shared_ptr<StorageEngine::CStoreSession> session)
     : storage_(storage)
     , session_(session)
+    , log_shard_(storage->_get_input_log_shard())
     , matcher_substitute_(nullptr)
+    , memory_(AKU_MEM_SESSIONS)
+    , deletion_gen_(storage->_get_deletion_generation())
+    , ingest_credit_(0)
 {
+    memory_.add(sizeof(StorageSession));
+}
+
+u64 StorageSession::acquire_ingest_credit(u64 n) {
+    // Number of tokens taken at once, storage is not locked for every sample
+    static const u64 INGEST_CREDIT_BATCH = 64;
+    if (AKU_LIKELY(!storage_->_has_ingest_quota())) {
+        return n;
+    }
+    if (ingest_credit_ < n) {
+        ingest_credit_ += storage_->_take_ingest_tokens(std::max(n - ingest_credit_, INGEST_CREDIT_BATCH));
+    }
+    u64 granted = std::min(n, ingest_credit_);
+    ingest_credit_ -= granted;
+    if (granted < n) {
+        storage_->_add_throttled(n - granted);
+    }
+    return granted;
+}
+
+void StorageSession::account_local_name(size_t len) {
+    // Name is copied to the local string pool, the id is added to the local
+    // lookup tables and to the column cache of the session
+    static const size_t ENTRY_OVERHEAD = 2*sizeof(StringT) + 2*sizeof(u64) + sizeof(std::shared_ptr<void>);
+    memory_.add(len + 1 + ENTRY_OVERHEAD);
+}
+
+void StorageSession::check_deleted() {
+    auto gen = storage_->_get_deletion_generation();
+    if (AKU_LIKELY(gen == deletion_gen_)) {
+        return;
+    }
+    deletion_gen_ = gen;
+    std::vector<u64> deleted;
+    for (auto id: local_matcher_.get_all_ids()) {
+        if (storage_->_is_deleted(id)) {
+            deleted.push_back(id);
+        }
+    }
+    local_matcher_.remove(deleted);
+    session_->clear_cache();
 }
 
 aku_Status StorageSession::write(aku_Sample const& sample) {
     using namespace StorageEngine;
+    AKU_TRACE_SCOPE2(session_write, sample.paramid, sample.timestamp);
+    ScopedLatency latency(Metrics::ingest());
+    if (storage_->is_read_only()) {
+        return AKU_ENOT_PERMITTED;
+    }
+    if (acquire_ingest_credit(1) == 0) {
+        return AKU_EBUSY;
+    }
+    check_deleted();
     std::vector<u64> rpoints;
     auto status = session_->write(sample, &rpoints);
     switch (status) {
     case NBTreeAppendResult::OK:
+        storage_->_write_input_log(log_shard_, &sample, 1);
+        storage_->_update_continuous_queries(&sample, 1);
         return AKU_SUCCESS;
     case NBTreeAppendResult::OK_FLUSH_NEEDED:
+        storage_->_write_input_log(log_shard_, &sample, 1);
         storage_-> _update_rescue_points(sample.paramid, std::move(rpoints));
+        storage_->_update_continuous_queries(&sample, 1);
+        return AKU_SUCCESS;
+    case NBTreeAppendResult::FAIL_BAD_ID:
+        // Series was deleted
+        return AKU_ENOT_FOUND;
+    case NBTreeAppendResult::FAIL_LATE_WRITE:
+        return AKU_ELATE_WRITE;
+    case NBTreeAppendResult::FAIL_BAD_VALUE:
+        return AKU_EBAD_ARG;
+    };
+    return AKU_SUCCESS;
+}
+
+aku_Status StorageSession::write_batch(aku_Sample const* samples, size_t size) {
+    using namespace StorageEngine;
+    AKU_TRACE_SCOPE1(session_write_batch, size);
+    ScopedLatency latency(Metrics::ingest());
+    if (storage_->is_read_only()) {
+        return AKU_ENOT_PERMITTED;
+    }
+    // Samples that exceed the ingest rate are rejected
+    size_t nallowed = static_cast<size_t>(acquire_ingest_credit(size));
+    if (nallowed == 0) {
+        return AKU_EBUSY;
+    }
+    check_deleted();
+    std::unordered_map<aku_ParamId, std::vector<u64>> rpoints;
+    auto status = session_->write_batch(samples, nallowed, &rpoints);
+    storage_->_update_rescue_points(std::move(rpoints));
+    // Rejected values are rejected again on replay
+    storage_->_write_input_log(log_shard_, samples, nallowed);
+    // Late writes are skipped by continuous queries the same way
+    storage_->_update_continuous_queries(samples, nallowed);
+    bool ok = status == NBTreeAppendResult::OK || status == NBTreeAppendResult::OK_FLUSH_NEEDED;
+    if (ok && nallowed < size) {
+        return AKU_EBUSY;
+    }
+    switch (status) {
+    case NBTreeAppendResult::OK:
+    case NBTreeAppendResult::OK_FLUSH_NEEDED:
         return AKU_SUCCESS;
     case NBTreeAppendResult::FAIL_BAD_ID:
-        AKU_PANIC("Invalid session cache, id = " + std::to_string(sample.paramid));
+        // Some series were deleted
+        return AKU_ENOT_FOUND;
     case NBTreeAppendResult::FAIL_LATE_WRITE:
         return AKU_ELATE_WRITE;
     case NBTreeAppendResult::FAIL_BAD_VALUE:
@@ -122,6 +391,7 @@ aku_Status StorageSession::write(aku_Sample const& sample) {
 }
 
 aku_Status StorageSession::init_series_id(const char* begin, const char* end, aku_Sample *sample) {
+    check_deleted();
     // Series name normalization procedure. Most likeley a bottleneck but
     // can be easily parallelized.
     const char* ksbegin = nullptr;
@@ -137,10 +407,14 @@ aku_Status StorageSession::init_series_id(const char* begin, const char* end, ak
     // Otherwise - match using global registry. On success - add global information to
     //  the local matcher. On error - add series name to global registry and then to
     //  the local matcher.
-    u64 id = local_matcher_.match(ob, ksend);
+    u64 hash = StringTools::hash(std::make_pair(ob, static_cast<int>(ksend - ob)));
+    u64 id = local_matcher_.match(ob, ksend, hash);
     if (!id) {
         // go to global registery
-        status = storage_->init_series_id(ob, ksend, sample, &local_matcher_);
+        status = storage_->init_series_id(ob, ksend, sample, &local_matcher_, hash);
+        if (status == AKU_SUCCESS) {
+            account_local_name(static_cast<size_t>(ksend - ob));
+        }
     } else {
         // initialize using local info
         sample->paramid = id;
@@ -149,6 +423,7 @@ aku_Status StorageSession::init_series_id(const char* begin, const char* end, ak
 }
 
 int StorageSession::get_series_ids(const char* begin, const char* end, aku_ParamId* ids, size_t ids_size) {
+    check_deleted();
     // Series name normalization procedure. Most likeley a bottleneck but
     // can be easily parallelized.
     const char* ksbegin = nullptr;
@@ -177,54 +452,60 @@ int StorageSession::get_series_ids(const char* begin, const char* end, aku_Param
         // Otherwise - match using global registry. On success - add global information to
         //  the local matcher. On error - add series name to global registry and then to
         //  the local matcher.
-        u64 id = local_matcher_.match(ob, ksend);
+        u64 hash = StringTools::hash(std::make_pair(ob, static_cast<int>(ksend - ob)));
+        u64 id = local_matcher_.match(ob, ksend, hash);
         if (!id) {
             // go to global registery
             aku_Sample sample;
-            status = storage_->init_series_id(ob, ksend, &sample, &local_matcher_);
+            status = storage_->init_series_id(ob, ksend, &sample, &local_matcher_, hash);
+            if (status == AKU_SUCCESS) {
+                account_local_name(static_cast<size_t>(ksend - ob));
+            }
             ids[0] = sample.paramid;
         } else {
             // initialize using local info
             ids[0] = id;
         }
     } else {
-        char series[AKU_LIMITS_MAX_SNAME];
-        // Copy tags without metrics to the end of the `series` array
-        int tagline_len = static_cast<int>(ksend - ksbegin + 1);  // +1 for space, cast is safe because ksend-ksbegin < AKU_LIMITS_MAX_SNAME
+        // Build names of all series first ("cpu.user tags", "cpu.system tags", ...)
+        // so the tags are canonicalized once and the local matcher is locked once
         const char* metric_end = ksbegin - 1;  // -1 for space
-        char* tagline = series + AKU_LIMITS_MAX_SNAME - tagline_len;
-        memcpy(tagline, metric_end, static_cast<size_t>(tagline_len));
-        char* send = series + AKU_LIMITS_MAX_SNAME;
-
+        size_t tagline_len = static_cast<size_t>(ksend - metric_end);
+        std::vector<char> series;
+        series.reserve(static_cast<size_t>(metric_end - ob) + static_cast<size_t>(nmetric)*tagline_len);
+        std::vector<size_t> offsets;
         const char* it_begin = ob;
-        const char* it_end = ob;
-        for (int i = 0; i < nmetric; i++) {
-            // copy i'th metric to the `series` array
-            while(*it_end != '|' && it_end < metric_end) {
-                it_end++;
+        for (long i = 0; i < nmetric; i++) {
+            const char* it_end = std::find(it_begin, metric_end, '|');
+            offsets.push_back(series.size());
+            series.insert(series.end(), it_begin, it_end);
+            series.insert(series.end(), metric_end, ksend);
+            it_begin = it_end + 1;
+        }
+        offsets.push_back(series.size());
+        std::vector<StringT> names;
+        std::vector<u64> hashes;
+        for (long i = 0; i < nmetric; i++) {
+            names.push_back(std::make_pair(series.data() + offsets[i],
+                                           static_cast<int>(offsets[i + 1] - offsets[i])));
+            hashes.push_back(StringTools::hash(names.back()));
+        }
+        local_matcher_.match(names.data(), hashes.data(), names.size(), ids);
+        for (long i = 0; i < nmetric; i++) {
+            if (ids[i]) {
+                continue;
             }
-            // Copy metric name to `series` array
-            auto metric_len = it_end - it_begin;
-            char* sbegin = tagline - metric_len;
-            memcpy(sbegin, it_begin, metric_len);
-            // Move to next metric (if any)
-            it_end++;
-            it_begin = it_end;
-
-            // Match series name locally (on success use local information)
-            // Otherwise - match using global registry. On success - add global information to
-            //  the local matcher. On error - add series name to global registry and then to
-            //  the local matcher.
-            u64 id = local_matcher_.match(sbegin, send);
-            if (!id) {
-                // go to global registery
-                aku_Sample tmp;
-                status = storage_->init_series_id(sbegin, send, &tmp, &local_matcher_);
-                ids[i] = tmp.paramid;
-            } else {
-                // initialize using local info
-                ids[i] = id;
+            // New to this session, go to global registry. On success - add global
+            // information to the local matcher. On error - add series name to
+            // global registry and then to the local matcher.
+            const char* sbegin = names[i].first;
+            const char* send = sbegin + names[i].second;
+            aku_Sample tmp = {};
+            status = storage_->init_series_id(sbegin, send, &tmp, &local_matcher_, hashes[i]);
+            if (status == AKU_SUCCESS) {
+                account_local_name(static_cast<size_t>(send - sbegin));
             }
+            ids[i] = tmp.paramid;
         }
     }
     return static_cast<int>(nmetric);
@@ -243,7 +524,12 @@ int StorageSession::get_series_name(aku_ParamId id, char* buffer, size_t buffer_
         name = local_matcher_.id2str(id);
         if (name.first == nullptr) {
             // not yet cached!
-            return storage_->get_series_name(id, buffer, buffer_size, &local_matcher_);
+            int len = storage_->get_series_name(id, buffer, buffer_size, &local_matcher_);
+            if (len != 0) {
+                // Name is added to the local matcher even if the buffer is too small
+                account_local_name(static_cast<size_t>(std::abs(len)));
+            }
+            return len;
         }
     }
     memcpy(buffer, name.first, static_cast<size_t>(name.second));
@@ -262,6 +548,26 @@ void StorageSession::search(InternalCursor* cur, const char* query) const {
     storage_->search(this, cur, query);
 }
 
+void StorageSession::subscribe(StreamingCursor* cur, const char* query) const {
+    storage_->subscribe(this, cur, query);
+}
+
+std::tuple<aku_Status, std::shared_ptr<PreparedStatement>> StorageSession::prepare(const char* query) const {
+    return storage_->prepare(query);
+}
+
+void StorageSession::execute(InternalCursor* cur, std::shared_ptr<PreparedStatement> stmt,
+                             aku_Timestamp begin, aku_Timestamp end) const
+{
+    storage_->execute(this, cur, stmt.get(), begin, end);
+}
+
+void StorageSession::poll(InternalCursor* cur, std::shared_ptr<PreparedStatement> stmt,
+                          aku_Timestamp begin, aku_Timestamp end, std::string resume_token) const
+{
+    storage_->execute(this, cur, stmt.get(), begin, end, &resume_token);
+}
+
 void StorageSession::set_series_matcher(std::shared_ptr<PlainSeriesMatcher> matcher) const {
     matcher_substitute_ = matcher;
 }
@@ -275,6 +581,35 @@ void StorageSession::clear_series_matcher() const {
 Storage::Storage()
     : done_{0}
     , close_barrier_(2)
+    , cqueries_(std::make_shared<QP::ContinuousQueries>())
+    , max_series_(0)
+    , nseries_{0}
+    , nrejected_{0}
+    , has_metric_limits_{false}
+    , write_buffer_budget_(0)
+    , write_buffer_size_{0}
+    , memory_limit_(0)
+    , memory_untracked_{0}
+    , nmemory_rejected_{0}
+    , compaction_min_fill_(0)
+    , compaction_count_{0}
+    , recompression_age_(0)
+    , recompression_count_{0}
+    , input_log_max_size_(0)
+    , input_log_concurrency_(0)
+    , deletion_gen_{0}
+    , snapshot_id_(0)
+    , checkpoint_gen_(0)
+    , query_memory_limit_(StorageEngine::AKU_QUERY_MEMORY_LIMIT)
+    , read_only_(false)
+    , hotlist_size_(0)
+    , default_quota_()
+    , tenant_memory_limit_{0}
+    , tenant_memory_{0}
+    , ingest_rate_{0}
+    , ingest_tokens_(0)
+    , nthrottled_{0}
+    , startup_()
 {
     //! In-memory SQLite database
     metadata_.reset(new MetadataStorage(":memory:"));
@@ -285,11 +620,46 @@ Storage::Storage()
     start_sync_worker();
 }
 
-Storage::Storage(const char* path)
+Storage::Storage(const char* path, aku_FineTuneParams const& params)
     : done_{0}
     , close_barrier_(2)
+    , cqueries_(std::make_shared<QP::ContinuousQueries>())
+    , max_series_(0)
+    , nseries_{0}
+    , nrejected_{0}
+    , has_metric_limits_{false}
+    , write_buffer_budget_(0)
+    , write_buffer_size_{0}
+    , memory_limit_(0)
+    , memory_untracked_{0}
+    , nmemory_rejected_{0}
+    , compaction_min_fill_(0)
+    , compaction_count_{0}
+    , recompression_age_(0)
+    , recompression_count_{0}
+    , input_log_max_size_(0)
+    , input_log_concurrency_(0)
+    , deletion_gen_{0}
+    , snapshot_id_(0)
+    , checkpoint_gen_(0)
+    , query_memory_limit_(StorageEngine::AKU_QUERY_MEMORY_LIMIT)
+    , read_only_(params.read_only != 0)
+    , hotlist_size_(0)
+    , default_quota_()
+    , tenant_memory_limit_{0}
+    , tenant_memory_{0}
+    , ingest_rate_{0}
+    , ingest_tokens_(0)
+    , nthrottled_{0}
+    , startup_()
 {
+    auto startup_begin = std::chrono::steady_clock::now();
+    path_ = path;
     metadata_.reset(new MetadataStorage(path));
+    if (read_only_) {
+        Logger::msg(AKU_LOG_INFO, "Open database in read-only mode");
+        metadata_->set_read_only();
+    }
 
     std::string metapath;
     std::vector<std::string> volpaths;
@@ -303,36 +673,241 @@ Storage::Storage(const char* path)
     std::string db_name = "db";
     metadata_->get_config_param("blockstore_type", &bstore_type);
     metadata_->get_config_param("db_name", &db_name);
+    // Databases created before the fanout became configurable use the default one
+    u16 fanout = StorageEngine::AKU_NBTREE_FANOUT;
+    std::string fanout_param;
+    if (metadata_->get_config_param("nbtree_fanout", &fanout_param)) {
+        fanout = static_cast<u16>(std::stoul(fanout_param));
+    }
+    StorageEngine::FileStorageParams bstore_params;
+    if (params.max_cache_size) {
+        bstore_params.cache_size = static_cast<size_t>(params.max_cache_size);
+    }
+    switch (params.durability) {
+    case AKU_DURABILITY_SPEED_TRADEOFF:
+        bstore_params.durability = StorageEngine::DurabilityPolicy::INTERVAL;
+        break;
+    case AKU_MAX_WRITE_SPEED:
+        bstore_params.durability = StorageEngine::DurabilityPolicy::ON_COMMIT;
+        break;
+    default:
+        bstore_params.durability = StorageEngine::DurabilityPolicy::EVERY_BLOCK;
+        break;
+    };
+    max_series_ = params.max_series;
+    write_buffer_budget_ = params.write_buffer_budget;
+    memory_limit_ = params.memory_limit;
+    compaction_min_fill_ = params.compaction_min_fill;
+    recompression_age_ = params.recompression_age;
+    if (params.query_memory_limit) {
+        query_memory_limit_ = params.query_memory_limit;
+    }
+    default_quota_.max_series = params.tenant_max_series;
+    default_quota_.memory_limit = params.tenant_memory_limit;
+    default_quota_.ingest_rate = params.tenant_ingest_rate;
+    if (params.archive_path) {
+        bstore_params.archive_path = params.archive_path;
+    }
+    bstore_params.archive_capacity = params.archive_capacity;
+    if (params.checksum_policy == AKU_CHECKSUM_FIRST_READ) {
+        bstore_params.checksum = StorageEngine::ChecksumPolicy::FIRST_READ;
+    }
+    switch (params.volume_access_pattern) {
+    case AKU_ACCESS_RANDOM:
+        bstore_params.access_pattern = StorageEngine::AccessPattern::RANDOM;
+        break;
+    case AKU_ACCESS_SEQUENTIAL:
+        bstore_params.access_pattern = StorageEngine::AccessPattern::SEQUENTIAL;
+        break;
+    default:
+        bstore_params.access_pattern = StorageEngine::AccessPattern::NORMAL;
+        break;
+    };
+    bstore_params.huge_pages = params.enable_huge_tlb != 0;
+    bstore_params.lock_current_volume = params.lock_current_volume != 0;
+    bstore_params.direct_io = params.direct_io != 0;
+    bstore_params.numa_aware = params.numa_aware != 0;
+    bstore_params.spare_volumes = params.spare_volumes;
+    bstore_params.read_only = read_only_;
     if (bstore_type == "FixedSizeFileStorage") {
         Logger::msg(AKU_LOG_INFO, "Open as fxied size storage");
-        bstore_ = StorageEngine::FixedSizeFileStorage::open(metadata_);
+        bstore_ = StorageEngine::FixedSizeFileStorage::open(metadata_, bstore_params);
     } else if (bstore_type == "ExpandableFileStorage") {
         Logger::msg(AKU_LOG_INFO, "Open as expandable storage");
-        bstore_ = StorageEngine::ExpandableFileStorage::open(metadata_);
+        bstore_ = StorageEngine::ExpandableFileStorage::open(metadata_, bstore_params);
     } else {
         Logger::msg(AKU_LOG_ERROR, "Unknown blockstore type (" + bstore_type + ")");
         AKU_PANIC("Unknown blockstore type (" + bstore_type + ")");
     }
-    cstore_ = std::make_shared<StorageEngine::ColumnStore>(bstore_);
+    if (read_only_) {
+        // Trees that weren't closed cleanly are repaired in memory
+        bstore_ = StorageEngine::BlockStoreBuilder::create_overlay(bstore_);
+    }
+    startup_.blockstore = elapsed_ns(startup_begin);
+    cstore_ = std::make_shared<StorageEngine::ColumnStore>(bstore_, parse_rollup_tiers(params.rollup_tiers),
+                                                           static_cast<size_t>(params.query_cache_size),
+                                                           params.reorder_window,
+                                                           params.write_ring_size,
+                                                           params.compression_workers,
+                                                           params.prefetch_blocks,
+                                                           fanout);
     // Update series matcher
+    global_matcher_.set_resident_limit(params.index_resident_metrics);
     boost::optional<u64> baseline = metadata_->get_prev_largest_id();
     if (baseline) {
         global_matcher_.series_id = baseline.get() + 1;
     }
-    auto status = metadata_->load_matcher_data(global_matcher_);
+    // Names from the index snapshot don't have to be parsed and indexed, only
+    // the names that were added after the last snapshot update are loaded
+    // from the metadata storage
+    u64 max_id = baseline ? baseline.get() : 0;
+    u64 last_id = 0;
+    auto phase_begin = std::chrono::steady_clock::now();
+    if (!read_only_) {
+        snapshot_.reset(new IndexSnapshot(std::string(path) + ".index"));
+        last_id = snapshot_->load(&global_matcher_, max_id);
+    }
+    startup_.index = elapsed_ns(phase_begin);
+    phase_begin = std::chrono::steady_clock::now();
+    auto status = metadata_->load_matcher_data(global_matcher_, last_id);
     if (status != AKU_SUCCESS) {
         Logger::msg(AKU_LOG_ERROR, "Can't read series names");
         AKU_PANIC("Can't read series names");
     }
-    // Update column store
-    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> mapping;
-    status = metadata_->load_rescue_points(mapping);
+    // Names of the deleted series are still stored if the sweep wasn't completed,
+    // such series are removed again and swept by the sync worker
+    std::vector<aku_ParamId> tombstones;
+    status = metadata_->load_tombstones(&tombstones);
     if (status != AKU_SUCCESS) {
-        Logger::msg(AKU_LOG_ERROR, "Can't read rescue points");
-        AKU_PANIC("Can't read rescue points");
+        Logger::msg(AKU_LOG_ERROR, "Can't read tombstones");
+        AKU_PANIC("Can't read tombstones");
     }
-    cstore_->open_or_restore(mapping, true);
-    start_sync_worker();
+    std::vector<SeriesMatcher::SeriesNameT> removed;
+    global_matcher_.remove(tombstones, &removed);
+    for (auto const& item: removed) {
+        deleted_.push_back(std::get<2>(item));
+    }
+    nseries_.store(global_matcher_.size());
+    startup_.matcher = elapsed_ns(phase_begin);
+    if (snapshot_ && last_id < max_id) {
+        std::vector<IndexSnapshot::SeriesT> tail;
+        for (u64 id = last_id + 1; id <= max_id; id++) {
+            auto str = global_matcher_.id2str(id);
+            if (str.second != 0) {
+                tail.push_back(std::make_tuple(str.first, str.second, id));
+            }
+        }
+        snapshot_->append(tail);
+    }
+    snapshot_id_ = max_id;
+    // Rescue points are written to the log by the sync, records that weren't
+    // saved to the metadata storage by the previous run are saved on open
+    StorageEngine::RescuePointLog::MappingT rplog_updates;
+    StorageEngine::RescuePointLog::IdSetT rplog_removed;
+    if (read_only_) {
+        // Records of the log can't be saved to the metadata storage, they're
+        // applied on top of the rescue points loaded from it
+        StorageEngine::RescuePointLog rplog(std::string(path) + ".rplog");
+        status = rplog.open(true);
+        if (status == AKU_SUCCESS) {
+            rplog.take_entries(&rplog_updates, &rplog_removed);
+        } else if (status != AKU_ENOT_FOUND) {
+            Logger::msg(AKU_LOG_ERROR, "Can't read rescue point log, " + StatusUtil::str(status));
+        }
+    } else {
+        status = metadata_->open_rescue_point_log(std::string(path) + ".rplog");
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Rescue points will be written to the metadata storage directly");
+        }
+    }
+    // Update column store. Rescue points and last values are taken from the
+    // checkpoint if the database was closed cleanly.
+    checkpoint_path_ = std::string(path) + ".checkpoint";
+    std::string generation;
+    metadata_->get_config_param(CHECKPOINT_GENERATION, &generation);
+    if (!generation.empty()) {
+        checkpoint_gen_ = std::strtoull(generation.c_str(), nullptr, 10);
+    }
+    std::vector<StorageEngine::ColumnCheckpoint> checkpoint;
+    phase_begin = std::chrono::steady_clock::now();
+    // Checkpoint is removed when loaded, rescue points are used instead in read-only
+    // mode (they're saved on close too)
+    status = read_only_ ? AKU_ENOT_FOUND
+                        : StorageEngine::Checkpoint::load(checkpoint_path_, checkpoint_gen_, &checkpoint);
+    if (status == AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_INFO, "Open " + std::to_string(checkpoint.size()) + " columns using the checkpoint");
+        std::unordered_set<aku_ParamId> deleted(tombstones.begin(), tombstones.end());
+        auto it = std::remove_if(checkpoint.begin(), checkpoint.end(),
+                                 [&deleted](StorageEngine::ColumnCheckpoint const& col) {
+                                     return deleted.count(col.id) != 0;
+                                 });
+        checkpoint.erase(it, checkpoint.end());
+        cstore_->open_checkpoint(checkpoint);
+    } else {
+        if (status != AKU_ENOT_FOUND) {
+            Logger::msg(AKU_LOG_INFO, "Checkpoint can't be used (" + StatusUtil::str(status) + ")");
+        }
+        std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> mapping;
+        status = metadata_->load_rescue_points(mapping);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't read rescue points");
+            AKU_PANIC("Can't read rescue points");
+        }
+        for (auto id: rplog_removed) {
+            mapping.erase(id);
+        }
+        for (auto& kv: rplog_updates) {
+            mapping[kv.first] = std::move(kv.second);
+        }
+        // Columns of the deleted series are not opened
+        for (auto id: tombstones) {
+            mapping.erase(id);
+        }
+        cstore_->open_or_restore(mapping);
+        startup_.restored = true;
+    }
+    startup_.columns = elapsed_ns(phase_begin);
+    // New generation is saved by the first sync before the rescue points are
+    // updated, after that the old checkpoint is not valid even if it wasn't removed
+    if (read_only_) {
+        checkpoint_path_.clear();
+    } else {
+        checkpoint_gen_++;
+        metadata_->set_config_param(CHECKPOINT_GENERATION, std::to_string(checkpoint_gen_));
+    }
+    // Replayed values should be rounded too
+    load_precision();
+    load_change_only();
+    if (params.input_log_path && read_only_) {
+        Logger::msg(AKU_LOG_INFO, "Input log is not used in read-only mode");
+    } else if (params.input_log_path) {
+        std::string logpath(params.input_log_path);
+        phase_begin = std::chrono::steady_clock::now();
+        replay_input_log(logpath);
+        startup_.replay = elapsed_ns(phase_begin);
+        input_log_max_size_ = params.input_log_max_size ? params.input_log_max_size
+                                                        : StorageEngine::AKU_DEFAULT_INPUT_LOG_MAX_SIZE;
+        input_log_path_ = logpath;
+        input_log_concurrency_ = params.input_log_concurrency;
+        inputlog_.reset(new StorageEngine::InputLog(logpath, params.input_log_concurrency,
+                                                    StorageEngine::AKU_DEFAULT_FLUSH_INTERVAL_MS));
+    }
+    status = metadata_->load_retention(&retention_);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read retention settings");
+        AKU_PANIC("Can't read retention settings");
+    }
+    if (!read_only_ && params.warmup_blocks != 0) {
+        hotlist_path_ = std::string(path) + ".hotblocks";
+        hotlist_size_ = params.warmup_blocks;
+        start_warmup();
+    }
+    load_tenants();
+    if (!read_only_) {
+        start_sync_worker();
+    }
+    startup_.total = elapsed_ns(startup_begin);
+    Logger::msg(AKU_LOG_INFO, "Database opened in " + std::to_string(startup_.total / 1000000) + "ms");
 }
 
 static std::string to_isostring(aku_Timestamp ts) {
@@ -555,6 +1130,88 @@ void dump_tree(std::ostream &stream,
     }
 };
 
+/** Dump trees on the thread pool.
+  * Every tree is dumped into its own buffer by the worker, buffers are written to the
+  * output stream by the calling thread in the order of completion. Number of completed
+  * buffers that wasn't written yet is bounded so memory use doesn't depend on the size
+  * of the database (workers wait for the writer if the output is slow).
+  */
+static void parallel_dump(std::ostream& stream,
+                          std::vector<aku_ParamId> const& ids,
+                          std::function<void(std::ostream&, aku_ParamId)> const& dump)
+{
+    enum {
+        MAX_WORKERS = 16,
+        //! Max number of completed buffers per worker
+        MAX_PENDING_PER_WORKER = 2,
+        //! Number of progress reports
+        NREPORTS = 10,
+    };
+    size_t nworkers = std::min(static_cast<size_t>(std::thread::hardware_concurrency()), ids.size());
+    nworkers = std::max(std::min(nworkers, static_cast<size_t>(MAX_WORKERS)), static_cast<size_t>(1));
+    const size_t max_pending = nworkers*MAX_PENDING_PER_WORKER;
+    size_t report_step = std::max(ids.size() / NREPORTS, static_cast<size_t>(1));
+
+    std::atomic<size_t> next(0);
+    std::mutex lock;
+    std::condition_variable produced;
+    std::condition_variable consumed;
+    std::deque<std::string> pending;
+    size_t nrunning = nworkers;
+
+    auto worker = [&]() {
+        set_thread_name("report-worker");
+        apply_thread_policy(AKU_THREAD_BACKGROUND);
+        size_t ix;
+        while ((ix = next++) < ids.size()) {
+            std::ostringstream buffer;
+            try {
+                dump(buffer, ids[ix]);
+            } catch (...) {
+                // Partially dumped tree is replaced by the error message
+                Logger::msg(AKU_LOG_ERROR, "Can't dump tree " + std::to_string(ids[ix]) + ", " +
+                                           boost::current_exception_diagnostic_information());
+                buffer.str(std::string());
+                buffer << "<fail>" << ids[ix] << "</fail>" << std::endl;
+            }
+            std::unique_lock<std::mutex> guard(lock);
+            consumed.wait(guard, [&] { return pending.size() < max_pending; });
+            pending.push_back(buffer.str());
+            produced.notify_one();
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        nrunning--;
+        produced.notify_one();
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nworkers; i++) {
+        threads.emplace_back(worker);
+    }
+    size_t ndone = 0;
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+        produced.wait(guard, [&] { return !pending.empty() || nrunning == 0; });
+        if (pending.empty()) {
+            break;
+        }
+        std::string buffer = std::move(pending.front());
+        pending.pop_front();
+        consumed.notify_one();
+        guard.unlock();
+        stream << buffer;
+        ndone++;
+        if (ndone % report_step == 0 || ndone == ids.size()) {
+            Logger::msg(AKU_LOG_INFO, "Report progress: " + std::to_string(ndone) + " of " +
+                                      std::to_string(ids.size()) + " trees");
+        }
+        guard.lock();
+    }
+    guard.unlock();
+    for (auto& th: threads) {
+        th.join();
+    }
+}
+
 aku_Status Storage::generate_report(const char* path, const char *output) {
     /* NOTE: this method generates XML report based on database structure.
      * Because database can be huge, this tool shouldn't consume memory
@@ -585,6 +1242,7 @@ aku_Status Storage::generate_report(const char* path, const char *output) {
     }
 
     // Load column-store mapping
+    metadata->open_rescue_point_log(std::string(path) + ".rplog");
     std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> mapping;
     status = metadata->load_rescue_points(mapping);
     if (status != AKU_SUCCESS) {
@@ -609,13 +1267,16 @@ aku_Status Storage::generate_report(const char* path, const char *output) {
     stream << "</volumes>" << std::endl;
 
     stream << "<database>" << std::endl;
-    for(auto kv: mapping) {
-        aku_ParamId id = kv.first;
-        std::vector<StorageEngine::LogicAddr> rescue_points = kv.second;
-        stream << "<tree>" << std::endl;
-        dump_tree(stream, bstore, matcher, id, rescue_points);
-        stream << "</tree>" << std::endl;
+    std::vector<aku_ParamId> ids;
+    ids.reserve(mapping.size());
+    for(auto const& kv: mapping) {
+        ids.push_back(kv.first);
     }
+    parallel_dump(stream, ids, [&](std::ostream& out, aku_ParamId id) {
+        out << "<tree>" << std::endl;
+        dump_tree(out, bstore, matcher, id, mapping.at(id));
+        out << "</tree>" << std::endl;
+    });
     stream << "</database>" << std::endl;
     stream << "</report>" << std::endl;
     return AKU_SUCCESS;
@@ -634,7 +1295,6 @@ aku_Status Storage::generate_recovery_report(const char* path, const char *outpu
     }
 
     auto bstore = StorageEngine::FixedSizeFileStorage::open(metadata);
-    auto cstore = std::make_shared<StorageEngine::ColumnStore>(bstore);
 
     // Load series matcher data
     PlainSeriesMatcher matcher;
@@ -645,6 +1305,7 @@ aku_Status Storage::generate_recovery_report(const char* path, const char *outpu
     }
 
     // Load column-store mapping
+    metadata->open_rescue_point_log(std::string(path) + ".rplog");
     std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> mapping;
     status = metadata->load_rescue_points(mapping);
     if (status != AKU_SUCCESS) {
@@ -652,9 +1313,6 @@ aku_Status Storage::generate_recovery_report(const char* path, const char *outpu
         return status;
     }
 
-    // Restore column store
-    cstore->open_or_restore(mapping);
-
     std::fstream outfile;
     if (output) {
         outfile.open(output, std::fstream::out);
@@ -672,24 +1330,35 @@ aku_Status Storage::generate_recovery_report(const char* path, const char *outpu
 
     stream << "<column_store>" << std::endl;
 
-    auto columns = cstore->_get_columns();
-    for(auto kv: columns) {
-        aku_ParamId id = kv.first;
-        std::shared_ptr<StorageEngine::NBTreeExtentsList> column = kv.second;
-        stream << "\t<column>" << std::endl;
+    // Columns are restored one by one and released after the dump, the whole
+    // column store is never kept in memory
+    std::vector<aku_ParamId> ids;
+    ids.reserve(mapping.size());
+    for(auto const& kv: mapping) {
+        ids.push_back(kv.first);
+    }
+    parallel_dump(stream, ids, [&](std::ostream& out, aku_ParamId id) {
+        auto const& rescue_points = mapping.at(id);
+        if (StorageEngine::NBTreeExtentsList::repair_status(rescue_points) ==
+                StorageEngine::NBTreeExtentsList::RepairStatus::REPAIR) {
+            Logger::msg(AKU_LOG_ERROR, "Repair needed, id=" + std::to_string(id));
+        }
+        auto column = std::make_shared<StorageEngine::NBTreeExtentsList>(id, rescue_points, bstore);
+        column->force_init();
+        out << "\t<column>" << std::endl;
         auto namekv = matcher.id2str(id);
         std::string name(namekv.first, namekv.first + namekv.second);
-        stream << "\t\t<id>" << id << "</id>\n";
-        stream << "\t\t<name>" << name << "</name>\n";
-        stream << "\t\t<extents>" << std::endl;
+        out << "\t\t<id>" << id << "</id>\n";
+        out << "\t\t<name>" << name << "</name>\n";
+        out << "\t\t<extents>" << std::endl;
         for(auto ext: column->get_extents()) {
-            stream << "\t\t\t<extent>" << std::endl;
-            ext->debug_dump(stream, 4, to_isostring);
-            stream << "\t\t\t</extent>" << std::endl;
+            out << "\t\t\t<extent>" << std::endl;
+            ext->debug_dump(out, 4, to_isostring);
+            out << "\t\t\t</extent>" << std::endl;
         }
-        stream << "\t\t</extents>" << std::endl;
-        stream << "\t</column>" << std::endl;
-    }
+        out << "\t\t</extents>" << std::endl;
+        out << "\t</column>" << std::endl;
+    });
     stream << "</column_store>" << std::endl;
     stream << "</report>" << std::endl;
     return AKU_SUCCESS;
@@ -705,87 +1374,1303 @@ Storage::Storage(std::shared_ptr<MetadataStorage>                  meta,
     , done_{0}
     , close_barrier_(2)
     , metadata_(meta)
+    , cqueries_(std::make_shared<QP::ContinuousQueries>())
+    , max_series_(0)
+    , nseries_{0}
+    , nrejected_{0}
+    , has_metric_limits_{false}
+    , write_buffer_budget_(0)
+    , write_buffer_size_{0}
+    , memory_limit_(0)
+    , memory_untracked_{0}
+    , nmemory_rejected_{0}
+    , compaction_min_fill_(0)
+    , compaction_count_{0}
+    , recompression_age_(0)
+    , recompression_count_{0}
+    , input_log_max_size_(0)
+    , input_log_concurrency_(0)
+    , deletion_gen_{0}
+    , snapshot_id_(0)
+    , checkpoint_gen_(0)
+    , query_memory_limit_(StorageEngine::AKU_QUERY_MEMORY_LIMIT)
+    , read_only_(false)
+    , hotlist_size_(0)
+    , default_quota_()
+    , tenant_memory_limit_{0}
+    , tenant_memory_{0}
+    , ingest_rate_{0}
+    , ingest_tokens_(0)
+    , nthrottled_{0}
+    , startup_()
 {
     if (start_worker) {
         start_sync_worker();
     }
 }
 
-void Storage::start_sync_worker() {
-    // This thread periodically sync rescue points and series names.
-    // It calls `flush` method of the blockstore and then `sync_with_metadata_storage` method
-    // if something needs to be synced.
-    // This order guarantees that metadata storage always contains correct rescue points and
-    // other metadata.
-    enum {
-        SYNC_REQUEST_TIMEOUT = 10000,
-    };
-    auto sync_worker = [this]() {
-        auto get_names = [this](std::vector<PlainSeriesMatcher::SeriesNameT>* names) {
-            std::lock_guard<std::mutex> guard(lock_);
-            global_matcher_.pull_new_names(names);
-        };
+static const std::string TENANT_PREFIX = "tenant.";
 
-        while(done_.load() == 0) {
-            auto status = metadata_->wait_for_sync_request(SYNC_REQUEST_TIMEOUT);
-            if (status == AKU_SUCCESS) {
-                bstore_->flush();
-                metadata_->sync_with_metadata_storage(get_names);
-            }
-        }
+Storage::Storage(Storage const& parent, std::string const& name, std::string const& path, TenantQuota const& quota)
+    : bstore_(parent.bstore_)
+    , done_{0}
+    , close_barrier_(2)
+    , cqueries_(std::make_shared<QP::ContinuousQueries>())
+    , max_series_(0)
+    , nseries_{0}
+    , nrejected_{0}
+    , has_metric_limits_{false}
+    , write_buffer_budget_(0)
+    , write_buffer_size_{0}
+    , memory_limit_(0)
+    , memory_untracked_{0}
+    , nmemory_rejected_{0}
+    , compaction_min_fill_(0)
+    , compaction_count_{0}
+    , recompression_age_(0)
+    , recompression_count_{0}
+    , input_log_max_size_(0)
+    , input_log_concurrency_(0)
+    , deletion_gen_{0}
+    , snapshot_id_(0)
+    , checkpoint_gen_(0)
+    , query_memory_limit_(parent.query_memory_limit_)
+    , read_only_(parent.read_only_)
+    , hotlist_size_(0)
+    , tenant_(name)
+    , default_quota_()
+    , tenant_memory_limit_{0}
+    , tenant_memory_{0}
+    , ingest_rate_{0}
+    , ingest_tokens_(0)
+    , nthrottled_{0}
+    , startup_()
+{
+    metadata_.reset(new MetadataStorage(path.c_str()));
+    if (read_only_) {
+        metadata_->set_read_only();
+    }
+    // Columns are small in comparison with the parent, query cache and rollups are not used,
+    // tenant shares the volumes of the parent so the fanout is the same
+    cstore_ = std::make_shared<StorageEngine::ColumnStore>(bstore_, std::vector<aku_Timestamp>(), 0, 0, 0, 0, 0,
+                                                           parent.cstore_->get_fanout());
+    global_matcher_.set_resident_limit(parent.global_matcher_.index.get_resident_limit());
+    boost::optional<u64> baseline = metadata_->get_prev_largest_id();
+    if (baseline) {
+        global_matcher_.series_id = baseline.get() + 1;
+    }
+    auto status = metadata_->load_matcher_data(global_matcher_);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read series names of the tenant " + name);
+        AKU_PANIC("Can't read series names");
+    }
+    std::vector<aku_ParamId> tombstones;
+    status = metadata_->load_tombstones(&tombstones);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read tombstones of the tenant " + name);
+        AKU_PANIC("Can't read tombstones");
+    }
+    std::vector<SeriesMatcher::SeriesNameT> removed;
+    global_matcher_.remove(tombstones, &removed);
+    for (auto const& item: removed) {
+        deleted_.push_back(std::get<2>(item));
+    }
+    nseries_.store(global_matcher_.size());
+    // Tenant doesn't have the shutdown checkpoint, columns are always opened
+    // using the rescue points
+    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> mapping;
+    status = metadata_->load_rescue_points(mapping);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read rescue points of the tenant " + name);
+        AKU_PANIC("Can't read rescue points");
+    }
+    for (auto id: tombstones) {
+        mapping.erase(id);
+    }
+    cstore_->open_or_restore(mapping);
+    load_precision();
+    load_change_only();
+    status = metadata_->load_retention(&retention_);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read retention settings of the tenant " + name);
+        AKU_PANIC("Can't read retention settings");
+    }
+    if (parent.inputlog_) {
+        // Every tenant has its own shards, records of the tenant are replayed
+        // into its own column store
+        auto logpath = boost::filesystem::path(parent.input_log_path_) / (TENANT_PREFIX + name);
+        input_log_path_ = logpath.string();
+        input_log_concurrency_ = parent.input_log_concurrency_;
+        input_log_max_size_ = parent.input_log_max_size_;
+        replay_input_log(input_log_path_);
+        inputlog_.reset(new StorageEngine::InputLog(input_log_path_, input_log_concurrency_,
+                                                    StorageEngine::AKU_DEFAULT_FLUSH_INTERVAL_MS));
+    }
+    set_quota(quota);
+}
 
-        close_barrier_.wait();
-    };
-    std::thread sync_worker_thread(sync_worker);
-    sync_worker_thread.detach();
+//! Tenant name should be usable as a part of the file name
+static bool is_valid_tenant_name(const char* name, size_t max_size) {
+    size_t len = strlen(name);
+    if (len == 0 || len > max_size) {
+        return false;
+    }
+    return std::all_of(name, name + len, [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_';
+    });
 }
 
-void Storage::close() {
-    // Wait for all ingestion sessions to stop
-    done_.store(1);
-    metadata_->force_sync();
-    close_barrier_.wait();
-    // Close column store
-    auto mapping = cstore_->close();
-    if (!mapping.empty()) {
-        for (auto kv: mapping) {
-            u64 id;
-            std::vector<u64> vals;
-            std::tie(id, vals) = kv;
-            metadata_->add_rescue_point(id, std::move(vals));
+void Storage::load_tenants() {
+    std::unordered_map<std::string, std::string> params;
+    auto status = metadata_->load_config_params(TENANT_PREFIX, &params);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read the list of tenants");
+        AKU_PANIC("Can't read the list of tenants");
+    }
+    for (auto const& kv: params) {
+        std::shared_ptr<Storage> tenant;
+        std::tie(status, tenant) = open_tenant(kv.first.c_str());
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't open tenant " + kv.first + ", " + StatusUtil::str(status));
         }
-        // Save finall mapping (should contain all affected columns)
-        metadata_->sync_with_metadata_storage(boost::bind(&SeriesMatcher::pull_new_names, &global_matcher_, _1));
     }
-    bstore_->flush();
 }
 
+std::tuple<aku_Status, std::shared_ptr<Storage>> Storage::open_tenant(const char* name) {
+    if (!is_valid_tenant_name(name, MAX_TENANT_NAME)) {
+        return std::make_tuple(AKU_EBAD_ARG, std::shared_ptr<Storage>());
+    }
+    if (!tenant_.empty()) {
+        // Tenants can't be nested
+        return std::make_tuple(AKU_ENOT_PERMITTED, std::shared_ptr<Storage>());
+    }
+    std::lock_guard<std::mutex> guard(tenants_lock_);
+    auto it = tenants_.find(name);
+    if (it != tenants_.end()) {
+        return std::make_tuple(AKU_SUCCESS, it->second);
+    }
+    std::string path = path_.empty() ? std::string(":memory:") : path_ + "." + TENANT_PREFIX + name;
+    if (read_only_ && (path_.empty() || !boost::filesystem::exists(path))) {
+        return std::make_tuple(AKU_ENOT_FOUND, std::shared_ptr<Storage>());
+    }
+    std::shared_ptr<Storage> tenant(new Storage(*this, name, path, default_quota_));
+    tenants_[name] = tenant;
+    if (!read_only_) {
+        // Saved by the next sync, before the metadata of the tenant
+        metadata_->set_config_param(TENANT_PREFIX + name, path);
+        Logger::msg(AKU_LOG_INFO, std::string("Tenant ") + name + " opened");
+    }
+    return std::make_tuple(AKU_SUCCESS, tenant);
+}
 
-void Storage::_update_rescue_points(aku_ParamId id, std::vector<StorageEngine::LogicAddr>&& rpoints) {
-    metadata_->add_rescue_point(id, std::move(rpoints));
+std::tuple<aku_Status, std::shared_ptr<StorageSession>> Storage::create_tenant_session(const char* name) {
+    aku_Status status;
+    std::shared_ptr<Storage> tenant;
+    std::tie(status, tenant) = open_tenant(name);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, std::shared_ptr<StorageSession>());
+    }
+    return std::make_tuple(AKU_SUCCESS, tenant->create_write_session());
 }
 
-std::shared_ptr<StorageSession> Storage::create_write_session() {
-    std::shared_ptr<StorageEngine::CStoreSession> session = std::make_shared<StorageEngine::CStoreSession>(cstore_);
-    return std::make_shared<StorageSession>(shared_from_this(), session);
+aku_Status Storage::set_tenant_quota(const char* name, TenantQuota const& quota) {
+    aku_Status status;
+    std::shared_ptr<Storage> tenant;
+    std::tie(status, tenant) = open_tenant(name);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    tenant->set_quota(quota);
+    return AKU_SUCCESS;
 }
 
-aku_Status Storage::init_series_id(const char* begin, const char* end, aku_Sample *sample, PlainSeriesMatcher *local_matcher) {
-    u64 id = 0;
-    bool create_new = false;
+void Storage::set_quota(TenantQuota const& quota) {
+    max_series_.store(quota.max_series);
+    tenant_memory_limit_.store(quota.memory_limit);
+    std::lock_guard<std::mutex> guard(ingest_lock_);
+    if (ingest_rate_.load() == 0) {
+        // Bucket starts full
+        ingest_tokens_ = static_cast<double>(quota.ingest_rate);
+        ingest_refill_ = std::chrono::steady_clock::now();
+    }
+    ingest_rate_.store(quota.ingest_rate);
+}
+
+std::vector<std::shared_ptr<Storage>> Storage::get_tenants() const {
+    std::vector<std::shared_ptr<Storage>> result;
+    std::lock_guard<std::mutex> guard(tenants_lock_);
+    for (auto const& kv: tenants_) {
+        result.push_back(kv.second);
+    }
+    return result;
+}
+
+u64 Storage::get_own_memory_use() const {
+    return global_matcher_.index_memory_use() + global_matcher_.pool_memory_use()
+         + cstore_->_get_uncommitted_memory() + cstore_->_get_query_cache_size();
+}
+
+void Storage::maintain_tenant() {
+    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rpoints;
+    cstore_->pull_rescue_points(&rpoints);
+    auto used = get_own_memory_use();
+    auto limit = tenant_memory_limit_.load();
+    if (limit != 0 && used > limit) {
+        // Write buffers is the only part that can be released, the index is
+        // limited by rejecting new series
+        size_t nbuffered = cstore_->_get_uncommitted_memory();
+        size_t excess = static_cast<size_t>(used - limit);
+        cstore_->release_write_buffers(nbuffered > excess ? nbuffered - excess : 0, &rpoints);
+        used = get_own_memory_use();
+    }
+    tenant_memory_.store(used);
+    if (!rpoints.empty()) {
+        _update_rescue_points(std::move(rpoints));
+    }
+}
+
+void Storage::sync_tenant() {
+    // Tombstones are added before the ids, so they are written by this sync
+    std::vector<aku_ParamId> deleted;
     {
         std::lock_guard<std::mutex> guard(lock_);
-        id = global_matcher_.match(begin, end);
-        if (id == 0) {
-            // create new series
-            id = global_matcher_.add(begin, end);
-            metadata_->add_rescue_point(id, std::vector<u64>());
-            create_new = true;
+        std::swap(deleted, deleted_);
+    }
+    auto get_names = [this](std::vector<PlainSeriesMatcher::SeriesNameT>* names) {
+        std::lock_guard<std::mutex> guard(lock_);
+        global_matcher_.pull_new_names(names);
+    };
+    metadata_->sync_with_metadata_storage(get_names);
+    if (!deleted.empty()) {
+        sweep(deleted);
+    }
+}
+
+void Storage::close_tenant_columns() {
+    auto mapping = cstore_->close();
+    if (read_only_) {
+        return;
+    }
+    for (auto kv: mapping) {
+        metadata_->add_rescue_point(kv.first, std::move(kv.second));
+    }
+}
+
+bool Storage::rotate_tenant_input_log() {
+    if (!inputlog_ || inputlog_->get_size() <= input_log_max_size_) {
+        return false;
+    }
+    rotate_input_log();
+    return true;
+}
+
+u64 Storage::_take_ingest_tokens(u64 n) {
+    std::lock_guard<std::mutex> guard(ingest_lock_);
+    auto rate = ingest_rate_.load();
+    if (rate == 0) {
+        return n;
+    }
+    // Bucket size is equal to the rate, so the burst can't be longer than one second
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - ingest_refill_).count();
+    ingest_refill_ = now;
+    ingest_tokens_ = std::min(static_cast<double>(rate), ingest_tokens_ + elapsed*static_cast<double>(rate));
+    u64 ntaken = std::min(n, static_cast<u64>(ingest_tokens_));
+    ingest_tokens_ -= static_cast<double>(ntaken);
+    return ntaken;
+}
+
+bool Storage::_has_ingest_quota() const {
+    return ingest_rate_.load() != 0;
+}
+
+void Storage::_add_throttled(u64 n) {
+    nthrottled_ += n;
+}
+
+void Storage::start_sync_worker() {
+    // This thread periodically sync rescue points and series names.
+    // It calls `flush` method of the blockstore and then `sync_with_metadata_storage` method
+    // if something needs to be synced.
+    // This order guarantees that metadata storage always contains correct rescue points and
+    // other metadata.
+    enum {
+        SYNC_REQUEST_TIMEOUT = 10000,
+        //! Max number of rescue points written by one sync transaction
+        SYNC_MAX_RESCUE_POINTS = 0x10000,
+        //! Min interval between write buffer budget checks (in milliseconds)
+        RELEASE_INTERVAL = 1000,
+        //! Min interval between background compaction passes (in milliseconds)
+        COMPACTION_INTERVAL = 600000,
+        //! Min interval between hot block list updates (in milliseconds)
+        HOTLIST_INTERVAL = 300000,
+    };
+    auto sync_worker = [this]() {
+        set_thread_name("sync-worker");
+        apply_thread_policy(AKU_THREAD_BACKGROUND);
+        std::vector<PlainSeriesMatcher::SeriesNameT> synced;
+        auto get_names = [this, &synced](std::vector<PlainSeriesMatcher::SeriesNameT>* names) {
+            std::lock_guard<std::mutex> guard(lock_);
+            global_matcher_.pull_new_names(names);
+            synced = *names;
+        };
+
+        auto take_deleted = [this]() {
+            std::vector<aku_ParamId> deleted;
+            std::lock_guard<std::mutex> guard(lock_);
+            std::swap(deleted, deleted_);
+            return deleted;
+        };
+        {
+            // Series that weren't swept before restart, tombstones are already written
+            auto deleted = take_deleted();
+            if (!deleted.empty()) {
+                sweep(deleted);
+            }
+        }
+
+        auto last_release = std::chrono::steady_clock::now();
+        auto last_compaction = last_release;
+        auto last_hotlist = last_release;
+        auto last_log_flush = last_release;
+        while(done_.load() == 0) {
+            auto status = metadata_->wait_for_sync_request(SYNC_REQUEST_TIMEOUT);
+            if (status == AKU_SUCCESS) {
+                // Tombstones are added before the ids, so they are written by this sync
+                auto deleted = take_deleted();
+                bstore_->flush();
+                metadata_->sync_with_metadata_storage(get_names, SYNC_MAX_RESCUE_POINTS);
+                update_snapshot(&synced);
+                if (!deleted.empty()) {
+                    sweep(deleted);
+                }
+            }
+            {
+                // Columns flushed by the compression workers since the last iteration,
+                // new rescue points will be saved by the next sync
+                std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rpoints;
+                cstore_->pull_rescue_points(&rpoints);
+                if (!rpoints.empty()) {
+                    _update_rescue_points(std::move(rpoints));
+                }
+            }
+            {
+                std::vector<std::shared_ptr<Storage>> pending;
+                std::vector<std::shared_ptr<Storage>> rotated;
+                for (auto const& tenant: get_tenants()) {
+                    tenant->maintain_tenant();
+                    if (tenant->rotate_tenant_input_log()) {
+                        rotated.push_back(tenant);
+                        pending.push_back(tenant);
+                    } else if (tenant->metadata_->wait_for_sync_request(0) == AKU_SUCCESS) {
+                        pending.push_back(tenant);
+                    }
+                }
+                if (!pending.empty()) {
+                    // Metadata of the tenants references blocks of the shared block store,
+                    // blocks and volume records should be saved first
+                    bstore_->flush();
+                    metadata_->sync_with_metadata_storage(get_names, SYNC_MAX_RESCUE_POINTS);
+                    update_snapshot(&synced);
+                    for (auto const& tenant: pending) {
+                        tenant->sync_tenant();
+                    }
+                }
+                for (auto const& tenant: rotated) {
+                    // Rescue points of the committed leaf nodes are saved by `sync_tenant`
+                    tenant->inputlog_->remove_old();
+                }
+            }
+            auto now = std::chrono::steady_clock::now();
+            bool has_budget = write_buffer_budget_ != 0 || memory_limit_ != 0;
+            if (has_budget && now - last_release > std::chrono::milliseconds(RELEASE_INTERVAL)) {
+                // New rescue points will be saved by the next sync
+                release_write_buffers();
+                last_release = now;
+            }
+            bool has_compaction = compaction_min_fill_ > 0 || recompression_age_ != 0;
+            if (has_compaction && now - last_compaction > std::chrono::milliseconds(COMPACTION_INTERVAL)) {
+                compact();
+                last_compaction = std::chrono::steady_clock::now();
+            }
+            if (!hotlist_path_.empty() && now - last_hotlist > std::chrono::milliseconds(HOTLIST_INTERVAL)) {
+                save_hot_blocks();
+                last_hotlist = now;
+            }
+            if (inputlog_ && now - last_log_flush >= inputlog_->get_commit_interval()) {
+                // Shards are committed by `append` only when new records arrive,
+                // records of the idle shards are written here
+                inputlog_->flush();
+                for (auto const& tenant: get_tenants()) {
+                    if (tenant->inputlog_) {
+                        tenant->inputlog_->flush();
+                    }
+                }
+                last_log_flush = now;
+            }
+            if (inputlog_ && inputlog_->get_size() > input_log_max_size_) {
+                // Old log files can be removed only after every value from them
+                // was committed and the rescue points were saved
+                rotate_input_log();
+                bstore_->flush();
+                metadata_->sync_with_metadata_storage(get_names);
+                update_snapshot(&synced);
+                inputlog_->remove_old();
+            }
+        }
+
+        close_barrier_.wait();
+    };
+    std::thread sync_worker_thread(sync_worker);
+    sync_worker_thread.detach();
+}
+
+void Storage::start_warmup() {
+    std::vector<StorageEngine::LogicAddr> addrs;
+    auto status = StorageEngine::HotBlockList::load(hotlist_path_, &addrs);
+    if (status != AKU_SUCCESS) {
+        if (status != AKU_ENOT_FOUND) {
+            Logger::msg(AKU_LOG_ERROR, "Can't read hot block list, " + StatusUtil::str(status));
+        }
+        return;
+    }
+    if (addrs.size() > hotlist_size_) {
+        addrs.resize(hotlist_size_);
+    }
+    // Queries are served while the cache is loaded, hottest blocks go first
+    warmup_task_ = std::async(std::launch::async, [this, addrs]() {
+        enum {
+            //! Number of blocks prefetched at once
+            WARMUP_BATCH = 256,
+        };
+        set_thread_name("warmup");
+        apply_thread_policy(AKU_THREAD_BACKGROUND);
+        auto start = std::chrono::steady_clock::now();
+        size_t ix = 0;
+        for (; ix < addrs.size() && done_.load() == 0; ix += WARMUP_BATCH) {
+            auto end = std::min(addrs.size(), ix + WARMUP_BATCH);
+            bstore_->warmup(std::vector<StorageEngine::LogicAddr>(addrs.begin() + ix, addrs.begin() + end));
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        Logger::msg(AKU_LOG_INFO, "Cache warmup completed, " + std::to_string(std::min(ix, addrs.size())) +
+                                  " blocks loaded in " + std::to_string(elapsed.count()) + "ms");
+    });
+}
+
+void Storage::save_hot_blocks() {
+    auto addrs = bstore_->get_hot_blocks(hotlist_size_);
+    if (addrs.empty()) {
+        // Cache is not used by the blockstore or wasn't filled yet, previous list is kept
+        return;
+    }
+    auto status = StorageEngine::HotBlockList::write(hotlist_path_, addrs);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't write hot block list, " + StatusUtil::str(status));
+    }
+}
+
+void Storage::release_write_buffers() {
+    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rpoints;
+    u64 budget = write_buffer_budget_ != 0 ? write_buffer_budget_ : std::numeric_limits<u64>::max();
+    if (memory_limit_ != 0) {
+        auto untracked = get_untracked_memory_use();
+        auto tracked = MemoryAccounting::get_all();
+        u64 nuntracked = std::accumulate(untracked.begin(), untracked.end(), 0ull);
+        u64 total = std::accumulate(tracked.begin(), tracked.end(), nuntracked);
+        memory_untracked_.store(nuntracked);
+        if (total > memory_limit_) {
+            // Uncommitted leaf nodes is the only memory that can be freed without losing anything
+            u64 excess = total - memory_limit_;
+            u64 nbuffered = untracked[AKU_MEM_WRITE_BUFFERS];
+            budget = std::min(budget, nbuffered > excess ? nbuffered - excess : static_cast<u64>(0));
+        }
+    }
+    auto size = cstore_->release_write_buffers(static_cast<size_t>(budget), &rpoints);
+    write_buffer_size_.store(size);
+    if (!rpoints.empty()) {
+        Logger::msg(AKU_LOG_TRACE, "Write buffer budget exceeded, " + std::to_string(rpoints.size()) +
+                                   " leaf nodes committed");
+    }
+    _update_rescue_points(std::move(rpoints));
+}
+
+MemoryAccounting::Snapshot Storage::get_untracked_memory_use() const {
+    MemoryAccounting::Snapshot result = {};
+    result[AKU_MEM_POSTINGS]      = global_matcher_.index_memory_use();
+    result[AKU_MEM_STRING_POOL]   = global_matcher_.pool_memory_use();
+    result[AKU_MEM_WRITE_BUFFERS] = cstore_->_get_uncommitted_memory();
+    result[AKU_MEM_BLOCK_CACHE]   = bstore_->get_stats().cache.size;
+    result[AKU_MEM_QUERY_CACHE]   = cstore_->_get_query_cache_size();
+    for (auto const& tenant: get_tenants()) {
+        result[AKU_MEM_POSTINGS]      += tenant->global_matcher_.index_memory_use();
+        result[AKU_MEM_STRING_POOL]   += tenant->global_matcher_.pool_memory_use();
+        result[AKU_MEM_WRITE_BUFFERS] += tenant->cstore_->_get_uncommitted_memory();
+        result[AKU_MEM_QUERY_CACHE]   += tenant->cstore_->_get_query_cache_size();
+    }
+    return result;
+}
+
+MemoryAccounting::Snapshot Storage::get_memory_use() const {
+    auto result = MemoryAccounting::get_all();
+    auto untracked = get_untracked_memory_use();
+    for (size_t i = 0; i < result.size(); i++) {
+        result[i] += untracked[i];
+    }
+    return result;
+}
+
+bool Storage::check_memory_limit() const {
+    if (memory_limit_ == 0) {
+        return true;
+    }
+    // Untracked part is updated periodically, tracked part (cursors, sessions, etc) can
+    // grow quickly and is always up to date
+    auto tracked = MemoryAccounting::get_all();
+    u64 total = std::accumulate(tracked.begin(), tracked.end(), memory_untracked_.load());
+    if (total > memory_limit_) {
+        nmemory_rejected_++;
+        return false;
+    }
+    return true;
+}
+
+void Storage::_set_memory_limit(u64 limit) {
+    memory_limit_ = limit;
+}
+
+void Storage::compact() {
+    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rpoints;
+    if (recompression_age_ != 0) {
+        auto nrewritten = cstore_->recompress(recompression_age_, &rpoints);
+        recompression_count_ += nrewritten;
+        if (nrewritten != 0) {
+            Logger::msg(AKU_LOG_INFO, "Background recompression, " + std::to_string(nrewritten) + " columns rewritten");
+        }
+    }
+    if (compaction_min_fill_ > 0) {
+        auto ncompacted = cstore_->compact(compaction_min_fill_, &rpoints);
+        compaction_count_ += ncompacted;
+        if (ncompacted != 0) {
+            Logger::msg(AKU_LOG_INFO, "Background compaction, " + std::to_string(ncompacted) + " columns rewritten");
+        }
+    }
+    _update_rescue_points(std::move(rpoints));
+}
+
+void Storage::close() {
+    if (!tenant_.empty()) {
+        // Tenant is closed by the parent, its metadata is synced after the shared block store
+        return;
+    }
+    if (read_only_) {
+        // Nothing to save, blocks created by the repair are dropped
+        done_.store(1);
+        for (auto const& tenant: get_tenants()) {
+            tenant->close_tenant_columns();
+        }
+        cstore_->close();
+        return;
+    }
+    // Wait for all ingestion sessions to stop
+    done_.store(1);
+    metadata_->force_sync();
+    close_barrier_.wait();
+    if (warmup_task_.valid()) {
+        warmup_task_.wait();
+    }
+    if (!hotlist_path_.empty()) {
+        // Saved before the column store is closed, it doesn't read anything after that
+        save_hot_blocks();
+    }
+    // Close column stores, rescue points of the tenants are saved after the
+    // blocks and the metadata of the parent
+    auto tenants = get_tenants();
+    for (auto const& tenant: tenants) {
+        tenant->close_tenant_columns();
+    }
+    auto mapping = cstore_->close();
+    for (auto kv: mapping) {
+        u64 id;
+        std::vector<u64> vals;
+        std::tie(id, vals) = kv;
+        metadata_->add_rescue_point(id, std::move(vals));
+    }
+    // Blocks should be written before the metadata that references them,
+    // volume updates are passed to the metadata storage by `flush`
+    bstore_->flush();
+    // Save finall mapping (should contain all affected columns) and
+    // the generation of the checkpoint
+    std::vector<PlainSeriesMatcher::SeriesNameT> synced;
+    auto get_names = [this, &synced](std::vector<PlainSeriesMatcher::SeriesNameT>* names) {
+        global_matcher_.pull_new_names(names);
+        synced = *names;
+    };
+    metadata_->sync_with_metadata_storage(get_names);
+    metadata_->compact_rescue_point_log();
+    update_snapshot(&synced);
+    for (auto const& tenant: tenants) {
+        tenant->sync_tenant();
+    }
+    if (!checkpoint_path_.empty()) {
+        // Written last, metadata and blocks referenced by the checkpoint are already durable
+        auto status = StorageEngine::Checkpoint::write(checkpoint_path_, checkpoint_gen_, cstore_->get_checkpoint());
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't write checkpoint, error: " + StatusUtil::str(status));
+        }
+    }
+    if (inputlog_) {
+        // Everything is committed, log is not needed anymore
+        inputlog_->rotate();
+        inputlog_->remove_old();
+        for (auto const& tenant: tenants) {
+            if (tenant->inputlog_) {
+                tenant->inputlog_->rotate();
+                tenant->inputlog_->remove_old();
+            }
+        }
+    }
+}
+
+void Storage::replay_input_log(std::string const& path) {
+    using namespace StorageEngine;
+    std::vector<InputLog::Record> records;
+    auto status = InputLog::read_all(path, &records);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read input log");
+        AKU_PANIC("Can't read input log");
+    }
+    if (records.empty()) {
+        return;
+    }
+    // Records are grouped by series, order of records of the series is preserved
+    std::unordered_map<aku_ParamId, std::vector<InputLog::Record>> series;
+    for (auto const& rec: records) {
+        series[rec.id].push_back(rec);
+    }
+    std::unordered_map<aku_ParamId, std::vector<LogicAddr>> rpoints;
+    size_t nreplayed = 0, nduplicates = 0, nlate = 0;
+    for (auto& kv: series) {
+        auto& recs = kv.second;
+        std::vector<aku_Sample> dest;
+        status = cstore_->read_last({ kv.first }, &dest);
+        if (status == AKU_SUCCESS && !dest.empty() && recs.front().timestamp <= dest.front().timestamp) {
+            // Records that are not newer than the last committed value are either committed
+            // before the crash or were held by the reorder buffer, only the stored ones are skipped
+            nduplicates += remove_committed(kv.first, dest.front().timestamp, &recs);
+        }
+        for (auto const& rec: recs) {
+            aku_Sample sample = {};
+            sample.paramid = rec.id;
+            sample.timestamp = rec.timestamp;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.size = sizeof(aku_Sample);
+            sample.payload.float64 = rec.value;
+            std::vector<LogicAddr> rp;
+            switch (cstore_->write(sample, &rp)) {
+            case NBTreeAppendResult::OK_FLUSH_NEEDED:
+                rpoints[rec.id] = std::move(rp);
+                nreplayed++;
+                break;
+            case NBTreeAppendResult::OK:
+                nreplayed++;
+                break;
+            case NBTreeAppendResult::FAIL_LATE_WRITE:
+                nlate++;
+                break;
+            case NBTreeAppendResult::FAIL_BAD_ID:
+            case NBTreeAppendResult::FAIL_BAD_VALUE:
+                break;
+            };
+        }
+    }
+    _update_rescue_points(std::move(rpoints));
+    Logger::msg(AKU_LOG_INFO, std::to_string(nreplayed) + " of " + std::to_string(records.size()) +
+                              " values restored from the input log, " + std::to_string(nduplicates) +
+                              " already committed");
+    if (nlate != 0) {
+        Logger::msg(AKU_LOG_ERROR, std::to_string(nlate) + " values from the input log are older than "
+                                   "the last committed value and can't be restored");
+    }
+}
+
+size_t Storage::remove_committed(aku_ParamId id, aku_Timestamp last, std::vector<StorageEngine::InputLog::Record>* recs) {
+    using namespace StorageEngine;
+    // Timestamps of the stored values that can be matched by the records
+    std::vector<aku_Timestamp> stored;
+    std::vector<std::unique_ptr<RealValuedOperator>> ops;
+    auto status = cstore_->scan({ id }, recs->front().timestamp, last + 1, &ops);
+    if (status == AKU_SUCCESS && !ops.empty()) {
+        const size_t SZBUF = 0x100;
+        std::vector<aku_Timestamp> outts(SZBUF, 0);
+        std::vector<double> outxs(SZBUF, 0);
+        size_t size = 0;
+        while (status == AKU_SUCCESS) {
+            std::tie(status, size) = ops.front()->read(outts.data(), outxs.data(), SZBUF);
+            stored.insert(stored.end(), outts.begin(), outts.begin() + static_cast<long>(size));
+        }
+    }
+    if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read column " + std::to_string(id) + " during input log replay, " +
+                                   StatusUtil::str(status));
+    }
+    return InputLog::remove_stored(recs, stored);
+}
+
+void Storage::rotate_input_log() {
+    auto status = inputlog_->rotate();
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't rotate input log, " + StatusUtil::str(status));
+    }
+    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rpoints;
+    std::vector<aku_Sample> pending;
+    auto ncommitted = cstore_->commit_write_buffers(&rpoints, &pending);
+    // Values from the reorder buffers can't be committed so they're moved to the new files
+    for (auto const& sample: pending) {
+        inputlog_->append(0, sample.paramid, sample.timestamp, sample.payload.float64);
+    }
+    inputlog_->flush();
+    Logger::msg(AKU_LOG_INFO, "Input log truncated, " + std::to_string(ncommitted) + " leaf nodes committed");
+    _update_rescue_points(std::move(rpoints));
+}
+
+void Storage::update_snapshot(std::vector<PlainSeriesMatcher::SeriesNameT>* names) {
+    for (auto const& item: *names) {
+        snapshot_id_ = std::max(snapshot_id_, std::get<2>(item));
+    }
+    // Names are appended after they were written to the metadata storage
+    if (snapshot_ && !names->empty()) {
+        auto status = snapshot_->append(*names);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't update index snapshot, " + StatusUtil::str(status));
+        }
+    }
+    names->clear();
+}
+
+void Storage::sweep(std::vector<aku_ParamId> const& ids) {
+    size_t ncolumns = 0;
+    for (auto id: ids) {
+        if (cstore_->remove_column(id) == AKU_SUCCESS) {
+            ncolumns++;
+        }
+    }
+    // Sessions could cache removed columns
+    deletion_gen_++;
+    if (snapshot_) {
+        // Only the names that were written to the metadata storage can be saved
+        std::vector<IndexSnapshot::SeriesT> names;
+        for (auto id: global_matcher_.get_all_ids()) {
+            if (id > snapshot_id_) {
+                break;
+            }
+            auto str = global_matcher_.id2str(id);
+            if (str.first != nullptr) {
+                names.push_back(std::make_tuple(str.first, str.second, id));
+            }
+        }
+        auto status = snapshot_->rewrite(names);
+        if (status != AKU_SUCCESS) {
+            // Deleted names will be skipped on load using tombstones
+            Logger::msg(AKU_LOG_ERROR, "Can't rewrite index snapshot, " + StatusUtil::str(status));
+        }
+    }
+    metadata_->remove_series(ids);
+    Logger::msg(AKU_LOG_INFO, std::to_string(ids.size()) + " deleted series swept, " +
+                              std::to_string(ncolumns) + " columns removed");
+}
+
+aku_Status Storage::delete_series(const char* query, u64* count) {
+    using namespace QP;
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    boost::property_tree::ptree ptree;
+    aku_Status status;
+    std::tie(status, ptree) = QueryParser::parse_json(query);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    std::vector<aku_ParamId> ids;
+    std::tie(status, ids) = QueryParser::parse_search_query(ptree, global_matcher_);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    // Deleted series can't be found by queries after this point, writes
+    // that use the same names will create new series
+    std::vector<SeriesMatcher::SeriesNameT> removed;
+    global_matcher_.remove(ids, &removed);
+    std::vector<aku_ParamId> deleted;
+    deleted.reserve(removed.size());
+    for (auto const& item: removed) {
+        const char* name = std::get<0>(item);
+        release_series(name, name + std::get<1>(item));
+        deleted.push_back(std::get<2>(item));
+    }
+    {
+        // Sync worker should see the ids only if their tombstones are pending or written
+        std::lock_guard<std::mutex> guard(lock_);
+        metadata_->add_tombstones(deleted);
+        deleted_.insert(deleted_.end(), deleted.begin(), deleted.end());
+    }
+    deletion_gen_++;
+    if (count) {
+        *count = deleted.size();
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status Storage::backup(const char* dest, const char* base, u64 rate) {
+    if (read_only_) {
+        // Metadata storage can't be attached and exported
+        return AKU_ENOT_PERMITTED;
+    }
+    boost::filesystem::path dir(dest);
+    StorageEngine::BackupManifest manifest = {};
+    if (base != nullptr && *base != '\0') {
+        StorageEngine::BackupManifest prev;
+        auto path = boost::filesystem::path(base) / "manifest";
+        auto status = prev.read(path.string());
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't read " + path.string() + ", " + StatusUtil::str(status));
+            return status;
+        }
+        manifest.since_addr = prev.until_addr;
+        manifest.since_series = prev.until_series;
+    }
+    boost::system::error_code error;
+    boost::filesystem::create_directories(dir, error);
+    if (error) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + dir.string() + ", error: " + error.message());
+        return AKU_EACCESS;
+    }
+    if (boost::filesystem::exists(dir / "manifest")) {
+        Logger::msg(AKU_LOG_ERROR, dir.string() + " already contains a backup");
+        return AKU_EBAD_ARG;
+    }
+    // Metadata is copied first, blocks referenced by the rescue points are already
+    // written so they're below the top address
+    auto status = metadata_->export_metadata((dir / "metadata.db").string(),
+                                             manifest.since_series, &manifest.until_series);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    for (auto const& tenant: get_tenants()) {
+        // Tenants reference blocks of the shared block store too
+        u64 until_series = 0;
+        auto path = dir / ("metadata.db." + TENANT_PREFIX + tenant->tenant_);
+        status = tenant->metadata_->export_metadata(path.string(), 0, &until_series);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't export metadata of the tenant " + tenant->tenant_);
+            return status;
+        }
+    }
+    manifest.until_addr = bstore_->get_top_addr();
+
+    StorageEngine::BackupWriter writer((dir / "blocks").string(), rate);
+    status = writer.open();
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    aku_Status write_status = AKU_SUCCESS;
+    status = bstore_->read_range(manifest.since_addr, manifest.until_addr,
+                                 [&](std::shared_ptr<StorageEngine::Block> block) {
+        write_status = writer.append(block->get_addr(), block->get_cdata(), block->get_size());
+        return write_status == AKU_SUCCESS;
+    });
+    if (status == AKU_SUCCESS) {
+        status = write_status;
+    }
+    auto close_status = writer.close();
+    if (status == AKU_SUCCESS) {
+        status = close_status;
+    }
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't write backup, " + StatusUtil::str(status));
+        return status;
+    }
+    manifest.nblocks = writer.nblocks();
+    status = manifest.write((dir / "manifest").string());
+    if (status == AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_INFO, "Backup " + dir.string() + " created, " + std::to_string(manifest.nblocks) +
+                                  " blocks in [" + std::to_string(manifest.since_addr) + ", " +
+                                  std::to_string(manifest.until_addr) + ") range");
+    }
+    return status;
+}
+
+bool Storage::is_read_only() const {
+    return read_only_;
+}
+
+u64 Storage::_get_deletion_generation() const {
+    return deletion_gen_.load();
+}
+
+bool Storage::_is_deleted(aku_ParamId id) const {
+    return global_matcher_.id2str(id).first == nullptr;
+}
+
+aku_Status Storage::set_retention(const char* metric, aku_Timestamp retention) {
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    std::string name(metric);
+    if (name.empty() || name.find_first_of(" \t\n") != std::string::npos) {
+        return AKU_EBAD_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (retention == 0) {
+            retention_.erase(name);
+        } else {
+            retention_[name] = retention;
+        }
+    }
+    metadata_->set_retention(name, retention);
+    return AKU_SUCCESS;
+}
+
+aku_Status Storage::set_series_limit(const char* metric, u64 limit) {
+    std::string name(metric);
+    if (name.empty() || name.find_first_of(" \t\n") != std::string::npos) {
+        return AKU_EBAD_ARG;
+    }
+    std::lock_guard<std::mutex> guard(limits_lock_);
+    if (limit == 0) {
+        metric_limits_.erase(name);
+    } else {
+        SeriesLimit item = { limit, global_matcher_.metric_cardinality(name.data(), name.data() + name.size()) };
+        metric_limits_[name] = item;
+    }
+    has_metric_limits_.store(!metric_limits_.empty());
+    return AKU_SUCCESS;
+}
+
+//! Name prefix of the precision hints in the configuration table
+static const std::string PRECISION_PREFIX = "precision.";
+
+aku_Status Storage::set_precision(const char* metric, int digits) {
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    std::string name(metric);
+    if (name.empty() || name.find_first_of(" \t\n") != std::string::npos) {
+        return AKU_EBAD_ARG;
+    }
+    if (digits > AKU_MAX_PRECISION) {
+        return AKU_EBAD_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (digits < 0) {
+            precision_.erase(name);
+        } else {
+            precision_[name] = digits;
+        }
+    }
+    metadata_->set_config_param(PRECISION_PREFIX + name, digits < 0 ? std::string() : std::to_string(digits));
+    apply_precision(name, digits);
+    return AKU_SUCCESS;
+}
+
+void Storage::load_precision() {
+    std::unordered_map<std::string, std::string> params;
+    auto status = metadata_->load_config_params(PRECISION_PREFIX, &params);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read precision settings");
+        AKU_PANIC("Can't read precision settings");
+    }
+    for (auto const& kv: params) {
+        int digits = -1;
+        try {
+            digits = std::stoi(kv.second);
+        } catch (std::exception const&) {
+            Logger::msg(AKU_LOG_ERROR, "Invalid precision setting of the " + kv.first + " metric");
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            precision_[kv.first] = digits;
+        }
+        apply_precision(kv.first, digits);
+    }
+}
+
+std::vector<aku_ParamId> Storage::get_metric_ids(std::string const& metric) const {
+    std::vector<aku_ParamId> ids;
+    for (auto id: global_matcher_.get_all_ids()) {
+        auto sname = global_matcher_.id2str(id);
+        auto end = std::find(sname.first, sname.first + sname.second, ' ');
+        if (metric.compare(0, std::string::npos, sname.first, static_cast<size_t>(end - sname.first)) == 0) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+void Storage::apply_precision(std::string const& metric, int digits) {
+    for (auto id: get_metric_ids(metric)) {
+        cstore_->set_precision(id, digits);
+    }
+}
+
+//! Name prefix of the change-only settings in the configuration table
+static const std::string CHANGE_ONLY_PREFIX = "change_only.";
+
+aku_Status Storage::set_change_only(const char* metric, aku_Timestamp heartbeat) {
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    std::string name(metric);
+    if (name.empty() || name.find_first_of(" \t\n") != std::string::npos) {
+        return AKU_EBAD_ARG;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (heartbeat == 0) {
+            change_only_.erase(name);
+        } else {
+            change_only_[name] = heartbeat;
+        }
+    }
+    metadata_->set_config_param(CHANGE_ONLY_PREFIX + name, heartbeat == 0 ? std::string() : std::to_string(heartbeat));
+    for (auto id: get_metric_ids(name)) {
+        cstore_->set_change_only(id, heartbeat);
+    }
+    return AKU_SUCCESS;
+}
+
+void Storage::load_change_only() {
+    std::unordered_map<std::string, std::string> params;
+    auto status = metadata_->load_config_params(CHANGE_ONLY_PREFIX, &params);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read change-only settings");
+        AKU_PANIC("Can't read change-only settings");
+    }
+    for (auto const& kv: params) {
+        if (kv.second.empty()) {
+            // Disabled
+            continue;
+        }
+        aku_Timestamp heartbeat = std::strtoull(kv.second.c_str(), nullptr, 10);
+        if (heartbeat == 0) {
+            Logger::msg(AKU_LOG_ERROR, "Invalid change-only setting of the " + kv.first + " metric");
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            change_only_[kv.first] = heartbeat;
+        }
+        for (auto id: get_metric_ids(kv.first)) {
+            cstore_->set_change_only(id, heartbeat);
+        }
+    }
+}
+
+bool Storage::apply_retention(QP::ReshapeRequest* req) const {
+    aku_Timestamp retention = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (retention_.empty()) {
+            return true;
+        }
+        for (auto const& column: req->select.columns) {
+            if (column.ids.empty()) {
+                continue;
+            }
+            // All series in the column belong to the same metric
+            auto sname = global_matcher_.id2str(column.ids.front());
+            auto end = std::find(sname.first, sname.first + sname.second, ' ');
+            auto it = retention_.find(std::string(sname.first, end));
+            if (it == retention_.end()) {
+                return true;
+            }
+            retention = std::max(retention, it->second);
+        }
+    }
+    auto now = DateTimeUtil::from_std_chrono(std::chrono::system_clock::now());
+    auto horizon = now > retention ? now - retention : 0;
+    auto& select = req->select;
+    if (select.begin < select.end) {
+        if (select.end <= horizon) {
+            return false;
+        }
+        select.begin = std::max(select.begin, horizon);
+    } else {
+        if (select.begin < horizon) {
+            return false;
+        }
+        select.end = std::max(select.end, horizon);
+    }
+    return true;
+}
+
+void Storage::_update_rescue_points(aku_ParamId id, std::vector<StorageEngine::LogicAddr>&& rpoints) {
+    metadata_->add_rescue_point(id, std::move(rpoints));
+}
+
+void Storage::_update_rescue_points(std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>>&& rpoints) {
+    metadata_->add_rescue_points(std::move(rpoints));
+}
+
+u32 Storage::_get_input_log_shard() {
+    return inputlog_ ? inputlog_->pick_shard() : 0;
+}
+
+void Storage::_write_input_log(u32 shard, aku_Sample const* samples, size_t size) {
+    if (!inputlog_) {
+        return;
+    }
+    for (size_t i = 0; i < size; i++) {
+        auto const& sample = samples[i];
+        if (sample.payload.type != AKU_PAYLOAD_FLOAT) {
+            continue;
+        }
+        auto status = inputlog_->append(shard, sample.paramid, sample.timestamp, sample.payload.float64);
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, "Can't write to input log, " + StatusUtil::str(status));
+        }
+    }
+}
+
+aku_Status Storage::import_series(const char* begin, const char* end, aku_Timestamp const* ts, double const* xs, size_t size) {
+    using namespace StorageEngine;
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    const char* ksbegin = nullptr;
+    const char* ksend = nullptr;
+    char buf[AKU_LIMITS_MAX_SNAME];
+    char* ob = static_cast<char*>(buf);
+    char* oe = static_cast<char*>(buf) + AKU_LIMITS_MAX_SNAME;
+    aku_Status status = SeriesParser::to_canonical_form(begin, end, ob, oe, &ksbegin, &ksend);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    u64 id = 0;
+    u64 hash = StringTools::hash(std::make_pair(ob, static_cast<int>(ksend - ob)));
+    status = get_or_create_series(ob, ksend, hash, &id);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    std::vector<u64> rpoints;
+    auto res = cstore_->write_range(id, ts, xs, size, &rpoints);
+    switch (res) {
+    case NBTreeAppendResult::OK:
+        break;
+    case NBTreeAppendResult::OK_FLUSH_NEEDED:
+        _update_rescue_points(id, std::move(rpoints));
+        break;
+    case NBTreeAppendResult::FAIL_BAD_ID:
+        AKU_PANIC("Invalid tree-registry, id = " + std::to_string(id));
+    case NBTreeAppendResult::FAIL_LATE_WRITE:
+        return AKU_ELATE_WRITE;
+    case NBTreeAppendResult::FAIL_BAD_VALUE:
+        return AKU_EBAD_ARG;
+    };
+    return AKU_SUCCESS;
+}
+
+std::shared_ptr<StorageSession> Storage::create_write_session() {
+    std::shared_ptr<StorageEngine::CStoreSession> session = std::make_shared<StorageEngine::CStoreSession>(cstore_);
+    return std::make_shared<StorageSession>(shared_from_this(), session);
+}
+
+bool Storage::reserve_series(const char* begin, const char* end) {
+    auto memory_limit = tenant_memory_limit_.load();
+    if (memory_limit != 0 && tenant_memory_.load() > memory_limit) {
+        // Index of the tenant can't grow until the memory use goes down
+        return false;
+    }
+    auto nseries = nseries_.fetch_add(1);
+    auto max_series = max_series_.load();
+    if (max_series != 0 && nseries >= max_series) {
+        nseries_.fetch_sub(1);
+        return false;
+    }
+    if (!has_metric_limits_.load()) {
+        return true;
+    }
+    auto metric_end = std::find(begin, end, ' ');
+    std::lock_guard<std::mutex> guard(limits_lock_);
+    auto it = metric_limits_.find(std::string(begin, metric_end));
+    if (it != metric_limits_.end()) {
+        if (it->second.count >= it->second.limit) {
+            nseries_.fetch_sub(1);
+            return false;
+        }
+        it->second.count++;
+    }
+    return true;
+}
+
+void Storage::release_series(const char* begin, const char* end) {
+    nseries_.fetch_sub(1);
+    if (!has_metric_limits_.load()) {
+        return;
+    }
+    auto metric_end = std::find(begin, end, ' ');
+    std::lock_guard<std::mutex> guard(limits_lock_);
+    auto it = metric_limits_.find(std::string(begin, metric_end));
+    if (it != metric_limits_.end() && it->second.count != 0) {
+        it->second.count--;
+    }
+}
+
+aku_Status Storage::get_or_create_series(const char* begin, const char* end, u64 hash, u64* id) {
+    // Fast path, global matcher can be searched without locking
+    *id = global_matcher_.match(begin, end, hash);
+    if (*id != 0) {
+        return AKU_SUCCESS;
+    }
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    if (!reserve_series(begin, end)) {
+        // Series could be created by another session after the first check
+        *id = global_matcher_.match(begin, end, hash);
+        if (*id == 0) {
+            nrejected_++;
+            return AKU_ESERIES_LIMIT;
         }
+        return AKU_SUCCESS;
+    }
+    // Lookup and insertion are done by the matcher in one critical
+    // section, storage-wide lock is not needed here
+    bool create_new = false;
+    *id = global_matcher_.add_if_absent(begin, end, hash, &create_new);
+    if (!create_new) {
+        release_series(begin, end);
+    }
+    if (*id == 0) {
+        return AKU_EBAD_DATA;
     }
     if (create_new) {
         // id guaranteed to be unique
-        cstore_->create_new_column(id);
+        metadata_->add_rescue_point(*id, std::vector<u64>());
+        cstore_->create_new_column(*id);
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!precision_.empty()) {
+            auto it = precision_.find(std::string(begin, std::find(begin, end, ' ')));
+            if (it != precision_.end()) {
+                cstore_->set_precision(*id, it->second);
+            }
+        }
+        if (!change_only_.empty()) {
+            auto it = change_only_.find(std::string(begin, std::find(begin, end, ' ')));
+            if (it != change_only_.end()) {
+                cstore_->set_change_only(*id, it->second);
+            }
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status Storage::init_series_id(const char* begin, const char* end, aku_Sample *sample, PlainSeriesMatcher *local_matcher, u64 hash) {
+    u64 id = 0;
+    auto status = get_or_create_series(begin, end, hash, &id);
+    if (status != AKU_SUCCESS) {
+        return status;
     }
     sample->paramid = id;
     local_matcher->_add(begin, end, id);
@@ -820,6 +2705,9 @@ aku_Status Storage::parse_query(boost::property_tree::ptree const& ptree, QP::Re
     case QueryKind::SELECT_META:
         Logger::msg(AKU_LOG_ERROR, "Metadata query is not supported");
         return AKU_EBAD_ARG;
+    case QueryKind::SELECT_LAST:
+        Logger::msg(AKU_LOG_ERROR, "Select-last query is not supported");
+        return AKU_EBAD_ARG;
     case QueryKind::AGGREGATE:
         std::tie(status, *req) = QueryParser::parse_aggregate_query(ptree, global_matcher_);
         if (status != AKU_SUCCESS) {
@@ -832,6 +2720,18 @@ aku_Status Storage::parse_query(boost::property_tree::ptree const& ptree, QP::Re
             return status;
         }
         break;
+    case QueryKind::OHLC:
+        std::tie(status, *req) = QueryParser::parse_ohlc_query(ptree, global_matcher_);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        break;
+    case QueryKind::WHERE_VALUE:
+        std::tie(status, *req) = QueryParser::parse_where_value_query(ptree, global_matcher_);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        break;
     case QueryKind::SELECT:
         std::tie(status, *req) = QueryParser::parse_select_query(ptree, global_matcher_);
         if (status != AKU_SUCCESS) {
@@ -848,24 +2748,231 @@ aku_Status Storage::parse_query(boost::property_tree::ptree const& ptree, QP::Re
     return AKU_SUCCESS;
 }
 
-void Storage::query(StorageSession const* session, InternalCursor* cur, const char* query) const {
-    using namespace QP;
+/** Move elementwise functions from the head of the processing topology to the
+  * storage operators. Only scan query is affected (other queries produce tuples
+  * or combine several series). Stateful transformations can't be used with
+  * group-by because the series are merged after the scan.
+  */
+static void fuse_value_transforms(QP::ReshapeRequest* req, std::vector<std::shared_ptr<QP::Node>>* nodes) {
+    if (req->agg.enabled || req->select.columns.size() != 1 || !req->compare.empty()) {
+        return;
+    }
+    size_t nfused = 0;
+    // The last node is the terminal, it should stay in the topology
+    while (nfused + 1 < nodes->size()) {
+        StorageEngine::ValueTransform fn;
+        if (!nodes->at(nfused)->get_value_transform(&fn)) {
+            break;
+        }
+        if (fn.kind == StorageEngine::ValueTransform::Kind::RATE && req->group_by.enabled) {
+            break;
+        }
+        req->transforms.push_back(fn);
+        nfused++;
+    }
+    nodes->erase(nodes->begin(), nodes->begin() + static_cast<std::ptrdiff_t>(nfused));
+}
+
+/** Move limit and offset from the head of the processing topology to the storage
+  * operators (scan query only). If the series are read one after another the
+  * node is removed from the topology. If the series are merged every series is
+  * limited by `limit + offset` values and the node stays in the topology.
+  */
+static void fuse_limit(QP::ReshapeRequest* req, std::vector<std::shared_ptr<QP::Node>>* nodes) {
+    if (req->agg.enabled || req->select.columns.size() != 1 || !req->compare.empty() || nodes->size() < 2) {
+        return;
+    }
+    u64 limit, offset;
+    if (!nodes->front()->get_limit(&limit, &offset)) {
+        return;
+    }
+    if (!req->group_by.enabled && req->order_by == QP::OrderBy::SERIES) {
+        req->limit = limit;
+        req->offset = offset;
+        nodes->erase(nodes->begin());
+    } else if (limit != 0) {
+        req->limit = limit + offset;
+    }
+}
+
+//! Parsed query and resolved reshape request
+struct PreparedQuery {
     boost::property_tree::ptree ptree;
+    QP::QueryKind kind;
+    //! Reshape request (only for queries that use it)
+    QP::ReshapeRequest req;
+    //! Series counter value at the moment when the ids were resolved
+    u64 watermark;
+    //! Deletion counter value at the moment when the ids were resolved
+    u64 generation;
+};
+
+std::tuple<aku_Status, std::shared_ptr<const PreparedQuery>> Storage::prepare_query(const char* query) const {
+    using namespace QP;
+    ScopedLatency latency(Metrics::query_prepare());
+    std::shared_ptr<const PreparedQuery> cached;
+    std::string key(query);
+    // Series added or deleted after this point invalidate the result
+    u64 watermark = global_matcher_.get_series_id();
+    u64 generation = deletion_gen_.load();
+    {
+        std::lock_guard<std::mutex> guard(prepared_lock_);
+        auto it = prepared_.find(key);
+        if (it != prepared_.end()) {
+            cached = it->second;
+        }
+    }
+    if (cached && cached->watermark == watermark && cached->generation == generation) {
+        return std::make_tuple(AKU_SUCCESS, cached);
+    }
+    auto result = std::make_shared<PreparedQuery>();
+    result->watermark = watermark;
+    result->generation = generation;
+    result->req = {};
+    aku_Status status;
+    if (cached) {
+        // Only ids should be resolved again
+        result->ptree = cached->ptree;
+        result->kind = cached->kind;
+    } else {
+        std::tie(status, result->ptree) = QueryParser::parse_json(query);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, cached);
+        }
+        std::tie(status, result->kind) = QueryParser::get_query_kind(result->ptree);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, cached);
+        }
+    }
+    if (result->kind != QueryKind::SELECT_META && result->kind != QueryKind::SELECT_LAST) {
+        status = parse_query(result->ptree, &result->req);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, std::shared_ptr<const PreparedQuery>());
+        }
+    }
+    std::lock_guard<std::mutex> guard(prepared_lock_);
+    if (prepared_.size() >= PREPARED_CACHE_SIZE && prepared_.count(key) == 0) {
+        prepared_.clear();
+    }
+    prepared_[key] = result;
+    return std::make_tuple(AKU_SUCCESS, result);
+}
+
+size_t Storage::_get_prepared_cache_size() const {
+    std::lock_guard<std::mutex> guard(prepared_lock_);
+    return prepared_.size();
+}
+
+void Storage::query(StorageSession const* session, InternalCursor* cur, const char* query) const {
     aku_Status status;
     session->clear_series_matcher();
-    std::tie(status, ptree) = QueryParser::parse_json(query);
+    std::shared_ptr<const PreparedQuery> prepared;
+    auto start = std::chrono::steady_clock::now();
+    std::tie(status, prepared) = prepare_query(query);
     if (status != AKU_SUCCESS) {
         cur->set_error(status);
         return;
     }
-    QueryKind kind;
-    std::tie(status, kind) = QueryParser::get_query_kind(ptree);
+    // Incremental query, token of the previous poll is passed using the `resume` field
+    auto resume_token = prepared->ptree.get_optional<std::string>("resume");
+    run_query(session, cur, *prepared, nullptr, resume_token.get_ptr(), elapsed_ns(start));
+}
+
+std::tuple<aku_Status, std::shared_ptr<PreparedStatement>> Storage::prepare(const char* query) const {
+    using namespace QP;
+    aku_Status status;
+    std::shared_ptr<const PreparedQuery> prepared;
+    std::tie(status, prepared) = prepare_query(query);
     if (status != AKU_SUCCESS) {
-        cur->set_error(status);
+        return std::make_tuple(status, std::shared_ptr<PreparedStatement>());
+    }
+    if (prepared->kind == QueryKind::SELECT_META || prepared->kind == QueryKind::SELECT_LAST) {
+        // These queries doesn't have time range
+        return std::make_tuple(AKU_EBAD_ARG, std::shared_ptr<PreparedStatement>());
+    }
+    auto stmt = std::make_shared<PreparedStatement>();
+    stmt->query = query;
+    stmt->prepared = prepared;
+    return std::make_tuple(AKU_SUCCESS, stmt);
+}
+
+void Storage::execute(StorageSession const* session, InternalCursor* cur, PreparedStatement* stmt,
+                      aku_Timestamp begin, aku_Timestamp end, std::string const* resume_token) const
+{
+    session->clear_series_matcher();
+    auto start = std::chrono::steady_clock::now();
+    u64 watermark = global_matcher_.get_series_id();
+    u64 generation = deletion_gen_.load();
+    std::shared_ptr<const PreparedQuery> prepared;
+    {
+        std::lock_guard<std::mutex> guard(stmt->lock);
+        prepared = stmt->prepared;
+    }
+    if (prepared->watermark != watermark || prepared->generation != generation) {
+        // New series were added or some series were deleted, ids should be resolved again
+        aku_Status status;
+        std::tie(status, prepared) = prepare_query(stmt->query.c_str());
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
+        std::lock_guard<std::mutex> guard(stmt->lock);
+        stmt->prepared = prepared;
+    }
+    auto range = std::make_pair(begin, end);
+    run_query(session, cur, *prepared, &range, resume_token, elapsed_ns(start));
+}
+
+void Storage::run_query(StorageSession const* session, InternalCursor* cur, PreparedQuery const& prepared,
+                        std::pair<aku_Timestamp, aku_Timestamp> const* range, std::string const* resume_token,
+                        u64 prepare_ns) const
+{
+    using namespace QP;
+    ScopedLatency latency(Metrics::query_execute());
+    aku_Status status;
+    boost::property_tree::ptree const& ptree = prepared.ptree;
+    QueryKind kind = prepared.kind;
+    std::unique_ptr<ProfilingCursor> pcur;
+    // Error bounds of the approximate query are reported using the profile
+    if (ptree.get<bool>("profile", false) || ptree.count("approximate")) {
+        pcur.reset(new ProfilingCursor(cur));
+        pcur->profile_.prepare_ns = prepare_ns;
+        cur = pcur.get();
+    }
+    QueryProfile::Scope profile_scope(pcur ? &pcur->profile_ : nullptr);
+    // Cursor attaches its own cancellation state, local one is used to enforce the deadline otherwise
+    QueryCancellation local_cancellation;
+    auto cancellation = QueryCancellation::get_current();
+    if (cancellation == nullptr) {
+        cancellation = &local_cancellation;
+    }
+    QueryCancellation::Scope cancellation_scope(cancellation);
+    if (auto timeout = ptree.get_optional<std::string>("timeout")) {
+        try {
+            auto timeout_ns = DateTimeUtil::parse_duration(timeout->c_str(), timeout->size());
+            cancellation->set_timeout(timeout_ns);
+        } catch (std::exception const& e) {
+            Logger::msg(AKU_LOG_ERROR, std::string("Can't parse `timeout`: ") + e.what());
+            cur->set_error(AKU_EQUERY_PARSING_ERROR);
+            return;
+        }
+    }
+    // Priority is applied by the executor before the query starts, only the value is validated here
+    auto priority = ptree.get<std::string>("priority", "interactive");
+    if (priority != "interactive" && priority != "batch") {
+        Logger::msg(AKU_LOG_ERROR, "Invalid `priority` value: " + priority);
+        cur->set_error(AKU_EQUERY_PARSING_ERROR);
         return;
     }
+    // Operators created by the query are released in one shot when the query completes
+    StorageEngine::QueryArena::Scope arena_scope(StorageEngine::AKU_QUERY_ARENA_LIMIT,
+                                                 static_cast<size_t>(query_memory_limit_));
     std::shared_ptr<IStreamProcessor> proc;
-    ReshapeRequest req;
+    if (!check_memory_limit()) {
+        Logger::msg(AKU_LOG_ERROR, "Memory limit exceeded, query rejected");
+        cur->set_error(AKU_ENO_MEM);
+        return;
+    }
 
     if (kind == QueryKind::SELECT_META) {
         std::vector<aku_ParamId> ids;
@@ -885,8 +2992,9 @@ void Storage::query(StorageSession const* session, InternalCursor* cur, const ch
             proc->stop();
         }
         return;
-    } else {
-        status = parse_query(ptree, &req);
+    } else if (kind == QueryKind::SELECT_LAST) {
+        std::vector<aku_ParamId> ids;
+        std::tie(status, ids) = QueryParser::parse_select_last_query(ptree, global_matcher_);
         if (status != AKU_SUCCESS) {
             cur->set_error(status);
             return;
@@ -897,7 +3005,45 @@ void Storage::query(StorageSession const* session, InternalCursor* cur, const ch
             cur->set_error(status);
             return;
         }
-        bool groupbytime = kind == QueryKind::GROUP_AGGREGATE;
+        // Latest values are maintained by the columns, block store is not used
+        std::vector<aku_Sample> samples;
+        status = cstore_->read_last(ids, &samples);
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
+        proc = std::make_shared<ScanQueryProcessor>(nodes, false);
+        if (proc->start()) {
+            for (auto const& sample: samples) {
+                if (!proc->put(sample)) {
+                    break;
+                }
+            }
+            proc->stop();
+        }
+        return;
+    } else {
+        // Request is modified below so the cached one should be copied
+        auto plan_start = std::chrono::steady_clock::now();
+        ReshapeRequest req = prepared.req;
+        if (range) {
+            req.select.begin = range->first;
+            req.select.end = range->second;
+        }
+        // Output of the incremental query is tracked to produce the next token
+        std::unique_ptr<ResumeCursor> rcur;
+        if (resume_token) {
+            rcur.reset(new ResumeCursor(cur));
+        }
+        std::vector<std::shared_ptr<Node>> nodes;
+        std::tie(status, nodes) = QueryParser::parse_processing_topology(ptree, rcur ? rcur.get() : cur);
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
+        fuse_limit(&req, &nodes);
+        fuse_value_transforms(&req, &nodes);
+        bool groupbytime = kind == QueryKind::GROUP_AGGREGATE || kind == QueryKind::OHLC;
         proc = std::make_shared<ScanQueryProcessor>(nodes, groupbytime);
         if (req.select.matcher) {
             session->set_series_matcher(req.select.matcher);
@@ -913,12 +3059,72 @@ void Storage::query(StorageSession const* session, InternalCursor* cur, const ch
             cur->set_error(AKU_ENOT_FOUND);
             return;
         }
+        ResumeToken prev_token;
+        if (rcur) {
+            // Output series should match the stored series, range should be forward
+            if (req.group_by.enabled || !req.compare.empty() || req.select.begin > req.select.end) {
+                Logger::msg(AKU_LOG_ERROR, "Statement `resume` can't be used with group-by, compare "
+                                           "or backward range");
+                cur->set_error(AKU_EQUERY_PARSING_ERROR);
+                return;
+            }
+            if (!resume_token->empty() && ResumeToken::decode(*resume_token, &prev_token) != AKU_SUCCESS) {
+                Logger::msg(AKU_LOG_ERROR, "Malformed resume token");
+                cur->set_error(AKU_EBAD_ARG);
+                return;
+            }
+        }
+        // Expired data shouldn't be returned
+        if (!apply_retention(&req)) {
+            cur->set_error(AKU_ENOT_FOUND);
+            return;
+        }
+        if (rcur) {
+            rcur->token_.watermark = prepared.watermark;
+            rcur->token_.generation = prepared.generation;
+            resume_query(&req, prev_token, &rcur->token_);
+        }
+        // Output series are known at this point, stateful nodes can use dense state
+        auto slots = QP::make_series_slots(req);
+        for (auto& node: nodes) {
+            node->set_series_slots(slots);
+        }
+        // Plan is chosen using the size of the query estimated from the roots of the columns
+        StorageEngine::QueryEstimate est;
+        status = cstore_->estimate(req.select.columns.at(0).ids, req.select.begin, req.select.end, &est);
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
         std::unique_ptr<QP::IQueryPlan> query_plan;
-        std::tie(status, query_plan) = QP::QueryPlanBuilder::create(req);
+        std::tie(status, query_plan) = QP::QueryPlanBuilder::create(req, est);
         if (status != AKU_SUCCESS) {
             cur->set_error(status);
             return;
         }
+        if (ptree.get<bool>("explain", false)) {
+            // Plan is returned instead of the query results (as a profile)
+            std::stringstream out;
+            out << "{\"plan\": "                 << query_plan->explain()
+                << ", \"series\": "              << req.select.columns.at(0).ids.size()
+                << ", \"estimated_series\": "    << est.nseries
+                << ", \"estimated_values\": "    << est.nvalues
+                << ", \"estimated_leaves\": "    << est.nleaves
+                << "}";
+            // Profiling cursor would replace the plan with its own profile
+            InternalCursor* dest = pcur ? pcur->cur_ : cur;
+            dest->set_profile(out.str());
+            dest->complete();
+            return;
+        }
+        if (pcur) {
+            pcur->profile_.plan_ns = elapsed_ns(plan_start);
+            if (req.agg.approx_error > 0) {
+                pcur->profile_.series_total = req.agg.series_total;
+                pcur->profile_.series_sampled = req.select.columns.at(0).ids.size();
+            }
+            pcur->start_execution();
+        }
         // TODO: log query plan if required
         if (proc->start()) {
             QueryPlanExecutor executor;
@@ -940,6 +3146,31 @@ void Storage::suggest(StorageSession const* session, InternalCursor* cur, const
     }
     std::vector<aku_ParamId> ids;
     std::shared_ptr<PlainSeriesMatcher> substitute;
+    if (QueryParser::is_cardinality_query(ptree)) {
+        std::vector<aku_Sample> samples;
+        std::tie(status, substitute, samples) = QueryParser::parse_cardinality_query(ptree, global_matcher_);
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
+        std::vector<std::shared_ptr<Node>> nodes;
+        std::tie(status, nodes) = QueryParser::parse_processing_topology(ptree, cur);
+        if (status != AKU_SUCCESS) {
+            cur->set_error(status);
+            return;
+        }
+        session->set_series_matcher(substitute);
+        std::shared_ptr<IStreamProcessor> proc = std::make_shared<ScanQueryProcessor>(nodes, false);
+        if (proc->start()) {
+            for (auto const& sample: samples) {
+                if (!proc->put(sample)) {
+                    break;
+                }
+            }
+            proc->stop();
+        }
+        return;
+    }
     std::tie(status, substitute, ids) = QueryParser::parse_suggest_query(ptree, global_matcher_);
     if (status != AKU_SUCCESS) {
         cur->set_error(status);
@@ -969,23 +3200,119 @@ void Storage::search(StorageSession const* session, InternalCursor* cur, const c
         cur->set_error(status);
         return;
     }
-    std::vector<aku_ParamId> ids;
-    std::tie(status, ids) = QueryParser::parse_search_query(ptree, global_matcher_);
+    std::vector<std::shared_ptr<Node>> nodes;
+    std::tie(status, nodes) = QueryParser::parse_processing_topology(ptree, cur);
+    if (status != AKU_SUCCESS) {
+        cur->set_error(status);
+        return;
+    }
+    // Index is searched in parallel, matches are passed to the cursor
+    // as they're found
+    auto proc = std::make_shared<MetadataQueryProcessor>(nodes.front(), std::vector<aku_ParamId>());
+    bool done = false;
+    status = QueryParser::parse_search_query(ptree, global_matcher_,
+                                             [&proc, &done](std::vector<aku_ParamId> const& ids) {
+        done = !proc->write(ids);
+        return !done;
+    });
+    if (status != AKU_SUCCESS) {
+        cur->set_error(status);
+        return;
+    }
+    if (!done) {
+        proc->stop();
+    }
+}
+
+void Storage::subscribe(StorageSession const* session, StreamingCursor* cur, const char* query) const {
+    using namespace QP;
+    boost::property_tree::ptree ptree;
+    aku_Status status;
+    session->clear_series_matcher();
+    if (!check_memory_limit()) {
+        Logger::msg(AKU_LOG_ERROR, "Memory limit exceeded, continuous query rejected");
+        cur->set_error(AKU_ENO_MEM);
+        return;
+    }
+    std::tie(status, ptree) = QueryParser::parse_json(query);
+    if (status != AKU_SUCCESS) {
+        cur->set_error(status);
+        return;
+    }
+    QueryKind kind;
+    std::tie(status, kind) = QueryParser::get_query_kind(ptree);
+    if (status != AKU_SUCCESS) {
+        cur->set_error(status);
+        return;
+    }
+    if (kind != QueryKind::GROUP_AGGREGATE) {
+        Logger::msg(AKU_LOG_ERROR, "Only group-aggregate query can be used as continuous query");
+        cur->set_error(AKU_EBAD_ARG);
+        return;
+    }
+    ReshapeRequest req;
+    status = parse_query(ptree, &req);
     if (status != AKU_SUCCESS) {
         cur->set_error(status);
         return;
     }
+    if (req.group_by.enabled || req.select.begin >= req.select.end) {
+        // Values of different columns are not ordered so they can't be
+        // combined, backward range can't be updated incrementally
+        Logger::msg(AKU_LOG_ERROR, "Continuous query should have forward range and no group-by");
+        cur->set_error(AKU_EBAD_ARG);
+        return;
+    }
+    if (std::any_of(req.agg.func.begin(), req.agg.func.end(), &StorageEngine::is_quantile)) {
+        // Window contains only aggregate of the bucket
+        Logger::msg(AKU_LOG_ERROR, "Quantiles can't be used in continuous query");
+        cur->set_error(AKU_EBAD_ARG);
+        return;
+    }
+    if (req.agg.window != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Hopping windows can't be used in continuous query");
+        cur->set_error(AKU_EBAD_ARG);
+        return;
+    }
+    if (!req.compare.empty()) {
+        Logger::msg(AKU_LOG_ERROR, "Statement `compare` can't be used in continuous query");
+        cur->set_error(AKU_EBAD_ARG);
+        return;
+    }
+    if (req.select.columns.empty() || req.select.columns.at(0).ids.empty()) {
+        cur->set_error(AKU_ENOT_FOUND);
+        return;
+    }
     std::vector<std::shared_ptr<Node>> nodes;
     std::tie(status, nodes) = QueryParser::parse_processing_topology(ptree, cur);
     if (status != AKU_SUCCESS) {
         cur->set_error(status);
         return;
     }
-    std::shared_ptr<IStreamProcessor> proc =
-            std::make_shared<MetadataQueryProcessor>(nodes.front(), std::move(ids));
-    if (proc->start()) {
-        proc->stop();
+    std::shared_ptr<IStreamProcessor> proc;
+    try {
+        proc = std::make_shared<ScanQueryProcessor>(nodes, true);
+    } catch (NodeException const& e) {
+        Logger::msg(AKU_LOG_ERROR, std::string("Can't create continuous query, ") + e.what());
+        cur->set_error(AKU_EQUERY_PARSING_ERROR);
+        return;
+    }
+    if (req.select.matcher) {
+        session->set_series_matcher(req.select.matcher);
     }
+    proc->start();
+    auto id = cqueries_->add(req, proc);
+    std::weak_ptr<ContinuousQueries> weak = cqueries_;
+    cur->set_close_handler([weak, id]() {
+        auto cqueries = weak.lock();
+        if (cqueries) {
+            cqueries->remove(id);
+        }
+    });
+}
+
+void Storage::_update_continuous_queries(aku_Sample const* samples, size_t size) {
+    cqueries_->on_write(samples, size);
 }
 
 void Storage::debug_print() const {
@@ -998,8 +3325,15 @@ aku_Status Storage::new_database( const char     *base_file_name
                                 , const char     *volumes_path
                                 , i32             num_volumes
                                 , u64             volume_size
-                                , bool            allocate)
+                                , bool            allocate
+                                , u16             fanout)
 {
+    if (fanout < StorageEngine::AKU_NBTREE_MIN_FANOUT || fanout > StorageEngine::AKU_NBTREE_FANOUT) {
+        Logger::msg(AKU_LOG_ERROR, "Invalid NB+tree fanout: " + std::to_string(fanout) + ", it should be in range ["
+                    + std::to_string(StorageEngine::AKU_NBTREE_MIN_FANOUT) + ", "
+                    + std::to_string(StorageEngine::AKU_NBTREE_FANOUT) + "]");
+        return AKU_EBAD_ARG;
+    }
     // Check for max volume size
     const u64 MAX_SIZE = 0x100000000 * 4096 - 1;  // 15TB
     const u64 MIN_SIZE = 0x100000;  // 1MB
@@ -1084,10 +3418,10 @@ aku_Status Storage::new_database( const char     *base_file_name
     }
     if (num_volumes == 0) {
         Logger::msg(AKU_LOG_INFO, "Creating expandable file storage");
-        create_metadata_page(base_file_name, sqlitepath.c_str(), mpaths, msizes, "ExpandableFileStorage");
+        create_metadata_page(base_file_name, sqlitepath.c_str(), mpaths, msizes, "ExpandableFileStorage", fanout);
     } else {
         Logger::msg(AKU_LOG_INFO, "Creating fixed file storage");
-        create_metadata_page(base_file_name, sqlitepath.c_str(), mpaths, msizes, "FixedSizeFileStorage");
+        create_metadata_page(base_file_name, sqlitepath.c_str(), mpaths, msizes, "FixedSizeFileStorage", fanout);
     }
     return AKU_SUCCESS;
 }
@@ -1116,6 +3450,9 @@ aku_Status Storage::remove_storage(const char* file_name, bool force) {
             return AKU_ENOT_PERMITTED;
         }
     }
+    // Metadata of the tenants is stored in separate files
+    std::unordered_map<std::string, std::string> tenants;
+    meta->load_config_params(TENANT_PREFIX, &tenants);
     meta.reset();
 
     // Check access rights
@@ -1149,6 +3486,23 @@ aku_Status Storage::remove_storage(const char* file_name, bool force) {
 
     std::for_each(volume_names.begin(), volume_names.end(), delete_file);
 
+    // WAL files are normally removed by sqlite on close, index snapshot,
+    // checkpoint, rescue point log and hot block list are created next to the database file
+    for (auto suffix: { "-wal", "-shm", ".index", ".checkpoint", ".rplog", ".hotblocks" }) {
+        std::string journal = std::string(file_name) + suffix;
+        if (boost::filesystem::exists(journal)) {
+            delete_file(journal);
+        }
+    }
+    for (auto const& kv: tenants) {
+        for (auto suffix: { "", "-wal", "-shm" }) {
+            std::string fname = kv.second + suffix;
+            if (boost::filesystem::exists(fname)) {
+                delete_file(fname);
+            }
+        }
+    }
+
     return AKU_SUCCESS;
 }
 
@@ -1164,8 +3518,165 @@ boost::property_tree::ptree Storage::get_stats() {
         std::string path = "volume_" + std::to_string(ix++);
         result.put(path + ".free_space", free_vol);
         result.put(path + ".file_name", name);
+        result.put(path + ".reads", stats.io.reads);
+        result.put(path + ".zero_copy_reads", stats.io.zero_copy_reads);
+        result.put(path + ".cache_hits", stats.io.cache_hits);
+        result.put(path + ".bytes_read", stats.io.bytes_read);
+        result.put(path + ".writes", stats.io.writes);
+        result.put(path + ".bytes_written", stats.io.bytes_written);
+    }
+    auto nbtree = StorageEngine::NBTreeIOStats::get();
+    for (int level = 0; level < StorageEngine::NBTreeIOStats::MAX_LEVELS; level++) {
+        if (nbtree.reads[level] == 0) {
+            continue;
+        }
+        std::string path = "nbtree.level_" + std::to_string(level);
+        result.put(path + ".reads", nbtree.reads[level]);
+        result.put(path + ".cache_hits", nbtree.cache_hits[level]);
+    }
+    result.put("nbtree.writes.append", nbtree.append_writes);
+    result.put("nbtree.writes.split", nbtree.split_writes);
+    result.put("nbtree.writes.flush", nbtree.flush_writes);
+    result.put("nbtree.writes.recovery", nbtree.recovery_writes);
+    result.put("nbtree.writes.compaction", nbtree.compaction_writes);
+    result.put("nbtree.write_amplification", nbtree.write_amplification());
+    result.put("nbtree.repeated_values", nbtree.repeated_values);
+    result.put("nbtree.staged_values", nbtree.staged_values);
+    auto cache = bstore_->get_stats().cache;
+    result.put("block_cache.hits", cache.hits);
+    result.put("block_cache.misses", cache.misses);
+    result.put("block_cache.evictions", cache.evictions);
+    result.put("block_cache.size", cache.size);
+    result.put("block_cache.capacity", cache.capacity);
+    result.put("startup.blockstore_ns", startup_.blockstore);
+    result.put("startup.index_ns", startup_.index);
+    result.put("startup.matcher_ns", startup_.matcher);
+    result.put("startup.columns_ns", startup_.columns);
+    result.put("startup.replay_ns", startup_.replay);
+    result.put("startup.total_ns", startup_.total);
+    result.put("startup.restored", startup_.restored);
+    result.put("series.count", nseries_.load());
+    result.put("series.limit", max_series_.load());
+    result.put("series.rejected", nrejected_.load());
+    if (global_matcher_.index.get_resident_limit() != 0) {
+        auto index = global_matcher_.get_resident_stats();
+        result.put("index.metrics", index.metrics);
+        result.put("index.resident_metrics", index.resident);
+        result.put("index.resident_limit", global_matcher_.index.get_resident_limit());
+        result.put("index.materialized", index.materialized);
+        result.put("index.evicted", index.evicted);
+    }
+    if (write_buffer_budget_ != 0) {
+        result.put("write_buffers.size", write_buffer_size_.load());
+        result.put("write_buffers.budget", write_buffer_budget_);
+    }
+    if (compaction_min_fill_ > 0) {
+        result.put("compaction.columns", compaction_count_.load());
+    }
+    if (recompression_age_ != 0) {
+        result.put("recompression.columns", recompression_count_.load());
+    }
+    auto memory = get_memory_use();
+    u64 total = 0;
+    for (int i = 0; i < AKU_MEM_MAX; i++) {
+        auto subsystem = static_cast<aku_MemorySubsystem>(i);
+        result.put(std::string("memory.") + MemoryAccounting::name(subsystem), memory[i]);
+        total += memory[i];
+    }
+    result.put("memory.total", total);
+    if (memory_limit_ != 0) {
+        result.put("memory.limit", memory_limit_);
+        result.put("memory.rejected_queries", nmemory_rejected_.load());
+    }
+    for (auto const& tenant: get_tenants()) {
+        std::string path = "tenants." + tenant->tenant_;
+        result.put(path + ".series.count", tenant->nseries_.load());
+        result.put(path + ".series.limit", tenant->max_series_.load());
+        result.put(path + ".series.rejected", tenant->nrejected_.load());
+        result.put(path + ".memory.used", tenant->tenant_memory_.load());
+        result.put(path + ".memory.limit", tenant->tenant_memory_limit_.load());
+        result.put(path + ".ingest.rate", tenant->ingest_rate_.load());
+        result.put(path + ".ingest.throttled", tenant->nthrottled_.load());
     }
     return result;
 }
 
+void Storage::format_metrics(std::ostream& out) {
+    auto cache = bstore_->get_stats().cache;
+    Metrics::format_counter(out, "akumuli_block_cache_hits_total", "Number of block cache hits", cache.hits);
+    Metrics::format_counter(out, "akumuli_block_cache_misses_total", "Number of block cache misses", cache.misses);
+    Metrics::format_counter(out, "akumuli_block_cache_evictions_total", "Number of evicted blocks", cache.evictions);
+    u64 nlookups = cache.hits + cache.misses;
+    double ratio = nlookups == 0 ? 0.0 : static_cast<double>(cache.hits) / static_cast<double>(nlookups);
+    Metrics::format_gauge(out, "akumuli_block_cache_hit_ratio", "Block cache hit ratio", ratio);
+    Metrics::format_gauge(out, "akumuli_block_cache_size_bytes", "Block cache size",
+                          static_cast<double>(cache.size));
+
+    typedef std::vector<std::pair<std::string, u64>> LabeledValues;
+    LabeledValues reads, zreads, hits, nbytes_read, writes, nbytes_written;
+    for (auto const& kv: bstore_->get_volume_stats()) {
+        auto const& io = kv.second.io;
+        reads.push_back(std::make_pair(kv.first, io.reads));
+        zreads.push_back(std::make_pair(kv.first, io.zero_copy_reads));
+        hits.push_back(std::make_pair(kv.first, io.cache_hits));
+        nbytes_read.push_back(std::make_pair(kv.first, io.bytes_read));
+        writes.push_back(std::make_pair(kv.first, io.writes));
+        nbytes_written.push_back(std::make_pair(kv.first, io.bytes_written));
+    }
+    Metrics::format_counter(out, "akumuli_volume_reads_total", "Number of blocks copied from the volume",
+                            "volume", reads);
+    Metrics::format_counter(out, "akumuli_volume_zero_copy_reads_total", "Number of blocks accessed through mmap",
+                            "volume", zreads);
+    Metrics::format_counter(out, "akumuli_volume_cache_hits_total", "Number of blocks found in the block cache",
+                            "volume", hits);
+    Metrics::format_counter(out, "akumuli_volume_read_bytes_total", "Number of bytes copied from the volume",
+                            "volume", nbytes_read);
+    Metrics::format_counter(out, "akumuli_volume_writes_total", "Number of blocks appended to the volume",
+                            "volume", writes);
+    Metrics::format_counter(out, "akumuli_volume_written_bytes_total", "Number of bytes appended to the volume",
+                            "volume", nbytes_written);
+
+    auto nbtree = StorageEngine::NBTreeIOStats::get();
+    LabeledValues node_reads, node_hits;
+    for (int level = 0; level < StorageEngine::NBTreeIOStats::MAX_LEVELS; level++) {
+        node_reads.push_back(std::make_pair(std::to_string(level), nbtree.reads[level]));
+        node_hits.push_back(std::make_pair(std::to_string(level), nbtree.cache_hits[level]));
+    }
+    Metrics::format_counter(out, "akumuli_nbtree_node_reads_total", "Number of NBTree nodes read (0 - leaf)",
+                            "level", node_reads);
+    Metrics::format_counter(out, "akumuli_nbtree_node_cache_hits_total",
+                            "Number of NBTree nodes found in the block cache", "level", node_hits);
+    LabeledValues node_writes = {
+        { "append",     nbtree.append_writes },
+        { "split",      nbtree.split_writes },
+        { "flush",      nbtree.flush_writes },
+        { "recovery",   nbtree.recovery_writes },
+        { "compaction", nbtree.compaction_writes },
+    };
+    Metrics::format_counter(out, "akumuli_nbtree_node_writes_total", "Number of NBTree nodes written",
+                            "cause", node_writes);
+    Metrics::format_gauge(out, "akumuli_nbtree_write_amplification",
+                          "Number of written NBTree nodes per node written by appends",
+                          nbtree.write_amplification());
+    Metrics::format_gauge(out, "akumuli_series", "Number of series", static_cast<double>(nseries_.load()));
+    Metrics::format_counter(out, "akumuli_series_rejected_total", "Number of rejected series", nrejected_.load());
+    if (write_buffer_budget_ != 0) {
+        Metrics::format_gauge(out, "akumuli_write_buffers_size_bytes", "Size of the leaf nodes that are not committed",
+                              static_cast<double>(write_buffer_size_.load()));
+    }
+    auto memory = get_memory_use();
+    LabeledValues memory_values;
+    for (int i = 0; i < AKU_MEM_MAX; i++) {
+        auto subsystem = static_cast<aku_MemorySubsystem>(i);
+        memory_values.push_back(std::make_pair(MemoryAccounting::name(subsystem), memory[i]));
+    }
+    Metrics::format_gauge(out, "akumuli_memory_bytes", "Memory used by the subsystem", "subsystem", memory_values);
+    if (memory_limit_ != 0) {
+        Metrics::format_gauge(out, "akumuli_memory_limit_bytes", "Memory limit", static_cast<double>(memory_limit_));
+        Metrics::format_counter(out, "akumuli_memory_rejected_queries_total",
+                                "Number of queries rejected because of the memory limit", nmemory_rejected_.load());
+    }
+    Metrics::format_histograms(out);
+}
+
 }
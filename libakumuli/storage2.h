@@ -17,40 +17,77 @@
 
 #pragma once
 #include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <future>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "akumuli_def.h"
+#include "akumuli_config.h"
 #include "metadatastorage.h"
 #include "index/seriesparser.h"
+#include "index/indexsnapshot.h"
 #include "util.h"
+#include "memory_accounting.h"
 
 #include "storage_engine/blockstore.h"
 #include "storage_engine/nbtree.h"
 #include "storage_engine/column_store.h"
+#include "storage_engine/input_log.h"
 
 #include "internal_cursor.h"
+#include "continuous_query.h"
 
 #include <boost/thread.hpp>
 
 namespace Akumuli {
 
 class Storage;
+struct StreamingCursor;
+struct PreparedQuery;
+struct PreparedStatement;
 
 class StorageSession : public std::enable_shared_from_this<StorageSession> {
     std::shared_ptr<Storage> storage_;
     PlainSeriesMatcher local_matcher_;
     std::shared_ptr<StorageEngine::CStoreSession> session_;
+    //! Input log shard used by the session
+    u32 log_shard_;
     //! Temporary query matcher
     mutable std::shared_ptr<PlainSeriesMatcher> matcher_substitute_;
+    //! Approximate size of the session and its local caches (AKU_MEM_SESSIONS)
+    MemoryTracker memory_;
+    //! Value of the storage deletion counter seen by the session
+    u64 deletion_gen_;
+    //! Ingest tokens taken from the storage but not used yet (if ingest rate is limited)
+    u64 ingest_credit_;
+
+    //! Account the name that was added to the local matcher
+    void account_local_name(size_t len);
+
+    /** Take `n` tokens from the ingest rate quota of the storage.
+      * @return number of samples that can be written (less than `n` if the quota is exceeded)
+      */
+    u64 acquire_ingest_credit(u64 n);
+
+    //! Drop deleted series from the local caches if something was deleted since the last call
+    void check_deleted();
 public:
     StorageSession(std::shared_ptr<Storage> storage, std::shared_ptr<StorageEngine::CStoreSession> session);
 
     aku_Status write(aku_Sample const& sample);
 
+    /** Write batch of samples.
+      * All samples that can be written are written, the status of the first
+      * failed write is returned. If the ingest rate quota is exceeded only the
+      * beginning of the batch is written and AKU_EBUSY is returned.
+      */
+    aku_Status write_batch(aku_Sample const* samples, size_t size);
+
     /** Match series name. If series with such name doesn't exists - create it.
       * This method should be called for each sample to init its `paramid` field.
       */
@@ -80,12 +117,78 @@ public:
      */
     void search(InternalCursor* cur, const char* query) const;
 
+    /**
+     * @brief register continuous query
+     * @param cur is a cursor that receives results until it's closed
+     * @param query is a string that contains group-aggregate query
+     */
+    void subscribe(StreamingCursor* cur, const char* query) const;
+
+    /**
+     * @brief prepare query for repeated execution
+     * @param query is a string that contains select, aggregate, group-aggregate or join query
+     * @return status and prepared statement (empty on error)
+     */
+    std::tuple<aku_Status, std::shared_ptr<PreparedStatement>> prepare(const char* query) const;
+
+    /**
+     * @brief execute prepared query using the new time range
+     * @param cur is a pointer to internal cursor
+     * @param stmt is a prepared statement
+     * @param begin is a beginning of the range (overrides the range of the query)
+     * @param end is an end of the range
+     */
+    void execute(InternalCursor* cur, std::shared_ptr<PreparedStatement> stmt,
+                 aku_Timestamp begin, aku_Timestamp end) const;
+
+    /**
+     * @brief execute prepared select query incrementally, only the values that follow
+     *        the values returned by the previous poll are read
+     * @param cur is a pointer to internal cursor (receives the new resume token)
+     * @param stmt is a prepared statement
+     * @param begin is a beginning of the range (overrides the range of the query)
+     * @param end is an end of the range
+     * @param resume_token is a token returned by the previous poll (empty for the first poll)
+     */
+    void poll(InternalCursor* cur, std::shared_ptr<PreparedStatement> stmt,
+              aku_Timestamp begin, aku_Timestamp end, std::string resume_token) const;
+
     // Temporary reset series matcher
     void set_series_matcher(std::shared_ptr<PlainSeriesMatcher> matcher) const;
     void clear_series_matcher() const;
 };
 
+/** Query that is parsed once and can be executed many times using
+  * different time ranges. Series ids are resolved again on execution
+  * if series were added or deleted after the query was prepared.
+  */
+struct PreparedStatement {
+    //! Query text
+    std::string query;
+    //! Parsed query (replaced when it becomes stale)
+    std::shared_ptr<const PreparedQuery> prepared;
+    //! Protects `prepared`
+    std::mutex lock;
+};
+
 class Storage : public std::enable_shared_from_this<Storage> {
+public:
+    //! Quota of the tenant namespace
+    struct TenantQuota {
+        //! Max number of series (0 - unlimited)
+        u64 max_series;
+        //! Memory limit of the index and write buffers (0 - unlimited)
+        u64 memory_limit;
+        //! Max number of samples written per second (0 - unlimited)
+        u64 ingest_rate;
+    };
+
+private:
+    //! Max number of prepared queries in the cache
+    enum { PREPARED_CACHE_SIZE = 1024 };
+    //! Max length of the tenant name
+    enum { MAX_TENANT_NAME = 64 };
+
     std::shared_ptr<StorageEngine::BlockStore> bstore_;
     std::shared_ptr<StorageEngine::ColumnStore> cstore_;
     std::atomic<int> done_;
@@ -93,17 +196,259 @@ class Storage : public std::enable_shared_from_this<Storage> {
     mutable std::mutex lock_;
     SeriesMatcher global_matcher_;
     std::shared_ptr<MetadataStorage> metadata_;
+    //! Index snapshot, used only by file-backed storage
+    std::unique_ptr<IndexSnapshot> snapshot_;
+    //! Retention settings (metric name to retention period mapping), protected by `lock_`
+    std::unordered_map<std::string, aku_Timestamp> retention_;
+    //! Precision hints (metric name to number of decimal digits mapping), protected by `lock_`
+    std::unordered_map<std::string, int> precision_;
+    //! Heartbeat intervals of the change-only metrics (metric name to interval mapping), protected by `lock_`
+    std::unordered_map<std::string, aku_Timestamp> change_only_;
+    //! Continuous queries, updated by the write sessions
+    std::shared_ptr<QP::ContinuousQueries> cqueries_;
+    //! Prepared queries (key is a query text)
+    mutable std::unordered_map<std::string, std::shared_ptr<const PreparedQuery>> prepared_;
+    //! Protects prepared queries cache
+    mutable std::mutex prepared_lock_;
+
+    //! Series limit of the metric
+    struct SeriesLimit {
+        u64 limit;
+        //! Number of series of the metric (including reserved)
+        u64 count;
+    };
+    //! Max number of series (0 - unlimited)
+    std::atomic<u64> max_series_;
+    //! Number of series (including reserved)
+    std::atomic<u64> nseries_;
+    //! Number of series that weren't created because of the limits
+    std::atomic<u64> nrejected_;
+    //! Per-metric series limits (key is a metric name), protected by `limits_lock_`
+    std::unordered_map<std::string, SeriesLimit> metric_limits_;
+    //! Set if `metric_limits_` is not empty
+    std::atomic<bool> has_metric_limits_;
+    mutable std::mutex limits_lock_;
+    //! Memory budget for the uncommitted leaf nodes (0 - unlimited)
+    u64 write_buffer_budget_;
+    //! Memory used by the uncommitted leaf nodes (updated by the sync worker if budget is set)
+    std::atomic<u64> write_buffer_size_;
+    //! Memory limit (0 - unlimited)
+    u64 memory_limit_;
+    //! Memory used by the subsystems that are not tracked by the allocator (updated by the sync worker if limit is set)
+    std::atomic<u64> memory_untracked_;
+    //! Number of queries rejected because of the memory limit
+    mutable std::atomic<u64> nmemory_rejected_;
+    //! Fill factor threshold of the background compaction (0 - disabled)
+    double compaction_min_fill_;
+    //! Number of columns rewritten by the background compaction
+    std::atomic<u64> compaction_count_;
+    //! Age of the values packed by the background compaction (0 - disabled)
+    aku_Timestamp recompression_age_;
+    //! Number of columns rewritten by the background recompression
+    std::atomic<u64> recompression_count_;
+    //! Input log (empty if disabled)
+    std::unique_ptr<StorageEngine::InputLog> inputlog_;
+    //! Size of the input log that triggers truncation
+    u64 input_log_max_size_;
+    //! Directory of the input log (tenants use subdirectories)
+    std::string input_log_path_;
+    //! Number of shards of the input log
+    u32 input_log_concurrency_;
+    //! Incremented when series are deleted and when their columns are removed
+    std::atomic<u64> deletion_gen_;
+    //! Deleted series that still have columns, protected by `lock_`
+    std::vector<aku_ParamId> deleted_;
+    //! Largest series id written to the index snapshot (used by the sync worker)
+    u64 snapshot_id_;
+    //! Path of the shutdown checkpoint (empty if storage is not file-backed)
+    std::string checkpoint_path_;
+    //! Generation of the checkpoint that will be written on close
+    u64 checkpoint_gen_;
+    //! Memory budget of a single query
+    u64 query_memory_limit_;
+    //! Set if the storage only serves queries (see `aku_FineTuneParams::read_only`)
+    bool read_only_;
+    //! Path of the hot block list (empty if the warmup is disabled)
+    std::string hotlist_path_;
+    //! Max number of addresses in the hot block list
+    size_t hotlist_size_;
+    //! Background warmup started on open
+    std::future<void> warmup_task_;
+    //! Path of the database file (empty if storage is not file-backed)
+    std::string path_;
+    //! Name of the tenant namespace (empty if storage is not a tenant)
+    std::string tenant_;
+    //! Tenant namespaces by name, protected by `tenants_lock_`
+    std::unordered_map<std::string, std::shared_ptr<Storage>> tenants_;
+    mutable std::mutex tenants_lock_;
+    //! Quota of the new tenant namespaces
+    TenantQuota default_quota_;
+    //! Memory limit of the tenant namespace (0 - unlimited)
+    std::atomic<u64> tenant_memory_limit_;
+    //! Memory used by the tenant namespace (updated by the sync worker of the parent)
+    std::atomic<u64> tenant_memory_;
+    //! Max number of samples written per second (0 - unlimited)
+    std::atomic<u64> ingest_rate_;
+    //! Ingest tokens available (token bucket, one token per sample), protected by `ingest_lock_`
+    double ingest_tokens_;
+    //! Last refill of the token bucket, protected by `ingest_lock_`
+    std::chrono::steady_clock::time_point ingest_refill_;
+    std::mutex ingest_lock_;
+    //! Number of samples rejected because of the ingest rate quota
+    std::atomic<u64> nthrottled_;
+
+    //! Duration of the startup phases (in nanoseconds)
+    struct StartupStats {
+        u64  blockstore;    //< open volumes
+        u64  index;         //< load series index snapshot
+        u64  matcher;       //< load series names added after the snapshot and tombstones
+        u64  columns;       //< open columns using the checkpoint or rescue points
+        u64  replay;        //< replay input log
+        u64  total;
+        bool restored;      //< columns were restored (database wasn't closed cleanly)
+    };
+    StartupStats startup_;
 
     void start_sync_worker();
 
+    //! Load blocks from the hot block list saved by the previous run into the cache in background
+    void start_warmup();
+
+    //! Save addresses of the hot blocks (called by the sync worker and on close)
+    void save_hot_blocks();
+
+    /** Commit leaf nodes of the least recently written columns if write buffer budget
+      * or memory limit is exceeded.
+      */
+    void release_write_buffers();
+
+    //! Memory used by the subsystems that know their own size (caches, string pool, write buffers)
+    MemoryAccounting::Snapshot get_untracked_memory_use() const;
+
+    //! Return false if the memory limit is exceeded (new queries shouldn't be started)
+    bool check_memory_limit() const;
+
+    //! Rewrite columns with underfilled leaf nodes and pack old values
+    void compact();
+
+    //! Write values from the input log to the columns (should be called on startup)
+    void replay_input_log(std::string const& path);
+
+    /** Remove records of the series that are already stored in the column (used by the replay).
+      * @param id is a series id
+      * @param last is a timestamp of the last committed value of the series
+      * @param recs are records of the series ordered by timestamp
+      * @return number of removed records
+      */
+    size_t remove_committed(aku_ParamId id, aku_Timestamp last, std::vector<StorageEngine::InputLog::Record>* recs);
+
+    /** Switch input log to the new files and commit leaf nodes of all columns.
+      * Old files can be removed after the blockstore and metadata are synced.
+      */
+    void rotate_input_log();
+
+    //! Append names that were written to the metadata storage to the index snapshot
+    void update_snapshot(std::vector<PlainSeriesMatcher::SeriesNameT>* names);
+
+    /** Reclaim space used by the deleted series (called by the sync worker after
+      * their tombstones were written). Columns are removed from the column store,
+      * the index snapshot is rewritten without the deleted names and finally
+      * names and rescue points are removed from the metadata storage.
+      */
+    void sweep(std::vector<aku_ParamId> const& ids);
+
     aku_Status parse_query(const boost::property_tree::ptree &ptree, QP::ReshapeRequest* req) const;
+
+    /** Parse the query and resolve series ids or take the result from the cache.
+      * Cached result is used only if no series were added or deleted since it was created,
+      * otherwise ids are resolved again (JSON is not parsed in both cases).
+      */
+    std::tuple<aku_Status, std::shared_ptr<const PreparedQuery>> prepare_query(const char* query) const;
+
+    /** Run prepared query.
+      * @param range overrides the time range of the query if not null
+      * @param resume_token is a token of the previous poll if the query is incremental (can be empty)
+      * @param prepare_ns time spent preparing the query (reported if the query is profiled)
+      */
+    void run_query(StorageSession const* session, InternalCursor* cur, PreparedQuery const& prepared,
+                   std::pair<aku_Timestamp, aku_Timestamp> const* range, std::string const* resume_token,
+                   u64 prepare_ns) const;
+
+    /** Narrow down the time range of the query using retention settings. Range is
+      * limited only if every column of the query has retention. Longest retention
+      * period is used if columns have different retention settings.
+      * @return false if all data in the range is expired
+      */
+    bool apply_retention(QP::ReshapeRequest* req) const;
+
+    //! Load precision hints from the metadata storage and apply them to the opened columns
+    void load_precision();
+
+    //! Set precision hint of every column of the metric
+    void apply_precision(std::string const& metric, int digits);
+
+    //! Load change-only settings from the metadata storage and apply them to the opened columns
+    void load_change_only();
+
+    //! Get ids of all series of the metric
+    std::vector<aku_ParamId> get_metric_ids(std::string const& metric) const;
+
+    /** Reserve place for the new series, global and per-metric limits are checked.
+      * @param begin is a beginning of the series name in canonical form
+      * @return false if the limit is reached
+      */
+    bool reserve_series(const char* begin, const char* end);
+
+    //! Cancel reservation made by `reserve_series`
+    void release_series(const char* begin, const char* end);
+
+    /** Match series name, create new series if it doesn't exist.
+      * @return AKU_ESERIES_LIMIT if series can't be created because of the series limits
+      */
+    aku_Status get_or_create_series(const char* begin, const char* end, u64 hash, u64* id);
+
+    /** C-tor for the tenant namespace. Names and rescue points of the tenant are stored
+      * in the separate metadata storage, blocks are written to the block store of the parent.
+      */
+    Storage(Storage const& parent, std::string const& name, std::string const& path, TenantQuota const& quota);
+
+    //! Open tenant namespaces registered in the metadata storage
+    void load_tenants();
+
+    //! Get tenant namespaces opened so far
+    std::vector<std::shared_ptr<Storage>> get_tenants() const;
+
+    /** Update memory use of the tenant, save rescue points of the columns flushed in
+      * background and commit leaf nodes if the memory quota is exceeded.
+      */
+    void maintain_tenant();
+
+    /** Write names and rescue points of the tenant to its metadata storage and sweep
+      * deleted series. Should be called by the parent after the block store and the
+      * parent metadata were synced.
+      */
+    void sync_tenant();
+
+    //! Close columns of the tenant, rescue points are written by the next `sync_tenant` call
+    void close_tenant_columns();
+
+    /** Commit leaf nodes of the tenant if its input log is too large.
+      * @return true if the log was rotated, old files can be removed after `sync_tenant`
+      */
+    bool rotate_tenant_input_log();
+
+    //! Memory used by the index and the column store of the storage
+    u64 get_own_memory_use() const;
+
+    //! Apply quota to the tenant namespace
+    void set_quota(TenantQuota const& quota);
 public:
 
     // Create empty in-memory storage
     Storage();
 
     // Open file-backed storage
-    Storage(const char* path);
+    Storage(const char* path, aku_FineTuneParams const& params);
 
     /** C-tor for test */
     Storage(std::shared_ptr<MetadataStorage>            meta,
@@ -111,16 +456,153 @@ public:
             std::shared_ptr<StorageEngine::ColumnStore> cstore,
             bool                                        start_worker);
 
-    //! Match series name. If series with such name doesn't exists - create it.
-    aku_Status init_series_id(const char* begin, const char* end, aku_Sample *sample, PlainSeriesMatcher *local_matcher);
+    /** Match series name. If series with such name doesn't exists - create it.
+      * @param hash should be equal to StringTools::hash of the series name
+      */
+    aku_Status init_series_id(const char* begin, const char* end, aku_Sample *sample, PlainSeriesMatcher *local_matcher, u64 hash);
 
     int get_series_name(aku_ParamId id, char* buffer, size_t buffer_size, PlainSeriesMatcher *local_matcher);
 
+    /** Import ordered range of values of the single series (offline bulk import).
+      * Series name is matched once for the whole range, values are written directly
+      * to the column without going through the write session.
+      * @param begin is a series name begining
+      * @param end is a series name end
+      * @param ts is an array of timestamps
+      * @param xs is an array of values
+      * @param size is a size of both arrays
+      * @return AKU_ELATE_WRITE if range is not ordered or overlaps with existing data
+      */
+    aku_Status import_series(const char* begin, const char* end, aku_Timestamp const* ts, double const* xs, size_t size);
+
     //! Create new write session
     std::shared_ptr<StorageSession> create_write_session();
 
+    /** Get tenant namespace, create it if it doesn't exist. Every tenant has its own
+      * series index and column store, blocks are stored in the shared block store.
+      * Names and rescue points of the tenant are stored in the separate metadata
+      * storage next to the database file.
+      * @param name is a tenant name (latin letters, digits, '-' and '_')
+      * @return AKU_EBAD_ARG if the name is invalid, AKU_ENOT_FOUND if the tenant doesn't
+      *         exist and the storage is read-only
+      */
+    std::tuple<aku_Status, std::shared_ptr<Storage>> open_tenant(const char* name);
+
+    /** Create write session of the tenant namespace (see `open_tenant`).
+      * Queries of the session only see series of the tenant.
+      */
+    std::tuple<aku_Status, std::shared_ptr<StorageSession>> create_tenant_session(const char* name);
+
+    /** Set quota of the tenant namespace, the tenant is created if it doesn't exist.
+      * New series are rejected with AKU_ESERIES_LIMIT error when the series limit or
+      * the memory limit is reached, samples that exceed the ingest rate are rejected
+      * with AKU_EBUSY error. Quota is not persisted.
+      */
+    aku_Status set_tenant_quota(const char* name, TenantQuota const& quota);
+
+    //! Take up to `n` ingest tokens, return number of tokens taken (`n` if the rate is unlimited)
+    u64 _take_ingest_tokens(u64 n);
+
+    //! Return true if the ingest rate is limited
+    bool _has_ingest_quota() const;
+
+    //! Count samples rejected by the ingest rate quota
+    void _add_throttled(u64 n);
+
+    /** Set retention period of the metric. Queries doesn't return data points
+      * that are older than retention period and skip corresponding subtrees
+      * without reading them.
+      * @param metric is a metric name
+      * @param retention is a retention period (0 - disable retention)
+      * @return AKU_EBAD_ARG if metric name is invalid
+      */
+    aku_Status set_retention(const char* metric, aku_Timestamp retention);
+
+    /** Set max number of series of the metric. New series of the metric are
+      * rejected with AKU_ESERIES_LIMIT error when the limit is reached, existing
+      * series are not affected. Limit is not persisted.
+      * @param metric is a metric name
+      * @param limit is a max number of series (0 - disable limit)
+      * @return AKU_EBAD_ARG if metric name is invalid
+      */
+    aku_Status set_series_limit(const char* metric, u64 limit);
+
+    /** Set precision hint of the metric. New values of the metric are rounded to
+      * `digits` decimal digits after the point before they're written, rounded
+      * values are stored as scaled integers. Setting is persisted in the
+      * configuration table of the metadata storage.
+      * @param metric is a metric name
+      * @param digits is a number of decimal digits (negative - disable rounding)
+      * @return AKU_EBAD_ARG if metric name is invalid or `digits` is too large
+      */
+    aku_Status set_precision(const char* metric, int digits);
+
+    /** Store values of the metric only when they change. Repeated value is dropped if
+      * the last stored value of the series is younger than `heartbeat`, so long runs of
+      * the same value cost one stored value per heartbeat interval. Queries return the
+      * stored values (step function), group-aggregate query can fill empty buckets
+      * using `"fill": "prev"`. Setting is persisted in the configuration table of the
+      * metadata storage.
+      * @param metric is a metric name
+      * @param heartbeat is a max interval between the stored values (0 - disable)
+      * @return AKU_EBAD_ARG if metric name is invalid
+      */
+    aku_Status set_change_only(const char* metric, aku_Timestamp heartbeat);
+
+    /** Delete all series that match the search query (the same format as in `search`).
+      * Series are removed from the index immediately, space is reclaimed by the
+      * sync worker after the tombstones are written to the metadata storage.
+      * Series with the same name can be created again, they will get new ids.
+      * @param query is a search query (JSON)
+      * @param count receives number of deleted series (can be null)
+      * @return error code if the query is invalid
+      */
+    aku_Status delete_series(const char* query, u64* count);
+
+    /** Write online backup of the database to the `dest` directory. Full backup
+      * contains all live blocks, incremental backup contains only the blocks appended
+      * after the `base` backup. Both contain a copy of the metadata storage, names of
+      * the series are copied only if they were added after the base backup.
+      * Names and rescue points are copied before the blocks, so every block that
+      * they reference is included in the backup (or in one of the base backups).
+      * Metadata of every tenant is copied to `metadata.db.tenant.<name>` file in full,
+      * ids of the tenant series are not tracked by the manifest.
+      * @param dest is a path to the new directory
+      * @param base is a path to the previous backup (null or empty - full backup)
+      * @param rate is a max write rate in bytes per second (0 - unlimited)
+      * @return AKU_EBAD_ARG if the destination already contains a backup, AKU_ENOT_FOUND
+      *         if the base backup is incomplete
+      */
+    aku_Status backup(const char* dest, const char* base, u64 rate);
+
+    //! Return true if the storage was opened read-only, all writes are rejected
+    bool is_read_only() const;
+
+    //! Value of the deletion counter, sessions drop their caches when it changes
+    u64 _get_deletion_generation() const;
+
+    //! Return true if series was deleted (or never existed)
+    bool _is_deleted(aku_ParamId id) const;
+
     void query(StorageSession const* session, InternalCursor* cur, const char* query) const;
 
+    /** Prepare query for repeated execution.
+      * Only select, aggregate, group-aggregate and join queries can be prepared.
+      * @return AKU_EBAD_ARG if query can't be prepared
+      */
+    std::tuple<aku_Status, std::shared_ptr<PreparedStatement>> prepare(const char* query) const;
+
+    /** Execute prepared query, time range of the query is replaced with [begin, end)
+      * (or [end, begin) in backward direction).
+      * @param resume_token is a token of the previous poll (empty for the first poll) if
+      *        the query should be incremental, new token is attached to the cursor
+      */
+    void execute(StorageSession const* session, InternalCursor* cur, PreparedStatement* stmt,
+                 aku_Timestamp begin, aku_Timestamp end, std::string const* resume_token = nullptr) const;
+
+    //! Number of prepared queries in the cache (for tests)
+    size_t _get_prepared_cache_size() const;
+
     /**
      * @brief suggest query implementation
      * @param session is a session pointer
@@ -137,10 +619,32 @@ public:
      */
     void search(StorageSession const* session, InternalCursor* cur, const char* query) const;
 
+    /**
+     * @brief register continuous query
+     * Group-aggregate query receives values from the write path, complete buckets
+     * are sent to the cursor. Query is removed when the cursor is closed.
+     * @param session is a session pointer
+     * @param cur is a streaming cursor
+     * @param query is a query string (JSON)
+     */
+    void subscribe(StorageSession const* session, StreamingCursor* cur, const char* query) const;
+
+    //! Pass written values to continuous queries
+    void _update_continuous_queries(aku_Sample const* samples, size_t size);
+
     void debug_print() const;
 
     void _update_rescue_points(aku_ParamId id, std::vector<StorageEngine::LogicAddr>&& rpoints);
 
+    //! Update rescue points of several columns (metadata storage is locked once)
+    void _update_rescue_points(std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>>&& rpoints);
+
+    //! Get input log shard for the new write session
+    u32 _get_input_log_shard();
+
+    //! Add samples to the input log (does nothing if the log is disabled)
+    void _write_input_log(u32 shard, aku_Sample const* samples, size_t size);
+
     /** This method should be called before object destructor.
       * All ingestion sessions should be stopped first.
       */
@@ -152,6 +656,7 @@ public:
       * @param volumes_path is a path to volumes storage
       * @param num_volumes defines how many volumes should be crated
       * @param page_size is a size of the individual page in bytes
+      * @param fanout is a fanout of the NB+tree nodes, can't be changed after creation
       * @return operation status
       */
     static aku_Status new_database( const char     *base_file_name
@@ -159,15 +664,19 @@ public:
                                   , const char     *volumes_path
                                   , i32             num_volumes
                                   , u64             page_size
-                                  , bool            allocate);
+                                  , bool            allocate
+                                  , u16             fanout = StorageEngine::AKU_NBTREE_FANOUT);
 
     /**
      * @brief Open storage and generate report (dont' modify anything)
+     * Trees are dumped in parallel and written out as soon as they're ready, memory use
+     * doesn't depend on the size of the database. Order of the trees is not defined.
      * @param path to sqlite3 database file
      * @return status
      */
     static aku_Status generate_report(const char* path, const char* output);
 
+    //! Restore every column (one at a time) and dump its extents, same as `generate_report`
     static aku_Status generate_recovery_report(const char* path, const char* output);
 
     /** Remove existing database
@@ -179,6 +688,15 @@ public:
     static aku_Status remove_storage(const char* file_name, bool force);
 
     boost::property_tree::ptree get_stats();
+
+    //! Memory used by the database (by subsystem)
+    MemoryAccounting::Snapshot get_memory_use() const;
+
+    //! Set memory limit (for tests)
+    void _set_memory_limit(u64 limit);
+
+    //! Write counters and latency histograms in Prometheus text format
+    void format_metrics(std::ostream& out);
 };
 
 }
@@ -0,0 +1,271 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "backup.h"
+#include "log_iface.h"
+#include "crc32c.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static const u32 MANIFEST_MAGIC = 0x424B4B41;  // "AKKB"
+static const u32 MANIFEST_VERSION = 1;
+
+struct ManifestRecord {
+    u32 magic;
+    u32 version;
+    u64 since_addr;
+    u64 until_addr;
+    u64 since_series;
+    u64 until_series;
+    u64 nblocks;
+    u32 crc;       //! Checksum of the preceding fields
+} __attribute__((packed));
+
+struct BlockHeader {
+    u64 addr;
+    u32 size;
+    u32 crc;       //! Block data checksum
+} __attribute__((packed));
+
+static u32 checksum(const char* data, size_t size) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data, size);
+}
+
+static aku_Status write_all(int fd, std::string const& path, const char* data, size_t size) {
+    for (size_t pos = 0; pos < size;) {
+        auto nwritten = ::write(fd, data + pos, size - pos);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::msg(AKU_LOG_ERROR, "Can't write " + path + ", error: " + strerror(errno));
+            return AKU_EGENERAL;
+        }
+        pos += static_cast<size_t>(nwritten);
+    }
+    return AKU_SUCCESS;
+}
+
+static bool read_all(int fd, char* data, size_t size) {
+    for (size_t pos = 0; pos < size;) {
+        auto nread = ::read(fd, data + pos, size - pos);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return false;
+        }
+        pos += static_cast<size_t>(nread);
+    }
+    return true;
+}
+
+// BackupManifest
+
+aku_Status BackupManifest::write(std::string const& path) const {
+    ManifestRecord rec = {};
+    rec.magic = MANIFEST_MAGIC;
+    rec.version = MANIFEST_VERSION;
+    rec.since_addr = since_addr;
+    rec.until_addr = until_addr;
+    rec.since_series = since_series;
+    rec.until_series = until_series;
+    rec.nblocks = nblocks;
+    rec.crc = checksum(reinterpret_cast<const char*>(&rec), offsetof(ManifestRecord, crc));
+
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP);
+    if (fd < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + tmp + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    auto status = write_all(fd, tmp, reinterpret_cast<const char*>(&rec), sizeof(rec));
+    if (status == AKU_SUCCESS && fsync(fd) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't sync " + tmp + ", error: " + strerror(errno));
+        status = AKU_EGENERAL;
+    }
+    ::close(fd);
+    if (status == AKU_SUCCESS && rename(tmp.c_str(), path.c_str()) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't replace " + path + ", error: " + strerror(errno));
+        status = AKU_EGENERAL;
+    }
+    if (status != AKU_SUCCESS) {
+        unlink(tmp.c_str());
+    }
+    return status;
+}
+
+aku_Status BackupManifest::read(std::string const& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return AKU_ENOT_FOUND;
+        }
+        Logger::msg(AKU_LOG_ERROR, "Can't open " + path + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    ManifestRecord rec;
+    bool success = read_all(fd, reinterpret_cast<char*>(&rec), sizeof(rec));
+    ::close(fd);
+    if (!success ||
+        rec.magic != MANIFEST_MAGIC ||
+        rec.version != MANIFEST_VERSION ||
+        rec.crc != checksum(reinterpret_cast<const char*>(&rec), offsetof(ManifestRecord, crc)))
+    {
+        return AKU_EBAD_DATA;
+    }
+    since_addr = rec.since_addr;
+    until_addr = rec.until_addr;
+    since_series = rec.since_series;
+    until_series = rec.until_series;
+    nblocks = rec.nblocks;
+    return AKU_SUCCESS;
+}
+
+// BackupWriter
+
+BackupWriter::BackupWriter(std::string path, u64 rate)
+    : path_(std::move(path))
+    , fd_(-1)
+    , rate_(rate)
+    , nwritten_(0)
+    , nblocks_(0)
+{
+    buffer_.reserve(BUFFER_SIZE);
+}
+
+BackupWriter::~BackupWriter() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+aku_Status BackupWriter::open() {
+    fd_ = ::open(path_.c_str(), O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP);
+    if (fd_ < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + path_ + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    start_ = std::chrono::steady_clock::now();
+    return AKU_SUCCESS;
+}
+
+aku_Status BackupWriter::flush() {
+    if (buffer_.empty()) {
+        return AKU_SUCCESS;
+    }
+    auto status = write_all(fd_, path_, buffer_.data(), buffer_.size());
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    if (fdatasync(fd_) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't sync " + path_ + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    // Written pages are not needed anymore
+    posix_fadvise(fd_, static_cast<off_t>(nwritten_), static_cast<off_t>(buffer_.size()), POSIX_FADV_DONTNEED);
+    nwritten_ += buffer_.size();
+    buffer_.clear();
+    if (rate_ != 0) {
+        // Sleep until the average rate drops below the limit
+        auto expected = std::chrono::microseconds(nwritten_ * 1000000 / rate_);
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        if (elapsed < expected) {
+            std::this_thread::sleep_for(expected - elapsed);
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status BackupWriter::append(LogicAddr addr, const u8* data, size_t size) {
+    BlockHeader header = {};
+    header.addr = addr;
+    header.size = static_cast<u32>(size);
+    header.crc = checksum(reinterpret_cast<const char*>(data), size);
+    auto p = reinterpret_cast<const char*>(&header);
+    buffer_.insert(buffer_.end(), p, p + sizeof(header));
+    buffer_.insert(buffer_.end(), data, data + size);
+    nblocks_++;
+    if (buffer_.size() >= BUFFER_SIZE) {
+        return flush();
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status BackupWriter::close() {
+    auto status = flush();
+    if (status == AKU_SUCCESS && fsync(fd_) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't sync " + path_ + ", error: " + strerror(errno));
+        status = AKU_EGENERAL;
+    }
+    ::close(fd_);
+    fd_ = -1;
+    return status;
+}
+
+u64 BackupWriter::nblocks() const {
+    return nblocks_;
+}
+
+// BackupReader
+
+aku_Status BackupReader::read(std::string const& path, std::function<void(LogicAddr, const u8*, size_t)> const& fn) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't open " + path + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    aku_Status status = AKU_SUCCESS;
+    std::vector<char> data;
+    while (true) {
+        BlockHeader header;
+        auto nread = ::read(fd, &header, sizeof(header));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread == 0) {
+            break;
+        }
+        if (nread != sizeof(header)) {
+            // Short reads are possible only at the end of the damaged file
+            status = AKU_EBAD_DATA;
+            break;
+        }
+        data.resize(header.size);
+        if (!read_all(fd, data.data(), data.size()) || checksum(data.data(), data.size()) != header.crc) {
+            status = AKU_EBAD_DATA;
+            break;
+        }
+        fn(header.addr, reinterpret_cast<const u8*>(data.data()), data.size());
+    }
+    ::close(fd);
+    return status;
+}
+
+}
+}  // namespaces
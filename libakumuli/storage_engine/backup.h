@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/blockstore.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Description of the backup. Backup contains blocks with addresses in
+  * [since_addr, until_addr) range and names of the series with ids in
+  * (since_series, until_series] range. Incremental backup starts where
+  * the previous one ends, full backup starts from zero.
+  * Manifest is written last, the backup is complete only if it exists.
+  */
+struct BackupManifest {
+    LogicAddr since_addr;
+    LogicAddr until_addr;
+    u64       since_series;
+    u64       until_series;
+    //! Number of blocks in the backup
+    u64       nblocks;
+
+    /** Write the manifest. New file is written next to the old one and renamed.
+      * @param path is a path to the manifest file
+      */
+    aku_Status write(std::string const& path) const;
+
+    /** Read the manifest.
+      * @param path is a path to the manifest file
+      * @return AKU_ENOT_FOUND if the file doesn't exist, AKU_EBAD_DATA if
+      *         the manifest is damaged
+      */
+    aku_Status read(std::string const& path);
+};
+
+/** Writes blocks to the backup file. Every record contains address of the
+  * block, checksum of the block data and the data itself. Writes are buffered
+  * and throttled, written data is synced and dropped from the page cache so
+  * the backup doesn't evict the pages used by the database.
+  */
+class BackupWriter {
+    std::string       path_;
+    int               fd_;
+    //! Max write rate in bytes per second (0 - unlimited)
+    const u64         rate_;
+    std::vector<char> buffer_;
+    u64               nwritten_;
+    u64               nblocks_;
+    std::chrono::steady_clock::time_point start_;
+
+    //! Size of the write buffer
+    static const size_t BUFFER_SIZE = 0x100000;
+
+    aku_Status flush();
+
+public:
+    /** C-tor.
+      * @param path is a path to the new file
+      * @param rate is a max write rate in bytes per second (0 - unlimited)
+      */
+    BackupWriter(std::string path, u64 rate);
+
+    ~BackupWriter();
+
+    //! Create the file (it shouldn't exist)
+    aku_Status open();
+
+    //! Add block to the file, blocks should be added in the order of addresses
+    aku_Status append(LogicAddr addr, const u8* data, size_t size);
+
+    //! Write buffered data and sync the file
+    aku_Status close();
+
+    //! Number of appended blocks
+    u64 nblocks() const;
+};
+
+//! Reads blocks written by the BackupWriter
+struct BackupReader {
+    /** Read all blocks from the file and check their checksums.
+      * @param path is a path to the file
+      * @param fn receives address and data of every block
+      * @return AKU_EBAD_DATA if the file is damaged
+      */
+    static aku_Status read(std::string const& path, std::function<void(LogicAddr, const u8*, size_t)> const& fn);
+};
+
+}
+}  // namespaces
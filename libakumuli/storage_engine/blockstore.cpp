@@ -21,10 +21,19 @@
 #include "status_util.h"
 #include "crc32c.h"
 #include "akumuli_version.h"
+#include "metrics.h"
+#include "akumuli_tracing.h"
 
+#include <algorithm>
+#include <iterator>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <boost/filesystem.hpp>
+#include <boost/exception/diagnostic_information.hpp>
 
 namespace Akumuli {
 namespace StorageEngine {
@@ -42,90 +51,279 @@ static u64 hash(u64 value, u32 bits) {
     return a ^ b;
 }
 
-BlockCache::BlockCache(u32 Nbits)
-    : block_cache_(1 << Nbits, PBlock())
-    , bits_(Nbits)
-    , gen_(dev_())
-    , dist_(0, 1 << Nbits)
+BlockCache::Shard::Shard()
+    : a1in_size(0)
+    , am_size(0)
+    , hits(0)
+    , misses(0)
+    , evictions(0)
 {
 }
 
-int BlockCache::probe(LogicAddr addr) {
-    auto h = hash(addr, bits_);
-    auto b = block_cache_.at(h);
-    if (b) {
-        return b->get_addr() == addr ? 2 : 1;
+BlockCache::BlockCache(size_t capacity, u32 Nbits, u32 Nnodes)
+    : bits_(Nbits)
+    , nnodes_(std::max(Nnodes, 1u))
+    , shard_capacity_((capacity / nnodes_) >> Nbits)
+    , a1in_capacity_(shard_capacity_ / 4)
+    , a1out_capacity_(shard_capacity_ / AKU_BLOCK_SIZE / 2)
+{
+    for (u32 i = 0; i < (nnodes_ << Nbits); i++) {
+        shards_.emplace_back(new Shard());
+    }
+}
+
+BlockCache::Shard& BlockCache::get_shard(LogicAddr addr) const {
+    auto ix = bits_ == 0 ? 0 : hash(addr, bits_);
+    if (nnodes_ > 1) {
+        ix += static_cast<u64>(get_current_numa_node() % nnodes_) << bits_;
+    }
+    return *shards_.at(ix);
+}
+
+void BlockCache::evict(Shard* shard) {
+    while (shard->a1in_size + shard->am_size > shard_capacity_) {
+        if (shard->a1in_size > a1in_capacity_ || shard->am.empty()) {
+            // Evict from A1in and remember the address in A1out
+            auto block = shard->a1in.back();
+            auto addr = block->get_addr();
+            shard->a1in.pop_back();
+            shard->a1in_size -= block->get_size();
+            shard->table.erase(addr);
+            shard->a1out.push_front(addr);
+            shard->ghosts[addr] = shard->a1out.begin();
+            if (shard->a1out.size() > a1out_capacity_) {
+                shard->ghosts.erase(shard->a1out.back());
+                shard->a1out.pop_back();
+            }
+        } else {
+            // Evict least recently used block from Am
+            auto block = shard->am.back();
+            shard->am.pop_back();
+            shard->am_size -= block->get_size();
+            shard->table.erase(block->get_addr());
+        }
+        shard->evictions++;
     }
-    return 0;
 }
 
 void BlockCache::insert(PBlock block) {
+    if (shard_capacity_ == 0) {
+        return;
+    }
     auto addr = block->get_addr();
-    auto pr = probe(addr);
-    if (pr == 2) {
+    auto& shard = get_shard(addr);
+    std::lock_guard<std::mutex> guard(shard.lock); AKU_UNUSED(guard);
+    if (shard.table.count(addr)) {
         // No need to insert, addr already sits in the cache.
         return;
     }
-    if (pr == 0) {
-        // Eviction. Generate two random hashes. Evict least accessed.
-        auto h1 = dist_(gen_);
-        auto h2 = dist_(gen_);
-        auto p1 = block_cache_.at(h1);
-        auto p2 = block_cache_.at(h2);
-        if (p1 && p2) {
-            if (p1.use_count() > p2.use_count()) {
-                block_cache_.at(h2).reset();
-            } else if (p1.use_count() < p2.use_count()) {
-                block_cache_.at(h1).reset();
-            } else {
-                if (p1->get_addr() < p2->get_addr()) {
-                    block_cache_.at(h1).reset();
-                } else {
-                    block_cache_.at(h2).reset();
-                }
+    auto size = block->get_size();
+    auto ghost = shard.ghosts.find(addr);
+    if (ghost != shard.ghosts.end()) {
+        // Second access after eviction from A1in, block is hot
+        shard.a1out.erase(ghost->second);
+        shard.ghosts.erase(ghost);
+        shard.am.push_front(std::move(block));
+        shard.am_size += size;
+        shard.table[addr] = { shard.am.begin(), true };
+    } else {
+        shard.a1in.push_front(std::move(block));
+        shard.a1in_size += size;
+        shard.table[addr] = { shard.a1in.begin(), false };
+    }
+    evict(&shard);
+}
+
+BlockCache::PBlock BlockCache::lookup(LogicAddr addr) {
+    PBlock result;
+    if (shard_capacity_ == 0) {
+        return result;
+    }
+    auto& shard = get_shard(addr);
+    std::lock_guard<std::mutex> guard(shard.lock); AKU_UNUSED(guard);
+    auto it = shard.table.find(addr);
+    if (it == shard.table.end()) {
+        shard.misses++;
+        return result;
+    }
+    shard.hits++;
+    if (it->second.hot) {
+        // Move to the head of the LRU queue
+        shard.am.splice(shard.am.begin(), shard.am, it->second.it);
+    }
+    // Blocks in A1in are not promoted on hit, this way
+    // short bursts of accesses can't pollute the Am queue
+    result = *it->second.it;
+    return result;
+}
+
+void BlockCache::promote(LogicAddr addr) {
+    if (shard_capacity_ == 0) {
+        return;
+    }
+    auto& shard = get_shard(addr);
+    std::lock_guard<std::mutex> guard(shard.lock); AKU_UNUSED(guard);
+    auto it = shard.table.find(addr);
+    if (it == shard.table.end() || it->second.hot) {
+        return;
+    }
+    auto size = (*it->second.it)->get_size();
+    shard.am.splice(shard.am.begin(), shard.a1in, it->second.it);
+    shard.a1in_size -= size;
+    shard.am_size += size;
+    it->second = { shard.am.begin(), true };
+}
+
+std::vector<LogicAddr> BlockCache::get_hot_addrs(size_t limit) const {
+    // Take the same share of the most recently used blocks from every shard
+    std::vector<std::vector<LogicAddr>> pershard;
+    for (auto const& shard: shards_) {
+        std::vector<LogicAddr> addrs;
+        std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+        for (auto const& block: shard->am) {
+            if (addrs.size() == limit) {
+                break;
+            }
+            addrs.push_back(block->get_addr());
+        }
+        pershard.push_back(std::move(addrs));
+    }
+    std::vector<LogicAddr> result;
+    for (size_t ix = 0; result.size() < limit; ix++) {
+        bool done = true;
+        for (auto const& addrs: pershard) {
+            if (ix < addrs.size() && result.size() < limit) {
+                result.push_back(addrs[ix]);
+                done = false;
             }
         }
+        if (done) {
+            break;
+        }
+    }
+    return result;
+}
+
+BlockCacheStats BlockCache::get_stats() const {
+    BlockCacheStats stats = {};
+    for (auto const& shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+        stats.hits      += shard->hits;
+        stats.misses    += shard->misses;
+        stats.evictions += shard->evictions;
+        stats.size      += shard->a1in_size + shard->am_size;
+    }
+    stats.capacity = (shard_capacity_ << bits_) * nnodes_;
+    return stats;
+}
+
+
+//! Allocate AKU_BLOCK_SIZE buffer aligned to the block size (can be used for direct I/O without copying)
+static u8* new_block_buffer() {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, AKU_BLOCK_SIZE, AKU_BLOCK_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    return static_cast<u8*>(ptr);
+}
+
+//! Thread local cache of the AKU_BLOCK_SIZE buffers
+struct BlockBufferPool {
+    enum {
+        MAX_CACHED = 64
+    };
+
+    std::vector<u8*> free_;
+
+    ~BlockBufferPool();
+
+    u8* allocate() {
+        if (free_.empty()) {
+            return new_block_buffer();
+        }
+        auto buf = free_.back();
+        free_.pop_back();
+        return buf;
     }
-    auto h = hash(addr, bits_);
-    block_cache_.at(h) = block;
+
+    void release(u8* buf) {
+        if (free_.size() < MAX_CACHED) {
+            free_.push_back(buf);
+        } else {
+            free(buf);
+        }
+    }
+};
+
+static thread_local BlockBufferPool s_block_pool;
+//! Blocks can outlive the pool (e.g. blocks owned by the static objects), trivially destructible
+static thread_local bool s_block_pool_destroyed = false;
+
+BlockBufferPool::~BlockBufferPool() {
+    for (auto buf: free_) {
+        free(buf);
+    }
+    free_.clear();
+    s_block_pool_destroyed = true;
 }
 
-BlockCache::PBlock BlockCache::loockup(LogicAddr addr) {
-    auto it = hash(addr, bits_);
-    auto p = block_cache_.at(it);
-    if (p->get_addr() != addr) {
-        p.reset();
+static u8* allocate_block_buffer() {
+    if (s_block_pool_destroyed) {
+        return new_block_buffer();
     }
-    return p;
+    return s_block_pool.allocate();
 }
 
+static void release_block_buffer(u8* buf) {
+    if (s_block_pool_destroyed) {
+        free(buf);
+        return;
+    }
+    s_block_pool.release(buf);
+}
 
 Block::Block(LogicAddr addr, std::vector<u8>&& data)
     : data_(std::move(data))
+    , pooled_(nullptr)
     , addr_(addr)
     , zptr_(nullptr)
 {
 }
 
 Block::Block(LogicAddr addr, const u8* ptr)
-    : addr_(addr)
+    : pooled_(nullptr)
+    , addr_(addr)
     , zptr_(ptr)
 {
 }
 
 Block::Block()
-    : data_(static_cast<size_t>(AKU_BLOCK_SIZE), 0)
+    : pooled_(allocate_block_buffer())
     , addr_(EMPTY_ADDR)
     , zptr_(nullptr)
 {
+    memset(pooled_, 0, AKU_BLOCK_SIZE);
+}
+
+Block::Block(UninitializedTag)
+    : pooled_(allocate_block_buffer())
+    , addr_(EMPTY_ADDR)
+    , zptr_(nullptr)
+{
+}
+
+Block::~Block() {
+    if (pooled_) {
+        release_block_buffer(pooled_);
+    }
 }
 
 const u8* Block::get_data() const {
-    return zptr_ ? zptr_ : data_.data();
+    return get_cdata();
 }
 
 const u8* Block::get_cdata() const {
-    return zptr_ ? zptr_ : data_.data();
+    return zptr_ ? zptr_ : pooled_ ? pooled_ : data_.data();
 }
 
 bool Block::is_readonly() const {
@@ -134,11 +332,11 @@ bool Block::is_readonly() const {
 
 u8* Block::get_data() {
     assert(is_readonly() == false);
-    return data_.data();
+    return pooled_ ? pooled_ : data_.data();
 }
 
 size_t Block::get_size() const {
-    return zptr_ ? AKU_BLOCK_SIZE : data_.size();
+    return (zptr_ || pooled_) ? static_cast<size_t>(AKU_BLOCK_SIZE) : data_.size();
 }
 
 LogicAddr Block::get_addr() const {
@@ -150,11 +348,95 @@ void Block::set_addr(LogicAddr addr) {
 }
 
 
-FileStorage::FileStorage(std::shared_ptr<VolumeRegistry> meta)
+std::vector<std::tuple<aku_Status, std::shared_ptr<Block>>> BlockStore::read_blocks(std::vector<LogicAddr> const& addrs) {
+    std::vector<std::tuple<aku_Status, std::shared_ptr<Block>>> result;
+    result.reserve(addrs.size());
+    prefetch(addrs);
+    for (auto addr: addrs) {
+        result.push_back(read_block(addr));
+    }
+    return result;
+}
+
+void BlockStore::prefetch(std::vector<LogicAddr> const&) {
+}
+
+void BlockStore::warmup(std::vector<LogicAddr> const& addrs) {
+    prefetch(addrs);
+}
+
+std::vector<LogicAddr> BlockStore::get_hot_blocks(size_t) const {
+    return std::vector<LogicAddr>();
+}
+
+LogicAddr BlockStore::get_min_live_addr() const {
+    return 0;
+}
+
+bool BlockStore::verify_checksum(LogicAddr, u8 const* data, size_t size, u32 expected) {
+    return checksum(data, size) == expected;
+}
+
+static bool& last_read_cached_flag() {
+    static thread_local bool cached = false;
+    return cached;
+}
+
+bool BlockStore::last_read_cached() {
+    return last_read_cached_flag();
+}
+
+void BlockStore::set_last_read_cached(bool cached) {
+    last_read_cached_flag() = cached;
+}
+
+//! Add I/O counters
+static void add_io_stats(BlockIOStats* dest, BlockIOStats const& src) {
+    dest->reads           += src.reads;
+    dest->zero_copy_reads += src.zero_copy_reads;
+    dest->cache_hits      += src.cache_hits;
+    dest->bytes_read      += src.bytes_read;
+    dest->writes          += src.writes;
+    dest->bytes_written   += src.bytes_written;
+}
+
+FileStorageParams::FileStorageParams()
+    : cache_size(AKU_DEFAULT_BLOCK_CACHE_SIZE)
+    , durability(DurabilityPolicy::EVERY_BLOCK)
+    , write_buffer_size(AKU_DEFAULT_WRITE_BUFFER_SIZE)
+    , flush_interval_ms(AKU_DEFAULT_FLUSH_INTERVAL_MS)
+    , checksum(ChecksumPolicy::EVERY_READ)
+    , archive_capacity(0)
+    , access_pattern(AccessPattern::NORMAL)
+    , huge_pages(false)
+    , lock_current_volume(false)
+    , direct_io(false)
+    , numa_aware(false)
+    , spare_volumes(0)
+    , read_only(false)
+{
+}
+
+FileStorage::FileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params)
     : meta_(MetaVolume::open_existing(meta))
     , current_volume_(0)
     , current_gen_(0)
     , total_size_(0)
+    , cache_(params.cache_size, 4, params.numa_aware ? get_numa_node_count() : 1)
+    , durability_(params.durability)
+    , write_buffer_size_(params.write_buffer_size)
+    , flush_interval_(params.flush_interval_ms)
+    , last_sync_(std::chrono::steady_clock::now())
+    , min_live_addr_(0)
+    , archive_path_(params.archive_path)
+    , archive_capacity_(params.archive_capacity)
+    , access_pattern_(params.access_pattern)
+    , huge_pages_(params.huge_pages)
+    , lock_current_volume_(params.lock_current_volume)
+    // Read-only mode serves the blocks from the memory mapping
+    , direct_io_(params.direct_io && !params.read_only)
+    , read_only_(params.read_only)
+    , archive_io_()
 {
     typedef VolumeRegistry::VolumeDesc TVol;
     auto volumes = meta->get_volumes();
@@ -175,10 +457,12 @@ FileStorage::FileStorage(std::shared_ptr<VolumeRegistry> meta)
                                                    StatusUtil::str(status)));
             AKU_PANIC("Can't open blockstore - " + StatusUtil::str(status));
         }
-        auto uptr = Volume::open_existing(volpath.c_str(), nblocks);
+        auto uptr = Volume::open_existing(volpath.c_str(), nblocks, read_only_);
+        setup_volume(uptr.get());
         volumes_.push_back(std::move(uptr));
         dirty_.push_back(0);
     }
+    volume_io_.resize(volumes_.size(), BlockIOStats());
 
     for (const auto& vol: volumes_) {
         total_size_ += vol->get_size();
@@ -203,6 +487,12 @@ FileStorage::FileStorage(std::shared_ptr<VolumeRegistry> meta)
             break;
         }
     }
+    if (lock_current_volume_ && !volumes_.empty()) {
+        volumes_[current_volume_]->lock_memory(true);
+    }
+    archive_tasks_.resize(volumes_.size());
+    open_archive();
+    update_min_live_addr();
 }
 
 void FileStorage::create(std::vector<std::tuple<u32, std::string>> vols)
@@ -217,9 +507,40 @@ void FileStorage::create(std::vector<std::tuple<u32, std::string>> vols)
     }
 }
 
+void FileStorage::setup_volume(Volume* vol) const {
+    if (direct_io_) {
+        vol->enable_direct_io();
+    }
+    if (durability_ != DurabilityPolicy::EVERY_BLOCK) {
+        vol->set_write_buffer_size(write_buffer_size_);
+    }
+    if (access_pattern_ != AccessPattern::NORMAL) {
+        vol->set_access_pattern(access_pattern_);
+    }
+    if (huge_pages_) {
+        vol->enable_huge_pages();
+    }
+}
+
 void FileStorage::handle_volume_transition() {
     Logger::msg(AKU_LOG_INFO, "Advance volume called, current gen:" + std::to_string(current_gen_));
+    // Write out the blocks buffered by the full volume
+    volumes_[current_volume_]->flush();
+    if (!archive_path_.empty()) {
+        u32 nblocks;
+        aku_Status status;
+        std::tie(status, nblocks) = meta_->get_nblocks(current_volume_);
+        if (status == AKU_SUCCESS) {
+            start_archiving(current_volume_, current_gen_, nblocks);
+        }
+    }
+    if (lock_current_volume_) {
+        volumes_[current_volume_]->lock_memory(false);
+    }
     adjust_current_volume();
+    if (lock_current_volume_) {
+        volumes_[current_volume_]->lock_memory(true);
+    }
     aku_Status status;
     std::tie(status, current_gen_) = meta_->get_generation(current_volume_);
     if (status != AKU_SUCCESS) {
@@ -234,6 +555,9 @@ void FileStorage::handle_volume_transition() {
         AKU_PANIC("Can't read nblocks of the next volume, " + StatusUtil::str(status));
     }
     if (nblocks != 0) {
+        if (!archive_path_.empty()) {
+            add_to_archive(current_volume_, current_gen_, nblocks);
+        }
         current_gen_ += volumes_.size();
         auto status = meta_->set_generation(current_volume_, current_gen_);
         if (status != AKU_SUCCESS) {
@@ -248,7 +572,11 @@ void FileStorage::handle_volume_transition() {
         }
         volumes_[current_volume_]->reset();
         dirty_[current_volume_]++;
+        update_min_live_addr();
     }
+    // Generation change can't wait for the next flush, otherwise the old content
+    // of the reused volume would be considered valid after crash
+    meta_->flush();
 }
 
 static u32 extract_gen(LogicAddr addr) {
@@ -263,25 +591,390 @@ static LogicAddr make_logic(u32 gen, BlockAddr addr) {
     return static_cast<u64>(gen) << 32 | addr;
 }
 
+aku_Status BlockStore::read_range(LogicAddr begin, LogicAddr end,
+                                  std::function<bool(std::shared_ptr<Block>)> const& fn)
+{
+    // Blocks are read in batches so adjacent blocks can be prefetched
+    static const size_t BATCH_SIZE = 64;
+    auto addr = std::max(begin, get_min_live_addr());
+    std::vector<LogicAddr> batch;
+    while (addr < end) {
+        batch.clear();
+        while (addr < end && batch.size() < BATCH_SIZE) {
+            if (exists(addr)) {
+                batch.push_back(addr++);
+            } else if (batch.empty()) {
+                // End of the volume or the volume was deleted, next generation
+                // starts from the beginning of the next volume
+                addr = make_logic(extract_gen(addr) + 1, 0);
+            } else {
+                break;
+            }
+        }
+        for (auto const& res: read_blocks(batch)) {
+            auto status = std::get<0>(res);
+            if (status == AKU_EUNAVAILABLE) {
+                // Deleted by retention after the `exists` call
+                continue;
+            }
+            if (status != AKU_SUCCESS) {
+                return status;
+            }
+            if (!fn(std::get<1>(res))) {
+                return AKU_SUCCESS;
+            }
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+void FileStorage::update_min_live_addr() {
+    // Generation of the volume grows every time the volume gets reused, so the
+    // block is deleted if its generation is smaller than the generation of every
+    // non-empty volume.
+    u32 min_gen = std::numeric_limits<u32>::max();
+    for (u32 ix = 0; ix < volumes_.size(); ix++) {
+        aku_Status status;
+        u32 gen, nblocks;
+        std::tie(status, gen) = meta_->get_generation(ix);
+        if (status == AKU_SUCCESS) {
+            std::tie(status, nblocks) = meta_->get_nblocks(ix);
+        }
+        if (status == AKU_SUCCESS && nblocks != 0) {
+            min_gen = std::min(min_gen, gen);
+        }
+    }
+    if (!archive_.empty()) {
+        // Blocks of the reused volumes can still be read from the archive
+        min_gen = std::min(min_gen, archive_.begin()->first);
+    }
+    if (min_gen != std::numeric_limits<u32>::max()) {
+        min_live_addr_.store(make_logic(min_gen, 0));
+    }
+}
+
+/** Copy first `nblocks` blocks of the volume, destination file is created atomically.
+  * If `drop_cache` is set copied data is evicted from the page cache.
+  */
+static aku_Status copy_volume(std::string const& src, std::string const& dest, u32 nblocks, bool drop_cache) {
+    std::string tmp = dest + ".tmp";
+    auto fail = [&](std::string const& what, int in, int out) {
+        boost::system::error_code error(errno, boost::system::system_category());
+        Logger::msg(AKU_LOG_ERROR, "Can't copy volume '" + src + "' to '" + dest + "', " + what +
+                                   " error: " + error.message());
+        if (in >= 0) {
+            ::close(in);
+        }
+        if (out >= 0) {
+            ::close(out);
+        }
+        ::unlink(tmp.c_str());
+        return AKU_EGENERAL;
+    };
+    int in = ::open(src.c_str(), O_RDONLY);
+    if (in < 0) {
+        return fail("open", in, -1);
+    }
+    int out = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) {
+        return fail("create", in, out);
+    }
+    const size_t CHUNK_SIZE = 256*AKU_BLOCK_SIZE;
+    std::vector<u8> buffer(CHUNK_SIZE);
+    size_t total = static_cast<size_t>(nblocks)*AKU_BLOCK_SIZE;
+    for (size_t offset = 0; offset < total;) {
+        auto size = std::min(CHUNK_SIZE, total - offset);
+        auto nread = ::pread(in, buffer.data(), size, static_cast<off_t>(offset));
+        if (nread != static_cast<ssize_t>(size)) {
+            return fail("read", in, out);
+        }
+        for (size_t pos = 0; pos < size;) {
+            auto nwritten = ::write(out, buffer.data() + pos, size - pos);
+            if (nwritten <= 0) {
+                return fail("write", in, out);
+            }
+            pos += static_cast<size_t>(nwritten);
+        }
+        if (drop_cache) {
+            ::posix_fadvise(in, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_DONTNEED);
+        }
+        offset += size;
+    }
+    if (::fsync(out) != 0) {
+        return fail("sync", in, out);
+    }
+    if (drop_cache) {
+        // Pages are clean after fsync and can be dropped
+        ::posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    ::close(in);
+    if (::close(out) != 0) {
+        return fail("close", -1, -1);
+    }
+    if (::rename(tmp.c_str(), dest.c_str()) != 0) {
+        return fail("rename", -1, -1);
+    }
+    return AKU_SUCCESS;
+}
+
+std::string FileStorage::get_archive_path(u32 gen) const {
+    boost::filesystem::path path(archive_path_);
+    path /= std::to_string(gen) + ".vol";
+    return path.string();
+}
+
+void FileStorage::open_archive() {
+    if (archive_path_.empty()) {
+        return;
+    }
+    boost::filesystem::path dir(archive_path_);
+    if (!boost::filesystem::exists(dir)) {
+        if (read_only_) {
+            return;
+        }
+        Logger::msg(AKU_LOG_INFO, archive_path_ + " doesn't exists, trying to create directory");
+        boost::filesystem::create_directories(dir);
+    }
+    for (boost::filesystem::directory_iterator it(dir), end; it != end; it++) {
+        auto path = it->path();
+        if (path.extension() == ".tmp") {
+            if (read_only_) {
+                continue;
+            }
+            // Copy operation was interrupted
+            boost::system::error_code error;
+            boost::filesystem::remove(path, error);
+            continue;
+        }
+        if (path.extension() != ".vol") {
+            continue;
+        }
+        u32 gen;
+        try {
+            gen = static_cast<u32>(std::stoul(path.stem().string()));
+        } catch (std::exception const&) {
+            Logger::msg(AKU_LOG_ERROR, "Unexpected file in the archive directory: " + path.string());
+            continue;
+        }
+        ArchivedVolume item;
+        item.path = path.string();
+        item.nblocks = static_cast<u32>(boost::filesystem::file_size(path) / AKU_BLOCK_SIZE);
+        archive_[gen] = std::move(item);
+    }
+    Logger::msg(AKU_LOG_INFO, std::to_string(archive_.size()) + " archived volumes found in " + archive_path_);
+}
+
+void FileStorage::start_archiving(u32 volix, u32 gen, u32 nblocks) {
+    if (archive_tasks_[volix].valid()) {
+        archive_tasks_[volix].wait();
+    }
+    auto src = volumes_[volix]->get_path();
+    auto dest = get_archive_path(gen);
+    // Volume is not modified until it gets reused so it can be copied without the lock
+    bool drop_cache = direct_io_;
+    archive_tasks_[volix] = std::async(std::launch::async, [src, dest, nblocks, drop_cache]() {
+        return copy_volume(src, dest, nblocks, drop_cache);
+    });
+}
+
+void FileStorage::add_to_archive(u32 volix, u32 gen, u32 nblocks) {
+    auto dest = get_archive_path(gen);
+    aku_Status status = AKU_SUCCESS;
+    if (archive_tasks_[volix].valid()) {
+        status = archive_tasks_[volix].get();
+    } else if (!boost::filesystem::exists(dest)) {
+        // Volume became full before the blockstore was opened
+        status = copy_volume(volumes_[volix]->get_path(), dest, nblocks, direct_io_);
+    }
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Volume " + volumes_[volix]->get_path() + " wasn't archived, " +
+                                   StatusUtil::str(status));
+        return;
+    }
+    ArchivedVolume item;
+    item.path = dest;
+    item.nblocks = nblocks;
+    archive_[gen] = std::move(item);
+    Logger::msg(AKU_LOG_INFO, "Volume " + volumes_[volix]->get_path() + " archived, generation: " +
+                              std::to_string(gen));
+    while (archive_capacity_ != 0 && archive_.size() > archive_capacity_) {
+        auto it = archive_.begin();
+        auto path = it->second.path;
+        archive_.erase(it);
+        boost::system::error_code error;
+        boost::filesystem::remove(path, error);
+        if (error) {
+            Logger::msg(AKU_LOG_ERROR, "Can't remove archived volume " + path + ", " + error.message());
+        }
+    }
+}
+
+bool FileStorage::is_archived(LogicAddr addr) const {
+    auto it = archive_.find(extract_gen(addr));
+    return it != archive_.end() && extract_vol(addr) < it->second.nblocks;
+}
+
+std::tuple<aku_Status, std::shared_ptr<Block>> FileStorage::read_archived_block(LogicAddr addr) {
+    auto it = archive_.find(extract_gen(addr));
+    auto vol = extract_vol(addr);
+    if (it == archive_.end() || vol >= it->second.nblocks) {
+        return std::make_tuple(AKU_EUNAVAILABLE, std::unique_ptr<Block>());
+    }
+    // Archived volume can be removed so the blocks are always copied
+    auto block = cache_.lookup(addr);
+    if (block) {
+        archive_io_.cache_hits++;
+        set_last_read_cached(true);
+        return std::make_tuple(AKU_SUCCESS, std::move(block));
+    }
+    auto& item = it->second;
+    if (!item.volume) {
+        try {
+            item.volume = Volume::open_existing(item.path.c_str(), item.nblocks, read_only_);
+            if (direct_io_) {
+                item.volume->enable_direct_io();
+            }
+        } catch (std::exception const& e) {
+            Logger::msg(AKU_LOG_ERROR, "Can't open archived volume " + item.path + ", " + e.what());
+            return std::make_tuple(AKU_EUNAVAILABLE, std::unique_ptr<Block>());
+        }
+    }
+    block = std::make_shared<Block>(Block::UninitializedTag());
+    aku_Status status = item.volume->read_block(vol, block->get_data());
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, std::unique_ptr<Block>());
+    }
+    archive_io_.reads++;
+    archive_io_.bytes_read += AKU_BLOCK_SIZE;
+    block->set_addr(addr);
+    cache_.insert(block);
+    return std::make_tuple(status, std::move(block));
+}
+
+LogicAddr FileStorage::get_min_live_addr() const {
+    return min_live_addr_.load(std::memory_order_relaxed);
+}
+
+LogicAddr FileStorage::get_top_addr() const {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    aku_Status status;
+    u32 nblocks;
+    std::tie(status, nblocks) = meta_->get_nblocks(current_volume_);
+    if (status != AKU_SUCCESS) {
+        AKU_PANIC("Invalid BlockStore state, " + StatusUtil::str(status));
+    }
+    return make_logic(current_gen_, nblocks);
+}
+
+void FileStorage::warmup(std::vector<LogicAddr> const& addrs) {
+    std::vector<LogicAddr> live;
+    for (auto addr: addrs) {
+        if (exists(addr)) {
+            live.push_back(addr);
+        }
+    }
+    prefetch(live);
+    // Blocks that can be accessed using zero-copy are not cached, prefetch is enough
+    for (auto addr: live) {
+        aku_Status status;
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = read_block(addr);
+        if (status == AKU_SUCCESS) {
+            cache_.promote(addr);
+        }
+    }
+}
+
+std::vector<LogicAddr> FileStorage::get_hot_blocks(size_t limit) const {
+    return cache_.get_hot_addrs(limit);
+}
+
 std::tuple<aku_Status, LogicAddr> FileStorage::append_block(std::shared_ptr<Block> data) {
+    AKU_TRACE_SCOPE1(block_append, data->get_size());
+    ScopedLatency latency(Metrics::block_write());
+    if (read_only_) {
+        return std::make_tuple(AKU_ENOT_PERMITTED, EMPTY_ADDR);
+    }
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    aku_Status status;
+    LogicAddr addr;
+    std::tie(status, addr) = append_block_nolock(data);
+    if (status == AKU_SUCCESS && replication_cb_) {
+        replication_cb_(addr, data);
+    }
+    return std::make_tuple(status, addr);
+}
+
+void FileStorage::set_replication_callback(std::function<void(LogicAddr, std::shared_ptr<Block>)> cb) {
     std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    replication_cb_ = std::move(cb);
+}
+
+aku_Status FileStorage::apply_replicated_block(LogicAddr addr, std::shared_ptr<Block> data) {
+    if (read_only_) {
+        return AKU_ENOT_PERMITTED;
+    }
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    aku_Status status;
+    u32 nblocks;
+    std::tie(status, nblocks) = meta_->get_nblocks(current_volume_);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    auto gen = extract_gen(addr);
+    auto vol = extract_vol(addr);
+    // Block should be written to the current volume or to the beginning of
+    // the next one if the current volume is full
+    bool next = gen == current_gen_ && vol == nblocks;
+    bool transition = gen != current_gen_ && vol == 0 && nblocks == volumes_[current_volume_]->get_size();
+    if (!next && !transition) {
+        Logger::msg(AKU_LOG_ERROR, "Replicated block " + std::to_string(addr) +
+                                   " doesn't match the next address, generation: " +
+                                   std::to_string(current_gen_) + ", nblocks: " + std::to_string(nblocks));
+        return AKU_EBAD_ARG;
+    }
+    LogicAddr actual;
+    std::tie(status, actual) = append_block_nolock(data);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    if (actual != addr) {
+        // Follower's volumes are different
+        Logger::msg(AKU_LOG_ERROR, "Replicated block " + std::to_string(addr) + " was written to " +
+                                   std::to_string(actual));
+        return AKU_EBAD_ARG;
+    }
+    return AKU_SUCCESS;
+}
+
+std::tuple<aku_Status, LogicAddr> FileStorage::append_block_nolock(std::shared_ptr<Block> data) {
     BlockAddr block_addr;
     aku_Status status;
-    std::tie(status, block_addr) = volumes_[current_volume_]->append_block(data->get_data());
+    std::tie(status, block_addr) = volumes_[current_volume_]->append_block(data->get_cdata());
     if (status == AKU_EOVERFLOW) {
       // transition to new/next volume
       handle_volume_transition();
-      std::tie(status, block_addr) = volumes_.at(current_volume_)->append_block(data->get_data());
+      std::tie(status, block_addr) = volumes_.at(current_volume_)->append_block(data->get_cdata());
       if (status != AKU_SUCCESS) {
         return std::make_tuple(status, 0ull);
       }
     }
     data->set_addr(block_addr);
+    volume_io_[current_volume_].writes++;
+    volume_io_[current_volume_].bytes_written += AKU_BLOCK_SIZE;
     status = meta_->set_nblocks(current_volume_, block_addr + 1);
     if (status != AKU_SUCCESS) {
       AKU_PANIC("Invalid BlockStore state, " + StatusUtil::str(status));
     }
     dirty_[current_volume_]++;
+    if (durability_ == DurabilityPolicy::INTERVAL) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_sync_ >= flush_interval_) {
+            volumes_[current_volume_]->sync();
+            meta_->flush();
+            last_sync_ = now;
+        }
+    }
     return std::make_tuple(status, make_logic(current_gen_, block_addr));
 }
 
@@ -295,9 +988,14 @@ void FileStorage::flush() {
         }
     }
     */
+    // Data should reach the disk before metadata that references it
     for (size_t ix = 0; ix < volumes_.size(); ix++) {
-        volumes_[ix]->flush();
+        if (dirty_[ix]) {
+            dirty_[ix] = 0;
+            volumes_[ix]->sync();
+        }
     }
+    last_sync_ = std::chrono::steady_clock::now();
     meta_->flush();
 }
 
@@ -317,10 +1015,57 @@ BlockStoreStats FileStorage::get_stats() const {
             stats.nblocks += res;
         }
     }
+    stats.cache = cache_.get_stats();
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    for (auto const& io: volume_io_) {
+        add_io_stats(&stats.io, io);
+    }
+    add_io_stats(&stats.io, archive_io_);
     return stats;
 }
 
+std::tuple<aku_Status, std::shared_ptr<Block>> FileStorage::read_volume_block(u32 volix, LogicAddr addr) {
+    AKU_TRACE_SCOPE1(block_read, addr);
+    aku_Status status;
+    auto vol = extract_vol(addr);
+    // Try to use zero-copy if possible
+    const u8* mptr;
+    std::tie(status, mptr) = volumes_[volix]->read_block_zero_copy(vol);
+    if (status == AKU_SUCCESS) {
+        volume_io_[volix].zero_copy_reads++;
+        QueryProfile::add(&QueryProfile::blocks_read, 1);
+        std::shared_ptr<Block> zblock = std::make_shared<Block>(addr, mptr);
+        return std::make_tuple(status, std::move(zblock));
+    } else if (status == AKU_EUNAVAILABLE) {
+        // Fallback to copying if not possible
+        QueryProfile::add(&QueryProfile::blocks_read, 1);
+        auto block = cache_.lookup(addr);
+        if (block) {
+            volume_io_[volix].cache_hits++;
+            set_last_read_cached(true);
+            QueryProfile::add(&QueryProfile::cache_hits, 1);
+            return std::make_tuple(AKU_SUCCESS, std::move(block));
+        }
+        block = std::make_shared<Block>(Block::UninitializedTag());
+        {
+            ScopedLatency latency(Metrics::block_read());
+            status = volumes_[volix]->read_block(vol, block->get_data());
+        }
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, std::unique_ptr<Block>());
+        }
+        volume_io_[volix].reads++;
+        volume_io_[volix].bytes_read += AKU_BLOCK_SIZE;
+        QueryProfile::add(&QueryProfile::bytes_read, AKU_BLOCK_SIZE);
+        block->set_addr(addr);
+        cache_.insert(block);
+        return std::make_tuple(status, std::move(block));
+    }
+    return std::make_tuple(status, std::unique_ptr<Block>());
+}
+
 PerVolumeStats FileStorage::get_volume_stats() const {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
     PerVolumeStats result;
     size_t nvol = meta_->get_nvolumes();
     for (u32 ix = 0; ix < nvol; ix++) {
@@ -336,11 +1081,13 @@ PerVolumeStats FileStorage::get_volume_stats() const {
         if (stat == AKU_SUCCESS) {
             stats.nblocks += res;
         }
+        if (ix < volume_io_.size()) {
+            stats.io = volume_io_[ix];
+        }
         auto name = volume_names_.at(ix);
         result[name] = stats;
     }
     return result;
-
 }
 
 static u32 crc32c(const u8* data, size_t size) {
@@ -354,14 +1101,26 @@ u32 FileStorage::checksum(u8 const* data, size_t size) const {
 
 // FixedSizeFileStorage
 
-FixedSizeFileStorage::FixedSizeFileStorage(std::shared_ptr<VolumeRegistry> meta)
-    : FileStorage::FileStorage(meta)
+FixedSizeFileStorage::FixedSizeFileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params)
+    : FileStorage::FileStorage(meta, params)
+    , checksum_policy_(params.checksum)
 {
-    // nothing specific needed except calling the parent constructor
+    if (checksum_policy_ == ChecksumPolicy::FIRST_READ) {
+        for (auto const& vol: volumes_) {
+            auto size = vol->get_size();
+            std::unique_ptr<std::atomic<u32>[]> flags(new std::atomic<u32>[size]);
+            for (u32 i = 0; i < size; i++) {
+                flags[i].store(0, std::memory_order_relaxed);
+            }
+            verified_.push_back(std::move(flags));
+        }
+    }
 }
 
-std::shared_ptr<FixedSizeFileStorage> FixedSizeFileStorage::open(std::shared_ptr<VolumeRegistry> meta) {
-    auto bs = new FixedSizeFileStorage(meta);
+std::shared_ptr<FixedSizeFileStorage> FixedSizeFileStorage::open(std::shared_ptr<VolumeRegistry> meta,
+                                                                 FileStorageParams const& params)
+{
+    auto bs = new FixedSizeFileStorage(meta, params);
     return std::shared_ptr<FixedSizeFileStorage>(bs);
 }
 
@@ -376,15 +1135,23 @@ bool FixedSizeFileStorage::exists(LogicAddr addr) const {
     if (status != AKU_SUCCESS) {
       return false;
     }
+    if (actual_gen != gen) {
+      return is_archived(addr);
+    }
     u32 nblocks;
     std::tie(status, nblocks) = meta_->get_nblocks(volix);
     if (status != AKU_SUCCESS) {
       return false;
     }
-    return actual_gen == gen && vol < nblocks;
+    return vol < nblocks;
 }
 
 std::tuple<aku_Status, std::shared_ptr<Block>> FixedSizeFileStorage::read_block(LogicAddr addr) {
+    set_last_read_cached(false);
+    if (addr < get_min_live_addr()) {
+        // Fast path, block was deleted by retention
+        return std::make_tuple(AKU_EUNAVAILABLE, std::unique_ptr<Block>());
+    }
     std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
     aku_Status status;
     auto gen = extract_gen(addr);
@@ -400,26 +1167,78 @@ std::tuple<aku_Status, std::shared_ptr<Block>> FixedSizeFileStorage::read_block(
     if (status != AKU_SUCCESS) {
         return std::make_tuple(AKU_EBAD_ARG, std::unique_ptr<Block>());
     }
-    if (actual_gen != gen || vol >= nblocks) {
+    if (actual_gen != gen) {
+        // Volume was reused
+        return read_archived_block(addr);
+    }
+    if (vol >= nblocks) {
         return std::make_tuple(AKU_EUNAVAILABLE, std::unique_ptr<Block>());
     }
-    // Try to use zero-copy if possible
-    const u8* mptr;
-    std::tie(status, mptr) = volumes_[volix]->read_block_zero_copy(vol);
-    if (status == AKU_SUCCESS) {
-        std::shared_ptr<Block> zblock = std::make_shared<Block>(addr, mptr);
-        return std::make_tuple(status, std::move(zblock));
-    } else if (status == AKU_EUNAVAILABLE) {
-        // Fallback to copying if not possible
-        std::vector<u8> dest(AKU_BLOCK_SIZE, 0);
-        status = volumes_[volix]->read_block(vol, dest.data());
-        if (status != AKU_SUCCESS) {
-            return std::make_tuple(status, std::unique_ptr<Block>());
+    return read_volume_block(volix, addr);
+}
+
+/** Split list of addresses into runs of adjacent blocks of the same generation.
+  * Callback receives generation, index of the first block and number of blocks.
+  */
+template<class Fn>
+static void for_each_run(std::vector<LogicAddr> const& addrs, Fn const& fn) {
+    // Child nodes are often written one after another, one madvise call per run is enough
+    std::vector<LogicAddr> sorted(addrs);
+    std::sort(sorted.begin(), sorted.end());
+    size_t ix = 0;
+    while (ix < sorted.size()) {
+        size_t next = ix + 1;
+        while (next < sorted.size() && sorted[next] - sorted[next - 1] <= 1 &&
+               extract_gen(sorted[next]) == extract_gen(sorted[ix]))
+        {
+            next++;
         }
-        auto block = std::make_shared<Block>(addr, std::move(dest));
-        return std::make_tuple(status, std::move(block));
+        auto begin = extract_vol(sorted[ix]);
+        auto count = extract_vol(sorted[next - 1]) - begin + 1;
+        fn(extract_gen(sorted[ix]), begin, count);
+        ix = next;
     }
-    return std::make_tuple(status, std::unique_ptr<Block>());
+}
+
+void FixedSizeFileStorage::prefetch(std::vector<LogicAddr> const& addrs) {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    for_each_run(addrs, [this](u32 gen, BlockAddr begin, u32 count) {
+        auto volix = gen % static_cast<u32>(volumes_.size());
+        aku_Status status;
+        u32 actual_gen;
+        std::tie(status, actual_gen) = meta_->get_generation(volix);
+        if (status == AKU_SUCCESS && actual_gen != gen) {
+            auto it = archive_.find(gen);
+            if (it != archive_.end() && it->second.volume) {
+                it->second.volume->prefetch_blocks(begin, count);
+            }
+            return;
+        }
+        volumes_[volix]->prefetch_blocks(begin, count);
+    });
+}
+
+bool FixedSizeFileStorage::verify_checksum(LogicAddr addr, u8 const* data, size_t size, u32 expected) {
+    if (checksum_policy_ == ChecksumPolicy::EVERY_READ) {
+        return checksum(data, size) == expected;
+    }
+    // Volumes can't be added to the fixed size storage so `verified_` is never
+    // changed after open and can be accessed without the lock
+    auto gen = extract_gen(addr);
+    auto vol = extract_vol(addr);
+    auto volix = gen % static_cast<u32>(volumes_.size());
+    if (vol >= volumes_[volix]->get_size()) {
+        return checksum(data, size) == expected;
+    }
+    auto& flag = verified_[volix][vol];
+    if (flag.load(std::memory_order_relaxed) == gen + 1) {
+        return true;
+    }
+    if (checksum(data, size) != expected) {
+        return false;
+    }
+    flag.store(gen + 1, std::memory_order_relaxed);
+    return true;
 }
 
 void FixedSizeFileStorage::adjust_current_volume() {
@@ -428,15 +1247,36 @@ void FixedSizeFileStorage::adjust_current_volume() {
 
 // ExpandableFileStorage
 
-ExpandableFileStorage::ExpandableFileStorage(std::shared_ptr<VolumeRegistry> meta)
-    : FileStorage::FileStorage(meta)
+ExpandableFileStorage::ExpandableFileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params)
+    : FileStorage::FileStorage(meta, params)
     , db_name_(meta->get_dbname())
+    , registry_(meta)
+    , spare_volumes_(params.spare_volumes)
 {
+    if (!archive_path_.empty()) {
+        // Volumes are never reused by this blockstore
+        Logger::msg(AKU_LOG_INFO, "Volume archive is not used by the expandable storage");
+        archive_path_.clear();
+        archive_.clear();
+        update_min_live_addr();
+    }
+    if (!read_only_) {
+        std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+        schedule_spare_volume();
+    }
+}
+
+ExpandableFileStorage::~ExpandableFileStorage() {
+    if (spare_task_.valid()) {
+        // Volume is registered by the task, it will be used after restart
+        spare_task_.wait();
+    }
 }
 
-std::shared_ptr<ExpandableFileStorage> ExpandableFileStorage::open(std::shared_ptr<VolumeRegistry> meta)
+std::shared_ptr<ExpandableFileStorage> ExpandableFileStorage::open(std::shared_ptr<VolumeRegistry> meta,
+                                                                   FileStorageParams const& params)
 {
-    auto bs = new ExpandableFileStorage(meta);
+    auto bs = new ExpandableFileStorage(meta, params);
     return std::shared_ptr<ExpandableFileStorage>(bs);
 }
 
@@ -459,6 +1299,7 @@ bool ExpandableFileStorage::exists(LogicAddr addr) const {
 }
 
 std::tuple<aku_Status, std::shared_ptr<Block>> ExpandableFileStorage::read_block(LogicAddr addr) {
+    set_last_read_cached(false);
     std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
     aku_Status status;
     auto gen = extract_gen(addr);
@@ -476,52 +1317,115 @@ std::tuple<aku_Status, std::shared_ptr<Block>> ExpandableFileStorage::read_block
     if (actual_gen != gen || vol >= nblocks) {
       return std::make_tuple(AKU_EUNAVAILABLE, std::unique_ptr<Block>());
     }
-    // Try to use zero-copy if possible
-    const u8* mptr;
-    std::tie(status, mptr) = volumes_[gen]->read_block_zero_copy(vol);
-    if (status == AKU_SUCCESS) {
-        std::shared_ptr<Block> zblock = std::make_shared<Block>(addr, mptr);
-        return std::make_tuple(status, std::move(zblock));
-    } else if (status == AKU_EUNAVAILABLE) {
-        // Fallback to copying if not possible
-        std::vector<u8> dest(AKU_BLOCK_SIZE, 0);
-        status = volumes_[gen]->read_block(vol, dest.data());
-        if (status != AKU_SUCCESS) {
-            return std::make_tuple(status, std::unique_ptr<Block>());
+    return read_volume_block(gen, addr);
+}
+
+void ExpandableFileStorage::prefetch(std::vector<LogicAddr> const& addrs) {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    for_each_run(addrs, [this](u32 gen, BlockAddr begin, u32 count) {
+        if (gen < volumes_.size()) {
+            volumes_[gen]->prefetch_blocks(begin, count);
         }
-        auto block = std::make_shared<Block>(addr, std::move(dest));
-        return std::make_tuple(status, std::move(block));
-    }
-    return std::make_tuple(status, std::unique_ptr<Block>());
+    });
 }
 
-std::unique_ptr<Volume> ExpandableFileStorage::create_new_volume(u32 id) {
-    u32 prev_id = current_volume_ - 1;
-    boost::filesystem::path prev_path(volumes_[prev_id]->get_path());
+std::string ExpandableFileStorage::get_volume_path(u32 id) const {
+    boost::filesystem::path prev_path(volumes_.back()->get_path());
     auto pp = prev_path.parent_path();
     std::string basename = std::string(db_name_) + "_" + std::to_string(id) + ".vol";
     boost::filesystem::path new_path = pp / basename;
-    Volume::create_new(new_path.c_str(), volumes_[prev_id]->get_size());
-    return Volume::open_existing(new_path.c_str(), 0);
+    return new_path.string();
+}
+
+std::unique_ptr<Volume> ExpandableFileStorage::create_new_volume(u32 id) {
+    auto path = get_volume_path(id);
+    Volume::create_new(path.c_str(), volumes_.back()->get_size());
+    return Volume::open_existing(path.c_str(), 0);
+}
+
+void ExpandableFileStorage::collect_spare_volume(bool wait) {
+    if (!spare_task_.valid()) {
+        return;
+    }
+    if (!wait && spare_task_.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+    auto vol = spare_task_.get();
+    if (vol) {
+        spare_.push_back(std::move(vol));
+    }
+}
+
+void ExpandableFileStorage::schedule_spare_volume() {
+    if (spare_volumes_ == 0 || volumes_.empty()) {
+        return;
+    }
+    collect_spare_volume(false);
+    if (spare_task_.valid()) {
+        return;
+    }
+    // Empty volumes after the current one were registered before restart
+    u32 nspare = static_cast<u32>(volumes_.size() - current_volume_ - 1 + spare_.size());
+    if (nspare >= spare_volumes_) {
+        return;
+    }
+    u32 id = static_cast<u32>(volumes_.size() + spare_.size());
+    auto path = get_volume_path(id);
+    u32 capacity = volumes_.back()->get_size();
+    auto registry = registry_;
+    // File creation, preallocation and the registry update are slow so the writer
+    // shouldn't do them, only in-memory state is updated when the volume gets used
+    spare_task_ = std::async(std::launch::async, [registry, id, path, capacity]() {
+        std::unique_ptr<Volume> vol;
+        try {
+            Volume::create_new(path.c_str(), capacity, true);
+            vol = Volume::open_existing(path.c_str(), 0);
+            VolumeRegistry::VolumeDesc desc;
+            desc.id         = id;
+            desc.path       = path;
+            desc.version    = AKUMULI_VERSION;
+            desc.nblocks    = 0;
+            desc.capacity   = capacity;
+            desc.generation = id;
+            registry->add_volume(desc);
+        } catch (...) {
+            Logger::msg(AKU_LOG_ERROR, "Can't create spare volume " + path + ", " +
+                                       boost::current_exception_diagnostic_information());
+            vol.reset();
+        }
+        return vol;
+    });
 }
 
 void ExpandableFileStorage::adjust_current_volume() {
     current_volume_ = current_volume_ + 1;
     if (current_volume_ >= volumes_.size()) {
         // add new volume
-        auto vol = create_new_volume(current_volume_);
+        std::unique_ptr<Volume> vol;
+        if (spare_.empty()) {
+            // Waiting for the volume that is almost ready is faster than creating another one
+            collect_spare_volume(true);
+        }
+        if (!spare_.empty()) {
+            vol = std::move(spare_.front());
+            spare_.pop_front();
+            meta_->attach_volume(current_volume_, vol->get_size(), vol->get_path());
+        } else {
+            vol = create_new_volume(current_volume_);
+            meta_->add_volume(current_volume_, vol->get_size(), vol->get_path());
+        }
+        setup_volume(vol.get());
 
         // update internal state of this class to be consistent
         dirty_.push_back(0);
         volume_names_.push_back(vol->get_path());
+        volume_io_.push_back(BlockIOStats());
         total_size_ += vol->get_size();
 
-        // update metadata
-        meta_->add_volume(current_volume_, vol->get_size(), vol->get_path());
-
         // finally add new volume to our internal list of volumes
         volumes_.push_back(std::move(vol));
     }
+    schedule_spare_volume();
 }
 
 //! Address space should be started from this address (otherwise some tests will pass no matter what).
@@ -531,6 +1435,7 @@ static const LogicAddr MEMSTORE_BASE = 619;
 MemStore::MemStore()
     : write_pos_(0)
     , removed_pos_(0)
+    , io_()
 {
 }
 
@@ -538,6 +1443,7 @@ MemStore::MemStore(std::function<void(LogicAddr)> append_cb)
     : append_callback_(append_cb)
     , write_pos_(0)
     , removed_pos_(0)
+    , io_()
 {
 }
 
@@ -550,6 +1456,7 @@ u32 MemStore::checksum(u8 const* data, size_t size) const {
 }
 
 std::tuple<aku_Status, std::shared_ptr<Block>> MemStore::read_block(LogicAddr addr) {
+    set_last_read_cached(false);
     addr -= MEMSTORE_BASE;
     std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
     std::shared_ptr<Block> block;
@@ -560,12 +1467,11 @@ std::tuple<aku_Status, std::shared_ptr<Block>> MemStore::read_block(LogicAddr ad
     if (addr < removed_pos_) {
         return std::make_tuple(AKU_EUNAVAILABLE, block);
     }
-    std::vector<u8> data;
-    data.reserve(AKU_BLOCK_SIZE);
-    auto begin = buffer_.begin() + offset;
-    auto end = begin + AKU_BLOCK_SIZE;
-    std::copy(begin, end, std::back_inserter(data));
-    block.reset(new Block(addr + MEMSTORE_BASE, std::move(data)));
+    block = std::make_shared<Block>(Block::UninitializedTag());
+    memcpy(block->get_data(), buffer_.data() + offset, AKU_BLOCK_SIZE);
+    block->set_addr(addr + MEMSTORE_BASE);
+    io_.reads++;
+    io_.bytes_read += AKU_BLOCK_SIZE;
     return std::make_tuple(AKU_SUCCESS, block);
 }
 
@@ -578,6 +1484,8 @@ std::tuple<aku_Status, LogicAddr> MemStore::append_block(std::shared_ptr<Block>
     }
     auto addr = write_pos_++;
     addr += MEMSTORE_BASE;
+    io_.writes++;
+    io_.bytes_written += AKU_BLOCK_SIZE;
     data->set_addr(addr);
     return std::make_tuple(AKU_SUCCESS, addr);
 }
@@ -587,29 +1495,129 @@ void MemStore::flush() {
 }
 
 BlockStoreStats MemStore::get_stats() const {
-    BlockStoreStats s;
+    BlockStoreStats s = {};
     s.block_size = 4096;
     s.capacity = 1024*4096;
     s.nblocks = write_pos_;
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    s.io = io_;
     return s;
 }
 
 PerVolumeStats MemStore::get_volume_stats() const {
     PerVolumeStats result;
-    BlockStoreStats s;
+    BlockStoreStats s = {};
     s.block_size = 4096;
     s.capacity = 1024*4096;
     s.nblocks = write_pos_;
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    s.io = io_;
     result["mem"] = s;
     return result;
 }
 
+LogicAddr MemStore::get_min_live_addr() const {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    return removed_pos_ + MEMSTORE_BASE;
+}
+
+LogicAddr MemStore::get_top_addr() const {
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    return write_pos_ + MEMSTORE_BASE;
+}
+
 bool MemStore::exists(LogicAddr addr) const {
     addr -= MEMSTORE_BASE;
     std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
     return addr < write_pos_;
 }
 
+// OverlayStore
+
+//! First address of the overlay, generation is too large to be used by the file storage
+static const LogicAddr OVERLAY_BASE = make_logic(0xFFFFFFFE, 0);
+
+OverlayStore::OverlayStore(std::shared_ptr<BlockStore> base)
+    : base_(base)
+{
+}
+
+bool OverlayStore::is_overlay_addr(LogicAddr addr) {
+    return addr >= OVERLAY_BASE && addr != EMPTY_ADDR;
+}
+
+std::tuple<aku_Status, std::shared_ptr<Block>> OverlayStore::read_block(LogicAddr addr) {
+    if (!is_overlay_addr(addr)) {
+        return base_->read_block(addr);
+    }
+    set_last_read_cached(true);
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    auto ix = addr - OVERLAY_BASE;
+    if (ix >= blocks_.size()) {
+        return std::make_tuple(AKU_EBAD_ARG, std::shared_ptr<Block>());
+    }
+    return std::make_tuple(AKU_SUCCESS, blocks_[ix]);
+}
+
+void OverlayStore::prefetch(std::vector<LogicAddr> const& addrs) {
+    std::vector<LogicAddr> base_addrs;
+    std::copy_if(addrs.begin(), addrs.end(), std::back_inserter(base_addrs), [](LogicAddr addr) {
+        return !is_overlay_addr(addr);
+    });
+    base_->prefetch(base_addrs);
+}
+
+std::tuple<aku_Status, LogicAddr> OverlayStore::append_block(std::shared_ptr<Block> data) {
+    // Caller can reuse the buffer
+    auto block = std::make_shared<Block>(Block::UninitializedTag());
+    memcpy(block->get_data(), data->get_cdata(), AKU_BLOCK_SIZE);
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    auto addr = OVERLAY_BASE + blocks_.size();
+    block->set_addr(addr);
+    data->set_addr(addr);
+    blocks_.push_back(std::move(block));
+    return std::make_tuple(AKU_SUCCESS, addr);
+}
+
+void OverlayStore::flush() {
+    // no-op
+}
+
+bool OverlayStore::exists(LogicAddr addr) const {
+    if (!is_overlay_addr(addr)) {
+        return base_->exists(addr);
+    }
+    std::lock_guard<std::mutex> guard(lock_); AKU_UNUSED(guard);
+    return addr - OVERLAY_BASE < blocks_.size();
+}
+
+u32 OverlayStore::checksum(u8 const* data, size_t size) const {
+    return base_->checksum(data, size);
+}
+
+bool OverlayStore::verify_checksum(LogicAddr addr, u8 const* data, size_t size, u32 expected) {
+    if (!is_overlay_addr(addr)) {
+        return base_->verify_checksum(addr, data, size, expected);
+    }
+    return checksum(data, size) == expected;
+}
+
+BlockStoreStats OverlayStore::get_stats() const {
+    return base_->get_stats();
+}
+
+PerVolumeStats OverlayStore::get_volume_stats() const {
+    return base_->get_volume_stats();
+}
+
+LogicAddr OverlayStore::get_min_live_addr() const {
+    return base_->get_min_live_addr();
+}
+
+LogicAddr OverlayStore::get_top_addr() const {
+    return base_->get_top_addr();
+}
+
 std::shared_ptr<BlockStore> BlockStoreBuilder::create_memstore() {
     return std::make_shared<MemStore>();
 }
@@ -618,4 +1626,8 @@ std::shared_ptr<BlockStore> BlockStoreBuilder::create_memstore(std::function<voi
     return std::make_shared<MemStore>(append_cb);
 }
 
+std::shared_ptr<BlockStore> BlockStoreBuilder::create_overlay(std::shared_ptr<BlockStore> base) {
+    return std::make_shared<OverlayStore>(base);
+}
+
 }}  // namespace
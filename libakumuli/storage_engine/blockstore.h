@@ -18,10 +18,16 @@
 #pragma once
 #include "volumeregistry.h"
 #include "volume.h"
-#include <random>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
 #include <mutex>
 #include <map>
 #include <string>
+#include <unordered_map>
 
 namespace Akumuli {
 namespace StorageEngine {
@@ -34,38 +40,192 @@ static const LogicAddr EMPTY_ADDR = std::numeric_limits<LogicAddr>::max();
 
 class Block;
 
-struct BlockCache {
+//! Block cache counters
+struct BlockCacheStats {
+    u64    hits;
+    u64    misses;
+    u64    evictions;
+    size_t size;      //< Number of bytes used by the cached blocks
+    size_t capacity;  //< Size limit in bytes
+};
+
+/** Sharded, scan-resistant block cache.
+  * Each shard implements 2Q replacement policy. New blocks are added to the
+  * FIFO queue (A1in). Blocks evicted from A1in are remembered in the ghost
+  * queue (A1out) and if the block gets accessed again while it's address is
+  * still in A1out it is moved to the LRU queue (Am). Large scans that touch
+  * every block only once can't push frequently accessed blocks (e.g. upper
+  * NBTree superblocks) out of the Am queue.
+  * In NUMA-aware mode the cache is partitioned by NUMA node, every thread
+  * looks up and inserts blocks in the partition of its own node so cached
+  * blocks are read by the threads that run on the same socket.
+  */
+class BlockCache {
+public:
     typedef std::shared_ptr<Block> PBlock;
-    std::vector<PBlock> block_cache_;
-    const u32 bits_;
-    // RNG
-    std::random_device dev_;
-    std::mt19937 gen_;
-    std::uniform_int_distribution<u32> dist_;
 
-    /** Check status of the cache cell.
-      * Return 0 if there is no such addr in the cache and slot is free.
-      * Return 1 if addr is not present in the cache but slot is occupied by the other block.
-      * Return 2 if addr is already present in the cache.
-      */
-    int probe(LogicAddr addr);
+private:
+    struct Shard {
+        typedef std::list<PBlock>    QueueT;
+        typedef std::list<LogicAddr> GhostQueueT;
+
+        struct Entry {
+            QueueT::iterator it;
+            bool             hot;  //< true if entry is in Am queue
+        };
+
+        mutable std::mutex lock;
+        QueueT             a1in;
+        QueueT             am;
+        GhostQueueT        a1out;
+        std::unordered_map<LogicAddr, Entry>                  table;
+        std::unordered_map<LogicAddr, GhostQueueT::iterator> ghosts;
+        size_t a1in_size;
+        size_t am_size;
+        u64    hits;
+        u64    misses;
+        u64    evictions;
+
+        Shard();
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    const u32    bits_;
+    const u32    nnodes_;          //< Number of NUMA partitions
+    const size_t shard_capacity_;  //< Shard size limit in bytes
+    const size_t a1in_capacity_;   //< A1in size limit in bytes
+    const size_t a1out_capacity_;  //< Max number of ghost entries
+
+    Shard& get_shard(LogicAddr addr) const;
+
+    void evict(Shard* shard);
 
-    BlockCache(u32 Nbits);
+public:
+    /**
+     * @brief Create block cache
+     * @param capacity is a size limit in bytes (0 disables the cache)
+     * @param Nbits defines number of shards (2^Nbits) per NUMA partition
+     * @param Nnodes is a number of NUMA partitions (capacity is split between them)
+     */
+    BlockCache(size_t capacity, u32 Nbits = 4, u32 Nnodes = 1);
 
+    //! Add block to the cache
     void insert(PBlock block);
 
-    PBlock loockup(LogicAddr addr);
+    //! Find cached block, return empty pointer if block is not cached
+    PBlock lookup(LogicAddr addr);
+
+    //! Move cached block to the Am queue (used to restore the hot set after restart)
+    void promote(LogicAddr addr);
+
+    /** Get addresses of the hot blocks (the ones that sit in Am queue because
+      * they were accessed more than once), most recently used blocks go first.
+      * @param limit is a max number of addresses
+      */
+    std::vector<LogicAddr> get_hot_addrs(size_t limit) const;
+
+    BlockCacheStats get_stats() const;
 };
 
 
+//! Block I/O counters
+struct BlockIOStats {
+    u64 reads;            //< blocks copied from the volume (block cache misses)
+    u64 zero_copy_reads;  //< blocks accessed through the memory mapping
+    u64 cache_hits;       //< blocks found in the block cache
+    u64 bytes_read;       //< number of bytes copied from the volume
+    u64 writes;           //< number of appended blocks
+    u64 bytes_written;    //< number of appended bytes
+};
+
 struct BlockStoreStats {
     size_t block_size;
     size_t capacity;
     size_t nblocks;
+    BlockCacheStats cache;
+    BlockIOStats io;
 };
 
 typedef std::map<std::string, BlockStoreStats> PerVolumeStats;
 
+//! Default block cache size limit (in bytes)
+static const size_t AKU_DEFAULT_BLOCK_CACHE_SIZE = 128*1024*1024;
+
+//! Default write-behind buffer size (in blocks)
+static const u32 AKU_DEFAULT_WRITE_BUFFER_SIZE = 64;
+
+//! Default flush interval for DurabilityPolicy::INTERVAL (in milliseconds)
+static const u32 AKU_DEFAULT_FLUSH_INTERVAL_MS = 100;
+
+//! Defines when appended blocks are written and synced to disk
+enum class DurabilityPolicy {
+    //! Every block is written to the volume immediately, volumes are synced on `flush`
+    EVERY_BLOCK,
+    /** Blocks are buffered and the full buffer is written to the volume. Current volume is
+      * synced by the append if `flush_interval_ms` has passed since the last sync (there is
+      * no timer, storage that doesn't receive new blocks is synced only on `flush`).
+      */
+    INTERVAL,
+    //! Blocks are buffered and the full buffer is written to the volume, volumes are synced only on `flush`
+    ON_COMMIT,
+};
+
+//! Defines when checksums of the blocks are verified
+enum class ChecksumPolicy {
+    //! Checksum is verified every time the block is read
+    EVERY_READ,
+    //! Checksum is verified only on the first read of the block after open
+    FIRST_READ,
+};
+
+//! File storage parameters
+struct FileStorageParams {
+    //! Block cache size limit in bytes (0 - disable the cache)
+    size_t cache_size;
+    //! Write durability policy
+    DurabilityPolicy durability;
+    //! Write-behind buffer size in blocks (not used by EVERY_BLOCK policy)
+    u32 write_buffer_size;
+    //! Flush interval used by INTERVAL policy
+    u32 flush_interval_ms;
+    //! Checksum verification policy (only FixedSizeFileStorage can skip checks)
+    ChecksumPolicy checksum;
+    /** Directory for the archived volumes (only used by FixedSizeFileStorage, empty - archive disabled).
+      * Full volumes are copied to this directory in background and blocks that were
+      * overwritten by the volume reuse are read from the copy. Directory can be located
+      * on slower device (e.g. HDD or object storage mounted to the local file system).
+      */
+    std::string archive_path;
+    //! Max number of archived volumes (0 - unlimited), oldest volumes are deleted first
+    u32 archive_capacity;
+    //! Readahead policy of the volumes
+    AccessPattern access_pattern;
+    //! Use transparent huge pages for the memory mapped volumes (if supported by the file system)
+    bool huge_pages;
+    //! Keep memory mapping of the current volume (the one that gets written and read most often) locked in RAM
+    bool lock_current_volume;
+    /** Open volumes with O_DIRECT (if supported by the file system). The block cache
+      * becomes the only cache of the volume data so it should be large enough to hold
+      * the working set. Archive copies don't pollute the page cache in this mode.
+      */
+    bool direct_io;
+    //! Partition the block cache by NUMA node
+    bool numa_aware;
+    /** Number of empty volumes that ExpandableFileStorage creates (and preallocates) in
+      * background before they're needed (0 - new volume is created when the last one
+      * becomes full).
+      */
+    u32 spare_volumes;
+    /** Open volumes for reading only (e.g. the copy of the volumes restored from backup).
+      * Blocks are served from the read-only memory mapping, `append_block` fails with
+      * AKU_ENOT_PERMITTED and nothing is written to the volumes or the archive.
+      * Direct I/O and spare volumes are not used in this mode.
+      */
+    bool read_only;
+
+    FileStorageParams();
+};
+
 /** Blockstore. Contains collection of volumes.
  * Translates logic adresses into physical ones.
  */
@@ -78,6 +238,29 @@ struct BlockStore {
       */
     virtual std::tuple<aku_Status, std::shared_ptr<Block>> read_block(LogicAddr addr) = 0;
 
+    /** Read several blocks at once. All blocks are prefetched first so the
+      * underlying device can process the reads in parallel.
+      * @param addrs is a list of addresses
+      * @return list of statuses and blocks (in the same order as `addrs`)
+      */
+    virtual std::vector<std::tuple<aku_Status, std::shared_ptr<Block>>> read_blocks(std::vector<LogicAddr> const& addrs);
+
+    /** Tell the blockstore that the blocks will be read soon.
+      * This method doesn't block, default implementation does nothing.
+      */
+    virtual void prefetch(std::vector<LogicAddr> const& addrs);
+
+    /** Load blocks into the cache as hot blocks (see `get_hot_blocks`). Blocks that
+      * don't exist anymore are skipped. Default implementation calls `prefetch`.
+      */
+    virtual void warmup(std::vector<LogicAddr> const& addrs);
+
+    /** Get addresses of the most frequently read blocks that are cached by the
+      * blockstore (default implementation returns empty list).
+      * @param limit is a max number of addresses
+      */
+    virtual std::vector<LogicAddr> get_hot_blocks(size_t limit) const;
+
     /** Add block to blockstore.
       * @param data Pointer to buffer.
       * @return Status and block's logic address.
@@ -90,12 +273,54 @@ struct BlockStore {
     //! Check if addr exists in block-store
     virtual bool exists(LogicAddr addr) const = 0;
 
+    /** Get smallest address that can still be read. All blocks with smaller
+      * addresses were deleted by retention. Unlike `exists` this method doesn't
+      * lock the blockstore and doesn't touch volume metadata so it can be used
+      * to skip deleted subtrees cheaply (default implementation returns 0).
+      */
+    virtual LogicAddr get_min_live_addr() const;
+
+    /** Get address of the next appended block. Blocks are append-only and
+      * addresses grow in the order of appends, so all blocks appended before
+      * the call have smaller addresses.
+      */
+    virtual LogicAddr get_top_addr() const = 0;
+
+    /** Read all live blocks in [begin, end) range in the order of addresses.
+      * Blocks deleted by retention and unused tails of the volumes are skipped.
+      * @param begin is a first address of the range
+      * @param end is an address that follows the last address of the range
+      * @param fn receives every block, iteration stops if it returns false
+      * @return error code if the block can't be read
+      */
+    virtual aku_Status read_range(LogicAddr begin, LogicAddr end, std::function<bool(std::shared_ptr<Block>)> const& fn);
+
     //! Compute checksum of the input data.
     virtual u32 checksum(u8 const* begin, size_t size) const = 0;
 
+    /** Check that the checksum of the block's data matches the expected value.
+      * Blockstore can skip the check if the block was already verified (default
+      * implementation always computes the checksum).
+      * @param addr is an address of the block
+      * @param data is a checksummed part of the block
+      * @param size is a size of the checksummed part
+      * @param expected is a checksum stored in the block
+      */
+    virtual bool verify_checksum(LogicAddr addr, u8 const* data, size_t size, u32 expected);
+
     virtual BlockStoreStats get_stats() const = 0;
 
     virtual PerVolumeStats get_volume_stats() const = 0;
+
+    /** Check if the last block returned by `read_block` to the current thread
+      * was found in the block cache. Used to break down cache hits by the
+      * consumer of the block (e.g. by NBTree level).
+      */
+    static bool last_read_cached();
+
+protected:
+    //! Should be called by every `read_block` implementation
+    static void set_last_read_cached(bool cached);
 };
 
 class FileStorage : public BlockStore {
@@ -116,13 +341,85 @@ protected:
     mutable std::mutex lock_;
     //! Volume names (for nice statistics)
     std::vector<std::string> volume_names_;
+    //! Cache for the blocks that can't be accessed without copying
+    mutable BlockCache cache_;
+    //! Durability parameters
+    const DurabilityPolicy durability_;
+    const u32 write_buffer_size_;
+    const std::chrono::milliseconds flush_interval_;
+    //! Time of the last sync (used by INTERVAL policy)
+    std::chrono::steady_clock::time_point last_sync_;
+    //! Smallest address that wasn't deleted by retention
+    std::atomic<LogicAddr> min_live_addr_;
+
+    //! Copy of the reused volume
+    struct ArchivedVolume {
+        std::string path;
+        u32 nblocks;
+        //! Opened on first access
+        std::unique_ptr<Volume> volume;
+    };
+    //! Archive directory (empty if archive is disabled)
+    std::string archive_path_;
+    //! Max number of archived volumes (0 - unlimited)
+    const u32 archive_capacity_;
+    const AccessPattern access_pattern_;
+    const bool huge_pages_;
+    const bool lock_current_volume_;
+    const bool direct_io_;
+    const bool read_only_;
+    //! Archived volumes ordered by generation
+    std::map<u32, ArchivedVolume> archive_;
+    //! Copy operations started when volumes became full (one per volume)
+    std::vector<std::future<aku_Status>> archive_tasks_;
+    //! Called for every appended block (empty if replication is disabled)
+    std::function<void(LogicAddr, std::shared_ptr<Block>)> replication_cb_;
+    //! I/O counters of every volume (protected by `lock_`)
+    std::vector<BlockIOStats> volume_io_;
+    //! I/O counters of the archived volumes (protected by `lock_`)
+    BlockIOStats archive_io_;
 
     //! Secret c-tor.
-    FileStorage(std::shared_ptr<VolumeRegistry> meta);
+    FileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params);
+
+    /** Read block from volume. Blocks that can't be accessed using zero-copy
+      * mechanism are copied and cached.
+      */
+    std::tuple<aku_Status, std::shared_ptr<Block>> read_volume_block(u32 volix, LogicAddr addr);
 
     virtual void adjust_current_volume() = 0;
     void handle_volume_transition();
 
+    //! Recalculate `min_live_addr_` using volume metadata (should be called under the lock)
+    void update_min_live_addr();
+
+    //! Enable write-behind buffering on volume if durability policy allows it
+    void setup_volume(Volume* vol) const;
+
+    //! Find archived volumes that was created before (should be called from c-tor)
+    void open_archive();
+
+    //! Get path of the archived volume in the archive directory
+    std::string get_archive_path(u32 gen) const;
+
+    //! Start copying the full volume to the archive in background (should be called under the lock)
+    void start_archiving(u32 volix, u32 gen, u32 nblocks);
+
+    /** Wait until the volume is copied and add it to the archive. Volume is
+      * copied synchronously if it wasn't copied in background.
+      * Should be called under the lock before the volume gets reused.
+      */
+    void add_to_archive(u32 volix, u32 gen, u32 nblocks);
+
+    //! Read block from the archived volume (should be called under the lock)
+    std::tuple<aku_Status, std::shared_ptr<Block>> read_archived_block(LogicAddr addr);
+
+    //! Check if the block is stored in the archive (should be called under the lock)
+    bool is_archived(LogicAddr addr) const;
+
+    //! Append block to the current volume (should be called under the lock)
+    std::tuple<aku_Status, LogicAddr> append_block_nolock(std::shared_ptr<Block> data);
+
 public:
     static void create(std::vector<std::tuple<u32, std::string>> vols);
 
@@ -132,6 +429,21 @@ public:
      */
     virtual std::tuple<aku_Status, LogicAddr> append_block(std::shared_ptr<Block> data);
 
+    /** Set replication callback. Callback is called for every appended block in
+      * the order of appends (addresses are increasing) under the blockstore lock,
+      * so it shouldn't block (e.g. it can put blocks to the send queue).
+      */
+    void set_replication_callback(std::function<void(LogicAddr, std::shared_ptr<Block>)> cb);
+
+    /** Write block received from the leader. Follower should have the same set of
+      * volumes as the leader and receive every block in order, so the block is
+      * written to the same address.
+      * @param addr is an address of the block in the leader's blockstore
+      * @param data is a block
+      * @return AKU_EBAD_ARG if the block can't be written to the same address
+      */
+    aku_Status apply_replicated_block(LogicAddr addr, std::shared_ptr<Block> data);
+
     virtual void flush();
 
     virtual u32 checksum(u8 const* data, size_t size) const;
@@ -139,12 +451,27 @@ public:
     virtual BlockStoreStats get_stats() const;
 
     virtual PerVolumeStats get_volume_stats() const;
+
+    virtual LogicAddr get_min_live_addr() const;
+
+    virtual LogicAddr get_top_addr() const;
+
+    virtual void warmup(std::vector<LogicAddr> const& addrs);
+
+    virtual std::vector<LogicAddr> get_hot_blocks(size_t limit) const;
 };
 
 class FixedSizeFileStorage : public FileStorage,
                              public std::enable_shared_from_this<FixedSizeFileStorage> {
+    const ChecksumPolicy checksum_policy_;
+    /** Generation of the last verified version of every block plus one (zero if the
+      * block wasn't verified since open), one array per volume. Volumes are reused
+      * so the generation should match, stale entries are ignored.
+      */
+    std::vector<std::unique_ptr<std::atomic<u32>[]>> verified_;
+
     //! Secret c-tor.
-    FixedSizeFileStorage(std::shared_ptr<VolumeRegistry> meta);
+    FixedSizeFileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params);
 
 protected:
     virtual void adjust_current_volume();
@@ -152,41 +479,69 @@ protected:
 public:
     /** Create BlockStore instance (can be created only on heap).
       */
-    static std::shared_ptr<FixedSizeFileStorage> open(std::shared_ptr<VolumeRegistry> meta);
+    static std::shared_ptr<FixedSizeFileStorage> open(std::shared_ptr<VolumeRegistry> meta,
+                                                      FileStorageParams const& params = FileStorageParams());
 
     virtual bool exists(LogicAddr addr) const;
 
     /** Read block from blockstore
       */
     virtual std::tuple<aku_Status, std::shared_ptr<Block>> read_block(LogicAddr addr);
+
+    virtual void prefetch(std::vector<LogicAddr> const& addrs);
+
+    virtual bool verify_checksum(LogicAddr addr, u8 const* data, size_t size, u32 expected);
 };
 
 class ExpandableFileStorage : public FileStorage,
                               public std::enable_shared_from_this<ExpandableFileStorage> {
      std::string db_name_;
+     std::shared_ptr<VolumeRegistry> registry_;
+     //! Number of spare volumes
+     const u32 spare_volumes_;
+     //! Spare volumes that are registered but not used yet (ordered by id)
+     std::deque<std::unique_ptr<Volume>> spare_;
+     //! Creates the next spare volume (only one volume is created at a time)
+     std::future<std::unique_ptr<Volume>> spare_task_;
 
      //! Secret c-tor.
-     ExpandableFileStorage(std::shared_ptr<VolumeRegistry> meta);
+     ExpandableFileStorage(std::shared_ptr<VolumeRegistry> meta, FileStorageParams const& params);
+
+     std::string get_volume_path(u32 id) const;
 
      std::unique_ptr<Volume> create_new_volume(u32 id);
+
+     /** Take result of the background task (should be called under the lock).
+       * @param wait should be set to wait for the task if it's not completed
+       */
+     void collect_spare_volume(bool wait);
+
+     //! Start creating the next spare volume if needed (should be called under the lock)
+     void schedule_spare_volume();
 protected:
      virtual void adjust_current_volume();
 
 public:
+     ~ExpandableFileStorage();
+
      /**
       * Create BlockStore instance (can be created only on heap).
       * @param db_name is a logical database name
       * @param metapath is a place where the meta-page is located
       * @param volpaths is a list of volume paths
       * @param on_volume_advance is function object that gets called when new volume is created
+      * @param params is a set of tunable parameters
       */
-     static std::shared_ptr<ExpandableFileStorage> open(std::shared_ptr<VolumeRegistry> meta);
+     static std::shared_ptr<ExpandableFileStorage> open(std::shared_ptr<VolumeRegistry> meta,
+                                                        FileStorageParams const& params = FileStorageParams());
 
      virtual bool exists(LogicAddr addr) const;
 
      /** Read block from blockstore
       */
      virtual std::tuple<aku_Status, std::shared_ptr<Block>> read_block(LogicAddr addr);
+
+     virtual void prefetch(std::vector<LogicAddr> const& addrs);
 };
 
 
@@ -197,6 +552,7 @@ struct MemStore : BlockStore, std::enable_shared_from_this<MemStore> {
     u32 write_pos_;
     u32 removed_pos_;
     u32 pad_;
+    BlockIOStats io_;
     mutable std::mutex lock_;
 
     MemStore();
@@ -210,24 +566,69 @@ struct MemStore : BlockStore, std::enable_shared_from_this<MemStore> {
     virtual u32 checksum(u8 const* data, size_t size) const;
     virtual BlockStoreStats get_stats() const;
     virtual PerVolumeStats get_volume_stats() const;
+    virtual LogicAddr get_min_live_addr() const;
+    virtual LogicAddr get_top_addr() const;
     void remove(size_t addr);
 };
 
+/** Blockstore that never modifies the underlying blockstore. Appended blocks are
+  * kept in memory and get addresses that can't be used by the underlying blockstore.
+  * Used in read-only mode, trees that weren't closed cleanly are repaired in memory.
+  */
+struct OverlayStore : BlockStore {
+    std::shared_ptr<BlockStore> base_;
+    std::vector<std::shared_ptr<Block>> blocks_;
+    mutable std::mutex lock_;
+
+    OverlayStore(std::shared_ptr<BlockStore> base);
+
+    virtual std::tuple<aku_Status, std::shared_ptr<Block> > read_block(LogicAddr addr);
+    virtual void prefetch(std::vector<LogicAddr> const& addrs);
+    virtual std::tuple<aku_Status, LogicAddr> append_block(std::shared_ptr<Block> data);
+    virtual void flush();
+    virtual bool exists(LogicAddr addr) const;
+    virtual u32 checksum(u8 const* data, size_t size) const;
+    virtual bool verify_checksum(LogicAddr addr, u8 const* data, size_t size, u32 expected);
+    virtual BlockStoreStats get_stats() const;
+    virtual PerVolumeStats get_volume_stats() const;
+    virtual LogicAddr get_min_live_addr() const;
+    //! Top address of the underlying blockstore (blocks kept in memory are not included)
+    virtual LogicAddr get_top_addr() const;
+
+    //! Check if the block is kept in memory
+    static bool is_overlay_addr(LogicAddr addr);
+};
+
 
 //! Represents memory block
 class Block {
     std::vector<u8>           data_;
+    u8*                       pooled_;  //< AKU_BLOCK_SIZE buffer taken from the thread local pool
     LogicAddr                 addr_;
     const u8*                 zptr_;
 
 public:
+    //! Empty tag to choose c-tor
+    struct UninitializedTag {};
+
     Block(LogicAddr addr, std::vector<u8>&& data);
 
     //! This c-tor is used in zero-copy mechanism, ptr should outlive the Block object
     Block(LogicAddr addr, const u8* ptr);
 
+    //! Create zero-initialized block
     Block();
 
+    /** Create block without initializing its content (should be used when the
+      * whole block gets overwritten, e.g. by the read operation).
+      */
+    Block(UninitializedTag);
+
+    ~Block();
+
+    Block(Block const&) = delete;
+    Block& operator = (Block const&) = delete;
+
     bool is_readonly() const;
 
     const u8* get_data() const;
@@ -247,6 +648,7 @@ public:
 struct BlockStoreBuilder {
     static std::shared_ptr<BlockStore> create_memstore();
     static std::shared_ptr<BlockStore> create_memstore(std::function<void(LogicAddr)> append_cb);
+    static std::shared_ptr<BlockStore> create_overlay(std::shared_ptr<BlockStore> base);
 };
 
 }
@@ -0,0 +1,198 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "checkpoint.h"
+#include "log_iface.h"
+#include "crc32c.h"
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static const u32 CHECKPOINT_MAGIC = 0x50434B41;  // "AKCP"
+static const u32 CHECKPOINT_VERSION = 1;
+
+struct CheckpointHeader {
+    u32 magic;
+    u32 version;
+    u64 generation;
+    u64 ncolumns;
+    u64 payload_size;
+    u32 crc;       //! Payload checksum
+} __attribute__((packed));
+
+static u32 checksum(const char* data, size_t size) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data, size);
+}
+
+template<class T>
+static void put(std::vector<char>* buf, T value) {
+    auto p = reinterpret_cast<const char*>(&value);
+    buf->insert(buf->end(), p, p + sizeof(T));
+}
+
+template<class T>
+static bool get(const char** pos, const char* end, T* value) {
+    if (static_cast<size_t>(end - *pos) < sizeof(T)) {
+        return false;
+    }
+    memcpy(value, *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+}
+
+aku_Status Checkpoint::write(std::string const& path, u64 generation, std::vector<ColumnCheckpoint> const& columns) {
+    std::vector<char> buf(sizeof(CheckpointHeader));
+    for (auto const& col: columns) {
+        if (col.roots.size() > std::numeric_limits<u16>::max()) {
+            return AKU_EBAD_ARG;
+        }
+        put(&buf, col.id);
+        put(&buf, static_cast<u16>(col.roots.size()));
+        for (auto addr: col.roots) {
+            put(&buf, addr);
+        }
+        put(&buf, static_cast<u8>(col.has_last));
+        put(&buf, col.last_ts);
+        put(&buf, col.last_value);
+    }
+    CheckpointHeader header = {};
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.generation = generation;
+    header.ncolumns = columns.size();
+    header.payload_size = buf.size() - sizeof(CheckpointHeader);
+    header.crc = checksum(buf.data() + sizeof(CheckpointHeader), header.payload_size);
+    memcpy(buf.data(), &header, sizeof(header));
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP);
+    if (fd < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't create " + tmp + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    for (size_t pos = 0; pos < buf.size();) {
+        auto nwritten = ::write(fd, buf.data() + pos, buf.size() - pos);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::msg(AKU_LOG_ERROR, "Can't write " + tmp + ", error: " + strerror(errno));
+            close(fd);
+            unlink(tmp.c_str());
+            return AKU_EGENERAL;
+        }
+        pos += static_cast<size_t>(nwritten);
+    }
+    if (fsync(fd) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't sync " + tmp + ", error: " + strerror(errno));
+        close(fd);
+        unlink(tmp.c_str());
+        return AKU_EGENERAL;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't replace " + path + ", error: " + strerror(errno));
+        unlink(tmp.c_str());
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status Checkpoint::load(std::string const& path, u64 generation, std::vector<ColumnCheckpoint>* columns) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return AKU_ENOT_FOUND;
+        }
+        Logger::msg(AKU_LOG_ERROR, "Can't open " + path + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    aku_Status status = AKU_EBAD_DATA;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(CheckpointHeader)) {
+        size_t size = static_cast<size_t>(st.st_size);
+        void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            Logger::msg(AKU_LOG_ERROR, "Can't map " + path + ", error: " + strerror(errno));
+            close(fd);
+            return AKU_EGENERAL;
+        }
+        const char* begin = static_cast<const char*>(addr);
+        const char* end = begin + size;
+        CheckpointHeader header;
+        memcpy(&header, begin, sizeof(header));
+        const char* pos = begin + sizeof(header);
+        if (header.magic == CHECKPOINT_MAGIC &&
+            header.version == CHECKPOINT_VERSION &&
+            header.generation == generation &&
+            header.payload_size == static_cast<u64>(end - pos) &&
+            header.crc == checksum(pos, header.payload_size))
+        {
+            status = AKU_SUCCESS;
+            columns->reserve(header.ncolumns);
+            for (u64 i = 0; i < header.ncolumns; i++) {
+                ColumnCheckpoint col;
+                u16 nroots = 0;
+                u8 has_last = 0;
+                if (!get(&pos, end, &col.id) || !get(&pos, end, &nroots)) {
+                    status = AKU_EBAD_DATA;
+                    break;
+                }
+                col.roots.resize(nroots);
+                for (auto& root: col.roots) {
+                    if (!get(&pos, end, &root)) {
+                        status = AKU_EBAD_DATA;
+                        break;
+                    }
+                }
+                if (status != AKU_SUCCESS ||
+                    !get(&pos, end, &has_last) ||
+                    !get(&pos, end, &col.last_ts) ||
+                    !get(&pos, end, &col.last_value))
+                {
+                    status = AKU_EBAD_DATA;
+                    break;
+                }
+                col.has_last = has_last != 0;
+                columns->push_back(std::move(col));
+            }
+            if (status != AKU_SUCCESS) {
+                columns->clear();
+            }
+        }
+        munmap(addr, size);
+    }
+    close(fd);
+    // Checkpoint can be used only once
+    if (unlink(path.c_str()) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't remove checkpoint " + path + ", error: " + strerror(errno));
+    }
+    return status;
+}
+
+}
+}  // namespaces
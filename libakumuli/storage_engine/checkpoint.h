@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <string>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/blockstore.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+//! State of the column saved in the checkpoint
+struct ColumnCheckpoint {
+    aku_ParamId            id;
+    //! Rescue points of the column
+    std::vector<LogicAddr> roots;
+    //! Set if the last value is known
+    bool                   has_last;
+    aku_Timestamp          last_ts;
+    double                 last_value;
+};
+
+/** Checkpoint of the column store written on clean shutdown. Contains rescue
+  * points and last values of all columns so the next startup doesn't have to
+  * load rescue points from the metadata storage and search every tree for its
+  * last value. Metadata storage is still the source of truth.
+  *
+  * Checkpoint is stamped with a generation that is stored in the metadata
+  * storage as well. Generation is changed on every startup in the same transaction
+  * as the first update of the rescue points, so the old checkpoint can't be
+  * mistaken for the current one. The file is removed after it's loaded.
+  */
+struct Checkpoint {
+    /** Write the checkpoint. New file is written next to the old one and renamed.
+      * @param path is a path to the checkpoint file
+      * @param generation is a generation of the checkpoint
+      * @param columns is a list of columns
+      */
+    static aku_Status write(std::string const& path, u64 generation, std::vector<ColumnCheckpoint> const& columns);
+
+    /** Map the checkpoint file, read its content and remove the file.
+      * @param path is a path to the checkpoint file
+      * @param generation is an expected generation
+      * @param columns is a destination
+      * @return AKU_ENOT_FOUND if the file doesn't exist, AKU_EBAD_DATA if the checkpoint
+      *         is damaged or has a different generation
+      */
+    static aku_Status load(std::string const& path, u64 generation, std::vector<ColumnCheckpoint>* columns);
+};
+
+}
+}  // namespaces
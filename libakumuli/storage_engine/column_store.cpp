@@ -9,22 +9,231 @@
 
 #include <boost/property_tree/ptree.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <thread>
+
 namespace Akumuli {
 namespace StorageEngine {
 
 using namespace QP;
 
 
+// ///////////////// //
+//  ColumnSpanIndex  //
+// ///////////////// //
+
+ColumnSpanIndex::ColumnSpanIndex()
+    : chunks_(new std::atomic<Span*>[MAX_CHUNKS]())
+{
+}
+
+ColumnSpanIndex::~ColumnSpanIndex() {
+    for (int i = 0; i < MAX_CHUNKS; i++) {
+        delete [] chunks_[i].load();
+    }
+}
+
+ColumnSpanIndex::Span* ColumnSpanIndex::get(aku_ParamId id, bool create) {
+    auto ix = id >> CHUNK_BITS;
+    if (ix >= MAX_CHUNKS) {
+        return nullptr;
+    }
+    Span* chunk = chunks_[ix].load(std::memory_order_acquire);
+    if (chunk == nullptr && create) {
+        Span* fresh = new Span[CHUNK_SIZE]();
+        if (chunks_[ix].compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) {
+            chunk = fresh;
+        } else {
+            delete [] fresh;
+        }
+    }
+    return chunk ? &chunk[id & (CHUNK_SIZE - 1)] : nullptr;
+}
+
+void ColumnSpanIndex::update(aku_ParamId id, NBTreeExtentsList const& column) {
+    Span* span = get(id, true);
+    if (span == nullptr || span->first.load() != 0) {
+        return;
+    }
+    // Values older than the first one can't be added, so only the
+    // last timestamp should be refreshed later
+    auto first = column.get_first_timestamp();
+    if (first == AKU_MAX_TIMESTAMP) {
+        return;
+    }
+    span->last.store(column.get_last_timestamp());
+    span->first.store(first);
+}
+
+bool ColumnSpanIndex::may_contain(aku_ParamId id, aku_Timestamp min, aku_Timestamp max,
+                                  std::function<std::shared_ptr<NBTreeExtentsList>()> const& column)
+{
+    Span* span = get(id, false);
+    if (span == nullptr) {
+        return true;
+    }
+    auto first = span->first.load();
+    if (first == 0) {
+        return true;
+    }
+    if (max < first) {
+        return false;
+    }
+    if (min <= span->last.load()) {
+        return true;
+    }
+    // Column could be written after the span was recorded
+    auto tree = column();
+    if (!tree) {
+        return true;
+    }
+    auto last = tree->get_last_timestamp();
+    span->last.store(last);
+    return min <= last;
+}
+
+
 // ////////////// //
 //  Column-store  //
 // ////////////// //
 
-ColumnStore::ColumnStore(std::shared_ptr<BlockStore> bstore)
+ColumnStore::ColumnStore(std::shared_ptr<BlockStore> bstore, std::vector<aku_Timestamp> const& rollup_tiers,
+                         size_t query_cache_size, u32 reorder_window, u32 write_ring_size,
+                         size_t compression_workers, size_t prefetch_blocks, u16 fanout)
     : blockstore_(bstore)
+    , reorder_window_(reorder_window)
+    , write_ring_size_(reorder_window == 0 ? write_ring_size : 0)
+    , fanout_(fanout)
 {
+    if (write_ring_size_ != 0) {
+        // Pool doesn't own the column-store, `this` outlives the workers (see `close`)
+        auto on_flush = [this](aku_ParamId id, std::shared_ptr<NBTreeExtentsList> const& tree) {
+            {
+                std::lock_guard<std::mutex> guard(flushed_lock_);
+                flushed_rescue_points_[id] = tree->get_roots();
+            }
+            update_rollups(id, tree, tree->get_last_timestamp());
+        };
+        compression_pool_.reset(new CompressionPool(compression_workers, on_flush));
+    }
+    if (!rollup_tiers.empty()) {
+        rollups_.reset(new RollupStore(rollup_tiers));
+    }
+    if (query_cache_size != 0) {
+        query_cache_.reset(new GroupAggregateCache(query_cache_size));
+    }
+    if (prefetch_blocks != 0) {
+        prefetcher_.reset(new RangePrefetcher(prefetch_blocks));
+    }
+}
+
+u16 ColumnStore::get_fanout() const {
+    return fanout_;
+}
+
+ColumnStore::TableShard& ColumnStore::get_shard(aku_ParamId id) {
+    return table_[id & (NSHARDS - 1)];
+}
+
+ColumnStore::TableShard const& ColumnStore::get_shard(aku_ParamId id) const {
+    return table_[id & (NSHARDS - 1)];
+}
+
+bool ColumnStore::add_column(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree) {
+    auto& shard = get_shard(id);
+    TableWriteLock lock(shard.lock);
+    return shard.columns.insert(std::make_pair(id, std::move(tree))).second;
+}
+
+std::shared_ptr<NBTreeExtentsList> ColumnStore::find_column(aku_ParamId id) const {
+    auto const& shard = get_shard(id);
+    TableReadLock lock(shard.lock);
+    auto it = shard.columns.find(id);
+    if (it != shard.columns.end()) {
+        return it->second;
+    }
+    return std::shared_ptr<NBTreeExtentsList>();
+}
+
+void ColumnStore::init_column(aku_ParamId id, NBTreeExtentsList& column) const {
+    if (!column.is_initialized()) {
+        column.force_init();
+    }
+    spans_.update(id, column);
+}
+
+bool ColumnStore::may_contain(aku_ParamId id, aku_Timestamp begin, aku_Timestamp end) const {
+    return spans_.may_contain(id, std::min(begin, end), std::max(begin, end), [this, id]() {
+        return find_column(id);
+    });
+}
+
+void ColumnStore::observe(aku_ParamId id, aku_Timestamp begin, aku_Timestamp end,
+                          std::shared_ptr<NBTreeExtentsList> const& column) const
+{
+    if (prefetcher_) {
+        prefetcher_->observe(id, begin, end, column);
+    }
+}
+
+std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> ColumnStore::_get_columns() {
+    ColumnTable result;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        result.insert(shard.columns.begin(), shard.columns.end());
+    }
+    return result;
+}
+
+/** Initialize trees in parallel.
+  * Trees are distributed between workers dynamically (each worker grabs
+  * the next uninitialized tree). Progress is reported to the log.
+  */
+static void parallel_init(std::vector<std::shared_ptr<NBTreeExtentsList>> const& trees) {
+    enum {
+        //! Min number of trees per worker
+        MIN_TREES_PER_WORKER = 16,
+        MAX_WORKERS = 16,
+        //! Number of progress reports
+        NREPORTS = 10,
+    };
+    size_t nworkers = std::min(static_cast<size_t>(std::thread::hardware_concurrency()),
+                               trees.size() / MIN_TREES_PER_WORKER);
+    nworkers = std::max(std::min(nworkers, static_cast<size_t>(MAX_WORKERS)), static_cast<size_t>(1));
+    size_t report_step = std::max(trees.size() / NREPORTS, static_cast<size_t>(1));
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> ndone(0);
+    auto worker = [&trees, &next, &ndone, report_step]() {
+        size_t ix;
+        while ((ix = next++) < trees.size()) {
+            trees[ix]->force_init();
+            auto n = ++ndone;
+            if (n % report_step == 0 || n == trees.size()) {
+                Logger::msg(AKU_LOG_INFO, "Recovery progress: " + std::to_string(n) + " of " +
+                                          std::to_string(trees.size()) + " columns");
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nworkers; i++) {
+        threads.emplace_back([&worker]() {
+            set_thread_name("recovery-worker");
+            apply_thread_policy(AKU_THREAD_BACKGROUND);
+            worker();
+        });
+    }
+    worker();  // current thread participates too
+    for (auto& th: threads) {
+        th.join();
+    }
 }
 
 aku_Status ColumnStore::open_or_restore(std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> const& mapping, bool force_init) {
+    // Trees are opened lazily on first access unless repair is needed
+    // or `force_init` is set.
+    std::vector<std::shared_ptr<NBTreeExtentsList>> init_list;
     for (auto it: mapping) {
         aku_ParamId id = it.first;
         std::vector<LogicAddr> const& rescue_points = it.second;
@@ -35,30 +244,86 @@ aku_Status ColumnStore::open_or_restore(std::unordered_map<aku_ParamId, std::vec
         if (status == NBTreeExtentsList::RepairStatus::REPAIR) {
             Logger::msg(AKU_LOG_ERROR, "Repair needed, id=" + std::to_string(id));
         }
-        auto tree = std::make_shared<NBTreeExtentsList>(id, rescue_points, blockstore_);
-
-        std::lock_guard<std::mutex> tl(table_lock_);
-        if (columns_.count(id)) {
+        auto tree = std::make_shared<NBTreeExtentsList>(id, rescue_points, blockstore_, fanout_);
+        tree->set_reorder_window(reorder_window_);
+        if (compression_pool_) {
+            tree->set_write_ring(write_ring_size_, compression_pool_);
+        }
+        if (!add_column(id, tree)) {
             Logger::msg(AKU_LOG_ERROR, "Can't open/repair " + std::to_string(id) + " (already exists)");
             return AKU_EBAD_ARG;
-        } else {
-            columns_[id] = std::move(tree);
         }
-        if (force_init) {
-            columns_[id]->force_init();
+        if (force_init || status == NBTreeExtentsList::RepairStatus::REPAIR) {
+            init_list.push_back(std::move(tree));
+        }
+    }
+    if (!init_list.empty()) {
+        Logger::msg(AKU_LOG_INFO, "Open " + std::to_string(init_list.size()) + " of " +
+                                  std::to_string(mapping.size()) + " columns at startup");
+        parallel_init(init_list);
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status ColumnStore::open_checkpoint(std::vector<ColumnCheckpoint> const& columns) {
+    std::unordered_map<aku_ParamId, std::vector<LogicAddr>> mapping;
+    for (auto const& col: columns) {
+        mapping[col.id] = col.roots;
+    }
+    auto status = open_or_restore(mapping);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+    for (auto const& col: columns) {
+        if (col.has_last) {
+            auto tree = find_column(col.id);
+            if (tree) {
+                tree->set_last_value(col.last_ts, col.last_value);
+            }
         }
     }
     return AKU_SUCCESS;
 }
 
+std::vector<ColumnCheckpoint> ColumnStore::get_checkpoint() const {
+    std::vector<ColumnCheckpoint> result;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& it: shard.columns) {
+            ColumnCheckpoint col;
+            col.id = it.first;
+            col.roots = it.second->get_roots();
+            col.has_last = it.second->get_last_value(&col.last_ts, &col.last_value);
+            if (!col.has_last) {
+                col.last_ts = 0;
+                col.last_value = 0;
+            }
+            result.push_back(std::move(col));
+        }
+    }
+    return result;
+}
+
 std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> ColumnStore::close() {
     std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> result;
-    std::lock_guard<std::mutex> tl(table_lock_);
     Logger::msg(AKU_LOG_INFO, "Column-store commit called");
-    for (auto it: columns_) {
-        if (it.second->is_initialized()) {
-            auto addrlist = it.second->close();
-            result[it.first] = addrlist;
+    if (compression_pool_) {
+        // Write rings that wasn't flushed yet are drained by `NBTreeExtentsList::close`
+        compression_pool_->stop();
+    }
+    if (rollups_) {
+        rollups_->stop();
+    }
+    if (prefetcher_) {
+        prefetcher_->stop();
+    }
+    for (auto& shard: table_) {
+        TableWriteLock lock(shard.lock);
+        for (auto it: shard.columns) {
+            if (it.second->is_initialized()) {
+                auto addrlist = it.second->close();
+                result[it.first] = addrlist;
+            }
         }
     }
     Logger::msg(AKU_LOG_INFO, "Column-store commit completed");
@@ -67,56 +332,372 @@ std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> ColumnSto
 
 aku_Status ColumnStore::create_new_column(aku_ParamId id) {
     std::vector<LogicAddr> empty;
-    auto tree = std::make_shared<NBTreeExtentsList>(id, empty, blockstore_);
+    auto tree = std::make_shared<NBTreeExtentsList>(id, empty, blockstore_, fanout_);
+    tree->set_reorder_window(reorder_window_);
+    if (compression_pool_) {
+        tree->set_write_ring(write_ring_size_, compression_pool_);
+    }
+    if (!add_column(id, tree)) {
+        return AKU_EBAD_ARG;
+    }
+    tree->force_init();
+    return AKU_SUCCESS;
+}
+
+aku_Status ColumnStore::remove_column(aku_ParamId id) {
+    std::shared_ptr<NBTreeExtentsList> tree;
     {
-        std::lock_guard<std::mutex> tl(table_lock_);
-        if (columns_.count(id)) {
-            return AKU_EBAD_ARG;
-        } else {
-            columns_[id] = std::move(tree);
-            columns_[id]->force_init();
-            return AKU_SUCCESS;
+        auto& shard = get_shard(id);
+        TableWriteLock lock(shard.lock);
+        auto it = shard.columns.find(id);
+        if (it == shard.columns.end()) {
+            return AKU_ENOT_FOUND;
+        }
+        tree = std::move(it->second);
+        shard.columns.erase(it);
+    }
+    if (rollups_) {
+        rollups_->remove(id);
+    }
+    if (compression_pool_) {
+        std::lock_guard<std::mutex> guard(flushed_lock_);
+        flushed_rescue_points_.erase(id);
+    }
+    // The tree is destroyed here or when the last reader releases it
+    return AKU_SUCCESS;
+}
+
+void ColumnStore::update_rollups(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> const& tree, aku_Timestamp watermark) {
+    if (rollups_) {
+        rollups_->notify(id, tree, watermark);
+    }
+}
+
+void ColumnStore::_wait_rollups() {
+    if (rollups_) {
+        rollups_->wait();
+    }
+}
+
+aku_Status ColumnStore::set_precision(aku_ParamId id, int digits) {
+    auto tree = find_column(id);
+    if (!tree) {
+        return AKU_ENOT_FOUND;
+    }
+    tree->set_precision(digits);
+    return AKU_SUCCESS;
+}
+
+aku_Status ColumnStore::set_change_only(aku_ParamId id, aku_Timestamp heartbeat) {
+    auto tree = find_column(id);
+    if (!tree) {
+        return AKU_ENOT_FOUND;
+    }
+    tree->set_change_only(heartbeat);
+    return AKU_SUCCESS;
+}
+
+void ColumnStore::pull_rescue_points(std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points) {
+    if (!compression_pool_) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(flushed_lock_);
+    for (auto& kv: flushed_rescue_points_) {
+        (*rescue_points)[kv.first] = std::move(kv.second);
+    }
+    flushed_rescue_points_.clear();
+}
+
+void ColumnStore::_wait_compression() {
+    if (compression_pool_) {
+        compression_pool_->wait();
+    }
+}
+
+size_t ColumnStore::_get_query_cache_size() const {
+    return query_cache_ ? query_cache_->_get_size() : 0;
+}
+
+aku_Status ColumnStore::estimate(std::vector<aku_ParamId> const& ids,
+                                 aku_Timestamp begin,
+                                 aku_Timestamp end,
+                                 QueryEstimate* est) const
+{
+    *est = QueryEstimate{0, 0, 0};
+    for (auto id: ids) {
+        if (!may_contain(id, begin, end)) {
+            continue;
+        }
+        auto column = find_column(id);
+        if (!column) {
+            return AKU_ENOT_FOUND;
+        }
+        init_column(id, *column);
+        u64 nvalues, nleaves;
+        column->estimate(begin, end, &nvalues, &nleaves);
+        if (nvalues != 0) {
+            est->nseries++;
+            est->nvalues += nvalues;
+            est->nleaves += nleaves;
         }
     }
+    return AKU_SUCCESS;
+}
+
+aku_Status ColumnStore::group_aggregate(std::vector<aku_ParamId> const& ids,
+                                        aku_Timestamp begin,
+                                        aku_Timestamp end,
+                                        aku_Timestamp step,
+                                        std::vector<std::unique_ptr<AggregateOperator>>* dest) const
+{
+    for (auto id: ids) {
+        if (!may_contain(id, begin, end)) {
+            EmptyOperator<AggregationResult>::push(dest, begin, end);
+            continue;
+        }
+        auto column = find_column(id);
+        if (!column) {
+            return AKU_ENOT_FOUND;
+        }
+        init_column(id, *column);
+        observe(id, begin, end, column);
+        std::unique_ptr<AggregateOperator> iter;
+        if (rollups_) {
+            iter = rollups_->group_aggregate(id, *column, begin, end, step);
+        }
+        if (!iter && query_cache_) {
+            iter = query_cache_->group_aggregate(id, *column, begin, end, step);
+        }
+        if (!iter) {
+            iter = column->group_aggregate(begin, end, step);
+        }
+        dest->push_back(std::move(iter));
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status ColumnStore::candlesticks(std::vector<aku_ParamId> const& ids,
+                                     aku_Timestamp begin,
+                                     aku_Timestamp end,
+                                     NBTreeCandlestickHint hint,
+                                     std::vector<std::unique_ptr<AggregateOperator>>* dest) const
+{
+    for (auto id: ids) {
+        if (!may_contain(id, begin, end)) {
+            EmptyOperator<AggregationResult>::push(dest, begin, end);
+            continue;
+        }
+        auto column = find_column(id);
+        if (!column) {
+            return AKU_ENOT_FOUND;
+        }
+        init_column(id, *column);
+        observe(id, begin, end, column);
+        dest->push_back(column->candlesticks(begin, end, hint));
+    }
+    return AKU_SUCCESS;
 }
 
 size_t ColumnStore::_get_uncommitted_memory() const {
-    std::lock_guard<std::mutex> guard(table_lock_);
     size_t total_size = 0;
-    for (auto const& p: columns_) {
-        if (p.second->is_initialized()) {
-            total_size += p.second->_get_uncommitted_size();
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& p: shard.columns) {
+            if (p.second->is_initialized()) {
+                total_size += p.second->_get_uncommitted_size();
+            }
         }
     }
     return total_size;
 }
 
+size_t ColumnStore::release_write_buffers(size_t budget,
+                                          std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points)
+{
+    struct Candidate {
+        aku_Timestamp last;
+        size_t size;
+        aku_ParamId id;
+        std::shared_ptr<NBTreeExtentsList> tree;
+    };
+    std::vector<Candidate> candidates;
+    size_t total_size = 0;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& p: shard.columns) {
+            auto size = p.second->get_write_buffer_size();
+            total_size += size;
+            if (size >= AKU_BLOCK_SIZE) {
+                // Only full leaf nodes can be replaced by the compact ones
+                Candidate item = { p.second->get_last_timestamp(), size, p.first, p.second };
+                candidates.push_back(std::move(item));
+            }
+        }
+    }
+    if (total_size <= budget) {
+        return total_size;
+    }
+    std::sort(candidates.begin(), candidates.end(), [](Candidate const& lhs, Candidate const& rhs) {
+        return lhs.last < rhs.last;
+    });
+    for (auto const& item: candidates) {
+        if (total_size <= budget) {
+            break;
+        }
+        if (item.tree->commit_leaf()) {
+            total_size -= item.size;
+            total_size += item.tree->get_write_buffer_size();
+            (*rescue_points)[item.id] = item.tree->get_roots();
+            update_rollups(item.id, item.tree, item.last);
+        }
+    }
+    return total_size;
+}
+
+size_t ColumnStore::commit_write_buffers(std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points,
+                                         std::vector<aku_Sample>* pending)
+{
+    std::vector<std::pair<aku_ParamId, std::shared_ptr<NBTreeExtentsList>>> columns;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& p: shard.columns) {
+            columns.push_back(p);
+        }
+    }
+    size_t ncommitted = 0;
+    for (auto const& p: columns) {
+        auto const& tree = p.second;
+        if (!tree->is_initialized()) {
+            continue;
+        }
+        // Reorder buffer is copied first, values that leave it after that
+        // are committed with the leaf node
+        for (auto const& kv: tree->get_reorder_buffer()) {
+            aku_Sample sample = {};
+            sample.paramid = p.first;
+            sample.timestamp = kv.first;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.size = sizeof(aku_Sample);
+            sample.payload.float64 = kv.second;
+            pending->push_back(sample);
+        }
+        if (tree->commit_leaf()) {
+            (*rescue_points)[p.first] = tree->get_roots();
+            update_rollups(p.first, tree, tree->get_last_timestamp());
+            ncommitted++;
+        }
+    }
+    return ncommitted;
+}
+
+size_t ColumnStore::compact(double min_fill, std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points) {
+    std::vector<std::pair<aku_ParamId, std::shared_ptr<NBTreeExtentsList>>> columns;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& p: shard.columns) {
+            columns.push_back(p);
+        }
+    }
+    // Columns are rewritten one by one, writers of other columns are not blocked
+    size_t ncompacted = 0;
+    for (auto const& p: columns) {
+        if (p.second->is_initialized() && p.second->compact(min_fill)) {
+            (*rescue_points)[p.first] = p.second->get_roots();
+            ncompacted++;
+        }
+    }
+    return ncompacted;
+}
+
+size_t ColumnStore::recompress(aku_Timestamp age, std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points) {
+    std::vector<std::pair<aku_ParamId, std::shared_ptr<NBTreeExtentsList>>> columns;
+    for (auto const& shard: table_) {
+        TableReadLock lock(shard.lock);
+        for (auto const& p: shard.columns) {
+            columns.push_back(p);
+        }
+    }
+    size_t nrewritten = 0;
+    for (auto const& p: columns) {
+        if (!p.second->is_initialized()) {
+            continue;
+        }
+        auto last = p.second->get_last_timestamp();
+        if (last > age && p.second->recompress(last - age)) {
+            (*rescue_points)[p.first] = p.second->get_roots();
+            nrewritten++;
+        }
+    }
+    return nrewritten;
+}
+
 NBTreeAppendResult ColumnStore::write(aku_Sample const& sample, std::vector<LogicAddr>* rescue_points,
-                               std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>>* cache_or_null)
+                                       std::shared_ptr<NBTreeExtentsList>* tree_or_null)
 {
-    std::lock_guard<std::mutex> lock(table_lock_);
     aku_ParamId id = sample.paramid;
-    auto it = columns_.find(id);
-    if (it != columns_.end()) {
-        if (!it->second->is_initialized()) {
-            it->second->force_init();
+    auto tree = find_column(id);
+    if (tree) {
+        if (!tree->is_initialized()) {
+            tree->force_init();
         }
-        auto tree = it->second;
         auto res = tree->append(sample.timestamp, sample.payload.float64);
         if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
             auto tmp = tree->get_roots();
             rescue_points->swap(tmp);
+            update_rollups(id, tree, sample.timestamp);
         }
-        if (cache_or_null != nullptr) {
+        if (tree_or_null != nullptr) {
             // Tree is guaranteed to be initialized here, so all values in the cache
             // don't need to be checked.
-            cache_or_null->insert(std::make_pair(id, tree));
+            *tree_or_null = tree;
         }
         return res;
     }
     return NBTreeAppendResult::FAIL_BAD_ID;
 }
 
+aku_Status ColumnStore::read_last(std::vector<aku_ParamId> const& ids, std::vector<aku_Sample>* dest) const {
+    for (auto id: ids) {
+        auto column = find_column(id);
+        if (!column) {
+            return AKU_ENOT_FOUND;
+        }
+        init_column(id, *column);
+        aku_Status status;
+        aku_Sample sample = {};
+        std::tie(status, sample.timestamp, sample.payload.float64) = column->read_last();
+        if (status == AKU_ENO_DATA) {
+            continue;
+        } else if (status != AKU_SUCCESS) {
+            return status;
+        }
+        sample.paramid = id;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.size = sizeof(aku_Sample);
+        dest->push_back(sample);
+    }
+    return AKU_SUCCESS;
+}
+
+NBTreeAppendResult ColumnStore::write_range(aku_ParamId id, aku_Timestamp const* ts, double const* xs, size_t size,
+                                            std::vector<LogicAddr>* rescue_points)
+{
+    auto tree = find_column(id);
+    if (!tree) {
+        return NBTreeAppendResult::FAIL_BAD_ID;
+    }
+    if (!tree->is_initialized()) {
+        tree->force_init();
+    }
+    auto res = tree->append_range(ts, xs, size);
+    if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+        auto tmp = tree->get_roots();
+        rescue_points->swap(tmp);
+        update_rollups(id, tree, ts[size - 1]);
+    }
+    return res;
+}
+
 
 // ////////////////////// //
 //      WriteSession      //
@@ -127,22 +708,143 @@ CStoreSession::CStoreSession(std::shared_ptr<ColumnStore> registry)
 {
 }
 
+std::shared_ptr<NBTreeExtentsList> const& CStoreSession::get_cached(aku_ParamId id) const {
+    static const std::shared_ptr<NBTreeExtentsList> EMPTY;
+    if (AKU_LIKELY(id < MAX_DENSE_ID)) {
+        return id < cache_.size() ? cache_[id] : EMPTY;
+    }
+    auto it = sparse_cache_.find(id);
+    return it != sparse_cache_.end() ? it->second : EMPTY;
+}
+
+void CStoreSession::add_to_cache(aku_ParamId id, std::shared_ptr<NBTreeExtentsList>&& tree) {
+    if (id < MAX_DENSE_ID) {
+        if (id >= cache_.size()) {
+            cache_.resize(id + 1);
+        }
+        cache_[id] = std::move(tree);
+    } else {
+        sparse_cache_[id] = std::move(tree);
+    }
+}
+
 NBTreeAppendResult CStoreSession::write(aku_Sample const& sample, std::vector<LogicAddr> *rescue_points) {
     if (AKU_UNLIKELY(sample.payload.type != AKU_PAYLOAD_FLOAT)) {
         return NBTreeAppendResult::FAIL_BAD_VALUE;
     }
     // Cache lookup
-    auto it = cache_.find(sample.paramid);
-    if (it != cache_.end()) {
-        auto res = it->second->append(sample.timestamp, sample.payload.float64);
+    auto const& tree = get_cached(sample.paramid);
+    if (tree) {
+        auto res = tree->append(sample.timestamp, sample.payload.float64);
         if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
-            auto tmp = it->second->get_roots();
+            auto tmp = tree->get_roots();
             rescue_points->swap(tmp);
+            cstore_->update_rollups(sample.paramid, tree, sample.timestamp);
         }
         return res;
     }
     // Cache miss - access global registry
-    return cstore_->write(sample, rescue_points, &cache_);
+    std::shared_ptr<NBTreeExtentsList> newtree;
+    auto res = cstore_->write(sample, rescue_points, &newtree);
+    if (newtree) {
+        add_to_cache(sample.paramid, std::move(newtree));
+    }
+    return res;
+}
+
+NBTreeAppendResult CStoreSession::write_batch(const aku_Sample* samples, size_t size,
+                                              std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points)
+{
+    // Stable sort keeps timestamps of every series in order
+    std::vector<u32> index(size);
+    std::iota(index.begin(), index.end(), 0);
+    std::stable_sort(index.begin(), index.end(), [samples](u32 lhs, u32 rhs) {
+        return samples[lhs].paramid < samples[rhs].paramid;
+    });
+    NBTreeAppendResult result = NBTreeAppendResult::OK;
+    auto set_error = [&result](NBTreeAppendResult res) {
+        if (result == NBTreeAppendResult::OK || result == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+            result = res;
+        }
+    };
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    size_t begin = 0;
+    while (begin < size) {
+        aku_ParamId id = samples[index[begin]].paramid;
+        size_t end = begin + 1;
+        while (end < size && samples[index[end]].paramid == id) {
+            end++;
+        }
+        bool flush_needed = false;
+        NBTreeExtentsList* tree = get_cached(id).get();
+        tss.clear();
+        xss.clear();
+        for (size_t ix = begin; ix < end; ix++) {
+            const aku_Sample& sample = samples[index[ix]];
+            if (AKU_UNLIKELY(sample.payload.type != AKU_PAYLOAD_FLOAT)) {
+                set_error(NBTreeAppendResult::FAIL_BAD_VALUE);
+                continue;
+            }
+            if (!tree) {
+                // Cache miss - access global registry
+                std::vector<LogicAddr> tmp;
+                std::shared_ptr<NBTreeExtentsList> newtree;
+                auto res = cstore_->write(sample, &tmp, &newtree);
+                if (res == NBTreeAppendResult::FAIL_BAD_ID) {
+                    set_error(res);
+                    break;
+                } else if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+                    flush_needed = true;
+                } else if (res != NBTreeAppendResult::OK) {
+                    set_error(res);
+                }
+                if (newtree) {
+                    tree = newtree.get();
+                    add_to_cache(id, std::move(newtree));
+                }
+                continue;
+            }
+            tss.push_back(sample.timestamp);
+            xss.push_back(sample.payload.float64);
+        }
+        if (tree && !tss.empty()) {
+            auto res = tree->append_range(tss.data(), xss.data(), tss.size());
+            if (res == NBTreeAppendResult::FAIL_LATE_WRITE) {
+                // Some values are out of order, slow path
+                for (size_t ix = 0; ix < tss.size(); ix++) {
+                    res = tree->append(tss[ix], xss[ix]);
+                    if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+                        flush_needed = true;
+                    } else if (res != NBTreeAppendResult::OK) {
+                        set_error(res);
+                    }
+                }
+            } else if (res == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+                flush_needed = true;
+            } else if (res != NBTreeAppendResult::OK) {
+                set_error(res);
+            }
+        }
+        if (flush_needed) {
+            (*rescue_points)[id] = tree->get_roots();
+            if (!tss.empty()) {
+                // Late writes are rejected so the last timestamp can't be
+                // larger than the last value in the tree
+                cstore_->update_rollups(id, get_cached(id), tss.back());
+            }
+            if (result == NBTreeAppendResult::OK) {
+                result = NBTreeAppendResult::OK_FLUSH_NEEDED;
+            }
+        }
+        begin = end;
+    }
+    return result;
+}
+
+void CStoreSession::clear_cache() {
+    cache_.clear();
+    sparse_cache_.clear();
 }
 
 void CStoreSession::close() {
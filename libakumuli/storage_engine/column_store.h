@@ -26,6 +26,10 @@
  */
 
 // Stdlib
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <unordered_map>
 #include <mutex>
 
@@ -39,82 +43,339 @@
 #include "metadatastorage.h"
 #include "index/seriesparser.h"
 #include "storage_engine/nbtree.h"
+#include "storage_engine/checkpoint.h"
+#include "storage_engine/rollup.h"
+#include "storage_engine/compression_pool.h"
+#include "storage_engine/querycache.h"
+#include "storage_engine/prefetcher.h"
 #include "queryprocessor_framework.h"
 
 namespace Akumuli {
 namespace StorageEngine {
 
 
+/** Time span of every column indexed by column id (ids are dense so it's
+  * stored in the array of lazily allocated chunks). Spans are recorded when
+  * columns are opened and used to skip columns that don't have any data in
+  * the query range without opening them or building operators.
+  */
+class ColumnSpanIndex {
+    enum {
+        CHUNK_BITS = 14,
+        CHUNK_SIZE = 1 << CHUNK_BITS,
+        //! Columns with larger ids are not indexed
+        MAX_CHUNKS = 1 << 14,
+    };
+
+    struct Span {
+        //! Timestamp of the oldest value (0 - span is unknown)
+        std::atomic<aku_Timestamp> first;
+        //! Upper bound of the newest value's timestamp
+        std::atomic<aku_Timestamp> last;
+    };
+
+    std::unique_ptr<std::atomic<Span*>[]> chunks_;
+
+    Span* get(aku_ParamId id, bool create);
+public:
+    ColumnSpanIndex();
+    ~ColumnSpanIndex();
+
+    ColumnSpanIndex(ColumnSpanIndex const&) = delete;
+    ColumnSpanIndex& operator = (ColumnSpanIndex const&) = delete;
+
+    //! Record span of the opened column (nothing is recorded if the column is empty)
+    void update(aku_ParamId id, NBTreeExtentsList const& column);
+
+    /** Check if the column may have data in the query range.
+      * @param column is used to refresh the span if the range is newer than
+      *        the recorded timestamp of the newest value
+      * @return false if the column doesn't have any data in [min, max]
+      */
+    bool may_contain(aku_ParamId id, aku_Timestamp min, aku_Timestamp max,
+                     std::function<std::shared_ptr<NBTreeExtentsList>()> const& column);
+};
+
+
+//! Operator without values, used instead of the columns pruned by ColumnSpanIndex
+template<class T>
+struct EmptyOperator : SeriesOperator<T> {
+    typedef typename SeriesOperator<T>::Direction Direction;
+    Direction dir_;
+
+    EmptyOperator(aku_Timestamp begin, aku_Timestamp end)
+        : dir_(begin <= end ? Direction::FORWARD : Direction::BACKWARD)
+    {
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp*, T*, size_t) override {
+        return std::make_tuple(AKU_ENO_DATA, 0ul);
+    }
+
+    virtual Direction get_direction() override {
+        return dir_;
+    }
+
+    static void push(std::vector<std::unique_ptr<SeriesOperator<T>>>* dest, aku_Timestamp begin, aku_Timestamp end) {
+        dest->push_back(std::unique_ptr<SeriesOperator<T>>(new EmptyOperator<T>(begin, end)));
+    }
+};
+
+
+//! Size of the query estimated by ColumnStore::estimate
+struct QueryEstimate {
+    //! Number of columns that have data in the query range
+    u64 nseries;
+    //! Number of values in the query range
+    u64 nvalues;
+    //! Number of leaf nodes that intersect the query range
+    u64 nleaves;
+};
+
+
 /** Columns store.
   * Serve as a central data repository for series metadata and all individual columns.
   * Each column is addressed by the series name. Data can be written in through WriteSession
   * and read back via IStreamProcessor interface. ColumnStore can reshape data (group, merge or join
   * different columns together).
   * Columns are built from NB+tree instances.
-  * Instances of this class is thread-safe.
+  * Instances of this class is thread-safe. Writers don't share any state except
+  * the shard locks (taken only on cache miss) and the locks of individual columns,
+  * new rescue points are returned to the caller.
   */
 class ColumnStore : public std::enable_shared_from_this<ColumnStore> {
+    //! Number of shards in the column table (should be a power of two)
+    enum { NSHARDS = 64 };
+
+    typedef std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> ColumnTable;
+    typedef LockGuard<RWLock, &RWLock::rdlock> TableReadLock;
+    typedef LockGuard<RWLock, &RWLock::wrlock> TableWriteLock;
+
+    //! Part of the column table, columns are distributed between shards by id
+    struct TableShard {
+        //! Protects the hashmap (shrink and resize)
+        mutable RWLock lock;
+        ColumnTable columns;
+    };
+
     std::shared_ptr<StorageEngine::BlockStore> blockstore_;
-    std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> columns_;
+    //! Sharded column table, readers only take shared locks of individual shards
+    std::array<TableShard, NSHARDS> table_;
     PlainSeriesMatcher global_matcher_;
-    //! List of metadata to update
-    std::unordered_map<aku_ParamId, std::vector<StorageEngine::LogicAddr>> rescue_points_;
-    //! Mutex for metadata storage and rescue points list
-    mutable std::mutex metadata_lock_;
-    //! Mutex for table_ hashmap (shrink and resize)
-    mutable std::mutex table_lock_;
-    //! Syncronization for watcher thread
-    std::condition_variable cvar_;
+    //! Rollup tiers (empty if disabled)
+    std::unique_ptr<RollupStore> rollups_;
+    //! Group-aggregate results cache (empty if disabled)
+    std::unique_ptr<GroupAggregateCache> query_cache_;
+    //! Size of the reorder window of every column
+    const u32 reorder_window_;
+    //! Size of the write ring of every column (0 - disabled)
+    const u32 write_ring_size_;
+    //! Fanout of the column trees
+    const u16 fanout_;
+    //! Rescue points changed by the compression pool, protected by `flushed_lock_`
+    std::unordered_map<aku_ParamId, std::vector<LogicAddr>> flushed_rescue_points_;
+    std::mutex flushed_lock_;
+    //! Flushes write rings in background (empty if disabled), workers use the fields above
+    std::shared_ptr<CompressionPool> compression_pool_;
+    //! Time spans of the opened columns
+    mutable ColumnSpanIndex spans_;
+    //! Prefetches the ranges that will be queried next (empty if disabled)
+    std::unique_ptr<RangePrefetcher> prefetcher_;
+
+    TableShard& get_shard(aku_ParamId id);
+    TableShard const& get_shard(aku_ParamId id) const;
+
+    //! Add new column to the table, return false if column already exists
+    bool add_column(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree);
+
+    //! Find column by id, return empty pointer if column doesn't exist
+    std::shared_ptr<NBTreeExtentsList> find_column(aku_ParamId id) const;
+
+    //! Initialize the column if needed and record its time span
+    void init_column(aku_ParamId id, NBTreeExtentsList& column) const;
+
+    //! Return false if the column doesn't have data in the query range (see ColumnSpanIndex)
+    bool may_contain(aku_ParamId id, aku_Timestamp begin, aku_Timestamp end) const;
+
+    //! Pass the query range to the prefetcher (if enabled)
+    void observe(aku_ParamId id, aku_Timestamp begin, aku_Timestamp end,
+                 std::shared_ptr<NBTreeExtentsList> const& column) const;
 
 public:
-    ColumnStore(std::shared_ptr<StorageEngine::BlockStore> bstore);
+    /** C-tor.
+      * @param bstore is a block store
+      * @param rollup_tiers is a list of bucket widths of the rollup tiers (sorted)
+      * @param query_cache_size is a size limit of the group-aggregate cache in bytes (0 - disabled)
+      * @param reorder_window is a number of values per column that can be written out of order (0 - disabled)
+      * @param write_ring_size is a number of values per column that are compressed in background (0 - disabled)
+      * @param compression_workers is a number of background compression threads (0 - half of the cores)
+      * @param prefetch_blocks is a max number of blocks prefetched per column when the
+      *        query pattern (pan or zoom out) is detected (0 - disabled)
+      * @param fanout is a fanout of the column trees (see NBTreeExtentsList)
+      */
+    ColumnStore(std::shared_ptr<StorageEngine::BlockStore> bstore,
+                std::vector<aku_Timestamp> const& rollup_tiers = std::vector<aku_Timestamp>(),
+                size_t query_cache_size = 0,
+                u32 reorder_window = 0,
+                u32 write_ring_size = 0,
+                size_t compression_workers = 0,
+                size_t prefetch_blocks = 0,
+                u16 fanout = AKU_NBTREE_FANOUT);
 
     // No value semantics allowed.
     ColumnStore(ColumnStore const&) = delete;
     ColumnStore(ColumnStore &&) = delete;
     ColumnStore& operator = (ColumnStore const&) = delete;
 
-    //! Open storage or restore if needed
+    /** Open storage or restore if needed.
+      * Columns that need repair are restored in parallel, other columns are
+      * opened lazily on first access (or immediately if `force_init` is set).
+      */
     aku_Status open_or_restore(const std::unordered_map<aku_ParamId, std::vector<LogicAddr> > &mapping, bool force_init=false);
 
+    //! Return fanout of the column trees
+    u16 get_fanout() const;
+
+    /** Open storage using the shutdown checkpoint. Same as `open_or_restore` but
+      * columns don't have to search for their last values when opened.
+      */
+    aku_Status open_checkpoint(std::vector<ColumnCheckpoint> const& columns);
+
     std::unordered_map<aku_ParamId, std::vector<LogicAddr> > close();
 
+    //! Get rescue points and last values of all columns (should be called after `close`)
+    std::vector<ColumnCheckpoint> get_checkpoint() const;
+
     /** Create new column.
       * @return completion status
       */
     aku_Status create_new_column(aku_ParamId id);
 
+    /** Remove column of the deleted series. Blocks of the column are not
+      * referenced anymore and will be reused when the volume is recycled.
+      * Sessions that cached the column should drop their caches.
+      * @return AKU_ENOT_FOUND if column doesn't exist
+      */
+    aku_Status remove_column(aku_ParamId id);
+
     /** Write sample to data-store.
       * @param sample to write
-      * @param cache_or_null is a pointer to external cache, tree ref will be added there on success
+      * @param tree_or_null receives the tree if the column exists (can be cached by the caller)
       */
     NBTreeAppendResult write(aku_Sample const& sample, std::vector<LogicAddr> *rescue_points,
-                     std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList> > *cache_or_null=nullptr);
+                             std::shared_ptr<NBTreeExtentsList>* tree_or_null=nullptr);
+
+    /** Write ordered range of values to the column (offline import).
+      * Bypasses the session cache, the whole range is validated first and
+      * written only if it's ordered and doesn't overlap with existing data.
+      * @param id is a column id
+      * @param ts is an array of timestamps
+      * @param xs is an array of values
+      * @param size is a size of both arrays
+      * @param rescue_points will be updated if the tree was flushed
+      */
+    NBTreeAppendResult write_range(aku_ParamId id, aku_Timestamp const* ts, double const* xs, size_t size,
+                                   std::vector<LogicAddr> *rescue_points);
+
+    /** Notify rollup worker that the column was committed.
+      * @param id is a column id
+      * @param tree is a column
+      * @param watermark is a timestamp of the last value written to the column
+      */
+    void update_rollups(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> const& tree, aku_Timestamp watermark);
+
+    //! Wait until rollup tiers will be up to date (for tests)
+    void _wait_rollups();
+
+    /** Set precision hint of the column (see NBTreeExtentsList::set_precision).
+      * @param id is a column id
+      * @param digits is a number of decimal digits (negative - disabled)
+      * @return AKU_ENOT_FOUND if column doesn't exist
+      */
+    aku_Status set_precision(aku_ParamId id, int digits);
+
+    /** Enable change-only mode of the column (see NBTreeExtentsList::set_change_only).
+      * @param id is a column id
+      * @param heartbeat is a max interval between the stored values (0 - disabled)
+      * @return AKU_ENOT_FOUND if column doesn't exist
+      */
+    aku_Status set_change_only(aku_ParamId id, aku_Timestamp heartbeat);
+
+    /** Move rescue points of the columns flushed by the background compression
+      * workers to `rescue_points` (nothing to do if write rings are disabled).
+      */
+    void pull_rescue_points(std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points);
+
+    //! Wait until all scheduled write rings will be flushed (for tests)
+    void _wait_compression();
+
+    //! Number of buckets in the group-aggregate cache (for tests)
+    size_t _get_query_cache_size() const;
 
     size_t _get_uncommitted_memory() const;
 
+    /** Commit leaf nodes of the least recently written columns until memory used by
+      * the leaf nodes fits the budget. Columns remain open, committed leaf nodes are
+      * replaced by the compact ones. Columns are ordered by the timestamp of the last value.
+      * @param budget is a memory budget in bytes
+      * @param rescue_points receives new rescue points of the committed columns
+      * @return memory used by the leaf nodes after the call
+      */
+    size_t release_write_buffers(size_t budget, std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points);
+
+    /** Commit leaf nodes of all opened columns (used to truncate the input log).
+      * Values from the reorder buffers can't be committed, they're returned to the caller.
+      * @param rescue_points receives new rescue points of the committed columns
+      * @param pending receives values from the reorder buffers
+      * @return number of committed columns
+      */
+    size_t commit_write_buffers(std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points,
+                                std::vector<aku_Sample>* pending);
+
+    /** Rewrite columns with underfilled leaf nodes (see NBTreeExtentsList::compact).
+      * Only opened columns are compacted.
+      * @param min_fill is a fill factor threshold
+      * @param rescue_points receives new rescue points of the rewritten columns
+      * @return number of rewritten columns
+      */
+    size_t compact(double min_fill, std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points);
+
+    /** Pack old values of the columns (see NBTreeExtentsList::recompress).
+      * Only opened columns are rewritten.
+      * @param age is a difference between the last timestamp of the column and
+      *        the timestamp of the newest value that should be packed
+      * @param rescue_points receives new rescue points of the rewritten columns
+      * @return number of rewritten columns
+      */
+    size_t recompress(aku_Timestamp age, std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points);
+
     //! For debug reports
-    std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> _get_columns() {
-        return columns_;
-    }
+    std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> _get_columns();
 
     // -------------
     // New-style API
     // -------------
 
-    template<class IterType, class Fn>
+    /** Create operator for every column in the query range.
+      * Columns that don't have any data in the range get empty operators.
+      */
+    template<class T, class Fn>
     aku_Status iterate(const std::vector<aku_ParamId>& ids,
-                      std::vector<std::unique_ptr<IterType>>* dest,
-                      const Fn& fn) const
+                       aku_Timestamp begin,
+                       aku_Timestamp end,
+                       std::vector<std::unique_ptr<SeriesOperator<T>>>* dest,
+                       const Fn& fn) const
     {
         for (auto id: ids) {
-            std::lock_guard<std::mutex> lg(table_lock_); AKU_UNUSED(lg);
-            auto it = columns_.find(id);
-            if (it != columns_.end()) {
-                if (!it->second->is_initialized()) {
-                    it->second->force_init();
-                }
-                std::unique_ptr<IterType> iter = fn(*it->second);
+            if (!may_contain(id, begin, end)) {
+                EmptyOperator<T>::push(dest, begin, end);
+                continue;
+            }
+            auto column = find_column(id);
+            if (column) {
+                init_column(id, *column);
+                observe(id, begin, end, column);
+                std::unique_ptr<SeriesOperator<T>> iter = fn(*column);
                 dest->push_back(std::move(iter));
             } else {
                 return AKU_ENOT_FOUND;
@@ -128,31 +389,111 @@ public:
                     aku_Timestamp end,
                     std::vector<std::unique_ptr<RealValuedOperator>>* dest) const
     {
-        return iterate(ids, dest, [begin, end](const NBTreeExtentsList& elist) {
+        return iterate(ids, begin, end, dest, [begin, end](const NBTreeExtentsList& elist) {
             return elist.search(begin, end);
         });
     }
 
+    /** Create scan operators with limit and offset.
+      * @param limits contains limit for every id (same object can be used by
+      *        several operators if they're read one after another)
+      */
+    aku_Status scan(std::vector<aku_ParamId> const& ids,
+                    aku_Timestamp begin,
+                    aku_Timestamp end,
+                    std::vector<std::shared_ptr<ScanLimit>> const& limits,
+                    std::vector<std::unique_ptr<RealValuedOperator>>* dest) const
+    {
+        // Operator is added to `dest` after the call, so its index is known
+        size_t base = dest->size();
+        return iterate(ids, begin, end, dest, [begin, end, &limits, dest, base](const NBTreeExtentsList& elist) {
+            return elist.search(begin, end, limits.at(dest->size() - base));
+        });
+    }
+
+    //! Create scan operators that return only values that match the filter
+    aku_Status filter(std::vector<aku_ParamId> const& ids,
+                      aku_Timestamp begin,
+                      aku_Timestamp end,
+                      ValueFilter const& filter,
+                      std::vector<std::unique_ptr<RealValuedOperator>>* dest) const
+    {
+        return iterate(ids, begin, end, dest, [begin, end, &filter](const NBTreeExtentsList& elist) {
+            return elist.filter(begin, end, filter);
+        });
+    }
+
+    /** Read the latest value of every column.
+      * Values are maintained by the columns on write so this method
+      * doesn't need to read anything from the block store.
+      * @param dest receives one sample per non-empty column, in the same order as `ids`
+      */
+    aku_Status read_last(std::vector<aku_ParamId> const& ids, std::vector<aku_Sample>* dest) const;
+
+    /** Estimate the size of the query using the roots of the columns (see NBTreeExtentsList::estimate).
+      * Columns are opened if needed but nothing is read from the block store.
+      */
+    aku_Status estimate(std::vector<aku_ParamId> const& ids,
+                        aku_Timestamp begin,
+                        aku_Timestamp end,
+                        QueryEstimate* est) const;
+
     aku_Status aggregate(std::vector<aku_ParamId> const& ids,
                          aku_Timestamp begin,
                          aku_Timestamp end,
                          std::vector<std::unique_ptr<AggregateOperator>>* dest) const
     {
-        return iterate(ids, dest, [begin, end](const NBTreeExtentsList& elist) {
+        return iterate(ids, begin, end, dest, [begin, end](const NBTreeExtentsList& elist) {
             return elist.aggregate(begin, end);
         });
     }
 
+    /** Create approximate aggregate operators.
+      * Leaf nodes are not read, see NBTreeExtentsList::approximate.
+      */
+    aku_Status approximate(std::vector<aku_ParamId> const& ids,
+                           aku_Timestamp begin,
+                           aku_Timestamp end,
+                           std::vector<std::unique_ptr<AggregateOperator>>* dest) const
+    {
+        return iterate(ids, begin, end, dest, [begin, end](const NBTreeExtentsList& elist) {
+            return elist.approximate(begin, end);
+        });
+    }
+
+    /** Create value range operators (where-value query). Every operator
+      * returns one aggregate per time range in which all values match the filter.
+      */
+    aku_Status value_ranges(std::vector<aku_ParamId> const& ids,
+                            aku_Timestamp begin,
+                            aku_Timestamp end,
+                            ValueFilter const& filter,
+                            std::vector<std::unique_ptr<AggregateOperator>>* dest) const
+    {
+        return iterate(ids, begin, end, dest, [begin, end, &filter](const NBTreeExtentsList& elist) {
+            return elist.value_ranges(begin, end, filter);
+        });
+    }
+
+    /** Create group-aggregate operators.
+      * Rollup tier is used if the step is a multiple of the tier's bucket width,
+      * otherwise immutable part of the range is read from the cache (if enabled).
+      */
     aku_Status group_aggregate(std::vector<aku_ParamId> const& ids,
                                aku_Timestamp begin,
                                aku_Timestamp end,
                                aku_Timestamp step,
-                               std::vector<std::unique_ptr<AggregateOperator>>* dest) const
-    {
-        return iterate(ids, dest, [begin, end, step](const NBTreeExtentsList& elist) {
-            return elist.group_aggregate(begin, end, step);
-        });
-    }
+                               std::vector<std::unique_ptr<AggregateOperator>>* dest) const;
+
+    /** Create candlestick operator for every column. Each candlestick spans
+      * less than `hint.min_delta`. Subtrees that are short enough are returned
+      * as one candlestick without reading them.
+      */
+    aku_Status candlesticks(std::vector<aku_ParamId> const& ids,
+                            aku_Timestamp begin,
+                            aku_Timestamp end,
+                            NBTreeCandlestickHint hint,
+                            std::vector<std::unique_ptr<AggregateOperator>>* dest) const;
 };
 
 
@@ -164,8 +505,23 @@ class CStoreSession : public std::enable_shared_from_this<CStoreSession>
 {
     //! Link to global column store.
     std::shared_ptr<ColumnStore> cstore_;
-    //! Tree cache
-    std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> cache_;
+    /** Tree cache indexed by series id. Ids are allocated sequentially so the
+      * cache is dense, lookup doesn't hash and doesn't touch the reference counter.
+      * Session holds its own references so cached trees can't be destroyed until
+      * `clear_cache` is called.
+      */
+    std::vector<std::shared_ptr<NBTreeExtentsList>> cache_;
+    //! Trees with ids that are too large for the dense cache
+    std::unordered_map<aku_ParamId, std::shared_ptr<NBTreeExtentsList>> sparse_cache_;
+
+    //! Ids below this value are stored in the dense cache
+    static const aku_ParamId MAX_DENSE_ID = 0x1000000;
+
+    //! Return cached tree or empty pointer
+    std::shared_ptr<NBTreeExtentsList> const& get_cached(aku_ParamId id) const;
+
+    //! Add tree to the cache
+    void add_to_cache(aku_ParamId id, std::shared_ptr<NBTreeExtentsList>&& tree);
 public:
     //! C-tor. Shouldn't be called directly.
     CStoreSession(std::shared_ptr<ColumnStore> registry);
@@ -177,6 +533,21 @@ public:
     //! Write sample
     NBTreeAppendResult write(const aku_Sample &sample, std::vector<LogicAddr>* rescue_points);
 
+    /** Write batch of samples.
+      * Samples are grouped by series id and every run is appended to the
+      * corresponding tree at once. Order of samples inside every series is preserved.
+      * Samples that can't be written are skipped.
+      * @param samples is an array of samples
+      * @param size is a size of the array
+      * @param rescue_points receives new rescue points of every tree that should be flushed
+      * @return result of the first failed write or OK (OK_FLUSH_NEEDED if `rescue_points` was updated)
+      */
+    NBTreeAppendResult write_batch(const aku_Sample* samples, size_t size,
+                                   std::unordered_map<aku_ParamId, std::vector<LogicAddr>>* rescue_points);
+
+    //! Drop cached trees (columns can be removed from the column store)
+    void clear_cache();
+
     /**
      * Closes the session. This method should unload all cached trees
      */
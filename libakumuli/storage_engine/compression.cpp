@@ -2,6 +2,7 @@
 #include "util.h"
 #include "akumuli_version.h"
 
+#include <cmath>
 #include <unordered_map>
 #include <algorithm>
 #include <iostream>
@@ -18,6 +19,10 @@ void SimplePredictor::update(u64 value) {
     last_value = value;
 }
 
+void SimplePredictor::reset() {
+    last_value = 0;
+}
+
 FcmPredictor::FcmPredictor(size_t table_size)
     : last_hash(0ull)
     , MASK_(table_size - 1)
@@ -35,6 +40,11 @@ void FcmPredictor::update(u64 value) {
     last_hash = ((last_hash << 5) ^ (value >> 50)) & MASK_;
 }
 
+void FcmPredictor::reset() {
+    std::fill(table.begin(), table.end(), 0ull);
+    last_hash = 0;
+}
+
 //! C-tor. `table_size` should be a power of two.
 DfcmPredictor::DfcmPredictor(int table_size)
     : last_hash (0ul)
@@ -55,6 +65,12 @@ void DfcmPredictor::update(u64 value) {
     last_value = value;
 }
 
+void DfcmPredictor::reset() {
+    std::fill(table.begin(), table.end(), 0ull);
+    last_hash = 0;
+    last_value = 0;
+}
+
 static const int PREDICTOR_N = 1 << 7;
 
 template<class StreamT>
@@ -120,6 +136,15 @@ static inline u64 decode_value(StreamT& rstream, unsigned char flag) {
     return diff;
 }
 
+//! Fast version, uses word sized reads when possible
+static inline u64 decode_value(VByteStreamReader& rstream, unsigned char flag) {
+    int nbytes = (flag & 7) + 1;
+    u64 diff = rstream.read_bytes<u64>(nbytes);
+    int shift_width = (64 - nbytes*8)*(flag >> 3);
+    diff <<= shift_width;
+    return diff;
+}
+
 
         // ///////////////////////////////// //
         // FcmStreamWriter & FcmStreamReader //
@@ -142,13 +167,41 @@ bool FcmStreamWriter::tput(double const* values, size_t n) {
     for (u32 i = 0; i < n; i++) {
         std::tie(diffs[i], flags[i]) = encode(values[i]);
     }
+    if (!write_chunk(diffs, flags, n)) {
+        return false;
+    }
+    return commit();
+}
+
+size_t FcmStreamWriter::chunk_size(u64 const* diffs, const u8* flags, size_t n) {
+    u64 sum_diff = 0;
+    for (u32 i = 0; i < n; i++) {
+        sum_diff |= diffs[i];
+    }
+    if (sum_diff == 0) {
+        return 1;
+    }
+    size_t size = n / 2;  // control bytes
+    for (u32 i = 0; i < n; i++) {
+        unsigned char flag = flags[i] == 0xF ? 0 : flags[i];
+        size += static_cast<size_t>((flag & 7) + 1);
+    }
+    return size;
+}
+
+/** Write chunk of FCM diffs. StreamT is either VByteStreamWriter or
+  * UncheckedStreamWriter (bounds checks are optimized out in this case).
+  */
+template<class StreamT>
+static bool write_fcm_chunk(StreamT& stream, u64 const* diffs, const u8* flags, size_t n) {
+    assert(n % 2 == 0);
     u64 sum_diff = 0;
     for (u32 i = 0; i < n; i++) {
         sum_diff |= diffs[i];
     }
     if (sum_diff == 0) {
         // Shortcut
-        if (!stream_.put_raw((u8)0xFF)) {
+        if (!stream.put_raw((u8)0xFF)) {
             return false;
         }
     } else {
@@ -166,18 +219,27 @@ bool FcmStreamWriter::tput(double const* values, size_t n) {
                 prev_flag = 0;
             }
             unsigned char flags = static_cast<unsigned char>((prev_flag << 4) | curr_flag);
-            if (!stream_.put_raw(flags)) {
+            if (!stream.put_raw(flags)) {
                 return false;
             }
-            if (!encode_value(stream_, prev_diff, prev_flag)) {
+            if (!encode_value(stream, prev_diff, prev_flag)) {
                 return false;
             }
-            if (!encode_value(stream_, curr_diff, curr_flag)) {
+            if (!encode_value(stream, curr_diff, curr_flag)) {
                 return false;
             }
         }
     }
-    return commit();
+    return true;
+}
+
+bool FcmStreamWriter::write_chunk(u64 const* diffs, const u8* flags, size_t n) {
+    // Chunk size is exact, capacity is checked once for the whole chunk
+    if (stream_.space_left() < chunk_size(diffs, flags, n)) {
+        return false;
+    }
+    UncheckedStreamWriter<VByteStreamWriter> unchecked(stream_);
+    return write_fcm_chunk(unchecked, diffs, flags, n);
 }
 
 std::tuple<u64, unsigned char> FcmStreamWriter::encode(double value) {
@@ -189,7 +251,10 @@ std::tuple<u64, unsigned char> FcmStreamWriter::encode(double value) {
     u64 predicted = predictor_.predict_next();
     predictor_.update(curr.bits);
     u64 diff = curr.bits ^ predicted;
+    return std::make_tuple(diff, diff_flag(diff));
+}
 
+unsigned char FcmStreamWriter::diff_flag(u64 diff) {
     // Number of trailing and leading zero-bytes
     int leading_bytes = 8;
     int trailing_bytes = 8;
@@ -203,7 +268,7 @@ std::tuple<u64, unsigned char> FcmStreamWriter::encode(double value) {
         // If there is 0 trailing zero bytes and 0 leading bytes
         // code will always generate flag 7 so we can use flag 17
         // for something different (like 0 indication)
-        return std::make_tuple(0, 0xF);
+        return 0xF;
     }
 
     int nbytes;
@@ -225,7 +290,7 @@ std::tuple<u64, unsigned char> FcmStreamWriter::encode(double value) {
         // zeroed 4th bit indicates that only trailing bytes are stored
         flag = nbytes&7;
     }
-    return std::make_tuple(diff, flag);
+    return flag;
 }
 
 bool FcmStreamWriter::put(double value) {
@@ -391,6 +456,320 @@ double FcmStreamReader::next() {
 
 const u8 *FcmStreamReader::pos() const { return stream_.pos(); }
 
+
+        // /////////////////////////////////////////// //
+        // AdaptiveStreamWriter & AdaptiveStreamReader //
+        // /////////////////////////////////////////// //
+
+static inline u64 double_to_bits(double value) {
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double bits_to_double(u64 bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline u64 zigzag_encode(i64 value) {
+    return static_cast<u64>((value << 1) ^ (value >> 63));
+}
+
+static inline i64 zigzag_decode(u64 value) {
+    return static_cast<i64>(value >> 1) ^ -static_cast<i64>(value & 1);
+}
+
+static inline size_t base128_size(u64 value) {
+    if (value == 0) {
+        return 1;
+    }
+    return static_cast<size_t>((64 - __builtin_clzl(value) + 6) / 7);
+}
+
+/** Convert value to integer if the conversion is lossless.
+  * Only integers that can be represented exactly are accepted.
+  */
+static inline bool to_integer(double value, i64* result) {
+    static const double MAX_EXACT = 9007199254740992.0;  // 2^53
+    if (!(value >= -MAX_EXACT && value <= MAX_EXACT)) {
+        // NaN or out of range
+        return false;
+    }
+    i64 ival = static_cast<i64>(value);
+    // Compare bit patterns to reject fractions and negative zero
+    if (double_to_bits(static_cast<double>(ival)) != double_to_bits(value)) {
+        return false;
+    }
+    *result = ival;
+    return true;
+}
+
+static const double POW10[AKU_MAX_PRECISION + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/** Convert value to integer scaled by `10^digits` if the conversion is lossless,
+  * `scaled / 10^digits` should produce the same value.
+  */
+static inline bool to_scaled(double value, int digits, i64* result) {
+    static const double MAX_EXACT = 9007199254740992.0;  // 2^53
+    double scaled = value * POW10[digits];
+    if (!(scaled >= -MAX_EXACT && scaled <= MAX_EXACT)) {
+        return false;
+    }
+    i64 ival = std::llround(scaled);
+    if (double_to_bits(static_cast<double>(ival) / POW10[digits]) != double_to_bits(value)) {
+        return false;
+    }
+    *result = ival;
+    return true;
+}
+
+double quantize_value(double value, int digits) {
+    static const double MAX_EXACT = 9007199254740992.0;  // 2^53
+    assert(digits >= 0 && digits <= AKU_MAX_PRECISION);
+    double scaled = value * POW10[digits];
+    if (!(scaled >= -MAX_EXACT && scaled <= MAX_EXACT)) {
+        return value;
+    }
+    // Same expression is used by the SCALED decoder
+    return static_cast<double>(std::llround(scaled)) / POW10[digits];
+}
+
+AdaptiveStreamWriter::AdaptiveStreamWriter(VByteStreamWriter& stream, ValueCodec codec)
+    : stream_(stream)
+    , fcm_(stream)
+    , codec_(codec)
+    , prev_bits_(0)
+{
+    assert(codec == ValueCodec::FCM || codec == ValueCodec::ADAPTIVE);
+}
+
+bool AdaptiveStreamWriter::tput(double const* values, size_t n) {
+    assert(n == 16);
+    if (codec_ == ValueCodec::FCM) {
+        return fcm_.tput(values, n);
+    }
+    u64 bits[16];
+    for (u32 i = 0; i < n; i++) {
+        bits[i] = double_to_bits(values[i]);
+    }
+    // FCM. Predictor should see all values even if other codec will
+    // be used because reader will update its predictor the same way.
+    u8  fcm_flags[16];
+    u64 fcm_diffs[16];
+    for (u32 i = 0; i < n; i++) {
+        std::tie(fcm_diffs[i], fcm_flags[i]) = fcm_.encode(values[i]);
+    }
+    ValueCodec best = ValueCodec::FCM;
+    size_t best_size = FcmStreamWriter::chunk_size(fcm_diffs, fcm_flags, n);
+
+    // XOR with previous value
+    u8  xor_flags[16];
+    u64 xor_diffs[16];
+    u64 prev = prev_bits_;
+    for (u32 i = 0; i < n; i++) {
+        xor_diffs[i] = bits[i] ^ prev;
+        xor_flags[i] = FcmStreamWriter::diff_flag(xor_diffs[i]);
+        prev = bits[i];
+    }
+    size_t xor_size = FcmStreamWriter::chunk_size(xor_diffs, xor_flags, n);
+    if (xor_size < best_size) {
+        best = ValueCodec::XOR;
+        best_size = xor_size;
+    }
+
+    // Constant run
+    bool is_const = true;
+    for (u32 i = 1; i < n; i++) {
+        is_const &= bits[i] == bits[0];
+    }
+    if (is_const && sizeof(u64) < best_size) {
+        best = ValueCodec::CONST;
+        best_size = sizeof(u64);
+    }
+
+    // Integer deltas, the first value is stored as is
+    u64 int_deltas[16];
+    bool is_int = true;
+    i64 prev_int = 0;
+    size_t int_size = 0;
+    for (u32 i = 0; i < n && is_int; i++) {
+        i64 curr_int;
+        is_int = to_integer(values[i], &curr_int);
+        int_deltas[i] = zigzag_encode(curr_int - prev_int);
+        int_size += base128_size(int_deltas[i]);
+        prev_int = curr_int;
+    }
+    if (is_int && int_size < best_size) {
+        best = ValueCodec::DELTA;
+        best_size = int_size;
+    }
+
+    // Decimal fractions (quantized values), the smallest number of digits
+    // that represents every value of the chunk is used
+    u64 scaled_deltas[16];
+    int digits = 1;
+    if (!is_int) {
+        i64 tmp;
+        for (u32 i = 0; i < n && digits <= AKU_MAX_PRECISION; i++) {
+            while (digits <= AKU_MAX_PRECISION && !to_scaled(values[i], digits, &tmp)) {
+                digits++;
+            }
+        }
+    }
+    if (!is_int && digits <= AKU_MAX_PRECISION) {
+        bool is_scaled = true;
+        i64 prev_scaled = 0;
+        size_t scaled_size = 1;  // number of digits
+        for (u32 i = 0; i < n && is_scaled; i++) {
+            i64 curr_scaled;
+            is_scaled = to_scaled(values[i], digits, &curr_scaled);
+            scaled_deltas[i] = zigzag_encode(curr_scaled - prev_scaled);
+            scaled_size += base128_size(scaled_deltas[i]);
+            prev_scaled = curr_scaled;
+        }
+        if (is_scaled && scaled_size < best_size) {
+            best = ValueCodec::SCALED;
+            best_size = scaled_size;
+        }
+    }
+
+    prev_bits_ = bits[n - 1];
+    // Size of the chosen encoding is exact (codec id is stored before the chunk),
+    // capacity is checked once and the chunk is written without bounds checks
+    if (stream_.space_left() < 1 + best_size) {
+        return false;
+    }
+    UncheckedStreamWriter<VByteStreamWriter> unchecked(stream_);
+    unchecked.put_raw(static_cast<u8>(best));
+    switch (best) {
+    case ValueCodec::FCM:
+        write_fcm_chunk(unchecked, fcm_diffs, fcm_flags, n);
+        break;
+    case ValueCodec::XOR:
+        write_fcm_chunk(unchecked, xor_diffs, xor_flags, n);
+        break;
+    case ValueCodec::CONST:
+        unchecked.put_raw(bits[0]);
+        break;
+    case ValueCodec::DELTA:
+        for (u32 i = 0; i < n; i++) {
+            unchecked.put_base128(int_deltas[i]);
+        }
+        break;
+    case ValueCodec::SCALED:
+        unchecked.put_raw(static_cast<u8>(digits));
+        for (u32 i = 0; i < n; i++) {
+            unchecked.put_base128(scaled_deltas[i]);
+        }
+        break;
+    case ValueCodec::ADAPTIVE:
+    case ValueCodec::DICTIONARY:
+    case ValueCodec::HISTOGRAM:
+        AKU_PANIC("invalid chunk codec");
+    };
+    return stream_.commit();
+}
+
+void AdaptiveStreamWriter::restart() {
+    fcm_.predictor_.reset();
+    prev_bits_ = 0;
+}
+
+AdaptiveStreamReader::AdaptiveStreamReader(VByteStreamReader& stream, ValueCodec codec)
+    : stream_(stream)
+    , fcm_(stream)
+    , codec_(codec)
+    , prev_bits_(0)
+{
+}
+
+void AdaptiveStreamReader::next_chunk(double* dest, size_t n) {
+    assert(n % 2 == 0);
+    ValueCodec codec = ValueCodec::FCM;
+    if (codec_ == ValueCodec::ADAPTIVE) {
+        codec = static_cast<ValueCodec>(stream_.read_raw<u8>());
+    } else if (codec_ != ValueCodec::FCM) {
+        AKU_PANIC("unknown block codec");
+    }
+    // Decoders of other codecs should update the FCM predictor because the
+    // writer have done this for every value.
+    switch (codec) {
+    case ValueCodec::FCM:
+        for (u32 i = 0; i < n; i++) {
+            dest[i] = fcm_.next();
+        }
+        break;
+    case ValueCodec::XOR: {
+        u64 prev = prev_bits_;
+        u8 flags = stream_.read_raw<u8>();
+        if (flags == 0xFF) {
+            // Shortcut, all diffs are zeroes
+            for (u32 i = 0; i < n; i++) {
+                dest[i] = bits_to_double(prev);
+                fcm_.predictor_.update(prev);
+            }
+            break;
+        }
+        for (u32 i = 0; i < n; i += 2) {
+            if (i != 0) {
+                flags = stream_.read_raw<u8>();
+            }
+            prev ^= decode_value(stream_, static_cast<unsigned char>(flags >> 4));
+            dest[i] = bits_to_double(prev);
+            fcm_.predictor_.update(prev);
+            prev ^= decode_value(stream_, static_cast<unsigned char>(flags & 0xF));
+            dest[i + 1] = bits_to_double(prev);
+            fcm_.predictor_.update(prev);
+        }
+    }
+    break;
+    case ValueCodec::CONST: {
+        u64 bits = stream_.read_raw<u64>();
+        for (u32 i = 0; i < n; i++) {
+            dest[i] = bits_to_double(bits);
+            fcm_.predictor_.update(bits);
+        }
+    }
+    break;
+    case ValueCodec::DELTA: {
+        i64 acc = 0;
+        for (u32 i = 0; i < n; i++) {
+            acc += zigzag_decode(stream_.next_base128<u64>());
+            dest[i] = static_cast<double>(acc);
+            fcm_.predictor_.update(double_to_bits(dest[i]));
+        }
+    }
+    break;
+    case ValueCodec::SCALED: {
+        u8 digits = stream_.read_raw<u8>();
+        if (digits > AKU_MAX_PRECISION) {
+            AKU_PANIC("invalid number of digits");
+        }
+        i64 acc = 0;
+        for (u32 i = 0; i < n; i++) {
+            acc += zigzag_decode(stream_.next_base128<u64>());
+            dest[i] = static_cast<double>(acc) / POW10[digits];
+            fcm_.predictor_.update(double_to_bits(dest[i]));
+        }
+    }
+    break;
+    default:
+        AKU_PANIC("unknown chunk codec");
+    };
+    prev_bits_ = double_to_bits(dest[n - 1]);
+}
+
+void AdaptiveStreamReader::restart() {
+    fcm_.predictor_.reset();
+    fcm_.iter_ = 0;
+    fcm_.nzeroes_ = 0;
+    prev_bits_ = 0;
+}
+
 void CompressionUtil::decompress_doubles(Base128StreamReader &rstream,
                                          size_t                   numvalues,
                                          std::vector<double>     *output)
@@ -595,32 +974,74 @@ namespace StorageEngine {
 DataBlockWriter::DataBlockWriter()
     : stream_(nullptr, nullptr)
     , ts_stream_(stream_)
-    , val_stream_(stream_)
+    , val_stream_(stream_, ValueCodec::FCM)
     , write_index_(0)
     , nchunks_(nullptr)
     , ntail_(nullptr)
+    , directory_(nullptr)
 {
 }
 
-DataBlockWriter::DataBlockWriter(aku_ParamId id, u8 *buf, int size)
+DataBlockWriter::DataBlockWriter(aku_ParamId id, u8 *buf, int size, ValueCodec codec)
     : stream_(buf, buf + size)
     , ts_stream_(stream_)
-    , val_stream_(stream_)
+    , val_stream_(stream_, codec)
     , write_index_(0)
 {
-    // offset 0
-    auto success = stream_.put_raw<u16>(AKUMULI_VERSION);
+    init_header(id, codec);
+}
+
+void DataBlockWriter::init_header(aku_ParamId id, ValueCodec codec) {
+    // offset 0, low byte - version, high byte - codec and format flags
+    u16 flags = static_cast<u16>(codec) | TS_REGULAR_FLAG | DIRECTORY_FLAG;
+    u16 version = static_cast<u16>(AKUMULI_VERSION & 0xFF) | static_cast<u16>(flags << 8);
+    auto success = stream_.put_raw<u16>(version);
     // offset 2
     nchunks_ = stream_.allocate<u16>();
     // offset 4
     ntail_ = stream_.allocate<u16>();
     // offset 6
     success = stream_.put_raw(id) && success;
-    if (!success || nchunks_ == nullptr || ntail_ == nullptr) {
+    // offset 14
+    directory_ = stream_.allocate<ChunkDirectory>();
+    if (!success || nchunks_ == nullptr || ntail_ == nullptr || directory_ == nullptr) {
         AKU_PANIC("Buffer is too small (3)");
     }
     *ntail_ = 0;
     *nchunks_ = 0;
+    memset(directory_, 0, sizeof(ChunkDirectory));
+    directory_->shift = ChunkDirectory::RESTART_SHIFT;
+}
+
+void DataBlockWriter::add_restart_point() {
+    // Index of the chunk that is about to be written
+    u32 nchunk = *nchunks_;
+    if (nchunk == 0 || nchunk % (1u << ChunkDirectory::RESTART_SHIFT) != 0) {
+        return;
+    }
+    // Value decoder should be restarted by the reader on every restart point because
+    // the entry can be dropped from the directory later, timestamp stream encodes
+    // the restart explicitly so it's restarted only when the entry is added.
+    val_stream_.restart();
+    if (nchunk % (1u << directory_->shift) != 0) {
+        return;
+    }
+    if (directory_->size == ChunkDirectory::NENTRIES) {
+        // Entry `i` points to the chunk `(i + 1) << shift`, after the interval is
+        // doubled it should point to the chunk that was pointed by the entry `2i + 1`.
+        for (u32 i = 0; i < ChunkDirectory::NENTRIES / 2; i++) {
+            directory_->entries[i] = directory_->entries[2*i + 1];
+        }
+        directory_->size = ChunkDirectory::NENTRIES / 2;
+        directory_->shift++;
+        if (nchunk % (1u << directory_->shift) != 0) {
+            return;
+        }
+    }
+    ChunkDirectory::Entry& entry = directory_->entries[directory_->size++];
+    entry.prev_ts = ts_stream_.delta_.prev_;
+    entry.offset  = static_cast<u16>(stream_.size());
+    ts_stream_.restart();
 }
 
 aku_Status DataBlockWriter::put(aku_Timestamp ts, double value) {
@@ -631,6 +1052,7 @@ aku_Status DataBlockWriter::put(aku_Timestamp ts, double value) {
         val_writebuf_[write_index_ & CHUNK_MASK] = value;
         write_index_++;
         if ((write_index_ & CHUNK_MASK) == 0) {
+            add_restart_point();
             // put timestamps
             if (ts_stream_.tput(ts_writebuf_, CHUNK_SIZE)) {
                 if (val_stream_.tput(val_writebuf_, CHUNK_SIZE)) {
@@ -658,6 +1080,31 @@ aku_Status DataBlockWriter::put(aku_Timestamp ts, double value) {
     return AKU_SUCCESS;
 }
 
+size_t DataBlockWriter::put_range(aku_Timestamp const* ts, double const* xs, size_t size) {
+    size_t ix = 0;
+    while (ix < size) {
+        if ((write_index_ & CHUNK_MASK) == 0 && size - ix >= CHUNK_SIZE && room_for_chunk()) {
+            // Fast path, write buffer is empty and the whole chunk is available
+            add_restart_point();
+            if (ts_stream_.tput(ts + ix, CHUNK_SIZE) && val_stream_.tput(xs + ix, CHUNK_SIZE)) {
+                write_index_ += CHUNK_SIZE;
+                *nchunks_ += 1;
+                ix += CHUNK_SIZE;
+                continue;
+            }
+            // This can happen only if `room_for_chunk` function
+            // estimates required space incorrectly.
+            assert(false);
+            break;
+        }
+        if (put(ts[ix], xs[ix]) != AKU_SUCCESS) {
+            break;
+        }
+        ix++;
+    }
+    return ix;
+}
+
 size_t DataBlockWriter::commit() {
     // It should be possible to store up to one million chunks in one block,
     // for 4K block size this is more then enough.
@@ -691,9 +1138,8 @@ size_t DataBlockWriter::commit() {
 }
 
 bool DataBlockWriter::room_for_chunk() const {
-    static const size_t MARGIN = 10*16 + 9*16;  // worst case
     auto free_space = stream_.space_left();
-    if (free_space < MARGIN) {
+    if (free_space < CHUNK_MARGIN) {
         return false;
     }
     return true;
@@ -712,6 +1158,20 @@ void DataBlockWriter::read_tail_elements(std::vector<aku_Timestamp>* timestamps,
     }
 }
 
+void DataBlockWriter::relocate(u8* buf, int size) {
+    if (*ntail_ != 0 || write_index_ >= CHUNK_SIZE) {
+        AKU_PANIC("Can't relocate block writer, data is already compressed");
+    }
+    // Only the header was written to the stream
+    u16 version;
+    aku_ParamId id;
+    memcpy(&version, stream_.begin_, sizeof(version));
+    memcpy(&id, stream_.begin_ + 6, sizeof(id));
+    auto codec = static_cast<ValueCodec>((version >> 8) & CODEC_MASK);
+    stream_ = VByteStreamWriter(buf, buf + size);
+    init_header(id, codec);
+}
+
 int DataBlockWriter::get_write_index() const {
     // Note: we need to be able to read this index to
     // get rid of write index inside NBTreeLeaf.
@@ -725,20 +1185,48 @@ int DataBlockWriter::get_write_index() const {
 // DataBlockReader implementation //
 // ////////////////////////////// //
 
+static u16 get_block_version(const u8* pdata) {
+    u16 version = *reinterpret_cast<const u16*>(pdata);
+    return version & 0xFF;
+}
+
+static ValueCodec get_block_codec(const u8* pdata) {
+    u16 version = *reinterpret_cast<const u16*>(pdata);
+    return static_cast<ValueCodec>((version >> 8) & DataBlockWriter::CODEC_MASK);
+}
+
+static bool get_block_ts_regular(const u8* pdata) {
+    u16 version = *reinterpret_cast<const u16*>(pdata);
+    return ((version >> 8) & DataBlockWriter::TS_REGULAR_FLAG) != 0;
+}
+
+static const ChunkDirectory* get_block_directory(const u8* pdata) {
+    u16 version = *reinterpret_cast<const u16*>(pdata);
+    if (((version >> 8) & DataBlockWriter::DIRECTORY_FLAG) == 0) {
+        return nullptr;
+    }
+    return reinterpret_cast<const ChunkDirectory*>(pdata + DataBlockWriter::HEADER_SIZE);
+}
+
 DataBlockReader::DataBlockReader(u8 const* buf, size_t bufsize)
     : begin_(buf)
-    , stream_(buf + DataBlockWriter::HEADER_SIZE, buf + bufsize)
-    , ts_stream_(stream_)
-    , val_stream_(stream_)
+    , stream_(buf + DataBlockWriter::HEADER_SIZE + (get_block_directory(buf) ? sizeof(ChunkDirectory) : 0),
+              buf + bufsize)
+    , ts_stream_(stream_, get_block_ts_regular(buf))
+    , val_stream_(stream_, get_block_codec(buf))
     , read_buffer_{}
+    , val_buffer_{}
     , read_index_(0)
+    , has_directory_(get_block_directory(buf) != nullptr)
 {
     assert(bufsize > 13);
 }
 
-static u16 get_block_version(const u8* pdata) {
-    u16 version = *reinterpret_cast<const u16*>(pdata);
-    return version;
+void DataBlockReader::start_chunk() {
+    u32 nchunk = read_index_ / CHUNK_SIZE;
+    if (has_directory_ && nchunk != 0 && nchunk % (1u << ChunkDirectory::RESTART_SHIFT) == 0) {
+        val_stream_.restart();
+    }
 }
 
 static u32 get_main_size(const u8* pdata) {
@@ -759,15 +1247,15 @@ static aku_ParamId get_block_id(const u8* pdata) {
 
 std::tuple<aku_Status, aku_Timestamp, double> DataBlockReader::next() {
     if (read_index_ < get_main_size(begin_)) {
-        auto chunk_index = read_index_++ & CHUNK_MASK;
+        auto chunk_index = read_index_ & CHUNK_MASK;
         if (chunk_index == 0) {
-            // read all timestamps
-            for (int i = 0; i < CHUNK_SIZE; i++) {
-                read_buffer_[i] = ts_stream_.next();
-            }
+            // read all timestamps and values
+            start_chunk();
+            ts_stream_.next_chunk(read_buffer_);
+            val_stream_.next_chunk(val_buffer_, CHUNK_SIZE);
         }
-        double value = val_stream_.next();
-        return std::make_tuple(AKU_SUCCESS, read_buffer_[chunk_index], value);
+        read_index_++;
+        return std::make_tuple(AKU_SUCCESS, read_buffer_[chunk_index], val_buffer_[chunk_index]);
     } else {
         // handle tail values
         if (read_index_ < get_total_size(begin_)) {
@@ -780,6 +1268,61 @@ std::tuple<aku_Status, aku_Timestamp, double> DataBlockReader::next() {
     return std::make_tuple(AKU_ENO_DATA, 0ull, 0.0);
 }
 
+std::tuple<aku_Status, size_t> DataBlockReader::read_batch(aku_Timestamp* destts, double* destxs, size_t size) {
+    const u32 main_size = get_main_size(begin_);
+    size_t nread = 0;
+    while (nread < size) {
+        if ((read_index_ & CHUNK_MASK) == 0 && read_index_ < main_size && size - nread >= CHUNK_SIZE) {
+            // Fast path, decode the whole chunk directly to destination
+            start_chunk();
+            ts_stream_.next_chunk(destts + nread);
+            val_stream_.next_chunk(destxs + nread, CHUNK_SIZE);
+            read_index_ += CHUNK_SIZE;
+            nread += CHUNK_SIZE;
+            continue;
+        }
+        aku_Status status;
+        aku_Timestamp ts;
+        double value;
+        std::tie(status, ts, value) = next();
+        if (status != AKU_SUCCESS) {
+            if (nread == 0) {
+                return std::make_tuple(status, 0);
+            }
+            break;
+        }
+        destts[nread] = ts;
+        destxs[nread] = value;
+        nread++;
+    }
+    return std::make_tuple(AKU_SUCCESS, nread);
+}
+
+size_t DataBlockReader::seek(aku_Timestamp ts) {
+    assert(read_index_ == 0);
+    const ChunkDirectory* directory = get_block_directory(begin_);
+    if (directory == nullptr) {
+        return 0;
+    }
+    // Find the last restart point that follows timestamp less than `ts`
+    int ix = -1;
+    for (int i = 0; i < directory->size; i++) {
+        if (directory->entries[i].prev_ts >= ts) {
+            break;
+        }
+        ix = i;
+    }
+    if (ix < 0) {
+        return 0;
+    }
+    ChunkDirectory::Entry const& entry = directory->entries[ix];
+    stream_ = VByteStreamReader(begin_ + entry.offset, stream_.end_);
+    ts_stream_.restart(entry.prev_ts);
+    val_stream_.restart();
+    read_index_ = (static_cast<u32>(ix + 1) << directory->shift) * CHUNK_SIZE;
+    return read_index_;
+}
+
 size_t DataBlockReader::nelements() const {
     return get_total_size(begin_);
 }
@@ -792,6 +1335,386 @@ u16 DataBlockReader::version() const {
     return get_block_version(begin_);
 }
 
+ValueCodec DataBlockReader::codec() const {
+    return get_block_codec(begin_);
+}
+
+// EventBlockWriter //
+
+EventBlockWriter::EventBlockWriter(aku_ParamId id, u8* buf, int size)
+    : begin_(buf)
+    , size_(size)
+    , id_(id)
+    , max_size_(HEADER_SIZE + 2*MAX_VARINT64)
+{
+    assert(size > HEADER_SIZE);
+}
+
+aku_Status EventBlockWriter::put(aku_Timestamp ts, const char* value, u32 size) {
+    // Worst case: new run of the timestamps (length and delta) and codes
+    const size_t element_size = 1 + MAX_VARINT64 + 1 + MAX_VARINT32;
+    if (timestamps_.size() == MAX_ELEMENTS) {
+        return AKU_EOVERFLOW;
+    }
+    std::string key(value, size);
+    auto it = index_.find(key);
+    size_t new_size = max_size_ + element_size;
+    if (it == index_.end()) {
+        new_size += 2*MAX_VARINT32 + size;
+    }
+    if (new_size > static_cast<size_t>(size_)) {
+        return AKU_EOVERFLOW;
+    }
+    if (it == index_.end()) {
+        it = index_.insert(std::make_pair(key, static_cast<u32>(values_.size()))).first;
+        values_.push_back(std::move(key));
+    }
+    timestamps_.push_back(ts);
+    codes_.push_back(it->second);
+    max_size_ = new_size;
+    return AKU_SUCCESS;
+}
+
+size_t EventBlockWriter::commit() {
+    Base128StreamWriter stream(begin_, begin_ + size_);
+    u16 version = static_cast<u16>(AKUMULI_VERSION & 0xFF) | static_cast<u16>(static_cast<u16>(ValueCodec::DICTIONARY) << 8);
+    bool success = stream.put_raw<u16>(version);
+    success = stream.put_raw<u16>(static_cast<u16>(timestamps_.size())) && success;
+    success = stream.put_raw<u16>(static_cast<u16>(values_.size())) && success;
+    success = stream.put_raw(id_) && success;
+    u16* codes_offset = stream.allocate<u16>();
+    u16* dict_offset = stream.allocate<u16>();
+    if (!success || codes_offset == nullptr || dict_offset == nullptr) {
+        AKU_PANIC("Buffer is too small (4)");
+    }
+    // Sorted dictionary, codes are remapped
+    std::vector<u32> order(values_.size());
+    for (u32 i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](u32 lhs, u32 rhs) {
+        return values_[lhs] < values_[rhs];
+    });
+    std::vector<u32> remap(values_.size());
+    for (u32 i = 0; i < order.size(); i++) {
+        remap[order[i]] = i;
+    }
+    {
+        DeltaRLEWriter ts_stream(stream);
+        for (auto ts: timestamps_) {
+            success = ts_stream.put(ts) && success;
+        }
+        success = ts_stream.commit() && success;
+    }
+    *codes_offset = static_cast<u16>(stream.size());
+    {
+        RLEStreamWriter<u32> code_stream(stream);
+        for (auto code: codes_) {
+            success = code_stream.put(remap[code]) && success;
+        }
+        success = code_stream.commit() && success;
+    }
+    *dict_offset = static_cast<u16>(stream.size());
+    const std::string* prev = nullptr;
+    for (auto ix: order) {
+        auto const& value = values_[ix];
+        u32 prefix = 0;
+        if (prev) {
+            auto limit = std::min(prev->size(), value.size());
+            while (prefix < limit && (*prev)[prefix] == value[prefix]) {
+                prefix++;
+            }
+        }
+        u32 suffix = static_cast<u32>(value.size()) - prefix;
+        success = stream.put(prefix) && stream.put(suffix) && success;
+        if (stream.space_left() < suffix) {
+            success = false;
+            break;
+        }
+        memcpy(stream.pos_, value.data() + prefix, suffix);
+        stream.pos_ += suffix;
+        prev = &value;
+    }
+    if (!success) {
+        // This can happen only if `put` estimates required space incorrectly
+        AKU_PANIC("Event block overflow");
+    }
+    return stream.size();
+}
+
+size_t EventBlockWriter::nelements() const {
+    return timestamps_.size();
+}
+
+// EventBlockReader //
+
+static u16 get_u16_field(const u8* buf, int offset) {
+    return *reinterpret_cast<const u16*>(buf + offset);
+}
+
+EventBlockReader::EventBlockReader(u8 const* buf, size_t bufsize)
+    : begin_(buf)
+    , end_(buf + bufsize)
+    , ts_input_(buf + EventBlockWriter::HEADER_SIZE, buf + get_u16_field(buf, 14))
+    , ts_stream_(ts_input_)
+    , code_input_(buf + get_u16_field(buf, 14), buf + get_u16_field(buf, 16))
+    , code_stream_(code_input_)
+    , read_index_(0)
+{
+    assert(bufsize > EventBlockWriter::HEADER_SIZE);
+    assert(static_cast<ValueCodec>(buf[1]) == ValueCodec::DICTIONARY);
+}
+
+std::tuple<aku_Status, aku_Timestamp, u32> EventBlockReader::next() {
+    if (read_index_ >= nelements()) {
+        return std::make_tuple(AKU_ENO_DATA, 0ull, 0u);
+    }
+    read_index_++;
+    aku_Timestamp ts = ts_stream_.next();
+    u32 code = code_stream_.next();
+    return std::make_tuple(AKU_SUCCESS, ts, code);
+}
+
+std::tuple<aku_Status, size_t> EventBlockReader::read_batch(aku_Timestamp* destts, u32* destcodes, size_t size) {
+    size_t n = std::min(size, nelements() - read_index_);
+    if (n == 0) {
+        return std::make_tuple(AKU_ENO_DATA, 0);
+    }
+    for (size_t i = 0; i < n; i++) {
+        destts[i] = ts_stream_.next();
+        destcodes[i] = code_stream_.next();
+    }
+    read_index_ += static_cast<u32>(n);
+    return std::make_tuple(AKU_SUCCESS, n);
+}
+
+const std::string* EventBlockReader::lookup(u32 code) {
+    if (code >= dictionary_size()) {
+        return nullptr;
+    }
+    if (dictionary_.empty()) {
+        // Front coded entries can only be decoded sequentially
+        Base128StreamReader stream(begin_ + get_u16_field(begin_, 16), end_);
+        dictionary_.resize(dictionary_size());
+        for (size_t i = 0; i < dictionary_.size(); i++) {
+            u32 prefix = stream.next<u32>();
+            u32 suffix = stream.next<u32>();
+            if ((i == 0 && prefix != 0) || (i != 0 && prefix > dictionary_[i - 1].size()) ||
+                stream.space_left() < suffix)
+            {
+                AKU_PANIC("can't read dictionary, out of bounds");
+            }
+            if (i != 0) {
+                dictionary_[i].assign(dictionary_[i - 1], 0, prefix);
+            }
+            dictionary_[i].append(reinterpret_cast<const char*>(stream.pos()), suffix);
+            stream.pos_ += suffix;
+        }
+    }
+    return &dictionary_[code];
+}
+
+size_t EventBlockReader::nelements() const {
+    return get_u16_field(begin_, 2);
+}
+
+size_t EventBlockReader::dictionary_size() const {
+    return get_u16_field(begin_, 4);
+}
+
+aku_ParamId EventBlockReader::get_id() const {
+    return *reinterpret_cast<const aku_ParamId*>(begin_ + 6);
+}
+
+// HistogramBlockWriter //
+
+static size_t base128_size(u64 value) {
+    size_t res = 1;
+    while (value >>= 7) {
+        res++;
+    }
+    return res;
+}
+
+static u64 zigzag(i64 value) {
+    return static_cast<u64>((value << 1) ^ (value >> 63));
+}
+
+size_t HistogramBlockWriter::ColumnSize::size() const {
+    // Last run is written on commit even if the column is empty
+    return complete + base128_size(reps) + base128_size(delta);
+}
+
+size_t HistogramBlockWriter::ColumnSize::size_with(u64 d) const {
+    if (reps == 0) {
+        return complete + base128_size(1) + base128_size(d);
+    }
+    if (d == delta) {
+        return complete + base128_size(reps + 1) + base128_size(delta);
+    }
+    return size() + base128_size(1) + base128_size(d);
+}
+
+void HistogramBlockWriter::ColumnSize::append(u64 d) {
+    if (reps != 0 && d == delta) {
+        reps++;
+        return;
+    }
+    if (reps != 0) {
+        complete += base128_size(reps) + base128_size(delta);
+    }
+    delta = d;
+    reps = 1;
+}
+
+HistogramBlockWriter::HistogramBlockWriter(aku_ParamId id, u8* buf, int size, std::vector<double> const& bounds)
+    : begin_(buf)
+    , size_(size)
+    , id_(id)
+    , bounds_(bounds)
+    , ts_size_{}
+    , bucket_size_(bounds.size(), ColumnSize{})
+    , max_size_(HEADER_SIZE + sizeof(double)*bounds.size())
+{
+    assert(bounds.size() <= MAX_BUCKETS);
+    assert(static_cast<size_t>(size) > max_size_);
+}
+
+size_t HistogramBlockWriter::encoded_size() const {
+    size_t total = max_size_ + ts_size_.size();
+    for (auto const& col: bucket_size_) {
+        total += col.size();
+    }
+    return total;
+}
+
+aku_Status HistogramBlockWriter::put(aku_Timestamp ts, u64 const* counts) {
+    if (timestamps_.size() == MAX_ELEMENTS) {
+        return AKU_EOVERFLOW;
+    }
+    u64 ts_delta = ts - ts_size_.prev;
+    size_t total = max_size_ + ts_size_.size_with(ts_delta);
+    for (size_t i = 0; i < bucket_size_.size(); i++) {
+        auto const& col = bucket_size_[i];
+        total += col.size_with(zigzag(static_cast<i64>(counts[i] - col.prev)));
+    }
+    if (total > static_cast<size_t>(size_)) {
+        return AKU_EOVERFLOW;
+    }
+    ts_size_.append(ts_delta);
+    ts_size_.prev = ts;
+    for (size_t i = 0; i < bucket_size_.size(); i++) {
+        auto& col = bucket_size_[i];
+        col.append(zigzag(static_cast<i64>(counts[i] - col.prev)));
+        col.prev = counts[i];
+    }
+    timestamps_.push_back(ts);
+    counts_.insert(counts_.end(), counts, counts + bounds_.size());
+    return AKU_SUCCESS;
+}
+
+size_t HistogramBlockWriter::commit() {
+    Base128StreamWriter stream(begin_, begin_ + size_);
+    u16 version = static_cast<u16>(AKUMULI_VERSION & 0xFF) | static_cast<u16>(static_cast<u16>(ValueCodec::HISTOGRAM) << 8);
+    bool success = stream.put_raw<u16>(version);
+    success = stream.put_raw<u16>(static_cast<u16>(timestamps_.size())) && success;
+    success = stream.put_raw<u16>(static_cast<u16>(bounds_.size())) && success;
+    success = stream.put_raw(id_) && success;
+    u16* buckets_offset = stream.allocate<u16>();
+    if (!success || buckets_offset == nullptr) {
+        AKU_PANIC("Buffer is too small (5)");
+    }
+    for (auto bound: bounds_) {
+        success = stream.put_raw(bound) && success;
+    }
+    {
+        DeltaRLEWriter ts_stream(stream);
+        for (auto ts: timestamps_) {
+            success = ts_stream.put(ts) && success;
+        }
+        success = ts_stream.commit() && success;
+    }
+    *buckets_offset = static_cast<u16>(stream.size());
+    const size_t nbuckets = bounds_.size();
+    for (size_t i = 0; i < nbuckets; i++) {
+        ZDeltaRLEWriter column(stream);
+        for (size_t j = 0; j < timestamps_.size(); j++) {
+            success = column.put(static_cast<i64>(counts_[j*nbuckets + i])) && success;
+        }
+        success = column.commit() && success;
+    }
+    if (!success || stream.size() != encoded_size()) {
+        // This can happen only if `put` estimates required space incorrectly
+        AKU_PANIC("Histogram block overflow");
+    }
+    return stream.size();
+}
+
+size_t HistogramBlockWriter::nelements() const {
+    return timestamps_.size();
+}
+
+// HistogramBlockReader //
+
+HistogramBlockReader::HistogramBlockReader(u8 const* buf, size_t bufsize)
+    : begin_(buf)
+    , read_index_(0)
+{
+    assert(bufsize > HistogramBlockWriter::HEADER_SIZE);
+    assert(static_cast<ValueCodec>(buf[1]) == ValueCodec::HISTOGRAM);
+    const size_t nbuckets = get_u16_field(buf, 4);
+    const size_t nelem = get_u16_field(buf, 2);
+    const u8* bounds = buf + HistogramBlockWriter::HEADER_SIZE;
+    const u8* buckets = buf + get_u16_field(buf, 14);
+    if (bounds + sizeof(double)*nbuckets > buckets || buckets > buf + bufsize) {
+        AKU_PANIC("can't read histogram block, out of bounds");
+    }
+    bounds_.resize(nbuckets);
+    memcpy(bounds_.data(), bounds, sizeof(double)*nbuckets);
+    Base128StreamReader ts_input(bounds + sizeof(double)*nbuckets, buckets);
+    DeltaRLEReader ts_stream(ts_input);
+    timestamps_.resize(nelem);
+    for (auto& ts: timestamps_) {
+        ts = ts_stream.next();
+    }
+    // Columns are stored one after another
+    Base128StreamReader input(buckets, buf + bufsize);
+    counts_.resize(nelem*nbuckets);
+    for (size_t i = 0; i < nbuckets; i++) {
+        ZDeltaRLEReader column(input);
+        for (size_t j = 0; j < nelem; j++) {
+            counts_[j*nbuckets + i] = static_cast<u64>(column.next());
+        }
+    }
+}
+
+aku_Status HistogramBlockReader::next(aku_Timestamp* ts, u64* counts) {
+    if (read_index_ >= timestamps_.size()) {
+        return AKU_ENO_DATA;
+    }
+    const size_t nbuckets = bounds_.size();
+    *ts = timestamps_[read_index_];
+    std::copy(counts_.begin() + read_index_*nbuckets, counts_.begin() + (read_index_ + 1)*nbuckets, counts);
+    read_index_++;
+    return AKU_SUCCESS;
+}
+
+std::vector<double> const& HistogramBlockReader::bounds() const {
+    return bounds_;
+}
+
+size_t HistogramBlockReader::nbuckets() const {
+    return bounds_.size();
+}
+
+size_t HistogramBlockReader::nelements() const {
+    return timestamps_.size();
+}
+
+aku_ParamId HistogramBlockReader::get_id() const {
+    return *reinterpret_cast<const aku_ParamId*>(begin_ + 6);
+}
+
 }
 
 }
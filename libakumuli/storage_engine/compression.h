@@ -25,10 +25,14 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <iterator>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <tuple>
+#include <type_traits>
 
 #include "akumuli.h"
 #include "util.h"
@@ -107,7 +111,7 @@ public:
             return begin;
         }
 
-        TVal           value = value_;
+        auto           value = static_cast<typename std::make_unsigned<TVal>::type>(value_);
         unsigned char* p     = begin;
 
         while (true) {
@@ -126,10 +130,32 @@ public:
         return p;
     }
 
+    //! Max size of the encoded value in bytes
+    static constexpr size_t max_size() { return (sizeof(TVal) * 8 + 6) / 7; }
+
+    /** Write base 128 encoded integer without bounds checks, at least
+      * `max_size()` bytes should be available.
+      * @returns iterator to next free region
+      */
+    unsigned char* put_unchecked(unsigned char* p) const {
+        auto value = static_cast<typename std::make_unsigned<TVal>::type>(value_);
+        while (value > 0x7F) {
+            *p++ = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        *p++ = static_cast<unsigned char>(value);
+        return p;
+    }
+
     //! turn into integer
     operator TVal() const { return value_; }
 };
 
+//! Identity transform, first stage of the fused codec stack
+struct IdentityTransform {
+    template <class TVal> TVal operator()(TVal value) const { return value; }
+};
+
 //! Base128 encoder
 struct Base128StreamWriter {
     // underlying memory region
@@ -151,9 +177,25 @@ struct Base128StreamWriter {
 
     //! Put value into stream (transactional).
     template <class TVal> bool tput(TVal const* iter, size_t n) {
+        return tput_map(iter, n, IdentityTransform());
+    }
+
+    /** Put values transformed by `fn` into stream (transactional).
+      * Capacity is checked once for the whole chunk, values are written
+      * without bounds checks if the worst case fits into the stream.
+      * Function `fn` is called once for every value in order.
+      */
+    template <class TVal, class Fn> bool tput_map(TVal const* iter, size_t n, Fn const& fn) {
+        typedef decltype(fn(*iter)) TOut;
+        if (space_left() >= n * Base128Int<TOut>::max_size()) {
+            for (size_t i = 0; i < n; i++) {
+                put_unchecked<TOut>(fn(iter[i]));
+            }
+            return commit();  // no-op
+        }
         auto oldpos = pos_;
         for (size_t i = 0; i < n; i++) {
-            if (!put(iter[i])) {
+            if (!put(fn(iter[i]))) {
                 // restore old pos_ value
                 pos_ = oldpos;
                 return false;
@@ -173,6 +215,11 @@ struct Base128StreamWriter {
         return true;
     }
 
+    //! Put value into stream without bounds check (see `Base128Int::max_size`)
+    template <class TVal> void put_unchecked(TVal value) {
+        pos_ = Base128Int<TVal>(value).put_unchecked(pos_);
+    }
+
     template <class TVal> bool put_raw(TVal value) {
         if ((end_ - pos_) < (int)sizeof(TVal)) {
             return false;
@@ -297,24 +344,39 @@ struct VByteStreamWriter {
 
     bool empty() const { return begin_ == end_; }
 
-    //! Perform combined write (TVal should be integer)
-    template<class TVal> bool encode(TVal fst, TVal snd) {
+    //! Size of the value in bytes (TVal should be unsigned integer)
+    template<class TVal> static int byte_length(TVal value) {
         static_assert(sizeof(TVal) <= 8, "Value is to large");
-        int fstlen = 8*sizeof(TVal);
-        int sndlen = 8*sizeof(TVal);
-        if (fst) {
-            fstlen = __builtin_clzl(fst);
-        }
-        if (snd) {
-            sndlen = __builtin_clzl(snd);
+        if (value == 0) {
+            return 0;
         }
-        int fstctrl = sizeof(TVal) - fstlen / 8;  // value should be in 0-8 range
-        int sndctrl = sizeof(TVal) - sndlen / 8;  // value should be in 0-8 range
-        u8 ctrlword = static_cast<u8>(fstctrl | (sndctrl << 4));
+        // Leading zeroes are counted in 64-bit word, u32 values have 32 extra zeroes
+        int nlz = __builtin_clzll(static_cast<u64>(value)) - static_cast<int>(64 - 8*sizeof(TVal));
+        return static_cast<int>(sizeof(TVal)) - nlz / 8;  // value should be in 0-8 range
+    }
+
+    //! Max number of bytes produced by `tput` for chunk of `n` values
+    template<class TVal> static constexpr size_t max_chunk_size(size_t n) {
+        return n / 2 + n * sizeof(TVal);
+    }
+
+    //! Perform combined write (TVal should be integer)
+    template<class TVal> bool encode(TVal fst, TVal snd) {
         // Check size
-        if (space_left() < static_cast<size_t>(1 + fstctrl + sndctrl)) {
+        if (space_left() < static_cast<size_t>(1 + byte_length(fst) + byte_length(snd))) {
             return false;
         }
+        encode_unchecked(fst, snd);
+        return true;
+    }
+
+    /** Perform combined write without bounds check, at least
+      * `max_chunk_size<TVal>(2)` bytes should be available.
+      */
+    template<class TVal> void encode_unchecked(TVal fst, TVal snd) {
+        int fstctrl = byte_length(fst);
+        int sndctrl = byte_length(snd);
+        u8 ctrlword = static_cast<u8>(fstctrl | (sndctrl << 4));
         // Write ctrl world
         *pos_++ = ctrlword;
         for (int i = 0; i < fstctrl; i++) {
@@ -325,7 +387,6 @@ struct VByteStreamWriter {
             *pos_++ = static_cast<u8>(snd);
             snd >>= 8;
         }
-        return true;
     }
 
     /** This method is used by DeltaDelta coding.
@@ -339,7 +400,12 @@ struct VByteStreamWriter {
         pos_ = p;
         return true;
     }
-    
+
+    //! Write base128 value without bounds check (see `Base128Int::max_size`)
+    template<class TVal> void put_base128_unchecked(TVal value) {
+        pos_ = Base128Int<TVal>(value).put_unchecked(pos_);
+    }
+
     bool shortcut() {
         // put sentinel
         if (space_left() == 0) {
@@ -352,25 +418,40 @@ struct VByteStreamWriter {
     /** Put value into stream (transactional).
       */
     template <class TVal> bool tput(TVal const* iter, size_t n) {
+        return tput_map(iter, n, IdentityTransform());
+    }
+
+    /** Put values transformed by `fn` into stream (transactional).
+      * Capacity is checked once for the whole chunk, pairs are written
+      * without bounds checks if the worst case fits into the stream.
+      * Function `fn` can be called more than once for every value.
+      */
+    template <class TVal, class Fn> bool tput_map(TVal const* iter, size_t n, Fn const& fn) {
+        typedef decltype(fn(*iter)) TOut;
         assert(n % 2 == 0);  // n expected to be eq 16 
-        auto oldpos = pos_;
         // Fast path for DeltaDelta encoding
         bool take_shortcut = true;
         for (u32 i = 0; i < n; i++) {
-            if (iter[i] != 0) {
+            if (fn(iter[i]) != 0) {
                 take_shortcut = false;
                 break;
             }
         }
         if (take_shortcut) {
             return shortcut();
-        } else {
+        }
+        if (space_left() >= max_chunk_size<TOut>(n)) {
             for (u32 i = 0; i < n; i+=2) {
-                if (!encode(iter[i], iter[i+1])) {
-                    // restore old pos_ value
-                    pos_ = oldpos;
-                    return false;
-                }
+                encode_unchecked<TOut>(fn(iter[i]), fn(iter[i+1]));
+            }
+            return true;
+        }
+        auto oldpos = pos_;
+        for (u32 i = 0; i < n; i+=2) {
+            if (!encode<TOut>(fn(iter[i]), fn(iter[i+1]))) {
+                // restore old pos_ value
+                pos_ = oldpos;
+                return false;
             }
         }
         return true;
@@ -389,6 +470,7 @@ struct VByteStreamWriter {
             u64 uint;
         } prev;
         if (cnt_ % 2 != 0) {
+            prev.uint = 0;
             prev.val = value;
             prev_ = prev.uint;
         } else {
@@ -450,6 +532,28 @@ struct VByteStreamWriter {
     }
 };
 
+/** Stream adapter that writes without bounds checks. Every method returns true
+  * so the checks of the generic encoders (templated over the stream type) are
+  * optimized out. Caller should check that the whole chunk fits into the stream.
+  */
+template <class Stream> struct UncheckedStreamWriter {
+    Stream& stream_;
+
+    UncheckedStreamWriter(Stream& stream)
+        : stream_(stream) {}
+
+    template <class TVal> bool put_raw(TVal value) {
+        memcpy(stream_.pos_, &value, sizeof(value));
+        stream_.pos_ += sizeof(value);
+        return true;
+    }
+
+    template <class TVal> bool put_base128(TVal value) {
+        stream_.pos_ = Base128Int<TVal>(value).put_unchecked(stream_.pos_);
+        return true;
+    }
+};
+
 
 //! Base128 decoder
 struct VByteStreamReader {
@@ -502,6 +606,60 @@ struct VByteStreamReader {
         return acc;
     }
 
+    /** Read N values at once. Should be used to read the whole chunk of values
+      * (N elements written by one `tput` call). Produces the same result as N
+      * sequential `next` calls.
+      */
+    template <class TVal, size_t N>
+    void next_chunk(TVal* dest) {
+        static_assert(N % 2 == 0, "N should be even");
+        if (scut_elements_ != 0 || cnt_ % 2 != 0) {
+            // Slow path, previous chunk is not completed
+            for (size_t i = 0; i < N; i++) {
+                dest[i] = next<TVal>();
+            }
+            return;
+        }
+        for (size_t i = 0; i < N; i += 2) {
+            ctrl_ = read_raw<u8>();
+            if ((ctrl_ >> 4) == 0xF) {
+                // Shortcut, all elements of the chunk are zeroes
+                scut_elements_ = CHUNK_SIZE-1;
+                cnt_++;
+                dest[i] = 0;
+                for (size_t j = i + 1; j < N; j++) {
+                    dest[j] = next<TVal>();
+                }
+                return;
+            }
+            dest[i]     = read_bytes<TVal>(ctrl_ & 0xF);
+            dest[i + 1] = read_bytes<TVal>(ctrl_ >> 4);
+            cnt_ += 2;
+        }
+    }
+
+    //! Read `bytelen` bytes wide value (little endian)
+    template <class TVal> TVal read_bytes(int bytelen) {
+        if (space_left() < static_cast<size_t>(bytelen)) {
+            AKU_PANIC("can't read value, out of bounds");
+        }
+        TVal acc = {};
+        if (space_left() >= sizeof(u64) && sizeof(TVal) == sizeof(u64)) {
+            // Fast path, single unaligned load
+            u64 word;
+            memcpy(&word, pos_, sizeof(word));
+            acc = static_cast<TVal>(bytelen == 8 ? word : word & ((1ull << (bytelen*8)) - 1));
+            pos_ += bytelen;
+            return acc;
+        }
+        for(int i = 0; i < bytelen*8; i += 8) {
+            TVal byte = *pos_;
+            acc |= (byte << i);
+            pos_++;
+        }
+        return acc;
+    }
+
     template <class TVal> TVal next_base128() {
         Base128Int<TVal> value;
         auto             p = value.get(pos_, end_);
@@ -535,23 +693,22 @@ template <class Stream, class TVal> struct ZigZagStreamWriter {
         : stream_(stream) {}
 
     bool tput(TVal const* iter, size_t n) {
-        assert(n < 1000);  // 1000 is too high for most uses but it woun't cause stack overflow
-        TVal outbuf[n];
-        memset(outbuf, 0, n);
-        for (size_t i = 0; i < n; i++) {
-            auto      value       = iter[i];
-            const int shift_width = sizeof(TVal) * 8 - 1;
-            auto      res         = (value << 1) ^ (value >> shift_width);
-            outbuf[i]             = res;
-        }
-        return stream_.tput(outbuf, n);
+        return tput_map(iter, n, IdentityTransform());
+    }
+
+    //! Put values transformed by `fn` into stream, zigzag encoding is fused into the next stage
+    template <class Fn> bool tput_map(TVal const* iter, size_t n, Fn const& fn) {
+        return stream_.tput_map(iter, n, [&fn](TVal value) { return encode(fn(value)); });
     }
 
     bool put(TVal value) {
+        return stream_.put(encode(value));
+    }
+
+    static TVal encode(TVal value) {
         // TVal should be signed
         const int shift_width = sizeof(TVal) * 8 - 1;
-        auto      res         = (value << 1) ^ (value >> shift_width);
-        return stream_.put(res);
+        return static_cast<TVal>((value << 1) ^ (value >> shift_width));
     }
 
     size_t size() const { return stream_.size(); }
@@ -567,7 +724,8 @@ template <class Stream, class TVal> struct ZigZagStreamReader {
 
     TVal next() {
         auto n = stream_.next();
-        return (n >> 1) ^ (-(n & 1));
+        typedef typename std::make_unsigned<TVal>::type TUnsigned;
+        return static_cast<TVal>(static_cast<TUnsigned>(n) >> 1) ^ (-(n & 1));
     }
 
     const unsigned char* pos() const { return stream_.pos(); }
@@ -584,16 +742,19 @@ template <class Stream, typename TVal> struct DeltaStreamWriter {
     {}
 
     bool tput(TVal const* iter, size_t n) {
-        assert(n < 1000);
-        TVal outbuf[n];
-        memset(outbuf, 0, n);
-        for (size_t i = 0; i < n; i++) {
-            auto value  = iter[i];
-            auto result = static_cast<TVal>(value) - prev_;
-            outbuf[i]   = result;
+        return tput_map(iter, n, IdentityTransform());
+    }
+
+    /** Put values transformed by `fn` into stream, delta encoding is fused into the next stage.
+      * The transform is stateful, next stage should call it once for every value in order.
+      */
+    template <class Fn> bool tput_map(TVal const* iter, size_t n, Fn const& fn) {
+        return stream_.tput_map(iter, n, [this, &fn](TVal value) {
+            value       = fn(value);
+            auto result = static_cast<TVal>(value - prev_);
             prev_       = value;
-        }
-        return stream_.tput(outbuf, n);
+            return result;
+        });
     }
 
     bool put(TVal value) {
@@ -640,22 +801,25 @@ template <size_t Step, typename TVal> struct DeltaDeltaStreamWriter {
 
     bool tput(TVal const* iter, size_t n) {
         assert(n == Step);
-        TVal outbuf[n];
+        TVal outbuf[Step];
         TVal min = iter[0] - prev_;
-        for (size_t i = 0; i < n; i++) {
+        for (size_t i = 0; i < Step; i++) {
             auto value  = iter[i];
             auto result = value - prev_;
             outbuf[i]   = result;
             prev_       = value;
             min         = std::min(result, min);
         }
+        auto oldpos = stream_.pos_;
         if (!stream_.put_base128(min)) {
             return false;
         }
-        for (size_t i = 0; i < n; i++) {
-            outbuf[i] -= min;
+        // Subtraction of the min value is fused into the vbyte encoder
+        if (!stream_.tput_map(outbuf, Step, [min](TVal delta) { return static_cast<TVal>(delta - min); })) {
+            stream_.pos_ = oldpos;
+            return false;
         }
-        return stream_.tput(outbuf, n);
+        return true;
     }
 
     bool put(TVal value) {
@@ -702,6 +866,153 @@ template <size_t Step, typename TVal> struct DeltaDeltaStreamReader {
         return value;
     }
 
+    /** Read `Step` values at once. Should be called at the beginning of
+      * the step (when `next` wasn't called or was called N*Step times).
+      */
+    void next_chunk(TVal* dest) {
+        assert(counter_ % Step == 0);
+        min_ = stream_.next_base128<TVal>();
+        stream_.next_chunk<TVal, Step>(dest);
+        TVal acc = prev_;
+        for (size_t i = 0; i < Step; i++) {
+            acc += dest[i] + min_;
+            dest[i] = acc;
+        }
+        prev_     = acc;
+        counter_ += Step;
+    }
+
+    const unsigned char* pos() const { return stream_.pos(); }
+};
+
+/** Delta-delta encoder that stores runs of regular chunks as start/interval/count.
+  * Every chunk starts with a control byte. Zero means that the chunk is encoded
+  * using DeltaDeltaStreamWriter. One means that the chunk starts a regular run,
+  * the control byte is followed by the first delta, the interval and the number
+  * of chunks in the run (raw u16). Subsequent chunks with the same interval only
+  * increment the counter and don't take any space.
+  */
+template <size_t Step, typename TVal> struct RegularDeltaDeltaStreamWriter {
+    enum {
+        CHUNK_DELTA_DELTA = 0,
+        CHUNK_REGULAR_RUN = 1,
+    };
+    VByteStreamWriter&                 stream_;
+    DeltaDeltaStreamWriter<Step, TVal> delta_;
+    //! Run length of the current run (nullptr if the last chunk wasn't regular)
+    u16*                               run_length_;
+    TVal                               interval_;
+
+    RegularDeltaDeltaStreamWriter(VByteStreamWriter& stream)
+        : stream_(stream)
+        , delta_(stream)
+        , run_length_(nullptr)
+        , interval_() {}
+
+    bool tput(TVal const* iter, size_t n) {
+        assert(n == Step);
+        TVal first = iter[0] - delta_.prev_;
+        TVal interval = iter[1] - iter[0];
+        bool regular = true;
+        for (size_t i = 2; i < n; i++) {
+            if (iter[i] - iter[i - 1] != interval) {
+                regular = false;
+                break;
+            }
+        }
+        if (regular && run_length_ != nullptr && first == interval_ && interval == interval_
+                    && *run_length_ != 0xFFFF) {
+            // Continue the run
+            *run_length_ += 1;
+            delta_.prev_ = iter[n - 1];
+            return true;
+        }
+        run_length_ = nullptr;
+        auto oldpos = stream_.pos_;
+        if (regular) {
+            if (stream_.put_raw<u8>(CHUNK_REGULAR_RUN) && stream_.put_base128(first)
+                                                       && stream_.put_base128(interval)) {
+                run_length_ = stream_.allocate<u16>();
+            }
+            if (run_length_ == nullptr) {
+                stream_.pos_ = oldpos;
+                return false;
+            }
+            *run_length_ = 1;
+            interval_    = interval;
+            delta_.prev_ = iter[n - 1];
+            return true;
+        }
+        if (!stream_.put_raw<u8>(CHUNK_DELTA_DELTA)) {
+            return false;
+        }
+        return delta_.tput(iter, n);
+    }
+
+    //! Start a new run on the next chunk (reader can start decoding from this point)
+    void restart() { run_length_ = nullptr; }
+
+    size_t size() const { return stream_.size(); }
+
+    bool commit() { return stream_.commit(); }
+};
+
+/** Decoder for RegularDeltaDeltaStreamWriter. If `regular` is false the stream is
+  * decoded as a plain delta-delta stream (data blocks written by older versions).
+  */
+template <size_t Step, typename TVal> struct RegularDeltaDeltaStreamReader {
+    VByteStreamReader&                 stream_;
+    DeltaDeltaStreamReader<Step, TVal> delta_;
+    bool                               regular_;
+    //! Number of chunks left in the current run
+    u32                                run_left_;
+    TVal                               interval_;
+
+    RegularDeltaDeltaStreamReader(VByteStreamReader& stream, bool regular)
+        : stream_(stream)
+        , delta_(stream)
+        , regular_(regular)
+        , run_left_(0)
+        , interval_() {}
+
+    //! Read `Step` values at once
+    void next_chunk(TVal* dest) {
+        TVal first = interval_;
+        if (regular_ && run_left_ == 0) {
+            auto ctrl = stream_.read_raw<u8>();
+            if (ctrl == RegularDeltaDeltaStreamWriter<Step, TVal>::CHUNK_DELTA_DELTA) {
+                delta_.next_chunk(dest);
+                return;
+            }
+            if (ctrl != RegularDeltaDeltaStreamWriter<Step, TVal>::CHUNK_REGULAR_RUN) {
+                AKU_PANIC("can't read value, bad chunk type");
+            }
+            first     = stream_.next_base128<TVal>();
+            interval_ = stream_.next_base128<TVal>();
+            run_left_ = stream_.read_raw<u16>();
+        } else if (run_left_ == 0) {
+            delta_.next_chunk(dest);
+            return;
+        }
+        TVal acc = delta_.prev_ + first;
+        for (size_t i = 0; i < Step; i++) {
+            dest[i] = acc;
+            acc += interval_;
+        }
+        delta_.prev_     = dest[Step - 1];
+        delta_.counter_ += Step;
+        run_left_--;
+    }
+
+    /** Continue decoding from the restart point.
+      * @param prev is a last timestamp before the restart point
+      */
+    void restart(TVal prev) {
+        delta_.prev_    = prev;
+        delta_.counter_ = 0;
+        run_left_       = 0;
+    }
+
     const unsigned char* pos() const { return stream_.pos(); }
 };
 
@@ -718,16 +1029,37 @@ template <typename TVal> struct RLEStreamWriter {
         , start_size_(stream.size()) {}
 
     bool tput(TVal const* iter, size_t n) {
+        return tput_map(iter, n, IdentityTransform());
+    }
+
+    /** Put values transformed by `fn` into stream (transactional).
+      * Runs are written directly to the stream if the worst case (every
+      * value starts a new run) fits, otherwise they're buffered first.
+      */
+    template <class Fn> bool tput_map(TVal const* iter, size_t n, Fn const& fn) {
+        if (stream_.space_left() >= n * 2 * Base128Int<TVal>::max_size()) {
+            encode_runs(iter, n, fn, [this](TVal value) { stream_.put_unchecked(value); });
+            return stream_.commit();
+        }
         size_t outpos = 0;
         TVal   outbuf[n * 2];
-        memset(outbuf, 0, n);
+        encode_runs(iter, n, fn, [&](TVal value) { outbuf[outpos++] = value; });
+        // continue
+        return stream_.tput(outbuf, outpos);
+    }
+
+    //! Split chunk into (reps, value) pairs, every pair is passed to `sink`
+    template <class Fn, class Sink>
+    void encode_runs(TVal const* iter, size_t n, Fn const& fn, Sink const& sink) {
+        size_t outpos = 0;
         for (size_t i = 0; i < n; i++) {
-            auto value = iter[i];
+            TVal value = fn(iter[i]);
             if (value != prev_) {
                 if (reps_) {
                     // commit changes
-                    outbuf[outpos++] = reps_;
-                    outbuf[outpos++] = prev_;
+                    sink(reps_);
+                    sink(prev_);
+                    outpos += 2;
                 }
                 prev_ = value;
                 reps_ = TVal();
@@ -736,13 +1068,11 @@ template <typename TVal> struct RLEStreamWriter {
         }
         // commit RLE if needed
         if (outpos < n * 2) {
-            outbuf[outpos++] = reps_;
-            outbuf[outpos++] = prev_;
+            sink(reps_);
+            sink(prev_);
         }
         prev_ = TVal();
         reps_ = TVal();
-        // continue
-        return stream_.tput(outbuf, outpos);
     }
 
     bool put(TVal value) {
@@ -799,6 +1129,9 @@ struct SimplePredictor {
     u64 predict_next() const;
 
     void update(u64 value);
+
+    //! Return predictor to the initial state
+    void reset();
 };
 
 struct FcmPredictor {
@@ -811,6 +1144,9 @@ struct FcmPredictor {
     u64 predict_next() const;
 
     void update(u64 value);
+
+    //! Return predictor to the initial state
+    void reset();
 };
 
 struct DfcmPredictor {
@@ -825,6 +1161,9 @@ struct DfcmPredictor {
     u64 predict_next() const;
 
     void update(u64 value);
+
+    //! Return predictor to the initial state
+    void reset();
 };
 
 // 2nd order DFCM predictor
@@ -859,6 +1198,19 @@ struct FcmStreamWriter {
 
     inline std::tuple<u64, unsigned char> encode(double value);
 
+    //! Compute control flag for the diff value (0xF is returned for zero diff).
+    static unsigned char diff_flag(u64 diff);
+
+    //! Compute size of the chunk that `write_chunk` will produce.
+    static size_t chunk_size(u64 const* diffs, const u8* flags, size_t n);
+
+    /** Write chunk of precomputed diffs to the stream.
+      * @param diffs is an array of diffs
+      * @param flags is an array of control flags (output of the `diff_flag` function)
+      * @param n is a size of both arrays
+      */
+    bool write_chunk(u64 const* diffs, const u8* flags, size_t n);
+
     bool tput(double const* values, size_t n);
 
     bool put(double value);
@@ -884,6 +1236,72 @@ struct FcmStreamReader {
 };
 
 
+/** Value codec id.
+  * Block level codec is stored in the data block header. The adaptive
+  * codec picks the most compact encoding for every chunk of values and
+  * stores the id of the chosen codec before the chunk.
+  */
+enum class ValueCodec : u8 {
+    FCM      = 0,  //! FCM/DFCM predictor, used by all blocks written by older versions
+    XOR      = 1,  //! XOR with the previous value (byte aligned Gorilla encoding)
+    DELTA    = 2,  //! Delta-encoded integers (ZigZag + Base128), only for integer values
+    CONST    = 3,  //! Constant run, the value is stored once
+    ADAPTIVE = 4,  //! Per-chunk selection
+    SCALED   = 5,  //! Decimal fractions stored as delta-encoded integers (value * 10^digits)
+    DICTIONARY = 6,  //! Dictionary codes of the event values (see EventBlockWriter)
+    HISTOGRAM  = 7,  //! Bucket counts of the histogram series (see HistogramBlockWriter)
+};
+
+enum {
+    //! Max number of decimal digits of the value precision hint (and SCALED codec)
+    AKU_MAX_PRECISION = 9,
+};
+
+/** Round value to `digits` decimal digits after the point. Result is exactly
+  * representable by the SCALED codec. Values that are too large (or NaN) are
+  * returned as is.
+  * @param value is a value to round
+  * @param digits is a number of decimal digits, should be less or equal to AKU_MAX_PRECISION
+  */
+double quantize_value(double value, int digits);
+
+//! Double to FCM/XOR/Delta/Const encoder
+struct AdaptiveStreamWriter {
+    VByteStreamWriter&   stream_;
+    FcmStreamWriter      fcm_;
+    ValueCodec           codec_;
+    u64                  prev_bits_;
+
+    /** C-tor
+      * @param stream is an output stream
+      * @param codec is a block-level codec, should be FCM or ADAPTIVE
+      */
+    AdaptiveStreamWriter(VByteStreamWriter& stream, ValueCodec codec);
+
+    //! Write chunk of `n` values (n should be equal to 16)
+    bool tput(double const* values, size_t n);
+
+    //! Reset predictor state before the next chunk (reader can start decoding from this point)
+    void restart();
+};
+
+//! FCM/XOR/Delta/Const to double decoder
+struct AdaptiveStreamReader {
+    VByteStreamReader&   stream_;
+    FcmStreamReader      fcm_;
+    ValueCodec           codec_;
+    u64                  prev_bits_;
+
+    AdaptiveStreamReader(VByteStreamReader& stream, ValueCodec codec);
+
+    //! Read chunk of `n` values (should match `n` used by the writer)
+    void next_chunk(double* dest, size_t n);
+
+    //! Continue decoding from the restart point
+    void restart();
+};
+
+
 //! SeriesSlice represents consiquent data points from one series
 struct SeriesSlice {
     //! Series id
@@ -975,23 +1393,55 @@ typedef DeltaStreamReader<RLEStreamReader<u64>, u64> DeltaRLEReader;
 typedef DeltaDeltaStreamReader<16, u64> DeltaDeltaReader;
 typedef DeltaDeltaStreamWriter<16, u64> DeltaDeltaWriter;
 
+typedef RegularDeltaDeltaStreamReader<16, u64> RegularDeltaDeltaReader;
+typedef RegularDeltaDeltaStreamWriter<16, u64> RegularDeltaDeltaWriter;
+
 
 namespace StorageEngine {
 
+/** Chunk directory of the data block.
+  * Every `1 << RESTART_SHIFT` chunks the writer resets the state of the timestamp
+  * and value encoders, so the reader can start decoding from there. Every `1 << shift`
+  * chunks the position of the restart point is recorded in the directory. When the
+  * directory is full the interval is doubled and every other entry is dropped.
+  */
+struct ChunkDirectory {
+    enum {
+        NENTRIES = 8,
+        RESTART_SHIFT = 4,  // restart every 16 chunks
+    };
+    struct Entry {
+        //! Last timestamp before the restart point
+        aku_Timestamp prev_ts;
+        //! Offset of the chunk from the beginning of the block
+        u16 offset;
+    } __attribute__((packed));
+    //! Number of used entries, entry `i` points to the chunk `(i + 1) << shift`
+    u8 size;
+    //! Log2 of the restart interval (in chunks)
+    u8 shift;
+    Entry entries[NENTRIES];
+} __attribute__((packed));
+
 struct DataBlockWriter {
     enum {
         CHUNK_SIZE  = 16,
         CHUNK_MASK  = 15,
-        HEADER_SIZE = 14,  // 2 (version) + 2 (nchunks) + 2 (tail size) + 8 (series id)
+        HEADER_SIZE = 14,  // 2 (version and codec) + 2 (nchunks) + 2 (tail size) + 8 (series id)
+        CHUNK_MARGIN = 10*16 + 9*16 + 2,  // worst case size of the compressed chunk
+        CODEC_MASK = 0x3F,     // value codec bits of the codec byte
+        TS_REGULAR_FLAG = 0x80,  // timestamps are encoded using RegularDeltaDeltaWriter
+        DIRECTORY_FLAG = 0x40,  // header is followed by the ChunkDirectory
     };
     VByteStreamWriter   stream_;
-    DeltaDeltaWriter    ts_stream_;
-    FcmStreamWriter     val_stream_;
+    RegularDeltaDeltaWriter ts_stream_;
+    AdaptiveStreamWriter val_stream_;
     int                 write_index_;
     aku_Timestamp       ts_writebuf_[CHUNK_SIZE];   //! Write buffer for timestamps
     double              val_writebuf_[CHUNK_SIZE];  //! Write buffer for values
     u16*                nchunks_;
     u16*                ntail_;
+    ChunkDirectory*     directory_;
 
     //! Empty c-tor. Constructs unwritable object.
     DataBlockWriter();
@@ -1000,8 +1450,9 @@ struct DataBlockWriter {
       * @param id Series id.
       * @param size Block size.
       * @param buf Pointer to buffer.
+      * @param codec Value codec (FCM or ADAPTIVE).
       */
-    DataBlockWriter(aku_ParamId id, u8* buf, int size);
+    DataBlockWriter(aku_ParamId id, u8* buf, int size, ValueCodec codec = ValueCodec::ADAPTIVE);
 
     /** Append value to block.
       * @param ts Timestamp.
@@ -1010,6 +1461,15 @@ struct DataBlockWriter {
       */
     aku_Status put(aku_Timestamp ts, double value);
 
+    /** Append several values to block.
+      * Whole chunks are written directly to the output stream bypassing the write buffer.
+      * @param ts Array of timestamps.
+      * @param xs Array of values.
+      * @param size Size of both arrays.
+      * @return number of values written (less than `size` if block is full).
+      */
+    size_t put_range(aku_Timestamp const* ts, double const* xs, size_t size);
+
     size_t commit();
 
     //! Read tail elements (the ones not yet written to output stream)
@@ -1018,9 +1478,22 @@ struct DataBlockWriter {
 
     int get_write_index() const;
 
+    /** Move writer to another buffer. Can be called only if nothing
+      * was compressed yet (all values are in the write buffer).
+      * @param buf Pointer to the new buffer.
+      * @param size Size of the new buffer.
+      */
+    void relocate(u8* buf, int size);
+
 private:
     //! Return true if there is enough free space to store `CHUNK_SIZE` compressed values
     bool room_for_chunk() const;
+
+    //! Write block header to the stream
+    void init_header(aku_ParamId id, ValueCodec codec);
+
+    //! Should be called before the chunk is written, adds restart point if needed
+    void add_restart_point();
 };
 
 struct DataBlockReader {
@@ -1030,20 +1503,223 @@ struct DataBlockReader {
     };
     const u8*           begin_;
     VByteStreamReader   stream_;
-    DeltaDeltaReader    ts_stream_;
-    FcmStreamReader     val_stream_;
+    RegularDeltaDeltaReader ts_stream_;
+    AdaptiveStreamReader val_stream_;
     aku_Timestamp       read_buffer_[CHUNK_SIZE];
+    double              val_buffer_[CHUNK_SIZE];
     u32                 read_index_;
+    bool                has_directory_;
 
     DataBlockReader(u8 const* buf, size_t bufsize);
 
     std::tuple<aku_Status, aku_Timestamp, double> next();
 
+    /** Read several values at once.
+      * @param destts is a timestamps destination
+      * @param destxs is a values destination
+      * @param size is a size of both arrays
+      * @return status and number of elements read (AKU_ENO_DATA if nothing was read)
+      */
+    std::tuple<aku_Status, size_t> read_batch(aku_Timestamp* destts, double* destxs, size_t size);
+
+    /** Skip chunks that contain only timestamps less than `ts` using the chunk directory.
+      * Should be called before anything was read. Skipped elements are not returned
+      * by `next` and `read_batch`, `nelements` is not affected.
+      * @return number of skipped elements
+      */
+    size_t seek(aku_Timestamp ts);
+
     size_t nelements() const;
 
     aku_ParamId get_id() const;
 
     u16 version() const;
+
+    //! Return block level value codec
+    ValueCodec codec() const;
+
+private:
+    //! Should be called before the chunk is decoded, resets decoder state on restart points
+    void start_chunk();
+};
+
+/** Block of the event (string valued) series.
+  * Values are replaced with codes of the per-block dictionary. Dictionary is sorted
+  * so the order of the codes is the same as the order of the values. Dictionary
+  * entries are front coded (length of the prefix shared with the previous entry
+  * followed by the rest of the entry). Block layout:
+  * - header (version and codec byte the same as in data block, codec is DICTIONARY);
+  * - timestamps (Delta-RLE);
+  * - codes (RLE);
+  * - dictionary.
+  * Data is kept in memory and encoded on commit.
+  */
+struct EventBlockWriter {
+    enum {
+        HEADER_SIZE = 18,  // 2 (version and codec) + 2 (nelements) + 2 (ndict) + 8 (series id) + 2 + 2 (offsets)
+        MAX_ELEMENTS = 0xFFFF,
+        MAX_VARINT64 = 10,  // max size of the Base128 encoded u64
+        MAX_VARINT32 = 5,   // max size of the Base128 encoded u32
+    };
+    u8*                                  begin_;
+    int                                  size_;
+    aku_ParamId                          id_;
+    std::vector<aku_Timestamp>           timestamps_;
+    std::vector<u32>                     codes_;
+    std::vector<std::string>             values_;     //! Dictionary in insertion order
+    std::unordered_map<std::string, u32> index_;
+    size_t                               max_size_;   //! Upper bound of the encoded size
+
+    /** C-tor
+      * @param id Series id.
+      * @param buf Pointer to buffer.
+      * @param size Block size.
+      */
+    EventBlockWriter(aku_ParamId id, u8* buf, int size);
+
+    /** Append value to block.
+      * @param ts Timestamp.
+      * @param value Pointer to the value.
+      * @param size Size of the value.
+      * @return AKU_EOVERFLOW when block is full or AKU_SUCCESS.
+      */
+    aku_Status put(aku_Timestamp ts, const char* value, u32 size);
+
+    //! Encode data, return size of the block
+    size_t commit();
+
+    //! Number of elements in the block
+    size_t nelements() const;
+};
+
+struct EventBlockReader {
+    const u8*                     begin_;
+    const u8*                     end_;
+    Base128StreamReader           ts_input_;
+    DeltaRLEReader                ts_stream_;
+    Base128StreamReader           code_input_;
+    RLEStreamReader<u32>          code_stream_;
+    u32                           read_index_;
+    //! Decoded dictionary (decoded on first lookup)
+    std::vector<std::string>      dictionary_;
+
+    EventBlockReader(u8 const* buf, size_t bufsize);
+
+    //! Read next timestamp and dictionary code
+    std::tuple<aku_Status, aku_Timestamp, u32> next();
+
+    /** Read several elements at once.
+      * @param destts is a timestamps destination
+      * @param destcodes is a codes destination
+      * @param size is a size of both arrays
+      * @return status and number of elements read (AKU_ENO_DATA if nothing was read)
+      */
+    std::tuple<aku_Status, size_t> read_batch(aku_Timestamp* destts, u32* destcodes, size_t size);
+
+    //! Get value by code, return nullptr if code is invalid
+    const std::string* lookup(u32 code);
+
+    size_t nelements() const;
+
+    //! Number of dictionary entries
+    size_t dictionary_size() const;
+
+    aku_ParamId get_id() const;
+};
+
+/** Block of the histogram series.
+  * Every element is a vector of bucket counts, bucket layout (upper bounds) is
+  * fixed and stored once in the block header. Counts of every bucket are stored
+  * as a separate Delta-RLE column (ZigZag encoded because counters can be reset),
+  * so cumulative counters that grow at steady rate take few bytes per element.
+  * Block layout:
+  * - header (version and codec byte the same as in data block, codec is HISTOGRAM);
+  * - bucket bounds (raw doubles);
+  * - timestamps (Delta-RLE);
+  * - bucket columns (ZigZag-Delta-RLE).
+  * Data is kept in memory and encoded on commit, encoded size is tracked
+  * precisely on every `put`.
+  */
+struct HistogramBlockWriter {
+    enum {
+        HEADER_SIZE = 16,  // 2 (version and codec) + 2 (nelements) + 2 (nbuckets) + 8 (series id) + 2 (offset)
+        MAX_ELEMENTS = 0xFFFF,
+        MAX_BUCKETS = 0xFF,
+    };
+
+    //! Size of the RLE encoded column
+    struct ColumnSize {
+        u64    prev;      //! Previous value
+        u64    delta;     //! Delta of the current run (ZigZag encoded for bucket columns)
+        u32    reps;      //! Length of the current run
+        size_t complete;  //! Size of the complete runs
+
+        size_t size() const;
+        //! Size of the column with `delta` appended
+        size_t size_with(u64 delta) const;
+        void append(u64 delta);
+    };
+
+    u8*                        begin_;
+    int                        size_;
+    aku_ParamId                id_;
+    std::vector<double>        bounds_;
+    std::vector<aku_Timestamp> timestamps_;
+    std::vector<u64>           counts_;      //! Bucket counts in row order
+    ColumnSize                 ts_size_;
+    std::vector<ColumnSize>    bucket_size_;
+    size_t                     max_size_;    //! Size of the header and bucket bounds
+
+    /** C-tor
+      * @param id Series id.
+      * @param buf Pointer to buffer.
+      * @param size Block size.
+      * @param bounds Upper bounds of the buckets (in ascending order).
+      */
+    HistogramBlockWriter(aku_ParamId id, u8* buf, int size, std::vector<double> const& bounds);
+
+    /** Append histogram to block.
+      * @param ts Timestamp.
+      * @param counts Bucket counts (array should have the same size as the list of bounds).
+      * @return AKU_EOVERFLOW when block is full or AKU_SUCCESS.
+      */
+    aku_Status put(aku_Timestamp ts, u64 const* counts);
+
+    //! Encode data, return size of the block
+    size_t commit();
+
+    //! Number of elements in the block
+    size_t nelements() const;
+
+private:
+    size_t encoded_size() const;
+};
+
+struct HistogramBlockReader {
+    const u8*                  begin_;
+    std::vector<double>        bounds_;
+    std::vector<aku_Timestamp> timestamps_;
+    std::vector<u64>           counts_;      //! Bucket counts in row order
+    u32                        read_index_;
+
+    //! Decode the block
+    HistogramBlockReader(u8 const* buf, size_t bufsize);
+
+    /** Read next element.
+      * @param ts is a timestamp destination
+      * @param counts is a destination of the bucket counts (should have `nbuckets` elements)
+      * @return AKU_ENO_DATA if there is no more elements
+      */
+    aku_Status next(aku_Timestamp* ts, u64* counts);
+
+    //! Upper bounds of the buckets
+    std::vector<double> const& bounds() const;
+
+    size_t nbuckets() const;
+
+    size_t nelements() const;
+
+    aku_ParamId get_id() const;
 };
 
 }  // namespace V2
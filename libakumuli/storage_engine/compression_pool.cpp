@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "compression_pool.h"
+#include "log_iface.h"
+#include "util.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+CompressionPool::CompressionPool(size_t nworkers, Callback on_flush)
+    : inprogress_(0)
+    , stop_(false)
+    , on_flush_(std::move(on_flush))
+{
+    if (nworkers == 0) {
+        nworkers = std::max(1u, std::thread::hardware_concurrency() / 2);
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        workers_.emplace_back(&CompressionPool::run, this);
+    }
+    Logger::msg(AKU_LOG_INFO, "Compression pool started, " + std::to_string(nworkers) + " workers");
+}
+
+CompressionPool::~CompressionPool() {
+    stop();
+}
+
+void CompressionPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+        pending_.clear();
+    }
+    cvar_.notify_all();
+    for (auto& worker: workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+}
+
+void CompressionPool::schedule(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree) {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (stop_) {
+            return;
+        }
+        Item item = { id, std::move(tree) };
+        pending_.push_back(std::move(item));
+    }
+    cvar_.notify_one();
+}
+
+void CompressionPool::wait() {
+    std::unique_lock<std::mutex> lock(lock_);
+    cvar_.wait(lock, [this] {
+        return stop_ || (pending_.empty() && inprogress_ == 0);
+    });
+}
+
+void CompressionPool::run() {
+    set_thread_name("compression");
+    apply_thread_policy(AKU_THREAD_BACKGROUND);
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        cvar_.wait(lock, [this] {
+            return stop_ || !pending_.empty();
+        });
+        if (stop_) {
+            break;
+        }
+        Item item = std::move(pending_.front());
+        pending_.pop_front();
+        inprogress_++;
+        lock.unlock();
+        if (item.tree->flush_write_ring() && on_flush_) {
+            on_flush_(item.id, item.tree);
+        }
+        lock.lock();
+        inprogress_--;
+        cvar_.notify_all();
+    }
+}
+
+}}  // namespace
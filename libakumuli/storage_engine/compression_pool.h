@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/nbtree.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Pool of workers that flush write rings of the columns.
+  * Writers add values to the uncompressed write ring of the column and schedule
+  * the flush when the ring is full. Worker compresses values from the ring and
+  * commits full leaf nodes to the block store so the writer thread doesn't
+  * pay for compression and I/O. Column is scheduled only once until its ring
+  * is flushed so the values of the column are written in order.
+  */
+class CompressionPool : public NBTreeFlushQueue {
+public:
+    //! Called by the worker if the flush changed rescue points of the column
+    typedef std::function<void(aku_ParamId, std::shared_ptr<NBTreeExtentsList> const&)> Callback;
+
+private:
+    struct Item {
+        aku_ParamId id;
+        std::shared_ptr<NBTreeExtentsList> tree;
+    };
+
+    //! Protects `pending_`, `inprogress_` and `stop_`
+    std::mutex lock_;
+    std::condition_variable cvar_;
+    std::deque<Item> pending_;
+    //! Number of columns that are being flushed by the workers
+    size_t inprogress_;
+    bool stop_;
+    Callback on_flush_;
+    std::vector<std::thread> workers_;
+
+    void run();
+
+public:
+    /** C-tor.
+      * @param nworkers is a number of worker threads (0 - half of the available cores)
+      * @param on_flush is called when rescue points of the column were changed
+      */
+    CompressionPool(size_t nworkers, Callback on_flush);
+
+    ~CompressionPool();
+
+    CompressionPool(CompressionPool const&) = delete;
+    CompressionPool& operator = (CompressionPool const&) = delete;
+
+    virtual void schedule(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree) override;
+
+    //! Wait until all scheduled columns will be flushed
+    void wait();
+
+    //! Stop workers, scheduled columns are not flushed
+    void stop();
+};
+
+}}  // namespace
@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "hotlist.h"
+#include "log_iface.h"
+#include "crc32c.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static const u32 HOTLIST_MAGIC = 0x4C484B41;  // "AKHL"
+static const u32 HOTLIST_VERSION = 1;
+
+struct HotListHeader {
+    u32 magic;
+    u32 version;
+    u64 naddrs;
+    u32 crc;       //! Payload checksum
+} __attribute__((packed));
+
+static u32 checksum(const char* data, size_t size) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data, size);
+}
+
+aku_Status HotBlockList::write(std::string const& path, std::vector<LogicAddr> const& addrs) {
+    HotListHeader header = {};
+    header.magic = HOTLIST_MAGIC;
+    header.version = HOTLIST_VERSION;
+    header.naddrs = addrs.size();
+    auto payload = reinterpret_cast<const char*>(addrs.data());
+    auto payload_size = addrs.size() * sizeof(LogicAddr);
+    header.crc = checksum(payload, payload_size);
+
+    // The list is a hint so it's not synced, damaged file is detected by the checksum
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary|std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(payload, static_cast<std::streamsize>(payload_size));
+        if (!out) {
+            Logger::msg(AKU_LOG_ERROR, "Can't write " + tmp);
+            out.close();
+            std::remove(tmp.c_str());
+            return AKU_EGENERAL;
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't replace " + path + ", error: " + strerror(errno));
+        std::remove(tmp.c_str());
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status HotBlockList::load(std::string const& path, std::vector<LogicAddr>* addrs) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return AKU_ENOT_FOUND;
+    }
+    HotListHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        header.magic != HOTLIST_MAGIC ||
+        header.version != HOTLIST_VERSION)
+    {
+        return AKU_EBAD_DATA;
+    }
+    std::vector<LogicAddr> result;
+    // Size is checked before the allocation, the header can be damaged
+    in.seekg(0, std::ios::end);
+    auto payload_size = static_cast<u64>(in.tellg()) - sizeof(header);
+    if (payload_size != header.naddrs * sizeof(LogicAddr)) {
+        return AKU_EBAD_DATA;
+    }
+    in.seekg(sizeof(header), std::ios::beg);
+    result.resize(header.naddrs);
+    if (!in.read(reinterpret_cast<char*>(result.data()), static_cast<std::streamsize>(payload_size)) ||
+        checksum(reinterpret_cast<const char*>(result.data()), payload_size) != header.crc)
+    {
+        return AKU_EBAD_DATA;
+    }
+    addrs->swap(result);
+    return AKU_SUCCESS;
+}
+
+}
+}  // namespaces
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <string>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/blockstore.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** List of the hot blocks (see `BlockStore::get_hot_blocks`) saved periodically
+  * and on shutdown. The blocks are loaded into the cache in background on the
+  * next startup. The list is only a hint, addresses that were reused or deleted
+  * by retention are skipped by the warmup.
+  */
+struct HotBlockList {
+    /** Write the list. New file is written next to the old one and renamed.
+      * @param path is a path to the file
+      * @param addrs is a list of addresses (hottest first)
+      */
+    static aku_Status write(std::string const& path, std::vector<LogicAddr> const& addrs);
+
+    /** Read the list.
+      * @param path is a path to the file
+      * @param addrs is a destination
+      * @return AKU_ENOT_FOUND if the file doesn't exist, AKU_EBAD_DATA if it's damaged
+      */
+    static aku_Status load(std::string const& path, std::vector<LogicAddr>* addrs);
+};
+
+}
+}  // namespaces
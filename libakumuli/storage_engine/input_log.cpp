@@ -0,0 +1,301 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "input_log.h"
+#include "crc32c.h"
+#include "log_iface.h"
+#include "status_util.h"
+#include "util.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static const char* LOG_PREFIX = "inputlog_";
+static const char* LOG_EXTENSION = ".ils";
+
+//! Extract sequence number from the file name, return false if file doesn't belong to the log
+static bool parse_log_name(boost::filesystem::path const& path, u64* seq) {
+    auto stem = path.stem().string();
+    std::string prefix(LOG_PREFIX);
+    if (path.extension() != LOG_EXTENSION || stem.compare(0, prefix.size(), prefix) != 0) {
+        return false;
+    }
+    // Name format: inputlog_<seq>_<shard>.ils
+    try {
+        *seq = std::stoull(stem.substr(prefix.size()));
+    } catch (std::exception const&) {
+        return false;
+    }
+    return true;
+}
+
+static u32 record_crc(InputLog::Record const& rec) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, &rec, sizeof(rec));
+}
+
+static void log_io_error(std::string const& what, std::string const& path) {
+    boost::system::error_code error(errno, boost::system::system_category());
+    Logger::msg(AKU_LOG_ERROR, "Input log " + what + " error, file: " + path + ", " + error.message());
+}
+
+InputLog::InputLog(std::string const& dir, u32 nshards, u32 commit_interval_ms)
+    : dir_(dir)
+    , commit_interval_(commit_interval_ms)
+    , next_shard_{0}
+    , size_{0}
+    , seq_{0}
+{
+    boost::filesystem::path path(dir_);
+    if (!boost::filesystem::exists(path)) {
+        Logger::msg(AKU_LOG_INFO, dir_ + " doesn't exists, trying to create directory");
+        boost::filesystem::create_directories(path);
+    }
+    // New files should follow the existing ones
+    u64 seq = 0;
+    for (boost::filesystem::directory_iterator it(path), end; it != end; it++) {
+        u64 fileseq;
+        if (parse_log_name(it->path(), &fileseq)) {
+            seq = std::max(seq, fileseq + 1);
+        }
+    }
+    seq_.store(seq);
+    for (u32 ix = 0; ix < std::max(nshards, 1u); ix++) {
+        std::unique_ptr<Shard> shard(new Shard());
+        shard->fd = -1;
+        shard->buffer.reserve(BUFFER_SIZE);
+        auto status = open_file(shard.get(), ix, seq);
+        if (status != AKU_SUCCESS) {
+            AKU_PANIC("Can't create input log - " + StatusUtil::str(status));
+        }
+        shards_.push_back(std::move(shard));
+    }
+}
+
+InputLog::~InputLog() {
+    for (auto& shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+        commit(shard.get());
+        if (shard->fd >= 0) {
+            ::close(shard->fd);
+        }
+    }
+}
+
+std::string InputLog::get_path(u64 seq, u32 shard) const {
+    boost::filesystem::path path(dir_);
+    path /= LOG_PREFIX + std::to_string(seq) + "_" + std::to_string(shard) + LOG_EXTENSION;
+    return path.string();
+}
+
+aku_Status InputLog::open_file(Shard* shard, u32 ix, u64 seq) {
+    auto path = get_path(seq, ix);
+    int fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (fd < 0) {
+        log_io_error("open", path);
+        return AKU_EGENERAL;
+    }
+    if (shard->fd >= 0) {
+        ::close(shard->fd);
+    }
+    shard->fd = fd;
+    shard->path = path;
+    shard->last_sync = std::chrono::steady_clock::now();
+    return AKU_SUCCESS;
+}
+
+aku_Status InputLog::commit(Shard* shard) {
+    shard->last_sync = std::chrono::steady_clock::now();
+    if (shard->buffer.empty()) {
+        return AKU_SUCCESS;
+    }
+    auto data = reinterpret_cast<const char*>(shard->buffer.data());
+    size_t size = shard->buffer.size() * sizeof(FramedRecord);
+    shard->buffer.clear();
+    for (size_t pos = 0; pos < size;) {
+        auto nwritten = ::write(shard->fd, data + pos, size - pos);
+        if (nwritten <= 0) {
+            log_io_error("write", shard->path);
+            return AKU_EGENERAL;
+        }
+        pos += static_cast<size_t>(nwritten);
+    }
+    size_ += size;
+    if (::fdatasync(shard->fd) != 0) {
+        log_io_error("sync", shard->path);
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+u32 InputLog::pick_shard() {
+    return next_shard_++ % static_cast<u32>(shards_.size());
+}
+
+aku_Status InputLog::append(u32 ix, aku_ParamId id, aku_Timestamp ts, double value) {
+    auto& shard = shards_.at(ix % shards_.size());
+    std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+    FramedRecord frame = {};
+    frame.record = { id, ts, value };
+    frame.crc = record_crc(frame.record);
+    shard->buffer.push_back(frame);
+    if (shard->buffer.size() >= BUFFER_SIZE ||
+        std::chrono::steady_clock::now() - shard->last_sync >= commit_interval_)
+    {
+        return commit(shard.get());
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status InputLog::flush() {
+    aku_Status result = AKU_SUCCESS;
+    for (auto& shard: shards_) {
+        std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+        auto status = commit(shard.get());
+        if (status != AKU_SUCCESS) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+std::chrono::milliseconds InputLog::get_commit_interval() const {
+    return commit_interval_;
+}
+
+u64 InputLog::get_size() const {
+    return size_.load();
+}
+
+aku_Status InputLog::rotate() {
+    std::lock_guard<std::mutex> rguard(rotate_lock_); AKU_UNUSED(rguard);
+    auto seq = seq_.load() + 1;
+    aku_Status result = AKU_SUCCESS;
+    for (u32 ix = 0; ix < shards_.size(); ix++) {
+        auto& shard = shards_[ix];
+        std::lock_guard<std::mutex> guard(shard->lock); AKU_UNUSED(guard);
+        // Buffered records should be written to the old file
+        auto status = commit(shard.get());
+        if (status == AKU_SUCCESS) {
+            status = open_file(shard.get(), ix, seq);
+        }
+        if (status != AKU_SUCCESS) {
+            result = status;
+        }
+    }
+    seq_.store(seq);
+    size_.store(0);
+    return result;
+}
+
+void InputLog::remove_old() {
+    std::lock_guard<std::mutex> rguard(rotate_lock_); AKU_UNUSED(rguard);
+    auto seq = seq_.load();
+    std::vector<boost::filesystem::path> old;
+    for (boost::filesystem::directory_iterator it(dir_), end; it != end; it++) {
+        u64 fileseq;
+        if (parse_log_name(it->path(), &fileseq) && fileseq < seq) {
+            old.push_back(it->path());
+        }
+    }
+    for (auto const& path: old) {
+        boost::system::error_code error;
+        boost::filesystem::remove(path, error);
+        if (error) {
+            Logger::msg(AKU_LOG_ERROR, "Can't remove input log file " + path.string() + ", " + error.message());
+        }
+    }
+}
+
+aku_Status InputLog::read_all(std::string const& dir, std::vector<Record>* dest) {
+    boost::filesystem::path path(dir);
+    if (!boost::filesystem::exists(path)) {
+        return AKU_SUCCESS;
+    }
+    std::vector<std::pair<u64, std::string>> files;
+    for (boost::filesystem::directory_iterator it(path), end; it != end; it++) {
+        u64 seq;
+        if (parse_log_name(it->path(), &seq)) {
+            files.push_back(std::make_pair(seq, it->path().string()));
+        }
+    }
+    std::sort(files.begin(), files.end());
+    for (auto const& file: files) {
+        int fd = ::open(file.second.c_str(), O_RDONLY);
+        if (fd < 0) {
+            log_io_error("open", file.second);
+            return AKU_EGENERAL;
+        }
+        auto size = boost::filesystem::file_size(file.second);
+        std::vector<FramedRecord> frames(static_cast<size_t>(size / sizeof(FramedRecord)));
+        auto data = reinterpret_cast<char*>(frames.data());
+        size_t total = frames.size() * sizeof(FramedRecord);
+        for (size_t pos = 0; pos < total;) {
+            auto nread = ::read(fd, data + pos, total - pos);
+            if (nread <= 0) {
+                log_io_error("read", file.second);
+                ::close(fd);
+                return AKU_EGENERAL;
+            }
+            pos += static_cast<size_t>(nread);
+        }
+        ::close(fd);
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (frames[i].crc != record_crc(frames[i].record)) {
+                // Records after the damaged one can't be trusted
+                Logger::msg(AKU_LOG_ERROR, "Input log file " + file.second + " is damaged at record " +
+                                           std::to_string(i) + ", " + std::to_string(frames.size() - i) +
+                                           " records ignored");
+                break;
+            }
+            dest->push_back(frames[i].record);
+        }
+    }
+    // Series can be written through different shards, every series is ordered by time
+    std::stable_sort(dest->begin(), dest->end(), [](Record const& lhs, Record const& rhs) {
+        return lhs.timestamp < rhs.timestamp;
+    });
+    return AKU_SUCCESS;
+}
+
+size_t InputLog::remove_stored(std::vector<Record>* records, std::vector<aku_Timestamp> const& stored) {
+    size_t nremoved = 0;
+    auto it = stored.begin();
+    auto out = records->begin();
+    for (auto const& rec: *records) {
+        while (it != stored.end() && *it < rec.timestamp) {
+            ++it;
+        }
+        if (it != stored.end() && *it == rec.timestamp) {
+            // Stored value is matched by this record
+            ++it;
+            nremoved++;
+            continue;
+        }
+        *out++ = rec;
+    }
+    records->erase(out, records->end());
+    return nremoved;
+}
+
+}}  // namespace
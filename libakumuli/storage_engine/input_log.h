@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+//! Default size of the input log that triggers truncation (in bytes)
+static const u64 AKU_DEFAULT_INPUT_LOG_MAX_SIZE = 64*1024*1024;
+
+/** Write-ahead log of the samples that are stored only in memory (in the leaf nodes
+  * of the NB+trees). Log is split into shards, every shard is a separate file so
+  * write sessions that use different shards don't compete for the lock. Records are
+  * buffered and written in groups, every group is synced with fdatasync. Shard is
+  * committed by `append` and by `flush` that should be called by the owner at least
+  * once per commit interval (records of the idle shard are written only by `flush`),
+  * so the amount of data lost in case of crash is bounded by the commit interval.
+  * Every record is stored with its checksum, torn or damaged tail of the file is
+  * detected on read.
+  * Log is truncated after all leaf nodes were committed (see `rotate` and `remove_old`).
+  */
+class InputLog {
+public:
+    //! Log record
+    struct Record {
+        aku_ParamId   id;
+        aku_Timestamp timestamp;
+        double        value;
+    };
+
+    //! Record as stored in the file (checksum covers the record fields)
+    struct FramedRecord {
+        Record record;
+        u32    crc;
+        u32    reserved;
+    };
+
+private:
+    struct Shard {
+        std::mutex lock;
+        int fd;
+        std::string path;
+        std::vector<FramedRecord> buffer;
+        std::chrono::steady_clock::time_point last_sync;
+    };
+
+    const std::string dir_;
+    const std::chrono::milliseconds commit_interval_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<u32> next_shard_;
+    //! Number of bytes written to the current files
+    std::atomic<u64> size_;
+    //! Sequence number of the current files
+    std::atomic<u64> seq_;
+    //! Serializes  and  calls
+    std::mutex rotate_lock_;
+
+    std::string get_path(u64 seq, u32 shard) const;
+
+    //! Write buffered records and sync the file (should be called under the shard lock)
+    aku_Status commit(Shard* shard);
+
+    //! Open new file for the shard (should be called under the shard lock)
+    aku_Status open_file(Shard* shard, u32 ix, u64 seq);
+
+public:
+    //! Max number of records in the buffer of one shard
+    enum { BUFFER_SIZE = 0x1000 };
+
+    /** C-tor. Creates new files, existing files are kept until  is called.
+      * @param dir is a log directory (created if doesn't exist)
+      * @param nshards is a number of shards
+      * @param commit_interval_ms is a max interval between syncs of the shard
+      */
+    InputLog(std::string const& dir, u32 nshards, u32 commit_interval_ms);
+
+    //! D-tor, commits all buffered records
+    ~InputLog();
+
+    InputLog(InputLog const&) = delete;
+    InputLog& operator = (InputLog const&) = delete;
+
+    //! Get shard for the new write session (shards are assigned in round-robin order)
+    u32 pick_shard();
+
+    /** Add record to the log.
+      * Shard is committed if its buffer is full or if the commit interval has passed.
+      */
+    aku_Status append(u32 shard, aku_ParamId id, aku_Timestamp ts, double value);
+
+    //! Commit all shards
+    aku_Status flush();
+
+    //! Get max interval between syncs of the shard
+    std::chrono::milliseconds get_commit_interval() const;
+
+    //! Get number of bytes written since the last rotation
+    u64 get_size() const;
+
+    /** Switch all shards to the new files. Records from the previous files
+      * can be removed by `remove_old` call after all data was committed.
+      */
+    aku_Status rotate();
+
+    //! Remove files that were created before the last rotation
+    void remove_old();
+
+    /** Read all records from the log directory.
+      * Incomplete records at the end of the file are ignored. Reading of the file
+      * stops at the first record with bad checksum (torn or damaged write).
+      * @param dir is a log directory
+      * @param dest receives records ordered by timestamp (order of records with the
+      *        same timestamp is preserved)
+      */
+    static aku_Status read_all(std::string const& dir, std::vector<Record>* dest);
+
+    /** Remove records of one series that are already stored in the column.
+      * Record is a duplicate if the column has a value with the same timestamp
+      * that wasn't matched by another record.
+      * @param records are records of the series ordered by timestamp
+      * @param stored are timestamps of the stored values (ordered)
+      * @return number of removed records
+      */
+    static size_t remove_stored(std::vector<Record>* records, std::vector<aku_Timestamp> const& stored);
+};
+
+}}  // namespace
@@ -18,15 +18,21 @@
 // C++
 #include <iostream>  // For debug print fn.
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <vector>
 #include <sstream>
 #include <stack>
 
+#include <zlib.h>
+
 // App
 #include "nbtree.h"
 #include "akumuli_version.h"
 #include "status_util.h"
 #include "log_iface.h"
+#include "metrics.h"
+#include "akumuli_tracing.h"
 #include "operators/scan.h"
 #include "operators/aggregate.h"
 
@@ -90,6 +96,167 @@ static SubtreeRef const* subtree_cast(u8 const* p) {
     return reinterpret_cast<SubtreeRef const*>(p);
 }
 
+static SubtreeRefCompact* compact_cast(u8* p) {
+    return reinterpret_cast<SubtreeRefCompact*>(p);
+}
+
+static SubtreeRefCompact const* compact_cast(u8 const* p) {
+    return reinterpret_cast<SubtreeRefCompact const*>(p);
+}
+
+static void compact_encode(SubtreeRef const& in, SubtreeRefCompact* out) {
+    assert(in.level <= std::numeric_limits<u8>::max());
+    out->count        = in.count;
+    out->begin        = in.begin;
+    out->end          = in.end;
+    out->addr         = in.addr;
+    out->min          = in.min;
+    out->min_time     = in.min_time;
+    out->max          = in.max;
+    out->max_time     = in.max_time;
+    out->sum          = in.sum;
+    out->first        = in.first;
+    out->last         = in.last;
+    out->version      = in.version;
+    out->fanout_index = in.fanout_index;
+    out->level        = static_cast<u8>(in.level);
+    out->type         = static_cast<u8>(in.type);
+}
+
+//! Restore full link from the compact one, `id` is taken from the superblock header
+static SubtreeRef compact_decode(SubtreeRefCompact const& in, aku_ParamId id) {
+    SubtreeRef out;
+    out.count        = in.count;
+    out.id           = id;
+    out.begin        = in.begin;
+    out.end          = in.end;
+    out.addr         = in.addr;
+    out.min          = in.min;
+    out.min_time     = in.min_time;
+    out.max          = in.max;
+    out.max_time     = in.max_time;
+    out.sum          = in.sum;
+    out.first        = in.first;
+    out.last         = in.last;
+    out.type         = static_cast<NBTreeBlockType>(in.type);
+    out.level        = in.level;
+    out.payload_size = 0;
+    out.version      = in.version;
+    out.fanout_index = in.fanout_index;
+    out.checksum     = 0;
+    return out;
+}
+
+
+// I/O counters
+
+//! Operation that writes nodes to the block store
+enum class WriteCause {
+    APPEND,
+    SPLIT,
+    FLUSH,
+    RECOVERY,
+    COMPACTION,
+};
+
+struct IOCounters {
+    std::array<std::atomic<u64>, NBTreeIOStats::MAX_LEVELS> reads;
+    std::array<std::atomic<u64>, NBTreeIOStats::MAX_LEVELS> cache_hits;
+    std::atomic<u64> append_writes;
+    std::atomic<u64> split_writes;
+    std::atomic<u64> flush_writes;
+    std::atomic<u64> recovery_writes;
+    std::atomic<u64> compaction_writes;
+    std::atomic<u64> repeated_values;
+    std::atomic<u64> staged_values;
+};
+
+static IOCounters& io_counters() {
+    // Has static storage duration and trivial c-tor so it's zero-initialized
+    static IOCounters counters;
+    return counters;
+}
+
+static WriteCause& current_write_cause() {
+    static thread_local WriteCause cause = WriteCause::APPEND;
+    return cause;
+}
+
+/** Attributes all writes of the current thread to some operation, previous one is
+  * restored on destruction. The outermost operation wins (e.g. the final commit of the
+  * compacted tree or a split during recovery are not counted as flush and split).
+  */
+class WriteCauseScope {
+    WriteCause prev_;
+public:
+    WriteCauseScope(WriteCause cause)
+        : prev_(current_write_cause())
+    {
+        if (prev_ == WriteCause::APPEND) {
+            current_write_cause() = cause;
+        }
+    }
+
+    ~WriteCauseScope() {
+        current_write_cause() = prev_;
+    }
+};
+
+static void count_read(u16 level, bool cached) {
+    auto& counters = io_counters();
+    auto ix = std::min<size_t>(level, NBTreeIOStats::MAX_LEVELS - 1);
+    counters.reads[ix].fetch_add(1, std::memory_order_relaxed);
+    if (cached) {
+        counters.cache_hits[ix].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static void count_write() {
+    auto& counters = io_counters();
+    switch (current_write_cause()) {
+    case WriteCause::APPEND:
+        counters.append_writes.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case WriteCause::SPLIT:
+        counters.split_writes.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case WriteCause::FLUSH:
+        counters.flush_writes.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case WriteCause::RECOVERY:
+        counters.recovery_writes.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case WriteCause::COMPACTION:
+        counters.compaction_writes.fetch_add(1, std::memory_order_relaxed);
+        break;
+    };
+}
+
+NBTreeIOStats NBTreeIOStats::get() {
+    auto& counters = io_counters();
+    NBTreeIOStats result = {};
+    for (size_t i = 0; i < MAX_LEVELS; i++) {
+        result.reads[i] = counters.reads[i].load(std::memory_order_relaxed);
+        result.cache_hits[i] = counters.cache_hits[i].load(std::memory_order_relaxed);
+    }
+    result.append_writes = counters.append_writes.load(std::memory_order_relaxed);
+    result.split_writes = counters.split_writes.load(std::memory_order_relaxed);
+    result.flush_writes = counters.flush_writes.load(std::memory_order_relaxed);
+    result.recovery_writes = counters.recovery_writes.load(std::memory_order_relaxed);
+    result.compaction_writes = counters.compaction_writes.load(std::memory_order_relaxed);
+    result.repeated_values = counters.repeated_values.load(std::memory_order_relaxed);
+    result.staged_values = counters.staged_values.load(std::memory_order_relaxed);
+    return result;
+}
+
+double NBTreeIOStats::write_amplification() const {
+    if (append_writes == 0) {
+        return 0.0;
+    }
+    u64 total = append_writes + split_writes + flush_writes + recovery_writes + compaction_writes;
+    return static_cast<double>(total) / static_cast<double>(append_writes);
+}
+
 
 static std::tuple<aku_Status, std::shared_ptr<Block>> read_and_check(std::shared_ptr<BlockStore> bstore, LogicAddr curr) {
     aku_Status status;
@@ -101,8 +268,8 @@ static std::tuple<aku_Status, std::shared_ptr<Block>> read_and_check(std::shared
     // Check consistency (works with both inner and leaf nodes).
     u8 const* data = block->get_cdata();
     SubtreeRef const* subtree = subtree_cast(data);
-    u32 crc = bstore->checksum(data + sizeof(SubtreeRef), subtree->payload_size);
-    if (crc != subtree->checksum) {
+    count_read(subtree->level, BlockStore::last_read_cached());
+    if (!bstore->verify_checksum(curr, data + sizeof(SubtreeRef), subtree->payload_size, subtree->checksum)) {
         std::stringstream fmt;
         fmt << "Invalid checksum (addr: " << curr << ", level: " << subtree->level << ")";
         Logger::msg(AKU_LOG_ERROR, fmt.str());
@@ -123,8 +290,8 @@ static std::shared_ptr<Block> read_block_from_bstore(std::shared_ptr<BlockStore>
     // Check consistency (works with both inner and leaf nodes).
     u8 const* data = block->get_cdata();
     SubtreeRef const* subtree = subtree_cast(data);
-    u32 crc = bstore->checksum(data + sizeof(SubtreeRef), subtree->payload_size);
-    if (crc != subtree->checksum) {
+    count_read(subtree->level, BlockStore::last_read_cached());
+    if (!bstore->verify_checksum(curr, data + sizeof(SubtreeRef), subtree->payload_size, subtree->checksum)) {
         std::stringstream fmt;
         fmt << "Invalid checksum (addr: " << curr << ", level: " << subtree->level << ")";
         AKU_PANIC(fmt.str());
@@ -214,6 +381,8 @@ struct NBTreeLeafIterator : RealValuedOperator {
     aku_Status                 status_;
     //! Padding
     u32 pad_;
+    //! Value filter (disabled by default)
+    ValueFilter                filter_;
 
     NBTreeLeafIterator(aku_Status status)
         : begin_()
@@ -236,6 +405,17 @@ struct NBTreeLeafIterator : RealValuedOperator {
         }
     }
 
+    NBTreeLeafIterator(aku_Timestamp begin, aku_Timestamp end, NBTreeLeaf const& node, ValueFilter const& filter)
+        : begin_(begin)
+        , end_(end)
+        , from_()
+        , to_()
+        , status_(AKU_ENO_DATA)
+        , filter_(filter)
+    {
+        init(node);
+    }
+
     void init(NBTreeLeaf const& node) {
         aku_Timestamp min = std::min(begin_, end_);
         aku_Timestamp max = std::max(begin_, end_);
@@ -245,7 +425,8 @@ struct NBTreeLeafIterator : RealValuedOperator {
             status_ = AKU_ENO_DATA;
             return;
         }
-        status_ = node.read_all(&tsbuf_, &xsbuf_);
+        // Chunks that precede or follow the range are not decoded
+        status_ = node.read_range(min, max, &tsbuf_, &xsbuf_);
         if (status_ == AKU_SUCCESS) {
             if (begin_ < end_) {
                 // FWD direction
@@ -254,7 +435,7 @@ struct NBTreeLeafIterator : RealValuedOperator {
                     from_ = std::distance(tsbuf_.begin(), it_begin);
                 } else {
                     from_ = 0;
-                    assert(tsbuf_.front() > begin_);
+                    assert(tsbuf_.empty() || tsbuf_.front() > begin_);
                 }
                 auto it_end = std::lower_bound(tsbuf_.begin(), tsbuf_.end(), end_);
                 to_ = std::distance(tsbuf_.begin(), it_end);
@@ -268,6 +449,13 @@ struct NBTreeLeafIterator : RealValuedOperator {
                 std::reverse(tsbuf_.begin(), tsbuf_.end());
                 std::reverse(xsbuf_.begin(), xsbuf_.end());
             }
+            if (filter_.is_enabled() && to_ > from_) {
+                // Matching values are moved to the beginning of the range
+                auto tsptr = tsbuf_.data() + from_;
+                auto xsptr = xsbuf_.data() + from_;
+                auto size = filter_.apply(tsptr, xsptr, get_size(), tsptr, xsptr);
+                to_ = from_ + static_cast<ssize_t>(size);
+            }
         }
     }
 
@@ -308,6 +496,65 @@ RealValuedOperator::Direction NBTreeLeafIterator::get_direction() {
     return Direction::BACKWARD;
 }
 
+/** Reads values of the leaf nodes in [begin, end) range (or (end, begin] in backward
+  * direction). Unlike NBTreeLeafIterator this is not an operator, it's embedded into
+  * the superblock scan so the buffers are reused by every leaf node and reads are
+  * inlined. Backward cursor copies values in reverse order instead of reversing the buffers.
+  */
+template<bool Forward>
+struct NBTreeLeafCursor {
+    std::vector<aku_Timestamp> tsbuf_;
+    std::vector<double>        xsbuf_;
+    //! Position of the next value (Forward) or past the next value (!Forward)
+    size_t                     from_;
+    //! Range end
+    size_t                     to_;
+
+    NBTreeLeafCursor()
+        : from_(0)
+        , to_(0)
+    {
+    }
+
+    aku_Status reset(NBTreeLeaf const& node, aku_Timestamp begin, aku_Timestamp end) {
+        tsbuf_.clear();
+        xsbuf_.clear();
+        from_ = to_ = 0;
+        aku_Status status = Forward ? node.read_range(begin, end, &tsbuf_, &xsbuf_)
+                                    : node.read_range(end, begin, &tsbuf_, &xsbuf_);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        if (Forward) {
+            from_ = static_cast<size_t>(std::lower_bound(tsbuf_.begin(), tsbuf_.end(), begin) - tsbuf_.begin());
+            to_   = static_cast<size_t>(std::lower_bound(tsbuf_.begin(), tsbuf_.end(), end) - tsbuf_.begin());
+        } else {
+            from_ = static_cast<size_t>(std::upper_bound(tsbuf_.begin(), tsbuf_.end(), begin) - tsbuf_.begin());
+            to_   = static_cast<size_t>(std::upper_bound(tsbuf_.begin(), tsbuf_.end(), end) - tsbuf_.begin());
+        }
+        return AKU_SUCCESS;
+    }
+
+    bool empty() const {
+        return Forward ? from_ >= to_ : from_ <= to_;
+    }
+
+    size_t read(aku_Timestamp *destts, double *destval, size_t size) {
+        if (Forward) {
+            size_t n = std::min(size, to_ - from_);
+            std::copy(tsbuf_.begin() + static_cast<ssize_t>(from_), tsbuf_.begin() + static_cast<ssize_t>(from_ + n), destts);
+            std::copy(xsbuf_.begin() + static_cast<ssize_t>(from_), xsbuf_.begin() + static_cast<ssize_t>(from_ + n), destval);
+            from_ += n;
+            return n;
+        }
+        size_t n = std::min(size, from_ - to_);
+        std::reverse_copy(tsbuf_.begin() + static_cast<ssize_t>(from_ - n), tsbuf_.begin() + static_cast<ssize_t>(from_), destts);
+        std::reverse_copy(xsbuf_.begin() + static_cast<ssize_t>(from_ - n), xsbuf_.begin() + static_cast<ssize_t>(from_), destval);
+        from_ -= n;
+        return n;
+    }
+};
+
 
 
 // ///////////////////////// //
@@ -339,6 +586,8 @@ struct NBTreeSBlockIteratorBase : SeriesOperator<TVal> {
     std::unique_ptr<SeriesOperator<TVal>> iter_;
     u32 fsm_pos_;
     i32 refs_pos_;
+    //! Position of the first child that wasn't prefetched yet
+    i32 prefetch_pos_;
 
     typedef std::unique_ptr<SeriesOperator<TVal>> TIter;
     typedef typename SeriesOperator<TVal>::Direction Direction;
@@ -350,6 +599,7 @@ struct NBTreeSBlockIteratorBase : SeriesOperator<TVal> {
         , bstore_(bstore)
         , fsm_pos_(0)
         , refs_pos_(0)
+        , prefetch_pos_(0)
     {
     }
 
@@ -368,6 +618,7 @@ struct NBTreeSBlockIteratorBase : SeriesOperator<TVal> {
         } else {
             refs_pos_ = begin_ < end_ ? 0 : static_cast<i32>(refs_.size()) - 1;
         }
+        prefetch_pos_ = refs_pos_;
     }
 
     aku_Status init() {
@@ -380,48 +631,124 @@ struct NBTreeSBlockIteratorBase : SeriesOperator<TVal> {
         NBTreeSuperblock current(block);
         status = current.read_all(&refs_);
         refs_pos_ = begin_ < end_ ? 0 : static_cast<i32>(refs_.size()) - 1;
+        prefetch_pos_ = refs_pos_;
         return status;
     }
 
+    /** Send prefetch request for the next AKU_NBTREE_PREFETCH_DEPTH child nodes
+      * (only for nodes that are in [begin_, end_) range). Request is sent when the
+      * read-ahead window is half empty so the blockstore can read many blocks
+      * in parallel instead of one block at a time.
+      */
+    void prefetch_children() {
+        bool fwd = get_direction() == Direction::FORWARD;
+        i32 window = fwd ? prefetch_pos_ - refs_pos_ : refs_pos_ - prefetch_pos_;
+        if (window > AKU_NBTREE_PREFETCH_DEPTH / 2) {
+            return;
+        }
+        if (window < 0) {
+            prefetch_pos_ = refs_pos_;
+        }
+        auto min = std::min(begin_, end_);
+        auto max = std::max(begin_, end_);
+        auto min_addr = bstore_->get_min_live_addr();
+        std::vector<LogicAddr> addrs;
+        while (addrs.size() < AKU_NBTREE_PREFETCH_DEPTH &&
+               prefetch_pos_ >= 0 && prefetch_pos_ < static_cast<i32>(refs_.size()))
+        {
+            SubtreeRef const& ref = refs_.at(static_cast<size_t>(prefetch_pos_));
+            if (subtree_in_range(ref, min, max) && ref.addr >= min_addr && !skip_subtree_read(ref) && !skip_subtree(ref)) {
+                addrs.push_back(ref.addr);
+            }
+            prefetch_pos_ += fwd ? 1 : -1;
+        }
+        if (!addrs.empty()) {
+            bstore_->prefetch(addrs);
+        }
+    }
+
+    //! Return true if iterator for the subtree can be created without reading it (used by prefetch).
+    virtual bool skip_subtree_read(const SubtreeRef &ref) const {
+        AKU_UNUSED(ref);
+        return false;
+    }
+
+    //! Return true if the subtree doesn't contain values that should be returned (it won't be read).
+    virtual bool skip_subtree(const SubtreeRef &ref) const {
+        AKU_UNUSED(ref);
+        return false;
+    }
+
+    /** Return true if the subtree should be skipped without reading (called once
+      * for every subtree in iteration order).
+      */
+    virtual bool consume_subtree(const SubtreeRef &ref) {
+        AKU_UNUSED(ref);
+        return false;
+    }
+
     //! Create leaf iterator (used by `get_next_iter` template method).
     virtual std::tuple<aku_Status, TIter> make_leaf_iterator(const SubtreeRef &ref) = 0;
 
     //! Create superblock iterator (used by `get_next_iter` template method).
     virtual std::tuple<aku_Status, TIter> make_superblock_iterator(const SubtreeRef &ref) = 0;
 
-    //! This is a template method, aggregator should derive from this object and
-    //! override make_*_iterator virtual methods to customize iterator's behavior.
-    std::tuple<aku_Status, TIter> get_next_iter() {
+    /** Move to the next child node.
+      * @param ref receives the child that should be read
+      * @return AKU_SUCCESS if the child should be read, AKU_ENOT_FOUND or AKU_EUNAVAILABLE
+      *         if it should be skipped, AKU_ENO_DATA if there are no more children
+      */
+    aku_Status next_subtree(SubtreeRef* ref) {
         auto min = std::min(begin_, end_);
         auto max = std::max(begin_, end_);
 
-        TIter empty;
-        SubtreeRef ref = INIT_SUBTREE_REF;
+        aku_Status cancelled = QueryCancellation::check();
+        if (cancelled != AKU_SUCCESS) {
+            // Query was abandoned by the client or timed out
+            return cancelled;
+        }
+        prefetch_children();
         if (get_direction() == Direction::FORWARD) {
             if (refs_pos_ == static_cast<i32>(refs_.size())) {
                 // Done
-                return std::make_tuple(AKU_ENO_DATA, std::move(empty));
+                return AKU_ENO_DATA;
             }
-            ref = refs_.at(static_cast<size_t>(refs_pos_));
+            *ref = refs_.at(static_cast<size_t>(refs_pos_));
             refs_pos_++;
         } else {
             if (refs_pos_ < 0) {
                 // Done
-                return std::make_tuple(AKU_ENO_DATA, std::move(empty));
+                return AKU_ENO_DATA;
             }
-            ref = refs_.at(static_cast<size_t>(refs_pos_));
+            *ref = refs_.at(static_cast<size_t>(refs_pos_));
             refs_pos_--;
         }
-        std::tuple<aku_Status, TIter> result;
-        if (!subtree_in_range(ref, min, max)) {
-            // Subtree not in [begin_, end_) range. Proceed to next.
-            result = std::make_tuple(AKU_ENOT_FOUND, std::move(empty));
-        } else if (ref.type == NBTreeBlockType::LEAF) {
-            result = std::move(make_leaf_iterator(ref));
-        } else {
-            result = std::move(make_superblock_iterator(ref));
+        if (!subtree_in_range(*ref, min, max) || skip_subtree(*ref)) {
+            // Subtree not in [begin_, end_) range or can't contain matching values. Proceed to next.
+            return AKU_ENOT_FOUND;
+        } else if (ref->addr < bstore_->get_min_live_addr()) {
+            // Subtree was deleted by retention (children of the superblock are
+            // always written before the superblock itself, so they're deleted too).
+            return AKU_EUNAVAILABLE;
+        } else if (consume_subtree(*ref)) {
+            return AKU_ENOT_FOUND;
+        }
+        return AKU_SUCCESS;
+    }
+
+    //! This is a template method, aggregator should derive from this object and
+    //! override make_*_iterator virtual methods to customize iterator's behavior.
+    std::tuple<aku_Status, TIter> get_next_iter() {
+        TIter empty;
+        SubtreeRef ref = INIT_SUBTREE_REF;
+        aku_Status status = next_subtree(&ref);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, std::move(empty));
         }
-        return std::move(result);
+        if (ref.type == NBTreeBlockType::LEAF) {
+            return make_leaf_iterator(ref);
+        }
+        return make_superblock_iterator(ref);
     }
 
     //! Iteration implementation. Can be customized in derived classes.
@@ -516,6 +843,198 @@ struct NBTreeSBlockIterator : NBTreeSBlockIteratorBase<double> {
     }
 };
 
+/** Superblock iterator used by the range scan. Direction is a template parameter, it's
+  * chosen once when the scan is created (see NBTreeSuperblock::search). Leaf nodes are
+  * read by the embedded cursor instead of the leaf iterators so the scan doesn't allocate
+  * anything per leaf node and doesn't dispatch reads of the leaf nodes through the
+  * operator interface.
+  */
+template<bool Forward>
+struct NBTreeSBlockScan : NBTreeSBlockIterator {
+    NBTreeLeafCursor<Forward> leaf_;
+
+    NBTreeSBlockScan(std::shared_ptr<BlockStore> bstore, LogicAddr addr, aku_Timestamp begin, aku_Timestamp end)
+        : NBTreeSBlockIterator(bstore, addr, begin, end)
+    {
+    }
+
+    NBTreeSBlockScan(std::shared_ptr<BlockStore> bstore, NBTreeSuperblock const& sblock, aku_Timestamp begin, aku_Timestamp end)
+        : NBTreeSBlockIterator(bstore, sblock, begin, end)
+    {
+    }
+
+    virtual std::tuple<aku_Status, TIter> make_superblock_iterator(const SubtreeRef &ref) {
+        TIter result;
+        result.reset(new NBTreeSBlockScan<Forward>(bstore_, ref.addr, begin_, end_));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+
+    aku_Status open_leaf(const SubtreeRef &ref) {
+        aku_Status status;
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = read_and_check(bstore_, ref.addr);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        NBTreeLeaf leaf(block);
+        return leaf_.reset(leaf, begin_, end_);
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, double *destval, size_t size) {
+        if (!fsm_pos_ ) {
+            aku_Status status = init();
+            if (status != AKU_SUCCESS) {
+                return std::make_pair(status, 0ul);
+            }
+            fsm_pos_++;
+        }
+        size_t out_size = 0;
+        while (out_size < size) {
+            if (!leaf_.empty()) {
+                out_size += leaf_.read(destts + out_size, destval + out_size, size - out_size);
+                continue;
+            }
+            aku_Status status;
+            if (iter_) {
+                size_t sz;
+                std::tie(status, sz) = iter_->read(destts + out_size, destval + out_size, size - out_size);
+                out_size += sz;
+                if (status == AKU_ENO_DATA) {
+                    iter_.reset();
+                } else if (status != AKU_SUCCESS) {
+                    return std::make_tuple(status, out_size);
+                }
+                continue;
+            }
+            SubtreeRef ref = INIT_SUBTREE_REF;
+            status = next_subtree(&ref);
+            if (status == AKU_ENOT_FOUND || status == AKU_EUNAVAILABLE) {
+                continue;
+            } else if (status != AKU_SUCCESS) {
+                return std::make_tuple(status, out_size);
+            }
+            if (ref.type == NBTreeBlockType::LEAF) {
+                status = open_leaf(ref);
+            } else {
+                std::tie(status, iter_) = make_superblock_iterator(ref);
+            }
+            if (status == AKU_EUNAVAILABLE) {
+                // Block was reclaimed after the check
+                continue;
+            } else if (status != AKU_SUCCESS) {
+                return std::make_tuple(status, out_size);
+            }
+        }
+        return std::make_tuple(AKU_SUCCESS, out_size);
+    }
+};
+
+/** Superblock iterator that returns only values that match the filter.
+  * Subtrees are skipped if their min and max values prove that they don't
+  * contain matching values.
+  */
+struct NBTreeSBlockFilter : NBTreeSBlockIterator {
+    ValueFilter filter_;
+
+    NBTreeSBlockFilter(std::shared_ptr<BlockStore> bstore, LogicAddr addr, aku_Timestamp begin, aku_Timestamp end,
+                       ValueFilter const& filter)
+        : NBTreeSBlockIterator(bstore, addr, begin, end)
+        , filter_(filter)
+    {
+    }
+
+    NBTreeSBlockFilter(std::shared_ptr<BlockStore> bstore, NBTreeSuperblock const& sblock, aku_Timestamp begin, aku_Timestamp end,
+                       ValueFilter const& filter)
+        : NBTreeSBlockIterator(bstore, sblock, begin, end)
+        , filter_(filter)
+    {
+    }
+
+    virtual bool skip_subtree(const SubtreeRef &ref) const {
+        return !filter_.match_range(ref.min, ref.max);
+    }
+
+    virtual std::tuple<aku_Status, TIter> make_leaf_iterator(const SubtreeRef &ref) {
+        assert(ref.type == NBTreeBlockType::LEAF);
+        aku_Status status;
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = read_and_check(bstore_, ref.addr);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, std::unique_ptr<RealValuedOperator>());
+        }
+        NBTreeLeaf leaf(block);
+        std::unique_ptr<RealValuedOperator> result;
+        result.reset(new NBTreeLeafIterator(begin_, end_, leaf, filter_));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+
+    virtual std::tuple<aku_Status, TIter> make_superblock_iterator(const SubtreeRef &ref) {
+        TIter result;
+        result.reset(new NBTreeSBlockFilter(bstore_, ref.addr, begin_, end_, filter_));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+};
+
+/** Superblock iterator with limit and offset.
+  * Subtrees that are inside the search range and fit into the offset are
+  * skipped using their value count, subtrees after the limit are not read.
+  * Leaf iterators share the limit so it's updated in iteration order.
+  */
+struct NBTreeSBlockLimit : NBTreeSBlockIterator {
+    std::shared_ptr<ScanLimit> limit_;
+
+    NBTreeSBlockLimit(std::shared_ptr<BlockStore> bstore, LogicAddr addr, aku_Timestamp begin, aku_Timestamp end,
+                      std::shared_ptr<ScanLimit> limit)
+        : NBTreeSBlockIterator(bstore, addr, begin, end)
+        , limit_(limit)
+    {
+    }
+
+    NBTreeSBlockLimit(std::shared_ptr<BlockStore> bstore, NBTreeSuperblock const& sblock, aku_Timestamp begin, aku_Timestamp end,
+                      std::shared_ptr<ScanLimit> limit)
+        : NBTreeSBlockIterator(bstore, sblock, begin, end)
+        , limit_(limit)
+    {
+    }
+
+    virtual bool skip_subtree(const SubtreeRef &ref) const {
+        AKU_UNUSED(ref);
+        return limit_->limit == 0;
+    }
+
+    virtual bool consume_subtree(const SubtreeRef &ref) {
+        if (limit_->limit == 0) {
+            return true;
+        }
+        // Forward range is [begin_, end_), backward range is (end_, begin_]
+        bool inside = begin_ < end_ ? begin_ <= ref.begin && ref.end < end_
+                                    : end_ < ref.begin && ref.end <= begin_;
+        if (inside && ref.count <= limit_->offset) {
+            limit_->offset -= ref.count;
+            return true;
+        }
+        return false;
+    }
+
+    virtual std::tuple<aku_Status, TIter> make_leaf_iterator(const SubtreeRef &ref) {
+        aku_Status status;
+        TIter leaf;
+        std::tie(status, leaf) = NBTreeSBlockIterator::make_leaf_iterator(ref);
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, std::move(leaf));
+        }
+        TIter result;
+        result.reset(new LimitOperator(std::move(leaf), limit_));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+
+    virtual std::tuple<aku_Status, TIter> make_superblock_iterator(const SubtreeRef &ref) {
+        TIter result;
+        result.reset(new NBTreeSBlockLimit(bstore_, ref.addr, begin_, end_, limit_));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+};
+
 // //////////////////// //
 // NBTreeLeafAggregator //
 // //////////////////// //
@@ -640,27 +1159,63 @@ ValueAggregator::Direction ValueAggregator::get_direction() {
     return dir_;
 }
 
+/** Estimate aggregate of the part of the subtree that belongs to [min, max) range.
+  * Values are assumed to be distributed evenly so count and sum are scaled by the
+  * fraction of the subtree's time range that overlaps the search range. Min, max,
+  * first and last values of the entire subtree are used.
+  */
+static AggregationResult estimate_subtree(SubtreeRef const& ref, aku_Timestamp min, aku_Timestamp max) {
+    auto agg = INIT_AGGRES;
+    agg.copy_from(ref);
+    aku_Timestamp lo = std::max(ref.begin, min);
+    aku_Timestamp hi = std::min(ref.end, max - 1);
+    double fraction = static_cast<double>(hi - lo + 1) / (static_cast<double>(ref.end - ref.begin) + 1.0);
+    if (fraction < 1.0) {
+        agg.cnt *= fraction;
+        agg.sum *= fraction;
+        agg._begin = lo;
+        agg._end = hi;
+        agg.mints = std::min(std::max(agg.mints, lo), hi);
+        agg.maxts = std::min(std::max(agg.maxts, lo), hi);
+        // Actual number of values in range is somewhere in [0, count]
+        double error = std::max(agg.cnt, static_cast<double>(ref.count) - agg.cnt);
+        QueryProfile::add(&QueryProfile::leaves_estimated, 1);
+        QueryProfile::add(&QueryProfile::count_error, static_cast<u64>(std::ceil(error)));
+    }
+    return agg;
+}
+
 /** Superblock aggregator (iterator that computes different aggregates e.g. min/max/avg/sum).
-  * Uses metadata stored in superblocks in some cases.
+  * Uses metadata stored in superblocks in some cases. In approximate mode leaf nodes
+  * are never read, their metadata is used instead.
   */
 class NBTreeSBlockAggregator : public NBTreeSBlockIteratorBase<AggregationResult> {
-
+    bool approximate_;
 public:
     NBTreeSBlockAggregator(std::shared_ptr<BlockStore> bstore,
                            NBTreeSuperblock const& sblock,
                            aku_Timestamp begin,
-                           aku_Timestamp end)
+                           aku_Timestamp end,
+                           bool approximate=false)
         : NBTreeSBlockIteratorBase<AggregationResult>(bstore, sblock, begin, end)
+        , approximate_(approximate)
     {
     }
 
     NBTreeSBlockAggregator(std::shared_ptr<BlockStore> bstore,
                            LogicAddr addr,
                            aku_Timestamp begin,
-                           aku_Timestamp end)
+                           aku_Timestamp end,
+                           bool approximate=false)
         : NBTreeSBlockIteratorBase<AggregationResult>(bstore, addr, begin, end)
+        , approximate_(approximate)
     {
     }
+
+    virtual bool skip_subtree_read(const SubtreeRef &ref) const override {
+        return approximate_ && ref.type == NBTreeBlockType::LEAF;
+    }
+
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_leaf_iterator(const SubtreeRef &ref) override;
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_superblock_iterator(const SubtreeRef &ref) override;
     virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) override;
@@ -715,6 +1270,13 @@ std::tuple<aku_Status, size_t> NBTreeSBlockAggregator::read(aku_Timestamp *destt
 }
 
 std::tuple<aku_Status, std::unique_ptr<AggregateOperator> > NBTreeSBlockAggregator::make_leaf_iterator(SubtreeRef const& ref) {
+    if (approximate_) {
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
+        auto agg = estimate_subtree(ref, std::min(begin_, end_), std::max(begin_, end_));
+        std::unique_ptr<AggregateOperator> result;
+        result.reset(new ValueAggregator(ref.end, agg, get_direction()));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
     aku_Status status;
     std::shared_ptr<Block> block;
     std::tie(status, block) = read_and_check(bstore_, ref.addr);
@@ -733,39 +1295,238 @@ std::tuple<aku_Status, std::unique_ptr<AggregateOperator> > NBTreeSBlockAggregat
     std::unique_ptr<AggregateOperator> result;
     if (min <= ref.begin && ref.end < max) {
         // We don't need to go to lower level, value from subtree ref can be used instead.
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
         auto agg = INIT_AGGRES;
         agg.copy_from(ref);
         result.reset(new ValueAggregator(ref.end, agg, get_direction()));
     } else {
-        result.reset(new NBTreeSBlockAggregator(bstore_, ref.addr, begin_, end_));
+        result.reset(new NBTreeSBlockAggregator(bstore_, ref.addr, begin_, end_, approximate_));
     }
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
 
-// ///////////////////////// //
-// NBTreeLeafGroupAggregator //
-// ///////////////////////// //
+// ///////////////////// //
+// NBTreeLeafValueRanges //
+// ///////////////////// //
 
-class NBTreeLeafGroupAggregator : public AggregateOperator {
+/** Value range search in the leaf node. Returns aggregates of the runs of
+  * consecutive values that match the filter. Runs are separated by empty
+  * aggregates (zero count) if they're interrupted by values that don't match.
+  * Runs produced by the adjacent nodes are joined by the ValueRangeOperator.
+  */
+class NBTreeLeafValueRanges : public AggregateOperator {
     NBTreeLeafIterator iter_;
-    bool enable_cached_metadata_;
-    SubtreeRef metacache_;
-    aku_Timestamp begin_;
-    aku_Timestamp end_;
-    aku_Timestamp step_;
+    ValueFilter filter_;
+    std::vector<aku_Timestamp> outts_;
+    std::vector<AggregationResult> outxs_;
+    size_t pos_;
+    aku_Status status_;
 public:
-    NBTreeLeafGroupAggregator(aku_Timestamp begin, aku_Timestamp end, u64 step, NBTreeLeaf const& node)
-        : iter_(begin, end, node, true)
-        , enable_cached_metadata_(false)
-        , metacache_(INIT_SUBTREE_REF)
-        , begin_(begin)
-        , end_(end)
-        , step_(step)
+    NBTreeLeafValueRanges(aku_Timestamp begin, aku_Timestamp end, NBTreeLeaf const& node, ValueFilter const& filter)
+        : iter_(begin, end, node)
+        , filter_(filter)
+        , pos_(0)
+        , status_(AKU_SUCCESS)
     {
-        aku_Timestamp nodemin, nodemax;
-        std::tie(nodemin, nodemax) = node.get_timestamps();
-        if (begin < end) {
+        status_ = init();
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destxs, size_t size) override;
+    virtual Direction get_direction() override;
+
+private:
+    //! Split values of the leaf into runs
+    aku_Status init();
+};
+
+aku_Status NBTreeLeafValueRanges::init() {
+    size_t size_hint = iter_.get_size();
+    if (size_hint == 0) {
+        return AKU_SUCCESS;
+    }
+    std::vector<double> xs(size_hint, .0);
+    std::vector<aku_Timestamp> ts(size_hint, 0);
+    aku_Status status;
+    size_t size;
+    std::tie(status, size) = iter_.read(ts.data(), xs.data(), size_hint);
+    if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+        return status;
+    }
+    bool forward = get_direction() == Direction::FORWARD;
+    AggregationResult run = INIT_AGGRES;
+    for (size_t i = 0; i < size; i++) {
+        if (filter_.match(xs[i])) {
+            run.add(ts[i], xs[i], forward);
+            continue;
+        }
+        if (run.cnt != 0) {
+            outts_.push_back(run._begin);
+            outxs_.push_back(run);
+            run = INIT_AGGRES;
+        }
+        if (outxs_.empty() || outxs_.back().cnt != 0) {
+            outts_.push_back(ts[i]);
+            outxs_.push_back(INIT_AGGRES);
+        }
+    }
+    if (run.cnt != 0) {
+        outts_.push_back(run._begin);
+        outxs_.push_back(run);
+    }
+    return AKU_SUCCESS;
+}
+
+NBTreeLeafValueRanges::Direction NBTreeLeafValueRanges::get_direction() {
+    return iter_.get_direction() == NBTreeLeafIterator::Direction::FORWARD ? Direction::FORWARD : Direction::BACKWARD;
+}
+
+std::tuple<aku_Status, size_t> NBTreeLeafValueRanges::read(aku_Timestamp *destts, AggregationResult *destxs, size_t size) {
+    if (size == 0) {
+        return std::make_tuple(AKU_EBAD_ARG, 0);
+    }
+    if (status_ != AKU_SUCCESS) {
+        return std::make_tuple(status_, 0);
+    }
+    size_t outsz = std::min(size, outxs_.size() - pos_);
+    std::copy(outts_.begin() + pos_, outts_.begin() + pos_ + outsz, destts);
+    std::copy(outxs_.begin() + pos_, outxs_.begin() + pos_ + outsz, destxs);
+    pos_ += outsz;
+    return std::make_tuple(pos_ == outxs_.size() ? AKU_ENO_DATA : AKU_SUCCESS, outsz);
+}
+
+
+// /////////////////////// //
+// NBTreeSBlockValueRanges //
+// /////////////////////// //
+
+/** Superblock value range search. Subtree that doesn't contain matching values
+  * becomes a separator and subtree that contains only matching values becomes
+  * a run, both without reading. Only subtrees that cross the threshold are read.
+  */
+class NBTreeSBlockValueRanges : public NBTreeSBlockIteratorBase<AggregationResult> {
+    ValueFilter filter_;
+public:
+    NBTreeSBlockValueRanges(std::shared_ptr<BlockStore> bstore,
+                            NBTreeSuperblock const& sblock,
+                            aku_Timestamp begin,
+                            aku_Timestamp end,
+                            ValueFilter const& filter)
+        : NBTreeSBlockIteratorBase<AggregationResult>(bstore, sblock, begin, end)
+        , filter_(filter)
+    {
+    }
+
+    NBTreeSBlockValueRanges(std::shared_ptr<BlockStore> bstore,
+                            LogicAddr addr,
+                            aku_Timestamp begin,
+                            aku_Timestamp end,
+                            ValueFilter const& filter)
+        : NBTreeSBlockIteratorBase<AggregationResult>(bstore, addr, begin, end)
+        , filter_(filter)
+    {
+    }
+
+    virtual bool skip_subtree_read(const SubtreeRef &ref) const override {
+        return !filter_.match_range(ref.min, ref.max) || matches_entirely(ref);
+    }
+
+    virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_leaf_iterator(const SubtreeRef &ref) override;
+    virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_superblock_iterator(const SubtreeRef &ref) override;
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) override;
+
+private:
+    //! Return true if the subtree is inside the search range and all its values match the filter
+    bool matches_entirely(const SubtreeRef &ref) const;
+    //! Create iterator from the subtree metadata, return empty pointer if the subtree should be read
+    std::unique_ptr<AggregateOperator> make_metadata_iterator(const SubtreeRef &ref);
+};
+
+bool NBTreeSBlockValueRanges::matches_entirely(const SubtreeRef &ref) const {
+    // Search range is [begin_, end_) if forward and (end_, begin_] if backward
+    bool inside = begin_ < end_ ? begin_ <= ref.begin && ref.end < end_
+                                : end_ < ref.begin && ref.end <= begin_;
+    // Filter is an interval so all values in [ref.min, ref.max] match if both ends match
+    return inside && filter_.match(ref.min) && filter_.match(ref.max);
+}
+
+std::unique_ptr<AggregateOperator> NBTreeSBlockValueRanges::make_metadata_iterator(const SubtreeRef &ref) {
+    std::unique_ptr<AggregateOperator> result;
+    if (!filter_.match_range(ref.min, ref.max)) {
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
+        result.reset(new ValueAggregator(ref.begin, INIT_AGGRES, get_direction()));
+    } else if (matches_entirely(ref)) {
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
+        auto agg = INIT_AGGRES;
+        agg.copy_from(ref);
+        result.reset(new ValueAggregator(ref.begin, agg, get_direction()));
+    }
+    return result;
+}
+
+std::tuple<aku_Status, size_t> NBTreeSBlockValueRanges::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    if (size == 0) {
+        return std::make_pair(AKU_EBAD_ARG, 0ul);
+    }
+    if (!fsm_pos_ ) {
+        aku_Status status = AKU_SUCCESS;
+        status = init();
+        if (status != AKU_SUCCESS) {
+            return std::make_pair(status, 0ul);
+        }
+        fsm_pos_++;
+    }
+    return iter(destts, destval, size);
+}
+
+std::tuple<aku_Status, std::unique_ptr<AggregateOperator> > NBTreeSBlockValueRanges::make_leaf_iterator(SubtreeRef const& ref) {
+    auto result = make_metadata_iterator(ref);
+    if (result) {
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+    aku_Status status;
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = read_and_check(bstore_, ref.addr);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, std::unique_ptr<AggregateOperator>());
+    }
+    NBTreeLeaf leaf(block);
+    result.reset(new NBTreeLeafValueRanges(begin_, end_, leaf, filter_));
+    return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
+
+std::tuple<aku_Status, std::unique_ptr<AggregateOperator> > NBTreeSBlockValueRanges::make_superblock_iterator(SubtreeRef const& ref) {
+    auto result = make_metadata_iterator(ref);
+    if (!result) {
+        result.reset(new NBTreeSBlockValueRanges(bstore_, ref.addr, begin_, end_, filter_));
+    }
+    return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
+
+
+// ///////////////////////// //
+// NBTreeLeafGroupAggregator //
+// ///////////////////////// //
+
+class NBTreeLeafGroupAggregator : public AggregateOperator {
+    NBTreeLeafIterator iter_;
+    bool enable_cached_metadata_;
+    SubtreeRef metacache_;
+    aku_Timestamp begin_;
+    aku_Timestamp end_;
+    aku_Timestamp step_;
+public:
+    NBTreeLeafGroupAggregator(aku_Timestamp begin, aku_Timestamp end, u64 step, NBTreeLeaf const& node)
+        : iter_(begin, end, node, true)
+        , enable_cached_metadata_(false)
+        , metacache_(INIT_SUBTREE_REF)
+        , begin_(begin)
+        , end_(end)
+        , step_(step)
+    {
+        aku_Timestamp nodemin, nodemax;
+        std::tie(nodemin, nodemax) = node.get_timestamps();
+        if (begin < end) {
             auto a = (nodemin - begin) / step;
             auto b = (nodemax - begin) / step;
             if (a == b && nodemin >= begin && nodemax < end) {
@@ -834,35 +1595,15 @@ std::tuple<aku_Status, size_t> NBTreeLeafGroupAggregator::read(aku_Timestamp *de
             return std::make_tuple(AKU_ENO_DATA, 0);
         }
         assert(out_size == size_hint);
-        int valcnt = 0;
-        AggregationResult outval = INIT_AGGRES;
         const bool forward = begin_ < end_;
-        u64 bin = 0;
-        for (size_t ix = 0; ix < out_size; ix++) {
-            aku_Timestamp normts = forward ? ts[ix] - begin_
-                                           : begin_ - ts[ix];
-            if (valcnt == 0) {
-                bin = normts / step_;
-            } else if (normts / step_ != bin) {
-                bin = normts / step_;
-                destxs[outix] = outval;
-                destts[outix] = outval._begin;
-                outix++;
-                outval = INIT_AGGRES;
-            }
-            valcnt++;
-            outval.add(ts[ix], xs[ix], forward);
+        outix = aggregate_by_step(ts.data(), xs.data(), out_size, begin_, step_, forward, destts, destxs);
+#ifndef NDEBUG
+        for (size_t ix = 0; ix < outix; ix++) {
             // Check invariant
-            auto delta = outval._end - outval._begin;
-            if (delta > step_) {
-                assert(delta <= step_);
-            }
-        }
-        if (outval.cnt > 0) {
-            destxs[outix] = outval;
-            destts[outix] = outval._begin;
-            outix++;
+            auto delta = destxs[ix]._end - destxs[ix]._begin;
+            assert(delta <= step_);
         }
+#endif
     }
     assert(outix <= size);
     return std::make_tuple(AKU_SUCCESS, outix);
@@ -1045,6 +1786,15 @@ public:
         return status;
     }
 
+    /** Return true if the whole subtree is inside the query range and belongs to one
+      * bucket. Aggregates from the link can be used instead of reading the subtree.
+      */
+    bool fits_one_bucket(SubtreeRef const& ref) const;
+
+    virtual bool skip_subtree_read(const SubtreeRef &ref) const override {
+        return fits_one_bucket(ref);
+    }
+
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_leaf_iterator(const SubtreeRef &ref) override;
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_superblock_iterator(const SubtreeRef &ref) override;
     virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) override;
@@ -1067,7 +1817,31 @@ std::tuple<aku_Status, size_t> NBTreeSBlockGroupAggregator::read(aku_Timestamp *
     return copy_to(destts, destval, size);
 }
 
+bool NBTreeSBlockGroupAggregator::fits_one_bucket(SubtreeRef const& ref) const {
+    if (begin_ < end_) {
+        // Bucket `k` is [begin + k*step, begin + (k+1)*step)
+        if (ref.begin < begin_ || ref.end >= end_) {
+            return false;
+        }
+        return (ref.begin - begin_) / step_ == (ref.end - begin_) / step_;
+    }
+    // Bucket `k` is (begin - (k+1)*step, begin - k*step]
+    if (ref.end > begin_ || ref.begin <= end_) {
+        return false;
+    }
+    return (begin_ - ref.end) / step_ == (begin_ - ref.begin) / step_;
+}
+
 std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockGroupAggregator::make_leaf_iterator(SubtreeRef const& ref) {
+    if (fits_one_bucket(ref)) {
+        // Link to the leaf contains all the aggregates, the leaf itself is not read
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
+        std::unique_ptr<AggregateOperator> result;
+        auto agg = INIT_AGGRES;
+        agg.copy_from(ref);
+        result.reset(new ValueAggregator(ref.end, agg, get_direction()));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
     aku_Status status;
     std::shared_ptr<Block> block;
     std::tie(status, block) = read_and_check(bstore_, ref.addr);
@@ -1082,24 +1856,9 @@ std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockGroupAggr
 
 std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockGroupAggregator::make_superblock_iterator(SubtreeRef const& ref) {
     std::unique_ptr<AggregateOperator> result;
-    bool inner = false;
-    if (get_direction() == Direction::FORWARD) {
-        auto const query_boundary = (end_ - begin_) / step_;
-        auto const start_bucket = (ref.begin - begin_) / step_;
-        auto const stop_bucket = (ref.end - begin_) / step_;
-        if (start_bucket == stop_bucket && stop_bucket != query_boundary) {
-            inner = true;
-        }
-    } else {
-        auto const query_boundary = (begin_ - end_) / step_;
-        auto const start_bucket = (begin_ - ref.end) / step_;
-        auto const stop_bucket = (begin_ - ref.begin) / step_;
-        if (start_bucket == stop_bucket && stop_bucket != query_boundary) {
-            inner = true;
-        }
-    }
-    if (inner) {
+    if (fits_one_bucket(ref)) {
         // We don't need to go to lower level, value from subtree ref can be used instead.
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
         auto agg = INIT_AGGRES;
         agg.copy_from(ref);
         result.reset(new ValueAggregator(ref.end, agg, get_direction()));
@@ -1114,6 +1873,95 @@ std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockGroupAggr
 // NBTreeSBlockCandlesticksIter //
 // //////////////////////////// //
 
+/** Precomputed list of candlesticks (see `make_leaf_candlesticks`).
+  */
+class CandlestickList : public AggregateOperator {
+    std::vector<aku_Timestamp> ts_;
+    std::vector<AggregationResult> xs_;
+    size_t pos_;
+    Direction dir_;
+public:
+    CandlestickList(std::vector<aku_Timestamp>&& ts, std::vector<AggregationResult>&& xs, Direction dir)
+        : ts_(std::move(ts))
+        , xs_(std::move(xs))
+        , pos_(0)
+        , dir_(dir)
+    {
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) override {
+        if (pos_ == ts_.size()) {
+            return std::make_tuple(AKU_ENO_DATA, 0ul);
+        }
+        size_t n = std::min(size, ts_.size() - pos_);
+        std::copy(ts_.begin() + static_cast<long>(pos_), ts_.begin() + static_cast<long>(pos_ + n), destts);
+        std::copy(xs_.begin() + static_cast<long>(pos_), xs_.begin() + static_cast<long>(pos_ + n), destval);
+        pos_ += n;
+        return std::make_tuple(AKU_SUCCESS, n);
+    }
+
+    virtual Direction get_direction() override {
+        return dir_;
+    }
+};
+
+//! Return true if the subtree is inside the query range and spans less than `min_delta`
+static bool fits_one_candlestick(SubtreeRef const& ref, aku_Timestamp begin, aku_Timestamp end,
+                                 NBTreeCandlestickHint const& hint)
+{
+    aku_Timestamp min = std::min(begin, end);
+    aku_Timestamp max = std::max(begin, end);
+    bool inside = begin < end ? min <= ref.begin && ref.end < max
+                              : min < ref.begin && ref.end <= max;
+    return inside && ref.end - ref.begin < hint.min_delta;
+}
+
+/** Split values of the leaf node that belong to the query range into candlesticks.
+  * Candlestick is closed when the next value is `min_delta` or more away from its
+  * first value. Timestamp of the candlestick is a timestamp of its first value.
+  */
+static std::unique_ptr<AggregateOperator> make_leaf_candlesticks(NBTreeLeaf const& leaf,
+                                                                 aku_Timestamp begin,
+                                                                 aku_Timestamp end,
+                                                                 NBTreeCandlestickHint const& hint)
+{
+    bool forward = begin < end;
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    std::vector<aku_Timestamp> outts;
+    std::vector<AggregationResult> outxs;
+    aku_Status status = leaf.read_all(&tss, &xss);
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't read leaf node, " + StatusUtil::str(status));
+        tss.clear();
+    }
+    for (size_t i = 0; i < tss.size(); i++) {
+        bool inside = forward ? begin <= tss[i] && tss[i] < end
+                              : end < tss[i] && tss[i] <= begin;
+        if (!inside) {
+            continue;
+        }
+        if (outts.empty() || tss[i] - outts.back() >= hint.min_delta) {
+            outts.push_back(tss[i]);
+            outxs.push_back(INIT_AGGRES);
+        }
+        outxs.back().add(tss[i], xss[i], true);
+    }
+    if (!forward) {
+        std::reverse(outts.begin(), outts.end());
+        std::reverse(outxs.begin(), outxs.end());
+    }
+    std::unique_ptr<AggregateOperator> result;
+    result.reset(new CandlestickList(std::move(outts), std::move(outxs),
+                                     forward ? AggregateOperator::Direction::FORWARD
+                                             : AggregateOperator::Direction::BACKWARD));
+    return result;
+}
+
+/** Candlestick iterator. Subtree that spans less than `min_delta` is returned
+  * as one candlestick computed from the subtree ref (without reading it), other
+  * subtrees are split further. Leaf nodes are split using raw values.
+  */
 class NBTreeSBlockCandlesticsIter : public NBTreeSBlockIteratorBase<AggregationResult> {
     NBTreeCandlestickHint hint_;
 public:
@@ -1138,33 +1986,47 @@ public:
     }
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_leaf_iterator(const SubtreeRef &ref) override;
     virtual std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> make_superblock_iterator(const SubtreeRef &ref) override;
+    virtual bool skip_subtree_read(const SubtreeRef &ref) const override;
     virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size) override;
 };
 
 
 std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockCandlesticsIter::make_leaf_iterator(const SubtreeRef &ref) {
-    auto agg = INIT_AGGRES;
-    agg.copy_from(ref);
     std::unique_ptr<AggregateOperator> result;
-    result.reset(new ValueAggregator(ref.end, agg, get_direction()));
+    if (fits_one_candlestick(ref, begin_, end_, hint_)) {
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
+        auto agg = INIT_AGGRES;
+        agg.copy_from(ref);
+        result.reset(new ValueAggregator(ref.begin, agg, get_direction()));
+        return std::make_tuple(AKU_SUCCESS, std::move(result));
+    }
+    aku_Status status;
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = read_and_check(bstore_, ref.addr);
+    if (status != AKU_SUCCESS) {
+        return std::make_tuple(status, std::move(result));
+    }
+    NBTreeLeaf leaf(block);
+    result = make_leaf_candlesticks(leaf, begin_, end_, hint_);
     return std::make_tuple(AKU_SUCCESS, std::move(result));
 }
 
 std::tuple<aku_Status, std::unique_ptr<AggregateOperator>> NBTreeSBlockCandlesticsIter::make_superblock_iterator(const SubtreeRef &ref) {
-    aku_Timestamp min = std::min(begin_, end_);
-    aku_Timestamp max = std::max(begin_, end_);
-    aku_Timestamp delta = max - min;
     std::unique_ptr<AggregateOperator> result;
-    if (min < ref.begin && ref.end < max && hint_.min_delta > delta) {
+    if (fits_one_candlestick(ref, begin_, end_, hint_)) {
         // We don't need to go to lower level, value from subtree ref can be used instead.
+        QueryProfile::add(&QueryProfile::subtrees_skipped, 1);
         auto agg = INIT_AGGRES;
         agg.copy_from(ref);
-        result.reset(new ValueAggregator(ref.end, agg, get_direction()));
+        result.reset(new ValueAggregator(ref.begin, agg, get_direction()));
     } else {
         result.reset(new NBTreeSBlockCandlesticsIter(bstore_, ref.addr, begin_, end_, hint_));
     }
     return std::make_tuple(AKU_SUCCESS, std::move(result));
+}
 
+bool NBTreeSBlockCandlesticsIter::skip_subtree_read(const SubtreeRef &ref) const {
+    return fits_one_candlestick(ref, begin_, end_, hint_);
 }
 
 std::tuple<aku_Status, size_t> NBTreeSBlockCandlesticsIter::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
@@ -1184,12 +2046,18 @@ std::tuple<aku_Status, size_t> NBTreeSBlockCandlesticsIter::read(aku_Timestamp *
 //    NBTreeLeaf    //
 // //////////////// //
 
-NBTreeLeaf::NBTreeLeaf(aku_ParamId id, LogicAddr prev, u16 fanout_index)
+NBTreeLeaf::NBTreeLeaf(aku_ParamId id, LogicAddr prev, u16 fanout_index, bool packed)
     : prev_(prev)
-    , block_(std::make_shared<Block>())
-    , writer_(id, block_->get_data() + sizeof(SubtreeRef), AKU_BLOCK_SIZE - sizeof(SubtreeRef))
+    , block_(std::make_shared<Block>(EMPTY_ADDR, std::vector<u8>(packed ? static_cast<size_t>(PACKED_BLOCK_SIZE)
+                                                                                : static_cast<size_t>(COMPACT_BLOCK_SIZE), 0)))
+    , writer_(id, block_->get_data() + sizeof(SubtreeRef), static_cast<int>(block_->get_size() - sizeof(SubtreeRef)))
     , fanout_index_(fanout_index)
+    , packed_(packed)
+    , next_check_(0)
 {
+    static_assert(COMPACT_BLOCK_SIZE >= sizeof(SubtreeRef) + DataBlockWriter::HEADER_SIZE + sizeof(ChunkDirectory)
+                                        + DataBlockWriter::CHUNK_MARGIN,
+                  "Compact leaf node can't buffer the first chunk");
     // Check that invariant holds.
     SubtreeRef* subtree = subtree_cast(block_->get_data());
     subtree->addr = prev;
@@ -1218,18 +2086,46 @@ NBTreeLeaf::NBTreeLeaf(std::shared_ptr<BlockStore> bstore, LogicAddr curr)
 {
 }
 
+bool NBTreeLeaf::is_packed(SubtreeRef const& ref) {
+    return ref.type == NBTreeBlockType::LEAF && (ref.version & PACKED_FLAG) != 0;
+}
+
+/** Decompress payload of the packed leaf node into the new buffer.
+  * Header of the node is copied as is, packed flag is preserved.
+  * Other blocks are returned unchanged.
+  */
+static std::shared_ptr<Block> unpack(std::shared_ptr<Block> block) {
+    const SubtreeRef* subtree = subtree_cast(block->get_cdata());
+    if (!NBTreeLeaf::is_packed(*subtree)) {
+        return block;
+    }
+    std::vector<u8> data(static_cast<size_t>(NBTreeLeaf::PACKED_BLOCK_SIZE), 0);
+    memcpy(data.data(), block->get_cdata(), sizeof(SubtreeRef));
+    uLongf size = static_cast<uLongf>(data.size() - sizeof(SubtreeRef));
+    int err = uncompress(data.data() + sizeof(SubtreeRef), &size,
+                         block->get_cdata() + sizeof(SubtreeRef), subtree->payload_size);
+    if (err != Z_OK) {
+        AKU_PANIC("Can't decompress packed leaf node " + std::to_string(block->get_addr()) +
+                  ", zlib error " + std::to_string(err));
+    }
+    return std::make_shared<Block>(block->get_addr(), std::move(data));
+}
+
 NBTreeLeaf::NBTreeLeaf(std::shared_ptr<Block> block)
     : prev_(EMPTY_ADDR)
+    , packed_(false)
+    , next_check_(0)
 {
-    block_ = block;
+    block_ = unpack(block);
     const SubtreeRef* subtree = subtree_cast(block_->get_cdata());
     prev_ = subtree->addr;
     fanout_index_ = subtree->fanout_index;
+    packed_ = is_packed(*subtree);
 }
 
 static std::shared_ptr<Block> clone(std::shared_ptr<Block> block) {
-    auto res = std::make_shared<Block>();
-    memcpy(res->get_data(), block->get_cdata(), AKU_BLOCK_SIZE);
+    auto res = std::make_shared<Block>(EMPTY_ADDR, std::vector<u8>(block->get_size(), 0));
+    memcpy(res->get_data(), block->get_cdata(), block->get_size());
     return res;
 }
 
@@ -1240,10 +2136,13 @@ static aku_ParamId getid(std::shared_ptr<Block> const& block) {
 
 NBTreeLeaf::NBTreeLeaf(std::shared_ptr<Block> block, NBTreeLeaf::CloneTag)
     : prev_(EMPTY_ADDR)
-    , block_(clone(block))
-    , writer_(getid(block_), block_->get_data() + sizeof(SubtreeRef), AKU_BLOCK_SIZE - sizeof(SubtreeRef))
+    , block_(clone(unpack(block)))
+    , writer_(getid(block_), block_->get_data() + sizeof(SubtreeRef), static_cast<int>(block_->get_size() - sizeof(SubtreeRef)))
+    , packed_(is_packed(*subtree_cast(block_->get_cdata())))
+    , next_check_(0)
 {
     // Re-insert the data
+    block = unpack(block);
     DataBlockReader reader(block->get_cdata() + sizeof(SubtreeRef), block->get_size());
     size_t sz = reader.nelements();
     for (size_t ix = 0; ix < sz; ix++) {
@@ -1269,14 +2168,40 @@ NBTreeLeaf::NBTreeLeaf(std::shared_ptr<Block> block, NBTreeLeaf::CloneTag)
     fanout_index_ = subtree->fanout_index;
 }
 
+void NBTreeLeaf::reserve(size_t nvalues) {
+    if (block_->get_size() == COMPACT_BLOCK_SIZE &&
+        writer_.get_write_index() + nvalues >= DataBlockWriter::CHUNK_SIZE)
+    {
+        expand();
+    }
+}
+
+void NBTreeLeaf::expand() {
+    if (block_->get_size() != COMPACT_BLOCK_SIZE) {
+        return;
+    }
+    auto block = std::make_shared<Block>();
+    memcpy(block->get_data(), block_->get_cdata(), sizeof(SubtreeRef));
+    writer_.relocate(block->get_data() + sizeof(SubtreeRef), AKU_BLOCK_SIZE - sizeof(SubtreeRef));
+    block_ = block;
+}
+
 size_t NBTreeLeaf::_get_uncommitted_size() const {
     return static_cast<size_t>(writer_.get_write_index());
 }
 
+size_t NBTreeLeaf::_get_buffer_size() const {
+    return block_->get_size();
+}
+
 SubtreeRef const* NBTreeLeaf::get_leafmeta() const {
     return subtree_cast(block_->get_cdata());
 }
 
+bool NBTreeLeaf::is_packed() const {
+    return packed_;
+}
+
 size_t NBTreeLeaf::nelements() const {
     SubtreeRef const* subtree = subtree_cast(block_->get_cdata());
     return subtree->count;
@@ -1323,20 +2248,22 @@ aku_Status NBTreeLeaf::read_all(std::vector<aku_Timestamp>* timestamps,
                                 std::vector<double>* values) const
 {
     int windex = writer_.get_write_index();
+    QueryProfile::add(&QueryProfile::leaves_decoded, 1);
     DataBlockReader reader(block_->get_cdata() + sizeof(SubtreeRef), block_->get_size());
     size_t sz = reader.nelements();
-    timestamps->reserve(sz);
-    values->reserve(sz);
-    for (size_t ix = 0; ix < sz; ix++) {
+    size_t pos = timestamps->size();
+    timestamps->resize(pos + sz);
+    values->resize(pos + sz);
+    if (sz != 0) {
         aku_Status status;
-        aku_Timestamp ts;
-        double value;
-        std::tie(status, ts, value) = reader.next();
+        size_t nread;
+        std::tie(status, nread) = reader.read_batch(timestamps->data() + pos, values->data() + pos, sz);
         if (status != AKU_SUCCESS) {
             return status;
         }
-        timestamps->push_back(ts);
-        values->push_back(value);
+        if (nread != sz) {
+            return AKU_EBAD_DATA;
+        }
     }
     // Read tail elements from `writer_`
     if (windex != 0) {
@@ -1345,7 +2272,82 @@ aku_Status NBTreeLeaf::read_all(std::vector<aku_Timestamp>* timestamps,
     return AKU_SUCCESS;
 }
 
+aku_Status NBTreeLeaf::read_until(aku_Timestamp max,
+                                  std::vector<aku_Timestamp>* timestamps,
+                                  std::vector<double>* values) const
+{
+    return read_range(AKU_MIN_TIMESTAMP, max, timestamps, values);
+}
+
+aku_Status NBTreeLeaf::read_range(aku_Timestamp min,
+                                  aku_Timestamp max,
+                                  std::vector<aku_Timestamp>* timestamps,
+                                  std::vector<double>* values) const
+{
+    const SubtreeRef* subtree = subtree_cast(block_->get_cdata());
+    if (subtree->end <= max && subtree->begin >= min) {
+        return read_all(timestamps, values);
+    }
+    QueryProfile::add(&QueryProfile::leaves_decoded, 1);
+    DataBlockReader reader(block_->get_cdata() + sizeof(SubtreeRef), block_->get_size());
+    // Chunks that precede the restart point are not decoded
+    size_t sz = reader.nelements() - reader.seek(min);
+    size_t pos = timestamps->size();
+    timestamps->resize(pos + sz);
+    values->resize(pos + sz);
+    size_t nread = 0;
+    while (nread < sz) {
+        // Values are decoded one chunk at a time to stop on the first chunk after `max`
+        aku_Status status;
+        size_t n;
+        std::tie(status, n) = reader.read_batch(timestamps->data() + pos + nread,
+                                                values->data() + pos + nread,
+                                                std::min(sz - nread, static_cast<size_t>(DataBlockReader::CHUNK_SIZE)));
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        nread += n;
+        if (timestamps->at(pos + nread - 1) > max) {
+            break;
+        }
+    }
+    timestamps->resize(pos + nread);
+    values->resize(pos + nread);
+    if (nread == sz && writer_.get_write_index() != 0) {
+        writer_.read_tail_elements(timestamps, values);
+    }
+    return AKU_SUCCESS;
+}
+
+bool NBTreeLeaf::has_room_packed() {
+    // Deflated stream grows by at most the size of the data added to the uncompressed stream
+    // (plus some small overhead) so the node is compressed only when the uncompressed stream
+    // outgrows the space left in the block after the previous check. The margin accounts for
+    // the chunk that can be written by the next `put` and the tail written by `commit`.
+    enum {
+        MARGIN = DataBlockWriter::CHUNK_MARGIN + DataBlockWriter::CHUNK_SIZE*16 + 64,
+        CAPACITY = AKU_BLOCK_SIZE - sizeof(SubtreeRef) - MARGIN,
+    };
+    size_t size = writer_.stream_.size();
+    if (size < next_check_) {
+        return true;
+    }
+    uLongf packed_size = compressBound(static_cast<uLong>(size));
+    std::vector<u8> buffer(packed_size);
+    int err = compress2(buffer.data(), &packed_size, block_->get_cdata() + sizeof(SubtreeRef),
+                        static_cast<uLong>(size), Z_BEST_COMPRESSION);
+    if (err != Z_OK || packed_size >= CAPACITY) {
+        return false;
+    }
+    next_check_ = size + (CAPACITY - packed_size);
+    return true;
+}
+
 aku_Status NBTreeLeaf::append(aku_Timestamp ts, double value) {
+    if (packed_ && !has_room_packed()) {
+        return AKU_EOVERFLOW;
+    }
+    reserve(1);
     aku_Status status = writer_.put(ts, value);
     if (status == AKU_SUCCESS) {
         SubtreeRef* subtree = subtree_cast(block_->get_data());
@@ -1369,8 +2371,46 @@ aku_Status NBTreeLeaf::append(aku_Timestamp ts, double value) {
     return status;
 }
 
+size_t NBTreeLeaf::append_range(aku_Timestamp const* ts, double const* xs, size_t size) {
+    if (packed_) {
+        // Space left in the packed node is checked before every value
+        size_t nvalues = 0;
+        while (nvalues < size && append(ts[nvalues], xs[nvalues]) == AKU_SUCCESS) {
+            nvalues++;
+        }
+        return nvalues;
+    }
+    reserve(size);
+    size_t nvalues = writer_.put_range(ts, xs, size);
+    if (nvalues == 0) {
+        return 0;
+    }
+    SubtreeRef* subtree = subtree_cast(block_->get_data());
+    if (subtree->count == 0) {
+        subtree->begin = ts[0];
+        subtree->first = xs[0];
+    }
+    subtree->end = ts[nvalues - 1];
+    subtree->last = xs[nvalues - 1];
+    subtree->count += nvalues;
+    for (size_t i = 0; i < nvalues; i++) {
+        subtree->sum += xs[i];
+        if (subtree->max < xs[i]) {
+            subtree->max = xs[i];
+            subtree->max_time = ts[i];
+        }
+        if (subtree->min > xs[i]) {
+            subtree->min = xs[i];
+            subtree->min_time = ts[i];
+        }
+    }
+    return nvalues;
+}
+
 std::tuple<aku_Status, LogicAddr> NBTreeLeaf::commit(std::shared_ptr<BlockStore> bstore) {
     assert(nelements() != 0);
+    // Only full blocks can be saved
+    expand();
     u16 size = static_cast<u16>(writer_.commit());
     assert(size);
     SubtreeRef* subtree = subtree_cast(block_->get_data());
@@ -1387,33 +2427,69 @@ std::tuple<aku_Status, LogicAddr> NBTreeLeaf::commit(std::shared_ptr<BlockStore>
     subtree->level = 0;
     subtree->type  = NBTreeBlockType::LEAF;
     subtree->fanout_index = fanout_index_;
+    if (packed_) {
+        return commit_packed(bstore, size);
+    }
     // Compute checksum
     subtree->checksum = bstore->checksum(block_->get_cdata() + sizeof(SubtreeRef), size);
-    return bstore->append_block(block_);
+    auto result = bstore->append_block(block_);
+    count_write();
+    AKU_TRACE2(nbtree_leaf_commit, subtree->id, std::get<1>(result));
+    return result;
 }
 
 
+std::tuple<aku_Status, LogicAddr> NBTreeLeaf::commit_packed(std::shared_ptr<BlockStore> bstore, u16 size) {
+    SubtreeRef* subtree = subtree_cast(block_->get_data());
+    subtree->version |= PACKED_FLAG;
+    auto block = std::make_shared<Block>();
+    memcpy(block->get_data(), block_->get_cdata(), sizeof(SubtreeRef));
+    uLongf packed_size = AKU_BLOCK_SIZE - sizeof(SubtreeRef);
+    int err = compress2(block->get_data() + sizeof(SubtreeRef), &packed_size,
+                        block_->get_cdata() + sizeof(SubtreeRef), size, Z_BEST_COMPRESSION);
+    if (err != Z_OK) {
+        // This shouldn't happen, `has_room_packed` leaves enough space for the tail
+        return std::make_tuple(AKU_EOVERFLOW, EMPTY_ADDR);
+    }
+    SubtreeRef* packed = subtree_cast(block->get_data());
+    packed->payload_size = static_cast<u16>(packed_size);
+    packed->checksum = bstore->checksum(block->get_cdata() + sizeof(SubtreeRef), packed_size);
+    auto result = bstore->append_block(block);
+    if (std::get<0>(result) == AKU_SUCCESS) {
+        block_->set_addr(std::get<1>(result));
+    }
+    count_write();
+    AKU_TRACE2(nbtree_leaf_commit, subtree->id, std::get<1>(result));
+    return result;
+}
+
 std::unique_ptr<RealValuedOperator> NBTreeLeaf::range(aku_Timestamp begin, aku_Timestamp end) const {
     std::unique_ptr<RealValuedOperator> it;
     it.reset(new NBTreeLeafIterator(begin, end, *this));
     return std::move(it);
 }
 
+std::unique_ptr<RealValuedOperator> NBTreeLeaf::filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    std::unique_ptr<RealValuedOperator> it;
+    it.reset(new NBTreeLeafIterator(begin, end, *this, filter));
+    return it;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeLeaf::aggregate(aku_Timestamp begin, aku_Timestamp end) const {
     std::unique_ptr<AggregateOperator> it;
     it.reset(new NBTreeLeafAggregator(begin, end, *this));
     return std::move(it);
 }
 
+std::unique_ptr<AggregateOperator> NBTreeLeaf::value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    std::unique_ptr<AggregateOperator> it;
+    it.reset(new NBTreeLeafValueRanges(begin, end, *this, filter));
+    return it;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeLeaf::candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const {
-    AKU_UNUSED(hint);
-    auto agg = INIT_AGGRES;
-    const SubtreeRef* subtree = subtree_cast(block_->get_cdata());
-    agg.copy_from(*subtree);
-    std::unique_ptr<AggregateOperator> result;
-    AggregateOperator::Direction dir = begin < end ? AggregateOperator::Direction::FORWARD : AggregateOperator::Direction::BACKWARD;
-    result.reset(new ValueAggregator(subtree->end, agg, dir));
-    return std::move(result);
+    // Subtree ref of the mutable node is not up to date, raw values are used
+    return make_leaf_candlesticks(*this, begin, end, hint);
 }
 
 std::unique_ptr<AggregateOperator> NBTreeLeaf::group_aggregate(aku_Timestamp begin, aku_Timestamp end, u64 step) const {
@@ -1487,7 +2563,7 @@ std::tuple<aku_Status, LogicAddr> NBTreeLeaf::split_into(std::shared_ptr<BlockSt
     // Make new superblock with two leafs
     // Left hand side leaf node
     u32 ixbase = 0;
-    NBTreeLeaf lhs(get_id(), preserve_backrefs ? prev_ : EMPTY_ADDR, *fanout_index);
+    NBTreeLeaf lhs(get_id(), preserve_backrefs ? prev_ : EMPTY_ADDR, *fanout_index, packed_);
     for (u32 i = 0; i < tss.size(); i++) {
         if (tss[i] < pivot) {
             status = lhs.append(tss[i], xss[i]);
@@ -1519,7 +2595,7 @@ std::tuple<aku_Status, LogicAddr> NBTreeLeaf::split_into(std::shared_ptr<BlockSt
     // Right hand side leaf node, it can't be empty in any case
     // because the leaf node is not empty.
     auto prev = lhs_ref.addr == EMPTY_ADDR ? prev_ : lhs_ref.addr;
-    NBTreeLeaf rhs(get_id(), prev, *fanout_index);
+    NBTreeLeaf rhs(get_id(), prev, *fanout_index, packed_);
     for (u32 i = ixbase; i < tss.size(); i++) {
         status = rhs.append(tss[i], xss[i]);
         if (status != AKU_SUCCESS) {
@@ -1561,10 +2637,11 @@ std::tuple<aku_Status, LogicAddr> NBTreeLeaf::split_into(std::shared_ptr<BlockSt
 
 std::tuple<aku_Status, LogicAddr> NBTreeLeaf::split(std::shared_ptr<BlockStore> bstore,
                                                     aku_Timestamp pivot,
-                                                    bool preserve_backrefs)
+                                                    bool preserve_backrefs,
+                                                    u16 max_fanout)
 {
     // New superblock
-    NBTreeSuperblock sblock(get_id(), preserve_backrefs ? get_prev_addr() : EMPTY_ADDR, get_fanout(), 0);
+    NBTreeSuperblock sblock(get_id(), preserve_backrefs ? get_prev_addr() : EMPTY_ADDR, get_fanout(), 0, max_fanout);
     aku_Status status;
     LogicAddr  addr;
     u16 fanout = 0;
@@ -1584,7 +2661,13 @@ std::tuple<aku_Status, LogicAddr> NBTreeLeaf::split(std::shared_ptr<BlockStore>
 //     NBTreeSuperblock     //
 // //////////////////////// //
 
-NBTreeSuperblock::NBTreeSuperblock(aku_ParamId id, LogicAddr prev, u16 fanout, u16 lvl)
+//! Get max number of links of the superblock using its header
+static u16 header_fanout(SubtreeRef const* ref) {
+    u16 fanout = (ref->version & NBTreeSuperblock::FANOUT_MASK) >> NBTreeSuperblock::FANOUT_SHIFT;
+    return fanout == 0 ? static_cast<u16>(AKU_NBTREE_FANOUT) : fanout;
+}
+
+NBTreeSuperblock::NBTreeSuperblock(aku_ParamId id, LogicAddr prev, u16 fanout, u16 lvl, u16 max_fanout)
     : block_(std::make_shared<Block>())
     , id_(id)
     , write_pos_(0)
@@ -1592,7 +2675,18 @@ NBTreeSuperblock::NBTreeSuperblock(aku_ParamId id, LogicAddr prev, u16 fanout, u
     , level_(lvl)
     , prev_(prev)
     , immutable_(false)
+    , compact_(true)
+    , max_fanout_(max_fanout)
 {
+    // Fanout is limited by the block size, header and all links should fit into one block
+    static_assert(sizeof(SubtreeRef) + AKU_NBTREE_FANOUT * sizeof(SubtreeRefCompact) <= AKU_BLOCK_SIZE,
+                  "Superblock can't store AKU_NBTREE_FANOUT links");
+    static_assert(AKU_NBTREE_LEGACY_FANOUT <= AKU_NBTREE_FANOUT,
+                  "Legacy superblock can't be converted to compact form");
+    static_assert(AKU_NBTREE_MAX_FANOUT_INDEX == AKU_NBTREE_FANOUT - 1, "Invalid max fanout index");
+    static_assert((AKU_NBTREE_FANOUT << FANOUT_SHIFT) <= FANOUT_MASK, "Fanout doesn't fit into the node header");
+    static_assert(AKUMULI_VERSION < (1 << FANOUT_SHIFT), "Version overlaps with the fanout bits");
+    assert(max_fanout_ >= AKU_NBTREE_MIN_FANOUT && max_fanout_ <= AKU_NBTREE_FANOUT);
     SubtreeRef* pref = subtree_cast(block_->get_data());
     pref->type = NBTreeBlockType::INNER;
     assert(prev_ != 0);
@@ -1610,6 +2704,8 @@ NBTreeSuperblock::NBTreeSuperblock(std::shared_ptr<Block> block)
     prev_ = ref->addr;
     write_pos_ = ref->payload_size;
     level_ = ref->level;
+    compact_ = (ref->version & COMPACT_FLAG) != 0;
+    max_fanout_ = header_fanout(ref);
     assert(prev_ != 0);
 }
 
@@ -1621,6 +2717,7 @@ NBTreeSuperblock::NBTreeSuperblock(LogicAddr addr, std::shared_ptr<BlockStore> b
 NBTreeSuperblock::NBTreeSuperblock(LogicAddr addr, std::shared_ptr<BlockStore> bstore, bool remove_last)
     : block_(std::make_shared<Block>())
     , immutable_(false)
+    , compact_(true)
 {
     std::shared_ptr<Block> block = read_block_from_bstore(bstore, addr);
     SubtreeRef const* ref = subtree_cast(block->get_cdata());
@@ -1630,12 +2727,32 @@ NBTreeSuperblock::NBTreeSuperblock(LogicAddr addr, std::shared_ptr<BlockStore> b
     prev_ = ref->addr;
     level_ = ref->level;
     write_pos_ = ref->payload_size;
+    max_fanout_ = header_fanout(ref);
     if (remove_last && write_pos_ != 0) {
         write_pos_--;
     }
     assert(prev_ != 0);
     // We can't use zero-copy here because `block` belongs to other node.
-    memcpy(block_->get_data(), block->get_cdata(), AKU_BLOCK_SIZE);
+    if (ref->version & COMPACT_FLAG) {
+        memcpy(block_->get_data(), block->get_cdata(), AKU_BLOCK_SIZE);
+    } else {
+        // Node was written by the previous version, links are converted to compact
+        // form so the node can be extended up to AKU_NBTREE_FANOUT elements.
+        memcpy(block_->get_data(), block->get_cdata(), sizeof(SubtreeRef));
+        SubtreeRef const* src = ref + 1;
+        SubtreeRefCompact* dst = compact_cast(block_->get_data() + sizeof(SubtreeRef));
+        for (u32 ix = 0u; ix < write_pos_; ix++) {
+            compact_encode(src[ix], dst + ix);
+        }
+    }
+}
+
+SubtreeRef NBTreeSuperblock::child_at(u32 ix) const {
+    u8 const* payload = block_->get_cdata() + sizeof(SubtreeRef);
+    if (compact_) {
+        return compact_decode(compact_cast(payload)[ix], id_);
+    }
+    return subtree_cast(payload)[ix];
 }
 
 SubtreeRef const* NBTreeSuperblock::get_sblockmeta() const {
@@ -1655,6 +2772,10 @@ u16 NBTreeSuperblock::get_fanout() const {
     return fanout_index_;
 }
 
+u16 NBTreeSuperblock::get_max_fanout() const {
+    return max_fanout_;
+}
+
 aku_ParamId NBTreeSuperblock::get_id() const {
     return id_;
 }
@@ -1689,8 +2810,8 @@ aku_Status NBTreeSuperblock::append(const SubtreeRef &p) {
     assert(p.count != 0);
     // Write data into buffer
     SubtreeRef* pref = subtree_cast(block_->get_data());
-    auto it = pref + 1 + write_pos_;
-    *it = p;
+    auto it = compact_cast(block_->get_data() + sizeof(SubtreeRef)) + write_pos_;
+    compact_encode(p, it);
     if (write_pos_ == 0) {
         pref->begin = p.begin;
     }
@@ -1716,21 +2837,22 @@ std::tuple<aku_Status, LogicAddr> NBTreeSuperblock::commit(std::shared_ptr<Block
     backref->id = id_;
     backref->level = level_;
     backref->type  = NBTreeBlockType::INNER;
-    backref->version = AKUMULI_VERSION;
+    backref->version = AKUMULI_VERSION | COMPACT_FLAG | (max_fanout_ << FANOUT_SHIFT);
     // add checksum
     backref->checksum = bstore->checksum(block_->get_cdata() + sizeof(SubtreeRef), backref->payload_size);
-    return bstore->append_block(block_);
+    auto result = bstore->append_block(block_);
+    count_write();
+    AKU_TRACE2(nbtree_sblock_commit, id_, std::get<1>(result));
+    return result;
 }
 
 bool NBTreeSuperblock::is_full() const {
-    return write_pos_ >= AKU_NBTREE_FANOUT;
+    return write_pos_ >= max_fanout_;
 }
 
 aku_Status NBTreeSuperblock::read_all(std::vector<SubtreeRef>* refs) const {
-    SubtreeRef const* ref = subtree_cast(block_->get_cdata());
     for(u32 ix = 0u; ix < write_pos_; ix++) {
-        auto p = ref + 1 + ix;
-        refs->push_back(*p);
+        refs->push_back(child_at(ix));
     }
     return AKU_SUCCESS;
 }
@@ -1739,9 +2861,7 @@ bool NBTreeSuperblock::top(SubtreeRef* outref) const {
     if (write_pos_ == 0) {
         return false;
     }
-    SubtreeRef const* ref = subtree_cast(block_->get_cdata());
-    auto p = ref + write_pos_;
-    *outref = *p;
+    *outref = child_at(write_pos_ - 1);
     return true;
 }
 
@@ -1764,10 +2884,34 @@ std::unique_ptr<RealValuedOperator> NBTreeSuperblock::search(aku_Timestamp begin
                                                          std::shared_ptr<BlockStore> bstore) const
 {
     std::unique_ptr<RealValuedOperator> result;
-    result.reset(new NBTreeSBlockIterator(bstore, *this, begin, end));
+    if (begin < end) {
+        result.reset(new NBTreeSBlockScan<true>(bstore, *this, begin, end));
+    } else {
+        result.reset(new NBTreeSBlockScan<false>(bstore, *this, begin, end));
+    }
     return std::move(result);
 }
 
+std::unique_ptr<RealValuedOperator> NBTreeSuperblock::search(aku_Timestamp begin,
+                                                             aku_Timestamp end,
+                                                             std::shared_ptr<ScanLimit> limit,
+                                                             std::shared_ptr<BlockStore> bstore) const
+{
+    std::unique_ptr<RealValuedOperator> result;
+    result.reset(new NBTreeSBlockLimit(bstore, *this, begin, end, limit));
+    return result;
+}
+
+std::unique_ptr<RealValuedOperator> NBTreeSuperblock::filter(aku_Timestamp begin,
+                                                             aku_Timestamp end,
+                                                             ValueFilter const& filter,
+                                                             std::shared_ptr<BlockStore> bstore) const
+{
+    std::unique_ptr<RealValuedOperator> result;
+    result.reset(new NBTreeSBlockFilter(bstore, *this, begin, end, filter));
+    return result;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeSuperblock::aggregate(aku_Timestamp begin,
                                                             aku_Timestamp end,
                                                             std::shared_ptr<BlockStore> bstore) const
@@ -1777,6 +2921,25 @@ std::unique_ptr<AggregateOperator> NBTreeSuperblock::aggregate(aku_Timestamp beg
     return std::move(result);
 }
 
+std::unique_ptr<AggregateOperator> NBTreeSuperblock::approximate(aku_Timestamp begin,
+                                                              aku_Timestamp end,
+                                                              std::shared_ptr<BlockStore> bstore) const
+{
+    std::unique_ptr<AggregateOperator> result;
+    result.reset(new NBTreeSBlockAggregator(bstore, *this, begin, end, true));
+    return std::move(result);
+}
+
+std::unique_ptr<AggregateOperator> NBTreeSuperblock::value_ranges(aku_Timestamp begin,
+                                                               aku_Timestamp end,
+                                                               ValueFilter const& filter,
+                                                               std::shared_ptr<BlockStore> bstore) const
+{
+    std::unique_ptr<AggregateOperator> result;
+    result.reset(new NBTreeSBlockValueRanges(bstore, *this, begin, end, filter));
+    return result;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeSuperblock::candlesticks(aku_Timestamp begin, aku_Timestamp end,
                                                                  std::shared_ptr<BlockStore> bstore,
                                                                  NBTreeCandlestickHint hint) const
@@ -1840,7 +3003,7 @@ std::tuple<aku_Status, LogicAddr> NBTreeSuperblock::split_into(std::shared_ptr<B
                 }
             } else {
                 NBTreeLeaf oldleaf(block);
-                if ((refs.size() - AKU_NBTREE_FANOUT) > 1) {
+                if ((refs.size() - max_fanout_) > 1) {
                     // Split in-place
                     std::tie(status, new_ith_child_addr) = oldleaf.split_into(bstore, pivot, preserve_horizontal_links, &current_fanout, root);
                     if (status != AKU_SUCCESS) {
@@ -1848,7 +3011,7 @@ std::tuple<aku_Status, LogicAddr> NBTreeSuperblock::split_into(std::shared_ptr<B
                     }
                 } else {
                     // Create new level in the tree
-                    std::tie(status, new_ith_child_addr) = oldleaf.split(bstore, pivot, preserve_horizontal_links);
+                    std::tie(status, new_ith_child_addr) = oldleaf.split(bstore, pivot, preserve_horizontal_links, max_fanout_);
                     if (status != AKU_SUCCESS) {
                         return std::make_tuple(status, EMPTY_ADDR);
                     }
@@ -1935,7 +3098,7 @@ std::tuple<aku_Status, LogicAddr, LogicAddr> NBTreeSuperblock::split(std::shared
 {
     aku_Status status;
     LogicAddr last_child;
-    NBTreeSuperblock new_sblock(id_, prev_, get_fanout(), level_);
+    NBTreeSuperblock new_sblock(id_, prev_, get_fanout(), level_, max_fanout_);
     std::tie(status, last_child) = split_into(bstore, pivot, preserve_horizontal_links, &new_sblock);
     if (status != AKU_SUCCESS || new_sblock.nelements() == 0) {
         return std::make_tuple(status, EMPTY_ADDR, EMPTY_ADDR);
@@ -1953,6 +3116,21 @@ std::tuple<aku_Status, LogicAddr, LogicAddr> NBTreeSuperblock::split(std::shared
 
 
 //! Represents extent made of one memory resident leaf node
+std::tuple<bool, LogicAddr> NBTreeExtent::append_range(aku_Timestamp const* ts, double const* xs, size_t size) {
+    bool parent_saved = false;
+    LogicAddr last_addr = EMPTY_ADDR;
+    for (size_t i = 0; i < size; i++) {
+        bool saved;
+        LogicAddr addr;
+        std::tie(saved, addr) = append(ts[i], xs[i]);
+        parent_saved |= saved;
+        if (addr != EMPTY_ADDR) {
+            last_addr = addr;
+        }
+    }
+    return std::make_tuple(parent_saved, last_addr);
+}
+
 struct NBTreeLeafExtent : NBTreeExtent {
     std::shared_ptr<BlockStore> bstore_;
     std::weak_ptr<NBTreeExtentsList> roots_;
@@ -1960,9 +3138,12 @@ struct NBTreeLeafExtent : NBTreeExtent {
     LogicAddr last_;
     std::shared_ptr<NBTreeLeaf> leaf_;
     u16 fanout_index_;
+    //! Fanout of the tree
+    u16 fanout_;
     // padding
-    u16 pad0_;
     u32 pad1_;
+    //! Values older than this timestamp are written to the packed leaf nodes
+    aku_Timestamp pack_before_;
 
     NBTreeLeafExtent(std::shared_ptr<BlockStore> bstore,
                      std::shared_ptr<NBTreeExtentsList> roots,
@@ -1973,8 +3154,9 @@ struct NBTreeLeafExtent : NBTreeExtent {
         , id_(id)
         , last_(last)
         , fanout_index_(0)
-        , pad0_{}
+        , fanout_(roots->get_fanout())
         , pad1_{}
+        , pack_before_(AKU_MIN_TIMESTAMP)
     {
         if (last_ != EMPTY_ADDR) {
             // Load previous node and calculate fanout.
@@ -1990,7 +3172,7 @@ struct NBTreeLeafExtent : NBTreeExtent {
             } else {
                 auto psubtree = subtree_cast(block->get_cdata());
                 fanout_index_ = psubtree->fanout_index + 1;
-                if (fanout_index_ == AKU_NBTREE_FANOUT) {
+                if (fanout_index_ >= fanout_) {
                     fanout_index_ = 0;
                     last_ = EMPTY_ADDR;
                 }
@@ -2044,14 +3226,29 @@ struct NBTreeLeafExtent : NBTreeExtent {
     }
 
     void reset_leaf() {
-        leaf_.reset(new NBTreeLeaf(id_, last_, fanout_index_));
+        leaf_.reset(new NBTreeLeaf(id_, last_, fanout_index_, pack_before_ != AKU_MIN_TIMESTAMP));
+    }
+
+    /** Write values older than `ts` to the packed leaf nodes. Should be called
+      * before anything is written. Values should be written in order, first value
+      * that is not older than `ts` commits the packed leaf node and resets the threshold.
+      */
+    void set_pack_threshold(aku_Timestamp ts) {
+        pack_before_ = ts;
+        reset_leaf();
     }
 
     virtual std::tuple<bool, LogicAddr> append(aku_Timestamp ts, double value);
+    virtual std::tuple<bool, LogicAddr> append_range(aku_Timestamp const* ts, double const* xs, size_t size);
     virtual std::tuple<bool, LogicAddr> append(const SubtreeRef &pl);
     virtual std::tuple<bool, LogicAddr> commit(bool final);
     virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end) const;
+
+    virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<ScanLimit> limit) const;
+    virtual std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
     virtual std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin, aku_Timestamp end) const;
+    virtual std::unique_ptr<AggregateOperator> approximate(aku_Timestamp begin, aku_Timestamp end) const;
+    virtual std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
     virtual std::unique_ptr<AggregateOperator> candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const;
     virtual std::unique_ptr<AggregateOperator> group_aggregate(aku_Timestamp begin, aku_Timestamp end, u64 step) const;
     virtual bool is_dirty() const;
@@ -2161,6 +3358,23 @@ std::tuple<bool, LogicAddr> NBTreeLeafExtent::append(SubtreeRef const&) {
 }
 
 std::tuple<bool, LogicAddr> NBTreeLeafExtent::append(aku_Timestamp ts, double value) {
+    if (pack_before_ != AKU_MIN_TIMESTAMP && ts >= pack_before_) {
+        // End of the cold data, the rest is written to the regular leaf nodes
+        pack_before_ = AKU_MIN_TIMESTAMP;
+        auto result = std::make_tuple(false, EMPTY_ADDR);
+        if (leaf_->nelements() != 0) {
+            result = commit(false);
+        } else {
+            reset_leaf();
+        }
+        bool parent_saved;
+        LogicAddr addr;
+        std::tie(parent_saved, addr) = append(ts, value);
+        if (addr != EMPTY_ADDR) {
+            return std::make_tuple(parent_saved || std::get<0>(result), addr);
+        }
+        return result;
+    }
     // Invariant: leaf_ should be initialized, if leaf_ is full
     // and pushed to block-store, reset_leaf should be called
     aku_Status status = leaf_->append(ts, value);
@@ -2178,6 +3392,38 @@ std::tuple<bool, LogicAddr> NBTreeLeafExtent::append(aku_Timestamp ts, double va
     return std::make_tuple(false, EMPTY_ADDR);
 }
 
+std::tuple<bool, LogicAddr> NBTreeLeafExtent::append_range(aku_Timestamp const* ts, double const* xs, size_t size) {
+    bool parent_saved = false;
+    LogicAddr last_addr = EMPTY_ADDR;
+    size_t ix = 0;
+    while (ix < size && pack_before_ != AKU_MIN_TIMESTAMP) {
+        // Packed leaf nodes are written one value at a time
+        bool saved;
+        LogicAddr addr;
+        std::tie(saved, addr) = append(ts[ix], xs[ix]);
+        parent_saved |= saved;
+        if (addr != EMPTY_ADDR) {
+            last_addr = addr;
+        }
+        ix++;
+    }
+    while (ix < size) {
+        size_t nvalues = leaf_->append_range(ts + ix, xs + ix, size - ix);
+        ix += nvalues;
+        if (ix < size) {
+            // Leaf is full, commit it and continue with the new one
+            if (leaf_->nelements() == 0) {
+                // Empty leaf can't be committed
+                AKU_PANIC("Can't append values to the empty leaf node");
+            }
+            bool saved;
+            std::tie(saved, last_addr) = commit(false);
+            parent_saved |= saved;
+        }
+    }
+    return std::make_tuple(parent_saved, last_addr);
+}
+
 //! Forcibly commit changes, even if current page is not full
 std::tuple<bool, LogicAddr> NBTreeLeafExtent::commit(bool final) {
     // Invariant: after call to this method data from `leaf_` should
@@ -2215,7 +3461,7 @@ std::tuple<bool, LogicAddr> NBTreeLeafExtent::commit(bool final) {
     }
     fanout_index_++;
     last_ = addr;
-    if (fanout_index_ == AKU_NBTREE_FANOUT) {
+    if (fanout_index_ >= fanout_) {
         fanout_index_ = 0;
         last_ = EMPTY_ADDR;
     }
@@ -2231,10 +3477,31 @@ std::unique_ptr<RealValuedOperator> NBTreeLeafExtent::search(aku_Timestamp begin
     return std::move(leaf_->range(begin, end));
 }
 
+std::unique_ptr<RealValuedOperator> NBTreeLeafExtent::search(aku_Timestamp begin, aku_Timestamp end,
+                                                             std::shared_ptr<ScanLimit> limit) const
+{
+    std::unique_ptr<RealValuedOperator> result;
+    result.reset(new LimitOperator(leaf_->range(begin, end), limit));
+    return result;
+}
+
+std::unique_ptr<RealValuedOperator> NBTreeLeafExtent::filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    return leaf_->filter(begin, end, filter);
+}
+
 std::unique_ptr<AggregateOperator> NBTreeLeafExtent::aggregate(aku_Timestamp begin, aku_Timestamp end) const {
     return std::move(leaf_->aggregate(begin, end));
 }
 
+std::unique_ptr<AggregateOperator> NBTreeLeafExtent::approximate(aku_Timestamp begin, aku_Timestamp end) const {
+    // Leaf is in memory, exact value is cheap
+    return std::move(leaf_->aggregate(begin, end));
+}
+
+std::unique_ptr<AggregateOperator> NBTreeLeafExtent::value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    return leaf_->value_ranges(begin, end, filter);
+}
+
 std::unique_ptr<AggregateOperator> NBTreeLeafExtent::candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const {
     return std::move(leaf_->candlesticks(begin, end, hint));
 }
@@ -2251,9 +3518,10 @@ bool NBTreeLeafExtent::is_dirty() const {
 }
 
 std::tuple<bool, LogicAddr> NBTreeLeafExtent::split(aku_Timestamp pivot) {
+    WriteCauseScope cause(WriteCause::SPLIT);
     aku_Status status;
     LogicAddr addr;
-    std::tie(status, addr) = leaf_->split(bstore_, pivot, true);
+    std::tie(status, addr) = leaf_->split(bstore_, pivot, true, fanout_);
     if (status != AKU_SUCCESS || addr == EMPTY_ADDR) {
         return std::make_tuple(false, EMPTY_ADDR);
     }
@@ -2280,7 +3548,7 @@ std::tuple<bool, LogicAddr> NBTreeLeafExtent::split(aku_Timestamp pivot) {
     }
     fanout_index_++;
     last_ = addr;
-    if (fanout_index_ == AKU_NBTREE_FANOUT) {
+    if (fanout_index_ >= fanout_) {
         fanout_index_ = 0;
         last_ = EMPTY_ADDR;
     }
@@ -2300,8 +3568,10 @@ struct NBTreeSBlockExtent : NBTreeExtent {
     LogicAddr last_;
     u16 fanout_index_;
     u16 level_;
+    //! Fanout of the tree
+    u16 fanout_;
     // padding
-    u32 killed_;
+    u16 killed_;
 
     NBTreeSBlockExtent(std::shared_ptr<BlockStore> bstore,
                        std::shared_ptr<NBTreeExtentsList> roots,
@@ -2314,6 +3584,7 @@ struct NBTreeSBlockExtent : NBTreeExtent {
         , last_(EMPTY_ADDR)
         , fanout_index_(0)
         , level_(level)
+        , fanout_(roots->get_fanout())
         , killed_(0)
     {
         if (addr != EMPTY_ADDR) {
@@ -2330,7 +3601,7 @@ struct NBTreeSBlockExtent : NBTreeExtent {
             } else {
                 auto psubtree = subtree_cast(block->get_cdata());
                 fanout_index_ = psubtree->fanout_index + 1;
-                if (fanout_index_ == AKU_NBTREE_FANOUT) {
+                if (fanout_index_ >= fanout_) {
                     fanout_index_ = 0;
                     last_ = EMPTY_ADDR;
                 }
@@ -2342,7 +3613,7 @@ struct NBTreeSBlockExtent : NBTreeExtent {
             curr_.reset(new NBTreeSuperblock(addr, bstore_, false));
         } else {
             // `addr` is not set. Node should be created from scratch.
-            curr_.reset(new NBTreeSuperblock(id, EMPTY_ADDR, 0, level));
+            curr_.reset(new NBTreeSuperblock(id, EMPTY_ADDR, 0, level, fanout_));
         }
     }
 
@@ -2375,7 +3646,7 @@ struct NBTreeSBlockExtent : NBTreeExtent {
     }
 
     void reset_subtree() {
-        curr_.reset(new NBTreeSuperblock(id_, last_, fanout_index_, level_));
+        curr_.reset(new NBTreeSuperblock(id_, last_, fanout_index_, level_, fanout_));
     }
 
     u16 get_fanout_index() const {
@@ -2394,7 +3665,12 @@ struct NBTreeSBlockExtent : NBTreeExtent {
     virtual std::tuple<bool, LogicAddr> append(const SubtreeRef &pl);
     virtual std::tuple<bool, LogicAddr> commit(bool final);
     virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end) const;
+
+    virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<ScanLimit> limit) const;
+    virtual std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
     virtual std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin, aku_Timestamp end) const;
+    virtual std::unique_ptr<AggregateOperator> approximate(aku_Timestamp begin, aku_Timestamp end) const;
+    virtual std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
     virtual std::unique_ptr<AggregateOperator> candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const;
     virtual std::unique_ptr<AggregateOperator> group_aggregate(aku_Timestamp begin, aku_Timestamp end, u64 step) const;
     virtual bool is_dirty() const;
@@ -2557,7 +3833,7 @@ std::tuple<bool, LogicAddr> NBTreeSBlockExtent::commit(bool final) {
     }
     fanout_index_++;
     last_ = addr;
-    if (fanout_index_ == AKU_NBTREE_FANOUT) {
+    if (fanout_index_ >= fanout_) {
         fanout_index_ = 0;
         last_ = EMPTY_ADDR;
     }
@@ -2571,10 +3847,28 @@ std::unique_ptr<RealValuedOperator> NBTreeSBlockExtent::search(aku_Timestamp beg
     return curr_->search(begin, end, bstore_);
 }
 
+std::unique_ptr<RealValuedOperator> NBTreeSBlockExtent::search(aku_Timestamp begin, aku_Timestamp end,
+                                                               std::shared_ptr<ScanLimit> limit) const
+{
+    return curr_->search(begin, end, limit, bstore_);
+}
+
+std::unique_ptr<RealValuedOperator> NBTreeSBlockExtent::filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    return curr_->filter(begin, end, filter, bstore_);
+}
+
 std::unique_ptr<AggregateOperator> NBTreeSBlockExtent::aggregate(aku_Timestamp begin, aku_Timestamp end) const {
     return curr_->aggregate(begin, end, bstore_);
 }
 
+std::unique_ptr<AggregateOperator> NBTreeSBlockExtent::approximate(aku_Timestamp begin, aku_Timestamp end) const {
+    return curr_->approximate(begin, end, bstore_);
+}
+
+std::unique_ptr<AggregateOperator> NBTreeSBlockExtent::value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    return curr_->value_ranges(begin, end, filter, bstore_);
+}
+
 std::unique_ptr<AggregateOperator> NBTreeSBlockExtent::candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const {
     return curr_->candlesticks(begin, end, bstore_, hint);
 }
@@ -2591,6 +3885,7 @@ bool NBTreeSBlockExtent::is_dirty() const {
 }
 
 std::tuple<bool, LogicAddr> NBTreeSBlockExtent::split(aku_Timestamp pivot) {
+    WriteCauseScope cause(WriteCause::SPLIT);
     const auto empty_res = std::make_tuple(false, EMPTY_ADDR);
     aku_Status status;
     std::unique_ptr<NBTreeSuperblock> clone;
@@ -2746,13 +4041,29 @@ void NBTreeExtent::check_extent(NBTreeExtent const* extent, std::shared_ptr<Bloc
 // ///////////////////// //
 
 
-NBTreeExtentsList::NBTreeExtentsList(aku_ParamId id, std::vector<LogicAddr> addresses, std::shared_ptr<BlockStore> bstore)
+NBTreeExtentsList::NBTreeExtentsList(aku_ParamId id, std::vector<LogicAddr> addresses, std::shared_ptr<BlockStore> bstore,
+                                     u16 fanout)
     : bstore_(bstore)
     , id_(id)
+    , fanout_(fanout)
     , last_(0ull)
+    , last_value_ts_(0ull)
+    , last_value_(0.0)
+    , has_last_value_(false)
     , rescue_points_(std::move(addresses))
     , initialized_(false)
     , write_count_(0ul)
+    , reorder_window_(0)
+    , precision_{-1}
+    , heartbeat_{0}
+    , stored_ts_(0ull)
+    , stored_value_(0.0)
+    , has_stored_(false)
+    , ring_size_{0}
+    , ring_scheduled_(false)
+    , ring_last_(0ull)
+    , stage_owned_(false)
+    , lock_(true)
     // test
     , rd_()
     , rand_gen_(rd_())
@@ -2762,6 +4073,13 @@ NBTreeExtentsList::NBTreeExtentsList(aku_ParamId id, std::vector<LogicAddr> addr
     if (rescue_points_.size() >= std::numeric_limits<u16>::max()) {
         AKU_PANIC("Tree depth is too large");
     }
+    if (fanout_ < AKU_NBTREE_MIN_FANOUT || fanout_ > AKU_NBTREE_FANOUT) {
+        AKU_PANIC("Invalid fanout " + std::to_string(fanout_));
+    }
+}
+
+u16 NBTreeExtentsList::get_fanout() const {
+    return fanout_;
 }
 
 void NBTreeExtentsList::force_init() {
@@ -2778,9 +4096,344 @@ size_t NBTreeExtentsList::_get_uncommitted_size() const {
             // Small check to make coverity scan happy
             AKU_PANIC("Bad extent at level 0, leaf node expected");
         }
-        return leaf->leaf_->_get_uncommitted_size();
+        return leaf->leaf_->_get_uncommitted_size();
+    }
+    return 0;
+}
+
+size_t NBTreeExtentsList::get_write_buffer_size() const {
+    SharedLock lock(lock_);
+    size_t ring_size = 0;
+    {
+        std::lock_guard<std::mutex> guard(ring_lock_);
+        ring_size = ring_ts_.capacity()*sizeof(aku_Timestamp) + ring_xs_.capacity()*sizeof(double);
+    }
+    if (!initialized_ || extents_.empty()) {
+        return ring_size;
+    }
+    auto leaf = dynamic_cast<NBTreeLeafExtent const*>(extents_.front().get());
+    if (leaf == nullptr) {
+        AKU_PANIC("Bad extent at level 0, leaf node expected");
+    }
+    return ring_size + leaf->leaf_->_get_buffer_size();
+}
+
+bool NBTreeExtentsList::commit_leaf() {
+    UniqueLock lock(lock_);
+    if (!initialized_) {
+        return false;
+    }
+    // Values from the write ring should be committed too
+    bool flushed = drain_write_ring() == NBTreeAppendResult::OK_FLUSH_NEEDED;
+    if (extents_.empty()) {
+        return flushed;
+    }
+    auto leaf = dynamic_cast<NBTreeLeafExtent*>(extents_.front().get());
+    if (leaf == nullptr) {
+        AKU_PANIC("Bad extent at level 0, leaf node expected");
+    }
+    if (leaf->leaf_->nelements() == 0) {
+        return flushed;
+    }
+    bool parent_saved = false;
+    LogicAddr addr = EMPTY_ADDR;
+    WriteCauseScope cause(WriteCause::FLUSH);
+    std::tie(parent_saved, addr) = leaf->commit(false);
+    if (rescue_points_.size() > 0) {
+        rescue_points_.at(0) = addr;
+    } else {
+        rescue_points_.push_back(addr);
+    }
+    return true;
+}
+
+struct NBTreeExtentsList::LeafStats {
+    //! Number of regular leaf nodes
+    u64 nleaves;
+    //! Number of values in regular leaf nodes
+    u64 nvalues;
+    //! Size of the largest regular leaf node
+    u64 maxcount;
+    //! Number of regular leaf nodes that contain only cold values
+    u64 ncold;
+    //! Number of values in packed leaf nodes
+    u64 npacked;
+    //! Timestamp that follows the last value of the packed leaf nodes
+    aku_Timestamp packed_end;
+};
+
+//! Add statistics of the leaf nodes of the subtrees
+static void collect_leaf_stats(std::shared_ptr<BlockStore> const& bstore, std::vector<SubtreeRef> const& refs,
+                               aku_Timestamp cold_before, NBTreeExtentsList::LeafStats* stats)
+{
+    for (auto const& ref: refs) {
+        if (NBTreeLeaf::is_packed(ref)) {
+            // Packed leaf nodes are larger than regular ones and shouldn't affect the fill factor
+            stats->npacked += ref.count;
+            stats->packed_end = std::max(stats->packed_end, ref.end + 1);
+            continue;
+        }
+        if (ref.type == NBTreeBlockType::LEAF) {
+            stats->nleaves += 1;
+            u64 count = ref.count;
+            stats->nvalues += count;
+            stats->maxcount = std::max(stats->maxcount, count);
+            if (ref.end < cold_before) {
+                stats->ncold += 1;
+            }
+            continue;
+        }
+        aku_Status status;
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = read_and_check(bstore, ref.addr);
+        if (status != AKU_SUCCESS) {
+            // Subtree was removed by retention
+            continue;
+        }
+        NBTreeSuperblock sblock(block);
+        std::vector<SubtreeRef> children;
+        if (sblock.read_all(&children) == AKU_SUCCESS) {
+            collect_leaf_stats(bstore, children, cold_before, stats);
+        }
+    }
+}
+
+void NBTreeExtentsList::get_leaf_stats(LeafStats* stats, aku_Timestamp cold_before) const {
+    *stats = LeafStats{0, 0, 0, 0, 0, AKU_MIN_TIMESTAMP};
+    for (size_t i = 1; i < extents_.size(); i++) {
+        auto sblock = dynamic_cast<NBTreeSBlockExtent const*>(extents_.at(i).get());
+        if (sblock == nullptr) {
+            AKU_PANIC("Bad extent at level " + std::to_string(i) + ", superblock expected");
+        }
+        std::vector<SubtreeRef> refs;
+        if (sblock->curr_ && sblock->curr_->read_all(&refs) == AKU_SUCCESS) {
+            collect_leaf_stats(bstore_, refs, cold_before, stats);
+        }
+    }
+}
+
+static double compute_fill_factor(u64 nleaves, u64 nvalues, u64 maxcount) {
+    if (nleaves < 2 || maxcount == 0) {
+        return 1.0;
+    }
+    return static_cast<double>(nvalues) / static_cast<double>(nleaves * maxcount);
+}
+
+double NBTreeExtentsList::get_fill_factor() const {
+    SharedLock lock(lock_);
+    if (!initialized_) {
+        return 1.0;
+    }
+    LeafStats stats;
+    get_leaf_stats(&stats, AKU_MIN_TIMESTAMP);
+    return compute_fill_factor(stats.nleaves, stats.nvalues, stats.maxcount);
+}
+
+//! Fraction of the [b, e] range that overlaps [min, max]
+static double overlap(aku_Timestamp b, aku_Timestamp e, aku_Timestamp min, aku_Timestamp max) {
+    if (e < min || max < b) {
+        return 0.0;
+    }
+    if (b == e) {
+        return 1.0;
+    }
+    auto lo = std::max(b, min);
+    auto hi = std::min(e, max);
+    return static_cast<double>(hi - lo + 1) / static_cast<double>(e - b + 1);
+}
+
+void NBTreeExtentsList::estimate(aku_Timestamp begin, aku_Timestamp end, u64* nvalues, u64* nleaves) const {
+    *nvalues = 0;
+    *nleaves = 0;
+    SharedLock lock(lock_);
+    if (!initialized_ || extents_.empty()) {
+        return;
+    }
+    auto min = std::min(begin, end);
+    auto max = std::max(begin, end);
+    double values = 0, leaves = 0;
+    for (size_t i = 1; i < extents_.size(); i++) {
+        auto sblock = dynamic_cast<NBTreeSBlockExtent const*>(extents_.at(i).get());
+        if (sblock == nullptr) {
+            AKU_PANIC("Bad extent at level " + std::to_string(i) + ", superblock expected");
+        }
+        std::vector<SubtreeRef> refs;
+        if (!sblock->curr_ || sblock->curr_->read_all(&refs) != AKU_SUCCESS) {
+            continue;
+        }
+        for (auto const& ref: refs) {
+            double frac = overlap(ref.begin, ref.end, min, max);
+            if (frac == 0.0) {
+                continue;
+            }
+            values += frac * static_cast<double>(ref.count);
+            // Partially covered leaf node has to be read entirely
+            leaves += ref.level == 0 ? 1.0 : std::max(1.0, frac * std::pow(static_cast<double>(fanout_), ref.level));
+        }
+    }
+    auto leaf = dynamic_cast<NBTreeLeafExtent const*>(extents_.front().get());
+    if (leaf == nullptr) {
+        AKU_PANIC("Bad extent at level 0, leaf node expected");
+    }
+    if (leaf->leaf_ && leaf->leaf_->nelements() != 0) {
+        aku_Timestamp b, e;
+        std::tie(b, e) = leaf->leaf_->get_timestamps();
+        double frac = overlap(b, e, min, max);
+        values += frac * static_cast<double>(leaf->leaf_->nelements());
+        leaves += frac == 0.0 ? 0.0 : 1.0;
+    }
+    *nvalues = static_cast<u64>(std::ceil(values));
+    *nleaves = static_cast<u64>(std::ceil(leaves));
+}
+
+size_t NBTreeExtentsList::prefetch(aku_Timestamp begin, aku_Timestamp end, size_t max_blocks) const {
+    auto min = std::min(begin, end);
+    auto max = std::max(begin, end);
+    auto overlaps = [min, max](SubtreeRef const& ref) {
+        return ref.begin <= max && min <= ref.end;
+    };
+    std::vector<SubtreeRef> refs;
+    {
+        SharedLock lock(lock_);
+        if (!initialized_ || extents_.empty()) {
+            return 0;
+        }
+        for (size_t i = 1; i < extents_.size(); i++) {
+            auto sblock = dynamic_cast<NBTreeSBlockExtent const*>(extents_.at(i).get());
+            if (sblock && sblock->curr_) {
+                sblock->curr_->read_all(&refs);
+            }
+        }
+    }
+    // Committed nodes are immutable, they can be read without the lock
+    size_t nloaded = 0;
+    std::vector<LogicAddr> leaves;
+    while (!refs.empty() && nloaded + leaves.size() < max_blocks) {
+        std::vector<SubtreeRef> next;
+        for (auto const& ref: refs) {
+            if (!overlaps(ref) || nloaded + leaves.size() >= max_blocks) {
+                continue;
+            }
+            if (ref.level == 0) {
+                leaves.push_back(ref.addr);
+                continue;
+            }
+            aku_Status status;
+            std::shared_ptr<Block> block;
+            std::tie(status, block) = read_and_check(bstore_, ref.addr);
+            nloaded++;
+            if (status == AKU_SUCCESS) {
+                NBTreeSuperblock sblock(block);
+                sblock.read_all(&next);
+            }
+        }
+        refs.swap(next);
+    }
+    if (!leaves.empty()) {
+        bstore_->read_blocks(leaves);
+        nloaded += leaves.size();
+    }
+    return nloaded;
+}
+
+bool NBTreeExtentsList::compact(double min_fill) {
+    UniqueLock lock(lock_);
+    if (!initialized_ || extents_.empty()) {
+        return false;
+    }
+    LeafStats stats;
+    get_leaf_stats(&stats, AKU_MIN_TIMESTAMP);
+    if (compute_fill_factor(stats.nleaves, stats.nvalues, stats.maxcount) >= min_fill) {
+        return false;
+    }
+    if (!rewrite(stats.packed_end, stats.nvalues + stats.npacked, "compact")) {
+        return false;
+    }
+    Logger::msg(AKU_LOG_TRACE, std::to_string(id_) + " Tree compacted, " + std::to_string(stats.nleaves) +
+                               " leaf nodes rewritten");
+    return true;
+}
+
+bool NBTreeExtentsList::recompress(aku_Timestamp older_than) {
+    // Packing less leaf nodes doesn't pay off the rewrite
+    enum { MIN_COLD_LEAVES = 4 };
+    UniqueLock lock(lock_);
+    if (!initialized_ || extents_.empty()) {
+        return false;
+    }
+    LeafStats stats;
+    get_leaf_stats(&stats, older_than);
+    if (stats.ncold < MIN_COLD_LEAVES) {
+        return false;
+    }
+    if (!rewrite(std::max(older_than, stats.packed_end), stats.nvalues + stats.npacked, "recompress")) {
+        return false;
+    }
+    Logger::msg(AKU_LOG_TRACE, std::to_string(id_) + " Tree recompressed, " + std::to_string(stats.ncold) +
+                               " leaf nodes packed");
+    return true;
+}
+
+bool NBTreeExtentsList::rewrite(aku_Timestamp pack_before, u64 nvalues, const char* what) {
+    auto leaf = dynamic_cast<NBTreeLeafExtent const*>(extents_.front().get());
+    if (leaf == nullptr) {
+        AKU_PANIC("Bad extent at level 0, leaf node expected");
+    }
+    if (leaf->leaf_) {
+        nvalues += leaf->leaf_->nelements();
+    }
+    // Copy all values to the new tree
+    WriteCauseScope cause(WriteCause::COMPACTION);
+    std::vector<std::unique_ptr<RealValuedOperator>> iterators;
+    for (auto it = extents_.rbegin(); it != extents_.rend(); it++) {
+        iterators.push_back((*it)->search(AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP));
+    }
+    ChainOperator chain(std::move(iterators));
+    auto tree = std::make_shared<NBTreeExtentsList>(id_, std::vector<LogicAddr>(), bstore_, fanout_);
+    tree->force_init();
+    if (pack_before != AKU_MIN_TIMESTAMP) {
+        // Create first leaf node of the new tree in packed mode
+        std::unique_ptr<NBTreeLeafExtent> newleaf(new NBTreeLeafExtent(bstore_, tree, id_, EMPTY_ADDR));
+        newleaf->set_pack_threshold(pack_before);
+        tree->extents_.push_back(std::move(newleaf));
+        tree->rescue_points_.push_back(EMPTY_ADDR);
+    }
+    const size_t BATCH_SIZE = 0x1000;
+    std::vector<aku_Timestamp> tss(BATCH_SIZE, 0);
+    std::vector<double> xss(BATCH_SIZE, 0);
+    u64 ncopied = 0;
+    while (true) {
+        aku_Status status;
+        size_t size;
+        std::tie(status, size) = chain.read(tss.data(), xss.data(), BATCH_SIZE);
+        if (size != 0) {
+            if (tree->append_range(tss.data(), xss.data(), size) == NBTreeAppendResult::FAIL_LATE_WRITE) {
+                AKU_PANIC("Invalid tree " + std::to_string(id_) + ", values are out of order");
+            }
+            ncopied += size;
+        }
+        if (status == AKU_ENO_DATA || status == AKU_EUNAVAILABLE) {
+            break;
+        }
+        if (status != AKU_SUCCESS) {
+            Logger::msg(AKU_LOG_ERROR, std::to_string(id_) + " Can't " + what + " the tree, read error: " +
+                                       StatusUtil::str(status));
+            return false;
+        }
     }
-    return 0;
+    if (ncopied != nvalues) {
+        Logger::msg(AKU_LOG_ERROR, std::to_string(id_) + " Can't " + what + " the tree, " + std::to_string(ncopied) +
+                                   " values copied out of " + std::to_string(nvalues));
+        return false;
+    }
+    // Switch to the new tree
+    rescue_points_ = tree->close();
+    extents_.clear();
+    // Values from the reorder buffer are not written to the new tree yet
+    write_count_ = reorder_buf_.size();
+    initialized_ = false;
+    init();
+    return true;
 }
 
 bool NBTreeExtentsList::is_initialized() const {
@@ -2941,7 +4594,7 @@ std::tuple<aku_Status, LogicAddr> NBTreeExtentsList::_split(aku_Timestamp pivot)
         if (extent_index > 0) {
             u16 prev_fanout = 0;
             LogicAddr prev_addr = EMPTY_ADDR;
-            if (pnode->fanout_index < AKU_NBTREE_MAX_FANOUT_INDEX) {
+            if (pnode->fanout_index + 1 < fanout_) {
                 prev_fanout = pnode->fanout_index + 1;
                 prev_addr   = paddr;
             }
@@ -2960,16 +4613,228 @@ std::tuple<aku_Status, LogicAddr> NBTreeExtentsList::_split(aku_Timestamp pivot)
 }
 
 NBTreeAppendResult NBTreeExtentsList::append(aku_Timestamp ts, double value) {
+    AKU_TRACE_SCOPE2(nbtree_append, id_, ts);
+    int digits = precision_.load(std::memory_order_relaxed);
+    if (digits >= 0) {
+        value = quantize_value(value, digits);
+    }
+    if (ring_size_.load(std::memory_order_relaxed) != 0) {
+        return append_to_ring(&ts, &value, 1);
+    }
+    auto stage = stage_values(&ts, &value, 1);
+    if (stage == StageStatus::LATE_WRITE) {
+        return NBTreeAppendResult::FAIL_LATE_WRITE;
+    } else if (stage == StageStatus::STAGED) {
+        return NBTreeAppendResult::OK;
+    }
     UniqueLock lock(lock_);  // NOTE: NBTreeExtentsList::append(subtree) can be called from here
                              //       recursively (maybe even many times).
+    StageOwnership owner = { this, stage != StageStatus::DIRECT };
+    auto result = NBTreeAppendResult::OK;
+    if (stage != StageStatus::OWNER_STAGED) {
+        result = append_value(ts, value);
+    }
+    if (owner.owned) {
+        result = drain_stage(result, &owner);
+    }
+    return result;
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_value(aku_Timestamp ts, double value) {
     if (!initialized_) {
         AKU_PANIC("NB+tree not imitialized");
     }
     if (ts < last_) {
         return NBTreeAppendResult::FAIL_LATE_WRITE;
     }
-    last_ = ts;
+    if (reorder_window_ != 0) {
+        return append_to_reorder_buffer(ts, value);
+    }
+    last_value_ts_ = ts;
+    last_value_ = value;
+    has_last_value_ = true;
+    write_count_++;
+    return append_to_tree(ts, value);
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_to_reorder_buffer(aku_Timestamp ts, double value) {
+    if (!has_last_value_ || ts >= last_value_ts_) {
+        last_value_ts_ = ts;
+        last_value_ = value;
+        has_last_value_ = true;
+    }
     write_count_++;
+    // Values with the same timestamp are kept in the write order
+    auto it = std::upper_bound(reorder_buf_.begin(), reorder_buf_.end(), ts,
+                               [](aku_Timestamp lhs, std::pair<aku_Timestamp, double> const& rhs) {
+                                   return lhs < rhs.first;
+                               });
+    reorder_buf_.insert(it, std::make_pair(ts, value));
+    auto result = NBTreeAppendResult::OK;
+    while (reorder_buf_.size() > reorder_window_) {
+        auto front = reorder_buf_.front();
+        reorder_buf_.pop_front();
+        if (append_to_tree(front.first, front.second) == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+            result = NBTreeAppendResult::OK_FLUSH_NEEDED;
+        }
+    }
+    return result;
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_to_ring(aku_Timestamp const* ts, double const* xs, size_t size) {
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> guard(ring_lock_);
+        if (size == 0) {
+            return NBTreeAppendResult::OK;
+        }
+        if (ts[0] < ring_last_) {
+            return NBTreeAppendResult::FAIL_LATE_WRITE;
+        }
+        for (size_t i = 1; i < size; i++) {
+            if (ts[i] < ts[i - 1]) {
+                return NBTreeAppendResult::FAIL_LATE_WRITE;
+            }
+        }
+        ring_last_ = ts[size - 1];
+        ring_ts_.insert(ring_ts_.end(), ts, ts + size);
+        ring_xs_.insert(ring_xs_.end(), xs, xs + size);
+        size_t threshold = ring_size_.load(std::memory_order_relaxed);
+        if (ring_ts_.size() < threshold || (ring_scheduled_ && ring_ts_.size() < 2*threshold)) {
+            return NBTreeAppendResult::OK;
+        }
+        if (!ring_scheduled_) {
+            ring_scheduled_ = true;
+            schedule = true;
+        }
+    }
+    if (schedule) {
+        auto queue = flush_queue_.lock();
+        if (queue) {
+            queue->schedule(id_, shared_from_this());
+            return NBTreeAppendResult::OK;
+        }
+    }
+    // Background flush can't keep up, the writer should flush the ring itself
+    return flush_write_ring() ? NBTreeAppendResult::OK_FLUSH_NEEDED : NBTreeAppendResult::OK;
+}
+
+NBTreeAppendResult NBTreeExtentsList::drain_write_ring() {
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    {
+        std::lock_guard<std::mutex> guard(ring_lock_);
+        tss.swap(ring_ts_);
+        xss.swap(ring_xs_);
+        ring_ts_.reserve(tss.size());
+        ring_xs_.reserve(xss.size());
+        ring_scheduled_ = false;
+    }
+    // Values in the ring are ordered but the tree could have been opened
+    // after they were accepted, values older than `last_` are late writes
+    auto begin = std::lower_bound(tss.begin(), tss.end(), last_) - tss.begin();
+    if (begin == static_cast<long>(tss.size())) {
+        return NBTreeAppendResult::OK;
+    }
+    last_ = tss.back();
+    last_value_ts_ = tss.back();
+    last_value_ = xss.back();
+    has_last_value_ = true;
+    write_count_ += tss.size() - begin;
+    return append_range_to_tree(tss.data() + begin, xss.data() + begin, tss.size() - begin);
+}
+
+NBTreeExtentsList::StageStatus NBTreeExtentsList::stage_values(aku_Timestamp const* ts, double const* xs, size_t size) {
+    std::lock_guard<std::mutex> guard(ring_lock_);
+    // Values can't be reordered if the ring is used as a staging queue
+    if (reorder_window_ != 0 || size == 0) {
+        return StageStatus::DIRECT;
+    }
+    if (ts[0] < ring_last_) {
+        return StageStatus::LATE_WRITE;
+    }
+    for (size_t i = 1; i < size; i++) {
+        if (ts[i] < ts[i - 1]) {
+            return StageStatus::LATE_WRITE;
+        }
+    }
+    ring_last_ = ts[size - 1];
+    if (stage_owned_ || !ring_ts_.empty()) {
+        // Values left by the previous owner should be written first
+        ring_ts_.insert(ring_ts_.end(), ts, ts + size);
+        ring_xs_.insert(ring_xs_.end(), xs, xs + size);
+        io_counters().staged_values.fetch_add(size, std::memory_order_relaxed);
+        if (stage_owned_) {
+            return StageStatus::STAGED;
+        }
+        stage_owned_ = true;
+        return StageStatus::OWNER_STAGED;
+    }
+    stage_owned_ = true;
+    return StageStatus::OWNER;
+}
+
+NBTreeExtentsList::StageOwnership::~StageOwnership() {
+    if (owned) {
+        std::lock_guard<std::mutex> guard(tree->ring_lock_);
+        tree->stage_owned_ = false;
+    }
+}
+
+NBTreeAppendResult NBTreeExtentsList::drain_stage(NBTreeAppendResult result, StageOwnership* owner) {
+    for (u32 round = 0; true; round++) {
+        {
+            std::lock_guard<std::mutex> guard(ring_lock_);
+            // Enabled ring is drained by the background thread
+            if (ring_ts_.empty() || ring_size_.load(std::memory_order_relaxed) != 0 || round == MAX_DRAIN_ROUNDS) {
+                // Released together with the check, otherwise the values staged after it could be lost
+                stage_owned_ = false;
+                owner->owned = false;
+                break;
+            }
+        }
+        if (drain_write_ring() == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+            result = NBTreeAppendResult::OK_FLUSH_NEEDED;
+        }
+    }
+    return result;
+}
+
+void NBTreeExtentsList::set_write_ring(u32 size, std::shared_ptr<NBTreeFlushQueue> queue) {
+    UniqueLock lock(lock_);
+    drain_write_ring();
+    std::lock_guard<std::mutex> guard(ring_lock_);
+    ring_last_ = std::max(ring_last_, last_);
+    ring_size_.store(reorder_window_ == 0 && queue ? size : 0);
+    flush_queue_ = queue;
+}
+
+bool NBTreeExtentsList::flush_write_ring() {
+    UniqueLock lock(lock_);
+    if (!initialized_) {
+        init();
+    }
+    return drain_write_ring() == NBTreeAppendResult::OK_FLUSH_NEEDED;
+}
+
+bool NBTreeExtentsList::is_repeated(aku_Timestamp ts, double value, aku_Timestamp heartbeat) {
+    // Values are compared bitwise, NaN repeats itself and 0.0 differs from -0.0
+    if (has_stored_ && std::memcmp(&value, &stored_value_, sizeof(double)) == 0 && ts - stored_ts_ < heartbeat) {
+        return true;
+    }
+    stored_ts_ = ts;
+    stored_value_ = value;
+    has_stored_ = true;
+    return false;
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_to_tree(aku_Timestamp ts, double value) {
+    last_ = ts;
+    auto heartbeat = heartbeat_.load(std::memory_order_relaxed);
+    if (heartbeat != 0 && is_repeated(ts, value, heartbeat)) {
+        io_counters().repeated_values.fetch_add(1, std::memory_order_relaxed);
+        return NBTreeAppendResult::OK;
+    }
     if (extents_.size() == 0) {
         // create first leaf node
         std::unique_ptr<NBTreeExtent> leaf;
@@ -2992,6 +4857,113 @@ NBTreeAppendResult NBTreeExtentsList::append(aku_Timestamp ts, double value) {
     return result;
 }
 
+NBTreeAppendResult NBTreeExtentsList::append_range(aku_Timestamp const* ts, double const* xs, size_t size) {
+    std::vector<double> quantized;
+    int digits = precision_.load(std::memory_order_relaxed);
+    if (digits >= 0) {
+        quantized.reserve(size);
+        for (size_t i = 0; i < size; i++) {
+            quantized.push_back(quantize_value(xs[i], digits));
+        }
+        xs = quantized.data();
+    }
+    if (ring_size_.load(std::memory_order_relaxed) != 0) {
+        return append_to_ring(ts, xs, size);
+    }
+    auto stage = stage_values(ts, xs, size);
+    if (stage == StageStatus::LATE_WRITE) {
+        return NBTreeAppendResult::FAIL_LATE_WRITE;
+    } else if (stage == StageStatus::STAGED) {
+        return NBTreeAppendResult::OK;
+    }
+    UniqueLock lock(lock_);
+    StageOwnership owner = { this, stage != StageStatus::DIRECT };
+    auto result = NBTreeAppendResult::OK;
+    if (stage != StageStatus::OWNER_STAGED) {
+        result = append_values(ts, xs, size);
+    }
+    if (owner.owned) {
+        result = drain_stage(result, &owner);
+    }
+    return result;
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_values(aku_Timestamp const* ts, double const* xs, size_t size) {
+    if (!initialized_) {
+        AKU_PANIC("NB+tree not imitialized");
+    }
+    if (size == 0) {
+        return NBTreeAppendResult::OK;
+    }
+    // Check the whole range before writing anything
+    if (ts[0] < last_) {
+        return NBTreeAppendResult::FAIL_LATE_WRITE;
+    }
+    for (size_t i = 1; i < size; i++) {
+        if (ts[i] < ts[i - 1]) {
+            return NBTreeAppendResult::FAIL_LATE_WRITE;
+        }
+    }
+    if (reorder_window_ != 0) {
+        // Values written to the tree are not newer than the current one so
+        // the rest of the range can't fail
+        auto result = NBTreeAppendResult::OK;
+        for (size_t i = 0; i < size; i++) {
+            if (append_to_reorder_buffer(ts[i], xs[i]) == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+                result = NBTreeAppendResult::OK_FLUSH_NEEDED;
+            }
+        }
+        return result;
+    }
+    last_ = ts[size - 1];
+    last_value_ts_ = ts[size - 1];
+    last_value_ = xs[size - 1];
+    has_last_value_ = true;
+    write_count_ += size;
+    return append_range_to_tree(ts, xs, size);
+}
+
+NBTreeAppendResult NBTreeExtentsList::append_range_to_tree(aku_Timestamp const* ts, double const* xs, size_t size) {
+    std::vector<aku_Timestamp> changed_ts;
+    std::vector<double> changed_xs;
+    auto heartbeat = heartbeat_.load(std::memory_order_relaxed);
+    if (heartbeat != 0) {
+        for (size_t i = 0; i < size; i++) {
+            if (!is_repeated(ts[i], xs[i], heartbeat)) {
+                changed_ts.push_back(ts[i]);
+                changed_xs.push_back(xs[i]);
+            }
+        }
+        io_counters().repeated_values.fetch_add(size - changed_ts.size(), std::memory_order_relaxed);
+        if (changed_ts.empty()) {
+            return NBTreeAppendResult::OK;
+        }
+        ts = changed_ts.data();
+        xs = changed_xs.data();
+        size = changed_ts.size();
+    }
+    if (extents_.size() == 0) {
+        // create first leaf node
+        std::unique_ptr<NBTreeExtent> leaf;
+        leaf.reset(new NBTreeLeafExtent(bstore_, shared_from_this(), id_, EMPTY_ADDR));
+        extents_.push_back(std::move(leaf));
+        rescue_points_.push_back(EMPTY_ADDR);
+    }
+    auto result = NBTreeAppendResult::OK;
+    bool parent_saved = false;
+    LogicAddr addr = EMPTY_ADDR;
+    std::tie(parent_saved, addr) = extents_.front()->append_range(ts, xs, size);
+    if (addr != EMPTY_ADDR) {
+        if (rescue_points_.size() > 0) {
+            rescue_points_.at(0) = addr;
+        } else {
+            rescue_points_.push_back(addr);
+        }
+        result = NBTreeAppendResult::OK_FLUSH_NEEDED;
+    }
+    return result;
+}
+
 bool NBTreeExtentsList::append(const SubtreeRef &pl) {
     // NOTE: this method should be called by extents which
     //       is called by another `append` overload recursively
@@ -3117,8 +5089,10 @@ void NBTreeExtentsList::open() {
         extents_.pop_back();
     }
 
-    // Restore `last_`
-    if (extents_.size()) {
+    // Restore `last_` (already known if the tree was opened from the checkpoint)
+    if (has_last_value_) {
+        last_ = last_value_ts_;
+    } else if (extents_.size()) {
         auto it = extents_.back()->search(AKU_MAX_TIMESTAMP, 0);
         aku_Timestamp ts;
         double val;
@@ -3162,6 +5136,7 @@ void NBTreeExtentsList::repair() {
     Logger::msg(AKU_LOG_INFO, std::to_string(id_) + " Trying to open tree, repair status - REPAIR, addr: " +
                               std::to_string(rescue_points_.back()));
     std::vector<LogicAddr> rescue_points(rescue_points_.begin(), rescue_points_.end());
+    WriteCauseScope cause(WriteCause::RECOVERY);
 
     // Construct roots using CoW
     if (rescue_points.size() < 2) {
@@ -3241,6 +5216,8 @@ void NBTreeExtentsList::init() {
             repair();
         }
     }
+    std::lock_guard<std::mutex> guard(ring_lock_);
+    ring_last_ = std::max(ring_last_, last_);
 }
 
 std::unique_ptr<RealValuedOperator> NBTreeExtentsList::search(aku_Timestamp begin, aku_Timestamp end) const {
@@ -3266,6 +5243,54 @@ std::unique_ptr<RealValuedOperator> NBTreeExtentsList::search(aku_Timestamp begi
     return concat;
 }
 
+std::unique_ptr<RealValuedOperator> NBTreeExtentsList::search(aku_Timestamp begin, aku_Timestamp end,
+                                                              std::shared_ptr<ScanLimit> limit) const
+{
+    SharedLock lock(lock_);
+    if (!initialized_) {
+        AKU_PANIC("NB+tree not imitialized");
+    }
+    std::vector<std::unique_ptr<RealValuedOperator>> iterators;
+    if (begin < end) {
+        for (auto it = extents_.rbegin(); it != extents_.rend(); it++) {
+            iterators.push_back((*it)->search(begin, end, limit));
+        }
+    } else {
+        for (auto const& root: extents_) {
+            iterators.push_back(root->search(begin, end, limit));
+        }
+    }
+    if (iterators.size() == 1) {
+        return std::move(iterators.front());
+    }
+    std::unique_ptr<RealValuedOperator> concat;
+    concat.reset(new ChainOperator(std::move(iterators)));
+    return concat;
+}
+
+std::unique_ptr<RealValuedOperator> NBTreeExtentsList::filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    SharedLock lock(lock_);
+    if (!initialized_) {
+        AKU_PANIC("NB+tree not imitialized");
+    }
+    std::vector<std::unique_ptr<RealValuedOperator>> iterators;
+    if (begin < end) {
+        for (auto it = extents_.rbegin(); it != extents_.rend(); it++) {
+            iterators.push_back((*it)->filter(begin, end, filter));
+        }
+    } else {
+        for (auto const& root: extents_) {
+            iterators.push_back(root->filter(begin, end, filter));
+        }
+    }
+    if (iterators.size() == 1) {
+        return std::move(iterators.front());
+    }
+    std::unique_ptr<RealValuedOperator> concat;
+    concat.reset(new ChainOperator(std::move(iterators)));
+    return concat;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeExtentsList::aggregate(aku_Timestamp begin, aku_Timestamp end) const {
     SharedLock lock(lock_);
     if (!initialized_) {
@@ -3290,6 +5315,52 @@ std::unique_ptr<AggregateOperator> NBTreeExtentsList::aggregate(aku_Timestamp be
 
 }
 
+std::unique_ptr<AggregateOperator> NBTreeExtentsList::approximate(aku_Timestamp begin, aku_Timestamp end) const {
+    SharedLock lock(lock_);
+    if (!initialized_) {
+        AKU_PANIC("NB+tree not imitialized");
+    }
+    std::vector<std::unique_ptr<AggregateOperator>> iterators;
+    if (begin < end) {
+        for (auto it = extents_.rbegin(); it != extents_.rend(); it++) {
+            iterators.push_back((*it)->approximate(begin, end));
+        }
+    } else {
+        for (auto const& root: extents_) {
+            iterators.push_back(root->approximate(begin, end));
+        }
+    }
+    if (iterators.size() == 1) {
+        return std::move(iterators.front());
+    }
+    std::unique_ptr<AggregateOperator> concat;
+    concat.reset(new CombineAggregateOperator(std::move(iterators)));
+    return concat;
+}
+
+std::unique_ptr<AggregateOperator> NBTreeExtentsList::value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const {
+    SharedLock lock(lock_);
+    if (!initialized_) {
+        AKU_PANIC("NB+tree not imitialized");
+    }
+    std::vector<std::unique_ptr<AggregateOperator>> iterators;
+    if (begin < end) {
+        for (auto it = extents_.rbegin(); it != extents_.rend(); it++) {
+            iterators.push_back((*it)->value_ranges(begin, end, filter));
+        }
+    } else {
+        for (auto const& root: extents_) {
+            iterators.push_back(root->value_ranges(begin, end, filter));
+        }
+    }
+    // Runs of the adjacent extents are joined as well
+    std::unique_ptr<AggregateOperator> concat;
+    concat.reset(new ChainAggregateOperator(std::move(iterators)));
+    std::unique_ptr<AggregateOperator> result;
+    result.reset(new ValueRangeOperator(std::move(concat)));
+    return result;
+}
+
 std::unique_ptr<AggregateOperator> NBTreeExtentsList::group_aggregate(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) const {
     SharedLock lock(lock_);
     if (!initialized_) {
@@ -3331,18 +5402,55 @@ std::unique_ptr<AggregateOperator> NBTreeExtentsList::candlesticks(aku_Timestamp
     }
     std::unique_ptr<AggregateOperator> concat;
     // NOTE: there is no intersections between extents so we can join iterators
-    concat.reset(new CombineAggregateOperator(std::move(iterators)));
+    concat.reset(new ChainAggregateOperator(std::move(iterators)));
     return concat;
 }
 
 
+void NBTreeExtentsList::set_change_only(aku_Timestamp heartbeat) {
+    UniqueLock lock(lock_);
+    heartbeat_.store(heartbeat);
+    // Values written before the mode was enabled are not compared with the new ones
+    has_stored_ = false;
+}
+
+void NBTreeExtentsList::set_precision(int digits) {
+    precision_.store(std::min(digits, static_cast<int>(AKU_MAX_PRECISION)));
+}
+
+void NBTreeExtentsList::set_reorder_window(u32 size) {
+    UniqueLock lock(lock_);
+    if (size != 0) {
+        // Write ring and reorder buffer can't be used together
+        drain_write_ring();
+        ring_size_.store(0);
+    }
+    while (reorder_buf_.size() > size) {
+        auto front = reorder_buf_.front();
+        reorder_buf_.pop_front();
+        append_to_tree(front.first, front.second);
+    }
+    // Staging queue checks the order using `ring_last_`
+    std::lock_guard<std::mutex> guard(ring_lock_);
+    reorder_window_ = size;
+    ring_last_ = std::max(ring_last_, last_);
+}
+
 std::vector<LogicAddr> NBTreeExtentsList::close() {
     UniqueLock lock(lock_);
     if (initialized_) {
+        // Buffered values should be written before the final commit
+        drain_write_ring();
+        while (!reorder_buf_.empty()) {
+            auto front = reorder_buf_.front();
+            reorder_buf_.pop_front();
+            append_to_tree(front.first, front.second);
+        }
         if (write_count_) {
             Logger::msg(AKU_LOG_TRACE, std::to_string(id_) + " Going to close the tree.");
             LogicAddr addr = EMPTY_ADDR;
             bool parent_saved = false;
+            WriteCauseScope cause(WriteCause::FLUSH);
             for(size_t index = 0ul; index < extents_.size(); index++) {
                 if (extents_.at(index)->is_dirty()) {
                     std::tie(parent_saved, addr) = extents_.at(index)->commit(true);
@@ -3383,6 +5491,83 @@ std::vector<LogicAddr> NBTreeExtentsList::_get_roots() const {
     return rescue_points_;
 }
 
+std::vector<std::pair<aku_Timestamp, double>> NBTreeExtentsList::get_reorder_buffer() const {
+    SharedLock lock(lock_);
+    return std::vector<std::pair<aku_Timestamp, double>>(reorder_buf_.begin(), reorder_buf_.end());
+}
+
+aku_Timestamp NBTreeExtentsList::get_last_timestamp() const {
+    SharedLock lock(lock_);
+    std::lock_guard<std::mutex> guard(ring_lock_);
+    return std::max(last_, ring_last_);
+}
+
+aku_Timestamp NBTreeExtentsList::get_first_timestamp() const {
+    auto it = search(AKU_MIN_TIMESTAMP, AKU_MAX_TIMESTAMP);
+    aku_Status status;
+    size_t size;
+    aku_Timestamp ts;
+    double xs;
+    std::tie(status, size) = it->read(&ts, &xs, 1);
+    if (size == 0) {
+        return AKU_MAX_TIMESTAMP;
+    }
+    return ts;
+}
+
+std::tuple<aku_Status, aku_Timestamp, double> NBTreeExtentsList::read_last() const {
+    {
+        std::lock_guard<std::mutex> guard(ring_lock_);
+        if (!ring_ts_.empty()) {
+            return std::make_tuple(AKU_SUCCESS, ring_ts_.back(), ring_xs_.back());
+        }
+    }
+    {
+        SharedLock lock(lock_);
+        if (has_last_value_) {
+            return std::make_tuple(AKU_SUCCESS, last_value_ts_, last_value_);
+        }
+    }
+    // Nothing was written since the tree was opened, read the last value
+    // from the tree once and remember it
+    auto it = search(AKU_MAX_TIMESTAMP, AKU_MIN_TIMESTAMP);
+    aku_Status status;
+    size_t size;
+    aku_Timestamp ts;
+    double xs;
+    std::tie(status, size) = it->read(&ts, &xs, 1);
+    if (size == 0) {
+        return std::make_tuple(status == AKU_SUCCESS ? AKU_ENO_DATA : status, 0ull, 0.0);
+    }
+    UniqueLock lock(lock_);
+    if (!has_last_value_) {
+        last_value_ts_ = ts;
+        last_value_ = xs;
+        has_last_value_ = true;
+    }
+    return std::make_tuple(AKU_SUCCESS, last_value_ts_, last_value_);
+}
+
+bool NBTreeExtentsList::get_last_value(aku_Timestamp* ts, double* value) const {
+    SharedLock lock(lock_);
+    if (has_last_value_) {
+        *ts = last_value_ts_;
+        *value = last_value_;
+    }
+    return has_last_value_;
+}
+
+void NBTreeExtentsList::set_last_value(aku_Timestamp ts, double value) {
+    UniqueLock lock(lock_);
+    if (initialized_) {
+        return;
+    }
+    last_ = ts;
+    last_value_ts_ = ts;
+    last_value_ = value;
+    has_last_value_ = true;
+}
+
 NBTreeExtentsList::RepairStatus NBTreeExtentsList::repair_status(std::vector<LogicAddr> const& rescue_points) {
     ssize_t count = static_cast<ssize_t>(rescue_points.size()) -
                     std::count(rescue_points.begin(), rescue_points.end(), EMPTY_ADDR);
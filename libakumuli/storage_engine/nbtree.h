@@ -74,7 +74,11 @@
 #pragma once
 
 // C++ headers
+#include <array>
+#include <atomic>
 #include <deque>
+#include <mutex>
+#include <random>
 
 // App headers
 #include "nbtree_def.h"
@@ -95,6 +99,33 @@ struct NBTreeCandlestickHint {
 };
 
 
+/** NBTree I/O counters (global, shared by all trees).
+  * Every written node is attributed to the operation that caused the write.
+  * Nodes written by appends are unavoidable, everything else is a write
+  * amplification.
+  */
+struct NBTreeIOStats {
+    enum {
+        MAX_LEVELS = 8,  //< deeper levels are counted in the last slot
+    };
+    std::array<u64, MAX_LEVELS> reads;       //< nodes read from the block store by level (0 - leaf)
+    std::array<u64, MAX_LEVELS> cache_hits;  //< nodes found in the block cache by level
+    u64 append_writes;       //< full nodes written by appends
+    u64 split_writes;        //< nodes written by splits
+    u64 flush_writes;        //< partially filled nodes written by `close` and `commit_leaf`
+    u64 recovery_writes;     //< nodes written by the crash recovery
+    u64 compaction_writes;   //< nodes written by the compaction
+    u64 repeated_values;     //< values that weren't stored by the change-only mode
+    u64 staged_values;       //< values passed to the writer that was appending to the same tree
+
+    //! Get current values of the counters
+    static NBTreeIOStats get();
+
+    //! Total number of written nodes divided by the number of nodes written by appends
+    double write_amplification() const;
+};
+
+
 class NBTreeSuperblock;
 
 /** NBTree leaf node. Supports append operation.
@@ -109,8 +140,43 @@ class NBTreeLeaf {
     DataBlockWriter writer_;
     //! Fanout index
     u16 fanout_index_;
+    //! Set if the node is stored in packed form
+    bool packed_;
+    //! Size of the data stream at which the packed node should be checked for overflow
+    size_t next_check_;
+
+    /** Size of the buffer of the new leaf node. Values are kept in the write buffer
+      * until the first chunk can be compressed, full block is allocated at this point.
+      * This way trees that are rarely updated don't hold `AKU_BLOCK_SIZE` bytes each.
+      */
+    enum { COMPACT_BLOCK_SIZE = 512 };
+
+    //! Replace compact buffer with the full block if `nvalues` values can't fit the write buffer
+    void reserve(size_t nvalues);
+
+    //! Replace compact buffer with the full block
+    void expand();
+
+    //! Return false if the packed node can't accept one more value
+    bool has_room_packed();
+
+    //! Compress the node and write it to block store
+    std::tuple<aku_Status, LogicAddr> commit_packed(std::shared_ptr<BlockStore> bstore, u16 size);
 
 public:
+    enum {
+        /** Size of the decompressed packed node. Packed leaf node is stored in one block
+          * (its payload is deflated), its contents is decompressed into the buffer of this
+          * size when the node is loaded.
+          */
+        PACKED_BLOCK_SIZE = 4*AKU_BLOCK_SIZE,
+        //! Set in `SubtreeRef::version` field of the packed leaf node and links to it
+        PACKED_FLAG = 0x8000,
+    };
+
+    //! Return true if `ref` is a packed leaf node or a link to it
+    static bool is_packed(SubtreeRef const& ref);
+
     //! Empty tag to choose c-tor
     struct CloneTag {};
 
@@ -122,13 +188,18 @@ public:
     //! Only for testing and benchmarks
     size_t _get_uncommitted_size() const;
 
+    //! Only for testing and benchmarks, size of the node's buffer
+    size_t _get_buffer_size() const;
+
     /** Create empty leaf node.
       * @param id Series id.
       * @param link to block store.
       * @param prev Prev element of the tree.
       * @param fanout_index Index inside current fanout
+      * @param packed If set the node is compressed on commit, it can hold
+      *        more values but it's slower to write and read.
       */
-    NBTreeLeaf(aku_ParamId id, LogicAddr prev, u16 fanout_index);
+    NBTreeLeaf(aku_ParamId id, LogicAddr prev, u16 fanout_index, bool packed = false);
 
     /** Load from block store.
       * @param block Leaf's serialized data.
@@ -153,6 +224,9 @@ public:
     //! Get leaf metadata.
     SubtreeRef const* get_leafmeta() const;
 
+    //! Return true if the node is stored in packed form
+    bool is_packed() const;
+
     //! Returns number of elements.
     size_t nelements() const;
 
@@ -178,9 +252,36 @@ public:
       */
     aku_Status read_all(std::vector<aku_Timestamp>* timestamps, std::vector<double>* values) const;
 
+    /** Read elements from the leaf node that are needed to cover the range up to `max`.
+      * Decoding stops on the first chunk that contains a timestamp larger than `max`,
+      * so the output can contain some elements after `max` (the tail of this chunk).
+      * @param max is a largest timestamp of the range
+      * @param timestamps Destination for timestamps.
+      * @param values Destination for values.
+      * @return status.
+      */
+    aku_Status read_until(aku_Timestamp max, std::vector<aku_Timestamp>* timestamps, std::vector<double>* values) const;
+
+    /** Read elements from the leaf node that are needed to cover the range [min, max].
+      * Same as `read_until` but chunks that precede `min` are skipped using the chunk
+      * directory of the leaf, so the output can contain some elements before `min`.
+      * @param min is a smallest timestamp of the range
+      * @param max is a largest timestamp of the range
+      * @param timestamps Destination for timestamps.
+      * @param values Destination for values.
+      * @return status.
+      */
+    aku_Status read_range(aku_Timestamp min, aku_Timestamp max,
+                          std::vector<aku_Timestamp>* timestamps, std::vector<double>* values) const;
+
     //! Append values to NBTree
     aku_Status append(aku_Timestamp ts, double value);
 
+    /** Append several values to the leaf.
+      * @return number of values appended (less than `size` if leaf is full)
+      */
+    size_t append_range(aku_Timestamp const* ts, double const* xs, size_t size);
+
     /** Flush all pending changes to block store and close.
       * Calling this function too often can result in unoptimal space usage.
       */
@@ -195,8 +296,14 @@ public:
     //! Return iterator that outputs all values in time range that is stored in this leaf.
     std::unique_ptr<RealValuedOperator> range(aku_Timestamp begin, aku_Timestamp end) const;
 
+    //! Return iterator that outputs values in time range that match the filter.
+    std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
+
     std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin, aku_Timestamp end) const;
 
+    //! Return iterator that outputs runs of consecutive values that match the filter.
+    std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
+
     //! Search for values in a range (in this and connected leaf nodes). DEPRICATED
     std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<BlockStore> bstore) const;
 
@@ -228,11 +335,13 @@ public:
      * @param bstore is a pointer to blockstore
      * @param pivot is a pivot point of the split
      * @param preserve_backrefs is a flag that controls the backrefs (ignored)
+     * @param max_fanout is a fanout of the tree (max number of links in the new topmost node)
      * @return status and address of the new topmost node
      */
     std::tuple<aku_Status, LogicAddr> split(std::shared_ptr<BlockStore> bstore,
                                             aku_Timestamp pivot,
-                                            bool preserve_backrefs);
+                                            bool preserve_backrefs,
+                                            u16 max_fanout = AKU_NBTREE_FANOUT);
 };
 
 
@@ -246,10 +355,34 @@ class NBTreeSuperblock {
     u16                    level_;
     LogicAddr              prev_;
     bool                   immutable_;
+    //! Set if links to child nodes are stored as `SubtreeRefCompact`
+    bool                   compact_;
+    //! Max number of links in the node (fanout of the tree)
+    u16                    max_fanout_;
+
+    //! Decode link to the child node
+    SubtreeRef child_at(u32 ix) const;
 
 public:
-    //! Create new writable node.
-    NBTreeSuperblock(aku_ParamId id, LogicAddr prev, u16 fanout, u16 lvl);
+    enum {
+        /** Set in `SubtreeRef::version` field of the superblock header if
+          * links are stored in compact form. Nodes without this flag were
+          * written with full `SubtreeRef` links.
+          */
+        COMPACT_FLAG = 0x4000,
+        /** Bits of `SubtreeRef::version` of the superblock header that store
+          * the fanout of the tree. Zero if the node was written before the
+          * fanout became configurable (AKU_NBTREE_FANOUT is used).
+          */
+        FANOUT_MASK = 0x3F00,
+        FANOUT_SHIFT = 8,
+    };
+
+    /** Create new writable node.
+      * @param fanout is a fanout index of the node
+      * @param max_fanout is a max number of links in the node (fanout of the tree)
+      */
+    NBTreeSuperblock(aku_ParamId id, LogicAddr prev, u16 fanout, u16 lvl, u16 max_fanout = AKU_NBTREE_FANOUT);
 
     //! Read immutable node from block-store.
     NBTreeSuperblock(std::shared_ptr<Block> block);
@@ -281,6 +414,9 @@ public:
     //! Get fanout index of the node
     u16 get_fanout() const;
 
+    //! Get max number of links in the node
+    u16 get_max_fanout() const;
+
     SubtreeRef const* get_sblockmeta() const;
 
     size_t nelements() const;
@@ -305,10 +441,37 @@ public:
 
     std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<BlockStore> bstore) const;
 
+    //! Search with limit and offset, subtrees that are inside the offset are skipped without reading
+    std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin,
+                                               aku_Timestamp end,
+                                               std::shared_ptr<ScanLimit> limit,
+                                               std::shared_ptr<BlockStore> bstore) const;
+
+    //! Search for values that match the filter, subtrees that can't contain matching values are skipped
+    std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin,
+                                               aku_Timestamp end,
+                                               ValueFilter const& filter,
+                                               std::shared_ptr<BlockStore> bstore) const;
+
     std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin,
                                                 aku_Timestamp end,
                                                 std::shared_ptr<BlockStore> bstore) const;
 
+    /** Approximate aggregate. Leaf nodes are never read, aggregates of the leaves that
+      * overlap the range partially are estimated using their SubtreeRef.
+      */
+    std::unique_ptr<AggregateOperator> approximate(aku_Timestamp begin,
+                                                  aku_Timestamp end,
+                                                  std::shared_ptr<BlockStore> bstore) const;
+
+    /** Runs of values that match the filter. Subtrees that match entirely or don't
+      * match at all (according to their min and max) are not read.
+      */
+    std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin,
+                                                   aku_Timestamp end,
+                                                   ValueFilter const& filter,
+                                                   std::shared_ptr<BlockStore> bstore) const;
+
     std::unique_ptr<AggregateOperator> candlesticks(aku_Timestamp begin, aku_Timestamp end,
                                                    std::shared_ptr<BlockStore> bstore,
                                                    NBTreeCandlestickHint hint) const;
@@ -369,6 +532,13 @@ struct NBTreeExtent {
       */
     virtual std::tuple<bool, LogicAddr> append(aku_Timestamp ts, double value) = 0;
 
+    /** Append several values to the root (doesn't work with superblocks)
+      * Default implementation appends values one by one.
+      * @return true if higher level node was saved and the address of the last committed
+      *         node (EMPTY if nothing was committed)
+      */
+    virtual std::tuple<bool, LogicAddr> append_range(aku_Timestamp const* ts, double const* xs, size_t size);
+
     /** Append subtree metadata to the root (doesn't work with leaf nodes)
       * If new root created - return address of the previous root, otherwise return EMPTY
       */
@@ -384,12 +554,24 @@ struct NBTreeExtent {
     //! Return iterator
     virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end) const = 0;
 
+    //! Return iterator that applies limit and offset (limit is updated during iteration)
+    virtual std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<ScanLimit> limit) const = 0;
+
+    //! Return iterator that outputs only values that match the filter
+    virtual std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const = 0;
+
     //! Returns true if extent was modified after last commit and has some unsaved data.
     virtual bool is_dirty() const = 0;
 
     //! Return iterator that will return single aggregated value.
     virtual std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin, aku_Timestamp end) const = 0;
 
+    //! Return iterator that will return single approximate aggregate (leaf nodes are not read).
+    virtual std::unique_ptr<AggregateOperator> approximate(aku_Timestamp begin, aku_Timestamp end) const = 0;
+
+    //! Return iterator that outputs runs of values that match the filter (separated by empty aggregates).
+    virtual std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const = 0;
+
     virtual std::unique_ptr<AggregateOperator> candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const = 0;
 
     //! Return group-aggregate query results iterator
@@ -435,6 +617,18 @@ enum class NBTreeAppendResult {
     FAIL_BAD_VALUE,
 };
 
+class NBTreeExtentsList;
+
+/** Receives columns with full write rings. The ring should be flushed to the tree
+  * by calling `NBTreeExtentsList::flush_write_ring` from the background thread.
+  */
+struct NBTreeFlushQueue {
+    virtual ~NBTreeFlushQueue() = default;
+
+    //! Schedule the flush, called by the writer thread (should not block)
+    virtual void schedule(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree) = 0;
+};
+
 /** @brief This class represents set of roots of the NBTree.
   * It serves two purposes:
   * @li store all roots of the NBTree
@@ -444,16 +638,61 @@ class NBTreeExtentsList : public std::enable_shared_from_this<NBTreeExtentsList>
     std::shared_ptr<BlockStore> bstore_;
     std::deque<std::unique_ptr<NBTreeExtent>> extents_;
     const aku_ParamId id_;
+    //! Number of children of the inner nodes
+    const u16 fanout_;
     //! Last timestamp
     aku_Timestamp last_;
+    //! Latest value and its timestamp (valid if `has_last_value_` is set)
+    mutable aku_Timestamp last_value_ts_;
+    mutable double last_value_;
+    mutable bool has_last_value_;
     std::vector<LogicAddr> rescue_points_;
     bool initialized_;
     //! Number of write operations performed on object
     u64 write_count_;
+    //! Max number of values in the reorder buffer (0 - out of order writes are rejected)
+    u32 reorder_window_;
+    //! Values that wasn't written to the tree yet (ordered by timestamp)
+    std::deque<std::pair<aku_Timestamp, double>> reorder_buf_;
+    //! Number of decimal digits the values are rounded to (negative - disabled)
+    std::atomic<int> precision_;
+    //! Max interval between the stored values in change-only mode (0 - every value is stored)
+    std::atomic<aku_Timestamp> heartbeat_;
+    //! Last value written to the tree and its timestamp (valid if `has_stored_` is set)
+    aku_Timestamp stored_ts_;
+    double stored_value_;
+    bool has_stored_;
+    /** Uncompressed values that wasn't written to the tree yet. Writers only take
+      * `ring_lock_` to add values to the ring, the ring is moved to the tree by the
+      * background thread (`lock_` should be acquired before `ring_lock_`). If the ring
+      * is disabled, it's used as a staging queue (see `stage_owned_`).
+      */
+    std::vector<aku_Timestamp> ring_ts_;
+    std::vector<double> ring_xs_;
+    //! Number of values in the ring that triggers the flush (0 - ring is disabled)
+    std::atomic<u32> ring_size_;
+    //! Set if the flush was scheduled but not performed yet
+    bool ring_scheduled_;
+    //! Timestamp of the last value added to the ring
+    aku_Timestamp ring_last_;
+    /** Set if some writer appends to the tree. Other writers add their values to the ring
+      * and return without waiting for `lock_`, the owner moves the ring to the tree before
+      * returning so concurrent writers never wait for each other's commits.
+      */
+    bool stage_owned_;
+    //! Max number of times the owner drains the staging queue before returning
+    enum { MAX_DRAIN_ROUNDS = 4 };
+    //! Not owned, the tree shouldn't keep the queue alive
+    std::weak_ptr<NBTreeFlushQueue> flush_queue_;
+    mutable std::mutex ring_lock_;
 
     void open();
     void repair();
     void init();
+    /** Readers (search, aggregate, etc) share the lock, they hold it only while the iterators
+      * are created (iterators copy the contents of the mutable nodes) so the queries
+      * don't block each other. Writers are preferred so ingestion is not starved by the queries.
+      */
     mutable RWLock lock_;
 
     // Testing
@@ -469,6 +708,78 @@ class NBTreeExtentsList : public std::enable_shared_from_this<NBTreeExtentsList>
     std::tuple<aku_Status, AggregationResult> get_aggregates(u32 ixnode) const;
 
     void check_rescue_points(u32 i) const;
+
+    //! Write value to the leaf node (lock should be acquired by the caller)
+    NBTreeAppendResult append_to_tree(aku_Timestamp ts, double value);
+
+    /** Return true if the value repeats the last stored value and should be dropped
+      * in change-only mode, update the last stored value otherwise (lock should be
+      * acquired by the caller).
+      */
+    bool is_repeated(aku_Timestamp ts, double value, aku_Timestamp heartbeat);
+
+    //! Add value to the reorder buffer and write oldest values out of the window to the tree
+    NBTreeAppendResult append_to_reorder_buffer(aku_Timestamp ts, double value);
+
+    //! Add values to the write ring and schedule the flush if the ring is full
+    NBTreeAppendResult append_to_ring(aku_Timestamp const* ts, double const* xs, size_t size);
+
+    //! Write values from the ring to the tree (lock should be acquired by the caller)
+    NBTreeAppendResult drain_write_ring();
+
+    enum class StageStatus {
+        DIRECT,        //< write to the tree directly (reorder buffer is used)
+        OWNER,         //< write to the tree and drain the staged values
+        OWNER_STAGED,  //< values were added after the ones left by the previous owner, drain the ring
+        STAGED,        //< values were added to the ring, nothing to do
+        LATE_WRITE,    //< values are older than the last accepted one
+    };
+
+    /** Ownership of the staging queue, released when the owner leaves `append` even
+      * if the write throws. Staged values left in the ring are written by the next owner
+      * (or by `commit_leaf` and `close`).
+      */
+    struct StageOwnership {
+        NBTreeExtentsList* tree;
+        bool owned;
+        ~StageOwnership();
+    };
+
+    //! Add values to the ring if some other writer appends to the tree
+    StageStatus stage_values(aku_Timestamp const* ts, double const* xs, size_t size);
+
+    /** Write staged values to the tree until the ring is empty and release the ownership
+      * (lock should be acquired by the caller). Number of drain rounds is limited so the
+      * owner doesn't write the values of other writers forever under constant load.
+      * @param result is a result of the owner's own write
+      * @param owner is an ownership of the staging queue
+      */
+    NBTreeAppendResult drain_stage(NBTreeAppendResult result, StageOwnership* owner);
+
+    //! Write value to the tree or reorder buffer (lock should be acquired by the caller)
+    NBTreeAppendResult append_value(aku_Timestamp ts, double value);
+
+    //! Write values to the tree or reorder buffer (lock should be acquired by the caller)
+    NBTreeAppendResult append_values(aku_Timestamp const* ts, double const* xs, size_t size);
+
+    //! Write several values to the leaf node (lock should be acquired by the caller)
+    NBTreeAppendResult append_range_to_tree(aku_Timestamp const* ts, double const* xs, size_t size);
+
+public:
+    //! Statistics of the committed leaf nodes
+    struct LeafStats;
+private:
+    /** Collect statistics of the committed leaf nodes.
+      * @param cold_before is a timestamp, regular leaf nodes that contain only older values are counted as cold
+      */
+    void get_leaf_stats(LeafStats* stats, aku_Timestamp cold_before) const;
+
+    /** Copy all values to the new tree and replace the current one with it (lock should be acquired by the caller).
+      * @param pack_before is a timestamp, older values are written to the packed leaf nodes
+      * @param nvalues is a number of values in the committed leaf nodes
+      * @param what is a name of the operation (for logging)
+      */
+    bool rewrite(aku_Timestamp pack_before, u64 nvalues, const char* what);
 public:
 
     std::tuple<aku_Status, LogicAddr> _split(aku_Timestamp pivot);
@@ -476,8 +787,14 @@ public:
     /** C-tor
       * @param addresses List of root addresses in blockstore or list of resque points.
       * @param bstore Block-store.
+      * @param fanout Number of children of the inner nodes (between AKU_NBTREE_MIN_FANOUT
+      *        and AKU_NBTREE_FANOUT), nodes written earlier keep their own fanout.
       */
-    NBTreeExtentsList(aku_ParamId id, std::vector<LogicAddr> addresses, std::shared_ptr<BlockStore> bstore);
+    NBTreeExtentsList(aku_ParamId id, std::vector<LogicAddr> addresses, std::shared_ptr<BlockStore> bstore,
+                      u16 fanout = AKU_NBTREE_FANOUT);
+
+    //! Get number of children of the inner nodes
+    u16 get_fanout() const;
 
     /** Append new subtree reference to extents list.
       * This operation can't fail and should be used only by NB-tree itself (from node-commit functions).
@@ -487,11 +804,18 @@ public:
     bool append(SubtreeRef const& pl);
 
     /** Append new value to extents list.
-      * This operation can fail if value is out of order.
+      * This operation can fail if value is out of order (and doesn't fit into the reorder window).
       * On success result is OK or OK_FLUSH_NEEDED (if rescue points list was changed).
       */
     NBTreeAppendResult append(aku_Timestamp ts, double value);
 
+    /** Append several values to extents list at once.
+      * Timestamps should be ordered and shouldn't be less than the last timestamp
+      * written to the tree, otherwise nothing is written and FAIL_LATE_WRITE is returned.
+      * On success result is OK or OK_FLUSH_NEEDED (if rescue points list was changed).
+      */
+    NBTreeAppendResult append_range(aku_Timestamp const* ts, double const* xs, size_t size);
+
     /**
      * @brief search function
      * @param begin is a start of the search interval
@@ -500,6 +824,25 @@ public:
      */
     std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end) const;
 
+    /**
+     * @brief search function with limit and offset, subtrees that fit into the
+     *        offset are skipped using their value count
+     * @param begin is a start of the search interval
+     * @param end is a next after the last element of the search interval
+     * @param limit is a limit and offset, can be shared with other operators
+     *        if they're read one after another
+     */
+    std::unique_ptr<RealValuedOperator> search(aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<ScanLimit> limit) const;
+
+    /**
+     * @brief search values that match the filter, subtrees that can't contain
+     *        matching values (according to their min and max) are not read
+     * @param begin is a start of the search interval
+     * @param end is a next after the last element of the search interval
+     * @param filter is a value filter
+     */
+    std::unique_ptr<RealValuedOperator> filter(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
+
     /**
      * @brief aggregate all values in search interval
      * @param begin is a start of the search interval
@@ -508,6 +851,28 @@ public:
      */
     std::unique_ptr<AggregateOperator> aggregate(aku_Timestamp begin, aku_Timestamp end) const;
 
+    /**
+     * @brief estimate aggregate of all values in search interval
+     * Superblocks are read as usual but leaf nodes that belong to the
+     * interval partially are not, their aggregates are estimated using
+     * metadata (see QueryProfile::count_error).
+     * @param begin is a start of the search interval
+     * @param end is a next after the last element of the search interval
+     * @return iterator that produces single value
+     */
+    std::unique_ptr<AggregateOperator> approximate(aku_Timestamp begin, aku_Timestamp end) const;
+
+    /**
+     * @brief find time ranges in which all values match the filter
+     * Subtrees that don't contain matching values or contain only
+     * matching values (according to their min and max) are not read.
+     * @param begin is a start of the search interval
+     * @param end is a next after the last element of the search interval
+     * @param filter is a value filter
+     * @return iterator that produces one aggregate per range
+     */
+    std::unique_ptr<AggregateOperator> value_ranges(aku_Timestamp begin, aku_Timestamp end, ValueFilter const& filter) const;
+
     std::unique_ptr<AggregateOperator> candlesticks(aku_Timestamp begin, aku_Timestamp end, NBTreeCandlestickHint hint) const;
 
     /**
@@ -519,6 +884,49 @@ public:
      */
     std::unique_ptr<AggregateOperator> group_aggregate(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) const;
 
+    /** Set size of the reorder window.
+      * Last `size` values are kept in the sorted buffer before they're written to the tree.
+      * Value can be written out of order if it's not older than the last value written to the tree.
+      * Buffered values are not visible to queries and are written to the tree on close.
+      * @param size is a max number of buffered values (0 - disabled)
+      */
+    void set_reorder_window(u32 size);
+
+    /** Set precision hint. New values are rounded to `digits` decimal digits after
+      * the point, this makes them compressible by the SCALED codec (lossy).
+      * @param digits is a number of digits (negative - disabled), values larger
+      *        than AKU_MAX_PRECISION are clamped
+      */
+    void set_precision(int digits);
+
+    /** Enable change-only mode. New value is not stored if it's equal to the last stored
+      * value and the last stored value is younger than `heartbeat`, so every run of the
+      * repeated values is stored as its first value followed by one value per heartbeat
+      * interval. Queries see the stored values as a step function (group-aggregate query
+      * can fill the empty buckets using `"fill": "prev"`).
+      * @param heartbeat is a max interval between the stored values (0 - disabled)
+      */
+    void set_change_only(aku_Timestamp heartbeat);
+
+    //! Get copy of the reorder buffer (values that wasn't written to the tree yet)
+    std::vector<std::pair<aku_Timestamp, double>> get_reorder_buffer() const;
+
+    /** Enable the write ring. Values are added to the uncompressed ring and the tree is
+      * passed to `queue` when `size` values are buffered. Compression and commit of the
+      * leaf nodes happen when the ring is flushed so the writer doesn't pay for them. If
+      * the flush can't keep up, the writer flushes the ring itself when it grows twice as
+      * large. Values from the ring are not visible to queries until the flush. The ring is
+      * not used if the reorder window is set.
+      * @param size is a number of buffered values (0 - disabled)
+      * @param queue is a flush queue (not owned by the tree)
+      */
+    void set_write_ring(u32 size, std::shared_ptr<NBTreeFlushQueue> queue);
+
+    /** Write values from the write ring to the tree.
+      * @return true if rescue points were changed
+      */
+    bool flush_write_ring();
+
     //! Commit changes to btree and close (do not call blockstore.flush), return list of addresses.
     std::vector<LogicAddr> close();
 
@@ -528,9 +936,94 @@ public:
     //! Get roots of the tree (only for internal use)
     std::vector<LogicAddr> _get_roots() const;
 
+    /** Get timestamp of the last value written to the tree.
+      * Late writes are rejected so values older than this timestamp can't change.
+      */
+    aku_Timestamp get_last_timestamp() const;
+
+    /** Get timestamp of the oldest value stored in the tree (reads the tree).
+      * New values can't be older than this timestamp if the tree isn't empty.
+      * @return AKU_MAX_TIMESTAMP if the tree is empty
+      */
+    aku_Timestamp get_first_timestamp() const;
+
+    /** Get the latest value of the series.
+      * Value is maintained by `append`, block store is accessed only once if
+      * nothing was written since the tree was opened.
+      * @return status (AKU_ENO_DATA if tree is empty), timestamp and value
+      */
+    std::tuple<aku_Status, aku_Timestamp, double> read_last() const;
+
+    /** Get the latest value if it's known without reading the tree.
+      * @return false if nothing was written or read since the tree was opened
+      */
+    bool get_last_value(aku_Timestamp* ts, double* value) const;
+
+    /** Set the latest value of the tree that wasn't initialized yet (e.g. from the
+      * shutdown checkpoint). The tree doesn't search for the last value when opened.
+      * Ignored if the tree is already initialized.
+      */
+    void set_last_value(aku_Timestamp ts, double value);
+
     //! Get size of the data stored in memory in compressed form (only for internal use)
     size_t _get_uncommitted_size() const;
 
+    //! Get size of the leaf node's buffer in bytes (0 if the tree is not initialized)
+    size_t get_write_buffer_size() const;
+
+    /** Commit the leaf node even if it's not full. Tree remains open, next value
+      * will be written to the new (compact) leaf node. Calling this function too
+      * often results in suboptimal space usage.
+      * @return true if the leaf node was committed and rescue points were changed,
+      *         false if the leaf node is empty
+      */
+    bool commit_leaf();
+
+    /** Get fill factor of the committed leaf nodes.
+      * Fill factor is an average number of values in the leaf node divided by the
+      * number of values in the largest one. Leaf nodes committed early or created by
+      * the split procedure decrease the fill factor.
+      * @return value between 0 and 1 (1 if the tree has less than two committed leaf nodes)
+      */
+    double get_fill_factor() const;
+
+    /** Estimate the number of values and leaf nodes in the time range without reading the tree.
+      * Only the subtree refs of the mutable superblocks and the mutable leaf node are used,
+      * subtrees that partially overlap the range are counted proportionally. Committed
+      * subtrees are full so the subtree of level L has FANOUT^L leaf nodes.
+      * @param nvalues receives estimated number of values
+      * @param nleaves receives estimated number of leaf nodes that has to be read
+      */
+    void estimate(aku_Timestamp begin, aku_Timestamp end, u64* nvalues, u64* nleaves) const;
+
+    /** Load nodes that intersect the time range into the block cache (see BlockStore::read_blocks).
+      * Superblocks are read level by level, leaf nodes are only prefetched. The tree
+      * is locked only to copy the refs of the mutable superblocks.
+      * @param max_blocks is a max number of blocks to load
+      * @return number of loaded blocks
+      */
+    size_t prefetch(aku_Timestamp begin, aku_Timestamp end, size_t max_blocks) const;
+
+    /** Rewrite the tree if its leaf nodes are underfilled.
+      * All values are copied to the new tree that consists of full leaf nodes and superblocks,
+      * then the new tree replaces the current one. Writers are blocked during compaction.
+      * Nodes of the old tree are not referenced after the call and will be reclaimed
+      * with the volume.
+      * @param min_fill is a fill factor threshold, tree is not rewritten if its fill factor is larger
+      * @return true if the tree was rewritten and rescue points were changed
+      */
+    bool compact(double min_fill);
+
+    /** Rewrite the tree if it has enough regular leaf nodes with values older than `older_than`.
+      * Values are copied to the new tree as in `compact` but old values are written to packed
+      * leaf nodes. Packed leaf node stores deflated payload of up to four regular ones in one
+      * block. It's decompressed transparently when loaded. Packed leaf nodes are preserved
+      * by `compact` and by subsequent calls.
+      * @param older_than is a timestamp, values older than this are packed
+      * @return true if the tree was rewritten and rescue points were changed
+      */
+    bool recompress(aku_Timestamp older_than);
+
     //! Get pointers to extents (for tests).
     std::vector<NBTreeExtent const*> get_extents() const;
 
@@ -19,8 +19,15 @@ enum class NBTreeBlockType : u16 {
 
 
 enum {
-    AKU_NBTREE_FANOUT = 32,
-    AKU_NBTREE_MAX_FANOUT_INDEX = 31,
+    //! Max number of children in superblock (limited by the size of the `SubtreeRefCompact`), default fanout
+    AKU_NBTREE_FANOUT = 42,
+    AKU_NBTREE_MAX_FANOUT_INDEX = 41,
+    //! Min fanout of the database (see `Storage::new_database`)
+    AKU_NBTREE_MIN_FANOUT = 4,
+    //! Fanout of the trees written before compact superblock format was introduced
+    AKU_NBTREE_LEGACY_FANOUT = 32,
+    //! Number of child nodes that superblock iterators read ahead
+    AKU_NBTREE_PREFETCH_DEPTH = 8,
 };
 
 
@@ -73,4 +80,43 @@ struct SubtreeRef {
     u32 checksum;
 } __attribute__((packed));
 
+
+/** Link to child node stored inside the superblock.
+  * Superblock header is a full `SubtreeRef`, links to child nodes omit fields
+  * that can be derived from the header (id) or not used for links (payload_size,
+  * checksum). Level and type are narrowed to one byte each.
+  */
+struct SubtreeRefCompact {
+    //! Number of elements in the subtree
+    u64 count;
+    //! First element's timestamp
+    aku_Timestamp begin;
+    //! Last element's timestamp
+    aku_Timestamp end;
+    //! Object addr in blockstore
+    LogicAddr addr;
+    //! Smalles value
+    double min;
+    //! Registration time of the smallest value
+    aku_Timestamp min_time;
+    //! Largest value
+    double max;
+    //! Registration time of the largest value
+    aku_Timestamp max_time;
+    //! Summ of all elements in subtree
+    double sum;
+    //! First value in subtree
+    double first;
+    //! Last value in subtree
+    double last;
+    //! Node version
+    u16 version;
+    //! Fan out index of the element
+    u16 fanout_index;
+    //! Node level in the tree
+    u8 level;
+    //! Node type
+    u8 type;
+} __attribute__((packed));
+
 }} // namespace
@@ -2,7 +2,9 @@
 #include "log_iface.h"
 #include "../tuples.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 namespace Akumuli {
 namespace StorageEngine {
@@ -61,6 +63,109 @@ AggregateOperator::Direction CombineAggregateOperator::get_direction() {
 }
 
 
+std::tuple<aku_Status, size_t> ChainAggregateOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    aku_Status status = AKU_ENO_DATA;
+    size_t ressz = 0;  // current size
+    size_t accsz = 0;  // accumulated size
+    while(iter_index_ < iter_.size()) {
+        std::tie(status, ressz) = iter_[iter_index_]->read(destts, destval, size);
+        destts += ressz;
+        destval += ressz;
+        size -= ressz;
+        accsz += ressz;
+        if (size == 0) {
+            break;
+        }
+        if (status == AKU_ENO_DATA || status == AKU_EUNAVAILABLE) {
+            // This extent is empty or removed, continue with next
+            iter_index_++;
+            continue;
+        }
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, accsz);
+        }
+    }
+    if (accsz != 0 && status == AKU_ENO_DATA) {
+        status = AKU_SUCCESS;
+    }
+    return std::make_tuple(status, accsz);
+}
+
+AggregateOperator::Direction ChainAggregateOperator::get_direction() {
+    return dir_;
+}
+
+
+// Precomputed aggregate operator //
+
+PrecomputedAggregateOperator::PrecomputedAggregateOperator(Direction dir)
+    : status_(AKU_ENO_DATA)
+    , dir_(dir)
+    , pos_(0)
+{
+}
+
+std::unique_ptr<AggregateOperator> PrecomputedAggregateOperator::drain(std::unique_ptr<AggregateOperator>&& source) {
+    const size_t SZBUF = 64;
+    std::unique_ptr<PrecomputedAggregateOperator> result(new PrecomputedAggregateOperator(source->get_direction()));
+    std::vector<AggregationResult> outval(SZBUF, INIT_AGGRES);
+    std::vector<aku_Timestamp> outts(SZBUF, 0);
+    aku_Status status = AKU_SUCCESS;
+    size_t ressz;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, ressz) = source->read(outts.data(), outval.data(), SZBUF);
+        result->ts_.insert(result->ts_.end(), outts.begin(), outts.begin() + ressz);
+        result->xs_.insert(result->xs_.end(), outval.begin(), outval.begin() + ressz);
+    }
+    result->status_ = status;
+    return std::move(result);
+}
+
+std::tuple<aku_Status, size_t> PrecomputedAggregateOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    if (size == 0) {
+        return std::make_tuple(AKU_EBAD_ARG, 0);
+    }
+    if (pos_ == xs_.size()) {
+        return std::make_tuple(status_, 0);
+    }
+    size_t nelements = std::min(size, xs_.size() - pos_);
+    std::copy(ts_.begin() + pos_, ts_.begin() + pos_ + nelements, destts);
+    std::copy(xs_.begin() + pos_, xs_.begin() + pos_ + nelements, destval);
+    pos_ += nelements;
+    return std::make_tuple(AKU_SUCCESS, nelements);
+}
+
+AggregateOperator::Direction PrecomputedAggregateOperator::get_direction() {
+    return dir_;
+}
+
+
+AggregateValueOperator::AggregateValueOperator(std::unique_ptr<AggregateOperator>&& base, AggregationFunction func)
+    : base_(std::move(base))
+    , func_(func)
+{
+}
+
+std::tuple<aku_Status, size_t> AggregateValueOperator::read(aku_Timestamp *destts, double *destval, size_t size) {
+    if (buffer_.size() < size) {
+        buffer_.resize(size);
+    }
+    aku_Status status;
+    size_t ressz;
+    std::tie(status, ressz) = base_->read(destts, buffer_.data(), size);
+    for (size_t i = 0; i < ressz; i++) {
+        destts[i] = buffer_[i]._begin;
+        destval[i] = TupleOutputUtils::get(buffer_[i], func_);
+    }
+    return std::make_tuple(status, ressz);
+}
+
+RealValuedOperator::Direction AggregateValueOperator::get_direction() {
+    return base_->get_direction() == AggregateOperator::Direction::FORWARD ? Direction::FORWARD
+                                                                           : Direction::BACKWARD;
+}
+
+
 // Group aggregate operator //
 
 
@@ -172,8 +277,9 @@ aku_Status CombineGroupAggregateOperator::refill_read_buffer() {
             }
             pos++;
         }
-        if (status == AKU_ENO_DATA) {
-            // This leaf node is empty, continue with next.
+        if (status == AKU_ENO_DATA || (status == AKU_SUCCESS && outsz == 0)) {
+            // This leaf node is empty, continue with next. Nested group-aggregate
+            // operator returns empty result instead of AKU_ENO_DATA.
             iter_index_++;
             continue;
         }
@@ -199,6 +305,453 @@ CombineGroupAggregateOperator::Direction CombineGroupAggregateOperator::get_dire
 }
 
 
+ReduceGroupAggregateOperator::ReduceGroupAggregateOperator(aku_Timestamp begin, u64 step,
+                                                           std::vector<std::unique_ptr<AggregateOperator>>&& iter)
+    : begin_(begin)
+    , step_(step)
+    , dir_(iter.empty() ? Direction::FORWARD : iter.front()->get_direction())
+    , accpos_(0)
+{
+    assert(step_ != 0);
+    for (auto& it: iter) {
+        Input input;
+        input.op = std::move(it);
+        input.rdpos = 0;
+        input.done = false;
+        inputs_.push_back(std::move(input));
+    }
+}
+
+u64 ReduceGroupAggregateOperator::get_bin(AggregationResult const& res) const {
+    return (dir_ == Direction::FORWARD ? res._begin - begin_ : begin_ - res._begin) / step_;
+}
+
+aku_Status ReduceGroupAggregateOperator::refill_read_buffer(Input* input) {
+    while (input->rdpos == input->rdbuf.size() && !input->done) {
+        input->rdts.resize(RDBUF_SIZE);
+        input->rdbuf.resize(RDBUF_SIZE, INIT_AGGRES);
+        input->rdpos = 0;
+        aku_Status status;
+        size_t size;
+        std::tie(status, size) = input->op->read(input->rdts.data(), input->rdbuf.data(), RDBUF_SIZE);
+        input->rdts.resize(size);
+        input->rdbuf.resize(size);
+        if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+            return status;
+        }
+        // Nested group-aggregate operator returns empty result instead of AKU_ENO_DATA
+        input->done = size == 0;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status ReduceGroupAggregateOperator::load_window(bool* found) {
+    // Window starts at the first bucket that is not consumed yet
+    *found = false;
+    u64 first = 0;
+    for (auto& input: inputs_) {
+        aku_Status status = refill_read_buffer(&input);
+        if (status != AKU_SUCCESS) {
+            return status;
+        }
+        if (input.rdpos < input.rdbuf.size()) {
+            auto bin = get_bin(input.rdbuf[input.rdpos]);
+            if (!*found || bin < first) {
+                first = bin;
+                *found = true;
+            }
+        }
+    }
+    if (!*found) {
+        return AKU_SUCCESS;
+    }
+    acc_.reset(WINDOW_SIZE);
+    accpos_ = 0;
+    bool acc_empty = true;
+    for (auto& input: inputs_) {
+        // The first input is written to the accumulator directly
+        AggregationBuckets* target = acc_empty ? &acc_ : &tmp_;
+        bool scattered = false;
+        while (true) {
+            aku_Status status = refill_read_buffer(&input);
+            if (status != AKU_SUCCESS) {
+                return status;
+            }
+            if (input.rdpos == input.rdbuf.size()) {
+                break;
+            }
+            auto const& res = input.rdbuf[input.rdpos];
+            auto bin = get_bin(res);
+            if (bin >= first + WINDOW_SIZE) {
+                break;
+            }
+            if (!scattered && target == &tmp_) {
+                tmp_.reset(WINDOW_SIZE);
+            }
+            scattered = true;
+            auto ix = static_cast<size_t>(bin - first);
+            if (target->cnt[ix] != 0) {
+                auto prev = target->get(ix);
+                prev.combine(res);
+                target->set(ix, prev);
+            } else {
+                target->set(ix, res);
+            }
+            input.rdpos++;
+        }
+        if (scattered) {
+            if (acc_empty) {
+                acc_empty = false;
+            } else {
+                acc_.combine(tmp_);
+            }
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+std::tuple<aku_Status, size_t> ReduceGroupAggregateOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    if (size == 0) {
+        return std::make_tuple(AKU_EBAD_ARG, 0);
+    }
+    size_t outsz = 0;
+    while (outsz < size) {
+        if (accpos_ == acc_.size()) {
+            bool found;
+            aku_Status status = load_window(&found);
+            if (status != AKU_SUCCESS) {
+                return std::make_tuple(status, outsz);
+            }
+            if (!found) {
+                break;
+            }
+        }
+        if (acc_.cnt[accpos_] != 0) {
+            auto res = acc_.get(accpos_);
+            destts[outsz] = res._begin;
+            destval[outsz] = res;
+            outsz++;
+        }
+        accpos_++;
+    }
+    return std::make_tuple(outsz == 0 ? AKU_ENO_DATA : AKU_SUCCESS, outsz);
+}
+
+ReduceGroupAggregateOperator::Direction ReduceGroupAggregateOperator::get_direction() {
+    return dir_;
+}
+
+
+ValueRangeOperator::ValueRangeOperator(std::unique_ptr<AggregateOperator>&& source)
+    : source_(std::move(source))
+    , dir_(source_->get_direction())
+    , rdpos_(0)
+    , source_done_(false)
+    , acc_(INIT_AGGRES)
+{
+}
+
+aku_Status ValueRangeOperator::refill_read_buffer() {
+    while (rdpos_ == rdbuf_.size() && !source_done_) {
+        rdts_.resize(RDBUF_SIZE);
+        rdbuf_.resize(RDBUF_SIZE, INIT_AGGRES);
+        rdpos_ = 0;
+        aku_Status status;
+        size_t size;
+        std::tie(status, size) = source_->read(rdts_.data(), rdbuf_.data(), RDBUF_SIZE);
+        rdts_.resize(size);
+        rdbuf_.resize(size);
+        if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+            return status;
+        }
+        source_done_ = status == AKU_ENO_DATA || size == 0;
+    }
+    return AKU_SUCCESS;
+}
+
+std::tuple<aku_Status, size_t> ValueRangeOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    if (size == 0) {
+        return std::make_tuple(AKU_EBAD_ARG, 0);
+    }
+    size_t outsz = 0;
+    while (outsz < size) {
+        aku_Status status = refill_read_buffer();
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, outsz);
+        }
+        bool done = rdpos_ == rdbuf_.size();
+        if (done || rdbuf_[rdpos_].cnt == 0) {
+            // End of the range
+            if (acc_.cnt != 0) {
+                destts[outsz] = acc_._begin;
+                destval[outsz] = acc_;
+                outsz++;
+                acc_ = INIT_AGGRES;
+            }
+            if (done) {
+                break;
+            }
+        } else {
+            acc_.combine(rdbuf_[rdpos_]);
+        }
+        rdpos_++;
+    }
+    return std::make_tuple(outsz == 0 ? AKU_ENO_DATA : AKU_SUCCESS, outsz);
+}
+
+ValueRangeOperator::Direction ValueRangeOperator::get_direction() {
+    return dir_;
+}
+
+
+GapFillOperator::GapFillOperator(std::unique_ptr<AggregateOperator>&& source, aku_Timestamp begin, aku_Timestamp end,
+                                 u64 step, FillMode mode)
+    : source_(std::move(source))
+    , begin_(begin)
+    , step_(step)
+    , mode_(mode)
+    , forward_(begin < end)
+    , nbins_(((begin < end ? end - begin : begin - end) + step - 1) / step)
+    , bin_(0)
+    , rdpos_(0)
+    , source_done_(false)
+    , has_prev_(false)
+    , prev_bin_(0)
+    , prev_(INIT_AGGRES)
+{
+    assert(step_ != 0);
+}
+
+u64 GapFillOperator::get_bin(AggregationResult const& res) const {
+    return (forward_ ? res._begin - begin_ : begin_ - res._begin) / step_;
+}
+
+aku_Status GapFillOperator::refill_read_buffer() {
+    while (rdpos_ == rdbuf_.size() && !source_done_) {
+        rdts_.resize(RDBUF_SIZE);
+        rdbuf_.resize(RDBUF_SIZE, INIT_AGGRES);
+        rdpos_ = 0;
+        aku_Status status;
+        size_t size;
+        std::tie(status, size) = source_->read(rdts_.data(), rdbuf_.data(), RDBUF_SIZE);
+        rdts_.resize(size);
+        rdbuf_.resize(size);
+        if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+            return status;
+        }
+        // Nested group-aggregate operator returns empty result instead of AKU_ENO_DATA
+        source_done_ = size == 0;
+    }
+    return AKU_SUCCESS;
+}
+
+static AggregationResult interpolate(AggregationResult const& a, AggregationResult const& b, double frac) {
+    auto lerp = [frac](double x, double y) {
+        return x + (y - x)*frac;
+    };
+    auto lerpts = [frac](aku_Timestamp x, aku_Timestamp y) {
+        return static_cast<aku_Timestamp>(static_cast<double>(x) + (static_cast<double>(y) - static_cast<double>(x))*frac);
+    };
+    AggregationResult res = a;
+    res.cnt   = lerp(a.cnt, b.cnt);
+    res.sum   = lerp(a.sum, b.sum);
+    res.min   = lerp(a.min, b.min);
+    res.max   = lerp(a.max, b.max);
+    res.first = lerp(a.first, b.first);
+    res.last  = lerp(a.last, b.last);
+    res.mints = lerpts(a.mints, b.mints);
+    res.maxts = lerpts(a.maxts, b.maxts);
+    return res;
+}
+
+std::tuple<aku_Status, size_t> GapFillOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    size_t outsz = 0;
+    while (outsz < size && bin_ < nbins_) {
+        aku_Status status = refill_read_buffer();
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, outsz);
+        }
+        bool has_next = rdpos_ < rdbuf_.size();
+        u64 next_bin = has_next ? get_bin(rdbuf_[rdpos_]) : 0;
+        if (has_next && next_bin < bin_) {
+            // Can't be returned (outside of the range)
+            rdpos_++;
+            continue;
+        }
+        aku_Timestamp ts = forward_ ? begin_ + bin_*step_ : begin_ - bin_*step_;
+        AggregationResult res = INIT_AGGRES;
+        if (has_next && next_bin == bin_) {
+            res = rdbuf_[rdpos_++];
+            prev_ = res;
+            prev_bin_ = bin_;
+            has_prev_ = true;
+        } else if (mode_ == FillMode::PREVIOUS && has_prev_) {
+            res = prev_;
+        } else if (mode_ == FillMode::LINEAR && has_prev_ && has_next) {
+            double frac = static_cast<double>(bin_ - prev_bin_) / static_cast<double>(next_bin - prev_bin_);
+            res = interpolate(prev_, rdbuf_[rdpos_], frac);
+        } else {
+            res.cnt = 0;
+        }
+        res._begin = ts;
+        res._end = ts;
+        destts[outsz] = ts;
+        destval[outsz] = res;
+        outsz++;
+        bin_++;
+    }
+    return std::make_tuple(bin_ == nbins_ ? AKU_ENO_DATA : AKU_SUCCESS, outsz);
+}
+
+GapFillOperator::Direction GapFillOperator::get_direction() {
+    return forward_ ? Direction::FORWARD : Direction::BACKWARD;
+}
+
+
+std::tuple<aku_Timestamp, aku_Timestamp> HoppingWindowOperator::get_scan_range(aku_Timestamp begin, aku_Timestamp end,
+                                                                               u64 step, u64 window)
+{
+    // Older buckets of the first window, extension should be a multiple of the step
+    aku_Timestamp ext = window - step;
+    if (begin < end) {
+        ext = std::min(ext, (begin / step) * step);
+        return std::make_tuple(begin - ext, end);
+    }
+    ext = std::min(ext, (end / step) * step);
+    return std::make_tuple(begin, end - ext);
+}
+
+HoppingWindowOperator::HoppingWindowOperator(std::unique_ptr<AggregateOperator>&& source, aku_Timestamp begin,
+                                             aku_Timestamp end, u64 step, u64 window)
+    : source_(std::move(source))
+    , step_(step)
+    , forward_(begin < end)
+    , width_(window / step)
+    , scan_begin_(begin)
+    , skip_(0)
+    , nbins_(0)
+    , head_(0)
+    , back_acc_(INIT_AGGRES)
+    , rdpos_(0)
+    , source_done_(false)
+{
+    assert(step_ != 0 && width_ != 0);
+    aku_Timestamp scan_end;
+    std::tie(scan_begin_, scan_end) = get_scan_range(begin, end, step, window);
+    u64 nbins = ((begin < end ? end - begin : begin - end) + step - 1) / step;
+    if (forward_) {
+        // Window of the bucket ends with the bucket, buckets before `begin` are not returned
+        skip_ = (begin - scan_begin_) / step_;
+        nbins_ = skip_ + nbins;
+    } else {
+        // Window of the bucket ends with the bucket that is read last
+        skip_ = width_ - 1;
+        nbins_ = skip_ + nbins;
+    }
+}
+
+u64 HoppingWindowOperator::get_bin(AggregationResult const& res) const {
+    return (forward_ ? res._begin - scan_begin_ : scan_begin_ - res._begin) / step_;
+}
+
+aku_Status HoppingWindowOperator::refill_read_buffer() {
+    while (rdpos_ == rdbuf_.size() && !source_done_) {
+        rdts_.resize(RDBUF_SIZE);
+        rdbuf_.resize(RDBUF_SIZE, INIT_AGGRES);
+        rdpos_ = 0;
+        aku_Status status;
+        size_t size;
+        std::tie(status, size) = source_->read(rdts_.data(), rdbuf_.data(), RDBUF_SIZE);
+        rdts_.resize(size);
+        rdbuf_.resize(size);
+        if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+            return status;
+        }
+        // Nested group-aggregate operator returns empty result instead of AKU_ENO_DATA
+        source_done_ = size == 0;
+    }
+    return AKU_SUCCESS;
+}
+
+void HoppingWindowOperator::pop() {
+    if (front_.empty()) {
+        // Move newer buckets to the front stack, the oldest one goes last
+        AggregationResult acc = INIT_AGGRES;
+        for (auto it = back_.rbegin(); it != back_.rend(); it++) {
+            acc.combine(it->second);
+            front_.push_back(std::make_pair(it->first, acc));
+        }
+        back_.clear();
+        back_acc_ = INIT_AGGRES;
+    }
+    front_.pop_back();
+}
+
+std::tuple<aku_Status, size_t> HoppingWindowOperator::read(aku_Timestamp *destts, AggregationResult *destval, size_t size) {
+    size_t outsz = 0;
+    while (outsz < size && head_ < nbins_) {
+        aku_Status status = refill_read_buffer();
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, outsz);
+        }
+        bool has_next = rdpos_ < rdbuf_.size();
+        bool empty = front_.empty() && back_.empty();
+        if (!has_next && empty) {
+            // All windows that contain data are returned
+            head_ = nbins_;
+            break;
+        }
+        if (has_next) {
+            auto const& next = rdbuf_[rdpos_];
+            bool inside = forward_ ? next._begin >= scan_begin_ : next._begin <= scan_begin_;
+            u64 next_bin = inside ? get_bin(next) : 0;
+            if (!inside || next_bin < head_) {
+                // Can't be returned (outside of the range)
+                rdpos_++;
+                continue;
+            }
+            if (empty && next_bin > head_) {
+                // Windows without data are skipped
+                head_ = next_bin;
+            }
+            if (next_bin == head_) {
+                back_acc_.combine(next);
+                back_.push_back(std::make_pair(next_bin, next));
+                rdpos_++;
+                continue;
+            }
+        }
+        // Window that ends with the `head_` bucket is complete
+        while (!(front_.empty() && back_.empty())) {
+            u64 oldest = front_.empty() ? back_.front().first : front_.back().first;
+            if (oldest + width_ > head_) {
+                break;
+            }
+            pop();
+        }
+        if (head_ >= skip_ && !(front_.empty() && back_.empty())) {
+            AggregationResult res = back_acc_;
+            if (!front_.empty()) {
+                res.combine(front_.back().second);
+            }
+            aku_Timestamp ts = forward_ ? scan_begin_ + head_*step_
+                                        : scan_begin_ - (head_ - skip_)*step_;
+            res._begin = ts;
+            res._end = ts;
+            destts[outsz] = ts;
+            destval[outsz] = res;
+            outsz++;
+        }
+        head_++;
+    }
+    return std::make_tuple(head_ == nbins_ ? AKU_ENO_DATA : AKU_SUCCESS, outsz);
+}
+
+HoppingWindowOperator::Direction HoppingWindowOperator::get_direction() {
+    return forward_ ? Direction::FORWARD : Direction::BACKWARD;
+}
+
+
 AggregateMaterializer::AggregateMaterializer(std::vector<aku_ParamId>&& ids, std::vector<std::unique_ptr<AggregateOperator>>&& it, AggregationFunction func)
     : iters_(std::move(it))
     , ids_(std::move(ids))
@@ -258,6 +811,29 @@ std::tuple<aku_Status, size_t> AggregateMaterializer::read(u8* dest, size_t size
             sample.timestamp = destval._end;
             sample.payload.float64 = destval.sum/destval.cnt;
         break;
+        case AggregationFunction::FIRST:
+            sample.timestamp = destval._begin;
+            sample.payload.float64 = destval.first;
+        break;
+        case AggregationFunction::LAST:
+            sample.timestamp = destval._end;
+            sample.payload.float64 = destval.last;
+        break;
+        case AggregationFunction::FIRST_TIMESTAMP:
+            sample.timestamp = destval._begin;
+            sample.payload.float64 = destval._begin;
+        break;
+        case AggregationFunction::LAST_TIMESTAMP:
+            sample.timestamp = destval._end;
+            sample.payload.float64 = destval._end;
+        break;
+        case AggregationFunction::P50:
+        case AggregationFunction::P90:
+        case AggregationFunction::P95:
+        case AggregationFunction::P99:
+        case AggregationFunction::P999:
+            // Query plan uses QuantileAggregateMaterializer for quantiles
+            AKU_PANIC("Quantile can't be computed from the aggregate");
         }
         memcpy(dest, &sample, sizeof(sample));
         // move to next
@@ -316,20 +892,145 @@ std::tuple<aku_Status, size_t> SeriesOrderAggregateMaterializer::read(u8 *dest,
         }
     }
     // Convert vectors to series of samples
+    size_t outsz = 0;
     for (size_t i = 0; i < accsz; i++) {
         double* tup;
         aku_Sample* sample;
         std::tie(sample, tup)   = cast(dest);
-        dest                   += sample_size;
         sample->payload.type    = AKU_PAYLOAD_TUPLE|aku_PData::REGULLAR;
-        sample->payload.size    = static_cast<u16>(sample_size);
         sample->paramid         = outids[i];
         sample->timestamp       = destts_vec[i];
-        sample->payload.float64 = get_flags(tuple_);
-        set_tuple(tup, tuple_, destval_vec[i]);
+        if (destval_vec[i].cnt == 0) {
+            // Empty bucket, all tuple elements are missing
+            sample->payload.size    = sizeof(aku_Sample);
+            sample->payload.float64 = make_header(static_cast<u32>(tuple_.size()), 0);
+        } else {
+            sample->payload.size    = static_cast<u16>(sample_size);
+            sample->payload.float64 = get_flags(tuple_);
+            set_tuple(tup, tuple_, destval_vec[i]);
+        }
+        dest  += sample->payload.size;
+        outsz += sample->payload.size;
+    }
+    return std::make_tuple(status, outsz);
+
+}
+
+
+QuantileAggregateMaterializer::QuantileAggregateMaterializer(std::vector<aku_ParamId>&& ids,
+                                                             std::vector<Group>&& groups,
+                                                             const std::vector<AggregationFunction>& func,
+                                                             aku_Timestamp begin,
+                                                             aku_Timestamp end,
+                                                             u64 step)
+    : ids_(std::move(ids))
+    , groups_(std::move(groups))
+    , func_(func)
+    , begin_(begin)
+    , step_(step)
+    , forward_(begin < end)
+    , pos_(0)
+    , readypos_(0)
+{
+    assert(ids_.size() == groups_.size());
+    assert(step_ != 0 || func_.size() == 1);
+}
+
+aku_Status QuantileAggregateMaterializer::compute(Group& group, aku_ParamId id) {
+    const size_t SZBUF = 0x1000;
+    std::vector<aku_Timestamp> tss(SZBUF, 0);
+    std::vector<double> xss(SZBUF, 0);
+    // Bucket index is a distance from the beginning of the range so buckets are
+    // ordered according to the query direction
+    std::map<u64, Bucket> buckets;
+    for (auto& op: group) {
+        // Every series is aggregated separately, aggregates are combined
+        // afterwards (values of different series are not ordered)
+        std::map<u64, AggregationResult> part;
+        aku_Status status = AKU_SUCCESS;
+        while (status == AKU_SUCCESS) {
+            size_t size;
+            std::tie(status, size) = op->read(tss.data(), xss.data(), SZBUF);
+            if (status != AKU_SUCCESS && status != AKU_ENO_DATA && status != AKU_EUNAVAILABLE) {
+                return status;
+            }
+            for (size_t i = 0; i < size; i++) {
+                u64 bin = 0;
+                if (step_) {
+                    bin = (forward_ ? tss[i] - begin_ : begin_ - tss[i]) / step_;
+                }
+                auto it = part.find(bin);
+                if (it == part.end()) {
+                    it = part.insert(std::make_pair(bin, INIT_AGGRES)).first;
+                    buckets.insert(std::make_pair(bin, Bucket{ INIT_AGGRES, QuantileSketch() }));
+                }
+                it->second.add(tss[i], xss[i], forward_);
+                buckets[bin].sketch.add(xss[i]);
+            }
+            if (size == 0 && status == AKU_SUCCESS) {
+                break;
+            }
+        }
+        for (auto const& kv: part) {
+            buckets[kv.first].agg.combine(kv.second);
+        }
     }
-    return std::make_tuple(status, accsz*sample_size);
+    // Convert buckets to samples
+    size_t sample_size = step_ ? get_tuple_size(func_) : sizeof(aku_Sample);
+    ready_.resize(buckets.size() * sample_size);
+    readypos_ = 0;
+    u8* dest = ready_.data();
+    for (auto const& kv: buckets) {
+        auto const& bucket = kv.second;
+        double* tup;
+        aku_Sample* sample;
+        std::tie(sample, tup) = cast(dest);
+        dest += sample_size;
+        sample->paramid = id;
+        sample->payload.size = static_cast<u16>(sample_size);
+        if (step_) {
+            sample->payload.type    = AKU_PAYLOAD_TUPLE|aku_PData::REGULLAR;
+            sample->timestamp       = bucket.agg._begin;
+            sample->payload.float64 = get_flags(func_);
+            for (auto fn: func_) {
+                *tup++ = is_quantile(fn) ? bucket.sketch.quantile(get_quantile(fn)) : get(bucket.agg, fn);
+            }
+        } else {
+            auto fn = func_.front();
+            sample->payload.type    = AKU_PAYLOAD_FLOAT;
+            sample->timestamp       = bucket.agg._end;
+            sample->payload.float64 = is_quantile(fn) ? bucket.sketch.quantile(get_quantile(fn)) : get(bucket.agg, fn);
+        }
+    }
+    return AKU_SUCCESS;
+}
 
+std::tuple<aku_Status, size_t> QuantileAggregateMaterializer::read(u8 *dest, size_t size) {
+    size_t accsz = 0;
+    while (true) {
+        if (readypos_ < ready_.size()) {
+            // All samples of the group have the same size
+            auto sample_size = reinterpret_cast<aku_Sample const*>(ready_.data())->payload.size;
+            size_t n = std::min(ready_.size() - readypos_, (size - accsz) / sample_size * sample_size);
+            if (n == 0) {
+                break;
+            }
+            memcpy(dest + accsz, ready_.data() + readypos_, n);
+            readypos_ += n;
+            accsz += n;
+            continue;
+        }
+        if (pos_ == groups_.size()) {
+            return std::make_tuple(AKU_ENO_DATA, accsz);
+        }
+        auto status = compute(groups_[pos_], ids_[pos_]);
+        groups_[pos_].clear();
+        pos_++;
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, accsz);
+        }
+    }
+    return std::make_tuple(AKU_SUCCESS, accsz);
 }
 
 }}
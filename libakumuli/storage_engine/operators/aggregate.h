@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <map>
 
 #include "operator.h"
 #include "merge.h"
@@ -40,6 +41,34 @@ struct CombineAggregateOperator : AggregateOperator {
 };
 
 
+/** Concatenating aggregate iterator.
+  * Output of all iterators is returned as is (e.g. candlesticks produced
+  * by different extents). Iterators should be in correct order.
+  */
+struct ChainAggregateOperator : AggregateOperator {
+    typedef std::vector<std::unique_ptr<AggregateOperator>> IterVec;
+    IterVec             iter_;
+    Direction           dir_;
+    u32                 iter_index_;
+
+    //! C-tor. Create iterator from list of iterators.
+    template<class TVec>
+    ChainAggregateOperator(TVec&& iter)
+        : iter_(std::forward<TVec>(iter))
+        , iter_index_(0)
+    {
+        if (iter_.empty()) {
+            dir_ = Direction::FORWARD;
+        } else {
+            dir_ = iter_.front()->get_direction();
+        }
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
 /** Aggregating operator (group-by + aggregate).
   */
 struct CombineGroupAggregateOperator : AggregateOperator {
@@ -109,6 +138,232 @@ struct CombineGroupAggregateOperator : AggregateOperator {
 };
 
 
+/** Cross-series group-aggregate operator (group-by tag reduce).
+  * Combines group-aggregate operators of different series bucket by bucket,
+  * output contains one aggregate per bucket as if all values belonged to the
+  * same series. All operators should have the same range, step and direction.
+  * Buckets are combined window by window, every input is scattered into the
+  * window and the windows are combined in bulk (see AggregationBuckets).
+  */
+struct ReduceGroupAggregateOperator : AggregateOperator {
+    struct Input {
+        std::unique_ptr<AggregateOperator> op;
+        std::vector<aku_Timestamp>         rdts;
+        std::vector<AggregationResult>     rdbuf;
+        size_t                             rdpos;
+        bool                               done;
+    };
+    const aku_Timestamp begin_;
+    const u64           step_;
+    Direction           dir_;
+    std::vector<Input>  inputs_;
+    //! Combined buckets of the current window
+    AggregationBuckets  acc_;
+    //! Buckets of the single input
+    AggregationBuckets  tmp_;
+    //! Next bucket of the window to return
+    size_t              accpos_;
+
+    enum {
+        RDBUF_SIZE = 0x100,
+        WINDOW_SIZE = 0x400,
+    };
+
+    ReduceGroupAggregateOperator(aku_Timestamp begin, u64 step, std::vector<std::unique_ptr<AggregateOperator>>&& iter);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+
+private:
+    //! Make sure that the read buffer of the input is not empty (unless the input is consumed)
+    aku_Status refill_read_buffer(Input* input);
+    //! Bucket index of the aggregate
+    u64 get_bin(AggregationResult const& res) const;
+    //! Combine the next window of buckets, `found` is set to false if all inputs are consumed
+    aku_Status load_window(bool* found);
+};
+
+
+/** Value range operator (where-value query).
+  * Input consists of runs (aggregates of consecutive values that match the
+  * value filter) and separators (aggregates with zero count that mark values
+  * or subtrees that don't match). Runs that are not separated are joined, every
+  * output element describes one time range in which all values match the filter.
+  */
+struct ValueRangeOperator : AggregateOperator {
+    std::unique_ptr<AggregateOperator> source_;
+    Direction                          dir_;
+    std::vector<aku_Timestamp>         rdts_;
+    std::vector<AggregationResult>     rdbuf_;
+    size_t                             rdpos_;
+    bool                               source_done_;
+    //! Range that is not complete yet
+    AggregationResult                  acc_;
+
+    enum {
+        RDBUF_SIZE = 0x100,
+    };
+
+    ValueRangeOperator(std::unique_ptr<AggregateOperator>&& source);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+
+private:
+    //! Make sure that the read buffer is not empty (unless the source is consumed)
+    aku_Status refill_read_buffer();
+};
+
+
+/** Gap filling group-aggregate operator.
+  * Returns one element for every bucket of the range. Timestamps are aligned
+  * to bucket boundaries (begin + k*step, or begin - k*step if the range is
+  * backward). Buckets without data are filled according to the fill mode,
+  * empty bucket is returned as an aggregate with zero count (it can't be
+  * produced otherwise). Leading and trailing buckets that can't be
+  * interpolated are empty.
+  */
+struct GapFillOperator : AggregateOperator {
+    std::unique_ptr<AggregateOperator> source_;
+    const aku_Timestamp                begin_;
+    const u64                          step_;
+    const FillMode                     mode_;
+    const bool                         forward_;
+    //! Total number of buckets
+    const u64                          nbins_;
+    //! Next bucket to return
+    u64                                bin_;
+    //! Elements read from the source
+    std::vector<aku_Timestamp>         rdts_;
+    std::vector<AggregationResult>     rdbuf_;
+    size_t                             rdpos_;
+    bool                               source_done_;
+    //! Last non-empty bucket
+    bool                               has_prev_;
+    u64                                prev_bin_;
+    AggregationResult                  prev_;
+
+    enum {
+        RDBUF_SIZE = 0x100,
+    };
+
+    GapFillOperator(std::unique_ptr<AggregateOperator>&& source, aku_Timestamp begin, aku_Timestamp end,
+                    u64 step, FillMode mode);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+
+private:
+    //! Make sure that the read buffer is not empty (unless the source is consumed)
+    aku_Status refill_read_buffer();
+    //! Bucket index of the aggregate
+    u64 get_bin(AggregationResult const& res) const;
+};
+
+
+/** Hopping window group-aggregate operator.
+  * Source is a group-aggregate operator with `step` sized buckets, every
+  * returned bucket is an aggregate of `window/step` adjacent source buckets:
+  * the bucket itself and the preceding (older) ones. Timestamps are the same
+  * as the source timestamps so the output looks like a group-aggregate with
+  * the step but every bucket covers the whole window. Source should be
+  * created for the range returned by `get_scan_range`, it starts earlier so
+  * the first windows are complete.
+  * Windows are maintained using the two-stack queue: every source bucket is
+  * combined twice on average regardless of the window width.
+  */
+struct HoppingWindowOperator : AggregateOperator {
+    typedef std::pair<u64, AggregationResult> Item;
+
+    std::unique_ptr<AggregateOperator> source_;
+    const u64                          step_;
+    const bool                         forward_;
+    //! Number of source buckets in the window
+    const u64                          width_;
+    //! Begin of the source range
+    aku_Timestamp                      scan_begin_;
+    //! Index of the first bucket that should be returned
+    u64                                skip_;
+    //! Number of buckets to process
+    u64                                nbins_;
+    //! Index of the last source bucket of the next window
+    u64                                head_;
+    //! Newer buckets, `back_acc_` is their aggregate
+    std::vector<Item>                  back_;
+    AggregationResult                  back_acc_;
+    //! Older buckets (the oldest one is the last), each element contains
+    //! an aggregate of itself and the newer elements of the stack
+    std::vector<Item>                  front_;
+    //! Elements read from the source
+    std::vector<aku_Timestamp>         rdts_;
+    std::vector<AggregationResult>     rdbuf_;
+    size_t                             rdpos_;
+    bool                               source_done_;
+
+    enum {
+        RDBUF_SIZE = 0x100,
+    };
+
+    HoppingWindowOperator(std::unique_ptr<AggregateOperator>&& source, aku_Timestamp begin, aku_Timestamp end,
+                          u64 step, u64 window);
+
+    /** Range that should be used to create the source operator.
+      * @return begin and end of the range
+      */
+    static std::tuple<aku_Timestamp, aku_Timestamp> get_scan_range(aku_Timestamp begin, aku_Timestamp end,
+                                                                   u64 step, u64 window);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+
+private:
+    //! Make sure that the read buffer is not empty (unless the source is consumed)
+    aku_Status refill_read_buffer();
+    //! Bucket index of the aggregate
+    u64 get_bin(AggregationResult const& res) const;
+    //! Remove the oldest bucket from the window
+    void pop();
+};
+
+
+/** Aggregate operator that replays precomputed results.
+  * Source operator is drained eagerly by the `drain` method (possibly
+  * in another thread) and the results are returned by the `read`
+  * method in the same order.
+  */
+struct PrecomputedAggregateOperator : AggregateOperator {
+    std::vector<aku_Timestamp>     ts_;
+    std::vector<AggregationResult> xs_;
+    //! Final status of the source operator
+    aku_Status                     status_;
+    Direction                      dir_;
+    size_t                         pos_;
+
+    PrecomputedAggregateOperator(Direction dir);
+
+    //! Read all data from the source operator
+    static std::unique_ptr<AggregateOperator> drain(std::unique_ptr<AggregateOperator>&& source);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, AggregationResult *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
+/** Returns single aggregation function of every bucket produced by the
+  * aggregate operator. Bucket timestamp is used as a value timestamp.
+  */
+struct AggregateValueOperator : RealValuedOperator {
+    std::unique_ptr<AggregateOperator> base_;
+    const AggregationFunction          func_;
+    std::vector<AggregationResult>     buffer_;
+
+    AggregateValueOperator(std::unique_ptr<AggregateOperator>&& base, AggregationFunction func);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, double *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
 /**
  * Performs materialization for aggregate queries
  */
@@ -129,6 +384,11 @@ public:
     std::tuple<aku_Status, size_t> read(u8* dest, size_t size);
 };
 
+/**
+ * Materializes group-aggregate results series by series. Aggregates with
+ * zero count (empty buckets produced by the GapFillOperator) are returned as
+ * tuples without values.
+ */
 struct SeriesOrderAggregateMaterializer : TupleOutputUtils, ColumnMaterializer {
     std::vector<std::unique_ptr<AggregateOperator>> iters_;
     std::vector<aku_ParamId> ids_;
@@ -149,13 +409,67 @@ struct SeriesOrderAggregateMaterializer : TupleOutputUtils, ColumnMaterializer {
 };
 
 
+/**
+ * Computes aggregates (including quantiles) from raw values.
+ * Every output series is computed from the group of operators. Values of all
+ * operators of the group are combined into time buckets of the `step` width,
+ * every bucket is written as a tuple. If `step` is 0 the whole range is one
+ * bucket and the result is a scalar (only one function is allowed).
+ */
+struct QuantileAggregateMaterializer : TupleOutputUtils, ColumnMaterializer {
+    struct Bucket {
+        AggregationResult agg;
+        QuantileSketch    sketch;
+    };
+    typedef std::vector<std::unique_ptr<RealValuedOperator>> Group;
+
+    std::vector<aku_ParamId> ids_;
+    std::vector<Group> groups_;
+    std::vector<AggregationFunction> func_;
+    aku_Timestamp begin_;
+    u64 step_;
+    bool forward_;
+    //! Next group
+    size_t pos_;
+    //! Samples of the current group that wasn't returned yet
+    std::vector<u8> ready_;
+    size_t readypos_;
+
+    QuantileAggregateMaterializer(std::vector<aku_ParamId>&& ids,
+                                  std::vector<Group>&& groups,
+                                  const std::vector<AggregationFunction>& func,
+                                  aku_Timestamp begin,
+                                  aku_Timestamp end,
+                                  u64 step);
+
+    //! Compute next group
+    aku_Status compute(Group& group, aku_ParamId id);
+
+    virtual std::tuple<aku_Status, size_t> read(u8 *dest, size_t size) override;
+};
+
+
+/**
+ * Materializes group-aggregate results in time order. If the gap filling is
+ * enabled every series has a value (possibly empty) in every bucket and the
+ * output is a dense time-aligned resample of all series.
+ */
 struct TimeOrderAggregateMaterializer : TupleOutputUtils, ColumnMaterializer {
     typedef MergeJoinMaterializer<MergeJoinUtil::OrderByTimestamp> Materializer;
     std::unique_ptr<Materializer> join_iter_;
 
+    //! Gap filling parameters
+    struct Fill {
+        FillMode      mode;
+        aku_Timestamp begin;
+        aku_Timestamp end;
+        u64           step;
+    };
+
     TimeOrderAggregateMaterializer(const std::vector<aku_ParamId>& ids,
                       std::vector<std::unique_ptr<AggregateOperator>> &it,
-                      const std::vector<AggregationFunction>& components)
+                      const std::vector<AggregationFunction>& components,
+                      Fill const& fill = Fill{ FillMode::NONE, 0, 0, 0 })
     {
         assert(it.size());
         bool forward = it.front()->get_direction() == AggregateOperator::Direction::FORWARD;
@@ -163,6 +477,9 @@ struct TimeOrderAggregateMaterializer : TupleOutputUtils, ColumnMaterializer {
         for (size_t i = 0; i < ids.size(); i++) {
             std::unique_ptr<ColumnMaterializer> iter;
             auto agg = std::move(it.at(i));
+            if (fill.mode != FillMode::NONE) {
+                agg.reset(new GapFillOperator(std::move(agg), fill.begin, fill.end, fill.step, fill.mode));
+            }
             std::vector<std::unique_ptr<AggregateOperator>> agglist;
             agglist.push_back(std::move(agg));
             auto ptr = new SeriesOrderAggregateMaterializer({ ids[i] }, std::move(agglist), components);
@@ -0,0 +1,297 @@
+#pragma once
+
+/**
+  * @file arena.h contains monotonic arena used by the query execution.
+  * Query creates a lot of small objects (operators for every series and every
+  * NBTree node that gets read). These objects are placed into the arena attached
+  * to the thread that executes the query and the memory is released in one shot
+  * when the query completes.
+  */
+
+#include "akumuli_def.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+//! Default size limit of the arena, objects are allocated on the heap when the limit is reached
+enum { AKU_QUERY_ARENA_LIMIT = 64*1024*1024 };
+
+//! Default memory budget of the query (see QueryMemoryReservation)
+enum { AKU_QUERY_MEMORY_LIMIT = 1024*1024*1024 };
+
+/** Monotonic arena. Object's memory is not reused after the object is deleted,
+  * the arena only counts live objects. Arena is destroyed when its scope is
+  * closed and the last object allocated from it is deleted, so the objects can
+  * outlive the scope safely (and can be deleted by other threads).
+  */
+class QueryArena {
+    enum {
+        CHUNK_SIZE = 0x10000,
+        //! Larger objects are allocated on the heap
+        MAX_OBJECT_SIZE = CHUNK_SIZE / 4,
+        ALIGNMENT = alignof(std::max_align_t),
+    };
+
+    std::vector<void*> chunks_;
+    u8*                pos_;
+    u8*                end_;
+    size_t             size_;
+    const size_t       limit_;
+    //! Number of live objects + 1 for the scope
+    std::atomic<size_t> refcnt_;
+    //! Memory budget of the query
+    const size_t       budget_;
+    //! Memory reserved by the operators (can be updated by any thread)
+    std::atomic<size_t> reserved_;
+
+    QueryArena(size_t limit, size_t budget)
+        : pos_(nullptr)
+        , end_(nullptr)
+        , size_(0)
+        , limit_(limit)
+        , refcnt_(1)
+        , budget_(budget)
+        , reserved_(0)
+    {
+    }
+
+    ~QueryArena() {
+        for (auto chunk: chunks_) {
+            free(chunk);
+        }
+    }
+
+    static QueryArena*& current() {
+        static thread_local QueryArena* arena = nullptr;
+        return arena;
+    }
+
+    /** Allocate memory (not thread safe, only the thread that owns the scope can allocate).
+      * @return nullptr if the object is too large or the limit is reached
+      */
+    void* allocate(size_t size) {
+        size = (size + ALIGNMENT - 1) & ~static_cast<size_t>(ALIGNMENT - 1);
+        if (size > MAX_OBJECT_SIZE) {
+            return nullptr;
+        }
+        if (pos_ == nullptr || static_cast<size_t>(end_ - pos_) < size) {
+            if (size_ + CHUNK_SIZE > limit_) {
+                return nullptr;
+            }
+            void* chunk = malloc(CHUNK_SIZE);
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+            chunks_.push_back(chunk);
+            size_ += CHUNK_SIZE;
+            pos_ = static_cast<u8*>(chunk);
+            end_ = pos_ + CHUNK_SIZE;
+        }
+        void* result = pos_;
+        pos_ += size;
+        refcnt_.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    void release() {
+        if (refcnt_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    void retain() {
+        refcnt_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    friend struct QueryArenaObject;
+    friend class QueryMemoryReservation;
+
+public:
+    QueryArena(QueryArena const&) = delete;
+    QueryArena& operator = (QueryArena const&) = delete;
+
+    //! Get arena attached to the current thread (or nullptr)
+    static QueryArena* get_current() {
+        return current();
+    }
+
+    //! Attach the arena to the current thread and return previous one (used to switch fibers)
+    static QueryArena* swap_current(QueryArena* arena) {
+        auto prev = current();
+        current() = arena;
+        return prev;
+    }
+
+    //! Number of bytes reserved by the arena
+    size_t size() const {
+        return size_;
+    }
+
+    //! Number of bytes reserved from the memory budget
+    size_t get_reserved() const {
+        return reserved_.load(std::memory_order_relaxed);
+    }
+
+    //! Memory budget of the query
+    size_t get_budget() const {
+        return budget_;
+    }
+
+    /** Creates new arena and attaches it to the current thread, previous arena is restored on destruction.
+      * @param limit is a size limit of the arena
+      * @param budget is a memory budget of the query
+      */
+    class Scope {
+        QueryArena* arena_;
+        QueryArena* prev_;
+    public:
+        explicit Scope(size_t limit = AKU_QUERY_ARENA_LIMIT, size_t budget = AKU_QUERY_MEMORY_LIMIT)
+            : arena_(new QueryArena(limit, budget))
+            , prev_(current())
+        {
+            current() = arena_;
+        }
+
+        ~Scope() {
+            current() = prev_;
+            arena_->release();
+        }
+
+        Scope(Scope const&) = delete;
+        Scope& operator = (Scope const&) = delete;
+
+        QueryArena* get() const {
+            return arena_;
+        }
+    };
+};
+
+
+/** Memory reserved from the budget of the query that owns the current arena.
+  * Operators that keep large state outside of the arena (merge buffers, hash
+  * tables) reserve it here and switch to the bounded mode (smaller buffers,
+  * spill to disk or error) when the budget is exhausted. The budget is unlimited
+  * if the thread doesn't have an arena. Reservation keeps the arena alive and
+  * can be used and released by any thread.
+  */
+class QueryMemoryReservation {
+    QueryArena* arena_;
+    size_t      size_;
+public:
+    QueryMemoryReservation()
+        : arena_(QueryArena::get_current())
+        , size_(0)
+    {
+        if (arena_) {
+            arena_->retain();
+        }
+    }
+
+    QueryMemoryReservation(QueryMemoryReservation&& other)
+        : arena_(other.arena_)
+        , size_(other.size_)
+    {
+        other.arena_ = nullptr;
+        other.size_ = 0;
+    }
+
+    ~QueryMemoryReservation() {
+        if (arena_) {
+            shrink(size_);
+            arena_->release();
+        }
+    }
+
+    QueryMemoryReservation(QueryMemoryReservation const&) = delete;
+    QueryMemoryReservation& operator = (QueryMemoryReservation const&) = delete;
+
+    //! Number of bytes that can be reserved
+    size_t available() const {
+        if (arena_ == nullptr) {
+            return ~static_cast<size_t>(0);
+        }
+        auto reserved = arena_->get_reserved();
+        return reserved < arena_->budget_ ? arena_->budget_ - reserved : 0;
+    }
+
+    //! Reserve `size` more bytes, return false if the budget of the query is exhausted
+    bool grow(size_t size) {
+        if (arena_ == nullptr) {
+            size_ += size;
+            return true;
+        }
+        auto reserved = arena_->reserved_.load(std::memory_order_relaxed);
+        do {
+            if (reserved + size > arena_->budget_) {
+                return false;
+            }
+        } while (!arena_->reserved_.compare_exchange_weak(reserved, reserved + size, std::memory_order_relaxed));
+        size_ += size;
+        return true;
+    }
+
+    //! Return `size` bytes to the budget
+    void shrink(size_t size) {
+        size = size < size_ ? size : size_;
+        size_ -= size;
+        if (arena_) {
+            arena_->reserved_.fetch_sub(size, std::memory_order_relaxed);
+        }
+    }
+
+    //! Number of bytes reserved
+    size_t size() const {
+        return size_;
+    }
+};
+
+
+/** Base class of the objects that should be allocated from the current query arena.
+  * Objects are allocated on the heap if the thread doesn't have an arena.
+  */
+struct QueryArenaObject {
+    static void* operator new(size_t size) {
+        void* ptr = nullptr;
+        auto arena = QueryArena::get_current();
+        if (arena) {
+            ptr = arena->allocate(sizeof(Header) + size);
+        }
+        if (ptr == nullptr) {
+            arena = nullptr;
+            ptr = malloc(sizeof(Header) + size);
+            if (ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        auto header = static_cast<Header*>(ptr);
+        header->arena = arena;
+        return header + 1;
+    }
+
+    static void operator delete(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        auto header = static_cast<Header*>(ptr) - 1;
+        if (header->arena) {
+            header->arena->release();
+        } else {
+            free(header);
+        }
+    }
+
+private:
+    //! Stored in front of every object, arena pointer is null if the object is on the heap
+    struct alignas(std::max_align_t) Header {
+        QueryArena* arena;
+    };
+};
+
+}
+}
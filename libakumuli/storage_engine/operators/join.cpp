@@ -1,4 +1,8 @@
 #include "join.h"
+#include "../tuples.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace Akumuli {
 namespace StorageEngine {
@@ -16,92 +20,155 @@ static std::tuple<aku_Sample*, double*> cast(u8* dest) {
 JoinMaterializer::JoinMaterializer(std::vector<aku_ParamId>&& ids,
                                      std::vector<std::unique_ptr<RealValuedOperator>>&& iters,
                                      aku_ParamId id)
-    : orig_ids_(ids)
+    : iters_(std::move(iters))
     , id_(id)
-    , curr_(AKU_MIN_TIMESTAMP)
-    , buffer_size_(0)
-    , buffer_pos_(0)
-    , max_ssize_(static_cast<u32>(sizeof(aku_Sample) + sizeof(double)*ids.size()))
+    , forward_(true)
+    , nwords_(TupleOutputUtils::get_bitmap_words(static_cast<u32>(ids.size())))
+    , max_ssize_(static_cast<u32>(TupleOutputUtils::get_max_tuple_size(static_cast<u32>(ids.size()))))
 {
-    merge_.reset(new MergeMaterializer<MergeJoinOrder, true>(std::move(ids), std::move(iters)));
-    buffer_.resize(0x1000);
+    if (iters_.size() != ids.size() || iters_.size() > AKU_MAX_COLUMNS) {
+        AKU_PANIC("JoinMaterializer - broken invariant");
+    }
+    if (!iters_.empty()) {
+        forward_ = iters_.front()->get_direction() == RealValuedOperator::Direction::FORWARD;
+    }
+    columns_.resize(iters_.size());
+    for (auto& col: columns_) {
+        col.ts.resize(RANGE_SIZE);
+        col.xs.resize(RANGE_SIZE);
+        col.size = 0;
+        col.pos  = 0;
+        col.done = false;
+    }
 }
 
-aku_Status JoinMaterializer::fill_buffer() {
-    // Invariant: buffer_pos_ <= buffer_size_, buffer_size_ <= buffer_.size()
-    assert(buffer_pos_ <= buffer_size_);
-    assert(buffer_size_ <= buffer_.size());
-    auto beg = buffer_.begin();
-    auto mid = buffer_.begin() + buffer_pos_;
-    auto end = buffer_.begin() + buffer_size_;
-    buffer_size_ = static_cast<u32>(end - mid);
-    buffer_pos_  = 0;
-    std::rotate(beg, mid, end);
-
-    size_t bytes_written;
+aku_Status JoinMaterializer::refill(u32 ix) {
+    Column& col = columns_[ix];
+    if (!col.empty() || col.done) {
+        return AKU_SUCCESS;
+    }
     aku_Status status;
-    std::tie(status, bytes_written) = merge_->read(buffer_.data() + buffer_size_, buffer_.size() - buffer_size_);
-    if (status == AKU_SUCCESS || status == AKU_ENO_DATA) {
-        buffer_size_ += static_cast<u32>(bytes_written);
+    size_t outsize;
+    std::tie(status, outsize) = iters_[ix]->read(col.ts.data(), col.xs.data(), RANGE_SIZE);
+    if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+        return status;
     }
-    return status;
+    col.size = static_cast<u32>(outsize);
+    col.pos  = 0;
+    col.done = status == AKU_ENO_DATA || outsize == 0;
+    return AKU_SUCCESS;
 }
 
-std::tuple<aku_Status, size_t> JoinMaterializer::read(u8 *dest, size_t size) {
-    size_t pos = 0;
-    while(pos < (size - max_ssize_)) {
-        aku_Sample* sample;
-        double*     values;
-        std::tie(sample, values) = cast(dest + pos);
-
-        union {
-            double d;
-            u64    u;
-        } ctrl;
+u32 JoinMaterializer::aligned_run(std::vector<u32> const& active, u32 maxrows) const {
+    // Timestamps of the column are compared with the first column by blocks,
+    // memcmp is vectorized so the common case (all columns are aligned) is
+    // checked without per-row branching.
+    const u32 BLOCK = 16;
+    Column const& first = columns_[active.front()];
+    u32 nrows = std::min(maxrows, first.size - first.pos);
+    const aku_Timestamp* lhs = first.ts.data() + first.pos;
+    for (u32 i = 1; i < active.size() && nrows != 0; i++) {
+        Column const& col = columns_[active[i]];
+        nrows = std::min(nrows, col.size - col.pos);
+        const aku_Timestamp* rhs = col.ts.data() + col.pos;
+        u32 k = 0;
+        while (k + BLOCK <= nrows && memcmp(lhs + k, rhs + k, BLOCK*sizeof(aku_Timestamp)) == 0) {
+            k += BLOCK;
+        }
+        while (k < nrows && lhs[k] == rhs[k]) {
+            k++;
+        }
+        nrows = k;
+    }
+    return nrows;
+}
 
-        ctrl.u = 0;
+double* JoinMaterializer::write_header(u8* dest, aku_Timestamp ts, std::vector<u64> const& bitmap, u32 npresent) {
+    aku_Sample* sample;
+    double*     values;
+    std::tie(sample, values) = cast(dest);
+    const u32 ncols = static_cast<u32>(columns_.size());
+    sample->timestamp       = ts;
+    sample->paramid         = id_;
+    sample->payload.float64 = TupleOutputUtils::make_header(ncols, bitmap.front());
+    sample->payload.type    = AKU_PAYLOAD_TUPLE;
+    sample->payload.size    = static_cast<u16>(sizeof(aku_Sample) + sizeof(u64)*nwords_ + sizeof(double)*npresent);
+    if (nwords_ != 0) {
+        // Extended tuple, bitmap is stored in front of the values
+        memcpy(values, bitmap.data(), sizeof(u64)*nwords_);
+        values += nwords_;
+    }
+    return values;
+}
 
-        u32 tuple_pos = 0;
+std::tuple<aku_Status, size_t> JoinMaterializer::read(u8 *dest, size_t size) {
+    const u32 ncols = static_cast<u32>(columns_.size());
+    std::vector<u32> active;
+    std::vector<u64> bitmap(std::max(nwords_, 1u));
+    active.reserve(ncols);
+    size_t pos = 0;
+    while (pos + max_ssize_ <= size) {
+        // After refill the column can be empty only if it's fully consumed
+        active.clear();
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        for (u32 i = 0; i < ncols; i++) {
+            auto status = refill(i);
+            if (status != AKU_SUCCESS) {
+                return std::make_tuple(status, 0);
+            }
+            if (!columns_[i].empty()) {
+                active.push_back(i);
+                bitmap[i / 64] |= 1ull << (i % 64);
+            }
+        }
+        if (active.empty()) {
+            return std::make_tuple(AKU_ENO_DATA, pos);
+        }
 
-        for (u32 i = 0; i < orig_ids_.size(); i++) {
-            if (buffer_size_ - buffer_pos_ < sizeof(aku_Sample)) {
-                auto status = fill_buffer();
-                if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
-                    return std::make_tuple(status, 0);
-                }
-                if (buffer_size_ == 0) {
-                    return std::make_tuple(AKU_ENO_DATA, pos);
+        // Dense rows (all remaining columns are present)
+        u32 nrows = aligned_run(active, static_cast<u32>((size - pos) / max_ssize_));
+        if (nrows != 0) {
+            const u32 npresent = static_cast<u32>(active.size());
+            Column const& first = columns_[active.front()];
+            const aku_Timestamp* ts = first.ts.data() + first.pos;
+            for (u32 r = 0; r < nrows; r++) {
+                double* values = write_header(dest + pos, ts[r], bitmap, npresent);
+                for (u32 i = 0; i < npresent; i++) {
+                    Column const& col = columns_[active[i]];
+                    values[i] = col.xs[col.pos + r];
                 }
+                pos += reinterpret_cast<aku_Sample*>(dest + pos)->payload.size;
             }
-
-            const aku_Sample* srcsample = reinterpret_cast<const aku_Sample*>(buffer_.data() + buffer_pos_);
-            if (srcsample->paramid != orig_ids_.at(i)) {
-                continue;
+            for (auto ix: active) {
+                columns_[ix].pos += nrows;
             }
+            continue;
+        }
 
-            if (tuple_pos == 0) {
-                // Expect curr_ to be different than srcsample->timestamp
-                curr_ = srcsample->timestamp;
-            } else if (curr_ != srcsample->timestamp) {
-                break;
+        // Sparse row, timestamp of the row is the smallest (or the largest
+        // if the direction is backward) timestamp among column heads
+        aku_Timestamp curr = columns_[active.front()].ts[columns_[active.front()].pos];
+        for (auto ix: active) {
+            auto ts = columns_[ix].ts[columns_[ix].pos];
+            if (forward_ ? ts < curr : ts > curr) {
+                curr = ts;
             }
-
-            ctrl.u |= 1ull << i;
-            values[tuple_pos] = srcsample->payload.float64;
-            tuple_pos++;
-
-            buffer_pos_ += srcsample->payload.size;
-            assert(buffer_pos_ <= buffer_.size());
         }
-
-        auto outsize            = sizeof(aku_Sample) + tuple_pos*sizeof(double);
-        pos                    += outsize;
-        ctrl.u                 |= static_cast<u64>(orig_ids_.size()) << 58;
-        sample->timestamp       = curr_;
-        sample->paramid         = id_;
-        sample->payload.float64 = ctrl.d;
-        sample->payload.type    = AKU_PAYLOAD_TUPLE;
-        sample->payload.size    = static_cast<u16>(outsize);
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        u32 npresent = 0;
+        for (auto ix: active) {
+            Column const& col = columns_[ix];
+            if (col.ts[col.pos] == curr) {
+                bitmap[ix / 64] |= 1ull << (ix % 64);
+                active[npresent++] = ix;
+            }
+        }
+        double* values = write_header(dest + pos, curr, bitmap, npresent);
+        for (u32 i = 0; i < npresent; i++) {
+            Column& col = columns_[active[i]];
+            values[i] = col.xs[col.pos++];
+        }
+        pos += reinterpret_cast<aku_Sample*>(dest + pos)->payload.size;
     }
     return std::make_tuple(AKU_SUCCESS, pos);
 }
@@ -9,25 +9,43 @@ namespace StorageEngine {
 
 
 /** Operator that can be used to join several series.
-  * This materializer is based on merge-join but returns tuples ordered by time
-  * instead of individual values.
-  * Tuple can contain up to 58 elements.
+  * Columns are read in batches directly from the scan operators and aligned
+  * by timestamp. When all columns have the same timestamps (the common case)
+  * the whole aligned run is written as dense tuples without per-row checks.
+  * Column that is fully consumed is treated as missing.
+  * Tuple can contain up to AKU_MAX_COLUMNS elements, extended tuple format is
+  * used if the number of columns is larger than 58.
   */
 class JoinMaterializer : public ColumnMaterializer {
 
-    std::unique_ptr<ColumnMaterializer> merge_;         //< underlying merge-iterator
-    std::vector<aku_ParamId>            orig_ids_;      //< array of original ids
-    aku_ParamId                         id_;            //< id of the resulting time-series
-    aku_Timestamp                       curr_;          //< timestamp of the currently processed sample
-    std::vector<u8>                     buffer_;        //< the read buffer
-    u32                                 buffer_size_;   //< read buffer size (capacity is defined by the vector size)
-    u32                                 buffer_pos_;    //< position in the read buffer
-    const u32                           max_ssize_;     //< element size (in bytes)
+    enum {
+        RANGE_SIZE = 1024
+    };
+
+    //! Read buffer of the individual column
+    struct Column {
+        std::vector<aku_Timestamp> ts;
+        std::vector<double>        xs;
+        u32                        size;    //< number of elements in the buffer
+        u32                        pos;     //< position of the first unread element
+        bool                       done;    //< set when the operator is fully consumed
+
+        bool empty() const {
+            return pos == size;
+        }
+    };
+
+    std::vector<std::unique_ptr<RealValuedOperator>> iters_;    //< scan operators (one per column)
+    std::vector<Column>                              columns_;  //< column buffers
+    aku_ParamId                                      id_;       //< id of the resulting time-series
+    bool                                             forward_;  //< read direction
+    const u32                                        nwords_;   //< number of bitmap words (extended tuples only)
+    const u32                                        max_ssize_;//< element size (in bytes)
 
 public:
 
     /**
-     * @brief JoinMaterializer2 c-tor
+     * @brief JoinMaterializer c-tor
      * @param ids is a original ids of the series
      * @param iters is an array of scan operators
      * @param id is an id of the resulting series
@@ -48,7 +66,14 @@ public:
     std::tuple<aku_Status, size_t> read(u8 *dest, size_t size);
 
 private:
-    aku_Status fill_buffer();
+    //! Read next batch into the column buffer if it's empty
+    aku_Status refill(u32 ix);
+
+    //! Number of rows (up to `maxrows`) that are present in all `active` columns
+    u32 aligned_run(std::vector<u32> const& active, u32 maxrows) const;
+
+    //! Write tuple header and return pointer to the tuple values
+    double* write_header(u8* dest, aku_Timestamp ts, std::vector<u64> const& bitmap, u32 npresent);
 };
 
 struct JoinConcatMaterializer : ColumnMaterializer {
@@ -1,7 +1,155 @@
 #include "merge.h"
+#include "log_iface.h"
+
+#include <cerrno>
+#include <cstring>
 
 namespace Akumuli {
 namespace StorageEngine {
 
+SpillRun::SpillRun()
+    : file_(tmpfile())
+    , size_(0)
+{
+    if (file_ == nullptr) {
+        Logger::msg(AKU_LOG_ERROR, std::string("Can't create spill file: ") + strerror(errno));
+    }
+}
+
+SpillRun::~SpillRun() {
+    if (file_) {
+        fclose(file_);
+    }
+}
+
+aku_Status SpillRun::append(u8 const* data, size_t size) {
+    if (file_ == nullptr) {
+        return AKU_EGENERAL;
+    }
+    if (size != 0 && fwrite(data, 1, size, file_) != size) {
+        Logger::msg(AKU_LOG_ERROR, std::string("Can't write spill file: ") + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    size_ += size;
+    return AKU_SUCCESS;
+}
+
+aku_Status SpillRun::seal() {
+    if (file_ == nullptr || fflush(file_) != 0 || fseek(file_, 0, SEEK_SET) != 0) {
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+std::tuple<aku_Status, size_t> SpillRun::read(u8* dest, size_t size) {
+    if (file_ == nullptr) {
+        return std::make_tuple(AKU_EGENERAL, 0);
+    }
+    // All samples have the same size, only whole samples are returned
+    size -= size % sizeof(aku_Sample);
+    auto nread = fread(dest, 1, size, file_);
+    if (nread < size) {
+        if (ferror(file_)) {
+            Logger::msg(AKU_LOG_ERROR, std::string("Can't read spill file: ") + strerror(errno));
+            return std::make_tuple(AKU_EGENERAL, 0);
+        }
+        return std::make_tuple(AKU_ENO_DATA, nread);
+    }
+    return std::make_tuple(AKU_SUCCESS, nread);
+}
+
+BackgroundMaterializer::BackgroundMaterializer(std::unique_ptr<ColumnMaterializer>&& mat)
+    : mat_(std::move(mat))
+    , curr_pos_(0)
+    , stop_(false)
+    , profile_(QueryProfile::get_current())
+    , cancellation_(QueryCancellation::get_current())
+{
+    for (int i = 0; i < NBUFFERS; i++) {
+        free_.emplace_back(BUFFER_SIZE);
+    }
+    curr_.size = 0;
+    curr_.status = AKU_SUCCESS;
+    worker_ = std::thread(&BackgroundMaterializer::run, this);
+}
+
+BackgroundMaterializer::~BackgroundMaterializer() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+    }
+    cvar_.notify_all();
+    worker_.join();
+}
+
+void BackgroundMaterializer::run() {
+    set_thread_name("materializer");
+    apply_thread_policy(AKU_THREAD_QUERY);
+    QueryProfile::Scope scope(profile_);
+    QueryCancellation::Scope cancellation_scope(cancellation_);
+    while (true) {
+        std::vector<u8> data;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cvar_.wait(lock, [this] {
+                return stop_ || !free_.empty();
+            });
+            if (stop_) {
+                return;
+            }
+            data = std::move(free_.back());
+            free_.pop_back();
+        }
+        Buffer buffer;
+        try {
+            std::tie(buffer.status, buffer.size) = mat_->read(data.data(), data.size());
+        } catch (std::exception const& e) {
+            Logger::msg(AKU_LOG_ERROR, std::string("Merge worker failure: ") + e.what());
+            buffer.status = AKU_EGENERAL;
+            buffer.size = 0;
+        }
+        buffer.data = std::move(data);
+        bool done = buffer.status != AKU_SUCCESS;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            ready_.push_back(std::move(buffer));
+        }
+        cvar_.notify_all();
+        if (done) {
+            return;
+        }
+    }
+}
+
+std::tuple<aku_Status, size_t> BackgroundMaterializer::read(u8* dest, size_t size) {
+    size_t outpos = 0;
+    while (true) {
+        // Copy whole samples from the current buffer
+        while (curr_pos_ < curr_.size) {
+            auto sample = reinterpret_cast<aku_Sample const*>(curr_.data.data() + curr_pos_);
+            if (size - outpos < sample->payload.size) {
+                return std::make_tuple(AKU_SUCCESS, outpos);
+            }
+            memcpy(dest + outpos, sample, sample->payload.size);
+            outpos += sample->payload.size;
+            curr_pos_ += sample->payload.size;
+        }
+        if (curr_.status != AKU_SUCCESS) {
+            // Last buffer was consumed
+            return std::make_tuple(curr_.status, curr_.status == AKU_ENO_DATA ? outpos : 0);
+        }
+        std::unique_lock<std::mutex> lock(lock_);
+        if (!curr_.data.empty()) {
+            free_.push_back(std::move(curr_.data));
+            cvar_.notify_all();
+        }
+        cvar_.wait(lock, [this] {
+            return !ready_.empty();
+        });
+        curr_ = std::move(ready_.front());
+        ready_.pop_front();
+        curr_pos_ = 0;
+    }
+}
 
 }}  // namespace
@@ -1,8 +1,15 @@
 #pragma once
 
 #include "operator.h"
+#include "metrics.h"
+#include "log_iface.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
 
-#include <boost/heap/skew_heap.hpp>
 #include <boost/range.hpp>
 #include <boost/range/iterator_range.hpp>
 
@@ -11,6 +18,66 @@ namespace Akumuli {
 namespace StorageEngine {
 
 
+/** Tournament tree (tree of losers) for k-way merge.
+  * Leafs are the merged sources, every inner node stores the source that lost
+  * the match in this node and the root stores the overall winner. When the winner
+  * advances only the matches on the path from its leaf to the root are replayed,
+  * so every output element costs log2(k) comparisons (binary heap needs two
+  * comparisons per level on pop and push).
+  * `better(a, b)` should return true if source `a` goes before source `b`, ties
+  * should be broken by source index so the merge is stable.
+  */
+struct LoserTree {
+    //! nodes_[0] is a winner, nodes_[k] is a loser of the match in node `k`
+    std::vector<u32> nodes_;
+    u32 size_;
+
+    LoserTree()
+        : size_(0)
+    {
+    }
+
+    template<class Better>
+    void build(u32 size, Better const& better) {
+        size_ = size;
+        nodes_.assign(std::max(size, 1u), 0);
+        // Leaf `i` is at position `size + i`, inner node `k` has children `2k` and `2k + 1`
+        std::vector<u32> winners(2*size, 0);
+        for (u32 i = 0; i < size; i++) {
+            winners[size + i] = i;
+        }
+        for (u32 k = size - 1; k >= 1 && size > 1; k--) {
+            u32 a = winners[2*k];
+            u32 b = winners[2*k + 1];
+            if (better(b, a)) {
+                winners[k] = b;
+                nodes_[k] = a;
+            } else {
+                winners[k] = a;
+                nodes_[k] = b;
+            }
+        }
+        nodes_[0] = size > 1 ? winners[1] : 0;
+    }
+
+    //! Index of the source that goes first
+    u32 winner() const {
+        return nodes_[0];
+    }
+
+    //! Replay matches of the winner (should be called when the winner changes)
+    template<class Better>
+    void update(Better const& better) {
+        u32 winner = nodes_[0];
+        for (u32 k = (winner + size_) / 2; k >= 1; k /= 2) {
+            if (better(nodes_[k], winner)) {
+                std::swap(nodes_[k], winner);
+            }
+        }
+        nodes_[0] = winner;
+    }
+};
+
 template<int dir>  // 0 - forward, 1 - backward
 struct TimeOrder {
     typedef std::tuple<aku_Timestamp, aku_ParamId> KeyType;
@@ -66,6 +133,10 @@ struct SeriesOrder {
 };
 
 
+/** K-way merge of the series. Every series is read ahead into its own range
+  * buffer, buffers are shrunk (down to MIN_RANGE_SIZE elements) if they don't
+  * fit into the memory budget of the query.
+  */
 template<template <int dir> class CmpPred, bool IsStable=false>
 struct MergeMaterializer : ColumnMaterializer {
     std::vector<std::unique_ptr<RealValuedOperator>> iters_;
@@ -73,23 +144,29 @@ struct MergeMaterializer : ColumnMaterializer {
     bool forward_;
 
     enum {
-        RANGE_SIZE=1024
+        RANGE_SIZE=1024,
+        MIN_RANGE_SIZE=32,
+        //! Memory used by one element of the range
+        ELEMENT_SIZE=sizeof(aku_Timestamp) + sizeof(double),
     };
 
     struct Range {
         std::vector<aku_Timestamp> ts;
         std::vector<double> xs;
         aku_ParamId id;
+        //! Index of the iterator
+        u32 iter;
         size_t size;
         size_t pos;
 
-        Range(aku_ParamId id)
+        Range(aku_ParamId id, u32 iter, size_t capacity)
             : id(id)
+            , iter(iter)
             , size(0)
             , pos(0)
         {
-            ts.resize(RANGE_SIZE);
-            xs.resize(RANGE_SIZE);
+            ts.resize(capacity);
+            xs.resize(capacity);
         }
 
         void advance() {
@@ -106,20 +183,28 @@ struct MergeMaterializer : ColumnMaterializer {
         }
 
         std::tuple<aku_Timestamp, aku_ParamId> top_key() const {
-            return std::make_tuple(ts.at(pos), id);
+            return std::make_tuple(ts[pos], id);
         }
 
         double top_value() const {
-            return xs.at(pos);
+            return xs[pos];
         }
     };
 
     std::vector<Range> ranges_;
+    //! Merge state is preserved between `read` calls
+    LoserTree tree_;
+    bool initialized_;
+    //! Memory used by the ranges
+    QueryMemoryReservation mem_;
+    size_t range_size_;
 
     MergeMaterializer(std::vector<aku_ParamId>&& ids, std::vector<std::unique_ptr<RealValuedOperator>>&& it)
         : iters_(std::move(it))
         , ids_(std::move(ids))
         , forward_(true)
+        , initialized_(false)
+        , range_size_(RANGE_SIZE)
     {
         if (!iters_.empty()) {
             forward_ = iters_.front()->get_direction() == RealValuedOperator::Direction::FORWARD;
@@ -127,6 +212,14 @@ struct MergeMaterializer : ColumnMaterializer {
         if (iters_.size() != ids_.size()) {
             AKU_PANIC("MergeIterator - broken invariant");
         }
+        while (!mem_.grow(iters_.size()*range_size_*ELEMENT_SIZE)) {
+            if (range_size_ == MIN_RANGE_SIZE) {
+                // Smallest ranges are used even if they don't fit, large merges should
+                // be spilled to disk (see `make_merge_materializer`)
+                break;
+            }
+            range_size_ /= 2;
+        }
     }
 
     virtual std::tuple<aku_Status, size_t> read(u8* dest, size_t size) override {
@@ -141,14 +234,35 @@ struct MergeMaterializer : ColumnMaterializer {
         if (iters_.empty()) {
             return std::make_tuple(AKU_ENO_DATA, 0);
         }
+        typedef CmpPred<dir> Comp;
+        // Source `a` goes before source `b`, empty sources go last. Ties are broken
+        // by position so series with the same key are returned in the input order
+        // (`IsStable` is always satisfied).
+        auto better = [this](u32 a, u32 b) {
+            Comp cmp;
+            Range const& ra = ranges_[a];
+            Range const& rb = ranges_[b];
+            if (rb.empty()) {
+                return !ra.empty();
+            }
+            if (ra.empty()) {
+                return false;
+            }
+            auto ia = std::make_tuple(ra.top_key(), .0, a);
+            auto ib = std::make_tuple(rb.top_key(), .0, b);
+            if (cmp(ib, ia)) {
+                return true;
+            }
+            return !cmp(ia, ib) && a < b;
+        };
         size_t outpos = 0;
-        if (ranges_.empty()) {
+        if (!initialized_) {
             // `ranges_` array should be initialized on first call
             for (size_t i = 0; i < iters_.size(); i++) {
-                Range range(ids_[i]);
+                Range range(ids_[i], static_cast<u32>(i), range_size_);
                 aku_Status status;
                 size_t outsize;
-                std::tie(status, outsize) = iters_[i]->read(range.ts.data(), range.xs.data(), RANGE_SIZE);
+                std::tie(status, outsize) = iters_[i]->read(range.ts.data(), range.xs.data(), range_size_);
                 if (status == AKU_SUCCESS || (status == AKU_ENO_DATA && outsize != 0)) {
                     range.size = outsize;
                     range.pos  = 0;
@@ -158,70 +272,45 @@ struct MergeMaterializer : ColumnMaterializer {
                     return std::make_tuple(status, 0);
                 }
             }
+            tree_.build(static_cast<u32>(ranges_.size()), better);
+            initialized_ = true;
         }
 
-        typedef CmpPred<dir> Comp;
-        typedef typename Comp::HeapItem HeapItem;
-        typedef typename Comp::KeyType KeyType;
-        typedef boost::heap::skew_heap<HeapItem, boost::heap::compare<Comp>, boost::heap::stable<IsStable>> Heap;
-        Heap heap;
-
-        int index = 0;
-        for(auto& range: ranges_) {
-            if (!range.empty()) {
-                KeyType key = range.top_key();
-                heap.push(std::make_tuple(key, range.top_value(), index));
+        while(!ranges_.empty()) {
+            Range& range = ranges_[tree_.winner()];
+            if (range.empty()) {
+                // Winner is empty only if all ranges are empty
+                break;
+            }
+            if (size - outpos < sizeof(aku_Sample)) {
+                // Output buffer is fully consumed
+                return std::make_tuple(AKU_SUCCESS, outpos);
             }
-            index++;
-        }
-
-        enum {
-            KEY = 0,
-            VALUE = 1,
-            INDEX = 2,
-            TIME = 0,
-            ID = 1,
-        };
-
-        while(!heap.empty()) {
-            HeapItem item = heap.top();
-            KeyType point = std::get<KEY>(item);
-            u32 index = std::get<INDEX>(item);
             aku_Sample sample;
-            sample.paramid = std::get<ID>(point);
-            sample.timestamp = std::get<TIME>(point);
+            sample.paramid = range.id;
+            sample.timestamp = range.ts[range.pos];
             sample.payload.type = AKU_PAYLOAD_FLOAT;
             sample.payload.size = sizeof(aku_Sample);
-            sample.payload.float64 = std::get<VALUE>(item);
-            if (size - outpos >= sizeof(aku_Sample)) {
-                memcpy(dest + outpos, &sample, sizeof(sample));
-                outpos += sizeof(sample);
-            } else {
-                // Output buffer is fully consumed
-                return std::make_tuple(AKU_SUCCESS, size);
-            }
-            heap.pop();
-            ranges_[index].advance();
-            if (ranges_[index].empty()) {
+            sample.payload.float64 = range.xs[range.pos];
+            memcpy(dest + outpos, &sample, sizeof(sample));
+            outpos += sizeof(sample);
+            range.advance();
+            if (range.empty()) {
                 // Refill range if possible
                 aku_Status status;
                 size_t outsize;
-                std::tie(status, outsize) = iters_[index]->read(ranges_[index].ts.data(), ranges_[index].xs.data(), RANGE_SIZE);
+                std::tie(status, outsize) = iters_[range.iter]->read(range.ts.data(), range.xs.data(), range_size_);
                 if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
                     return std::make_tuple(status, 0);
                 }
-                ranges_[index].size = outsize;
-                ranges_[index].pos  = 0;
+                range.size = outsize;
+                range.pos  = 0;
             }
-            if (!ranges_[index].empty()) {
-                KeyType point = ranges_[index].top_key();
-                heap.push(std::make_tuple(point, ranges_[index].top_value(), index));
-            }
-        }
-        if (heap.empty()) {
-            iters_.clear();
-            ranges_.clear();
+            tree_.update(better);
         }
+        iters_.clear();
+        ranges_.clear();
+        mem_.shrink(mem_.size());
         // All iterators are fully consumed
         return std::make_tuple(AKU_ENO_DATA, outpos);
     }
@@ -281,12 +370,15 @@ struct MergeJoinMaterializer : ColumnMaterializer {
 
     struct Range {
         std::vector<u8> buffer;
+        //! Index of the iterator
+        u32 iter;
         u32 size;
         u32 pos;
         u32 last_advance;
 
-        Range()
-            : size(0u)
+        Range(u32 iter)
+            : iter(iter)
+            , size(0u)
             , pos(0u)
             , last_advance(0u)
         {
@@ -307,7 +399,7 @@ struct MergeJoinMaterializer : ColumnMaterializer {
             return !(pos < size);
         }
 
-        std::tuple<aku_Timestamp, aku_ParamId> top_key() const {
+        typename CmpPred<0>::KeyType top_key() const {
             u8 const* top = buffer.data() + pos;
             aku_Sample const* sample = reinterpret_cast<aku_Sample const*>(top);
             return CmpPred<0>::make_key(sample);  // Direction doesn't matter here
@@ -322,10 +414,14 @@ struct MergeJoinMaterializer : ColumnMaterializer {
     std::vector<std::unique_ptr<ColumnMaterializer>> iters_;
     bool forward_;
     std::vector<Range> ranges_;
+    //! Merge state is preserved between `read` calls
+    LoserTree tree_;
+    bool initialized_;
 
     MergeJoinMaterializer(std::vector<std::unique_ptr<ColumnMaterializer>>&& it, bool forward)
         : iters_(std::move(it))
         , forward_(forward)
+        , initialized_(false)
     {
     }
 
@@ -341,11 +437,32 @@ struct MergeJoinMaterializer : ColumnMaterializer {
         if (iters_.empty()) {
             return std::make_tuple(AKU_ENO_DATA, 0);
         }
+        typedef CmpPred<dir> Comp;
+        typedef typename Comp::HeapItem HeapItem;
+        // Source `a` goes before source `b`, empty sources go last, ties are broken by position.
+        // Predicates are stateless (and might have internal linkage) so they're not captured.
+        auto better = [this](u32 a, u32 b) {
+            Comp cmp;
+            Range const& ra = ranges_[a];
+            Range const& rb = ranges_[b];
+            if (rb.empty()) {
+                return !ra.empty();
+            }
+            if (ra.empty()) {
+                return false;
+            }
+            HeapItem ia = { ra.top_key(), ra.top(), a };
+            HeapItem ib = { rb.top_key(), rb.top(), b };
+            if (cmp(ib, ia)) {
+                return true;
+            }
+            return !cmp(ia, ib) && a < b;
+        };
         size_t outpos = 0;
-        if (ranges_.empty()) {
+        if (!initialized_) {
             // `ranges_` array should be initialized on first call
             for (size_t i = 0; i < iters_.size(); i++) {
-                Range range;
+                Range range(static_cast<u32>(i));
                 aku_Status status;
                 size_t outsize;
                 std::tie(status, outsize) = iters_[i]->read(range.buffer.data(), range.buffer.size());
@@ -358,27 +475,17 @@ struct MergeJoinMaterializer : ColumnMaterializer {
                     return std::make_tuple(status, 0);
                 }
             }
+            tree_.build(static_cast<u32>(ranges_.size()), better);
+            initialized_ = true;
         }
 
-        typedef CmpPred<dir> Comp;
-        typedef typename Comp::HeapItem HeapItem;
-        typedef typename Comp::KeyType KeyType;
-        typedef boost::heap::skew_heap<HeapItem, boost::heap::compare<Comp>> Heap;
-        Heap heap;
-
-        size_t index = 0;
-        for(auto& range: ranges_) {
-            if (!range.empty()) {
-                KeyType key = range.top_key();
-                heap.push({key, range.top(), index});
+        while(!ranges_.empty()) {
+            Range& range = ranges_[tree_.winner()];
+            if (range.empty()) {
+                // Winner is empty only if all ranges are empty
+                break;
             }
-            index++;
-        }
-
-        while(!heap.empty()) {
-            HeapItem item = heap.top();
-            size_t index = item.index;
-            aku_Sample const* sample = item.sample;
+            aku_Sample const* sample = range.top();
             if (size - outpos >= sample->payload.size) {
                 memcpy(dest + outpos, sample, sample->payload.size);
                 outpos += sample->payload.size;
@@ -386,32 +493,236 @@ struct MergeJoinMaterializer : ColumnMaterializer {
                 // Output buffer is fully consumed
                 return std::make_tuple(AKU_SUCCESS, outpos);
             }
-            heap.pop();
-            ranges_[index].advance(sample->payload.size);
-            if (ranges_[index].empty()) {
+            range.advance(sample->payload.size);
+            if (range.empty()) {
                 // Refill range if possible
                 aku_Status status;
                 size_t outsize;
-                std::tie(status, outsize) = iters_[index]->read(ranges_[index].buffer.data(), ranges_[index].buffer.size());
+                std::tie(status, outsize) = iters_[range.iter]->read(range.buffer.data(), range.buffer.size());
                 if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
                     return std::make_tuple(status, 0);
                 }
-                ranges_[index].size = static_cast<u32>(outsize);
-                ranges_[index].pos  = 0;
-            }
-            if (!ranges_[index].empty()) {
-                KeyType point = ranges_[index].top_key();
-                heap.push({point, ranges_[index].top(), index});
+                range.size = static_cast<u32>(outsize);
+                range.pos  = 0;
             }
+            tree_.update(better);
         }
-        if (heap.empty()) {
-            iters_.clear();
-            ranges_.clear();
-        }
+        iters_.clear();
+        ranges_.clear();
         // All iterators are fully consumed
         return std::make_tuple(AKU_ENO_DATA, outpos);
     }
 
 };
 
+/**
+ * Runs materializer on a separate thread. Output is produced ahead of time into
+ * a bounded set of buffers, so several materializers can run in parallel.
+ */
+struct BackgroundMaterializer : ColumnMaterializer {
+    enum {
+        NBUFFERS = 4,
+        BUFFER_SIZE = 0x400*sizeof(aku_Sample),
+    };
+
+    struct Buffer {
+        std::vector<u8> data;
+        size_t size;
+        aku_Status status;
+    };
+
+    std::unique_ptr<ColumnMaterializer> mat_;
+    std::mutex lock_;
+    std::condition_variable cvar_;
+    //! Buffers with data (in output order)
+    std::deque<Buffer> ready_;
+    //! Empty buffers that can be reused by the producer
+    std::vector<std::vector<u8>> free_;
+    //! Buffer that is currently read by the consumer
+    Buffer curr_;
+    size_t curr_pos_;
+    bool stop_;
+    //! Profile of the query that created the materializer (attached to the worker)
+    QueryProfile* profile_;
+    //! Cancellation state of the query (attached to the worker)
+    QueryCancellation* cancellation_;
+    std::thread worker_;
+
+    BackgroundMaterializer(std::unique_ptr<ColumnMaterializer>&& mat);
+
+    ~BackgroundMaterializer();
+
+    virtual std::tuple<aku_Status, size_t> read(u8* dest, size_t size) override;
+
+private:
+    void run();
+};
+
+/**
+ * Sorted run of the external merge. Samples are written to the temporary
+ * file (removed automatically when closed) and read back sequentially.
+ * Only scalar samples (fixed size) can be stored.
+ */
+struct SpillRun : ColumnMaterializer {
+    FILE* file_;
+    //! Number of bytes written
+    u64 size_;
+
+    SpillRun();
+
+    ~SpillRun();
+
+    //! Append samples to the run
+    aku_Status append(u8 const* data, size_t size);
+
+    //! Finish writing, the run can be read after this call
+    aku_Status seal();
+
+    virtual std::tuple<aku_Status, size_t> read(u8* dest, size_t size) override;
+};
+
+/**
+ * Merge that doesn't fit into the memory budget of the query. Series are split
+ * into groups, every group is merged and spilled to disk as a sorted run. The
+ * runs are merged again when the output is read. First `read` call produces all
+ * runs, `CmpPred` and `OrderPred` have the same meaning as in `make_merge_materializer`.
+ */
+template<template <int dir> class CmpPred, template <int dir> class OrderPred>
+struct ExternalMergeMaterializer : ColumnMaterializer {
+    enum {
+        SPILL_BUFFER_SIZE = 0x400*sizeof(aku_Sample),
+    };
+
+    std::vector<aku_ParamId> ids_;
+    std::vector<std::unique_ptr<RealValuedOperator>> iters_;
+    size_t series_per_run_;
+    bool forward_;
+    std::unique_ptr<ColumnMaterializer> merge_;
+
+    ExternalMergeMaterializer(std::vector<aku_ParamId>&& ids,
+                              std::vector<std::unique_ptr<RealValuedOperator>>&& iters,
+                              size_t series_per_run)
+        : ids_(std::move(ids))
+        , iters_(std::move(iters))
+        , series_per_run_(std::max(series_per_run, static_cast<size_t>(2)))
+        , forward_(true)
+    {
+        if (iters_.size() != ids_.size()) {
+            AKU_PANIC("MergeIterator - broken invariant");
+        }
+        if (!iters_.empty()) {
+            forward_ = iters_.front()->get_direction() == RealValuedOperator::Direction::FORWARD;
+        }
+    }
+
+    aku_Status spill() {
+        std::vector<std::unique_ptr<ColumnMaterializer>> runs;
+        std::vector<u8> buffer(SPILL_BUFFER_SIZE);
+        for (size_t begin = 0; begin < iters_.size(); begin += series_per_run_) {
+            size_t end = std::min(begin + series_per_run_, iters_.size());
+            std::vector<aku_ParamId> ids(ids_.begin() + static_cast<ssize_t>(begin), ids_.begin() + static_cast<ssize_t>(end));
+            std::vector<std::unique_ptr<RealValuedOperator>> iters;
+            for (size_t i = begin; i < end; i++) {
+                iters.push_back(std::move(iters_[i]));
+            }
+            MergeMaterializer<CmpPred> merge(std::move(ids), std::move(iters));
+            std::unique_ptr<SpillRun> run(new SpillRun());
+            while (true) {
+                aku_Status status;
+                size_t size;
+                std::tie(status, size) = merge.read(buffer.data(), buffer.size());
+                if (status != AKU_SUCCESS && status != AKU_ENO_DATA) {
+                    return status;
+                }
+                auto write_status = run->append(buffer.data(), size);
+                if (write_status != AKU_SUCCESS) {
+                    return write_status;
+                }
+                if (status == AKU_ENO_DATA) {
+                    break;
+                }
+            }
+            auto status = run->seal();
+            if (status != AKU_SUCCESS) {
+                return status;
+            }
+            runs.push_back(std::move(run));
+        }
+        Logger::msg(AKU_LOG_INFO, "Merge of " + std::to_string(iters_.size()) + " series doesn't fit into the "
+                                  "query memory budget, spilled to " + std::to_string(runs.size()) + " runs");
+        ids_.clear();
+        iters_.clear();
+        merge_.reset(new MergeJoinMaterializer<OrderPred>(std::move(runs), forward_));
+        return AKU_SUCCESS;
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(u8* dest, size_t size) override {
+        if (!merge_) {
+            auto status = spill();
+            if (status != AKU_SUCCESS) {
+                return std::make_tuple(status, 0);
+            }
+        }
+        return merge_->read(dest, size);
+    }
+};
+
+enum {
+    //! Min number of series per merge worker
+    MIN_SERIES_PER_MERGE_WORKER = 0x400,
+    MAX_MERGE_WORKERS = 8,
+    //! Min number of series per run of the external merge
+    MIN_SERIES_PER_RUN = 0x100,
+};
+
+/** Create merge materializer. Large merges are split into several partitions
+  * (contiguous groups of series), each partition is merged by a separate thread
+  * and the partial outputs are merged again. The output is the same as the output
+  * of the `MergeMaterializer<CmpPred>` (`OrderPred` should define the same order
+  * on the `aku_Sample` values, ties are resolved by partition index).
+  * Merge is spilled to disk if the range buffers of all series can't fit into
+  * the memory budget of the query (see ExternalMergeMaterializer).
+  */
+template<template <int dir> class CmpPred, template <int dir> class OrderPred>
+std::unique_ptr<ColumnMaterializer> make_merge_materializer(std::vector<aku_ParamId>&& ids,
+                                                            std::vector<std::unique_ptr<RealValuedOperator>>&& iters,
+                                                            size_t nworkers=std::thread::hardware_concurrency())
+{
+    std::unique_ptr<ColumnMaterializer> result;
+    typedef MergeMaterializer<CmpPred> Merge;
+    const size_t min_series_size = Merge::MIN_RANGE_SIZE*Merge::ELEMENT_SIZE;
+    auto available = QueryMemoryReservation().available();
+    if (iters.size() > MIN_SERIES_PER_RUN && iters.size() > available / min_series_size) {
+        // Half of the budget is left for the runs
+        auto per_run = std::max(available / 2 / min_series_size, static_cast<size_t>(MIN_SERIES_PER_RUN));
+        result.reset(new ExternalMergeMaterializer<CmpPred, OrderPred>(std::move(ids), std::move(iters), per_run));
+        return result;
+    }
+    nworkers = std::min(nworkers, iters.size() / MIN_SERIES_PER_MERGE_WORKER);
+    nworkers = std::min(nworkers, static_cast<size_t>(MAX_MERGE_WORKERS));
+    if (nworkers < 2) {
+        result.reset(new MergeMaterializer<CmpPred>(std::move(ids), std::move(iters)));
+        return result;
+    }
+    if (iters.size() != ids.size()) {
+        AKU_PANIC("MergeIterator - broken invariant");
+    }
+    bool forward = iters.front()->get_direction() == RealValuedOperator::Direction::FORWARD;
+    std::vector<std::unique_ptr<ColumnMaterializer>> parts;
+    size_t begin = 0;
+    for (size_t i = 0; i < nworkers; i++) {
+        size_t end = iters.size() * (i + 1) / nworkers;
+        std::vector<aku_ParamId> pids(ids.begin() + static_cast<ssize_t>(begin), ids.begin() + static_cast<ssize_t>(end));
+        std::vector<std::unique_ptr<RealValuedOperator>> piters;
+        for (size_t j = begin; j < end; j++) {
+            piters.push_back(std::move(iters[j]));
+        }
+        std::unique_ptr<ColumnMaterializer> merge(new MergeMaterializer<CmpPred>(std::move(pids), std::move(piters)));
+        parts.emplace_back(new BackgroundMaterializer(std::move(merge)));
+        begin = end;
+    }
+    result.reset(new MergeJoinMaterializer<OrderPred>(std::move(parts), forward));
+    return result;
+}
+
 }}  // namespace
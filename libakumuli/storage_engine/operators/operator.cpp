@@ -1,10 +1,279 @@
 #include "operator.h"
+#include "util.h"
 
 #include <cassert>
+#include <cmath>
+#include <tuple>
 
 namespace Akumuli {
 namespace StorageEngine {
 
+ValueFilter::ValueFilter()
+    : lo_(-std::numeric_limits<double>::infinity())
+    , hi_(std::numeric_limits<double>::infinity())
+    , lo_incl_(true)
+    , hi_incl_(true)
+    , enabled_(false)
+{
+}
+
+ValueFilter& ValueFilter::add(Op op, double threshold) {
+    switch (op) {
+    case Op::GT:
+        if (threshold > lo_ || (threshold == lo_ && lo_incl_)) {
+            lo_ = threshold;
+            lo_incl_ = false;
+        }
+        break;
+    case Op::GE:
+        if (threshold > lo_) {
+            lo_ = threshold;
+            lo_incl_ = true;
+        }
+        break;
+    case Op::LT:
+        if (threshold < hi_ || (threshold == hi_ && hi_incl_)) {
+            hi_ = threshold;
+            hi_incl_ = false;
+        }
+        break;
+    case Op::LE:
+        if (threshold < hi_) {
+            hi_ = threshold;
+            hi_incl_ = true;
+        }
+        break;
+    };
+    enabled_ = true;
+    return *this;
+}
+
+bool ValueFilter::is_enabled() const {
+    return enabled_;
+}
+
+bool ValueFilter::match(double value) const {
+    // Bitwise operators are used intentionally, the check shouldn't branch
+    bool lo = (value > lo_) | (lo_incl_ & (value == lo_));
+    bool hi = (value < hi_) | (hi_incl_ & (value == hi_));
+    return lo & hi;
+}
+
+bool ValueFilter::match_range(double min, double max) const {
+    bool lo = (max > lo_) | (lo_incl_ & (max == lo_));
+    bool hi = (min < hi_) | (hi_incl_ & (min == hi_));
+    return lo & hi;
+}
+
+size_t ValueFilter::apply(aku_Timestamp const* srcts, double const* srcxs, size_t size,
+                          aku_Timestamp* destts, double* destxs) const
+{
+    // Every value is copied, output position is advanced only if the value
+    // matches so the loop doesn't have data dependent branches
+    size_t n = 0;
+    for (size_t i = 0; i < size; i++) {
+        double x = srcxs[i];
+        destts[n] = srcts[i];
+        destxs[n] = x;
+        n += static_cast<size_t>(match(x));
+    }
+    return n;
+}
+
+bool is_quantile(AggregationFunction func) {
+    switch (func) {
+    case AggregationFunction::P50:
+    case AggregationFunction::P90:
+    case AggregationFunction::P95:
+    case AggregationFunction::P99:
+    case AggregationFunction::P999:
+        return true;
+    default:
+        return false;
+    };
+}
+
+double get_quantile(AggregationFunction func) {
+    switch (func) {
+    case AggregationFunction::P50:
+        return 0.5;
+    case AggregationFunction::P90:
+        return 0.9;
+    case AggregationFunction::P95:
+        return 0.95;
+    case AggregationFunction::P99:
+        return 0.99;
+    case AggregationFunction::P999:
+        return 0.999;
+    default:
+        break;
+    };
+    AKU_PANIC("Not a quantile");
+}
+
+// --------------
+// QuantileSketch
+// --------------
+
+constexpr double QuantileSketch::MIN_VALUE;
+
+QuantileSketch::QuantileSketch(double accuracy)
+    : gamma_((1.0 + accuracy) / (1.0 - accuracy))
+    , lngamma_(std::log(gamma_))
+    , posoff_(0)
+    , negoff_(0)
+    , zero_(0)
+    , count_(0)
+    , min_(std::numeric_limits<double>::max())
+    , max_(std::numeric_limits<double>::lowest())
+{
+}
+
+i32 QuantileSketch::get_index(double x) const {
+    return static_cast<i32>(std::ceil(std::log(x) / lngamma_));
+}
+
+double QuantileSketch::get_value(i32 index) const {
+    // Middle of the bucket in terms of relative error
+    return 2.0 * std::pow(gamma_, index) / (gamma_ + 1.0);
+}
+
+void QuantileSketch::increment(std::vector<u64>* buckets, i32* off, i32 index, u64 n) {
+    if (buckets->empty()) {
+        *off = index;
+        buckets->push_back(n);
+        return;
+    }
+    if (index < *off) {
+        buckets->insert(buckets->begin(), static_cast<size_t>(*off - index), 0);
+        *off = index;
+    } else if (index - *off >= static_cast<i32>(buckets->size())) {
+        buckets->resize(static_cast<size_t>(index - *off) + 1, 0);
+    }
+    buckets->at(static_cast<size_t>(index - *off)) += n;
+}
+
+void QuantileSketch::add(double x) {
+    if (std::isnan(x)) {
+        return;
+    }
+    if (x > MIN_VALUE) {
+        increment(&pos_, &posoff_, get_index(x), 1);
+    } else if (x < -MIN_VALUE) {
+        increment(&neg_, &negoff_, get_index(-x), 1);
+    } else {
+        zero_++;
+    }
+    count_++;
+    min_ = std::min(min_, x);
+    max_ = std::max(max_, x);
+}
+
+void QuantileSketch::merge(QuantileSketch const& other) {
+    for (size_t i = 0; i < other.pos_.size(); i++) {
+        if (other.pos_[i]) {
+            increment(&pos_, &posoff_, other.posoff_ + static_cast<i32>(i), other.pos_[i]);
+        }
+    }
+    for (size_t i = 0; i < other.neg_.size(); i++) {
+        if (other.neg_[i]) {
+            increment(&neg_, &negoff_, other.negoff_ + static_cast<i32>(i), other.neg_[i]);
+        }
+    }
+    zero_  += other.zero_;
+    count_ += other.count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+u64 QuantileSketch::count() const {
+    return count_;
+}
+
+double QuantileSketch::quantile(double q) const {
+    if (count_ == 0) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    q = std::max(0.0, std::min(1.0, q));
+    u64 rank = static_cast<u64>(q * static_cast<double>(count_ - 1));
+    double result = 0;
+    u64 acc = 0;
+    bool found = false;
+    // Negative values in ascending order (largest magnitude first)
+    for (size_t i = neg_.size(); i --> 0;) {
+        acc += neg_[i];
+        if (acc > rank) {
+            result = -get_value(negoff_ + static_cast<i32>(i));
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        acc += zero_;
+        if (acc > rank) {
+            result = 0;
+            found = true;
+        }
+    }
+    if (!found) {
+        for (size_t i = 0; i < pos_.size(); i++) {
+            acc += pos_[i];
+            if (acc > rank) {
+                result = get_value(posoff_ + static_cast<i32>(i));
+                break;
+            }
+        }
+    }
+    // Estimate can't be outside of the range of the values
+    return std::max(min_, std::min(max_, result));
+}
+
+bool Histogram::merge(Histogram const& other) {
+    if (counts.empty() && bounds.empty()) {
+        *this = other;
+        return true;
+    }
+    if (bounds != other.bounds) {
+        return false;
+    }
+    for (size_t i = 0; i < counts.size(); i++) {
+        counts[i] += other.counts[i];
+    }
+    return true;
+}
+
+u64 Histogram::count() const {
+    u64 total = 0;
+    for (auto cnt: counts) {
+        total += cnt;
+    }
+    return total;
+}
+
+double Histogram::quantile(double q) const {
+    u64 total = count();
+    if (total == 0) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    q = std::max(0.0, std::min(1.0, q));
+    double rank = q * static_cast<double>(total);
+    u64 acc = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] == 0 || static_cast<double>(acc + counts[i]) < rank) {
+            acc += counts[i];
+            continue;
+        }
+        double lower = i == 0 ? std::min(0.0, bounds[0]) : bounds[i - 1];
+        double upper = bounds[i];
+        if (std::isinf(upper)) {
+            return lower;
+        }
+        double frac = (rank - static_cast<double>(acc)) / static_cast<double>(counts[i]);
+        return lower + (upper - lower) * frac;
+    }
+    return bounds.back();
+}
+
 void AggregationResult::copy_from(SubtreeRef const& r) {
     cnt = r.count;
     sum = r.sum;
@@ -18,19 +287,77 @@ void AggregationResult::copy_from(SubtreeRef const& r) {
     _end = r.end;
 }
 
+namespace {
+
+/** Compute sum, min and max of the array.
+  * The loop uses several independent accumulators so there is no
+  * loop-carried dependency between adjacent elements and the compiler
+  * can keep them in vector registers.
+  * Min and max are updated only if array contains smaller (or larger) value.
+  * @return true if min was updated and true if max was updated
+  */
+std::tuple<bool, bool> reduce(double const* xss, size_t size, double* sum, double* min, double* max) {
+    enum {
+        NLANES = 4
+    };
+    double lsum[NLANES] = {};
+    double lmin[NLANES] = { *min, *min, *min, *min };
+    double lmax[NLANES] = { *max, *max, *max, *max };
+    size_t i = 0;
+    for (; i + NLANES <= size; i += NLANES) {
+        for (int l = 0; l < NLANES; l++) {
+            double x = xss[i + l];
+            lsum[l] += x;
+            lmin[l] = x < lmin[l] ? x : lmin[l];
+            lmax[l] = x > lmax[l] ? x : lmax[l];
+        }
+    }
+    for (; i < size; i++) {
+        double x = xss[i];
+        lsum[0] += x;
+        lmin[0] = x < lmin[0] ? x : lmin[0];
+        lmax[0] = x > lmax[0] ? x : lmax[0];
+    }
+    double rmin = lmin[0];
+    double rmax = lmax[0];
+    for (int l = 1; l < NLANES; l++) {
+        rmin = lmin[l] < rmin ? lmin[l] : rmin;
+        rmax = lmax[l] > rmax ? lmax[l] : rmax;
+    }
+    *sum += (lsum[0] + lsum[1]) + (lsum[2] + lsum[3]);
+    bool min_updated = rmin < *min;
+    bool max_updated = rmax > *max;
+    *min = rmin;
+    *max = rmax;
+    return std::make_tuple(min_updated, max_updated);
+}
+
+//! Find index of the first occurrence of the value (value should be present)
+size_t find_first(double const* xss, size_t size, double value) {
+    size_t i = 0;
+    for (; i < size; i++) {
+        if (xss[i] == value) {
+            break;
+        }
+    }
+    assert(i < size);
+    return i;
+}
+
+}  // namespace
+
 void AggregationResult::do_the_math(aku_Timestamp* tss, double const* xss, size_t size, bool inverted) {
     assert(size);
     cnt += size;
-    for (size_t i = 0; i < size; i++) {
-        sum += xss[i];
-        if (min > xss[i]) {
-            min = xss[i];
-            mints = tss[i];
-        }
-        if (max < xss[i]) {
-            max = xss[i];
-            maxts = tss[i];
-        }
+    bool min_updated, max_updated;
+    std::tie(min_updated, max_updated) = reduce(xss, size, &sum, &min, &max);
+    // Only the position of the extremum is needed, it's enough to
+    // find the first element equal to it.
+    if (min_updated) {
+        mints = tss[find_first(xss, size, min)];
+    }
+    if (max_updated) {
+        maxts = tss[find_first(xss, size, max)];
     }
     if (!inverted) {
         first = xss[0];
@@ -45,6 +372,146 @@ void AggregationResult::do_the_math(aku_Timestamp* tss, double const* xss, size_
     }
 }
 
+void AggregationResult::add_range(aku_Timestamp const* tss, double const* xss, size_t size, bool forward) {
+    if (size == 0) {
+        return;
+    }
+    bool min_updated, max_updated;
+    std::tie(min_updated, max_updated) = reduce(xss, size, &sum, &min, &max);
+    if (min_updated) {
+        mints = tss[find_first(xss, size, min)];
+    }
+    if (max_updated) {
+        maxts = tss[find_first(xss, size, max)];
+    }
+    if (cnt == 0) {
+        first = xss[0];
+        if (forward) {
+            _begin = tss[0];
+        } else {
+            _end = tss[0];
+        }
+    }
+    last = xss[size - 1];
+    if (forward) {
+        _end = tss[size - 1];
+    } else {
+        _begin = tss[size - 1];
+    }
+    cnt += size;
+}
+
+size_t aggregate_by_step(aku_Timestamp const* tss,
+                         double const* xss,
+                         size_t size,
+                         aku_Timestamp begin,
+                         u64 step,
+                         bool forward,
+                         aku_Timestamp* destts,
+                         AggregationResult* destxs)
+{
+    assert(step);
+    size_t outix = 0;
+    size_t ix = 0;
+    while (ix < size) {
+        // Timestamps are ordered so every bin is a contiguous run of
+        // elements. Find the run by comparing against the bin boundary
+        // instead of dividing every timestamp.
+        aku_Timestamp normts = forward ? tss[ix] - begin : begin - tss[ix];
+        u64 bin = normts / step;
+        u64 limit = bin * step + step;
+        bool overflow = limit < normts;
+        size_t runend = ix + 1;
+        while (runend < size) {
+            aku_Timestamp nts = forward ? tss[runend] - begin : begin - tss[runend];
+            if (!overflow && nts >= limit) {
+                break;
+            }
+            runend++;
+        }
+        AggregationResult outval = INIT_AGGRES;
+        outval.add_range(tss + ix, xss + ix, runend - ix, forward);
+        destxs[outix] = outval;
+        destts[outix] = outval._begin;
+        outix++;
+        ix = runend;
+    }
+    return outix;
+}
+
+void AggregationBuckets::reset(size_t size) {
+    cnt.assign(size, INIT_AGGRES.cnt);
+    sum.assign(size, INIT_AGGRES.sum);
+    min.assign(size, INIT_AGGRES.min);
+    max.assign(size, INIT_AGGRES.max);
+    first.assign(size, INIT_AGGRES.first);
+    last.assign(size, INIT_AGGRES.last);
+    mints.assign(size, INIT_AGGRES.mints);
+    maxts.assign(size, INIT_AGGRES.maxts);
+    begin.assign(size, INIT_AGGRES._begin);
+    end.assign(size, INIT_AGGRES._end);
+}
+
+size_t AggregationBuckets::size() const {
+    return cnt.size();
+}
+
+void AggregationBuckets::set(size_t ix, AggregationResult const& value) {
+    cnt[ix] = value.cnt;
+    sum[ix] = value.sum;
+    min[ix] = value.min;
+    max[ix] = value.max;
+    first[ix] = value.first;
+    last[ix] = value.last;
+    mints[ix] = value.mints;
+    maxts[ix] = value.maxts;
+    begin[ix] = value._begin;
+    end[ix] = value._end;
+}
+
+AggregationResult AggregationBuckets::get(size_t ix) const {
+    AggregationResult value = {
+        cnt[ix], sum[ix], min[ix], max[ix], first[ix], last[ix],
+        mints[ix], maxts[ix], begin[ix], end[ix],
+    };
+    return value;
+}
+
+namespace {
+
+//! Replace elements of `dest` with elements of `src` if `src` key is less (greater if `Greater` is set)
+template<bool Greater, class Key, class Val>
+void select_extremum(size_t size, Key* destkey, Val* destval,
+                     Key const* srckey, Val const* srcval)
+{
+    for (size_t i = 0; i < size; i++) {
+        bool upd = Greater ? srckey[i] > destkey[i] : srckey[i] < destkey[i];
+        destval[i] = upd ? srcval[i] : destval[i];
+        destkey[i] = upd ? srckey[i] : destkey[i];
+    }
+}
+
+void add_arrays(size_t size, double* dest, double const* src) {
+    for (size_t i = 0; i < size; i++) {
+        dest[i] += src[i];
+    }
+}
+
+}  // namespace
+
+void AggregationBuckets::combine(AggregationBuckets const& other) {
+    assert(other.size() == size());
+    const size_t n = size();
+    // Every kernel touches few arrays and doesn't have branches (selects
+    // are compiled into blend instructions), so it can be vectorized.
+    add_arrays(n, cnt.data(), other.cnt.data());
+    add_arrays(n, sum.data(), other.sum.data());
+    select_extremum<false>(n, min.data(), mints.data(), other.min.data(), other.mints.data());
+    select_extremum<true>(n, max.data(), maxts.data(), other.max.data(), other.maxts.data());
+    select_extremum<false>(n, begin.data(), first.data(), other.begin.data(), other.first.data());
+    select_extremum<true>(n, end.data(), last.data(), other.end.data(), other.last.data());
+}
+
 void AggregationResult::add(aku_Timestamp ts, double xs, bool forward) {
     sum += xs;
     if (min > xs) {
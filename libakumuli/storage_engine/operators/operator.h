@@ -12,6 +12,10 @@
 
 #include "akumuli_def.h"
 #include "../nbtree_def.h"
+#include "arena.h"
+
+#include <limits>
+#include <vector>
 
 
 namespace Akumuli {
@@ -24,7 +28,105 @@ enum class AggregationFunction {
     CNT,
     MIN_TIMESTAMP,
     MAX_TIMESTAMP,
-    MEAN
+    MEAN,
+    // Quantiles are computed from raw values (see QuantileSketch)
+    P50,
+    P90,
+    P95,
+    P99,
+    P999,
+    // Values with the smallest and largest timestamps
+    FIRST,
+    LAST,
+    // Smallest and largest timestamps
+    FIRST_TIMESTAMP,
+    LAST_TIMESTAMP,
+};
+
+//! Returns true if the aggregation function is a quantile
+bool is_quantile(AggregationFunction func);
+
+//! Returns quantile (between 0 and 1) of the aggregation function
+double get_quantile(AggregationFunction func);
+
+//! Defines how group-aggregate fills the buckets that don't have any data
+enum class FillMode {
+    NONE,        //! Empty buckets are skipped
+    NULL_VALUE,  //! Empty tuple
+    PREVIOUS,    //! Aggregate of the previous non-empty bucket
+    LINEAR,      //! Linear interpolation between surrounding non-empty buckets
+};
+
+/** Elementwise transformation of the series values.
+  * Transformation doesn't depend on other series so it can be computed by the
+  * storage operator before materialization.
+  */
+struct ValueTransform {
+    enum class Kind {
+        //! x * weight
+        SCALE,
+        //! |x|
+        ABS,
+        //! (x - prev_x) / (t - prev_t), per second (previous value is 0 at t = 0)
+        RATE,
+    };
+    Kind   kind;
+    double weight;
+};
+
+/** Filter that accepts values from the range defined by the lower and upper
+  * bounds (both are optional). Filter can be evaluated by the storage operators,
+  * subtrees that can't contain matching values are not read.
+  */
+struct ValueFilter {
+    enum class Op {
+        //! x > threshold
+        GT,
+        //! x >= threshold
+        GE,
+        //! x < threshold
+        LT,
+        //! x <= threshold
+        LE,
+    };
+
+    double lo_;
+    double hi_;
+    bool lo_incl_;
+    bool hi_incl_;
+    bool enabled_;
+
+    //! C-tor, empty filter accepts all values
+    ValueFilter();
+
+    //! Add condition (filter accepts values that match all conditions)
+    ValueFilter& add(Op op, double threshold);
+
+    //! Returns true if filter has conditions
+    bool is_enabled() const;
+
+    //! Returns true if value matches all conditions (NaN never matches)
+    bool match(double value) const;
+
+    //! Returns true if some value from [min, max] range can match
+    bool match_range(double min, double max) const;
+
+    /** Copy matching values to the output arrays (can be the same as input).
+      * @return number of values copied
+      */
+    size_t apply(aku_Timestamp const* srcts, double const* srcxs, size_t size,
+                 aku_Timestamp* destts, double* destxs) const;
+};
+
+/** Limit and offset of the scan operator. Can be shared by several operators
+  * that are read one after another, in this case it's applied to their
+  * concatenation.
+  */
+struct ScanLimit {
+    //! Number of values that should be skipped
+    u64 offset;
+    //! Max number of values that should be returned after the offset
+    u64 limit;
 };
 
 //! Result of the aggregation operation that has several components.
@@ -51,11 +153,97 @@ struct AggregationResult {
      * @param forward is used to indicate external order of added elements
      */
     void add(aku_Timestamp ts, double xs, bool forward);
+    /**
+     * Add range of values to aggregate.
+     * Result is the same as calling `add` for every element but the
+     * values are processed in bulk.
+     * @param tss is an array of timestamps
+     * @param xss is an array of values
+     * @param size is a size of both arrays
+     * @param forward is used to indicate external order of added elements
+     */
+    void add_range(aku_Timestamp const* tss, double const* xss, size_t size, bool forward);
     //! Combine this value with the other one (inplace update).
     void combine(const AggregationResult& other);
 };
 
 
+/** Mergeable quantile sketch (DDSketch).
+  * Values are mapped to logarithmically sized buckets so the estimated quantile
+  * has bounded relative error. Sketches can be built independently (e.g. by
+  * different workers or for different series) and merged, the result doesn't
+  * depend on the order of values.
+  */
+class QuantileSketch {
+    double gamma_;
+    double lngamma_;
+    //! Bucket `i` contains values from (gamma^(i-1), gamma^i], `off` is an index of the first bucket
+    std::vector<u64> pos_;
+    std::vector<u64> neg_;
+    i32 posoff_;
+    i32 negoff_;
+    //! Number of values that are too small to be mapped to buckets
+    u64 zero_;
+    u64 count_;
+    double min_;
+    double max_;
+
+    i32 get_index(double x) const;
+    double get_value(i32 index) const;
+    static void increment(std::vector<u64>* buckets, i32* off, i32 index, u64 n);
+
+public:
+    //! Values with smaller magnitude are treated as zeroes
+    static constexpr double MIN_VALUE = 1.0E-9;
+
+    /** C-tor.
+      * @param accuracy is a relative error of the estimated quantile (between 0 and 1)
+      */
+    QuantileSketch(double accuracy = 0.01);
+
+    //! Add value to the sketch (NaN values are ignored)
+    void add(double x);
+
+    //! Add all values from the other sketch (sketches should have the same accuracy)
+    void merge(QuantileSketch const& other);
+
+    //! Number of values
+    u64 count() const;
+
+    /** Get quantile estimate.
+      * @param q is a quantile between 0 and 1
+      * @return estimated value or NaN if the sketch is empty
+      */
+    double quantile(double q) const;
+};
+
+
+/** Histogram with fixed bucket layout (native histogram series value).
+  * Bucket `i` contains values from (bounds[i-1], bounds[i]], the last bound can
+  * be infinite. Histograms with the same layout can be merged.
+  */
+struct Histogram {
+    std::vector<double> bounds;  //! Upper bounds of the buckets
+    std::vector<u64>    counts;  //! Number of values in every bucket (not cumulative)
+
+    /** Add counts of the other histogram.
+      * @return false if bucket layouts are different
+      */
+    bool merge(Histogram const& other);
+
+    //! Number of values
+    u64 count() const;
+
+    /** Get quantile estimate. Value is interpolated linearly inside the bucket
+      * (lower bound of the first bucket is 0 unless the upper bound is negative).
+      * If the quantile falls into the bucket with infinite upper bound the lower
+      * bound of this bucket is returned.
+      * @param q is a quantile between 0 and 1
+      * @return estimated value or NaN if the histogram is empty
+      */
+    double quantile(double q) const;
+};
+
 static const AggregationResult INIT_AGGRES = {
     .0,
     .0,
@@ -69,6 +257,63 @@ static const AggregationResult INIT_AGGRES = {
     std::numeric_limits<aku_Timestamp>::lowest(),
 };
 
+/**
+ * Split decoded values into step-aligned bins and aggregate every bin.
+ * Timestamps should be ordered according to the `forward` flag. Bin boundaries
+ * are computed relative to `begin` (bin index is |ts - begin| / step).
+ * @param tss is an array of timestamps
+ * @param xss is an array of values
+ * @param size is a size of both arrays
+ * @param begin is a beginning of the query range
+ * @param step is a bin width
+ * @param forward is an iteration direction
+ * @param destts is a destination for bin timestamps (should have room for `size` elements)
+ * @param destxs is a destination for bin aggregates (should have room for `size` elements)
+ * @return number of bins written
+ */
+size_t aggregate_by_step(aku_Timestamp const* tss,
+                         double const* xss,
+                         size_t size,
+                         aku_Timestamp begin,
+                         u64 step,
+                         bool forward,
+                         aku_Timestamp* destts,
+                         AggregationResult* destxs);
+
+
+/** Aggregates of consecutive buckets stored as a structure of arrays.
+  * Used by the operators that combine group-aggregate results of many series
+  * bucket by bucket. Every component is stored in its own array so the buckets
+  * can be combined in bulk by a branch-free loop that the compiler vectorizes.
+  * Empty bucket has zero count (other components are set to identity values).
+  */
+struct AggregationBuckets {
+    std::vector<double>        cnt;
+    std::vector<double>        sum;
+    std::vector<double>        min;
+    std::vector<double>        max;
+    std::vector<double>        first;
+    std::vector<double>        last;
+    std::vector<aku_Timestamp> mints;
+    std::vector<aku_Timestamp> maxts;
+    std::vector<aku_Timestamp> begin;
+    std::vector<aku_Timestamp> end;
+
+    //! Resize and make all buckets empty
+    void reset(size_t size);
+    //! Number of buckets
+    size_t size() const;
+    //! Replace bucket
+    void set(size_t ix, AggregationResult const& value);
+    //! Read bucket
+    AggregationResult get(size_t ix) const;
+    /** Combine every bucket with the corresponding bucket of `other`.
+      * Result is the same as calling AggregationResult::combine bucket by bucket.
+      * @param other should have the same size
+      */
+    void combine(AggregationBuckets const& other);
+};
+
 
 /** Single series operator.
   * @note all ranges is semi-open. This means that if we're
@@ -76,9 +321,10 @@ static const AggregationResult INIT_AGGRES = {
   *       data in range [A, B), and B timestamp should be
   *       greater (or less if we're reading data in backward
   *       direction) then all timestamps that we've read before.
+  *       Operators are allocated from the query arena if it's available.
   */
 template <class TValue>
-struct SeriesOperator {
+struct SeriesOperator : QueryArenaObject {
 
     //! Iteration direction
     enum class Direction {
@@ -109,7 +355,7 @@ using AggregateOperator = SeriesOperator<AggregationResult>;
 /** This interface is used by column-store internally.
   * It materializes tuples/values and produces a series of aku_Sample values.
   */
-struct ColumnMaterializer {
+struct ColumnMaterializer : QueryArenaObject {
 
     virtual ~ColumnMaterializer() = default;
 
@@ -1,5 +1,8 @@
 #include "scan.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace Akumuli {
 namespace StorageEngine {
 
@@ -34,6 +37,114 @@ RealValuedOperator::Direction ChainOperator::get_direction() {
 }
 
 
+TransformOperator::TransformOperator(std::unique_ptr<RealValuedOperator>&& base, std::vector<ValueTransform> const& fn)
+    : base_(std::move(base))
+    , fn_(fn)
+    , prev_(fn.size(), std::make_pair(aku_Timestamp(0), 0.0))
+{
+}
+
+std::tuple<aku_Status, size_t> TransformOperator::read(aku_Timestamp *destts, double *destval, size_t size) {
+    aku_Status status;
+    size_t ressz;
+    std::tie(status, ressz) = base_->read(destts, destval, size);
+    for (size_t i = 0; i < fn_.size(); i++) {
+        auto const& fn = fn_[i];
+        switch (fn.kind) {
+        case ValueTransform::Kind::SCALE:
+            for (size_t j = 0; j < ressz; j++) {
+                destval[j] *= fn.weight;
+            }
+            break;
+        case ValueTransform::Kind::ABS:
+            for (size_t j = 0; j < ressz; j++) {
+                destval[j] = std::abs(destval[j]);
+            }
+            break;
+        case ValueTransform::Kind::RATE: {
+            const double nsec = 1000000000;
+            aku_Timestamp oldT = prev_[i].first;
+            double oldX = prev_[i].second;
+            for (size_t j = 0; j < ressz; j++) {
+                auto newT = destts[j];
+                double newX = destval[j];
+                destval[j] = (newX - oldX) / (newT - oldT) * nsec;
+                oldT = newT;
+                oldX = newX;
+            }
+            prev_[i] = std::make_pair(oldT, oldX);
+        }
+        break;
+        };
+    }
+    return std::make_tuple(status, ressz);
+}
+
+RealValuedOperator::Direction TransformOperator::get_direction() {
+    return base_->get_direction();
+}
+
+
+LimitOperator::LimitOperator(std::unique_ptr<RealValuedOperator>&& base, std::shared_ptr<ScanLimit> limit)
+    : base_(std::move(base))
+    , limit_(limit)
+{
+}
+
+std::tuple<aku_Status, size_t> LimitOperator::read(aku_Timestamp *destts, double *destval, size_t size) {
+    aku_Status status = AKU_ENO_DATA;
+    size_t accsz = 0;
+    while (accsz < size && limit_->limit != 0) {
+        // Values after the limit are not read
+        u64 toread = std::min(static_cast<u64>(size - accsz),
+                              limit_->offset + std::min(limit_->limit, static_cast<u64>(size)));
+        size_t ressz = 0;
+        std::tie(status, ressz) = base_->read(destts + accsz, destval + accsz, static_cast<size_t>(toread));
+        auto nskip = static_cast<size_t>(std::min(static_cast<u64>(ressz), limit_->offset));
+        limit_->offset -= nskip;
+        auto nout = ressz - nskip;
+        if (nskip != 0) {
+            std::copy(destts + accsz + nskip, destts + accsz + ressz, destts + accsz);
+            std::copy(destval + accsz + nskip, destval + accsz + ressz, destval + accsz);
+        }
+        limit_->limit -= nout;
+        accsz += nout;
+        if (status != AKU_SUCCESS) {
+            return std::make_tuple(status, accsz);
+        }
+    }
+    if (limit_->limit == 0) {
+        status = AKU_ENO_DATA;
+    }
+    return std::make_tuple(status, accsz);
+}
+
+RealValuedOperator::Direction LimitOperator::get_direction() {
+    return base_->get_direction();
+}
+
+
+TimeShiftOperator::TimeShiftOperator(std::unique_ptr<RealValuedOperator>&& base, aku_Timestamp shift)
+    : base_(std::move(base))
+    , shift_(shift)
+{
+}
+
+std::tuple<aku_Status, size_t> TimeShiftOperator::read(aku_Timestamp *destts, double *destval, size_t size) {
+    aku_Status status;
+    size_t ressz;
+    std::tie(status, ressz) = base_->read(destts, destval, size);
+    for (size_t i = 0; i < ressz; i++) {
+        destts[i] += shift_;
+    }
+    return std::make_tuple(status, ressz);
+}
+
+RealValuedOperator::Direction TimeShiftOperator::get_direction() {
+    return base_->get_direction();
+}
+
+
 ChainMaterializer::ChainMaterializer(std::vector<aku_ParamId>&& ids, std::vector<std::unique_ptr<RealValuedOperator>>&& it)
     : iters_(std::move(it))
     , ids_(std::move(ids))
@@ -40,6 +40,49 @@ struct ChainOperator : RealValuedOperator {
 };
 
 
+/** Applies list of transformations to the values of the underlying operator.
+  */
+struct TransformOperator : RealValuedOperator {
+    std::unique_ptr<RealValuedOperator> base_;
+    std::vector<ValueTransform> fn_;
+    //! Previous timestamp and value (used by RATE transform)
+    std::vector<std::pair<aku_Timestamp, double>> prev_;
+
+    TransformOperator(std::unique_ptr<RealValuedOperator>&& base, std::vector<ValueTransform> const& fn);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, double *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
+/** Skips first `offset` values of the underlying operator and stops after
+  * `limit` values. Limit is updated during iteration.
+  */
+struct LimitOperator : RealValuedOperator {
+    std::unique_ptr<RealValuedOperator> base_;
+    std::shared_ptr<ScanLimit> limit_;
+
+    LimitOperator(std::unique_ptr<RealValuedOperator>&& base, std::shared_ptr<ScanLimit> limit);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, double *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
+/** Moves timestamps of the underlying operator forward by `shift`.
+  * Used to align the range read in the past with the query range.
+  */
+struct TimeShiftOperator : RealValuedOperator {
+    std::unique_ptr<RealValuedOperator> base_;
+    const aku_Timestamp shift_;
+
+    TimeShiftOperator(std::unique_ptr<RealValuedOperator>&& base, aku_Timestamp shift);
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp *destts, double *destval, size_t size);
+    virtual Direction get_direction();
+};
+
+
 /**
  * Materializes list of columns by chaining them
  */
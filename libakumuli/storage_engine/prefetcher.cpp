@@ -0,0 +1,189 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "prefetcher.h"
+#include "log_iface.h"
+#include "util.h"
+
+#include <limits>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static aku_Timestamp absdiff(aku_Timestamp a, aku_Timestamp b) {
+    return a > b ? a - b : b - a;
+}
+
+RangePrefetcher::RangePrefetcher(size_t max_blocks, size_t max_history)
+    : max_blocks_(max_blocks)
+    , max_history_(std::max(static_cast<size_t>(NSHARDS), max_history))
+    , inprogress_(false)
+    , stop_(false)
+    , observed_{0}
+    , scheduled_{0}
+    , dropped_{0}
+    , loaded_{0}
+{
+    worker_ = std::thread(&RangePrefetcher::run, this);
+}
+
+RangePrefetcher::~RangePrefetcher() {
+    stop();
+}
+
+void RangePrefetcher::stop() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+        pending_.clear();
+    }
+    cvar_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+bool RangePrefetcher::predict(Range prev, Range curr, Range* next) {
+    const aku_Timestamp MAX_TS = std::numeric_limits<aku_Timestamp>::max();
+    aku_Timestamp pwidth = prev.end - prev.begin;
+    aku_Timestamp width  = curr.end - curr.begin;
+    if (pwidth == 0 || width == 0) {
+        return false;
+    }
+    // Dashboards round the range boundaries so some slack is allowed
+    aku_Timestamp slack = std::max(width, pwidth) / 16;
+    if (absdiff(width, pwidth) <= slack) {
+        if (curr.begin < prev.begin && absdiff(curr.end, prev.begin) <= slack) {
+            // Pan left
+            if (curr.begin == 0) {
+                return false;
+            }
+            next->begin = curr.begin > width ? curr.begin - width : 0;
+            next->end   = curr.begin;
+            return true;
+        }
+        if (curr.begin > prev.begin && absdiff(curr.begin, prev.end) <= slack) {
+            // Pan right
+            if (curr.end == MAX_TS) {
+                return false;
+            }
+            next->begin = curr.end;
+            next->end   = MAX_TS - curr.end > width ? curr.end + width : MAX_TS;
+            return true;
+        }
+        return false;
+    }
+    if (curr.begin <= prev.begin && curr.end >= prev.end && width >= pwidth + pwidth / 2) {
+        // Zoom out, the next step is likely to have the same ratio
+        double ratio = static_cast<double>(width) / static_cast<double>(pwidth);
+        double nwidth = std::min(static_cast<double>(width) * ratio, static_cast<double>(MAX_TS));
+        aku_Timestamp half = static_cast<aku_Timestamp>(nwidth / 2);
+        aku_Timestamp mid  = curr.begin + width / 2;
+        next->begin = mid > half ? mid - half : 0;
+        next->end   = MAX_TS - mid > half ? mid + half : MAX_TS;
+        return true;
+    }
+    return false;
+}
+
+void RangePrefetcher::observe(aku_ParamId id,
+                              aku_Timestamp begin,
+                              aku_Timestamp end,
+                              std::shared_ptr<NBTreeExtentsList> const& column)
+{
+    observed_++;
+    Range curr = { std::min(begin, end), std::max(begin, end) };
+    Range prev, next;
+    bool found = false;
+    {
+        auto& shard = history_.at(id & (NSHARDS - 1));
+        std::lock_guard<std::mutex> lock(shard.lock);
+        auto it = shard.ranges.find(id);
+        if (it != shard.ranges.end()) {
+            prev = it->second;
+            it->second = curr;
+            found = true;
+        } else {
+            if (shard.ranges.size() >= max_history_ / NSHARDS) {
+                shard.ranges.clear();
+            }
+            shard.ranges.insert(std::make_pair(id, curr));
+        }
+    }
+    if (!found || !predict(prev, curr, &next)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (stop_) {
+            return;
+        }
+        if (pending_.size() >= MAX_PENDING) {
+            dropped_++;
+            return;
+        }
+        Item item = { next, column };
+        pending_.push_back(std::move(item));
+    }
+    scheduled_++;
+    cvar_.notify_one();
+}
+
+void RangePrefetcher::wait() {
+    std::unique_lock<std::mutex> lock(lock_);
+    cvar_.wait(lock, [this] {
+        return stop_ || (pending_.empty() && !inprogress_);
+    });
+}
+
+RangePrefetcher::Stats RangePrefetcher::get_stats() const {
+    Stats stats = {};
+    stats.observed  = observed_.load();
+    stats.scheduled = scheduled_.load();
+    stats.dropped   = dropped_.load();
+    stats.loaded    = loaded_.load();
+    return stats;
+}
+
+void RangePrefetcher::run() {
+    set_thread_name("prefetch");
+    apply_thread_policy(AKU_THREAD_BACKGROUND);
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        cvar_.wait(lock, [this] {
+            return stop_ || !pending_.empty();
+        });
+        if (stop_) {
+            break;
+        }
+        Item item = std::move(pending_.front());
+        pending_.pop_front();
+        inprogress_ = true;
+        lock.unlock();
+        try {
+            loaded_ += item.column->prefetch(item.range.begin, item.range.end, max_blocks_);
+        } catch (std::exception const& e) {
+            // Prefetch is an optimization, the query will report the error if any
+            Logger::msg(AKU_LOG_ERROR, std::string("Prefetch failed: ") + e.what());
+        }
+        lock.lock();
+        inprogress_ = false;
+        cvar_.notify_all();
+    }
+}
+
+}}  // namespace
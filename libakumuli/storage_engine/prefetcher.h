@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/nbtree.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Predictive prefetch of the query ranges.
+  * Dashboards usually walk the time axis: the next query reads the adjacent
+  * range (pan) or the wider range that contains the previous one (zoom out).
+  * Prefetcher remembers the last queried range of every column, detects these
+  * patterns and loads nodes of the predicted range into the block cache using
+  * the background thread, so the next query doesn't have to wait for I/O.
+  */
+class RangePrefetcher {
+public:
+    struct Range {
+        aku_Timestamp begin;  //! Inclusive, always less or equal to `end`
+        aku_Timestamp end;
+    };
+
+    struct Stats {
+        //! Number of observed queries
+        u64 observed;
+        //! Number of scheduled prefetches
+        u64 scheduled;
+        //! Number of prefetches dropped because the queue was full
+        u64 dropped;
+        //! Number of blocks loaded by the worker
+        u64 loaded;
+    };
+
+private:
+    //! Number of shards of the history table (should be a power of two)
+    enum { NSHARDS = 16 };
+    //! Max number of pending prefetches, new ones are dropped if the queue is full
+    enum { MAX_PENDING = 1024 };
+
+    struct HistoryShard {
+        std::mutex lock;
+        std::unordered_map<aku_ParamId, Range> ranges;
+    };
+
+    struct Item {
+        Range range;
+        std::shared_ptr<NBTreeExtentsList> column;
+    };
+
+    const size_t max_blocks_;
+    const size_t max_history_;
+    std::array<HistoryShard, NSHARDS> history_;
+
+    //! Protects `pending_`, `inprogress_` and `stop_`
+    std::mutex lock_;
+    std::condition_variable cvar_;
+    std::deque<Item> pending_;
+    bool inprogress_;
+    bool stop_;
+    std::thread worker_;
+
+    std::atomic<u64> observed_;
+    std::atomic<u64> scheduled_;
+    std::atomic<u64> dropped_;
+    std::atomic<u64> loaded_;
+
+    void run();
+
+public:
+    /** C-tor.
+      * @param max_blocks is a max number of blocks loaded per prediction
+      * @param max_history is a max number of tracked columns (history is reset when exceeded)
+      */
+    RangePrefetcher(size_t max_blocks, size_t max_history = 0x10000);
+
+    ~RangePrefetcher();
+
+    RangePrefetcher(RangePrefetcher const&) = delete;
+    RangePrefetcher& operator = (RangePrefetcher const&) = delete;
+
+    /** Predict the next range using the current and the previous ranges.
+      * @return true if pan or zoom out was detected, `next` is set in this case
+      */
+    static bool predict(Range prev, Range curr, Range* next);
+
+    /** Record the query range of the column and schedule prefetch of the predicted range.
+      * Can be called concurrently, doesn't block on I/O.
+      */
+    void observe(aku_ParamId id, aku_Timestamp begin, aku_Timestamp end, std::shared_ptr<NBTreeExtentsList> const& column);
+
+    //! Wait until all scheduled prefetches will be completed
+    void wait();
+
+    //! Stop the worker, scheduled prefetches are discarded
+    void stop();
+
+    Stats get_stats() const;
+};
+
+}}  // namespace
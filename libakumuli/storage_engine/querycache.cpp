@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "querycache.h"
+#include "log_iface.h"
+#include "status_util.h"
+#include "operators/aggregate.h"
+
+#include <algorithm>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+size_t GroupAggregateCache::KeyHash::operator () (Key const& key) const {
+    size_t h = std::hash<aku_ParamId>()(key.id);
+    h ^= std::hash<aku_Timestamp>()(key.step) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    h ^= std::hash<aku_Timestamp>()(key.phase) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+}
+
+GroupAggregateCache::GroupAggregateCache(size_t capacity)
+    : capacity_(capacity / (sizeof(aku_Timestamp) + sizeof(AggregationResult)))
+    , size_(0)
+{
+}
+
+size_t GroupAggregateCache::_get_size() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return size_;
+}
+
+void GroupAggregateCache::evict() {
+    // Empty entries should be evicted too, so every entry costs at least one bucket
+    while (size_ > capacity_ && !lru_.empty()) {
+        auto it = entries_.find(lru_.back());
+        size_ -= it->second.ts.size() + 1;
+        entries_.erase(it);
+        lru_.pop_back();
+    }
+}
+
+//! Compute buckets of the range [lo, hi) from the tree
+static aku_Status compute_buckets(NBTreeExtentsList const& tree, aku_Timestamp lo, aku_Timestamp hi, aku_Timestamp step,
+                                  std::vector<aku_Timestamp>* ts, std::vector<AggregationResult>* xs)
+{
+    const size_t SZBUF = 0x100;
+    std::vector<aku_Timestamp> outts(SZBUF, 0);
+    std::vector<AggregationResult> outxs(SZBUF, INIT_AGGRES);
+    auto it = tree.group_aggregate(lo, hi, step);
+    aku_Status status = AKU_SUCCESS;
+    size_t size = 0;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = it->read(outts.data(), outxs.data(), SZBUF);
+        for (size_t i = 0; i < size; i++) {
+            auto const& agg = outxs[i];
+            ts->push_back(lo + (agg._begin - lo) / step * step);
+            xs->push_back(agg);
+        }
+        if (size == 0 && status == AKU_SUCCESS) {
+            // Group-aggregate operator can return empty result instead of AKU_ENO_DATA
+            status = AKU_ENO_DATA;
+        }
+    }
+    return status == AKU_ENO_DATA ? AKU_SUCCESS : status;
+}
+
+aku_Status GroupAggregateCache::get_buckets(Key const& key, NBTreeExtentsList const& tree, aku_Timestamp lo, aku_Timestamp hi,
+                                            std::vector<aku_Timestamp>* ts, std::vector<AggregationResult>* xs)
+{
+    // Copy cached part of the range
+    bool found = false;
+    aku_Timestamp elo = 0, ehi = 0;
+    std::vector<aku_Timestamp> cts;
+    std::vector<AggregationResult> cxs;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            auto const& entry = it->second;
+            lru_.splice(lru_.begin(), lru_, entry.lru);
+            if (lo <= entry.hi && entry.lo <= hi) {
+                found = true;
+                elo = entry.lo;
+                ehi = entry.hi;
+                auto first = std::lower_bound(entry.ts.begin(), entry.ts.end(), lo);
+                auto last = std::lower_bound(first, entry.ts.end(), hi);
+                auto xfirst = entry.xs.begin() + std::distance(entry.ts.begin(), first);
+                auto xlast = entry.xs.begin() + std::distance(entry.ts.begin(), last);
+                cts.assign(first, last);
+                cxs.assign(xfirst, xlast);
+            }
+        }
+    }
+    // Compute missing buckets
+    std::vector<aku_Timestamp> hts, tts;
+    std::vector<AggregationResult> hxs, txs;
+    aku_Status status = AKU_SUCCESS;
+    if (!found) {
+        status = compute_buckets(tree, lo, hi, key.step, &hts, &hxs);
+    } else {
+        if (lo < elo) {
+            status = compute_buckets(tree, lo, elo, key.step, &hts, &hxs);
+        }
+        if (status == AKU_SUCCESS && ehi < hi) {
+            status = compute_buckets(tree, ehi, hi, key.step, &tts, &txs);
+        }
+    }
+    if (status != AKU_SUCCESS) {
+        Logger::msg(AKU_LOG_ERROR, "Can't compute group-aggregate for " + std::to_string(key.id) +
+                    ", error: " + StatusUtil::str(status));
+        return status;
+    }
+    ts->insert(ts->end(), hts.begin(), hts.end());
+    ts->insert(ts->end(), cts.begin(), cts.end());
+    ts->insert(ts->end(), tts.begin(), tts.end());
+    xs->insert(xs->end(), hxs.begin(), hxs.end());
+    xs->insert(xs->end(), cxs.begin(), cxs.end());
+    xs->insert(xs->end(), txs.begin(), txs.end());
+    // Update the cache
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        lru_.push_front(key);
+        Entry entry = { lo, hi, *ts, *xs, lru_.begin() };
+        size_ += entry.ts.size() + 1;
+        entries_.insert(std::make_pair(key, std::move(entry)));
+    } else if (!found) {
+        // Ranges don't overlap, new range replaces the old one
+        auto& entry = it->second;
+        size_ -= entry.ts.size();
+        entry.lo = lo;
+        entry.hi = hi;
+        entry.ts = *ts;
+        entry.xs = *xs;
+        size_ += entry.ts.size();
+    } else if (it->second.lo == elo && it->second.hi == ehi) {
+        auto& entry = it->second;
+        entry.ts.insert(entry.ts.begin(), hts.begin(), hts.end());
+        entry.xs.insert(entry.xs.begin(), hxs.begin(), hxs.end());
+        entry.ts.insert(entry.ts.end(), tts.begin(), tts.end());
+        entry.xs.insert(entry.xs.end(), txs.begin(), txs.end());
+        entry.lo = std::min(entry.lo, lo);
+        entry.hi = std::max(entry.hi, hi);
+        size_ += hts.size() + tts.size();
+    }
+    // Otherwise the entry was updated concurrently, the result is not cached
+    evict();
+    return AKU_SUCCESS;
+}
+
+std::unique_ptr<AggregateOperator> GroupAggregateCache::group_aggregate(aku_ParamId id,
+                                                                        NBTreeExtentsList const& tree,
+                                                                        aku_Timestamp begin,
+                                                                        aku_Timestamp end,
+                                                                        aku_Timestamp step)
+{
+    std::unique_ptr<AggregateOperator> result;
+    if (step == 0 || begin == end || capacity_ == 0) {
+        return result;
+    }
+    // Range of the buckets that are completely inside the query range [lo, hi),
+    // backward query bucket `k` is (begin - (k+1)*step, begin - k*step]
+    const bool forward = begin < end;
+    aku_Timestamp lo, hi;
+    if (forward) {
+        lo = begin;
+        hi = begin + (end - begin) / step * step;
+    } else {
+        if (begin == AKU_MAX_TIMESTAMP) {
+            return result;
+        }
+        hi = begin + 1;
+        lo = hi - (begin - end) / step * step;
+    }
+    const aku_Timestamp phase = lo % step;
+    // Bucket that contains the last value can still change
+    auto last = tree.get_last_timestamp();
+    if (last < phase) {
+        return result;
+    }
+    hi = std::min(hi, phase + (last - phase) / step * step);
+    if (hi <= lo) {
+        return result;
+    }
+    Key key = { id, step, phase };
+    std::vector<aku_Timestamp> ts;
+    std::vector<AggregationResult> xs;
+    if (get_buckets(key, tree, lo, hi, &ts, &xs) != AKU_SUCCESS) {
+        return result;
+    }
+    std::vector<std::unique_ptr<AggregateOperator>> iters;
+    std::unique_ptr<PrecomputedAggregateOperator> cached;
+    if (forward) {
+        cached.reset(new PrecomputedAggregateOperator(AggregateOperator::Direction::FORWARD));
+        for (auto const& agg: xs) {
+            cached->ts_.push_back(agg._begin);
+        }
+        cached->xs_ = std::move(xs);
+        iters.push_back(std::move(cached));
+        if (hi < end) {
+            iters.push_back(tree.group_aggregate(hi, end, step));
+        }
+    } else {
+        cached.reset(new PrecomputedAggregateOperator(AggregateOperator::Direction::BACKWARD));
+        for (auto it = xs.rbegin(); it != xs.rend(); it++) {
+            // Buckets were computed in forward direction
+            auto agg = *it;
+            std::swap(agg.first, agg.last);
+            cached->ts_.push_back(agg._begin);
+            cached->xs_.push_back(agg);
+        }
+        if (hi <= begin) {
+            iters.push_back(tree.group_aggregate(begin, hi - 1, step));
+        }
+        iters.push_back(std::move(cached));
+        if (lo - 1 > end) {
+            iters.push_back(tree.group_aggregate(lo - 1, end, step));
+        }
+    }
+    result.reset(new CombineGroupAggregateOperator(begin, step, std::move(iters)));
+    return result;
+}
+
+}}  // namespace
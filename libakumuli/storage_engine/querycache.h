@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/nbtree.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Group-aggregate results cache.
+  * Query is normalized to the list of time buckets of the individual column. The
+  * bucket is defined by the step and the offset of the first bucket (phase), the
+  * query direction and the range don't matter, so the same buckets are shared by
+  * all queries with the same step and alignment (aggregation functions are applied
+  * later during materialization).
+  * Only buckets older than the last value of the column are cached, these buckets
+  * can't be changed because late writes are rejected. The tail of the range is
+  * always computed from the tree.
+  * Every entry contains contiguous range of buckets. Query that overlaps or touches
+  * the range extends it with the missing buckets. Entries are evicted in LRU order.
+  */
+class GroupAggregateCache {
+    struct Key {
+        aku_ParamId   id;
+        aku_Timestamp step;
+        aku_Timestamp phase;
+
+        bool operator == (Key const& other) const {
+            return id == other.id && step == other.step && phase == other.phase;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator () (Key const& key) const;
+    };
+
+    struct Entry {
+        //! Range of cached buckets [lo, hi)
+        aku_Timestamp lo;
+        aku_Timestamp hi;
+        //! Start timestamps of the non-empty buckets
+        std::vector<aku_Timestamp>     ts;
+        std::vector<AggregationResult> xs;
+        std::list<Key>::iterator       lru;
+    };
+
+    //! Max number of buckets in the cache
+    const size_t capacity_;
+    //! Number of buckets in the cache
+    size_t size_;
+    mutable std::mutex lock_;
+    std::unordered_map<Key, Entry, KeyHash> entries_;
+    //! Most recently used keys at the front
+    std::list<Key> lru_;
+
+    /** Get buckets from the range [lo, hi) (the range should be aligned), compute
+      * missing buckets from the tree and update the cache.
+      */
+    aku_Status get_buckets(Key const& key, NBTreeExtentsList const& tree, aku_Timestamp lo, aku_Timestamp hi,
+                           std::vector<aku_Timestamp>* ts, std::vector<AggregationResult>* xs);
+
+    void evict();
+
+public:
+    //! C-tor. Capacity is a size limit in bytes.
+    GroupAggregateCache(size_t capacity);
+
+    GroupAggregateCache(GroupAggregateCache const&) = delete;
+    GroupAggregateCache& operator = (GroupAggregateCache const&) = delete;
+
+    /** Create group-aggregate operator that uses cached buckets.
+      * @return operator or empty pointer if the query can't be cached
+      */
+    std::unique_ptr<AggregateOperator> group_aggregate(aku_ParamId id,
+                                                       NBTreeExtentsList const& tree,
+                                                       aku_Timestamp begin,
+                                                       aku_Timestamp end,
+                                                       aku_Timestamp step);
+
+    //! Number of cached buckets (for tests)
+    size_t _get_size() const;
+};
+
+}}  // namespace
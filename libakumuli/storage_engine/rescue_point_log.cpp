@@ -0,0 +1,255 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "rescue_point_log.h"
+#include "log_iface.h"
+#include "crc32c.h"
+
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+static const u32 RPLOG_MAGIC = 0x4C504B41;  // "AKPL"
+
+//! Number of rescue points that marks removed column
+static const u16 REMOVED = std::numeric_limits<u16>::max();
+
+struct RecordHeader {
+    u32 magic;
+    u32 payload_size;
+    u32 crc;       //! Payload checksum
+} __attribute__((packed));
+
+static u32 checksum(const char* data, size_t size) {
+    static crc32c_impl_t crc32c = chose_crc32c_implementation();
+    return crc32c(0, data, size);
+}
+
+template<class T>
+static void put(std::vector<char>* buf, T value) {
+    auto p = reinterpret_cast<const char*>(&value);
+    buf->insert(buf->end(), p, p + sizeof(T));
+}
+
+template<class T>
+static bool get(const char** pos, const char* end, T* value) {
+    if (static_cast<size_t>(end - *pos) < sizeof(T)) {
+        return false;
+    }
+    memcpy(value, *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+}
+
+RescuePointLog::RescuePointLog(std::string path)
+    : path_(std::move(path))
+    , fd_(-1)
+    , size_(0)
+{
+}
+
+RescuePointLog::~RescuePointLog() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+aku_Status RescuePointLog::open(bool read_only) {
+    if (read_only) {
+        fd_ = ::open(path_.c_str(), O_RDONLY);
+        if (fd_ < 0 && errno == ENOENT) {
+            return AKU_ENOT_FOUND;
+        }
+    } else {
+        fd_ = ::open(path_.c_str(), O_RDWR|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP);
+    }
+    if (fd_ < 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't open " + path_ + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    std::vector<char> buf;
+    char chunk[0x10000];
+    while (true) {
+        auto nread = ::read(fd_, chunk, sizeof(chunk));
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::msg(AKU_LOG_ERROR, "Can't read " + path_ + ", error: " + strerror(errno));
+            return AKU_EGENERAL;
+        }
+        if (nread == 0) {
+            break;
+        }
+        buf.insert(buf.end(), chunk, chunk + nread);
+    }
+    const char* begin = buf.data();
+    const char* end = begin + buf.size();
+    const char* pos = begin;
+    while (pos != end) {
+        RecordHeader header;
+        const char* record = pos;
+        if (!get(&pos, end, &header) ||
+            header.magic != RPLOG_MAGIC ||
+            header.payload_size > static_cast<u64>(end - pos) ||
+            header.crc != checksum(pos, header.payload_size))
+        {
+            pos = record;
+            break;
+        }
+        const char* payload_end = pos + header.payload_size;
+        while (pos != payload_end) {
+            aku_ParamId id;
+            u16 naddr;
+            if (!get(&pos, payload_end, &id) || !get(&pos, payload_end, &naddr)) {
+                // Checksum is correct so the record is written by incompatible version
+                Logger::msg(AKU_LOG_ERROR, "Can't parse " + path_);
+                return AKU_EBAD_DATA;
+            }
+            if (naddr == REMOVED) {
+                updates_.erase(id);
+                removed_.insert(id);
+                continue;
+            }
+            std::vector<LogicAddr> addrlist(naddr);
+            for (auto& addr: addrlist) {
+                if (!get(&pos, payload_end, &addr)) {
+                    Logger::msg(AKU_LOG_ERROR, "Can't parse " + path_);
+                    return AKU_EBAD_DATA;
+                }
+            }
+            updates_[id] = std::move(addrlist);
+        }
+    }
+    size_ = static_cast<u64>(pos - begin);
+    if (pos != end && !read_only) {
+        Logger::msg(AKU_LOG_INFO, "Damaged tail of the " + path_ + " is discarded, " +
+                                  std::to_string(end - pos) + " bytes");
+        if (ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+            Logger::msg(AKU_LOG_ERROR, "Can't truncate " + path_ + ", error: " + strerror(errno));
+            return AKU_EGENERAL;
+        }
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status RescuePointLog::write_record(std::vector<char>* buf) {
+    RecordHeader header = {};
+    header.magic = RPLOG_MAGIC;
+    header.payload_size = static_cast<u32>(buf->size() - sizeof(RecordHeader));
+    header.crc = checksum(buf->data() + sizeof(RecordHeader), header.payload_size);
+    memcpy(buf->data(), &header, sizeof(header));
+    for (size_t pos = 0; pos < buf->size();) {
+        auto nwritten = ::write(fd_, buf->data() + pos, buf->size() - pos);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Logger::msg(AKU_LOG_ERROR, "Can't write " + path_ + ", error: " + strerror(errno));
+            // Partially written record shouldn't be followed by the next one
+            if (ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+                Logger::msg(AKU_LOG_ERROR, "Can't truncate " + path_ + ", error: " + strerror(errno));
+            }
+            return AKU_EGENERAL;
+        }
+        pos += static_cast<size_t>(nwritten);
+    }
+    size_ += buf->size();
+    if (fdatasync(fd_) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't sync " + path_ + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    return AKU_SUCCESS;
+}
+
+aku_Status RescuePointLog::append(MappingT const& batch) {
+    if (batch.empty()) {
+        return AKU_SUCCESS;
+    }
+    std::vector<char> buf(sizeof(RecordHeader));
+    for (auto const& kv: batch) {
+        if (kv.second.size() >= REMOVED) {
+            return AKU_EBAD_ARG;
+        }
+        put(&buf, kv.first);
+        put(&buf, static_cast<u16>(kv.second.size()));
+        for (auto addr: kv.second) {
+            put(&buf, addr);
+        }
+    }
+    if (buf.size() > std::numeric_limits<u32>::max()) {
+        return AKU_EOVERFLOW;
+    }
+    auto status = write_record(&buf);
+    if (status == AKU_SUCCESS) {
+        for (auto const& kv: batch) {
+            updates_[kv.first] = kv.second;
+        }
+    }
+    return status;
+}
+
+aku_Status RescuePointLog::remove(std::vector<aku_ParamId> const& ids) {
+    if (ids.empty()) {
+        return AKU_SUCCESS;
+    }
+    std::vector<char> buf(sizeof(RecordHeader));
+    for (auto id: ids) {
+        put(&buf, id);
+        put(&buf, REMOVED);
+    }
+    if (buf.size() > std::numeric_limits<u32>::max()) {
+        return AKU_EOVERFLOW;
+    }
+    auto status = write_record(&buf);
+    if (status == AKU_SUCCESS) {
+        for (auto id: ids) {
+            updates_.erase(id);
+            removed_.insert(id);
+        }
+    }
+    return status;
+}
+
+u64 RescuePointLog::size() const {
+    return size_;
+}
+
+void RescuePointLog::take_entries(MappingT* updates, IdSetT* removed) {
+    std::swap(*updates, updates_);
+    std::swap(*removed, removed_);
+    updates_.clear();
+    removed_.clear();
+}
+
+aku_Status RescuePointLog::reset() {
+    if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't truncate " + path_ + ", error: " + strerror(errno));
+        return AKU_EGENERAL;
+    }
+    size_ = 0;
+    return AKU_SUCCESS;
+}
+
+}
+}  // namespaces
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/blockstore.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Append-only log of the rescue point updates.
+  * Every sync appends one checksummed record with the rescue points of all
+  * updated columns instead of updating the metadata storage. Latest state of
+  * every column is merged in memory and saved to the metadata storage when the
+  * log grows large (compaction), after that the log is truncated. Records that
+  * weren't compacted are replayed on startup, damaged tail (write interrupted
+  * by the crash) is discarded.
+  * Not thread safe, used by the sync thread only.
+  */
+class RescuePointLog {
+public:
+    typedef std::unordered_map<aku_ParamId, std::vector<LogicAddr>> MappingT;
+    typedef std::unordered_set<aku_ParamId> IdSetT;
+
+private:
+    std::string path_;
+    int         fd_;
+    u64         size_;
+    //! Latest rescue points of the columns updated since the last compaction
+    MappingT    updates_;
+    //! Columns removed since the last compaction
+    IdSetT      removed_;
+
+    aku_Status write_record(std::vector<char>* buf);
+
+public:
+    explicit RescuePointLog(std::string path);
+
+    ~RescuePointLog();
+
+    /** Read the log and open it for writing.
+      * Content of the log can be accessed using `take_entries`.
+      * @param read_only if set the log is only read (damaged tail is not discarded,
+      *        AKU_ENOT_FOUND is returned if the log doesn't exist)
+      */
+    aku_Status open(bool read_only = false);
+
+    //! Append rescue points of several columns (one record)
+    aku_Status append(MappingT const& batch);
+
+    //! Append removal of the columns (one record)
+    aku_Status remove(std::vector<aku_ParamId> const& ids);
+
+    //! Size of the log in bytes
+    u64 size() const;
+
+    /** Take latest state of the columns stored in the log. Log should be
+      * truncated using `reset` after the entries are saved.
+      * @param updates receives latest rescue points of the updated columns
+      * @param removed receives ids of the removed columns
+      */
+    void take_entries(MappingT* updates, IdSetT* removed);
+
+    //! Truncate the log
+    aku_Status reset();
+};
+
+}
+}  // namespaces
@@ -0,0 +1,293 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "rollup.h"
+#include "log_iface.h"
+#include "status_util.h"
+#include "operators/aggregate.h"
+
+#include <algorithm>
+
+namespace Akumuli {
+namespace StorageEngine {
+
+RollupStore::RollupStore(std::vector<aku_Timestamp> const& steps)
+    : steps_(steps)
+    , inprogress_(0)
+    , stop_(false)
+{
+    assert(std::is_sorted(steps_.begin(), steps_.end()));
+    worker_ = std::thread(&RollupStore::run, this);
+}
+
+RollupStore::~RollupStore() {
+    stop();
+}
+
+void RollupStore::stop() {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+        pending_.clear();
+    }
+    cvar_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+void RollupStore::remove(aku_ParamId id) {
+    // Update that is already in progress can add the column back, the worker is
+    // not waited for because it can be busy for a long time under write load
+    std::lock_guard<std::mutex> lock(lock_);
+    pending_.erase(id);
+    columns_.erase(id);
+}
+
+void RollupStore::notify(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree, aku_Timestamp watermark) {
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (stop_) {
+            return;
+        }
+        auto it = pending_.find(id);
+        if (it == pending_.end()) {
+            Update upd = { std::move(tree), watermark };
+            pending_.insert(std::make_pair(id, std::move(upd)));
+        } else {
+            it->second.watermark = std::max(it->second.watermark, watermark);
+        }
+    }
+    cvar_.notify_all();
+}
+
+void RollupStore::wait() {
+    std::unique_lock<std::mutex> lock(lock_);
+    cvar_.wait(lock, [this] {
+        return stop_ || (pending_.empty() && inprogress_ == 0);
+    });
+}
+
+void RollupStore::run() {
+    set_thread_name("rollup-worker");
+    apply_thread_policy(AKU_THREAD_BACKGROUND);
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        cvar_.wait(lock, [this] {
+            return stop_ || !pending_.empty();
+        });
+        if (stop_) {
+            break;
+        }
+        std::unordered_map<aku_ParamId, Update> batch;
+        batch.swap(pending_);
+        inprogress_ = batch.size();
+        lock.unlock();
+        for (auto const& kv: batch) {
+            update(kv.first, kv.second);
+        }
+        lock.lock();
+        inprogress_ = 0;
+        cvar_.notify_all();
+    }
+}
+
+std::shared_ptr<RollupStore::Column> RollupStore::find_column(aku_ParamId id) const {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = columns_.find(id);
+    if (it != columns_.end()) {
+        return it->second;
+    }
+    return std::shared_ptr<Column>();
+}
+
+void RollupStore::update(aku_ParamId id, Update const& upd) {
+    auto column = find_column(id);
+    if (!column) {
+        column = std::make_shared<Column>();
+        column->tiers.resize(steps_.size());
+        for (auto& tier: column->tiers) {
+            tier.done = 0;
+        }
+        std::lock_guard<std::mutex> lock(lock_);
+        columns_[id] = column;
+    }
+    const size_t SZBUF = 0x100;
+    std::vector<aku_Timestamp> outts(SZBUF, 0);
+    std::vector<AggregationResult> outxs(SZBUF, INIT_AGGRES);
+    for (size_t ix = 0; ix < steps_.size(); ix++) {
+        auto step = steps_[ix];
+        // Values of the bucket that contains the watermark can still be written,
+        // everything before this bucket is final. Only the worker changes `done`
+        // so it can be read without the lock.
+        aku_Timestamp limit = upd.watermark - upd.watermark % step;
+        aku_Timestamp done = column->tiers[ix].done;
+        if (limit <= done) {
+            continue;
+        }
+        std::vector<aku_Timestamp> ts;
+        std::vector<AggregationResult> xs;
+        auto it = upd.tree->group_aggregate(done, limit, step);
+        aku_Status status = AKU_SUCCESS;
+        size_t size = 0;
+        while (status == AKU_SUCCESS) {
+            std::tie(status, size) = it->read(outts.data(), outxs.data(), SZBUF);
+            for (size_t i = 0; i < size; i++) {
+                auto const& agg = outxs[i];
+                ts.push_back(agg._begin - agg._begin % step);
+                xs.push_back(agg);
+            }
+            if (size == 0 && status == AKU_SUCCESS) {
+                // Group-aggregate operator can return empty result instead of AKU_ENO_DATA
+                status = AKU_ENO_DATA;
+            }
+        }
+        if (status != AKU_ENO_DATA) {
+            // Tier will be updated on next commit
+            Logger::msg(AKU_LOG_ERROR, "Can't update rollup for " + std::to_string(id) +
+                        ", error: " + StatusUtil::str(status));
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(column->lock);
+        auto& tier = column->tiers[ix];
+        tier.ts.insert(tier.ts.end(), ts.begin(), ts.end());
+        tier.xs.insert(tier.xs.end(), xs.begin(), xs.end());
+        tier.done = limit;
+    }
+}
+
+int RollupStore::choose_tier(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) const {
+    // Query buckets should consist of whole tier buckets. Forward query bucket
+    // starts at `begin + k*step`, backward query bucket ends at `begin - k*step`.
+    for (int ix = static_cast<int>(steps_.size()) - 1; ix >= 0; ix--) {
+        auto width = steps_[static_cast<size_t>(ix)];
+        if (step % width != 0) {
+            continue;
+        }
+        if (begin < end ? begin % width == 0 : (begin + 1) % width == 0) {
+            return ix;
+        }
+    }
+    return -1;
+}
+
+//! Combine tier buckets that belong to the same query bucket
+template<class TsIt, class XsIt>
+static void combine_buckets(TsIt tsbegin, TsIt tsend, XsIt xsbegin, aku_Timestamp begin, aku_Timestamp step,
+                            bool forward, PrecomputedAggregateOperator* dest)
+{
+    u64 lastbin = 0;
+    for (auto it = tsbegin; it != tsend; it++, xsbegin++) {
+        u64 bin = forward ? (*it - begin) / step : (begin - *it) / step;
+        if (dest->xs_.empty() || bin != lastbin) {
+            dest->xs_.push_back(*xsbegin);
+        } else {
+            dest->xs_.back().combine(*xsbegin);
+        }
+        lastbin = bin;
+    }
+    for (auto& agg: dest->xs_) {
+        if (!forward) {
+            // Tier buckets were computed in forward direction
+            std::swap(agg.first, agg.last);
+        }
+        dest->ts_.push_back(agg._begin);
+    }
+}
+
+std::unique_ptr<AggregateOperator> RollupStore::group_aggregate(aku_ParamId id,
+                                                                NBTreeExtentsList const& tree,
+                                                                aku_Timestamp begin,
+                                                                aku_Timestamp end,
+                                                                aku_Timestamp step) const
+{
+    std::unique_ptr<AggregateOperator> result;
+    int ix = choose_tier(begin, end, step);
+    if (ix < 0) {
+        return result;
+    }
+    auto column = find_column(id);
+    if (!column) {
+        return result;
+    }
+    std::vector<std::unique_ptr<AggregateOperator>> iters;
+    if (begin < end) {
+        std::unique_ptr<PrecomputedAggregateOperator> precomputed;
+        precomputed.reset(new PrecomputedAggregateOperator(AggregateOperator::Direction::FORWARD));
+        aku_Timestamp top;
+        {
+            std::lock_guard<std::mutex> lock(column->lock);
+            auto const& tier = column->tiers[static_cast<size_t>(ix)];
+            // Tier covers [begin, top), the rest is read from the tree
+            auto limit = std::min(tier.done, end);
+            if (limit <= begin) {
+                return result;
+            }
+            top = begin + (limit - begin) / step * step;
+            if (top == begin) {
+                return result;
+            }
+            auto first = std::lower_bound(tier.ts.begin(), tier.ts.end(), begin);
+            auto last = std::lower_bound(first, tier.ts.end(), top);
+            combine_buckets(first, last, tier.xs.begin() + std::distance(tier.ts.begin(), first),
+                            begin, step, true, precomputed.get());
+        }
+        iters.push_back(std::move(precomputed));
+        if (top < end) {
+            iters.push_back(tree.group_aggregate(top, end, step));
+        }
+    } else {
+        std::unique_ptr<PrecomputedAggregateOperator> precomputed;
+        precomputed.reset(new PrecomputedAggregateOperator(AggregateOperator::Direction::BACKWARD));
+        aku_Timestamp hi, lo;
+        {
+            std::lock_guard<std::mutex> lock(column->lock);
+            auto const& tier = column->tiers[static_cast<size_t>(ix)];
+            // Query bucket `k` contains (begin - (k+1)*step, begin - k*step], tier covers
+            // buckets [k0, k1) that are complete and are not cut by `end`
+            auto k0 = begin < tier.done ? 0 : (begin - tier.done + step) / step;
+            auto k1 = (begin - end) / step;
+            if (k0 >= k1) {
+                return result;
+            }
+            hi = begin - k0 * step;
+            lo = begin - k1 * step;
+            // Buckets are aligned so the last one starts at `hi - width + 1`
+            auto width = steps_[static_cast<size_t>(ix)];
+            auto first = std::lower_bound(tier.ts.begin(), tier.ts.end(), lo + 1);
+            auto last = std::upper_bound(first, tier.ts.end(), hi - (width - 1));
+            auto xlast = tier.xs.begin() + std::distance(tier.ts.begin(), last);
+            typedef std::vector<aku_Timestamp>::const_iterator TsIt;
+            typedef std::vector<AggregationResult>::const_iterator XsIt;
+            combine_buckets(std::reverse_iterator<TsIt>(last),
+                            std::reverse_iterator<TsIt>(first),
+                            std::reverse_iterator<XsIt>(xlast),
+                            begin, step, false, precomputed.get());
+        }
+        if (hi != begin) {
+            iters.push_back(tree.group_aggregate(begin, hi, step));
+        }
+        iters.push_back(std::move(precomputed));
+        if (lo > end) {
+            iters.push_back(tree.group_aggregate(lo, end, step));
+        }
+    }
+    result.reset(new CombineGroupAggregateOperator(begin, step, std::move(iters)));
+    return result;
+}
+
+}}  // namespace
@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#pragma once
+
+// Stdlib
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Project
+#include "akumuli_def.h"
+#include "storage_engine/nbtree.h"
+
+namespace Akumuli {
+namespace StorageEngine {
+
+/** Rollup tiers (precomputed group-aggregate results).
+  * Every tier stores aggregates of fixed size time buckets (e.g. 1m, 1h, 24h) for
+  * every column. Buckets are computed by the background worker when the column
+  * commits a leaf node. Only complete buckets are stored, the bucket is complete
+  * if all values that belong to it are already written (writes are ordered within
+  * the column). Tiers are not persisted, after restart the worker rebuilds them
+  * from the tree on first commit.
+  * Group-aggregate query with the step that is a multiple of the tier's bucket
+  * width reads precomputed buckets, only the part of the range that wasn't rolled
+  * up yet is computed from the tree.
+  */
+class RollupStore {
+    //! Buckets of the single tier
+    struct Tier {
+        //! All buckets before this timestamp are complete
+        aku_Timestamp          done;
+        //! Start timestamps of the non-empty buckets
+        std::vector<aku_Timestamp> ts;
+        std::vector<AggregationResult> xs;
+    };
+
+    //! Tiers of the single column
+    struct Column {
+        std::mutex        lock;
+        std::vector<Tier> tiers;
+    };
+
+    //! Pending update
+    struct Update {
+        std::shared_ptr<NBTreeExtentsList> tree;
+        //! Timestamp of the last write
+        aku_Timestamp watermark;
+    };
+
+    //! Bucket widths of all tiers (in ascending order)
+    const std::vector<aku_Timestamp> steps_;
+    //! Protects `columns_`, `pending_` and `stop_`
+    mutable std::mutex lock_;
+    std::condition_variable cvar_;
+    std::unordered_map<aku_ParamId, std::shared_ptr<Column>> columns_;
+    std::unordered_map<aku_ParamId, Update> pending_;
+    //! Number of updates that are being processed by the worker
+    size_t inprogress_;
+    bool stop_;
+    std::thread worker_;
+
+    void run();
+
+    //! Add new buckets to all tiers of the column
+    void update(aku_ParamId id, Update const& upd);
+
+    std::shared_ptr<Column> find_column(aku_ParamId id) const;
+
+    //! Find tier with the largest bucket width that can be used by the query
+    int choose_tier(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) const;
+
+public:
+    /** C-tor.
+      * @param steps is a list of bucket widths, tier is created for every element
+      */
+    RollupStore(std::vector<aku_Timestamp> const& steps);
+
+    ~RollupStore();
+
+    RollupStore(RollupStore const&) = delete;
+    RollupStore& operator = (RollupStore const&) = delete;
+
+    /** Notify the worker that the leaf node of the column was committed.
+      * @param id is a column id
+      * @param tree is a column
+      * @param watermark is a timestamp of the last value written to the column (or smaller)
+      */
+    void notify(aku_ParamId id, std::shared_ptr<NBTreeExtentsList> tree, aku_Timestamp watermark);
+
+    //! Wait until all pending updates will be processed
+    void wait();
+
+    //! Stop the worker, pending updates are discarded
+    void stop();
+
+    //! Drop precomputed buckets and pending updates of the removed column
+    void remove(aku_ParamId id);
+
+    /** Create group-aggregate operator that uses precomputed buckets.
+      * @return operator or empty pointer if the query can't use any tier
+      */
+    std::unique_ptr<AggregateOperator> group_aggregate(aku_ParamId id,
+                                                       NBTreeExtentsList const& tree,
+                                                       aku_Timestamp begin,
+                                                       aku_Timestamp end,
+                                                       aku_Timestamp step) const;
+};
+
+}}  // namespace
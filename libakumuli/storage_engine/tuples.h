@@ -30,7 +30,7 @@ struct TupleOutputUtils {
         return bits.d;
     }
 
-    // Returns size of the tuple and bitmap
+    // Returns size of the tuple and bitmap (bitmap is not set if tuple is extended)
     static std::tuple<u32, u64> get_size_and_bitmap(double value) {
         union {
             double d;
@@ -38,10 +38,50 @@ struct TupleOutputUtils {
         } bits;
         bits.d = value;
         u32 size = static_cast<u32>(bits.u >> 58);
-        u32 bitmap = 0x3ffffffffffffff & bits.u;
+        if (size == AKU_TUPLE_EXTENDED) {
+            return std::make_tuple(static_cast<u32>(bits.u), 0ull);
+        }
+        u64 bitmap = 0x3ffffffffffffff & bits.u;
         return std::make_tuple(size, bitmap);
     }
 
+    //! Returns true if tuple header describes extended tuple
+    static bool is_extended(double value) {
+        union {
+            double d;
+            u64 u;
+        } bits;
+        bits.d = value;
+        return (bits.u >> 58) == AKU_TUPLE_EXTENDED;
+    }
+
+    //! Number of bitmap words stored in front of the tuple values
+    static u32 get_bitmap_words(u32 ncolumns) {
+        return ncolumns > AKU_TUPLE_COMPACT_MAX_COLUMNS ? (ncolumns + 63) / 64 : 0;
+    }
+
+    /** Make tuple header.
+      * @param ncolumns is a number of columns
+      * @param bitmap is a bitmap of present values (ignored if tuple is extended)
+      */
+    static double make_header(u32 ncolumns, u64 bitmap) {
+        union {
+            double d;
+            u64 u;
+        } bits;
+        if (ncolumns > AKU_TUPLE_COMPACT_MAX_COLUMNS) {
+            bits.u = (static_cast<u64>(AKU_TUPLE_EXTENDED) << 58) | ncolumns;
+        } else {
+            bits.u = bitmap | (static_cast<u64>(ncolumns) << 58);
+        }
+        return bits.d;
+    }
+
+    //! Size of the tuple with all values present
+    static size_t get_max_tuple_size(u32 ncolumns) {
+        return sizeof(aku_Sample) + sizeof(u64)*get_bitmap_words(ncolumns) + sizeof(double)*ncolumns;
+    }
+
     static double get(StorageEngine::AggregationResult const& res, StorageEngine::AggregationFunction afunc) {
         double out = 0;
         switch (afunc) {
@@ -66,6 +106,26 @@ struct TupleOutputUtils {
         case StorageEngine::AggregationFunction::MEAN:
             out = res.sum / res.cnt;
             break;
+        case StorageEngine::AggregationFunction::FIRST:
+            out = res.first;
+            break;
+        case StorageEngine::AggregationFunction::LAST:
+            out = res.last;
+            break;
+        case StorageEngine::AggregationFunction::FIRST_TIMESTAMP:
+            out = static_cast<double>(res._begin);
+            break;
+        case StorageEngine::AggregationFunction::LAST_TIMESTAMP:
+            out = static_cast<double>(res._end);
+            break;
+        case StorageEngine::AggregationFunction::P50:
+        case StorageEngine::AggregationFunction::P90:
+        case StorageEngine::AggregationFunction::P95:
+        case StorageEngine::AggregationFunction::P99:
+        case StorageEngine::AggregationFunction::P999:
+            // Quantiles can't be computed from the aggregate (see QuantileSketch)
+            out = std::numeric_limits<double>::quiet_NaN();
+            break;
         }
         return out;
     }
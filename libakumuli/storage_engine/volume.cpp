@@ -19,8 +19,18 @@
 #include <apr.h>
 #include <apr_general.h>
 #include <apr_file_io.h>
+#include <apr_portable.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <set>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <boost/exception/all.hpp>
 
 #include "log_iface.h"
@@ -50,15 +60,29 @@ static AprPoolPtr _make_apr_pool() {
     return std::move(pool);
 }
 
-static AprFilePtr _open_file(const char* file_name, apr_pool_t* pool) {
+static AprFilePtr _open_file(const char* file_name, apr_pool_t* pool, bool read_only = false) {
     apr_file_t* pfile = nullptr;
-    apr_status_t status = apr_file_open(&pfile, file_name, APR_READ|APR_WRITE, APR_OS_DEFAULT, pool);
+    apr_int32_t flags = read_only ? APR_READ : APR_READ|APR_WRITE;
+    apr_status_t status = apr_file_open(&pfile, file_name, flags, APR_OS_DEFAULT, pool);
     panic_on_error(status, "Can't open file");
     AprFilePtr file(pfile, &_close_apr_file);
     return std::move(file);
 }
 
 
+//! Allocate buffer suitable for direct I/O
+static AlignedBufPtr _make_aligned_buffer(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, AKU_BLOCK_SIZE, size) != 0) {
+        AKU_PANIC("Can't allocate aligned buffer");
+    }
+    return AlignedBufPtr(static_cast<u8*>(ptr), &free);
+}
+
+static bool _is_aligned(const void* ptr) {
+    return (reinterpret_cast<uintptr_t>(ptr) & (AKU_BLOCK_SIZE - 1)) == 0;
+}
+
 static size_t _get_file_size(apr_file_t* file) {
     apr_finfo_t info;
     auto status = apr_file_info_get(&info, APR_FINFO_SIZE, file);
@@ -68,7 +92,7 @@ static size_t _get_file_size(apr_file_t* file) {
 
 /** This function creates file with specified size
   */
-static void _create_file(const char* file_name, u64 size) {
+static void _create_file(const char* file_name, u64 size, bool preallocate) {
     Logger::msg(AKU_LOG_INFO, "Create " + std::string(file_name) + " size: " + std::to_string(size));
     AprPoolPtr pool = _make_apr_pool();
     apr_file_t* pfile = nullptr;
@@ -77,6 +101,16 @@ static void _create_file(const char* file_name, u64 size) {
     AprFilePtr file(pfile, &_close_apr_file);
     status = apr_file_trunc(file.get(), static_cast<apr_off_t>(size));
     panic_on_error(status, "Can't truncate file");
+    if (preallocate) {
+        apr_os_file_t fd;
+        status = apr_os_file_get(&fd, file.get());
+        panic_on_error(status, "Can't get file descriptor");
+        int err = posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (err != 0) {
+            // Volume is still usable, blocks are allocated on write
+            Logger::msg(AKU_LOG_ERROR, "Can't preallocate " + std::string(file_name) + ", error: " + strerror(err));
+        }
+    }
 }
 
 //------------------------- MetaVolume ---------------------------------//
@@ -163,6 +197,26 @@ std::tuple<aku_Status, u32> MetaVolume::get_generation(u32 id) const {
 }
 
 aku_Status MetaVolume::add_volume(u32 id, u32 capacity, const std::string& path) {
+    auto status = attach_volume(id, capacity, path);
+    if (status != AKU_SUCCESS) {
+        return status;
+    }
+
+    // Update metadata storage
+    VolumeRegistry::VolumeDesc vol;
+    vol.nblocks         = 0;
+    vol.generation      = id;
+    vol.capacity        = capacity;
+    vol.version         = AKUMULI_VERSION;
+    vol.id              = id;
+    vol.path            = path;
+
+    meta_->add_volume(vol);
+
+    return AKU_SUCCESS;
+}
+
+aku_Status MetaVolume::attach_volume(u32 id, u32 capacity, const std::string& path) {
     if (path.size() > AKU_BLOCK_SIZE - sizeof(VolumeRef)) {
         return AKU_EBAD_ARG;
     }
@@ -180,17 +234,6 @@ aku_Status MetaVolume::add_volume(u32 id, u32 capacity, const std::string& path)
     memcpy(pvolume->path, path.data(), path.size());
     pvolume->path[path.size()] = '\0';
 
-    // Update metadata storage
-    VolumeRegistry::VolumeDesc vol;
-    vol.nblocks         = pvolume->nblocks;
-    vol.generation      = pvolume->generation;
-    vol.capacity        = pvolume->capacity;
-    vol.version         = AKUMULI_VERSION;
-    vol.id              = pvolume->id;
-    vol.path            = path;
-
-    meta_->add_volume(vol);
-
     return AKU_SUCCESS;
 }
 
@@ -201,18 +244,7 @@ aku_Status MetaVolume::update(u32 id, u32 nblocks, u32 capacity, u32 gen) {
         pvol->capacity   = capacity;
         pvol->generation = gen;
         pvol->version    = AKUMULI_VERSION;
-
-        // Update metadata storage (this update will be written into the sqlite
-        // database eventually in the asynchronous manner.
-        VolumeRegistry::VolumeDesc vol;
-        vol.nblocks      = pvol->nblocks;
-        vol.generation   = pvol->generation;
-        vol.capacity     = pvol->capacity;
-        vol.id           = pvol->id;
-        vol.version      = AKUMULI_VERSION;
-        vol.path.assign(static_cast<const char*>(pvol->path));
-        meta_->update_volume(vol);
-
+        dirty_.insert(id);
         return AKU_SUCCESS;
     }
     return AKU_EBAD_ARG;  // id out of range
@@ -222,16 +254,7 @@ aku_Status MetaVolume::set_nblocks(u32 id, u32 nblocks) {
     if (id < file_size_/AKU_BLOCK_SIZE) {
         auto pvol = get_volref(double_write_buffer_.data(), id);
         pvol->nblocks = nblocks;
-
-        VolumeRegistry::VolumeDesc vol;
-        vol.nblocks      = pvol->nblocks;
-        vol.generation   = pvol->generation;
-        vol.capacity     = pvol->capacity;
-        vol.id           = pvol->id;
-        vol.version      = pvol->version;
-        vol.path.assign(static_cast<const char*>(pvol->path));
-        meta_->update_volume(vol);
-
+        dirty_.insert(id);
         return AKU_SUCCESS;
     }
     return AKU_EBAD_ARG;  // id out of range
@@ -241,16 +264,7 @@ aku_Status MetaVolume::set_capacity(u32 id, u32 cap) {
     if (id < file_size_/AKU_BLOCK_SIZE) {
         auto pvol = get_volref(double_write_buffer_.data(), id);
         pvol->capacity = cap;
-
-        VolumeRegistry::VolumeDesc vol;
-        vol.nblocks      = pvol->nblocks;
-        vol.generation   = pvol->generation;
-        vol.capacity     = pvol->capacity;
-        vol.id           = pvol->id;
-        vol.version      = pvol->version;
-        vol.path.assign(static_cast<const char*>(pvol->path));
-        meta_->update_volume(vol);
-
+        dirty_.insert(id);
         return AKU_SUCCESS;
     }
     return AKU_EBAD_ARG;  // id out of range
@@ -260,41 +274,62 @@ aku_Status MetaVolume::set_generation(u32 id, u32 gen) {
     if (id < file_size_/AKU_BLOCK_SIZE) {
         auto pvol = get_volref(double_write_buffer_.data(), id);
         pvol->generation = gen;
-
-        VolumeRegistry::VolumeDesc vol;
-        vol.nblocks      = pvol->nblocks;
-        vol.generation   = pvol->generation;
-        vol.capacity     = pvol->capacity;
-        vol.id           = pvol->id;
-        vol.version      = pvol->version;
-        vol.path.assign(static_cast<const char*>(pvol->path));
-        meta_->update_volume(vol);
-
+        dirty_.insert(id);
         return AKU_SUCCESS;
     }
     return AKU_EBAD_ARG;  // id out of range
 }
 
 void MetaVolume::flush() {
+    for (auto id: dirty_) {
+        write_entry(id);
+    }
+    dirty_.clear();
 }
 
 aku_Status MetaVolume::flush(u32 id) {
+    if (id >= file_size_/AKU_BLOCK_SIZE) {
+        return AKU_EBAD_ARG;
+    }
+    if (dirty_.erase(id)) {
+        write_entry(id);
+    }
     return AKU_SUCCESS;
 }
 
+void MetaVolume::write_entry(u32 id) {
+    auto pvol = get_volref(double_write_buffer_.data(), id);
+    // Update metadata storage (this update will be written into the sqlite
+    // database eventually in the asynchronous manner.
+    VolumeRegistry::VolumeDesc vol;
+    vol.nblocks      = pvol->nblocks;
+    vol.generation   = pvol->generation;
+    vol.capacity     = pvol->capacity;
+    vol.id           = pvol->id;
+    vol.version      = pvol->version;
+    vol.path.assign(static_cast<const char*>(pvol->path));
+    meta_->update_volume(vol);
+}
+
 //--------------------------- Volume -----------------------------------//
 
-Volume::Volume(const char* path, size_t write_pos)
+Volume::Volume(const char* path, size_t write_pos, bool read_only)
     : apr_pool_(_make_apr_pool())
-    , apr_file_handle_(_open_file(path, apr_pool_.get()))
+    , apr_file_handle_(_open_file(path, apr_pool_.get(), read_only))
     , file_size_(static_cast<u32>(_get_file_size(apr_file_handle_.get())/AKU_BLOCK_SIZE))
     , write_pos_(static_cast<u32>(write_pos))
     , path_(path)
     , mmap_ptr_(nullptr)
+    , wbuf_pos_(static_cast<u32>(write_pos))
+    , wbuf_cap_(0)
+    , locked_(false)
+    , direct_io_(false)
+    , read_only_(read_only)
+    , dio_buf_(nullptr, &free)
 {
 #if UINTPTR_MAX == 0xFFFFFFFFFFFFFFFF
     // 64-bit architecture, we can use mmap for speed
-    mmap_.reset(new MemoryMappedFile(path, false));
+    mmap_.reset(new MemoryMappedFile(path, false, read_only));
     if (mmap_->is_bad()) {
         // Fallback on error
         Logger::msg(AKU_LOG_ERROR, path_ + " memory mapping error: '" + mmap_->error_message() + "', fallback to `fopen`");
@@ -313,25 +348,46 @@ Volume::Volume(const char* path, size_t write_pos)
 }
 
 void Volume::reset() {
+    // Buffered blocks belong to the previous generation and can be dropped
+    wbuf_.clear();
     write_pos_ = 0;
+    wbuf_pos_ = 0;
 }
 
-void Volume::create_new(const char* path, size_t capacity) {
+void Volume::create_new(const char* path, size_t capacity, bool preallocate) {
     auto size = capacity * AKU_BLOCK_SIZE;
-    _create_file(path, size);
+    _create_file(path, size, preallocate);
 }
 
-std::unique_ptr<Volume> Volume::open_existing(const char* path, size_t pos) {
+std::unique_ptr<Volume> Volume::open_existing(const char* path, size_t pos, bool read_only) {
     std::unique_ptr<Volume> result;
-    result.reset(new Volume(path, pos));
+    result.reset(new Volume(path, pos, read_only));
     return std::move(result);
 }
 
 //! Append block to file (source size should be 4 at least BLOCK_SIZE)
 std::tuple<aku_Status, BlockAddr> Volume::append_block(const u8* source) {
+    if (read_only_) {
+        return std::make_tuple(AKU_ENOT_PERMITTED, 0u);
+    }
     if (write_pos_ >= file_size_) {
         return std::make_tuple(AKU_EOVERFLOW, 0u);
     }
+    if (wbuf_cap_) {
+        // Write-behind mode
+        wbuf_.insert(wbuf_.end(), source, source + AKU_BLOCK_SIZE);
+        auto result = write_pos_++;
+        if (write_pos_ - wbuf_pos_ >= wbuf_cap_) {
+            write_pending();
+        }
+        return std::make_tuple(AKU_SUCCESS, result);
+    }
+    if (direct_io_) {
+        direct_write(static_cast<size_t>(write_pos_) * AKU_BLOCK_SIZE, source, AKU_BLOCK_SIZE);
+        auto result = write_pos_++;
+        wbuf_pos_ = write_pos_;
+        return std::make_tuple(AKU_SUCCESS, result);
+    }
     apr_off_t seek_off = write_pos_ * AKU_BLOCK_SIZE;
     apr_status_t status = apr_file_seek(apr_file_handle_.get(), APR_SET, &seek_off);
     panic_on_error(status, "Volume seek error");
@@ -339,20 +395,110 @@ std::tuple<aku_Status, BlockAddr> Volume::append_block(const u8* source) {
     status = apr_file_write_full(apr_file_handle_.get(), source, AKU_BLOCK_SIZE, &bytes_written);
     panic_on_error(status, "Volume write error");
     auto result = write_pos_++;
+    wbuf_pos_ = write_pos_;
     return std::make_tuple(AKU_SUCCESS, result);
 }
 
+void Volume::write_pending() {
+    if (wbuf_.empty()) {
+        return;
+    }
+    if (direct_io_) {
+        direct_write(static_cast<size_t>(wbuf_pos_) * AKU_BLOCK_SIZE, wbuf_.data(), wbuf_.size());
+        wbuf_.clear();
+        wbuf_pos_ = write_pos_;
+        return;
+    }
+    apr_off_t seek_off = static_cast<apr_off_t>(wbuf_pos_) * AKU_BLOCK_SIZE;
+    apr_status_t status = apr_file_seek(apr_file_handle_.get(), APR_SET, &seek_off);
+    panic_on_error(status, "Volume seek error");
+    apr_size_t bytes_written = 0;
+    status = apr_file_write_full(apr_file_handle_.get(), wbuf_.data(), wbuf_.size(), &bytes_written);
+    panic_on_error(status, "Volume write error");
+    wbuf_.clear();
+    wbuf_pos_ = write_pos_;
+}
+
+bool Volume::is_pending(u32 ix) const {
+    return ix >= wbuf_pos_ && ix < write_pos_;
+}
+
+void Volume::direct_write(size_t offset, const u8* source, size_t size) {
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    panic_on_error(status, "Can't get file descriptor");
+    while (size) {
+        size_t chunk = size;
+        const u8* ptr = source;
+        if (!_is_aligned(source)) {
+            // Unaligned buffer is copied to the bounce buffer
+            chunk = std::min(size, static_cast<size_t>(AKU_DIRECT_IO_BUFFER_SIZE));
+            memcpy(dio_buf_.get(), source, chunk);
+            ptr = dio_buf_.get();
+        }
+        auto nwritten = ::pwrite(fd, ptr, chunk, static_cast<off_t>(offset));
+        if (nwritten <= 0) {
+            Logger::msg(AKU_LOG_ERROR, path_ + " direct write error: " + strerror(errno));
+            AKU_PANIC("Volume write error");
+        }
+        size   -= static_cast<size_t>(nwritten);
+        offset += static_cast<size_t>(nwritten);
+        source += nwritten;
+    }
+}
+
+void Volume::direct_read(size_t offset, u8* dest, size_t size) const {
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    panic_on_error(status, "Can't get file descriptor");
+    while (size) {
+        size_t chunk = size;
+        u8* ptr = dest;
+        if (!_is_aligned(dest)) {
+            chunk = std::min(size, static_cast<size_t>(AKU_DIRECT_IO_BUFFER_SIZE));
+            ptr = dio_buf_.get();
+        }
+        auto nread = ::pread(fd, ptr, chunk, static_cast<off_t>(offset));
+        if (nread <= 0) {
+            Logger::msg(AKU_LOG_ERROR, path_ + " direct read error: " + strerror(errno));
+            AKU_PANIC("Volume read error");
+        }
+        if (ptr != dest) {
+            memcpy(dest, ptr, static_cast<size_t>(nread));
+        }
+        size   -= static_cast<size_t>(nread);
+        offset += static_cast<size_t>(nread);
+        dest   += nread;
+    }
+}
+
+void Volume::set_write_buffer_size(u32 nblocks) {
+    write_pending();
+    wbuf_cap_ = nblocks;
+    wbuf_.reserve(static_cast<size_t>(nblocks) * AKU_BLOCK_SIZE);
+}
+
 //! Read filxed size block from file
 aku_Status Volume::read_block(u32 ix, u8* dest) const {
     if (ix >= write_pos_) {
         return AKU_EBAD_ARG;
     }
+    if (is_pending(ix)) {
+        // Block is not written yet
+        size_t offset = static_cast<size_t>(ix - wbuf_pos_) * AKU_BLOCK_SIZE;
+        memcpy(dest, wbuf_.data() + offset, AKU_BLOCK_SIZE);
+        return AKU_SUCCESS;
+    }
     if (mmap_ptr_) {
         // Fast path
         size_t offset = ix * AKU_BLOCK_SIZE;
         memcpy(dest, mmap_ptr_ + offset, AKU_BLOCK_SIZE);
         return AKU_SUCCESS;
     }
+    if (direct_io_) {
+        direct_read(static_cast<size_t>(ix) * AKU_BLOCK_SIZE, dest, AKU_BLOCK_SIZE);
+        return AKU_SUCCESS;
+    }
     apr_off_t offset = ix * AKU_BLOCK_SIZE;
     apr_status_t status = apr_file_seek(apr_file_handle_.get(), APR_SET, &offset);
     panic_on_error(status, "Volume seek error");
@@ -366,7 +512,7 @@ std::tuple<aku_Status, const u8*> Volume::read_block_zero_copy(u32 ix) const {
     if (ix >= write_pos_) {
         return std::make_tuple(AKU_EBAD_ARG, nullptr);
     }
-    if (mmap_ptr_) {
+    if (mmap_ptr_ && !is_pending(ix)) {
         // Fast path
         size_t offset = ix * AKU_BLOCK_SIZE;
         auto ptr = mmap_ptr_ + offset;
@@ -375,11 +521,150 @@ std::tuple<aku_Status, const u8*> Volume::read_block_zero_copy(u32 ix) const {
     return std::make_tuple(AKU_EUNAVAILABLE, nullptr);
 }
 
+void Volume::prefetch_block(u32 ix) const {
+    prefetch_blocks(ix, 1);
+}
+
+void Volume::prefetch_blocks(u32 ix, u32 count) const {
+    // Buffered blocks are already in memory
+    u32 end = std::min(ix + count, std::min(write_pos_, wbuf_pos_));
+    if (ix >= end || direct_io_) {
+        // Page cache is not used in direct I/O mode
+        return;
+    }
+    size_t offset = static_cast<size_t>(ix) * AKU_BLOCK_SIZE;
+    size_t size = static_cast<size_t>(end - ix) * AKU_BLOCK_SIZE;
+    if (mmap_ptr_) {
+        auto ptr = align_to_page(mmap_ptr_ + offset, get_page_size());
+        madvise(const_cast<void*>(ptr), size, MADV_WILLNEED);
+        return;
+    }
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    if (status == APR_SUCCESS) {
+        posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_WILLNEED);
+    }
+}
+
+void Volume::set_access_pattern(AccessPattern pattern) {
+    // Advice is applied to the entire mapping, changing it for the individual
+    // blocks would split the mapping into many small VMAs.
+    int madv = MADV_NORMAL;
+    int fadv = POSIX_FADV_NORMAL;
+    switch (pattern) {
+    case AccessPattern::NORMAL:
+        break;
+    case AccessPattern::RANDOM:
+        madv = MADV_RANDOM;
+        fadv = POSIX_FADV_RANDOM;
+        break;
+    case AccessPattern::SEQUENTIAL:
+        madv = MADV_SEQUENTIAL;
+        fadv = POSIX_FADV_SEQUENTIAL;
+        break;
+    };
+    if (mmap_ptr_) {
+        if (madvise(const_cast<u8*>(mmap_ptr_), mmap_->get_size(), madv) != 0) {
+            Logger::msg(AKU_LOG_ERROR, path_ + " madvise error: " + strerror(errno));
+        }
+    }
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    if (status == APR_SUCCESS) {
+        posix_fadvise(fd, 0, 0, fadv);
+    }
+}
+
+void Volume::enable_huge_pages() {
+    if (!mmap_ptr_) {
+        return;
+    }
+#ifdef MADV_HUGEPAGE
+    // File backed THP is only supported by some file systems, the call is a hint
+    if (madvise(const_cast<u8*>(mmap_ptr_), mmap_->get_size(), MADV_HUGEPAGE) != 0) {
+        Logger::msg(AKU_LOG_INFO, path_ + " huge pages are not available: " + strerror(errno));
+    }
+#endif
+}
+
+aku_Status Volume::lock_memory(bool lock) {
+    if (!mmap_ptr_) {
+        return AKU_EUNAVAILABLE;
+    }
+    if (lock == locked_) {
+        return AKU_SUCCESS;
+    }
+    void* ptr = const_cast<u8*>(mmap_ptr_);
+    size_t size = mmap_->get_size();
+    int err;
+    if (lock) {
+#if defined(MLOCK_ONFAULT) && defined(SYS_mlock2)
+        // Don't read the whole volume at once
+        err = static_cast<int>(syscall(SYS_mlock2, ptr, size, MLOCK_ONFAULT));
+        if (err != 0 && errno == ENOSYS) {
+            err = mlock(ptr, size);
+        }
+#else
+        err = mlock(ptr, size);
+#endif
+    } else {
+        err = munlock(ptr, size);
+    }
+    if (err != 0) {
+        Logger::msg(AKU_LOG_ERROR, path_ + (lock ? " mlock" : " munlock") + " error: " + strerror(errno));
+        return AKU_EACCESS;
+    }
+    locked_ = lock;
+    return AKU_SUCCESS;
+}
+
+aku_Status Volume::enable_direct_io() {
+    if (direct_io_) {
+        return AKU_SUCCESS;
+    }
+#ifdef O_DIRECT
+    write_pending();
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    panic_on_error(status, "Can't get file descriptor");
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0) {
+        // E.g. tmpfs doesn't support O_DIRECT
+        Logger::msg(AKU_LOG_INFO, path_ + " direct I/O is not available: " + strerror(errno));
+        return AKU_EUNAVAILABLE;
+    }
+    // Data written through the page cache before the switch should reach the disk first
+    apr_file_flush(apr_file_handle_.get());
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    dio_buf_ = _make_aligned_buffer(AKU_DIRECT_IO_BUFFER_SIZE);
+    // The mapping would use the page cache, munmap releases the lock as well
+    mmap_ptr_ = nullptr;
+    mmap_.reset();
+    locked_ = false;
+    direct_io_ = true;
+    return AKU_SUCCESS;
+#else
+    return AKU_EUNAVAILABLE;
+#endif
+}
+
 void Volume::flush() {
+    write_pending();
     apr_status_t status = apr_file_flush(apr_file_handle_.get());
     panic_on_error(status, "Volume flush error");
 }
 
+void Volume::sync() {
+    flush();
+    apr_os_file_t fd;
+    apr_status_t status = apr_os_file_get(&fd, apr_file_handle_.get());
+    panic_on_error(status, "Can't get volume file descriptor");
+    if (fdatasync(fd) != 0) {
+        Logger::msg(AKU_LOG_ERROR, path_ + " fdatasync error: " + strerror(errno));
+    }
+}
+
 u32 Volume::get_size() const {
     return file_size_;
 }
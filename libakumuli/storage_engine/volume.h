@@ -20,6 +20,7 @@
 #include <cstdint>
 #include <future>
 #include <memory>
+#include <set>
 
 // libraries
 #include <apr.h>
@@ -37,9 +38,22 @@ namespace StorageEngine {
 //! Address of the block inside volume (index of the block)
 typedef u32 BlockAddr;
 enum { AKU_BLOCK_SIZE = 4096 };
+//! Size of the bounce buffer used by direct I/O
+enum { AKU_DIRECT_IO_BUFFER_SIZE = 64*AKU_BLOCK_SIZE };
+
+//! Expected access pattern of the volume (used to tune the kernel readahead)
+enum class AccessPattern {
+    //! Default readahead
+    NORMAL,
+    //! Readahead disabled, useful when most queries are point lookups (scans are prefetched by NBTree anyway)
+    RANDOM,
+    //! Aggressive readahead
+    SEQUENTIAL,
+};
 
 typedef std::unique_ptr<apr_pool_t, void (*)(apr_pool_t*)> AprPoolPtr;
 typedef std::unique_ptr<apr_file_t, void (*)(apr_file_t*)> AprFilePtr;
+typedef std::unique_ptr<u8, void (*)(void*)> AlignedBufPtr;
 
 
 /** Class that represents metadata volume.
@@ -50,15 +64,25 @@ typedef std::unique_ptr<apr_file_t, void (*)(apr_file_t*)> AprFilePtr;
   * 4KB and sector writes are atomic (each write less or equal to 4K will be
   * fully written to disk or not, FS checksum failure is a hardware bug, not
   * a result of the partial sector write).
+  *
+  * Content of the metadata volume is stored in the volume registry. Updates
+  * are coalesced in memory and passed to the registry by `flush`, so every
+  * entry is written at most once per flush (in the same transaction as the
+  * rescue points that reference the new blocks).
   */
 class MetaVolume {
     std::shared_ptr<VolumeRegistry>  meta_;
     size_t                           file_size_;
     mutable std::vector<u8>          double_write_buffer_;
     const std::string                path_;
+    //! Entries that were changed since the last flush
+    std::set<u32>                    dirty_;
 
     MetaVolume(std::shared_ptr<VolumeRegistry> meta);
 
+    //! Pass entry to the volume registry
+    void write_entry(u32 id);
+
 public:
 
     /** Open existing meta-volume.
@@ -91,6 +115,15 @@ public:
      */
     aku_Status add_volume(u32 id, u32 vol_capacity, const std::string &path);
 
+    /**
+     * @brief Track the volume that was already added to the volume registry
+     * (only the in-memory copy is updated)
+     * @param id is a new volume's id
+     * @param vol_capacity is a volume's capacity
+     * @return status
+     */
+    aku_Status attach_volume(u32 id, u32 vol_capacity, const std::string &path);
+
     aku_Status update(u32 id, u32 nblocks, u32 capacity, u32 gen);
 
     //! Set number of used blocks for the volume.
@@ -102,10 +135,10 @@ public:
     //! Set generation
     aku_Status set_generation(u32 id, u32 nblocks);
 
-    //! Flush entire file
+    //! Flush all changed entries
     void flush();
 
-    //! Flush one entry
+    //! Flush one entry (if it was changed)
     aku_Status flush(u32 id);
 };
 
@@ -119,24 +152,52 @@ class Volume {
     // Optional mmap
     std::unique_ptr<MemoryMappedFile> mmap_;
     const u8* mmap_ptr_;
-
-    Volume(const char* path, size_t write_pos);
+    // Optional write-behind buffer
+    std::vector<u8> wbuf_;
+    //! Index of the first block in the write-behind buffer
+    u32 wbuf_pos_;
+    //! Capacity of the write-behind buffer in blocks (0 - buffer disabled)
+    u32 wbuf_cap_;
+    //! Set if the mapping is locked in memory
+    bool locked_;
+    //! Set if the file is opened with O_DIRECT
+    bool direct_io_;
+    //! Set if the file is opened and mapped for reading only
+    bool read_only_;
+    //! Aligned buffer used by direct I/O when the caller's buffer is not aligned
+    AlignedBufPtr dio_buf_;
+
+    Volume(const char* path, size_t write_pos, bool read_only);
+
+    //! Write content of the write-behind buffer to file using single write call
+    void write_pending();
+
+    //! Check if block is stored in the write-behind buffer
+    bool is_pending(u32 ix) const;
+
+    //! Write data to file bypassing the page cache (offset and size should be multiples of the block size)
+    void direct_write(size_t offset, const u8* source, size_t size);
+
+    //! Read data from file bypassing the page cache (offset and size should be multiples of the block size)
+    void direct_read(size_t offset, u8* dest, size_t size) const;
     
 public:
     /** Create new volume.
       * @param path Path to volume.
       * @param capacity Size of the volume in blocks.
+      * @param preallocate Allocate disk space for the whole volume (otherwise the file is sparse).
       * @throw std::runtime_exception on error.
       */
-    static void create_new(const char* path, size_t capacity);
+    static void create_new(const char* path, size_t capacity, bool preallocate = false);
 
     /** Open volume.
       * @throw std::runtime_error on error.
       * @param path Path to volume file.
       * @param pos Write position inside volume (in blocks).
+      * @param read_only Open the file for reading only (append fails with AKU_ENOT_PERMITTED).
       * @return New instance of V2::Volume.
       */
-    static std::unique_ptr<Volume> open_existing(const char* path, size_t pos);
+    static std::unique_ptr<Volume> open_existing(const char* path, size_t pos, bool read_only = false);
 
     // Mutators
 
@@ -145,9 +206,37 @@ public:
     //! Append block to file (source size should be 4 at least BLOCK_SIZE)
     std::tuple<aku_Status, BlockAddr> append_block(const u8* source);
 
-    //! Flush volume
+    /** Enable write-behind buffering. Appended blocks are kept in memory
+      * and written to the file in large chunks when the buffer is full or
+      * when `flush` gets called. Buffered blocks are readable.
+      * @param nblocks is a buffer size in blocks (0 - disable buffering)
+      */
+    void set_write_buffer_size(u32 nblocks);
+
+    //! Flush volume (write all buffered blocks)
     void flush();
 
+    //! Flush volume and wait until data is written to disk
+    void sync();
+
+    //! Set readahead policy of the volume
+    void set_access_pattern(AccessPattern pattern);
+
+    //! Ask the kernel to back the memory mapping with transparent huge pages (best effort)
+    void enable_huge_pages();
+
+    /** Lock memory mapping of the volume in RAM (or unlock it). Pages are
+      * locked when they're accessed for the first time if the platform supports it.
+      * @return AKU_EUNAVAILABLE if mmap is not used, AKU_EACCESS if limit is exceeded
+      */
+    aku_Status lock_memory(bool lock);
+
+    /** Bypass the OS page cache (O_DIRECT). Memory mapping is disabled so
+      * every read goes to disk and the caller should cache the blocks instead.
+      * @return AKU_EUNAVAILABLE if direct I/O is not supported by the file system
+      */
+    aku_Status enable_direct_io();
+
     // Accessors
 
     //! Read filxed size block from file
@@ -160,6 +249,20 @@ public:
      */
     std::tuple<aku_Status, const u8*> read_block_zero_copy(u32 ix) const;
 
+    /**
+     * @brief Tell the OS that the block will be accessed soon. The call doesn't block,
+     *        the data is read in background by the kernel.
+     * @param ix is an index of the page
+     */
+    void prefetch_block(u32 ix) const;
+
+    /**
+     * @brief Tell the OS that the range of blocks will be accessed soon (one call for the entire range)
+     * @param ix is an index of the first page
+     * @param count is a number of pages
+     */
+    void prefetch_blocks(u32 ix, u32 count) const;
+
     //! Return size in blocks
     u32 get_size() const;
 
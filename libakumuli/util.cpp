@@ -17,16 +17,28 @@
 
 #include "util.h"
 #include <stdio.h>
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <thread>
 #include <sstream>
 #include <iostream>
-
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <ucontext.h>
 
 #include "log_iface.h"
 
+#include <boost/exception/diagnostic_information.hpp>
+
 namespace Akumuli
 {
 
@@ -60,7 +72,7 @@ void invoke_panic_handler(std::string const& message) {
     invoke_panic_handler(message.c_str());
 }
 
-MemoryMappedFile::MemoryMappedFile(const char* file_name, bool enable_huge_tlb)
+MemoryMappedFile::MemoryMappedFile(const char* file_name, bool enable_huge_tlb, bool read_only)
     : mem_pool_()
     , mmap_()
     , fp_()
@@ -68,6 +80,7 @@ MemoryMappedFile::MemoryMappedFile(const char* file_name, bool enable_huge_tlb)
     , status_(APR_EINIT)
     , path_(file_name)
     , enable_huge_tlb_(enable_huge_tlb)
+    , read_only_(read_only)
 {
     map_file();
 }
@@ -95,16 +108,18 @@ apr_status_t MemoryMappedFile::map_file() {
     status_ = apr_pool_create(&mem_pool_, NULL);
     if (status_ == APR_SUCCESS) {
         success_count++;
-        status_ = apr_file_open(&fp_, path_.c_str(), APR_WRITE|APR_READ, APR_OS_DEFAULT, mem_pool_);
+        apr_int32_t open_flags = read_only_ ? APR_READ : APR_WRITE|APR_READ;
+        status_ = apr_file_open(&fp_, path_.c_str(), open_flags, APR_OS_DEFAULT, mem_pool_);
         if (status_ == APR_SUCCESS) {
             success_count++;
-            status_ = apr_file_lock(fp_, APR_FLOCK_EXCLUSIVE);
+            // Several readers can share the file
+            status_ = apr_file_lock(fp_, read_only_ ? APR_FLOCK_SHARED : APR_FLOCK_EXCLUSIVE);
             if (status_ == APR_SUCCESS) {
                 // No need to increment success_count, no cleanup needed for apr_file_lock
                 status_ = apr_file_info_get(&finfo_, APR_FINFO_SIZE, fp_);
                 if (status_ == APR_SUCCESS) {
                     success_count++;
-                    apr_int32_t flags = APR_MMAP_WRITE | APR_MMAP_READ;
+                    apr_int32_t flags = read_only_ ? APR_MMAP_READ : APR_MMAP_WRITE | APR_MMAP_READ;
                     if (enable_huge_tlb_) {
 #if defined MAP_HUGETLB
 						flags |= MAP_HUGETLB;
@@ -326,6 +341,420 @@ void prefetch_mem(const void* ptr, size_t mem_size) {
     }
 }
 
+void set_thread_name(const char* name) {
+#ifdef __gnu_linux__
+    char buf[16] = {};
+    strncpy(buf, name, sizeof(buf) - 1);
+    pthread_setname_np(pthread_self(), buf);
+#else
+    AKU_UNUSED(name);
+#endif
+}
+
+bool parse_cpu_list(std::string const& cpulist, std::vector<u32>* cpus) {
+    // Format: 0-7,16-23
+    std::stringstream stream(cpulist);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty()) {
+            continue;
+        }
+        char* end = nullptr;
+        auto first = std::strtoul(range.c_str(), &end, 10);
+        auto last  = first;
+        if (end == range.c_str()) {
+            return false;
+        }
+        if (*end == '-') {
+            auto pos = end + 1;
+            last = std::strtoul(pos, &end, 10);
+            if (end == pos || last < first) {
+                return false;
+            }
+        }
+        if (*end != '\0' && *end != '\n') {
+            return false;
+        }
+        for (auto cpu = first; cpu <= last; cpu++) {
+            cpus->push_back(static_cast<u32>(cpu));
+        }
+    }
+    return true;
+}
+
+namespace {
+
+//! CPUs of every NUMA node
+struct NumaTopology {
+    std::vector<std::vector<u32>> nodes;
+    std::vector<u32> cpu2node;
+
+    NumaTopology() {
+#ifdef __gnu_linux__
+        for (u32 node = 0;; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string cpulist;
+            if (!std::getline(file, cpulist)) {
+                break;
+            }
+            std::vector<u32> cpus;
+            parse_cpu_list(cpulist, &cpus);
+            for (auto cpu: cpus) {
+                if (cpu2node.size() <= cpu) {
+                    cpu2node.resize(cpu + 1, 0);
+                }
+                cpu2node[cpu] = node;
+            }
+            nodes.push_back(std::move(cpus));
+        }
+#endif
+    }
+
+    static NumaTopology const& instance() {
+        static NumaTopology topology;
+        return topology;
+    }
+};
+
+}
+
+u32 get_numa_node_count() {
+    auto const& topology = NumaTopology::instance();
+    return topology.nodes.empty() ? 1 : static_cast<u32>(topology.nodes.size());
+}
+
+u32 get_current_numa_node() {
+#ifdef __gnu_linux__
+    auto const& topology = NumaTopology::instance();
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && static_cast<size_t>(cpu) < topology.cpu2node.size()) {
+        return topology.cpu2node[static_cast<size_t>(cpu)];
+    }
+#endif
+    return 0;
+}
+
+bool bind_thread_to_numa_node(u32 node) {
+#ifdef __gnu_linux__
+    auto const& topology = NumaTopology::instance();
+    if (node >= topology.nodes.size() || topology.nodes[node].empty()) {
+        return false;
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (auto cpu: topology.nodes[node]) {
+        CPU_SET(cpu, &cpuset);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+    AKU_UNUSED(node);
+    return false;
+#endif
+}
+
+namespace {
+
+//! Affinity and priority of the threads by role
+struct ThreadPolicies {
+    struct Policy {
+        std::vector<u32> cpus;
+        int nice;
+        bool enabled;
+    };
+    std::mutex lock;
+    Policy policies[AKU_THREAD_ROLE_MAX];
+
+    static ThreadPolicies& instance() {
+        static ThreadPolicies policies;
+        return policies;
+    }
+};
+
+}
+
+aku_Status set_thread_policy(aku_ThreadRole role, std::string const& cpus, int nice) {
+    if (role < 0 || role >= AKU_THREAD_ROLE_MAX) {
+        return AKU_EBAD_ARG;
+    }
+    ThreadPolicies::Policy policy = {};
+    if (!parse_cpu_list(cpus, &policy.cpus)) {
+        return AKU_EBAD_ARG;
+    }
+#ifdef __gnu_linux__
+    for (auto cpu: policy.cpus) {
+        if (cpu >= CPU_SETSIZE) {
+            return AKU_EBAD_ARG;
+        }
+    }
+#endif
+    policy.nice = nice;
+    policy.enabled = true;
+    auto& policies = ThreadPolicies::instance();
+    std::lock_guard<std::mutex> guard(policies.lock);
+    policies.policies[role] = std::move(policy);
+    return AKU_SUCCESS;
+}
+
+void apply_thread_policy(aku_ThreadRole role) {
+    if (role < 0 || role >= AKU_THREAD_ROLE_MAX) {
+        return;
+    }
+    ThreadPolicies::Policy policy;
+    {
+        auto& policies = ThreadPolicies::instance();
+        std::lock_guard<std::mutex> guard(policies.lock);
+        policy = policies.policies[role];
+    }
+    if (!policy.enabled) {
+        return;
+    }
+#ifdef __gnu_linux__
+    if (!policy.cpus.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (auto cpu: policy.cpus) {
+            CPU_SET(cpu, &cpuset);
+        }
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+            Logger::msg(AKU_LOG_ERROR, "Can't set CPU affinity of the thread");
+        }
+    }
+    // Nice value is a per-thread attribute on Linux
+    auto tid = static_cast<id_t>(syscall(SYS_gettid));
+    if (setpriority(PRIO_PROCESS, tid, policy.nice) != 0) {
+        Logger::msg(AKU_LOG_ERROR, "Can't set priority of the thread");
+    }
+#endif
+}
+
+#ifdef __gnu_linux__
+// ioprio_set/ioprio_get don't have glibc wrappers
+static const int IOPRIO_WHO_THREAD = 1;
+static const int IOPRIO_CLASS_SHIFT = 13;
+static const int IOPRIO_CLASS_BE = 2;
+static const int IOPRIO_LOWEST_LEVEL = 7;
+#endif
+
+LowIOPriorityScope::LowIOPriorityScope()
+    : prev_(-1)
+{
+#ifdef __gnu_linux__
+    auto tid = static_cast<int>(syscall(SYS_gettid));
+    prev_ = static_cast<int>(syscall(SYS_ioprio_get, IOPRIO_WHO_THREAD, tid));
+    int prio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_LOWEST_LEVEL;
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_THREAD, tid, prio) != 0) {
+        prev_ = -1;
+    }
+#endif
+}
+
+LowIOPriorityScope::~LowIOPriorityScope() {
+#ifdef __gnu_linux__
+    if (prev_ >= 0) {
+        auto tid = static_cast<int>(syscall(SYS_gettid));
+        syscall(SYS_ioprio_set, IOPRIO_WHO_THREAD, tid, prev_);
+    }
+#endif
+}
+
+static Fiber*& current_fiber() {
+    static thread_local Fiber* fiber = nullptr;
+    return fiber;
+}
+
+Fiber::Fiber(std::function<void()> fn, size_t stack_size)
+    : fn_(std::move(fn))
+    , stack_(nullptr)
+    , stack_size_(stack_size)
+    , context_(new ucontext_t())
+    , caller_(new ucontext_t())
+    , done_(false)
+{
+    auto page_size = get_page_size();
+    stack_size_ = (stack_size_ + page_size - 1) / page_size * page_size + page_size;
+    stack_ = mmap(nullptr, stack_size_, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (stack_ == MAP_FAILED) {
+        AKU_PANIC("Can't allocate fiber stack");
+    }
+    // Guard page, stack grows down
+    mprotect(stack_, page_size, PROT_NONE);
+    auto ctx = static_cast<ucontext_t*>(context_);
+    if (getcontext(ctx) != 0) {
+        AKU_PANIC("getcontext error");
+    }
+    ctx->uc_stack.ss_sp = static_cast<char*>(stack_) + page_size;
+    ctx->uc_stack.ss_size = stack_size_ - page_size;
+    ctx->uc_link = static_cast<ucontext_t*>(caller_);
+    makecontext(ctx, &Fiber::entry, 0);
+}
+
+Fiber::~Fiber() {
+    munmap(stack_, stack_size_);
+    delete static_cast<ucontext_t*>(context_);
+    delete static_cast<ucontext_t*>(caller_);
+}
+
+void Fiber::entry() {
+    auto self = current_fiber();
+    try {
+        self->fn_();
+    } catch (...) {
+        // Exception can't cross the fiber boundary
+        Logger::msg(AKU_LOG_ERROR, "Unhandled exception in fiber: " +
+                    boost::current_exception_diagnostic_information());
+    }
+    self->fn_ = nullptr;
+    self->done_ = true;
+    // Returns to `uc_link` (caller context)
+}
+
+bool Fiber::resume() {
+    if (done_) {
+        return true;
+    }
+    auto prev = current_fiber();
+    current_fiber() = this;
+    swapcontext(static_cast<ucontext_t*>(caller_), static_cast<ucontext_t*>(context_));
+    current_fiber() = prev;
+    return done_;
+}
+
+void Fiber::yield() {
+    auto self = current_fiber();
+    if (self == nullptr) {
+        AKU_PANIC("Fiber::yield called outside of the fiber");
+    }
+    swapcontext(static_cast<ucontext_t*>(self->context_), static_cast<ucontext_t*>(self->caller_));
+}
+
+Fiber* Fiber::get_current() {
+    return current_fiber();
+}
+
+bool Fiber::is_done() const {
+    return done_;
+}
+
+// ForkJoinPool //
+
+struct ForkJoinPool::Batch {
+    std::function<void(size_t)> const& fn;
+    const size_t size;
+    std::atomic<size_t> next;
+    //! Number of pool threads that run the batch (protected by the pool's mutex)
+    size_t active;
+    std::condition_variable done;
+    std::exception_ptr error;
+    std::atomic<bool> failed;
+
+    Batch(std::function<void(size_t)> const& fn, size_t size)
+        : fn(fn)
+        , size(size)
+        , next{0}
+        , active(0)
+        , failed{false}
+    {
+    }
+};
+
+ForkJoinPool::ForkJoinPool(u32 nworkers)
+    : max_pending_(4*nworkers)
+    , stop_(false)
+{
+    for (u32 i = 0; i < nworkers; i++) {
+        workers_.emplace_back(&ForkJoinPool::worker, this);
+    }
+}
+
+ForkJoinPool::~ForkJoinPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+    for (auto& th: workers_) {
+        th.join();
+    }
+}
+
+void ForkJoinPool::run(Batch* batch) {
+    size_t ix;
+    while (!batch->failed && (ix = batch->next++) < batch->size) {
+        try {
+            batch->fn(ix);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!batch->error) {
+                batch->error = std::current_exception();
+            }
+            batch->failed = true;
+        }
+    }
+}
+
+void ForkJoinPool::worker() {
+    set_thread_name("query-worker");
+    apply_thread_policy(AKU_THREAD_QUERY);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (queue_.empty()) {
+            if (stop_) {
+                return;
+            }
+            cond_.wait(lock);
+            continue;
+        }
+        auto batch = std::move(queue_.front());
+        queue_.pop_front();
+        batch->active++;
+        lock.unlock();
+        run(batch.get());
+        lock.lock();
+        if (--batch->active == 0) {
+            batch->done.notify_all();
+        }
+    }
+}
+
+void ForkJoinPool::parallel_for(size_t n, std::function<void(size_t)> const& fn, size_t max_helpers) {
+    if (n == 0) {
+        return;
+    }
+    auto batch = std::make_shared<Batch>(fn, n);
+    size_t nhelpers = std::min(std::min(max_helpers, n - 1), workers_.size());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Pending entries are bounded, the caller runs the loop alone if the pool is overloaded
+        size_t room = queue_.size() < max_pending_ ? max_pending_ - queue_.size() : 0;
+        nhelpers = std::min(nhelpers, room);
+        for (size_t i = 0; i < nhelpers; i++) {
+            queue_.push_back(batch);
+        }
+    }
+    if (nhelpers == 1) {
+        cond_.notify_one();
+    } else if (nhelpers > 1) {
+        cond_.notify_all();
+    }
+    run(batch.get());
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Entries that weren't picked up yet have nothing left to do
+    queue_.erase(std::remove(queue_.begin(), queue_.end(), batch), queue_.end());
+    batch->done.wait(lock, [&batch]() { return batch->active == 0; });
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+}
+
+size_t ForkJoinPool::size() const {
+    return workers_.size();
+}
+
+ForkJoinPool& ForkJoinPool::instance() {
+    static ForkJoinPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
 size_t get_page_size() {
     auto page_size = sysconf(_SC_PAGESIZE);
     if (AKU_UNLIKELY(page_size < 0)) {
@@ -346,10 +775,21 @@ u32 Rand::operator () () {
     return (u32)rand_();
 }
 
-RWLock::RWLock()
+RWLock::RWLock(bool prefer_writers)
     : rwlock_ PTHREAD_RWLOCK_INITIALIZER
 {
-    int error = pthread_rwlock_init(&rwlock_, nullptr);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __gnu_linux__
+    if (prefer_writers) {
+        // Default glibc policy prefers readers
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    }
+#else
+    AKU_UNUSED(prefer_writers);
+#endif
+    int error = pthread_rwlock_init(&rwlock_, &attr);
+    pthread_rwlockattr_destroy(&attr);
     if (error) {
         AKU_PANIC("pthread_rwlock_init error");
     }
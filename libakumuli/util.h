@@ -27,10 +27,16 @@
 #include <apr_general.h>
 #include <apr_mmap.h>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <boost/throw_exception.hpp>
 #include <ostream>
 #include <random>
 #include <stdexcept>
+#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -56,9 +62,11 @@ class MemoryMappedFile {
     apr_status_t status_;
     std::string  path_;
     const bool   enable_huge_tlb_;
+    //! File is opened for reading and mapped without write access (shared lock)
+    const bool   read_only_;
 
 public:
-    MemoryMappedFile(const char* file_name, bool enable_huge_tlb);
+    MemoryMappedFile(const char* file_name, bool enable_huge_tlb, bool read_only = false);
     ~MemoryMappedFile();
     void move_file(const char* new_name);
     void   delete_file();
@@ -96,7 +104,124 @@ const void* align_to_page(const void* ptr, size_t get_page_size);
 void* align_to_page(void* ptr, size_t get_page_size);
 
 void prefetch_mem(const void* ptr, size_t mem_size);
-    
+
+//! Set name of the current thread (shown by top, gdb and profilers), name is truncated to 15 characters
+void set_thread_name(const char* name);
+
+//! Number of NUMA nodes (1 if the topology is not available)
+u32 get_numa_node_count();
+
+//! NUMA node of the CPU that runs the current thread
+u32 get_current_numa_node();
+
+/** Bind current thread to the CPUs of the NUMA node. The kernel places the memory
+  * on the node of the CPU that touches it first so data structures created by the
+  * thread afterwards are node-local.
+  * @return false if the node doesn't exist or the thread can't be bound
+  */
+bool bind_thread_to_numa_node(u32 node);
+
+/** Parse set of cores in the cpulist format (e.g. "0-7,16-23")
+  * @return false if the string is malformed
+  */
+bool parse_cpu_list(std::string const& cpulist, std::vector<u32>* cpus);
+
+/** Set CPU affinity and priority of the threads with the role
+  * @param cpus is a set of cores in the cpulist format (empty - not pinned)
+  * @param nice is a nice value of the threads
+  */
+aku_Status set_thread_policy(aku_ThreadRole role, std::string const& cpus, int nice);
+
+//! Apply policy of the role to the current thread
+void apply_thread_policy(aku_ThreadRole role);
+
+/** Lower I/O priority of the current thread (idle-most best-effort level)
+  * and restore previous value on exit. Page faults and reads done by the
+  * thread in this scope yield to the reads issued by other threads.
+  */
+struct LowIOPriorityScope {
+    int prev_;
+    LowIOPriorityScope();
+    ~LowIOPriorityScope();
+    LowIOPriorityScope(LowIOPriorityScope const&) = delete;
+    LowIOPriorityScope& operator = (LowIOPriorityScope const&) = delete;
+};
+
+/** Cooperative task with its own stack. Fiber runs on the thread that calls
+  * `resume` until it calls `yield` or completes. Fiber can be resumed again
+  * only by the same thread (thread local variables of the fiber's code may be
+  * cached by the compiler). Stack memory is reserved but committed only when
+  * touched, so suspended fiber costs a few pages.
+  */
+class Fiber {
+    std::function<void()> fn_;
+    void*  stack_;
+    size_t stack_size_;
+    void*  context_;
+    void*  caller_;
+    bool   done_;
+
+    static void entry();
+
+public:
+    explicit Fiber(std::function<void()> fn, size_t stack_size = AKU_STACK_SIZE);
+    ~Fiber();
+
+    Fiber(Fiber const&) = delete;
+    Fiber& operator = (Fiber const&) = delete;
+
+    //! Run fiber until it yields or completes, return true if the fiber is completed
+    bool resume();
+
+    //! Suspend the current fiber and return to the thread that resumed it
+    static void yield();
+
+    //! Get fiber that runs on the current thread (or nullptr)
+    static Fiber* get_current();
+
+    bool is_done() const;
+};
+
+/** Process-wide pool of threads for data-parallel loops. Number of threads
+  * is fixed, concurrent loops share them instead of spawning threads of their
+  * own.
+  */
+class ForkJoinPool {
+    struct Batch;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    //! One entry per helper requested by the loop
+    std::deque<std::shared_ptr<Batch>> queue_;
+    std::vector<std::thread> workers_;
+    const size_t max_pending_;
+    bool stop_;
+
+    void worker();
+
+    void run(Batch* batch);
+
+public:
+    explicit ForkJoinPool(u32 nworkers);
+    ~ForkJoinPool();
+
+    ForkJoinPool(ForkJoinPool const&) = delete;
+    ForkJoinPool& operator = (ForkJoinPool const&) = delete;
+
+    /** Call `fn` for every index in [0, n) and wait until all calls complete.
+      * Calling thread processes indexes too, up to `max_helpers` idle pool threads
+      * join it (the loop is completed by the calling thread alone if the pool is
+      * busy). First exception thrown by `fn` is rethrown by the calling thread.
+      */
+    void parallel_for(size_t n, std::function<void(size_t)> const& fn, size_t max_helpers);
+
+    //! Get number of threads
+    size_t size() const;
+
+    //! Get global instance
+    static ForkJoinPool& instance();
+};
+
 class Rand {
     std::ranlux48_base rand_;
 
@@ -113,7 +238,12 @@ class RWLock {
     pthread_rwlock_t rwlock_;
 
 public:
-    RWLock();
+    /** C-tor.
+      * @param prefer_writers if set, new readers are blocked while a writer is waiting (so
+      *        the writer can't be starved by the stream of readers). Read lock can't be
+      *        taken recursively in this mode.
+      */
+    RWLock(bool prefer_writers = false);
 
     RWLock(RWLock const&) = delete;
     RWLock(RWLock &&) = delete;
@@ -151,7 +281,7 @@ struct LockGuard {
 };
 
 using UniqueLock = LockGuard<RWLock, &RWLock::wrlock>;
-using SharedLock = LockGuard<RWLock, &RWLock::wrlock>;
+using SharedLock = LockGuard<RWLock, &RWLock::rdlock>;
 
 //! Compare two double values and return true if they are equal at bit-level (needed to supress CLang analyzer warnings).
 bool same_value(double a, double b);
@@ -0,0 +1,696 @@
+/**
+ * Ingestion load generator for akumulid.
+ *
+ * Replays captured traffic or generates it at the target rate over many concurrent
+ * connections using RESP, OpenTSDB or UDP (RESP over UDP) protocols. Reports sustained
+ * throughput, acknowledgement latency (OpenTSDB only, `version` command is used as
+ * an acknowledgement) and server CPU time per million points (if server pid is known)
+ * as a JSON object.
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include "akumuli_def.h"
+
+namespace po = boost::program_options;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Protocol {
+    RESP,
+    OPENTSDB,
+    UDP,
+};
+
+struct BenchConfig {
+    Protocol    protocol;
+    std::string host;
+    u16         port;
+    u32         nconnections;
+    double      rate;           //< target rate (points per second, all connections), 0 - unlimited
+    double      duration;       //< in seconds
+    u32         nseries;
+    u32         batch;          //< number of records sent at once
+    u32         ack_every;      //< send acknowledgement request every N points (OpenTSDB)
+    u32         datagram_size;  //< max UDP datagram size
+    std::string replay;         //< path to captured traffic
+    int         server_pid;     //< akumulid pid (if server runs on the same host)
+};
+
+//! Single protocol data unit (or several PDUs) and number of data points in it
+struct Record {
+    std::string data;
+    u32 npoints;
+    size_t tag_pos;     //< position of the connection tag (end of the series name) or npos
+    size_t ts_pos;      //< position of the integer timestamp or npos
+    size_t ts_len;
+    aku_Timestamp ts;
+};
+
+struct ConnectionStats {
+    u64 points;
+    u64 bytes;
+    u64 errors;
+    u64 acks_sent;
+    std::vector<double> ack_latencies;  //< in seconds
+    double last_ack;                    //< time of the last acknowledgement since start (seconds)
+};
+
+// -------------
+// Replay
+// -------------
+
+//! Split text stream into lines (line terminator is preserved)
+static std::vector<std::string> split_lines(std::string const& text) {
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        auto eol = text.find('\n', pos);
+        if (eol == std::string::npos) {
+            lines.push_back(text.substr(pos) + "\n");
+            break;
+        }
+        lines.push_back(text.substr(pos, eol - pos + 1));
+        pos = eol + 1;
+    }
+    return lines;
+}
+
+//! Get length of the line without line terminator
+static size_t content_length(std::string const& line) {
+    auto len = line.size();
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    return len;
+}
+
+//! Remember position of the integer timestamp
+static void set_timestamp(Record* rec, size_t pos, std::string const& digits) {
+    if (digits.empty() || !std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+        return;  // ISO8601 timestamps are not adjusted
+    }
+    rec->ts_pos = pos;
+    rec->ts_len = digits.size();
+    rec->ts = std::stoull(digits);
+}
+
+static Record empty_record() {
+    Record rec = {};
+    rec.tag_pos = std::string::npos;
+    rec.ts_pos = std::string::npos;
+    return rec;
+}
+
+/** Split captured RESP text stream into PDUs.
+  * Data point (series, timestamp, value), row (series, timestamp, array of values) and
+  * alias binding (array of the alias and series name) PDUs are recognized. Binary
+  * protocol is not supported.
+  */
+static std::vector<Record> split_resp(std::string const& text) {
+    std::vector<Record> records;
+    auto lines = split_lines(text);
+    size_t ix = 0;
+    auto array_size = [](std::string const& line) {
+        return static_cast<size_t>(std::stoul(line.substr(1)));
+    };
+    while (ix < lines.size()) {
+        Record rec = empty_record();
+        if (lines[ix].empty() || lines[ix][0] == '*') {
+            // Alias binding
+            size_t n = array_size(lines[ix]);
+            for (size_t i = 0; i <= n && ix < lines.size(); i++) {
+                if (i == 2 && lines[ix][0] == '+') {
+                    rec.tag_pos = rec.data.size() + content_length(lines[ix]);
+                }
+                rec.data += lines[ix++];
+            }
+        } else {
+            // Series name (or alias) and timestamp
+            if (lines[ix][0] == '+') {
+                rec.tag_pos = content_length(lines[ix]);
+            }
+            rec.data += lines[ix++];
+            if (ix < lines.size()) {
+                auto const& line = lines[ix];
+                if (line[0] == ':') {
+                    set_timestamp(&rec, rec.data.size() + 1, line.substr(1, content_length(line) - 1));
+                }
+                rec.data += lines[ix++];
+            }
+            if (ix < lines.size() && lines[ix][0] == '*') {
+                size_t n = array_size(lines[ix]);
+                rec.data += lines[ix++];
+                for (size_t i = 0; i < n && ix < lines.size(); i++) {
+                    rec.data += lines[ix++];
+                }
+                rec.npoints = static_cast<u32>(n);
+            } else if (ix < lines.size()) {
+                rec.data += lines[ix++];
+                rec.npoints = 1;
+            }
+        }
+        records.push_back(std::move(rec));
+    }
+    return records;
+}
+
+static std::vector<Record> split_opentsdb(std::string const& text) {
+    std::vector<Record> records;
+    for (auto& line: split_lines(text)) {
+        Record rec = empty_record();
+        if (line.compare(0, 4, "put ") == 0) {
+            // put <metric> <timestamp> <value> <tags>
+            rec.npoints = 1;
+            rec.tag_pos = content_length(line);
+            std::stringstream fields(line);
+            std::string cmd, metric, ts;
+            fields >> cmd >> metric >> ts;
+            set_timestamp(&rec, line.find(ts, 4 + metric.size()), ts);
+        }
+        rec.data = std::move(line);
+        records.push_back(std::move(rec));
+    }
+    return records;
+}
+
+static std::vector<Record> load_replay(BenchConfig const& cfg) {
+    std::ifstream input(cfg.replay, std::ios::binary);
+    if (!input) {
+        throw std::runtime_error("can't open " + cfg.replay);
+    }
+    std::stringstream str;
+    str << input.rdbuf();
+    if (cfg.protocol == Protocol::OPENTSDB) {
+        return split_opentsdb(str.str());
+    }
+    return split_resp(str.str());
+}
+
+// -------------
+// Generator
+// -------------
+
+//! Generates data points for the subset of series owned by the connection
+class Generator {
+    Protocol protocol_;
+    std::vector<std::string> names_;
+    std::vector<double> values_;
+    std::mt19937 gen_;
+    std::normal_distribution<double> walk_;
+    aku_Timestamp ts_;
+    size_t ix_;
+public:
+    Generator(BenchConfig const& cfg, u32 conn)
+        : protocol_(cfg.protocol)
+        , gen_(conn)
+        , walk_(0.0, 1.0)
+        , ix_(0)
+    {
+        u32 per_conn = std::max(1u, cfg.nseries / cfg.nconnections);
+        for (u32 i = 0; i < per_conn; i++) {
+            u32 id = conn * per_conn + i;
+            std::stringstream name;
+            name << "bench.cpu host=h" << id << " region=r" << (id % 10);
+            names_.push_back(name.str());
+        }
+        values_.resize(names_.size(), 100.0);
+        ts_ = static_cast<aku_Timestamp>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::system_clock::now().time_since_epoch()).count());
+    }
+
+    Record next() {
+        if (ix_ == names_.size()) {
+            ix_ = 0;
+            ts_ += 1000000;  // 1ms
+        }
+        auto& value = values_[ix_];
+        value += walk_(gen_);
+        std::stringstream str;
+        if (protocol_ == Protocol::OPENTSDB) {
+            auto const& name = names_[ix_];
+            auto space = name.find(' ');
+            str << "put " << name.substr(0, space) << " " << ts_ << " " << value << name.substr(space) << "\n";
+        } else {
+            str << "+" << names_[ix_] << "\r\n:" << ts_ << "\r\n+" << value << "\r\n";
+        }
+        ix_++;
+        Record rec = empty_record();
+        rec.data = str.str();
+        rec.npoints = 1;
+        return rec;
+    }
+};
+
+// -------------
+// Connections
+// -------------
+
+/** Source of records, replays captured traffic in a loop or generates new records.
+  * Replayed series names get the `bench=<connection>` tag and integer timestamps are
+  * shifted on every pass, otherwise the server would reject the data as late writes.
+  */
+class RecordSource {
+    std::vector<Record> const* replay_;
+    size_t pos_;
+    aku_Timestamp offset_;
+    aku_Timestamp span_;
+    std::string tag_;
+    std::unique_ptr<Generator> gen_;
+public:
+    RecordSource(BenchConfig const& cfg, std::vector<Record> const* replay, u32 conn)
+        : replay_(replay)
+        , pos_(0)
+        , offset_(0)
+        , span_(0)
+        , tag_(" bench=" + std::to_string(conn))
+    {
+        if (replay_ == nullptr) {
+            gen_.reset(new Generator(cfg, conn));
+        } else {
+            aku_Timestamp min = std::numeric_limits<aku_Timestamp>::max(), max = 0;
+            for (auto const& rec: *replay_) {
+                if (rec.ts_pos != std::string::npos) {
+                    min = std::min(min, rec.ts);
+                    max = std::max(max, rec.ts);
+                }
+            }
+            span_ = max >= min ? max - min + 1 : 0;
+        }
+    }
+
+    Record next() {
+        if (gen_) {
+            return gen_->next();
+        }
+        auto const& rec = replay_->at(pos_);
+        auto offset = offset_;
+        pos_++;
+        if (pos_ == replay_->size()) {
+            pos_ = 0;
+            offset_ += span_;
+        }
+        // Insert tag and adjusted timestamp
+        struct Splice {
+            size_t pos;
+            size_t len;
+            std::string text;
+        };
+        std::vector<Splice> splices;
+        if (rec.tag_pos != std::string::npos) {
+            splices.push_back({ rec.tag_pos, 0, tag_ });
+        }
+        if (rec.ts_pos != std::string::npos) {
+            splices.push_back({ rec.ts_pos, rec.ts_len, std::to_string(rec.ts + offset) });
+        }
+        std::sort(splices.begin(), splices.end(), [](Splice const& lhs, Splice const& rhs) {
+            return lhs.pos < rhs.pos;
+        });
+        Record result = rec;
+        result.data.clear();
+        size_t pos = 0;
+        for (auto const& sp: splices) {
+            result.data.append(rec.data, pos, sp.pos - pos);
+            result.data.append(sp.text);
+            pos = sp.pos + sp.len;
+        }
+        result.data.append(rec.data, pos, std::string::npos);
+        return result;
+    }
+};
+
+//! Sleep to keep the target rate
+class Pacer {
+    double rate_;
+    Clock::time_point start_;
+    u64 sent_;
+public:
+    Pacer(double rate)
+        : rate_(rate)
+        , start_(Clock::now())
+        , sent_(0)
+    {
+    }
+
+    void wait(u64 npoints) {
+        sent_ += npoints;
+        if (rate_ <= 0) {
+            return;
+        }
+        auto due = start_ + std::chrono::duration_cast<Clock::duration>(
+                                std::chrono::duration<double>(static_cast<double>(sent_) / rate_));
+        std::this_thread::sleep_until(due);
+    }
+};
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void run_tcp_connection(BenchConfig const& cfg, std::vector<Record> const* replay, u32 conn,
+                               Clock::time_point start, ConnectionStats* stats)
+{
+    boost::asio::io_service io;
+    tcp::socket socket(io);
+    tcp::resolver resolver(io);
+    boost::asio::connect(socket, resolver.resolve({cfg.host, std::to_string(cfg.port)}));
+    socket.set_option(tcp::no_delay(true));
+
+    // Acknowledgements are read by separate thread, send time of every request is queued
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Clock::time_point> pending;
+    std::atomic<bool> closed = {false};
+    std::thread reader([&]() {
+        boost::asio::streambuf buf;
+        std::istream is(&buf);
+        std::string line;
+        try {
+            while (true) {
+                boost::asio::read_until(socket, buf, '\n');
+                std::getline(is, line);
+                if (line.compare(0, 12, "net.opentsdb") == 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!pending.empty()) {
+                        stats->ack_latencies.push_back(seconds_since(pending.front()));
+                        stats->last_ack = seconds_since(start);
+                        pending.pop_front();
+                    }
+                    cond.notify_all();
+                } else if (line.compare(0, 6, "Akumul") != 0) {
+                    // Server closes connection after the error
+                    std::cerr << "conn " << conn << ": " << line << std::endl;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats->errors++;
+                }
+            }
+        } catch (boost::system::system_error const&) {
+            // Connection closed
+        }
+        closed.store(true);
+        cond.notify_all();
+    });
+
+    RecordSource source(cfg, replay, conn);
+    Pacer pacer(cfg.rate / cfg.nconnections);
+    bool acks = cfg.protocol == Protocol::OPENTSDB && cfg.ack_every != 0;
+    u64 since_ack = 0;
+    std::string out;
+    try {
+        while (seconds_since(start) < cfg.duration && !closed.load()) {
+            out.clear();
+            u64 npoints = 0;
+            bool send_ack = false;
+            for (u32 i = 0; i < cfg.batch; i++) {
+                auto rec = source.next();
+                out += rec.data;
+                npoints += rec.npoints;
+            }
+            since_ack += npoints;
+            if (acks && since_ack >= cfg.ack_every) {
+                out += "version\n";
+                since_ack = 0;
+                send_ack = true;
+            }
+            if (send_ack) {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(Clock::now());
+                stats->acks_sent++;
+            }
+            boost::asio::write(socket, boost::asio::buffer(out));
+            stats->points += npoints;
+            stats->bytes += out.size();
+            pacer.wait(npoints);
+        }
+        if (acks && !closed.load()) {
+            // Final acknowledgement, all points should be written when it's received
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(Clock::now());
+                stats->acks_sent++;
+            }
+            boost::asio::write(socket, boost::asio::buffer(std::string("version\n")));
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait_for(lock, std::chrono::seconds(30), [&]() {
+                return pending.empty() || closed.load();
+            });
+        }
+    } catch (boost::system::system_error const& e) {
+        std::cerr << "conn " << conn << ": " << e.what() << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        stats->errors++;
+    }
+    boost::system::error_code ignored;
+    socket.shutdown(tcp::socket::shutdown_both, ignored);
+    socket.close(ignored);
+    reader.join();
+}
+
+static void run_udp_connection(BenchConfig const& cfg, std::vector<Record> const* replay, u32 conn,
+                               Clock::time_point start, ConnectionStats* stats)
+{
+    boost::asio::io_service io;
+    udp::resolver resolver(io);
+    udp::endpoint endpoint = *resolver.resolve({udp::v4(), cfg.host, std::to_string(cfg.port)});
+    udp::socket socket(io);
+    socket.open(udp::v4());
+
+    RecordSource source(cfg, replay, conn);
+    Pacer pacer(cfg.rate / cfg.nconnections);
+    std::string out;
+    u64 npoints = 0;
+    auto send = [&]() {
+        if (out.empty()) {
+            return;
+        }
+        boost::system::error_code err;
+        socket.send_to(boost::asio::buffer(out), endpoint, 0, err);
+        if (err) {
+            stats->errors++;
+        } else {
+            stats->points += npoints;
+            stats->bytes += out.size();
+        }
+        pacer.wait(npoints);
+        out.clear();
+        npoints = 0;
+    };
+    while (seconds_since(start) < cfg.duration) {
+        // PDUs are not split between datagrams
+        auto rec = source.next();
+        if (out.size() + rec.data.size() > cfg.datagram_size) {
+            send();
+        }
+        out += rec.data;
+        npoints += rec.npoints;
+    }
+    send();
+}
+
+// -------------
+// Server CPU
+// -------------
+
+//! Get CPU time (user + system) of the process in seconds, negative value on error
+static double get_cpu_time(int pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string content;
+    if (!stat || !std::getline(stat, content)) {
+        return -1.0;
+    }
+    // Process name can contain spaces, fields are counted from the closing parenthesis
+    auto pos = content.rfind(')');
+    if (pos == std::string::npos) {
+        return -1.0;
+    }
+    std::stringstream fields(content.substr(pos + 2));
+    std::string field;
+    u64 utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+    return static_cast<double>(utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+static double percentile(std::vector<double> values, double q) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    auto ix = static_cast<size_t>(q * static_cast<double>(values.size() - 1) + 0.5);
+    return values.at(std::min(ix, values.size() - 1));
+}
+
+int main(int argc, char** argv) {
+    BenchConfig cfg;
+    std::string protocol;
+
+    po::options_description desc("akumulid ingestion benchmark");
+    desc.add_options()
+        ("help", "Produce help message")
+        ("protocol", po::value<std::string>(&protocol)->default_value("resp"), "Protocol (resp, opentsdb or udp)")
+        ("host", po::value<std::string>(&cfg.host)->default_value("127.0.0.1"), "Server host")
+        ("port", po::value<u16>(&cfg.port), "Server port (8282 for resp, 4242 for opentsdb, 8383 for udp by default)")
+        ("connections", po::value<u32>(&cfg.nconnections)->default_value(8), "Number of concurrent connections")
+        ("rate", po::value<double>(&cfg.rate)->default_value(0), "Target rate in points per second (0 - unlimited)")
+        ("duration", po::value<double>(&cfg.duration)->default_value(60), "Duration of the test in seconds")
+        ("series", po::value<u32>(&cfg.nseries)->default_value(10000), "Number of generated series")
+        ("batch", po::value<u32>(&cfg.batch)->default_value(100), "Number of records sent at once")
+        ("ack-every", po::value<u32>(&cfg.ack_every)->default_value(10000), "Request acknowledgement every N points (opentsdb only, 0 - disable)")
+        ("datagram-size", po::value<u32>(&cfg.datagram_size)->default_value(1400), "Max size of the UDP datagram")
+        ("replay", po::value<std::string>(&cfg.replay), "Replay captured traffic from file instead of generating it")
+        ("pid", po::value<int>(&cfg.server_pid)->default_value(0), "Server pid, used to measure server CPU usage")
+    ;
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (po::error const& e) {
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    u16 default_port;
+    if (protocol == "resp") {
+        cfg.protocol = Protocol::RESP;
+        default_port = 8282;
+    } else if (protocol == "opentsdb") {
+        cfg.protocol = Protocol::OPENTSDB;
+        default_port = 4242;
+    } else if (protocol == "udp") {
+        cfg.protocol = Protocol::UDP;
+        default_port = 8383;
+    } else {
+        std::cerr << "Unknown protocol " << protocol << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (!vm.count("port")) {
+        cfg.port = default_port;
+    }
+    if (cfg.nconnections == 0 || cfg.batch == 0 || cfg.nseries == 0) {
+        std::cerr << "Invalid parameters" << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    std::vector<Record> replay;
+    if (!cfg.replay.empty()) {
+        try {
+            replay = load_replay(cfg);
+        } catch (std::exception const& e) {
+            std::cerr << "Can't load captured traffic: " << e.what() << std::endl;
+            return 1;
+        }
+        if (replay.empty()) {
+            std::cerr << "Captured traffic is empty" << std::endl;
+            return 1;
+        }
+    }
+
+    double cpu_before = cfg.server_pid ? get_cpu_time(cfg.server_pid) : -1.0;
+    std::vector<ConnectionStats> stats(cfg.nconnections, ConnectionStats());
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    for (u32 i = 0; i < cfg.nconnections; i++) {
+        auto pstats = &stats[i];
+        auto preplay = replay.empty() ? nullptr : &replay;
+        threads.emplace_back([&cfg, preplay, i, start, pstats]() {
+            try {
+                if (cfg.protocol == Protocol::UDP) {
+                    run_udp_connection(cfg, preplay, i, start, pstats);
+                } else {
+                    run_tcp_connection(cfg, preplay, i, start, pstats);
+                }
+            } catch (std::exception const& e) {
+                std::cerr << "conn " << i << ": " << e.what() << std::endl;
+                pstats->errors++;
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    double elapsed = seconds_since(start);
+    double cpu_after = cfg.server_pid ? get_cpu_time(cfg.server_pid) : -1.0;
+
+    ConnectionStats total = {};
+    for (auto const& st: stats) {
+        total.points += st.points;
+        total.bytes += st.bytes;
+        total.errors += st.errors;
+        total.acks_sent += st.acks_sent;
+        total.ack_latencies.insert(total.ack_latencies.end(), st.ack_latencies.begin(), st.ack_latencies.end());
+        total.last_ack = std::max(total.last_ack, st.last_ack);
+    }
+    // When acknowledgements are used, throughput is measured till the last acknowledgement
+    // (all points are written by that time)
+    bool acked = !total.ack_latencies.empty();
+    double span = acked ? std::max(total.last_ack, 1e-9) : std::max(elapsed, 1e-9);
+
+    std::cout << "{\"protocol\": \"" << protocol << "\""
+              << ", \"connections\": " << cfg.nconnections
+              << ", \"target_rate\": " << cfg.rate
+              << ", \"seconds\": " << span
+              << ", \"points\": " << total.points
+              << ", \"points_per_sec\": " << static_cast<double>(total.points) / span
+              << ", \"bytes_per_sec\": " << static_cast<double>(total.bytes) / span
+              << ", \"errors\": " << total.errors;
+    if (acked) {
+        std::cout << ", \"ack\": {\"sent\": " << total.acks_sent
+                  << ", \"received\": " << total.ack_latencies.size()
+                  << ", \"p50_ms\": " << percentile(total.ack_latencies, 0.50) * 1000.0
+                  << ", \"p99_ms\": " << percentile(total.ack_latencies, 0.99) * 1000.0
+                  << ", \"max_ms\": " << percentile(total.ack_latencies, 1.00) * 1000.0
+                  << "}";
+    }
+    if (cpu_before >= 0 && cpu_after >= 0) {
+        double cpu = cpu_after - cpu_before;
+        std::cout << ", \"server_cpu_sec\": " << cpu;
+        if (total.points) {
+            std::cout << ", \"server_cpu_sec_per_million_points\": "
+                      << cpu * 1000000.0 / static_cast<double>(total.points);
+        }
+    }
+    std::cout << "}" << std::endl;
+    return total.errors ? 2 : 0;
+}
@@ -93,8 +93,39 @@ struct TestRunResults {
     // Performance
     std::vector<double> perf;
     std::vector<double> gz_perf;
+    double write_rate;   //< column store write throughput (M el/sec)
+    double encode_rate;  //< block encoding throughput (M el/sec)
 };
 
+/** Encode every series into blocks using `DataBlockWriter::put_range`.
+  * @return throughput in millions of elements per second
+  */
+static double block_encode_rate(UncompressedChunk const& header) {
+    std::map<aku_ParamId, std::pair<std::vector<aku_Timestamp>, std::vector<double>>> series;
+    for (size_t i = 0; i < header.paramids.size(); i++) {
+        auto& s = series[header.paramids[i]];
+        s.first.push_back(header.timestamps[i]);
+        s.second.push_back(header.values[i]);
+    }
+    std::vector<u8> block(StorageEngine::AKU_BLOCK_SIZE);
+    PerfTimer tm;
+    for (auto const& kv: series) {
+        auto const& ts = kv.second.first;
+        auto const& xs = kv.second.second;
+        size_t pos = 0;
+        while (pos < ts.size()) {
+            StorageEngine::DataBlockWriter writer(kv.first, block.data(), static_cast<int>(block.size()));
+            size_t n = writer.put_range(ts.data() + pos, xs.data() + pos, ts.size() - pos);
+            writer.commit();
+            if (n == 0) {
+                break;
+            }
+            pos += n;
+        }
+    }
+    return header.paramids.size()/tm.elapsed()/1000000.0;
+}
+
 TestRunResults run_tests(fs::path path) {
     TestRunResults runresults;
     runresults.file_name = fs::basename(path);
@@ -111,6 +142,7 @@ TestRunResults run_tests(fs::path path) {
 
     aku_ParamId previd = 0;
     std::vector<u64> rpoints;
+    PerfTimer tm;
     for (size_t i = 0; i < header.paramids.size(); i++) {
         aku_Sample sample = {};
         sample.payload.type = AKU_PAYLOAD_FLOAT;
@@ -122,6 +154,7 @@ TestRunResults run_tests(fs::path path) {
         }
         cstore->write(sample, &rpoints, nullptr);
     }
+    runresults.write_rate = header.paramids.size()/tm.elapsed()/1000000.0;
     auto store_stats = bstore->get_stats();
     auto uncommitted = cstore->_get_uncommitted_memory();
     cstore->close();
@@ -141,6 +174,7 @@ TestRunResults run_tests(fs::path path) {
     runresults.nelements            = header.timestamps.size();
     runresults.bytes_per_element    = BYTES_PER_EL;
     runresults.compression_ratio    = COMPRESSION_RATIO;
+    runresults.encode_rate          = block_encode_rate(header);
 
     // Try to decompress
     // TBD
@@ -170,8 +204,8 @@ int main(int argc, char** argv) {
     }
 
     // Write table
-    std::cout << "| File name | num elements | uncompressed | compressed | ratio | bytes/el |" << std::endl;
-    std::cout << "| ----- | ---- | ----- | ---- | ----- | ---- | " << std::endl;
+    std::cout << "| File name | num elements | uncompressed | compressed | ratio | bytes/el | write M el/sec | encode M el/sec |" << std::endl;
+    std::cout << "| ----- | ---- | ----- | ---- | ----- | ---- | ---- | ---- | " << std::endl;
     for (auto const& run: results) {
         std::cout << run.file_name << " | " <<
                      run.nelements << " | " <<
@@ -179,6 +213,8 @@ int main(int argc, char** argv) {
                      run.compressed << " | " <<
                      run.compression_ratio << " | " <<
                      run.bytes_per_element << " | " <<
+                     run.write_rate << " | " <<
+                     run.encode_rate << " | " <<
                      std::endl;
     }
 
@@ -35,6 +35,44 @@ struct RandomWalk {
     }
 };
 
+/** Encode `input` in chunks of 16 values using `tput` (capacity is checked once
+  * per chunk, codec stages are fused), decode it back and print throughput.
+  */
+template<class TVal, class TWriter, class TReader, class TWStream, class TRStream>
+static bool bench_codec(const char* name, std::vector<TVal> const& input, size_t nruns) {
+    const size_t CHUNK = 16;
+    ByteVector out(input.size()*24);
+    std::vector<double> timings(nruns, .0);
+    size_t outsize = 0;
+    for (size_t k = 0; k < nruns; k++) {
+        PerfTimer tm;
+        TWStream wstream(out.data(), out.data() + out.size());
+        TWriter writer(wstream);
+        for (size_t i = 0; i + CHUNK <= input.size(); i += CHUNK) {
+            if (!writer.tput(input.data() + i, CHUNK)) {
+                std::cout << name << " encoding error" << std::endl;
+                return false;
+            }
+        }
+        timings.at(k) = tm.elapsed();
+        outsize = wstream.size();
+    }
+    double fastest = *std::min_element(timings.begin(), timings.end());
+    std::cout << name << " fastest run: " << fastest << ", "
+              << (input.size()/fastest/1000000.0) << " M values/sec, "
+              << (double(outsize)/input.size()) << " bytes/value" << std::endl;
+
+    TRStream rstream(out.data(), out.data() + outsize);
+    TReader reader(rstream);
+    for (size_t i = 0; i < input.size(); i++) {
+        if (reader.next() != input[i]) {
+            std::cout << name << " decoding error" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
     const u64 TEST_SIZE = 100000;
     UncompressedChunk header;
@@ -74,4 +112,80 @@ int main(int argc, char** argv) {
     std::cout << "Total bytes: " << total_bytes << std::endl;
     std::cout << "Compression: " << (double(UNCOMPRESSED_SIZE)/double(total_bytes/nruns)) << std::endl;
     std::cout << "Bytes/point: " << (double(total_bytes/nruns)/TEST_SIZE) << std::endl;
+
+    auto report = [&](const char* name, std::vector<double> const& timings) {
+        double fastest = std::accumulate(timings.begin(), timings.end(), 1E10, [](double a, double b) {
+            return std::min(a, b);
+        });
+        std::cout << name << " fastest run: " << fastest << ", "
+                  << (TEST_SIZE/fastest/1000000.0) << " M points/sec" << std::endl;
+        return fastest;
+    };
+    double put_time = report("Encoding (put)", timings);
+
+    for (size_t k = 0; k < nruns; k++) {
+        PerfTimer tm;
+        Akumuli::StorageEngine::DataBlockWriter writer(42, out.data(), static_cast<int>(out.size()));
+        writer.put_range(header.timestamps.data(), header.values.data(), TEST_SIZE);
+        writer.commit();
+        timings.at(k) = tm.elapsed();
+    }
+    double range_time = report("Encoding (put_range)", timings);
+    std::cout << "Speedup: " << (put_time/range_time) << std::endl;
+
+    // Codec stacks, integer inputs are derived from the test data
+    std::vector<u64> ts64(header.timestamps.begin(), header.timestamps.end());
+    std::vector<u32> ts32;
+    std::vector<i64> xs64;
+    for (size_t i = 0; i < TEST_SIZE; i++) {
+        ts32.push_back(static_cast<u32>(header.timestamps[i] >> 15));
+        xs64.push_back(static_cast<i64>(header.values[i]*1000.0));
+    }
+    using namespace Akumuli::StorageEngine;
+    bool codecs_ok = bench_codec<u64, DeltaRLEWriter, DeltaRLEReader, Base128StreamWriter, Base128StreamReader>(
+                         "DeltaRLE (u64)", ts64, nruns)
+                  && bench_codec<i64, ZDeltaRLEWriter, ZDeltaRLEReader, Base128StreamWriter, Base128StreamReader>(
+                         "ZigZag DeltaRLE (i64)", xs64, nruns)
+                  && bench_codec<u64, DeltaDeltaStreamWriter<16, u64>, DeltaDeltaStreamReader<16, u64>,
+                                 VByteStreamWriter, VByteStreamReader>("DeltaDelta (u64)", ts64, nruns)
+                  && bench_codec<u32, DeltaDeltaStreamWriter<16, u32>, DeltaDeltaStreamReader<16, u32>,
+                                 VByteStreamWriter, VByteStreamReader>("DeltaDelta (u32)", ts32, nruns);
+    if (!codecs_ok) {
+        return 1;
+    }
+
+    // Decompression
+    Akumuli::StorageEngine::DataBlockWriter writer(42, out.data(), static_cast<int>(out.size()));
+    for (size_t i = 0; i < header.timestamps.size(); i++) {
+        writer.put(header.timestamps[i], header.values[i]);
+    }
+    size_t outsize = writer.commit();
+
+    std::vector<aku_Timestamp> tsout(TEST_SIZE, 0);
+    std::vector<double> xsout(TEST_SIZE, 0);
+    for (size_t k = 0; k < nruns; k++) {
+        PerfTimer tm;
+        Akumuli::StorageEngine::DataBlockReader reader(out.data(), outsize);
+        for (size_t i = 0; i < TEST_SIZE; i++) {
+            aku_Status status;
+            std::tie(status, tsout[i], xsout[i]) = reader.next();
+        }
+        timings.at(k) = tm.elapsed();
+    }
+    double scalar = report("Decoding (next)", timings);
+
+    for (size_t k = 0; k < nruns; k++) {
+        PerfTimer tm;
+        Akumuli::StorageEngine::DataBlockReader reader(out.data(), outsize);
+        reader.read_batch(tsout.data(), xsout.data(), TEST_SIZE);
+        timings.at(k) = tm.elapsed();
+    }
+    double batch = report("Decoding (read_batch)", timings);
+    std::cout << "Speedup: " << (scalar/batch) << std::endl;
+    if (!std::equal(tsout.begin(), tsout.end(), header.timestamps.begin()) ||
+        !std::equal(xsout.begin(), xsout.end(), header.values.begin()))
+    {
+        std::cout << "Decoding error" << std::endl;
+        return 1;
+    }
 }
@@ -27,5 +27,17 @@ int main() {
     double elapsed = timer.elapsed();
     std::cout << "Summ: " << tsacc << std::endl;
     std::cout << "Elapsed: " << elapsed << std::endl;
+
+    // Formatting, timestamps are 1ms apart so many values share the same second
+    aku_Timestamp base = DateTimeUtil::from_iso_string(test_strings[0]);
+    char buffer[0x100];
+    size_t lenacc = 0;
+    timer.restart();
+    for(int k = 1000000; k --> 0;) {
+        lenacc += DateTimeUtil::to_iso_string(base + k*1000000ul, buffer, sizeof(buffer));
+    }
+    elapsed = timer.elapsed();
+    std::cout << "Formatted: " << lenacc << std::endl;
+    std::cout << "Elapsed: " << elapsed << std::endl;
     return 0;
 }
@@ -1,24 +1,105 @@
-#include "invertedindex.h"
+#include "index/invertedindex.h"
+#include "perftest_tools.h"
+
 #include <iostream>
-#include <cstring>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <iterator>
 
 using namespace Akumuli;
 
-int main() {
+//! Number of series in the posting lists
+const u64 NSERIES = 1000000;
+//! Average distance between ids (ids are string pool offsets)
+const u64 ID_STEP = 40;
+const int NITERS = 10;
 
-    InvertedIndex index(128);
+/** Generate sorted list of ids.
+  * @param fraction is a probability of the id to be included in the list
+  */
+static std::vector<u64> generate_ids(std::mt19937& rng, double fraction) {
+    std::bernoulli_distribution coin(fraction);
+    std::vector<u64> res;
+    u64 id = 1ull << 23;
+    for (u64 i = 0; i < NSERIES; i++) {
+        id += ID_STEP;
+        if (coin(rng)) {
+            res.push_back(id);
+        }
+    }
+    return res;
+}
 
-    for (int i = 0; i < 1000; i++) {
-        char buffer[128];
-        int n = snprintf(buffer, 128, "%d", i);
-        index.append(i, buffer, buffer + n);
+static CompressedPList to_plist(std::vector<u64> const& ids) {
+    CompressedPList res;
+    for (auto id: ids) {
+        res.add(id);
     }
+    return res;
+}
 
-    const char* query = "981";
-    auto results = index.get_count(query, query + strlen(query));
-    for (auto kv: results) {
-        std::cout << "kv: " << kv.first << ", " << kv.second << std::endl;
+template<class Fn>
+static void run(const char* name, Fn const& fn) {
+    PerfTimer tm;
+    size_t card = 0;
+    for (int i = 0; i < NITERS; i++) {
+        card += fn();
     }
+    double elapsed = tm.elapsed();
+    std::cout << name << ": " << (elapsed / NITERS * 1000.0) << "ms (cardinality: "
+              << card / NITERS << ")" << std::endl;
+}
+
+int main() {
+    std::mt19937 rng(42);
+    // Large metric-wide list, large tag list (e.g. `pod`) and small tag list (e.g. `host`)
+    auto metric = generate_ids(rng, 0.9);
+    auto large = generate_ids(rng, 0.5);
+    auto small = generate_ids(rng, 0.001);
+
+    auto pmetric = to_plist(metric);
+    auto plarge = to_plist(large);
+    auto psmall = to_plist(small);
+
+    std::cout << "Posting list sizes (bytes): " << pmetric.getSizeInBytes() << ", "
+              << plarge.getSizeInBytes() << ", " << psmall.getSizeInBytes() << std::endl;
 
+    run("sorted vectors, intersection (large)", [&]() {
+        std::vector<u64> res;
+        std::set_intersection(metric.begin(), metric.end(), large.begin(), large.end(),
+                              std::back_inserter(res));
+        return res.size();
+    });
+    run("compressed plist, intersection (large)", [&]() {
+        return (pmetric & plarge).cardinality();
+    });
+    run("sorted vectors, intersection (small)", [&]() {
+        std::vector<u64> res;
+        std::set_intersection(metric.begin(), metric.end(), small.begin(), small.end(),
+                              std::back_inserter(res));
+        return res.size();
+    });
+    run("compressed plist, intersection (small)", [&]() {
+        return (pmetric & psmall).cardinality();
+    });
+    run("sorted vectors, union", [&]() {
+        std::vector<u64> res;
+        std::set_union(metric.begin(), metric.end(), large.begin(), large.end(),
+                       std::back_inserter(res));
+        return res.size();
+    });
+    run("compressed plist, union", [&]() {
+        return (pmetric | plarge).cardinality();
+    });
+    run("sorted vectors, difference", [&]() {
+        std::vector<u64> res;
+        std::set_difference(metric.begin(), metric.end(), large.begin(), large.end(),
+                            std::back_inserter(res));
+        return res.size();
+    });
+    run("compressed plist, difference", [&]() {
+        return (pmetric ^ plarge).cardinality();
+    });
     return 0;
 }
@@ -0,0 +1,204 @@
+/**
+ * Microbenchmarks of the storage kernels (block codec, aggregation, string pool,
+ * posting lists and block cache). See `MicroBenchmark` for command line options.
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <apr.h>
+
+#include "perftest_tools.h"
+#include "log_iface.h"
+#include "storage_engine/blockstore.h"
+#include "storage_engine/compression.h"
+#include "storage_engine/operators/operator.h"
+#include "index/stringpool.h"
+#include "index/invertedindex.h"
+
+using namespace Akumuli;
+using namespace Akumuli::StorageEngine;
+
+//! Result of the computation, prevents the compiler from removing benchmark loops
+static volatile double g_sink = 0;
+
+//! Generate random walk
+static std::vector<double> make_values(size_t n) {
+    std::mt19937 gen(42);
+    std::normal_distribution<double> dist(0.0, 1.0);
+    std::vector<double> xs;
+    double x = 100.0;
+    for (size_t i = 0; i < n; i++) {
+        x += dist(gen);
+        xs.push_back(x);
+    }
+    return xs;
+}
+
+static void add_datablock_benchmarks(MicroBenchmark& bench) {
+    auto xs = make_values(AKU_BLOCK_SIZE);
+
+    bench.add("DataBlockWriter::put", [xs]() {
+        std::vector<u8> buffer(AKU_BLOCK_SIZE);
+        DataBlockWriter writer(42, buffer.data(), AKU_BLOCK_SIZE);
+        size_t n = 0;
+        while (n < xs.size() && writer.put(1000 + n*10, xs[n]) == AKU_SUCCESS) {
+            n++;
+        }
+        writer.commit();
+        return n;
+    });
+
+    // Block is encoded once and decoded in every iteration
+    auto block = std::make_shared<std::vector<u8>>(AKU_BLOCK_SIZE);
+    {
+        DataBlockWriter writer(42, block->data(), AKU_BLOCK_SIZE);
+        size_t n = 0;
+        while (n < xs.size() && writer.put(1000 + n*10, xs[n]) == AKU_SUCCESS) {
+            n++;
+        }
+        writer.commit();
+    }
+    bench.add("DataBlockReader::next", [block]() {
+        DataBlockReader reader(block->data(), block->size());
+        size_t n = reader.nelements();
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            aku_Status status;
+            aku_Timestamp ts;
+            double x;
+            std::tie(status, ts, x) = reader.next();
+            sum += x;
+        }
+        g_sink = sum;
+        return n;
+    });
+}
+
+static void add_aggregation_benchmarks(MicroBenchmark& bench) {
+    static const size_t N = 0x1000;
+    auto xs = make_values(N);
+    std::vector<AggregationResult> partial;
+    for (size_t i = 0; i < N; i++) {
+        AggregationResult res = INIT_AGGRES;
+        res.add(1000 + i*10, xs[i], true);
+        res.add(1005 + i*10, xs[i]/2, true);
+        partial.push_back(res);
+    }
+    bench.add("AggregationResult::combine", [partial]() {
+        AggregationResult total = INIT_AGGRES;
+        for (auto const& res: partial) {
+            total.combine(res);
+        }
+        g_sink = total.sum;
+        return partial.size();
+    });
+}
+
+static void add_stringpool_benchmarks(MicroBenchmark& bench) {
+    static const size_t N = 10000;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < N; i++) {
+        names.push_back("cpu.user host=host_" + std::to_string(i) + " region=region_" + std::to_string(i % 20));
+    }
+    bench.add("StringPool::add", [names]() {
+        StringPool pool;
+        u64 sum = 0;
+        for (auto const& name: names) {
+            sum += pool.add(name.data(), name.data() + name.size());
+        }
+        g_sink = static_cast<double>(sum);
+        return names.size();
+    });
+}
+
+static void add_plist_benchmarks(MicroBenchmark& bench) {
+    static const u64 N = 100000;
+    auto plist = std::make_shared<CompressedPList>();
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<u64> step(1, 100);
+    u64 id = 1024;
+    for (u64 i = 0; i < N; i++) {
+        id += step(gen);
+        plist->add(id);
+    }
+    bench.add("CompressedPList::iterate", [plist]() {
+        u64 sum = 0;
+        size_t n = 0;
+        for (auto it = plist->begin(); it != plist->end(); ++it) {
+            sum += *it;
+            n++;
+        }
+        g_sink = static_cast<double>(sum);
+        return n;
+    });
+}
+
+static void add_blockcache_benchmarks(MicroBenchmark& bench) {
+    static const u64 NBLOCKS = 1024;
+    static const size_t NLOOKUPS = 100000;
+    // Half of the addresses are not cached
+    auto cache = std::make_shared<BlockCache>(NBLOCKS*AKU_BLOCK_SIZE);
+    for (u64 addr = 0; addr < NBLOCKS; addr++) {
+        std::vector<u8> data(AKU_BLOCK_SIZE, static_cast<u8>(addr));
+        cache->insert(std::make_shared<Block>(addr, std::move(data)));
+    }
+    std::vector<LogicAddr> addrs;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<u64> dist(0, 2*NBLOCKS - 1);
+    for (size_t i = 0; i < NLOOKUPS; i++) {
+        addrs.push_back(dist(gen));
+    }
+    bench.add("BlockCache::lookup", [cache, addrs]() {
+        size_t nhits = 0;
+        for (auto addr: addrs) {
+            if (cache->lookup(addr)) {
+                nhits++;
+            }
+        }
+        g_sink = static_cast<double>(nhits);
+        return addrs.size();
+    });
+}
+
+static void logger(aku_LogLevel, const char*) {
+}
+
+int main(int argc, char** argv) {
+    apr_initialize();
+    Logger::set_logger(&logger);
+
+    MicroBenchmark bench;
+    if (!bench.parse_args(argc, argv)) {
+        std::cerr << "Usage: perf_kernels [--warmup N] [--reps N] [--filter STR] "
+                     "[--output FILE] [--baseline FILE] [--threshold X]" << std::endl;
+        return 1;
+    }
+    add_datablock_benchmarks(bench);
+    add_aggregation_benchmarks(bench);
+    add_stringpool_benchmarks(bench);
+    add_plist_benchmarks(bench);
+    add_blockcache_benchmarks(bench);
+
+    int nregressions = bench.run();
+    if (nregressions < 0) {
+        return 1;
+    }
+    return nregressions ? 2 : 0;
+}
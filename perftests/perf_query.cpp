@@ -0,0 +1,297 @@
+/**
+ * Query latency benchmark.
+ *
+ * Generates synthetic dataset (configurable number of series, tags, points and
+ * sparsity), runs a mix of queries against it (cold and warm) and prints
+ * latency percentiles and throughput as JSON lines.
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+#include "akumuli.h"
+#include "perftest_tools.h"
+
+using namespace Akumuli;
+
+namespace po = boost::program_options;
+
+static const char* DB_NAME = "perfquery";
+static const char* DB_PATH = "/tmp";
+static const char* DB_META_FILE = "/tmp/perfquery.akumuli";
+
+//! Dataset parameters
+struct DatasetParams {
+    u32    nseries;     //< number of series per metric
+    u32    ntags;       //< number of distinct values of every tag
+    u64    npoints;     //< number of points per series
+    double sparsity;    //< probability of the missing point (0 - dense, 1 - empty)
+    u64    step;        //< distance between points
+};
+
+//! Benchmark parameters
+struct BenchParams {
+    u32 nruns;          //< number of warm runs of every query
+    u32 ncold;          //< number of cold runs of every query (database is reopened before each)
+};
+
+//! Query latency results
+struct QueryStats {
+    std::vector<double> latencies;  //< in seconds
+    u64 nsamples;
+    u64 nerrors;
+};
+
+void logger_(aku_LogLevel level, const char * msg) {
+    if (level == AKU_LOG_ERROR) {
+        aku_console_logger(level, msg);
+    }
+}
+
+static aku_Database* open_database() {
+    aku_FineTuneParams params = {};
+    auto db = aku_open_database(DB_META_FILE, params);
+    if (db == nullptr) {
+        std::cerr << "Can't open database " << DB_META_FILE << std::endl;
+        std::exit(1);
+    }
+    return db;
+}
+
+static std::string series_name(const char* metric, u32 ix, DatasetParams const& ds) {
+    std::stringstream str;
+    str << metric << " host=h" << ix
+        << " region=r" << (ix % ds.ntags)
+        << " rack=k" << ((ix / ds.ntags) % ds.ntags);
+    return str.str();
+}
+
+static void generate_dataset(aku_Database* db, DatasetParams const& ds) {
+    const char* metrics[] = { "cpu.user", "cpu.sys" };
+    auto session = aku_create_session(db);
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<double> skip(0.0, 1.0);
+    std::normal_distribution<double> walk(0.0, 1.0);
+    std::vector<aku_ParamId> ids;
+    for (auto metric: metrics) {
+        for (u32 i = 0; i < ds.nseries; i++) {
+            auto name = series_name(metric, i, ds);
+            aku_Sample sample;
+            if (aku_series_to_param_id(session, name.data(), name.data() + name.size(), &sample) != AKU_SUCCESS) {
+                std::cerr << "Can't add series " << name << std::endl;
+                std::exit(1);
+            }
+            ids.push_back(sample.paramid);
+        }
+    }
+    std::vector<double> values(ids.size(), 100.0);
+    PerfTimer timer;
+    u64 nwritten = 0;
+    for (u64 t = 0; t < ds.npoints; t++) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            values[i] += walk(generator);
+            if (skip(generator) < ds.sparsity) {
+                continue;
+            }
+            aku_Sample sample = {};
+            sample.paramid = ids[i];
+            sample.timestamp = t * ds.step;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.float64 = values[i];
+            aku_Status status = aku_write(session, &sample);
+            if (status != AKU_SUCCESS) {
+                std::cerr << "Write error: " << aku_error_message(status) << std::endl;
+                std::exit(1);
+            }
+            nwritten++;
+        }
+    }
+    aku_destroy_session(session);
+    std::cout << "{\"dataset\": {\"series\": " << ids.size()
+              << ", \"points\": " << nwritten
+              << ", \"seconds\": " << timer.elapsed() << "}}" << std::endl;
+}
+
+//! Run single query, returns number of samples or -1 on error
+static i64 run_query(aku_Database* db, std::string const& query) {
+    const int NUM_ELEMENTS = 1000;
+    aku_Sample samples[NUM_ELEMENTS];
+    auto session = aku_create_session(db);
+    auto cursor = aku_query(session, query.c_str());
+    i64 count = 0;
+    while (!aku_cursor_is_done(cursor)) {
+        aku_Status err = AKU_SUCCESS;
+        if (aku_cursor_is_error(cursor, &err)) {
+            std::cerr << "Query error: " << aku_error_message(err) << ", query: " << query << std::endl;
+            count = -1;
+            break;
+        }
+        // Output size is not checked, the buffer holds a batch of fixed size samples
+        // (variable sized tuples of join/group-aggregate queries are counted as one sample)
+        auto nbytes = aku_cursor_read(cursor, samples, sizeof(samples));
+        count += static_cast<i64>(nbytes / sizeof(aku_Sample));
+    }
+    aku_Status err = AKU_SUCCESS;
+    if (count >= 0 && aku_cursor_is_error(cursor, &err)) {
+        std::cerr << "Query error: " << aku_error_message(err) << ", query: " << query << std::endl;
+        count = -1;
+    }
+    aku_cursor_close(cursor);
+    aku_destroy_session(session);
+    return count;
+}
+
+static double percentile(std::vector<double> values, double q) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    auto ix = static_cast<size_t>(q * static_cast<double>(values.size() - 1) + 0.5);
+    return values.at(std::min(ix, values.size() - 1));
+}
+
+static void report(std::string const& name, std::string const& mode, QueryStats const& stats) {
+    double total = 0;
+    for (auto it: stats.latencies) {
+        total += it;
+    }
+    double throughput = total > 0 ? static_cast<double>(stats.nsamples) / total : 0.0;
+    std::cout << "{\"query\": \"" << name << "\""
+              << ", \"mode\": \"" << mode << "\""
+              << ", \"runs\": " << stats.latencies.size()
+              << ", \"errors\": " << stats.nerrors
+              << ", \"p50_ms\": " << percentile(stats.latencies, 0.50) * 1000.0
+              << ", \"p99_ms\": " << percentile(stats.latencies, 0.99) * 1000.0
+              << ", \"samples\": " << stats.nsamples
+              << ", \"samples_per_sec\": " << throughput
+              << "}" << std::endl;
+}
+
+static void measure(aku_Database* db, std::string const& query, QueryStats* stats) {
+    PerfTimer timer;
+    auto count = run_query(db, query);
+    auto elapsed = timer.elapsed();
+    if (count < 0) {
+        stats->nerrors++;
+        return;
+    }
+    stats->latencies.push_back(elapsed);
+    stats->nsamples += static_cast<u64>(count);
+}
+
+static std::vector<std::pair<std::string, std::string>> make_queries(DatasetParams const& ds) {
+    u64 end = ds.npoints * ds.step;
+    u64 step = std::max<u64>(ds.step, end / 100);
+    std::stringstream range;
+    range << "\"range\": { \"from\": 0, \"to\": " << end << "}";
+    auto r = range.str();
+    std::vector<std::pair<std::string, std::string>> queries = {
+        { "select",
+          "{ \"select\": \"cpu.user\", " + r + "}" },
+        { "aggregate",
+          "{ \"aggregate\": { \"cpu.user\": \"max\" }, " + r + "}" },
+        { "group-aggregate",
+          "{ \"group-aggregate\": { \"metric\": \"cpu.user\", \"step\": \"" + std::to_string(step) +
+          "n\", \"func\": [ \"min\", \"max\", \"count\" ] }, " + r + "}" },
+        { "join",
+          "{ \"join\": [ \"cpu.user\", \"cpu.sys\" ], " + r + "}" },
+        { "group-by",
+          "{ \"select\": \"cpu.user\", \"group-by\": [ \"region\" ], \"order-by\": \"time\", " + r + "}" },
+        { "where",
+          "{ \"select\": \"cpu.user\", \"where\": { \"region\": [ \"r0\" ] }, " + r + "}" },
+    };
+    return queries;
+}
+
+int main(int argc, char** argv) {
+    DatasetParams ds;
+    BenchParams bench;
+    bool keep = false;
+
+    po::options_description desc("Query latency benchmark");
+    desc.add_options()
+        ("help", "Produce help message")
+        ("series", po::value<u32>(&ds.nseries)->default_value(1000), "Number of series per metric")
+        ("tags", po::value<u32>(&ds.ntags)->default_value(10), "Number of distinct values of every tag")
+        ("points", po::value<u64>(&ds.npoints)->default_value(10000), "Number of points per series")
+        ("sparsity", po::value<double>(&ds.sparsity)->default_value(0.0), "Probability of the missing point [0, 1)")
+        ("step", po::value<u64>(&ds.step)->default_value(1000), "Distance between points (in timestamp units)")
+        ("runs", po::value<u32>(&bench.nruns)->default_value(20), "Number of warm runs of every query")
+        ("cold", po::value<u32>(&bench.ncold)->default_value(3), "Number of cold runs of every query")
+        ("keep", po::bool_switch(&keep), "Don't remove the database at exit")
+    ;
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (po::error const& e) {
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    if (ds.ntags == 0 || ds.nseries == 0 || ds.step == 0 || ds.sparsity < 0.0 || ds.sparsity >= 1.0) {
+        std::cerr << "Invalid dataset parameters" << std::endl << desc << std::endl;
+        return 1;
+    }
+
+    aku_initialize(nullptr, logger_);
+    aku_remove_database(DB_META_FILE, true);
+    aku_Status status = aku_create_database_ex(DB_NAME, DB_PATH, DB_PATH, 4, 256*1024*1024, false);
+    if (status != AKU_SUCCESS) {
+        std::cerr << "Can't create database: " << aku_error_message(status) << std::endl;
+        return 1;
+    }
+
+    auto db = open_database();
+    generate_dataset(db, ds);
+    aku_close_database(db);
+
+    auto queries = make_queries(ds);
+    for (auto const& query: queries) {
+        // Cold runs: database is reopened so the block cache is empty (OS page cache is not dropped)
+        QueryStats cold = {};
+        for (u32 i = 0; i < bench.ncold; i++) {
+            db = open_database();
+            measure(db, query.second, &cold);
+            aku_close_database(db);
+        }
+        report(query.first, "cold", cold);
+
+        QueryStats warm = {};
+        db = open_database();
+        run_query(db, query.second);  // warm up
+        for (u32 i = 0; i < bench.nruns; i++) {
+            measure(db, query.second, &warm);
+        }
+        aku_close_database(db);
+        report(query.first, "warm", warm);
+    }
+
+    if (!keep) {
+        aku_remove_database(DB_META_FILE, true);
+    }
+    return 0;
+}
@@ -2,6 +2,8 @@
 #include "perftest_tools.h"
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
 const int TEST_ITERATIONS = 100000;
 const int N_TESTS = 1000;
@@ -10,41 +12,51 @@ using namespace Akumuli;
 
 bool push_to_graphite = false;
 
-int main(int argc, char *argv[]) {
-    if (argc == 2) {
-        push_to_graphite = std::string(argv[1]) == "graphite";
+//! Stream reader without direct access, RESPStream uses the slow path
+struct SlowStreamReader : MemStreamReader {
+    SlowStreamReader(const Byte* buffer, size_t buffer_len)
+        : MemStreamReader(buffer, buffer_len)
+    {
     }
-    const char* pattern = ":1234567\r\n+3.14159\r\n";
-    std::string input;
-    for (int i = 0; i < TEST_ITERATIONS/2; i++) {
-        input += pattern;
+
+    virtual size_t get_chunk(const Byte** data) const override {
+        return ByteStreamReader::get_chunk(data);
     }
+};
+
+template<class Reader>
+double run_test(std::string const& input) {
     std::vector<double> timedeltas;
+    bool success;
     u64 intvalue;
+    int len;
     Byte buffer[RESPStream::STRING_LENGTH_MAX];
     for (int i = N_TESTS; i --> 0;) {
         PerfTimer tm;
-        MemStreamReader stream(input.data(), input.size());
+        Reader stream(input.data(), input.size());
         RESPStream protocol(&stream);
         for (int j = TEST_ITERATIONS; j --> 0;) {
             auto type = protocol.next_type();
             switch(type) {
             case RESPStream::INTEGER:
-                intvalue = protocol.read_int();
-                if (intvalue != 1234567) {
+                std::tie(success, intvalue) = protocol.read_int();
+                if (!success || intvalue != 1234567) {
                     std::cerr << "Bad int value at " << j << std::endl;
                     return -1;
                 }
                 break;
             case RESPStream::STRING: {
-                    int len = protocol.read_string(buffer, sizeof(buffer));
-                    if (len != 7) {
+                    std::tie(success, len) = protocol.read_string(buffer, sizeof(buffer));
+                    if (!success || len != 7) {
                         std::cerr << "Bad string value at " << j << std::endl;
                         return -1;
                     }
-                    char *p = buffer;
-                    double res = strtod(buffer, &p);
-                    if (abs(res - 3.14159) > 0.0001) {
+                    double res;
+                    if (!parse_decimal(buffer, buffer + len, &res)) {
+                        buffer[len] = '\0';
+                        res = strtod(buffer, nullptr);
+                    }
+                    if (std::abs(res - 3.14159) > 0.0001) {
                         std::cerr << "Can't parse float at " << j << std::endl;
                         return -1;
                     }
@@ -65,7 +77,25 @@ int main(int argc, char *argv[]) {
     for (auto t: timedeltas) {
         min = std::min(min, t);
     }
+    return min;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        push_to_graphite = std::string(argv[1]) == "graphite";
+    }
+    const char* pattern = ":1234567\r\n+3.14159\r\n";
+    std::string input;
+    for (int i = 0; i < TEST_ITERATIONS/2; i++) {
+        input += pattern;
+    }
+    double slow = run_test<SlowStreamReader>(input);
+    double min = run_test<MemStreamReader>(input);
+    if (slow < 0 || min < 0) {
+        return -1;
+    }
     std::cout << "Parsing " << TEST_ITERATIONS << " messages in " << min << " sec." << std::endl;
+    std::cout << "Parsing " << TEST_ITERATIONS << " messages without direct access in " << slow << " sec." << std::endl;
     if (push_to_graphite) {
         push_metric_to_graphite("respstream", 1000.0*min);
     }
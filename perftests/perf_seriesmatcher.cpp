@@ -4,9 +4,13 @@
 #include <cstdlib>
 #include <time.h>
 #include <stdio.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "util.h"
-#include "seriesparser.h"
+#include "index/seriesparser.h"
 
 using namespace Akumuli;
 
@@ -45,15 +49,52 @@ int main() {
     // Load data to the matcher
     char input[0x1000];
     char output[0x1000];
+    std::vector<std::string> names;
     for(int i = 0; i < NELEMENTS; i++) {
-        int n = sprintf(input, series_name_fmt, i%100000, i%100000);
+        int n = sprintf(input, series_name_fmt, i, i%100);
         const char* keystr = nullptr;
         const char* outend = nullptr;
-        SeriesParser::to_normal_form(input, input+n, output, output+n+1, &keystr, &outend);
+        SeriesParser::to_canonical_form(input, input+n, output, output+n+1, &keystr, &outend);
         matcher.add(output, outend);
+        names.emplace_back(static_cast<const char*>(output), outend);
     }
     double elapsed = tm.elapsed();
     std::cout << "Putting " << NELEMENTS << " values to the matcher in "
               << elapsed << " seconds" << std::endl;
-}
 
+    // Match existing names (ingestion hot path)
+    const int NTHREADS = 4;
+    const int NROUNDS = 4;
+    std::atomic<u64> nmatched = {0};
+    auto lookup = [&](int offset) {
+        u64 n = 0;
+        for (int r = 0; r < NROUNDS; r++) {
+            for (size_t i = offset; i < names.size(); i += 7) {
+                auto const& name = names[i];
+                auto hash = StringTools::hash(std::make_pair(name.data(), static_cast<int>(name.size())));
+                if (matcher.match(name.data(), name.data() + name.size(), hash) != 0) {
+                    n++;
+                }
+            }
+        }
+        nmatched += n;
+    };
+    tm.restart();
+    lookup(0);
+    elapsed = tm.elapsed();
+    std::cout << "Matching " << nmatched.load() << " values in "
+              << elapsed << " seconds (1 thread)" << std::endl;
+
+    nmatched.store(0);
+    tm.restart();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < NTHREADS; i++) {
+        threads.emplace_back(lookup, i);
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    elapsed = tm.elapsed();
+    std::cout << "Matching " << nmatched.load() << " values in "
+              << elapsed << " seconds (" << NTHREADS << " threads)" << std::endl;
+}
@@ -0,0 +1,304 @@
+/**
+ * Startup and recovery time benchmark.
+ *
+ * Creates database with N series and M points per series, shuts it down (cleanly
+ * or without calling close, like crashed process does) and then reopens it several
+ * times. Duration of every startup phase (block store, index snapshot, series names,
+ * columns, input log replay) and latency of the first query are printed as JSON
+ * lines. Every open runs in a separate process, so the state of the database left
+ * by the unclean shutdown is the same for every run.
+ *
+ * Built as `perf_startup` (clean shutdown by default) and `perf_recovery` (unclean
+ * shutdown by default, AKU_PERF_RECOVERY is defined).
+ *
+ * Copyright (c) 2017 Eugene Lazin <4lazin@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "akumuli.h"
+#include "perftest_tools.h"
+
+using namespace Akumuli;
+
+namespace po = boost::program_options;
+
+static const char* DB_NAME = "perfstartup";
+static const char* DB_PATH = "/tmp";
+static const char* DB_META_FILE = "/tmp/perfstartup.akumuli";
+
+#ifdef AKU_PERF_RECOVERY
+static const char* DEFAULT_SHUTDOWN = "unclean";
+#else
+static const char* DEFAULT_SHUTDOWN = "clean";
+#endif
+
+//! Benchmark parameters
+struct Params {
+    u32  nseries;       //< number of series
+    u64  npoints;       //< number of points per series
+    u64  step;          //< distance between points
+    u32  nruns;         //< number of measured opens
+    u32  sync_wait;     //< time given to the sync worker before unclean shutdown (ms)
+    bool unclean;       //< don't close the database
+};
+
+void logger_(aku_LogLevel level, const char * msg) {
+    if (level == AKU_LOG_ERROR) {
+        aku_console_logger(level, msg);
+    }
+}
+
+static aku_Database* open_database() {
+    aku_FineTuneParams params = {};
+    auto db = aku_open_database(DB_META_FILE, params);
+    if (db == nullptr) {
+        std::cerr << "Can't open database " << DB_META_FILE << std::endl;
+        std::exit(1);
+    }
+    return db;
+}
+
+/** Shutdown the database. Unclean shutdown skips `aku_close_database`, the process
+  * exits after the sync worker had a chance to save rescue points (buffered writes
+  * are lost, as if the process was killed).
+  */
+static void shutdown_database(aku_Database* db, Params const& params, int code) {
+    if (params.unclean) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(params.sync_wait));
+        std::cout.flush();
+        std::cerr.flush();
+        _exit(code);
+    }
+    aku_close_database(db);
+    std::cout.flush();
+    std::exit(code);
+}
+
+//! Run `fn` in the child process, returns its exit code
+template<class Fn>
+static int run_in_child(Fn const& fn) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Can't fork" << std::endl;
+        std::exit(1);
+    }
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static void generate_dataset(Params const& params) {
+    auto db = open_database();
+    auto session = aku_create_session(db);
+    std::vector<aku_ParamId> ids;
+    for (u32 i = 0; i < params.nseries; i++) {
+        std::stringstream str;
+        str << "cpu host=h" << i << " region=r" << (i % 10);
+        auto name = str.str();
+        aku_Sample sample;
+        if (aku_series_to_param_id(session, name.data(), name.data() + name.size(), &sample) != AKU_SUCCESS) {
+            std::cerr << "Can't add series " << name << std::endl;
+            std::exit(1);
+        }
+        ids.push_back(sample.paramid);
+    }
+    PerfTimer timer;
+    for (u64 t = 0; t < params.npoints; t++) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            aku_Sample sample = {};
+            sample.paramid = ids[i];
+            sample.timestamp = t * params.step;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.float64 = static_cast<double>(t % 1000);
+            aku_Status status = aku_write(session, &sample);
+            if (status != AKU_SUCCESS) {
+                std::cerr << "Write error: " << aku_error_message(status) << std::endl;
+                std::exit(1);
+            }
+        }
+    }
+    aku_destroy_session(session);
+    std::cout << "{\"dataset\": {\"series\": " << ids.size()
+              << ", \"points\": " << ids.size() * params.npoints
+              << ", \"seconds\": " << timer.elapsed()
+              << ", \"shutdown\": \"" << (params.unclean ? "unclean" : "clean") << "\"}}" << std::endl;
+    shutdown_database(db, params, 0);
+}
+
+static boost::property_tree::ptree get_stats(aku_Database* db) {
+    std::vector<char> buffer(0x10000);
+    int len = aku_json_stats(db, buffer.data(), buffer.size());
+    if (len < 0 && len != -1) {
+        buffer.resize(static_cast<size_t>(-len) + 1);
+        len = aku_json_stats(db, buffer.data(), buffer.size());
+    }
+    boost::property_tree::ptree result;
+    if (len > 0) {
+        std::stringstream str(std::string(buffer.data(), static_cast<size_t>(len)));
+        boost::property_tree::json_parser::read_json(str, result);
+    }
+    return result;
+}
+
+/** Run the first query (count of every series), returns total number of points
+  * or -1 on error.
+  */
+static i64 count_points(aku_Database* db, Params const& params) {
+    const int NUM_ELEMENTS = 1000;
+    aku_Sample samples[NUM_ELEMENTS];
+    std::stringstream query;
+    query << "{ \"aggregate\": { \"cpu\": \"count\" }, \"range\": { \"from\": 0, \"to\": "
+          << params.npoints * params.step + 1 << "}}";
+    auto session = aku_create_session(db);
+    auto cursor = aku_query(session, query.str().c_str());
+    i64 count = 0;
+    aku_Status err = AKU_SUCCESS;
+    while (!aku_cursor_is_done(cursor)) {
+        if (aku_cursor_is_error(cursor, &err)) {
+            break;
+        }
+        auto nbytes = aku_cursor_read(cursor, samples, sizeof(samples));
+        for (size_t i = 0; i < nbytes / sizeof(aku_Sample); i++) {
+            count += static_cast<i64>(samples[i].payload.float64);
+        }
+    }
+    if (aku_cursor_is_error(cursor, &err)) {
+        std::cerr << "Query error: " << aku_error_message(err) << std::endl;
+        count = -1;
+    }
+    aku_cursor_close(cursor);
+    aku_destroy_session(session);
+    return count;
+}
+
+static double to_ms(boost::property_tree::ptree const& stats, const char* path) {
+    return static_cast<double>(stats.get<u64>(path, 0)) / 1000000.0;
+}
+
+//! Open the database, measure startup and the first query, print results
+static void measure_open(u32 run, Params const& params) {
+    PerfTimer timer;
+    auto db = open_database();
+    double open_time = timer.elapsed();
+    timer.restart();
+    i64 points = count_points(db, params);
+    double query_time = timer.elapsed();
+    auto stats = get_stats(db);
+    // Clean shutdown should preserve everything, only the data that wasn't
+    // committed to the block store is lost after unclean shutdown
+    i64 expected = static_cast<i64>(params.nseries * params.npoints);
+    bool ok = params.unclean ? points >= 0 && points <= expected
+                             : points == expected;
+    std::cout << "{\"run\": " << run
+              << ", \"shutdown\": \"" << (params.unclean ? "unclean" : "clean") << "\""
+              << ", \"restored\": " << (stats.get<bool>("startup.restored", false) ? "true" : "false")
+              << ", \"open_ms\": " << open_time * 1000.0
+              << ", \"blockstore_ms\": " << to_ms(stats, "startup.blockstore_ns")
+              << ", \"index_ms\": " << to_ms(stats, "startup.index_ns")
+              << ", \"matcher_ms\": " << to_ms(stats, "startup.matcher_ns")
+              << ", \"columns_ms\": " << to_ms(stats, "startup.columns_ns")
+              << ", \"replay_ms\": " << to_ms(stats, "startup.replay_ns")
+              << ", \"first_query_ms\": " << query_time * 1000.0
+              << ", \"series\": " << stats.get<u64>("series.count", 0)
+              << ", \"points\": " << points
+              << ", \"expected_points\": " << expected
+              << ", \"success\": " << (ok ? "true" : "false")
+              << "}" << std::endl;
+    shutdown_database(db, params, ok ? 0 : 1);
+}
+
+int main(int argc, char** argv) {
+    Params params;
+    std::string mode;
+    bool keep = false;
+
+    po::options_description desc("Startup and recovery time benchmark");
+    desc.add_options()
+        ("help", "Produce help message")
+        ("series", po::value<u32>(&params.nseries)->default_value(10000), "Number of series")
+        ("points", po::value<u64>(&params.npoints)->default_value(1000), "Number of points per series")
+        ("step", po::value<u64>(&params.step)->default_value(1000), "Distance between points (in timestamp units)")
+        ("runs", po::value<u32>(&params.nruns)->default_value(5), "Number of measured opens")
+        ("shutdown", po::value<std::string>(&mode)->default_value(DEFAULT_SHUTDOWN), "Shutdown mode (clean or unclean)")
+        ("sync-wait", po::value<u32>(&params.sync_wait)->default_value(1000),
+         "Time given to the sync worker before unclean shutdown (ms)")
+        ("keep", po::bool_switch(&keep), "Don't remove the database at exit")
+    ;
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    } catch (po::error const& e) {
+        std::cerr << e.what() << std::endl << desc << std::endl;
+        return 1;
+    }
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+    if (params.nseries == 0 || params.npoints == 0 || params.step == 0 || (mode != "clean" && mode != "unclean")) {
+        std::cerr << "Invalid parameters" << std::endl << desc << std::endl;
+        return 1;
+    }
+    params.unclean = mode == "unclean";
+
+    aku_initialize(nullptr, logger_);
+    aku_remove_database(DB_META_FILE, true);
+    aku_Status status = aku_create_database_ex(DB_NAME, DB_PATH, DB_PATH, 4, 256*1024*1024, false);
+    if (status != AKU_SUCCESS) {
+        std::cerr << "Can't create database: " << aku_error_message(status) << std::endl;
+        return 1;
+    }
+
+    if (run_in_child([&]() { generate_dataset(params); }) != 0) {
+        std::cerr << "Can't generate dataset" << std::endl;
+        return 1;
+    }
+    u32 nfailures = 0;
+    for (u32 i = 0; i < params.nruns; i++) {
+        if (run_in_child([&]() { measure_open(i, params); }) != 0) {
+            nfailures++;
+        }
+    }
+    std::cout << "{\"summary\": {\"runs\": " << params.nruns
+              << ", \"failures\": " << nfailures
+              << ", \"success\": " << (nfailures == 0 ? "true" : "false") << "}}" << std::endl;
+
+    if (!keep) {
+        aku_remove_database(DB_META_FILE, true);
+    }
+    return nfailures == 0 ? 0 : 1;
+}
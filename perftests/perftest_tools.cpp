@@ -1,7 +1,16 @@
 #include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
 #include <string>
 #include <chrono>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
 #include <time.h>
 #include "perftest_tools.h"
 
@@ -67,4 +76,203 @@ void push_metric_to_graphite(std::string metric, double value) {
     sock.close();
 }
 
+
+MicroBenchmark::MicroBenchmark()
+    : nwarmup_(3)
+    , nreps_(20)
+    , threshold_(0.02)
+{
+}
+
+bool MicroBenchmark::parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "Value expected after " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--warmup") {
+                nwarmup_ = std::stoi(value);
+            } else if (arg == "--reps") {
+                nreps_ = std::stoi(value);
+            } else if (arg == "--threshold") {
+                threshold_ = std::stod(value);
+            } else if (arg == "--filter") {
+                filter_ = value;
+            } else if (arg == "--output") {
+                output_ = value;
+            } else if (arg == "--baseline") {
+                baseline_ = value;
+            } else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                return false;
+            }
+        } catch (std::exception const&) {
+            std::cerr << "Invalid value of " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return nwarmup_ >= 0 && nreps_ > 1;
+}
+
+void MicroBenchmark::add(std::string name, Fn fn) {
+    benchmarks_.push_back({ name, fn });
+}
+
+double MicroBenchmark::t_critical(double dof) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (dof < 1.0) {
+        return table[0];
+    }
+    if (dof <= 30.0) {
+        return table[static_cast<int>(dof) - 1];
+    }
+    if (dof <= 60.0) {
+        return 2.000;
+    }
+    if (dof <= 120.0) {
+        return 1.980;
+    }
+    return 1.960;
+}
+
+MicroBenchmark::Result MicroBenchmark::compute(std::string name, std::vector<double> samples) {
+    Result res = {};
+    res.name = name;
+    res.nreps = samples.size();
+    if (samples.empty()) {
+        return res;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (auto x: samples) {
+        sum += x;
+    }
+    auto n = static_cast<double>(samples.size());
+    res.mean_ns = sum / n;
+    double sqsum = 0;
+    for (auto x: samples) {
+        sqsum += (x - res.mean_ns)*(x - res.mean_ns);
+    }
+    res.stddev_ns = samples.size() > 1 ? std::sqrt(sqsum / (n - 1)) : 0.0;
+    res.ci95_ns = t_critical(n - 1) * res.stddev_ns / std::sqrt(n);
+    res.min_ns = samples.front();
+    auto mid = samples.size() / 2;
+    res.median_ns = samples.size() % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2;
+    return res;
+}
+
+MicroBenchmark::Comparison MicroBenchmark::compare(Result const& baseline, Result const& result, double threshold) {
+    Comparison cmp = {};
+    cmp.baseline = baseline;
+    if (baseline.mean_ns <= 0 || baseline.nreps < 2 || result.nreps < 2) {
+        return cmp;
+    }
+    cmp.change = (result.mean_ns - baseline.mean_ns) / baseline.mean_ns;
+    auto n1 = static_cast<double>(baseline.nreps);
+    auto n2 = static_cast<double>(result.nreps);
+    double v1 = baseline.stddev_ns*baseline.stddev_ns / n1;
+    double v2 = result.stddev_ns*result.stddev_ns / n2;
+    if (v1 + v2 == 0) {
+        cmp.significant = std::abs(cmp.change) > threshold;
+        return cmp;
+    }
+    double t = (result.mean_ns - baseline.mean_ns) / std::sqrt(v1 + v2);
+    // Welch-Satterthwaite degrees of freedom
+    double dof = (v1 + v2)*(v1 + v2) / (v1*v1/(n1 - 1) + v2*v2/(n2 - 1));
+    cmp.significant = std::abs(t) > t_critical(dof) && std::abs(cmp.change) > threshold;
+    return cmp;
+}
+
+//! Read results written by `MicroBenchmark::run`
+static std::map<std::string, MicroBenchmark::Result> read_baseline(std::string const& path) {
+    namespace pt = boost::property_tree;
+    std::map<std::string, MicroBenchmark::Result> results;
+    pt::ptree tree;
+    pt::read_json(path, tree);
+    for (auto const& item: tree.get_child("benchmarks")) {
+        MicroBenchmark::Result res = {};
+        res.name      = item.second.get<std::string>("name");
+        res.nreps     = item.second.get<size_t>("reps");
+        res.mean_ns   = item.second.get<double>("mean_ns");
+        res.stddev_ns = item.second.get<double>("stddev_ns");
+        res.ci95_ns   = item.second.get<double>("ci95_ns");
+        res.min_ns    = item.second.get<double>("min_ns");
+        res.median_ns = item.second.get<double>("median_ns");
+        results[res.name] = res;
+    }
+    return results;
+}
+
+int MicroBenchmark::run() {
+    std::map<std::string, Result> baseline;
+    if (!baseline_.empty()) {
+        try {
+            baseline = read_baseline(baseline_);
+        } catch (std::exception const& e) {
+            std::cerr << "Can't read baseline " << baseline_ << ": " << e.what() << std::endl;
+            return -1;
+        }
+    }
+    std::stringstream json;
+    json << "{\"benchmarks\": [";
+    int nregressions = 0;
+    bool first = true;
+    for (auto const& bench: benchmarks_) {
+        if (!filter_.empty() && bench.name.find(filter_) == std::string::npos) {
+            continue;
+        }
+        for (int i = 0; i < nwarmup_; i++) {
+            bench.fn();
+        }
+        std::vector<double> samples;
+        for (int i = 0; i < nreps_; i++) {
+            PerfTimer tm;
+            auto nops = bench.fn();
+            auto elapsed = tm.elapsed();
+            samples.push_back(elapsed * 1000000000.0 / static_cast<double>(std::max<size_t>(nops, 1)));
+        }
+        auto res = compute(bench.name, samples);
+        json << (first ? "\n" : ",\n");
+        first = false;
+        json << "  {\"name\": \"" << res.name << "\", \"reps\": " << res.nreps
+             << ", \"mean_ns\": " << res.mean_ns << ", \"stddev_ns\": " << res.stddev_ns
+             << ", \"ci95_ns\": " << res.ci95_ns << ", \"min_ns\": " << res.min_ns
+             << ", \"median_ns\": " << res.median_ns;
+        std::cerr << res.name << ": " << res.mean_ns << " ns/op +- " << res.ci95_ns;
+        auto it = baseline.find(res.name);
+        if (it != baseline.end()) {
+            auto cmp = compare(it->second, res, threshold_);
+            const char* verdict = !cmp.significant ? "same" : cmp.change > 0 ? "regression" : "improvement";
+            json << ", \"baseline_mean_ns\": " << it->second.mean_ns
+                 << ", \"change\": " << cmp.change
+                 << ", \"verdict\": \"" << verdict << "\"";
+            std::cerr << " (" << (cmp.change > 0 ? "+" : "") << cmp.change * 100.0 << "%, " << verdict << ")";
+            if (cmp.significant && cmp.change > 0) {
+                nregressions++;
+            }
+        }
+        json << "}";
+        std::cerr << std::endl;
+    }
+    json << "\n]}\n";
+    if (output_.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream out(output_);
+        out << json.str();
+        if (!out) {
+            std::cerr << "Can't write " << output_ << std::endl;
+            return -1;
+        }
+    }
+    return nregressions;
+}
+
 }
@@ -17,6 +17,10 @@
 #pragma once
 #include <time.h>
 
+#include <functional>
+#include <string>
+#include <vector>
+
 namespace Akumuli {
 
 class PerfTimer {
@@ -33,4 +37,78 @@ private:
  * `GRAPHITE_HOST` environment variable.
  */
 void push_metric_to_graphite(std::string metric, double value);
+
+
+/** Microbenchmark runner.
+  * Every benchmark is a function that runs one iteration and returns number of
+  * operations performed. Benchmarks are warmed up and repeated, results (time per
+  * operation with 95% confidence interval) are printed as JSON. Results can be
+  * compared with baseline (JSON output of the previous run) using Welch's t-test.
+  *
+  * Command line options:
+  *     --warmup N      number of warmup iterations (default 3)
+  *     --reps N        number of measured iterations (default 20)
+  *     --filter STR    run only benchmarks with STR in the name
+  *     --output FILE   write JSON to file instead of stdout
+  *     --baseline FILE compare with previous results
+  *     --threshold X   min relative change reported as regression (default 0.02)
+  */
+class MicroBenchmark {
+public:
+    //! Benchmark iteration, returns number of operations performed
+    typedef std::function<size_t()> Fn;
+
+    struct Result {
+        std::string name;
+        size_t      nreps;
+        double      mean_ns;    //< mean time per operation
+        double      stddev_ns;
+        double      ci95_ns;    //< half width of the 95% confidence interval
+        double      min_ns;
+        double      median_ns;
+    };
+
+    struct Comparison {
+        Result      baseline;
+        double      change;     //< relative change of the mean (positive - slower)
+        bool        significant;
+    };
+
+private:
+    struct Benchmark {
+        std::string name;
+        Fn          fn;
+    };
+    std::vector<Benchmark> benchmarks_;
+    int         nwarmup_;
+    int         nreps_;
+    double      threshold_;
+    std::string filter_;
+    std::string output_;
+    std::string baseline_;
+
+public:
+    MicroBenchmark();
+
+    //! Parse command line, return false if command line is invalid
+    bool parse_args(int argc, char** argv);
+
+    //! Register benchmark
+    void add(std::string name, Fn fn);
+
+    /** Run all benchmarks and print results.
+      * @return number of regressions (if baseline is set) or -1 on error
+      */
+    int run();
+
+    //! Compute statistics of the measurements (time per operation in nanoseconds)
+    static Result compute(std::string name, std::vector<double> samples);
+
+    //! Compare result with baseline using Welch's t-test
+    static Comparison compare(Result const& baseline, Result const& result, double threshold);
+
+    //! Two sided 95% critical value of the Student's t-distribution
+    static double t_critical(double dof);
+};
+
 }
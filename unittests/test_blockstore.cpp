@@ -1,4 +1,6 @@
 #include <iostream>
+#include <fstream>
+#include <thread>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
@@ -10,6 +12,7 @@
 #include "storage_engine/blockstore.h"
 #include "storage_engine/volume.h"
 #include "log_iface.h"
+#include "util.h"
 
 using namespace Akumuli;
 
@@ -17,6 +20,7 @@ struct VolumeRegistryMock : VolumeRegistry {
 
     std::vector<VolumeDesc> volumes;
     std::string dbname;
+    int nupdates = 0;
 
     std::vector<VolumeDesc> get_volumes() const {
         return volumes;
@@ -27,8 +31,9 @@ struct VolumeRegistryMock : VolumeRegistry {
     }
 
     void update_volume(const VolumeDesc &vol) {
+        nupdates++;
         auto ix = vol.id;
-        auto volume = volumes.at(ix);
+        auto& volume = volumes.at(ix);
         volume.capacity = vol.capacity;
         volume.nblocks = vol.nblocks;
         volume.generation = vol.generation;
@@ -70,24 +75,31 @@ static void create_expandable_storage() {
     Volume::create_new(EXP_VOLPATH[0].c_str(), CAPACITIES[0]);
 }
 
-static std::shared_ptr<FixedSizeFileStorage> open_blockstore() {
+static std::shared_ptr<FixedSizeFileStorage> open_blockstore(FileStorageParams const& params = FileStorageParams(),
+                                                             std::vector<u32> const& generations = { 0, 0 },
+                                                             std::vector<u32> const& nblocks = { 0, 0 },
+                                                             std::shared_ptr<VolumeRegistryMock> *mock = 0) {
     std::shared_ptr<VolumeRegistryMock> vrmock(new VolumeRegistryMock());
     vrmock->volumes = {
-        { 0, VOLPATH[0], 0, 0, CAPACITIES[0], 0 },
-        { 1, VOLPATH[1], 0, 0, CAPACITIES[1], 0 },
+        { 0, VOLPATH[0], 0, nblocks.at(0), CAPACITIES[0], generations.at(0) },
+        { 1, VOLPATH[1], 0, nblocks.at(1), CAPACITIES[1], generations.at(1) },
     };
     vrmock->dbname = "test";
-    auto bstore = FixedSizeFileStorage::open(vrmock);
+    auto bstore = FixedSizeFileStorage::open(vrmock, params);
+    if (mock) {
+        *mock = vrmock;
+    }
     return bstore;
 }
 
-static std::shared_ptr<ExpandableFileStorage> open_expandable_storage(std::shared_ptr<VolumeRegistryMock> *mock = 0) {
+static std::shared_ptr<ExpandableFileStorage> open_expandable_storage(std::shared_ptr<VolumeRegistryMock> *mock = 0,
+                                                                      FileStorageParams const& params = FileStorageParams()) {
     std::shared_ptr<VolumeRegistryMock> vrmock(new VolumeRegistryMock());
     vrmock->volumes = {
         { 0, EXP_VOLPATH[0], 0, 0, CAPACITIES[0], 0 },
     };
     vrmock->dbname = "test";
-    auto bstore = ExpandableFileStorage::open(vrmock);
+    auto bstore = ExpandableFileStorage::open(vrmock, params);
     if (mock) {
         *mock = vrmock;
     }
@@ -181,6 +193,130 @@ BOOST_AUTO_TEST_CASE(Test_blockstore_1) {
     delete_blockstore();
 }
 
+BOOST_AUTO_TEST_CASE(Test_blockstore_archive) {
+    const std::string ARCHIVE_PATH = "volume_archive";
+    delete_blockstore();
+    boost::filesystem::remove_all(ARCHIVE_PATH);
+    create_blockstore();
+    FileStorageParams params;
+    params.archive_path = ARCHIVE_PATH;
+    params.archive_capacity = 2;
+    // Generations should be unique, same as in the newly created database
+    const std::vector<u32> GENERATIONS = { 0, 1 };
+    auto bstore = open_blockstore(params, GENERATIONS);
+
+    // Every volume is reused twice, volumes of the first two generations are archived
+    // and the oldest one is removed after that
+    LogicAddr addr;
+    aku_Status status;
+    for (int i = 0; i < 33; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    BOOST_REQUIRE_EQUAL(addr, (4ull << 32));
+
+    auto check = [](std::shared_ptr<FixedSizeFileStorage> bstore) {
+        std::shared_ptr<Block> block;
+        aku_Status status;
+        std::tie(status, block) = bstore->read_block(0);
+        BOOST_REQUIRE_EQUAL(status, AKU_EUNAVAILABLE);
+        BOOST_REQUIRE(!bstore->exists(0));
+        BOOST_REQUIRE_EQUAL(bstore->get_min_live_addr(), 1ull << 32);
+
+        // Generations 1 and 2 are read from the archive
+        std::tie(status, block) = bstore->read_block((1ull << 32) | 3);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 11);
+        BOOST_REQUIRE(bstore->exists((2ull << 32) | 5));
+        std::tie(status, block) = bstore->read_block((2ull << 32) | 5);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 21);
+
+        // Generation 3 is still stored in the volume
+        std::tie(status, block) = bstore->read_block((3ull << 32) | 7);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 31);
+    };
+    check(bstore);
+    bstore->flush();
+    bstore.reset();
+
+    // Archive should be found after reopen
+    bstore = open_blockstore(params, GENERATIONS);
+    BOOST_REQUIRE_EQUAL(std::get<0>(bstore->read_block(2ull << 32)), AKU_SUCCESS);
+
+    bstore.reset();
+    boost::filesystem::remove_all(ARCHIVE_PATH);
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_replication) {
+    const std::vector<std::string> REPLICA_VOLPATH = { "replica0", "replica1" };
+    auto delete_replica = [&]() {
+        for (auto const& path: REPLICA_VOLPATH) {
+            boost::filesystem::remove(path);
+        }
+    };
+    delete_blockstore();
+    delete_replica();
+    create_blockstore();
+    for (u32 i = 0; i < REPLICA_VOLPATH.size(); i++) {
+        Volume::create_new(REPLICA_VOLPATH[i].c_str(), CAPACITIES[i]);
+    }
+    const std::vector<u32> GENERATIONS = { 0, 1 };
+    auto leader = open_blockstore(FileStorageParams(), GENERATIONS);
+    std::shared_ptr<VolumeRegistryMock> vrmock(new VolumeRegistryMock());
+    vrmock->volumes = {
+        { 0, REPLICA_VOLPATH[0], 0, 0, CAPACITIES[0], GENERATIONS[0] },
+        { 1, REPLICA_VOLPATH[1], 0, 0, CAPACITIES[1], GENERATIONS[1] },
+    };
+    auto follower = FixedSizeFileStorage::open(vrmock);
+
+    std::vector<std::tuple<LogicAddr, std::shared_ptr<Block>>> log;
+    leader->set_replication_callback([&log](LogicAddr addr, std::shared_ptr<Block> block) {
+        log.push_back(std::make_tuple(addr, block));
+    });
+    // Volumes are reused by the leader
+    std::vector<LogicAddr> addrs;
+    for (int i = 0; i < 20; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        aku_Status status;
+        LogicAddr addr;
+        std::tie(status, addr) = leader->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    BOOST_REQUIRE_EQUAL(log.size(), addrs.size());
+
+    // Block can't be applied out of order
+    BOOST_REQUIRE_EQUAL(follower->apply_replicated_block(std::get<0>(log.at(1)), std::get<1>(log.at(1))),
+                        AKU_EBAD_ARG);
+    for (auto const& item: log) {
+        BOOST_REQUIRE_EQUAL(follower->apply_replicated_block(std::get<0>(item), std::get<1>(item)),
+                            AKU_SUCCESS);
+    }
+    for (size_t i = 0; i < addrs.size(); i++) {
+        aku_Status expected, actual;
+        std::shared_ptr<Block> lblock, fblock;
+        std::tie(expected, lblock) = leader->read_block(addrs[i]);
+        std::tie(actual, fblock) = follower->read_block(addrs[i]);
+        BOOST_REQUIRE_EQUAL(actual, expected);
+        if (expected == AKU_SUCCESS) {
+            BOOST_REQUIRE_EQUAL(fblock->get_cdata()[0], lblock->get_cdata()[0]);
+        }
+    }
+    // Same block can't be applied twice
+    BOOST_REQUIRE_EQUAL(follower->apply_replicated_block(std::get<0>(log.back()), std::get<1>(log.back())),
+                        AKU_EBAD_ARG);
+    leader.reset();
+    follower.reset();
+    delete_replica();
+    delete_blockstore();
+}
+
 BOOST_AUTO_TEST_CASE(Test_blockstore_3) {
     delete_expandable_storage();
     create_expandable_storage();
@@ -261,3 +397,573 @@ BOOST_AUTO_TEST_CASE(Test_blockstore_4) {
     boost::filesystem::remove(expected_path);
     delete_expandable_storage();
 }
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_meta_updates) {
+    delete_blockstore();
+    create_blockstore();
+    std::shared_ptr<VolumeRegistryMock> mock;
+    auto bstore = open_blockstore(FileStorageParams(), { 0, 0 }, { 0, 0 }, &mock);
+    aku_Status status;
+    LogicAddr addr;
+    for (int i = 0; i < 5; i++) {
+        auto buffer = std::make_shared<Block>();
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    // Updates are coalesced until flush
+    BOOST_REQUIRE_EQUAL(mock->nupdates, 0);
+    BOOST_REQUIRE_EQUAL(mock->volumes.at(0).nblocks, 0u);
+    bstore->flush();
+    BOOST_REQUIRE_EQUAL(mock->nupdates, 1);
+    BOOST_REQUIRE_EQUAL(mock->volumes.at(0).nblocks, 5u);
+    bstore->flush();
+    BOOST_REQUIRE_EQUAL(mock->nupdates, 1);
+    // Volume transition is written immediately
+    for (u32 i = 5; i <= CAPACITIES.at(0); i++) {
+        auto buffer = std::make_shared<Block>();
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    BOOST_REQUIRE_EQUAL(mock->volumes.at(0).nblocks, CAPACITIES.at(0));
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_spare_volumes) {
+    delete_expandable_storage();
+    std::vector<std::string> spare_paths = { "test_1.vol", "test_2.vol" };
+    for (auto const& path: spare_paths) {
+        boost::filesystem::remove(path);
+    }
+    create_expandable_storage();
+    FileStorageParams params;
+    params.spare_volumes = 1;
+    std::shared_ptr<VolumeRegistryMock> mock;
+    auto bstore = open_expandable_storage(&mock, params);
+    aku_Status status;
+    LogicAddr addr;
+    for (u32 i = 0; i <= CAPACITIES.at(0); i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    // Last block is written to the spare volume
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = bstore->read_block(addr);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(block->get_cdata()[0], CAPACITIES.at(0));
+    // Next spare volume is created when the previous one gets used
+    // (destructor waits for the background task)
+    bstore.reset();
+    BOOST_REQUIRE_EQUAL(mock->volumes.size(), 3u);
+    for (u32 i = 1; i < 3; i++) {
+        BOOST_REQUIRE_EQUAL(mock->volumes.at(i).id, i);
+        BOOST_REQUIRE_EQUAL(mock->volumes.at(i).path, spare_paths.at(i - 1));
+        BOOST_REQUIRE_EQUAL(mock->volumes.at(i).capacity, CAPACITIES.at(0));
+        BOOST_REQUIRE(boost::filesystem::exists(spare_paths.at(i - 1)));
+        BOOST_REQUIRE_EQUAL(boost::filesystem::file_size(spare_paths.at(i - 1)), CAPACITIES.at(0)*4096);
+    }
+    for (auto const& path: spare_paths) {
+        boost::filesystem::remove(path);
+    }
+    delete_expandable_storage();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_read_blocks) {
+    delete_blockstore();
+    create_blockstore();
+    auto bstore = open_blockstore();
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    for (u8 i = 0; i < 4; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = i;
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    // Read in reverse order, add one non-existing address
+    std::reverse(addrs.begin(), addrs.end());
+    addrs.push_back(100);
+    auto blocks = bstore->read_blocks(addrs);
+    BOOST_REQUIRE_EQUAL(blocks.size(), addrs.size());
+    for (u32 i = 0; i < 4; i++) {
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = blocks.at(i);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_addr(), addrs.at(i));
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 3 - i);
+    }
+    BOOST_REQUIRE_NE(std::get<0>(blocks.back()), AKU_SUCCESS);
+    delete_blockstore();
+}
+
+//! Read first byte of the block directly from the volume file
+static u8 read_first_byte(std::string const& path, u32 ix) {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(static_cast<std::streamoff>(ix) * AKU_BLOCK_SIZE);
+    char result = 0;
+    file.read(&result, 1);
+    return static_cast<u8>(result);
+}
+
+BOOST_AUTO_TEST_CASE(Test_volume_write_behind) {
+    delete_blockstore();
+    create_blockstore();
+    auto volume = Volume::open_existing(VOLPATH[0].c_str(), 0);
+    volume->set_write_buffer_size(4);
+    std::vector<u8> block(AKU_BLOCK_SIZE, 0);
+    aku_Status status;
+    BlockAddr addr;
+    for (u8 i = 0; i < 3; i++) {
+        block[0] = i + 1;
+        std::tie(status, addr) = volume->append_block(block.data());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(addr, i);
+    }
+    // Buffered blocks should be readable but not accessible without copying
+    std::vector<u8> dest(AKU_BLOCK_SIZE, 0);
+    for (u32 i = 0; i < 3; i++) {
+        status = volume->read_block(i, dest.data());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(dest[0], i + 1);
+        BOOST_REQUIRE_EQUAL(std::get<0>(volume->read_block_zero_copy(i)), AKU_EUNAVAILABLE);
+    }
+    // Nothing is written to the file yet
+    BOOST_REQUIRE_EQUAL(read_first_byte(VOLPATH[0], 0), 0);
+
+    // Fourth block fills the buffer
+    for (u8 i = 3; i < 5; i++) {
+        block[0] = i + 1;
+        std::tie(status, addr) = volume->append_block(block.data());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    for (u32 i = 0; i < 4; i++) {
+        BOOST_REQUIRE_EQUAL(read_first_byte(VOLPATH[0], i), i + 1);
+    }
+    BOOST_REQUIRE_EQUAL(read_first_byte(VOLPATH[0], 4), 0);
+
+    volume->flush();
+    BOOST_REQUIRE_EQUAL(read_first_byte(VOLPATH[0], 4), 5);
+    status = volume->read_block(4, dest.data());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(dest[0], 5);
+    volume.reset();
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_write_behind) {
+    delete_blockstore();
+    create_blockstore();
+    FileStorageParams params;
+    params.durability = DurabilityPolicy::ON_COMMIT;
+    params.write_buffer_size = 3;
+    auto bstore = open_blockstore(params);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    // Overflow both volumes
+    for (u32 i = 0; i < 20; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    auto check = [&](std::shared_ptr<BlockStore> bs, u32 begin) {
+        for (u32 i = begin; i < 20; i++) {
+            std::shared_ptr<Block> block;
+            std::tie(status, block) = bs->read_block(addrs.at(i));
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(block->get_cdata()[0], i);
+        }
+    };
+    // Last 4 blocks belong to the current generation, some of them are still buffered
+    check(bstore, 16);
+    bstore->flush();
+    check(bstore, 16);
+    BOOST_REQUIRE_EQUAL(read_first_byte(VOLPATH[0], 3), 19);
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_access_hints) {
+    delete_blockstore();
+    create_blockstore();
+    FileStorageParams params;
+    params.access_pattern = AccessPattern::RANDOM;
+    params.huge_pages = true;
+    params.lock_current_volume = true;
+    const std::vector<u32> GENERATIONS = { 0, 1 };
+    auto bstore = open_blockstore(params, GENERATIONS);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    // Second volume becomes current and gets locked instead of the first one
+    for (u32 i = 0; i < 12; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    // Hints shouldn't change the content, runs of adjacent blocks are prefetched at once
+    std::vector<LogicAddr> rev(addrs.rbegin(), addrs.rend());
+    bstore->prefetch(rev);
+    for (u32 i = 0; i < 12; i++) {
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = bstore->read_block(addrs.at(i));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], i);
+    }
+    // Blocks that are not written yet are ignored
+    auto volume = Volume::open_existing(VOLPATH[1].c_str(), 4);
+    volume->set_access_pattern(AccessPattern::SEQUENTIAL);
+    volume->prefetch_blocks(2, 100);
+    status = volume->lock_memory(true);
+    // Can fail if RLIMIT_MEMLOCK is too small
+    BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_EACCESS);
+    BOOST_REQUIRE_EQUAL(volume->lock_memory(false), AKU_SUCCESS);
+    volume.reset();
+    bstore.reset();
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_direct_io) {
+    delete_blockstore();
+    create_blockstore();
+    FileStorageParams params;
+    params.direct_io = true;
+    params.write_buffer_size = 3;
+    params.durability = DurabilityPolicy::ON_COMMIT;
+    const std::vector<u32> GENERATIONS = { 0, 1 };
+    auto bstore = open_blockstore(params, GENERATIONS);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    for (u32 i = 0; i < 12; i++) {
+        std::shared_ptr<Block> buffer;
+        if (i % 2) {
+            buffer = std::make_shared<Block>();
+        } else {
+            // Unaligned buffer, written through the bounce buffer
+            buffer = std::make_shared<Block>(EMPTY_ADDR, std::vector<u8>(AKU_BLOCK_SIZE, 0));
+        }
+        buffer->get_data()[0] = static_cast<u8>(i);
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    bstore->flush();
+    for (u32 i = 0; i < 12; i++) {
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = bstore->read_block(addrs.at(i));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], i);
+    }
+    bstore.reset();
+    // Data should be readable without direct I/O
+    auto volume = Volume::open_existing(VOLPATH[1].c_str(), 4);
+    u8 buf[AKU_BLOCK_SIZE];
+    BOOST_REQUIRE_EQUAL(volume->read_block(1, buf), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(buf[0], 9);
+    // Can be unavailable if the file system doesn't support O_DIRECT (e.g. tmpfs)
+    status = volume->enable_direct_io();
+    BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_EUNAVAILABLE);
+    BOOST_REQUIRE_EQUAL(volume->read_block(2, buf + 1), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(buf[1], 10);
+    volume.reset();
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_read_only) {
+    delete_blockstore();
+    create_blockstore();
+    std::shared_ptr<VolumeRegistryMock> mock;
+    auto bstore = open_blockstore(FileStorageParams(), { 0, 0 }, { 0, 0 }, &mock);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    for (u32 i = 0; i < 4; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    bstore->flush();
+    bstore.reset();
+
+    FileStorageParams params;
+    params.read_only = true;
+    auto volumes = mock->get_volumes();
+    auto rostore = open_blockstore(params,
+                                   { volumes.at(0).generation, volumes.at(1).generation },
+                                   { volumes.at(0).nblocks, volumes.at(1).nblocks });
+    auto top = rostore->get_top_addr();
+    BOOST_REQUIRE_EQUAL(top, addrs.back() + 1);
+    LogicAddr addr;
+    std::tie(status, addr) = rostore->append_block(std::make_shared<Block>());
+    BOOST_REQUIRE_EQUAL(status, AKU_ENOT_PERMITTED);
+
+    // Appended blocks are kept in memory
+    auto overlay = BlockStoreBuilder::create_overlay(rostore);
+    auto buffer = std::make_shared<Block>();
+    buffer->get_data()[0] = 42;
+    std::tie(status, addr) = overlay->append_block(buffer);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE(OverlayStore::is_overlay_addr(addr));
+    BOOST_REQUIRE(overlay->exists(addr));
+    BOOST_REQUIRE_EQUAL(overlay->get_top_addr(), top);
+    for (u32 i = 0; i < 4; i++) {
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = overlay->read_block(addrs.at(i));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], i);
+    }
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = overlay->read_block(addr);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 42);
+    overlay.reset();
+    rostore.reset();
+
+    auto volume = Volume::open_existing(VOLPATH[0].c_str(), 4);
+    u8 buf[AKU_BLOCK_SIZE];
+    BOOST_REQUIRE_EQUAL(volume->read_block(3, buf), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(buf[0], 3);
+    volume.reset();
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_io_stats) {
+    delete_blockstore();
+    create_blockstore();
+    FileStorageParams params;
+    params.durability = DurabilityPolicy::ON_COMMIT;
+    params.write_buffer_size = 8;
+    auto bstore = open_blockstore(params);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    for (u32 i = 0; i < 3; i++) {
+        auto buffer = std::make_shared<Block>();
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    // Buffered blocks can't be accessed through mmap, they're copied and cached
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto addr: addrs) {
+            std::shared_ptr<Block> block;
+            std::tie(status, block) = bstore->read_block(addr);
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(BlockStore::last_read_cached(), pass == 1);
+        }
+    }
+    bstore->flush();
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = bstore->read_block(addrs.front());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    auto stats = bstore->get_stats().io;
+    BOOST_REQUIRE_EQUAL(stats.writes, 3);
+    BOOST_REQUIRE_EQUAL(stats.bytes_written, 3*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE_EQUAL(stats.reads, 3);
+    BOOST_REQUIRE_EQUAL(stats.bytes_read, 3*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE_EQUAL(stats.cache_hits + stats.zero_copy_reads, 4);
+
+    auto volstats = bstore->get_volume_stats();
+    BOOST_REQUIRE_EQUAL(volstats.size(), 2);
+    BOOST_REQUIRE_EQUAL(volstats[VOLPATH[0]].io.writes, 3);
+    BOOST_REQUIRE_EQUAL(volstats[VOLPATH[0]].io.reads, 3);
+    BOOST_REQUIRE_EQUAL(volstats[VOLPATH[1]].io.writes, 0);
+    BOOST_REQUIRE_EQUAL(volstats[VOLPATH[1]].io.reads, 0);
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_blockstore_checksum_first_read) {
+    delete_blockstore();
+    create_blockstore();
+    FileStorageParams params;
+    params.checksum = ChecksumPolicy::FIRST_READ;
+    auto bstore = open_blockstore(params);
+    aku_Status status;
+    std::vector<LogicAddr> addrs;
+    for (u32 i = 0; i < 2; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = static_cast<u8>(i);
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    auto verify = [&](std::shared_ptr<BlockStore> bs, LogicAddr addr, u32 expected) {
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = bs->read_block(addr);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        return bs->verify_checksum(addr, block->get_cdata(), block->get_size(), expected);
+    };
+    std::shared_ptr<Block> block;
+    std::tie(status, block) = bstore->read_block(addrs.at(0));
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    u32 crc = bstore->checksum(block->get_cdata(), block->get_size());
+    // Invalid checksum is always detected before the block was verified
+    BOOST_REQUIRE(!verify(bstore, addrs.at(0), crc + 1));
+    BOOST_REQUIRE(verify(bstore, addrs.at(0), crc));
+    // Verified block is not checked again
+    BOOST_REQUIRE(verify(bstore, addrs.at(0), crc + 1));
+    BOOST_REQUIRE(!verify(bstore, addrs.at(1), crc));
+    bstore.reset();
+    // Default policy checks every read (volume registry mock doesn't persist the state)
+    auto bstore2 = open_blockstore(FileStorageParams(), { 0, 0 }, { 2, 0 });
+    std::tie(status, block) = bstore2->read_block(addrs.at(0));
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE(verify(bstore2, addrs.at(0), crc));
+    BOOST_REQUIRE(!verify(bstore2, addrs.at(0), crc + 1));
+    delete_blockstore();
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_buffer_reuse) {
+    auto bstore = BlockStoreBuilder::create_memstore();
+    std::vector<LogicAddr> addrs;
+    for (u8 i = 0; i < 4; i++) {
+        auto buffer = std::make_shared<Block>();
+        buffer->get_data()[0] = i;
+        buffer->get_data()[AKU_BLOCK_SIZE - 1] = i;
+        aku_Status status;
+        LogicAddr addr;
+        std::tie(status, addr) = bstore->append_block(buffer);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        addrs.push_back(addr);
+    }
+    const u8* prev = nullptr;
+    for (u8 i = 0; i < 4; i++) {
+        aku_Status status;
+        std::shared_ptr<Block> block;
+        std::tie(status, block) = bstore->read_block(addrs.at(i));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(block->get_size(), AKU_BLOCK_SIZE);
+        BOOST_REQUIRE_EQUAL(block->get_addr(), addrs.at(i));
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[0], i);
+        BOOST_REQUIRE_EQUAL(block->get_cdata()[AKU_BLOCK_SIZE - 1], i);
+        if (prev) {
+            // Buffer of the released block should be reused
+            BOOST_REQUIRE(block->get_cdata() == prev);
+        }
+        prev = block->get_cdata();
+    }
+    // New blocks are zero-initialized even if the buffer is reused
+    auto empty = std::make_shared<Block>();
+    BOOST_REQUIRE(empty->get_cdata() == prev);
+    for (size_t i = 0; i < AKU_BLOCK_SIZE; i++) {
+        BOOST_REQUIRE_EQUAL(empty->get_cdata()[i], 0);
+    }
+}
+
+static std::shared_ptr<Block> make_cached_block(LogicAddr addr) {
+    std::vector<u8> data(AKU_BLOCK_SIZE, 0);
+    data[0] = static_cast<u8>(addr);
+    return std::make_shared<Block>(addr, std::move(data));
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_cache_0) {
+    // Single shard, room for 16 blocks
+    BlockCache cache(16*AKU_BLOCK_SIZE, 0);
+    BOOST_REQUIRE(!cache.lookup(1));
+    cache.insert(make_cached_block(1));
+    auto block = cache.lookup(1);
+    BOOST_REQUIRE(block);
+    BOOST_REQUIRE_EQUAL(block->get_addr(), 1);
+    BOOST_REQUIRE_EQUAL(block->get_cdata()[0], 1);
+
+    // Size limit should be respected
+    for (LogicAddr addr = 100; addr < 200; addr++) {
+        cache.insert(make_cached_block(addr));
+    }
+    auto stats = cache.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.capacity, 16*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE(stats.size <= stats.capacity);
+    BOOST_REQUIRE_EQUAL(stats.hits, 1);
+    BOOST_REQUIRE_EQUAL(stats.misses, 1);
+    BOOST_REQUIRE_EQUAL(stats.evictions, 101 - 16);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_cache_1) {
+    // Hot blocks should survive the large scan
+    BlockCache cache(16*AKU_BLOCK_SIZE, 0);
+    std::vector<LogicAddr> hot = { 1, 2, 3, 4 };
+    for (int round = 0; round < 2; round++) {
+        for (auto addr: hot) {
+            if (!cache.lookup(addr)) {
+                cache.insert(make_cached_block(addr));
+            }
+        }
+        // Push the hot blocks out of the A1in queue
+        LogicAddr base = 1000 + 100*static_cast<LogicAddr>(round);
+        for (LogicAddr addr = base; addr < base + 16; addr++) {
+            cache.insert(make_cached_block(addr));
+        }
+    }
+    // Hot blocks are re-read after eviction and should sit in Am queue now,
+    // the scan shouldn't be able to evict them
+    for (LogicAddr addr = 2000; addr < 3000; addr++) {
+        cache.insert(make_cached_block(addr));
+    }
+    for (auto addr: hot) {
+        BOOST_REQUIRE(cache.lookup(addr));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_cache_hot_addrs) {
+    // Only blocks from the Am queue are hot, most recently used go first
+    BlockCache cache(16*AKU_BLOCK_SIZE, 0);
+    for (LogicAddr addr = 1; addr <= 8; addr++) {
+        cache.insert(make_cached_block(addr));
+    }
+    BOOST_REQUIRE(cache.get_hot_addrs(100).empty());
+    cache.promote(3);
+    cache.promote(5);
+    cache.promote(42);  // not cached
+    auto hot = cache.get_hot_addrs(100);
+    BOOST_REQUIRE_EQUAL(hot.size(), 2u);
+    BOOST_REQUIRE_EQUAL(hot.at(0), 5u);
+    BOOST_REQUIRE_EQUAL(hot.at(1), 3u);
+    BOOST_REQUIRE_EQUAL(cache.get_hot_addrs(1).size(), 1u);
+    // Promoted blocks survive the large scan
+    for (LogicAddr addr = 1000; addr < 2000; addr++) {
+        cache.insert(make_cached_block(addr));
+    }
+    BOOST_REQUIRE(cache.lookup(3));
+    BOOST_REQUIRE(cache.lookup(5));
+    BOOST_REQUIRE(cache.get_stats().size <= cache.get_stats().capacity);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_cache_2) {
+    // Zero capacity disables the cache
+    BlockCache cache(0);
+    cache.insert(make_cached_block(1));
+    BOOST_REQUIRE(!cache.lookup(1));
+    auto stats = cache.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.size, 0);
+    BOOST_REQUIRE_EQUAL(stats.capacity, 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_cache_3) {
+    // Capacity is split between the NUMA partitions
+    BlockCache cache(32*AKU_BLOCK_SIZE, 0, 2);
+    std::thread worker([&cache]() {
+        // Thread should stay on one node, otherwise it can see other partition
+        bind_thread_to_numa_node(0);
+        cache.insert(make_cached_block(1));
+        BOOST_REQUIRE(cache.lookup(1));
+        for (LogicAddr addr = 100; addr < 200; addr++) {
+            cache.insert(make_cached_block(addr));
+        }
+    });
+    worker.join();
+    auto stats = cache.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.capacity, 32*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE_EQUAL(stats.size, 16*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE_EQUAL(stats.evictions, 101 - 16);
+}
@@ -1,4 +1,8 @@
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <numeric>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
@@ -11,6 +15,10 @@
 #include "akumuli.h"
 #include "storage_engine/column_store.h"
 #include "query_processing/queryplan.h"
+#include "storage_engine/operators/merge.h"
+#include "storage_engine/operators/join.h"
+#include "storage_engine/operators/aggregate.h"
+#include "metrics.h"
 #include "log_iface.h"
 #include "status_util.h"
 
@@ -81,6 +89,99 @@ BOOST_AUTO_TEST_CASE(Test_column_store_add_values_3) {
     BOOST_REQUIRE(status == NBTreeAppendResult::FAIL_BAD_ID);
 }
 
+BOOST_AUTO_TEST_CASE(Test_column_store_session_cache) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    // Small id goes to the dense cache, large one to the sparse cache
+    std::vector<aku_ParamId> ids = { 1024, 0x10000000000ull };
+    for (auto id: ids) {
+        cstore->create_new_column(id);
+    }
+    std::vector<u64> rpoints;
+    for (aku_Timestamp ts = 1; ts <= 10; ts++) {
+        for (auto id: ids) {
+            aku_Sample sample;
+            sample.paramid = id;
+            sample.timestamp = ts;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.float64 = ts;
+            auto status = session->write(sample, &rpoints);
+            BOOST_REQUIRE(status == NBTreeAppendResult::OK);
+        }
+    }
+    std::vector<aku_Sample> last;
+    auto status = cstore->read_last(ids, &last);
+    BOOST_REQUIRE(status == AKU_SUCCESS);
+    BOOST_REQUIRE(last.size() == 2);
+    for (auto const& sample: last) {
+        BOOST_REQUIRE(sample.timestamp == 10);
+    }
+    // Removed columns shouldn't be reachable after the cache is cleared
+    for (auto id: ids) {
+        BOOST_REQUIRE(cstore->remove_column(id) == AKU_SUCCESS);
+    }
+    session->clear_cache();
+    for (auto id: ids) {
+        aku_Sample sample;
+        sample.paramid = id;
+        sample.timestamp = 11;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.float64 = 11;
+        BOOST_REQUIRE(session->write(sample, &rpoints) == NBTreeAppendResult::FAIL_BAD_ID);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_concurrent_access) {
+    auto cstore = create_cstore();
+    const u32 NTHREADS = 4;
+    const u32 NCOLUMNS = 200;
+    const aku_Timestamp NSAMPLES = 100;
+    // Boost.Test assertions are not thread-safe, errors are counted instead
+    std::atomic<int> nerrors(0);
+    std::vector<std::thread> threads;
+    for (u32 t = 0; t < NTHREADS; t++) {
+        threads.emplace_back([cstore, t, &nerrors]() {
+            auto session = create_session(cstore);
+            for (u32 i = 0; i < NCOLUMNS; i++) {
+                aku_ParamId id = t*NCOLUMNS + i;
+                if (cstore->create_new_column(id) != AKU_SUCCESS) {
+                    nerrors++;
+                }
+                aku_Sample sample;
+                sample.paramid = id;
+                sample.payload.type = AKU_PAYLOAD_FLOAT;
+                std::vector<u64> rpoints;
+                for (aku_Timestamp ts = 0; ts < NSAMPLES; ts++) {
+                    sample.timestamp = ts;
+                    sample.payload.float64 = ts;
+                    if (cstore->write(sample, &rpoints) == NBTreeAppendResult::FAIL_BAD_ID) {
+                        nerrors++;
+                    }
+                }
+                // Columns created by other threads can be read concurrently
+                std::vector<aku_ParamId> ids = { id };
+                std::vector<std::unique_ptr<RealValuedOperator>> iters;
+                if (cstore->scan(ids, 0, NSAMPLES, &iters) != AKU_SUCCESS) {
+                    nerrors++;
+                }
+            }
+        });
+    }
+    for (auto& th: threads) {
+        th.join();
+    }
+    BOOST_REQUIRE_EQUAL(nerrors.load(), 0);
+    BOOST_REQUIRE_EQUAL(cstore->_get_columns().size(), NTHREADS*NCOLUMNS);
+    BOOST_REQUIRE_EQUAL(cstore->create_new_column(0), AKU_EBAD_ARG);
+    std::vector<aku_ParamId> ids = { 0, NTHREADS*NCOLUMNS - 1 };
+    std::vector<std::unique_ptr<RealValuedOperator>> iters;
+    BOOST_REQUIRE_EQUAL(cstore->scan(ids, 0, NSAMPLES, &iters), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(iters.size(), 2);
+    ids.push_back(NTHREADS*NCOLUMNS);
+    iters.clear();
+    BOOST_REQUIRE_EQUAL(cstore->scan(ids, 0, NSAMPLES, &iters), AKU_ENOT_FOUND);
+}
+
 struct QueryProcessorMock : QP::IStreamProcessor {
     bool started = false;
     bool stopped = false;
@@ -453,6 +554,68 @@ void test_reopen(aku_Timestamp begin, aku_Timestamp end) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(Test_column_store_release_write_buffers) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore));
+    auto session = create_session(cstore);
+    const aku_Timestamp N = 100;
+    std::vector<aku_ParamId> ids = { 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 };
+    for (auto id: ids) {
+        // Columns with the smaller ids are written earlier
+        fill_data_in(cstore, session, id, id*1000, id*1000 + N);
+    }
+    std::unordered_map<aku_ParamId, std::vector<LogicAddr>> rpoints;
+    size_t total = cstore->release_write_buffers(ids.size()*AKU_BLOCK_SIZE, &rpoints);
+    BOOST_REQUIRE_EQUAL(total, ids.size()*AKU_BLOCK_SIZE);
+    BOOST_REQUIRE(rpoints.empty());
+    const size_t budget = ids.size()*AKU_BLOCK_SIZE/2;
+    total = cstore->release_write_buffers(budget, &rpoints);
+    BOOST_REQUIRE_LE(total, budget);
+    BOOST_REQUIRE(!rpoints.empty());
+    for (auto const& kv: rpoints) {
+        // Least recently written columns are committed first
+        BOOST_REQUIRE_LT(kv.first, ids.front() + rpoints.size());
+        BOOST_REQUIRE(kv.second.front() != EMPTY_ADDR);
+    }
+    // Committed columns remain writable
+    for (auto id: ids) {
+        aku_Sample sample;
+        sample.paramid = id;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        std::vector<u64> tmp;
+        for (aku_Timestamp ts = id*1000 + N; ts < id*1000 + 2*N; ts++) {
+            sample.timestamp = ts;
+            sample.payload.float64 = ts*0.1;
+            BOOST_REQUIRE(session->write(sample, &tmp) != NBTreeAppendResult::FAIL_BAD_ID);
+        }
+    }
+    auto check = [&](std::shared_ptr<ColumnStore> store) {
+        QueryProcessorMock qproc;
+        ReshapeRequest req = {};
+        req.group_by.enabled = false;
+        req.select.begin = 0;
+        req.select.end = 100000;
+        req.select.columns.emplace_back();
+        req.select.columns[0].ids = ids;
+        req.order_by = OrderBy::SERIES;
+        execute(store, &qproc, req);
+        BOOST_REQUIRE(qproc.error == AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(qproc.samples.size(), ids.size()*2*N);
+        for (size_t i = 0; i < qproc.samples.size(); i++) {
+            auto id = ids.at(i / (2*N));
+            BOOST_REQUIRE_EQUAL(qproc.samples[i].paramid, id);
+            BOOST_REQUIRE_EQUAL(qproc.samples[i].timestamp, id*1000 + i % (2*N));
+        }
+    };
+    check(cstore);
+    session.reset();
+    auto mapping = cstore->close();
+    cstore.reset(new ColumnStore(bstore));
+    cstore->open_or_restore(mapping);
+    check(cstore);
+}
+
 BOOST_AUTO_TEST_CASE(Test_column_store_reopen_1) {
     test_reopen(100, 200);     // 100 el.
 }
@@ -465,12 +628,67 @@ BOOST_AUTO_TEST_CASE(Test_column_store_reopen_3) {
     test_reopen(1000, 11000);  // 10000 el.
 }
 
-void test_aggregation(aku_Timestamp begin, aku_Timestamp end) {
+BOOST_AUTO_TEST_CASE(Test_column_store_parallel_recovery) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore));
+    auto session = create_session(cstore);
+    const aku_Timestamp begin = 1000, end = 11000;
+    const aku_ParamId NCOLUMNS = 200;
+    std::unordered_map<aku_ParamId, std::vector<LogicAddr>> mapping;
+    for (aku_ParamId id = 1; id <= NCOLUMNS; id++) {
+        fill_data_in(cstore, session, id, begin, end);
+    }
+    session.reset();
+    // Simulate crash in odd columns, close even columns properly
+    for (auto kv: cstore->_get_columns()) {
+        if (kv.first % 2 == 0) {
+            mapping[kv.first] = kv.second->close();
+        } else {
+            mapping[kv.first] = kv.second->get_roots();
+        }
+    }
+
+    // Reopen
+    cstore.reset(new ColumnStore(bstore));
+    BOOST_REQUIRE_EQUAL(cstore->open_or_restore(mapping), AKU_SUCCESS);
+    for (auto kv: cstore->_get_columns()) {
+        auto status = NBTreeExtentsList::repair_status(mapping[kv.first]);
+        // Only columns that need repair should be restored at startup
+        BOOST_REQUIRE_EQUAL(kv.second->is_initialized(), status == NBTreeExtentsList::RepairStatus::REPAIR);
+    }
+
+    QueryProcessorMock qproc;
+    ReshapeRequest req = {};
+    req.group_by.enabled = false;
+    req.select.begin = begin;
+    req.select.end = end;
+    req.select.columns.emplace_back();
+    for (aku_ParamId id = 2; id <= NCOLUMNS; id += 2) {
+        req.select.columns[0].ids.push_back(id);
+    }
+    req.order_by = OrderBy::SERIES;
+    execute(cstore, &qproc, req);
+
+    BOOST_REQUIRE(qproc.error == AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(qproc.samples.size(), req.select.columns[0].ids.size()*(end - begin));
+    size_t niter = 0;
+    for (auto id: req.select.columns[0].ids) {
+        for (aku_Timestamp tx = begin; tx < end; tx++) {
+            BOOST_REQUIRE(qproc.samples.at(niter).paramid == id);
+            BOOST_REQUIRE(qproc.samples.at(niter).timestamp == tx);
+            niter++;
+        }
+    }
+}
+
+void test_aggregation(aku_Timestamp begin, aku_Timestamp end, size_t nseries = 10) {
     auto cstore = create_cstore();
     auto session = create_session(cstore);
-    std::vector<aku_ParamId> ids = {
-        10,11,12,13,14,15,16,17,18,19
-    };
+    std::vector<aku_ParamId> ids;
+    for (size_t i = 0; i < nseries; i++) {
+        ids.push_back(10 + i);
+    }
     std::vector<double> sums;
     for (auto id: ids) {
         double sum = fill_data_in(cstore, session, id, begin, end);
@@ -507,6 +725,11 @@ BOOST_AUTO_TEST_CASE(Test_column_store_aggregation_3) {
     test_aggregation(10000, 110000);
 }
 
+BOOST_AUTO_TEST_CASE(Test_column_store_aggregation_4) {
+    // Large number of series, operators can be evaluated in parallel
+    test_aggregation(100, 1100, 256);
+}
+
 void test_aggregation_group_by(aku_Timestamp begin, aku_Timestamp end) {
     auto cstore = create_cstore();
     auto session = create_session(cstore);
@@ -693,6 +916,127 @@ BOOST_AUTO_TEST_CASE(Test_column_store_join_1) {
     test_join(100, 1100);
 }
 
+void test_compare(OrderBy order, u64 step) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    std::vector<aku_ParamId> col = {
+        10,11,12,13,14
+    };
+    for (auto id: col) {
+        fill_data_in(cstore, session, id, 0, 3000);
+    }
+    // Query range and two ranges shifted back in time
+    const aku_Timestamp begin = 2000, end = 3000;
+    std::vector<aku_Timestamp> shifts = { 500, 2000 };
+    std::vector<aku_Timestamp> timestamps;
+    for (aku_Timestamp ts = begin; ts < end; ts += step == 0 ? 1 : step) {
+        timestamps.push_back(ts);
+    }
+    TupleQueryProcessorMock mock(3);
+    ReshapeRequest req = {};
+    req.agg.enabled = step != 0;
+    req.agg.step = step;
+    req.agg.func = { AggregationFunction::MIN };
+    req.group_by.enabled = false;
+    req.order_by = order;
+    req.select.begin = begin;
+    req.select.end = end;
+    req.select.columns.push_back({col});
+    req.compare = shifts;
+
+    execute(cstore, &mock, req);
+
+    BOOST_REQUIRE(mock.error == AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(mock.timestamps.size(), col.size()*timestamps.size());
+    for (u32 ix = 0; ix < mock.timestamps.size(); ix++) {
+        auto id = order == OrderBy::SERIES ? col.at(ix / timestamps.size()) : col.at(ix % col.size());
+        auto ts = order == OrderBy::SERIES ? timestamps.at(ix % timestamps.size()) : timestamps.at(ix / col.size());
+        BOOST_REQUIRE_EQUAL(mock.paramids.at(ix), id);
+        BOOST_REQUIRE_EQUAL(mock.timestamps.at(ix), ts);
+        // Values are ts*0.1 so every column should contain the value of the shifted timestamp
+        BOOST_REQUIRE_CLOSE(mock.columns[0][ix], ts*0.1, 10E-10);
+        for (size_t i = 0; i < shifts.size(); i++) {
+            BOOST_REQUIRE_CLOSE(mock.columns[i + 1][ix], (ts - shifts[i])*0.1, 10E-10);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_compare_1) {
+    test_compare(OrderBy::SERIES, 0);
+    test_compare(OrderBy::TIME, 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_compare_2) {
+    test_compare(OrderBy::SERIES, 100);
+    test_compare(OrderBy::TIME, 100);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_estimate) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    std::vector<aku_ParamId> col = {
+        10,11,12,13,14
+    };
+    const aku_Timestamp N = 100000;
+    for (auto id: col) {
+        fill_data_in(cstore, session, id, 0, N);
+    }
+    // Series without data in the query range
+    fill_data_in(cstore, session, 15, 2*N, 2*N + 1000);
+    col.push_back(15);
+
+    QueryEstimate est;
+    BOOST_REQUIRE_EQUAL(cstore->estimate(col, 0, N, &est), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(est.nseries, 5);
+    BOOST_REQUIRE_EQUAL(est.nvalues, 5*N);
+    BOOST_REQUIRE(est.nleaves > 5);
+
+    // Subtrees that partially overlap the range are counted proportionally
+    QueryEstimate half;
+    BOOST_REQUIRE_EQUAL(cstore->estimate(col, N, 0, &half), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(half.nvalues, est.nvalues);
+    BOOST_REQUIRE_EQUAL(cstore->estimate(col, N/4, 3*N/4, &half), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(half.nseries, 5);
+    BOOST_REQUIRE_CLOSE(static_cast<double>(half.nvalues), 5*N/2, 5.0);
+    BOOST_REQUIRE(half.nleaves < est.nleaves);
+
+    // Only one series has data, merge is replaced with the chain
+    ReshapeRequest req = {};
+    req.group_by.enabled = false;
+    req.order_by = OrderBy::TIME;
+    req.select.begin = 2*N;
+    req.select.end = 3*N;
+    req.select.columns.push_back({col});
+    BOOST_REQUIRE_EQUAL(cstore->estimate(col, req.select.begin, req.select.end, &est), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(est.nseries, 1);
+    BOOST_REQUIRE_EQUAL(est.nvalues, 1000);
+    aku_Status status;
+    std::unique_ptr<QP::IQueryPlan> plan;
+    std::tie(status, plan) = QP::QueryPlanBuilder::create(req, est);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(plan->explain(), "{\"tier1\": \"scan\", \"tier2\": \"chain\", \"parallelism\": 1}");
+    QueryProcessorMock qproc;
+    if (qproc.start()) {
+        QueryPlanExecutor executor;
+        executor.execute(*cstore, std::move(plan), qproc);
+        qproc.stop();
+    }
+    BOOST_REQUIRE(qproc.error == AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(qproc.samples.size(), 1000);
+    for (u32 i = 0; i < qproc.samples.size(); i++) {
+        BOOST_REQUIRE_EQUAL(qproc.samples.at(i).paramid, 15);
+        BOOST_REQUIRE_EQUAL(qproc.samples.at(i).timestamp, 2*N + i);
+    }
+
+    // Small query is merged by one thread
+    req.select.begin = 0;
+    req.select.end = N;
+    BOOST_REQUIRE_EQUAL(cstore->estimate(col, req.select.begin, req.select.end, &est), AKU_SUCCESS);
+    std::tie(status, plan) = QP::QueryPlanBuilder::create(req, est);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(plan->explain(), "{\"tier1\": \"scan\", \"tier2\": \"merge-by-time\", \"parallelism\": 1}");
+}
+
 void test_group_aggregate(aku_Timestamp begin, aku_Timestamp end) {
     auto cstore = create_cstore();
     auto session = create_session(cstore);
@@ -851,3 +1195,827 @@ BOOST_AUTO_TEST_CASE(Test_column_store_aggregate_group_by_2) {
 BOOST_AUTO_TEST_CASE(Test_column_store_aggregate_group_by_3) {
     test_aggregate_and_group_by(1000, 11000);
 }
+
+static std::vector<std::pair<aku_Timestamp, AggregationResult>> read_group_aggregate(std::shared_ptr<ColumnStore> cstore,
+                                                                                     aku_ParamId id,
+                                                                                     aku_Timestamp begin,
+                                                                                     aku_Timestamp end,
+                                                                                     aku_Timestamp step)
+{
+    std::vector<std::unique_ptr<AggregateOperator>> ops;
+    auto status = cstore->group_aggregate({ id }, begin, end, step, &ops);
+    BOOST_REQUIRE(status == AKU_SUCCESS);
+    BOOST_REQUIRE(ops.size() == 1);
+    std::vector<std::pair<aku_Timestamp, AggregationResult>> result;
+    const size_t SZBUF = 100;
+    std::vector<aku_Timestamp> ts(SZBUF, 0);
+    std::vector<AggregationResult> xs(SZBUF, INIT_AGGRES);
+    size_t size = 0;
+    status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = ops.front()->read(ts.data(), xs.data(), SZBUF);
+        for (size_t i = 0; i < size; i++) {
+            result.push_back(std::make_pair(ts[i], xs[i]));
+        }
+        if (size == 0) {
+            break;
+        }
+    }
+    BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+    return result;
+}
+
+//! Compare results of the group-aggregate query with the results from the plain column-store
+static void check_group_aggregate(std::shared_ptr<ColumnStore> cstore, std::shared_ptr<ColumnStore> plain,
+                                  aku_ParamId id, aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step)
+{
+    auto actual = read_group_aggregate(cstore, id, begin, end, step);
+    auto expected = read_group_aggregate(plain, id, begin, end, step);
+    BOOST_REQUIRE(!expected.empty());
+    BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+    for (size_t i = 0; i < actual.size(); i++) {
+        auto const& a = actual[i].second;
+        auto const& e = expected[i].second;
+        BOOST_REQUIRE_EQUAL(actual[i].first, expected[i].first);
+        BOOST_REQUIRE_EQUAL(a.cnt, e.cnt);
+        BOOST_REQUIRE_CLOSE(a.sum, e.sum, 10E-10);
+        BOOST_REQUIRE_EQUAL(a.min, e.min);
+        BOOST_REQUIRE_EQUAL(a.max, e.max);
+        if (begin < end) {
+            // Backward group-aggregate doesn't preserve first/last values of
+            // the buckets split between leaf nodes
+            BOOST_REQUIRE_EQUAL(a.first, e.first);
+            BOOST_REQUIRE_EQUAL(a.last, e.last);
+        }
+        BOOST_REQUIRE_EQUAL(a.mints, e.mints);
+        BOOST_REQUIRE_EQUAL(a.maxts, e.maxts);
+        BOOST_REQUIRE_EQUAL(a._begin, e._begin);
+        BOOST_REQUIRE_EQUAL(a._end, e._end);
+    }
+}
+
+static std::vector<std::pair<aku_Timestamp, AggregationResult>> read_gap_fill(std::shared_ptr<ColumnStore> cstore,
+                                                                              aku_ParamId id,
+                                                                              aku_Timestamp begin,
+                                                                              aku_Timestamp end,
+                                                                              aku_Timestamp step,
+                                                                              FillMode mode)
+{
+    std::vector<std::unique_ptr<AggregateOperator>> ops;
+    auto status = cstore->group_aggregate({ id }, begin, end, step, &ops);
+    BOOST_REQUIRE(status == AKU_SUCCESS);
+    GapFillOperator op(std::move(ops.at(0)), begin, end, step, mode);
+    std::vector<std::pair<aku_Timestamp, AggregationResult>> result;
+    // Small buffer, results are returned in several steps
+    const size_t SZBUF = 3;
+    std::vector<aku_Timestamp> ts(SZBUF, 0);
+    std::vector<AggregationResult> xs(SZBUF, INIT_AGGRES);
+    size_t size = 0;
+    status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = op.read(ts.data(), xs.data(), SZBUF);
+        for (size_t i = 0; i < size; i++) {
+            result.push_back(std::make_pair(ts[i], xs[i]));
+        }
+    }
+    BOOST_REQUIRE(status == AKU_ENO_DATA);
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_gap_fill) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    // Data in buckets 0, 1, 6 and 7
+    fill_data_in(cstore, session, 42, 0, 100);
+    aku_Sample sample;
+    sample.paramid = 42;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    std::vector<u64> rpoints;
+    for (aku_Timestamp ix = 300; ix < 400; ix++) {
+        sample.payload.float64 = ix*0.1;
+        sample.timestamp = ix;
+        session->write(sample, &rpoints);
+    }
+    const aku_Timestamp step = 50;
+    auto check = [&](FillMode mode, std::vector<double> const& expected) {
+        auto actual = read_gap_fill(cstore, 42, 0, 500, step, mode);
+        BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+        for (size_t i = 0; i < actual.size(); i++) {
+            BOOST_REQUIRE_EQUAL(actual[i].first, i*step);
+            if (std::isnan(expected[i])) {
+                BOOST_REQUIRE_EQUAL(actual[i].second.cnt, 0);
+            } else {
+                BOOST_REQUIRE_EQUAL(actual[i].second.cnt, step);
+                BOOST_REQUIRE_CLOSE(actual[i].second.min, expected[i], 0.0001);
+            }
+        }
+    };
+    check(FillMode::NULL_VALUE, { 0.0, 5.0, NAN, NAN, NAN, NAN, 30.0, 35.0, NAN, NAN });
+    check(FillMode::PREVIOUS,   { 0.0, 5.0, 5.0, 5.0, 5.0, 5.0, 30.0, 35.0, 35.0, 35.0 });
+    check(FillMode::LINEAR,     { 0.0, 5.0, 10.0, 15.0, 20.0, 25.0, 30.0, 35.0, NAN, NAN });
+}
+
+static void test_reduce_group_aggregate(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    const aku_Timestamp N = 10000;
+    fill_data_in(cstore, session, 42, 0, N);
+    fill_data_in(cstore, session, 43, 0, N);
+    fill_data_in(cstore, session, 44, N/2, N);
+    std::vector<std::unique_ptr<AggregateOperator>> ops;
+    BOOST_REQUIRE(cstore->group_aggregate({ 42, 43, 44 }, begin, end, step, &ops) == AKU_SUCCESS);
+    ReduceGroupAggregateOperator op(begin, step, std::move(ops));
+    std::vector<std::pair<aku_Timestamp, AggregationResult>> actual;
+    // Small buffer, results are returned in several steps
+    const size_t SZBUF = 7;
+    std::vector<aku_Timestamp> ts(SZBUF, 0);
+    std::vector<AggregationResult> xs(SZBUF, INIT_AGGRES);
+    aku_Status status = AKU_SUCCESS;
+    size_t size = 0;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = op.read(ts.data(), xs.data(), SZBUF);
+        for (size_t i = 0; i < size; i++) {
+            actual.push_back(std::make_pair(ts[i], xs[i]));
+        }
+    }
+    BOOST_REQUIRE(status == AKU_ENO_DATA);
+    bool forward = begin < end;
+    BOOST_REQUIRE_EQUAL(actual.size(), (forward ? end - begin : begin - end) / step);
+    for (size_t i = 0; i < actual.size(); i++) {
+        auto const& res = actual[i].second;
+        aku_Timestamp lo = forward ? begin + i*step : begin - (i + 1)*step + 1;
+        double nseries = lo < N/2 ? 2 : 3;
+        BOOST_REQUIRE_EQUAL(actual[i].first, lo);
+        BOOST_REQUIRE_EQUAL(res.cnt, nseries*step);
+        BOOST_REQUIRE_CLOSE(res.min, lo*0.1, 0.0001);
+        BOOST_REQUIRE_CLOSE(res.max, (lo + step - 1)*0.1, 0.0001);
+        double sum = 0;
+        for (aku_Timestamp ix = lo; ix < lo + step; ix++) {
+            sum += ix*0.1;
+        }
+        BOOST_REQUIRE_CLOSE(res.sum, nseries*sum, 0.0001);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_reduce_group_aggregate_fwd) {
+    test_reduce_group_aggregate(0, 10000, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_reduce_group_aggregate_bwd) {
+    test_reduce_group_aggregate(9999, 999, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_reduce_group_aggregate_many_windows) {
+    // Buckets are combined in several windows
+    test_reduce_group_aggregate(0, 10000, 4);
+    test_reduce_group_aggregate(9999, 999, 5);
+}
+
+static void test_hopping_window(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step, aku_Timestamp window) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    // Data in [1000, 2000) and [2600, 5000)
+    fill_data_in(cstore, session, 42, 1000, 2000);
+    aku_Sample sample;
+    sample.paramid = 42;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    std::vector<u64> rpoints;
+    for (aku_Timestamp ix = 2600; ix < 5000; ix++) {
+        sample.payload.float64 = ix*0.1;
+        sample.timestamp = ix;
+        session->write(sample, &rpoints);
+    }
+    auto has_value = [](aku_Timestamp ts) {
+        return (ts >= 1000 && ts < 2000) || (ts >= 2600 && ts < 5000);
+    };
+    aku_Timestamp scan_begin, scan_end;
+    std::tie(scan_begin, scan_end) = HoppingWindowOperator::get_scan_range(begin, end, step, window);
+    std::vector<std::unique_ptr<AggregateOperator>> ops;
+    BOOST_REQUIRE(cstore->group_aggregate({ 42 }, scan_begin, scan_end, step, &ops) == AKU_SUCCESS);
+    HoppingWindowOperator op(std::move(ops.at(0)), begin, end, step, window);
+    std::map<aku_Timestamp, AggregationResult> actual;
+    // Small buffer, results are returned in several steps
+    const size_t SZBUF = 3;
+    std::vector<aku_Timestamp> ts(SZBUF, 0);
+    std::vector<AggregationResult> xs(SZBUF, INIT_AGGRES);
+    aku_Status status = AKU_SUCCESS;
+    size_t size = 0;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = op.read(ts.data(), xs.data(), SZBUF);
+        for (size_t i = 0; i < size; i++) {
+            BOOST_REQUIRE(actual.count(ts[i]) == 0);
+            actual[ts[i]] = xs[i];
+        }
+    }
+    BOOST_REQUIRE(status == AKU_ENO_DATA);
+    // Every bucket of the range is an aggregate of the window that ends with the bucket
+    bool forward = begin < end;
+    size_t nexpected = 0;
+    u64 nbins = ((forward ? end - begin : begin - end) + step - 1) / step;
+    for (u64 bin = 0; bin < nbins; bin++) {
+        aku_Timestamp bucket = forward ? begin + bin*step : begin - bin*step;
+        // Window of the forward bucket is [lo, bucket + step), backward - (bucket - window, bucket]
+        aku_Timestamp lo = forward ? (bucket + step > window ? bucket + step - window : 0)
+                                   : (bucket + 1 > window ? bucket + 1 - window : 0);
+        aku_Timestamp hi = forward ? bucket + step : bucket + 1;
+        double cnt = 0;
+        for (aku_Timestamp t = lo; t < hi; t++) {
+            cnt += has_value(t) ? 1 : 0;
+        }
+        auto it = actual.find(bucket);
+        if (cnt == 0) {
+            BOOST_REQUIRE(it == actual.end());
+            continue;
+        }
+        BOOST_REQUIRE(it != actual.end());
+        nexpected++;
+        aku_Timestamp first = lo, last = hi - 1;
+        while (!has_value(first)) first++;
+        while (!has_value(last)) last--;
+        BOOST_REQUIRE_EQUAL(it->second.cnt, cnt);
+        BOOST_REQUIRE_CLOSE(it->second.min, first*0.1, 0.0001);
+        BOOST_REQUIRE_CLOSE(it->second.max, last*0.1, 0.0001);
+        BOOST_REQUIRE_EQUAL(it->second.mints, first);
+        BOOST_REQUIRE_EQUAL(it->second.maxts, last);
+        BOOST_REQUIRE_EQUAL(it->second._begin, bucket);
+    }
+    BOOST_REQUIRE_EQUAL(actual.size(), nexpected);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_hopping_window_fwd) {
+    test_hopping_window(0, 6000, 100, 500);
+    test_hopping_window(1200, 4300, 100, 500);
+    test_hopping_window(1000, 6000, 250, 250);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_hopping_window_bwd) {
+    test_hopping_window(5999, 0, 100, 500);
+    test_hopping_window(4299, 1199, 100, 500);
+    test_hopping_window(5999, 999, 250, 250);
+}
+
+static AggregationResult read_single_aggregate(std::unique_ptr<AggregateOperator> op) {
+    aku_Timestamp ts;
+    AggregationResult xs = INIT_AGGRES;
+    aku_Status status;
+    size_t size;
+    std::tie(status, size) = op->read(&ts, &xs, 1);
+    BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+    BOOST_REQUIRE_EQUAL(size, 1);
+    return xs;
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_approximate_aggregate) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    const aku_Timestamp N = 100000;
+    fill_data_in(cstore, session, 42, 0, N);
+
+    auto check = [&](aku_Timestamp begin, aku_Timestamp end) {
+        std::vector<std::unique_ptr<AggregateOperator>> exact, approx;
+        BOOST_REQUIRE(cstore->aggregate({ 42 }, begin, end, &exact) == AKU_SUCCESS);
+        BOOST_REQUIRE(cstore->approximate({ 42 }, begin, end, &approx) == AKU_SUCCESS);
+        QueryProfile profile;
+        QueryProfile::Scope scope(&profile);
+        auto expected = read_single_aggregate(std::move(exact.at(0)));
+        profile.count_error = 0;
+        profile.leaves_estimated = 0;
+        auto actual = read_single_aggregate(std::move(approx.at(0)));
+        // Leaf nodes can only be estimated at both ends of the range
+        BOOST_REQUIRE(profile.leaves_estimated <= 2);
+        BOOST_REQUIRE(std::abs(actual.cnt - expected.cnt) <= profile.count_error);
+        if (profile.leaves_estimated == 0) {
+            BOOST_REQUIRE_EQUAL(actual.cnt, expected.cnt);
+            BOOST_REQUIRE_CLOSE(actual.sum, expected.sum, 10E-10);
+        }
+        BOOST_REQUIRE(actual.min <= expected.min);
+        BOOST_REQUIRE(actual.max >= expected.max);
+    };
+    check(0, N);
+    check(1000, 95000);
+    check(12345, 12346);
+    check(N - 1, 0);
+    check(89999, 1234);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_value_ranges) {
+    auto cstore = create_cstore();
+    auto session = create_session(cstore);
+    const aku_Timestamp N = 200000;
+    // Every third period of 7000 values is above the threshold
+    auto value = [](aku_Timestamp ts) {
+        return (ts / 7000) % 3 == 0 ? 100.0 + static_cast<double>(ts % 7) : static_cast<double>(ts % 50);
+    };
+    cstore->create_new_column(42);
+    aku_Sample sample;
+    sample.paramid = 42;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    std::vector<u64> rpoints;
+    for (aku_Timestamp ix = 0; ix < N; ix++) {
+        sample.payload.float64 = value(ix);
+        sample.timestamp = ix;
+        session->write(sample, &rpoints);
+    }
+    ValueFilter filter;
+    filter.add(ValueFilter::Op::GT, 60.0);
+
+    auto check = [&](aku_Timestamp begin, aku_Timestamp end) {
+        // Expected ranges in iteration order
+        std::vector<AggregationResult> expected;
+        bool forward = begin < end;
+        AggregationResult run = INIT_AGGRES;
+        for (aku_Timestamp ts = begin; ts != end; forward ? ts++ : ts--) {
+            if (filter.match(value(ts))) {
+                run.add(ts, value(ts), forward);
+            } else if (run.cnt != 0) {
+                expected.push_back(run);
+                run = INIT_AGGRES;
+            }
+        }
+        if (run.cnt != 0) {
+            expected.push_back(run);
+        }
+        std::vector<std::unique_ptr<AggregateOperator>> ops;
+        BOOST_REQUIRE(cstore->value_ranges({ 42 }, begin, end, filter, &ops) == AKU_SUCCESS);
+        QueryProfile profile;
+        QueryProfile::Scope scope(&profile);
+        std::vector<AggregationResult> actual;
+        aku_Status status = AKU_SUCCESS;
+        while (status == AKU_SUCCESS) {
+            aku_Timestamp ts[16];
+            AggregationResult xs[16];
+            size_t size;
+            std::tie(status, size) = ops.at(0)->read(ts, xs, 16);
+            BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+            for (size_t i = 0; i < size; i++) {
+                BOOST_REQUIRE_EQUAL(ts[i], xs[i]._begin);
+                actual.push_back(xs[i]);
+            }
+        }
+        BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+        for (size_t i = 0; i < actual.size(); i++) {
+            BOOST_REQUIRE_EQUAL(actual[i]._begin, expected[i]._begin);
+            BOOST_REQUIRE_EQUAL(actual[i]._end, expected[i]._end);
+            BOOST_REQUIRE_EQUAL(actual[i].cnt, expected[i].cnt);
+            BOOST_REQUIRE_EQUAL(actual[i].min, expected[i].min);
+            BOOST_REQUIRE_EQUAL(actual[i].max, expected[i].max);
+        }
+        return profile.subtrees_skipped.load();
+    };
+    // Leaves that don't cross the threshold are not read
+    BOOST_REQUIRE(check(0, N) > 0);
+    check(1000, 95000);
+    check(7000, 13999);
+    check(N - 1, 0);
+    check(89999, 1234);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_rollup_tiers) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> rollups;
+    rollups.reset(new ColumnStore(bstore, { 10, 100 }));
+    auto plain = create_cstore();
+    auto session = create_session(rollups);
+    auto plain_session = create_session(plain);
+    const aku_Timestamp N = 100000;
+    fill_data_in(rollups, session, 42, 0, N);
+    fill_data_in(plain, plain_session, 42, 0, N);
+    rollups->_wait_rollups();
+
+    auto check = [&](aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) {
+        check_group_aggregate(rollups, plain, 42, begin, end, step);
+    };
+    // Forward queries (the tail is read from the tree)
+    check(0, N, 100);
+    check(1000, 95000, 1000);
+    check(100, 99999, 10);
+    check(0, N, 300);
+    // Backward queries
+    check(N - 1, 0, 100);
+    check(89999, 1234, 1000);
+    check(N - 1, 0, 10);
+    // Step doesn't match any tier
+    check(0, N, 15);
+    check(5, N, 100);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_query_cache) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cached;
+    cached.reset(new ColumnStore(bstore, {}, 0x400000));
+    auto plain = create_cstore();
+    auto session = create_session(cached);
+    auto plain_session = create_session(plain);
+    const aku_Timestamp N = 100000;
+    fill_data_in(cached, session, 42, 0, N);
+    fill_data_in(plain, plain_session, 42, 0, N);
+
+    auto check = [&](aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) {
+        check_group_aggregate(cached, plain, 42, begin, end, step);
+    };
+    check(0, N, 100);
+    auto size = cached->_get_query_cache_size();
+    BOOST_REQUIRE(size != 0);
+    // Same query and the query with the same buckets shouldn't add anything
+    check(0, N, 100);
+    check(N - 1001, 5000, 100);
+    BOOST_REQUIRE_EQUAL(size, cached->_get_query_cache_size());
+    // Overlapping ranges with different alignment
+    check(50, 70000, 100);
+    check(30050, N, 100);
+    check(N - 51, 0, 100);
+    check(0, N, 1000);
+    check(3, N, 7);
+    BOOST_REQUIRE(size < cached->_get_query_cache_size());
+
+    // New values should be visible
+    fill_data_in(cached, session, 42, N, 2*N);
+    fill_data_in(plain, plain_session, 42, N, 2*N);
+    check(0, 2*N, 100);
+    check(2*N - 1, 0, 100);
+    check(50, 2*N, 100);
+    check(3, 2*N, 7);
+}
+
+//! Operator that returns values from the array
+struct ArrayOperator : RealValuedOperator {
+    std::vector<aku_Timestamp> ts_;
+    std::vector<double> xs_;
+    size_t pos_;
+    Direction dir_;
+
+    ArrayOperator(std::vector<aku_Timestamp> const& ts, std::vector<double> const& xs, Direction dir)
+        : ts_(ts)
+        , xs_(xs)
+        , pos_(0)
+        , dir_(dir)
+    {
+    }
+
+    virtual std::tuple<aku_Status, size_t> read(aku_Timestamp* destts, double* destval, size_t size) {
+        size_t n = std::min(size, ts_.size() - pos_);
+        std::copy(ts_.begin() + pos_, ts_.begin() + pos_ + n, destts);
+        std::copy(xs_.begin() + pos_, xs_.begin() + pos_ + n, destval);
+        pos_ += n;
+        return std::make_tuple(pos_ == ts_.size() ? AKU_ENO_DATA : AKU_SUCCESS, n);
+    }
+
+    virtual Direction get_direction() {
+        return dir_;
+    }
+};
+
+static std::vector<aku_Sample> read_merge(ColumnMaterializer* mat) {
+    std::vector<aku_Sample> result;
+    std::vector<aku_Sample> buffer(777);
+    aku_Status status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        size_t size;
+        std::tie(status, size) = mat->read(reinterpret_cast<u8*>(buffer.data()), buffer.size()*sizeof(aku_Sample));
+        BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+        BOOST_REQUIRE_EQUAL(size % sizeof(aku_Sample), 0);
+        result.insert(result.end(), buffer.begin(), buffer.begin() + static_cast<ssize_t>(size/sizeof(aku_Sample)));
+    }
+    return result;
+}
+
+void test_parallel_merge(bool forward, bool spill = false) {
+    const size_t nseries = MIN_SERIES_PER_MERGE_WORKER*4;
+    auto dir = forward ? RealValuedOperator::Direction::FORWARD : RealValuedOperator::Direction::BACKWARD;
+    std::vector<std::vector<aku_Timestamp>> tss;
+    std::vector<std::vector<double>> xss;
+    std::vector<aku_ParamId> ids;
+    for (size_t i = 0; i < nseries; i++) {
+        // Series overlap and share some timestamps, some series are empty
+        std::vector<aku_Timestamp> ts;
+        std::vector<double> xs;
+        for (aku_Timestamp t = i % 7; t < 500 && i % 101 != 0; t += 1 + i % 13) {
+            ts.push_back(t);
+            xs.push_back(static_cast<double>(i*1000 + t));
+        }
+        if (!forward) {
+            std::reverse(ts.begin(), ts.end());
+            std::reverse(xs.begin(), xs.end());
+        }
+        tss.push_back(ts);
+        xss.push_back(xs);
+        // Ids are not sorted
+        ids.push_back((i * 7919) % nseries + 1);
+    }
+    auto make_iters = [&]() {
+        std::vector<std::unique_ptr<RealValuedOperator>> iters;
+        for (size_t i = 0; i < nseries; i++) {
+            iters.emplace_back(new ArrayOperator(tss[i], xss[i], dir));
+        }
+        return iters;
+    };
+    auto seq_ids = ids;
+    MergeMaterializer<TimeOrder> seq(std::move(seq_ids), make_iters());
+    auto expected = read_merge(&seq);
+    size_t total = 0;
+    for (auto const& ts: tss) {
+        total += ts.size();
+    }
+    BOOST_REQUIRE_EQUAL(expected.size(), total);
+    for (size_t i = 1; i < expected.size(); i++) {
+        auto prev = std::make_tuple(expected[i - 1].timestamp, expected[i - 1].paramid);
+        auto curr = std::make_tuple(expected[i].timestamp, expected[i].paramid);
+        BOOST_REQUIRE(forward ? prev < curr : prev > curr);
+    }
+    auto par_ids = ids;
+    // Range buffers of the quarter of the series fit into the budget
+    const size_t budget = nseries/4*MergeMaterializer<TimeOrder>::MIN_RANGE_SIZE*MergeMaterializer<TimeOrder>::ELEMENT_SIZE;
+    std::unique_ptr<QueryArena::Scope> scope;
+    if (spill) {
+        scope.reset(new QueryArena::Scope(AKU_QUERY_ARENA_LIMIT, budget));
+    }
+    auto par = make_merge_materializer<TimeOrder, MergeJoinUtil::OrderByTimestamp>(std::move(par_ids), make_iters(), 4);
+    if (spill) {
+        typedef ExternalMergeMaterializer<TimeOrder, MergeJoinUtil::OrderByTimestamp> ExternalMerge;
+        BOOST_REQUIRE(dynamic_cast<ExternalMerge*>(par.get()) != nullptr);
+    } else {
+        BOOST_REQUIRE(dynamic_cast<MergeJoinMaterializer<MergeJoinUtil::OrderByTimestamp>*>(par.get()) != nullptr);
+    }
+    auto actual = read_merge(par.get());
+    if (spill) {
+        BOOST_REQUIRE_LE(scope->get()->get_reserved(), budget);
+    }
+    BOOST_REQUIRE_EQUAL(actual.size(), expected.size());
+    for (size_t i = 0; i < actual.size(); i++) {
+        BOOST_REQUIRE_EQUAL(actual[i].paramid, expected[i].paramid);
+        BOOST_REQUIRE_EQUAL(actual[i].timestamp, expected[i].timestamp);
+        BOOST_REQUIRE_EQUAL(actual[i].payload.float64, expected[i].payload.float64);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_parallel_merge_1) {
+    test_parallel_merge(true);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_parallel_merge_2) {
+    test_parallel_merge(false);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_external_merge_1) {
+    test_parallel_merge(true, true);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_external_merge_2) {
+    test_parallel_merge(false, true);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_parallel_merge_early_close) {
+    // Materializer can be destroyed before the merge is complete
+    std::vector<std::unique_ptr<RealValuedOperator>> iters;
+    std::vector<aku_ParamId> ids;
+    std::vector<aku_Timestamp> ts(10000);
+    std::iota(ts.begin(), ts.end(), 0);
+    std::vector<double> xs(ts.size(), 1.0);
+    for (size_t i = 0; i < MIN_SERIES_PER_MERGE_WORKER*2; i++) {
+        iters.emplace_back(new ArrayOperator(ts, xs, RealValuedOperator::Direction::FORWARD));
+        ids.push_back(i + 1);
+    }
+    auto mat = make_merge_materializer<TimeOrder, MergeJoinUtil::OrderByTimestamp>(std::move(ids), std::move(iters), 2);
+    std::vector<aku_Sample> buffer(100);
+    aku_Status status;
+    size_t size;
+    std::tie(status, size) = mat->read(reinterpret_cast<u8*>(buffer.data()), buffer.size()*sizeof(aku_Sample));
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(size, buffer.size()*sizeof(aku_Sample));
+    mat.reset();
+}
+
+void test_join_materializer(bool forward, u32 ncols) {
+    // Columns are aligned most of the time but some values are missing
+    auto dir = forward ? RealValuedOperator::Direction::FORWARD : RealValuedOperator::Direction::BACKWARD;
+    std::vector<std::vector<aku_Timestamp>> tss(ncols);
+    std::vector<std::vector<double>> xss(ncols);
+    std::map<aku_Timestamp, std::vector<std::pair<u32, double>>> expected;
+    for (u32 i = 0; i < ncols; i++) {
+        for (aku_Timestamp t = 0; t < 5000; t++) {
+            bool missing = (t > 1000 && t < 1100 && i == 1) || (t % 997 == i) || (i == 4 && t > 3000);
+            if (missing) {
+                continue;
+            }
+            tss[i].push_back(t);
+            xss[i].push_back(static_cast<double>(t*1000 + i));
+            expected[t].push_back(std::make_pair(i, static_cast<double>(t*1000 + i)));
+        }
+        if (!forward) {
+            std::reverse(tss[i].begin(), tss[i].end());
+            std::reverse(xss[i].begin(), xss[i].end());
+        }
+    }
+    std::vector<std::unique_ptr<RealValuedOperator>> iters;
+    std::vector<aku_ParamId> ids;
+    for (u32 i = 0; i < ncols; i++) {
+        iters.emplace_back(new ArrayOperator(tss[i], xss[i], dir));
+        ids.push_back(i);
+    }
+    JoinMaterializer join(std::move(ids), std::move(iters), 42);
+    // Buffer size is not a multiple of the tuple size
+    std::vector<u8> buffer(AKU_MAX_TUPLE_SIZE + 1000);
+    std::vector<u8> output;
+    aku_Status status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        size_t size;
+        std::tie(status, size) = join.read(buffer.data(), buffer.size());
+        BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+        output.insert(output.end(), buffer.begin(), buffer.begin() + static_cast<ssize_t>(size));
+    }
+    std::vector<aku_Timestamp> order;
+    for (auto const& kv: expected) {
+        order.push_back(kv.first);
+    }
+    if (!forward) {
+        std::reverse(order.begin(), order.end());
+    }
+    size_t pos = 0;
+    for (auto ts: order) {
+        BOOST_REQUIRE(pos < output.size());
+        aku_Sample sample;
+        memcpy(&sample, output.data() + pos, sizeof(aku_Sample));
+        BOOST_REQUIRE_EQUAL(sample.timestamp, ts);
+        BOOST_REQUIRE_EQUAL(sample.paramid, 42);
+        BOOST_REQUIRE_EQUAL(sample.payload.type, AKU_PAYLOAD_TUPLE);
+        auto const& row = expected[ts];
+        auto nwords = ncols > AKU_TUPLE_COMPACT_MAX_COLUMNS ? (ncols + 63)/64 : 0;
+        BOOST_REQUIRE_EQUAL(sample.payload.size, sizeof(aku_Sample) + (nwords + row.size())*sizeof(double));
+        u64 header;
+        memcpy(&header, &sample.payload.float64, sizeof(u64));
+        if (nwords == 0) {
+            BOOST_REQUIRE_EQUAL(header >> 58, ncols);
+        } else {
+            BOOST_REQUIRE_EQUAL(header >> 58, AKU_TUPLE_EXTENDED);
+            BOOST_REQUIRE_EQUAL(static_cast<u32>(header), ncols);
+        }
+        QP::MutableSample mut(reinterpret_cast<aku_Sample const*>(output.data() + pos));
+        BOOST_REQUIRE_EQUAL(mut.size(), ncols);
+        size_t j = 0;
+        for (u32 i = 0; i < ncols; i++) {
+            auto value = mut[i];
+            if (j < row.size() && row[j].first == i) {
+                BOOST_REQUIRE(value != nullptr);
+                BOOST_REQUIRE_EQUAL(*value, row[j].second);
+                j++;
+            } else {
+                BOOST_REQUIRE(value == nullptr);
+            }
+        }
+        BOOST_REQUIRE(mut[ncols] == nullptr);
+        pos += sample.payload.size;
+    }
+    BOOST_REQUIRE_EQUAL(pos, output.size());
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_join_materializer_1) {
+    test_join_materializer(true, 5);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_join_materializer_2) {
+    test_join_materializer(false, 5);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_join_materializer_3) {
+    // Extended tuples
+    test_join_materializer(true, 100);
+    test_join_materializer(false, AKU_MAX_COLUMNS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_join_materializer_4) {
+    // Compact tuples that don't fit into the inline storage of the MutableSample
+    test_join_materializer(true, 20);
+    test_join_materializer(false, 58);
+}
+
+static size_t count_values(RealValuedOperator& op) {
+    const size_t SZBUF = 100;
+    std::vector<aku_Timestamp> ts(SZBUF, 0);
+    std::vector<double> xs(SZBUF, 0);
+    size_t total = 0;
+    aku_Status status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        size_t size;
+        std::tie(status, size) = op.read(ts.data(), xs.data(), SZBUF);
+        total += size;
+    }
+    BOOST_REQUIRE(status == AKU_ENO_DATA);
+    return total;
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_span_pruning) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore));
+    auto session = create_session(cstore);
+    fill_data_in(cstore, session, 10, 100, 200);
+    fill_data_in(cstore, session, 11, 1000, 1100);
+    session.reset();
+    auto mapping = cstore->close();
+
+    // Columns are opened lazily after reopen, spans are unknown
+    cstore.reset(new ColumnStore(bstore));
+    cstore->open_or_restore(mapping);
+    std::vector<aku_ParamId> ids = { 10, 11 };
+    auto is_empty = [](std::unique_ptr<RealValuedOperator> const& op) {
+        return dynamic_cast<EmptyOperator<double>*>(op.get()) != nullptr;
+    };
+    for (int i = 0; i < 2; i++) {
+        std::vector<std::unique_ptr<RealValuedOperator>> ops;
+        BOOST_REQUIRE(cstore->scan(ids, 1000, 1100, &ops) == AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(ops.size(), 2);
+        // Span of the column 10 is known after the first query
+        BOOST_REQUIRE_EQUAL(is_empty(ops.at(0)), i != 0);
+        BOOST_REQUIRE(!is_empty(ops.at(1)));
+        BOOST_REQUIRE_EQUAL(count_values(*ops.at(0)), 0);
+        BOOST_REQUIRE_EQUAL(count_values(*ops.at(1)), 100);
+    }
+    {
+        // Backward direction
+        std::vector<std::unique_ptr<RealValuedOperator>> ops;
+        BOOST_REQUIRE(cstore->scan(ids, 199, 0, &ops) == AKU_SUCCESS);
+        BOOST_REQUIRE(!is_empty(ops.at(0)));
+        BOOST_REQUIRE(is_empty(ops.at(1)));
+        BOOST_REQUIRE(ops.at(1)->get_direction() == RealValuedOperator::Direction::BACKWARD);
+        BOOST_REQUIRE_EQUAL(count_values(*ops.at(0)), 100);
+    }
+
+    // Column written after its span was recorded can't be pruned
+    session = create_session(cstore);
+    fill_data_in(cstore, session, 10, 2000, 2010);
+    {
+        std::vector<std::unique_ptr<RealValuedOperator>> ops;
+        BOOST_REQUIRE(cstore->scan(ids, 2000, 2100, &ops) == AKU_SUCCESS);
+        BOOST_REQUIRE(!is_empty(ops.at(0)));
+        BOOST_REQUIRE(is_empty(ops.at(1)));
+        BOOST_REQUIRE_EQUAL(count_values(*ops.at(0)), 10);
+    }
+    {
+        std::vector<std::unique_ptr<AggregateOperator>> ops;
+        BOOST_REQUIRE(cstore->group_aggregate(ids, 2000, 2100, 10, &ops) == AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(ops.size(), 2);
+        BOOST_REQUIRE(dynamic_cast<EmptyOperator<AggregationResult>*>(ops.at(1).get()) != nullptr);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_range_prefetcher_predict) {
+    typedef RangePrefetcher::Range Range;
+    Range next = {};
+    // Pan left
+    BOOST_REQUIRE(RangePrefetcher::predict({ 1000, 2000 }, { 0, 1000 }, &next) == false);
+    BOOST_REQUIRE(RangePrefetcher::predict({ 2000, 3000 }, { 1010, 2010 }, &next));
+    BOOST_REQUIRE_EQUAL(next.begin, 10);
+    BOOST_REQUIRE_EQUAL(next.end, 1010);
+    // Pan right
+    BOOST_REQUIRE(RangePrefetcher::predict({ 1000, 2000 }, { 2000, 3000 }, &next));
+    BOOST_REQUIRE_EQUAL(next.begin, 3000);
+    BOOST_REQUIRE_EQUAL(next.end, 4000);
+    // Zoom out
+    BOOST_REQUIRE(RangePrefetcher::predict({ 1000, 2000 }, { 500, 2500 }, &next));
+    BOOST_REQUIRE_EQUAL(next.begin, 0);
+    BOOST_REQUIRE_EQUAL(next.end, 3500);
+    // Same range, zoom in and unrelated ranges are not predicted
+    BOOST_REQUIRE(RangePrefetcher::predict({ 1000, 2000 }, { 1000, 2000 }, &next) == false);
+    BOOST_REQUIRE(RangePrefetcher::predict({ 500, 2500 }, { 1000, 2000 }, &next) == false);
+    BOOST_REQUIRE(RangePrefetcher::predict({ 1000, 2000 }, { 5000, 6000 }, &next) == false);
+}
+
+BOOST_AUTO_TEST_CASE(Test_range_prefetcher_load) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore));
+    auto session = create_session(cstore);
+    fill_data_in(cstore, session, 10, 100000, 200000);
+    auto columns = cstore->_get_columns();
+    auto column = columns.at(10);
+
+    RangePrefetcher prefetcher(16);
+    prefetcher.observe(10, 150000, 160000, column);
+    prefetcher.observe(10, 140000, 150000, column);
+    prefetcher.wait();
+    auto stats = prefetcher.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.observed, 2);
+    BOOST_REQUIRE_EQUAL(stats.scheduled, 1);
+    BOOST_REQUIRE(stats.loaded > 0);
+    BOOST_REQUIRE(stats.loaded <= 16);
+
+    // Range without data
+    prefetcher.observe(10, 0, 10000, column);
+    prefetcher.observe(10, 10000, 20000, column);
+    prefetcher.wait();
+    BOOST_REQUIRE_EQUAL(prefetcher.get_stats().loaded, stats.loaded);
+}
+
+BOOST_AUTO_TEST_CASE(Test_column_store_prefetch_pan) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore, {}, 0, 0, 0, 0, 16));
+    auto session = create_session(cstore);
+    fill_data_in(cstore, session, 10, 100000, 200000);
+    std::vector<aku_ParamId> ids = { 10 };
+    for (aku_Timestamp begin = 100000; begin < 200000; begin += 10000) {
+        std::vector<std::unique_ptr<RealValuedOperator>> ops;
+        BOOST_REQUIRE(cstore->scan(ids, begin, begin + 10000, &ops) == AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(count_values(*ops.at(0)), 10000);
+    }
+}
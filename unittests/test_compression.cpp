@@ -4,8 +4,11 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <limits>
+#include <cstring>
 
 #include "storage_engine/compression.h"
+#include "akumuli_version.h"
 
 
 using namespace Akumuli;
@@ -252,6 +255,84 @@ BOOST_AUTO_TEST_CASE(Test_chunked_delta_delta_vbyte_1) {
     }
 }
 
+/** Encode the same chunks into the large buffer (capacity is checked once per
+  * chunk and values are written without bounds checks) and into the buffer that
+  * fits the output exactly (the last chunks are written by the checked path).
+  * Output should be the same and one byte less should not be enough.
+  */
+template<class TVal, class TWriter, class TReader, class TWStream, class TRStream>
+void test_chunked_capacity(std::vector<TVal> const& input) {
+    const size_t step_size = 16;
+    BOOST_REQUIRE(input.size() % step_size == 0);
+    auto encode = [&](std::vector<unsigned char>* data) {
+        TWStream wstream(data->data(), data->data() + data->size());
+        TWriter writer(wstream);
+        for (size_t offset = 0; offset < input.size(); offset += step_size) {
+            if (!writer.tput(input.data() + offset, step_size)) {
+                return size_t(0);
+            }
+        }
+        return wstream.size();
+    };
+    std::vector<unsigned char> large(input.size()*32);
+    size_t size = encode(&large);
+    BOOST_REQUIRE(size != 0);
+
+    std::vector<unsigned char> exact(size);
+    BOOST_REQUIRE_EQUAL(encode(&exact), size);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(large.begin(), large.begin() + static_cast<long>(size),
+                                    exact.begin(), exact.end());
+
+    std::vector<unsigned char> small(size - 1);
+    BOOST_REQUIRE_EQUAL(encode(&small), 0u);
+
+    TRStream rstream(exact.data(), exact.data() + exact.size());
+    TReader reader(rstream);
+    std::vector<TVal> results;
+    for (size_t i = 0; i < input.size(); i++) {
+        results.push_back(reader.next());
+    }
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(input.begin(), input.end(),
+                                    results.begin(), results.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunked_capacity_delta_rle) {
+    std::vector<u64> input;
+    u64 value = 0;
+    for (u32 i = 0; i < 1600; i++) {
+        value += i % 100 == 0 ? 1ull << (i % 60) : static_cast<u64>(rand() % 4);
+        input.push_back(value);
+    }
+    test_chunked_capacity<u64, DeltaRLEWriter, DeltaRLEReader, Base128StreamWriter, Base128StreamReader>(input);
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunked_capacity_zigzag_delta_rle) {
+    std::vector<i64> input;
+    for (u32 i = 0; i < 1600; i++) {
+        switch (i % 7) {
+        case 0: input.push_back(std::numeric_limits<i64>::min()); break;
+        case 1: input.push_back(std::numeric_limits<i64>::max()); break;
+        default: input.push_back(static_cast<i64>(rand() % 1000) - 500); break;
+        }
+    }
+    test_chunked_capacity<i64, ZDeltaRLEWriter, ZDeltaRLEReader, Base128StreamWriter, Base128StreamReader>(input);
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunked_capacity_delta_delta) {
+    std::vector<u64> input64;
+    std::vector<u32> input32;
+    u64 value = 0;
+    for (u32 i = 0; i < 1600; i++) {
+        value += i % 50 == 0 ? 100000u : 1000u + static_cast<u64>(rand() % 3);
+        input64.push_back(value);
+        input32.push_back(static_cast<u32>(value));
+    }
+    test_chunked_capacity<u64, DeltaDeltaStreamWriter<16, u64>, DeltaDeltaStreamReader<16, u64>,
+                          VByteStreamWriter, VByteStreamReader>(input64);
+    test_chunked_capacity<u32, DeltaDeltaStreamWriter<16, u32>, DeltaDeltaStreamReader<16, u32>,
+                          VByteStreamWriter, VByteStreamReader>(input32);
+}
+
 BOOST_AUTO_TEST_CASE(Test_rle) {
     std::vector<unsigned char> data;
     data.resize(1000);
@@ -517,6 +598,31 @@ void test_block_compression(double start, unsigned N=10000, bool regullar=false)
                        ", actual: " << out_values.at(i));
         }
     }
+
+    // decompress in batches of different size
+    StorageEngine::DataBlockReader batch_reader(block.data(), size_used);
+    const std::vector<size_t> batch_sizes = { 1, 16, 7, 33, 100 };
+    std::vector<aku_Timestamp> batch_timestamps(nelem + 100, 0);
+    std::vector<double> batch_values(nelem + 100, 0);
+    size_t nread = 0;
+    for (size_t i = 0; nread < nelem; i++) {
+        size_t n;
+        std::tie(status, n) = batch_reader.read_batch(batch_timestamps.data() + nread,
+                                                      batch_values.data() + nread,
+                                                      batch_sizes.at(i % batch_sizes.size()));
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_NE(n, 0);
+        nread += n;
+    }
+    BOOST_REQUIRE_EQUAL(nread, nelem);
+    size_t n;
+    std::tie(status, n) = batch_reader.read_batch(batch_timestamps.data(), batch_values.data(), 16);
+    BOOST_REQUIRE_EQUAL(status, AKU_ENO_DATA);
+    BOOST_REQUIRE_EQUAL(n, 0);
+    for (size_t i = 0; i < nelem; i++) {
+        BOOST_REQUIRE_EQUAL(timestamps.at(i), batch_timestamps.at(i));
+        BOOST_REQUIRE_EQUAL(values.at(i), batch_values.at(i));
+    }
 }
 
 BOOST_AUTO_TEST_CASE(Test_block_compression_00) {
@@ -599,6 +705,310 @@ BOOST_AUTO_TEST_CASE(Test_block_compression_19) {
     test_block_compression(0, 0x111, true);
 }
 
+//! Fill block with values using codec and check that all values can be decoded, return number of stored values
+size_t test_block_codec(std::vector<double> const& values, ValueCodec codec) {
+    std::vector<u8> block;
+    block.resize(4096);
+    StorageEngine::DataBlockWriter writer(42, block.data(), static_cast<int>(block.size()), codec);
+    size_t nelements = 0;
+    for (auto value: values) {
+        aku_Status status = writer.put(static_cast<aku_Timestamp>(1000 + nelements * 10), value);
+        if (status == AKU_EOVERFLOW) {
+            break;
+        }
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        nelements++;
+    }
+    size_t size_used = writer.commit();
+
+    StorageEngine::DataBlockReader reader(block.data(), size_used);
+    BOOST_REQUIRE(reader.codec() == codec);
+    BOOST_REQUIRE_EQUAL(reader.version(), AKUMULI_VERSION);
+    BOOST_REQUIRE_EQUAL(reader.nelements(), nelements);
+    std::vector<aku_Timestamp> outts(nelements, 0);
+    std::vector<double> outxs(nelements, 0);
+    aku_Status status;
+    size_t outsize;
+    std::tie(status, outsize) = reader.read_batch(outts.data(), outxs.data(), nelements);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(outsize, nelements);
+    for (size_t i = 0; i < nelements; i++) {
+        BOOST_REQUIRE_EQUAL(outts.at(i), 1000 + i * 10);
+        // Compare bit patterns to check NaN and negative zero
+        u64 expected, actual;
+        memcpy(&expected, &values.at(i), sizeof(u64));
+        memcpy(&actual, &outxs.at(i), sizeof(u64));
+        if (expected != actual) {
+            BOOST_FAIL("Bad value at " << i << ", expected: " << values.at(i) << ", actual: " << outxs.at(i));
+        }
+    }
+    return nelements;
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_codec_counter) {
+    // Irregular integer counter
+    std::vector<double> values;
+    double acc = 0;
+    for (int i = 0; i < 10000; i++) {
+        acc += rand() % 100;
+        values.push_back(acc);
+    }
+    size_t nfcm = test_block_codec(values, ValueCodec::FCM);
+    size_t nadaptive = test_block_codec(values, ValueCodec::ADAPTIVE);
+    BOOST_TEST_MESSAGE("Counter, FCM: " << nfcm << " values, adaptive: " << nadaptive << " values");
+    BOOST_REQUIRE_GT(nadaptive, nfcm);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_codec_gauge) {
+    // Slowly changing gauge with long constant runs
+    std::vector<double> values;
+    double curr = 36.6;
+    for (int i = 0; i < 10000; i++) {
+        if (rand() % 40 == 0) {
+            curr += 0.1;
+        }
+        values.push_back(curr);
+    }
+    size_t nfcm = test_block_codec(values, ValueCodec::FCM);
+    size_t nadaptive = test_block_codec(values, ValueCodec::ADAPTIVE);
+    BOOST_TEST_MESSAGE("Gauge, FCM: " << nfcm << " values, adaptive: " << nadaptive << " values");
+    BOOST_REQUIRE_GE(nadaptive, nfcm);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_codec_mixed) {
+    // Integers, fractions and special values in the same block
+    std::vector<double> values;
+    RandomWalk rwalk(0, 1., .11);
+    for (int i = 0; i < 10000; i++) {
+        switch ((i / 16) % 5) {
+        case 0:
+            values.push_back(static_cast<double>(i - 100));
+            break;
+        case 1:
+            values.push_back(rwalk.generate());
+            break;
+        case 2:
+            values.push_back(42.0);
+            break;
+        case 3:
+            values.push_back(i % 3 == 0 ? -0.0 : i % 3 == 1 ? std::numeric_limits<double>::quiet_NaN() : 1E300);
+            break;
+        case 4:
+            values.push_back(i % 2 ? 9007199254740992.0 : -9007199254740992.0);
+            break;
+        };
+    }
+    test_block_codec(values, ValueCodec::FCM);
+    test_block_codec(values, ValueCodec::ADAPTIVE);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_codec_quantized) {
+    // Noisy sensor values rounded to two digits
+    std::vector<double> noisy, rounded;
+    RandomWalk rwalk(20.0, .01, .1);
+    for (int i = 0; i < 10000; i++) {
+        double value = rwalk.generate();
+        noisy.push_back(value);
+        rounded.push_back(quantize_value(value, 2));
+    }
+    BOOST_REQUIRE_EQUAL(quantize_value(21.374, 2), 21.37);
+    BOOST_REQUIRE_EQUAL(quantize_value(-0.005, 2), -0.01);
+    BOOST_REQUIRE_EQUAL(quantize_value(1E300, 2), 1E300);
+    size_t nnoisy = test_block_codec(noisy, ValueCodec::ADAPTIVE);
+    size_t nrounded = test_block_codec(rounded, ValueCodec::ADAPTIVE);
+    BOOST_TEST_MESSAGE("Quantized, noisy: " << nnoisy << " values, rounded: " << nrounded << " values");
+    BOOST_REQUIRE_GT(nrounded, 2*nnoisy);
+}
+
+//! Fill block with timestamps (constant value), check that they can be decoded, return number of stored values
+size_t test_block_timestamps(std::vector<aku_Timestamp> const& timestamps) {
+    std::vector<u8> block;
+    block.resize(4096);
+    StorageEngine::DataBlockWriter writer(42, block.data(), static_cast<int>(block.size()));
+    size_t nelements = writer.put_range(timestamps.data(), std::vector<double>(timestamps.size(), 1.0).data(),
+                                        timestamps.size());
+    size_t size_used = writer.commit();
+
+    StorageEngine::DataBlockReader reader(block.data(), size_used);
+    BOOST_REQUIRE_EQUAL(reader.nelements(), nelements);
+    for (size_t i = 0; i < nelements; i++) {
+        aku_Status status;
+        aku_Timestamp ts;
+        double value;
+        std::tie(status, ts, value) = reader.next();
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(ts, timestamps.at(i));
+        BOOST_REQUIRE_EQUAL(value, 1.0);
+    }
+    return nelements;
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_regular_timestamps) {
+    // Fixed interval
+    std::vector<aku_Timestamp> regular;
+    for (u64 i = 0; i < 100000; i++) {
+        regular.push_back(1500000000000000000ull + i * 1000000000ull);
+    }
+    // Fixed interval with gaps and jittered parts
+    std::vector<aku_Timestamp> mixed;
+    aku_Timestamp ts = 1500000000000000000ull;
+    for (u64 i = 0; i < 100000; i++) {
+        ts += 1000000000ull;
+        if (i % 1000 == 0) {
+            ts += 60000000000ull;
+        } else if ((i / 256) % 3 == 0) {
+            ts += static_cast<aku_Timestamp>(rand() % 1000);
+        }
+        mixed.push_back(ts);
+    }
+    // Irregular
+    std::vector<aku_Timestamp> irregular;
+    ts = 1500000000000000000ull;
+    for (u64 i = 0; i < 100000; i++) {
+        ts += 1000000000ull + static_cast<aku_Timestamp>(rand() % 1000);
+        irregular.push_back(ts);
+    }
+    size_t nregular = test_block_timestamps(regular);
+    size_t nmixed = test_block_timestamps(mixed);
+    size_t nirregular = test_block_timestamps(irregular);
+    BOOST_TEST_MESSAGE("Regular: " << nregular << ", mixed: " << nmixed << ", irregular: " << nirregular);
+    BOOST_REQUIRE_GT(nregular, nmixed);
+    BOOST_REQUIRE_GT(nmixed, nirregular);
+}
+
+BOOST_AUTO_TEST_CASE(Test_block_seek) {
+    for (auto codec: { ValueCodec::FCM, ValueCodec::ADAPTIVE }) {
+        std::vector<u8> block;
+        block.resize(4096);
+        StorageEngine::DataBlockWriter writer(42, block.data(), static_cast<int>(block.size()), codec);
+        RandomWalk rwalk(0, 1., .11);
+        std::vector<aku_Timestamp> expts;
+        std::vector<double> expxs;
+        aku_Timestamp ts = 1000;
+        while (true) {
+            ts += 1 + static_cast<aku_Timestamp>(rand() % 3 == 0 ? rand() % 100 : 0);
+            double value = expts.size() % 100 < 50 ? rwalk.generate() : 42.0;
+            if (writer.put(ts, value) != AKU_SUCCESS) {
+                break;
+            }
+            expts.push_back(ts);
+            expxs.push_back(value);
+        }
+        size_t size_used = writer.commit();
+        BOOST_REQUIRE_GT(expts.size(), 0x100);
+        for (size_t ix = 0; ix < expts.size(); ix += 7) {
+            StorageEngine::DataBlockReader reader(block.data(), size_used);
+            size_t skipped = reader.seek(expts.at(ix));
+            BOOST_REQUIRE_LE(skipped, ix);
+            BOOST_REQUIRE_EQUAL(skipped % StorageEngine::DataBlockReader::CHUNK_SIZE, 0);
+            if (ix > 0x100) {
+                // Directory has at least one entry per 1/8th of the block
+                BOOST_REQUIRE_GT(skipped, 0);
+            }
+            size_t nelements = reader.nelements() - skipped;
+            std::vector<aku_Timestamp> outts(nelements, 0);
+            std::vector<double> outxs(nelements, 0);
+            aku_Status status;
+            size_t outsize;
+            std::tie(status, outsize) = reader.read_batch(outts.data(), outxs.data(), nelements);
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(outsize, nelements);
+            BOOST_REQUIRE(std::equal(outts.begin(), outts.end(), expts.begin() + static_cast<long>(skipped)));
+            BOOST_REQUIRE(std::equal(outxs.begin(), outxs.end(), expxs.begin() + static_cast<long>(skipped)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_event_block) {
+    std::vector<std::string> states = { "deploy started", "deploy finished", "deploy failed",
+                                        "service restarted", "service stopped" };
+    std::vector<u8> block;
+    block.resize(4096);
+    StorageEngine::EventBlockWriter writer(42, block.data(), static_cast<int>(block.size()));
+    std::vector<aku_Timestamp> expts;
+    std::vector<std::string> expvals;
+    aku_Timestamp ts = 1000;
+    while (true) {
+        ts += 1 + static_cast<aku_Timestamp>(rand() % 10);
+        // Values are repeated and some are unique
+        std::string value = expts.size() % 10 == 0 ? "build " + std::to_string(expts.size())
+                                                   : states.at(expts.size() / 7 % states.size());
+        if (writer.put(ts, value.data(), static_cast<u32>(value.size())) != AKU_SUCCESS) {
+            break;
+        }
+        expts.push_back(ts);
+        expvals.push_back(value);
+    }
+    size_t size_used = writer.commit();
+    BOOST_REQUIRE_LE(size_used, block.size());
+    // Values are stored once
+    BOOST_REQUIRE_GT(expts.size(), 200);
+
+    StorageEngine::EventBlockReader reader(block.data(), size_used);
+    BOOST_REQUIRE_EQUAL(reader.get_id(), 42);
+    BOOST_REQUIRE_EQUAL(reader.nelements(), expts.size());
+    std::vector<aku_Timestamp> outts(expts.size(), 0);
+    std::vector<u32> outcodes(expts.size(), 0);
+    aku_Status status;
+    size_t outsize;
+    std::tie(status, outsize) = reader.read_batch(outts.data(), outcodes.data(), expts.size());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(outsize, expts.size());
+    BOOST_REQUIRE(std::equal(outts.begin(), outts.end(), expts.begin()));
+    for (size_t i = 0; i < expts.size(); i++) {
+        auto value = reader.lookup(outcodes[i]);
+        BOOST_REQUIRE(value != nullptr);
+        BOOST_REQUIRE_EQUAL(*value, expvals[i]);
+    }
+    // Codes are ordered the same way as values
+    for (u32 code = 1; code < reader.dictionary_size(); code++) {
+        BOOST_REQUIRE_LT(*reader.lookup(code - 1), *reader.lookup(code));
+    }
+    BOOST_REQUIRE(reader.lookup(static_cast<u32>(reader.dictionary_size())) == nullptr);
+    std::tie(status, ts, outcodes[0]) = reader.next();
+    BOOST_REQUIRE_EQUAL(status, AKU_ENO_DATA);
+}
+
+BOOST_AUTO_TEST_CASE(Test_histogram_block) {
+    std::vector<double> bounds = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0,
+                                   std::numeric_limits<double>::infinity() };
+    std::vector<u8> block;
+    block.resize(4096);
+    StorageEngine::HistogramBlockWriter writer(42, block.data(), static_cast<int>(block.size()), bounds);
+    std::vector<aku_Timestamp> expts;
+    std::vector<u64> expcounts;
+    std::vector<u64> counts(bounds.size(), 0);
+    aku_Timestamp ts = 1000;
+    while (true) {
+        ts += 10;
+        // Cumulative counters with steady rate and occasional reset
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] = expts.size() % 1000 == 999 ? 0 : counts[i] + (i < 6 ? 10 - i : 1) + (expts.size() % 50 == 0);
+        }
+        if (writer.put(ts, counts.data()) != AKU_SUCCESS) {
+            break;
+        }
+        expts.push_back(ts);
+        expcounts.insert(expcounts.end(), counts.begin(), counts.end());
+    }
+    size_t size_used = writer.commit();
+    BOOST_REQUIRE_LE(size_used, block.size());
+    BOOST_REQUIRE_GT(expts.size(), 1000);
+
+    StorageEngine::HistogramBlockReader reader(block.data(), size_used);
+    BOOST_REQUIRE_EQUAL(reader.get_id(), 42);
+    BOOST_REQUIRE_EQUAL(reader.nelements(), expts.size());
+    BOOST_REQUIRE_EQUAL(reader.nbuckets(), bounds.size());
+    BOOST_REQUIRE(reader.bounds() == bounds);
+    for (size_t i = 0; i < expts.size(); i++) {
+        aku_Timestamp outts;
+        BOOST_REQUIRE_EQUAL(reader.next(&outts, counts.data()), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(outts, expts[i]);
+        BOOST_REQUIRE(std::equal(counts.begin(), counts.end(), expcounts.begin() + i*bounds.size()));
+    }
+    BOOST_REQUIRE_EQUAL(reader.next(&ts, counts.data()), AKU_ENO_DATA);
+}
+
 void test_chunk_header_compression(double start) {
 
     UncompressedChunk expected;
@@ -135,3 +135,298 @@ BOOST_AUTO_TEST_CASE(Test_cursor_error_100_7)
     test_cursor_error(100, 7);
 }
 
+BOOST_AUTO_TEST_CASE(Test_cursor_read_batch) {
+    const u32 N = 10000;
+    ConcurrentCursor cursor;
+    auto generator = [N, &cursor]() {
+        for (u32 i = 0u; i < 2*N + 1; i++) {
+            union {
+                aku_Sample sample;
+                char buf[sizeof(aku_Sample) + sizeof(double)];
+            } r = {};
+            r.sample.paramid = i;
+            r.sample.timestamp = 2*i;
+            if (i == N) {
+                // Tuple in the middle of the scalars
+                r.sample.payload.type = AKU_PAYLOAD_TUPLE;
+                r.sample.payload.size = sizeof(r.buf);
+            } else {
+                r.sample.payload.float64 = i;
+                r.sample.payload.type = AKU_PAYLOAD_FLOAT;
+                r.sample.payload.size = sizeof(aku_Sample);
+            }
+            cursor.put(r.sample);
+        }
+        cursor.complete();
+    };
+    cursor.start(generator);
+    u32 next = 0;
+    while (true) {
+        aku_Batch batch;
+        auto status = cursor.read_batch(&batch);
+        if (status == AKU_EBAD_DATA) {
+            BOOST_REQUIRE_EQUAL(next, N);
+            char buf[sizeof(aku_Sample) + sizeof(double)];
+            BOOST_REQUIRE_EQUAL(cursor.read(buf, sizeof(buf)), sizeof(buf));
+            BOOST_REQUIRE_EQUAL(reinterpret_cast<aku_Sample*>(buf)->paramid, N);
+            next++;
+            continue;
+        }
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        if (batch.size == 0) {
+            break;
+        }
+        BOOST_REQUIRE(batch.size <= SampleColumns::BATCH_SIZE);
+        for (u32 i = 0; i < batch.size; i++, next++) {
+            BOOST_REQUIRE_EQUAL(batch.paramid[i], next);
+            BOOST_REQUIRE_EQUAL(batch.timestamp[i], 2*next);
+            BOOST_REQUIRE_EQUAL(batch.value[i], next);
+        }
+    }
+    BOOST_REQUIRE_EQUAL(next, 2*N + 1);
+    BOOST_REQUIRE(cursor.is_done());
+    cursor.close();
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_backpressure)
+{
+    // Producer should block when all buffers are full and
+    // should be stopped when reader closes the cursor.
+    const u32 NSAMPLES = 1000000;
+    const u32 MAX_BUFFERED = 0x20*0x4000/sizeof(aku_Sample);
+    ConcurrentCursor cursor;
+    std::atomic<u32> nwritten(0);
+    auto generator = [&]() {
+        for (u32 i = 0u; i < NSAMPLES; i++) {
+            aku_Sample r = {};
+            r.payload.float64 = i;
+            r.payload.type = AKU_PAYLOAD_FLOAT;
+            r.payload.size = sizeof(aku_Sample);
+            if (!cursor.put(r)) {
+                break;
+            }
+            nwritten++;
+        }
+        cursor.complete();
+    };
+    cursor.start(generator);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_REQUIRE_LE(nwritten.load(), MAX_BUFFERED);
+    aku_Sample sample;
+    BOOST_REQUIRE_EQUAL(cursor.read(&sample, sizeof(sample)), sizeof(sample));
+    BOOST_REQUIRE_EQUAL(sample.payload.float64, 0.0);
+    cursor.close();
+    BOOST_REQUIRE_LT(nwritten.load(), NSAMPLES);
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_read_nowait)
+{
+    // Non-blocking read returns samples that are ready without waiting
+    // until the buffer is full, and zero if nothing is ready
+    ConcurrentCursor cursor;
+    std::atomic<bool> proceed(false);
+    auto put = [&cursor](double value) {
+        aku_Sample r = {};
+        r.payload.float64 = value;
+        r.payload.type = AKU_PAYLOAD_FLOAT;
+        r.payload.size = sizeof(aku_Sample);
+        cursor.put(r);
+    };
+    auto generator = [&]() {
+        put(1.0);
+        while (!proceed) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        put(2.0);
+        cursor.complete();
+    };
+    cursor.start(generator);
+    aku_Sample samples[10];
+    u32 nbytes = 0;
+    while (nbytes == 0) {
+        nbytes = cursor.read_nowait(samples, sizeof(samples));
+    }
+    BOOST_REQUIRE_EQUAL(nbytes, sizeof(aku_Sample));
+    BOOST_REQUIRE_EQUAL(samples[0].payload.float64, 1.0);
+    BOOST_REQUIRE_EQUAL(cursor.read_nowait(samples, sizeof(samples)), 0);
+    BOOST_REQUIRE(!cursor.is_done());
+    proceed = true;
+    BOOST_REQUIRE_EQUAL(cursor.read(samples, sizeof(samples)), sizeof(aku_Sample));
+    BOOST_REQUIRE_EQUAL(samples[0].payload.float64, 2.0);
+    BOOST_REQUIRE(cursor.is_done());
+    cursor.close();
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_suspended_writers)
+{
+    // Writers of the full cursors are suspended and don't occupy the executor's
+    // threads, so the number of concurrent cursors can exceed the number of threads
+    const u32 NCURSORS = 4*std::max(8u, 2*std::thread::hardware_concurrency());
+    const u32 NSAMPLES = 2*0x20*0x4000/sizeof(aku_Sample);
+    std::vector<std::unique_ptr<ConcurrentCursor>> cursors;
+    for (u32 i = 0; i < NCURSORS; i++) {
+        cursors.emplace_back(new ConcurrentCursor());
+        auto cursor = cursors.back().get();
+        cursor->start([cursor, NSAMPLES]() {
+            for (u32 i = 0u; i < NSAMPLES; i++) {
+                aku_Sample r = {};
+                r.payload.float64 = i;
+                r.payload.type = AKU_PAYLOAD_FLOAT;
+                r.payload.size = sizeof(aku_Sample);
+                if (!cursor->put(r)) {
+                    break;
+                }
+            }
+            cursor->complete();
+        });
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (CursorExecutor::instance().get_stats().suspended < NCURSORS &&
+           std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    BOOST_REQUIRE_EQUAL(CursorExecutor::instance().get_stats().suspended, NCURSORS);
+    for (auto& cursor: cursors) {
+        u32 nread = 0;
+        std::vector<aku_Sample> buffer(1000);
+        while (!cursor->is_done()) {
+            auto size = cursor->read(buffer.data(), static_cast<u32>(buffer.size()*sizeof(aku_Sample)));
+            for (u32 i = 0; i < size/sizeof(aku_Sample); i++) {
+                BOOST_REQUIRE_EQUAL(buffer[i].payload.float64, nread);
+                nread++;
+            }
+        }
+        BOOST_REQUIRE_EQUAL(nread, NSAMPLES);
+        cursor->close();
+    }
+    BOOST_REQUIRE_EQUAL(CursorExecutor::instance().get_stats().suspended, 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_executor_queue)
+{
+    // One worker and room for one queued task
+    CursorExecutor executor(1, 1);
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool release = false;
+    std::atomic<int> nexecuted(0);
+    auto blocking_task = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!release) {
+            cond.wait(lock);
+        }
+        nexecuted++;
+    };
+    bool accepted;
+    CursorExecutor::TaskId id0, id1, id2;
+    std::tie(accepted, id0) = executor.submit(blocking_task);
+    BOOST_REQUIRE(accepted);
+    // Wait until the first task is started
+    while (executor.get_stats().running != 1) {
+        std::this_thread::yield();
+    }
+    std::tie(accepted, id1) = executor.submit([&]() { nexecuted++; });
+    BOOST_REQUIRE(accepted);
+    std::tie(accepted, id2) = executor.submit([&]() { nexecuted++; });
+    BOOST_REQUIRE(!accepted);
+    auto stats = executor.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.queued, 1);
+    BOOST_REQUIRE_EQUAL(stats.running, 1);
+    BOOST_REQUIRE_EQUAL(stats.rejected, 1);
+
+    // Queued task can be cancelled, running task can't
+    BOOST_REQUIRE(executor.cancel(id1));
+    BOOST_REQUIRE(!executor.cancel(id1));
+    BOOST_REQUIRE(!executor.cancel(id0));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+        cond.notify_all();
+    }
+    while (executor.get_stats().running != 0) {
+        std::this_thread::yield();
+    }
+    BOOST_REQUIRE_EQUAL(nexecuted.load(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_executor_priority)
+{
+    // Batch tasks can't take all workers
+    CursorExecutor executor(2, 64);
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool release = false;
+    auto blocking_task = [&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!release) {
+            cond.wait(lock);
+        }
+    };
+    bool accepted;
+    CursorExecutor::TaskId id;
+    std::tie(accepted, id) = executor.submit(blocking_task, CursorExecutor::Priority::BATCH);
+    BOOST_REQUIRE(accepted);
+    std::tie(accepted, id) = executor.submit(blocking_task, CursorExecutor::Priority::BATCH);
+    BOOST_REQUIRE(accepted);
+    while (executor.get_stats().running_batch != 1) {
+        std::this_thread::yield();
+    }
+    std::atomic<bool> interactive_done(false);
+    std::tie(accepted, id) = executor.submit([&]() { interactive_done = true; });
+    BOOST_REQUIRE(accepted);
+    while (!interactive_done) {
+        std::this_thread::yield();
+    }
+    auto stats = executor.get_stats();
+    BOOST_REQUIRE_EQUAL(stats.running_batch, 1);
+    BOOST_REQUIRE_EQUAL(stats.queued_batch, 1);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+        cond.notify_all();
+    }
+    while (executor.get_stats().running != 0 || executor.get_stats().queued != 0) {
+        std::this_thread::yield();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_cursor_executor_weighted_order)
+{
+    CursorExecutor executor(1, 64);
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool release = false;
+    bool accepted;
+    CursorExecutor::TaskId id;
+    std::tie(accepted, id) = executor.submit([&]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!release) {
+            cond.wait(lock);
+        }
+    });
+    BOOST_REQUIRE(accepted);
+    while (executor.get_stats().running != 1) {
+        std::this_thread::yield();
+    }
+    std::vector<char> order;  // only one worker, no need to synchronize
+    const int NBATCH = 2, NINTERACTIVE = 8;
+    for (int i = 0; i < NBATCH; i++) {
+        executor.submit([&]() { order.push_back('b'); }, CursorExecutor::Priority::BATCH);
+    }
+    for (int i = 0; i < NINTERACTIVE; i++) {
+        executor.submit([&]() { order.push_back('i'); });
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+        cond.notify_all();
+    }
+    while (executor.get_stats().running != 0 || executor.get_stats().queued != 0) {
+        std::this_thread::yield();
+    }
+    BOOST_REQUIRE_EQUAL(order.size(), NBATCH + NINTERACTIVE);
+    // Interactive tasks get four turns per one turn of the batch tasks
+    std::string actual(order.begin(), order.end());
+    BOOST_REQUIRE_EQUAL(actual, "biiiibiiii");
+}
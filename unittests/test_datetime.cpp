@@ -29,6 +29,51 @@ BOOST_AUTO_TEST_CASE(Test_string_iso_to_timestamp_conversion) {
 
 }
 
+//! Reference implementation (boost based)
+static aku_Timestamp boost_parse(const char* str) {
+    auto pt = boost::posix_time::from_iso_string(str);
+    return DateTimeUtil::from_boost_ptime(pt);
+}
+
+BOOST_AUTO_TEST_CASE(Test_string_iso_to_timestamp_fast_path) {
+    const char* inputs[] = {
+        "20060102T150405",
+        "20060102T150405.5",
+        "20060102T160000.000000001",
+        "20000229T235959.999999999",
+        "19700101T000000",
+        "21001231T230000.1",
+    };
+    for (auto str: inputs) {
+        BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string(str), boost_parse(str));
+        // Same hour is parsed twice, second time cached value is used
+        BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string(str), boost_parse(str));
+    }
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("20060102T150405,123"), 1136214245123000000ul);
+    // Dates are validated
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("20060230T150405"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("20061301T150405"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("2006010XT150405"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("20060102T150405Z"), BadDateTimeFormat);
+}
+
+BOOST_AUTO_TEST_CASE(Test_string_rfc3339_to_timestamp_conversion) {
+    const aku_Timestamp expected = 1136214245999999999ul;
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02T15:04:05.999999999Z"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02t15:04:05.999999999z"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02 15:04:05.999999999"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02T15:04:05.9999999999Z"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02T08:04:05.999999999-07:00"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-03T00:34:05.999999999+09:30"), expected);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02T15:04:05Z"), 1136214245000000000ul);
+    BOOST_REQUIRE_EQUAL(DateTimeUtil::from_iso_string("2006-01-02T15:04:05.5Z"), 1136214245500000000ul);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("2006-01-02T15:04:05.Z"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("2006-01-02T15:04:05+0700"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("2006-01-02T15-04-05Z"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("2006-02-30T15:04:05Z"), BadDateTimeFormat);
+    BOOST_REQUIRE_THROW(DateTimeUtil::from_iso_string("1970-01-01T00:00:00+01:00"), BadDateTimeFormat);
+}
+
 BOOST_AUTO_TEST_CASE(Test_string_to_duration_seconds) {
 
     const char* test_case = "10s";
@@ -0,0 +1,522 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+
+#include "http2_server.h"
+#include "signal_handler.h"
+#include "logger.h"
+
+#ifdef AKU_WITH_NGHTTP2
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <nghttp2/nghttp2.h>
+
+using namespace Akumuli;
+using namespace Akumuli::Http;
+
+
+static Logger logger_ = Logger("http2-server-test");
+
+/** Query cursor, response is the request body repeated `NREPEATS` times.
+  * Data is returned only when `nwait` cursors are started so the
+  * responses of the concurrent streams are sent at the same time.
+  */
+struct CursorMock : ReadOperation {
+    enum {
+        NREPEATS = 1000,
+    };
+    std::atomic<int>& nstarted;
+    const int         nwait;
+    std::string       query;
+    std::string       output;
+    size_t            pos;
+
+    CursorMock(std::atomic<int>& nstarted, int nwait)
+        : nstarted(nstarted)
+        , nwait(nwait)
+        , pos(0)
+    {
+    }
+
+    virtual void start() override {
+        if (query == "error") {
+            throw std::runtime_error("bad query");
+        }
+        nstarted++;
+        for (int i = 0; i < NREPEATS; i++) {
+            output += query + "\n";
+        }
+    }
+
+    virtual void append(const char* data, size_t data_size) override {
+        query.append(data, data_size);
+    }
+
+    virtual aku_Status get_error() override {
+        return AKU_SUCCESS;
+    }
+
+    virtual std::tuple<size_t, bool> read_some(char* buf, size_t buf_size) override {
+        if (nstarted.load() < nwait) {
+            return std::make_tuple(0u, false);
+        }
+        if (pos == output.size()) {
+            return std::make_tuple(0u, true);
+        }
+        // Small chunks, every stream is sent using many DATA frames
+        size_t sz = std::min(std::min(buf_size, output.size() - pos), static_cast<size_t>(0x100));
+        memcpy(buf, output.data() + pos, sz);
+        pos += sz;
+        return std::make_tuple(sz, false);
+    }
+
+    virtual void close() override {
+    }
+};
+
+struct QueryProcMock : ReadOperationBuilder {
+    std::atomic<int> nstarted;
+    int              nwait;
+
+    QueryProcMock(int nwait = 0)
+        : nstarted{0}
+        , nwait(nwait)
+    {
+    }
+
+    virtual ReadOperation* create(ApiEndpoint) override {
+        return new CursorMock(nstarted, nwait);
+    }
+
+    virtual ReadOperation* create_tenant(ApiEndpoint, std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_all_stats() override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_metrics() override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_resource(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::tuple<aku_Status, u64> prepare(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual ReadOperation* create_execute(u64) override {
+        // Prepared queries are not known
+        return nullptr;
+    }
+};
+
+const int PORT = 14098;
+
+static int connect_to_server() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<u16>(PORT));
+    BOOST_REQUIRE_EQUAL(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+//! Wait until the server closes the connection, returns false on timeout
+static bool wait_for_close(int fd) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        char buf[0x1000];
+        auto nread = recv(fd, buf, sizeof(buf), 0);
+        if (nread <= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** HTTP/2 client, uses nghttp2 client session to encode the requests (HPACK) and
+  * decode the responses.
+  */
+struct Http2Client {
+    struct Response {
+        std::string                        request_body;
+        size_t                             request_pos;
+        int                                status;
+        std::map<std::string, std::string> headers;
+        std::string                        body;
+        bool                               closed;
+        u32                                error_code;
+    };
+
+    int                                         fd;
+    nghttp2_session*                            session;
+    std::map<i32, std::unique_ptr<Response>>    responses;
+    //! Stream ids of the received DATA frames in the order of arrival
+    std::vector<i32>                            frames;
+    //! Output of the nghttp2 session
+    std::vector<u8>                             output;
+    //! Max size of the socket write (0 - unlimited)
+    size_t                                      write_size;
+    //! Max size of the request DATA frame (0 - unlimited)
+    size_t                                      data_size;
+
+    Http2Client()
+        : fd(connect_to_server())
+        , session(nullptr)
+        , write_size(0)
+        , data_size(0)
+    {
+        nghttp2_session_callbacks* callbacks;
+        BOOST_REQUIRE_EQUAL(nghttp2_session_callbacks_new(&callbacks), 0);
+        nghttp2_session_callbacks_set_send_callback(callbacks, &on_send);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, &on_header);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &on_data_chunk_recv);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &on_stream_close);
+        int ret = nghttp2_session_client_new(&session, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+        BOOST_REQUIRE_EQUAL(ret, 0);
+        BOOST_REQUIRE_EQUAL(nghttp2_submit_settings(session, NGHTTP2_FLAG_NONE, nullptr, 0), 0);
+    }
+
+    ~Http2Client() {
+        nghttp2_session_del(session);
+        ::close(fd);
+    }
+
+    static ssize_t on_send(nghttp2_session*, const u8* data, size_t length, int, void* user_data) {
+        auto client = static_cast<Http2Client*>(user_data);
+        client->output.insert(client->output.end(), data, data + length);
+        return static_cast<ssize_t>(length);
+    }
+
+    static int on_header(nghttp2_session*, const nghttp2_frame* frame, const u8* name, size_t namelen,
+                         const u8* value, size_t valuelen, u8, void* user_data)
+    {
+        auto client = static_cast<Http2Client*>(user_data);
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_RESPONSE) {
+            return 0;
+        }
+        auto it = client->responses.find(frame->hd.stream_id);
+        if (it == client->responses.end()) {
+            return 0;
+        }
+        std::string key(reinterpret_cast<const char*>(name), namelen);
+        std::string val(reinterpret_cast<const char*>(value), valuelen);
+        if (key == ":status") {
+            it->second->status = std::stoi(val);
+        } else {
+            it->second->headers[key] = val;
+        }
+        return 0;
+    }
+
+    static int on_data_chunk_recv(nghttp2_session*, u8, i32 stream_id, const u8* data, size_t len, void* user_data) {
+        auto client = static_cast<Http2Client*>(user_data);
+        auto it = client->responses.find(stream_id);
+        if (it != client->responses.end()) {
+            it->second->body.append(reinterpret_cast<const char*>(data), len);
+            client->frames.push_back(stream_id);
+        }
+        return 0;
+    }
+
+    static int on_stream_close(nghttp2_session*, i32 stream_id, u32 error_code, void* user_data) {
+        auto client = static_cast<Http2Client*>(user_data);
+        auto it = client->responses.find(stream_id);
+        if (it != client->responses.end()) {
+            it->second->closed = true;
+            it->second->error_code = error_code;
+        }
+        return 0;
+    }
+
+    static ssize_t read_body(nghttp2_session*, i32, u8* buf, size_t length, u32* data_flags,
+                             nghttp2_data_source* source, void* user_data)
+    {
+        auto client = static_cast<Http2Client*>(user_data);
+        auto response = static_cast<Response*>(source->ptr);
+        size_t sz = std::min(length, response->request_body.size() - response->request_pos);
+        if (client->data_size != 0) {
+            sz = std::min(sz, client->data_size);
+        }
+        memcpy(buf, response->request_body.data() + response->request_pos, sz);
+        response->request_pos += sz;
+        if (response->request_pos == response->request_body.size()) {
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+        }
+        return static_cast<ssize_t>(sz);
+    }
+
+    //! Submit the request, returns stream id
+    i32 submit(std::string method, std::string path, std::string body,
+               std::vector<std::pair<std::string, std::string>> headers = {})
+    {
+        std::unique_ptr<Response> response(new Response());
+        response->request_body = std::move(body);
+        response->request_pos = 0;
+        response->status = 0;
+        response->closed = false;
+        response->error_code = 0;
+        std::string scheme = "http";
+        std::string authority = "localhost";
+        headers.insert(headers.begin(), {
+            { ":method", method },
+            { ":path", path },
+            { ":scheme", scheme },
+            { ":authority", authority },
+        });
+        std::vector<nghttp2_nv> nva;
+        for (auto const& kv: headers) {
+            nghttp2_nv nv = {
+                reinterpret_cast<u8*>(const_cast<char*>(kv.first.data())),
+                reinterpret_cast<u8*>(const_cast<char*>(kv.second.data())),
+                kv.first.size(),
+                kv.second.size(),
+                NGHTTP2_NV_FLAG_NONE,
+            };
+            nva.push_back(nv);
+        }
+        nghttp2_data_provider provider;
+        provider.source.ptr = response.get();
+        provider.read_callback = &read_body;
+        bool has_body = !response->request_body.empty();
+        i32 id = nghttp2_submit_request(session, nullptr, nva.data(), nva.size(), has_body ? &provider : nullptr, nullptr);
+        BOOST_REQUIRE(id > 0);
+        responses[id] = std::move(response);
+        return id;
+    }
+
+    //! Write the session output to the socket
+    void write_output() {
+        size_t pos = 0;
+        while (pos < output.size()) {
+            size_t sz = output.size() - pos;
+            if (write_size != 0) {
+                sz = std::min(sz, write_size);
+            }
+            auto nsent = ::send(fd, output.data() + pos, sz, MSG_NOSIGNAL);
+            BOOST_REQUIRE(nsent > 0);
+            pos += static_cast<size_t>(nsent);
+            if (write_size != 0) {
+                // Every piece is received by the server separately
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        output.clear();
+    }
+
+    bool all_closed() const {
+        for (auto const& kv: responses) {
+            if (!kv.second->closed) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //! Send requests and receive responses until all streams are closed
+    void run() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < deadline) {
+            BOOST_REQUIRE_EQUAL(nghttp2_session_send(session), 0);
+            write_output();
+            if (all_closed()) {
+                return;
+            }
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            u8 buf[0x4000];
+            auto nread = recv(fd, buf, sizeof(buf), 0);
+            BOOST_REQUIRE(nread > 0);
+            auto ret = nghttp2_session_mem_recv(session, buf, static_cast<size_t>(nread));
+            BOOST_REQUIRE_EQUAL(ret, nread);
+        }
+        BOOST_FAIL("HTTP/2 streams are not closed");
+    }
+
+    Response const& get(i32 id) const {
+        return *responses.at(id);
+    }
+};
+
+struct Http2ServerTestSuite {
+    std::shared_ptr<QueryProcMock> proc;
+    std::shared_ptr<Http2Server>   serv;
+    SignalHandler                  sig;
+
+    Http2ServerTestSuite(int nwait = 0, HttpSettings const& settings = HttpSettings()) {
+        proc = std::make_shared<QueryProcMock>(nwait);
+        serv = std::make_shared<Http2Server>(PORT, proc, 1, 100, settings);
+        serv->start(&sig, 0);
+    }
+
+    ~Http2ServerTestSuite() {
+        logger_.info() << "Clean up suite resources";
+        // Stop the server the same way the signal does
+        for (auto const& handler: sig.handlers_) {
+            handler.first();
+        }
+    }
+};
+
+static std::string expected_body(std::string const& query) {
+    std::string result;
+    for (int i = 0; i < CursorMock::NREPEATS; i++) {
+        result += query + "\n";
+    }
+    return result;
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_query) {
+
+    Http2ServerTestSuite suite;
+    Http2Client client;
+
+    // Url parameters are ignored
+    auto id = client.submit("POST", "/api/query?format=csv", "select cpu");
+    client.run();
+
+    auto const& response = client.get(id);
+    BOOST_REQUIRE_EQUAL(response.error_code, 0u);
+    BOOST_REQUIRE_EQUAL(response.status, 200);
+    BOOST_REQUIRE(response.headers.count("content-encoding") == 0);
+    BOOST_REQUIRE(response.body == expected_body("select cpu"));
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_invalid_request) {
+
+    Http2ServerTestSuite suite;
+    Http2Client client;
+
+    auto get = client.submit("GET", "/api/query", "");
+    auto unknown = client.submit("POST", "/api/unknown", "select cpu");
+    auto execute = client.submit("POST", "/api/execute/42", "{}");
+    auto error = client.submit("POST", "/api/query", "error");
+    client.run();
+
+    BOOST_REQUIRE_EQUAL(client.get(get).status, 404);
+    BOOST_REQUIRE_EQUAL(client.get(get).body, "-Invalid url /api/query\r\n");
+    BOOST_REQUIRE_EQUAL(client.get(unknown).status, 404);
+    BOOST_REQUIRE_EQUAL(client.get(unknown).body, "-Invalid url /api/unknown\r\n");
+    BOOST_REQUIRE_EQUAL(client.get(execute).status, 404);
+    BOOST_REQUIRE_EQUAL(client.get(execute).body, "-Unknown prepared query /api/execute/42\r\n");
+    // Cursor start error
+    BOOST_REQUIRE_EQUAL(client.get(error).status, 400);
+    BOOST_REQUIRE_EQUAL(client.get(error).body, "-bad query\r\n");
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_accept_encoding) {
+
+    HttpSettings settings;
+    settings.gzip = true;
+    Http2ServerTestSuite suite(0, settings);
+    Http2Client client;
+
+    auto plain = client.submit("POST", "/api/query", "select cpu");
+    auto gzip = client.submit("POST", "/api/query", "select cpu", { { "accept-encoding", "deflate, gzip" } });
+    client.run();
+
+    BOOST_REQUIRE_EQUAL(client.get(plain).status, 200);
+    BOOST_REQUIRE(client.get(plain).headers.count("content-encoding") == 0);
+    BOOST_REQUIRE(client.get(plain).body == expected_body("select cpu"));
+
+    BOOST_REQUIRE_EQUAL(client.get(gzip).status, 200);
+    BOOST_REQUIRE_EQUAL(client.get(gzip).headers.at("content-encoding"), "gzip");
+    // Repeated query is compressed well
+    BOOST_REQUIRE(client.get(gzip).body.size() < expected_body("select cpu").size()/10);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_fragmented_frames) {
+
+    Http2ServerTestSuite suite;
+    Http2Client client;
+
+    // Frames are received by the server in small pieces, request body is
+    // split between several DATA frames
+    client.write_size = 5;
+    client.data_size = 3;
+    auto id = client.submit("POST", "/api/query", "select cpu where host=a");
+    client.run();
+
+    BOOST_REQUIRE_EQUAL(client.get(id).status, 200);
+    BOOST_REQUIRE(client.get(id).body == expected_body("select cpu where host=a"));
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_interleaved_streams) {
+
+    // Cursors don't return data until both queries are started
+    Http2ServerTestSuite suite(2);
+    Http2Client client;
+
+    auto first = client.submit("POST", "/api/query", "select cpu");
+    auto second = client.submit("POST", "/api/query", "select mem");
+    client.run();
+
+    BOOST_REQUIRE_EQUAL(client.get(first).error_code, 0u);
+    BOOST_REQUIRE_EQUAL(client.get(first).status, 200);
+    BOOST_REQUIRE(client.get(first).body == expected_body("select cpu"));
+    BOOST_REQUIRE_EQUAL(client.get(second).error_code, 0u);
+    BOOST_REQUIRE_EQUAL(client.get(second).status, 200);
+    BOOST_REQUIRE(client.get(second).body == expected_body("select mem"));
+
+    // DATA frames of the streams are interleaved on the connection
+    size_t nswitches = 0;
+    for (size_t i = 1; i < client.frames.size(); i++) {
+        if (client.frames.at(i) != client.frames.at(i - 1)) {
+            nswitches++;
+        }
+    }
+    BOOST_REQUIRE(nswitches > 1);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_http2_server_protocol_error) {
+
+    Http2ServerTestSuite suite;
+
+    // HTTP/1.1 request instead of the connection preface
+    int fd = connect_to_server();
+    std::string request = "POST /api/query HTTP/1.1\r\nHost: localhost\r\nContent-Length: 0\r\n\r\n";
+    BOOST_REQUIRE_EQUAL(::send(fd, request.data(), request.size(), MSG_NOSIGNAL), static_cast<ssize_t>(request.size()));
+    BOOST_REQUIRE(wait_for_close(fd));
+    ::close(fd);
+
+    // Server still works
+    Http2Client client;
+    auto id = client.submit("POST", "/api/query", "select cpu");
+    client.run();
+    BOOST_REQUIRE_EQUAL(client.get(id).status, 200);
+}
+
+#endif
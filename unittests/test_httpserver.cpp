@@ -0,0 +1,447 @@
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include "httpserver.h"
+#include "signal_handler.h"
+#include "logger.h"
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef AKU_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace Akumuli;
+using namespace Akumuli::Http;
+
+
+static Logger logger_ = Logger("http-server-test");
+
+//! Session that stores the written samples, series names are mapped to ids in order of appearance
+struct SessionMock : DbSession {
+    std::mutex                         mutex;
+    std::map<std::string, aku_ParamId> index;
+    std::vector<aku_ParamId>           param_;
+    std::vector<aku_Timestamp>         ts_;
+    std::vector<double>                data_;
+
+    aku_ParamId get_id(std::string const& name) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = index.find(name);
+        if (it == index.end()) {
+            it = index.insert(std::make_pair(name, static_cast<aku_ParamId>(index.size() + 1))).first;
+        }
+        return it->second;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return param_.size();
+    }
+
+    virtual aku_Status write(const aku_Sample &sample) override {
+        std::lock_guard<std::mutex> guard(mutex);
+        param_.push_back(sample.paramid);
+        ts_.push_back(sample.timestamp);
+        data_.push_back(sample.payload.float64);
+        return AKU_SUCCESS;
+    }
+
+    virtual std::shared_ptr<DbCursor> query(std::string) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> suggest(std::string) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> search(std::string) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "Not implemented";
+    }
+
+    virtual int param_id_to_series(aku_ParamId, char*, size_t) override {
+        throw "Not implemented";
+    }
+
+    virtual aku_Status series_to_param_id(const char* begin, size_t sz, aku_Sample* sample) override {
+        std::string name(begin, begin + sz);
+        boost::algorithm::trim(name);
+        sample->paramid = get_id(name);
+        return AKU_SUCCESS;
+    }
+
+    virtual int name_to_param_id_list(const char* begin, const char* end, aku_ParamId* ids, u32 cap) override {
+        std::string name(begin, end);
+        auto space = name.find(' ');
+        if (space == std::string::npos || cap == 0) {
+            return -1;
+        }
+        // Only single metric names are used in the tests
+        ids[0] = get_id(name);
+        return 1;
+    }
+};
+
+struct ConnectionMock : DbConnection {
+    std::shared_ptr<SessionMock> session;
+
+    ConnectionMock()
+        : session(std::make_shared<SessionMock>())
+    {
+    }
+
+    virtual std::string get_all_stats() override {
+        throw "Not implemented";
+    }
+
+    virtual std::string get_metrics() override {
+        throw "Not implemented";
+    }
+
+    virtual std::shared_ptr<DbSession> create_session() override {
+        return session;
+    }
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string) override {
+        return std::shared_ptr<DbSession>();
+    }
+};
+
+struct QueryProcMock : ReadOperationBuilder {
+    virtual ReadOperation* create(ApiEndpoint) override {
+        throw "not implemented";
+    }
+
+    virtual ReadOperation* create_tenant(ApiEndpoint, std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_all_stats() override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_metrics() override {
+        throw "not implemented";
+    }
+
+    virtual std::string get_resource(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::tuple<aku_Status, u64> prepare(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual ReadOperation* create_execute(u64) override {
+        return nullptr;
+    }
+};
+
+const int PORT = 14099;
+
+struct HttpServerTestSuite {
+    std::shared_ptr<ConnectionMock> db;
+    std::shared_ptr<HttpServer>     serv;
+    SignalHandler                   sig;
+
+    HttpServerTestSuite() {
+        db = std::make_shared<ConnectionMock>();
+        serv = std::make_shared<HttpServer>(PORT, std::make_shared<QueryProcMock>(), db);
+        serv->start(&sig, 0);
+    }
+
+    ~HttpServerTestSuite() {
+        logger_.info() << "Clean up suite resources";
+        // Stop the server the same way the signal does
+        for (auto const& handler: sig.handlers_) {
+            handler.first();
+        }
+    }
+};
+
+struct HttpResponse {
+    int         status;
+    std::string body;
+};
+
+/** Send HTTP/1.1 POST request and read the response (the connection is closed
+  * by the server after the response).
+  */
+static HttpResponse http_post(std::string const& url, std::string const& body, std::string const& encoding = "") {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE(fd >= 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<u16>(PORT));
+    BOOST_REQUIRE_EQUAL(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+
+    std::string request = "POST " + url + " HTTP/1.1\r\n"
+                          "Host: localhost\r\n"
+                          "Connection: close\r\n"
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    if (!encoding.empty()) {
+        request += "Content-Encoding: " + encoding + "\r\n";
+    }
+    request += "\r\n" + body;
+    size_t pos = 0;
+    while (pos < request.size()) {
+        auto nsent = ::send(fd, request.data() + pos, request.size() - pos, MSG_NOSIGNAL);
+        BOOST_REQUIRE(nsent > 0);
+        pos += static_cast<size_t>(nsent);
+    }
+
+    std::string response;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        char buf[0x1000];
+        auto nread = recv(fd, buf, sizeof(buf), 0);
+        if (nread <= 0) {
+            break;
+        }
+        response.append(buf, static_cast<size_t>(nread));
+    }
+    ::close(fd);
+
+    HttpResponse result = {};
+    // Status line: HTTP/1.1 200 OK
+    auto space = response.find(' ');
+    BOOST_REQUIRE(space != std::string::npos);
+    result.status = std::stoi(response.substr(space + 1, 3));
+    auto hdrend = response.find("\r\n\r\n");
+    if (hdrend != std::string::npos) {
+        result.body = response.substr(hdrend + 4);
+    }
+    return result;
+}
+
+//! Compress the data, `window_bits` defines the header (15 - zlib, 15 + 16 - gzip)
+static std::string zlib_compress(std::string const& data, int window_bits) {
+    z_stream zstream = {};
+    BOOST_REQUIRE_EQUAL(deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY), Z_OK);
+    std::string result(deflateBound(&zstream, static_cast<uLong>(data.size())), '\0');
+    zstream.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zstream.avail_in  = static_cast<uInt>(data.size());
+    zstream.next_out  = reinterpret_cast<Bytef*>(&result[0]);
+    zstream.avail_out = static_cast<uInt>(result.size());
+    BOOST_REQUIRE_EQUAL(deflate(&zstream, Z_FINISH), Z_STREAM_END);
+    result.resize(zstream.total_out);
+    deflateEnd(&zstream);
+    return result;
+}
+
+static std::string gzip_compress(std::string const& data) {
+    return zlib_compress(data, 15 + 16);
+}
+
+static std::string deflate_compress(std::string const& data) {
+    return zlib_compress(data, 15);
+}
+
+#ifdef AKU_WITH_ZSTD
+static std::string zstd_compress(std::string const& data) {
+    std::string result(ZSTD_compressBound(data.size()), '\0');
+    size_t size = ZSTD_compress(&result[0], result.size(), data.data(), data.size(), 19);
+    BOOST_REQUIRE(!ZSTD_isError(size));
+    result.resize(size);
+    return result;
+}
+#endif
+
+/** RESP body with `n` samples. Body is highly compressible so a small compressed
+  * chunk is decompressed into many output buffers.
+  */
+static std::string resp_body(int n) {
+    std::string result;
+    for (int i = 0; i < n; i++) {
+        result += "+test tag=A\r\n:" + std::to_string(i % 10) + "\r\n+1.5\r\n";
+    }
+    return result;
+}
+
+static void check_resp_samples(SessionMock& session, int n) {
+    BOOST_REQUIRE_EQUAL(session.size(), static_cast<size_t>(n));
+    for (int i = 0; i < n; i++) {
+        BOOST_REQUIRE_EQUAL(session.param_.at(i), session.index.at("test tag=A"));
+        BOOST_REQUIRE_EQUAL(session.ts_.at(i), static_cast<aku_Timestamp>(i % 10));
+        BOOST_REQUIRE_EQUAL(session.data_.at(i), 1.5);
+    }
+}
+
+static const int NSAMPLES = 100000;
+
+//! Write compressed body using WriteOperation directly, data is passed in chunks of `chunk_size` bytes
+static std::tuple<std::string, bool> write_body(std::shared_ptr<SessionMock> session,
+                                                WriteOperation::Encoding encoding,
+                                                std::string const& body,
+                                                size_t chunk_size)
+{
+    WriteOperation op(session, WriteOperation::Format::RESP, encoding);
+    for (size_t pos = 0; pos < body.size(); pos += chunk_size) {
+        op.append(body.data() + pos, std::min(chunk_size, body.size() - pos));
+    }
+    op.finish();
+    return op.get_error();
+}
+
+static void test_write_operation(WriteOperation::Encoding encoding, std::string const& compressed) {
+    // The whole body in one chunk, compressed chunk is decompressed into many output buffers
+    for (size_t chunk_size: { compressed.size(), static_cast<size_t>(1000), static_cast<size_t>(1) }) {
+        auto session = std::make_shared<SessionMock>();
+        auto err = write_body(session, encoding, compressed, chunk_size);
+        BOOST_REQUIRE_EQUAL(std::get<0>(err), "");
+        check_resp_samples(*session, NSAMPLES);
+    }
+    // Truncated stream
+    auto session = std::make_shared<SessionMock>();
+    auto err = write_body(session, encoding, compressed.substr(0, compressed.size() / 2), compressed.size());
+    BOOST_REQUIRE(std::get<0>(err).find("compressed stream is truncated") != std::string::npos);
+    BOOST_REQUIRE(!std::get<1>(err));
+}
+
+BOOST_AUTO_TEST_CASE(Test_write_operation_gzip) {
+    test_write_operation(WriteOperation::Encoding::GZIP, gzip_compress(resp_body(NSAMPLES)));
+}
+
+BOOST_AUTO_TEST_CASE(Test_write_operation_deflate) {
+    test_write_operation(WriteOperation::Encoding::GZIP, deflate_compress(resp_body(NSAMPLES)));
+}
+
+#ifdef AKU_WITH_ZSTD
+BOOST_AUTO_TEST_CASE(Test_write_operation_zstd) {
+    test_write_operation(WriteOperation::Encoding::ZSTD, zstd_compress(resp_body(NSAMPLES)));
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(Test_write_operation_invalid_stream) {
+    auto session = std::make_shared<SessionMock>();
+    std::string garbage(1000, 'x');
+    auto err = write_body(session, WriteOperation::Encoding::GZIP, garbage, garbage.size());
+    BOOST_REQUIRE(std::get<0>(err).find("invalid gzip stream") != std::string::npos);
+    BOOST_REQUIRE_EQUAL(session->size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_write_operation_names) {
+    WriteOperation::Format format;
+    BOOST_REQUIRE(WriteOperation::get_format("resp", &format));
+    BOOST_REQUIRE(format == WriteOperation::Format::RESP);
+    BOOST_REQUIRE(WriteOperation::get_format("influx", &format));
+    BOOST_REQUIRE(format == WriteOperation::Format::INFLUX);
+    BOOST_REQUIRE(WriteOperation::get_format("graphite", &format));
+    BOOST_REQUIRE(format == WriteOperation::Format::GRAPHITE);
+    BOOST_REQUIRE(!WriteOperation::get_format("opentsdb", &format));
+
+    WriteOperation::Encoding encoding;
+    BOOST_REQUIRE(WriteOperation::get_encoding("identity", &encoding));
+    BOOST_REQUIRE(encoding == WriteOperation::Encoding::IDENTITY);
+    for (auto name: { "gzip", "x-gzip", "deflate" }) {
+        BOOST_REQUIRE(WriteOperation::get_encoding(name, &encoding));
+        BOOST_REQUIRE(encoding == WriteOperation::Encoding::GZIP);
+    }
+#ifdef AKU_WITH_ZSTD
+    BOOST_REQUIRE(WriteOperation::get_encoding("zstd", &encoding));
+    BOOST_REQUIRE(encoding == WriteOperation::Encoding::ZSTD);
+#endif
+    BOOST_REQUIRE(!WriteOperation::get_encoding("br", &encoding));
+}
+
+BOOST_AUTO_TEST_CASE(Test_http_write_compressed) {
+
+    HttpServerTestSuite suite;
+    std::string body = resp_body(NSAMPLES);
+    std::vector<std::pair<std::string, std::string>> requests = {
+        { "",        body },
+        { "gzip",    gzip_compress(body) },
+        { "deflate", deflate_compress(body) },
+#ifdef AKU_WITH_ZSTD
+        { "zstd",    zstd_compress(body) },
+#endif
+    };
+    for (auto const& req: requests) {
+        suite.db->session = std::make_shared<SessionMock>();
+        auto resp = http_post("/api/write", req.second, req.first);
+        BOOST_REQUIRE_EQUAL(resp.status, 200);
+        BOOST_REQUIRE_EQUAL(resp.body, "+OK\r\n");
+        check_resp_samples(*suite.db->session, NSAMPLES);
+    }
+
+    // Truncated body is rejected
+    auto compressed = gzip_compress(body);
+    auto resp = http_post("/api/write", compressed.substr(0, compressed.size() / 2), "gzip");
+    BOOST_REQUIRE_EQUAL(resp.status, 400);
+
+    // Unsupported encoding
+    resp = http_post("/api/write", body, "br");
+    BOOST_REQUIRE_EQUAL(resp.status, 415);
+}
+
+BOOST_AUTO_TEST_CASE(Test_http_write_format) {
+
+    HttpServerTestSuite suite;
+
+    std::string influx =
+        "cpu,host=A user=8.11 1418197423000000000\n"
+        "cpu,host=A user=9.5 1418197425000000000\n";
+    auto resp = http_post("/api/write?format=influx", gzip_compress(influx), "gzip");
+    BOOST_REQUIRE_EQUAL(resp.status, 200);
+    auto session = suite.db->session;
+    BOOST_REQUIRE_EQUAL(session->size(), 2);
+    BOOST_REQUIRE_EQUAL(session->param_.at(0), session->index.at("cpu.user host=A"));
+    BOOST_REQUIRE_EQUAL(session->param_.at(1), session->param_.at(0));
+    BOOST_REQUIRE_EQUAL(session->ts_.at(0), 1418197423000000000ul);
+    BOOST_REQUIRE_EQUAL(session->data_.at(1), 9.5);
+
+    suite.db->session = std::make_shared<SessionMock>();
+    std::string graphite =
+        "servers.A.cpu 8.11 1418197423\n"
+        "servers.A.cpu 9.5 1418197425\n";
+    resp = http_post("/api/write?format=graphite", graphite);
+    BOOST_REQUIRE_EQUAL(resp.status, 200);
+    session = suite.db->session;
+    BOOST_REQUIRE_EQUAL(session->size(), 2);
+    BOOST_REQUIRE_EQUAL(session->param_.at(0), session->index.at("servers.A.cpu source=graphite"));
+    BOOST_REQUIRE_EQUAL(session->ts_.at(1), 1418197425000000000ul);
+    BOOST_REQUIRE_EQUAL(session->data_.at(0), 8.11);
+
+    // RESP body with the wrong format is a parse error
+    suite.db->session = std::make_shared<SessionMock>();
+    resp = http_post("/api/write?format=influx", resp_body(10));
+    BOOST_REQUIRE_EQUAL(resp.status, 400);
+
+    // Unknown format
+    resp = http_post("/api/write?format=opentsdb", graphite);
+    BOOST_REQUIRE_EQUAL(resp.status, 400);
+    BOOST_REQUIRE_EQUAL(suite.db->session->size(), 0);
+}
@@ -7,6 +7,9 @@
 
 #include <apr.h>
 #include <queue>
+#include <atomic>
+#include <thread>
+#include <algorithm>
 #include <fstream>
 #include <stdlib.h>
 
@@ -16,6 +19,7 @@
 #include "storage_engine/nbtree.h"
 #include "log_iface.h"
 #include "status_util.h"
+#include "metrics.h"
 
 void test_logger(aku_LogLevel tag, const char* msg) {
     AKU_UNUSED(tag);
@@ -120,6 +124,73 @@ BOOST_AUTO_TEST_CASE(Test_nbtree_rc_append_6) {
     test_nbtree_roots_collection(200000, 199999, 0);
 }
 
+void test_nbtree_append_range(u32 N, u32 max_range) {
+    std::shared_ptr<BlockStore> bstore_a = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<BlockStore> bstore_b = BlockStoreBuilder::create_memstore();
+    std::vector<LogicAddr> addrlist;  // should be empty at first
+    auto expected = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore_a);
+    expected->force_init();
+    auto actual = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore_b);
+    actual->force_init();
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    for (u32 i = 0; i < N; i++) {
+        tss.push_back(1000 + i);
+        xss.push_back(static_cast<double>(rand() % 1000) / 10.0);
+        expected->append(tss.back(), xss.back());
+    }
+    u32 ix = 0;
+    while (ix < N) {
+        u32 size = std::min(N - ix, 1 + static_cast<u32>(rand()) % max_range);
+        auto res = actual->append_range(tss.data() + ix, xss.data() + ix, size);
+        BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+        ix += size;
+    }
+    // Bulk append should produce the same tree
+    auto expected_roots = expected->get_roots();
+    auto actual_roots = actual->get_roots();
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(expected_roots.begin(), expected_roots.end(),
+                                    actual_roots.begin(), actual_roots.end());
+
+    // Out of order data shouldn't be written
+    aku_Timestamp late[] = { 2000 + N, 1999 + N };
+    double values[] = { 1.0, 2.0 };
+    BOOST_REQUIRE(actual->append_range(late, values, 2) == NBTreeAppendResult::FAIL_LATE_WRITE);
+    BOOST_REQUIRE(actual->append_range(late + 1, values, 1) == NBTreeAppendResult::OK);
+    BOOST_REQUIRE(actual->append_range(late, values, 1) == NBTreeAppendResult::OK);
+    BOOST_REQUIRE(actual->append_range(late + 1, values, 1) == NBTreeAppendResult::FAIL_LATE_WRITE);
+
+    // Read data back
+    std::unique_ptr<RealValuedOperator> it = actual->search(0, 3000 + N);
+    std::vector<aku_Timestamp> outts(N + 2, 0);
+    std::vector<double> outxs(N + 2, 0);
+    aku_Status status;
+    size_t sz;
+    std::tie(status, sz) = it->read(outts.data(), outxs.data(), N + 2);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(sz, N + 2);
+    for (u32 i = 0; i < N; i++) {
+        if (outts[i] != tss[i] || outxs[i] != xss[i]) {
+            BOOST_REQUIRE_EQUAL(outts[i], tss[i]);
+            BOOST_REQUIRE_EQUAL(outxs[i], xss[i]);
+        }
+    }
+    BOOST_REQUIRE_EQUAL(outts[N], late[1]);
+    BOOST_REQUIRE_EQUAL(outts[N + 1], late[0]);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_append_range_1) {
+    test_nbtree_append_range(100, 10);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_append_range_2) {
+    test_nbtree_append_range(200000, 100);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_append_range_3) {
+    test_nbtree_append_range(200000, 10000);
+}
+
 BOOST_AUTO_TEST_CASE(Test_nbtree_rc_append_rand_read) {
     for (int i = 0; i < 100; i++) {
         auto N = static_cast<u32>(rand()) % 200000u;
@@ -645,6 +716,106 @@ BOOST_AUTO_TEST_CASE(Test_nbtree_leaf_iteration_8) {
     test_nbtree_leaf_iteration(500, 200);
 }
 
+BOOST_AUTO_TEST_CASE(Test_nbtree_leaf_read_until) {
+    auto bstore = BlockStoreBuilder::create_memstore();
+    NBTreeLeaf leaf(42, EMPTY_ADDR, 0);
+    aku_Timestamp ts = 100;
+    while (leaf.append(ts, static_cast<double>(ts)) == AKU_SUCCESS) {
+        ts++;
+    }
+    aku_Status status;
+    LogicAddr addr;
+    std::tie(status, addr) = leaf.commit(bstore);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    NBTreeLeaf committed(bstore, addr);
+    std::vector<aku_Timestamp> all_ts;
+    std::vector<double> all_xs;
+    BOOST_REQUIRE_EQUAL(committed.read_all(&all_ts, &all_xs), AKU_SUCCESS);
+    for (aku_Timestamp max: { 0ul, 100ul, 115ul, 116ul, 300ul, ts - 2, ts + 10 }) {
+        std::vector<aku_Timestamp> tss;
+        std::vector<double> xss;
+        BOOST_REQUIRE_EQUAL(committed.read_until(max, &tss, &xss), AKU_SUCCESS);
+        BOOST_REQUIRE(!tss.empty());
+        BOOST_REQUIRE(std::equal(tss.begin(), tss.end(), all_ts.begin()));
+        auto expected = std::upper_bound(all_ts.begin(), all_ts.end(), max) - all_ts.begin();
+        BOOST_REQUIRE_GE(tss.size(), static_cast<size_t>(expected));
+        // Only the chunk that contains `max` is decoded past the range
+        BOOST_REQUIRE_LE(tss.size(), static_cast<size_t>(expected) + DataBlockReader::CHUNK_SIZE);
+    }
+    for (aku_Timestamp min: { 0ul, 100ul, 300ul, ts - 200, ts - 2, ts + 10 }) {
+        std::vector<aku_Timestamp> tss;
+        std::vector<double> xss;
+        BOOST_REQUIRE_EQUAL(committed.read_range(min, ts + 10, &tss, &xss), AKU_SUCCESS);
+        BOOST_REQUIRE(!tss.empty());
+        // Output is a suffix of the leaf that starts before `min`
+        BOOST_REQUIRE(std::equal(tss.begin(), tss.end(), all_ts.end() - static_cast<long>(tss.size())));
+        BOOST_REQUIRE(std::equal(xss.begin(), xss.end(), all_xs.end() - static_cast<long>(xss.size())));
+        BOOST_REQUIRE(tss.front() <= std::max(min, all_ts.front()));
+        if (min > all_ts.front() + 256) {
+            // Some chunks are skipped
+            BOOST_REQUIRE_LT(tss.size(), all_ts.size());
+        }
+    }
+    // Partial ranges in both directions
+    for (auto range: { std::make_pair(150ul, 400ul), std::make_pair(400ul, 150ul) }) {
+        auto it = committed.aggregate(range.first, range.second);
+        aku_Timestamp outts;
+        AggregationResult outxs;
+        size_t size;
+        std::tie(status, size) = it->read(&outts, &outxs, 1);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(size, 1);
+        BOOST_REQUIRE_EQUAL(outxs.cnt, 250);
+        BOOST_REQUIRE_EQUAL(outxs.min, range.first < range.second ? 150 : 151);
+        BOOST_REQUIRE_EQUAL(outxs.max, range.first < range.second ? 399 : 400);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_leaf_compact_buffer) {
+    auto bstore = BlockStoreBuilder::create_memstore();
+    NBTreeLeaf leaf(42, EMPTY_ADDR, 0);
+    size_t compact_size = leaf._get_buffer_size();
+    BOOST_REQUIRE_LT(compact_size, static_cast<size_t>(AKU_BLOCK_SIZE));
+    // Values are kept in the write buffer until the first chunk can be compressed
+    aku_Timestamp ts = 100;
+    for (; ts < 100 + DataBlockWriter::CHUNK_SIZE - 1; ts++) {
+        BOOST_REQUIRE_EQUAL(leaf.append(ts, static_cast<double>(ts)), AKU_SUCCESS);
+    }
+    BOOST_REQUIRE_EQUAL(leaf._get_buffer_size(), compact_size);
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    BOOST_REQUIRE_EQUAL(leaf.read_all(&tss, &xss), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(tss.size(), DataBlockWriter::CHUNK_SIZE - 1);
+    BOOST_REQUIRE_EQUAL(leaf.append(ts, static_cast<double>(ts)), AKU_SUCCESS);
+    ts++;
+    BOOST_REQUIRE_EQUAL(leaf._get_buffer_size(), static_cast<size_t>(AKU_BLOCK_SIZE));
+    while (ts < 1000) {
+        BOOST_REQUIRE_EQUAL(leaf.append(ts, static_cast<double>(ts)), AKU_SUCCESS);
+        ts++;
+    }
+    // Small leaf is expanded on commit
+    NBTreeLeaf small(43, EMPTY_ADDR, 0);
+    std::vector<aku_Timestamp> smallts = { 1, 2, 3 };
+    std::vector<double> smallxs = { 1.0, 2.0, 3.0 };
+    BOOST_REQUIRE_EQUAL(small.append_range(smallts.data(), smallxs.data(), smallts.size()), smallts.size());
+    BOOST_REQUIRE_EQUAL(small._get_buffer_size(), compact_size);
+    for (NBTreeLeaf* node: { &leaf, &small }) {
+        std::vector<aku_Timestamp> expts;
+        std::vector<double> expxs;
+        BOOST_REQUIRE_EQUAL(node->read_all(&expts, &expxs), AKU_SUCCESS);
+        aku_Status status;
+        LogicAddr addr;
+        std::tie(status, addr) = node->commit(bstore);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        NBTreeLeaf committed(bstore, addr);
+        std::vector<aku_Timestamp> actts;
+        std::vector<double> actxs;
+        BOOST_REQUIRE_EQUAL(committed.read_all(&actts, &actxs), AKU_SUCCESS);
+        BOOST_REQUIRE(expts == actts);
+        BOOST_REQUIRE(expxs == actxs);
+    }
+}
+
 // Test aggregation
 
 //! Generate time-series from random walk
@@ -991,9 +1162,308 @@ BOOST_AUTO_TEST_CASE(Test_nbtree_recovery_with_retention_1) {
     }
 }
 
+//! Memstore that counts reads of the deleted blocks
+struct CountingMemStore : MemStore {
+    size_t nexpired = 0;
+    size_t nreads = 0;
+
+    virtual std::tuple<aku_Status, std::shared_ptr<Block>> read_block(LogicAddr addr) override {
+        nreads++;
+        auto res = MemStore::read_block(addr);
+        if (std::get<0>(res) == AKU_EUNAVAILABLE) {
+            nexpired++;
+        }
+        return res;
+    }
+};
+
+void test_nbtree_retention_pruning(aku_Timestamp N, size_t nremoved) {
+    auto mstore = std::make_shared<CountingMemStore>();
+    std::shared_ptr<BlockStore> bstore = mstore;
+    std::vector<LogicAddr> empty;
+    auto extents = std::make_shared<NBTreeExtentsList>(42, empty, bstore);
+    extents->force_init();
+    for (aku_Timestamp ts = 0; ts < N; ts++) {
+        extents->append(ts, static_cast<double>(ts));
+    }
+    mstore->remove(nremoved);
+
+    for (auto range: { std::make_pair(aku_Timestamp(0), N), std::make_pair(N, aku_Timestamp(0)) }) {
+        mstore->nexpired = 0;
+        auto it = extents->search(range.first, range.second);
+        std::vector<aku_Timestamp> tss(N, 0);
+        std::vector<double> xss(N, 0);
+        aku_Status status;
+        size_t outsz;
+        std::tie(status, outsz) = it->read(tss.data(), xss.data(), N);
+        BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+        BOOST_REQUIRE(outsz < N);
+        // Deleted subtrees shouldn't be read
+        BOOST_REQUIRE_EQUAL(mstore->nexpired, 0);
+    }
+
+    mstore->nexpired = 0;
+    auto it = extents->aggregate(0, N);
+    aku_Timestamp ts;
+    AggregationResult res;
+    size_t outsz;
+    aku_Status status;
+    std::tie(status, outsz) = it->read(&ts, &res, 1);
+    BOOST_REQUIRE_EQUAL(outsz, 1);
+    BOOST_REQUIRE(res.cnt < N);
+    BOOST_REQUIRE_EQUAL(mstore->nexpired, 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_retention_pruning) {
+    test_nbtree_retention_pruning(100000, 10);
+    test_nbtree_retention_pruning(100000, 100);
+    test_nbtree_retention_pruning(1000000, 1000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_read_last) {
+    const u32 N = 100000;
+    auto mstore = std::make_shared<CountingMemStore>();
+    std::shared_ptr<BlockStore> bstore = mstore;
+    std::vector<LogicAddr> empty;
+    auto extents = std::make_shared<NBTreeExtentsList>(42, empty, bstore);
+    extents->force_init();
+
+    aku_Status status;
+    aku_Timestamp ts;
+    double xs;
+    std::tie(status, ts, xs) = extents->read_last();
+    BOOST_REQUIRE_EQUAL(status, AKU_ENO_DATA);
+
+    for (u32 i = 1; i <= N; i++) {
+        extents->append(i, i * 0.5);
+        if (i % 1000 == 0) {
+            // Latest value is maintained on write
+            mstore->nreads = 0;
+            std::tie(status, ts, xs) = extents->read_last();
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(ts, i);
+            BOOST_REQUIRE_EQUAL(xs, i * 0.5);
+            BOOST_REQUIRE_EQUAL(mstore->nreads, 0);
+        }
+    }
+
+    // Reopened tree reads the latest value from the block store only once
+    auto addrlist = extents->close();
+    extents = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    extents->force_init();
+    std::tie(status, ts, xs) = extents->read_last();
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(ts, N);
+    BOOST_REQUIRE_EQUAL(xs, N * 0.5);
+    mstore->nreads = 0;
+    std::tie(status, ts, xs) = extents->read_last();
+    BOOST_REQUIRE_EQUAL(ts, N);
+    BOOST_REQUIRE_EQUAL(mstore->nreads, 0);
+
+    // Tree opened with the last value from the checkpoint doesn't search for it
+    BOOST_REQUIRE(extents->get_last_value(&ts, &xs));
+    addrlist = extents->close();
+    extents = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    mstore->nreads = 0;
+    extents->force_init();
+    auto nreads = mstore->nreads;
+    extents->close();
+    extents = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    extents->set_last_value(ts, xs);
+    mstore->nreads = 0;
+    extents->force_init();
+    BOOST_REQUIRE_LT(mstore->nreads, nreads);
+    BOOST_REQUIRE_EQUAL(extents->get_last_timestamp(), N);
+    std::tie(status, ts, xs) = extents->read_last();
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(ts, N);
+    BOOST_REQUIRE_EQUAL(xs, N * 0.5);
+    BOOST_REQUIRE_LT(mstore->nreads, nreads);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_group_aggregate_uses_metadata) {
+    const aku_Timestamp N = 200000;
+    const u64 step = 2000;
+    auto mstore = std::make_shared<CountingMemStore>();
+    std::shared_ptr<BlockStore> bstore = mstore;
+    std::vector<LogicAddr> empty;
+    auto extents = std::make_shared<NBTreeExtentsList>(42, empty, bstore);
+    extents->force_init();
+    // Random values don't compress well so every bucket spans many leafs
+    RandomWalk rwalk(0.0, 1.0, 1.0);
+    for (aku_Timestamp ts = 0; ts < N; ts++) {
+        extents->append(ts, rwalk.next());
+    }
+    auto addrs = extents->close();
+    auto reopened = std::make_shared<NBTreeExtentsList>(42, addrs, bstore);
+    reopened->force_init();
+    for (auto range: { std::make_pair(aku_Timestamp(0), N), std::make_pair(N, aku_Timestamp(0)) }) {
+        mstore->nreads = 0;
+        auto it = reopened->group_aggregate(range.first, range.second, step);
+        std::vector<aku_Timestamp> tss(N / step + 1, 0);
+        std::vector<AggregationResult> xss(N / step + 1, INIT_AGGRES);
+        aku_Status status;
+        size_t outsz;
+        std::tie(status, outsz) = it->read(tss.data(), xss.data(), tss.size());
+        BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+        BOOST_REQUIRE_EQUAL(outsz, N / step);
+        double total = 0;
+        for (size_t i = 0; i < outsz; i++) {
+            total += xss[i].cnt;
+        }
+        // Backward range (N, 0] doesn't include the first value
+        BOOST_REQUIRE_EQUAL(total, range.first < range.second ? N : N - 1);
+        // Only leafs that cross the bucket boundary are read (plus superblocks)
+        BOOST_REQUIRE_LT(mstore->nreads, N / step * 2);
+    }
+}
+
+//! Read all values from the operator
+static void read_all(RealValuedOperator& it, std::vector<aku_Timestamp>* ts, std::vector<double>* xs) {
+    const size_t SZBUF = 0x1000;
+    std::vector<aku_Timestamp> outts(SZBUF, 0);
+    std::vector<double> outxs(SZBUF, 0);
+    aku_Status status = AKU_SUCCESS;
+    size_t size = 0;
+    while (status == AKU_SUCCESS) {
+        std::tie(status, size) = it.read(outts.data(), outxs.data(), SZBUF);
+        BOOST_REQUIRE(status == AKU_SUCCESS || status == AKU_ENO_DATA);
+        ts->insert(ts->end(), outts.begin(), outts.begin() + static_cast<long>(size));
+        xs->insert(xs->end(), outxs.begin(), outxs.begin() + static_cast<long>(size));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_filter) {
+    const aku_Timestamp N = 200000;
+    auto mstore = std::make_shared<CountingMemStore>();
+    std::shared_ptr<BlockStore> bstore = mstore;
+    std::vector<LogicAddr> empty;
+    auto extents = std::make_shared<NBTreeExtentsList>(42, empty, bstore);
+    extents->force_init();
+    // Values grow with time so most of the subtrees can be skipped by the filter
+    for (aku_Timestamp ts = 0; ts < N; ts++) {
+        extents->append(ts, static_cast<double>(ts) / 10.0);
+    }
+    auto addrs = extents->close();
+    auto reopened = std::make_shared<NBTreeExtentsList>(42, addrs, bstore);
+    reopened->force_init();
+    ValueFilter filter;
+    filter.add(ValueFilter::Op::GT, 5000.0).add(ValueFilter::Op::LE, 6000.0);
+    for (auto range: { std::make_pair(aku_Timestamp(0), N), std::make_pair(N, aku_Timestamp(0)) }) {
+        std::vector<aku_Timestamp> expts, actts;
+        std::vector<double> expxs, actxs;
+        mstore->nreads = 0;
+        auto scan = reopened->search(range.first, range.second);
+        read_all(*scan, &expts, &expxs);
+        size_t nscan = mstore->nreads;
+        size_t ix = 0;
+        for (size_t i = 0; i < expxs.size(); i++) {
+            if (filter.match(expxs[i])) {
+                expts[ix] = expts[i];
+                expxs[ix] = expxs[i];
+                ix++;
+            }
+        }
+        expts.resize(ix);
+        expxs.resize(ix);
+        BOOST_REQUIRE_EQUAL(ix, 10000);
+
+        mstore->nreads = 0;
+        auto it = reopened->filter(range.first, range.second, filter);
+        read_all(*it, &actts, &actxs);
+        BOOST_REQUIRE_EQUAL(actts.size(), expts.size());
+        for (size_t i = 0; i < actts.size(); i++) {
+            BOOST_REQUIRE_EQUAL(actts[i], expts[i]);
+            BOOST_REQUIRE_EQUAL(actxs[i], expxs[i]);
+        }
+        BOOST_REQUIRE_LT(mstore->nreads * 4, nscan);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_search_limit) {
+    const aku_Timestamp N = 200000;
+    auto mstore = std::make_shared<CountingMemStore>();
+    std::shared_ptr<BlockStore> bstore = mstore;
+    std::vector<LogicAddr> empty;
+    auto extents = std::make_shared<NBTreeExtentsList>(42, empty, bstore);
+    extents->force_init();
+    for (aku_Timestamp ts = 0; ts < N; ts++) {
+        extents->append(ts, static_cast<double>(ts));
+    }
+    // Last values are kept in memory
+    auto addrs = extents->close();
+    auto reopened = std::make_shared<NBTreeExtentsList>(42, addrs, bstore);
+    reopened->force_init();
+    for (aku_Timestamp ts = N; ts < N + 1000; ts++) {
+        reopened->append(ts, static_cast<double>(ts));
+    }
+    const aku_Timestamp M = N + 1000;
+    std::vector<std::pair<u64, u64>> limits = {
+        { 0, 100 }, { 150000, 100 }, { 100000, 150000 }, { 190000, 0 }, { M - 10, 100 },
+    };
+    for (auto range: { std::make_pair(aku_Timestamp(10), M), std::make_pair(M, aku_Timestamp(10)) }) {
+        std::vector<aku_Timestamp> allts;
+        std::vector<double> allxs;
+        mstore->nreads = 0;
+        auto scan = reopened->search(range.first, range.second);
+        read_all(*scan, &allts, &allxs);
+        size_t nscan = mstore->nreads;
+        for (auto lim: limits) {
+            auto limit = std::make_shared<ScanLimit>();
+            limit->offset = lim.first;
+            limit->limit = lim.second == 0 ? std::numeric_limits<u64>::max() : lim.second;
+            mstore->nreads = 0;
+            std::vector<aku_Timestamp> ts;
+            std::vector<double> xs;
+            auto it = reopened->search(range.first, range.second, limit);
+            read_all(*it, &ts, &xs);
+            size_t first = std::min(allts.size(), static_cast<size_t>(lim.first));
+            size_t last = lim.second == 0 ? allts.size() : std::min(allts.size(), first + lim.second);
+            BOOST_REQUIRE_EQUAL(ts.size(), last - first);
+            for (size_t i = 0; i < ts.size(); i++) {
+                BOOST_REQUIRE_EQUAL(ts[i], allts[first + i]);
+                BOOST_REQUIRE_EQUAL(xs[i], allxs[first + i]);
+            }
+            // Subtrees that fit into the offset or are after the limit are not read
+            size_t nread = last - first;
+            if (nread < allts.size() / 4) {
+                BOOST_REQUIRE_LT(mstore->nreads * 2, nscan);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_search_shared_limit) {
+    // Limit is applied to the concatenation of two trees
+    auto bstore = BlockStoreBuilder::create_memstore();
+    std::vector<LogicAddr> empty;
+    std::vector<std::shared_ptr<NBTreeExtentsList>> trees;
+    for (aku_ParamId id: { 1, 2 }) {
+        trees.push_back(std::make_shared<NBTreeExtentsList>(id, empty, bstore));
+        trees.back()->force_init();
+        for (aku_Timestamp ts = 0; ts < 10000; ts++) {
+            trees.back()->append(ts, static_cast<double>(id));
+        }
+    }
+    auto limit = std::make_shared<ScanLimit>();
+    limit->offset = 9000;
+    limit->limit = 2000;
+    std::vector<aku_Timestamp> ts;
+    std::vector<double> xs;
+    for (auto const& tree: trees) {
+        auto it = tree->search(0, 10000, limit);
+        read_all(*it, &ts, &xs);
+    }
+    BOOST_REQUIRE_EQUAL(ts.size(), 2000);
+    BOOST_REQUIRE_EQUAL(ts.front(), 9000);
+    BOOST_REQUIRE_EQUAL(xs.front(), 1.0);
+    BOOST_REQUIRE_EQUAL(ts.back(), 999);
+    BOOST_REQUIRE_EQUAL(xs.back(), 2.0);
+    BOOST_REQUIRE_EQUAL(limit->limit, 0);
+}
 
 void test_nbtree_superblock_candlesticks(size_t commit_limit, aku_Timestamp delta) {
-    // Build this tree structure.
     aku_Timestamp begin = 1000;
     aku_Timestamp end = begin;
     size_t ncommits = 0;
@@ -1005,28 +1475,57 @@ void test_nbtree_superblock_candlesticks(size_t commit_limit, aku_Timestamp delt
     std::shared_ptr<NBTreeExtentsList> extents(new NBTreeExtentsList(42, empty, bstore));
     extents->force_init();
     RandomWalk rwalk(1.0, 0.1, 0.1);
-    while(ncommits < AKU_NBTREE_FANOUT*AKU_NBTREE_FANOUT) {  // we should build three levels
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    while(ncommits < commit_limit) {
         double value = rwalk.next();
         aku_Timestamp ts = end++;
         extents->append(ts, value);
+        tss.push_back(ts);
+        xss.push_back(value);
     }
 
-    // Check actual output
     NBTreeCandlestickHint hint;
     hint.min_delta = delta;
     auto it = extents->candlesticks(begin, end, hint);
-    aku_Status status;
-    size_t size = 1000;
-    std::vector<aku_Timestamp> destts(size, 0);
-    std::vector<AggregationResult> destxs(size, INIT_AGGRES);
-    std::tie(status, size) = it->read(destts.data(), destxs.data(), size);
-    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-
-    for(size_t i = 1; i < size; i++) {
-        AggregationResult prev, curr;
-        prev = destxs[i - 1];
-        curr = destxs[i];
-        BOOST_REQUIRE_CLOSE(prev.last, curr.first, 10e-5);
+    std::vector<aku_Timestamp> destts;
+    std::vector<AggregationResult> destxs;
+    aku_Status status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        size_t size = 1000;
+        std::vector<aku_Timestamp> outts(size, 0);
+        std::vector<AggregationResult> outxs(size, INIT_AGGRES);
+        std::tie(status, size) = it->read(outts.data(), outxs.data(), size);
+        destts.insert(destts.end(), outts.begin(), outts.begin() + static_cast<long>(size));
+        destxs.insert(destxs.end(), outxs.begin(), outxs.begin() + static_cast<long>(size));
+    }
+    BOOST_REQUIRE_EQUAL(status, AKU_ENO_DATA);
+    BOOST_REQUIRE(!destxs.empty());
+
+    // Candlesticks should cover all values, shouldn't overlap and shouldn't be coarser than `delta`
+    double count = 0;
+    for (size_t i = 0; i < destxs.size(); i++) {
+        auto const& curr = destxs[i];
+        BOOST_REQUIRE_EQUAL(destts[i], curr._begin);
+        BOOST_REQUIRE(curr._end - curr._begin < delta);
+        if (i > 0) {
+            BOOST_REQUIRE(destxs[i - 1]._end < curr._begin);
+        }
+        auto lo = std::lower_bound(tss.begin(), tss.end(), curr._begin) - tss.begin();
+        auto hi = std::upper_bound(tss.begin(), tss.end(), curr._end) - tss.begin();
+        BOOST_REQUIRE_EQUAL(curr.cnt, static_cast<double>(hi - lo));
+        BOOST_REQUIRE_EQUAL(curr.first, xss.at(static_cast<size_t>(lo)));
+        BOOST_REQUIRE_EQUAL(curr.last, xss.at(static_cast<size_t>(hi - 1)));
+        auto minmax = std::minmax_element(xss.begin() + lo, xss.begin() + hi);
+        BOOST_REQUIRE_EQUAL(curr.min, *minmax.first);
+        BOOST_REQUIRE_EQUAL(curr.max, *minmax.second);
+        count += curr.cnt;
+    }
+    BOOST_REQUIRE_EQUAL(count, static_cast<double>(tss.size()));
+    if (delta > tss.size() / ncommits) {
+        // Large candlesticks are built from subtree refs, at most one per committed node
+        // plus the ones from the leaf node that is not committed yet
+        BOOST_REQUIRE(destxs.size() <= ncommits + 1);
     }
 }
 
@@ -1135,6 +1634,308 @@ BOOST_AUTO_TEST_CASE(Test_reopen_late_write) {
     BOOST_REQUIRE(status == NBTreeAppendResult::FAIL_LATE_WRITE);
 }
 
+BOOST_AUTO_TEST_CASE(Test_nbtree_reorder_window) {
+    const u32 N = 10000;
+    const u32 W = 16;
+    std::vector<LogicAddr> addrlist;
+    std::shared_ptr<BlockStore> bstore =
+        BlockStoreBuilder::create_memstore();
+
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->set_reorder_window(W);
+    collection->force_init();
+
+    // Every value is displaced by less than the window size
+    std::vector<aku_Timestamp> tss;
+    for (u32 i = 0; i < N; i += W/2) {
+        for (u32 j = W/2; j --> 0;) {
+            tss.push_back(1000 + i + j);
+        }
+    }
+    for (auto ts: tss) {
+        auto res = collection->append(ts, static_cast<double>(ts));
+        BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    }
+    BOOST_REQUIRE_EQUAL(collection->get_last_timestamp(), 999 + N - W);
+
+    // Latest value includes buffered values
+    aku_Status status;
+    aku_Timestamp lastts;
+    double lastxs;
+    std::tie(status, lastts, lastxs) = collection->read_last();
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(lastts, 999 + N);
+
+    // Value older than the window should be rejected
+    BOOST_REQUIRE(collection->append(998 + N - W, 0.0) == NBTreeAppendResult::FAIL_LATE_WRITE);
+    BOOST_REQUIRE(collection->append_range(tss.data(), &lastxs, 1) == NBTreeAppendResult::FAIL_LATE_WRITE);
+
+    addrlist = collection->close();
+    collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+
+    auto it = collection->search(0, 2000 + N);
+    std::vector<aku_Timestamp> outts(N, 0);
+    std::vector<double> outxs(N, 0);
+    size_t sz;
+    std::tie(status, sz) = it->read(outts.data(), outxs.data(), N);
+    BOOST_REQUIRE_EQUAL(sz, N);
+    for (u32 i = 0; i < N; i++) {
+        if (outts[i] != 1000 + i || outxs[i] != static_cast<double>(1000 + i)) {
+            BOOST_REQUIRE_EQUAL(outts[i], 1000 + i);
+            BOOST_REQUIRE_EQUAL(outxs[i], static_cast<double>(1000 + i));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_change_only) {
+    const u32 N = 1000;
+    const aku_Timestamp HEARTBEAT = 100;
+    std::vector<LogicAddr> addrlist;
+    std::shared_ptr<BlockStore> bstore =
+        BlockStoreBuilder::create_memstore();
+
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->set_change_only(HEARTBEAT);
+    collection->force_init();
+
+    // Value changes every 250 steps, step is 10
+    u64 nrepeated = NBTreeIOStats::get().repeated_values;
+    std::vector<aku_Timestamp> expts;
+    std::vector<double> expxs;
+    aku_Timestamp lastts = 0;
+    double lastxs = -1;
+    for (u32 i = 0; i < N; i++) {
+        aku_Timestamp ts = 1000 + i*10;
+        double xs = static_cast<double>(i / 250);
+        if (xs != lastxs || ts - lastts >= HEARTBEAT) {
+            expts.push_back(ts);
+            expxs.push_back(xs);
+            lastts = ts;
+            lastxs = xs;
+        }
+        auto res = collection->append(ts, xs);
+        BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    }
+    BOOST_REQUIRE_EQUAL(NBTreeIOStats::get().repeated_values - nrepeated, N - expts.size());
+
+    auto it = collection->search(0, 1000 + N*10);
+    std::vector<aku_Timestamp> outts(N, 0);
+    std::vector<double> outxs(N, 0);
+    aku_Status status;
+    size_t sz;
+    std::tie(status, sz) = it->read(outts.data(), outxs.data(), N);
+    BOOST_REQUIRE_EQUAL(sz, expts.size());
+    for (u32 i = 0; i < sz; i++) {
+        BOOST_REQUIRE_EQUAL(outts[i], expts[i]);
+        BOOST_REQUIRE_EQUAL(outxs[i], expxs[i]);
+    }
+
+    // Disabled mode stores every value
+    collection->set_change_only(0);
+    auto res = collection->append(2000 + N*10, lastxs);
+    BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    res = collection->append(2001 + N*10, lastxs);
+    BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    it = collection->search(2000 + N*10, 3000 + N*10);
+    std::tie(status, sz) = it->read(outts.data(), outxs.data(), N);
+    BOOST_REQUIRE_EQUAL(sz, 2);
+}
+
+//! Flush queue that doesn't flush anything, scheduled trees are flushed by the test
+struct MockFlushQueue : NBTreeFlushQueue {
+    std::vector<std::shared_ptr<NBTreeExtentsList>> scheduled;
+
+    virtual void schedule(aku_ParamId, std::shared_ptr<NBTreeExtentsList> tree) override {
+        scheduled.push_back(tree);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_write_ring) {
+    const u32 N = 10000;
+    const u32 R = 1000;
+    std::vector<LogicAddr> addrlist;
+    std::shared_ptr<BlockStore> bstore =
+        BlockStoreBuilder::create_memstore();
+    auto queue = std::make_shared<MockFlushQueue>();
+
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->set_write_ring(R, queue);
+    collection->force_init();
+
+    auto count = [&]() {
+        auto it = collection->search(0, 2000 + N);
+        std::vector<aku_Timestamp> outts(N, 0);
+        std::vector<double> outxs(N, 0);
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = it->read(outts.data(), outxs.data(), N);
+        return sz;
+    };
+
+    // Tree should be scheduled once when the ring is full
+    for (u32 i = 0; i < R; i++) {
+        auto res = collection->append(1000 + i, static_cast<double>(i));
+        BOOST_REQUIRE(res == NBTreeAppendResult::OK);
+    }
+    BOOST_REQUIRE_EQUAL(queue->scheduled.size(), 1);
+    BOOST_REQUIRE_EQUAL(count(), 0);
+    BOOST_REQUIRE_EQUAL(collection->get_last_timestamp(), 999 + R);
+
+    // Late writes should be rejected by the ring
+    BOOST_REQUIRE(collection->append(1000, 0.0) == NBTreeAppendResult::FAIL_LATE_WRITE);
+
+    // Latest value is taken from the ring
+    aku_Status status;
+    aku_Timestamp lastts;
+    double lastxs;
+    std::tie(status, lastts, lastxs) = collection->read_last();
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(lastts, 999 + R);
+
+    // Values are visible after the flush
+    queue->scheduled.front()->flush_write_ring();
+    queue->scheduled.clear();
+    BOOST_REQUIRE_EQUAL(count(), R);
+
+    // Writer flushes the ring itself if the queue doesn't
+    for (u32 i = R; i < N; i++) {
+        auto res = collection->append(1000 + i, static_cast<double>(i));
+        BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    }
+    BOOST_REQUIRE(!queue->scheduled.empty());
+    BOOST_REQUIRE_GE(count(), N - 2*R);
+
+    // Close should drain the ring
+    addrlist = collection->close();
+    collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+    BOOST_REQUIRE_EQUAL(count(), N);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_compaction) {
+    const u32 N = 40000;
+    std::vector<LogicAddr> addrlist;
+    std::shared_ptr<BlockStore> bstore =
+        BlockStoreBuilder::create_memstore();
+
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+
+    // Leaf nodes that are committed early are underfilled
+    for (u32 i = 0; i < N; i++) {
+        collection->append(1000 + i, static_cast<double>(i));
+        if (i < N/2 && i % 100 == 99) {
+            collection->commit_leaf();
+        }
+    }
+    BOOST_REQUIRE_LT(collection->get_fill_factor(), 0.5);
+    auto before = collection->get_roots();
+
+    BOOST_REQUIRE(collection->compact(0.5));
+    BOOST_REQUIRE_GT(collection->get_fill_factor(), 0.5);
+    BOOST_REQUIRE(!collection->compact(0.5));
+    auto after = collection->get_roots();
+    BOOST_REQUIRE(before != after);
+
+    auto check = [N](std::shared_ptr<NBTreeExtentsList> tree) {
+        auto it = tree->search(0, 2000 + N);
+        std::vector<aku_Timestamp> outts(N + 1, 0);
+        std::vector<double> outxs(N + 1, 0);
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = it->read(outts.data(), outxs.data(), N + 1);
+        BOOST_REQUIRE_EQUAL(sz, N + 1);
+        for (u32 i = 0; i < N + 1; i++) {
+            if (outts[i] != 1000 + i || outxs[i] != static_cast<double>(i)) {
+                BOOST_REQUIRE_EQUAL(outts[i], 1000 + i);
+                BOOST_REQUIRE_EQUAL(outxs[i], static_cast<double>(i));
+            }
+        }
+    };
+
+    // Tree remains writable after compaction
+    BOOST_REQUIRE(collection->append(999, 0.0) == NBTreeAppendResult::FAIL_LATE_WRITE);
+    auto res = collection->append(1000 + N, static_cast<double>(N));
+    BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    check(collection);
+
+    addrlist = collection->close();
+    collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+    check(collection);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_recompression) {
+    const u32 N = 40000;
+    std::vector<LogicAddr> addrlist;
+    std::shared_ptr<BlockStore> bstore =
+        BlockStoreBuilder::create_memstore();
+
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+
+    // Values converted from single precision floats are not compressed
+    // well by the value codecs but deflate handles them well
+    std::vector<double> xss;
+    RandomWalk rwalk(0.0, 0.01, 0.1);
+    for (u32 i = 0; i < N; i++) {
+        xss.push_back(static_cast<float>(rwalk.next()));
+        collection->append(1000 + i, xss.back());
+    }
+    auto before = collection->get_roots();
+    auto nwrites = bstore->get_stats().nblocks;
+
+    // Values that are not old enough are not packed
+    BOOST_REQUIRE(!collection->recompress(1000));
+    BOOST_REQUIRE(collection->recompress(1000 + N/2));
+    BOOST_REQUIRE(!collection->recompress(1000 + N/2));
+    // Packed leaf nodes don't affect the fill factor
+    BOOST_REQUIRE(!collection->compact(0.5));
+    auto after = collection->get_roots();
+    BOOST_REQUIRE(before != after);
+    // Packed half of the tree takes less space than the original one
+    auto nrewritten = bstore->get_stats().nblocks - nwrites;
+    BOOST_REQUIRE_LT(nrewritten, nwrites);
+
+    auto check = [&xss](std::shared_ptr<NBTreeExtentsList> tree, aku_Timestamp begin, aku_Timestamp end) {
+        auto it = tree->search(begin, end);
+        std::vector<aku_Timestamp> outts(end - begin, 0);
+        std::vector<double> outxs(end - begin, 0);
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = it->read(outts.data(), outxs.data(), outts.size());
+        BOOST_REQUIRE_EQUAL(sz, outts.size());
+        for (u32 i = 0; i < sz; i++) {
+            if (outts[i] != begin + i || outxs[i] != xss.at(begin + i - 1000)) {
+                BOOST_REQUIRE_EQUAL(outts[i], begin + i);
+                BOOST_REQUIRE_EQUAL(outxs[i], xss.at(begin + i - 1000));
+            }
+        }
+    };
+    check(collection, 1000, 1000 + N);
+    check(collection, 1000 + N/4, 1000 + N/2 + 100);
+
+    // Tree remains writable after recompression
+    xss.push_back(1.0);
+    auto res = collection->append(1000 + N, xss.back());
+    BOOST_REQUIRE(res == NBTreeAppendResult::OK || res == NBTreeAppendResult::OK_FLUSH_NEEDED);
+    check(collection, 1000, 1001 + N);
+
+    addrlist = collection->close();
+    collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    collection->force_init();
+    check(collection, 1000, 1001 + N);
+    auto agg = collection->aggregate(1000, 1001 + N);
+    aku_Timestamp ts;
+    AggregationResult aggres;
+    size_t sz;
+    aku_Status status;
+    std::tie(status, sz) = agg->read(&ts, &aggres, 1);
+    BOOST_REQUIRE_EQUAL(sz, 1);
+    BOOST_REQUIRE_EQUAL(aggres.cnt, N + 1);
+}
+
 BOOST_AUTO_TEST_CASE(Test_reopen_write_reopen) {
     std::vector<LogicAddr> addrlist;
     std::shared_ptr<BlockStore> bstore =
@@ -1953,7 +2754,8 @@ void test_node_split_algorithm_lvl2_split_twice(aku_Timestamp pivot1,
     std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
     const aku_ParamId id = 42;
     LogicAddr prev = EMPTY_ADDR;
-    NBTreeSuperblock sblock(id, EMPTY_ADDR, 0, 1);
+    // Expected structure depends on the fanout of the node
+    NBTreeSuperblock sblock(id, EMPTY_ADDR, 0, 1, AKU_NBTREE_LEGACY_FANOUT);
 
     for(auto kv: tss) {
         NBTreeLeaf leaf(id, prev, static_cast<u16>(kv.first));
@@ -2065,3 +2867,536 @@ BOOST_AUTO_TEST_CASE(Test_node_split_algorithm_22) {
     }
     test_node_split_algorithm_lvl2_split_twice(15, 17, tss, 2, 34);
 }
+
+void check_aggregation_results(AggregationResult const& expected, AggregationResult const& actual) {
+    BOOST_REQUIRE_EQUAL(expected.cnt, actual.cnt);
+    BOOST_REQUIRE_CLOSE(expected.sum, actual.sum, 1E-10);
+    BOOST_REQUIRE_EQUAL(expected.min, actual.min);
+    BOOST_REQUIRE_EQUAL(expected.max, actual.max);
+    BOOST_REQUIRE_EQUAL(expected.mints, actual.mints);
+    BOOST_REQUIRE_EQUAL(expected.maxts, actual.maxts);
+    BOOST_REQUIRE_EQUAL(expected.first, actual.first);
+    BOOST_REQUIRE_EQUAL(expected.last, actual.last);
+    BOOST_REQUIRE_EQUAL(expected._begin, actual._begin);
+    BOOST_REQUIRE_EQUAL(expected._end, actual._end);
+}
+
+void test_aggregate_by_step(bool forward, size_t size, u64 step) {
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    for (size_t i = 0; i < size; i++) {
+        tss.push_back(1000 + i*3);
+        // Use repeated values to check that timestamp of the first extremum is used
+        xss.push_back(static_cast<double>(rand() % 100));
+    }
+    aku_Timestamp begin = 1000;
+    if (!forward) {
+        std::reverse(tss.begin(), tss.end());
+        std::reverse(xss.begin(), xss.end());
+        begin = tss.front();
+    }
+    // Compute expected values using per-element update
+    std::vector<AggregationResult> expected;
+    u64 bin = 0;
+    for (size_t i = 0; i < size; i++) {
+        aku_Timestamp normts = forward ? tss[i] - begin : begin - tss[i];
+        if (expected.empty() || normts / step != bin) {
+            bin = normts / step;
+            expected.push_back(INIT_AGGRES);
+        }
+        expected.back().add(tss[i], xss[i], forward);
+    }
+    std::vector<aku_Timestamp> destts(size, 0);
+    std::vector<AggregationResult> destxs(size, INIT_AGGRES);
+    size_t nbins = aggregate_by_step(tss.data(), xss.data(), size, begin, step, forward, destts.data(), destxs.data());
+    BOOST_REQUIRE_EQUAL(nbins, expected.size());
+    for (size_t i = 0; i < nbins; i++) {
+        BOOST_REQUIRE_EQUAL(destts.at(i), expected.at(i)._begin);
+        check_aggregation_results(expected.at(i), destxs.at(i));
+    }
+    // Whole range at once
+    AggregationResult total = INIT_AGGRES;
+    for (size_t i = 0; i < size; i++) {
+        total.add(tss[i], xss[i], true);
+    }
+    AggregationResult actual = INIT_AGGRES;
+    actual.do_the_math(tss.data(), xss.data(), size, false);
+    check_aggregation_results(total, actual);
+}
+
+BOOST_AUTO_TEST_CASE(Test_aggregate_by_step_forward) {
+    for (auto size: { 1u, 3u, 4u, 7u, 100u, 1000u }) {
+        for (auto step: { 1u, 5u, 10u, 100u, 100000u }) {
+            test_aggregate_by_step(true, size, step);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_aggregate_by_step_backward) {
+    for (auto size: { 1u, 3u, 4u, 7u, 100u, 1000u }) {
+        for (auto step: { 1u, 5u, 10u, 100u, 100000u }) {
+            test_aggregate_by_step(false, size, step);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_aggregation_buckets_combine) {
+    const size_t N = 100;
+    // Random buckets, some of them are empty
+    auto make_bucket = [](size_t i) {
+        AggregationResult res = INIT_AGGRES;
+        for (int j = rand() % 3; j > 0; j--) {
+            res.add(1000 + i*10 + static_cast<aku_Timestamp>(rand() % 10), static_cast<double>(rand() % 10), true);
+        }
+        return res;
+    };
+    std::vector<AggregationResult> expected;
+    AggregationBuckets lhs, rhs;
+    lhs.reset(N);
+    rhs.reset(N);
+    for (size_t i = 0; i < N; i++) {
+        auto a = make_bucket(i);
+        auto b = make_bucket(i);
+        lhs.set(i, a);
+        rhs.set(i, b);
+        a.combine(b);
+        expected.push_back(a);
+    }
+    lhs.combine(rhs);
+    BOOST_REQUIRE_EQUAL(lhs.size(), N);
+    for (size_t i = 0; i < N; i++) {
+        auto actual = lhs.get(i);
+        BOOST_REQUIRE_EQUAL(expected[i].cnt, actual.cnt);
+        if (expected[i].cnt != 0) {
+            check_aggregation_results(expected[i], actual);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_concurrent_readers) {
+    // Readers share the lock, they should see consistent prefix of the
+    // series while the writer appends values and splits nodes
+    const u32 N = 200000;
+    const int NREADERS = 4;
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    auto tree = std::make_shared<NBTreeExtentsList>(42, std::vector<LogicAddr>(), bstore);
+    tree->force_init();
+    std::atomic<bool> done = {false};
+    std::atomic<int> nerrors = {0};
+
+    auto reader = [&]() {
+        std::vector<aku_Timestamp> ts(N);
+        std::vector<double> xs(N);
+        size_t prev = 0;
+        while (true) {
+            bool last = done.load();
+            auto it = tree->search(0, N);
+            size_t nread = 0;
+            while (nread < N) {
+                aku_Status status;
+                size_t sz;
+                std::tie(status, sz) = it->read(ts.data() + nread, xs.data() + nread, N - nread);
+                nread += sz;
+                if (status != AKU_SUCCESS) {
+                    break;
+                }
+            }
+            for (size_t i = 0; i < nread; i++) {
+                if (ts[i] != i || !same_value(xs[i], i)) {
+                    nerrors++;
+                    return;
+                }
+            }
+            auto agg = tree->aggregate(0, N);
+            aku_Timestamp aggts;
+            AggregationResult res;
+            size_t sz;
+            aku_Status status;
+            std::tie(status, sz) = agg->read(&aggts, &res, 1);
+            if (nread < prev || (sz == 1 && res.cnt < nread)) {
+                // Data can't disappear
+                nerrors++;
+                return;
+            }
+            prev = nread;
+            if (last) {
+                if (nread != N) {
+                    nerrors++;
+                }
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < NREADERS; i++) {
+        readers.emplace_back(reader);
+    }
+    for (u32 i = 0; i < N; i++) {
+        BOOST_REQUIRE(tree->append(i, i) != NBTreeAppendResult::FAIL_LATE_WRITE);
+    }
+    done.store(true);
+    for (auto& t: readers) {
+        t.join();
+    }
+    BOOST_REQUIRE_EQUAL(nerrors.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_concurrent_writers) {
+    // Writers of the same series don't wait for each other, values passed to the
+    // writer that holds the lock should be written in order and none of them lost
+    const u32 N = 100000;
+    const int NWRITERS = 4;
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    auto tree = std::make_shared<NBTreeExtentsList>(42, std::vector<LogicAddr>(), bstore);
+    tree->force_init();
+    std::atomic<aku_Timestamp> clock = {1000};
+    std::atomic<u32> naccepted = {0};
+
+    auto writer = [&]() {
+        for (u32 i = 0; i < N; i++) {
+            aku_Timestamp ts = clock++;
+            auto res = tree->append(ts, static_cast<double>(ts));
+            if (res != NBTreeAppendResult::FAIL_LATE_WRITE) {
+                naccepted++;
+            }
+        }
+    };
+    std::vector<std::thread> writers;
+    for (int i = 0; i < NWRITERS; i++) {
+        writers.emplace_back(writer);
+    }
+    for (auto& t: writers) {
+        t.join();
+    }
+    BOOST_REQUIRE(naccepted.load() > 0);
+
+    auto addrlist = tree->close();
+    tree = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore);
+    tree->force_init();
+    auto it = tree->search(0, clock.load());
+    std::vector<aku_Timestamp> outts(N*NWRITERS, 0);
+    std::vector<double> outxs(N*NWRITERS, 0);
+    aku_Status status;
+    size_t sz;
+    std::tie(status, sz) = it->read(outts.data(), outxs.data(), outts.size());
+    BOOST_REQUIRE_EQUAL(sz, naccepted.load());
+    for (size_t i = 1; i < sz; i++) {
+        if (outts[i] <= outts[i - 1] || outxs[i] != static_cast<double>(outts[i])) {
+            BOOST_REQUIRE_LT(outts[i - 1], outts[i]);
+            BOOST_REQUIRE_EQUAL(outxs[i], static_cast<double>(outts[i]));
+        }
+    }
+    BOOST_REQUIRE_EQUAL(tree->get_last_timestamp(), outts[sz - 1]);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_query_arena) {
+    const u32 N = 100000;
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    auto tree = std::make_shared<NBTreeExtentsList>(42, std::vector<LogicAddr>(), bstore);
+    tree->force_init();
+    for (u32 i = 0; i < N; i++) {
+        BOOST_REQUIRE(tree->append(i, i) != NBTreeAppendResult::FAIL_LATE_WRITE);
+    }
+    std::unique_ptr<RealValuedOperator> it;
+    {
+        QueryArena::Scope scope;
+        BOOST_REQUIRE(QueryArena::get_current() == scope.get());
+        it = tree->search(0, N);
+        BOOST_REQUIRE(scope.get()->size() != 0);
+        // Arena is too small, operators are allocated on the heap
+        QueryArena::Scope small(0);
+        auto agg = tree->aggregate(0, N);
+        BOOST_REQUIRE_EQUAL(small.get()->size(), 0);
+        aku_Timestamp aggts;
+        AggregationResult res;
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = agg->read(&aggts, &res, 1);
+        BOOST_REQUIRE_EQUAL(sz, 1);
+        BOOST_REQUIRE_EQUAL(res.cnt, N);
+    }
+    BOOST_REQUIRE(QueryArena::get_current() == nullptr);
+    // Operator outlives the scope, the arena is released when the operator is deleted
+    std::vector<aku_Timestamp> ts(N);
+    std::vector<double> xs(N);
+    size_t nread = 0;
+    while (nread < N) {
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = it->read(ts.data() + nread, xs.data() + nread, N - nread);
+        nread += sz;
+        if (status != AKU_SUCCESS) {
+            break;
+        }
+    }
+    BOOST_REQUIRE_EQUAL(nread, N);
+    for (u32 i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(ts[i], i);
+    }
+    it.reset();
+}
+
+static aku_Status read_until_error(RealValuedOperator& it, size_t* nread) {
+    std::vector<aku_Timestamp> ts(1000);
+    std::vector<double> xs(1000);
+    aku_Status status = AKU_SUCCESS;
+    while (status == AKU_SUCCESS) {
+        size_t sz;
+        std::tie(status, sz) = it.read(ts.data(), xs.data(), ts.size());
+        *nread += sz;
+    }
+    return status;
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_query_cancellation) {
+    const u32 N = 100000;
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    auto tree = std::make_shared<NBTreeExtentsList>(42, std::vector<LogicAddr>(), bstore);
+    tree->force_init();
+    for (u32 i = 0; i < N; i++) {
+        BOOST_REQUIRE(tree->append(i, i) != NBTreeAppendResult::FAIL_LATE_WRITE);
+    }
+    // Threads without cancellation state are not affected
+    size_t nread = 0;
+    BOOST_REQUIRE_EQUAL(read_until_error(*tree->search(0, N), &nread), AKU_ENO_DATA);
+    BOOST_REQUIRE_EQUAL(nread, N);
+    {
+        QueryCancellation state;
+        QueryCancellation::Scope scope(&state);
+        auto it = tree->search(0, N);
+        std::vector<aku_Timestamp> ts(1000);
+        std::vector<double> xs(1000);
+        aku_Status status;
+        size_t sz;
+        std::tie(status, sz) = it->read(ts.data(), xs.data(), ts.size());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        state.cancel();
+        nread = sz;
+        BOOST_REQUIRE_EQUAL(read_until_error(*it, &nread), AKU_ECLOSED);
+        BOOST_REQUIRE(nread < N);
+    }
+    {
+        QueryCancellation state;
+        QueryCancellation::Scope scope(&state);
+        state.set_timeout(0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        nread = 0;
+        BOOST_REQUIRE_EQUAL(read_until_error(*tree->search(0, N), &nread), AKU_ETIMEOUT);
+        BOOST_REQUIRE(nread < N);
+    }
+}
+
+static void fill_superblock(NBTreeSuperblock* sblock, u32 nleaves, std::shared_ptr<BlockStore> bstore) {
+    const aku_ParamId id = sblock->get_id();
+    LogicAddr prev = EMPTY_ADDR;
+    for (u32 i = 0; i < nleaves; i++) {
+        NBTreeLeaf leaf(id, prev, static_cast<u16>(i));
+        std::vector<aku_Timestamp> tss;
+        for (aku_Timestamp ts = i*10; ts < i*10 + 10; ts++) {
+            tss.push_back(ts);
+        }
+        fill_leaf(&leaf, tss);
+        prev = save_leaf(&leaf, sblock, bstore);
+    }
+}
+
+static void check_same_links(std::vector<SubtreeRef> const& expected, std::vector<SubtreeRef> const& actual) {
+    BOOST_REQUIRE_EQUAL(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        BOOST_REQUIRE_EQUAL(expected[i].count, actual[i].count);
+        BOOST_REQUIRE_EQUAL(expected[i].id, actual[i].id);
+        BOOST_REQUIRE_EQUAL(expected[i].begin, actual[i].begin);
+        BOOST_REQUIRE_EQUAL(expected[i].end, actual[i].end);
+        BOOST_REQUIRE_EQUAL(expected[i].addr, actual[i].addr);
+        BOOST_REQUIRE_EQUAL(expected[i].min, actual[i].min);
+        BOOST_REQUIRE_EQUAL(expected[i].max, actual[i].max);
+        BOOST_REQUIRE_EQUAL(expected[i].sum, actual[i].sum);
+        BOOST_REQUIRE_EQUAL(expected[i].first, actual[i].first);
+        BOOST_REQUIRE_EQUAL(expected[i].last, actual[i].last);
+        BOOST_REQUIRE_EQUAL(expected[i].level, actual[i].level);
+        BOOST_REQUIRE_EQUAL(expected[i].version, actual[i].version);
+        BOOST_REQUIRE_EQUAL(expected[i].fanout_index, actual[i].fanout_index);
+        BOOST_REQUIRE(expected[i].type == actual[i].type);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_superblock_compact_links) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    NBTreeSuperblock sblock(42, EMPTY_ADDR, 0, 1);
+    fill_superblock(&sblock, AKU_NBTREE_FANOUT, bstore);
+    BOOST_REQUIRE(sblock.is_full());
+
+    std::vector<SubtreeRef> expected;
+    BOOST_REQUIRE_EQUAL(sblock.read_all(&expected), AKU_SUCCESS);
+    aku_Status status;
+    LogicAddr addr;
+    std::tie(status, addr) = sblock.commit(bstore);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    NBTreeSuperblock restored(read_block(bstore, addr));
+    BOOST_REQUIRE(restored.get_sblockmeta()->version & NBTreeSuperblock::COMPACT_FLAG);
+    std::vector<SubtreeRef> actual;
+    BOOST_REQUIRE_EQUAL(restored.read_all(&actual), AKU_SUCCESS);
+    check_same_links(expected, actual);
+
+    auto it = restored.search(0, AKU_NBTREE_FANOUT*10, bstore);
+    BOOST_REQUIRE_EQUAL(extract_timestamps(*it).size(), AKU_NBTREE_FANOUT*10);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_superblock_legacy_links) {
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    NBTreeSuperblock sblock(42, EMPTY_ADDR, 0, 1);
+    fill_superblock(&sblock, AKU_NBTREE_LEGACY_FANOUT, bstore);
+    std::vector<SubtreeRef> expected;
+    BOOST_REQUIRE_EQUAL(sblock.read_all(&expected), AKU_SUCCESS);
+
+    // Write the node using the layout of the previous version
+    auto block = std::make_shared<Block>();
+    SubtreeRef* header = reinterpret_cast<SubtreeRef*>(block->get_data());
+    BOOST_REQUIRE_EQUAL(init_subtree_from_subtree(sblock, *header), AKU_SUCCESS);
+    header->addr = EMPTY_ADDR;
+    header->payload_size = static_cast<u16>(expected.size());
+    std::copy(expected.begin(), expected.end(), header + 1);
+    header->checksum = bstore->checksum(block->get_cdata() + sizeof(SubtreeRef), header->payload_size);
+    aku_Status status;
+    LogicAddr addr;
+    std::tie(status, addr) = bstore->append_block(block);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    NBTreeSuperblock legacy(read_block(bstore, addr));
+    std::vector<SubtreeRef> actual;
+    BOOST_REQUIRE_EQUAL(legacy.read_all(&actual), AKU_SUCCESS);
+    check_same_links(expected, actual);
+
+    // Copy on write converts the node to compact form and allows it to grow past the legacy fanout
+    NBTreeSuperblock cow(addr, bstore, false);
+    actual.clear();
+    BOOST_REQUIRE_EQUAL(cow.read_all(&actual), AKU_SUCCESS);
+    check_same_links(expected, actual);
+    BOOST_REQUIRE_EQUAL(cow.append(expected.back()), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cow.nelements(), AKU_NBTREE_LEGACY_FANOUT + 1);
+}
+
+//! Check that all superblocks of the subtree have the same fanout
+static void check_subtree_fanout(LogicAddr addr, u16 fanout, std::shared_ptr<BlockStore> bstore) {
+    NBTreeSuperblock sblock(read_block(bstore, addr));
+    auto version = sblock.get_sblockmeta()->version;
+    BOOST_REQUIRE_EQUAL((version & NBTreeSuperblock::FANOUT_MASK) >> NBTreeSuperblock::FANOUT_SHIFT, fanout);
+    BOOST_REQUIRE_EQUAL(sblock.get_max_fanout(), fanout);
+    BOOST_REQUIRE_LE(sblock.nelements(), fanout);
+    std::vector<SubtreeRef> refs;
+    BOOST_REQUIRE_EQUAL(sblock.read_all(&refs), AKU_SUCCESS);
+    for (auto const& ref: refs) {
+        if (ref.type == NBTreeBlockType::INNER) {
+            check_subtree_fanout(ref.addr, fanout, bstore);
+        }
+    }
+}
+
+static void check_tree_fanout(std::vector<LogicAddr> const& roots, u16 fanout, std::shared_ptr<BlockStore> bstore) {
+    // First root is a leaf
+    for (size_t i = 1; i < roots.size(); i++) {
+        if (roots[i] != EMPTY_ADDR) {
+            check_subtree_fanout(roots[i], fanout, bstore);
+        }
+    }
+}
+
+static void check_tree_size(std::vector<LogicAddr> const& roots, u16 fanout, u32 N, std::shared_ptr<BlockStore> bstore) {
+    auto col = std::make_shared<NBTreeExtentsList>(42, roots, bstore, fanout);
+    col->force_init();
+    auto it = col->search(0, N);
+    u32 nread = 0;
+    while (true) {
+        auto ts = extract_timestamps(*it);
+        if (ts.empty()) {
+            break;
+        }
+        for (auto t: ts) {
+            BOOST_REQUIRE_EQUAL(t, nread);
+            nread++;
+        }
+    }
+    BOOST_REQUIRE_EQUAL(nread, N);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_small_fanout) {
+    const u16 FANOUT = AKU_NBTREE_MIN_FANOUT;
+    const u32 NLEAVES = FANOUT*FANOUT*FANOUT + 3;
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore();
+    std::vector<LogicAddr> addrlist;
+    auto collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore, FANOUT);
+    collection->force_init();
+
+    u32 nleaves = 0;
+    u32 nitems = 0;
+    u32 ncommitted = 0;
+    for (u32 i = 0; nleaves < NLEAVES; i++) {
+        if (collection->append(i, i) == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+            // Last value is added to the new leaf
+            ncommitted = i;
+            nleaves++;
+        }
+        nitems = i + 1;
+    }
+    // Every level of the small tree holds at most FANOUT nodes
+    auto roots = collection->get_roots();
+    BOOST_REQUIRE_GE(roots.size(), 4u);
+
+    // Recovery of the tree that wasn't closed
+    BOOST_REQUIRE(NBTreeExtentsList::repair_status(roots) == NBTreeExtentsList::RepairStatus::REPAIR);
+    check_tree_fanout(roots, FANOUT, bstore);
+    check_tree_size(roots, FANOUT, ncommitted, bstore);
+
+    addrlist = collection->close();
+    BOOST_REQUIRE(NBTreeExtentsList::repair_status(addrlist) == NBTreeExtentsList::RepairStatus::OK);
+    check_tree_fanout(addrlist, FANOUT, bstore);
+    check_tree_size(addrlist, FANOUT, nitems, bstore);
+
+    // Reopened tree keeps the fanout
+    collection = std::make_shared<NBTreeExtentsList>(42, addrlist, bstore, FANOUT);
+    collection->force_init();
+    for (u32 i = nitems; nleaves < 2*NLEAVES; i++) {
+        if (collection->append(i, i) == NBTreeAppendResult::OK_FLUSH_NEEDED) {
+            nleaves++;
+        }
+        nitems = i + 1;
+    }
+    addrlist = collection->close();
+    check_tree_fanout(addrlist, FANOUT, bstore);
+    check_tree_size(addrlist, FANOUT, nitems, bstore);
+}
+
+BOOST_AUTO_TEST_CASE(Test_nbtree_stage_released_on_error) {
+    bool fail = false;
+    auto cb = [&fail](LogicAddr) {
+        if (fail) {
+            throw std::runtime_error("append failed");
+        }
+    };
+    std::shared_ptr<BlockStore> bstore = BlockStoreBuilder::create_memstore(cb);
+    auto tree = std::make_shared<NBTreeExtentsList>(42, std::vector<LogicAddr>(), bstore);
+    tree->force_init();
+    // Owner of the staging queue leaves `append` with exception on the first commit
+    fail = true;
+    aku_Timestamp ts = 0;
+    bool thrown = false;
+    for (; !thrown && ts < 1000000; ts++) {
+        try {
+            tree->append(ts, static_cast<double>(ts));
+        } catch (std::runtime_error const&) {
+            thrown = true;
+        }
+    }
+    BOOST_REQUIRE(thrown);
+    fail = false;
+    // Values are written to the tree, not staged for the owner that is gone
+    auto nstaged = NBTreeIOStats::get().staged_values;
+    BOOST_REQUIRE(tree->append(ts, static_cast<double>(ts)) != NBTreeAppendResult::FAIL_LATE_WRITE);
+    BOOST_REQUIRE_EQUAL(NBTreeIOStats::get().staged_values, nstaged);
+    auto it = tree->search(ts, ts + 1);
+    auto actual = extract_timestamps(*it);
+    BOOST_REQUIRE_EQUAL(actual.size(), 1u);
+    BOOST_REQUIRE_EQUAL(actual.front(), ts);
+}
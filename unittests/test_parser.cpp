@@ -5,9 +5,18 @@
 #include <boost/test/unit_test.hpp>
 
 #include "index/seriesparser.h"
+#include "index/indexsnapshot.h"
+#include "index/hashring.h"
 #include "queryprocessor_framework.h"
 #include "datetime.h"
 #include <tuple>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <set>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
 
 using namespace Akumuli;
 using namespace Akumuli::QP;
@@ -61,6 +70,130 @@ BOOST_AUTO_TEST_CASE(Test_stringpool_0) {
     BOOST_REQUIRE_EQUAL(std::string(result_bar.first, result_bar.first + result_bar.second), bar);
 }
 
+BOOST_AUTO_TEST_CASE(Test_stringpool_1) {
+
+    StringPool pool;
+    std::vector<std::pair<u64, std::string>> expected;
+    // Should span several bins
+    for (int i = 0; i < 0x100000; i++) {
+        std::string name = "test key=" + std::to_string(i) + " tag=" + std::string(i % 100 + 1, 'x');
+        auto id = pool.add(name.data(), name.data() + name.size());
+        BOOST_REQUIRE(id != 0);
+        expected.push_back(std::make_pair(id, name));
+    }
+    BOOST_REQUIRE(pool.pool.size() > 1);
+    BOOST_REQUIRE_EQUAL(pool.size(), expected.size());
+    for (auto const& kv: expected) {
+        auto res = pool.str(kv.first);
+        BOOST_REQUIRE_EQUAL(std::string(res.first, res.first + res.second), kv.second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_inverted_string_table) {
+
+    InvertedStringTable table;
+    const char* foo = "foo";
+    const char* bar = "bar";
+    std::vector<u64> ids = { 1024, 1026, 1025, 1000, 1ull << 40, 1024 + 0x20000 };
+    for (auto id: ids) {
+        table.insert(id, std::make_pair(foo, 3));
+    }
+    table.insert(1026, std::make_pair(bar, 3));  // replace
+    BOOST_REQUIRE_EQUAL(table.size(), ids.size());
+    for (auto id: ids) {
+        auto res = table.find(id);
+        BOOST_REQUIRE(res.first == (id == 1026 ? bar : foo));
+        BOOST_REQUIRE_EQUAL(res.second, 3);
+    }
+    BOOST_REQUIRE(table.find(1027).first == nullptr);
+    BOOST_REQUIRE(table.find(0).first == nullptr);
+    std::sort(ids.begin(), ids.end());
+    auto actual = table.get_ids();
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), ids.begin(), ids.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_series_tokens) {
+    SeriesTokens tokens;
+    std::vector<std::string> names = {
+        "cpu host=a zone=1",
+        "cpu host=b zone=1",
+        "mem host=a",
+    };
+    std::vector<u64> ids = { 1024, 1025, 1ull << 40 };
+    for (size_t i = 0; i < names.size(); i++) {
+        tokens.add(ids[i], std::make_pair(names[i].data(), static_cast<u32>(names[i].size())));
+    }
+    auto token = [&](std::string str) {
+        return tokens.token(std::make_pair(str.data(), static_cast<int>(str.size())));
+    };
+    auto a = tokens.find(1024);
+    auto b = tokens.find(1025);
+    auto c = tokens.find(1ull << 40);
+    BOOST_REQUIRE_EQUAL(a.size, 3);
+    BOOST_REQUIRE_EQUAL(b.size, 3);
+    BOOST_REQUIRE_EQUAL(c.size, 2);
+    BOOST_REQUIRE_EQUAL(a.tokens[0], token("cpu"));
+    BOOST_REQUIRE_EQUAL(a.tokens[0], b.tokens[0]);
+    BOOST_REQUIRE_EQUAL(a.tokens[2], b.tokens[2]);
+    BOOST_REQUIRE_EQUAL(a.tokens[1], c.tokens[1]);
+    BOOST_REQUIRE(a.tokens[1] != b.tokens[1]);
+    BOOST_REQUIRE_EQUAL(tokens.tag_of(b.tokens[1]), token("host"));
+    BOOST_REQUIRE_EQUAL(tokens.tag_of(b.tokens[2]), token("zone"));
+    auto str = tokens.str(b.tokens[1]);
+    BOOST_REQUIRE_EQUAL(std::string(str.first, str.first + str.second), "host=b");
+    BOOST_REQUIRE_EQUAL(token("host=c"), 0);
+    BOOST_REQUIRE(tokens.find(1026).tokens == nullptr);
+    tokens.erase(1025);
+    tokens.erase(1ull << 40);
+    BOOST_REQUIRE(tokens.find(1025).tokens == nullptr);
+    BOOST_REQUIRE(tokens.find(1ull << 40).tokens == nullptr);
+    BOOST_REQUIRE_EQUAL(tokens.find(1024).size, 3);
+}
+
+BOOST_AUTO_TEST_CASE(Test_flat_string_table) {
+
+    FlatStringTable table;
+    const u64 N = 100000;
+    std::vector<std::string> names;
+    for (u64 i = 0; i < N; i++) {
+        names.push_back("cpu host=" + std::to_string(i));
+    }
+    std::atomic<int> done = {0};
+    std::atomic<u64> nfound = {0};
+    // Readers can run concurrently with the writer
+    auto reader = [&]() {
+        while (done.load() == 0) {
+            for (u64 i = 0; i < N; i += 97) {
+                auto str = std::make_pair(names[i].data(), static_cast<int>(names[i].size()));
+                auto res = table.find(str);
+                if (res != 0) {
+                    BOOST_REQUIRE_EQUAL(res, i + 1);
+                    nfound++;
+                }
+            }
+        }
+    };
+    std::thread th(reader);
+    for (u64 i = 0; i < N; i++) {
+        auto str = std::make_pair(names[i].data(), static_cast<int>(names[i].size()));
+        table.insert(str, StringTools::hash(str), i + 1);
+    }
+    done.store(1);
+    th.join();
+    BOOST_REQUIRE_EQUAL(table.size(), N);
+    for (u64 i = 0; i < N; i++) {
+        auto str = std::make_pair(names[i].data(), static_cast<int>(names[i].size()));
+        BOOST_REQUIRE_EQUAL(table.find(str), i + 1);
+    }
+    std::string missing = "cpu host=foo";
+    BOOST_REQUIRE_EQUAL(table.find(std::make_pair(missing.data(), static_cast<int>(missing.size()))), 0);
+    // Replace
+    auto first = std::make_pair(names[0].data(), static_cast<int>(names[0].size()));
+    table.insert(first, StringTools::hash(first), 42);
+    BOOST_REQUIRE_EQUAL(table.find(first), 42);
+    BOOST_REQUIRE_EQUAL(table.size(), N);
+}
+
 BOOST_AUTO_TEST_CASE(Test_seriesmatcher_0) {
 
     SeriesMatcher matcher(1ul);
@@ -82,6 +215,100 @@ BOOST_AUTO_TEST_CASE(Test_seriesmatcher_0) {
     BOOST_REQUIRE_EQUAL(buz_id, 0ul);
 }
 
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_concurrent_access) {
+    SeriesMatcher matcher(1ul);
+    const int nwriters = 4, nnames = 1000;
+    std::atomic<bool> done{false};
+    std::atomic<size_t> nsearches{0};
+    std::atomic<size_t> nerrors{0};
+    // Queries and id lookups run concurrently with writers
+    std::thread reader([&]() {
+        MetricName mname("cpu");
+        std::vector<TagValuePair> tags = { TagValuePair("zone=z0") };
+        IncludeIfAllTagsMatch query(mname, tags.begin(), tags.end());
+        while (!done.load()) {
+            auto res = matcher.search(query);
+            for (auto const& item: res) {
+                auto name = matcher.id2str(std::get<2>(item));
+                if (name.first != std::get<0>(item)) {
+                    nerrors++;
+                }
+            }
+            nsearches++;
+        }
+    });
+    std::vector<std::thread> writers;
+    for (int w = 0; w < nwriters; w++) {
+        writers.emplace_back([&matcher, w]() {
+            for (int i = 0; i < nnames; i++) {
+                std::string name = "cpu host=w" + std::to_string(w) + "-" + std::to_string(i)
+                                 + " zone=z" + std::to_string(i % 2);
+                matcher.add(name.data(), name.data() + name.size());
+            }
+        });
+    }
+    std::vector<SeriesMatcher::SeriesNameT> names;
+    for (auto& t: writers) {
+        t.join();
+    }
+    done.store(true);
+    reader.join();
+    BOOST_REQUIRE(nsearches.load() > 0);
+    BOOST_REQUIRE_EQUAL(nerrors.load(), 0);
+    matcher.pull_new_names(&names);
+    BOOST_REQUIRE_EQUAL(names.size(), nwriters*nnames);
+    BOOST_REQUIRE_EQUAL(matcher.get_series_id(), 1ul + nwriters*nnames);
+    MetricName mname("cpu");
+    std::vector<TagValuePair> tags = { TagValuePair("zone=z1") };
+    IncludeIfAllTagsMatch query(mname, tags.begin(), tags.end());
+    BOOST_REQUIRE_EQUAL(matcher.search(query).size(), nwriters*nnames/2);
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_add_if_absent) {
+    SeriesMatcher matcher(1ul);
+    const int nwriters = 4, nnames = 1000;
+    // Every writer adds the same set of names
+    std::vector<std::vector<u64>> ids(nwriters);
+    std::vector<size_t> ncreated(nwriters, 0);
+    std::vector<std::thread> writers;
+    for (int w = 0; w < nwriters; w++) {
+        writers.emplace_back([&, w]() {
+            for (int i = 0; i < nnames; i++) {
+                std::string name = "cpu host=h" + std::to_string(i) + " zone=z" + std::to_string(i % 2);
+                bool created = false;
+                auto hash = StringTools::hash(std::make_pair(name.data(), static_cast<int>(name.size())));
+                ids[w].push_back(matcher.add_if_absent(name.data(), name.data() + name.size(), hash, &created));
+                if (created) {
+                    ncreated[w]++;
+                }
+            }
+        });
+    }
+    for (auto& t: writers) {
+        t.join();
+    }
+    size_t total = 0;
+    for (int w = 0; w < nwriters; w++) {
+        total += ncreated[w];
+        BOOST_REQUIRE(ids[w] == ids[0]);
+    }
+    BOOST_REQUIRE_EQUAL(total, nnames);
+    BOOST_REQUIRE_EQUAL(matcher.get_series_id(), 1ul + nnames);
+    std::vector<SeriesMatcher::SeriesNameT> names;
+    matcher.pull_new_names(&names);
+    BOOST_REQUIRE_EQUAL(names.size(), nnames);
+    MetricName mname("cpu");
+    std::vector<TagValuePair> tags = { TagValuePair("zone=z1") };
+    IncludeIfAllTagsMatch query(mname, tags.begin(), tags.end());
+    BOOST_REQUIRE_EQUAL(matcher.search(query).size(), nnames/2);
+    // Malformed name is rejected
+    std::string bad = "cpu";
+    bool created = true;
+    auto hash = StringTools::hash(std::make_pair(bad.data(), static_cast<int>(bad.size())));
+    BOOST_REQUIRE_EQUAL(matcher.add_if_absent(bad.data(), bad.data() + bad.size(), hash, &created), 0ul);
+    BOOST_REQUIRE(!created);
+}
+
 BOOST_AUTO_TEST_CASE(Test_seriesmatcher_1) {
 
     LegacyStringPool spool;
@@ -182,6 +409,38 @@ BOOST_AUTO_TEST_CASE(Test_seriesparser_5) {
     BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
 }
 
+static std::string to_canonical(std::string const& series) {
+    char out[AKU_LIMITS_MAX_SNAME];
+    const char* pbegin = nullptr;
+    const char* pend = nullptr;
+    int status = SeriesParser::to_canonical_form(series.data(), series.data() + series.size(),
+                                                 out, out + AKU_LIMITS_MAX_SNAME, &pbegin, &pend);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    std::string result(static_cast<const char*>(out), pend);
+    BOOST_REQUIRE_EQUAL(result.substr(result.size() - (pend - pbegin)), std::string(pbegin, pend));
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesparser_7) {
+    // Keys with common prefix longer than eight bytes
+    BOOST_REQUIRE_EQUAL(to_canonical("m longprefix_b=2 longprefix_a=1 longprefix=0"),
+                        "m longprefix=0 longprefix_a=1 longprefix_b=2");
+    // Tags with the same key should preserve their order
+    BOOST_REQUIRE_EQUAL(to_canonical("m b=2 a=1 a=0"), "m a=1 a=0 b=2");
+    // Tabs are allowed inside metric name and tag value
+    BOOST_REQUIRE_EQUAL(to_canonical("m\tx b=1\ta=2"), "m\tx b=1\ta=2");
+    // Non-ascii characters are compared as signed chars
+    BOOST_REQUIRE_EQUAL(to_canonical("m b=1 \xc3\xa9=2 a=3"), "m \xc3\xa9=2 a=3 b=1");
+    // Large number of tags
+    std::string series = "m";
+    std::string expected = "m";
+    for (int i = 0; i < 20; i++) {
+        series   += " key" + std::to_string(200 - i) + "=" + std::to_string(i);
+        expected += " key" + std::to_string(181 + i) + "=" + std::to_string(19 - i);
+    }
+    BOOST_REQUIRE_EQUAL(to_canonical(series), expected);
+}
+
 BOOST_AUTO_TEST_CASE(Test_seriesparser_6) {
     const char* tags[] = {
         "tag2",
@@ -411,3 +670,798 @@ BOOST_AUTO_TEST_CASE(Test_index_4) {
         i++;
     }
 }
+
+BOOST_AUTO_TEST_CASE(Test_tag_value_pattern) {
+    auto strt = [](const char* s) { return std::make_pair(s, static_cast<u32>(std::strlen(s))); };
+    TagValuePattern glob(TagValuePattern::Kind::GLOB, "web-*.?");
+    BOOST_REQUIRE(glob.match(strt("web-1.a")));
+    BOOST_REQUIRE(glob.match(strt("web-.b")));
+    BOOST_REQUIRE(glob.match(strt("web-x.y.z")));
+    BOOST_REQUIRE(!glob.match(strt("web-1.ab")));
+    BOOST_REQUIRE(!glob.match(strt("db-1.a")));
+    BOOST_REQUIRE_EQUAL(fromstrt(glob.get_prefix()), "web-");
+
+    TagValuePattern regex(TagValuePattern::Kind::REGEX, "web-[0-9]+");
+    BOOST_REQUIRE(regex.match(strt("web-10")));
+    BOOST_REQUIRE(!regex.match(strt("web-10a")));
+    BOOST_REQUIRE_EQUAL(fromstrt(regex.get_prefix()), "web-");
+    BOOST_REQUIRE_EQUAL(fromstrt(TagValuePattern(TagValuePattern::Kind::REGEX, "webs?").get_prefix()), "web");
+    BOOST_REQUIRE_EQUAL(fromstrt(TagValuePattern(TagValuePattern::Kind::REGEX, "web|db").get_prefix()), "");
+
+    BOOST_REQUIRE_THROW(TagValuePattern(TagValuePattern::Kind::REGEX, "web-[0-9"), std::regex_error);
+}
+
+BOOST_AUTO_TEST_CASE(Test_index_pattern_query) {
+    SeriesMatcher matcher(1ul);
+    std::vector<std::string> expected;
+    for (int i = 0; i < 100; i++) {
+        std::string host = (i % 2 ? "web-" : "db-") + std::to_string(i);
+        std::string name = "cpu host=" + host + " zone=z" + std::to_string(i % 3);
+        matcher.add(name.data(), name.data() + name.size());
+        if (i % 2 && i % 3 == 1 && i < 50) {
+            expected.push_back(name);
+        }
+    }
+    std::map<std::string, std::vector<std::string>> tags = {
+        {"zone", {"z1"}},
+    };
+    std::map<std::string, TagValuePattern> patterns = {
+        {"host", TagValuePattern(TagValuePattern::Kind::REGEX, "web-[1-4]?[0-9]")},
+    };
+    IncludeMany2Many query("cpu", tags, patterns);
+    std::vector<std::string> actual;
+    for (auto tup: matcher.search(query)) {
+        actual.push_back(std::string(std::get<0>(tup), std::get<0>(tup) + std::get<1>(tup)));
+    }
+    std::sort(actual.begin(), actual.end());
+    std::sort(expected.begin(), expected.end());
+    BOOST_REQUIRE(actual == expected);
+
+    std::map<std::string, TagValuePattern> nomatch = {
+        {"host", TagValuePattern(TagValuePattern::Kind::GLOB, "app-*")},
+    };
+    IncludeMany2Many empty_query("cpu", tags, nomatch);
+    BOOST_REQUIRE(matcher.search(empty_query).empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_index_streaming_search) {
+    SeriesMatcher matcher(1ul);
+    const int nnames = 100000;
+    for (int i = 0; i < nnames; i++) {
+        std::string name = "cpu host=h" + std::to_string(i) + " zone=z" + std::to_string(i % 4);
+        matcher.add(name.data(), name.data() + name.size());
+    }
+    std::map<std::string, std::vector<std::string>> tags = {
+        {"zone", {"z1", "z2"}},
+    };
+    IncludeMany2Many query("cpu", tags);
+    auto expected = matcher.search(query);
+    BOOST_REQUIRE_EQUAL(expected.size(), nnames/2);
+    std::vector<SeriesMatcher::SeriesNameT> actual;
+    size_t nbatches = 0;
+    matcher.search(query, [&](std::vector<SeriesMatcher::SeriesNameT> const& batch) {
+        actual.insert(actual.end(), batch.begin(), batch.end());
+        nbatches++;
+        return true;
+    });
+    BOOST_REQUIRE(actual == expected);
+    BOOST_REQUIRE(nbatches > 1);
+    // Search stops when the sink returns false
+    nbatches = 0;
+    matcher.search(query, [&](std::vector<SeriesMatcher::SeriesNameT> const&) {
+        nbatches++;
+        return false;
+    });
+    BOOST_REQUIRE_EQUAL(nbatches, 1);
+}
+
+BOOST_AUTO_TEST_CASE(Test_index_cardinality_order) {
+    Index index;
+    for (int i = 0; i < 100; i++) {
+        std::string rack = i == 42 ? "rare" : "common";
+        std::string name = "cpu host=h" + std::to_string(i) + " rack=" + rack + " zone=z" + std::to_string(i % 2);
+        std::string alt = "mem host=h" + std::to_string(i) + " rack=" + rack;
+        index.append(name.data(), name.data() + name.size());
+        index.append(alt.data(), alt.data() + alt.size());
+    }
+    BOOST_REQUIRE_EQUAL(index.metric_cardinality(MetricName("cpu")), 100);
+    BOOST_REQUIRE_EQUAL(index.tagvalue_cardinality(TagValuePair("rack=rare")), 2);
+    BOOST_REQUIRE_EQUAL(index.tagvalue_cardinality(TagValuePair("zone=z0")), 50);
+    BOOST_REQUIRE_EQUAL(index.tagvalue_cardinality(TagValuePair("rack=none")), 0);
+
+    auto to_names = [](IndexQueryResults const& res) {
+        std::vector<std::string> names;
+        for (auto name: res) {
+            names.push_back(std::string(name.first, name.first + name.second));
+        }
+        return names;
+    };
+    // Order of the where clause doesn't change the result
+    std::vector<TagValuePair> tags = { TagValuePair("zone=z0"), TagValuePair("rack=rare") };
+    IncludeIfAllTagsMatch query(MetricName("cpu"), tags.begin(), tags.end());
+    auto names = to_names(query.query(index));
+    BOOST_REQUIRE_EQUAL(names.size(), 1);
+    BOOST_REQUIRE_EQUAL(names.at(0), "cpu host=h42 rack=rare zone=z0");
+
+    // Pair that doesn't match anything short-circuits the query
+    tags.push_back(TagValuePair("rack=none"));
+    IncludeIfAllTagsMatch empty_query(MetricName("cpu"), tags.begin(), tags.end());
+    BOOST_REQUIRE(to_names(empty_query.query(index)).empty());
+
+    std::vector<MetricName> metrics = { MetricName("cpu"), MetricName("mem") };
+    std::vector<TagValuePair> jtags = { TagValuePair("host=h42"), TagValuePair("rack=rare") };
+    JoinByTags join(metrics.begin(), metrics.end(), jtags.begin(), jtags.end());
+    names = to_names(join.query(index));
+    std::sort(names.begin(), names.end());
+    BOOST_REQUIRE_EQUAL(names.size(), 2);
+    BOOST_REQUIRE_EQUAL(names.at(0), "cpu host=h42 rack=rare zone=z0");
+    BOOST_REQUIRE_EQUAL(names.at(1), "mem host=h42 rack=rare");
+}
+
+BOOST_AUTO_TEST_CASE(Test_group_by_tag_incremental) {
+    SeriesMatcher matcher(1ul);
+    auto add = [&](std::string name) {
+        return matcher.add(name.data(), name.data() + name.size());
+    };
+    auto a1 = add("cpu host=a zone=1");
+    auto a2 = add("cpu host=a zone=2");
+    auto b1 = add("cpu host=b zone=1");
+    auto m1 = add("mem host=a zone=1");
+    auto z1 = add("cpu zone=3");
+
+    auto group = matcher.group_by("cpu", { "host" });
+    BOOST_REQUIRE(group == matcher.group_by("cpu", { "host" }));
+    auto map = group->get_dense_mapping();
+    auto local_name = [&](aku_ParamId id) {
+        auto str = group->local_matcher_.id2str(map->find(id));
+        return std::string(str.first, str.first + str.second);
+    };
+    BOOST_REQUIRE_EQUAL(local_name(a1), "cpu host=a");
+    BOOST_REQUIRE_EQUAL(map->find(a1), map->find(a2));
+    BOOST_REQUIRE_EQUAL(local_name(b1), "cpu host=b");
+    BOOST_REQUIRE_EQUAL(map->find(m1), 0);
+    BOOST_REQUIRE_EQUAL(map->find(z1), 0);
+
+    // Only new names are processed, previous snapshot is not modified
+    auto c1 = add("cpu host=c zone=1");
+    auto b2 = add("cpu host=b zone=2");
+    add("mem host=c zone=1");
+    BOOST_REQUIRE_EQUAL(map->find(c1), 0);
+    auto newmap = group->get_dense_mapping();
+    BOOST_REQUIRE(newmap != map);
+    map = newmap;
+    BOOST_REQUIRE_EQUAL(local_name(c1), "cpu host=c");
+    BOOST_REQUIRE_EQUAL(map->find(b2), map->find(b1));
+    BOOST_REQUIRE(group->get_dense_mapping() == map);
+    BOOST_REQUIRE_EQUAL(group->get_mapping().size(), 5);
+}
+
+static std::vector<std::string> to_strings(std::vector<StringT> const& strs) {
+    std::vector<std::string> res;
+    for (auto str: strs) {
+        res.push_back(std::string(str.first, str.first + str.second));
+    }
+    return res;
+}
+
+BOOST_AUTO_TEST_CASE(Test_index_suggest_prefix) {
+    SeriesMatcher matcher(1ul);
+    std::vector<std::string> expected_values;
+    for (int i = 999; i >= 0; i--) {
+        auto pod = "pod-" + std::to_string(i);
+        std::string name = "cpu." + std::to_string(i % 3) + " pod=" + pod + " host=h" + std::to_string(i % 7);
+        matcher.add(name.data(), name.data() + name.size());
+        if (pod.compare(0, 5, "pod-1") == 0) {
+            expected_values.push_back(pod);
+        }
+    }
+    std::string other = "mem pod=pod-1 zone=a";
+    matcher.add(other.data(), other.data() + other.size());
+    std::sort(expected_values.begin(), expected_values.end());
+
+    std::vector<std::string> metrics = { "cpu.0", "cpu.1", "cpu.2" };
+    BOOST_REQUIRE(to_strings(matcher.suggest_metric("cpu")) == metrics);
+    BOOST_REQUIRE(to_strings(matcher.suggest_metric("cpu.", 2)) == std::vector<std::string>(metrics.begin(), metrics.begin() + 2));
+    BOOST_REQUIRE_EQUAL(matcher.suggest_metric("").size(), 4);
+    BOOST_REQUIRE(matcher.suggest_metric("cpu.3").empty());
+
+    std::vector<std::string> tags = { "host", "pod" };
+    BOOST_REQUIRE(to_strings(matcher.suggest_tags("cpu.0", "")) == tags);
+    BOOST_REQUIRE(to_strings(matcher.suggest_tags("mem", "z")) == std::vector<std::string>({ "zone" }));
+    BOOST_REQUIRE(matcher.suggest_tags("disk", "").empty());
+
+    // Values of all metrics are sorted lexicographically
+    std::vector<std::string> values;
+    for (auto metric: metrics) {
+        auto res = to_strings(matcher.suggest_tag_values(metric, "pod", "pod-1"));
+        BOOST_REQUIRE(std::is_sorted(res.begin(), res.end()));
+        values.insert(values.end(), res.begin(), res.end());
+    }
+    std::sort(values.begin(), values.end());
+    BOOST_REQUIRE(values == expected_values);
+    auto first = to_strings(matcher.suggest_tag_values("cpu.1", "pod", "pod-1", 3));
+    std::vector<std::string> expected_first = { "pod-1", "pod-10", "pod-100" };
+    BOOST_REQUIRE(first == expected_first);
+    BOOST_REQUIRE(matcher.suggest_tag_values("cpu.1", "pod", "pod-x").empty());
+}
+
+static std::vector<u64> to_vector(CompressedPList const& plist) {
+    std::vector<u64> res;
+    for (auto it = plist.begin(); it != plist.end(); ++it) {
+        res.push_back(*it);
+    }
+    return res;
+}
+
+static void test_plist_operations(std::vector<u64> const& lhs, std::vector<u64> const& rhs) {
+    CompressedPList a, b;
+    for (auto x: lhs) {
+        a.add(x);
+    }
+    for (auto x: rhs) {
+        b.add(x);
+    }
+    std::set<u64> sa(lhs.begin(), lhs.end());
+    std::set<u64> sb(rhs.begin(), rhs.end());
+    BOOST_REQUIRE_EQUAL(a.cardinality(), sa.size());
+    auto va = to_vector(a);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(va.begin(), va.end(), sa.begin(), sa.end());
+
+    std::vector<u64> expected;
+    std::set_intersection(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expected));
+    auto actual = to_vector(a & b);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    BOOST_REQUIRE_EQUAL((a & b).cardinality(), expected.size());
+
+    expected.clear();
+    std::set_union(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expected));
+    actual = to_vector(a | b);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    BOOST_REQUIRE_EQUAL((a | b).cardinality(), expected.size());
+
+    expected.clear();
+    std::set_difference(sa.begin(), sa.end(), sb.begin(), sb.end(), std::back_inserter(expected));
+    actual = to_vector(a ^ b);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    BOOST_REQUIRE_EQUAL((a ^ b).cardinality(), expected.size());
+}
+
+BOOST_AUTO_TEST_CASE(Test_compressed_plist_0) {
+    std::mt19937 rng(42);
+    // Sparse lists (array containers), dense lists (bitmap containers) and mixed lists
+    std::vector<std::pair<u64, u64>> params = {
+        { 1000,    1ull << 24 },
+        { 100000,  1ull << 20 },
+        { 100000,  1ull << 17 },
+        { 10,      1ull << 18 },
+        { 200000,  1ull << 40 },
+    };
+    for (auto lp: params) {
+        for (auto rp: params) {
+            std::vector<u64> lhs, rhs;
+            for (u64 i = 0; i < lp.first; i++) {
+                lhs.push_back(rng() % lp.second);
+            }
+            for (u64 i = 0; i < rp.first; i++) {
+                rhs.push_back(rng() % rp.second);
+            }
+            // Ids are usually added in ascending order
+            std::sort(rhs.begin(), rhs.end());
+            test_plist_operations(lhs, rhs);
+        }
+    }
+}
+
+static std::vector<std::string> search_names(SeriesMatcher const& matcher, const char* metric, const char* tag) {
+    MetricName mname(metric);
+    std::vector<TagValuePair> tags = {
+        TagValuePair(tag)
+    };
+    IncludeIfAllTagsMatch query(mname, tags.begin(), tags.end());
+    std::vector<std::string> res;
+    for (auto tup: matcher.search(query)) {
+        res.push_back(std::string(std::get<0>(tup), std::get<0>(tup) + std::get<1>(tup)));
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static void write_snapshot(std::string const& path, SeriesMatcher& matcher) {
+    std::vector<PlainSeriesMatcher::SeriesNameT> names;
+    matcher.pull_new_names(&names);
+    IndexSnapshot snapshot(path);
+    BOOST_REQUIRE_EQUAL(snapshot.append(names), AKU_SUCCESS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_index_snapshot_0) {
+    auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    SeriesMatcher expected(10ul);
+    std::vector<std::string> names = {
+        "foo tagA=1 tagB=1",
+        "foo tagA=1 tagB=2",
+        "foo tagA=2 tagB=1",
+        "bar tagA=1 tagC=1",
+        "bar tagA=2 tagC=2",
+    };
+    for (auto name: names) {
+        expected.add(name.data(), name.data() + name.size());
+    }
+    // Two segments
+    write_snapshot(path, expected);
+    std::string last = "foo tagA=3 tagB=3";
+    expected.add(last.data(), last.data() + last.size());
+    names.push_back(last);
+    write_snapshot(path, expected);
+
+    {
+        SeriesMatcher actual(1ul);
+        IndexSnapshot snapshot(path);
+        BOOST_REQUIRE_EQUAL(snapshot.load(&actual, 100ul), 15ul);
+        for (auto name: names) {
+            BOOST_REQUIRE_EQUAL(actual.match(name.data(), name.data() + name.size()),
+                                expected.match(name.data(), name.data() + name.size()));
+        }
+        // Name added before the first query should be indexed alongside the loaded ones
+        std::string newname = "foo tagA=1 tagB=3";
+        actual._add(newname.data(), newname.data() + newname.size(), 16ul);
+        expected._add(newname.data(), newname.data() + newname.size(), 16ul);
+        BOOST_REQUIRE(search_names(actual, "foo", "tagA=1") == search_names(expected, "foo", "tagA=1"));
+        BOOST_REQUIRE_EQUAL(search_names(actual, "foo", "tagA=1").size(), 3);
+        BOOST_REQUIRE(search_names(actual, "bar", "tagC=2") == search_names(expected, "bar", "tagC=2"));
+        auto mactual = actual.suggest_metric("");
+        auto mexpected = expected.suggest_metric("");
+        BOOST_REQUIRE_EQUAL(mactual.size(), mexpected.size());
+        BOOST_REQUIRE_EQUAL(actual.suggest_tag_values("foo", "tagA", "").size(), 3);
+    }
+
+    // Damaged tail should be truncated
+    auto size = boost::filesystem::file_size(path);
+    {
+        std::ofstream out(path, std::ios::app|std::ios::binary);
+        out << "garbage";
+    }
+    {
+        SeriesMatcher actual(1ul);
+        IndexSnapshot snapshot(path);
+        BOOST_REQUIRE_EQUAL(snapshot.load(&actual, 100ul), 15ul);
+        BOOST_REQUIRE_EQUAL(search_names(actual, "foo", "tagA=2").size(), 1);
+    }
+    BOOST_REQUIRE_EQUAL(boost::filesystem::file_size(path), size);
+
+    // Snapshot is discarded if metadata storage doesn't have all the names
+    {
+        SeriesMatcher actual(1ul);
+        IndexSnapshot snapshot(path);
+        BOOST_REQUIRE_EQUAL(snapshot.load(&actual, 14ul), 0ul);
+        BOOST_REQUIRE_EQUAL(actual.match(last.data(), last.data() + last.size()), 0ul);
+    }
+    BOOST_REQUIRE_EQUAL(boost::filesystem::file_size(path), 0ul);
+    boost::filesystem::remove(path);
+}
+
+static std::vector<u64> plist_values(CompressedPList const& plist) {
+    std::vector<u64> result;
+    for (auto it = plist.begin(); it != plist.end(); ++it) {
+        result.push_back(*it);
+    }
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(Test_cm_sketch_merge_0) {
+    // Merged and deserialized partial sketches should be the same as the sketch
+    // that contains all values
+    const u32 M = 64;
+    CMSketch all(M), part1(M), part2(M), restored(M);
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<u64> keys(0, 1000000);
+    std::vector<u64> added;
+    for (u64 value = 1; value < 2000; value++) {
+        auto key = keys(gen);
+        added.push_back(key);
+        all.add(key, value * 3);
+        if (value % 3 == 0) {
+            part1.add(key, value * 3);
+        } else {
+            part2.add(key, value * 3);
+        }
+    }
+    std::vector<char> buffer;
+    part2.serialize(&buffer);
+    BOOST_REQUIRE(!buffer.empty());
+    BOOST_REQUIRE_EQUAL(restored.deserialize(buffer.data(), buffer.data() + buffer.size()), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(part1.merge(restored), AKU_SUCCESS);
+    for (auto key: added) {
+        auto expected = plist_values(all.extract(key));
+        auto actual = plist_values(part1.extract(key));
+        BOOST_REQUIRE(!expected.empty());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    }
+    // Sketches of different size can't be merged
+    CMSketch other(128);
+    BOOST_REQUIRE_EQUAL(part1.merge(other), AKU_EBAD_ARG);
+    BOOST_REQUIRE_EQUAL(other.deserialize(buffer.data(), buffer.data() + buffer.size()), AKU_EBAD_DATA);
+    // Damaged data is rejected
+    CMSketch damaged(M);
+    BOOST_REQUIRE_EQUAL(damaged.deserialize(buffer.data(), buffer.data() + buffer.size() - 1), AKU_EBAD_DATA);
+    buffer.push_back(0);
+    BOOST_REQUIRE_EQUAL(damaged.deserialize(buffer.data(), buffer.data() + buffer.size()), AKU_EBAD_DATA);
+}
+
+BOOST_AUTO_TEST_CASE(Test_hyperloglog_0) {
+    HyperLogLog small, large, merged;
+    for (u64 i = 0; i < 100; i++) {
+        small.add(HyperLogLog::mix(i));
+        small.add(HyperLogLog::mix(i));
+    }
+    // Small sets are counted exactly
+    BOOST_REQUIRE_EQUAL(small.estimate(), 100);
+    for (u64 i = 0; i < 100000; i++) {
+        large.add(HyperLogLog::mix(i + 50));
+    }
+    auto error = [](u64 estimate, double expected) {
+        return std::abs(static_cast<double>(estimate) - expected) / expected;
+    };
+    BOOST_REQUIRE_LT(error(large.estimate(), 100000), 0.1);
+    merged.merge(small);
+    merged.merge(large);
+    BOOST_REQUIRE_LT(error(merged.estimate(), 100050), 0.1);
+    small.merge(large);
+    BOOST_REQUIRE_EQUAL(small.estimate(), merged.estimate());
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_estimate_cardinality) {
+    auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    {
+        SeriesMatcher matcher(1ul);
+        for (int i = 0; i < 1000; i++) {
+            auto name = "cpu host=" + std::to_string(i) + " region=" + (i % 4 == 0 ? "eu" : "us");
+            matcher.add(name.data(), name.data() + name.size());
+        }
+        std::string mem = "mem host=0 region=eu";
+        matcher.add(mem.data(), mem.data() + mem.size());
+        matcher.add(mem.data(), mem.data() + mem.size());
+        auto error = [](u64 estimate, double expected) {
+            return std::abs(static_cast<double>(estimate) - expected) / expected;
+        };
+        BOOST_REQUIRE_LT(error(matcher.estimate_cardinality("cpu", {}), 1000), 0.1);
+        BOOST_REQUIRE_LT(error(matcher.estimate_cardinality("cpu", { "region=eu" }), 250), 0.1);
+        BOOST_REQUIRE_LT(error(matcher.estimate_cardinality("cpu", { "region=eu", "region=us" }), 1000), 0.1);
+        BOOST_REQUIRE_EQUAL(matcher.estimate_cardinality("mem", {}), 1);
+        BOOST_REQUIRE_EQUAL(matcher.estimate_cardinality("mem", { "region=us" }), 0);
+        BOOST_REQUIRE_EQUAL(matcher.estimate_cardinality("disk", {}), 0);
+        write_snapshot(path, matcher);
+    }
+    // Sketches are restored together with the posting lists
+    SeriesMatcher matcher(1ul);
+    IndexSnapshot snapshot(path);
+    BOOST_REQUIRE_EQUAL(snapshot.load(&matcher, 2000ul), 1002ul);
+    BOOST_REQUIRE_EQUAL(matcher.estimate_cardinality("mem", { "region=eu" }), 1);
+    BOOST_REQUIRE_GT(matcher.estimate_cardinality("cpu", {}), 900);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_add_batch) {
+    // Enough names for several ranges, names are not in canonical form
+    std::vector<std::pair<std::string, u64>> items;
+    for (u64 i = 0; i < 200000; i++) {
+        auto name = "cpu region=" + std::string(i % 4 == 0 ? "eu" : "us") + " host=" + std::to_string(i);
+        items.push_back(std::make_pair(name, 1024 + i));
+    }
+    // Duplicate name is indexed once
+    items.push_back(std::make_pair("cpu host=0 region=eu", 1024 + items.size()));
+    for (size_t nworkers: { 1u, 4u }) {
+        SeriesMatcher matcher(1ul);
+        matcher._add_batch(items, nworkers);
+        BOOST_REQUIRE_EQUAL(matcher.size(), items.size() - 1);
+        std::string name = "cpu host=5 region=us";
+        BOOST_REQUIRE_EQUAL(matcher.match(name.data(), name.data() + name.size()), 1029ul);
+        name = "cpu host=0 region=eu";
+        BOOST_REQUIRE_EQUAL(matcher.match(name.data(), name.data() + name.size()), items.back().second);
+        auto str = matcher.id2str(1024 + 199999);
+        BOOST_REQUIRE_EQUAL(std::string(str.first, str.first + str.second), "cpu host=199999 region=us");
+        MetricName mname("cpu");
+        std::vector<TagValuePair> tags = {
+            TagValuePair("region=eu")
+        };
+        IncludeIfAllTagsMatch query(mname, tags.begin(), tags.end());
+        BOOST_REQUIRE_EQUAL(matcher.search(query).size(), 50000);
+        BOOST_REQUIRE_EQUAL(matcher.suggest_metric("c").size(), 1);
+        // Names added later are indexed as usual
+        name = "cpu host=x region=eu";
+        matcher.add(name.data(), name.data() + name.size());
+        BOOST_REQUIRE_EQUAL(matcher.search(query).size(), 50001);
+    }
+    // Malformed name
+    SeriesMatcher matcher(1ul);
+    BOOST_REQUIRE_THROW(matcher._add_batch({ std::make_pair(std::string("cpu"), 1024ul) }, 1), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE(Test_compressed_plist_remove) {
+    std::mt19937 rng(42);
+    // Bitmap container (dense range) and array containers
+    std::set<u64> expected;
+    CompressedPList plist;
+    for (u64 i = 0; i < 10000; i++) {
+        expected.insert(i);
+    }
+    for (u64 i = 0; i < 1000; i++) {
+        expected.insert(rng() % (1ull << 30));
+    }
+    for (auto x: expected) {
+        plist.add(x);
+    }
+    std::vector<u64> values(expected.begin(), expected.end());
+    std::shuffle(values.begin(), values.end(), rng);
+    for (size_t i = 0; i < values.size()/2 + 100; i++) {
+        plist.remove(values[i]);
+        expected.erase(values[i]);
+    }
+    // Missing values are ignored
+    plist.remove(values[0]);
+    plist.remove(1ull << 40);
+    BOOST_REQUIRE_EQUAL(plist.cardinality(), expected.size());
+    auto actual = plist_values(plist);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    // Removed values can be added back
+    plist.add(values[0]);
+    expected.insert(values[0]);
+    actual = plist_values(plist);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    for (auto x: expected) {
+        plist.remove(x);
+    }
+    BOOST_REQUIRE_EQUAL(plist.cardinality(), 0);
+    BOOST_REQUIRE(plist.begin() == plist.end());
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_remove) {
+    auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    std::vector<std::string> names = {
+        "foo tagA=1 tagB=1",
+        "foo tagA=1 tagB=2",
+        "foo tagA=2 tagB=1",
+        "bar tagA=1 tagC=1",
+    };
+    {
+        SeriesMatcher matcher(10ul);
+        for (auto name: names) {
+            matcher.add(name.data(), name.data() + name.size());
+        }
+        write_snapshot(path, matcher);
+    }
+    // Posting lists loaded from the snapshot are not merged yet
+    SeriesMatcher matcher(1ul);
+    IndexSnapshot snapshot(path);
+    BOOST_REQUIRE_EQUAL(snapshot.load(&matcher, 100ul), 13ul);
+    matcher.series_id = 14ul;
+    std::vector<SeriesMatcher::SeriesNameT> removed;
+    matcher.remove({ 11ul, 12ul, 100ul }, &removed);
+    BOOST_REQUIRE_EQUAL(removed.size(), 2);
+    BOOST_REQUIRE_EQUAL(std::get<2>(removed.at(0)), 11ul);
+    BOOST_REQUIRE_EQUAL(std::string(std::get<0>(removed.at(0)), std::get<1>(removed.at(0))), names.at(1));
+    BOOST_REQUIRE_EQUAL(matcher.size(), 2);
+    BOOST_REQUIRE_EQUAL(matcher.match(names[1].data(), names[1].data() + names[1].size()), 0ul);
+    BOOST_REQUIRE(matcher.id2str(12ul).first == nullptr);
+    BOOST_REQUIRE((matcher.get_all_ids() == std::vector<u64>{ 10ul, 13ul }));
+    BOOST_REQUIRE((search_names(matcher, "foo", "tagA=1") == std::vector<std::string>{ names[0] }));
+    BOOST_REQUIRE(search_names(matcher, "foo", "tagA=2").empty());
+    std::string foo = "foo";
+    BOOST_REQUIRE_EQUAL(matcher.metric_cardinality(foo.data(), foo.data() + foo.size()), 1);
+
+    // Removed name gets new id
+    auto id = matcher.add(names[1].data(), names[1].data() + names[1].size());
+    BOOST_REQUIRE_EQUAL(id, 14ul);
+    BOOST_REQUIRE_EQUAL(matcher.match(names[1].data(), names[1].data() + names[1].size()), 14ul);
+    BOOST_REQUIRE_EQUAL(search_names(matcher, "foo", "tagA=1").size(), 2);
+
+    // Snapshot without removed names
+    std::vector<IndexSnapshot::SeriesT> live;
+    for (auto i: matcher.get_all_ids()) {
+        auto str = matcher.id2str(i);
+        live.push_back(std::make_tuple(str.first, str.second, i));
+    }
+    BOOST_REQUIRE_EQUAL(snapshot.rewrite(live), AKU_SUCCESS);
+    {
+        SeriesMatcher actual(1ul);
+        IndexSnapshot restored(path);
+        BOOST_REQUIRE_EQUAL(restored.load(&actual, 100ul), 14ul);
+        BOOST_REQUIRE_EQUAL(actual.size(), 3);
+        BOOST_REQUIRE(search_names(actual, "foo", "tagA=1") == search_names(matcher, "foo", "tagA=1"));
+        BOOST_REQUIRE(search_names(actual, "foo", "tagA=2").empty());
+    }
+    // Rewritten file can be appended
+    std::string last = "bar tagA=2 tagC=2";
+    matcher.add(last.data(), last.data() + last.size());
+    std::vector<PlainSeriesMatcher::SeriesNameT> added;
+    matcher.pull_new_names(&added);
+    BOOST_REQUIRE_EQUAL(snapshot.append({ added.back() }), AKU_SUCCESS);
+    {
+        SeriesMatcher actual(1ul);
+        IndexSnapshot restored(path);
+        BOOST_REQUIRE_EQUAL(restored.load(&actual, 100ul), 15ul);
+        BOOST_REQUIRE_EQUAL(actual.size(), 4);
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_search_concurrent_remove) {
+    SeriesMatcher matcher(1ul);
+    const int nnames = 50000;
+    for (int i = 0; i < nnames; i++) {
+        std::string name = "cpu host=h" + std::to_string(i);
+        matcher.add(name.data(), name.data() + name.size());
+    }
+    std::map<std::string, std::vector<std::string>> tags;
+    IncludeMany2Many query("cpu", tags);
+    auto all = matcher.search(query);
+    BOOST_REQUIRE_EQUAL(all.size(), nnames);
+    std::vector<u64> ids;
+    for (size_t i = nnames/2; i < all.size(); i++) {
+        ids.push_back(std::get<2>(all.at(i)));
+    }
+    {
+        // Names are removed after the index query is evaluated (the sink is
+        // called without the lock), removed names are skipped
+        SeriesMatcher other(1ul);
+        for (int i = 0; i < nnames; i++) {
+            std::string name = "cpu host=h" + std::to_string(i);
+            other.add(name.data(), name.data() + name.size());
+        }
+        std::vector<SeriesMatcher::SeriesNameT> actual;
+        bool first = true;
+        other.search(query, [&](std::vector<SeriesMatcher::SeriesNameT> const& batch) {
+            if (first) {
+                std::vector<SeriesMatcher::SeriesNameT> removed;
+                other.remove(ids, &removed);
+                BOOST_REQUIRE_EQUAL(removed.size(), ids.size());
+                first = false;
+            }
+            actual.insert(actual.end(), batch.begin(), batch.end());
+            return true;
+        });
+        // First shard is resolved before the names are removed
+        BOOST_REQUIRE_EQUAL(actual.size(), nnames/2);
+        for (auto const& item: actual) {
+            BOOST_REQUIRE(std::get<2>(item) != 0);
+        }
+    }
+    // Search and remove run concurrently
+    std::thread remover([&]() {
+        for (auto id: ids) {
+            std::vector<SeriesMatcher::SeriesNameT> removed;
+            matcher.remove({ id }, &removed);
+        }
+    });
+    size_t last = nnames;
+    for (int i = 0; i < 10; i++) {
+        auto res = matcher.search(query);
+        BOOST_REQUIRE(res.size() <= last);
+        last = res.size();
+    }
+    remover.join();
+    BOOST_REQUIRE_EQUAL(matcher.search(query).size(), nnames/2);
+}
+
+BOOST_AUTO_TEST_CASE(Test_seriesmatcher_resident_metrics) {
+    auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    std::vector<std::string> names = {
+        "foo tagA=1 tagB=1",
+        "foo tagA=1 tagB=2",
+        "bar tagA=1 tagC=1",
+        "bar tagA=2 tagC=1",
+        "baz tagA=1",
+    };
+    {
+        SeriesMatcher matcher(10ul);
+        for (auto name: names) {
+            matcher.add(name.data(), name.data() + name.size());
+        }
+        write_snapshot(path, matcher);
+    }
+    SeriesMatcher matcher(1ul);
+    matcher.set_resident_limit(2);
+    IndexSnapshot snapshot(path);
+    BOOST_REQUIRE_EQUAL(snapshot.load(&matcher, 100ul), 14ul);
+    matcher.series_id = 15ul;
+    // Nothing is indexed before the first query
+    std::string foo = "foo";
+    BOOST_REQUIRE_EQUAL(matcher.metric_cardinality(foo.data(), foo.data() + foo.size()), 2);
+    BOOST_REQUIRE_EQUAL(matcher.suggest_metric("").size(), 3);
+    auto stats = matcher.get_resident_stats();
+    BOOST_REQUIRE_EQUAL(stats.metrics, 3);
+    BOOST_REQUIRE_EQUAL(stats.resident, 0);
+
+    BOOST_REQUIRE((search_names(matcher, "foo", "tagA=1") == std::vector<std::string>{ names[0], names[1] }));
+    BOOST_REQUIRE((search_names(matcher, "bar", "tagA=1") == std::vector<std::string>{ names[2] }));
+    BOOST_REQUIRE_EQUAL(matcher.get_resident_stats().resident, 2);
+    // Least recently queried metric is evicted
+    BOOST_REQUIRE((search_names(matcher, "foo", "tagB=2") == std::vector<std::string>{ names[1] }));
+    BOOST_REQUIRE((search_names(matcher, "baz", "tagA=1") == std::vector<std::string>{ names[4] }));
+    stats = matcher.get_resident_stats();
+    BOOST_REQUIRE_EQUAL(stats.resident, 2);
+    BOOST_REQUIRE_EQUAL(stats.materialized, 3);
+    BOOST_REQUIRE_EQUAL(stats.evicted, 1);
+    BOOST_REQUIRE_EQUAL(matcher.suggest_tags("foo", "").size(), 2);
+
+    // Names of the evicted metric are indexed again on next query
+    std::string name = "bar tagA=1 tagC=2";
+    matcher.add(name.data(), name.data() + name.size());
+    BOOST_REQUIRE((search_names(matcher, "bar", "tagA=1") == std::vector<std::string>{ names[2], name }));
+    BOOST_REQUIRE_EQUAL(matcher.suggest_tag_values("bar", "tagC", "").size(), 2);
+    stats = matcher.get_resident_stats();
+    BOOST_REQUIRE_EQUAL(stats.resident, 2);
+    BOOST_REQUIRE_EQUAL(stats.evicted, 2);
+
+    // Removed names are dropped from the metric
+    std::vector<SeriesMatcher::SeriesNameT> removed;
+    matcher.remove({ 12ul }, &removed);
+    BOOST_REQUIRE_EQUAL(removed.size(), 1);
+    BOOST_REQUIRE((search_names(matcher, "bar", "tagA=1") == std::vector<std::string>{ name }));
+    std::string bar = "bar";
+    BOOST_REQUIRE_EQUAL(matcher.metric_cardinality(bar.data(), bar.data() + bar.size()), 2);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(Test_hash_ring_0) {
+    HashRing ring;
+    const char* series = "cpu host=A region=B";
+    aku_Status status;
+    std::string owner;
+    std::tie(status, owner) = ring.route(series, series + strlen(series));
+    BOOST_REQUIRE_EQUAL(status, AKU_ENOT_FOUND);
+
+    BOOST_REQUIRE(ring.add_node("node0"));
+    BOOST_REQUIRE(ring.add_node("node1"));
+    BOOST_REQUIRE(ring.add_node("node2"));
+    BOOST_REQUIRE(!ring.add_node("node1"));
+
+    // Order of tags doesn't matter
+    const char* other = "cpu  region=B host=A";
+    std::string other_owner;
+    std::tie(status, owner) = ring.route(series, series + strlen(series));
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    std::tie(status, other_owner) = ring.route(other, other + strlen(other));
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(owner, other_owner);
+
+    const char* invalid = "cpu";
+    std::tie(status, owner) = ring.route(invalid, invalid + strlen(invalid));
+    BOOST_REQUIRE_NE(status, AKU_SUCCESS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_hash_ring_1) {
+    HashRing ring;
+    const int NNODES = 4;
+    const int NSERIES = 10000;
+    for (int i = 0; i < NNODES; i++) {
+        ring.add_node("node" + std::to_string(i));
+    }
+    std::vector<std::string> owners;
+    std::map<std::string, int> counts;
+    for (int i = 0; i < NSERIES; i++) {
+        auto name = "cpu host=" + std::to_string(i);
+        aku_Status status;
+        std::string owner;
+        std::tie(status, owner) = ring.route(name.data(), name.data() + name.size());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        owners.push_back(owner);
+        counts[owner]++;
+    }
+    // Series are distributed evenly
+    BOOST_REQUIRE_EQUAL(counts.size(), static_cast<size_t>(NNODES));
+    for (auto const& kv: counts) {
+        BOOST_REQUIRE_GT(kv.second, NSERIES / NNODES / 2);
+    }
+    // Only the series of the removed node are moved
+    ring.remove_node("node1");
+    for (int i = 0; i < NSERIES; i++) {
+        auto name = "cpu host=" + std::to_string(i);
+        aku_Status status;
+        std::string owner;
+        std::tie(status, owner) = ring.route(name.data(), name.data() + name.size());
+        BOOST_REQUIRE_NE(owner, "node1");
+        if (owners.at(i) != "node1") {
+            BOOST_REQUIRE_EQUAL(owner, owners.at(i));
+        }
+    }
+}
@@ -1,10 +1,13 @@
 #include <iostream>
+#include <map>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/trim.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
 
 #include "ingestion_pipeline.h"
 #include "protocolparser.h"
@@ -38,6 +41,19 @@ struct ConsumerMock : DbSession {
         throw "Not implemented";
     }
 
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "Not implemented";
+    }
+
     virtual int param_id_to_series(aku_ParamId id, char* buf, size_t sz) override {
         auto str = std::to_string(id);
         assert(str.size() <= sz);
@@ -164,6 +180,39 @@ BOOST_AUTO_TEST_CASE(Test_protocol_parse_2) {
     parser.close();
 }
 
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_server_timestamps) {
+    const char *messages = "+1\r\n+\r\n+1.0\r\n+2\r\n:42\r\n+2.0\r\n+3\r\n+\r\n+3.0\r\n";
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+
+    // Timestamp is required by default
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, messages, strlen(messages));
+    BOOST_REQUIRE_THROW(parser.parse_next(buf, static_cast<u32>(strlen(messages))), StreamError);
+
+    RESPProtocolParser sparser(cons);
+    sparser.start();
+    sparser.set_server_timestamps(RESPProtocolParser::ServerTimestamps::PER_BATCH);
+    for (int i = 0; i < 2; i++) {
+        sparser.begin_batch();
+        buf = sparser.get_next_buffer();
+        memcpy(buf, messages, strlen(messages));
+        sparser.parse_next(buf, static_cast<u32>(strlen(messages)));
+    }
+    sparser.close();
+
+    BOOST_REQUIRE_EQUAL(cons->ts_.size(), 6);
+    // Explicit timestamps are used as is
+    BOOST_REQUIRE_EQUAL(cons->ts_[1], 42);
+    BOOST_REQUIRE_EQUAL(cons->ts_[4], 42);
+    // Samples of the batch get consecutive timestamps, next batch doesn't go back
+    BOOST_REQUIRE(cons->ts_[0] > 42);
+    BOOST_REQUIRE_EQUAL(cons->ts_[2], cons->ts_[0] + 1);
+    BOOST_REQUIRE(cons->ts_[3] > cons->ts_[2]);
+    BOOST_REQUIRE_EQUAL(cons->ts_[5], cons->ts_[3] + 1);
+}
+
 BOOST_AUTO_TEST_CASE(Test_protocol_parse_error_format) {
     const char *messages = "+1\r\n:2\r\n+34.5\r\n+2\r\n:d\r\n+8.9\r\n";
     std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
@@ -309,6 +358,7 @@ struct NameCheckingConsumer : DbSession {
 
     int called_;
     int num_calls_expected_;
+    int nlookups_ = 0;
 
     std::map<u64, std::string> series;
     std::map<std::string, u64> index;
@@ -363,6 +413,19 @@ struct NameCheckingConsumer : DbSession {
         throw "Not implemented";
     }
 
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "Not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "Not implemented";
+    }
+
     virtual int param_id_to_series(aku_ParamId id, char* buf, size_t sz) override {
         if (series.count(id)) {
             std::string expected = series[id];
@@ -374,6 +437,7 @@ struct NameCheckingConsumer : DbSession {
     }
 
     virtual aku_Status series_to_param_id(const char* begin, size_t sz, aku_Sample* sample) override {
+        nlookups_++;
         std::string name(begin, begin + sz);
         if (index.count(name)) {
             sample->paramid = index[name];
@@ -419,6 +483,330 @@ BOOST_AUTO_TEST_CASE(Test_protocol_parse_series_name_error_no_carriage_return_2)
 }
 
 
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_aliases) {
+    const char *message = "*2\r\n:1\r\n+10\r\n"
+                          "*2\r\n:2\r\n+20|21\r\n"
+                          ":1\r\n:3\r\n+1.5\r\n"
+                          ":2\r\n:4\r\n*2\r\n+2.5\r\n+3.5\r\n"
+                          "*2\r\n:1\r\n+30\r\n"
+                          ":1\r\n:5\r\n+4.5\r\n";
+
+    auto pred = [] (std::shared_ptr<ConsumerMock> cons) {
+        BOOST_REQUIRE_EQUAL(cons->param_.size(), 4);
+        std::vector<aku_ParamId> ids = { 10, 20, 21, 30 };
+        std::vector<aku_Timestamp> ts = { 3, 4, 4, 5 };
+        std::vector<double> xs = { 1.5, 2.5, 3.5, 4.5 };
+        for (size_t i = 0; i < 4; i++) {
+            BOOST_REQUIRE_EQUAL(cons->param_[i], ids[i]);
+            BOOST_REQUIRE_EQUAL(cons->ts_[i], ts[i]);
+            BOOST_REQUIRE_EQUAL(cons->data_[i], xs[i]);
+        }
+    };
+
+    size_t msglen = strlen(message);
+    for (int i = 0; i < 100; i++) {
+        size_t pivot1 = 1 + static_cast<size_t>(rand()) % (msglen / 2);
+        size_t pivot2 = 1+ static_cast<size_t>(rand()) % (msglen - pivot1 - 2) + pivot1;
+        std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+        find_framing_issues<RESPProtocolParser>(message, msglen, pivot1, pivot2, pred, cons);
+    }
+}
+
+struct LookupCountingConsumer : ConsumerMock {
+    int nlookups_ = 0;
+
+    virtual int name_to_param_id_list(const char* begin, const char* end, aku_ParamId* ids, u32 cap) override {
+        nlookups_++;
+        return ConsumerMock::name_to_param_id_list(begin, end, ids, cap);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_compound_name_cache) {
+    const char *message = "+1|2|3\r\n:10\r\n*3\r\n:7\r\n+2.5\r\n:9\r\n"
+                          "+4\r\n:10\r\n+1.5\r\n"
+                          "+1|2|3\r\n:11\r\n*3\r\n+8\r\n:3\r\n+9.5\r\n";
+    std::shared_ptr<LookupCountingConsumer> cons(new LookupCountingConsumer());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    size_t msglen = strlen(message);
+    memcpy(buf, message, msglen);
+    parser.parse_next(buf, static_cast<u32>(msglen));
+    parser.close();
+
+    // Every name is resolved only once
+    BOOST_REQUIRE_EQUAL(cons->nlookups_, 2);
+    std::vector<aku_ParamId> ids = { 1, 2, 3, 4, 1, 2, 3 };
+    std::vector<aku_Timestamp> ts = { 10, 10, 10, 10, 11, 11, 11 };
+    std::vector<double> xs = { 7, 2.5, 9, 1.5, 8, 3, 9.5 };
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_[i], ids[i]);
+        BOOST_REQUIRE_EQUAL(cons->ts_[i], ts[i]);
+        BOOST_REQUIRE_EQUAL(cons->data_[i], xs[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_unknown_alias) {
+    const char *message = "*2\r\n:1\r\n+10\r\n:2\r\n:3\r\n+1.5\r\n";
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, message, strlen(message));
+    BOOST_REQUIRE_THROW(parser.parse_next(buf, static_cast<u32>(strlen(message))), ProtocolParserError);
+}
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_ack) {
+    const char *message = "+1\r\n:2\r\n+3.5\r\n"
+                          "*2\r\n+ack\r\n:10\r\n"
+                          "+4\r\n:5\r\n+6.5\r\n"
+                          "*2\r\n+ack\r\n:11\r\n";
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    // Request is acknowledged only when it's received completely
+    size_t pivot = strlen(message) - 3;
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, message, pivot);
+    auto response = parser.parse_next(buf, static_cast<u32>(pivot));
+    BOOST_REQUIRE(response.is_available());
+    BOOST_REQUIRE_EQUAL(response.get_body(), ":10\r\n");
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 2);
+
+    buf = parser.get_next_buffer();
+    memcpy(buf, message + pivot, 3);
+    response = parser.parse_next(buf, 3);
+    BOOST_REQUIRE(response.is_available());
+    BOOST_REQUIRE_EQUAL(response.get_body(), ":11\r\n");
+
+    // Nothing to acknowledge
+    std::string points = "+7\r\n:8\r\n+9.5\r\n";
+    buf = parser.get_next_buffer();
+    memcpy(buf, points.data(), points.size());
+    response = parser.parse_next(buf, static_cast<u32>(points.size()));
+    BOOST_REQUIRE(!response.is_available());
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_ack_bad_command) {
+    const char *message = "*2\r\n+nack\r\n:10\r\n";
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, message, strlen(message));
+    BOOST_REQUIRE_THROW(parser.parse_next(buf, static_cast<u32>(strlen(message))), ProtocolParserError);
+}
+
+
+//                                    //
+//   Binary protocol tests            //
+//                                    //
+
+struct BinaryMessage {
+    std::string data;
+
+    BinaryMessage() : data("AKUI") {}
+
+    template<class T>
+    void put(T value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void dict(u32 id, std::string name) {
+        data.push_back('D');
+        put(static_cast<u32>(sizeof(u32) + name.size()));
+        put(id);
+        data.append(name);
+    }
+
+    void points(u32 id, std::vector<u64> ts, std::vector<double> xs) {
+        data.push_back('P');
+        put(static_cast<u32>(2*sizeof(u32) + (ts.size() + xs.size())*sizeof(u64)));
+        put(id);
+        put(static_cast<u32>(ts.size()));
+        for (auto t: ts) {
+            put(t);
+        }
+        for (auto x: xs) {
+            put(x);
+        }
+    }
+
+    void ack(u64 seq) {
+        data.push_back('A');
+        put(static_cast<u32>(sizeof(u64)));
+        put(seq);
+    }
+};
+
+static BinaryMessage make_binary_message() {
+    BinaryMessage msg;
+    msg.dict(7, "10");
+    msg.dict(8, "20|21");
+    msg.points(7, { 1, 2 }, { 1.5, 2.5 });
+    msg.points(8, { 3 }, { 3.5, 4.5 });
+    return msg;
+}
+
+static void check_binary_message(std::shared_ptr<ConsumerMock> cons) {
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 4);
+    std::vector<aku_ParamId> ids = { 10, 10, 20, 21 };
+    std::vector<aku_Timestamp> ts = { 1, 2, 3, 3 };
+    std::vector<double> xs = { 1.5, 2.5, 3.5, 4.5 };
+    for (size_t i = 0; i < 4; i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_[i], ids[i]);
+        BOOST_REQUIRE_EQUAL(cons->ts_[i], ts[i]);
+        BOOST_REQUIRE_EQUAL(cons->data_[i], xs[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_binary) {
+    auto msg = make_binary_message();
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, msg.data.data(), msg.data.size());
+    parser.parse_next(buf, static_cast<u32>(msg.data.size()));
+    parser.close();
+    check_binary_message(cons);
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_binary_ack) {
+    auto msg = make_binary_message();
+    msg.ack(100);
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, msg.data.data(), msg.data.size());
+    auto response = parser.parse_next(buf, static_cast<u32>(msg.data.size()));
+    parser.close();
+    check_binary_message(cons);
+    BOOST_REQUIRE(response.is_available());
+    BOOST_REQUIRE_EQUAL(response.get_body(), ":100\r\n");
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_binary_framing) {
+    auto msg = make_binary_message();
+    size_t msglen = msg.data.size();
+    // First pivot can split the magic
+    for (size_t pivot1 = 1; pivot1 < msglen - 1; pivot1++) {
+        size_t pivot2 = pivot1 + 1 + static_cast<size_t>(rand()) % (msglen - pivot1 - 1);
+        std::shared_ptr<ConsumerMock> cons(new ConsumerMock);
+        find_framing_issues<RESPProtocolParser>(msg.data.data(), msglen, pivot1, pivot2, &check_binary_message, cons);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_binary_unknown_id) {
+    BinaryMessage msg;
+    msg.dict(1, "10");
+    msg.points(2, { 1 }, { 1.0 });
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, msg.data.data(), msg.data.size());
+    BOOST_REQUIRE_THROW(parser.parse_next(buf, static_cast<u32>(msg.data.size())), ProtocolParserError);
+}
+
+//                                    //
+//   ReadBuffer tests                 //
+//                                    //
+
+//! Feed the message to the parser using pieces of random size
+template<class Protocol>
+void feed_in_pieces(Protocol& parser, const char* message, size_t msglen) {
+    size_t pos = 0;
+    while (pos < msglen) {
+        size_t size = std::min(msglen - pos, 1 + static_cast<size_t>(rand()) % Protocol::RDBUF_SIZE);
+        auto buf = parser.get_next_buffer();
+        memcpy(buf, message + pos, size);
+        parser.parse_next(buf, static_cast<u32>(size));
+        pos += size;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_chunk_boundaries) {
+    // Message is much larger than the chunk so many lines are split between chunks
+    std::string message;
+    const int N = 10000;
+    for (int i = 0; i < N; i++) {
+        message += "+" + std::to_string(i) + "\r\n:" + std::to_string(i) + "\r\n+" + std::to_string(i) + ".5\r\n";
+    }
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    feed_in_pieces(parser, message.data(), message.size());
+    parser.close();
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), N);
+    for (int i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_[i], i);
+        BOOST_REQUIRE_EQUAL(cons->ts_[i], i);
+        BOOST_REQUIRE_EQUAL(cons->data_[i], i + 0.5);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_protocol_parser_binary_large_frame) {
+    // Frame is larger than the chunk
+    const u32 N = 5000;
+    std::vector<u64> ts;
+    std::vector<double> xs;
+    for (u32 i = 0; i < N; i++) {
+        ts.push_back(i);
+        xs.push_back(i*0.5);
+    }
+    BinaryMessage msg;
+    msg.dict(1, "10");
+    msg.points(1, ts, xs);
+    std::shared_ptr<ConsumerMock> cons(new ConsumerMock());
+    RESPProtocolParser parser(cons);
+    parser.start();
+    feed_in_pieces(parser, msg.data.data(), msg.data.size());
+    parser.close();
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), N);
+    for (u32 i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_[i], 10);
+        BOOST_REQUIRE_EQUAL(cons->ts_[i], ts[i]);
+        BOOST_REQUIRE_EQUAL(cons->data_[i], xs[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_read_buffer_releases_chunks) {
+    const size_t BUFSZ = 0x100;
+    ReadBuffer rdbuf(BUFSZ);
+    BOOST_REQUIRE_EQUAL(rdbuf._get_nchunks(), 0);
+    // Fill several chunks, the line spans all of them
+    std::string line(BUFSZ*10, 'x');
+    line += "\n";
+    size_t pos = 0;
+    while (pos < line.size()) {
+        auto size = std::min(line.size() - pos, BUFSZ);
+        auto buf = rdbuf.pull();
+        memcpy(buf, line.data() + pos, size);
+        rdbuf.push(buf, static_cast<u32>(size));
+        pos += size;
+    }
+    BOOST_REQUIRE(rdbuf._get_nchunks() > 1);
+    std::vector<Byte> out(line.size());
+    auto res = rdbuf.read_line(out.data(), out.size());
+    BOOST_REQUIRE_EQUAL(res, static_cast<int>(line.size()));
+    BOOST_REQUIRE(std::string(out.begin(), out.end()) == line);
+    // Partially consumed buffer holds only the last chunk
+    auto buf = rdbuf.pull();
+    memcpy(buf, "abc", 3);
+    rdbuf.push(buf, 3);
+    rdbuf.consume();
+    BOOST_REQUIRE_EQUAL(rdbuf._get_nchunks(), 1);
+    BOOST_REQUIRE_EQUAL(rdbuf.available(), 3);
+    BOOST_REQUIRE_EQUAL(rdbuf.get(), 'a');
+    rdbuf.discard();
+    BOOST_REQUIRE_EQUAL(rdbuf.read(out.data(), 3), 3);
+    rdbuf.consume();
+    BOOST_REQUIRE_EQUAL(rdbuf._get_nchunks(), 0);
+}
+
 //                                    //
 //   OpenTSDB protocol parser tests   //
 //                                    //
@@ -479,6 +867,33 @@ BOOST_AUTO_TEST_CASE(Test_opentsdb_protocol_parse_2) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(Test_opentsdb_protocol_name_cache) {
+    std::string messages =
+        "put test 1 1.0 tag=1\n"
+        "put test 1 2.0 tag=2\n"
+        "put test 2 3.0 tag=1\n"
+        "put test 2 4.0 tag=2 \n"
+        "put  test 3 5.0 tag=1\n";
+    std::vector<std::string> expected_names = { "test tag=1", "test tag=2" };
+    std::vector<int> expected_ix = { 0, 1, 0, 1, 0 };
+    std::shared_ptr<NameCheckingConsumer> cons(new NameCheckingConsumer(expected_names, -1));
+    OpenTSDBProtocolParser parser(cons);
+    parser.start();
+    for (int i = 0; i < 2; i++) {
+        auto buf = parser.get_next_buffer();
+        memcpy(buf, messages.data(), messages.size());
+        parser.parse_next(buf, static_cast<u32>(messages.size()));
+    }
+    parser.close();
+
+    // Every series is resolved only once
+    BOOST_REQUIRE_EQUAL(cons->nlookups_, 2);
+    BOOST_REQUIRE_EQUAL(cons->ids.size(), 10);
+    for (size_t i = 0; i < cons->ids.size(); i++) {
+        BOOST_REQUIRE_EQUAL(cons->ids.at(i), cons->index[expected_names.at(expected_ix.at(i % 5))]);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(Test_open_tsdb_protocol_parser_framing) {
 
     const char *message = "put test 10001 34.57 tag1=1 tag2=1\n"
@@ -522,3 +937,170 @@ BOOST_AUTO_TEST_CASE(Test_open_tsdb_protocol_parser_framing) {
         find_framing_issues<OpenTSDBProtocolParser>(message, msglen, pivot1, pivot2, pred, cons);
     }
 }
+
+BOOST_AUTO_TEST_CASE(Test_opentsdb_protocol_version_ack) {
+    std::string messages =
+        "put test 2 34.5 tag=1\n"
+        "version\n"
+        "put test 7 89.0 tag=2\n"
+        "version\n";
+    std::vector<std::string> expected_names = { "test tag=1", "test tag=2" };
+    std::shared_ptr<NameCheckingConsumer> cons(new NameCheckingConsumer(expected_names, 2));
+    OpenTSDBProtocolParser parser(cons);
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, messages.data(), messages.size());
+    parser.start();
+    auto response = parser.parse_next(buf, static_cast<u32>(messages.size()));
+    parser.close();
+
+    // Both data points should be written and both commands should get the response
+    BOOST_REQUIRE_EQUAL(cons->ids.size(), 2);
+    BOOST_REQUIRE(response.is_available());
+    auto body = response.get_body();
+    size_t nresp = 0;
+    for (size_t pos = body.find("net.opentsdb"); pos != std::string::npos; pos = body.find("net.opentsdb", pos + 1)) {
+        nresp++;
+    }
+    BOOST_REQUIRE_EQUAL(nresp, 2);
+    BOOST_REQUIRE_EQUAL(body.back(), '\n');
+}
+
+//! Assigns ids to the series names, compound names are split
+struct SeriesIndexConsumer : ConsumerMock {
+    std::map<std::string, aku_ParamId> index;
+    int nlookups_ = 0;
+
+    aku_ParamId get_id(std::string const& name) {
+        auto it = index.find(name);
+        if (it == index.end()) {
+            it = index.insert(std::make_pair(name, static_cast<aku_ParamId>(index.size() + 1))).first;
+        }
+        return it->second;
+    }
+
+    virtual int name_to_param_id_list(const char* begin, const char* end, aku_ParamId* ids, u32 cap) override {
+        nlookups_++;
+        std::string name(begin, end);
+        auto space = name.find(' ');
+        if (space == std::string::npos) {
+            return -1;
+        }
+        std::string tags = name.substr(space);
+        std::vector<std::string> metrics;
+        boost::algorithm::split(metrics, name.substr(0, space), boost::is_any_of("|"));
+        if (metrics.size() > cap) {
+            return -1;
+        }
+        for (size_t i = 0; i < metrics.size(); i++) {
+            ids[i] = get_id(metrics[i] + tags);
+        }
+        return static_cast<int>(metrics.size());
+    }
+};
+
+template<class Parser>
+void parse_lines(Parser& parser, std::string const& messages) {
+    auto buf = parser.get_next_buffer();
+    memcpy(buf, messages.data(), messages.size());
+    parser.parse_next(buf, static_cast<u32>(messages.size()));
+}
+
+BOOST_AUTO_TEST_CASE(Test_influx_protocol_parse_1) {
+    std::string messages =
+        "cpu,host=A,region=NW user=8.11,sys=12.6,idle=79i 1418197423000000000\n"
+        "# comment\n"
+        "\n"
+        "cpu,host=B user=1.5,state=\"busy, ok\",up=true 1418197424000000000\r\n"
+        "cpu,host=A,region=NW user=9.5,sys=11.2,idle=80i 1418197425000000000\n";
+    std::shared_ptr<SeriesIndexConsumer> cons(new SeriesIndexConsumer());
+    InfluxProtocolParser parser(cons);
+    parser.start();
+    parse_lines(parser, messages);
+    parser.close();
+
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 8);
+    std::vector<std::string> names = {
+        "cpu.user host=A region=NW",
+        "cpu.sys host=A region=NW",
+        "cpu.idle host=A region=NW",
+        "cpu.user host=B",
+        "cpu.up host=B",
+        "cpu.user host=A region=NW",
+        "cpu.sys host=A region=NW",
+        "cpu.idle host=A region=NW",
+    };
+    std::vector<double> values = { 8.11, 12.6, 79, 1.5, 1.0, 9.5, 11.2, 80 };
+    std::vector<aku_Timestamp> ts = {
+        1418197423000000000ul, 1418197423000000000ul, 1418197423000000000ul,
+        1418197424000000000ul, 1418197424000000000ul,
+        1418197425000000000ul, 1418197425000000000ul, 1418197425000000000ul,
+    };
+    for (size_t i = 0; i < names.size(); i++) {
+        BOOST_REQUIRE_EQUAL(cons->param_.at(i), cons->index.at(names.at(i)));
+        BOOST_REQUIRE_EQUAL(cons->data_.at(i), values.at(i));
+        BOOST_REQUIRE_EQUAL(cons->ts_.at(i), ts.at(i));
+    }
+    // Every line is resolved at once, the last line hits the cache
+    BOOST_REQUIRE_EQUAL(cons->nlookups_, 2);
+}
+
+BOOST_AUTO_TEST_CASE(Test_influx_protocol_parse_errors) {
+    std::vector<std::string> messages = {
+        "cpu,host=A\n",
+        "cpu,host=A user\n",
+        "cpu,host=A user=abc 1\n",
+        "cpu,host=A user=1 12abc\n",
+        "cpu,host=A user=\"unterminated 1\n",
+        "cpu\\ load,host=A user=1 1\n",
+    };
+    for (auto const& msg: messages) {
+        std::shared_ptr<SeriesIndexConsumer> cons(new SeriesIndexConsumer());
+        InfluxProtocolParser parser(cons);
+        parser.start();
+        BOOST_REQUIRE_THROW(parse_lines(parser, msg), ProtocolParserError);
+        // Bad line is skipped, the rest of the stream can be parsed
+        parse_lines(parser, "cpu,host=A user=1 1\n");
+        BOOST_REQUIRE_EQUAL(cons->param_.size(), 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_graphite_protocol_parse_1) {
+    std::string messages =
+        "servers.A.cpu 8.11 1418197423\n"
+        "cpu.user;host=A;region=NW 1.5 1418197424.5\r\n"
+        "servers.A.cpu 9.5 1418197425\n";
+    std::shared_ptr<SeriesIndexConsumer> cons(new SeriesIndexConsumer());
+    GraphiteProtocolParser parser(cons);
+    parser.start();
+    parse_lines(parser, messages);
+    parser.close();
+
+    BOOST_REQUIRE_EQUAL(cons->param_.size(), 3);
+    BOOST_REQUIRE_EQUAL(cons->param_.at(0), cons->index.at("servers.A.cpu source=graphite"));
+    BOOST_REQUIRE_EQUAL(cons->param_.at(1), cons->index.at("cpu.user host=A region=NW"));
+    BOOST_REQUIRE_EQUAL(cons->param_.at(2), cons->param_.at(0));
+    BOOST_REQUIRE_EQUAL(cons->ts_.at(0), 1418197423000000000ul);
+    BOOST_REQUIRE_EQUAL(cons->ts_.at(1), 1418197424500000000ul);
+    BOOST_REQUIRE_EQUAL(cons->data_.at(0), 8.11);
+    BOOST_REQUIRE_EQUAL(cons->data_.at(1), 1.5);
+    BOOST_REQUIRE_EQUAL(cons->nlookups_, 2);
+}
+
+BOOST_AUTO_TEST_CASE(Test_graphite_protocol_parser_framing) {
+    std::string message =
+        "test.a 34.57 10001\n"
+        "test.b 81.09 10002\n"
+        "test.c 12.13 10003\n"
+        "test.a 16.71 10004\n";
+    for (size_t pivot = 1; pivot < message.size(); pivot++) {
+        std::shared_ptr<SeriesIndexConsumer> cons(new SeriesIndexConsumer());
+        GraphiteProtocolParser parser(cons);
+        parser.start();
+        parse_lines(parser, message.substr(0, pivot));
+        parse_lines(parser, message.substr(pivot));
+        BOOST_REQUIRE_EQUAL(cons->param_.size(), 4);
+        BOOST_REQUIRE_EQUAL(cons->param_.at(3), cons->param_.at(0));
+        BOOST_REQUIRE_EQUAL(cons->ts_.at(3), 10004*1000000000ul);
+        BOOST_REQUIRE_EQUAL(cons->data_.at(2), 12.13);
+    }
+}
@@ -7,8 +7,11 @@
 #include <boost/test/unit_test.hpp>
 #include <vector>
 #include <thread>
+#include <algorithm>
+#include <chrono>
 
 #include "query_results_pooler.h"
+#include "dtoa.h"
 
 using namespace Akumuli;
 
@@ -16,6 +19,8 @@ struct CursorMock : DbCursor {
 
     constexpr static const double floatval = 3.1415;
     bool isdone_ = false;
+    std::string profile_;
+    std::string resume_token_;
 
     size_t read(void *dest, size_t dest_size) {
         return read_impl((aku_Sample*)dest, dest_size);
@@ -58,9 +63,66 @@ struct CursorMock : DbCursor {
     }
 
     void close() {}
+
+    std::string get_profile() {
+        return profile_;
+    }
+
+    std::string get_resume_token() {
+        return resume_token_;
+    }
+};
+
+//! Cursor that returns `nsamples_` samples, records prefetch limits
+struct StreamCursorMock : DbCursor {
+    size_t nsamples_;
+    size_t pos_ = 0;
+    std::vector<size_t> prefetch_;
+
+    StreamCursorMock(size_t n) : nsamples_(n) {}
+
+    size_t read(void *dest, size_t dest_size) {
+        aku_Sample* out = static_cast<aku_Sample*>(dest);
+        size_t n = std::min(dest_size / sizeof(aku_Sample), nsamples_ - pos_);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = {};
+            out[i].paramid = 1;
+            out[i].timestamp = pos_++;
+            out[i].payload.size = sizeof(aku_Sample);
+            out[i].payload.type = AKU_PAYLOAD_FLOAT;
+            out[i].payload.float64 = 1.0;
+        }
+        return n*sizeof(aku_Sample);
+    }
+
+    int is_done() {
+        return pos_ == nsamples_;
+    }
+
+    bool is_error(aku_Status *out_error_code_or_null) {
+        if (out_error_code_or_null) {
+            *out_error_code_or_null = AKU_SUCCESS;
+        }
+        return false;
+    }
+
+    void close() {}
+
+    std::string get_profile() {
+        return std::string();
+    }
+
+    std::string get_resume_token() {
+        return std::string();
+    }
+
+    void set_prefetch(size_t nbytes) {
+        prefetch_.push_back(nbytes);
+    }
 };
 
 struct SessionMock : DbSession {
+    std::shared_ptr<StreamCursorMock> stream_;
 
     aku_Status write(const aku_Sample &sample) {
         return AKU_SUCCESS;
@@ -70,7 +132,14 @@ struct SessionMock : DbSession {
     }
 
     std::shared_ptr<DbCursor> query(std::string query) {
-        return std::make_shared<CursorMock>();
+        if (stream_) {
+            return stream_;
+        }
+        auto cursor = std::make_shared<CursorMock>();
+        if (query.find("profile") != std::string::npos) {
+            cursor->profile_ = "{\"exec_ns\": 100}";
+        }
+        return cursor;
     }
 
     std::shared_ptr<DbCursor> suggest(std::string query) {
@@ -81,6 +150,26 @@ struct SessionMock : DbSession {
         return std::make_shared<CursorMock>();
     }
 
+    std::shared_ptr<DbCursor> subscribe(std::string query) {
+        return std::make_shared<CursorMock>();
+    }
+
+    std::shared_ptr<DbPreparedQuery> prepare(std::string query, aku_Status* status) {
+        *status = AKU_SUCCESS;
+        return std::make_shared<DbPreparedQuery>();
+    }
+
+    std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery> query, aku_Timestamp begin, aku_Timestamp end) {
+        return std::make_shared<CursorMock>();
+    }
+
+    std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery> query, aku_Timestamp begin, aku_Timestamp end,
+                                   std::string resume_token) {
+        auto cursor = std::make_shared<CursorMock>();
+        cursor->resume_token_ = resume_token + "next";
+        return cursor;
+    }
+
     int param_id_to_series(aku_ParamId id, char *buffer, size_t buffer_size) {
         std::string strid = std::to_string(id);
         if (strid.size() < buffer_size) {
@@ -105,16 +194,24 @@ struct ConnectionMock : DbConnection
         return "{}";
     }
 
+    virtual std::string get_metrics() override {
+        return "";
+    }
+
     virtual std::shared_ptr<DbSession> create_session() override {
         return std::make_shared<SessionMock>();
     }
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string) override {
+        return std::make_shared<SessionMock>();
+    }
 };
 
 using namespace Akumuli;
 
 BOOST_AUTO_TEST_CASE(Test_query_cursor) {
 
-    std::string expected = "+33\r\n+20141210T074243.111999000\r\n+3.1415000000000002\r\n+44\r\n+20141210T122434.999111000\r\n+3.1415000000000002\r\n";
+    std::string expected = "+33\r\n+20141210T074243.111999000\r\n+3.1415\r\n+44\r\n+20141210T122434.999111000\r\n+3.1415\r\n";
     std::shared_ptr<DbSession> session;
     session.reset(new SessionMock());
     char buffer[0x1000];
@@ -129,3 +226,199 @@ BOOST_AUTO_TEST_CASE(Test_query_cursor) {
     auto actual = std::string(buffer, buffer + len);
     BOOST_REQUIRE_EQUAL(expected, actual);
 }
+
+BOOST_AUTO_TEST_CASE(Test_query_cursor_profile) {
+
+    std::string results = "+33\r\n+20141210T074243.111999000\r\n+3.1415\r\n+44\r\n+20141210T122434.999111000\r\n+3.1415\r\n";
+    std::string trailer = "+{\"profile\": {\"exec_ns\": 100, \"format_ns\": ";
+    std::shared_ptr<DbSession> session;
+    session.reset(new SessionMock());
+    char buffer[48];
+    QueryResultsPooler cursor(session, 1000, ApiEndpoint::QUERY);
+    std::string query = "{\"profile\": true}";
+    cursor.append(query.data(), query.size());
+    cursor.start();
+    std::string actual;
+    size_t len;
+    bool done = false;
+    while (!done) {
+        std::tie(len, done) = cursor.read_some(buffer, sizeof(buffer));
+        actual += std::string(buffer, buffer + len);
+    }
+    // Profile is sent after the results
+    BOOST_REQUIRE_EQUAL(actual.substr(0, results.size()), results);
+    BOOST_REQUIRE_EQUAL(actual.substr(results.size(), trailer.size()), trailer);
+    BOOST_REQUIRE_EQUAL(actual.substr(actual.size() - 4), "}}\r\n");
+}
+
+BOOST_AUTO_TEST_CASE(Test_query_cursor_resume_token) {
+
+    std::string results = "+33\r\n+20141210T074243.111999000\r\n+3.1415\r\n+44\r\n+20141210T122434.999111000\r\n+3.1415\r\n";
+    std::shared_ptr<DbSession> session;
+    session.reset(new SessionMock());
+    char buffer[48];
+    auto prepared = std::make_shared<DbPreparedQuery>();
+    QueryResultsPooler cursor(session, 1000, prepared, "{}");
+    std::string body = "{\"range\": {\"from\": \"20141210T000000\", \"to\": \"20141211T000000\"}, \"resume\": \"abc\"}";
+    cursor.append(body.data(), body.size());
+    cursor.start();
+    std::string actual;
+    size_t len;
+    bool done = false;
+    while (!done) {
+        std::tie(len, done) = cursor.read_some(buffer, sizeof(buffer));
+        actual += std::string(buffer, buffer + len);
+    }
+    // Token of the next poll is sent after the results
+    BOOST_REQUIRE_EQUAL(actual, results + "+{\"resume\": \"abcnext\"}\r\n");
+}
+
+BOOST_AUTO_TEST_CASE(Test_query_cursor_binary_output) {
+
+    std::shared_ptr<DbSession> session;
+    session.reset(new SessionMock());
+    std::vector<char> buffer(0x1000);
+    QueryResultsPooler cursor(session, 1000, ApiEndpoint::QUERY);
+    std::string query = "{\"output\": { \"format\": \"binary\" }}";
+    cursor.append(query.data(), query.size());
+    cursor.start();
+    std::string actual;
+    size_t len;
+    bool done = false;
+    while (!done) {
+        std::tie(len, done) = cursor.read_some(buffer.data(), buffer.size());
+        actual += std::string(buffer.data(), buffer.data() + len);
+    }
+
+    aku_Sample sample;
+    aku_parse_timestamp("20141210T074243.111999", &sample);
+    aku_Timestamp ts1 = sample.timestamp;
+    aku_parse_timestamp("20141210T122434.999111", &sample);
+    aku_Timestamp ts2 = sample.timestamp;
+
+    std::string expected = "AKUB";
+    auto append = [&](const void* data, size_t size) {
+        expected += std::string(static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    };
+    auto append_block = [&](u64 id, aku_Timestamp ts) {
+        u32 len = 2;
+        u32 n = 1;
+        double value = CursorMock::floatval;
+        std::string name = std::to_string(id);
+        expected += 'S';
+        append(&id, sizeof(id));
+        append(&len, sizeof(len));
+        expected += name;
+        expected += 'F';
+        append(&id, sizeof(id));
+        append(&n, sizeof(n));
+        append(&ts, sizeof(ts));
+        append(&value, sizeof(value));
+    };
+    append_block(33, ts1);
+    append_block(44, ts2);
+    BOOST_REQUIRE_EQUAL(expected.size(), actual.size());
+    BOOST_REQUIRE(expected == actual);
+}
+
+BOOST_AUTO_TEST_CASE(Test_chunk_size_controller) {
+    // Time is simulated, the client drains every chunk in `drain` microseconds
+    ChunkSizeController::TimePoint now;
+    auto drain = [&](int usec) {
+        now += std::chrono::microseconds(usec);
+    };
+    ChunkSizeController chunk;
+    size_t size = chunk.next(now);
+    BOOST_REQUIRE_EQUAL(size, static_cast<size_t>(ChunkSizeController::MIN_CHUNK));
+    // Empty chunks are not measured
+    chunk.produced(0, now);
+    drain(20000);
+    BOOST_REQUIRE_EQUAL(chunk.next(now), size);
+    // Fast client
+    for (int i = 0; i < 10; i++) {
+        chunk.produced(size, now);
+        drain(10);
+        auto next = chunk.next(now);
+        BOOST_REQUIRE(next >= size);
+        size = next;
+    }
+    BOOST_REQUIRE(size > static_cast<size_t>(ChunkSizeController::MAX_CHUNK) / 2);
+    BOOST_REQUIRE_EQUAL(chunk.prefetch(), size*ChunkSizeController::PREFETCH_CHUNKS);
+    // Slow client
+    for (int i = 0; i < 3; i++) {
+        chunk.produced(ChunkSizeController::MIN_CHUNK, now);
+        drain(50000);
+        auto next = chunk.next(now);
+        BOOST_REQUIRE(next < size);
+        size = next;
+    }
+    BOOST_REQUIRE(size >= static_cast<size_t>(ChunkSizeController::MIN_CHUNK));
+    // Client that drains the chunk in exactly FLUSH_INTERVAL_US keeps the chunk size
+    chunk.produced(size, now);
+    drain(ChunkSizeController::FLUSH_INTERVAL_US);
+    BOOST_REQUIRE_EQUAL(chunk.next(now), size);
+}
+
+BOOST_AUTO_TEST_CASE(Test_query_cursor_adaptive_chunks) {
+    const size_t N = 100000;
+    auto session = std::make_shared<SessionMock>();
+    session->stream_ = std::make_shared<StreamCursorMock>(N);
+    std::vector<char> buffer(0x10000);
+    QueryResultsPooler cursor(session, 0x100000, ApiEndpoint::QUERY);
+    std::string query = "{\"output\": { \"format\": \"csv\" }}";
+    cursor.append(query.data(), query.size());
+    cursor.start();
+    std::vector<size_t> sizes;
+    size_t nlines = 0;
+    size_t len;
+    bool done = false;
+    while (!done) {
+        std::tie(len, done) = cursor.read_some(buffer.data(), buffer.size());
+        nlines += std::count(buffer.begin(), buffer.begin() + len, '\n');
+        if (len) {
+            sizes.push_back(len);
+        }
+    }
+    BOOST_REQUIRE_EQUAL(nlines, N);
+    // First chunk is small, the consumer is fast so the next ones are larger
+    BOOST_REQUIRE(sizes.front() <= static_cast<size_t>(ChunkSizeController::MIN_CHUNK));
+    BOOST_REQUIRE(*std::max_element(sizes.begin(), sizes.end()) > static_cast<size_t>(ChunkSizeController::MIN_CHUNK));
+    // Prefetch limit follows the chunk size
+    auto const& prefetch = session->stream_->prefetch_;
+    BOOST_REQUIRE(prefetch.size() > 1);
+    BOOST_REQUIRE_EQUAL(prefetch.front(), static_cast<size_t>(ChunkSizeController::MIN_CHUNK*ChunkSizeController::PREFETCH_CHUNKS));
+    BOOST_REQUIRE(prefetch.back() > prefetch.front());
+}
+
+BOOST_AUTO_TEST_CASE(Test_dtoa_roundtrip) {
+    std::vector<std::pair<double, std::string>> expected = {
+        { 0.0,       "0" },
+        { -0.0,      "-0" },
+        { 1.0,       "1" },
+        { -42.0,     "-42" },
+        { 0.1,       "0.1" },
+        { 0.05,      "0.05" },
+        { 3.1415,    "3.1415" },
+        { -123.625,  "-123.625" },
+        { 1e14,      "100000000000000" },
+        { 0.1 + 0.2, "0.30000000000000004" },
+        { 1e-7,      "9.9999999999999995e-08" },
+        { 1e300,     "1.0000000000000001e+300" },
+    };
+    char buffer[0x100];
+    for (auto const& kv: expected) {
+        int len = dtoa(kv.first, buffer, sizeof(buffer));
+        BOOST_REQUIRE(len > 0);
+        BOOST_REQUIRE_EQUAL(std::string(buffer, buffer + len), kv.second);
+    }
+    // Random values should be parsed back to the same value
+    std::vector<double> values = { M_PI, M_E, 1.0/3.0, 2.0/3.0, 123456.789, 1e-4, 99999999999999.9 };
+    for (auto value: values) {
+        int len = dtoa(value, buffer, sizeof(buffer));
+        BOOST_REQUIRE(len > 0);
+        BOOST_REQUIRE_EQUAL(strtod(std::string(buffer, buffer + len).c_str(), nullptr), value);
+    }
+    // Not enough space
+    BOOST_REQUIRE_EQUAL(dtoa(3.1415, buffer, 5), -1);
+    BOOST_REQUIRE_EQUAL(dtoa(3.1415, buffer, 6), 6);
+}
@@ -278,3 +278,19 @@ BOOST_AUTO_TEST_CASE(Test_respstream_read_array_cant_parse) {
     RESPStream resp(&stream);
     BOOST_CHECK_THROW(resp.read_array_size(), RESPError);
 }
+
+BOOST_AUTO_TEST_CASE(Test_respstream_parse_decimal) {
+
+    const char* inputs[] = { "3.14159", "-0.5", "+42", "100.", ".25", "123456789.123456" };
+    for (auto str: inputs) {
+        double value;
+        BOOST_REQUIRE(parse_decimal(str, str + strlen(str), &value));
+        BOOST_REQUIRE_EQUAL(value, strtod(str, nullptr));
+    }
+    // Fallback to strtod is required
+    const char* fallback[] = { "1e10", "", "-", ".", "1.2.3", "nan", "12345678901234567890", "9007199254740993" };
+    for (auto str: fallback) {
+        double value;
+        BOOST_REQUIRE(!parse_decimal(str, str + strlen(str), &value));
+    }
+}
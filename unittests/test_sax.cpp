@@ -57,3 +57,42 @@ BOOST_AUTO_TEST_CASE(Test_encoding) {
     BOOST_REQUIRE_EQUAL_COLLECTIONS(words.begin(), words.end(), expected.begin(), expected.end());
 }
 
+
+BOOST_AUTO_TEST_CASE(Test_batch_encoding) {
+    // Batch encoding should produce the same words as the sample by sample encoding
+    const int width = 10;
+    std::mt19937 gen(3);
+    std::normal_distribution<double> dist(0.0, 1.0);
+    std::vector<double> input;
+    for (int i = 0; i < 1000; i++) {
+        input.push_back(i % 50 < 25 ? dist(gen) : 1.0);
+    }
+    SAXEncoder single(8, width);
+    std::vector<std::string> expected;
+    std::vector<size_t> expected_indexes;
+    for (size_t i = 0; i < input.size(); i++) {
+        std::string w;
+        w.resize(width);
+        if (single.encode(input[i], &w[0], w.size())) {
+            expected.push_back(w);
+            expected_indexes.push_back(i);
+        }
+    }
+    for (size_t batch_size: { 1ul, 3ul, 9ul, 10ul, 64ul, 1000ul }) {
+        SAXEncoder batch(8, width);
+        std::vector<std::string> words;
+        std::vector<size_t> indexes;
+        std::vector<char> outwords(batch_size*width);
+        std::vector<size_t> outindexes(batch_size);
+        for (size_t pos = 0; pos < input.size(); pos += batch_size) {
+            size_t size = std::min(batch_size, input.size() - pos);
+            auto nwords = batch.encode(input.data() + pos, size, outwords.data(), outindexes.data());
+            for (size_t i = 0; i < nwords; i++) {
+                words.emplace_back(outwords.data() + i*width, outwords.data() + (i + 1)*width);
+                indexes.push_back(pos + outindexes[i]);
+            }
+        }
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(words.begin(), words.end(), expected.begin(), expected.end());
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(indexes.begin(), indexes.end(), expected_indexes.begin(), expected_indexes.end());
+    }
+}
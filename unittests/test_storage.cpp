@@ -4,15 +4,45 @@
 #define BOOST_TEST_MODULE Main
 #include <boost/test/unit_test.hpp>
 #include <vector>
+#include <map>
+#include <set>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "queryprocessor_framework.h"
 #include "metadatastorage.h"
 #include "storage2.h"
+#include "resume_token.h"
+#include "cursor.h"
 #include "query_processing/queryparser.h"
+#include "query_processing/scale.h"
+#include "query_processing/absolute.h"
+#include "query_processing/rate.h"
+#include "query_processing/limiter.h"
+#include "query_processing/top.h"
+#include "query_processing/spacesaver.h"
+#include "query_processing/sax.h"
+#include "query_processing/anomaly.h"
+#include "query_processing/sliding_window.h"
 
 #include "akumuli.h"
 #include "log_iface.h"
 #include "status_util.h"
+#include "metrics.h"
+#include "storage_engine/checkpoint.h"
+#include "storage_engine/hotlist.h"
+#include "storage_engine/backup.h"
 
 // To initialize apr and sqlite properly
 #include <apr.h>
@@ -93,7 +123,7 @@ BOOST_AUTO_TEST_CASE(Test_metadata_storage_numeric_config) {
     const char* creation_datetime = "2015-02-03 00:00:00";  // Formatting not required
     const char* bstore_type = "FixedSizeFileStorage";
     const char* db_name = "db_test";
-    db.init_config(db_name, creation_datetime, bstore_type);
+    db.init_config(db_name, creation_datetime, bstore_type, 16);
     std::string actual_dt;
     bool success = db.get_config_param("creation_datetime", &actual_dt);
     BOOST_REQUIRE(success);
@@ -106,6 +136,51 @@ BOOST_AUTO_TEST_CASE(Test_metadata_storage_numeric_config) {
     success = db.get_config_param("db_name", &actual_db_name);
     BOOST_REQUIRE(success);
     BOOST_REQUIRE_EQUAL(db_name, actual_db_name);
+    std::string actual_fanout;
+    success = db.get_config_param("nbtree_fanout", &actual_fanout);
+    BOOST_REQUIRE(success);
+    BOOST_REQUIRE_EQUAL("16", actual_fanout);
+}
+
+BOOST_AUTO_TEST_CASE(Test_metadata_storage_incremental_sync) {
+
+    MetadataStorage db(":memory:");
+    const u64 N = 100;
+    const size_t MAX_RESCUE_POINTS = 30;
+    std::vector<std::string> names;
+    for (u64 id = 1; id <= N; id++) {
+        // Names are not escaped by sqlite, prepared statements should be used
+        names.push_back("test key='" + std::to_string(id) + "'");
+        db.add_rescue_point(id, std::vector<u64>{ id, ~0ull, id*10 });
+    }
+    auto pull_names = [&names](std::vector<MetadataStorage::SeriesT>* items) {
+        u64 id = 1;
+        for (auto const& name: names) {
+            items->push_back(std::make_tuple(name.data(), static_cast<int>(name.size()), id++));
+        }
+        names.clear();
+    };
+    std::unordered_map<u64, std::vector<u64>> mapping;
+    size_t nsyncs = 0;
+    while (db.wait_for_sync_request(0) == AKU_SUCCESS) {
+        db.sync_with_metadata_storage(pull_names, MAX_RESCUE_POINTS);
+        nsyncs++;
+        mapping.clear();
+        BOOST_REQUIRE_EQUAL(db.load_rescue_points(mapping), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(mapping.size(), std::min(nsyncs*MAX_RESCUE_POINTS, static_cast<size_t>(N)));
+    }
+    BOOST_REQUIRE_EQUAL(nsyncs, (N + MAX_RESCUE_POINTS - 1) / MAX_RESCUE_POINTS);
+    for (u64 id = 1; id <= N; id++) {
+        std::vector<u64> expected = { id, ~0ull, id*10 };
+        auto actual = mapping.at(id);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), expected.begin(), expected.end());
+    }
+    PlainSeriesMatcher matcher;
+    BOOST_REQUIRE_EQUAL(db.load_matcher_data(matcher), AKU_SUCCESS);
+    for (u64 id = 1; id <= N; id++) {
+        std::string name = "test key='" + std::to_string(id) + "'";
+        BOOST_REQUIRE_EQUAL(matcher.match(name.data(), name.data() + name.size()), id);
+    }
 }
 
 BOOST_AUTO_TEST_CASE(Test_storage_add_series_1) {
@@ -235,6 +310,8 @@ struct CursorMock : InternalCursor {
     bool done;
     std::vector<aku_Sample> samples;
     aku_Status error;
+    std::string profile;
+    std::string resume_token;
 
     CursorMock() {
         done = false;
@@ -263,6 +340,20 @@ struct CursorMock : InternalCursor {
         done = true;
         error = error_code;
     }
+
+    virtual void set_profile(std::string const& p) override {
+        if (done) {
+            BOOST_FAIL("Cursor invariant broken");
+        }
+        profile = p;
+    }
+
+    virtual void set_resume_token(std::string const& t) override {
+        if (done) {
+            BOOST_FAIL("Cursor invariant broken");
+        }
+        resume_token = t;
+    }
 };
 
 std::string make_scan_query(aku_Timestamp begin, aku_Timestamp end, OrderBy order) {
@@ -415,6 +506,399 @@ BOOST_AUTO_TEST_CASE(Test_storage_query) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(Test_storage_write_batch) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+        "test key=2",
+        "test key=3",
+    };
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    std::vector<aku_ParamId> ids;
+    for (auto name: series_names) {
+        aku_Sample s;
+        auto status = session->init_series_id(name.data(), name.data() + name.size(), &s);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        ids.push_back(s.paramid);
+    }
+    // Samples of different series are interleaved
+    const aku_Timestamp N = 10000;
+    std::vector<aku_Sample> batch;
+    for (aku_Timestamp ts = 100; ts < N; ts++) {
+        for (auto id: ids) {
+            aku_Sample s;
+            s.paramid = id;
+            s.timestamp = ts;
+            s.payload.type = AKU_PAYLOAD_FLOAT;
+            s.payload.float64 = double(ts)/10.0;
+            batch.push_back(s);
+        }
+        if (batch.size() >= 100) {
+            auto status = session->write_batch(batch.data(), batch.size());
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            batch.clear();
+        }
+    }
+    // Late write in the middle of the batch shouldn't prevent other samples from being written
+    aku_Sample late;
+    late.paramid = ids.at(0);
+    late.timestamp = 1;
+    late.payload.type = AKU_PAYLOAD_FLOAT;
+    late.payload.float64 = 0.;
+    batch.insert(batch.begin(), late);
+    auto status = session->write_batch(batch.data(), batch.size());
+    BOOST_REQUIRE_EQUAL(status, AKU_ELATE_WRITE);
+
+    CursorMock cursor;
+    auto query = make_scan_query(100, N, OrderBy::SERIES);
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), (N - 100)*ids.size());
+    size_t ix = 0;
+    for (auto id: ids) {
+        for (aku_Timestamp ts = 100; ts < N; ts++) {
+            auto const& sample = cursor.samples.at(ix++);
+            if (sample.paramid != id || sample.timestamp != ts) {
+                BOOST_REQUIRE_EQUAL(sample.paramid, id);
+                BOOST_REQUIRE_EQUAL(sample.timestamp, ts);
+            }
+            BOOST_REQUIRE_EQUAL(sample.payload.float64, double(ts)/10.0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_import_series) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test   key=1",  // should be normalized
+    };
+    auto storage = create_storage();
+    const aku_Timestamp N = 10000;
+    std::vector<aku_Timestamp> tss;
+    std::vector<double> xss;
+    for (aku_Timestamp ts = 100; ts < N; ts++) {
+        tss.push_back(ts);
+        xss.push_back(double(ts)/10.0);
+    }
+    for (auto name: series_names) {
+        auto status = storage->import_series(name.data(), name.data() + name.size(),
+                                             tss.data(), xss.data(), tss.size());
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    // Overlapping range shouldn't be imported
+    auto status = storage->import_series(series_names[0].data(), series_names[0].data() + series_names[0].size(),
+                                         tss.data(), xss.data(), tss.size());
+    BOOST_REQUIRE_EQUAL(status, AKU_ELATE_WRITE);
+
+    auto session = storage->create_write_session();
+    std::vector<aku_ParamId> ids;
+    for (auto name: series_names) {
+        aku_Sample s;
+        auto status = session->init_series_id(name.data(), name.data() + name.size(), &s);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        ids.push_back(s.paramid);
+    }
+    BOOST_REQUIRE(ids.at(0) != ids.at(1));
+
+    CursorMock cursor;
+    auto query = make_scan_query(0, N, OrderBy::SERIES);
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), tss.size()*ids.size());
+    size_t ix = 0;
+    for (auto id: ids) {
+        for (size_t i = 0; i < tss.size(); i++) {
+            auto const& sample = cursor.samples.at(ix++);
+            if (sample.paramid != id || sample.timestamp != tss[i]) {
+                BOOST_REQUIRE_EQUAL(sample.paramid, id);
+                BOOST_REQUIRE_EQUAL(sample.timestamp, tss[i]);
+            }
+            BOOST_REQUIRE_EQUAL(sample.payload.float64, xss[i]);
+        }
+    }
+}
+
+static std::string make_group_aggregate_query(aku_Timestamp begin, aku_Timestamp end, aku_Timestamp step) {
+    std::stringstream str;
+    str << "{ \"group-aggregate\": { \"metric\": \"test\", \"step\": \"" << step << "n\", ";
+    str << "\"func\": [ \"count\", \"sum\", \"min\", \"max\" ] }, ";
+    str << "\"range\": { \"from\": " << begin << ", \"to\": " << end << "} }";
+    return str.str();
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_series_limit) {
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    auto init = [&](std::string name) {
+        aku_Sample s;
+        return session->init_series_id(name.data(), name.data() + name.size(), &s);
+    };
+    BOOST_REQUIRE_EQUAL(init("cpu key=0"), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(storage->set_series_limit("cpu key=0", 2), AKU_EBAD_ARG);
+    // Existing series are counted
+    BOOST_REQUIRE_EQUAL(storage->set_series_limit("cpu", 2), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(init("cpu key=1"), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(init("cpu key=2"), AKU_ESERIES_LIMIT);
+    // Existing series can be written and other metrics are not limited
+    BOOST_REQUIRE_EQUAL(init("cpu key=0"), AKU_SUCCESS);
+    auto other = storage->create_write_session();
+    aku_Sample s;
+    std::string name = "cpu   key=1";
+    BOOST_REQUIRE_EQUAL(other->init_series_id(name.data(), name.data() + name.size(), &s), AKU_SUCCESS);
+    for (int i = 0; i < 10; i++) {
+        BOOST_REQUIRE_EQUAL(init("mem key=" + std::to_string(i)), AKU_SUCCESS);
+    }
+    auto stats = storage->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("series.count"), 12);
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("series.rejected"), 1);
+    // Limit can be removed
+    BOOST_REQUIRE_EQUAL(storage->set_series_limit("cpu", 0), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(init("cpu key=2"), AKU_SUCCESS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_memory_limit) {
+    auto storage = create_storage();
+    auto before = storage->get_memory_use();
+    auto session = storage->create_write_session();
+    for (int i = 0; i < 100; i++) {
+        aku_Sample s;
+        std::string name = "test key=" + std::to_string(i);
+        BOOST_REQUIRE_EQUAL(session->init_series_id(name.data(), name.data() + name.size(), &s), AKU_SUCCESS);
+        s.payload.type = AKU_PAYLOAD_FLOAT;
+        s.payload.float64 = i;
+        s.timestamp = 100;
+        BOOST_REQUIRE_EQUAL(session->write(s), AKU_SUCCESS);
+    }
+    auto after = storage->get_memory_use();
+    BOOST_REQUIRE(after[AKU_MEM_SESSIONS] > before[AKU_MEM_SESSIONS]);
+    BOOST_REQUIRE(after[AKU_MEM_SERIES_TABLE] > before[AKU_MEM_SERIES_TABLE]);
+    BOOST_REQUIRE(after[AKU_MEM_STRING_POOL] > 0);
+    BOOST_REQUIRE(after[AKU_MEM_WRITE_BUFFERS] > 0);
+    auto stats = storage->get_stats();
+    BOOST_REQUIRE(stats.get<u64>("memory.total") >= after[AKU_MEM_SESSIONS] + after[AKU_MEM_STRING_POOL]);
+
+    auto query = make_scan_query(0, 1000, OrderBy::SERIES);
+    CursorMock cursor;
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), 100);
+
+    // Session alone exceeds the limit
+    storage->_set_memory_limit(1);
+    CursorMock rejected;
+    session->query(&rejected, query.c_str());
+    BOOST_REQUIRE(rejected.done);
+    BOOST_REQUIRE_EQUAL(rejected.error, AKU_ENO_MEM);
+    stats = storage->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("memory.rejected_queries"), 1);
+
+    storage->_set_memory_limit(0);
+    CursorMock accepted;
+    session->query(&accepted, query.c_str());
+    BOOST_REQUIRE_EQUAL(accepted.error, AKU_SUCCESS);
+
+    // Session memory is released
+    auto nsession = after[AKU_MEM_SESSIONS];
+    session.reset();
+    BOOST_REQUIRE(storage->get_memory_use()[AKU_MEM_SESSIONS] < nsession);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_tenant_isolation) {
+    auto storage = create_storage();
+    aku_Status status;
+    std::shared_ptr<StorageSession> session_a, session_b;
+    std::tie(status, session_a) = storage->create_tenant_session("team-a");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    std::tie(status, session_b) = storage->create_tenant_session("team_b");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    std::shared_ptr<StorageSession> invalid;
+    std::tie(status, invalid) = storage->create_tenant_session("../team");
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+    std::tie(status, invalid) = storage->create_tenant_session("");
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+
+    fill_data(session_a, 100, 200, { "cpu host=a" });
+    fill_data(session_b, 100, 150, { "cpu host=b", "mem host=b" });
+    fill_data(storage->create_write_session(), 100, 110, { "cpu host=c" });
+
+    auto query = make_scan_query(0, 1000, OrderBy::SERIES);
+    auto check = [&](std::shared_ptr<StorageSession> session, size_t expected) {
+        CursorMock cursor;
+        session->query(&cursor, query.c_str());
+        BOOST_REQUIRE(cursor.done);
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected);
+    };
+    // Every namespace only sees its own series
+    check(session_a, 100);
+    check(session_b, 100);
+    check(storage->create_write_session(), 10);
+
+    // Tenant is opened once
+    std::shared_ptr<StorageSession> session_a2;
+    std::tie(status, session_a2) = storage->create_tenant_session("team-a");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    check(session_a2, 100);
+
+    auto stats = storage->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("series.count"), 1);
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("tenants.team-a.series.count"), 1);
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("tenants.team_b.series.count"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_tenant_quota) {
+    auto storage = create_storage();
+    Storage::TenantQuota quota = {};
+    quota.max_series = 2;
+    quota.ingest_rate = 100;
+    BOOST_REQUIRE_EQUAL(storage->set_tenant_quota("noisy", quota), AKU_SUCCESS);
+    aku_Status status;
+    std::shared_ptr<StorageSession> session;
+    std::tie(status, session) = storage->create_tenant_session("noisy");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    // Series limit
+    std::vector<aku_Sample> samples;
+    for (int i = 0; i < 3; i++) {
+        aku_Sample s = {};
+        std::string name = "cpu key=" + std::to_string(i);
+        status = session->init_series_id(name.data(), name.data() + name.size(), &s);
+        BOOST_REQUIRE_EQUAL(status, i < 2 ? AKU_SUCCESS : AKU_ESERIES_LIMIT);
+        if (status == AKU_SUCCESS) {
+            samples.push_back(s);
+        }
+    }
+    // Other namespaces are not limited
+    auto other = storage->create_write_session();
+    for (int i = 0; i < 3; i++) {
+        aku_Sample s = {};
+        std::string name = "cpu key=" + std::to_string(i);
+        BOOST_REQUIRE_EQUAL(other->init_series_id(name.data(), name.data() + name.size(), &s), AKU_SUCCESS);
+    }
+
+    // Ingest rate, bucket is full initially and can't hold more than one second of writes
+    std::vector<aku_Sample> batch;
+    for (aku_Timestamp ts = 1; ts <= 75; ts++) {
+        for (auto s: samples) {
+            s.timestamp = ts;
+            s.payload.type = AKU_PAYLOAD_FLOAT;
+            s.payload.float64 = static_cast<double>(ts);
+            batch.push_back(s);
+        }
+    }
+    BOOST_REQUIRE_EQUAL(session->write_batch(batch.data(), batch.size()), AKU_EBUSY);
+    auto stats = storage->get_stats();
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("tenants.noisy.ingest.throttled"), 50);
+    BOOST_REQUIRE_EQUAL(stats.get<u64>("tenants.noisy.series.rejected"), 1);
+
+    CursorMock cursor;
+    auto query = make_scan_query(0, 1000, OrderBy::SERIES);
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), 100);
+
+    // Quota can be removed
+    quota.ingest_rate = 0;
+    BOOST_REQUIRE_EQUAL(storage->set_tenant_quota("noisy", quota), AKU_SUCCESS);
+    aku_Sample s = samples.front();
+    s.timestamp = 1000;
+    s.payload.type = AKU_PAYLOAD_FLOAT;
+    s.payload.float64 = 0;
+    BOOST_REQUIRE_EQUAL(session->write(s), AKU_SUCCESS);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_continuous_query) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+        "test key=2",
+    };
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    std::vector<aku_ParamId> ids;
+    for (auto name: series_names) {
+        aku_Sample s;
+        auto status = session->init_series_id(name.data(), name.data() + name.size(), &s);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        ids.push_back(s.paramid);
+    }
+    const aku_Timestamp begin = 1000, end = 5000, step = 100;
+    auto query = make_group_aggregate_query(begin, end, step);
+    StreamingCursor cursor;
+    session->subscribe(&cursor, query.c_str());
+    BOOST_REQUIRE(!cursor.is_error());
+    // Slow subscriber shouldn't block the writers
+    StreamingCursor overflow(0x100);
+    session->subscribe(&overflow, query.c_str());
+    BOOST_REQUIRE(!overflow.is_error());
+    // Unsubscribed cursor shouldn't receive anything
+    StreamingCursor closed;
+    session->subscribe(&closed, query.c_str());
+    closed.close();
+
+    std::vector<aku_Sample> batch;
+    for (aku_Timestamp ts = 0; ts < 6000; ts++) {
+        for (auto id: ids) {
+            aku_Sample s;
+            s.paramid = id;
+            s.timestamp = ts;
+            s.payload.type = AKU_PAYLOAD_FLOAT;
+            s.payload.float64 = double(ts);
+            s.payload.size = sizeof(aku_Sample);
+            if (ts < 3000) {
+                auto status = session->write(s);
+                BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            } else {
+                batch.push_back(s);
+            }
+        }
+        if (batch.size() >= 100) {
+            auto status = session->write_batch(batch.data(), batch.size());
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            batch.clear();
+        }
+    }
+    auto status = session->write_batch(batch.data(), batch.size());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    // All columns were written past the end of the range
+    BOOST_REQUIRE(!cursor.is_error());
+
+    const size_t nbuckets = (end - begin) / step;
+    const size_t sample_size = sizeof(aku_Sample) + 4*sizeof(double);
+    std::vector<u8> buffer(nbuckets*ids.size()*sample_size + sample_size);
+    u32 nbytes = cursor.read(buffer.data(), static_cast<u32>(buffer.size()));
+    BOOST_REQUIRE_EQUAL(nbytes, nbuckets*ids.size()*sample_size);
+    BOOST_REQUIRE(cursor.is_done());
+    std::map<aku_ParamId, aku_Timestamp> next;
+    for (u32 pos = 0; pos < nbytes; pos += sample_size) {
+        auto sample = reinterpret_cast<aku_Sample const*>(buffer.data() + pos);
+        auto tup = reinterpret_cast<double const*>(sample->payload.data);
+        BOOST_REQUIRE_EQUAL(sample->payload.size, sample_size);
+        BOOST_REQUIRE(std::count(ids.begin(), ids.end(), sample->paramid));
+        auto it = next.find(sample->paramid);
+        aku_Timestamp bucket = it == next.end() ? begin : it->second;
+        BOOST_REQUIRE_EQUAL(sample->timestamp, bucket);
+        BOOST_REQUIRE_EQUAL(tup[0], double(step));
+        BOOST_REQUIRE_EQUAL(tup[1], double(step*bucket + step*(step - 1)/2));
+        BOOST_REQUIRE_EQUAL(tup[2], double(bucket));
+        BOOST_REQUIRE_EQUAL(tup[3], double(bucket + step - 1));
+        next[sample->paramid] = bucket + step;
+    }
+    BOOST_REQUIRE(overflow.is_error(&status));
+    BOOST_REQUIRE_EQUAL(status, AKU_EOVERFLOW);
+    BOOST_REQUIRE_EQUAL(closed.read(buffer.data(), static_cast<u32>(buffer.size())), 0u);
+
+    // Only group-aggregate query can be used
+    StreamingCursor invalid;
+    auto scan = make_scan_query(begin, end, OrderBy::TIME);
+    session->subscribe(&invalid, scan.c_str());
+    BOOST_REQUIRE(invalid.is_error(&status));
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+}
+
 // Test metadata query
 
 static void test_metadata_query() {
@@ -637,6 +1121,38 @@ BOOST_AUTO_TEST_CASE(Test_storage_suggest_query_3) {
     test_suggest_tag_values();
 }
 
+BOOST_AUTO_TEST_CASE(Test_storage_suggest_query_4) {
+    // Suggestions are sorted, limit and offset are applied to the sorted list
+    auto query = "{\"select\": \"tag-values\", \"metric\": \"test\", \"tag\":\"foo\", \"starts-with\": \"ba\","
+                 " \"limit\": 2, \"offset\": 1 }";
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    std::vector<std::string> series_names = {
+        "test foo=bar",
+        "test foo=buz",
+        "test foo=baer",
+        "test foo=baar",
+        "test foo=ba",
+        "test foo=bacr",
+    };
+    for (auto name: series_names) {
+        aku_Sample s;
+        auto status = session->init_series_id(name.data(), name.data() + name.size(), &s);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    }
+    CursorMock cursor;
+    session->suggest(&cursor, query);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    std::vector<std::string> expected = { "baar", "bacr" };
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        char buffer[AKU_LIMITS_MAX_SNAME];
+        auto len = session->get_series_name(cursor.samples[i].paramid, buffer, AKU_LIMITS_MAX_SNAME);
+        BOOST_REQUIRE(len > 0);
+        BOOST_REQUIRE_EQUAL(std::string(buffer, buffer + len), expected[i]);
+    }
+}
+
 // Group-by query
 
 static const aku_Timestamp gb_begin = 100;
@@ -842,62 +1358,334 @@ BOOST_AUTO_TEST_CASE(Test_storage_where_form2) {
     test_storage_where_clause2(begin, end);
 }
 
-// Test SeriesRetreiver
+static void test_storage_where_pattern(const char* pattern, std::vector<int> keys, aku_Status expected_status = AKU_SUCCESS) {
+    aku_Timestamp begin = 100, end = 200;
+    std::vector<std::string> series_names;
+    std::vector<std::string> expected_series;
+    for (int i = 0; i < 100; i++) {
+        series_names.push_back("test key=" + std::to_string(i) + " zzz=0");
+    }
+    for (auto key: keys) {
+        expected_series.push_back(series_names.at(static_cast<size_t>(key)));
+    }
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
 
-void test_retreiver() {
-    std::vector<u64> ids;
-    std::vector<std::string> test_data = {
-        "aaa foo=1 bar=1 buz=1",
-        "aaa foo=1 bar=1 buz=2",
-        "aaa foo=1 bar=2 buz=2",
-        "aaa foo=2 bar=2 buz=2",
-        "aaa foo=2 bar=2 buz=3",
-        "bbb foo=2 bar=3 buz=3",
-        "bbb foo=3 bar=3 buz=3",
-        "bbb foo=3 bar=3 buz=4",
-        "bbb foo=3 bar=4 buz=4",
-        "bbb foo=4 bar=4 buz=4",
-        "bbb foo=4 bar=4 buz=5",
-        "bbb foo=4 bar=4 buz=6",
-    };
-    PlainSeriesMatcher m;
-    for (auto s: test_data) {
-        char buffer[0x100];
-        const char* pkeys_begin;
-        const char* pkeys_end;
-        aku_Status status = SeriesParser::to_canonical_form(s.data(), s.data() + s.size(),
-                                                            buffer, buffer + 0x100,
-                                                            &pkeys_begin, &pkeys_end);
-        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-        auto id = m.add(buffer, pkeys_end);
-        ids.push_back(id);
+    std::stringstream query;
+    query << "{";
+    query << "   \"select\": \"test\",\n";
+    query << "   \"where\": { \"key\": " << pattern << ", \"zzz\": 0 },\n";
+    query << "   \"order-by\": \"series\",\n";
+    query << "   \"range\": { \"from\": " << begin << ", \"to\": " << end << "}\n";
+    query << "}";
+
+    CursorMock cursor;
+    session->query(&cursor, query.str().c_str());
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, expected_status);
+    if (expected_status != AKU_SUCCESS) {
+        return;
+    }
+    size_t expected_size = (end - begin)*expected_series.size();
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected_size);
+    std::vector<aku_Timestamp> expected;
+    for (aku_Timestamp ts = begin; ts < end; ts++) {
+        expected.push_back(ts);
     }
+    check_timestamps(cursor, expected, OrderBy::SERIES, expected_series);
+    check_paramids(*session, cursor, OrderBy::SERIES, expected_series, expected_size, true);
+}
 
-    std::vector<u64> act;
-    aku_Status status;
+BOOST_AUTO_TEST_CASE(Test_storage_where_pattern) {
+    test_storage_where_pattern("{ \"glob\": \"1?\" }", { 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 });
+    test_storage_where_pattern("{ \"regex\": \"[0-9]*5\" }", { 5, 15, 25, 35, 45, 55, 65, 75, 85, 95 });
+    test_storage_where_pattern("{ \"glob\": \"x*\" }", {}, AKU_ENOT_FOUND);
+    test_storage_where_pattern("{ \"regex\": \"[0-9\" }", {}, AKU_EQUERY_PARSING_ERROR);
+    test_storage_where_pattern("{ \"like\": \"1%\" }", {}, AKU_EQUERY_PARSING_ERROR);
+}
 
-    SeriesRetreiver rt1;
-    status = rt1.add_tag("foo", "1");
-    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
-    std::tie(status, act) = rt1.extract_ids(m);
+BOOST_AUTO_TEST_CASE(Test_storage_select_last) {
+    aku_Timestamp begin = 100, end = 200;
+    std::vector<std::string> series_names;
+    for (int i = 0; i < 10; i++) {
+        series_names.push_back("test key=" + std::to_string(i) + " zzz=" + std::to_string(i % 2));
+    }
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
+    // One series is updated later than the others
+    aku_Sample sample = {};
+    sample.timestamp = 300;
+    sample.payload.type = AKU_PAYLOAD_FLOAT;
+    sample.payload.float64 = 42.0;
+    auto status = session->init_series_id(series_names[4].data(), series_names[4].data() + series_names[4].size(), &sample);
     BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin(), ids.end(), act.begin(), act.end());
+    BOOST_REQUIRE_EQUAL(session->write(sample), AKU_SUCCESS);
 
-    SeriesRetreiver rt2({"bbb"});
-    std::tie(status, act) = rt2.extract_ids(m);
-    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin() + 5, ids.end(), act.begin(), act.end());
+    CursorMock cursor;
+    const char* query = R"({ "select-last": "test", "where": { "zzz": 0 } })";
+    session->query(&cursor, query);
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), 5);
+    std::vector<std::string> expected_names = {
+        "test key=0 zzz=0",
+        "test key=2 zzz=0",
+        "test key=4 zzz=0",
+        "test key=6 zzz=0",
+        "test key=8 zzz=0",
+    };
+    char buffer[AKU_LIMITS_MAX_SNAME];
+    for (size_t i = 0; i < cursor.samples.size(); i++) {
+        auto const& s = cursor.samples[i];
+        auto len = session->get_series_name(s.paramid, buffer, AKU_LIMITS_MAX_SNAME);
+        BOOST_REQUIRE(len > 0);
+        BOOST_REQUIRE_EQUAL(std::string(buffer, buffer + len), expected_names[i]);
+        if (i == 2) {
+            BOOST_REQUIRE_EQUAL(s.timestamp, 300);
+            BOOST_REQUIRE_EQUAL(s.payload.float64, 42.0);
+        } else {
+            BOOST_REQUIRE_EQUAL(s.timestamp, end - 1);
+            BOOST_REQUIRE_EQUAL(s.payload.float64, double(end - 1)/10.0);
+        }
+    }
 
-    SeriesRetreiver rt3({"bbb"});
-    status = rt3.add_tag("foo", "3");
-    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-    status = rt3.add_tag("buz", "4");
-    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-    status = rt3.add_tag("buz", "4");
-    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
-    std::tie(status, act) = rt3.extract_ids(m);
-    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
-    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin() + 7, ids.begin() + 9, act.begin(), act.end());
+    CursorMock error_cursor;
+    session->query(&error_cursor, R"({ "select-last": "test", "range": { "from": 0, "to": 10 } })");
+    BOOST_REQUIRE(error_cursor.done);
+    BOOST_REQUIRE_EQUAL(error_cursor.error, AKU_EQUERY_PARSING_ERROR);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_prepared_query) {
+    aku_Timestamp begin = 100, end = 200;
+    std::vector<std::string> series_names;
+    for (int i = 0; i < 10; i++) {
+        series_names.push_back("test key=" + std::to_string(i) + " zzz=0");
+    }
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
+
+    std::stringstream query;
+    query << "{ \"select\": \"test\", \"where\": { \"zzz\": 0 }, \"order-by\": \"series\",";
+    query << "  \"range\": { \"from\": " << begin << ", \"to\": " << end << "}}";
+    auto check_query = [&](std::vector<std::string> const& expected_series) {
+        CursorMock cursor;
+        session->query(&cursor, query.str().c_str());
+        BOOST_REQUIRE(cursor.done);
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        size_t expected_size = (end - begin)*expected_series.size();
+        BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected_size);
+        std::vector<aku_Timestamp> expected;
+        for (aku_Timestamp ts = begin; ts < end; ts++) {
+            expected.push_back(ts);
+        }
+        check_timestamps(cursor, expected, OrderBy::SERIES, expected_series);
+    };
+    check_query(series_names);
+    BOOST_REQUIRE_EQUAL(storage->_get_prepared_cache_size(), 1);
+    // Cached query
+    check_query(series_names);
+    BOOST_REQUIRE_EQUAL(storage->_get_prepared_cache_size(), 1);
+
+    // New series invalidates resolved ids
+    series_names.push_back("test key=10 zzz=0");
+    fill_data(session, begin, end, { series_names.back() });
+    check_query(series_names);
+    BOOST_REQUIRE_EQUAL(storage->_get_prepared_cache_size(), 1);
+
+    // Invalid queries are not cached
+    CursorMock cursor;
+    session->query(&cursor, "{ \"select\": ");
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_EQUERY_PARSING_ERROR);
+    BOOST_REQUIRE_EQUAL(storage->_get_prepared_cache_size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_prepared_statement) {
+    aku_Timestamp begin = 100, end = 300;
+    std::vector<std::string> series_names;
+    for (int i = 0; i < 10; i++) {
+        series_names.push_back("test key=" + std::to_string(i) + " zzz=0");
+    }
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
+
+    std::stringstream query;
+    query << "{ \"select\": \"test\", \"where\": { \"zzz\": 0 }, \"order-by\": \"series\",";
+    query << "  \"range\": { \"from\": " << begin << ", \"to\": " << end << "}}";
+    aku_Status status;
+    std::shared_ptr<PreparedStatement> stmt;
+    std::tie(status, stmt) = session->prepare(query.str().c_str());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE(stmt);
+
+    auto check_execute = [&](aku_Timestamp from, aku_Timestamp to, std::vector<std::string> const& expected_series) {
+        CursorMock cursor;
+        session->execute(&cursor, stmt, from, to);
+        BOOST_REQUIRE(cursor.done);
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        std::vector<aku_Timestamp> expected;
+        for (aku_Timestamp ts = from; ts < to; ts++) {
+            expected.push_back(ts);
+        }
+        BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected.size()*expected_series.size());
+        check_timestamps(cursor, expected, OrderBy::SERIES, expected_series);
+    };
+    check_execute(120, 150, series_names);
+    check_execute(200, 210, series_names);
+
+    // New series are picked up by the prepared statement
+    series_names.push_back("test key=10 zzz=0");
+    fill_data(session, begin, end, { series_names.back() });
+    check_execute(150, 160, series_names);
+
+    // Queries without range can't be prepared
+    std::tie(status, stmt) = session->prepare("{ \"select-last\": \"test\" }");
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+    BOOST_REQUIRE(!stmt);
+    std::tie(status, stmt) = session->prepare("{ \"select\": ");
+    BOOST_REQUIRE_EQUAL(status, AKU_EQUERY_PARSING_ERROR);
+}
+
+BOOST_AUTO_TEST_CASE(Test_resume_token_encoding) {
+    ResumeToken token;
+    token.watermark = 1024;
+    token.generation = 3;
+    token.ids = { 1024, 1025, 1030, 1001 };
+    token.timestamps = { 1000000, 0, 1000100, 999999 };
+    auto text = token.encode();
+    ResumeToken decoded;
+    BOOST_REQUIRE_EQUAL(ResumeToken::decode(text, &decoded), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(decoded.watermark, token.watermark);
+    BOOST_REQUIRE_EQUAL(decoded.generation, token.generation);
+    BOOST_REQUIRE(decoded.ids == token.ids);
+    BOOST_REQUIRE(decoded.timestamps == token.timestamps);
+
+    // Empty token
+    BOOST_REQUIRE_EQUAL(ResumeToken::decode(ResumeToken().encode(), &decoded), AKU_SUCCESS);
+    BOOST_REQUIRE(decoded.ids.empty());
+
+    // Damaged token
+    text[text.size() / 2] = text[text.size() / 2] == 'A' ? 'B' : 'A';
+    BOOST_REQUIRE_EQUAL(ResumeToken::decode(text, &decoded), AKU_EBAD_ARG);
+    BOOST_REQUIRE_EQUAL(ResumeToken::decode("not a token", &decoded), AKU_EBAD_ARG);
+    BOOST_REQUIRE_EQUAL(ResumeToken::decode("", &decoded), AKU_EBAD_ARG);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_incremental_query) {
+    std::vector<std::string> series_names;
+    for (int i = 0; i < 10; i++) {
+        series_names.push_back("test key=" + std::to_string(i) + " zzz=0");
+    }
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, 100, 200, series_names);
+
+    std::string query = "{ \"select\": \"test\", \"where\": { \"zzz\": 0 }, \"order-by\": \"series\","
+                        "  \"range\": { \"from\": 100, \"to\": 1000 }}";
+    aku_Status status;
+    std::shared_ptr<PreparedStatement> stmt;
+    std::tie(status, stmt) = session->prepare(query.c_str());
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+
+    auto poll = [&](std::string const& token, aku_Timestamp min_ts, size_t expected) {
+        CursorMock cursor;
+        session->poll(&cursor, stmt, 100, 1000, token);
+        BOOST_REQUIRE(cursor.done);
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected);
+        for (auto const& sample: cursor.samples) {
+            BOOST_REQUIRE(sample.timestamp >= min_ts);
+        }
+        BOOST_REQUIRE(!cursor.resume_token.empty());
+        return cursor.resume_token;
+    };
+    auto token = poll("", 100, 1000);
+    // Nothing new
+    token = poll(token, 100, 0);
+    fill_data(session, 200, 250, series_names);
+    token = poll(token, 200, 500);
+
+    // New series is read from the beginning of the range
+    fill_data(session, 200, 260, { "test key=10 zzz=0" });
+    token = poll(token, 200, 60);
+    token = poll(token, 200, 0);
+
+    // Token can be passed using the query
+    fill_data(session, 250, 255, series_names);
+    std::string resume_query = query.substr(0, query.size() - 1) + ", \"resume\": \"" + token + "\"}";
+    {
+        CursorMock cursor;
+        session->query(&cursor, resume_query.c_str());
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(cursor.samples.size(), 50);
+        BOOST_REQUIRE(!cursor.resume_token.empty());
+    }
+
+    // Malformed token
+    CursorMock cursor;
+    session->poll(&cursor, stmt, 100, 1000, "bad token");
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_EBAD_ARG);
+}
+
+// Test SeriesRetreiver
+
+void test_retreiver() {
+    std::vector<u64> ids;
+    std::vector<std::string> test_data = {
+        "aaa foo=1 bar=1 buz=1",
+        "aaa foo=1 bar=1 buz=2",
+        "aaa foo=1 bar=2 buz=2",
+        "aaa foo=2 bar=2 buz=2",
+        "aaa foo=2 bar=2 buz=3",
+        "bbb foo=2 bar=3 buz=3",
+        "bbb foo=3 bar=3 buz=3",
+        "bbb foo=3 bar=3 buz=4",
+        "bbb foo=3 bar=4 buz=4",
+        "bbb foo=4 bar=4 buz=4",
+        "bbb foo=4 bar=4 buz=5",
+        "bbb foo=4 bar=4 buz=6",
+    };
+    PlainSeriesMatcher m;
+    for (auto s: test_data) {
+        char buffer[0x100];
+        const char* pkeys_begin;
+        const char* pkeys_end;
+        aku_Status status = SeriesParser::to_canonical_form(s.data(), s.data() + s.size(),
+                                                            buffer, buffer + 0x100,
+                                                            &pkeys_begin, &pkeys_end);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        auto id = m.add(buffer, pkeys_end);
+        ids.push_back(id);
+    }
+
+    std::vector<u64> act;
+    aku_Status status;
+
+    SeriesRetreiver rt1;
+    status = rt1.add_tag("foo", "1");
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+    std::tie(status, act) = rt1.extract_ids(m);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin(), ids.end(), act.begin(), act.end());
+
+    SeriesRetreiver rt2({"bbb"});
+    std::tie(status, act) = rt2.extract_ids(m);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin() + 5, ids.end(), act.begin(), act.end());
+
+    SeriesRetreiver rt3({"bbb"});
+    status = rt3.add_tag("foo", "3");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    status = rt3.add_tag("buz", "4");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    status = rt3.add_tag("buz", "4");
+    BOOST_REQUIRE_EQUAL(status, AKU_EBAD_ARG);
+    std::tie(status, act) = rt3.extract_ids(m);
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(ids.begin() + 7, ids.begin() + 9, act.begin(), act.end());
 
     SeriesRetreiver rt4({"bbb"});
     status = rt4.add_tag("foo", "4");
@@ -992,5 +1780,1237 @@ BOOST_AUTO_TEST_CASE(Test_series_add_5) {
     BOOST_REQUIRE_EQUAL(-1*nids, AKU_EBAD_DATA);
 }
 
+// Some series are already known to the session
+BOOST_AUTO_TEST_CASE(Test_series_add_6) {
+    auto store = create_storage();
+    auto session = store->create_write_session();
+
+    aku_ParamId known[1];
+    const char* sname0 = "world tag=1";
+    BOOST_REQUIRE_EQUAL(session->get_series_ids(sname0, sname0 + strlen(sname0), known, 1), 1);
+
+    const char* sname = "hello|world|hi tag=1";
+    aku_ParamId ids[10];
+    auto nids = session->get_series_ids(sname, sname + strlen(sname), ids, 10);
+    BOOST_REQUIRE_EQUAL(nids, 3);
+    BOOST_REQUIRE_EQUAL(ids[1], known[0]);
+
+    std::vector<std::string> expected = { "hello tag=1", "world tag=1", "hi tag=1" };
+    for (int i = 0; i < 3; i++) {
+        char buf[100];
+        auto buflen = session->get_series_name(ids[i], buf, 100);
+        BOOST_REQUIRE_EQUAL(std::string(buf, buf + buflen), expected[i]);
+    }
+
+    // Second lookup uses local information only
+    aku_ParamId ids2[10];
+    BOOST_REQUIRE_EQUAL(session->get_series_ids(sname, sname + strlen(sname), ids2, 10), 3);
+    BOOST_REQUIRE(std::equal(ids, ids + 3, ids2));
+}
+
 // Test reopen
 
+// Test batch processing
+
+struct CollectorNode : Node {
+    std::vector<aku_Sample> samples;
+
+    void complete() {}
+
+    bool put(MutableSample& sample) {
+        samples.push_back(sample.get_sample());
+        return true;
+    }
+
+    void set_error(aku_Status) {
+        BOOST_FAIL("set_error shouldn't be called");
+    }
+
+    int get_requirements() const {
+        return TERMINAL;
+    }
+};
+
+static std::shared_ptr<Node> make_batch_test_topology(std::shared_ptr<Node> last) {
+    auto limiter = std::make_shared<Limiter>(1000, 0, last);
+    auto rate = std::make_shared<SimpleRate>(limiter);
+    auto abs = std::make_shared<Absolute>(rate);
+    std::vector<double> weights = { -2.0 };
+    return std::make_shared<Scale>(weights, abs);
+}
+
+BOOST_AUTO_TEST_CASE(Test_batch_processing_0) {
+    // Batches should produce the same output as individual samples
+    auto expected = std::make_shared<CollectorNode>();
+    auto actual = std::make_shared<CollectorNode>();
+    auto seq = make_batch_test_topology(expected);
+    auto batched = make_batch_test_topology(actual);
+    std::vector<aku_Sample> input;
+    for (u32 i = 0; i < 2000; i++) {
+        aku_Sample sample = {};
+        // Series are interleaved in groups of different length
+        sample.paramid = 1 + (i / 7) % 3;
+        sample.timestamp = 1000 + i*100;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.size = sizeof(aku_Sample);
+        sample.payload.float64 = (i % 2 ? 1.0 : -1.0)*i*i;
+        input.push_back(sample);
+    }
+    bool seqres = true;
+    for (auto const& sample: input) {
+        MutableSample mut(&sample);
+        seqres = seq->put(mut);
+        if (!seqres) {
+            break;
+        }
+    }
+    bool batchres = true;
+    SampleBatch batch;
+    for (size_t i = 0; i < input.size() && batchres; i++) {
+        batch.append(input[i]);
+        if (batch.size() == 37) {
+            batchres = batched->put_batch(batch);
+            batch.clear();
+        }
+    }
+    if (batchres && !batch.empty()) {
+        batchres = batched->put_batch(batch);
+    }
+    BOOST_REQUIRE(!seqres);
+    BOOST_REQUIRE(!batchres);
+    BOOST_REQUIRE_EQUAL(expected->samples.size(), 1000);
+    BOOST_REQUIRE_EQUAL(actual->samples.size(), expected->samples.size());
+    for (size_t i = 0; i < expected->samples.size(); i++) {
+        BOOST_REQUIRE_EQUAL(actual->samples[i].paramid, expected->samples[i].paramid);
+        BOOST_REQUIRE_EQUAL(actual->samples[i].timestamp, expected->samples[i].timestamp);
+        BOOST_REQUIRE_EQUAL(actual->samples[i].payload.float64, expected->samples[i].payload.float64);
+    }
+}
+
+// Test dense per-series state
+
+BOOST_AUTO_TEST_CASE(Test_series_slots_0) {
+    // Compact ids use direct table, sparse ids use sorted array
+    std::vector<std::vector<aku_ParamId>> cases = {
+        { 12, 10, 11, 15, 10 },
+        { 1, 1ull << 40, 7, 1ull << 50 },
+    };
+    for (auto const& ids: cases) {
+        SeriesSlots slots(ids, 2);
+        std::vector<aku_ParamId> uniq(ids);
+        std::sort(uniq.begin(), uniq.end());
+        uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+        BOOST_REQUIRE_EQUAL(slots.size(), uniq.size());
+        BOOST_REQUIRE_EQUAL(slots.width(), 2);
+        std::set<u32> seen;
+        for (auto id: uniq) {
+            auto slot = slots.get(id);
+            BOOST_REQUIRE(slot < slots.size());
+            BOOST_REQUIRE(seen.insert(slot).second);
+        }
+        BOOST_REQUIRE_EQUAL(slots.get(0), static_cast<u32>(SeriesSlots::NO_SLOT));
+        BOOST_REQUIRE_EQUAL(slots.get(13), static_cast<u32>(SeriesSlots::NO_SLOT));
+        BOOST_REQUIRE_EQUAL(slots.get(1ull << 45), static_cast<u32>(SeriesSlots::NO_SLOT));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_series_slots_1) {
+    // Stateful nodes should produce the same output with and without the mapping,
+    // series that are not in the mapping use the fallback table
+    auto expected = std::make_shared<CollectorNode>();
+    auto actual = std::make_shared<CollectorNode>();
+    auto seqsum = std::make_shared<CumulativeSum>(expected);
+    auto seqrate = std::make_shared<SimpleRate>(seqsum);
+    auto densesum = std::make_shared<CumulativeSum>(actual);
+    auto denserate = std::make_shared<SimpleRate>(densesum);
+    std::shared_ptr<const SeriesSlots> slots = std::make_shared<SeriesSlots>(std::vector<aku_ParamId>{ 1, 2, 3 }, 1);
+    denserate->set_series_slots(slots);
+    densesum->set_series_slots(slots);
+    for (u32 i = 0; i < 1000; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 1 + i % 4;
+        sample.timestamp = 1000 + i*100;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.size = sizeof(aku_Sample);
+        sample.payload.float64 = (i % 3)*i;
+        MutableSample mseq(&sample);
+        MutableSample mdense(&sample);
+        BOOST_REQUIRE(seqrate->put(mseq));
+        BOOST_REQUIRE(denserate->put(mdense));
+    }
+    BOOST_REQUIRE_EQUAL(actual->samples.size(), expected->samples.size());
+    for (size_t i = 0; i < expected->samples.size(); i++) {
+        BOOST_REQUIRE_EQUAL(actual->samples[i].paramid, expected->samples[i].paramid);
+        BOOST_REQUIRE_EQUAL(actual->samples[i].timestamp, expected->samples[i].timestamp);
+        BOOST_REQUIRE_EQUAL(actual->samples[i].payload.float64, expected->samples[i].payload.float64);
+    }
+}
+
+// Test rolling window functions
+
+BOOST_AUTO_TEST_CASE(Test_rolling_window_0) {
+    // Output should match the statistic of the last N values of every series
+    const size_t width = 7;
+    auto minres = std::make_shared<CollectorNode>();
+    auto maxres = std::make_shared<CollectorNode>();
+    auto medres = std::make_shared<CollectorNode>();
+    auto q90res = std::make_shared<CollectorNode>();
+    std::vector<std::shared_ptr<Node>> nodes = {
+        std::make_shared<RollingMinMaxNode>(width, false, minres),
+        std::make_shared<RollingMinMaxNode>(width, true, maxres),
+        std::make_shared<RollingQuantileNode>(width, 0.5, medres),
+        std::make_shared<RollingQuantileNode>(width, 0.9, q90res),
+    };
+    // Series 4 is not in the mapping and uses the fallback table
+    std::shared_ptr<const SeriesSlots> slots = std::make_shared<SeriesSlots>(std::vector<aku_ParamId>{ 1, 2, 3 }, 1);
+    for (auto node: nodes) {
+        node->set_series_slots(slots);
+    }
+    std::map<aku_ParamId, std::vector<double>> history;
+    std::vector<std::vector<double>> expected(4);
+    for (u32 i = 0; i < 1000; i++) {
+        aku_Sample sample = {};
+        sample.paramid = 1 + i % 4;
+        sample.timestamp = 1000 + i*100;
+        sample.payload.type = AKU_PAYLOAD_FLOAT|aku_PData::REGULLAR;
+        sample.payload.size = sizeof(aku_Sample);
+        // Repeated values and runs of increasing/decreasing values
+        sample.payload.float64 = static_cast<double>((i*7919) % 23) - (i % 50 < 25 ? i % 25 : 25 - i % 25);
+        auto& hist = history[sample.paramid];
+        hist.push_back(sample.payload.float64);
+        std::vector<double> wnd(hist.size() > width ? hist.end() - width : hist.begin(), hist.end());
+        std::sort(wnd.begin(), wnd.end());
+        expected[0].push_back(wnd.front());
+        expected[1].push_back(wnd.back());
+        expected[2].push_back(wnd.at((wnd.size() - 1)/2));
+        expected[3].push_back(wnd.at(static_cast<size_t>(0.9*(wnd.size() - 1))));
+        for (auto node: nodes) {
+            MutableSample mut(&sample);
+            BOOST_REQUIRE(node->put(mut));
+        }
+    }
+    std::vector<std::shared_ptr<CollectorNode>> results = { minres, maxres, medres, q90res };
+    for (size_t k = 0; k < results.size(); k++) {
+        BOOST_REQUIRE_EQUAL(results[k]->samples.size(), expected[k].size());
+        for (size_t i = 0; i < expected[k].size(); i++) {
+            BOOST_REQUIRE_EQUAL(results[k]->samples[i].payload.float64, expected[k][i]);
+        }
+    }
+}
+
+// Test push-down of the processing functions
+
+static std::string make_scan_query_with_apply(aku_Timestamp begin, aku_Timestamp end, OrderBy order, u64 limit, u64 offset) {
+    std::stringstream str;
+    str << "{ \"select\": \"test\", \"range\": { \"from\": " << begin << ", \"to\": " << end << "},";
+    str << "  \"order-by\": " << (order == OrderBy::SERIES ? "\"series\"" : "\"time\"") << ",";
+    if (limit) {
+        str << "  \"limit\": " << limit << ",";
+    }
+    if (offset) {
+        str << "  \"offset\": " << offset << ",";
+    }
+    str << "  \"apply\": [ { \"name\": \"scale\", \"weights\": [ -2.0 ] },";
+    str << "             { \"name\": \"abs\" },";
+    str << "             { \"name\": \"rate\" } ]";
+    str << "}";
+    return str.str();
+}
+
+static void test_storage_fused_transforms(aku_Timestamp begin, aku_Timestamp end, OrderBy order, u64 limit, u64 offset=0) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+        "test key=2",
+    };
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, std::min(begin, end), std::max(begin, end), series_names);
+    // Functions are applied to the output of the plain scan query
+    CursorMock scan;
+    auto query = make_scan_query(begin, end, order);
+    session->query(&scan, query.c_str());
+    BOOST_REQUIRE_EQUAL(scan.error, AKU_SUCCESS);
+    auto expected = std::make_shared<CollectorNode>();
+    std::shared_ptr<Node> topology = std::make_shared<SimpleRate>(expected);
+    topology = std::make_shared<Absolute>(topology);
+    topology = std::make_shared<Scale>(std::vector<double>{ -2.0 }, topology);
+    if (limit || offset) {
+        topology = std::make_shared<Limiter>(limit, offset, topology);
+    }
+    for (auto const& sample: scan.samples) {
+        MutableSample mut(&sample);
+        if (!topology->put(mut)) {
+            break;
+        }
+    }
+    CursorMock cursor;
+    query = make_scan_query_with_apply(begin, end, order, limit, offset);
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(cursor.samples.size(), expected->samples.size());
+    for (size_t i = 0; i < cursor.samples.size(); i++) {
+        BOOST_REQUIRE_EQUAL(cursor.samples[i].paramid, expected->samples[i].paramid);
+        BOOST_REQUIRE_EQUAL(cursor.samples[i].timestamp, expected->samples[i].timestamp);
+        BOOST_REQUIRE_EQUAL(cursor.samples[i].payload.float64, expected->samples[i].payload.float64);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_fused_transforms) {
+    for (auto order: { OrderBy::SERIES, OrderBy::TIME }) {
+        test_storage_fused_transforms(100, 200, order, 0);
+        test_storage_fused_transforms(200, 100, order, 0);
+        // Limit and offset are pushed down together with the transforms if the
+        // series are chained, otherwise the limiter stays in the topology
+        test_storage_fused_transforms(100, 200, order, 50);
+        test_storage_fused_transforms(100, 200, order, 50, 120);
+        test_storage_fused_transforms(200, 100, order, 0, 120);
+        test_storage_fused_transforms(200, 100, order, 500, 120);
+    }
+}
+
+// Test top-N
+
+BOOST_AUTO_TEST_CASE(Test_top_n_0) {
+    // Series with the largest sums should be returned in descending order
+    const size_t N = 5;
+    auto collector = std::make_shared<CollectorNode>();
+    auto top = std::make_shared<TopN>(N, collector);
+    std::vector<std::pair<double, aku_ParamId>> sums;
+    for (aku_ParamId id = 1; id <= 100; id++) {
+        // Value is constant, the first two samples initialize the state so the sum is equal to the value
+        double rate = static_cast<double>((id * 37) % 101);
+        for (u32 i = 0; i < 3; i++) {
+            aku_Sample sample = {};
+            sample.paramid = id;
+            sample.timestamp = 1000000000ull * (1 + i);
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.size = sizeof(aku_Sample);
+            sample.payload.float64 = rate;
+            MutableSample mut(&sample);
+            BOOST_REQUIRE(top->put(mut));
+        }
+        sums.push_back(std::make_pair(-rate, id));
+    }
+    top->complete();
+    std::sort(sums.begin(), sums.end());
+    BOOST_REQUIRE_EQUAL(collector->samples.size(), N);
+    for (size_t i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(collector->samples[i].paramid, sums[i].second);
+        BOOST_REQUIRE_EQUAL(collector->samples[i].payload.float64, -sums[i].first);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_top_n_1) {
+    // Merged partial results should be the same as the result computed at once
+    const size_t N = 10;
+    TopN::Heap all(N);
+    std::vector<TopN::Heap> partial(4, TopN::Heap(N));
+    for (aku_ParamId id = 1; id <= 1000; id++) {
+        TopN::Context ctx = {};
+        ctx.id = id;
+        ctx.sum = static_cast<double>((id * 7919) % 257);
+        all.add(ctx);
+        partial[id % partial.size()].add(ctx);
+    }
+    TopN::Heap merged(N);
+    for (auto const& heap: partial) {
+        merged.merge(heap);
+    }
+    auto expected = all.extract();
+    auto actual = merged.extract();
+    BOOST_REQUIRE_EQUAL(expected.size(), N);
+    BOOST_REQUIRE_EQUAL(actual.size(), N);
+    for (size_t i = 0; i < N; i++) {
+        BOOST_REQUIRE_EQUAL(actual[i].id, expected[i].id);
+        BOOST_REQUIRE_EQUAL(actual[i].sum, expected[i].sum);
+        if (i > 0) {
+            BOOST_REQUIRE(actual[i - 1].sum >= actual[i].sum);
+        }
+    }
+}
+
+// Test mergeable frequent items summary
+
+BOOST_AUTO_TEST_CASE(Test_space_saver_merge_0) {
+    // Frequent items computed by parts should be the same as the result of the
+    // whole stream
+    auto expected = std::make_shared<CollectorNode>();
+    auto actual = std::make_shared<CollectorNode>();
+    SpaceSaver<false> all(0.01, 0.05, expected);
+    SpaceSaver<false> part1(0.01, 0.05, actual);
+    SpaceSaver<false> part2(0.01, 0.05, actual);
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<aku_ParamId> noise(100, 100000);
+    for (u32 i = 0; i < 20000; i++) {
+        aku_Sample sample = {};
+        // Series 1-4 are frequent, the rest is noise
+        sample.paramid = i % 4 == 0 ? 1 + (i / 4) % 4 : noise(gen);
+        sample.timestamp = i;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.size = sizeof(aku_Sample);
+        sample.payload.float64 = 1.0;
+        MutableSample m1(&sample);
+        BOOST_REQUIRE(all.put(m1));
+        MutableSample m2(&sample);
+        BOOST_REQUIRE((i < 10000 ? part1 : part2).put(m2));
+    }
+    std::vector<char> buffer;
+    part2.serialize(&buffer);
+    BOOST_REQUIRE_EQUAL(part1.deserialize(buffer.data(), buffer.data() + buffer.size()), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(part1.N, all.N);
+    BOOST_REQUIRE(part1.counters_.size() <= part1.M);
+    all.complete();
+    part1.complete();
+    BOOST_REQUIRE_EQUAL(expected->samples.size(), 4);
+    BOOST_REQUIRE_EQUAL(actual->samples.size(), expected->samples.size());
+    std::set<aku_ParamId> eids, aids;
+    for (size_t i = 0; i < expected->samples.size(); i++) {
+        eids.insert(expected->samples[i].paramid);
+        aids.insert(actual->samples[i].paramid);
+        // Count is an upper bound of the real frequency (1250 per series)
+        BOOST_REQUIRE(actual->samples[i].payload.float64 >= 1250.0);
+    }
+    BOOST_REQUIRE(eids == aids);
+    // Damaged data is rejected
+    SpaceSaver<false> damaged(0.01, 0.05, actual);
+    BOOST_REQUIRE_EQUAL(damaged.deserialize(buffer.data(), buffer.data() + buffer.size() - 1), AKU_EBAD_DATA);
+    SpaceSaver<false> other(0.1, 0.05, actual);
+    BOOST_REQUIRE_EQUAL(other.deserialize(buffer.data(), buffer.data() + buffer.size()), AKU_EBAD_DATA);
+}
+
+// Test quantiles
+
+BOOST_AUTO_TEST_CASE(Test_quantile_sketch_0) {
+    QuantileSketch all(0.01);
+    std::vector<QuantileSketch> partial(3, QuantileSketch(0.01));
+    std::vector<double> values;
+    std::mt19937 gen(11);
+    std::lognormal_distribution<double> dist(0.0, 2.0);
+    for (u32 i = 0; i < 10000; i++) {
+        double x = i % 10 == 0 ? -dist(gen) : dist(gen);
+        values.push_back(x);
+        all.add(x);
+        partial[i % partial.size()].add(x);
+    }
+    std::sort(values.begin(), values.end());
+    QuantileSketch merged(0.01);
+    for (auto const& sketch: partial) {
+        merged.merge(sketch);
+    }
+    BOOST_REQUIRE_EQUAL(all.count(), values.size());
+    BOOST_REQUIRE_EQUAL(merged.count(), values.size());
+    for (double q: { 0.0, 0.05, 0.25, 0.5, 0.9, 0.99, 0.999, 1.0 }) {
+        auto expected = values.at(static_cast<size_t>(q * (values.size() - 1)));
+        auto actual = all.quantile(q);
+        BOOST_REQUIRE(std::abs(actual - expected) <= 0.01 * std::abs(expected) + QuantileSketch::MIN_VALUE);
+        BOOST_REQUIRE_EQUAL(merged.quantile(q), actual);
+    }
+    QuantileSketch empty;
+    BOOST_REQUIRE(std::isnan(empty.quantile(0.5)));
+    empty.add(NAN);
+    BOOST_REQUIRE_EQUAL(empty.count(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(Test_histogram_quantile) {
+    Histogram a = { { 1.0, 2.0, 4.0, INFINITY }, { 10, 20, 0, 0 } };
+    Histogram b = { { 1.0, 2.0, 4.0, INFINITY }, { 0, 20, 40, 10 } };
+    Histogram other = { { 1.0, 2.0, INFINITY }, { 1, 1, 1 } };
+    Histogram merged;
+    BOOST_REQUIRE(std::isnan(merged.quantile(0.5)));
+    BOOST_REQUIRE(merged.merge(a));
+    BOOST_REQUIRE(merged.merge(b));
+    BOOST_REQUIRE(!merged.merge(other));
+    BOOST_REQUIRE_EQUAL(merged.count(), 100u);
+    BOOST_REQUIRE_CLOSE(a.quantile(0.5), 1.25, 0.0001);
+    BOOST_REQUIRE_CLOSE(merged.quantile(0.0), 0.0, 0.0001);
+    BOOST_REQUIRE_CLOSE(merged.quantile(0.05), 0.5, 0.0001);
+    BOOST_REQUIRE_CLOSE(merged.quantile(0.5), 2.0, 0.0001);
+    BOOST_REQUIRE_CLOSE(merged.quantile(0.7), 3.0, 0.0001);
+    // Last bucket is unbounded
+    BOOST_REQUIRE_CLOSE(merged.quantile(0.99), 4.0, 0.0001);
+}
+
+static std::string make_quantile_query(aku_Timestamp begin, aku_Timestamp end, std::string func, bool group_by) {
+    std::stringstream str;
+    str << "{ \"aggregate\": { \"test\": \"" << func << "\" },";
+    if (group_by) {
+        str << "  \"group-by\": [ \"group\" ],";
+    }
+    str << "  \"range\": { \"from\": " << begin << ", \"to\": " << end << "} }";
+    return str.str();
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_quantile_query_0) {
+    std::vector<std::string> series_names = {
+        "test key=0 group=0",
+        "test key=1 group=0",
+        "test key=2 group=1",
+    };
+    const aku_Timestamp begin = 100, end = 1100;
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
+    // Values are ts/10 so quantiles of every series (and group) are the same
+    std::vector<std::pair<std::string, double>> expected = {
+        { "p50",  0.1*(begin + 0.50*(end - begin - 1)) },
+        { "p90",  0.1*(begin + 0.90*(end - begin - 1)) },
+        { "p999", 0.1*(begin + 0.999*(end - begin - 1)) },
+    };
+    for (bool group_by: { false, true }) {
+        for (auto const& kv: expected) {
+            CursorMock cursor;
+            auto query = make_quantile_query(begin, end, kv.first, group_by);
+            session->query(&cursor, query.c_str());
+            BOOST_REQUIRE(cursor.done);
+            BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+            BOOST_REQUIRE_EQUAL(cursor.samples.size(), group_by ? 2 : series_names.size());
+            std::set<aku_ParamId> ids;
+            for (auto const& sample: cursor.samples) {
+                BOOST_REQUIRE(std::abs(sample.payload.float64 - kv.second) <= 0.01 * kv.second);
+                ids.insert(sample.paramid);
+            }
+            BOOST_REQUIRE_EQUAL(ids.size(), cursor.samples.size());
+        }
+    }
+}
+
+// Test value filter
+
+BOOST_AUTO_TEST_CASE(Test_storage_filter_query) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+    };
+    const aku_Timestamp begin = 100, end = 1100;
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, begin, end, series_names);
+    for (auto order: { OrderBy::SERIES, OrderBy::TIME }) {
+        CursorMock cursor;
+        std::stringstream query;
+        query << "{ \"select\": \"test\", \"range\": { \"from\": " << begin << ", \"to\": " << end << "},";
+        query << "  \"order-by\": " << (order == OrderBy::SERIES ? "\"series\"" : "\"time\"") << ",";
+        query << "  \"filter\": { \"test\": { \"gt\": 50, \"le\": 80 } } }";
+        session->query(&cursor, query.str().c_str());
+        BOOST_REQUIRE(cursor.done);
+        BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+        // Values are ts/10 so only timestamps from (500, 800] should be returned
+        std::vector<aku_Timestamp> expected;
+        for (aku_Timestamp ts = 501; ts <= 800; ts++) {
+            expected.push_back(ts);
+        }
+        check_timestamps(cursor, expected, order, series_names);
+        for (auto const& sample: cursor.samples) {
+            BOOST_REQUIRE(sample.payload.float64 > 50 && sample.payload.float64 <= 80);
+        }
+    }
+    // Filter should refer to the selected metric
+    CursorMock cursor;
+    session->query(&cursor, "{ \"select\": \"test\", \"range\": { \"from\": 100, \"to\": 1100 },"
+                            "  \"filter\": { \"cpu\": { \"gt\": 50 } } }");
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_EQUERY_PARSING_ERROR);
+}
+
+// Test SAX encoding
+
+BOOST_AUTO_TEST_CASE(Test_storage_sax_query) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+    };
+    const aku_Timestamp begin = 100, end = 1100;
+    const int width = 4;
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    std::map<aku_ParamId, std::vector<std::pair<aku_Timestamp, std::string>>> expected;
+    for (auto const& name: series_names) {
+        aku_Sample sample;
+        auto status = session->init_series_id(name.data(), name.data() + name.size(), &sample);
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        SAX::SAXEncoder encoder(4, width);
+        for (aku_Timestamp ts = begin; ts < end; ts++) {
+            sample.timestamp = ts;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.float64 = static_cast<double>((ts * 7919 + sample.paramid) % 13);
+            status = session->write(sample);
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            std::string word(width, '\0');
+            if (encoder.encode(sample.payload.float64, &word[0], word.size())) {
+                expected[sample.paramid].push_back(std::make_pair(ts, word));
+            }
+        }
+    }
+    std::stringstream query;
+    query << "{ \"select\": \"test\", \"range\": { \"from\": " << begin << ", \"to\": " << end << "},";
+    query << "  \"order-by\": \"series\",";
+    query << "  \"apply\": [ { \"name\": \"sax\", \"alphabet_size\": 4, \"window_width\": " << width << " } ] }";
+    CursorMock cursor;
+    session->query(&cursor, query.str().c_str());
+    BOOST_REQUIRE(cursor.done);
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    std::map<aku_ParamId, std::vector<std::pair<aku_Timestamp, std::string>>> actual;
+    for (auto const& sample: cursor.samples) {
+        BOOST_REQUIRE(sample.payload.type & aku_PData::SAX_WORD);
+        actual[sample.paramid].push_back(std::make_pair(sample.timestamp, std::string(sample.payload.data, width)));
+    }
+    BOOST_REQUIRE_EQUAL(actual.size(), series_names.size());
+    for (auto const& kv: expected) {
+        auto const& words = actual[kv.first];
+        BOOST_REQUIRE(kv.second.size() > 100);
+        BOOST_REQUIRE_EQUAL(words.size(), kv.second.size());
+        for (size_t i = 0; i < words.size(); i++) {
+            BOOST_REQUIRE_EQUAL(words[i].first, kv.second[i].first);
+            BOOST_REQUIRE_EQUAL(words[i].second, kv.second[i].second);
+        }
+    }
+}
+
+// Test anomaly detector
+
+BOOST_AUTO_TEST_CASE(Test_anomaly_detector_clone) {
+    // Checkpoint should produce the same results as the original detector,
+    // batch and sample by sample updates should be the same
+    auto detector = AnomalyDetectorUtil::create_approx_ewma(3, 1024, 1.0, 0.5);
+    std::unique_ptr<AnomalyDetectorIface> checkpoint;
+    std::mt19937 gen(5);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    std::vector<u64> ids;
+    for (u64 id = 1; id <= 100; id++) {
+        ids.push_back(id);
+    }
+    size_t nanomalies = 0;
+    for (int frame = 0; frame < 40; frame++) {
+        std::vector<double> values;
+        for (auto id: ids) {
+            double x = static_cast<double>(id) + noise(gen);
+            values.push_back(id == 42 && frame > 30 ? 10.0*x : x);
+        }
+        if (frame == 20) {
+            checkpoint = detector->clone();
+        }
+        for (size_t i = 0; i < ids.size(); i++) {
+            detector->add(ids[i], values[i]);
+        }
+        detector->move_sliding_window();
+        if (checkpoint) {
+            checkpoint->add(ids.data(), values.data(), ids.size());
+            checkpoint->move_sliding_window();
+            for (auto id: ids) {
+                BOOST_REQUIRE_EQUAL(checkpoint->is_anomaly_candidate(id), detector->is_anomaly_candidate(id));
+            }
+        }
+        if (frame > 30) {
+            nanomalies += detector->is_anomaly_candidate(42);
+        }
+    }
+    BOOST_REQUIRE(nanomalies > 0);
+}
+
+BOOST_AUTO_TEST_CASE(Test_anomaly_detector_node) {
+    auto collector = std::make_shared<CollectorNode>();
+    AnomalyDetector node(1, 8, 1.0, 0.5, 0.0, 0.0, 0, Forecasting::EWMA, collector);
+    SampleBatch batch;
+    for (aku_Timestamp ts = 1; ts <= 30; ts++) {
+        for (aku_ParamId id = 1; id <= 10; id++) {
+            aku_Sample sample = {};
+            sample.paramid = id;
+            sample.timestamp = ts;
+            sample.payload.type = AKU_PAYLOAD_FLOAT;
+            sample.payload.size = sizeof(aku_Sample);
+            sample.payload.float64 = id == 5 && ts == 20 ? 100.0 : 1.0;
+            if (ts % 2) {
+                MutableSample mut(&sample);
+                BOOST_REQUIRE(node.put(mut));
+            } else {
+                batch.append(sample);
+            }
+        }
+        if (!batch.empty()) {
+            BOOST_REQUIRE(node.put_batch(batch));
+            batch.clear();
+        }
+    }
+    node.complete();
+    BOOST_REQUIRE(!collector->samples.empty());
+    BOOST_REQUIRE_EQUAL(collector->samples.front().timestamp, 20u);
+    BOOST_REQUIRE_EQUAL(collector->samples.front().payload.float64, 100.0);
+    for (auto const& sample: collector->samples) {
+        BOOST_REQUIRE_EQUAL(sample.paramid, 5u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_0) {
+    const std::string LOG_PATH = "input_log_test";
+    boost::filesystem::remove_all(LOG_PATH);
+    {
+        InputLog log(LOG_PATH, 2, 1000);
+        auto s0 = log.pick_shard();
+        auto s1 = log.pick_shard();
+        BOOST_REQUIRE_NE(s0, s1);
+        // Series are written through both shards, every series is ordered
+        for (u64 i = 0; i < 100; i++) {
+            BOOST_REQUIRE_EQUAL(log.append(i % 2 ? s0 : s1, 1 + i % 3, i, static_cast<double>(i)), AKU_SUCCESS);
+        }
+        BOOST_REQUIRE_EQUAL(log.flush(), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(log.get_size(), 100*sizeof(InputLog::FramedRecord));
+    }
+    std::vector<InputLog::Record> records;
+    BOOST_REQUIRE_EQUAL(InputLog::read_all(LOG_PATH, &records), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(records.size(), 100u);
+    for (u64 i = 0; i < 100; i++) {
+        BOOST_REQUIRE_EQUAL(records.at(i).id, 1 + i % 3);
+        BOOST_REQUIRE_EQUAL(records.at(i).timestamp, i);
+        BOOST_REQUIRE_EQUAL(records.at(i).value, static_cast<double>(i));
+    }
+    boost::filesystem::remove_all(LOG_PATH);
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_1) {
+    const std::string LOG_PATH = "input_log_test";
+    boost::filesystem::remove_all(LOG_PATH);
+    {
+        InputLog log(LOG_PATH, 1, 1000);
+        log.append(0, 1, 10, 1.0);
+        log.append(0, 1, 20, 2.0);
+        BOOST_REQUIRE_EQUAL(log.rotate(), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(log.get_size(), 0u);
+        log.append(0, 1, 30, 3.0);
+        log.flush();
+        // Records from the old files are kept until they're removed
+        std::vector<InputLog::Record> records;
+        InputLog::read_all(LOG_PATH, &records);
+        BOOST_REQUIRE_EQUAL(records.size(), 3u);
+        log.remove_old();
+        records.clear();
+        InputLog::read_all(LOG_PATH, &records);
+        BOOST_REQUIRE_EQUAL(records.size(), 1u);
+        BOOST_REQUIRE_EQUAL(records.front().timestamp, 30u);
+    }
+    // Torn write, incomplete record is ignored
+    for (boost::filesystem::directory_iterator it(LOG_PATH), end; it != end; it++) {
+        std::ofstream file(it->path().string(), std::ios::app|std::ios::binary);
+        file.write("xxxx", 4);
+    }
+    // New log doesn't overwrite existing files
+    InputLog log(LOG_PATH, 1, 1000);
+    log.append(0, 1, 40, 4.0);
+    log.flush();
+    std::vector<InputLog::Record> records;
+    BOOST_REQUIRE_EQUAL(InputLog::read_all(LOG_PATH, &records), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(records.size(), 2u);
+    BOOST_REQUIRE_EQUAL(records.at(0).timestamp, 30u);
+    BOOST_REQUIRE_EQUAL(records.at(1).timestamp, 40u);
+    boost::filesystem::remove_all(LOG_PATH);
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_checksum) {
+    const std::string LOG_PATH = "input_log_test";
+    boost::filesystem::remove_all(LOG_PATH);
+    {
+        InputLog log(LOG_PATH, 1, 1000);
+        for (u64 i = 0; i < 4; i++) {
+            log.append(0, 1, 10*(i + 1), static_cast<double>(i));
+        }
+        log.flush();
+    }
+    // Damage the value of the third record, it and the records after it are ignored
+    for (boost::filesystem::directory_iterator it(LOG_PATH), end; it != end; it++) {
+        std::fstream file(it->path().string(), std::ios::in|std::ios::out|std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(2*sizeof(InputLog::FramedRecord) + offsetof(InputLog::Record, value)));
+        file.write("xxxx", 4);
+    }
+    std::vector<InputLog::Record> records;
+    BOOST_REQUIRE_EQUAL(InputLog::read_all(LOG_PATH, &records), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(records.size(), 2u);
+    BOOST_REQUIRE_EQUAL(records.at(0).timestamp, 10u);
+    BOOST_REQUIRE_EQUAL(records.at(1).timestamp, 20u);
+    boost::filesystem::remove_all(LOG_PATH);
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_remove_stored) {
+    std::vector<InputLog::Record> records = {
+        { 1, 10, 1.0 },
+        { 1, 20, 2.0 },
+        { 1, 20, 2.5 },  // same timestamp, only one value is stored
+        { 1, 25, 3.0 },  // held by the reorder buffer, not stored
+        { 1, 30, 4.0 },
+    };
+    std::vector<aku_Timestamp> stored = { 5, 10, 20, 30 };
+    BOOST_REQUIRE_EQUAL(InputLog::remove_stored(&records, stored), 3u);
+    BOOST_REQUIRE_EQUAL(records.size(), 2u);
+    BOOST_REQUIRE_EQUAL(records.at(0).timestamp, 20u);
+    BOOST_REQUIRE_EQUAL(records.at(0).value, 2.5);
+    BOOST_REQUIRE_EQUAL(records.at(1).timestamp, 25u);
+}
+
+//! Run `fn` in the child process, returns its exit code
+template<class Fn>
+static int run_in_child(Fn const& fn) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(fn());
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static std::vector<aku_Sample> read_series(std::shared_ptr<StorageSession> session, const char* metric) {
+    CursorMock cursor;
+    std::stringstream query;
+    query << "{ \"select\": \"" << metric << "\", \"range\": { \"from\": 0, \"to\": 1000 }}";
+    session->query(&cursor, query.str().c_str());
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    return cursor.samples;
+}
+
+static std::vector<aku_Sample> read_series(Storage& storage, const char* metric) {
+    return read_series(storage.create_write_session(), metric);
+}
+
+/** Write few values (input log buffer is not full) and wait until they're written to the
+  * input log by the sync worker, appends don't commit the log when the stream is idle.
+  * @return 0 on success
+  */
+static int write_idle_stream(std::shared_ptr<StorageSession> session, const char* sname, std::string const& log_path) {
+    for (aku_Timestamp ts = 100; ts <= 300; ts += 100) {
+        aku_Sample sample = {};
+        sample.timestamp = ts;
+        sample.payload.type = AKU_PAYLOAD_FLOAT;
+        sample.payload.float64 = static_cast<double>(ts);
+        if (session->init_series_id(sname, sname + strlen(sname), &sample) != AKU_SUCCESS ||
+            session->write(sample) != AKU_SUCCESS)
+        {
+            return 2;
+        }
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(AKU_DEFAULT_FLUSH_INTERVAL_MS));
+        std::vector<InputLog::Record> records;
+        if (InputLog::read_all(log_path, &records) == AKU_SUCCESS && records.size() == 3) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_idle_stream_replay) {
+    const std::string DIR = boost::filesystem::absolute("input_log_storage_test").string();
+    const std::string META_PATH = DIR + "/db.akumuli";
+    const std::string LOG_PATH = DIR + "/inputlog";
+    const std::string SAVED_PATH = DIR + "/inputlog.saved";
+    const char* sname = "cpu host=a";
+    boost::filesystem::remove_all(DIR);
+    BOOST_REQUIRE_EQUAL(Storage::new_database("db", DIR.c_str(), DIR.c_str(), 1, 0x400000, false), AKU_SUCCESS);
+    aku_FineTuneParams params = {};
+    params.input_log_path = LOG_PATH.c_str();
+    params.input_log_concurrency = 1;
+    {
+        // Series name is saved by the clean shutdown
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        auto session = storage->create_write_session();
+        aku_Sample sample = {};
+        BOOST_REQUIRE_EQUAL(session->init_series_id(sname, sname + strlen(sname), &sample), AKU_SUCCESS);
+        session.reset();
+        storage->close();
+    }
+    auto code = run_in_child([&]() {
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        int result = write_idle_stream(storage->create_write_session(), sname, LOG_PATH);
+        // Crash, the storage is not closed and not destroyed
+        _exit(result);
+        return result;
+    });
+    BOOST_REQUIRE_EQUAL(code, 0);
+    boost::filesystem::create_directories(SAVED_PATH);
+    for (boost::filesystem::directory_iterator it(LOG_PATH), end; it != end; it++) {
+        boost::filesystem::copy_file(it->path(), boost::filesystem::path(SAVED_PATH) / it->path().filename());
+    }
+    {
+        // Values are restored from the log and committed by the clean shutdown
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        auto samples = read_series(*storage, "cpu");
+        BOOST_REQUIRE_EQUAL(samples.size(), 3u);
+        for (size_t i = 0; i < samples.size(); i++) {
+            BOOST_REQUIRE_EQUAL(samples.at(i).timestamp, 100*(i + 1));
+        }
+        storage->close();
+    }
+    // Replay of the records that are already committed doesn't duplicate them
+    boost::filesystem::remove_all(LOG_PATH);
+    boost::filesystem::rename(SAVED_PATH, LOG_PATH);
+    {
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        BOOST_REQUIRE_EQUAL(read_series(*storage, "cpu").size(), 3u);
+        storage->close();
+    }
+    boost::filesystem::remove_all(DIR);
+}
+
+BOOST_AUTO_TEST_CASE(Test_input_log_tenant_replay) {
+    const std::string DIR = boost::filesystem::absolute("input_log_tenant_test").string();
+    const std::string META_PATH = DIR + "/db.akumuli";
+    const std::string LOG_PATH = DIR + "/inputlog";
+    const std::string TENANT_LOG_PATH = LOG_PATH + "/tenant.team-a";
+    const char* sname = "cpu host=a";
+    boost::filesystem::remove_all(DIR);
+    BOOST_REQUIRE_EQUAL(Storage::new_database("db", DIR.c_str(), DIR.c_str(), 1, 0x400000, false), AKU_SUCCESS);
+    aku_FineTuneParams params = {};
+    params.input_log_path = LOG_PATH.c_str();
+    params.input_log_concurrency = 1;
+    {
+        // Tenant and its series name are saved by the clean shutdown
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        aku_Status status;
+        std::shared_ptr<StorageSession> session;
+        std::tie(status, session) = storage->create_tenant_session("team-a");
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        aku_Sample sample = {};
+        BOOST_REQUIRE_EQUAL(session->init_series_id(sname, sname + strlen(sname), &sample), AKU_SUCCESS);
+        session.reset();
+        storage->close();
+    }
+    auto code = run_in_child([&]() {
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        aku_Status status;
+        std::shared_ptr<StorageSession> session;
+        std::tie(status, session) = storage->create_tenant_session("team-a");
+        if (status != AKU_SUCCESS) {
+            _exit(3);
+        }
+        int result = write_idle_stream(session, sname, TENANT_LOG_PATH);
+        // Crash, the storage is not closed and not destroyed
+        _exit(result);
+        return result;
+    });
+    BOOST_REQUIRE_EQUAL(code, 0);
+    {
+        // Values of the tenant are restored into the tenant namespace
+        auto storage = std::make_shared<Storage>(META_PATH.c_str(), params);
+        aku_Status status;
+        std::shared_ptr<StorageSession> session;
+        std::tie(status, session) = storage->create_tenant_session("team-a");
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        auto samples = read_series(session, "cpu");
+        BOOST_REQUIRE_EQUAL(samples.size(), 3u);
+        for (size_t i = 0; i < samples.size(); i++) {
+            BOOST_REQUIRE_EQUAL(samples.at(i).timestamp, 100*(i + 1));
+        }
+        session.reset();
+        storage->close();
+    }
+    // Log of the tenant is removed after the values were committed
+    std::vector<InputLog::Record> records;
+    BOOST_REQUIRE_EQUAL(InputLog::read_all(TENANT_LOG_PATH, &records), AKU_SUCCESS);
+    BOOST_REQUIRE(records.empty());
+    boost::filesystem::remove_all(DIR);
+}
+
+BOOST_AUTO_TEST_CASE(Test_checkpoint_0) {
+    const std::string PATH = "checkpoint_test";
+    boost::filesystem::remove(PATH);
+    std::vector<ColumnCheckpoint> columns;
+    for (u64 i = 1; i <= 100; i++) {
+        ColumnCheckpoint col;
+        col.id = i;
+        col.roots = std::vector<LogicAddr>(i % 3, EMPTY_ADDR);
+        col.roots.push_back(i*10);
+        col.has_last = i % 2 == 0;
+        col.last_ts = i*100;
+        col.last_value = static_cast<double>(i)/2;
+        columns.push_back(col);
+    }
+    std::vector<ColumnCheckpoint> actual;
+    BOOST_REQUIRE_EQUAL(Checkpoint::load(PATH, 1, &actual), AKU_ENOT_FOUND);
+    BOOST_REQUIRE_EQUAL(Checkpoint::write(PATH, 1, columns), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(Checkpoint::load(PATH, 1, &actual), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(actual.size(), columns.size());
+    for (size_t i = 0; i < columns.size(); i++) {
+        BOOST_REQUIRE_EQUAL(actual.at(i).id, columns.at(i).id);
+        BOOST_REQUIRE(actual.at(i).roots == columns.at(i).roots);
+        BOOST_REQUIRE_EQUAL(actual.at(i).has_last, columns.at(i).has_last);
+        BOOST_REQUIRE_EQUAL(actual.at(i).last_ts, columns.at(i).last_ts);
+        BOOST_REQUIRE_EQUAL(actual.at(i).last_value, columns.at(i).last_value);
+    }
+    // Checkpoint can be loaded only once
+    BOOST_REQUIRE(!boost::filesystem::exists(PATH));
+    // Checkpoint of the other generation is rejected
+    actual.clear();
+    BOOST_REQUIRE_EQUAL(Checkpoint::write(PATH, 1, columns), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(Checkpoint::load(PATH, 2, &actual), AKU_EBAD_DATA);
+    BOOST_REQUIRE(actual.empty());
+    // Damaged checkpoint is rejected
+    BOOST_REQUIRE_EQUAL(Checkpoint::write(PATH, 1, columns), AKU_SUCCESS);
+    {
+        std::fstream file(PATH, std::ios::in|std::ios::out|std::ios::binary);
+        file.seekp(100);
+        file.write("xxxx", 4);
+    }
+    BOOST_REQUIRE_EQUAL(Checkpoint::load(PATH, 1, &actual), AKU_EBAD_DATA);
+    BOOST_REQUIRE(actual.empty());
+}
+
+BOOST_AUTO_TEST_CASE(Test_hot_block_list_0) {
+    const std::string PATH = "hotlist_test";
+    boost::filesystem::remove(PATH);
+    std::vector<LogicAddr> addrs;
+    for (LogicAddr addr = 1000; addr > 0; addr -= 10) {
+        addrs.push_back(addr);
+    }
+    std::vector<LogicAddr> actual;
+    BOOST_REQUIRE_EQUAL(HotBlockList::load(PATH, &actual), AKU_ENOT_FOUND);
+    BOOST_REQUIRE_EQUAL(HotBlockList::write(PATH, addrs), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(HotBlockList::load(PATH, &actual), AKU_SUCCESS);
+    BOOST_REQUIRE(actual == addrs);
+    // The list can be loaded many times
+    actual.clear();
+    BOOST_REQUIRE_EQUAL(HotBlockList::load(PATH, &actual), AKU_SUCCESS);
+    BOOST_REQUIRE(actual == addrs);
+    // Damaged list is rejected
+    {
+        std::fstream file(PATH, std::ios::in|std::ios::out|std::ios::binary);
+        file.seekp(100);
+        file.write("xxxx", 4);
+    }
+    actual.clear();
+    BOOST_REQUIRE_EQUAL(HotBlockList::load(PATH, &actual), AKU_EBAD_DATA);
+    BOOST_REQUIRE(actual.empty());
+    boost::filesystem::remove(PATH);
+}
+
+BOOST_AUTO_TEST_CASE(Test_rescue_point_log_0) {
+    const std::string PATH = "rplog_test";
+    boost::filesystem::remove(PATH);
+    RescuePointLog::MappingT updates;
+    RescuePointLog::IdSetT removed;
+    {
+        RescuePointLog log(PATH);
+        BOOST_REQUIRE_EQUAL(log.open(), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(log.size(), 0);
+        for (u64 i = 0; i < 10; i++) {
+            RescuePointLog::MappingT batch;
+            for (u64 id = 1; id <= 10; id++) {
+                batch[id] = std::vector<LogicAddr>(id % 3, EMPTY_ADDR);
+                batch[id].push_back(i*100 + id);
+            }
+            BOOST_REQUIRE_EQUAL(log.append(batch), AKU_SUCCESS);
+        }
+        BOOST_REQUIRE_EQUAL(log.remove({ 2, 3 }), AKU_SUCCESS);
+    }
+    // Latest rescue points are replayed
+    {
+        RescuePointLog log(PATH);
+        BOOST_REQUIRE_EQUAL(log.open(), AKU_SUCCESS);
+        BOOST_REQUIRE(log.size() != 0);
+        log.take_entries(&updates, &removed);
+        BOOST_REQUIRE_EQUAL(updates.size(), 8);
+        BOOST_REQUIRE(removed == RescuePointLog::IdSetT({ 2, 3 }));
+        for (auto const& kv: updates) {
+            BOOST_REQUIRE_EQUAL(kv.second.size(), kv.first % 3 + 1);
+            BOOST_REQUIRE_EQUAL(kv.second.back(), 900 + kv.first);
+        }
+        BOOST_REQUIRE_EQUAL(log.append({{ 3, { 42 } }}), AKU_SUCCESS);
+    }
+    // Damaged tail is discarded
+    auto size = boost::filesystem::file_size(PATH);
+    {
+        std::ofstream file(PATH, std::ios::app|std::ios::binary);
+        file.write("xxxxxxxxxxxxxxxx", 16);
+    }
+    {
+        RescuePointLog log(PATH);
+        BOOST_REQUIRE_EQUAL(log.open(), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(log.size(), size);
+        log.take_entries(&updates, &removed);
+        BOOST_REQUIRE_EQUAL(updates.size(), 9);
+        BOOST_REQUIRE(updates.at(3) == std::vector<LogicAddr>({ 42 }));
+        BOOST_REQUIRE_EQUAL(log.reset(), AKU_SUCCESS);
+    }
+    BOOST_REQUIRE_EQUAL(boost::filesystem::file_size(PATH), 0);
+    boost::filesystem::remove(PATH);
+}
+
+BOOST_AUTO_TEST_CASE(Test_backup_0) {
+    const std::string FULL = "backup_test_full";
+    const std::string INCR = "backup_test_incr";
+    boost::filesystem::remove_all(FULL);
+    boost::filesystem::remove_all(INCR);
+    auto meta = create_metadatastorage();
+    auto bstore = BlockStoreBuilder::create_memstore();
+    std::shared_ptr<ColumnStore> cstore;
+    cstore.reset(new ColumnStore(bstore));
+    auto store = std::make_shared<Storage>(meta, bstore, cstore, false);
+
+    u64 nextid = 1;
+    auto add_series = [&](u64 count) {
+        std::vector<std::string> names;
+        for (u64 i = 0; i < count; i++) {
+            names.push_back("test key=" + std::to_string(nextid + i));
+        }
+        meta->sync_with_metadata_storage([&](std::vector<MetadataStorage::SeriesT>* items) {
+            for (auto const& name: names) {
+                items->push_back(std::make_tuple(name.data(), static_cast<int>(name.size()), nextid++));
+            }
+        });
+    };
+    std::vector<LogicAddr> addrlist;
+    auto add_blocks = [&](u64 count) {
+        for (u64 i = 0; i < count; i++) {
+            auto block = std::make_shared<Block>();
+            block->get_data()[0] = static_cast<u8>(addrlist.size());
+            aku_Status status;
+            LogicAddr addr;
+            std::tie(status, addr) = bstore->append_block(block);
+            BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+            addrlist.push_back(addr);
+        }
+    };
+    auto check_blocks = [&](std::string const& dir, size_t begin, size_t end) {
+        BackupManifest manifest;
+        BOOST_REQUIRE_EQUAL(manifest.read(dir + "/manifest"), AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL(manifest.nblocks, end - begin);
+        std::vector<LogicAddr> actual;
+        auto status = BackupReader::read(dir + "/blocks", [&](LogicAddr addr, const u8* data, size_t size) {
+            BOOST_REQUIRE_EQUAL(size, AKU_BLOCK_SIZE);
+            BOOST_REQUIRE_EQUAL(data[0], static_cast<u8>(begin + actual.size()));
+            actual.push_back(addr);
+        });
+        BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+        BOOST_REQUIRE_EQUAL_COLLECTIONS(actual.begin(), actual.end(), addrlist.begin() + begin, addrlist.begin() + end);
+        return manifest;
+    };
+    auto count_series = [](std::string const& dir) {
+        sqlite3* db = nullptr;
+        BOOST_REQUIRE_EQUAL(sqlite3_open((dir + "/metadata.db").c_str(), &db), SQLITE_OK);
+        int count = -1;
+        sqlite3_exec(db, "SELECT count(*) FROM akumuli_series;", [](void* arg, int, char** values, char**) {
+            *static_cast<int*>(arg) = std::atoi(values[0]);
+            return 0;
+        }, &count, nullptr);
+        sqlite3_close(db);
+        return count;
+    };
+
+    add_series(10);
+    add_blocks(100);
+    BOOST_REQUIRE_EQUAL(store->backup(FULL.c_str(), nullptr, 0), AKU_SUCCESS);
+    auto full = check_blocks(FULL, 0, 100);
+    BOOST_REQUIRE_EQUAL(full.since_series, 0);
+    BOOST_REQUIRE_EQUAL(full.until_series, 10);
+    BOOST_REQUIRE_EQUAL(count_series(FULL), 10);
+    // Backup can't be overwritten
+    BOOST_REQUIRE_EQUAL(store->backup(FULL.c_str(), nullptr, 0), AKU_EBAD_ARG);
+
+    // Incremental backup contains only new blocks and names
+    add_series(5);
+    add_blocks(50);
+    BOOST_REQUIRE_EQUAL(store->backup(INCR.c_str(), FULL.c_str(), 0), AKU_SUCCESS);
+    auto incr = check_blocks(INCR, 100, 150);
+    BOOST_REQUIRE_EQUAL(incr.since_addr, full.until_addr);
+    BOOST_REQUIRE_EQUAL(incr.since_series, 10);
+    BOOST_REQUIRE_EQUAL(incr.until_series, 15);
+    BOOST_REQUIRE_EQUAL(count_series(INCR), 5);
+    BOOST_REQUIRE(!boost::filesystem::exists(INCR + "/metadata.db.tenant.team-a"));
+
+    // Metadata of the tenants is included
+    aku_Status status;
+    std::shared_ptr<Storage> tenant;
+    std::tie(status, tenant) = store->open_tenant("team-a");
+    BOOST_REQUIRE_EQUAL(status, AKU_SUCCESS);
+    const std::string TENANT = "backup_test_tenant";
+    boost::filesystem::remove_all(TENANT);
+    BOOST_REQUIRE_EQUAL(store->backup(TENANT.c_str(), INCR.c_str(), 0), AKU_SUCCESS);
+    BOOST_REQUIRE(boost::filesystem::exists(TENANT + "/metadata.db.tenant.team-a"));
+    boost::filesystem::remove_all(TENANT);
+
+    boost::filesystem::remove_all(FULL);
+    boost::filesystem::remove_all(INCR);
+}
+
+BOOST_AUTO_TEST_CASE(Test_latency_histogram) {
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::get_bucket(999), 0);
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::get_bucket(1000), 1);
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::get_bucket(3999), 2);
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::get_bucket(4000), 3);
+    BOOST_REQUIRE_EQUAL(LatencyHistogram::get_bucket(~0ull), LatencyHistogram::NBUCKETS - 1);
+    LatencyHistogram hist;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&hist]() {
+            for (u64 i = 0; i < 1000; i++) {
+                hist.add(i*1000);
+            }
+        });
+    }
+    for (auto& t: threads) {
+        t.join();
+    }
+    auto snapshot = hist.get_snapshot();
+    BOOST_REQUIRE_EQUAL(snapshot.count, 4000u);
+    BOOST_REQUIRE_EQUAL(snapshot.sum, 4u*1000u*999u*1000u/2u);
+    BOOST_REQUIRE_EQUAL(snapshot.buckets[0], 4u);
+    BOOST_REQUIRE_EQUAL(snapshot.buckets[1], 4u);
+    BOOST_REQUIRE_EQUAL(snapshot.buckets[10], 4u*(1000u - 512u));
+    std::stringstream out;
+    Metrics::format_histogram(out, "test_latency_seconds", "Test", hist);
+    auto text = out.str();
+    BOOST_REQUIRE(text.find("# TYPE test_latency_seconds histogram\n") != std::string::npos);
+    BOOST_REQUIRE(text.find("test_latency_seconds_bucket{le=\"+Inf\"} 4000\n") != std::string::npos);
+    BOOST_REQUIRE(text.find("test_latency_seconds_count 4000\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_metrics) {
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    auto before = Metrics::ingest().get_snapshot().count;
+    aku_Sample s;
+    std::string name = "cpu key=0";
+    BOOST_REQUIRE_EQUAL(session->init_series_id(name.data(), name.data() + name.size(), &s), AKU_SUCCESS);
+    s.timestamp = 100;
+    s.payload.type = AKU_PAYLOAD_FLOAT;
+    s.payload.float64 = 1.0;
+    BOOST_REQUIRE_EQUAL(session->write(s), AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(Metrics::ingest().get_snapshot().count, before + 1);
+    std::stringstream out;
+    storage->format_metrics(out);
+    auto text = out.str();
+    BOOST_REQUIRE(text.find("akumuli_series 1\n") != std::string::npos);
+    BOOST_REQUIRE(text.find("akumuli_block_cache_hits_total ") != std::string::npos);
+    BOOST_REQUIRE(text.find("akumuli_ingest_latency_seconds_count ") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(Test_storage_query_profile) {
+    std::vector<std::string> series_names = {
+        "test key=0",
+        "test key=1",
+    };
+    auto storage = create_storage();
+    auto session = storage->create_write_session();
+    fill_data(session, 100, 200, series_names);
+    CursorMock cursor;
+    auto query = make_scan_query(100, 200, OrderBy::TIME);
+    session->query(&cursor, query.c_str());
+    BOOST_REQUIRE_EQUAL(cursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE(cursor.profile.empty());
+
+    CursorMock pcursor;
+    query.back() = ',';
+    query += "\"profile\": true}";
+    session->query(&pcursor, query.c_str());
+    BOOST_REQUIRE(pcursor.done);
+    BOOST_REQUIRE_EQUAL(pcursor.error, AKU_SUCCESS);
+    BOOST_REQUIRE_EQUAL(pcursor.samples.size(), cursor.samples.size());
+    boost::property_tree::ptree profile;
+    std::stringstream str(pcursor.profile);
+    boost::property_tree::json_parser::read_json(str, profile);
+    BOOST_REQUIRE_EQUAL(profile.get<u64>("samples_out"), pcursor.samples.size());
+    BOOST_REQUIRE_EQUAL(profile.get<u64>("samples_in"), pcursor.samples.size());
+    BOOST_REQUIRE(profile.get<u64>("exec_ns") > 0);
+    BOOST_REQUIRE(profile.count("blocks_read"));
+    BOOST_REQUIRE(profile.count("subtrees_skipped"));
+}
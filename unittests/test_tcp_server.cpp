@@ -11,6 +11,10 @@
 #include "tcp_server.h"
 #include "logger.h"
 
+#ifdef AKU_WITH_ZSTD
+#include <zstd.h>
+#endif
+
 using namespace Akumuli;
 
 
@@ -42,6 +46,19 @@ struct SessionMock : DbSession {
         throw "not implemented";
     }
 
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "not implemented";
+    }
+
     virtual int param_id_to_series(aku_ParamId id, char* buf, size_t sz) override {
         auto str = std::to_string(id);
         assert(str.size() <= sz);
@@ -80,9 +97,15 @@ struct ConnectionMock : DbConnection {
 
     virtual std::string get_all_stats() override { throw "not impelemnted"; }
 
+    virtual std::string get_metrics() override { throw "not impelemnted"; }
+
     virtual std::shared_ptr<DbSession> create_session() override {
         return std::make_shared<SessionMock>(results);
     }
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string) override {
+        return std::make_shared<SessionMock>(results);
+    }
 };
 
 
@@ -102,6 +125,19 @@ struct DbSessionErrorMock : DbSession {
     virtual std::shared_ptr<DbCursor> search(std::string) override {
         throw "not implemented";
     }
+
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "not implemented";
+    }
     virtual int param_id_to_series(aku_ParamId id, char* buf, size_t sz) override {
         auto str = std::to_string(id);
         assert(str.size() <= sz);
@@ -136,9 +172,15 @@ template<aku_Status ERR>
 struct DbConnectionErrorMock : DbConnection {
     virtual std::string get_all_stats() override { throw "not impelemented"; }
 
+    virtual std::string get_metrics() override { throw "not impelemented"; }
+
     virtual std::shared_ptr<DbSession> create_session() override {
         return std::make_shared<DbSessionErrorMock<ERR>>();
     }
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string) override {
+        return std::make_shared<DbSessionErrorMock<ERR>>();
+    }
 };
 
 const int PORT = 14096;
@@ -289,6 +331,52 @@ BOOST_AUTO_TEST_CASE(Test_tcp_server_loopback_3) {
 }
 
 
+#ifdef AKU_WITH_ZSTD
+static std::string zstd_compress(std::string const& data) {
+    std::string result(ZSTD_compressBound(data.size()), '\0');
+    size_t size = ZSTD_compress(&result[0], result.size(), data.data(), data.size(), 1);
+    BOOST_REQUIRE(!ZSTD_isError(size));
+    result.resize(size);
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(Test_tcp_server_compressed_stream) {
+
+    TCPServerTestSuite<ConnectionMock> suite;
+
+    suite.run([&](SocketT& socket) {
+        const int N = 1000;  // decompressed data doesn't fit one read buffer
+        std::stringstream first, second;
+        for (int i = 0; i < N; i++) {
+            first << "+" << i << "\r\n:" << i << "\r\n+" << i << ".5\r\n";
+            second << "+" << (N + i) << "\r\n:" << (N + i) << "\r\n+" << (N + i) << ".5\r\n";
+        }
+        // Handshake and the first frame are received by one read
+        std::string handshake("\0AKZ", 4);
+        boost::asio::write(socket, boost::asio::buffer(handshake + zstd_compress(first.str())));
+        suite.io.run_one();
+        BOOST_REQUIRE_EQUAL(suite.dbcon->results.size(), N);
+
+        boost::asio::write(socket, boost::asio::buffer(zstd_compress(second.str())));
+        while (suite.dbcon->results.size() < 2*N) {
+            suite.io.run_one();
+        }
+
+        BOOST_REQUIRE_EQUAL(suite.dbcon->results.size(), 2*N);
+        for (int i = 0; i < 2*N; i++) {
+            aku_ParamId id;
+            aku_Timestamp ts;
+            double value;
+            std::tie(id, ts, value) = suite.dbcon->results.at(static_cast<size_t>(i));
+            BOOST_REQUIRE_EQUAL(id, i);
+            BOOST_REQUIRE_EQUAL(ts, i);
+            BOOST_REQUIRE_CLOSE_FRACTION(value, i + 0.5, 0.00001);
+        }
+    });
+}
+#endif
+
+
 BOOST_AUTO_TEST_CASE(Test_tcp_server_parser_error_handling) {
 
     TCPServerTestSuite<ConnectionMock> suite;
@@ -360,3 +448,88 @@ BOOST_AUTO_TEST_CASE(Test_tcp_server_backend_error_handling) {
     });
 }
 
+BOOST_AUTO_TEST_CASE(Test_token_bucket) {
+    TokenBucket bucket(1000);
+    // Bucket is full initially
+    BOOST_REQUIRE_EQUAL(bucket.take(1000), 0);
+    // Debt of 500 tokens takes about half a second to repay
+    auto delay = bucket.take(500);
+    BOOST_REQUIRE(delay > 400000 && delay <= 500000);
+}
+
+BOOST_AUTO_TEST_CASE(Test_tcp_server_rate_limit) {
+
+    auto dbcon = std::make_shared<ConnectionMock>();
+    IOServiceT io;
+    std::vector<IOServiceT*> iovec = { &io };
+    auto builder = ProtocolSessionBuilder::create_resp_builder(false);
+    builder->limits = IngestLimits(0, 10);
+    auto limits = builder->limits;
+    auto serv = std::make_shared<TcpAcceptor>(iovec, PORT, std::move(builder), dbcon, false);
+    serv->_start();
+
+    SocketT socket(io);
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    boost::asio::ip::tcp::endpoint peer(loopback, PORT);
+    socket.connect(peer);
+    serv->_run_one();  // handle_accept
+
+    // Samples are written but the session stops reading for a while
+    boost::asio::streambuf stream;
+    std::ostream os(&stream);
+    for (int i = 0; i < 20; i++) {
+        os << "+1\r\n" << ":" << i << "\r\n" << "+3.14\r\n";
+    }
+    boost::asio::write(socket, stream);
+    while (dbcon->results.size() < 20) {
+        io.run_one();
+    }
+    BOOST_REQUIRE_EQUAL(limits.counters->samples.load(), 20);
+    BOOST_REQUIRE(limits.counters->throttled.load() >= 1);
+    BOOST_REQUIRE(limits.counters->paused_us.load() > 0);
+
+    serv->_stop();
+}
+
+
+#ifdef SO_REUSEPORT
+BOOST_AUTO_TEST_CASE(Test_tcp_server_reuse_port) {
+
+    auto dbcon = std::make_shared<ConnectionMock>();
+    IOServiceT io;
+    std::vector<IOServiceT*> iovec = { &io };
+    // Both acceptors listen on the same port
+    std::vector<std::shared_ptr<TcpAcceptor>> acceptors;
+    for (int i = 0; i < 2; i++) {
+        auto serv = std::make_shared<TcpAcceptor>(iovec, PORT, ProtocolSessionBuilder::create_resp_builder(false),
+                                                  dbcon, false, true);
+        serv->_start();
+        acceptors.push_back(serv);
+    }
+
+    SocketT socket(io);
+    auto loopback = boost::asio::ip::address_v4::loopback();
+    boost::asio::ip::tcp::endpoint peer(loopback, PORT);
+    socket.connect(peer);
+    io.run_one();  // handle_accept of one of the acceptors
+
+    boost::asio::streambuf stream;
+    std::ostream os(&stream);
+    os << "+1\r\n" << ":2\r\n" << "+3.14\r\n";
+    boost::asio::write(socket, stream);
+    io.run_one();
+
+    BOOST_REQUIRE_EQUAL(dbcon->results.size(), 1);
+    aku_ParamId id;
+    aku_Timestamp ts;
+    double value;
+    std::tie(id, ts, value) = dbcon->results.at(0);
+    BOOST_REQUIRE_EQUAL(id, 1);
+    BOOST_REQUIRE_EQUAL(ts, 2);
+    BOOST_REQUIRE_CLOSE_FRACTION(value, 3.14, 0.00001);
+
+    for (auto serv: acceptors) {
+        serv->_stop();
+    }
+}
+#endif
@@ -0,0 +1,301 @@
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Main
+#include <boost/test/unit_test.hpp>
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "uring_server.h"
+#include "signal_handler.h"
+#include "logger.h"
+
+#ifdef AKU_WITH_URING
+
+using namespace Akumuli;
+
+
+static Logger logger_ = Logger("uring-server-test");
+typedef std::tuple<aku_ParamId, aku_Timestamp, double> ValueT;
+
+
+//! Results are written by the worker thread of the server and read by the test
+struct Results {
+    std::mutex          mutex;
+    std::vector<ValueT> values;
+
+    void push(ValueT value) {
+        std::lock_guard<std::mutex> guard(mutex);
+        values.push_back(value);
+    }
+
+    std::vector<ValueT> get() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return values;
+    }
+
+    //! Wait until `n` values are written (or timeout)
+    std::vector<ValueT> wait(size_t n) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < deadline) {
+            auto result = get();
+            if (result.size() >= n) {
+                return result;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return get();
+    }
+};
+
+
+template<aku_Status ERR>
+struct SessionMock : DbSession {
+    Results& results;
+
+    SessionMock(Results& results)
+        : results(results) {}
+
+    virtual aku_Status write(const aku_Sample &sample) override {
+        if (ERR != AKU_SUCCESS) {
+            return ERR;
+        }
+        logger_.trace() << "write_double(" << sample.paramid << ", " << sample.timestamp << ", " << sample.payload.float64 << ")";
+        results.push(std::make_tuple(sample.paramid, sample.timestamp, sample.payload.float64));
+        return AKU_SUCCESS;
+    }
+
+    virtual std::shared_ptr<DbCursor> query(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> suggest(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> search(std::string) override {
+        throw "not implemented";
+    }
+
+    virtual std::shared_ptr<DbCursor> subscribe(std::string) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbPreparedQuery> prepare(std::string, aku_Status*) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> execute(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp) override {
+        throw "not implemented";
+    }
+    virtual std::shared_ptr<DbCursor> poll(std::shared_ptr<DbPreparedQuery>, aku_Timestamp, aku_Timestamp, std::string) override {
+        throw "not implemented";
+    }
+
+    virtual int param_id_to_series(aku_ParamId id, char* buf, size_t sz) override {
+        auto str = std::to_string(id);
+        assert(str.size() <= sz);
+        memcpy(buf, str.data(), str.size());
+        return static_cast<int>(str.size());
+    }
+
+    virtual aku_Status series_to_param_id(const char* begin, size_t sz, aku_Sample* sample) override {
+        std::string num(begin, begin + sz);
+        sample->paramid = boost::lexical_cast<u64>(num);
+        return AKU_SUCCESS;
+    }
+
+    virtual int name_to_param_id_list(const char*, const char*, aku_ParamId*, u32) override {
+        throw "not implemented";
+    }
+};
+
+
+template<aku_Status ERR>
+struct ConnectionMock : DbConnection {
+    Results results;
+
+    virtual std::string get_all_stats() override { throw "not impelemnted"; }
+
+    virtual std::string get_metrics() override { throw "not impelemnted"; }
+
+    virtual std::shared_ptr<DbSession> create_session() override {
+        return std::make_shared<SessionMock<ERR>>(results);
+    }
+
+    virtual std::shared_ptr<DbSession> create_tenant_session(std::string) override {
+        return std::make_shared<SessionMock<ERR>>(results);
+    }
+};
+
+const int PORT = 14097;
+
+template<aku_Status ERR = AKU_SUCCESS>
+struct UringServerTestSuite {
+    std::shared_ptr<ConnectionMock<ERR>> dbcon;
+    std::shared_ptr<UringTcpServer>      serv;
+    SignalHandler                        sig;
+    boost::asio::io_service              io;
+
+    UringServerTestSuite() {
+        // Create mock pipeline
+        dbcon = std::make_shared<ConnectionMock<ERR>>();
+
+        // Run server, one worker (the ring) and one RESP listener
+        std::vector<UringTcpServer::Listener> listeners = {
+            { PORT, UringTcpServer::Protocol::RESP },
+        };
+        serv = std::make_shared<UringTcpServer>(dbcon, 1, listeners);
+        serv->start(&sig, 0);
+    }
+
+    ~UringServerTestSuite() {
+        logger_.info() << "Clean up suite resources";
+        // Stop the server the same way the signal does
+        for (auto const& handler: sig.handlers_) {
+            handler.first();
+        }
+    }
+
+    std::unique_ptr<boost::asio::ip::tcp::socket> connect() {
+        std::unique_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(io));
+        auto loopback = boost::asio::ip::address_v4::loopback();
+        boost::asio::ip::tcp::endpoint peer(loopback, PORT);
+        socket->connect(peer);
+        return socket;
+    }
+};
+
+//! Read everything until the server closes the connection
+static std::string read_until_eof(boost::asio::ip::tcp::socket& socket) {
+    std::string result;
+    char buffer[0x1000];
+    boost::system::error_code err;
+    while (true) {
+        size_t n = socket.read_some(boost::asio::buffer(buffer), err);
+        result.append(buffer, n);
+        if (err) {
+            BOOST_REQUIRE(err == boost::asio::error::eof);
+            break;
+        }
+    }
+    return result;
+}
+
+static void check_value(ValueT const& actual, aku_ParamId id, aku_Timestamp ts, double value) {
+    BOOST_REQUIRE_EQUAL(std::get<0>(actual), id);
+    BOOST_REQUIRE_EQUAL(std::get<1>(actual), ts);
+    BOOST_REQUIRE_CLOSE_FRACTION(std::get<2>(actual), value, 0.00001);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_uring_server_accept) {
+
+    UringServerTestSuite<> suite;
+
+    auto socket = suite.connect();
+    boost::asio::write(*socket, boost::asio::buffer(std::string("+1\r\n:2\r\n+3.14\r\n")));
+
+    auto results = suite.dbcon->results.wait(1);
+    BOOST_REQUIRE_EQUAL(results.size(), 1);
+    check_value(results.at(0), 1, 2, 3.14);
+
+    // Every connection gets its own session
+    auto other = suite.connect();
+    boost::asio::write(*other, boost::asio::buffer(std::string("+3\r\n:4\r\n+1.61\r\n")));
+
+    results = suite.dbcon->results.wait(2);
+    BOOST_REQUIRE_EQUAL(results.size(), 2);
+    check_value(results.at(1), 3, 4, 1.61);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_uring_server_partial_read) {
+
+    UringServerTestSuite<> suite;
+
+    auto socket = suite.connect();
+
+    // Message is split in the middle of the value, the parts are
+    // received separately
+    boost::asio::write(*socket, boost::asio::buffer(std::string("+1\r\n:2\r\n+3.")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    BOOST_REQUIRE_EQUAL(suite.dbcon->results.get().size(), 0);
+    boost::asio::write(*socket, boost::asio::buffer(std::string("14\r\n")));
+
+    auto results = suite.dbcon->results.wait(1);
+    BOOST_REQUIRE_EQUAL(results.size(), 1);
+    check_value(results.at(0), 1, 2, 3.14);
+
+    // Data doesn't fit one provided buffer (4KB), messages are
+    // split between the buffers
+    const int N = 1000;
+    std::stringstream stream;
+    for (int i = 0; i < N; i++) {
+        stream << "+" << i << "\r\n:" << i << "\r\n+" << i << ".5\r\n";
+    }
+    BOOST_REQUIRE(stream.str().size() > 0x1000);
+    boost::asio::write(*socket, boost::asio::buffer(stream.str()));
+
+    results = suite.dbcon->results.wait(N + 1);
+    BOOST_REQUIRE_EQUAL(results.size(), N + 1);
+    for (int i = 0; i < N; i++) {
+        check_value(results.at(static_cast<size_t>(i + 1)), static_cast<aku_ParamId>(i),
+                    static_cast<aku_Timestamp>(i), i + 0.5);
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_uring_server_client_close) {
+
+    UringServerTestSuite<> suite;
+
+    auto socket = suite.connect();
+    boost::asio::write(*socket, boost::asio::buffer(std::string("+1\r\n:2\r\n+3.14\r\n")));
+    socket->shutdown(boost::asio::ip::tcp::socket::shutdown_send);
+
+    // Data sent before the shutdown is processed and the server closes
+    // the connection without sending anything back
+    BOOST_REQUIRE_EQUAL(read_until_eof(*socket), "");
+    auto results = suite.dbcon->results.get();
+    BOOST_REQUIRE_EQUAL(results.size(), 1);
+    check_value(results.at(0), 1, 2, 3.14);
+
+    // Server still accepts new connections
+    auto other = suite.connect();
+    boost::asio::write(*other, boost::asio::buffer(std::string("+3\r\n:4\r\n+1.61\r\n")));
+    results = suite.dbcon->results.wait(2);
+    BOOST_REQUIRE_EQUAL(results.size(), 2);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_uring_server_parser_error_handling) {
+
+    UringServerTestSuite<> suite;
+
+    auto socket = suite.connect();
+    boost::asio::write(*socket, boost::asio::buffer(std::string("+1\r\n:E\r\n+3.14\r\n")));
+    //                                                           error ^
+
+    // Error is sent back and then the connection is closed
+    auto response = read_until_eof(*socket);
+    BOOST_REQUIRE_EQUAL(response.substr(0, 7), "-PARSER");
+    BOOST_REQUIRE_EQUAL(suite.dbcon->results.get().size(), 0);
+}
+
+
+BOOST_AUTO_TEST_CASE(Test_uring_server_backend_error_handling) {
+
+    UringServerTestSuite<AKU_EBAD_DATA> suite;
+
+    auto socket = suite.connect();
+    boost::asio::write(*socket, boost::asio::buffer(std::string("+1\r\n:2\r\n+3.14\r\n")));
+
+    auto response = read_until_eof(*socket);
+    BOOST_REQUIRE_EQUAL(response.substr(0, 3), "-DB");
+}
+
+#endif
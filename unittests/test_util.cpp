@@ -1,4 +1,8 @@
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <set>
 
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Main
@@ -139,3 +143,111 @@ BOOST_AUTO_TEST_CASE(test_crc32c_0) {
 
     BOOST_REQUIRE_EQUAL(hw, sw);
 }
+
+BOOST_AUTO_TEST_CASE(test_crc32c_1) {
+    auto crc32hw = chose_crc32c_implementation(CRC32C_hint::FORCE_HW);
+    auto crc32best = chose_crc32c_implementation(CRC32C_hint::FORCE_BEST_HW);
+    auto crc32sw = chose_crc32c_implementation(CRC32C_hint::FORCE_SW);
+    if (chose_crc32c_implementation(CRC32C_hint::DETECT) == crc32sw) {
+        BOOST_TEST_MESSAGE("Can't compare crc32c implementation, hardware version is not available.");
+        return;
+    }
+    std::vector<u8> data(100000, 0);
+    std::generate(data.begin(), data.end(), []() { return static_cast<u8>(rand()); });
+    // Unaligned buffers and sizes that are not multiples of the interleaved blocks
+    for (int i = 0; i < 1000; i++) {
+        size_t offset = static_cast<size_t>(rand()) % 16;
+        size_t size = static_cast<size_t>(rand()) % (i % 10 == 0 ? data.size() - offset : 2000);
+        u32 seed = static_cast<u32>(i);
+        u32 sw = crc32sw(seed, data.data() + offset, size);
+        BOOST_REQUIRE_EQUAL(crc32hw(seed, data.data() + offset, size), sw);
+        BOOST_REQUIRE_EQUAL(crc32best(seed, data.data() + offset, size), sw);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(Test_parse_cpu_list) {
+    std::vector<u32> cpus;
+    BOOST_REQUIRE(parse_cpu_list("0-3,8,10-11\n", &cpus));
+    std::vector<u32> expected = { 0, 1, 2, 3, 8, 10, 11 };
+    BOOST_REQUIRE_EQUAL_COLLECTIONS(cpus.begin(), cpus.end(), expected.begin(), expected.end());
+    cpus.clear();
+    BOOST_REQUIRE(parse_cpu_list("", &cpus));
+    BOOST_REQUIRE(cpus.empty());
+    BOOST_REQUIRE(!parse_cpu_list("3-1", &cpus));
+    BOOST_REQUIRE(!parse_cpu_list("a", &cpus));
+    BOOST_REQUIRE(!parse_cpu_list("1-", &cpus));
+    BOOST_REQUIRE(!parse_cpu_list("1;2", &cpus));
+}
+
+BOOST_AUTO_TEST_CASE(Test_thread_policy) {
+    BOOST_REQUIRE(set_thread_policy(AKU_THREAD_QUERY, "x", 0) == AKU_EBAD_ARG);
+    BOOST_REQUIRE(set_thread_policy(AKU_THREAD_ROLE_MAX, "", 0) == AKU_EBAD_ARG);
+    BOOST_REQUIRE(set_thread_policy(AKU_THREAD_QUERY, "0", 0) == AKU_SUCCESS);
+    std::thread worker([]() {
+        apply_thread_policy(AKU_THREAD_QUERY);
+        BOOST_REQUIRE_EQUAL(sched_getcpu(), 0);
+    });
+    worker.join();
+}
+
+BOOST_AUTO_TEST_CASE(Test_fiber) {
+    std::string trace;
+    Fiber fiber([&trace]() {
+        trace += "a";
+        Fiber::yield();
+        trace += "b";
+        Fiber::yield();
+        trace += "c";
+    });
+    BOOST_REQUIRE(Fiber::get_current() == nullptr);
+    BOOST_REQUIRE(!fiber.resume());
+    trace += "1";
+    BOOST_REQUIRE(!fiber.resume());
+    trace += "2";
+    BOOST_REQUIRE(fiber.resume());
+    BOOST_REQUIRE(fiber.is_done());
+    BOOST_REQUIRE_EQUAL(trace, "a1b2c");
+}
+
+BOOST_AUTO_TEST_CASE(Test_fork_join_pool) {
+    ForkJoinPool pool(4);
+    const size_t N = 10000;
+    std::vector<int> visited(N, 0);
+    std::set<std::thread::id> threads;
+    std::mutex mutex;
+    pool.parallel_for(N, [&](size_t ix) {
+        visited.at(ix)++;
+        std::lock_guard<std::mutex> guard(mutex);
+        threads.insert(std::this_thread::get_id());
+    }, 3);
+    for (auto cnt: visited) {
+        BOOST_REQUIRE_EQUAL(cnt, 1);
+    }
+    BOOST_REQUIRE(threads.count(std::this_thread::get_id()) != 0);
+    BOOST_REQUIRE(threads.size() <= 4);
+    // Calling thread completes the loop alone without helpers
+    threads.clear();
+    pool.parallel_for(100, [&](size_t) {
+        std::lock_guard<std::mutex> guard(mutex);
+        threads.insert(std::this_thread::get_id());
+    }, 0);
+    BOOST_REQUIRE_EQUAL(threads.size(), 1);
+    // Concurrent loops share the pool
+    std::atomic<size_t> total{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 8; i++) {
+        callers.emplace_back([&]() {
+            pool.parallel_for(1000, [&](size_t) { total++; }, 4);
+        });
+    }
+    for (auto& th: callers) {
+        th.join();
+    }
+    BOOST_REQUIRE_EQUAL(total.load(), 8000);
+    // Exception is rethrown by the calling thread
+    BOOST_REQUIRE_THROW(pool.parallel_for(1000, [](size_t ix) {
+        if (ix == 500) {
+            throw std::runtime_error("error");
+        }
+    }, 3), std::runtime_error);
+}